@@ -0,0 +1,491 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * analyze.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "sqfsanalyze.h"
+
+/* the same notion of a name extension as fragment grouping uses */
+static const char *name_extension(const char *name)
+{
+	const char *ext = strrchr(name, '.');
+
+	if (ext == NULL || ext == name)
+		return "";
+
+	return ext + 1;
+}
+
+static int grow(void **array, size_t *max, size_t count, size_t size)
+{
+	size_t new_max = *max > 0 ? *max * 2 : 128;
+	void *new;
+
+	if (count < *max)
+		return 0;
+
+	new = realloc(*array, new_max * size);
+	if (new == NULL)
+		return -1;
+
+	*array = new;
+	*max = new_max;
+	return 0;
+}
+
+static sqfs_u64 blocks_on_disk(const sqfs_inode_generic_t *inode)
+{
+	sqfs_u64 size = 0;
+	size_t i;
+
+	for (i = 0; i < inode->num_file_blocks; ++i)
+		size += SQFS_ON_DISK_BLOCK_SIZE(inode->block_sizes[i]);
+
+	return size;
+}
+
+/* the bytes unpacked to read the blocks, sparse blocks are not unpacked */
+static sqfs_u64 blocks_unpacked(const image_t *img,
+				const sqfs_inode_generic_t *inode)
+{
+	sqfs_u64 filesize, offset = 0, diff, size = 0;
+	size_t i;
+
+	sqfs_inode_get_file_size(inode, &filesize);
+
+	for (i = 0; i < inode->num_file_blocks; ++i) {
+		diff = filesize - offset;
+		if (diff > img->super.block_size)
+			diff = img->super.block_size;
+
+		if (!SQFS_IS_SPARSE_BLOCK(inode->block_sizes[i]))
+			size += diff;
+
+		offset += diff;
+	}
+
+	return size;
+}
+
+/*****************************************************************************/
+
+static int add_file(image_t *img, const sqfs_tree_node_t *n)
+{
+	const sqfs_inode_generic_t *inode = n->inode;
+	file_stats_t *fi;
+	frag_stats_t *frag;
+	size_t i;
+
+	if (grow((void **)&img->files, &img->max_files, img->num_files,
+		 sizeof(img->files[0]))) {
+		goto fail_errno;
+	}
+
+	fi = img->files + img->num_files;
+	memset(fi, 0, sizeof(*fi));
+
+	fi->node = n;
+	fi->path = sqfs_tree_node_get_path(n);
+	if (fi->path == NULL)
+		goto fail_errno;
+
+	img->num_files += 1;
+	fi->ext = name_extension((const char *)n->name);
+
+	sqfs_inode_get_file_size(inode, &fi->size);
+	sqfs_inode_get_file_block_start(inode, &fi->block_start);
+	sqfs_inode_get_frag_location(inode, &fi->frag_index,
+				     &fi->frag_offset);
+
+	fi->num_blocks = inode->num_file_blocks;
+	fi->stored = blocks_on_disk(inode);
+
+	for (i = 0; i < inode->num_file_blocks; ++i) {
+		if (SQFS_IS_SPARSE_BLOCK(inode->block_sizes[i]))
+			fi->sparse_blocks += 1;
+	}
+
+	if (fi->frag_index == 0xFFFFFFFF)
+		return 0;
+
+	if (fi->frag_index >= img->super.fragment_entry_count) {
+		fprintf(stderr, "%s: %s: fragment index out of bounds.\n",
+			img->filename, fi->path);
+		return -1;
+	}
+
+	fi->tail = fi->size % img->super.block_size;
+
+	frag = img->frags + fi->frag_index;
+	frag->files += 1;
+
+	if (fi->frag_offset + fi->tail > frag->size)
+		frag->size = fi->frag_offset + fi->tail;
+
+	return 0;
+fail_errno:
+	perror("analyzing files");
+	return -1;
+}
+
+static int collect_files(image_t *img, const sqfs_tree_node_t *n,
+			 sqfs_u8 *seen)
+{
+	sqfs_u32 num;
+
+	if (S_ISDIR(n->inode->base.mode)) {
+		for (n = n->children; n != NULL; n = n->next) {
+			if (collect_files(img, n, seen))
+				return -1;
+		}
+		return 0;
+	}
+
+	if (!S_ISREG(n->inode->base.mode))
+		return 0;
+
+	num = n->inode->base.inode_number;
+
+	if (num > img->super.inode_count) {
+		fprintf(stderr, "%s: inode number %u out of bounds.\n",
+			img->filename, (unsigned int)num);
+		return -1;
+	}
+
+	/* hard links */
+	if (seen[num])
+		return 0;
+
+	seen[num] = 1;
+	return add_file(img, n);
+}
+
+static int load_fragment_table(image_t *img)
+{
+	sqfs_u32 i, count = img->super.fragment_entry_count;
+	sqfs_fragment_t ent;
+	int ret;
+
+	img->frags = calloc(count + 1, sizeof(img->frags[0]));
+	if (img->frags == NULL) {
+		perror("loading fragment table");
+		return -1;
+	}
+
+	for (i = 0; i < count; ++i) {
+		ret = sqfs_data_reader_get_fragment_entry(img->data, i, &ent);
+		if (ret) {
+			sqfs_perror(img->filename, "reading fragment table",
+				    ret);
+			return -1;
+		}
+
+		img->frags[i].on_disk = SQFS_ON_DISK_BLOCK_SIZE(ent.size);
+	}
+
+	return 0;
+}
+
+static void finish_file(const image_t *img, file_stats_t *fi)
+{
+	const frag_stats_t *frag;
+
+	fi->read_bytes = blocks_unpacked(img, fi->node->inode);
+	fi->disk_read_bytes = fi->stored;
+
+	if (fi->frag_index == 0xFFFFFFFF)
+		return;
+
+	/* the entire fragment block is unpacked, no matter the tail size */
+	frag = img->frags + fi->frag_index;
+
+	fi->read_bytes += frag->size;
+	fi->disk_read_bytes += frag->on_disk;
+
+	if (frag->size > 0) {
+		fi->stored_tail = (sqfs_u64)fi->tail * frag->on_disk /
+				  frag->size;
+	}
+}
+
+/*****************************************************************************/
+
+/* files without blocks on disk only have a tail end to share */
+static sqfs_u64 data_start(const file_stats_t *fi)
+{
+	return fi->stored > 0 ? fi->block_start : 0;
+}
+
+static int cmp_shared(const void *lhs, const void *rhs)
+{
+	const file_stats_t *l = *((const file_stats_t *const *)lhs);
+	const file_stats_t *r = *((const file_stats_t *const *)rhs);
+
+	if (data_start(l) != data_start(r))
+		return data_start(l) < data_start(r) ? -1 : 1;
+
+	if (l->frag_index != r->frag_index)
+		return l->frag_index < r->frag_index ? -1 : 1;
+
+	if (l->frag_offset != r->frag_offset)
+		return l->frag_offset < r->frag_offset ? -1 : 1;
+
+	return 0;
+}
+
+static int cmp_shared_order(const void *lhs, const void *rhs)
+{
+	const file_stats_t *l = *((const file_stats_t *const *)lhs);
+	const file_stats_t *r = *((const file_stats_t *const *)rhs);
+	int ret = cmp_shared(lhs, rhs);
+
+	if (ret != 0)
+		return ret;
+
+	return l < r ? -1 : (l > r ? 1 : 0);
+}
+
+/*
+  Files that were deduplicated point to the same blocks, or to the same
+  tail end if that is all they have.
+ */
+static int find_shared(image_t *img)
+{
+	size_t i, j, count = 0;
+	file_stats_t **list;
+
+	list = alloc_array(sizeof(list[0]), img->num_files + 1);
+	if (list == NULL) {
+		perror("finding duplicate files");
+		return -1;
+	}
+
+	for (i = 0; i < img->num_files; ++i) {
+		if (img->files[i].stored > 0 ||
+		    img->files[i].frag_index != 0xFFFFFFFF) {
+			list[count++] = img->files + i;
+		}
+	}
+
+	qsort(list, count, sizeof(list[0]), cmp_shared_order);
+
+	for (i = 0; i < count; i = j) {
+		for (j = i + 1; j < count; ++j) {
+			if (cmp_shared(list + i, list + j) != 0)
+				break;
+		}
+
+		list[i]->shared = j - i - 1;
+
+		for (i = i + 1; i < j; ++i) {
+			list[i]->shared = list[i - 1]->shared;
+			list[i]->duplicate = true;
+		}
+	}
+
+	free(list);
+	return 0;
+}
+
+/*****************************************************************************/
+
+static int cmp_u64(const void *lhs, const void *rhs)
+{
+	sqfs_u64 l = *((const sqfs_u64 *)lhs), r = *((const sqfs_u64 *)rhs);
+
+	return l < r ? -1 : (l > r ? 1 : 0);
+}
+
+static size_t sort_unique(sqfs_u64 *list, size_t count)
+{
+	size_t i, unique = 0;
+
+	qsort(list, count, sizeof(list[0]), cmp_u64);
+
+	for (i = 0; i < count; ++i) {
+		if (i == 0 || list[i] != list[unique - 1])
+			list[unique++] = list[i];
+	}
+
+	return unique;
+}
+
+static void dir_listing(const sqfs_inode_generic_t *inode, dir_stats_t *di)
+{
+	sqfs_u32 size, offset;
+
+	if (inode->base.type == SQFS_INODE_EXT_DIR) {
+		size = inode->data.dir_ext.size;
+		offset = inode->data.dir_ext.offset;
+	} else {
+		size = inode->data.dir.size;
+		offset = inode->data.dir.offset;
+	}
+
+	/* the size includes 3 bytes for the "." and ".." entries */
+	di->listing_bytes = size > 3 ? size - 3 : 0;
+
+	if (di->listing_bytes > 0) {
+		di->dir_meta_blocks = (offset + di->listing_bytes - 1) /
+				      SQFS_META_BLOCK_SIZE + 1;
+	}
+}
+
+/*
+  Gather what it takes to read the regular files of a directory one after
+  another, in the order they are listed in. The scratch buffer has room for
+  one entry per child.
+ */
+static void dir_files(const image_t *img, const sqfs_tree_node_t *dir,
+		      dir_stats_t *di, sqfs_u64 *scratch)
+{
+	sqfs_u64 start, end, size, first = 0, last = 0, prev_end = 0;
+	sqfs_u32 frag_index, frag_offset;
+	const sqfs_tree_node_t *n;
+	bool have_data = false;
+	size_t i, count = 0;
+
+	for (n = dir->children; n != NULL; n = n->next) {
+		if (!S_ISREG(n->inode->base.mode))
+			continue;
+
+		sqfs_inode_get_file_size(n->inode, &size);
+		di->files += 1;
+		di->file_bytes += size;
+		di->read_bytes += blocks_unpacked(img, n->inode);
+
+		sqfs_inode_get_frag_location(n->inode, &frag_index,
+					     &frag_offset);
+
+		if (frag_index < img->super.fragment_entry_count)
+			scratch[count++] = frag_index;
+
+		end = blocks_on_disk(n->inode);
+		if (end == 0)
+			continue;
+
+		sqfs_inode_get_file_block_start(n->inode, &start);
+		end += start;
+
+		if (have_data) {
+			di->seek_distance += start > prev_end ?
+				(start - prev_end) : (prev_end - start);
+
+			first = start < first ? start : first;
+			last = end > last ? end : last;
+		} else {
+			first = start;
+			last = end;
+			have_data = true;
+		}
+
+		prev_end = end;
+	}
+
+	di->data_span = last - first;
+
+	/* every fragment block is unpacked once */
+	count = sort_unique(scratch, count);
+	di->fragment_blocks = count;
+
+	for (i = 0; i < count; ++i)
+		di->read_bytes += img->frags[scratch[i]].size;
+}
+
+static int add_dir(image_t *img, const sqfs_tree_node_t *dir,
+		   sqfs_u64 *scratch)
+{
+	const sqfs_tree_node_t *n;
+	dir_stats_t *di;
+	size_t count;
+
+	if (grow((void **)&img->dirs, &img->max_dirs, img->num_dirs,
+		 sizeof(img->dirs[0]))) {
+		goto fail_errno;
+	}
+
+	di = img->dirs + img->num_dirs;
+	memset(di, 0, sizeof(*di));
+
+	di->path = sqfs_tree_node_get_path(dir);
+	if (di->path == NULL)
+		goto fail_errno;
+
+	img->num_dirs += 1;
+
+	dir_listing(dir->inode, di);
+
+	count = 0;
+	for (n = dir->children; n != NULL; n = n->next)
+		scratch[count++] = n->inode_ref >> 16;
+
+	di->entries = count;
+	di->inode_meta_blocks = sort_unique(scratch, count);
+
+	dir_files(img, dir, di, scratch);
+	return 0;
+fail_errno:
+	perror("analyzing directories");
+	return -1;
+}
+
+static int collect_dirs(image_t *img, const sqfs_tree_node_t *dir)
+{
+	const sqfs_tree_node_t *n;
+	sqfs_u64 *scratch;
+	size_t count = 0;
+	int ret;
+
+	for (n = dir->children; n != NULL; n = n->next)
+		++count;
+
+	scratch = alloc_array(sizeof(scratch[0]), count + 1);
+	if (scratch == NULL) {
+		perror("analyzing directories");
+		return -1;
+	}
+
+	ret = add_dir(img, dir, scratch);
+	free(scratch);
+
+	if (ret)
+		return -1;
+
+	for (n = dir->children; n != NULL; n = n->next) {
+		if (S_ISDIR(n->inode->base.mode) && collect_dirs(img, n))
+			return -1;
+	}
+
+	return 0;
+}
+
+int image_analyze(image_t *img)
+{
+	sqfs_u8 *seen;
+	size_t i;
+	int ret;
+
+	if (load_fragment_table(img))
+		return -1;
+
+	seen = calloc(img->super.inode_count + 1, 1);
+	if (seen == NULL) {
+		perror("analyzing files");
+		return -1;
+	}
+
+	ret = collect_files(img, img->root, seen);
+	free(seen);
+
+	if (ret)
+		return -1;
+
+	for (i = 0; i < img->num_files; ++i)
+		finish_file(img, img->files + i);
+
+	if (find_shared(img))
+		return -1;
+
+	return collect_dirs(img, img->root);
+}
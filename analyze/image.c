@@ -0,0 +1,140 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * image.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "sqfsanalyze.h"
+
+static int load_image(image_t *img)
+{
+	sqfs_compressor_config_t cfg;
+	int ret;
+
+	ret = sqfs_super_read(&img->super, img->file);
+	if (ret) {
+		sqfs_perror(img->filename, "reading super block", ret);
+		return -1;
+	}
+
+	sqfs_compressor_config_init(&cfg, img->super.compression_id,
+				    img->super.block_size,
+				    SQFS_COMP_FLAG_UNCOMPRESS);
+
+	img->cmp = sqfs_compressor_create(&cfg);
+	if (img->cmp == NULL) {
+		fprintf(stderr, "%s: error creating compressor.\n",
+			img->filename);
+		return -1;
+	}
+
+	if (img->super.flags & SQFS_FLAG_COMPRESSOR_OPTIONS) {
+		ret = img->cmp->read_options(img->cmp, img->file);
+		if (ret) {
+			sqfs_perror(img->filename, "reading compressor "
+				    "options", ret);
+			return -1;
+		}
+	}
+
+	img->idtbl = sqfs_id_table_create();
+	if (img->idtbl == NULL) {
+		sqfs_perror(img->filename, "creating ID table",
+			    SQFS_ERROR_ALLOC);
+		return -1;
+	}
+
+	ret = sqfs_id_table_read(img->idtbl, img->file, &img->super,
+				 img->cmp);
+	if (ret) {
+		sqfs_perror(img->filename, "loading ID table", ret);
+		return -1;
+	}
+
+	img->dirrd = sqfs_dir_reader_create(&img->super, img->cmp, img->file);
+	if (img->dirrd == NULL) {
+		sqfs_perror(img->filename, "creating dir reader",
+			    SQFS_ERROR_ALLOC);
+		return -1;
+	}
+
+	ret = sqfs_dir_reader_set_readahead(img->dirrd, META_READAHEAD);
+	if (ret) {
+		sqfs_perror(img->filename, "setting up meta data read ahead",
+			    ret);
+		return -1;
+	}
+
+	/* only used for the fragment table, no data is ever read */
+	img->data = sqfs_data_reader_create(img->file, img->super.block_size,
+					    img->cmp, 0);
+	if (img->data == NULL) {
+		sqfs_perror(img->filename, "creating data reader",
+			    SQFS_ERROR_ALLOC);
+		return -1;
+	}
+
+	ret = sqfs_data_reader_load_fragment_table(img->data, &img->super);
+	if (ret) {
+		sqfs_perror(img->filename, "loading fragment table", ret);
+		return -1;
+	}
+
+	ret = sqfs_dir_reader_get_full_hierarchy(img->dirrd, img->idtbl, NULL,
+						 0, &img->root);
+	if (ret) {
+		sqfs_perror(img->filename, "reading filesystem tree", ret);
+		return -1;
+	}
+
+	return 0;
+}
+
+int image_open(image_t *img, const char *filename)
+{
+	memset(img, 0, sizeof(*img));
+	img->filename = filename;
+
+	img->file = sqfs_open_file(filename, SQFS_FILE_OPEN_READ_ONLY);
+	if (img->file == NULL) {
+		perror(filename);
+		return -1;
+	}
+
+	if (load_image(img)) {
+		image_close(img);
+		return -1;
+	}
+
+	return 0;
+}
+
+void image_close(image_t *img)
+{
+	size_t i;
+
+	for (i = 0; i < img->num_files; ++i)
+		free(img->files[i].path);
+
+	for (i = 0; i < img->num_dirs; ++i)
+		free(img->dirs[i].path);
+
+	free(img->files);
+	free(img->dirs);
+	free(img->frags);
+
+	if (img->root != NULL)
+		sqfs_dir_tree_destroy(img->root);
+	if (img->data != NULL)
+		sqfs_data_reader_destroy(img->data);
+	if (img->dirrd != NULL)
+		sqfs_dir_reader_destroy(img->dirrd);
+	if (img->idtbl != NULL)
+		sqfs_id_table_destroy(img->idtbl);
+	if (img->cmp != NULL)
+		img->cmp->destroy(img->cmp);
+	if (img->file != NULL)
+		img->file->destroy(img->file);
+
+	memset(img, 0, sizeof(*img));
+}
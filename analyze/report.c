@@ -0,0 +1,274 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * report.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "sqfsanalyze.h"
+
+#include <inttypes.h>
+
+static void print_string(FILE *fp, const char *str)
+{
+	const unsigned char *ptr = (const unsigned char *)str;
+
+	fputc('"', fp);
+
+	for (; *ptr != '\0'; ++ptr) {
+		if (*ptr == '"' || *ptr == '\\') {
+			fprintf(fp, "\\%c", *ptr);
+		} else if (*ptr < 0x20) {
+			fprintf(fp, "\\u%04x", *ptr);
+		} else {
+			fputc(*ptr, fp);
+		}
+	}
+
+	fputc('"', fp);
+}
+
+static double ratio(sqfs_u64 num, sqfs_u64 den)
+{
+	return den > 0 ? (double)num / (double)den : 0.0;
+}
+
+/* what the data of a file adds to the image */
+static sqfs_u64 file_stored(const file_stats_t *fi)
+{
+	return fi->duplicate ? 0 : fi->stored + fi->stored_tail;
+}
+
+static void print_summary(FILE *fp, const image_t *img)
+{
+	sqfs_u64 bytes = 0, stored = 0, dup_bytes = 0, frag_bytes = 0;
+	sqfs_u64 small_bytes = 0, small_read = 0, dir_blocks = 0;
+	size_t i, dup_files = 0, small_files = 0, frag_count = 0;
+	sqfs_u64 inode_blocks = 0;
+	sqfs_u32 max_dir_blocks = 0;
+
+	for (i = 0; i < img->num_files; ++i) {
+		const file_stats_t *fi = img->files + i;
+
+		bytes += fi->size;
+		stored += file_stored(fi);
+
+		if (fi->duplicate) {
+			dup_files += 1;
+			dup_bytes += fi->size;
+		}
+
+		if (fi->num_blocks == 0 && fi->tail > 0) {
+			small_files += 1;
+			small_bytes += fi->size;
+			small_read += fi->read_bytes;
+		}
+	}
+
+	for (i = 0; i < img->super.fragment_entry_count; ++i) {
+		if (img->frags[i].files == 0)
+			continue;
+
+		frag_count += 1;
+		frag_bytes += img->frags[i].on_disk;
+	}
+
+	for (i = 0; i < img->num_dirs; ++i) {
+		dir_blocks += img->dirs[i].dir_meta_blocks;
+		inode_blocks += img->dirs[i].inode_meta_blocks;
+
+		if (img->dirs[i].dir_meta_blocks > max_dir_blocks)
+			max_dir_blocks = img->dirs[i].dir_meta_blocks;
+	}
+
+	fprintf(fp, "  \"summary\": {\n");
+	fprintf(fp, "    \"files\": %zu,\n", img->num_files);
+	fprintf(fp, "    \"file_bytes\": %" PRIu64 ",\n", bytes);
+	fprintf(fp, "    \"stored_bytes\": %" PRIu64 ",\n", stored);
+	fprintf(fp, "    \"ratio\": %.3f,\n", ratio(bytes, stored));
+	fprintf(fp, "    \"fragment_blocks\": %zu,\n", frag_count);
+	fprintf(fp, "    \"fragment_block_bytes\": %" PRIu64 ",\n",
+		frag_bytes);
+	fprintf(fp, "    \"duplicate_files\": %zu,\n", dup_files);
+	fprintf(fp, "    \"duplicate_bytes\": %" PRIu64 ",\n", dup_bytes);
+	fprintf(fp, "    \"small_files\": %zu,\n", small_files);
+	fprintf(fp, "    \"small_file_bytes\": %" PRIu64 ",\n", small_bytes);
+	fprintf(fp, "    \"small_file_read_bytes\": %" PRIu64 ",\n",
+		small_read);
+	fprintf(fp, "    \"small_file_amplification\": %.3f,\n",
+		ratio(small_read, small_bytes));
+	fprintf(fp, "    \"directories\": %zu,\n", img->num_dirs);
+	fprintf(fp, "    \"dir_meta_blocks\": %" PRIu64 ",\n", dir_blocks);
+	fprintf(fp, "    \"dir_meta_blocks_max\": %u,\n", max_dir_blocks);
+	fprintf(fp, "    \"inode_meta_blocks\": %" PRIu64 "\n", inode_blocks);
+	fprintf(fp, "  }");
+}
+
+static int cmp_ext(const void *lhs, const void *rhs)
+{
+	const file_stats_t *l = *((const file_stats_t *const *)lhs);
+	const file_stats_t *r = *((const file_stats_t *const *)rhs);
+
+	return strcmp(l->ext, r->ext);
+}
+
+static int print_extensions(FILE *fp, const image_t *img)
+{
+	sqfs_u64 bytes, stored;
+	const file_stats_t **list;
+	size_t i, j, count;
+
+	list = alloc_array(sizeof(list[0]), img->num_files + 1);
+	if (list == NULL) {
+		perror("sorting files by extension");
+		return -1;
+	}
+
+	for (i = 0; i < img->num_files; ++i)
+		list[i] = img->files + i;
+
+	qsort(list, img->num_files, sizeof(list[0]), cmp_ext);
+
+	fprintf(fp, ",\n  \"extensions\": [");
+
+	for (i = 0; i < img->num_files; i = j) {
+		bytes = stored = 0;
+
+		for (j = i; j < img->num_files; ++j) {
+			if (strcmp(list[i]->ext, list[j]->ext) != 0)
+				break;
+
+			bytes += list[j]->size;
+			stored += file_stored(list[j]);
+		}
+
+		count = j - i;
+
+		fprintf(fp, "%s\n    { \"extension\": ", i == 0 ? "" : ",");
+		print_string(fp, list[i]->ext);
+		fprintf(fp, ", \"files\": %zu, \"file_bytes\": %" PRIu64
+			", \"stored_bytes\": %" PRIu64 ", \"ratio\": %.3f }",
+			count, bytes, stored, ratio(bytes, stored));
+	}
+
+	fprintf(fp, "%s]", img->num_files > 0 ? "\n  " : "");
+	free(list);
+	return 0;
+}
+
+static void print_dirs(FILE *fp, const image_t *img)
+{
+	const dir_stats_t *di;
+	size_t i;
+
+	fprintf(fp, ",\n  \"directories\": [");
+
+	for (i = 0; i < img->num_dirs; ++i) {
+		di = img->dirs + i;
+
+		fprintf(fp, "%s\n    { \"path\": ", i == 0 ? "" : ",");
+		print_string(fp, di->path);
+		fprintf(fp, ", \"entries\": %u, \"listing_bytes\": %u"
+			", \"dir_meta_blocks\": %u, \"inode_meta_blocks\": %u"
+			", \"files\": %u, \"file_bytes\": %" PRIu64
+			", \"fragment_blocks\": %u, \"read_bytes\": %" PRIu64
+			", \"amplification\": %.3f, \"data_span\": %" PRIu64
+			", \"seek_distance\": %" PRIu64 " }",
+			di->entries, di->listing_bytes, di->dir_meta_blocks,
+			di->inode_meta_blocks, di->files, di->file_bytes,
+			di->fragment_blocks, di->read_bytes,
+			ratio(di->read_bytes, di->file_bytes), di->data_span,
+			di->seek_distance);
+	}
+
+	fprintf(fp, "%s]", img->num_dirs > 0 ? "\n  " : "");
+}
+
+static void print_files(FILE *fp, const image_t *img)
+{
+	const file_stats_t *fi;
+	size_t i;
+
+	fprintf(fp, ",\n  \"files\": [");
+
+	for (i = 0; i < img->num_files; ++i) {
+		fi = img->files + i;
+
+		fprintf(fp, "%s\n    { \"path\": ", i == 0 ? "" : ",");
+		print_string(fp, fi->path);
+		fprintf(fp, ", \"size\": %" PRIu64 ", \"blocks\": %u"
+			", \"sparse_blocks\": %u, \"stored_bytes\": %" PRIu64,
+			fi->size, fi->num_blocks, fi->sparse_blocks,
+			fi->stored + fi->stored_tail);
+
+		if (fi->frag_index != 0xFFFFFFFF) {
+			fprintf(fp, ", \"tail\": %u, \"fragment\": %u"
+				", \"fragment_size\": %u", fi->tail,
+				fi->frag_index,
+				img->frags[fi->frag_index].size);
+		}
+
+		fprintf(fp, ", \"read_bytes\": %" PRIu64
+			", \"disk_read_bytes\": %" PRIu64
+			", \"amplification\": %.3f, \"shared\": %zu }",
+			fi->read_bytes, fi->disk_read_bytes,
+			ratio(fi->read_bytes, fi->size), fi->shared);
+	}
+
+	fprintf(fp, "%s]", img->num_files > 0 ? "\n  " : "");
+}
+
+int write_report(const image_t *img, const char *filename, bool summary_only)
+{
+	const char *name;
+	FILE *fp = stdout;
+	int ret = 0;
+
+	if (filename != NULL) {
+		fp = fopen(filename, "w");
+		if (fp == NULL) {
+			perror(filename);
+			return -1;
+		}
+	}
+
+	name = sqfs_compressor_name_from_id(img->super.compression_id);
+
+	fprintf(fp, "{\n  \"image\": ");
+	print_string(fp, img->filename);
+	fprintf(fp, ",\n  \"compressor\": ");
+	print_string(fp, name == NULL ? "unknown" : name);
+	fprintf(fp, ",\n  \"block_size\": %u,\n", img->super.block_size);
+	fprintf(fp, "  \"image_bytes\": %" PRIu64 ",\n",
+		img->super.bytes_used);
+
+	print_summary(fp, img);
+
+	if (print_extensions(fp, img)) {
+		ret = -1;
+		goto out;
+	}
+
+	if (!summary_only) {
+		print_dirs(fp, img);
+		print_files(fp, img);
+	}
+
+	fprintf(fp, "\n}\n");
+
+	if (ferror(fp))
+		ret = -1;
+out:
+	if (fp != stdout) {
+		if (fclose(fp) != 0)
+			ret = -1;
+	} else if (fflush(fp) != 0) {
+		ret = -1;
+	}
+
+	if (ret) {
+		fprintf(stderr, "%s: error writing report\n",
+			filename == NULL ? "stdout" : filename);
+	}
+
+	return ret;
+}
@@ -0,0 +1,112 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * sqfsanalyze.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "sqfsanalyze.h"
+
+static struct option long_opts[] = {
+	{ "output", required_argument, NULL, 'o' },
+	{ "summary", no_argument, NULL, 's' },
+	{ "help", no_argument, NULL, 'h' },
+	{ "version", no_argument, NULL, 'V' },
+};
+
+static const char *short_opts = "o:shV";
+
+static const char *usagestr =
+"Usage: sqfsanalyze [OPTIONS...] <image>\n"
+"\n"
+"Report how the layout of a squashfs image affects reading it, as JSON.\n"
+"\n"
+"For every file, the bytes that are unpacked and read from disk to read\n"
+"it, including the entire fragment block its tail end is in, and how many\n"
+"other files share its data. For every directory, the meta data blocks\n"
+"touched to list it and to look at the inodes of the entries, and how far\n"
+"apart the data of its files is. Along with the compression ratio for each\n"
+"file name extension and a summary of the entire image.\n"
+"\n"
+"Possible options:\n"
+"\n"
+"  --output, -o <file>  Write the report to a file instead of stdout.\n"
+"  --summary, -s        Only report the summary and the extensions, not\n"
+"                       every single file and directory.\n"
+"  --help, -h           Print help text and exit.\n"
+"  --version, -V        Print version information and exit.\n"
+"\n"
+"Examples:\n"
+"\n"
+"\tsqfsanalyze -o layout.json rootfs.sqfs\n"
+"\n";
+
+static const char *image;
+static const char *output;
+static bool summary_only;
+
+static void process_args(int argc, char **argv)
+{
+	int i;
+
+	for (;;) {
+		i = getopt_long(argc, argv, short_opts, long_opts, NULL);
+		if (i == -1)
+			break;
+
+		switch (i) {
+		case 'o':
+			output = optarg;
+			break;
+		case 's':
+			summary_only = true;
+			break;
+		case 'h':
+			fputs(usagestr, stdout);
+			exit(EXIT_SUCCESS);
+		case 'V':
+			print_version();
+			exit(EXIT_SUCCESS);
+		default:
+			goto fail_arg;
+		}
+	}
+
+	if (optind >= argc) {
+		fputs("Missing argument: squashfs image to analyze\n",
+		      stderr);
+		goto fail_arg;
+	}
+
+	image = argv[optind++];
+
+	if (optind < argc) {
+		fputs("Unknown extra arguments specified.\n", stderr);
+		goto fail_arg;
+	}
+	return;
+fail_arg:
+	fputs("Try `sqfsanalyze --help' for more information.\n", stderr);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	int status = EXIT_FAILURE;
+	image_t img;
+
+	process_args(argc, argv);
+
+	if (image_open(&img, image))
+		return EXIT_FAILURE;
+
+	if (image_analyze(&img))
+		goto out;
+
+	if (write_report(&img, output, summary_only))
+		goto out;
+
+	status = EXIT_SUCCESS;
+out:
+	image_close(&img);
+	return status;
+}
@@ -0,0 +1,125 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * sqfsanalyze.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef SQFSANALYZE_H
+#define SQFSANALYZE_H
+
+#include "config.h"
+#include "common.h"
+#include "util/util.h"
+#include "util/compat.h"
+
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+/* a fragment block and the tail ends in it */
+typedef struct {
+	/* end of the last tail end in the block, i.e. its unpacked size */
+	sqfs_u32 size;
+
+	sqfs_u32 on_disk;
+	sqfs_u32 files;
+} frag_stats_t;
+
+/* a regular file, hard links are only counted once */
+typedef struct {
+	const sqfs_tree_node_t *node;
+	char *path;
+
+	/* the name extension, pointing into the name of the node */
+	const char *ext;
+
+	sqfs_u64 size;
+	sqfs_u64 block_start;
+	sqfs_u32 num_blocks;
+	sqfs_u32 sparse_blocks;
+
+	sqfs_u32 frag_index;
+	sqfs_u32 frag_offset;
+	sqfs_u32 tail;
+
+	/* bytes of the blocks on disk, and the share of the fragment block */
+	sqfs_u64 stored;
+	sqfs_u64 stored_tail;
+
+	/* bytes unpacked and read from disk to read the entire file */
+	sqfs_u64 read_bytes;
+	sqfs_u64 disk_read_bytes;
+
+	/* the number of other files that have the same data */
+	size_t shared;
+
+	/* set if an earlier file has the same data */
+	bool duplicate;
+} file_stats_t;
+
+typedef struct {
+	char *path;
+	sqfs_u32 entries;
+
+	/* size of the listing and the meta data blocks it spans */
+	sqfs_u32 listing_bytes;
+	sqfs_u32 dir_meta_blocks;
+
+	/* meta data blocks with the inodes of the entries, e.g. for ls -l */
+	sqfs_u32 inode_meta_blocks;
+
+	/* the regular files directly in the directory */
+	sqfs_u32 files;
+	sqfs_u64 file_bytes;
+	sqfs_u32 fragment_blocks;
+
+	/* bytes unpacked to read all of the files */
+	sqfs_u64 read_bytes;
+
+	/* from the first to the last data block of the files */
+	sqfs_u64 data_span;
+
+	/* the gaps between the files, reading them in the listing order */
+	sqfs_u64 seek_distance;
+} dir_stats_t;
+
+typedef struct {
+	const char *filename;
+	sqfs_file_t *file;
+	sqfs_super_t super;
+	sqfs_compressor_t *cmp;
+	sqfs_id_table_t *idtbl;
+	sqfs_dir_reader_t *dirrd;
+	sqfs_data_reader_t *data;
+	sqfs_tree_node_t *root;
+
+	/* indexed by fragment table index */
+	frag_stats_t *frags;
+
+	file_stats_t *files;
+	size_t num_files;
+	size_t max_files;
+
+	dir_stats_t *dirs;
+	size_t num_dirs;
+	size_t max_dirs;
+} image_t;
+
+/* Prints an error message and returns -1 on failure. */
+int image_open(image_t *img, const char *filename);
+
+void image_close(image_t *img);
+
+/*
+  Walk the directory tree of the image and gather the statistics of all
+  files and directories. Prints an error message and returns -1 on failure.
+ */
+int image_analyze(image_t *img);
+
+/* Prints an error message and returns -1 on failure. */
+int write_report(const image_t *img, const char *filename, bool summary_only);
+
+#endif /* SQFSANALYZE_H */
@@ -0,0 +1,319 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * micro_data.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "microbench.h"
+
+#include "sqfs/data_writer.h"
+#include "sqfs/data_reader.h"
+#include "sqfs/compressor.h"
+#include "sqfs/inode.h"
+#include "sqfs/super.h"
+#include "sqfs/error.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#define BLOCK_SIZE (SQFS_DEFAULT_BLOCK_SIZE)
+
+/* one large file, cut into a number of smaller ones for the writer */
+#define DATA_SIZE (16 * 1024 * 1024)
+#define NUM_FILES (64)
+
+#define READ_CHUNK (64 * 1024)
+#define RANDOM_READ_SIZE (4096)
+#define RANDOM_READ_COUNT (4096)
+#define READER_CACHE (8 * BLOCK_SIZE)
+
+static const unsigned int thread_counts[] = { 1, 2, 4 };
+
+static sqfs_inode_generic_t *create_file_inode(sqfs_u64 size)
+{
+	size_t count = size / BLOCK_SIZE + 1;
+	sqfs_inode_generic_t *inode;
+
+	inode = alloc_flex(sizeof(*inode), sizeof(sqfs_u32), count);
+	if (inode == NULL)
+		return NULL;
+
+	inode->block_sizes = (sqfs_u32 *)inode->extra;
+	inode->base.type = SQFS_INODE_FILE;
+	sqfs_inode_set_file_size(inode, size);
+	sqfs_inode_set_frag_location(inode, 0xFFFFFFFF, 0xFFFFFFFF);
+	return inode;
+}
+
+static int pack(sqfs_compressor_t *cmp, unsigned int num_jobs,
+		const sqfs_u8 *data, size_t num_files, mem_file_t *out,
+		sqfs_inode_generic_t **inodes, sqfs_super_t *super)
+{
+	size_t i, file_size = DATA_SIZE / num_files;
+	sqfs_data_writer_t *wr;
+	int ret;
+
+	wr = sqfs_data_writer_create(BLOCK_SIZE, cmp, num_jobs, 10 * num_jobs,
+				     10 * num_jobs, 0, (sqfs_file_t *)out, 0);
+	if (wr == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	for (i = 0; i < num_files; ++i) {
+		ret = sqfs_data_writer_begin_file(wr, inodes[i], 0);
+		if (ret == 0)
+			ret = sqfs_data_writer_append(wr, data + i * file_size,
+						      file_size);
+		if (ret == 0)
+			ret = sqfs_data_writer_end_file(wr);
+		if (ret)
+			goto out;
+	}
+
+	ret = sqfs_data_writer_finish(wr);
+
+	if (ret == 0 && super != NULL)
+		ret = sqfs_data_writer_write_fragment_table(wr, super);
+out:
+	sqfs_data_writer_destroy(wr);
+	return ret;
+}
+
+/*
+  The time from the first append to the finished output, for files of
+  a quarter MiB each, i.e. two blocks and no tail end.
+ */
+int bench_data_writer_append(void)
+{
+	sqfs_inode_generic_t *inodes[NUM_FILES];
+	sqfs_compressor_config_t cfg;
+	sqfs_compressor_t *cmp;
+	char params[128];
+	size_t i, j, k;
+	bench_run_t run;
+	mem_file_t *out;
+	sqfs_u8 *data;
+	int id, ret = -1;
+
+	memset(inodes, 0, sizeof(inodes));
+	memset(&run, 0, sizeof(run));
+
+	data = malloc(DATA_SIZE);
+	if (data == NULL)
+		goto fail_alloc;
+
+	bench_fill(data, DATA_SIZE, 42);
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		inodes[i] = create_file_inode(DATA_SIZE / NUM_FILES);
+		if (inodes[i] == NULL)
+			goto fail_alloc;
+	}
+
+	for (id = SQFS_COMP_MIN; id <= SQFS_COMP_MAX; ++id) {
+		if (!sqfs_compressor_exists(id))
+			continue;
+
+		sqfs_compressor_config_init(&cfg, id, BLOCK_SIZE, 0);
+
+		for (j = 0; j < sizeof(thread_counts) /
+			     sizeof(thread_counts[0]); ++j) {
+			for (k = 0; k < bench_repeat; ++k) {
+				cmp = sqfs_compressor_create(&cfg);
+				out = mem_file_create(DATA_SIZE + BLOCK_SIZE);
+
+				if (cmp == NULL || out == NULL) {
+					if (cmp != NULL)
+						cmp->destroy(cmp);
+					mem_file_destroy(out);
+					goto fail_alloc;
+				}
+
+				bench_begin(&run);
+				ret = pack(cmp, thread_counts[j], data,
+					   NUM_FILES, out, inodes, NULL);
+				bench_end(&run, DATA_SIZE / (1024.0 * 1024.0));
+
+				cmp->destroy(cmp);
+				mem_file_destroy(out);
+
+				if (ret) {
+					fprintf(stderr, "packing data: %d\n",
+						ret);
+					goto out;
+				}
+			}
+
+			snprintf(params, sizeof(params),
+				 "comp=%s,threads=%u",
+				 sqfs_compressor_name_from_id(id),
+				 thread_counts[j]);
+			bench_report(&run, "data_writer_append", params,
+				     "MiB/s");
+		}
+	}
+
+	ret = 0;
+out:
+	for (i = 0; i < NUM_FILES; ++i)
+		free(inodes[i]);
+	free(data);
+	return ret;
+fail_alloc:
+	fputs("data writer benchmark: out of memory\n", stderr);
+	ret = -1;
+	goto out;
+}
+
+/*****************************************************************************/
+
+static int read_sequential(sqfs_data_reader_t *rd,
+			   const sqfs_inode_generic_t *inode, sqfs_u8 *buffer)
+{
+	sqfs_u64 offset;
+	sqfs_s32 ret;
+
+	for (offset = 0; offset < DATA_SIZE; offset += READ_CHUNK) {
+		ret = sqfs_data_reader_read(rd, inode, offset, buffer,
+					    READ_CHUNK);
+		if (ret != READ_CHUNK)
+			return ret < 0 ? ret : SQFS_ERROR_OUT_OF_BOUNDS;
+	}
+
+	return 0;
+}
+
+static int read_random(sqfs_data_reader_t *rd,
+		       const sqfs_inode_generic_t *inode, sqfs_u8 *buffer)
+{
+	sqfs_u32 seed = 1337;
+	sqfs_u64 offset;
+	sqfs_s32 ret;
+	size_t i;
+
+	for (i = 0; i < RANDOM_READ_COUNT; ++i) {
+		offset = bench_rand(&seed) % (DATA_SIZE - RANDOM_READ_SIZE);
+
+		ret = sqfs_data_reader_read(rd, inode, offset, buffer,
+					    RANDOM_READ_SIZE);
+		if (ret != RANDOM_READ_SIZE)
+			return ret < 0 ? ret : SQFS_ERROR_OUT_OF_BOUNDS;
+	}
+
+	return 0;
+}
+
+/*
+  Each run uses a fresh data reader, so the sequential read uncompresses
+  every block once. The random reads go through a cache of 8 blocks.
+ */
+int bench_data_reader_read(void)
+{
+	sqfs_inode_generic_t *inode = NULL;
+	sqfs_compressor_config_t cfg;
+	bench_run_t seq, rnd;
+	sqfs_compressor_t *cmp, *ucmp = NULL;
+	sqfs_data_reader_t *rd;
+	sqfs_u8 *data, *buffer;
+	mem_file_t *img = NULL;
+	char params[128];
+	sqfs_super_t super;
+	int id, ret = -1;
+	size_t i;
+
+	memset(&seq, 0, sizeof(seq));
+	memset(&rnd, 0, sizeof(rnd));
+
+	data = malloc(DATA_SIZE);
+	buffer = malloc(READ_CHUNK);
+	if (data == NULL || buffer == NULL)
+		goto fail_alloc;
+
+	bench_fill(data, DATA_SIZE, 4711);
+
+	for (id = SQFS_COMP_MIN; id <= SQFS_COMP_MAX; ++id) {
+		if (!sqfs_compressor_exists(id))
+			continue;
+
+		sqfs_compressor_config_init(&cfg, id, BLOCK_SIZE, 0);
+
+		cmp = sqfs_compressor_create(&cfg);
+		if (cmp == NULL)
+			goto fail_alloc;
+
+		cfg.flags |= SQFS_COMP_FLAG_UNCOMPRESS;
+		ucmp = sqfs_compressor_create(&cfg);
+		img = mem_file_create(DATA_SIZE + BLOCK_SIZE);
+		inode = create_file_inode(DATA_SIZE);
+
+		if (ucmp == NULL || img == NULL || inode == NULL) {
+			cmp->destroy(cmp);
+			goto fail_alloc;
+		}
+
+		memset(&super, 0, sizeof(super));
+		ret = pack(cmp, 1, data, 1, img, &inode, &super);
+		cmp->destroy(cmp);
+
+		if (ret) {
+			fprintf(stderr, "packing data: %d\n", ret);
+			goto out;
+		}
+
+		mem_file_enable_map(img);
+
+		for (i = 0; i < bench_repeat; ++i) {
+			rd = sqfs_data_reader_create((sqfs_file_t *)img,
+						     BLOCK_SIZE, ucmp,
+						     READER_CACHE);
+			if (rd == NULL)
+				goto fail_alloc;
+
+			bench_begin(&seq);
+			ret = read_sequential(rd, inode, buffer);
+			bench_end(&seq, DATA_SIZE / (1024.0 * 1024.0));
+
+			if (ret == 0) {
+				bench_begin(&rnd);
+				ret = read_random(rd, inode, buffer);
+				bench_end(&rnd, RANDOM_READ_COUNT);
+			}
+
+			sqfs_data_reader_destroy(rd);
+
+			if (ret) {
+				fprintf(stderr, "reading data: %d\n", ret);
+				goto out;
+			}
+		}
+
+		snprintf(params, sizeof(params), "comp=%s,access=sequential",
+			 sqfs_compressor_name_from_id(id));
+		bench_report(&seq, "data_reader_read", params, "MiB/s");
+
+		snprintf(params, sizeof(params), "comp=%s,access=random",
+			 sqfs_compressor_name_from_id(id));
+		bench_report(&rnd, "data_reader_read", params, "reads/s");
+
+		ucmp->destroy(ucmp);
+		ucmp = NULL;
+		mem_file_destroy(img);
+		img = NULL;
+		free(inode);
+		inode = NULL;
+	}
+
+	ret = 0;
+out:
+	if (ucmp != NULL)
+		ucmp->destroy(ucmp);
+	mem_file_destroy(img);
+	free(inode);
+	free(buffer);
+	free(data);
+	return ret;
+fail_alloc:
+	fputs("data reader benchmark: out of memory\n", stderr);
+	ret = -1;
+	goto out;
+}
@@ -0,0 +1,235 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * micro_inode.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "microbench.h"
+
+#include "sqfs/meta_writer.h"
+#include "sqfs/meta_reader.h"
+#include "sqfs/compressor.h"
+#include "sqfs/block.h"
+#include "sqfs/inode.h"
+#include "sqfs/super.h"
+#include "sqfs/error.h"
+
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#define NUM_INODES (100000)
+#define MAX_BLOCKS (16)
+
+typedef struct {
+	sqfs_u64 block_start;
+	sqfs_u32 offset;
+} inode_pos_t;
+
+static const char *target = "../../usr/lib/libsquashfs.so.1";
+
+/*
+  Mostly files with a few blocks and a fragment, some directories and
+  symlinks, roughly the mix of a root file system.
+ */
+static sqfs_inode_generic_t *create_inode(size_t i, sqfs_u32 *seed)
+{
+	sqfs_inode_generic_t *inode;
+	size_t count, len;
+	sqfs_u64 size;
+
+	switch (i % 8) {
+	case 0:
+		inode = calloc(1, sizeof(*inode));
+		if (inode == NULL)
+			return NULL;
+
+		inode->base.type = SQFS_INODE_DIR;
+		inode->base.mode = S_IFDIR | 0755;
+		inode->data.dir.start_block = bench_rand(seed) % 100000;
+		inode->data.dir.nlink = 2 + bench_rand(seed) % 10;
+		inode->data.dir.size = 3 + bench_rand(seed) % 1000;
+		inode->data.dir.offset = bench_rand(seed) % 8192;
+		inode->data.dir.parent_inode = 1 + i / 8;
+		break;
+	case 1:
+		len = strlen(target);
+		inode = calloc(1, sizeof(*inode) + len + 1);
+		if (inode == NULL)
+			return NULL;
+
+		inode->base.type = SQFS_INODE_SLINK;
+		inode->base.mode = S_IFLNK | 0777;
+		inode->slink_target = (char *)inode->extra;
+		memcpy(inode->slink_target, target, len);
+		inode->data.slink.nlink = 1;
+		inode->data.slink.target_size = len;
+		break;
+	default:
+		count = bench_rand(seed) % MAX_BLOCKS;
+		size = count * SQFS_DEFAULT_BLOCK_SIZE +
+			bench_rand(seed) % SQFS_DEFAULT_BLOCK_SIZE;
+
+		inode = alloc_flex(sizeof(*inode), sizeof(sqfs_u32), count);
+		if (inode == NULL)
+			return NULL;
+
+		inode->base.type = SQFS_INODE_FILE;
+		inode->base.mode = S_IFREG | 0644;
+		inode->block_sizes = (sqfs_u32 *)inode->extra;
+		inode->num_file_blocks = count;
+
+		while (count-- > 0) {
+			inode->block_sizes[count] =
+				1 + bench_rand(seed) % SQFS_DEFAULT_BLOCK_SIZE;
+		}
+
+		inode->data.file.blocks_start = bench_rand(seed);
+		sqfs_inode_set_file_size(inode, size);
+		sqfs_inode_set_frag_location(inode, bench_rand(seed) % 1000,
+					     bench_rand(seed) %
+					     SQFS_DEFAULT_BLOCK_SIZE);
+		break;
+	}
+
+	inode->base.uid_idx = i % 3;
+	inode->base.gid_idx = i % 2;
+	inode->base.mod_time = 1570000000 + i;
+	inode->base.inode_number = i + 1;
+	return inode;
+}
+
+static int write_inodes(sqfs_compressor_t *cmp, mem_file_t *file,
+			inode_pos_t *pos)
+{
+	sqfs_inode_generic_t *inode;
+	sqfs_meta_writer_t *wr;
+	sqfs_u32 seed = 99;
+	int ret = 0;
+	size_t i;
+
+	wr = sqfs_meta_writer_create((sqfs_file_t *)file, cmp, 0);
+	if (wr == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	for (i = 0; i < NUM_INODES && ret == 0; ++i) {
+		inode = create_inode(i, &seed);
+		if (inode == NULL) {
+			ret = SQFS_ERROR_ALLOC;
+			break;
+		}
+
+		sqfs_meta_writer_get_position(wr, &pos[i].block_start,
+					      &pos[i].offset);
+		ret = sqfs_meta_writer_write_inode(wr, inode);
+		free(inode);
+	}
+
+	if (ret == 0)
+		ret = sqfs_meta_writer_flush(wr);
+
+	sqfs_meta_writer_destroy(wr);
+	return ret;
+}
+
+static int read_inodes(sqfs_compressor_t *cmp, mem_file_t *file,
+		       const sqfs_super_t *super, const inode_pos_t *pos)
+{
+	sqfs_inode_generic_t *inode;
+	sqfs_meta_reader_t *rd;
+	int ret = 0;
+	size_t i;
+
+	rd = sqfs_meta_reader_create((sqfs_file_t *)file, cmp, 0,
+				     file->size);
+	if (rd == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	for (i = 0; i < NUM_INODES; ++i) {
+		ret = sqfs_meta_reader_read_inode(rd, super, pos[i].block_start,
+						  pos[i].offset, &inode);
+		if (ret)
+			break;
+
+		free(inode);
+	}
+
+	sqfs_meta_reader_destroy(rd);
+	return ret;
+}
+
+/* Decoding an inode table front to back, with a fresh meta data reader. */
+int bench_read_inode(void)
+{
+	sqfs_compressor_config_t cfg;
+	sqfs_compressor_t *cmp, *ucmp;
+	mem_file_t *file;
+	char params[128];
+	sqfs_super_t super;
+	inode_pos_t *pos;
+	bench_run_t run;
+	int id, ret = 0;
+	size_t i;
+
+	memset(&run, 0, sizeof(run));
+
+	pos = alloc_array(sizeof(pos[0]), NUM_INODES);
+	if (pos == NULL)
+		goto fail_alloc;
+
+	for (id = SQFS_COMP_MIN; id <= SQFS_COMP_MAX && ret == 0; ++id) {
+		if (!sqfs_compressor_exists(id))
+			continue;
+
+		sqfs_compressor_config_init(&cfg, id, SQFS_META_BLOCK_SIZE, 0);
+
+		cmp = sqfs_compressor_create(&cfg);
+		cfg.flags |= SQFS_COMP_FLAG_UNCOMPRESS;
+		ucmp = sqfs_compressor_create(&cfg);
+		file = mem_file_create(NUM_INODES * 32);
+
+		if (cmp == NULL || ucmp == NULL || file == NULL) {
+			if (cmp != NULL)
+				cmp->destroy(cmp);
+			if (ucmp != NULL)
+				ucmp->destroy(ucmp);
+			mem_file_destroy(file);
+			goto fail_alloc;
+		}
+
+		sqfs_super_init(&super, SQFS_DEFAULT_BLOCK_SIZE, 0, id);
+		super.inode_table_start = 0;
+
+		ret = write_inodes(cmp, file, pos);
+		if (ret == 0)
+			mem_file_enable_map(file);
+
+		for (i = 0; i < bench_repeat && ret == 0; ++i) {
+			bench_begin(&run);
+			ret = read_inodes(ucmp, file, &super, pos);
+			bench_end(&run, NUM_INODES);
+		}
+
+		cmp->destroy(cmp);
+		ucmp->destroy(ucmp);
+		mem_file_destroy(file);
+
+		if (ret) {
+			fprintf(stderr, "inode benchmark: %d\n", ret);
+			break;
+		}
+
+		snprintf(params, sizeof(params), "comp=%s,inodes=%d",
+			 sqfs_compressor_name_from_id(id), NUM_INODES);
+		bench_report(&run, "meta_reader_read_inode", params,
+			     "inodes/s");
+	}
+
+	free(pos);
+	return ret ? -1 : 0;
+fail_alloc:
+	fputs("inode benchmark: out of memory\n", stderr);
+	free(pos);
+	return -1;
+}
@@ -0,0 +1,266 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * micro_tar.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "microbench.h"
+
+#include "fstream.h"
+#include "tar.h"
+
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#define NUM_HEADERS (20000)
+
+/* An output stream that gathers everything in memory. */
+typedef struct {
+	ostream_t base;
+	sqfs_u8 *data;
+	size_t size;
+	size_t max;
+} mem_ostream_t;
+
+/* An input stream that has the entire archive in its buffer. */
+typedef struct {
+	istream_t base;
+} mem_istream_t;
+
+static int mem_append(mem_ostream_t *strm, const void *data, size_t size)
+{
+	size_t new_max;
+	sqfs_u8 *new;
+
+	if (strm->size + size > strm->max) {
+		for (new_max = strm->max; strm->size + size > new_max; )
+			new_max *= 2;
+
+		new = realloc(strm->data, new_max);
+		if (new == NULL) {
+			fputs("tar benchmark: out of memory\n", stderr);
+			return -1;
+		}
+
+		strm->data = new;
+		strm->max = new_max;
+	}
+
+	memcpy(strm->data + strm->size, data, size);
+	strm->size += size;
+	return 0;
+}
+
+static int mem_ostream_write(ostream_t *base, const void *data, size_t size)
+{
+	mem_ostream_t *strm = (mem_ostream_t *)base;
+
+	if (mem_append(strm, base->buffer, base->buffer_used))
+		return -1;
+
+	base->buffer_used = 0;
+	return mem_append(strm, data, size);
+}
+
+static int mem_istream_precache(istream_t *strm)
+{
+	strm->eof = true;
+	return 0;
+}
+
+static const char *mem_get_filename(void)
+{
+	return "tar benchmark";
+}
+
+static const char *mem_ostream_get_filename(ostream_t *strm)
+{
+	(void)strm;
+	return mem_get_filename();
+}
+
+static const char *mem_istream_get_filename(istream_t *strm)
+{
+	(void)strm;
+	return mem_get_filename();
+}
+
+/*
+  Mostly plain entries, with a long path that needs an extension header
+  or extended attributes for every 10th.
+ */
+static int create_archive(mem_ostream_t *strm)
+{
+	static char key[] = "user.mime_type", value[] = "text/plain";
+	char name[256], target[64];
+	tar_xattr_t *xattr;
+	struct stat sb;
+	unsigned int i;
+	int ret;
+
+	xattr = calloc(1, sizeof(*xattr));
+	if (xattr == NULL)
+		return -1;
+
+	xattr->key = key;
+	xattr->value = value;
+
+	memset(&sb, 0, sizeof(sb));
+	sb.st_uid = 1000;
+	sb.st_gid = 100;
+	sb.st_mtime = 1570000000;
+
+	for (i = 0; i < NUM_HEADERS; ++i) {
+		sb.st_mode = S_IFREG | 0644;
+
+		switch (i % 10) {
+		case 0:
+			snprintf(name, sizeof(name),
+				 "usr/share/doc/a_rather_long_package_name/"
+				 "examples/with_a_deeply_nested/directory/"
+				 "structure/and_a_long_file_name_%u.txt", i);
+			ret = write_tar_header(&strm->base, &sb, name, NULL,
+					       NULL, i);
+			break;
+		case 1:
+			snprintf(name, sizeof(name), "etc/config_%u", i);
+			ret = write_tar_header(&strm->base, &sb, name, NULL,
+					       xattr, i);
+			break;
+		case 2:
+			sb.st_mode = S_IFLNK | 0777;
+			snprintf(name, sizeof(name), "usr/lib/lib%u.so", i);
+			snprintf(target, sizeof(target), "lib%u.so.1", i);
+			ret = write_tar_header(&strm->base, &sb, name, target,
+					       NULL, i);
+			break;
+		default:
+			snprintf(name, sizeof(name), "usr/bin/file_%u", i);
+			ret = write_tar_header(&strm->base, &sb, name, NULL,
+					       NULL, i);
+			break;
+		}
+
+		if (ret)
+			break;
+	}
+
+	free(xattr);
+
+	if (ret == 0)
+		ret = ostream_append_zero(&strm->base, 2 * TAR_RECORD_SIZE);
+	if (ret == 0)
+		ret = ostream_flush(&strm->base);
+
+	return ret ? -1 : 0;
+}
+
+static int read_archive(const mem_ostream_t *archive)
+{
+	tar_header_decoded_t hdr;
+	mem_istream_t strm;
+	size_t count = 0;
+	int ret;
+
+	memset(&strm, 0, sizeof(strm));
+	strm.base.buffer = archive->data;
+	strm.base.buffer_used = archive->size;
+	strm.base.eof = true;
+	strm.base.precache = mem_istream_precache;
+	strm.base.get_filename = mem_istream_get_filename;
+
+	for (;;) {
+		ret = read_header(&strm.base, &hdr);
+		if (ret > 0)
+			break;
+		if (ret < 0)
+			return -1;
+
+		clear_header(&hdr);
+		++count;
+	}
+
+	return count == NUM_HEADERS ? 0 : -1;
+}
+
+static int init_archive(mem_ostream_t *archive)
+{
+	memset(archive, 0, sizeof(*archive));
+
+	archive->max = NUM_HEADERS * 3 * TAR_RECORD_SIZE;
+	archive->data = malloc(archive->max);
+	archive->base.buffer = malloc(OSTREAM_BUFFER_SIZE);
+	archive->base.write = mem_ostream_write;
+	archive->base.get_filename = mem_ostream_get_filename;
+
+	if (archive->data == NULL || archive->base.buffer == NULL) {
+		fputs("tar benchmark: out of memory\n", stderr);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Encoding the same headers into a stream that collects them in memory. */
+int bench_tar_write_header(void)
+{
+	mem_ostream_t archive;
+	bench_run_t run;
+	char params[64];
+	int ret;
+	size_t i;
+
+	memset(&run, 0, sizeof(run));
+
+	ret = init_archive(&archive);
+
+	for (i = 0; i < bench_repeat && ret == 0; ++i) {
+		archive.size = 0;
+
+		bench_begin(&run);
+		ret = create_archive(&archive);
+		bench_end(&run, NUM_HEADERS);
+	}
+
+	if (ret == 0) {
+		snprintf(params, sizeof(params), "headers=%d", NUM_HEADERS);
+		bench_report(&run, "tar_write_header", params, "headers/s");
+	}
+
+	free(archive.base.buffer);
+	free(archive.data);
+	return ret;
+}
+
+/* Decoding headers from memory, including the pax and GNU extensions. */
+int bench_tar_read_header(void)
+{
+	mem_ostream_t archive;
+	bench_run_t run;
+	char params[64];
+	int ret;
+	size_t i;
+
+	memset(&run, 0, sizeof(run));
+
+	ret = init_archive(&archive);
+	if (ret == 0)
+		ret = create_archive(&archive);
+
+	for (i = 0; i < bench_repeat && ret == 0; ++i) {
+		bench_begin(&run);
+		ret = read_archive(&archive);
+		bench_end(&run, NUM_HEADERS);
+	}
+
+	if (ret == 0) {
+		snprintf(params, sizeof(params), "headers=%d", NUM_HEADERS);
+		bench_report(&run, "tar_read_header", params, "headers/s");
+	}
+
+	free(archive.base.buffer);
+	free(archive.data);
+	return ret;
+}
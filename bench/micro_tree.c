@@ -0,0 +1,168 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * micro_tree.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "microbench.h"
+
+#include "util/str_table.h"
+#include "fstree.h"
+
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#define NUM_STRINGS (100000)
+#define NUM_ENTRIES (100000)
+
+static char **create_names(size_t count, const char *prefix)
+{
+	char **names = alloc_array(sizeof(names[0]), count);
+	char buffer[128];
+	size_t i;
+
+	if (names == NULL)
+		return NULL;
+
+	for (i = 0; i < count; ++i) {
+		snprintf(buffer, sizeof(buffer), "%s%08zx_%zu", prefix,
+			 (size_t)(i * 2654435761UL) & 0xFFFFFFFF, i);
+
+		names[i] = strdup(buffer);
+		if (names[i] == NULL) {
+			while (i-- > 0)
+				free(names[i]);
+			free(names);
+			return NULL;
+		}
+	}
+
+	return names;
+}
+
+static void free_names(char **names, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; ++i)
+		free(names[i]);
+
+	free(names);
+}
+
+/*
+  Inserting distinct strings into an empty table, i.e. including all the
+  rehashing, and looking all of them up again afterwards.
+ */
+int bench_str_table(void)
+{
+	bench_run_t insert, lookup;
+	char **names, params[64];
+	str_table_t table;
+	int ret = 0;
+	size_t i, j, idx;
+
+	memset(&insert, 0, sizeof(insert));
+	memset(&lookup, 0, sizeof(lookup));
+
+	names = create_names(NUM_STRINGS, "user.");
+	if (names == NULL)
+		goto fail_alloc;
+
+	for (i = 0; i < bench_repeat && ret == 0; ++i) {
+		if (str_table_init(&table, 0))
+			goto fail_alloc;
+
+		bench_begin(&insert);
+		for (j = 0; j < NUM_STRINGS && ret == 0; ++j)
+			ret = str_table_get_index(&table, names[j], &idx);
+		bench_end(&insert, NUM_STRINGS);
+
+		if (ret == 0) {
+			bench_begin(&lookup);
+			for (j = 0; j < NUM_STRINGS && ret == 0; ++j) {
+				ret = str_table_get_index(&table, names[j],
+							  &idx);
+				if (ret == 0 && idx != j)
+					ret = -1;
+			}
+			bench_end(&lookup, NUM_STRINGS);
+		}
+
+		str_table_cleanup(&table);
+	}
+
+	free_names(names, NUM_STRINGS);
+
+	if (ret) {
+		fprintf(stderr, "string table benchmark: %d\n", ret);
+		return -1;
+	}
+
+	snprintf(params, sizeof(params), "op=insert,strings=%d", NUM_STRINGS);
+	bench_report(&insert, "str_table_get_index", params, "ops/s");
+
+	snprintf(params, sizeof(params), "op=lookup,strings=%d", NUM_STRINGS);
+	bench_report(&lookup, "str_table_get_index", params, "ops/s");
+	return 0;
+fail_alloc:
+	fputs("string table benchmark: out of memory\n", stderr);
+	if (names != NULL)
+		free_names(names, NUM_STRINGS);
+	return -1;
+}
+
+/*
+  Adding a large number of files to a single directory, which is the worst
+  case for the name lookup when inserting a node.
+ */
+int bench_fstree_add(void)
+{
+	char **names, params[64];
+	bench_run_t run;
+	struct stat sb;
+	fstree_t fs;
+	int ret = 0;
+	size_t i, j;
+
+	memset(&run, 0, sizeof(run));
+	memset(&sb, 0, sizeof(sb));
+	sb.st_mode = S_IFREG | 0644;
+
+	names = create_names(NUM_ENTRIES, "usr/share/doc/file_");
+	if (names == NULL) {
+		fputs("fstree benchmark: out of memory\n", stderr);
+		return -1;
+	}
+
+	for (i = 0; i < bench_repeat && ret == 0; ++i) {
+		if (fstree_init(&fs, NULL)) {
+			ret = -1;
+			break;
+		}
+
+		bench_begin(&run);
+		for (j = 0; j < NUM_ENTRIES; ++j) {
+			if (fstree_add_generic(&fs, names[j], &sb,
+					       NULL) == NULL) {
+				perror(names[j]);
+				ret = -1;
+				break;
+			}
+		}
+		bench_end(&run, NUM_ENTRIES);
+
+		fstree_cleanup(&fs);
+	}
+
+	free_names(names, NUM_ENTRIES);
+
+	if (ret)
+		return -1;
+
+	snprintf(params, sizeof(params), "entries=%d,depth=4", NUM_ENTRIES);
+	bench_report(&run, "fstree_add_generic", params, "entries/s");
+	return 0;
+}
@@ -0,0 +1,336 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * microbench.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "microbench.h"
+
+#include "sqfs/error.h"
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#define DEFAULT_REPEAT (5)
+
+static const bench_t benchmarks[] = {
+	{ "data_writer_append", bench_data_writer_append },
+	{ "data_reader_read", bench_data_reader_read },
+	{ "meta_reader_read_inode", bench_read_inode },
+	{ "str_table", bench_str_table },
+	{ "fstree_add_generic", bench_fstree_add },
+	{ "tar_read_header", bench_tar_read_header },
+	{ "tar_write_header", bench_tar_write_header },
+};
+
+static struct option long_opts[] = {
+	{ "repeat", required_argument, NULL, 'r' },
+	{ "list", no_argument, NULL, 'l' },
+	{ "help", no_argument, NULL, 'h' },
+};
+
+static const char *short_opts = "r:lh";
+
+static const char *usagestr =
+"Usage: sqfs_microbench [OPTIONS...] [<filter>...]\n"
+"\n"
+"Time hot paths of libsquashfs and the support libraries on generated data\n"
+"and print one tab separated line per result: the benchmark name, its\n"
+"parameters, the median of all runs, the unit and the spread between the\n"
+"fastest and slowest run in percent of the median.\n"
+"\n"
+"If filters are given, only benchmarks whose name contains one of them\n"
+"are run.\n"
+"\n"
+"Possible options:\n"
+"\n"
+"  --repeat, -r <count>  Number of runs per measurement. Defaults to %d.\n"
+"  --list, -l            List the benchmarks and exit.\n"
+"  --help, -h            Print help text and exit.\n"
+"\n";
+
+size_t bench_repeat = DEFAULT_REPEAT;
+
+/*****************************************************************************/
+
+void bench_begin(bench_run_t *run)
+{
+	run->start = get_time_ns();
+}
+
+void bench_end(bench_run_t *run, double work)
+{
+	sqfs_u64 elapsed = get_time_ns() - run->start;
+
+	if (elapsed == 0)
+		elapsed = 1;
+
+	if (run->count < MAX_REPEAT)
+		run->samples[run->count++] = work * 1e9 / (double)elapsed;
+}
+
+static int cmp_double(const void *lhs, const void *rhs)
+{
+	double l = *((const double *)lhs), r = *((const double *)rhs);
+
+	return l < r ? -1 : (l > r ? 1 : 0);
+}
+
+void bench_report(bench_run_t *run, const char *name, const char *params,
+		  const char *unit)
+{
+	double median, spread;
+
+	if (run->count == 0)
+		return;
+
+	qsort(run->samples, run->count, sizeof(run->samples[0]), cmp_double);
+
+	median = run->samples[run->count / 2];
+	if (run->count % 2 == 0) {
+		median += run->samples[run->count / 2 - 1];
+		median /= 2.0;
+	}
+
+	spread = run->samples[run->count - 1] - run->samples[0];
+	spread = median > 0.0 ? (100.0 * spread / median) : 0.0;
+
+	printf("%s\t%s\t%.2f\t%s\t%.1f\n", name, params, median, unit, spread);
+	fflush(stdout);
+
+	run->count = 0;
+}
+
+sqfs_u32 bench_rand(sqfs_u32 *state)
+{
+	*state = *state * 1103515245 + 12345;
+	return *state >> 8;
+}
+
+void bench_fill(sqfs_u8 *data, size_t size, sqfs_u32 seed)
+{
+	static const char *words[] = {
+		"squashfs ", "inode ", "directory ", "fragment ", "block ",
+		"the ", "of ", "compressor ", "table ", "0x1234 ", "\n",
+		"static int ", "return 0;\n", "#include <stdio.h>\n",
+	};
+	size_t i = 0, run, len;
+	const char *word;
+
+	while (i < size) {
+		run = 256 + bench_rand(&seed) % 4096;
+		if (run > size - i)
+			run = size - i;
+
+		switch (bench_rand(&seed) % 8) {
+		case 0:
+			while (run-- > 0)
+				data[i++] = bench_rand(&seed);
+			break;
+		case 1:
+			memset(data + i, 0, run);
+			i += run;
+			break;
+		default:
+			while (run > 0) {
+				word = words[bench_rand(&seed) %
+					     (sizeof(words) / sizeof(words[0]))];
+				len = strlen(word);
+				if (len > run)
+					len = run;
+
+				memcpy(data + i, word, len);
+				i += len;
+				run -= len;
+			}
+			break;
+		}
+	}
+}
+
+/*****************************************************************************/
+
+static int mem_write_at(sqfs_file_t *base, sqfs_u64 offset,
+			const void *buffer, size_t size)
+{
+	mem_file_t *file = (mem_file_t *)base;
+	size_t new_max;
+	sqfs_u8 *new;
+
+	if (offset + size > file->max) {
+		for (new_max = file->max; offset + size > new_max; )
+			new_max *= 2;
+
+		new = realloc(file->data, new_max);
+		if (new == NULL)
+			return SQFS_ERROR_ALLOC;
+
+		file->data = new;
+		file->max = new_max;
+	}
+
+	if (offset > file->size)
+		memset(file->data + file->size, 0, offset - file->size);
+
+	memcpy(file->data + offset, buffer, size);
+
+	if (offset + size > file->size)
+		file->size = offset + size;
+
+	return 0;
+}
+
+static int mem_read_at(sqfs_file_t *base, sqfs_u64 offset,
+		       void *buffer, size_t size)
+{
+	mem_file_t *file = (mem_file_t *)base;
+
+	if (offset > file->size || size > file->size - offset)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	memcpy(buffer, file->data + offset, size);
+	return 0;
+}
+
+static int mem_map_at(sqfs_file_t *base, sqfs_u64 offset, size_t size,
+		      const void **out)
+{
+	mem_file_t *file = (mem_file_t *)base;
+
+	if (offset > file->size || size > file->size - offset)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	*out = file->data + offset;
+	return 0;
+}
+
+static sqfs_u64 mem_get_size(const sqfs_file_t *base)
+{
+	return ((const mem_file_t *)base)->size;
+}
+
+static int mem_truncate(sqfs_file_t *base, sqfs_u64 size)
+{
+	mem_file_t *file = (mem_file_t *)base;
+
+	if (size > file->size)
+		return mem_write_at(base, size, "", 0);
+
+	file->size = size;
+	return 0;
+}
+
+static void mem_destroy(sqfs_file_t *base)
+{
+	mem_file_t *file = (mem_file_t *)base;
+
+	free(file->data);
+	free(file);
+}
+
+mem_file_t *mem_file_create(size_t initial_size)
+{
+	mem_file_t *file = calloc(1, sizeof(*file));
+
+	if (file == NULL)
+		return NULL;
+
+	file->max = initial_size > 0 ? initial_size : 4096;
+	file->data = malloc(file->max);
+
+	if (file->data == NULL) {
+		free(file);
+		return NULL;
+	}
+
+	file->base.destroy = mem_destroy;
+	file->base.read_at = mem_read_at;
+	file->base.write_at = mem_write_at;
+	file->base.get_size = mem_get_size;
+	file->base.truncate = mem_truncate;
+	return file;
+}
+
+void mem_file_destroy(mem_file_t *file)
+{
+	if (file != NULL)
+		file->base.destroy((sqfs_file_t *)file);
+}
+
+void mem_file_enable_map(mem_file_t *file)
+{
+	file->base.map_at = mem_map_at;
+}
+
+/*****************************************************************************/
+
+static bool selected(const char *name, char **filters, int count)
+{
+	int i;
+
+	if (count == 0)
+		return true;
+
+	for (i = 0; i < count; ++i) {
+		if (strstr(name, filters[i]) != NULL)
+			return true;
+	}
+
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	int i, status = EXIT_SUCCESS;
+	size_t j;
+	long val;
+
+	for (;;) {
+		i = getopt_long(argc, argv, short_opts, long_opts, NULL);
+		if (i == -1)
+			break;
+
+		switch (i) {
+		case 'r':
+			val = strtol(optarg, NULL, 0);
+			if (val < 1 || val > MAX_REPEAT) {
+				fprintf(stderr, "Repeat count must be between "
+					"1 and %d.\n", MAX_REPEAT);
+				return EXIT_FAILURE;
+			}
+			bench_repeat = val;
+			break;
+		case 'l':
+			for (j = 0; j < sizeof(benchmarks) /
+				     sizeof(benchmarks[0]); ++j) {
+				puts(benchmarks[j].name);
+			}
+			return EXIT_SUCCESS;
+		case 'h':
+			printf(usagestr, DEFAULT_REPEAT);
+			return EXIT_SUCCESS;
+		default:
+			fputs("Try `sqfs_microbench --help' for more "
+			      "information.\n", stderr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("# benchmark\tparameters\tmedian\tunit\tspread%%\n");
+
+	for (j = 0; j < sizeof(benchmarks) / sizeof(benchmarks[0]); ++j) {
+		if (!selected(benchmarks[j].name, argv + optind,
+			      argc - optind)) {
+			continue;
+		}
+
+		if (benchmarks[j].run() != 0) {
+			fprintf(stderr, "%s: failed\n", benchmarks[j].name);
+			status = EXIT_FAILURE;
+		}
+	}
+
+	return status;
+}
@@ -0,0 +1,96 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * microbench.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef MICROBENCH_H
+#define MICROBENCH_H
+
+#include "config.h"
+
+#include "sqfs/predef.h"
+#include "sqfs/io.h"
+#include "util/util.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MAX_REPEAT (64)
+
+/*
+  The samples of one measurement. Each run is timed separately and the
+  median is reported, which is a lot less noisy than the mean.
+ */
+typedef struct {
+	double samples[MAX_REPEAT];
+	size_t count;
+	sqfs_u64 start;
+} bench_run_t;
+
+/* An sqfs_file_t that keeps everything in memory. */
+typedef struct {
+	sqfs_file_t base;
+	sqfs_u8 *data;
+	sqfs_u64 size;
+	size_t max;
+} mem_file_t;
+
+typedef struct {
+	const char *name;
+
+	/* Runs the benchmark and prints its results. Returns 0 on success. */
+	int (*run)(void);
+} bench_t;
+
+/* Number of runs per measurement, from the command line. */
+extern size_t bench_repeat;
+
+void bench_begin(bench_run_t *run);
+
+/* Stop the clock and record the amount of work done per second. */
+void bench_end(bench_run_t *run, double work);
+
+/*
+  Print a result line: the benchmark name, its parameters as a comma
+  separated list of key=value pairs, the median, the unit and how far
+  the fastest and slowest run are apart, in percent of the median.
+ */
+void bench_report(bench_run_t *run, const char *name, const char *params,
+		  const char *unit);
+
+/* Deterministic pseudo random numbers, so every run sees the same data. */
+sqfs_u32 bench_rand(sqfs_u32 *state);
+
+/*
+  Fill a buffer with data that compresses about as well as typical file
+  system contents: runs of words, with some random bytes and zeros.
+ */
+void bench_fill(sqfs_u8 *data, size_t size, sqfs_u32 seed);
+
+/* Returns NULL on allocation failure. */
+mem_file_t *mem_file_create(size_t initial_size);
+
+void mem_file_destroy(mem_file_t *file);
+
+/*
+  Let the readers access the data in place, like the tools do with a memory
+  mapped image. Must not be used if the file is written to afterwards.
+ */
+void mem_file_enable_map(mem_file_t *file);
+
+int bench_data_writer_append(void);
+
+int bench_data_reader_read(void);
+
+int bench_read_inode(void);
+
+int bench_str_table(void);
+
+int bench_fstree_add(void);
+
+int bench_tar_read_header(void);
+
+int bench_tar_write_header(void);
+
+#endif /* MICROBENCH_H */
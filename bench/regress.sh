@@ -0,0 +1,228 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-3.0-or-later
+#
+# regress.sh
+#
+# Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+#
+# Run the tools end to end on a synthetic corpus and the archives in
+# tests/tar, record wall time, CPU time, peak RSS and I/O of each step
+# and compare them against a baseline. The measuring is done by
+# sqfs_runstat, see its help text for what the I/O numbers mean.
+
+set -e
+
+usage() {
+	cat <<EOF
+Usage: regress.sh [OPTIONS...]
+
+Run gensquashfs, tar2sqfs, sqfs2tar, rdsquashfs and sqfsdiff on a corpus
+generated by sqfs_synth and on the archives in tests/tar. For each step, the
+wall time and CPU time in seconds, the peak RSS in KiB, the bytes read and
+written through system calls and the size of the input and output in bytes
+are recorded, as the best of several runs.
+
+The results are printed as tab separated lines. If a baseline is given,
+every value that grew by more than the tolerance is reported and the exit
+status is 1.
+
+Possible options:
+
+  -b <file>     Compare against this baseline, from an earlier -s.
+  -s <file>     Save the results as a new baseline.
+  -t <percent>  Tolerance for the comparison. Defaults to 10.
+  -r <count>    Number of runs, the best one is recorded. Defaults to 3.
+  -n <count>    Number of files in the synthetic corpus. Defaults to 20000.
+  -B <dir>      Build directory with the tools. Defaults to the current one.
+  -S <dir>      Source directory with tests/tar. Defaults to the parent
+                directory of this script.
+  -w <dir>      Scratch directory, deleted afterwards. Defaults to a new
+                one in \$TMPDIR.
+  -h            Print this help text and exit.
+EOF
+}
+
+BASELINE=""
+SAVE=""
+TOLERANCE=10
+RUNS=3
+FILES=20000
+BUILDDIR="."
+SRCDIR="$(dirname "$0")/.."
+WORKDIR=""
+
+while getopts "b:s:t:r:n:B:S:w:h" opt; do
+	case "$opt" in
+	b) BASELINE="$OPTARG" ;;
+	s) SAVE="$OPTARG" ;;
+	t) TOLERANCE="$OPTARG" ;;
+	r) RUNS="$OPTARG" ;;
+	n) FILES="$OPTARG" ;;
+	B) BUILDDIR="$OPTARG" ;;
+	S) SRCDIR="$OPTARG" ;;
+	w) WORKDIR="$OPTARG" ;;
+	h) usage; exit 0 ;;
+	*) usage >&2; exit 2 ;;
+	esac
+done
+
+BUILDDIR="$(cd "$BUILDDIR" && pwd)"
+SRCDIR="$(cd "$SRCDIR" && pwd)"
+
+if [ -z "$WORKDIR" ]; then
+	WORKDIR="$(mktemp -d "${TMPDIR:-/tmp}/sqfs_regress.XXXXXX")"
+else
+	mkdir -p "$WORKDIR"
+fi
+
+trap 'rm -rf "$WORKDIR"' EXIT
+
+RUNSTAT="$BUILDDIR/sqfs_runstat"
+RESULTS="$WORKDIR/results"
+
+# measure <tool> <corpus> <sqfs_runstat arguments...>
+measure() {
+	tool="$1"
+	corpus="$2"
+	shift 2
+
+	rm -f "$WORKDIR/line"
+
+	if ! "$RUNSTAT" -a "$WORKDIR/line" "$@" > "$WORKDIR/log" 2>&1; then
+		cat "$WORKDIR/log" >&2
+		echo "$tool on $corpus failed" >&2
+		exit 2
+	fi
+
+	printf "%s\t%s\t" "$tool" "$corpus" >> "$RESULTS"
+	cut -f 1-7 "$WORKDIR/line" >> "$RESULTS"
+}
+
+# like measure, but for every archive in tests/tar, summed up
+measure_tar() {
+	tool="$1"
+	shift
+
+	rm -f "$WORKDIR/line"
+
+	for tarball in "$SRCDIR"/tests/tar/*/*.tar; do
+		case "$tarball" in
+		*/file-size/*) continue ;;	# truncated, header tests only
+		esac
+
+		name="$(echo "${tarball#$SRCDIR/tests/tar/}" | tr '/' '_')"
+
+		if [ "$tool" = "tar2sqfs" ]; then
+			set -- -i "$tarball" -O "$WORKDIR/tar/$name.sqfs" -- \
+			    "$BUILDDIR/tar2sqfs" -q -f "$WORKDIR/tar/$name.sqfs"
+		else
+			set -- -I "$WORKDIR/tar/$name.sqfs" \
+			    -o "$WORKDIR/tar/$name.tar" -- \
+			    "$BUILDDIR/sqfs2tar" "$WORKDIR/tar/$name.sqfs"
+		fi
+
+		if ! "$RUNSTAT" -a "$WORKDIR/line" "$@" \
+		     > "$WORKDIR/log" 2>&1; then
+			cat "$WORKDIR/log" >&2
+			echo "$tool on $tarball failed" >&2
+			exit 2
+		fi
+	done
+
+	awk -v tool="$tool" -F '\t' '
+		{ for (i = 1; i <= 7; ++i) sum[i] += $i;
+		  if ($3 > rss) rss = $3 }
+		END { printf "%s\ttests/tar\t%.3f\t%.3f\t%d\t%.0f\t%.0f\t%.0f\t%.0f\n",
+		      tool, sum[1], sum[2], rss, sum[4], sum[5], sum[6], sum[7] }
+	' "$WORKDIR/line" >> "$RESULTS"
+}
+
+run_suite() {
+	cd "$WORKDIR"
+	rm -rf synth.sqfs tree gen.sqfs synth.tar tar.sqfs tar
+	mkdir tar
+
+	measure sqfs_synth synth -O synth.sqfs -- "$BUILDDIR/sqfs_synth" -q \
+		-n "$FILES" -F 64 -s log:1,256k -D 10 -S 2 -x 5 synth.sqfs
+	measure rdsquashfs synth -I synth.sqfs -O tree -- \
+		"$BUILDDIR/rdsquashfs" -q -u / -p tree synth.sqfs
+	measure gensquashfs synth -I tree -O gen.sqfs -- \
+		"$BUILDDIR/gensquashfs" -q -D tree gen.sqfs
+	measure sqfs2tar synth -I synth.sqfs -o synth.tar -- \
+		"$BUILDDIR/sqfs2tar" synth.sqfs
+	measure tar2sqfs synth -i synth.tar -O tar.sqfs -- \
+		"$BUILDDIR/tar2sqfs" -q tar.sqfs
+	measure sqfsdiff synth -I synth.sqfs -- \
+		"$BUILDDIR/sqfsdiff" -a synth.sqfs -b tar.sqfs
+
+	measure_tar tar2sqfs
+	measure_tar sqfs2tar
+}
+
+run=0
+while [ "$run" -lt "$RUNS" ]; do
+	run_suite
+	run=$((run + 1))
+done
+
+# best of all runs, for every step and value
+awk -F '\t' '
+	BEGIN { OFS = "\t";
+		print "# tool", "corpus", "wall_s", "cpu_s", "maxrss_kib",
+		      "read_bytes", "write_bytes", "in_bytes", "out_bytes" }
+	{
+		key = $1 "\t" $2
+		if (!(key in best)) { order[n++] = key; best[key] = 1 }
+		for (i = 3; i <= 9; ++i) {
+			if (!((key, i) in v) || $i < v[key, i])
+				v[key, i] = $i
+		}
+	}
+	END {
+		for (j = 0; j < n; ++j) {
+			k = order[j]
+			print k, v[k, 3], v[k, 4], v[k, 5], v[k, 6], v[k, 7],
+			      v[k, 8], v[k, 9]
+		}
+	}
+' "$RESULTS" > "$WORKDIR/best"
+
+cat "$WORKDIR/best"
+
+if [ -n "$SAVE" ]; then
+	cp "$WORKDIR/best" "$SAVE"
+fi
+
+if [ -z "$BASELINE" ]; then
+	exit 0
+fi
+
+# Values below these are in the noise: 50ms, 1 MiB of RSS, 4 KiB of I/O.
+awk -F '\t' -v tol="$TOLERANCE" '
+	BEGIN { name[3] = "wall_s"; name[4] = "cpu_s";
+		name[5] = "maxrss_kib"; name[6] = "read_bytes";
+		name[7] = "write_bytes"; name[8] = "in_bytes";
+		name[9] = "out_bytes";
+		noise[3] = 0.05; noise[4] = 0.05; noise[5] = 1024;
+		noise[6] = 4096; noise[7] = 4096; noise[8] = 4096;
+		noise[9] = 4096 }
+	/^#/ { next }
+	FNR == NR { for (i = 3; i <= 9; ++i) base[$1 "\t" $2, i] = $i; next }
+	{
+		key = $1 "\t" $2
+		if (!((key, 3) in base)) {
+			printf "%s: not in baseline\n", key
+			next
+		}
+		for (i = 3; i <= 9; ++i) {
+			old = base[key, i]
+			if ($i - old <= noise[i] || $i <= old * (1 + tol / 100))
+				continue
+			printf "REGRESSION\t%s\t%s\t%s -> %s (+%.1f%%)\n",
+			       key, name[i], old, $i,
+			       (old > 0 ? 100 * ($i - old) / old : 100)
+			bad = 1
+		}
+	}
+	END { exit bad }
+' "$BASELINE" "$WORKDIR/best" >&2
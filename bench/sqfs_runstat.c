@@ -0,0 +1,225 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * sqfs_runstat.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <time.h>
+
+static const char *usagestr =
+"Usage: sqfs_runstat [OPTIONS...] [--] <command>...\n"
+"\n"
+"Run a command and print one tab separated line with its wall time and CPU\n"
+"time in seconds, its peak resident set size in KiB, the number of bytes it\n"
+"read and wrote through system calls, the size of its input and output in\n"
+"bytes and its exit status.\n"
+"\n"
+"  -i <file>  Connect the standard input of the command to a file.\n"
+"  -o <file>  Connect the standard output of the command to a file.\n"
+"  -I <path>  Count this file or directory as input of the command.\n"
+"  -O <path>  Count this file or directory as output of the command.\n"
+"  -a <file>  Append the result line to a file instead of printing it.\n"
+"\n"
+"The number of bytes read and written through system calls comes from\n"
+"/proc/<pid>/io and is reported as 0 if that is not available. It does not\n"
+"cover memory mapped files or I/O submitted through io_uring, the input and\n"
+"output sizes do. Files redirected with -i and -o are counted as input and\n"
+"output, -I and -O add up the sizes of all regular files below a path.\n";
+
+static double timeval_s(const struct timeval *tv)
+{
+	return (double)tv->tv_sec + (double)tv->tv_usec / 1e6;
+}
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* must be called while the child is a zombie, i.e. before reaping it */
+static void read_io(pid_t pid, uint64_t *rchar, uint64_t *wchar)
+{
+	char path[64], key[32];
+	unsigned long long value;
+	FILE *fp;
+
+	*rchar = 0;
+	*wchar = 0;
+
+	snprintf(path, sizeof(path), "/proc/%ld/io", (long)pid);
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return;
+
+	while (fscanf(fp, "%31[^:]: %llu\n", key, &value) == 2) {
+		if (strcmp(key, "rchar") == 0)
+			*rchar = value;
+		if (strcmp(key, "wchar") == 0)
+			*wchar = value;
+	}
+
+	fclose(fp);
+}
+
+static uint64_t tree_size;
+
+static int add_size(const char *path, const struct stat *sb, int type,
+		    struct FTW *ftw)
+{
+	(void)path;
+	(void)ftw;
+
+	if (type == FTW_F && S_ISREG(sb->st_mode))
+		tree_size += sb->st_size;
+
+	return 0;
+}
+
+static uint64_t path_size(const char *path)
+{
+	tree_size = 0;
+
+	if (path != NULL && nftw(path, add_size, 16, FTW_PHYS) != 0)
+		perror(path);
+
+	return tree_size;
+}
+
+static int redirect(const char *path, int fd, int flags)
+{
+	int new;
+
+	new = open(path, flags, 0644);
+	if (new < 0 || dup2(new, fd) < 0) {
+		perror(path);
+		return -1;
+	}
+
+	close(new);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *in = NULL, *out = NULL, *log = NULL;
+	const char *in_path = NULL, *out_path = NULL;
+	uint64_t rchar, wchar, in_size, out_size;
+	double start, wall;
+	struct rusage ru;
+	siginfo_t info;
+	int i, status;
+	FILE *fp;
+	pid_t pid;
+
+	while ((i = getopt(argc, argv, "+i:o:I:O:a:h")) != -1) {
+		switch (i) {
+		case 'i':
+			in = optarg;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'I':
+			in_path = optarg;
+			break;
+		case 'O':
+			out_path = optarg;
+			break;
+		case 'a':
+			log = optarg;
+			break;
+		case 'h':
+			fputs(usagestr, stdout);
+			return EXIT_SUCCESS;
+		default:
+			fputs(usagestr, stderr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc) {
+		fputs(usagestr, stderr);
+		return EXIT_FAILURE;
+	}
+
+	start = now_s();
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return EXIT_FAILURE;
+	}
+
+	if (pid == 0) {
+		if (in != NULL && redirect(in, STDIN_FILENO, O_RDONLY))
+			_exit(127);
+
+		if (out != NULL && redirect(out, STDOUT_FILENO,
+					    O_WRONLY | O_CREAT | O_TRUNC)) {
+			_exit(127);
+		}
+
+		execvp(argv[optind], argv + optind);
+		perror(argv[optind]);
+		_exit(127);
+	}
+
+	/* wait without reaping, so the I/O counters can still be read */
+	while (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) != 0) {
+		if (errno != EINTR) {
+			perror("waitid");
+			return EXIT_FAILURE;
+		}
+	}
+
+	wall = now_s() - start;
+	read_io(pid, &rchar, &wchar);
+
+	if (wait4(pid, &status, 0, &ru) < 0) {
+		perror("wait4");
+		return EXIT_FAILURE;
+	}
+
+	status = WIFEXITED(status) ? WEXITSTATUS(status) :
+		(128 + WTERMSIG(status));
+
+	in_size = path_size(in) + path_size(in_path);
+	out_size = path_size(out) + path_size(out_path);
+
+	fp = log == NULL ? stdout : fopen(log, "a");
+	if (fp == NULL) {
+		perror(log);
+		return EXIT_FAILURE;
+	}
+
+	fprintf(fp, "%.3f\t%.3f\t%ld\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64
+		"\t%" PRIu64 "\t%d\n", wall,
+		timeval_s(&ru.ru_utime) + timeval_s(&ru.ru_stime),
+		ru.ru_maxrss, rchar, wchar, in_size, out_size, status);
+
+	if (fp != stdout)
+		fclose(fp);
+
+	return status;
+}
@@ -0,0 +1,674 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * sqfs_synth.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+#include "common.h"
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#define MILLION (1000000)
+
+enum {
+	SIZE_FIXED = 0,
+	SIZE_UNIFORM,
+	SIZE_LOG,
+};
+
+static struct option long_opts[] = {
+	{ "files", required_argument, NULL, 'n' },
+	{ "fan-out", required_argument, NULL, 'F' },
+	{ "size", required_argument, NULL, 's' },
+	{ "duplicates", required_argument, NULL, 'D' },
+	{ "sparse", required_argument, NULL, 'S' },
+	{ "xattr", required_argument, NULL, 'x' },
+	{ "seed", required_argument, NULL, 'r' },
+	{ "compressor", required_argument, NULL, 'c' },
+	{ "comp-extra", required_argument, NULL, 'X' },
+	{ "block-size", required_argument, NULL, 'b' },
+	{ "num-jobs", required_argument, NULL, 'j' },
+	{ "queue-backlog", required_argument, NULL, 'Q' },
+	{ "max-memory", required_argument, NULL, 'M' },
+	{ "intern-strings", no_argument, NULL, 'i' },
+	{ "exportable", no_argument, NULL, 'e' },
+	{ "trace", required_argument, NULL, 'T' },
+	{ "progress", no_argument, NULL, 'R' },
+	{ "force", no_argument, NULL, 'f' },
+	{ "quiet", no_argument, NULL, 'q' },
+	{ "help", no_argument, NULL, 'h' },
+};
+
+static const char *short_opts = "n:F:s:D:S:x:r:c:X:b:j:Q:M:ieT:Rfqh";
+
+static const char *usagestr =
+"Usage: sqfs_synth [OPTIONS...] <sqfsfile>\n"
+"\n"
+"Generate a SquashFS image with a synthetic directory tree, for testing how\n"
+"the packer scales. Nothing is read from the file system, the file contents\n"
+"are generated on the fly into the buffers of the data writer. The same\n"
+"options and seed always produce the same image.\n"
+"\n"
+"Possible options:\n"
+"\n"
+"  --files, -n <count>         Number of regular files. Defaults to 10000.\n"
+"  --fan-out, -F <count>       Maximum number of entries per directory.\n"
+"                              Defaults to 64.\n"
+"  --size, -s <distribution>   File size distribution, one of:\n"
+"                                fixed:<size>\n"
+"                                uniform:<min>,<max>\n"
+"                                log:<min>,<max>   (uniform power of two)\n"
+"                              Sizes can have a k, M or G suffix.\n"
+"                              Defaults to log:1,64k.\n"
+"  --duplicates, -D <percent>  Percentage of files that are copies of an\n"
+"                              earlier one. Defaults to 0.\n"
+"  --sparse, -S <percent>      Percentage of files with every other block\n"
+"                              left as a hole. Defaults to 0.\n"
+"  --xattr, -x <percent>       Percentage of files that get one to four\n"
+"                              extended attributes. Defaults to 0.\n"
+"  --seed, -r <number>         Seed for everything that is generated.\n"
+"\n"
+"  --compressor, -c <name>     Select the compressor to use.\n"
+"  --comp-extra, -X <options>  Extra options for the selected compressor.\n"
+"  --block-size, -b <size>     Block size to use. Defaults to %u.\n"
+"  --num-jobs, -j <count>      Number of compressor jobs to create.\n"
+"  --queue-backlog, -Q <count> Maximum number of data blocks in the thread\n"
+"                              worker queue. Defaults to 10 times the\n"
+"                              number of jobs.\n"
+"  --max-memory, -M <MiB>      Approximate limit for the memory used to\n"
+"                              buffer data blocks.\n"
+"  --intern-strings, -i        Store repeated names only once in memory.\n"
+"  --exportable, -e            Generate an export table for NFS support.\n"
+"  --trace, -T <file>          Record a Chrome trace JSON file.\n"
+"  --progress, -R              Show a status line while packing.\n"
+"  --force, -f                 Overwrite the output file if it exists.\n"
+"  --quiet, -q                 Do not print out statistics.\n"
+"  --help, -h                  Print help text and exit.\n"
+"\n"
+"Example:\n"
+"\n"
+"\tsqfs_synth -n 10000000 -F 256 -s log:1,1M -D 20 -x 5 -R big.sqfs\n"
+"\n";
+
+static const char *extensions[] = {
+	"", ".txt", ".c", ".h", ".so", ".png", ".html", ".py", ".gz", ".conf",
+};
+
+static const char *xattr_keys[] = {
+	"user.mime_type", "user.checksum", "user.origin", "trusted.overlay",
+};
+
+static const char *mime_types[] = {
+	"text/plain", "text/html", "image/png", "application/octet-stream",
+};
+
+static const char *fill_words[] = {
+	"squashfs ", "inode ", "directory ", "fragment ", "block ", "the ",
+	"of ", "compressor ", "table ", "0x1234 ", "\n", "static int ",
+	"return 0;\n", "#include <stdio.h>\n",
+};
+
+static struct {
+	sqfs_u64 num_files;
+	sqfs_u64 fan_out;
+	int size_dist;
+	sqfs_u64 size_min;
+	sqfs_u64 size_max;
+	sqfs_u32 dup_ratio;
+	sqfs_u32 sparse_ratio;
+	sqfs_u32 xattr_ratio;
+	sqfs_u64 seed;
+} synth = {
+	.num_files = 10000,
+	.fan_out = 64,
+	.size_dist = SIZE_LOG,
+	.size_min = 1,
+	.size_max = 64 * 1024,
+	.seed = 0x5175A54F,
+};
+
+static sqfs_writer_cfg_t cfg;
+static sqfs_writer_t sqfs;
+
+/*****************************************************************************/
+
+/* splitmix64, so every property of a file can be derived from its index */
+static sqfs_u64 mix(sqfs_u64 x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+static sqfs_u64 hash2(sqfs_u64 a, sqfs_u64 b)
+{
+	return mix(mix(a ^ synth.seed) + b);
+}
+
+static bool chance(sqfs_u64 hash, sqfs_u32 ratio)
+{
+	return (hash % MILLION) < ratio;
+}
+
+/*
+  The content of file i is identified by the index of the file that first
+  had it. A duplicate picks an earlier file and takes over its content,
+  which may in turn be a duplicate, so no table of all files is needed.
+ */
+static sqfs_u64 content_id(sqfs_u64 i)
+{
+	sqfs_u64 h;
+
+	while (i > 0) {
+		h = hash2(i, 1);
+		if (!chance(h, synth.dup_ratio))
+			break;
+		i = mix(h) % i;
+	}
+
+	return i;
+}
+
+static sqfs_u64 content_size(sqfs_u64 id)
+{
+	sqfs_u64 h = hash2(id, 2), lo, hi;
+	unsigned int shift, lo_shift, hi_shift;
+
+	switch (synth.size_dist) {
+	case SIZE_UNIFORM:
+		return synth.size_min + h % (synth.size_max - synth.size_min + 1);
+	case SIZE_LOG:
+		for (lo_shift = 0; (2ULL << lo_shift) <= synth.size_min; )
+			++lo_shift;
+		for (hi_shift = lo_shift; hi_shift < 62 &&
+			     (2ULL << hi_shift) <= synth.size_max; ) {
+			++hi_shift;
+		}
+
+		shift = lo_shift + (h % (hi_shift - lo_shift + 1));
+		lo = 1ULL << shift;
+		hi = (2ULL << shift) - 1;
+
+		if (lo < synth.size_min)
+			lo = synth.size_min;
+		if (hi > synth.size_max)
+			hi = synth.size_max;
+
+		return lo + mix(h) % (hi - lo + 1);
+	default:
+		return synth.size_min;
+	}
+}
+
+static bool content_sparse(sqfs_u64 id)
+{
+	return chance(hash2(id, 3), synth.sparse_ratio);
+}
+
+/*
+  Fill a block with runs of words, random bytes and zeros, which compresses
+  about as well as typical file system contents.
+ */
+static void fill_block(sqfs_u8 *data, size_t size, sqfs_u64 id,
+		       sqfs_u64 offset)
+{
+	sqfs_u64 state = hash2(id, offset + 16), r;
+	size_t i = 0, run, len;
+	const char *word;
+
+	while (i < size) {
+		state = mix(state);
+		run = 256 + state % 4096;
+		if (run > size - i)
+			run = size - i;
+
+		switch ((state >> 32) % 8) {
+		case 0:
+			for (r = state; run >= sizeof(r); run -= sizeof(r)) {
+				r = mix(r);
+				memcpy(data + i, &r, sizeof(r));
+				i += sizeof(r);
+			}
+			memset(data + i, 0x55, run);
+			i += run;
+			break;
+		case 1:
+			memset(data + i, 0, run);
+			i += run;
+			break;
+		default:
+			for (r = state; run > 0; r >>= 4) {
+				word = fill_words[(r & 0x0F) %
+						  (sizeof(fill_words) /
+						   sizeof(fill_words[0]))];
+				len = strlen(word);
+				if (len > run)
+					len = run;
+
+				memcpy(data + i, word, len);
+				i += len;
+				run -= len;
+
+				if (r < 16)
+					r = mix(state + i);
+			}
+			break;
+		}
+	}
+}
+
+/*
+  The path of a file is its index written in base fan-out. Every digit but
+  the last names a directory, so each directory holds at most fan-out
+  entries and the tree gets deeper as the number of files grows.
+ */
+static void file_path(char *buffer, size_t size, sqfs_u64 i)
+{
+	sqfs_u64 div = 1, cap = synth.fan_out;
+	size_t len = 0;
+
+	while (cap < synth.num_files && cap <= (~0ULL) / synth.fan_out) {
+		cap *= synth.fan_out;
+		div *= synth.fan_out;
+	}
+
+	while (div > 1) {
+		len += snprintf(buffer + len, size - len, "d%llx/",
+				(unsigned long long)((i / div) %
+						     synth.fan_out));
+		div /= synth.fan_out;
+	}
+
+	snprintf(buffer + len, size - len, "f%llu%s", (unsigned long long)i,
+		 extensions[hash2(i, 4) % (sizeof(extensions) /
+					   sizeof(extensions[0]))]);
+}
+
+/*****************************************************************************/
+
+static int add_xattrs(tree_node_t *node, const char *path, sqfs_u64 i)
+{
+	sqfs_u64 h = hash2(i, 5), count, k;
+	char value[32];
+	size_t len;
+	int ret;
+
+	ret = sqfs_xattr_writer_begin(sqfs.xwr);
+	if (ret) {
+		sqfs_perror(path, "beginning xattr block", ret);
+		return -1;
+	}
+
+	count = 1 + (h >> 8) % 4;
+
+	for (k = 0; k < count; ++k) {
+		switch (k) {
+		case 0:
+			strcpy(value, mime_types[(h >> 16) % 4]);
+			break;
+		case 1:
+			snprintf(value, sizeof(value), "%016llx",
+				 (unsigned long long)hash2(content_id(i), 6));
+			break;
+		default:
+			snprintf(value, sizeof(value), "source-%u",
+				 (unsigned int)((h >> 24) % 16));
+			break;
+		}
+
+		len = strlen(value);
+		ret = sqfs_xattr_writer_add(sqfs.xwr, xattr_keys[k],
+					    value, len);
+		if (ret) {
+			sqfs_perror(path, "storing xattr key-value pair", ret);
+			return -1;
+		}
+	}
+
+	ret = sqfs_xattr_writer_end(sqfs.xwr, &node->xattr_idx);
+	if (ret) {
+		sqfs_perror(path, "completing xattr block", ret);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int write_content(const char *path, sqfs_u64 id, sqfs_u64 size)
+{
+	bool sparse = content_sparse(id);
+	sqfs_u64 offset, index;
+	size_t diff, fill;
+	void *buffer;
+	int ret = 0;
+
+	for (offset = 0; offset < size && ret == 0; offset += diff) {
+		index = offset / cfg.block_size;
+		diff = cfg.block_size - offset % cfg.block_size;
+		if (diff > size - offset)
+			diff = size - offset;
+
+		if (sparse && (index % 2) == 1 && diff == cfg.block_size) {
+			ret = sqfs_data_writer_append_sparse(sqfs.data, diff);
+			continue;
+		}
+
+		ret = sqfs_data_writer_get_buffer(sqfs.data, &buffer, &fill);
+		if (ret)
+			break;
+
+		if (fill > diff)
+			fill = diff;
+
+		fill_block(buffer, fill, id, offset);
+		ret = sqfs_data_writer_commit(sqfs.data, fill);
+		diff = fill;
+	}
+
+	if (ret) {
+		sqfs_perror(path, "packing file data", ret);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int add_file(sqfs_u64 i, char *path, size_t path_size)
+{
+	sqfs_inode_generic_t *inode;
+	sqfs_u64 id, size, count;
+	tree_node_t *node;
+	struct stat sb;
+	int ret;
+
+	id = content_id(i);
+	size = content_size(id);
+	file_path(path, path_size, i);
+
+	memset(&sb, 0, sizeof(sb));
+	sb.st_mode = S_IFREG | 0644;
+	sb.st_mtime = sqfs.fs.defaults.st_mtime;
+	sb.st_size = size;
+
+	node = fstree_add_generic(&sqfs.fs, path, &sb, NULL);
+	if (node == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	if (sqfs.xwr != NULL && chance(hash2(i, 7), synth.xattr_ratio)) {
+		if (add_xattrs(node, path, i))
+			return -1;
+	}
+
+	count = size / cfg.block_size + 1;
+
+	inode = alloc_flex(sizeof(*inode), sizeof(sqfs_u32), count);
+	if (inode == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	inode->block_sizes = (sqfs_u32 *)inode->extra;
+	inode->base.type = SQFS_INODE_FILE;
+	sqfs_inode_set_file_size(inode, size);
+	sqfs_inode_set_frag_location(inode, 0xFFFFFFFF, 0xFFFFFFFF);
+	node->data.file.user_ptr = inode;
+
+	ret = sqfs_data_writer_begin_file(sqfs.data, inode, 0);
+	if (ret) {
+		sqfs_perror(path, "beginning file data blocks", ret);
+		return -1;
+	}
+
+	if (write_content(path, id, size))
+		return -1;
+
+	ret = sqfs_data_writer_end_file(sqfs.data);
+	if (ret) {
+		sqfs_perror(path, "finishing file data", ret);
+		return -1;
+	}
+
+	sqfs.stats.bytes_read += size;
+	sqfs.stats.file_count += 1;
+	progress_update(&sqfs.stats);
+	return 0;
+}
+
+/*****************************************************************************/
+
+static sqfs_u64 parse_size(const char *str, const char **end)
+{
+	char *ptr;
+	sqfs_u64 value = strtoull(str, &ptr, 0);
+
+	switch (*ptr) {
+	case 'G': case 'g':
+		value *= 1024;
+		/* fall-through */
+	case 'M': case 'm':
+		value *= 1024;
+		/* fall-through */
+	case 'K': case 'k':
+		value *= 1024;
+		++ptr;
+		break;
+	default:
+		break;
+	}
+
+	if (end != NULL) {
+		*end = ptr;
+	} else if (*ptr != '\0') {
+		fprintf(stderr, "Invalid size '%s'\n", str);
+		exit(EXIT_FAILURE);
+	}
+
+	return value;
+}
+
+static sqfs_u32 parse_ratio(const char *str)
+{
+	char *end;
+	double value = strtod(str, &end);
+
+	if (*end != '\0' || value < 0.0 || value > 100.0) {
+		fprintf(stderr, "Invalid percentage '%s'\n", str);
+		exit(EXIT_FAILURE);
+	}
+
+	return (sqfs_u32)(value * (MILLION / 100));
+}
+
+static void parse_distribution(const char *str)
+{
+	const char *ptr;
+
+	if (strncmp(str, "fixed:", 6) == 0) {
+		synth.size_dist = SIZE_FIXED;
+		synth.size_min = parse_size(str + 6, NULL);
+		synth.size_max = synth.size_min;
+		return;
+	}
+
+	if (strncmp(str, "uniform:", 8) == 0) {
+		synth.size_dist = SIZE_UNIFORM;
+		ptr = str + 8;
+	} else if (strncmp(str, "log:", 4) == 0) {
+		synth.size_dist = SIZE_LOG;
+		ptr = str + 4;
+	} else {
+		goto fail;
+	}
+
+	synth.size_min = parse_size(ptr, &ptr);
+	if (*(ptr++) != ',')
+		goto fail;
+
+	synth.size_max = parse_size(ptr, NULL);
+
+	if (synth.size_max < synth.size_min)
+		goto fail;
+
+	if (synth.size_dist == SIZE_LOG && synth.size_min < 1)
+		synth.size_min = 1;
+	return;
+fail:
+	fprintf(stderr, "Invalid size distribution '%s'\n", str);
+	exit(EXIT_FAILURE);
+}
+
+static void process_args(int argc, char **argv)
+{
+	int i;
+
+	sqfs_writer_cfg_init(&cfg);
+
+	for (;;) {
+		i = getopt_long(argc, argv, short_opts, long_opts, NULL);
+		if (i == -1)
+			break;
+
+		switch (i) {
+		case 'n':
+			synth.num_files = strtoull(optarg, NULL, 0);
+			break;
+		case 'F':
+			synth.fan_out = strtoull(optarg, NULL, 0);
+			if (synth.fan_out < 2) {
+				fputs("The fan-out must be at least 2\n",
+				      stderr);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 's':
+			parse_distribution(optarg);
+			break;
+		case 'D':
+			synth.dup_ratio = parse_ratio(optarg);
+			break;
+		case 'S':
+			synth.sparse_ratio = parse_ratio(optarg);
+			break;
+		case 'x':
+			synth.xattr_ratio = parse_ratio(optarg);
+			break;
+		case 'r':
+			synth.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'c':
+			if (sqfs_compressor_id_from_name(optarg,
+							 &cfg.comp_id) ||
+			    !sqfs_compressor_exists(cfg.comp_id)) {
+				fprintf(stderr, "Unsupported compressor '%s'\n",
+					optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'X':
+			cfg.comp_extra = optarg;
+			break;
+		case 'b':
+			cfg.block_size = parse_size(optarg, NULL);
+			break;
+		case 'j':
+			cfg.num_jobs = strtol(optarg, NULL, 0);
+			break;
+		case 'Q':
+			cfg.max_backlog = strtol(optarg, NULL, 0);
+			break;
+		case 'M':
+			cfg.max_memory = strtoul(optarg, NULL, 0);
+			cfg.max_memory *= 1024 * 1024;
+			break;
+		case 'i':
+			cfg.intern_strings = true;
+			break;
+		case 'e':
+			cfg.exportable = true;
+			break;
+		case 'T':
+			cfg.trace_file = optarg;
+			break;
+		case 'R':
+			cfg.progress = true;
+			break;
+		case 'f':
+			cfg.outmode |= SQFS_FILE_OPEN_OVERWRITE;
+			break;
+		case 'q':
+			cfg.quiet = true;
+			break;
+		case 'h':
+			printf(usagestr, SQFS_DEFAULT_BLOCK_SIZE);
+			compressor_print_available();
+			exit(EXIT_SUCCESS);
+		default:
+			goto fail_arg;
+		}
+	}
+
+	if (cfg.num_jobs < 1)
+		cfg.num_jobs = 1;
+
+	if (cfg.max_backlog < 1)
+		cfg.max_backlog = 10 * cfg.num_jobs;
+
+	if (optind >= argc) {
+		fputs("Missing argument: squashfs image\n", stderr);
+		goto fail_arg;
+	}
+
+	cfg.filename = argv[optind++];
+
+	if (optind < argc) {
+		fputs("Unknown extra arguments\n", stderr);
+		goto fail_arg;
+	}
+	return;
+fail_arg:
+	fputs("Try `sqfs_synth --help' for more information.\n", stderr);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	int status = EXIT_FAILURE;
+	char path[256];
+	sqfs_u64 i;
+
+	process_args(argc, argv);
+
+	if (sqfs_writer_init(&sqfs, &cfg))
+		return EXIT_FAILURE;
+
+	if (sqfs.data == NULL) {
+		fputs("A compressor dictionary can only be trained by "
+		      "gensquashfs.\n", stderr);
+		goto out;
+	}
+
+	if (cfg.progress) {
+		for (i = 0; i < synth.num_files; ++i)
+			sqfs.stats.progress.total += content_size(content_id(i));
+	}
+
+	for (i = 0; i < synth.num_files; ++i) {
+		if (add_file(i, path, sizeof(path)))
+			goto out;
+	}
+
+	if (sqfs_writer_finish(&sqfs, &cfg))
+		goto out;
+
+	status = EXIT_SUCCESS;
+out:
+	sqfs_writer_cleanup(&sqfs);
+	return status;
+}
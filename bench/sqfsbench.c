@@ -0,0 +1,794 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * sqfsbench.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+#include "common.h"
+
+#include <sys/stat.h>
+#include <getopt.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+#define DEFAULT_SAMPLE_SIZE (16)
+
+typedef struct {
+	E_SQFS_COMPRESSOR id;
+	char *options;
+} comp_run_t;
+
+typedef struct {
+	sqfs_u8 *data;
+	size_t size;
+	size_t max_size;
+} sample_t;
+
+static struct option long_opts[] = {
+	{ "compressor", required_argument, NULL, 'c' },
+	{ "block-size", required_argument, NULL, 'b' },
+	{ "level", required_argument, NULL, 'l' },
+	{ "sample-size", required_argument, NULL, 's' },
+	{ "help", no_argument, NULL, 'h' },
+	{ "version", no_argument, NULL, 'V' },
+};
+
+static const char *short_opts = "c:b:l:s:hV";
+
+static const char *usagestr =
+"Usage: sqfsbench [OPTIONS...] <input>\n"
+"\n"
+"Compress sample data with a range of compressors, compression levels and\n"
+"block sizes and report the compression ratio, as well as the compression\n"
+"and decompression speed of a single thread.\n"
+"\n"
+"The input can be a directory, a SquashFS image or any other file. The\n"
+"regular files in a directory or image are concatenated in sorted order\n"
+"and the result is cut into blocks of the block size.\n"
+"\n"
+"Possible options:\n"
+"\n"
+"  --compressor, -c <name>[:<options>]  Benchmark a compressor, optionally\n"
+"                                       with a comma separated list of\n"
+"                                       extra options, as accepted by the\n"
+"                                       -X option of gensquashfs. Can be\n"
+"                                       specified more than once. The\n"
+"                                       default is to benchmark every\n"
+"                                       available compressor with its\n"
+"                                       default options.\n"
+"  --block-size, -b <sizes>             A comma separated list of block\n"
+"                                       sizes to try. Defaults to %u.\n"
+"  --level, -l <min>[-<max>]            The range of compression levels to\n"
+"                                       try. Limited to the levels that a\n"
+"                                       compressor supports. The default is\n"
+"                                       to try all of them. Ignored if the\n"
+"                                       compressor options set a level.\n"
+"  --sample-size, -s <size>             Maximum amount of sample data to\n"
+"                                       read in MiB. Defaults to %u.\n"
+"\n"
+"  --help, -h                           Print help text and exit.\n"
+"  --version, -V                        Print version information and exit.\n"
+"\n"
+"Examples:\n"
+"\n"
+"\tsqfsbench rootfs/\n"
+"\tsqfsbench -c gzip -c gzip:default,filtered -b 65536,131072 rootfs.sqfs\n"
+"\tsqfsbench -c zstd -l 15-19 -s 64 rootfs/\n"
+"\n";
+
+static const char *input;
+static comp_run_t *runs = NULL;
+static size_t num_runs = 0;
+static sqfs_u32 *block_sizes = NULL;
+static size_t num_block_sizes = 0;
+static size_t min_level = 0;
+static size_t max_level = ~((size_t)0);
+static size_t sample_size = DEFAULT_SAMPLE_SIZE;
+
+static int add_run(E_SQFS_COMPRESSOR id, const char *options)
+{
+	comp_run_t *new;
+
+	new = realloc(runs, sizeof(runs[0]) * (num_runs + 1));
+	if (new == NULL)
+		return -1;
+
+	runs = new;
+	runs[num_runs].id = id;
+	runs[num_runs].options = NULL;
+
+	if (options != NULL) {
+		runs[num_runs].options = strdup(options);
+		if (runs[num_runs].options == NULL)
+			return -1;
+	}
+
+	num_runs += 1;
+	return 0;
+}
+
+static int parse_compressor(char *arg)
+{
+	E_SQFS_COMPRESSOR id;
+	char *options;
+
+	options = strchr(arg, ':');
+	if (options != NULL)
+		*(options++) = '\0';
+
+	if (sqfs_compressor_id_from_name(arg, &id) ||
+	    !sqfs_compressor_exists(id)) {
+		fprintf(stderr, "Unsupported compressor '%s'\n", arg);
+		return -1;
+	}
+
+	if (add_run(id, options)) {
+		perror("parsing compressor list");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int parse_block_sizes(const char *arg)
+{
+	unsigned long value;
+	sqfs_u32 *new;
+	char *end;
+
+	for (;;) {
+		value = strtoul(arg, &end, 0);
+
+		if (end == arg || (*end != '\0' && *end != ',') ||
+		    (value & (value - 1)) != 0 ||
+		    value < 4096 || value > (1 << 20)) {
+			fprintf(stderr, "Invalid block size list '%s'. Block "
+				"sizes must be powers of two between 4K "
+				"and 1M.\n", arg);
+			return -1;
+		}
+
+		new = realloc(block_sizes,
+			      sizeof(block_sizes[0]) * (num_block_sizes + 1));
+		if (new == NULL) {
+			perror("parsing block size list");
+			return -1;
+		}
+
+		block_sizes = new;
+		block_sizes[num_block_sizes++] = value;
+
+		if (*end == '\0')
+			break;
+
+		arg = end + 1;
+	}
+
+	return 0;
+}
+
+static int parse_level(const char *arg)
+{
+	const char *str = arg;
+	char *end;
+
+	min_level = strtoul(str, &end, 10);
+	max_level = min_level;
+
+	if (end != str && *end == '-') {
+		str = end + 1;
+		max_level = strtoul(str, &end, 10);
+	}
+
+	if (end == str || *end != '\0' || max_level < min_level) {
+		fprintf(stderr, "Invalid compression level range '%s'.\n",
+			arg);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void process_args(int argc, char **argv)
+{
+	int i;
+
+	for (;;) {
+		i = getopt_long(argc, argv, short_opts, long_opts, NULL);
+		if (i == -1)
+			break;
+
+		switch (i) {
+		case 'c':
+			if (parse_compressor(optarg))
+				goto fail;
+			break;
+		case 'b':
+			if (parse_block_sizes(optarg))
+				goto fail;
+			break;
+		case 'l':
+			if (parse_level(optarg))
+				goto fail;
+			break;
+		case 's':
+			sample_size = strtoul(optarg, NULL, 0);
+			if (sample_size == 0) {
+				fputs("Sample size must be at least 1 MiB.\n",
+				      stderr);
+				goto fail;
+			}
+			break;
+		case 'h':
+			printf(usagestr, SQFS_DEFAULT_BLOCK_SIZE,
+			       DEFAULT_SAMPLE_SIZE);
+			compressor_print_available();
+			goto out_success;
+		case 'V':
+			print_version();
+			goto out_success;
+		default:
+			goto fail_arg;
+		}
+	}
+
+	if (optind >= argc) {
+		fputs("Missing argument: input file or directory\n", stderr);
+		goto fail_arg;
+	}
+
+	input = argv[optind++];
+
+	if (optind < argc) {
+		fputs("Unknown extra arguments\n", stderr);
+		goto fail_arg;
+	}
+
+	if (num_runs == 0) {
+		for (i = SQFS_COMP_MIN; i <= SQFS_COMP_MAX; ++i) {
+			if (!sqfs_compressor_exists(i))
+				continue;
+
+			if (add_run(i, NULL)) {
+				perror("creating compressor list");
+				goto fail;
+			}
+		}
+	}
+
+	if (num_block_sizes == 0) {
+		block_sizes = malloc(sizeof(block_sizes[0]));
+		if (block_sizes == NULL) {
+			perror("creating block size list");
+			goto fail;
+		}
+
+		block_sizes[num_block_sizes++] = SQFS_DEFAULT_BLOCK_SIZE;
+	}
+	return;
+fail_arg:
+	fputs("Try `sqfsbench --help' for more information.\n", stderr);
+	goto fail;
+fail:
+	exit(EXIT_FAILURE);
+out_success:
+	exit(EXIT_SUCCESS);
+}
+
+/*****************************************************************************/
+
+static bool sample_full(const sample_t *smp)
+{
+	return smp->size >= smp->max_size;
+}
+
+static int sample_fd(sample_t *smp, const char *name, int fd)
+{
+	ssize_t ret;
+
+	while (!sample_full(smp)) {
+		ret = read(fd, smp->data + smp->size,
+			   smp->max_size - smp->size);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(name);
+			return -1;
+		}
+
+		if (ret == 0)
+			break;
+
+		smp->size += ret;
+	}
+
+	return 0;
+}
+
+static int sample_file(sample_t *smp, const char *name)
+{
+	int fd, ret;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		perror(name);
+		return -1;
+	}
+
+	ret = sample_fd(smp, name, fd);
+	close(fd);
+	return ret;
+}
+
+static int sample_dir(sample_t *smp, const char *path)
+{
+	struct dirent **ents;
+	int i, count, ret = 0;
+	struct stat sb;
+	char *name;
+
+	count = scandir(path, &ents, NULL, alphasort);
+	if (count < 0) {
+		perror(path);
+		return -1;
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (ret != 0 || sample_full(smp) ||
+		    !strcmp(ents[i]->d_name, ".") ||
+		    !strcmp(ents[i]->d_name, "..")) {
+			free(ents[i]);
+			continue;
+		}
+
+		name = malloc(strlen(path) + strlen(ents[i]->d_name) + 2);
+		if (name == NULL) {
+			perror(path);
+			ret = -1;
+			free(ents[i]);
+			continue;
+		}
+
+		sprintf(name, "%s/%s", path, ents[i]->d_name);
+		free(ents[i]);
+
+		if (lstat(name, &sb)) {
+			perror(name);
+			ret = -1;
+		} else if (S_ISDIR(sb.st_mode)) {
+			ret = sample_dir(smp, name);
+		} else if (S_ISREG(sb.st_mode)) {
+			ret = sample_file(smp, name);
+		}
+
+		free(name);
+	}
+
+	free(ents);
+	return ret;
+}
+
+static int sample_tree(sample_t *smp, sqfs_data_reader_t *data,
+		       const sqfs_tree_node_t *n)
+{
+	sqfs_u64 filesize, offset = 0;
+	sqfs_s32 ret;
+	size_t size;
+
+	if (S_ISDIR(n->inode->base.mode)) {
+		for (n = n->children; n != NULL; n = n->next) {
+			if (sample_full(smp))
+				break;
+
+			if (sample_tree(smp, data, n))
+				return -1;
+		}
+		return 0;
+	}
+
+	if (!S_ISREG(n->inode->base.mode))
+		return 0;
+
+	sqfs_inode_get_file_size(n->inode, &filesize);
+
+	size = smp->max_size - smp->size;
+	if (size > filesize)
+		size = filesize;
+
+	while (size > 0) {
+		ret = sqfs_data_reader_read(data, n->inode, offset,
+					    smp->data + smp->size,
+					    size > 0x7FFFFFFF ? 0x7FFFFFFF :
+					    size);
+		if (ret <= 0) {
+			sqfs_perror(input, "reading file data",
+				    ret < 0 ? ret : SQFS_ERROR_CORRUPTED);
+			return -1;
+		}
+
+		smp->size += ret;
+		offset += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+static int sample_image(sample_t *smp, sqfs_file_t *file,
+			const sqfs_super_t *super)
+{
+	sqfs_compressor_config_t cfg;
+	sqfs_tree_node_t *root = NULL;
+	sqfs_data_reader_t *data;
+	sqfs_compressor_t *cmp;
+	sqfs_id_table_t *idtbl;
+	sqfs_dir_reader_t *dr;
+	int ret, status = -1;
+
+	if (!sqfs_compressor_exists(super->compression_id)) {
+		fprintf(stderr, "%s: unknown compressor used.\n", input);
+		return -1;
+	}
+
+	sqfs_compressor_config_init(&cfg, super->compression_id,
+				    super->block_size,
+				    SQFS_COMP_FLAG_UNCOMPRESS);
+
+	cmp = sqfs_compressor_create(&cfg);
+	if (cmp == NULL) {
+		fputs("Error creating compressor.\n", stderr);
+		return -1;
+	}
+
+	if (super->flags & SQFS_FLAG_COMPRESSOR_OPTIONS) {
+		ret = cmp->read_options(cmp, file);
+		if (ret) {
+			sqfs_perror(input, "reading compressor options", ret);
+			goto out_cmp;
+		}
+	}
+
+	idtbl = sqfs_id_table_create();
+	if (idtbl == NULL) {
+		perror("creating ID table");
+		goto out_cmp;
+	}
+
+	ret = sqfs_id_table_read(idtbl, file, super, cmp);
+	if (ret) {
+		sqfs_perror(input, "loading ID table", ret);
+		goto out_id;
+	}
+
+	data = sqfs_data_reader_create(file, super->block_size, cmp, 0);
+	if (data == NULL) {
+		sqfs_perror(input, "creating data reader", SQFS_ERROR_ALLOC);
+		goto out_id;
+	}
+
+	ret = sqfs_data_reader_load_fragment_table(data, super);
+	if (ret) {
+		sqfs_perror(input, "loading fragment table", ret);
+		goto out_data;
+	}
+
+	dr = sqfs_dir_reader_create(super, cmp, file);
+	if (dr == NULL) {
+		sqfs_perror(input, "creating dir reader", SQFS_ERROR_ALLOC);
+		goto out_data;
+	}
+
+	ret = sqfs_dir_reader_get_full_hierarchy(dr, idtbl, NULL,
+						 SQFS_TREE_COMPACT, &root);
+	if (ret) {
+		sqfs_perror(input, "loading filesystem tree", ret);
+		goto out_dr;
+	}
+
+	status = sample_tree(smp, data, root);
+	sqfs_dir_tree_destroy(root);
+out_dr:
+	sqfs_dir_reader_destroy(dr);
+out_data:
+	sqfs_data_reader_destroy(data);
+out_id:
+	sqfs_id_table_destroy(idtbl);
+out_cmp:
+	cmp->destroy(cmp);
+	return status;
+}
+
+static int read_sample(sample_t *smp)
+{
+	sqfs_super_t super;
+	sqfs_file_t *file;
+	struct stat sb;
+	int ret;
+
+	smp->size = 0;
+	smp->max_size = sample_size * 1024 * 1024;
+	smp->data = malloc(smp->max_size);
+
+	if (smp->data == NULL) {
+		perror("allocating sample buffer");
+		return -1;
+	}
+
+	if (stat(input, &sb)) {
+		perror(input);
+		return -1;
+	}
+
+	if (S_ISDIR(sb.st_mode))
+		return sample_dir(smp, input);
+
+	file = sqfs_open_file(input, SQFS_FILE_OPEN_READ_ONLY);
+	if (file == NULL) {
+		perror(input);
+		return -1;
+	}
+
+	if (sqfs_super_read(&super, file) == 0) {
+		ret = sample_image(smp, file, &super);
+	} else {
+		ret = sample_file(smp, input);
+	}
+
+	file->destroy(file);
+	return ret;
+}
+
+/*****************************************************************************/
+
+static double get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int benchmark(const sample_t *smp, sqfs_compressor_config_t *cfg,
+		     sqfs_u8 *cmp_data, sqfs_u8 *unpacked,
+		     sqfs_u32 *cmp_sizes, const char *options,
+		     const char *level)
+{
+	sqfs_compressor_t *cmp, *ucmp;
+	sqfs_u64 total = 0;
+	double start, t_comp, t_uncomp;
+	size_t i, count, offset, size;
+	sqfs_s32 ret;
+	int status = -1;
+
+	cmp = sqfs_compressor_create(cfg);
+	if (cmp == NULL) {
+		fputs("Error creating compressor.\n", stderr);
+		return -1;
+	}
+
+	cfg->flags |= SQFS_COMP_FLAG_UNCOMPRESS;
+	ucmp = sqfs_compressor_create(cfg);
+	cfg->flags &= ~SQFS_COMP_FLAG_UNCOMPRESS;
+
+	if (ucmp == NULL) {
+		fputs("Error creating decompressor.\n", stderr);
+		goto out_cmp;
+	}
+
+	count = (smp->size + cfg->block_size - 1) / cfg->block_size;
+
+	start = get_time();
+
+	for (i = 0; i < count; ++i) {
+		offset = i * cfg->block_size;
+		size = smp->size - offset;
+		if (size > cfg->block_size)
+			size = cfg->block_size;
+
+		ret = cmp->do_block(cmp, smp->data + offset, size,
+				    cmp_data + offset, size);
+		if (ret < 0) {
+			sqfs_perror(input, "compressing sample data", ret);
+			goto out;
+		}
+
+		cmp_sizes[i] = ret;
+	}
+
+	t_comp = get_time() - start;
+	start = get_time();
+
+	for (i = 0; i < count; ++i) {
+		offset = i * cfg->block_size;
+		size = smp->size - offset;
+		if (size > cfg->block_size)
+			size = cfg->block_size;
+
+		if (cmp_sizes[i] == 0) {
+			memcpy(unpacked + offset, smp->data + offset, size);
+			total += size;
+			continue;
+		}
+
+		ret = ucmp->do_block(ucmp, cmp_data + offset, cmp_sizes[i],
+				     unpacked + offset, size);
+		if (ret < 0) {
+			sqfs_perror(input, "uncompressing sample data", ret);
+			goto out;
+		}
+
+		total += cmp_sizes[i];
+	}
+
+	t_uncomp = get_time() - start;
+
+	if (memcmp(unpacked, smp->data, smp->size) != 0) {
+		fprintf(stderr, "%s: uncompressed data does not match the "
+			"sample data.\n", sqfs_compressor_name_from_id(cfg->id));
+		goto out;
+	}
+
+	printf("%-6s %-24s %6u %5s %7.2f%% %10.1f %10.1f\n",
+	       sqfs_compressor_name_from_id(cfg->id),
+	       options == NULL ? "-" : options, (unsigned int)cfg->block_size,
+	       level, 100.0 * (double)total / (double)smp->size,
+	       (double)smp->size / 1e6 / t_comp,
+	       (double)smp->size / 1e6 / t_uncomp);
+	fflush(stdout);
+
+	status = 0;
+out:
+	ucmp->destroy(ucmp);
+out_cmp:
+	cmp->destroy(cmp);
+	return status;
+}
+
+static int run_compressor(const sample_t *smp, const comp_run_t *run,
+			  sqfs_u32 block_size, sqfs_u8 *cmp_data,
+			  sqfs_u8 *unpacked, sqfs_u32 *cmp_sizes)
+{
+	size_t level, lo, hi;
+	sqfs_compressor_config_t cfg;
+	char *options = NULL;
+	char lvlstr[32];
+	bool levels;
+	int ret = -1;
+
+	if (run->options != NULL) {
+		options = strdup(run->options);
+		if (options == NULL) {
+			perror("parsing compressor options");
+			return -1;
+		}
+	}
+
+	if (compressor_cfg_init_options(&cfg, run->id, block_size, options))
+		goto out;
+
+	if (cfg.id == SQFS_COMP_ZSTD && (cfg.flags & SQFS_COMP_FLAG_ZSTD_DICT)) {
+		fputs("Dictionaries are not supported by sqfsbench.\n",
+		      stderr);
+		goto out;
+	}
+
+	levels = compressor_get_level_range(cfg.id, &lo, &hi);
+
+	if (run->options != NULL && strstr(run->options, "level=") != NULL)
+		levels = false;
+
+	if (cfg.id == SQFS_COMP_LZO && cfg.opt.lzo.algorithm != SQFS_LZO1X_999)
+		levels = false;
+
+	if (cfg.id == SQFS_COMP_LZ4 && !(cfg.flags & SQFS_COMP_FLAG_LZ4_HC))
+		levels = false;
+
+	if (!levels) {
+		ret = benchmark(smp, &cfg, cmp_data, unpacked, cmp_sizes,
+				run->options, "-");
+		goto out;
+	}
+
+	if (lo < min_level)
+		lo = min_level;
+	if (hi > max_level)
+		hi = max_level;
+
+	for (level = lo; level <= hi; ++level) {
+		switch (cfg.id) {
+		case SQFS_COMP_GZIP:
+			cfg.opt.gzip.level = level;
+			break;
+		case SQFS_COMP_LZO:
+			cfg.opt.lzo.level = level;
+			break;
+		case SQFS_COMP_ZSTD:
+			cfg.opt.zstd.level = level;
+			break;
+		case SQFS_COMP_XZ:
+			cfg.opt.xz.level = level;
+			break;
+		case SQFS_COMP_LZ4:
+			cfg.opt.lz4.level = level;
+			break;
+		default:
+			break;
+		}
+
+		sprintf(lvlstr, "%zu", level);
+
+		if (benchmark(smp, &cfg, cmp_data, unpacked, cmp_sizes,
+			      run->options, lvlstr)) {
+			goto out;
+		}
+	}
+
+	ret = 0;
+out:
+	free(options);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	sqfs_u8 *cmp_data = NULL, *unpacked = NULL;
+	sqfs_u32 *cmp_sizes = NULL;
+	int status = EXIT_FAILURE;
+	sample_t smp;
+	size_t i, j;
+
+	process_args(argc, argv);
+
+	memset(&smp, 0, sizeof(smp));
+
+	if (read_sample(&smp))
+		goto out;
+
+	if (smp.size == 0) {
+		fprintf(stderr, "%s: no sample data found.\n", input);
+		goto out;
+	}
+
+	cmp_data = malloc(smp.size);
+	unpacked = malloc(smp.size);
+	cmp_sizes = alloc_array(sizeof(cmp_sizes[0]),
+				smp.size / 4096 + 1);
+
+	if (cmp_data == NULL || unpacked == NULL || cmp_sizes == NULL) {
+		perror("allocating benchmark buffers");
+		goto out;
+	}
+
+	printf("Sample size: %zu bytes\n\n", smp.size);
+	printf("%-6s %-24s %6s %5s %8s %10s %10s\n", "comp", "options",
+	       "block", "level", "ratio", "comp MB/s", "unc. MB/s");
+
+	for (i = 0; i < num_block_sizes; ++i) {
+		for (j = 0; j < num_runs; ++j) {
+			if (run_compressor(&smp, runs + j, block_sizes[i],
+					   cmp_data, unpacked, cmp_sizes)) {
+				goto out;
+			}
+		}
+	}
+
+	status = EXIT_SUCCESS;
+out:
+	free(cmp_sizes);
+	free(unpacked);
+	free(cmp_data);
+	free(smp.data);
+	for (i = 0; i < num_runs; ++i)
+		free(runs[i].options);
+	free(runs);
+	free(block_sizes);
+	return status;
+}
@@ -0,0 +1,456 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * source.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "sqfscompose.h"
+
+static int load_tree(source_t *src, subdir_filter_t *filter)
+{
+	sqfs_inode_generic_t *inode;
+	bool as_root = true;
+	const char **paths;
+	size_t i, count = 0;
+	int ret;
+
+	if (filter->count == 0) {
+		ret = sqfs_dir_reader_get_full_hierarchy(src->dirrd, src->idtbl,
+							 NULL, 0, &src->root);
+		goto out;
+	}
+
+	paths = alloc_array(sizeof(paths[0]), filter->count);
+	if (paths == NULL) {
+		perror(src->filename);
+		return -1;
+	}
+
+	/* an image that a path is missing in just has nothing to add there */
+	for (i = 0; i < filter->count; ++i) {
+		ret = sqfs_dir_reader_find_by_path(src->dirrd,
+						   filter->paths[i], &inode);
+		if (ret == SQFS_ERROR_NO_ENTRY)
+			continue;
+
+		if (ret) {
+			sqfs_perror(filter->paths[i], "looking up sub "
+				    "directory", ret);
+			free(paths);
+			return -1;
+		}
+
+		/* only a directory can be turned into the root */
+		if (!S_ISDIR(inode->base.mode))
+			as_root = false;
+
+		free(inode);
+		filter->found[i] = true;
+		paths[count++] = filter->paths[i];
+	}
+
+	ret = 0;
+	if (count == 1 && as_root && !filter->keep_as_dir) {
+		ret = sqfs_dir_reader_get_full_hierarchy(src->dirrd, src->idtbl,
+							 paths[0], 0,
+							 &src->root);
+	} else if (count > 0) {
+		ret = sqfs_dir_reader_get_subtrees(src->dirrd, src->idtbl,
+						   paths, count, 0, &src->root);
+	}
+
+	free(paths);
+out:
+	if (ret) {
+		sqfs_perror(src->filename, "reading filesystem tree", ret);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int load_source(source_t *src, subdir_filter_t *filter)
+{
+	sqfs_compressor_config_t cfg;
+	int ret;
+
+	ret = sqfs_super_read(&src->super, src->file);
+	if (ret) {
+		sqfs_perror(src->filename, "reading super block", ret);
+		return -1;
+	}
+
+	sqfs_compressor_config_init(&cfg, src->super.compression_id,
+				    src->super.block_size,
+				    SQFS_COMP_FLAG_UNCOMPRESS);
+
+	src->cmp = sqfs_compressor_create(&cfg);
+	if (src->cmp == NULL) {
+		fprintf(stderr, "%s: error creating compressor.\n",
+			src->filename);
+		return -1;
+	}
+
+	if (src->super.flags & SQFS_FLAG_COMPRESSOR_OPTIONS) {
+		ret = src->cmp->read_options(src->cmp, src->file);
+		if (ret) {
+			sqfs_perror(src->filename, "reading compressor "
+				    "options", ret);
+			return -1;
+		}
+	}
+
+	src->idtbl = sqfs_id_table_create();
+	if (src->idtbl == NULL) {
+		sqfs_perror(src->filename, "creating ID table",
+			    SQFS_ERROR_ALLOC);
+		return -1;
+	}
+
+	ret = sqfs_id_table_read(src->idtbl, src->file, &src->super,
+				 src->cmp);
+	if (ret) {
+		sqfs_perror(src->filename, "loading ID table", ret);
+		return -1;
+	}
+
+	if (!(src->super.flags & SQFS_FLAG_NO_XATTRS)) {
+		src->xattr = sqfs_xattr_reader_create(src->file, &src->super,
+						      src->cmp);
+		if (src->xattr == NULL) {
+			sqfs_perror(src->filename, "creating xattr reader",
+				    SQFS_ERROR_ALLOC);
+			return -1;
+		}
+
+		ret = sqfs_xattr_reader_load_locations(src->xattr);
+		if (ret) {
+			sqfs_perror(src->filename, "loading xattr table", ret);
+			return -1;
+		}
+	}
+
+	src->dirrd = sqfs_dir_reader_create(&src->super, src->cmp, src->file);
+	if (src->dirrd == NULL) {
+		sqfs_perror(src->filename, "creating dir reader",
+			    SQFS_ERROR_ALLOC);
+		return -1;
+	}
+
+	src->data = sqfs_data_reader_create(src->file, src->super.block_size,
+					    src->cmp, 0);
+	if (src->data == NULL) {
+		sqfs_perror(src->filename, "creating data reader",
+			    SQFS_ERROR_ALLOC);
+		return -1;
+	}
+
+	ret = sqfs_data_reader_load_fragment_table(src->data, &src->super);
+	if (ret) {
+		sqfs_perror(src->filename, "loading fragment table", ret);
+		return -1;
+	}
+
+	return load_tree(src, filter);
+}
+
+int source_open(source_t *src, const char *filename,
+		subdir_filter_t *filter)
+{
+	memset(src, 0, sizeof(*src));
+	src->filename = filename;
+
+	src->file = sqfs_open_file(filename, SQFS_FILE_OPEN_READ_ONLY);
+	if (src->file == NULL) {
+		perror(filename);
+		return -1;
+	}
+
+	if (load_source(src, filter)) {
+		source_close(src);
+		return -1;
+	}
+
+	return 0;
+}
+
+void source_close(source_t *src)
+{
+	if (src->root != NULL)
+		sqfs_dir_tree_destroy(src->root);
+	if (src->data != NULL)
+		sqfs_data_reader_destroy(src->data);
+	if (src->dirrd != NULL)
+		sqfs_dir_reader_destroy(src->dirrd);
+	if (src->xattr != NULL)
+		sqfs_xattr_reader_destroy(src->xattr);
+	if (src->idtbl != NULL)
+		sqfs_id_table_destroy(src->idtbl);
+	if (src->cmp != NULL)
+		src->cmp->destroy(src->cmp);
+	if (src->file != NULL)
+		src->file->destroy(src->file);
+
+	memset(src, 0, sizeof(*src));
+}
+
+int source_check_compatible(source_t *src, const sqfs_writer_t *sqfs)
+{
+	sqfs_u8 *old_opt, *new_opt;
+	size_t old_size, new_size;
+	int ret;
+
+	if (src->super.compression_id != sqfs->super.compression_id ||
+	    src->super.block_size != sqfs->super.block_size) {
+		fprintf(stderr, "%s: different compressor or block size than "
+			"the first image.\n", src->filename);
+		return -1;
+	}
+
+	old_opt = malloc(SQFS_META_BLOCK_SIZE);
+	new_opt = malloc(SQFS_META_BLOCK_SIZE);
+
+	if (old_opt == NULL || new_opt == NULL) {
+		perror(src->filename);
+		ret = -1;
+		goto out;
+	}
+
+	ret = compressor_read_raw_options(src->file, &src->super, old_opt,
+					  &old_size);
+	if (ret == 0) {
+		ret = compressor_read_raw_options(sqfs->outfile, &sqfs->super,
+						  new_opt, &new_size);
+	}
+
+	if (ret) {
+		sqfs_perror(src->filename, "reading compressor options", ret);
+		ret = -1;
+		goto out;
+	}
+
+	if (old_size != new_size || memcmp(old_opt, new_opt, old_size) != 0) {
+		fprintf(stderr, "%s: different compressor options, see "
+			"--comp-extra.\n", src->filename);
+		ret = -1;
+	}
+out:
+	free(old_opt);
+	free(new_opt);
+	return ret;
+}
+
+typedef struct {
+	source_t *src;
+	sqfs_writer_t *sqfs;
+	bool no_xattr;
+	path_buf_t path;
+
+	/* the first entry of each inode with hard links, by inode number */
+	tree_node_t **links;
+} merge_t;
+
+static int copy_xattr(merge_t *m, const sqfs_tree_node_t *n, tree_node_t *node)
+{
+	const sqfs_xattr_set_t *set;
+	sqfs_u32 index;
+	size_t i;
+	int ret;
+
+	node->xattr_idx = 0xFFFFFFFF;
+
+	if (m->no_xattr || m->src->xattr == NULL)
+		return 0;
+
+	sqfs_inode_get_xattr_index(n->inode, &index);
+	if (index == 0xFFFFFFFF)
+		return 0;
+
+	ret = sqfs_xattr_reader_get_set(m->src->xattr, index, &set);
+	if (ret)
+		goto fail;
+
+	ret = sqfs_xattr_writer_begin(m->sqfs->xwr);
+	if (ret)
+		goto fail;
+
+	for (i = 0; i < set->count; ++i) {
+		ret = sqfs_xattr_writer_add(m->sqfs->xwr,
+					    (const char *)set->keys[i]->key,
+					    set->values[i]->value,
+					    set->values[i]->size);
+		if (ret)
+			goto fail;
+	}
+
+	ret = sqfs_xattr_writer_end(m->sqfs->xwr, &node->xattr_idx);
+	if (ret)
+		goto fail;
+
+	return 0;
+fail:
+	sqfs_perror(m->path.str, "copying xattrs", ret);
+	return -1;
+}
+
+static tree_node_t *add_hard_link(merge_t *m, tree_node_t *target)
+{
+	tree_node_t *node;
+	char *path;
+
+	path = fstree_get_path(target);
+	if (path == NULL)
+		return NULL;
+
+	node = fstree_add_hard_link(&m->sqfs->fs, m->path.str, path);
+	free(path);
+	return node;
+}
+
+static int merge_node(merge_t *m, const sqfs_tree_node_t *n);
+
+static int merge_children(merge_t *m, const sqfs_tree_node_t *n)
+{
+	size_t old_len = m->path.len;
+	const char *name;
+	int ret;
+
+	for (n = n->children; n != NULL; n = n->next) {
+		name = (const char *)n->name;
+
+		if (!is_filename_sane(name)) {
+			fprintf(stderr, "Found an entry named '%s', "
+				"skipping.\n", name);
+			continue;
+		}
+
+		ret = path_buf_push(&m->path, name, strlen(name));
+		if (ret) {
+			sqfs_perror(name, "merging directory tree", ret);
+			return -1;
+		}
+
+		ret = merge_node(m, n);
+		path_buf_truncate(&m->path, old_len);
+
+		if (ret)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int merge_node(merge_t *m, const sqfs_tree_node_t *n)
+{
+	fstree_t *fs = &m->sqfs->fs;
+	sqfs_u32 num = n->inode->base.inode_number;
+	const char *extra;
+	tree_node_t *node;
+	struct stat sb;
+
+	if (inode_stat(n, &sb)) {
+		fprintf(stderr, "%s: unsupported inode type\n", m->path.str);
+		return -1;
+	}
+
+	node = fstree_get_node_by_path(fs, m->path.str);
+
+	if (node != NULL) {
+		/* a directory keeps its contents, but takes the attributes */
+		if (S_ISDIR(node->mode) && S_ISDIR(sb.st_mode)) {
+			node->uid = sb.st_uid;
+			node->gid = sb.st_gid;
+			node->mode = sb.st_mode;
+			node->mod_time = sb.st_mtime;
+			node->data.dir.created_implicitly = false;
+
+			if (copy_xattr(m, n, node))
+				return -1;
+
+			return merge_children(m, n);
+		}
+
+		fstree_remove_node(fs, node);
+	}
+
+	if (num == 0 || num > m->src->super.inode_count) {
+		fprintf(stderr, "%s: inode number out of range\n",
+			m->path.str);
+		return -1;
+	}
+
+	if (!S_ISDIR(sb.st_mode) && m->links[num] != NULL) {
+		if (add_hard_link(m, m->links[num]) == NULL)
+			goto fail_errno;
+		return 0;
+	}
+
+	if (S_ISLNK(sb.st_mode)) {
+		extra = n->inode->slink_target;
+	} else if (S_ISREG(sb.st_mode)) {
+		extra = m->path.str;
+	} else {
+		extra = NULL;
+	}
+
+	node = fstree_add_generic(fs, m->path.str, &sb, extra);
+	if (node == NULL)
+		goto fail_errno;
+
+	if (!S_ISDIR(sb.st_mode) && sb.st_nlink > 1)
+		m->links[num] = node;
+
+	if (copy_xattr(m, n, node))
+		return -1;
+
+	if (S_ISREG(sb.st_mode))
+		node->data.file.user_ptr = (void *)n;
+
+	return S_ISDIR(sb.st_mode) ? merge_children(m, n) : 0;
+fail_errno:
+	perror(m->path.str);
+	return -1;
+}
+
+int source_merge(source_t *src, sqfs_writer_t *sqfs, bool no_xattr)
+{
+	tree_node_t *root = sqfs->fs.root;
+	merge_t m;
+	int ret;
+
+	if (src->root == NULL)
+		return 0;
+
+	memset(&m, 0, sizeof(m));
+	m.src = src;
+	m.sqfs = sqfs;
+	m.no_xattr = no_xattr;
+
+	m.links = calloc((size_t)src->super.inode_count + 1,
+			 sizeof(m.links[0]));
+	if (m.links == NULL) {
+		perror(src->filename);
+		return -1;
+	}
+
+	ret = path_buf_init(&m.path, "");
+	if (ret) {
+		sqfs_perror(src->filename, "merging directory tree", ret);
+		free(m.links);
+		return -1;
+	}
+
+	/* the root directory always exists, it takes the attributes */
+	root->uid = src->root->uid;
+	root->gid = src->root->gid;
+	root->mode = src->root->inode->base.mode;
+	root->mod_time = src->root->inode->base.mod_time;
+
+	ret = copy_xattr(&m, src->root, root);
+	if (ret == 0)
+		ret = merge_children(&m, src->root);
+
+	path_buf_cleanup(&m.path);
+	free(m.links);
+	return ret;
+}
@@ -0,0 +1,481 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * sqfscompose.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "sqfscompose.h"
+
+static struct option long_opts[] = {
+	{ "comp-extra", required_argument, NULL, 'X' },
+	{ "subdir", required_argument, NULL, 'd' },
+	{ "keep-as-dir", no_argument, NULL, 'k' },
+	{ "num-jobs", required_argument, NULL, 'j' },
+	{ "queue-backlog", required_argument, NULL, 'Q' },
+	{ "max-memory", required_argument, NULL, 'M' },
+	{ "dev-block-size", required_argument, NULL, 'B' },
+	{ "stats-json", required_argument, NULL, 'J' },
+	{ "no-xattr", no_argument, NULL, 'x' },
+	{ "exportable", no_argument, NULL, 'e' },
+	{ "group-fragments", no_argument, NULL, 'G' },
+	{ "best-fit-fragments", no_argument, NULL, 'K' },
+	{ "progress", no_argument, NULL, 'R' },
+	{ "force", no_argument, NULL, 'f' },
+	{ "quiet", no_argument, NULL, 'q' },
+	{ "help", no_argument, NULL, 'h' },
+	{ "version", no_argument, NULL, 'V' },
+};
+
+static const char *short_opts = "X:d:kj:Q:M:B:J:xeGKRfqhV";
+
+static const char *usagestr =
+"Usage: sqfscompose [OPTIONS...] <sqfsfile> <image>...\n"
+"\n"
+"Put several squashfs images together into a new one, e.g. a base image and\n"
+"application bundles, without unpacking them.\n"
+"\n"
+"The images are stacked on top of each other, the first one at the bottom.\n"
+"Entries replace entries with the same path in the images below, except\n"
+"that directories are merged. The compressed data blocks of the files are\n"
+"copied over as they are, only the tail ends are packed into new fragment\n"
+"blocks. All images need the same compressor, compressor options and block\n"
+"size, which the new image uses as well.\n"
+"\n"
+"Possible options:\n"
+"\n"
+"  --comp-extra, -X <options>  Extra options of the compressor, if the images\n"
+"                              do not use its defaults, see gensquashfs.\n"
+"  --subdir, -d <dir>          Only take the given sub directory from the\n"
+"                              images, instead of everything. Can be used\n"
+"                              more than once.\n"
+"  --keep-as-dir, -k           If --subdir is used only once, don't make the\n"
+"                              sub directory the root, instead keep it as a\n"
+"                              directory with its parents. Using --subdir\n"
+"                              more than once implies --keep-as-dir.\n"
+"  --num-jobs, -j <count>      Number of compressor jobs to create.\n"
+"  --queue-backlog, -Q <count> Maximum number of data blocks in the thread\n"
+"                              worker queue before the packer starts waiting\n"
+"                              for the block processors to catch up.\n"
+"                              Defaults to 10 times the number of jobs.\n"
+"  --max-memory, -M <MiB>      Approximate limit for the memory used to buffer\n"
+"                              data blocks.\n"
+"  --dev-block-size, -B <size> Device block size to padd the image to.\n"
+"                              Defaults to %u.\n"
+"  --stats-json, -J <file>     Write the statistics, including the time taken\n"
+"                              by each phase, to a JSON file.\n"
+"\n"
+"  --no-xattr, -x              Do not copy extended attributes.\n"
+"  --exportable, -e            Generate an export table for NFS support.\n"
+"  --group-fragments, -G       Pack tail ends of files with the same name\n"
+"                              extension into the same fragment blocks.\n"
+"  --best-fit-fragments, -K    Keep more fragment blocks open and put each\n"
+"                              tail end into the one it fills up best.\n"
+"  --progress, -R              Show a status line instead of the name of\n"
+"                              each file copied.\n"
+"  --force, -f                 Overwrite the output file if it exists.\n"
+"  --quiet, -q                 Do not print out progress reports.\n"
+"  --help, -h                  Print help text and exit.\n"
+"  --version, -V               Print version information and exit.\n"
+"\n"
+"Examples:\n"
+"\n"
+"\tsqfscompose rootfs.sqfs base.sqfs app1.sqfs app2.sqfs\n"
+"\tsqfscompose -k -d /usr/share/locale/de de.sqfs rootfs.sqfs\n"
+"\n";
+
+static sqfs_writer_cfg_t cfg;
+static sqfs_writer_t sqfs;
+static source_t *sources = NULL;
+static size_t num_sources = 0;
+static const char **images = NULL;
+static size_t num_images = 0;
+static subdir_filter_t filter;
+
+/* a regular file of the new image and where its data comes from */
+typedef struct {
+	file_info_t *fi;
+	const sqfs_tree_node_t *node;
+	size_t source;
+	sqfs_u64 start;
+} pack_ent_t;
+
+static int add_subdir(const char *path)
+{
+	size_t new_count;
+	char **new;
+
+	if (filter.count == filter.max) {
+		new_count = filter.max ? filter.max * 2 : 16;
+		new = realloc(filter.paths, new_count * sizeof(new[0]));
+		if (new == NULL)
+			goto fail_errno;
+
+		filter.max = new_count;
+		filter.paths = new;
+	}
+
+	filter.paths[filter.count] = strdup(path);
+	if (filter.paths[filter.count] == NULL)
+		goto fail_errno;
+
+	if (canonicalize_name(filter.paths[filter.count])) {
+		perror(path);
+		free(filter.paths[filter.count]);
+		return -1;
+	}
+
+	filter.count += 1;
+	return 0;
+fail_errno:
+	perror("parsing options");
+	return -1;
+}
+
+static void free_subdirs(void)
+{
+	size_t i;
+
+	for (i = 0; i < filter.count; ++i)
+		free(filter.paths[i]);
+
+	free(filter.paths);
+	free(filter.found);
+}
+
+static void process_args(int argc, char **argv)
+{
+	int i;
+
+	sqfs_writer_cfg_init(&cfg);
+
+	for (;;) {
+		i = getopt_long(argc, argv, short_opts, long_opts, NULL);
+		if (i == -1)
+			break;
+
+		switch (i) {
+		case 'X':
+			cfg.comp_extra = optarg;
+			break;
+		case 'd':
+			if (add_subdir(optarg))
+				goto fail;
+			break;
+		case 'k':
+			filter.keep_as_dir = true;
+			break;
+		case 'j':
+			cfg.num_jobs = strtol(optarg, NULL, 0);
+			break;
+		case 'Q':
+			cfg.max_backlog = strtol(optarg, NULL, 0);
+			break;
+		case 'M':
+			cfg.max_memory = strtoul(optarg, NULL, 0);
+			cfg.max_memory *= 1024 * 1024;
+			break;
+		case 'B':
+			cfg.devblksize = strtol(optarg, NULL, 0);
+			if (cfg.devblksize < 1024) {
+				fputs("Device block size must be at "
+				      "least 1024\n", stderr);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'J':
+			cfg.stats_json = optarg;
+			break;
+		case 'x':
+			cfg.no_xattr = true;
+			break;
+		case 'e':
+			cfg.exportable = true;
+			break;
+		case 'G':
+			cfg.group_fragments = true;
+			break;
+		case 'K':
+			cfg.best_fit_fragments = true;
+			break;
+		case 'R':
+			cfg.progress = true;
+			break;
+		case 'f':
+			cfg.outmode |= SQFS_FILE_OPEN_OVERWRITE;
+			break;
+		case 'q':
+			cfg.quiet = true;
+			break;
+		case 'h':
+			printf(usagestr, SQFS_DEVBLK_SIZE);
+			exit(EXIT_SUCCESS);
+		case 'V':
+			print_version();
+			exit(EXIT_SUCCESS);
+		default:
+			goto fail_arg;
+		}
+	}
+
+	if (cfg.num_jobs < 1)
+		cfg.num_jobs = 1;
+
+	if (cfg.max_backlog < 1)
+		cfg.max_backlog = 10 * cfg.num_jobs;
+
+	if (optind >= argc) {
+		fputs("Missing argument: squashfs image\n", stderr);
+		goto fail_arg;
+	}
+
+	cfg.filename = argv[optind++];
+
+	if (optind >= argc) {
+		fputs("Missing argument: images to put together\n", stderr);
+		goto fail_arg;
+	}
+
+	images = (const char **)(argv + optind);
+	num_images = argc - optind;
+
+	if (filter.count > 1)
+		filter.keep_as_dir = true;
+
+	if (filter.count > 0) {
+		filter.found = calloc(filter.count, sizeof(filter.found[0]));
+		if (filter.found == NULL) {
+			perror("parsing options");
+			goto fail;
+		}
+	}
+	return;
+fail_arg:
+	fputs("Try `sqfscompose --help' for more information.\n", stderr);
+fail:
+	free_subdirs();
+	exit(EXIT_FAILURE);
+}
+
+static int open_sources(void)
+{
+	size_t i;
+
+	sources = alloc_array(sizeof(sources[0]), num_images);
+	if (sources == NULL) {
+		perror("opening images");
+		return -1;
+	}
+
+	for (i = 0; i < num_images; ++i) {
+		if (source_open(sources + i, images[i], &filter))
+			return -1;
+
+		++num_sources;
+	}
+
+	for (i = 0; i < filter.count; ++i) {
+		if (!filter.found[i]) {
+			fprintf(stderr, "%s: not found in any of the images\n",
+				filter.paths[i]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void close_sources(void)
+{
+	size_t i;
+
+	for (i = 0; i < num_sources; ++i)
+		source_close(sources + i);
+
+	free(sources);
+}
+
+static int cmp_pack_ent(const void *lhs, const void *rhs)
+{
+	const pack_ent_t *l = lhs, *r = rhs;
+
+	if (l->source != r->source)
+		return l->source < r->source ? -1 : 1;
+
+	if (l->start != r->start)
+		return l->start < r->start ? -1 : 1;
+
+	return 0;
+}
+
+static int find_source(const sqfs_tree_node_t *n, size_t *out)
+{
+	size_t i;
+
+	while (n->parent != NULL)
+		n = n->parent;
+
+	for (i = 0; i < num_sources; ++i) {
+		if (sources[i].root == n) {
+			*out = i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/*
+  The files are copied image by image, in the order their data is stored
+  in, so each image is read front to back.
+ */
+static pack_ent_t *gen_pack_list(size_t *count)
+{
+	pack_ent_t *list;
+	file_info_t *fi;
+	size_t i = 0;
+
+	*count = 0;
+	for (fi = sqfs.fs.files; fi != NULL; fi = fi->next)
+		*count += 1;
+
+	list = alloc_array(sizeof(list[0]), *count > 0 ? *count : 1);
+	if (list == NULL) {
+		perror("sorting files");
+		return NULL;
+	}
+
+	for (fi = sqfs.fs.files; fi != NULL; fi = fi->next, ++i) {
+		list[i].fi = fi;
+		list[i].node = fi->user_ptr;
+
+		if (find_source(list[i].node, &list[i].source)) {
+			fprintf(stderr, "%s: image of file not found\n",
+				fi->input_file);
+			free(list);
+			return NULL;
+		}
+
+		sqfs_inode_get_file_block_start(list[i].node->inode,
+						&list[i].start);
+	}
+
+	qsort(list, *count, sizeof(list[0]), cmp_pack_ent);
+	return list;
+}
+
+static int pack_file(pack_ent_t *ent)
+{
+	const sqfs_inode_generic_t *original = ent->node->inode;
+	source_t *src = sources + ent->source;
+	sqfs_inode_generic_t *inode;
+	sqfs_u64 filesize;
+
+	inode = alloc_flex(sizeof(*inode), sizeof(sqfs_u32),
+			   original->num_file_blocks);
+	if (inode == NULL) {
+		perror("creating file inode");
+		return -1;
+	}
+
+	sqfs_inode_get_file_size(original, &filesize);
+
+	inode->block_sizes = (sqfs_u32 *)inode->extra;
+	inode->base.type = SQFS_INODE_FILE;
+	sqfs_inode_set_file_size(inode, filesize);
+	sqfs_inode_set_frag_location(inode, 0xFFFFFFFF, 0xFFFFFFFF);
+
+	ent->fi->user_ptr = inode;
+
+	if (!cfg.quiet && !cfg.progress)
+		printf("copying %s\n", ent->fi->input_file);
+
+	if (write_data_from_image(ent->fi->input_file, sqfs.data, inode,
+				  src->file, src->data, original,
+				  src->super.block_size, 0)) {
+		return -1;
+	}
+
+	sqfs.stats.bytes_read += filesize;
+	sqfs.stats.file_count += 1;
+	progress_update(&sqfs.stats);
+	return 0;
+}
+
+static int pack_files(void)
+{
+	sqfs_u64 filesize;
+	pack_ent_t *list;
+	size_t i, count;
+	int ret = 0;
+
+	list = gen_pack_list(&count);
+	if (list == NULL)
+		return -1;
+
+	for (i = 0; i < count; ++i) {
+		sqfs_inode_get_file_size(list[i].node->inode, &filesize);
+		sqfs.stats.progress.total += filesize;
+	}
+
+	for (i = 0; i < count; ++i) {
+		ret = pack_file(list + i);
+		if (ret)
+			break;
+	}
+
+	free(list);
+	return ret;
+}
+
+static int compose(void)
+{
+	size_t i;
+
+	if (open_sources())
+		return -1;
+
+	/* the new image is written the way the first one was */
+	cfg.comp_id = sources[0].super.compression_id;
+	cfg.block_size = sources[0].super.block_size;
+
+	if (sqfs_writer_init(&sqfs, &cfg))
+		return -1;
+
+	for (i = 0; i < num_sources; ++i) {
+		if (source_check_compatible(sources + i, &sqfs))
+			goto fail;
+	}
+
+	for (i = 0; i < num_sources; ++i) {
+		if (source_merge(sources + i, &sqfs, cfg.no_xattr))
+			goto fail;
+	}
+
+	fstree_gen_file_list(&sqfs.fs);
+	stats_phase_end(&sqfs.stats, WRITER_PHASE_SCAN);
+
+	if (pack_files())
+		goto fail;
+
+	if (sqfs_writer_finish(&sqfs, &cfg))
+		goto fail;
+
+	sqfs_writer_cleanup(&sqfs);
+	return 0;
+fail:
+	sqfs_writer_cleanup(&sqfs);
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+
+	process_args(argc, argv);
+
+	ret = compose();
+	close_sources();
+	free_subdirs();
+
+	return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
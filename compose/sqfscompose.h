@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * sqfscompose.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef SQFSCOMPOSE_H
+#define SQFSCOMPOSE_H
+
+#include "config.h"
+#include "common.h"
+#include "fstree.h"
+#include "util/util.h"
+#include "util/compat.h"
+#include "util/path_buf.h"
+
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+/* the parts of the images that are taken over, see --subdir */
+typedef struct {
+	char **paths;
+	size_t count;
+	size_t max;
+
+	/* set for each path that was found in at least one image */
+	bool *found;
+
+	/* keep a single path as a directory, instead of making it the root */
+	bool keep_as_dir;
+} subdir_filter_t;
+
+/* one of the images that are put together */
+typedef struct {
+	const char *filename;
+	sqfs_file_t *file;
+	sqfs_super_t super;
+	sqfs_compressor_t *cmp;
+	sqfs_id_table_t *idtbl;
+	sqfs_dir_reader_t *dirrd;
+	sqfs_data_reader_t *data;
+	sqfs_xattr_reader_t *xattr;
+	sqfs_tree_node_t *root;
+} source_t;
+
+/*
+  Open an image and read its directory tree, or only the sub trees of the
+  filter paths that exist in the image. The root is NULL if there are none.
+  Prints an error message and returns -1 on failure.
+ */
+int source_open(source_t *src, const char *filename,
+		subdir_filter_t *filter);
+
+void source_close(source_t *src);
+
+/*
+  The data blocks of an image can only be copied over verbatim if the new
+  image uses the same compressor, with the same options, and block size.
+  Prints an error message and returns -1 if it does not.
+ */
+int source_check_compatible(source_t *src, const sqfs_writer_t *sqfs);
+
+/*
+  Add the tree of an image to the tree of the new one. Entries replace the
+  ones with the same path that came from images before, except that
+  directories are merged. Regular files get their path as input file and
+  the node in the image tree as user_ptr. Prints an error message and
+  returns -1 on failure.
+ */
+int source_merge(source_t *src, sqfs_writer_t *sqfs, bool no_xattr);
+
+#endif /* SQFSCOMPOSE_H */
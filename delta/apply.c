@@ -0,0 +1,414 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * apply.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "sqfsdelta.h"
+
+typedef struct {
+	const options_t *opt;
+	sqfs_file_t *old_file;
+	sqfs_u64 old_size;
+	istream_t *patch;
+	sqfs_file_t *out;
+
+	/*
+	  The output is gathered in chunks of DELTA_MAX_DATA bytes, which are
+	  hashed the same way as by hash_image before writing them out.
+	 */
+	sqfs_u8 *chunk;
+	size_t chunk_used;
+	sqfs_u64 written;
+	sqfs_u64 hash;
+
+	/* a block from the block store, allocated when first needed */
+	sqfs_u8 *block;
+} patcher_t;
+
+static int read_patch(patcher_t *p, void *data, size_t size)
+{
+	sqfs_s32 ret = istream_read(p->patch, data, size);
+
+	if (ret < 0)
+		return -1;
+
+	if ((size_t)ret < size) {
+		fprintf(stderr, "%s: unexpected end of patch.\n",
+			p->opt->patch_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int flush_chunk(patcher_t *p)
+{
+	int ret;
+
+	if (p->chunk_used == 0)
+		return 0;
+
+	ret = p->out->write_at(p->out, p->written, p->chunk, p->chunk_used);
+	if (ret) {
+		sqfs_perror(p->opt->new_path, "writing image", ret);
+		return -1;
+	}
+
+	p->hash = hash_chunk(p->hash, p->chunk, p->chunk_used);
+	p->written += p->chunk_used;
+	p->chunk_used = 0;
+	return 0;
+}
+
+static int copy_old(patcher_t *p, sqfs_u64 offset, sqfs_u64 size)
+{
+	size_t diff;
+	int ret;
+
+	if (p->old_file == NULL) {
+		fprintf(stderr, "%s: patch refers to an old image.\n",
+			p->opt->patch_path);
+		return -1;
+	}
+
+	if (offset > p->old_size || size > p->old_size - offset) {
+		fprintf(stderr, "%s: patch refers to data past the end of "
+			"%s.\n", p->opt->patch_path, p->opt->old_path);
+		return -1;
+	}
+
+	while (size > 0) {
+		diff = DELTA_MAX_DATA - p->chunk_used;
+		if ((sqfs_u64)diff > size)
+			diff = size;
+
+		ret = p->old_file->read_at(p->old_file, offset,
+					   p->chunk + p->chunk_used, diff);
+		if (ret) {
+			sqfs_perror(p->opt->old_path, "reading image", ret);
+			return -1;
+		}
+
+		p->chunk_used += diff;
+		offset += diff;
+		size -= diff;
+
+		if (p->chunk_used == DELTA_MAX_DATA && flush_chunk(p))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int copy_data(patcher_t *p, size_t size)
+{
+	size_t diff;
+
+	if (size > DELTA_MAX_DATA) {
+		fprintf(stderr, "%s: data record too large.\n",
+			p->opt->patch_path);
+		return -1;
+	}
+
+	while (size > 0) {
+		diff = DELTA_MAX_DATA - p->chunk_used;
+		if (diff > size)
+			diff = size;
+
+		if (read_patch(p, p->chunk + p->chunk_used, diff))
+			return -1;
+
+		p->chunk_used += diff;
+		size -= diff;
+
+		if (p->chunk_used == DELTA_MAX_DATA && flush_chunk(p))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int copy_stored(patcher_t *p, sqfs_u64 hash, size_t size)
+{
+	size_t diff, offset = 0;
+
+	if (p->opt->store_path == NULL) {
+		fprintf(stderr, "%s: patch refers to a block store, "
+			"see --store.\n", p->opt->patch_path);
+		return -1;
+	}
+
+	if (size > DELTA_MAX_DATA) {
+		fprintf(stderr, "%s: store record too large.\n",
+			p->opt->patch_path);
+		return -1;
+	}
+
+	if (p->block == NULL) {
+		p->block = malloc(DELTA_MAX_DATA);
+		if (p->block == NULL) {
+			perror("allocating block buffer");
+			return -1;
+		}
+	}
+
+	if (store_get_block(p->opt->store_path, hash, size, p->block))
+		return -1;
+
+	while (offset < size) {
+		diff = DELTA_MAX_DATA - p->chunk_used;
+		if (diff > size - offset)
+			diff = size - offset;
+
+		memcpy(p->chunk + p->chunk_used, p->block + offset, diff);
+		p->chunk_used += diff;
+		offset += diff;
+
+		if (p->chunk_used == DELTA_MAX_DATA && flush_chunk(p))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int process_records(patcher_t *p)
+{
+	delta_record_t rec;
+	int ret;
+
+	for (;;) {
+		if (read_patch(p, &rec, sizeof(rec)))
+			return -1;
+
+		switch (le32toh(rec.type)) {
+		case DELTA_COPY:
+			ret = copy_old(p, le64toh(rec.offset),
+				       le32toh(rec.size));
+			break;
+		case DELTA_DATA:
+			ret = copy_data(p, le32toh(rec.size));
+			break;
+		case DELTA_STORE:
+			ret = copy_stored(p, le64toh(rec.offset),
+					  le32toh(rec.size));
+			break;
+		case DELTA_END:
+			return flush_chunk(p);
+		default:
+			fprintf(stderr, "%s: unknown record type %u.\n",
+				p->opt->patch_path,
+				(unsigned int)le32toh(rec.type));
+			return -1;
+		}
+
+		if (ret)
+			return -1;
+	}
+}
+
+static int open_patch(patcher_t *p)
+{
+	istream_t *strm;
+	int ret;
+
+	if (strcmp(p->opt->patch_path, "-") == 0) {
+		p->patch = istream_open_stdin();
+	} else {
+		p->patch = istream_open_file(p->opt->patch_path);
+	}
+
+	if (p->patch == NULL)
+		return -1;
+
+	ret = istream_detect_compressor(p->patch);
+	if (ret < 0)
+		return -1;
+
+	if (ret > 0) {
+		strm = istream_compressor_create(p->patch, ret);
+		if (strm == NULL)
+			return -1;
+
+		p->patch = strm;
+	}
+
+	return 0;
+}
+
+static int check_magic(const options_t *opt, const delta_header_t *hdr)
+{
+	if (memcmp(hdr->magic, DELTA_MAGIC, sizeof(hdr->magic)) != 0) {
+		fprintf(stderr, "%s: not a squashfs delta patch.\n",
+			opt->patch_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int check_old_image(patcher_t *p, const delta_header_t *hdr)
+{
+	sqfs_u64 hash;
+
+	if (check_magic(p->opt, hdr))
+		return -1;
+
+	if (p->old_file == NULL) {
+		if (hdr->old_size == 0)
+			return 0;
+
+		fprintf(stderr, "%s: patch needs the old image it was "
+			"created for, see --old.\n", p->opt->patch_path);
+		return -1;
+	}
+
+	if (p->old_size != le64toh(hdr->old_size))
+		goto fail_mismatch;
+
+	if (hash_image(p->opt->old_path, p->old_file, &hash))
+		return -1;
+
+	if (hash != le64toh(hdr->old_hash))
+		goto fail_mismatch;
+
+	return 0;
+fail_mismatch:
+	fprintf(stderr, "%s: patch was not created for %s.\n",
+		p->opt->patch_path, p->opt->old_path);
+	return -1;
+}
+
+int apply_patch(const options_t *opt)
+{
+	delta_header_t hdr;
+	int status = -1;
+	patcher_t p;
+	int ret;
+
+	memset(&p, 0, sizeof(p));
+	p.opt = opt;
+
+	if (opt->old_path != NULL) {
+		p.old_file = sqfs_open_file(opt->old_path,
+					    SQFS_FILE_OPEN_READ_ONLY |
+					    SQFS_FILE_OPEN_MMAP);
+		if (p.old_file == NULL) {
+			perror(opt->old_path);
+			return -1;
+		}
+
+		p.old_size = p.old_file->get_size(p.old_file);
+	}
+
+	if (open_patch(&p))
+		goto out;
+
+	if (read_patch(&p, &hdr, sizeof(hdr)))
+		goto out;
+
+	if (check_old_image(&p, &hdr))
+		goto out;
+
+	p.chunk = malloc(DELTA_MAX_DATA);
+	if (p.chunk == NULL) {
+		perror("allocating output buffer");
+		goto out;
+	}
+
+	p.out = sqfs_open_file(opt->new_path, opt->force ?
+			       SQFS_FILE_OPEN_OVERWRITE : 0);
+	if (p.out == NULL) {
+		perror(opt->new_path);
+		goto out;
+	}
+
+	if (process_records(&p))
+		goto out;
+
+	ret = sqfs_file_flush(p.out, 0);
+	if (ret) {
+		sqfs_perror(opt->new_path, "writing image", ret);
+		goto out;
+	}
+
+	if (p.written != le64toh(hdr.new_size) ||
+	    p.hash != le64toh(hdr.new_hash)) {
+		fprintf(stderr, "%s: reconstructed image does not match the "
+			"one the patch was created from.\n", opt->new_path);
+		goto out;
+	}
+
+	status = 0;
+out:
+	if (p.out != NULL)
+		p.out->destroy(p.out);
+	if (p.patch != NULL)
+		p.patch->destroy(p.patch);
+	if (p.old_file != NULL)
+		p.old_file->destroy(p.old_file);
+	free(p.chunk);
+	free(p.block);
+	return status;
+}
+
+int list_missing_blocks(const options_t *opt)
+{
+	char name[STORE_NAME_MAX];
+	delta_header_t hdr;
+	delta_record_t rec;
+	int status = -1;
+	sqfs_u64 hash;
+	sqfs_u32 size;
+	patcher_t p;
+	bool found;
+
+	memset(&p, 0, sizeof(p));
+	p.opt = opt;
+
+	if (open_patch(&p))
+		goto out;
+
+	if (read_patch(&p, &hdr, sizeof(hdr)) || check_magic(opt, &hdr))
+		goto out;
+
+	for (;;) {
+		if (read_patch(&p, &rec, sizeof(rec)))
+			goto out;
+
+		size = le32toh(rec.size);
+
+		switch (le32toh(rec.type)) {
+		case DELTA_COPY:
+			break;
+		case DELTA_DATA:
+			if (istream_skip(p.patch, size))
+				goto out;
+			break;
+		case DELTA_STORE:
+			hash = le64toh(rec.offset);
+
+			if (store_has_block(opt->store_path, hash, size,
+					    &found))
+				goto out;
+
+			if (!found) {
+				store_block_name(name, hash, size);
+				printf("%s\n", name);
+			}
+			break;
+		case DELTA_END:
+			status = 0;
+			goto out;
+		default:
+			fprintf(stderr, "%s: unknown record type %u.\n",
+				opt->patch_path,
+				(unsigned int)le32toh(rec.type));
+			goto out;
+		}
+	}
+out:
+	if (p.patch != NULL)
+		p.patch->destroy(p.patch);
+	return status;
+}
@@ -0,0 +1,454 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * create.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "sqfsdelta.h"
+
+/* the largest amount of old image data referenced by a single record */
+#define DELTA_MAX_COPY (0x80000000UL)
+
+typedef struct {
+	const options_t *opt;
+	sqfs_file_t *old_file;
+	sqfs_file_t *new_file;
+	sqfs_file_t *patch;
+	sqfs_u64 patch_size;
+
+	/* blocks of the old image, sorted by hash */
+	extent_list_t old;
+
+	sqfs_u8 *old_buf;
+	sqfs_u8 *new_buf;
+	sqfs_u8 *data_buf;
+
+	/* old image data to copy, not written out yet */
+	sqfs_u64 copy_src;
+	sqfs_u64 copy_size;
+
+	/* new image data to include in the patch, not written out yet */
+	sqfs_u64 data_start;
+	sqfs_u64 data_size;
+
+	sqfs_u64 copied;
+	sqfs_u64 literal;
+	sqfs_u64 stored;
+	sqfs_u64 stored_new;
+} delta_t;
+
+static int get_raw(sqfs_file_t *file, sqfs_u64 offset, size_t size,
+		   void *buffer, const void **out)
+{
+	if (file->map_at != NULL)
+		return file->map_at(file, offset, size, out);
+
+	*out = buffer;
+	return file->read_at(file, offset, buffer, size);
+}
+
+static int compare_hash(const void *lhs, const void *rhs)
+{
+	const extent_t *a = lhs, *b = rhs;
+
+	if (a->hash != b->hash)
+		return a->hash < b->hash ? -1 : 1;
+
+	if (a->size != b->size)
+		return a->size < b->size ? -1 : 1;
+
+	if (a->offset != b->offset)
+		return a->offset < b->offset ? -1 : 1;
+
+	return 0;
+}
+
+static int index_old_image(delta_t *d)
+{
+	const void *ptr;
+	extent_t *ext;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < d->old.count; ++i) {
+		ext = d->old.list + i;
+
+		ret = get_raw(d->old_file, ext->offset, ext->size,
+			      d->old_buf, &ptr);
+		if (ret) {
+			sqfs_perror(d->opt->old_path, "reading data block",
+				    ret);
+			return -1;
+		}
+
+		ext->hash = xxh64(ptr, ext->size);
+	}
+
+	qsort(d->old.list, d->old.count, sizeof(d->old.list[0]),
+	      compare_hash);
+	return 0;
+}
+
+static int write_patch(delta_t *d, const void *data, size_t size)
+{
+	int ret;
+
+	ret = d->patch->write_at(d->patch, d->patch_size, data, size);
+	if (ret) {
+		sqfs_perror(d->opt->patch_path, "writing patch", ret);
+		return -1;
+	}
+
+	d->patch_size += size;
+	return 0;
+}
+
+static int write_record(delta_t *d, sqfs_u32 type, sqfs_u32 size,
+			sqfs_u64 offset)
+{
+	delta_record_t rec;
+
+	rec.type = htole32(type);
+	rec.size = htole32(size);
+	rec.offset = htole64(offset);
+
+	return write_patch(d, &rec, sizeof(rec));
+}
+
+static int flush_copy(delta_t *d)
+{
+	sqfs_u64 diff;
+
+	for (; d->copy_size > 0; d->copy_size -= diff) {
+		diff = d->copy_size;
+		if (diff > DELTA_MAX_COPY)
+			diff = DELTA_MAX_COPY;
+
+		if (write_record(d, DELTA_COPY, diff, d->copy_src))
+			return -1;
+
+		d->copy_src += diff;
+		d->copied += diff;
+	}
+
+	return 0;
+}
+
+static int flush_data(delta_t *d)
+{
+	size_t diff;
+	int ret;
+
+	for (; d->data_size > 0; d->data_size -= diff) {
+		diff = DELTA_MAX_DATA;
+		if ((sqfs_u64)diff > d->data_size)
+			diff = d->data_size;
+
+		ret = d->new_file->read_at(d->new_file, d->data_start,
+					   d->data_buf, diff);
+		if (ret) {
+			sqfs_perror(d->opt->new_path, "reading image", ret);
+			return -1;
+		}
+
+		if (write_record(d, DELTA_DATA, diff, 0))
+			return -1;
+
+		if (write_patch(d, d->data_buf, diff))
+			return -1;
+
+		d->data_start += diff;
+		d->literal += diff;
+	}
+
+	return 0;
+}
+
+static int add_copy(delta_t *d, sqfs_u64 src, sqfs_u64 size)
+{
+	if (flush_data(d))
+		return -1;
+
+	if (d->copy_size > 0 && d->copy_src + d->copy_size != src) {
+		if (flush_copy(d))
+			return -1;
+	}
+
+	if (d->copy_size == 0)
+		d->copy_src = src;
+
+	d->copy_size += size;
+	return 0;
+}
+
+static int add_data(delta_t *d, sqfs_u64 start, sqfs_u64 size)
+{
+	if (flush_copy(d))
+		return -1;
+
+	if (d->data_size == 0)
+		d->data_start = start;
+
+	d->data_size += size;
+	return 0;
+}
+
+static int add_stored(delta_t *d, const void *data, sqfs_u32 size,
+		      sqfs_u64 hash)
+{
+	bool added;
+
+	if (flush_copy(d) || flush_data(d))
+		return -1;
+
+	if (store_put_block(d->opt->store_path, hash, data, size, &added))
+		return -1;
+
+	d->stored += size;
+	if (added)
+		d->stored_new += size;
+
+	return write_record(d, DELTA_STORE, size, hash);
+}
+
+/*
+  Find a block of the old image with the same on-disk data. If there is more
+  than one, prefer the one that continues the pending copy.
+ */
+static int find_block(delta_t *d, const void *data, sqfs_u32 size,
+		      sqfs_u64 hash, sqfs_u64 *out, bool *found)
+{
+	size_t i, lo = 0, hi = d->old.count;
+	extent_t key;
+	const void *ptr;
+	int ret;
+
+	key.hash = hash;
+	key.size = size;
+	key.offset = 0;
+
+	while (lo < hi) {
+		i = lo + (hi - lo) / 2;
+
+		if (compare_hash(d->old.list + i, &key) < 0) {
+			lo = i + 1;
+		} else {
+			hi = i;
+		}
+	}
+
+	*found = false;
+
+	for (i = lo; i < d->old.count; ++i) {
+		if (d->old.list[i].hash != key.hash ||
+		    d->old.list[i].size != key.size)
+			break;
+
+		ret = get_raw(d->old_file, d->old.list[i].offset, size,
+			      d->old_buf, &ptr);
+		if (ret) {
+			sqfs_perror(d->opt->old_path, "reading data block",
+				    ret);
+			return -1;
+		}
+
+		if (memcmp(ptr, data, size) != 0)
+			continue;
+
+		*out = d->old.list[i].offset;
+		*found = true;
+
+		if (*out == d->copy_src + d->copy_size)
+			break;
+	}
+
+	return 0;
+}
+
+static int process_new_image(delta_t *d, const extent_list_t *new)
+{
+	sqfs_u64 pos = 0, size, src, hash;
+	const void *ptr;
+	const extent_t *ext;
+	bool found;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < new->count; ++i) {
+		ext = new->list + i;
+
+		/* overlapping blocks can only come from a broken image */
+		if (ext->offset < pos)
+			continue;
+
+		if (ext->offset > pos) {
+			if (add_data(d, pos, ext->offset - pos))
+				return -1;
+		}
+
+		ret = get_raw(d->new_file, ext->offset, ext->size,
+			      d->new_buf, &ptr);
+		if (ret) {
+			sqfs_perror(d->opt->new_path, "reading data block",
+				    ret);
+			return -1;
+		}
+
+		hash = xxh64(ptr, ext->size);
+
+		if (find_block(d, ptr, ext->size, hash, &src, &found))
+			return -1;
+
+		if (found) {
+			ret = add_copy(d, src, ext->size);
+		} else if (d->opt->store_path != NULL) {
+			ret = add_stored(d, ptr, ext->size, hash);
+		} else {
+			ret = add_data(d, ext->offset, ext->size);
+		}
+
+		if (ret)
+			return -1;
+
+		pos = ext->offset + ext->size;
+	}
+
+	size = d->new_file->get_size(d->new_file);
+
+	if (size > pos) {
+		if (add_data(d, pos, size - pos))
+			return -1;
+	}
+
+	if (flush_copy(d) || flush_data(d))
+		return -1;
+
+	return write_record(d, DELTA_END, 0, 0);
+}
+
+static int write_header(delta_t *d)
+{
+	delta_header_t hdr;
+	sqfs_u64 hash;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, DELTA_MAGIC, sizeof(hdr.magic));
+
+	if (d->old_file != NULL) {
+		if (hash_image(d->opt->old_path, d->old_file, &hash))
+			return -1;
+
+		hdr.old_size = htole64(d->old_file->get_size(d->old_file));
+		hdr.old_hash = htole64(hash);
+	}
+
+	if (hash_image(d->opt->new_path, d->new_file, &hash))
+		return -1;
+
+	hdr.new_size = htole64(d->new_file->get_size(d->new_file));
+	hdr.new_hash = htole64(hash);
+
+	return write_patch(d, &hdr, sizeof(hdr));
+}
+
+int create_patch(const options_t *opt)
+{
+	extent_list_t new;
+	int status = -1;
+	sqfs_u32 max;
+	delta_t d;
+	int ret;
+
+	memset(&d, 0, sizeof(d));
+	memset(&new, 0, sizeof(new));
+	d.opt = opt;
+
+	if (opt->old_path != NULL) {
+		d.old_file = sqfs_open_file(opt->old_path,
+					    SQFS_FILE_OPEN_READ_ONLY |
+					    SQFS_FILE_OPEN_MMAP);
+		if (d.old_file == NULL) {
+			perror(opt->old_path);
+			return -1;
+		}
+	}
+
+	d.new_file = sqfs_open_file(opt->new_path, SQFS_FILE_OPEN_READ_ONLY |
+				    SQFS_FILE_OPEN_MMAP);
+	if (d.new_file == NULL) {
+		perror(opt->new_path);
+		goto out;
+	}
+
+	if (d.old_file != NULL &&
+	    collect_extents(opt->old_path, d.old_file, &d.old))
+		goto out;
+
+	if (collect_extents(opt->new_path, d.new_file, &new))
+		goto out;
+
+	max = d.old.max_size > new.max_size ? d.old.max_size : new.max_size;
+
+	d.old_buf = malloc(max > 0 ? max : 1);
+	d.new_buf = malloc(max > 0 ? max : 1);
+	d.data_buf = malloc(DELTA_MAX_DATA);
+
+	if (d.old_buf == NULL || d.new_buf == NULL || d.data_buf == NULL) {
+		perror("allocating block buffers");
+		goto out;
+	}
+
+	if (index_old_image(&d))
+		goto out;
+
+	d.patch = sqfs_open_file(opt->patch_path, opt->force ?
+				 SQFS_FILE_OPEN_OVERWRITE : 0);
+	if (d.patch == NULL) {
+		perror(opt->patch_path);
+		goto out;
+	}
+
+	if (write_header(&d))
+		goto out;
+
+	if (process_new_image(&d, &new))
+		goto out;
+
+	ret = sqfs_file_flush(d.patch, 0);
+	if (ret) {
+		sqfs_perror(opt->patch_path, "writing patch", ret);
+		goto out;
+	}
+
+	if (!opt->quiet) {
+		printf("Copied from old image: %llu bytes\n",
+		       (unsigned long long)d.copied);
+		printf("Included in patch: %llu bytes\n",
+		       (unsigned long long)d.literal);
+
+		if (opt->store_path != NULL) {
+			printf("Taken from block store: %llu bytes\n",
+			       (unsigned long long)d.stored);
+			printf("Added to block store: %llu bytes\n",
+			       (unsigned long long)d.stored_new);
+		}
+
+		printf("Patch size: %llu bytes\n",
+		       (unsigned long long)d.patch_size);
+	}
+
+	status = 0;
+out:
+	if (d.patch != NULL)
+		d.patch->destroy(d.patch);
+	if (d.new_file != NULL)
+		d.new_file->destroy(d.new_file);
+	if (d.old_file != NULL)
+		d.old_file->destroy(d.old_file);
+	extent_list_cleanup(&d.old);
+	extent_list_cleanup(&new);
+	free(d.old_buf);
+	free(d.new_buf);
+	free(d.data_buf);
+	return status;
+}
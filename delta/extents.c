@@ -0,0 +1,289 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * extents.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "sqfsdelta.h"
+
+static int add_extent(extent_list_t *list, sqfs_u64 offset, sqfs_u32 size)
+{
+	extent_t *new;
+	size_t max;
+
+	if (list->count == list->max) {
+		max = list->max > 0 ? list->max * 2 : 1024;
+
+		if (SZ_MUL_OV(max, sizeof(new[0]), &max)) {
+			errno = EOVERFLOW;
+			return -1;
+		}
+
+		new = realloc(list->list, max);
+		if (new == NULL)
+			return -1;
+
+		list->list = new;
+		list->max = max / sizeof(new[0]);
+	}
+
+	list->list[list->count].offset = offset;
+	list->list[list->count].size = size;
+	list->list[list->count].hash = 0;
+	list->count += 1;
+
+	if (size > list->max_size)
+		list->max_size = size;
+	return 0;
+}
+
+static int add_file_blocks(extent_list_t *list,
+			   const sqfs_inode_generic_t *inode)
+{
+	sqfs_u64 location;
+	sqfs_u32 size;
+	size_t i;
+
+	sqfs_inode_get_file_block_start(inode, &location);
+
+	for (i = 0; i < inode->num_file_blocks; ++i) {
+		size = SQFS_ON_DISK_BLOCK_SIZE(inode->block_sizes[i]);
+		if (size == 0)
+			continue;
+
+		if (add_extent(list, location, size))
+			return -1;
+
+		location += size;
+	}
+
+	return 0;
+}
+
+static int add_tree_blocks(extent_list_t *list, const sqfs_tree_node_t *n)
+{
+	for (; n != NULL; n = n->next) {
+		if (S_ISREG(n->inode->base.mode)) {
+			if (add_file_blocks(list, n->inode))
+				return -1;
+		} else if (S_ISDIR(n->inode->base.mode)) {
+			if (add_tree_blocks(list, n->children))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int add_fragments(const char *path, extent_list_t *list,
+			 sqfs_data_reader_t *data, const sqfs_super_t *super)
+{
+	sqfs_fragment_t frag;
+	sqfs_u32 i, size;
+	int ret;
+
+	for (i = 0; i < super->fragment_entry_count; ++i) {
+		ret = sqfs_data_reader_get_fragment_entry(data, i, &frag);
+		if (ret) {
+			sqfs_perror(path, "reading fragment table", ret);
+			return -1;
+		}
+
+		size = SQFS_ON_DISK_BLOCK_SIZE(frag.size);
+		if (size == 0)
+			continue;
+
+		if (add_extent(list, frag.start_offset, size)) {
+			perror(path);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int compare_offset(const void *lhs, const void *rhs)
+{
+	const extent_t *a = lhs, *b = rhs;
+
+	if (a->offset != b->offset)
+		return a->offset < b->offset ? -1 : 1;
+
+	return 0;
+}
+
+/* hard links and deduplicated files share blocks */
+static void remove_duplicates(extent_list_t *list)
+{
+	size_t i, j;
+
+	if (list->count == 0)
+		return;
+
+	qsort(list->list, list->count, sizeof(list->list[0]), compare_offset);
+
+	for (i = 0, j = 1; j < list->count; ++j) {
+		if (list->list[j].offset != list->list[i].offset)
+			list->list[++i] = list->list[j];
+	}
+
+	list->count = i + 1;
+}
+
+int collect_extents(const char *path, sqfs_file_t *file, extent_list_t *out)
+{
+	sqfs_compressor_config_t cfg;
+	sqfs_tree_node_t *root = NULL;
+	sqfs_data_reader_t *data;
+	sqfs_id_table_t *idtbl;
+	sqfs_compressor_t *cmp;
+	sqfs_dir_reader_t *dr;
+	sqfs_super_t super;
+	int ret, status = -1;
+
+	memset(out, 0, sizeof(*out));
+
+	ret = sqfs_super_read(&super, file);
+	if (ret) {
+		sqfs_perror(path, "reading super block", ret);
+		return -1;
+	}
+
+	if (!sqfs_compressor_exists(super.compression_id)) {
+		fprintf(stderr, "%s: unknown compressor used.\n", path);
+		return -1;
+	}
+
+	sqfs_compressor_config_init(&cfg, super.compression_id,
+				    super.block_size,
+				    SQFS_COMP_FLAG_UNCOMPRESS);
+
+	cmp = sqfs_compressor_create(&cfg);
+	if (cmp == NULL) {
+		fprintf(stderr, "%s: error creating compressor.\n", path);
+		return -1;
+	}
+
+	if (super.flags & SQFS_FLAG_COMPRESSOR_OPTIONS) {
+		ret = cmp->read_options(cmp, file);
+		if (ret) {
+			sqfs_perror(path, "reading compressor options", ret);
+			goto out_cmp;
+		}
+	}
+
+	idtbl = sqfs_id_table_create();
+	if (idtbl == NULL) {
+		sqfs_perror(path, "creating ID table", SQFS_ERROR_ALLOC);
+		goto out_cmp;
+	}
+
+	ret = sqfs_id_table_read(idtbl, file, &super, cmp);
+	if (ret) {
+		sqfs_perror(path, "loading ID table", ret);
+		goto out_id;
+	}
+
+	dr = sqfs_dir_reader_create(&super, cmp, file);
+	if (dr == NULL) {
+		sqfs_perror(path, "creating directory reader",
+			    SQFS_ERROR_ALLOC);
+		goto out_id;
+	}
+
+	ret = sqfs_dir_reader_get_full_hierarchy(dr, idtbl, NULL,
+						 SQFS_TREE_NO_DEVICES |
+						 SQFS_TREE_NO_SOCKETS |
+						 SQFS_TREE_NO_FIFO |
+						 SQFS_TREE_NO_SLINKS, &root);
+	if (ret) {
+		sqfs_perror(path, "loading filesystem tree", ret);
+		goto out_dr;
+	}
+
+	data = sqfs_data_reader_create(file, super.block_size, cmp, 0);
+	if (data == NULL) {
+		sqfs_perror(path, "creating data reader", SQFS_ERROR_ALLOC);
+		goto out_tree;
+	}
+
+	ret = sqfs_data_reader_load_fragment_table(data, &super);
+	if (ret) {
+		sqfs_perror(path, "loading fragment table", ret);
+		goto out_data;
+	}
+
+	if (add_tree_blocks(out, root)) {
+		perror(path);
+		goto out_data;
+	}
+
+	if (add_fragments(path, out, data, &super))
+		goto out_data;
+
+	remove_duplicates(out);
+	status = 0;
+out_data:
+	sqfs_data_reader_destroy(data);
+out_tree:
+	sqfs_dir_tree_destroy(root);
+out_dr:
+	sqfs_dir_reader_destroy(dr);
+out_id:
+	sqfs_id_table_destroy(idtbl);
+out_cmp:
+	cmp->destroy(cmp);
+	if (status != 0)
+		extent_list_cleanup(out);
+	return status;
+}
+
+void extent_list_cleanup(extent_list_t *list)
+{
+	free(list->list);
+	memset(list, 0, sizeof(*list));
+}
+
+sqfs_u64 hash_chunk(sqfs_u64 state, const void *data, size_t size)
+{
+	sqfs_u64 values[2];
+
+	values[0] = htole64(state);
+	values[1] = htole64(xxh64(data, size));
+
+	return xxh64(values, sizeof(values));
+}
+
+int hash_image(const char *path, sqfs_file_t *file, sqfs_u64 *out)
+{
+	sqfs_u64 offset, size = file->get_size(file);
+	sqfs_u8 *buffer;
+	size_t diff;
+	int ret;
+
+	buffer = malloc(DELTA_MAX_DATA);
+	if (buffer == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	*out = 0;
+
+	for (offset = 0; offset < size; offset += diff) {
+		diff = DELTA_MAX_DATA;
+		if ((sqfs_u64)diff > size - offset)
+			diff = size - offset;
+
+		ret = file->read_at(file, offset, buffer, diff);
+		if (ret) {
+			sqfs_perror(path, "reading image", ret);
+			free(buffer);
+			return -1;
+		}
+
+		*out = hash_chunk(*out, buffer, diff);
+	}
+
+	free(buffer);
+	return 0;
+}
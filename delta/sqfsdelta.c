@@ -0,0 +1,164 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * sqfsdelta.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "sqfsdelta.h"
+
+static struct option long_opts[] = {
+	{ "old", required_argument, NULL, 'a' },
+	{ "new", required_argument, NULL, 'b' },
+	{ "patch", required_argument, NULL, 'p' },
+	{ "store", required_argument, NULL, 's' },
+	{ "missing", no_argument, NULL, 'm' },
+	{ "apply", no_argument, NULL, 'x' },
+	{ "force", no_argument, NULL, 'f' },
+	{ "quiet", no_argument, NULL, 'q' },
+	{ "help", no_argument, NULL, 'h' },
+	{ "version", no_argument, NULL, 'V' },
+};
+
+static const char *short_opts = "a:b:p:s:mxfqhV";
+
+static const char *usagestr =
+"Usage: sqfsdelta [OPTIONS...] --old,-a <old> --new,-b <new> --patch,-p <patch>\n"
+"       sqfsdelta [OPTIONS...] --store,-s <dir> --new,-b <new> --patch,-p <patch>\n"
+"\n"
+"Create a patch that turns one squashfs image into another, or apply it.\n"
+"\n"
+"The patch contains the compressed data blocks and fragment blocks of the\n"
+"new image that are not found anywhere in the old one, as well as the super\n"
+"block and meta data tables. Everything else is copied over from the old\n"
+"image when applying it. The result is identical to the new image, byte for\n"
+"byte, which is checked when applying the patch.\n"
+"\n"
+"With a block store, the blocks that are not in the old image go into the\n"
+"store instead of the patch. Without an old image, this exports all blocks\n"
+"of the new image and the patch becomes a small manifest, that rebuilds it\n"
+"from the store. Blocks are shared by all images in the same store.\n"
+"\n"
+"Possible options:\n"
+"\n"
+"  --old, -a <old>       The image that the patch is applied to.\n"
+"  --new, -b <new>       The image to create. When creating a patch, this\n"
+"                        must already exist.\n"
+"  --patch, -p <patch>   The patch file to create or apply. When applying\n"
+"                        a patch, '-' reads it from stdin. Patches that are\n"
+"                        compressed with gzip, xz, zstd or bzip2 are\n"
+"                        uncompressed on the fly.\n"
+"  --store, -s <dir>     A directory with blocks, named after their hash and\n"
+"                        size. When creating a patch, blocks that are not\n"
+"                        in the old image are added to it. The old image\n"
+"                        is optional with a block store.\n"
+"  --missing, -m         Only print the names of the blocks that the patch\n"
+"                        takes from the block store, but that are not in\n"
+"                        it yet. Needs only --patch and --store.\n"
+"\n"
+"  --apply, -x           Apply the patch to the old image, instead of\n"
+"                        creating it.\n"
+"  --force, -f           Overwrite the output file if it exists.\n"
+"  --quiet, -q           Do not print out statistics after creating a\n"
+"                        patch.\n"
+"\n"
+"  --help, -h            Print help text and exit.\n"
+"  --version, -V         Print version information and exit.\n"
+"\n";
+
+static void process_options(options_t *opt, int argc, char **argv)
+{
+	int i;
+
+	memset(opt, 0, sizeof(*opt));
+
+	for (;;) {
+		i = getopt_long(argc, argv, short_opts, long_opts, NULL);
+		if (i == -1)
+			break;
+
+		switch (i) {
+		case 'a':
+			opt->old_path = optarg;
+			break;
+		case 'b':
+			opt->new_path = optarg;
+			break;
+		case 'p':
+			opt->patch_path = optarg;
+			break;
+		case 's':
+			opt->store_path = optarg;
+			break;
+		case 'm':
+			opt->list_missing = true;
+			break;
+		case 'x':
+			opt->apply = true;
+			break;
+		case 'f':
+			opt->force = true;
+			break;
+		case 'q':
+			opt->quiet = true;
+			break;
+		case 'h':
+			fputs(usagestr, stdout);
+			exit(EXIT_SUCCESS);
+		case 'V':
+			print_version();
+			exit(EXIT_SUCCESS);
+		default:
+			goto fail_arg;
+		}
+	}
+
+	if (opt->patch_path == NULL) {
+		fputs("Missing arguments: patch file\n", stderr);
+		goto fail_arg;
+	}
+
+	if (opt->list_missing) {
+		if (opt->store_path == NULL) {
+			fputs("Missing arguments: block store\n", stderr);
+			goto fail_arg;
+		}
+	} else {
+		if (opt->old_path == NULL && opt->store_path == NULL) {
+			fputs("Missing arguments: old image or block store\n",
+			      stderr);
+			goto fail_arg;
+		}
+
+		if (opt->new_path == NULL) {
+			fputs("Missing arguments: new image\n", stderr);
+			goto fail_arg;
+		}
+	}
+
+	if (optind < argc) {
+		fputs("Unknown extra arguments\n", stderr);
+		goto fail_arg;
+	}
+	return;
+fail_arg:
+	fputs("Try `sqfsdelta --help' for more information.\n", stderr);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	options_t opt;
+	int ret;
+
+	process_options(&opt, argc, argv);
+
+	if (opt.list_missing) {
+		ret = list_missing_blocks(&opt);
+	} else if (opt.apply) {
+		ret = apply_patch(&opt);
+	} else {
+		ret = create_patch(&opt);
+	}
+
+	return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,158 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * sqfsdelta.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef SQFSDELTA_H
+#define SQFSDELTA_H
+
+#include "config.h"
+#include "common.h"
+#include "fstream.h"
+#include "util/util.h"
+#include "util/compat.h"
+
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+/*
+  A patch starts with a header, followed by a sequence of records that
+  produce the new image front to back. All values are little endian.
+
+  A patch that was created without an old image, against a block store
+  (see --store), has an old size and hash of 0. It is a manifest that
+  only uses store and data records.
+ */
+#define DELTA_MAGIC "SQFSDLT1"
+
+/* the largest amount of literal data in a single record */
+#define DELTA_MAX_DATA (1024 * 1024)
+
+typedef struct {
+	sqfs_u8 magic[8];
+	sqfs_u64 old_size;
+	sqfs_u64 old_hash;
+	sqfs_u64 new_size;
+	sqfs_u64 new_hash;
+} delta_header_t;
+
+enum {
+	/* copy size bytes from the old image, starting at offset */
+	DELTA_COPY = 1,
+
+	/* size bytes of data follow the record, offset is unused */
+	DELTA_DATA = 2,
+
+	/* the last record of a patch */
+	DELTA_END = 3,
+
+	/*
+	  copy a block of size bytes from the block store, offset is the
+	  xxh64 hash of the block
+	 */
+	DELTA_STORE = 4,
+};
+
+typedef struct {
+	sqfs_u32 type;
+	sqfs_u32 size;
+	sqfs_u64 offset;
+} delta_record_t;
+
+/* a compressed data block or fragment block of an image */
+typedef struct {
+	sqfs_u64 offset;
+	sqfs_u64 hash;
+	sqfs_u32 size;
+} extent_t;
+
+typedef struct {
+	extent_t *list;
+	size_t count;
+	size_t max;
+
+	/* the largest on-disk size of an extent */
+	sqfs_u32 max_size;
+} extent_list_t;
+
+typedef struct {
+	const char *old_path;
+	const char *new_path;
+	const char *patch_path;
+	const char *store_path;
+	bool list_missing;
+	bool apply;
+	bool force;
+	bool quiet;
+} options_t;
+
+/*
+  Collect the locations of all data blocks and fragment blocks of an image,
+  sorted by location, without duplicates. Prints an error message and returns
+  -1 on failure.
+ */
+int collect_extents(const char *path, sqfs_file_t *file, extent_list_t *out);
+
+void extent_list_cleanup(extent_list_t *list);
+
+/*
+  Hash an entire image, in chunks of DELTA_MAX_DATA bytes. Prints an error
+  message and returns -1 on failure.
+ */
+int hash_image(const char *path, sqfs_file_t *file, sqfs_u64 *out);
+
+/* Fold the hash of the next chunk of an image into the running hash. */
+sqfs_u64 hash_chunk(sqfs_u64 state, const void *data, size_t size);
+
+/*
+  A block store is a directory that holds compressed data blocks and fragment
+  blocks, each in a file named after the xxh64 hash and the size of its
+  contents, e.g. "1f/2e3d4c5b6a7980-4096". Blocks are shared by all images
+  that are exported into the same store.
+ */
+#define STORE_NAME_MAX (32)
+
+/* Get the name of a block, relative to the store, as shown above. */
+void store_block_name(char *out, sqfs_u64 hash, sqfs_u32 size);
+
+/*
+  Get the full path of a block in a store. Prints an error message and
+  returns NULL on failure.
+ */
+char *store_block_path(const char *dir, sqfs_u64 hash, sqfs_u32 size);
+
+/* Prints an error message and returns -1 on failure. */
+int store_has_block(const char *dir, sqfs_u64 hash, sqfs_u32 size,
+		    bool *out);
+
+/*
+  Add a block to a store, unless it is already there. The added flag tells
+  which of the two happened. Prints an error message and returns -1 on
+  failure.
+ */
+int store_put_block(const char *dir, sqfs_u64 hash, const void *data,
+		    sqfs_u32 size, bool *added);
+
+/*
+  Read a block from a store and check that it matches its hash. Prints an
+  error message and returns -1 on failure.
+ */
+int store_get_block(const char *dir, sqfs_u64 hash, sqfs_u32 size,
+		    void *buffer);
+
+int create_patch(const options_t *opt);
+
+int apply_patch(const options_t *opt);
+
+/*
+  Print the names of all blocks that a patch takes from the block store, but
+  that are not in it yet. Returns -1 on failure.
+ */
+int list_missing_blocks(const options_t *opt);
+
+#endif /* SQFSDELTA_H */
@@ -0,0 +1,168 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * store.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "sqfsdelta.h"
+
+char *store_block_path(const char *dir, sqfs_u64 hash, sqfs_u32 size)
+{
+	char name[STORE_NAME_MAX];
+	char *path;
+
+	store_block_name(name, hash, size);
+
+	path = malloc(strlen(dir) + strlen(name) + 2);
+	if (path == NULL) {
+		perror(dir);
+		return NULL;
+	}
+
+	sprintf(path, "%s/%s", dir, name);
+	return path;
+}
+
+void store_block_name(char *out, sqfs_u64 hash, sqfs_u32 size)
+{
+	char hex[17];
+
+	sprintf(hex, "%016llx", (unsigned long long)hash);
+	sprintf(out, "%.2s/%s-%lu", hex, hex + 2, (unsigned long)size);
+}
+
+int store_has_block(const char *dir, sqfs_u64 hash, sqfs_u32 size,
+		    bool *out)
+{
+	struct stat sb;
+	char *path;
+
+	path = store_block_path(dir, hash, size);
+	if (path == NULL)
+		return -1;
+
+	*out = false;
+
+	if (stat(path, &sb) == 0) {
+		*out = true;
+	} else if (errno != ENOENT) {
+		perror(path);
+		free(path);
+		return -1;
+	}
+
+	free(path);
+	return 0;
+}
+
+int store_put_block(const char *dir, sqfs_u64 hash, const void *data,
+		    sqfs_u32 size, bool *added)
+{
+	char *path, *tmp, *sep;
+	sqfs_file_t *file;
+	int ret;
+
+	if (store_has_block(dir, hash, size, added))
+		return -1;
+
+	if (*added) {
+		*added = false;
+		return 0;
+	}
+
+	path = store_block_path(dir, hash, size);
+	if (path == NULL)
+		return -1;
+
+	tmp = malloc(strlen(path) + 5);
+	if (tmp == NULL) {
+		perror(path);
+		free(path);
+		return -1;
+	}
+
+	sprintf(tmp, "%s.tmp", path);
+
+	sep = strrchr(path, '/');
+	*sep = '\0';
+	ret = mkdir_p(path);
+	*sep = '/';
+	if (ret)
+		goto fail;
+
+	/* a block that is only half written must never show up in the store */
+	file = sqfs_open_file(tmp, SQFS_FILE_OPEN_OVERWRITE);
+	if (file == NULL) {
+		perror(tmp);
+		goto fail;
+	}
+
+	ret = file->write_at(file, 0, data, size);
+	if (ret == 0)
+		ret = sqfs_file_flush(file, SQFS_FILE_FLUSH_SYNC);
+	file->destroy(file);
+
+	if (ret) {
+		sqfs_perror(tmp, "writing block", ret);
+		remove(tmp);
+		goto fail;
+	}
+
+	if (rename(tmp, path)) {
+		perror(path);
+		remove(tmp);
+		goto fail;
+	}
+
+	*added = true;
+	free(tmp);
+	free(path);
+	return 0;
+fail:
+	free(tmp);
+	free(path);
+	return -1;
+}
+
+int store_get_block(const char *dir, sqfs_u64 hash, sqfs_u32 size,
+		    void *buffer)
+{
+	sqfs_file_t *file;
+	char *path;
+	int ret;
+
+	path = store_block_path(dir, hash, size);
+	if (path == NULL)
+		return -1;
+
+	file = sqfs_open_file(path, SQFS_FILE_OPEN_READ_ONLY);
+	if (file == NULL) {
+		perror(path);
+		free(path);
+		return -1;
+	}
+
+	if (file->get_size(file) != size) {
+		fprintf(stderr, "%s: block has the wrong size.\n", path);
+		goto fail;
+	}
+
+	ret = file->read_at(file, 0, buffer, size);
+	if (ret) {
+		sqfs_perror(path, "reading block", ret);
+		goto fail;
+	}
+
+	if (xxh64(buffer, size) != hash) {
+		fprintf(stderr, "%s: block is damaged.\n", path);
+		goto fail;
+	}
+
+	file->destroy(file);
+	free(path);
+	return 0;
+fail:
+	file->destroy(file);
+	free(path);
+	return -1;
+}
@@ -11,8 +11,9 @@ int compare_dir_entries(sqfsdiff_t *sd, sqfs_tree_node_t *old,
 {
 	sqfs_tree_node_t *old_it = old->children, *old_prev = NULL;
 	sqfs_tree_node_t *new_it = new->children, *new_prev = NULL;
+	size_t old_len = sd->path.len;
 	int ret, result = 0;
-	char *path;
+	const char *path;
 
 	while (old_it != NULL || new_it != NULL) {
 		if (old_it != NULL && new_it != NULL) {
@@ -26,21 +27,22 @@ int compare_dir_entries(sqfsdiff_t *sd, sqfs_tree_node_t *old,
 
 		if (ret < 0) {
 			result = 1;
-			path = node_path(old_it);
-			if (path == NULL)
+			if (node_path_push(sd, old_it))
 				return -1;
 
+			/* reported relative to the root, without the slash */
+			path = sd->path.str + 1;
+
 			if ((sd->compare_flags & COMPARE_EXTRACT_FILES) &&
 			    S_ISREG(old_it->inode->base.mode)) {
-				if (extract_files(sd, old_it->inode,
+				if (extract_files(sd, &sd->fc, old_it->inode,
 						  NULL, path)) {
-					free(path);
 					return -1;
 				}
 			}
 
-			fprintf(stdout, "< %s\n", path);
-			free(path);
+			report(sd, DIFF_REMOVED, path, old_it->inode);
+			path_buf_truncate(&sd->path, old_len);
 
 			if (old_prev == NULL) {
 				old->children = old_it->next;
@@ -53,21 +55,21 @@ int compare_dir_entries(sqfsdiff_t *sd, sqfs_tree_node_t *old,
 			}
 		} else if (ret > 0) {
 			result = 1;
-			path = node_path(new_it);
-			if (path == NULL)
+			if (node_path_push(sd, new_it))
 				return -1;
 
+			path = sd->path.str + 1;
+
 			if ((sd->compare_flags & COMPARE_EXTRACT_FILES) &&
 			    S_ISREG(new_it->inode->base.mode)) {
-				if (extract_files(sd, NULL, new_it->inode,
-						  path)) {
-					free(path);
+				if (extract_files(sd, &sd->fc, NULL,
+						  new_it->inode, path)) {
 					return -1;
 				}
 			}
 
-			fprintf(stdout, "> %s\n", path);
-			free(path);
+			report(sd, DIFF_ADDED, path, new_it->inode);
+			path_buf_truncate(&sd->path, old_len);
 
 			if (new_prev == NULL) {
 				new->children = new_it->next;
@@ -6,8 +6,34 @@
  */
 #include "sqfsdiff.h"
 
-static unsigned char old_buf[MAX_WINDOW_SIZE];
-static unsigned char new_buf[MAX_WINDOW_SIZE];
+int file_cmp_init(file_cmp_t *fc, sqfs_data_reader_t *old_data,
+		  sqfs_data_reader_t *new_data)
+{
+	memset(fc, 0, sizeof(*fc));
+	fc->old_data = old_data;
+	fc->new_data = new_data;
+	fc->same_old_frag = 0xFFFFFFFF;
+	fc->same_new_frag = 0xFFFFFFFF;
+
+	fc->old_buf = malloc(MAX_WINDOW_SIZE);
+	fc->new_buf = malloc(MAX_WINDOW_SIZE);
+
+	if (fc->old_buf == NULL || fc->new_buf == NULL) {
+		perror("allocating file comparison buffers");
+		file_cmp_cleanup(fc);
+		return -1;
+	}
+
+	return 0;
+}
+
+void file_cmp_cleanup(file_cmp_t *fc)
+{
+	free(fc->old_buf);
+	free(fc->new_buf);
+	fc->old_buf = NULL;
+	fc->new_buf = NULL;
+}
 
 static int read_blob(const char *prefix, const char *path,
 		     sqfs_data_reader_t *rd, const sqfs_inode_generic_t *inode,
@@ -27,7 +53,203 @@ static int read_blob(const char *prefix, const char *path,
 	return 0;
 }
 
-int compare_files(sqfsdiff_t *sd, const sqfs_inode_generic_t *old,
+static int get_raw(sqfs_state_t *state, sqfs_u64 offset, size_t size,
+		   void *buffer, const void **out)
+{
+	sqfs_file_t *file = state->file;
+
+	if (file->map_at != NULL)
+		return file->map_at(file, offset, size, out);
+
+	*out = buffer;
+	return file->read_at(file, offset, buffer, size);
+}
+
+/* compare the raw data of two blocks, without uncompressing them */
+static int raw_equal(sqfsdiff_t *sd, file_cmp_t *fc, const char *path,
+		     sqfs_u64 old_off, sqfs_u64 new_off, sqfs_u32 size,
+		     bool *equal)
+{
+	const void *old_ptr, *new_ptr;
+	int ret;
+
+	ret = get_raw(&sd->sqfs_old, old_off, size, fc->old_buf, &old_ptr);
+	if (ret == 0) {
+		ret = get_raw(&sd->sqfs_new, new_off, size, fc->new_buf,
+			      &new_ptr);
+	}
+
+	if (ret) {
+		sqfs_perror(path, "reading raw data block", ret);
+		return -1;
+	}
+
+	*equal = memcmp(old_ptr, new_ptr, size) == 0;
+	return 0;
+}
+
+static int compare_blocks(sqfsdiff_t *sd, file_cmp_t *fc,
+			  const sqfs_inode_generic_t *old,
+			  const sqfs_inode_generic_t *new, const char *path)
+{
+	sqfs_u32 old_sz, new_sz;
+	sqfs_u64 old_loc, new_loc;
+	size_t i, old_len, new_len;
+	const void *old_ptr, *new_ptr;
+	bool equal;
+	int ret;
+
+	sqfs_inode_get_file_block_start(old, &old_loc);
+	sqfs_inode_get_file_block_start(new, &new_loc);
+
+	for (i = 0; i < old->num_file_blocks; ++i) {
+		old_sz = old->block_sizes[i];
+		new_sz = new->block_sizes[i];
+
+		if (old_sz == new_sz) {
+			if (SQFS_IS_SPARSE_BLOCK(old_sz))
+				continue;
+
+			if (raw_equal(sd, fc, path, old_loc, new_loc,
+				      SQFS_ON_DISK_BLOCK_SIZE(old_sz), &equal))
+				return -1;
+
+			old_loc += SQFS_ON_DISK_BLOCK_SIZE(old_sz);
+			new_loc += SQFS_ON_DISK_BLOCK_SIZE(new_sz);
+
+			if (equal)
+				continue;
+		} else {
+			old_loc += SQFS_ON_DISK_BLOCK_SIZE(old_sz);
+			new_loc += SQFS_ON_DISK_BLOCK_SIZE(new_sz);
+		}
+
+		ret = sqfs_data_reader_peek_block(fc->old_data, old, i,
+						  &old_ptr, &old_len);
+		if (ret == 0) {
+			ret = sqfs_data_reader_peek_block(fc->new_data, new, i,
+							  &new_ptr, &new_len);
+		}
+
+		if (ret) {
+			sqfs_perror(path, "reading data block", ret);
+			return -1;
+		}
+
+		if (old_len != new_len || memcmp(old_ptr, new_ptr, old_len))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int compare_tail(sqfsdiff_t *sd, file_cmp_t *fc,
+			const sqfs_inode_generic_t *old,
+			const sqfs_inode_generic_t *new, const char *path)
+{
+	sqfs_u32 old_idx, old_off, new_idx, new_off;
+	sqfs_fragment_t old_ent, new_ent;
+	const void *old_ptr, *new_ptr;
+	size_t old_len, new_len;
+	bool equal;
+	int ret;
+
+	sqfs_inode_get_frag_location(old, &old_idx, &old_off);
+	sqfs_inode_get_frag_location(new, &new_idx, &new_off);
+
+	if (old_off != new_off)
+		goto uncompress;
+
+	if (old_idx == fc->same_old_frag && new_idx == fc->same_new_frag)
+		return 0;
+
+	if (sqfs_data_reader_get_fragment_entry(fc->old_data, old_idx,
+						&old_ent) ||
+	    sqfs_data_reader_get_fragment_entry(fc->new_data, new_idx,
+						&new_ent) ||
+	    old_ent.size != new_ent.size) {
+		goto uncompress;
+	}
+
+	if (raw_equal(sd, fc, path, old_ent.start_offset,
+		      new_ent.start_offset, SQFS_ON_DISK_BLOCK_SIZE(old_ent.size),
+		      &equal)) {
+		return -1;
+	}
+
+	if (equal) {
+		fc->same_old_frag = old_idx;
+		fc->same_new_frag = new_idx;
+		return 0;
+	}
+uncompress:
+	ret = sqfs_data_reader_peek_fragment(fc->old_data, old,
+					     &old_ptr, &old_len);
+	if (ret == 0) {
+		ret = sqfs_data_reader_peek_fragment(fc->new_data, new,
+						     &new_ptr, &new_len);
+	}
+
+	if (ret) {
+		sqfs_perror(path, "reading fragment block", ret);
+		return -1;
+	}
+
+	return (old_len != new_len || memcmp(old_ptr, new_ptr, old_len)) ?
+		1 : 0;
+}
+
+/*
+  If both images are encoded the same way, compare the files block by block
+  and only uncompress the blocks that differ on disk. Returns -1 on error,
+  0 if the contents are the same, 1 if they differ.
+ */
+static int compare_raw(sqfsdiff_t *sd, file_cmp_t *fc,
+		       const sqfs_inode_generic_t *old,
+		       const sqfs_inode_generic_t *new, const char *path,
+		       sqfs_u64 size)
+{
+	sqfs_u64 block_size = sd->sqfs_old.super.block_size;
+	int ret;
+
+	ret = compare_blocks(sd, fc, old, new, path);
+	if (ret != 0)
+		return ret;
+
+	if (size <= (sqfs_u64)old->num_file_blocks * block_size)
+		return 0;
+
+	return compare_tail(sd, fc, old, new, path);
+}
+
+/* both inodes refer to the exact same data blocks and tail end */
+static bool same_location(const sqfs_inode_generic_t *old,
+			  const sqfs_inode_generic_t *new)
+{
+	sqfs_u32 old_idx, old_off, new_idx, new_off;
+	sqfs_u64 old_start, new_start;
+
+	if (old->num_file_blocks != new->num_file_blocks)
+		return false;
+
+	sqfs_inode_get_file_block_start(old, &old_start);
+	sqfs_inode_get_file_block_start(new, &new_start);
+
+	if (old->num_file_blocks > 0 && old_start != new_start)
+		return false;
+
+	sqfs_inode_get_frag_location(old, &old_idx, &old_off);
+	sqfs_inode_get_frag_location(new, &new_idx, &new_off);
+
+	if (old_idx != new_idx || old_off != new_off)
+		return false;
+
+	return memcmp(old->block_sizes, new->block_sizes,
+		      old->num_file_blocks * sizeof(old->block_sizes[0])) == 0;
+}
+
+int compare_files(sqfsdiff_t *sd, file_cmp_t *fc,
+		  const sqfs_inode_generic_t *old,
 		  const sqfs_inode_generic_t *new, const char *path)
 {
 	sqfs_u64 offset, diff, oldsz, newsz;
@@ -42,6 +264,19 @@ int compare_files(sqfsdiff_t *sd, const sqfs_inode_generic_t *old,
 	if (sd->compare_flags & COMPARE_NO_CONTENTS)
 		return 0;
 
+	if (sd->same_image && same_location(old, new))
+		return 0;
+
+	if (sd->raw_compare &&
+	    old->num_file_blocks == new->num_file_blocks) {
+		ret = compare_raw(sd, fc, old, new, path, oldsz);
+		if (ret < 0)
+			return -1;
+		if (ret > 0)
+			goto out_different;
+		return 0;
+	}
+
 	for (offset = 0; offset < oldsz; offset += diff) {
 		diff = oldsz - offset;
 
@@ -49,23 +284,189 @@ int compare_files(sqfsdiff_t *sd, const sqfs_inode_generic_t *old,
 			diff = MAX_WINDOW_SIZE;
 
 		ret = read_blob(sd->old_path, path,
-				sd->sqfs_old.data, old, old_buf, offset, diff);
+				fc->old_data, old, fc->old_buf, offset, diff);
 		if (ret)
 			return -1;
 
 		ret = read_blob(sd->new_path, path,
-				sd->sqfs_new.data, new, new_buf, offset, diff);
+				fc->new_data, new, fc->new_buf, offset, diff);
 		if (ret)
 			return -1;
 
-		if (memcmp(old_buf, new_buf, diff) != 0)
+		if (memcmp(fc->old_buf, fc->new_buf, diff) != 0)
 			goto out_different;
 	}
 
 	return status;
 out_different:
 	if (sd->compare_flags & COMPARE_EXTRACT_FILES) {
-		if (extract_files(sd, old, new, path))
+		if (extract_files(sd, fc, old, new, path))
+			return -1;
+	}
+	return 1;
+}
+
+static int add_range(range_list_t *list, sqfs_u64 offset, sqfs_u64 size)
+{
+	byte_range_t *last, *new;
+	size_t max;
+
+	if (list->count > 0) {
+		last = list->ranges + list->count - 1;
+
+		if (last->offset + last->size == offset) {
+			last->size += size;
+			return 0;
+		}
+	}
+
+	if (list->count == list->max) {
+		max = list->max > 0 ? list->max * 2 : 16;
+
+		new = realloc(list->ranges, sizeof(new[0]) * max);
+		if (new == NULL) {
+			perror("recording changed byte ranges");
+			return -1;
+		}
+
+		list->ranges = new;
+		list->max = max;
+	}
+
+	list->ranges[list->count].offset = offset;
+	list->ranges[list->count].size = size;
+	list->count += 1;
+	return 0;
+}
+
+static int read_equal(sqfsdiff_t *sd, file_cmp_t *fc,
+		      const sqfs_inode_generic_t *old,
+		      const sqfs_inode_generic_t *new, const char *path,
+		      sqfs_u64 offset, size_t size, bool *equal)
+{
+	if (read_blob(sd->old_path, path, fc->old_data, old, fc->old_buf,
+		      offset, size)) {
+		return -1;
+	}
+
+	if (read_blob(sd->new_path, path, fc->new_data, new, fc->new_buf,
+		      offset, size)) {
+		return -1;
+	}
+
+	*equal = memcmp(fc->old_buf, fc->new_buf, size) == 0;
+	return 0;
+}
+
+/*
+  Compare one block sized window of the two files. Full blocks and the tail
+  end are compared on disk first, if the images are encoded the same way.
+ */
+static int window_equal(sqfsdiff_t *sd, file_cmp_t *fc,
+			const sqfs_inode_generic_t *old,
+			const sqfs_inode_generic_t *new, const char *path,
+			size_t index, sqfs_u64 offset, size_t size,
+			const sqfs_u64 *old_loc, const sqfs_u64 *new_loc,
+			bool *equal)
+{
+	sqfs_u32 old_sz, new_sz;
+	int ret;
+
+	if (sd->raw_compare && index < old->num_file_blocks &&
+	    index < new->num_file_blocks) {
+		old_sz = old->block_sizes[index];
+		new_sz = new->block_sizes[index];
+
+		if (old_sz == new_sz) {
+			if (SQFS_IS_SPARSE_BLOCK(old_sz)) {
+				*equal = true;
+				return 0;
+			}
+
+			if (raw_equal(sd, fc, path, *old_loc, *new_loc,
+				      SQFS_ON_DISK_BLOCK_SIZE(old_sz), equal))
+				return -1;
+
+			if (*equal)
+				return 0;
+		}
+	} else if (sd->raw_compare && index == old->num_file_blocks &&
+		   index == new->num_file_blocks) {
+		ret = compare_tail(sd, fc, old, new, path);
+		if (ret < 0)
+			return -1;
+
+		if (ret == 0) {
+			*equal = true;
+			return 0;
+		}
+	}
+
+	return read_equal(sd, fc, old, new, path, offset, size, equal);
+}
+
+int compare_file_ranges(sqfsdiff_t *sd, file_cmp_t *fc,
+			const sqfs_inode_generic_t *old,
+			const sqfs_inode_generic_t *new, const char *path,
+			range_list_t *out)
+{
+	sqfs_u64 block_size = sd->sqfs_new.super.block_size;
+	sqfs_u64 oldsz, newsz, offset, size, old_loc, new_loc;
+	bool equal;
+	size_t i;
+	int ret;
+
+	out->count = 0;
+	sqfs_inode_get_file_size(old, &oldsz);
+	sqfs_inode_get_file_size(new, &newsz);
+
+	if (sd->compare_flags & COMPARE_NO_CONTENTS) {
+		if (oldsz == newsz)
+			return 0;
+
+		/* only the size is known to differ, assume the end changed */
+		offset = oldsz < newsz ? oldsz : newsz;
+		offset -= offset % block_size;
+
+		if (offset < newsz && add_range(out, offset, newsz - offset))
+			return -1;
+		return 1;
+	}
+
+	if (oldsz == newsz && sd->same_image && same_location(old, new))
+		return 0;
+
+	sqfs_inode_get_file_block_start(old, &old_loc);
+	sqfs_inode_get_file_block_start(new, &new_loc);
+
+	for (i = 0, offset = 0; offset < newsz; ++i, offset += size) {
+		size = newsz - offset;
+		if (size > block_size)
+			size = block_size;
+
+		if (offset + size > oldsz) {
+			equal = false;
+		} else {
+			ret = window_equal(sd, fc, old, new, path, i, offset,
+					   size, &old_loc, &new_loc, &equal);
+			if (ret)
+				return -1;
+		}
+
+		if (i < old->num_file_blocks)
+			old_loc += SQFS_ON_DISK_BLOCK_SIZE(old->block_sizes[i]);
+		if (i < new->num_file_blocks)
+			new_loc += SQFS_ON_DISK_BLOCK_SIZE(new->block_sizes[i]);
+
+		if (!equal && add_range(out, offset, size))
+			return -1;
+	}
+
+	if (out->count == 0 && oldsz == newsz)
+		return 0;
+
+	if (sd->compare_flags & COMPARE_EXTRACT_FILES) {
+		if (extract_files(sd, fc, old, new, path))
 			return -1;
 	}
 	return 1;
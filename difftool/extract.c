@@ -27,7 +27,8 @@ static int extract(sqfs_data_reader_t *data, const sqfs_inode_generic_t *inode,
 		return -1;
 	}
 
-	if (sqfs_data_reader_dump(path, data, inode, fd, block_size, true)) {
+	if (sqfs_data_reader_dump(path, data, inode, fd, block_size,
+				  DUMP_ALLOW_SPARSE)) {
 		close(fd);
 		return -1;
 	}
@@ -36,18 +37,19 @@ static int extract(sqfs_data_reader_t *data, const sqfs_inode_generic_t *inode,
 	return 0;
 }
 
-int extract_files(sqfsdiff_t *sd, const sqfs_inode_generic_t *old,
+int extract_files(sqfsdiff_t *sd, file_cmp_t *fc,
+		  const sqfs_inode_generic_t *old,
 		  const sqfs_inode_generic_t *new,
 		  const char *path)
 {
 	if (old != NULL) {
-		if (extract(sd->sqfs_old.data, old, "old",
+		if (extract(fc->old_data, old, "old",
 			    path, sd->sqfs_old.super.block_size))
 			return -1;
 	}
 
 	if (new != NULL) {
-		if (extract(sd->sqfs_new.data, new, "new",
+		if (extract(fc->new_data, new, "new",
 			    path, sd->sqfs_new.super.block_size))
 			return -1;
 	}
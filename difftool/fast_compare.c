@@ -0,0 +1,590 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * fast_compare.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "sqfsdiff.h"
+#include "sqfs/meta_reader.h"
+#include "util/compat.h"
+
+/*
+  Instead of loading both trees, the directory tables are walked side by
+  side. Images built the same way encode an unchanged entry exactly the same
+  way, so the raw inodes are compared first and only decoded and compared
+  field by field if they differ, or if they are needed anyway, i.e. for
+  reading a directory or comparing the contents of a file.
+ */
+typedef struct {
+	sqfs_state_t *state;
+	const char *filename;
+	sqfs_meta_reader_t *inodes;
+	sqfs_meta_reader_t *dirs;
+
+	/* the encoded inode that was read last */
+	sqfs_u8 *raw;
+	size_t raw_size;
+	size_t raw_max;
+} side_t;
+
+typedef struct {
+	sqfs_dir_entry_t *ent;
+	sqfs_u64 ref;
+
+	/* for the old side, index of the entry with the same name, if any */
+	size_t other;
+} entry_t;
+
+typedef struct {
+	entry_t *list;
+	size_t count;
+	size_t max;
+} listing_t;
+
+typedef struct {
+	sqfsdiff_t *sd;
+	side_t old;
+	side_t new;
+
+	/* both ID tables map every index to the same ID */
+	bool same_ids;
+} fast_t;
+
+static int side_init(side_t *side, sqfs_state_t *state, const char *filename)
+{
+	const sqfs_super_t *super = &state->super;
+	sqfs_u64 limit;
+	int ret;
+
+	memset(side, 0, sizeof(*side));
+	side->state = state;
+	side->filename = filename;
+
+	/* same bounds as for a directory reader */
+	limit = super->id_table_start;
+
+	if (super->fragment_table_start < limit)
+		limit = super->fragment_table_start;
+
+	if (super->export_table_start < limit)
+		limit = super->export_table_start;
+
+	side->inodes = sqfs_meta_reader_create(state->file, state->cmp,
+					       super->inode_table_start,
+					       super->directory_table_start);
+	side->dirs = sqfs_meta_reader_create(state->file, state->cmp,
+					     super->directory_table_start,
+					     limit);
+
+	if (side->inodes == NULL || side->dirs == NULL) {
+		sqfs_perror(filename, "creating meta data readers",
+			    SQFS_ERROR_ALLOC);
+		return -1;
+	}
+
+	/* inodes are read raw first and then decoded, which seeks back into
+	   the block they started in if they straddle a block boundary */
+	ret = sqfs_meta_reader_set_cache_size(side->inodes, 4);
+	if (ret == 0)
+		ret = sqfs_meta_reader_set_cache_size(side->dirs, 4);
+
+	if (ret) {
+		sqfs_perror(filename, "creating meta data cache", ret);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void side_cleanup(side_t *side)
+{
+	if (side->inodes != NULL)
+		sqfs_meta_reader_destroy(side->inodes);
+
+	if (side->dirs != NULL)
+		sqfs_meta_reader_destroy(side->dirs);
+
+	free(side->raw);
+}
+
+static bool same_ids(const sqfs_state_t *a, const sqfs_state_t *b)
+{
+	sqfs_u32 a_id, b_id;
+	size_t i;
+
+	if (a->super.id_count != b->super.id_count)
+		return false;
+
+	for (i = 0; i < a->super.id_count; ++i) {
+		if (sqfs_id_table_index_to_id(a->idtbl, i, &a_id) ||
+		    sqfs_id_table_index_to_id(b->idtbl, i, &b_id) ||
+		    a_id != b_id) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static int push_name(sqfsdiff_t *sd, const sqfs_dir_entry_t *ent)
+{
+	int ret = path_buf_push(&sd->path, (const char *)ent->name,
+				strlen((const char *)ent->name));
+
+	if (ret)
+		sqfs_perror((const char *)ent->name, "get path", ret);
+
+	return ret;
+}
+
+static int read_raw(fast_t *f, side_t *side, sqfs_u64 ref)
+{
+	size_t size = 0;
+	void *new;
+	int ret;
+
+	for (;;) {
+		ret = sqfs_meta_reader_read_raw_inode(side->inodes,
+						      &side->state->super,
+						      ref >> 16, ref & 0xFFFF,
+						      side->raw, side->raw_max,
+						      &size);
+		if (ret != SQFS_ERROR_OVERFLOW || size <= side->raw_max)
+			break;
+
+		new = realloc(side->raw, size);
+		if (new == NULL) {
+			ret = SQFS_ERROR_ALLOC;
+			break;
+		}
+
+		side->raw = new;
+		side->raw_max = size;
+	}
+
+	if (ret) {
+		sqfs_perror(side->filename, f->sd->path.str, ret);
+		return -1;
+	}
+
+	side->raw_size = size;
+	return 0;
+}
+
+static void raw_base(const side_t *side, sqfs_inode_t *base)
+{
+	memcpy(base, side->raw, sizeof(*base));
+
+	base->type = le16toh(base->type);
+	base->uid_idx = le16toh(base->uid_idx);
+	base->gid_idx = le16toh(base->gid_idx);
+}
+
+/* both inodes are encoded the same way and refer to the same IDs */
+static int same_encoding(fast_t *f, sqfs_u64 old_ref, sqfs_u64 new_ref,
+			 bool *out)
+{
+	sqfs_u32 old_uid, old_gid, new_uid, new_gid;
+	sqfs_inode_t base;
+
+	*out = false;
+
+	if (read_raw(f, &f->old, old_ref) || read_raw(f, &f->new, new_ref))
+		return -1;
+
+	if (f->old.raw_size != f->new.raw_size ||
+	    memcmp(f->old.raw, f->new.raw, f->old.raw_size) != 0) {
+		return 0;
+	}
+
+	if (!f->same_ids) {
+		raw_base(&f->old, &base);
+
+		if (sqfs_id_table_index_to_id(f->old.state->idtbl,
+					      base.uid_idx, &old_uid) ||
+		    sqfs_id_table_index_to_id(f->old.state->idtbl,
+					      base.gid_idx, &old_gid) ||
+		    sqfs_id_table_index_to_id(f->new.state->idtbl,
+					      base.uid_idx, &new_uid) ||
+		    sqfs_id_table_index_to_id(f->new.state->idtbl,
+					      base.gid_idx, &new_gid)) {
+			return 0;
+		}
+
+		if (old_uid != new_uid || old_gid != new_gid)
+			return 0;
+	}
+
+	*out = true;
+	return 0;
+}
+
+/* decode an inode into a stand alone node, like in a loaded tree */
+static sqfs_tree_node_t *load_node(fast_t *f, side_t *side, sqfs_u64 ref)
+{
+	const sqfs_state_t *state = side->state;
+	sqfs_tree_node_t *n;
+	int ret;
+
+	n = calloc(1, sizeof(*n) + 1);
+	if (n == NULL) {
+		perror(f->sd->path.str);
+		return NULL;
+	}
+
+	ret = sqfs_meta_reader_read_inode(side->inodes, &state->super,
+					  ref >> 16, ref & 0xFFFF, &n->inode);
+	if (ret)
+		goto fail;
+
+	ret = sqfs_id_table_index_to_id(state->idtbl, n->inode->base.uid_idx,
+					&n->uid);
+	if (ret)
+		goto fail;
+
+	ret = sqfs_id_table_index_to_id(state->idtbl, n->inode->base.gid_idx,
+					&n->gid);
+	if (ret)
+		goto fail;
+
+	n->inode_ref = ref;
+	return n;
+fail:
+	sqfs_perror(side->filename, f->sd->path.str, ret);
+	free(n->inode);
+	free(n);
+	return NULL;
+}
+
+static void free_node(sqfs_tree_node_t *n)
+{
+	if (n != NULL) {
+		free(n->inode);
+		free(n);
+	}
+}
+
+static bool is_dir(const sqfs_inode_generic_t *inode)
+{
+	return inode->base.type == SQFS_INODE_DIR ||
+		inode->base.type == SQFS_INODE_EXT_DIR;
+}
+
+static bool is_file(const sqfs_inode_generic_t *inode)
+{
+	return inode->base.type == SQFS_INODE_FILE ||
+		inode->base.type == SQFS_INODE_EXT_FILE;
+}
+
+static int listing_append(listing_t *ls, sqfs_dir_entry_t *ent, sqfs_u64 ref)
+{
+	size_t new_max;
+	void *new;
+
+	if (ls->count == ls->max) {
+		new_max = ls->max ? ls->max * 2 : 64;
+
+		new = realloc(ls->list, new_max * sizeof(ls->list[0]));
+		if (new == NULL)
+			return SQFS_ERROR_ALLOC;
+
+		ls->list = new;
+		ls->max = new_max;
+	}
+
+	ls->list[ls->count].ent = ent;
+	ls->list[ls->count].ref = ref;
+	ls->list[ls->count].other = (size_t)-1;
+	ls->count += 1;
+	return 0;
+}
+
+static void listing_cleanup(listing_t *ls)
+{
+	size_t i;
+
+	for (i = 0; i < ls->count; ++i)
+		free(ls->list[i].ent);
+
+	free(ls->list);
+}
+
+/* same as a directory reader would, but keeping the inode references */
+static int read_listing(fast_t *f, side_t *side,
+			const sqfs_inode_generic_t *inode, listing_t *ls)
+{
+	const sqfs_super_t *super = &side->state->super;
+	sqfs_u64 block_start, size, diff;
+	sqfs_dir_entry_t *ent;
+	sqfs_dir_header_t hdr;
+	size_t i, offset;
+	int ret;
+
+	if (inode->base.type == SQFS_INODE_EXT_DIR) {
+		size = inode->data.dir_ext.size;
+		offset = inode->data.dir_ext.offset;
+		block_start = inode->data.dir_ext.start_block;
+	} else {
+		size = inode->data.dir.size;
+		offset = inode->data.dir.offset;
+		block_start = inode->data.dir.start_block;
+	}
+
+	if (size <= sizeof(hdr))
+		return 0;
+
+	ret = sqfs_meta_reader_seek(side->dirs,
+				    super->directory_table_start + block_start,
+				    offset);
+	if (ret)
+		goto fail;
+
+	while (size >= sizeof(hdr)) {
+		ret = sqfs_meta_reader_read_dir_header(side->dirs, &hdr);
+		if (ret)
+			goto fail;
+
+		size -= sizeof(hdr);
+
+		for (i = 0; i <= hdr.count; ++i) {
+			ret = sqfs_meta_reader_read_dir_ent(side->dirs, &ent);
+			if (ret)
+				goto fail;
+
+			ret = listing_append(ls, ent, ((sqfs_u64)hdr.start_block
+						       << 16) | ent->offset);
+			if (ret) {
+				free(ent);
+				goto fail;
+			}
+
+			diff = sizeof(*ent) + strlen((const char *)ent->name);
+			if (diff > size) {
+				size = 0;
+				break;
+			}
+
+			size -= diff;
+		}
+	}
+
+	return 0;
+fail:
+	sqfs_perror(side->filename, f->sd->path.str, ret);
+	return -1;
+}
+
+static int compare_pair(fast_t *f, sqfs_u64 old_ref, sqfs_u64 new_ref);
+
+/* an entry that only exists on one side */
+static int report_single(fast_t *f, side_t *side, const entry_t *e,
+			 bool removed)
+{
+	sqfsdiff_t *sd = f->sd;
+	size_t old_len = sd->path.len;
+	sqfs_tree_node_t *n;
+	const char *path;
+	int ret = 0;
+
+	if (push_name(sd, e->ent))
+		return -1;
+
+	n = load_node(f, side, e->ref);
+	if (n == NULL) {
+		ret = -1;
+		goto out;
+	}
+
+	/* reported relative to the root, without the slash */
+	path = sd->path.str + 1;
+
+	if ((sd->compare_flags & COMPARE_EXTRACT_FILES) &&
+	    S_ISREG(n->inode->base.mode)) {
+		ret = extract_files(sd, &sd->fc, removed ? n->inode : NULL,
+				    removed ? NULL : n->inode, path);
+		if (ret)
+			goto out;
+	}
+
+	report(sd, removed ? DIFF_REMOVED : DIFF_ADDED, path, n->inode);
+out:
+	free_node(n);
+	path_buf_truncate(&sd->path, old_len);
+	return ret;
+}
+
+static int compare_dirs(fast_t *f, const sqfs_tree_node_t *a,
+			const sqfs_tree_node_t *b)
+{
+	listing_t old_ls, new_ls;
+	sqfsdiff_t *sd = f->sd;
+	size_t i, j, old_len;
+	int ret, status = 0;
+
+	memset(&old_ls, 0, sizeof(old_ls));
+	memset(&new_ls, 0, sizeof(new_ls));
+
+	if (read_listing(f, &f->old, a->inode, &old_ls) ||
+	    read_listing(f, &f->new, b->inode, &new_ls)) {
+		status = -1;
+		goto out;
+	}
+
+	/* differences in the entries are reported before the ones inside */
+	i = j = 0;
+
+	while (i < old_ls.count || j < new_ls.count) {
+		if (i < old_ls.count && j < new_ls.count) {
+			ret = strcmp((const char *)old_ls.list[i].ent->name,
+				     (const char *)new_ls.list[j].ent->name);
+		} else {
+			ret = i < old_ls.count ? -1 : 1;
+		}
+
+		if (ret < 0) {
+			if (report_single(f, &f->old, old_ls.list + i, true))
+				goto fail;
+			status = 1;
+			++i;
+		} else if (ret > 0) {
+			if (report_single(f, &f->new, new_ls.list + j, false))
+				goto fail;
+			status = 1;
+			++j;
+		} else {
+			old_ls.list[i++].other = j++;
+		}
+	}
+
+	old_len = sd->path.len;
+
+	for (i = 0; i < old_ls.count; ++i) {
+		j = old_ls.list[i].other;
+		if (j >= new_ls.count)
+			continue;
+
+		if (push_name(sd, old_ls.list[i].ent))
+			goto fail;
+
+		ret = compare_pair(f, old_ls.list[i].ref, new_ls.list[j].ref);
+		path_buf_truncate(&sd->path, old_len);
+
+		if (ret < 0)
+			goto fail;
+		if (ret > 0)
+			status = 1;
+	}
+out:
+	listing_cleanup(&old_ls);
+	listing_cleanup(&new_ls);
+	return status;
+fail:
+	status = -1;
+	goto out;
+}
+
+static int compare_pair(fast_t *f, sqfs_u64 old_ref, sqfs_u64 new_ref)
+{
+	sqfs_tree_node_t *a = NULL, *b = NULL;
+	sqfsdiff_t *sd = f->sd;
+	int ret, status = 0;
+	sqfs_inode_t base;
+	bool same;
+
+	if (same_encoding(f, old_ref, new_ref, &same))
+		return -1;
+
+	if (same) {
+		raw_base(&f->old, &base);
+
+		switch (base.type) {
+		case SQFS_INODE_DIR:
+		case SQFS_INODE_EXT_DIR:
+			break;
+		case SQFS_INODE_FILE:
+		case SQFS_INODE_EXT_FILE:
+			if (sd->compare_flags & COMPARE_NO_CONTENTS)
+				return 0;
+			break;
+		default:
+			return 0;
+		}
+	}
+
+	a = load_node(f, &f->old, old_ref);
+	b = load_node(f, &f->new, new_ref);
+	if (a == NULL || b == NULL) {
+		status = -1;
+		goto out;
+	}
+
+	if (!same) {
+		status = node_compare_meta(sd, a, b, sd->path.str);
+		if (status == 2) {
+			status = 1;
+			goto out;
+		}
+	}
+
+	if (is_dir(a->inode)) {
+		ret = compare_dirs(f, a, b);
+	} else if (is_file(a->inode)) {
+		ret = report_compare_files(sd, a->inode, b->inode,
+					   sd->path.str);
+
+		/* a comparison carried out later still needs the inodes */
+		if (ret >= 0 && sd->num_jobs > 1) {
+			b->next = sd->fast_keep;
+			a->next = b;
+			sd->fast_keep = a;
+			a = b = NULL;
+		}
+	} else {
+		ret = 0;
+	}
+
+	if (ret < 0) {
+		status = -1;
+	} else if (ret > 0) {
+		status = 1;
+	}
+out:
+	free_node(a);
+	free_node(b);
+	return status;
+}
+
+int fast_compare(sqfsdiff_t *sd)
+{
+	int ret = -1;
+	fast_t f;
+
+	memset(&f, 0, sizeof(f));
+	f.sd = sd;
+
+	if (side_init(&f.old, &sd->sqfs_old, sd->old_path))
+		goto out;
+
+	if (side_init(&f.new, &sd->sqfs_new, sd->new_path))
+		goto out;
+
+	f.same_ids = same_ids(&sd->sqfs_old, &sd->sqfs_new);
+
+	ret = compare_pair(&f, sd->sqfs_old.super.root_inode_ref,
+			   sd->sqfs_new.super.root_inode_ref);
+out:
+	side_cleanup(&f.old);
+	side_cleanup(&f.new);
+	return ret;
+}
+
+void fast_compare_cleanup(sqfsdiff_t *sd)
+{
+	sqfs_tree_node_t *n;
+
+	while (sd->fast_keep != NULL) {
+		n = sd->fast_keep;
+		sd->fast_keep = n->next;
+		free_node(n);
+	}
+}
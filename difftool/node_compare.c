@@ -6,17 +6,11 @@
  */
 #include "sqfsdiff.h"
 
-int node_compare(sqfsdiff_t *sd, sqfs_tree_node_t *a, sqfs_tree_node_t *b)
+int node_compare_meta(sqfsdiff_t *sd, const sqfs_tree_node_t *a,
+		      const sqfs_tree_node_t *b, const char *path)
 {
-	char *path = sqfs_tree_node_get_path(a);
-	sqfs_tree_node_t *ait, *bit;
 	bool promoted, demoted;
-	int ret, status = 0;
-
-	if (path == NULL) {
-		perror("constructing absolute file path");
-		return -1;
-	}
+	int status = 0;
 
 	if (a->inode->base.type != b->inode->base.type) {
 		promoted = demoted = false;
@@ -81,37 +75,35 @@ int node_compare(sqfsdiff_t *sd, sqfs_tree_node_t *a, sqfs_tree_node_t *b)
 		}
 
 		if (promoted) {
-			fprintf(stdout, "%s has an extended type\n", path);
+			report(sd, DIFF_EXTENDED_TYPE, path, NULL);
 			status = 1;
 		} else if (demoted) {
-			fprintf(stdout, "%s has a basic type\n", path);
+			report(sd, DIFF_BASIC_TYPE, path, NULL);
 			status = 1;
 		} else {
-			fprintf(stdout, "%s has a different type\n", path);
-			free(path);
-			return 1;
+			report(sd, DIFF_TYPE, path, NULL);
+			return 2;
 		}
 	}
 
 	if (!(sd->compare_flags & COMPARE_NO_PERM)) {
 		if ((a->inode->base.mode & ~S_IFMT) !=
 		    (b->inode->base.mode & ~S_IFMT)) {
-			fprintf(stdout, "%s has different permissions\n",
-				path);
+			report(sd, DIFF_PERMISSIONS, path, NULL);
 			status = 1;
 		}
 	}
 
 	if (!(sd->compare_flags & COMPARE_NO_OWNER)) {
 		if (a->uid != b->uid || a->gid != b->gid) {
-			fprintf(stdout, "%s has different ownership\n", path);
+			report(sd, DIFF_OWNER, path, NULL);
 			status = 1;
 		}
 	}
 
 	if (sd->compare_flags & COMPARE_TIMESTAMP) {
 		if (a->inode->base.mod_time != b->inode->base.mod_time) {
-			fprintf(stdout, "%s has a different timestamp\n", path);
+			report(sd, DIFF_TIMESTAMP, path, NULL);
 			status = 1;
 		}
 	}
@@ -119,8 +111,7 @@ int node_compare(sqfsdiff_t *sd, sqfs_tree_node_t *a, sqfs_tree_node_t *b)
 	if (sd->compare_flags & COMPARE_INODE_NUM) {
 		if (a->inode->base.inode_number !=
 		    b->inode->base.inode_number) {
-			fprintf(stdout, "%s has a different inode number\n",
-				path);
+			report(sd, DIFF_INODE_NUM, path, NULL);
 			status = 1;
 		}
 	}
@@ -130,12 +121,15 @@ int node_compare(sqfsdiff_t *sd, sqfs_tree_node_t *a, sqfs_tree_node_t *b)
 	case SQFS_INODE_EXT_SOCKET:
 	case SQFS_INODE_FIFO:
 	case SQFS_INODE_EXT_FIFO:
+	case SQFS_INODE_DIR:
+	case SQFS_INODE_EXT_DIR:
+	case SQFS_INODE_FILE:
+	case SQFS_INODE_EXT_FILE:
 		break;
 	case SQFS_INODE_BDEV:
 	case SQFS_INODE_CDEV:
 		if (a->inode->data.dev.devno != b->inode->data.dev.devno) {
-			fprintf(stdout, "%s has different device number\n",
-				path);
+			report(sd, DIFF_DEVNO, path, NULL);
 			status = 1;
 		}
 		break;
@@ -143,18 +137,43 @@ int node_compare(sqfsdiff_t *sd, sqfs_tree_node_t *a, sqfs_tree_node_t *b)
 	case SQFS_INODE_EXT_CDEV:
 		if (a->inode->data.dev_ext.devno !=
 		    b->inode->data.dev_ext.devno) {
-			fprintf(stdout, "%s has different device number\n",
-				path);
+			report(sd, DIFF_DEVNO, path, NULL);
 			status = 1;
 		}
 		break;
 	case SQFS_INODE_SLINK:
 	case SQFS_INODE_EXT_SLINK:
 		if (strcmp(a->inode->slink_target, b->inode->slink_target)) {
-			fprintf(stdout, "%s has a different link target\n",
-				path);
+			report(sd, DIFF_LINK_TARGET, path, NULL);
 		}
 		break;
+	default:
+		report(sd, DIFF_UNKNOWN_TYPE, path, NULL);
+		break;
+	}
+
+	return status;
+}
+
+int node_compare(sqfsdiff_t *sd, sqfs_tree_node_t *a, sqfs_tree_node_t *b)
+{
+	size_t old_len = sd->path.len;
+	sqfs_tree_node_t *ait, *bit;
+	int ret, status;
+	const char *path;
+
+	if (a->parent != NULL && node_path_push(sd, a))
+		return -1;
+
+	path = sd->path.str;
+
+	status = node_compare_meta(sd, a, b, path);
+	if (status == 2) {
+		path_buf_truncate(&sd->path, old_len);
+		return 1;
+	}
+
+	switch (a->inode->base.type) {
 	case SQFS_INODE_DIR:
 	case SQFS_INODE_EXT_DIR:
 		ret = compare_dir_entries(sd, a, b);
@@ -165,9 +184,6 @@ int node_compare(sqfsdiff_t *sd, sqfs_tree_node_t *a, sqfs_tree_node_t *b)
 		if (ret > 0)
 			status = 1;
 
-		free(path);
-		path = NULL;
-
 		ait = a->children;
 		bit = b->children;
 
@@ -184,19 +200,17 @@ int node_compare(sqfsdiff_t *sd, sqfs_tree_node_t *a, sqfs_tree_node_t *b)
 		break;
 	case SQFS_INODE_FILE:
 	case SQFS_INODE_EXT_FILE:
-		ret = compare_files(sd, a->inode, b->inode, path);
+		ret = report_compare_files(sd, a->inode, b->inode, path);
 		if (ret < 0) {
 			status = -1;
 		} else if (ret > 0) {
-			fprintf(stdout, "regular file %s differs\n", path);
 			status = 1;
 		}
 		break;
 	default:
-		fprintf(stdout, "%s has unknown type, ignoring\n", path);
 		break;
 	}
 
-	free(path);
+	path_buf_truncate(&sd->path, old_len);
 	return status;
 }
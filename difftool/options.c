@@ -16,11 +16,14 @@ static struct option long_opts[] = {
 	{ "inode-num", no_argument, NULL, 'I' },
 	{ "super", no_argument, NULL, 'S' },
 	{ "extract", required_argument, NULL, 'e' },
+	{ "num-jobs", required_argument, NULL, 'j' },
+	{ "json", no_argument, NULL, 'J' },
+	{ "fast", no_argument, NULL, 'F' },
 	{ "help", no_argument, NULL, 'h' },
 	{ "version", no_argument, NULL, 'V' },
 };
 
-static const char *short_opts = "a:b:OPCTISe:hV";
+static const char *short_opts = "a:b:OPCTISe:j:JFhV";
 
 static const char *usagestr =
 "Usage: sqfsdiff [OPTIONS...] --old,-a <first> --new,-b <second>\n"
@@ -56,12 +59,31 @@ static const char *usagestr =
 "                              end up in a subdirectory 'old' and of the\n"
 "                              second filesystem in a subdirectory 'new'.\n"
 "\n"
+"  --num-jobs, -j <count>      Number of threads to use for comparing file\n"
+"                              contents. The report is printed in the same\n"
+"                              order regardless. The default is to compare\n"
+"                              them one at a time on the main thread.\n"
+"\n"
+"  --json, -J                  Print the report as JSON, one object per line\n"
+"                              and difference. For regular files with\n"
+"                              different contents, list the byte ranges of\n"
+"                              the second file that changed, at block\n"
+"                              granularity.\n"
+"\n"
+"  --fast, -F                  Do not load the directory trees up front.\n"
+"                              Walk both images side by side instead and\n"
+"                              only decode the inodes that are not encoded\n"
+"                              exactly the same way. Much faster for images\n"
+"                              that are built the same way and are mostly\n"
+"                              identical.\n"
+"\n"
 "  --help, -h                  Print help text and exit.\n"
 "  --version, -V               Print version information and exit.\n"
 "\n";
 
 void process_options(sqfsdiff_t *sd, int argc, char **argv)
 {
+	long jobs;
 	int i;
 
 	for (;;) {
@@ -98,6 +120,16 @@ void process_options(sqfsdiff_t *sd, int argc, char **argv)
 			sd->compare_flags |= COMPARE_EXTRACT_FILES;
 			sd->extract_dir = optarg;
 			break;
+		case 'j':
+			jobs = strtol(optarg, NULL, 0);
+			sd->num_jobs = jobs < 1 ? 1 : jobs;
+			break;
+		case 'J':
+			sd->json = true;
+			break;
+		case 'F':
+			sd->fast = true;
+			break;
 		case 'h':
 			fputs(usagestr, stdout);
 			exit(0);
@@ -0,0 +1,438 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * report.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "sqfsdiff.h"
+
+#ifdef WITH_PTHREAD
+#include <pthread.h>
+#endif
+
+struct report_t {
+	report_t *next;
+
+	int what;
+	char *path;
+
+	/* size of an added regular file */
+	bool is_file;
+	sqfs_u64 size;
+
+	/* the two files to compare for DIFF_CONTENTS */
+	const sqfs_inode_generic_t *old;
+	const sqfs_inode_generic_t *new;
+	range_list_t ranges;
+
+	int result;
+	bool done;
+};
+
+static const struct {
+	const char *text;
+	const char *name;
+} diff_kinds[] = {
+	[DIFF_REMOVED] = { "< %s\n", "removed" },
+	[DIFF_ADDED] = { "> %s\n", "added" },
+	[DIFF_EXTENDED_TYPE] = { "%s has an extended type\n", "extended type" },
+	[DIFF_BASIC_TYPE] = { "%s has a basic type\n", "basic type" },
+	[DIFF_TYPE] = { "%s has a different type\n", "type" },
+	[DIFF_PERMISSIONS] = { "%s has different permissions\n",
+			       "permissions" },
+	[DIFF_OWNER] = { "%s has different ownership\n", "ownership" },
+	[DIFF_TIMESTAMP] = { "%s has a different timestamp\n", "timestamp" },
+	[DIFF_INODE_NUM] = { "%s has a different inode number\n",
+			     "inode number" },
+	[DIFF_DEVNO] = { "%s has different device number\n",
+			 "device number" },
+	[DIFF_LINK_TARGET] = { "%s has a different link target\n",
+			       "link target" },
+	[DIFF_UNKNOWN_TYPE] = { "%s has unknown type, ignoring\n",
+				"unknown type" },
+	[DIFF_CONTENTS] = { "regular file %s differs\n", "contents" },
+};
+
+static bool is_queued(const sqfsdiff_t *sd)
+{
+#ifdef WITH_PTHREAD
+	return sd->num_jobs > 1;
+#else
+	(void)sd;
+	return false;
+#endif
+}
+
+static void append(sqfsdiff_t *sd, report_t *rep)
+{
+	if (sd->report_last == NULL) {
+		sd->report_first = rep;
+	} else {
+		sd->report_last->next = rep;
+	}
+
+	sd->report_last = rep;
+}
+
+/*
+  Paths are printed as stored in the image, only quotes, backslashes and
+  control characters are escaped. Paths always start with a slash.
+ */
+static void print_json_path(const char *path)
+{
+	const unsigned char *ptr = (const unsigned char *)path;
+
+	fputc('"', stdout);
+
+	if (*ptr != '/')
+		fputc('/', stdout);
+
+	for (; *ptr != '\0'; ++ptr) {
+		if (*ptr == '"' || *ptr == '\\') {
+			fprintf(stdout, "\\%c", *ptr);
+		} else if (*ptr < 0x20) {
+			fprintf(stdout, "\\u%04x", *ptr);
+		} else {
+			fputc(*ptr, stdout);
+		}
+	}
+
+	fputc('"', stdout);
+}
+
+static void print_json_ranges(const range_list_t *list)
+{
+	size_t i;
+
+	fputs(",\"ranges\":[", stdout);
+
+	for (i = 0; i < list->count; ++i) {
+		fprintf(stdout, "%s[%llu,%llu]", i > 0 ? "," : "",
+			(unsigned long long)list->ranges[i].offset,
+			(unsigned long long)list->ranges[i].size);
+	}
+
+	fputc(']', stdout);
+}
+
+static void print_entry(const sqfsdiff_t *sd, const report_t *rep)
+{
+	sqfs_u64 old_size, new_size;
+	range_list_t all;
+	byte_range_t whole;
+
+	if (!sd->json) {
+		fprintf(stdout, diff_kinds[rep->what].text, rep->path);
+		return;
+	}
+
+	fputs("{\"path\":", stdout);
+	print_json_path(rep->path);
+	fprintf(stdout, ",\"change\":\"%s\"", diff_kinds[rep->what].name);
+
+	if (rep->what == DIFF_CONTENTS) {
+		sqfs_inode_get_file_size(rep->old, &old_size);
+		sqfs_inode_get_file_size(rep->new, &new_size);
+
+		fprintf(stdout, ",\"old_size\":%llu,\"new_size\":%llu",
+			(unsigned long long)old_size,
+			(unsigned long long)new_size);
+		print_json_ranges(&rep->ranges);
+	} else if (rep->what == DIFF_ADDED && rep->is_file) {
+		whole.offset = 0;
+		whole.size = rep->size;
+		all.ranges = &whole;
+		all.count = rep->size > 0 ? 1 : 0;
+
+		fprintf(stdout, ",\"new_size\":%llu",
+			(unsigned long long)rep->size);
+		print_json_ranges(&all);
+	}
+
+	fputs("}\n", stdout);
+
+	/* a consumer may act on each entry while the rest is compared */
+	fflush(stdout);
+}
+
+void report(sqfsdiff_t *sd, int what, const char *path,
+	    const sqfs_inode_generic_t *inode)
+{
+	report_t entry, *rep;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.what = what;
+	entry.path = (char *)path;
+
+	if (inode != NULL && S_ISREG(inode->base.mode)) {
+		entry.is_file = true;
+		sqfs_inode_get_file_size(inode, &entry.size);
+	}
+
+	if (!is_queued(sd)) {
+		print_entry(sd, &entry);
+		return;
+	}
+
+	rep = malloc(sizeof(*rep));
+	if (rep == NULL || (entry.path = strdup(path)) == NULL) {
+		perror("recording difference report");
+		sd->report_failed = true;
+		free(rep);
+		return;
+	}
+
+	*rep = entry;
+	append(sd, rep);
+}
+
+static int compare_entry(sqfsdiff_t *sd, file_cmp_t *fc, report_t *rep)
+{
+	if (sd->json) {
+		return compare_file_ranges(sd, fc, rep->old, rep->new,
+					   rep->path, &rep->ranges);
+	}
+
+	return compare_files(sd, fc, rep->old, rep->new, rep->path);
+}
+
+int report_compare_files(sqfsdiff_t *sd, const sqfs_inode_generic_t *old,
+			 const sqfs_inode_generic_t *new, const char *path)
+{
+	report_t entry, *rep;
+	int ret;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.what = DIFF_CONTENTS;
+	entry.path = (char *)path;
+	entry.old = old;
+	entry.new = new;
+
+	if (!is_queued(sd)) {
+		ret = compare_entry(sd, &sd->fc, &entry);
+
+		if (ret > 0)
+			print_entry(sd, &entry);
+
+		free(entry.ranges.ranges);
+		return ret;
+	}
+
+	rep = malloc(sizeof(*rep));
+	if (rep == NULL || (entry.path = strdup(path)) == NULL) {
+		perror("recording file comparison");
+		free(rep);
+		return -1;
+	}
+
+	*rep = entry;
+	append(sd, rep);
+	return 0;
+}
+
+#ifdef WITH_PTHREAD
+typedef struct {
+	sqfsdiff_t *sd;
+	report_t **jobs;
+	size_t count;
+	size_t next;
+	pthread_mutex_t mtx;
+	pthread_cond_t done_cond;
+} job_queue_t;
+
+typedef struct {
+	job_queue_t *queue;
+	file_cmp_t fc;
+	pthread_t thread;
+} worker_t;
+
+static void *worker_proc(void *arg)
+{
+	worker_t *worker = arg;
+	job_queue_t *queue = worker->queue;
+	report_t *rep;
+	size_t i;
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&queue->mtx);
+		i = queue->next++;
+		pthread_mutex_unlock(&queue->mtx);
+
+		if (i >= queue->count)
+			break;
+
+		rep = queue->jobs[i];
+		ret = compare_entry(queue->sd, &worker->fc, rep);
+
+		pthread_mutex_lock(&queue->mtx);
+		rep->result = ret;
+		rep->done = true;
+		pthread_cond_broadcast(&queue->done_cond);
+		pthread_mutex_unlock(&queue->mtx);
+	}
+
+	return NULL;
+}
+
+static int create_worker(sqfsdiff_t *sd, worker_t *worker, job_queue_t *queue)
+{
+	sqfs_data_reader_t *old_data, *new_data;
+
+	old_data = sqfs_data_reader_create_copy(sd->sqfs_old.data);
+	new_data = sqfs_data_reader_create_copy(sd->sqfs_new.data);
+
+	if (old_data == NULL || new_data == NULL)
+		goto fail;
+
+	if (file_cmp_init(&worker->fc, old_data, new_data))
+		goto fail;
+
+	worker->queue = queue;
+
+	if (pthread_create(&worker->thread, NULL, worker_proc, worker) != 0) {
+		file_cmp_cleanup(&worker->fc);
+		goto fail;
+	}
+
+	return 0;
+fail:
+	if (old_data != NULL)
+		sqfs_data_reader_destroy(old_data);
+	if (new_data != NULL)
+		sqfs_data_reader_destroy(new_data);
+	return -1;
+}
+
+static void destroy_worker(worker_t *worker)
+{
+	pthread_join(worker->thread, NULL);
+	sqfs_data_reader_destroy(worker->fc.old_data);
+	sqfs_data_reader_destroy(worker->fc.new_data);
+	file_cmp_cleanup(&worker->fc);
+}
+
+static int collect_jobs(sqfsdiff_t *sd, job_queue_t *queue)
+{
+	report_t *rep;
+	size_t i = 0;
+
+	for (rep = sd->report_first; rep != NULL; rep = rep->next) {
+		if (rep->what == DIFF_CONTENTS)
+			queue->count += 1;
+	}
+
+	if (queue->count == 0)
+		return 0;
+
+	queue->jobs = alloc_array(sizeof(queue->jobs[0]), queue->count);
+	if (queue->jobs == NULL) {
+		perror("starting file comparison jobs");
+		return -1;
+	}
+
+	for (rep = sd->report_first; rep != NULL; rep = rep->next) {
+		if (rep->what == DIFF_CONTENTS)
+			queue->jobs[i++] = rep;
+	}
+
+	return 0;
+}
+
+/*
+  The file comparisons are handed out in the order they were recorded, so
+  the report can be printed while the later ones are still running.
+ */
+static int run_jobs(sqfsdiff_t *sd)
+{
+	unsigned int i, started = 0;
+	int ret, status = 0;
+	worker_t *workers;
+	job_queue_t queue;
+	report_t *rep;
+
+	memset(&queue, 0, sizeof(queue));
+	queue.sd = sd;
+	queue.mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	queue.done_cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+
+	if (collect_jobs(sd, &queue))
+		return -1;
+
+	workers = NULL;
+	if (queue.count > 0) {
+		workers = alloc_array(sizeof(workers[0]), sd->num_jobs);
+		if (workers == NULL) {
+			perror("starting file comparison jobs");
+			free(queue.jobs);
+			return -1;
+		}
+
+		for (i = 0; i < sd->num_jobs; ++i) {
+			if (create_worker(sd, workers + i, &queue))
+				break;
+			++started;
+		}
+
+		/* if no thread could be started, do it all right here */
+		if (started == 0) {
+			workers[0].queue = &queue;
+			workers[0].fc = sd->fc;
+			worker_proc(workers);
+		}
+	}
+
+	for (rep = sd->report_first; rep != NULL; rep = rep->next) {
+		if (rep->what != DIFF_CONTENTS) {
+			print_entry(sd, rep);
+			continue;
+		}
+
+		pthread_mutex_lock(&queue.mtx);
+		while (!rep->done)
+			pthread_cond_wait(&queue.done_cond, &queue.mtx);
+		ret = rep->result;
+		pthread_mutex_unlock(&queue.mtx);
+
+		if (ret < 0) {
+			status = -1;
+		} else if (ret > 0) {
+			print_entry(sd, rep);
+			if (status == 0)
+				status = 1;
+		}
+	}
+
+	for (i = 0; i < started; ++i)
+		destroy_worker(workers + i);
+
+	pthread_cond_destroy(&queue.done_cond);
+	pthread_mutex_destroy(&queue.mtx);
+	free(workers);
+	free(queue.jobs);
+	return status;
+}
+#endif
+
+int report_finish(sqfsdiff_t *sd)
+{
+	report_t *rep;
+	int status = 0;
+
+#ifdef WITH_PTHREAD
+	if (sd->report_first != NULL)
+		status = run_jobs(sd);
+#endif
+
+	while (sd->report_first != NULL) {
+		rep = sd->report_first;
+		sd->report_first = rep->next;
+
+		free(rep->ranges.ranges);
+		free(rep->path);
+		free(rep);
+	}
+
+	sd->report_last = NULL;
+	return sd->report_failed ? -1 : status;
+}
@@ -6,11 +6,13 @@
  */
 #include "sqfsdiff.h"
 
-static int open_sfqs(sqfs_state_t *state, const char *path)
+static int open_sfqs(sqfs_state_t *state, const char *path,
+		     sqfs_u32 tree_flags, bool load_tree)
 {
 	int ret;
 
-	state->file = sqfs_open_file(path, SQFS_FILE_OPEN_READ_ONLY);
+	state->file = sqfs_open_image(path, SQFS_FILE_OPEN_READ_ONLY |
+				     SQFS_FILE_OPEN_MMAP);
 	if (state->file == NULL) {
 		perror(path);
 		return -1;
@@ -67,16 +69,20 @@ static int open_sfqs(sqfs_state_t *state, const char *path)
 		goto fail_id;
 	}
 
-	ret = sqfs_dir_reader_get_full_hierarchy(state->dr, state->idtbl,
-						 NULL, 0, &state->root);
-	if (ret) {
-		sqfs_perror(path, "loading filesystem tree", ret);
-		goto fail_dr;
+	if (load_tree) {
+		ret = sqfs_dir_reader_get_full_hierarchy(state->dr,
+							 state->idtbl, NULL,
+							 tree_flags,
+							 &state->root);
+		if (ret) {
+			sqfs_perror(path, "loading filesystem tree", ret);
+			goto fail_dr;
+		}
 	}
 
 	state->data = sqfs_data_reader_create(state->file,
 					      state->super.block_size,
-					      state->cmp);
+					      state->cmp, 0);
 	if (state->data == NULL) {
 		sqfs_perror(path, "creating data reader", SQFS_ERROR_ALLOC);
 		goto fail_tree;
@@ -92,7 +98,8 @@ static int open_sfqs(sqfs_state_t *state, const char *path)
 fail_data:
 	sqfs_data_reader_destroy(state->data);
 fail_tree:
-	sqfs_dir_tree_destroy(state->root);
+	if (state->root != NULL)
+		sqfs_dir_tree_destroy(state->root);
 fail_dr:
 	sqfs_dir_reader_destroy(state->dr);
 fail_id:
@@ -107,15 +114,52 @@ fail_file:
 static void close_sfqs(sqfs_state_t *state)
 {
 	sqfs_data_reader_destroy(state->data);
-	sqfs_dir_tree_destroy(state->root);
+	if (state->root != NULL)
+		sqfs_dir_tree_destroy(state->root);
 	sqfs_dir_reader_destroy(state->dr);
 	sqfs_id_table_destroy(state->idtbl);
 	state->cmp->destroy(state->cmp);
 	state->file->destroy(state->file);
 }
 
+static bool same_encoding(sqfsdiff_t *sd)
+{
+	sqfs_u8 old_opt[SQFS_META_BLOCK_SIZE], new_opt[SQFS_META_BLOCK_SIZE];
+	const sqfs_super_t *old = &sd->sqfs_old.super;
+	const sqfs_super_t *new = &sd->sqfs_new.super;
+	size_t old_sz, new_sz;
+
+	if (old->compression_id != new->compression_id ||
+	    old->block_size != new->block_size) {
+		return false;
+	}
+
+	if (compressor_read_raw_options(sd->sqfs_old.file, old,
+					old_opt, &old_sz)) {
+		return false;
+	}
+
+	if (compressor_read_raw_options(sd->sqfs_new.file, new,
+					new_opt, &new_sz)) {
+		return false;
+	}
+
+	return old_sz == new_sz && memcmp(old_opt, new_opt, old_sz) == 0;
+}
+
+static bool is_same_file(const char *a, const char *b)
+{
+	struct stat sa, sb;
+
+	if (stat(a, &sa) != 0 || stat(b, &sb) != 0)
+		return false;
+
+	return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
 int main(int argc, char **argv)
 {
+	sqfs_u32 tree_flags = 0;
 	int status, ret = 0;
 	sqfsdiff_t sd;
 
@@ -127,10 +171,14 @@ int main(int argc, char **argv)
 			return 2;
 	}
 
-	if (open_sfqs(&sd.sqfs_old, sd.old_path))
+	/* the block lists are only needed for reading the file contents */
+	if ((sd.compare_flags & COMPARE_NO_CONTENTS) && sd.extract_dir == NULL)
+		tree_flags |= SQFS_TREE_NO_BLOCK_LISTS;
+
+	if (open_sfqs(&sd.sqfs_old, sd.old_path, tree_flags, !sd.fast))
 		return 2;
 
-	if (open_sfqs(&sd.sqfs_new, sd.new_path)) {
+	if (open_sfqs(&sd.sqfs_new, sd.new_path, tree_flags, !sd.fast)) {
 		status = 2;
 		goto out_sqfs_old;
 	}
@@ -143,13 +191,40 @@ int main(int argc, char **argv)
 		}
 	}
 
-	ret = node_compare(&sd, sd.sqfs_old.root, sd.sqfs_new.root);
+	sd.raw_compare = same_encoding(&sd);
+	sd.same_image = is_same_file(sd.old_path, sd.new_path);
+
+	if (file_cmp_init(&sd.fc, sd.sqfs_old.data, sd.sqfs_new.data)) {
+		ret = -1;
+		goto out;
+	}
+
+	ret = path_buf_init(&sd.path, "/");
+	if (ret) {
+		sqfs_perror(sd.old_path, "comparing images", ret);
+		ret = -1;
+		goto out;
+	}
+
+	if (sd.fast) {
+		ret = fast_compare(&sd);
+	} else {
+		ret = node_compare(&sd, sd.sqfs_old.root, sd.sqfs_new.root);
+	}
+
+	status = report_finish(&sd);
+	if (status < 0) {
+		ret = -1;
+	} else if (ret == 0) {
+		ret = status;
+	}
+
 	if (ret != 0)
 		goto out;
 
 	if (sd.compare_super) {
 		ret = compare_super_blocks(&sd.sqfs_old.super,
-					   &sd.sqfs_new.super);
+					   &sd.sqfs_new.super, sd.json);
 		if (ret != 0)
 			goto out;
 	}
@@ -161,6 +236,9 @@ out:
 	} else {
 		status = 0;
 	}
+	fast_compare_cleanup(&sd);
+	path_buf_cleanup(&sd.path);
+	file_cmp_cleanup(&sd.fc);
 	close_sfqs(&sd.sqfs_new);
 out_sqfs_old:
 	close_sfqs(&sd.sqfs_old);
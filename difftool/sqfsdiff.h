@@ -32,6 +32,32 @@ typedef struct {
 	sqfs_data_reader_t *data;
 } sqfs_state_t;
 
+/* state for comparing file contents, one per thread */
+typedef struct {
+	sqfs_data_reader_t *old_data;
+	sqfs_data_reader_t *new_data;
+	sqfs_u8 *old_buf;
+	sqfs_u8 *new_buf;
+
+	/* the last pair of fragment blocks found to be identical on disk */
+	sqfs_u32 same_old_frag;
+	sqfs_u32 same_new_frag;
+} file_cmp_t;
+
+typedef struct report_t report_t;
+
+/* a changed region of a file, in bytes */
+typedef struct {
+	sqfs_u64 offset;
+	sqfs_u64 size;
+} byte_range_t;
+
+typedef struct {
+	byte_range_t *ranges;
+	size_t count;
+	size_t max;
+} range_list_t;
+
 typedef struct {
 	const char *old_path;
 	const char *new_path;
@@ -40,6 +66,44 @@ typedef struct {
 	sqfs_state_t sqfs_new;
 	bool compare_super;
 	const char *extract_dir;
+
+	/*
+	  Both images use the same compressor, options and block size, so
+	  identical on-disk blocks hold identical data.
+	 */
+	bool raw_compare;
+
+	/*
+	  Both sides are the same image file, so files that refer to the
+	  same data blocks and fragment are identical.
+	 */
+	bool same_image;
+
+	unsigned int num_jobs;
+	file_cmp_t fc;
+
+	/* path of the node currently compared, with a leading slash */
+	path_buf_t path;
+
+	/* print the report as JSON, one object per line */
+	bool json;
+
+	/* with more than one job, the report is collected here first */
+	report_t *report_first;
+	report_t *report_last;
+	bool report_failed;
+
+	/*
+	  Walk the directory tables instead of loading both trees and only
+	  decode inodes that are not encoded exactly the same way.
+	 */
+	bool fast;
+
+	/*
+	  Nodes that fast_compare loaded for a file comparison that is
+	  carried out later by report_finish, linked through next.
+	 */
+	sqfs_tree_node_t *fast_keep;
 } sqfsdiff_t;
 
 enum {
@@ -51,19 +115,91 @@ enum {
 	COMPARE_EXTRACT_FILES = 0x20,
 };
 
+/* kinds of differences in the report */
+enum {
+	DIFF_REMOVED = 0,
+	DIFF_ADDED,
+	DIFF_EXTENDED_TYPE,
+	DIFF_BASIC_TYPE,
+	DIFF_TYPE,
+	DIFF_PERMISSIONS,
+	DIFF_OWNER,
+	DIFF_TIMESTAMP,
+	DIFF_INODE_NUM,
+	DIFF_DEVNO,
+	DIFF_LINK_TARGET,
+	DIFF_UNKNOWN_TYPE,
+	DIFF_CONTENTS,
+};
+
 int compare_dir_entries(sqfsdiff_t *sd, sqfs_tree_node_t *old,
 			sqfs_tree_node_t *new);
 
-char *node_path(const sqfs_tree_node_t *n);
+/* Append the name of a node to the current path. */
+int node_path_push(sqfsdiff_t *sd, const sqfs_tree_node_t *n);
+
+int file_cmp_init(file_cmp_t *fc, sqfs_data_reader_t *old_data,
+		  sqfs_data_reader_t *new_data);
 
-int compare_files(sqfsdiff_t *sd, const sqfs_inode_generic_t *old,
+void file_cmp_cleanup(file_cmp_t *fc);
+
+int compare_files(sqfsdiff_t *sd, file_cmp_t *fc,
+		  const sqfs_inode_generic_t *old,
 		  const sqfs_inode_generic_t *new, const char *path);
 
+/*
+  Like compare_files, but instead of stopping at the first difference, list
+  the byte ranges of the new file that differ, at block granularity.
+ */
+int compare_file_ranges(sqfsdiff_t *sd, file_cmp_t *fc,
+			const sqfs_inode_generic_t *old,
+			const sqfs_inode_generic_t *new, const char *path,
+			range_list_t *out);
+
+/*
+  Print an entry of the report, or record it if there is more than one job.
+  For added or removed entries, inode points to the inode of the entry.
+ */
+void report(sqfsdiff_t *sd, int what, const char *path,
+	    const sqfs_inode_generic_t *inode);
+
+/*
+  Compare the contents of two files and report if they differ. With more
+  than one job, this is recorded and carried out by report_finish.
+ */
+int report_compare_files(sqfsdiff_t *sd, const sqfs_inode_generic_t *old,
+			 const sqfs_inode_generic_t *new, const char *path);
+
+/*
+  Run the recorded file comparisons and print the report in order. Returns
+  -1 on error, 1 if any of the files differ, 0 otherwise.
+ */
+int report_finish(sqfsdiff_t *sd);
+
 int node_compare(sqfsdiff_t *sd, sqfs_tree_node_t *a, sqfs_tree_node_t *b);
 
-int compare_super_blocks(const sqfs_super_t *a, const sqfs_super_t *b);
+/*
+  Compare and report everything about two nodes, except for the directory
+  entries and the file contents. Returns 2 if the nodes have entirely
+  different types and nothing else was compared.
+ */
+int node_compare_meta(sqfsdiff_t *sd, const sqfs_tree_node_t *a,
+		      const sqfs_tree_node_t *b, const char *path);
+
+/*
+  Same result as node_compare on the root nodes, but without loading the
+  trees, see the fast flag.
+ */
+int fast_compare(sqfsdiff_t *sd);
+
+/* Release the nodes kept for report_finish, once it is done. */
+void fast_compare_cleanup(sqfsdiff_t *sd);
+
+int compare_super_blocks(const sqfs_super_t *a, const sqfs_super_t *b,
+			 bool json);
 
-int extract_files(sqfsdiff_t *sd, const sqfs_inode_generic_t *old,
+int extract_files(sqfsdiff_t *sd, file_cmp_t *fc,
+		  const sqfs_inode_generic_t *old,
 		  const sqfs_inode_generic_t *new,
 		  const char *path);
 
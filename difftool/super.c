@@ -78,11 +78,17 @@ static void print_flag_diff(sqfs_u16 a, sqfs_u16 b)
 	}
 }
 
-int compare_super_blocks(const sqfs_super_t *a, const sqfs_super_t *b)
+int compare_super_blocks(const sqfs_super_t *a, const sqfs_super_t *b,
+			 bool json)
 {
 	if (memcmp(a, b, sizeof(*a)) == 0)
 		return 0;
 
+	if (json) {
+		fputs("{\"change\":\"super block\"}\n", stdout);
+		return 1;
+	}
+
 	fputs("======== super blocks are different ========\n", stdout);
 
 	/* TODO: if a new magic number or squashfs version is introduced,
@@ -6,20 +6,13 @@
  */
 #include "sqfsdiff.h"
 
-char *node_path(const sqfs_tree_node_t *n)
+int node_path_push(sqfsdiff_t *sd, const sqfs_tree_node_t *n)
 {
-	char *path = sqfs_tree_node_get_path(n);
+	int ret = path_buf_push(&sd->path, (const char *)n->name,
+				strlen((const char *)n->name));
 
-	if (path == NULL) {
-		perror("get path");
-		return NULL;
-	}
+	if (ret)
+		sqfs_perror((const char *)n->name, "get path", ret);
 
-	if (canonicalize_name(path)) {
-		fprintf(stderr, "failed to canonicalization '%s'\n", path);
-		free(path);
-		return NULL;
-	}
-
-	return path;
+	return ret;
 }
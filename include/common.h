@@ -23,31 +23,118 @@
 #include "sqfs/dir_reader.h"
 #include "sqfs/block.h"
 #include "sqfs/xattr.h"
+#include "sqfs/trace.h"
+#include "sqfs/thread_pool.h"
+#include "sqfs/path_index.h"
 #include "sqfs/dir.h"
 #include "sqfs/io.h"
 
 #include "util/compat.h"
 #include "util/util.h"
+#include "util/path_buf.h"
 
 #include "fstree.h"
 #include "tar.h"
 
 #include <stddef.h>
 
+/* number of data blocks read ahead per decompressor thread */
+#define READAHEAD_PER_JOB (4)
+
+/* meta data blocks read ahead when the tables are not preloaded */
+#define META_READAHEAD (16)
+
+typedef struct block_cache_t block_cache_t;
+
+typedef struct level_tuner_t level_tuner_t;
+
+typedef struct block_probe_t block_probe_t;
+
+/* a status line updated while packing, see progress_update */
+typedef struct {
+	sqfs_data_writer_t *data;
+	size_t max_backlog;
+	size_t block_size;
+
+	/* expected number of input bytes, 0 if unknown */
+	sqfs_u64 total;
+
+	/* input bytes in the blocks and tail ends the data writer is done with */
+	sqfs_u64 bytes_in;
+
+	sqfs_u64 start;
+	sqfs_u64 last;
+	bool enabled;
+	bool tty;
+	bool shown;
+} progress_t;
+
+/* the steps of building an image, timed separately in the statistics */
+typedef enum {
+	/* reading and sorting the input tree, only done by gensquashfs */
+	WRITER_PHASE_SCAN = 0,
+
+	/* packing file data, until the data writer is done */
+	WRITER_PHASE_DATA,
+	WRITER_PHASE_INODES,
+	WRITER_PHASE_FRAGMENTS,
+	WRITER_PHASE_EXPORT,
+	WRITER_PHASE_IDS,
+	WRITER_PHASE_XATTRS,
+
+	/* padding, the final super block and flushing the output */
+	WRITER_PHASE_FINISH,
+
+	WRITER_PHASE_COUNT
+} E_WRITER_PHASE;
+
+typedef struct {
+	/* wall clock and process CPU time in nanoseconds */
+	sqfs_u64 wall;
+	sqfs_u64 cpu;
+
+	/* false if the phase was skipped */
+	bool done;
+} phase_time_t;
+
 typedef struct {
 	size_t file_count;
+	size_t duplicate_files;
+	size_t reused_files;
 	size_t blocks_written;
 	size_t frag_blocks_written;
 	size_t duplicate_blocks;
 	size_t sparse_blocks;
+	size_t cached_blocks;
 	size_t frag_count;
 	size_t frag_dup;
 	sqfs_u64 bytes_written;
 	sqfs_u64 bytes_read;
+
+	/* data and fragment blocks per sqfs_compressor_t::method, by bit */
+	size_t method_blocks[16];
+
+	/* filled in after the data writer is done, if size is non-zero */
+	sqfs_data_writer_timing_t timing;
+
+	/* see stats_phase_end */
+	phase_time_t phases[WRITER_PHASE_COUNT];
+	sqfs_u64 phase_wall_start;
+	sqfs_u64 phase_cpu_start;
+
+	progress_t progress;
+
+	/* fed from the block hooks, if the level is tuned automatically */
+	level_tuner_t *tuner;
 } data_writer_stats_t;
 
+typedef struct export_table_t export_table_t;
+
+typedef struct inode_spill_t inode_spill_t;
+
 typedef struct {
 	sqfs_data_writer_t *data;
+	sqfs_thread_pool_t *pool;
 	sqfs_compressor_t *cmp;
 	sqfs_id_table_t *idtbl;
 	sqfs_file_t *outfile;
@@ -55,16 +142,37 @@ typedef struct {
 	fstree_t fs;
 	data_writer_stats_t stats;
 	sqfs_xattr_writer_t *xwr;
+	block_cache_t *cache;
+	export_table_t *export;
+	inode_spill_t *spill;
+	level_tuner_t *tuner;
+	sqfs_compressor_config_t comp_cfg;
+
+	/* the output can't seek, see sqfs_stream_trailer_t */
+	bool stream;
+
+	/* the cache belongs to the caller, see sqfs_writer_cfg_t */
+	bool borrowed_cache;
 } sqfs_writer_t;
 
 typedef struct {
 	const char *filename;
+	const char *block_cache;
+
+	/*
+	  A block cache that is already loaded and used instead of opening
+	  the block_cache file, if that is the file it is kept in. It still
+	  belongs to the caller afterwards.
+	 */
+	block_cache_t *warm_cache;
+
 	char *fs_defaults;
 	char *comp_extra;
 	size_t block_size;
 	size_t devblksize;
 	size_t max_backlog;
 	size_t num_jobs;
+	size_t max_memory;
 
 	int outmode;
 	E_SQFS_COMPRESSOR comp_id;
@@ -72,8 +180,71 @@ typedef struct {
 	bool exportable;
 	bool no_xattr;
 	bool quiet;
+	bool group_fragments;
+	bool best_fit_fragments;
+	bool skip_incompressible;
+	bool pin_workers;
+	bool huge_pages;
+
+	/*
+	  Treat num_jobs as a maximum and park or wake up compressor threads
+	  while packing, see SQFS_DATA_WRITER_ADAPTIVE_WORKERS.
+	 */
+	bool adaptive_workers;
+	bool no_page_cache;
+	bool intern_strings;
+
+	/* move finished file inodes to a temporary file, see inode_spill_t */
+	bool spill_inodes;
+
+	/* avoid splitting the entry inodes of a directory across meta blocks */
+	bool align_inodes;
+
+	/* maximum number of directory entries per header, 0 for the default */
+	size_t dir_index_step;
+
+	/* write the image to stdout, strictly front to back */
+	bool stream_output;
+
+	/* if set, record a trace to this file, see trace_open */
+	const char *trace_file;
+
+	/* show a status line instead of the name of each file packed */
+	bool progress;
+
+	/* if set, also write the statistics to this file, as JSON */
+	const char *stats_json;
+
+	/* if set, write a path index for the image to this file */
+	const char *path_index;
+
+	/* lower the compression level if the compressors hold up packing */
+	bool auto_level;
+
+	/* if not 0, pick the block size by sampling, see block_probe_apply */
+	size_t max_read_amp;
 } sqfs_writer_cfg_t;
 
+/*
+  If an image is streamed to an output that can't seek, the super block at
+  the start is only a placeholder that the final one can't replace. Instead,
+  the final super block is appended after the padded image, in a trailer.
+
+  sqfs_stream_fixup moves it into place and cuts off the trailer, which
+  leaves exactly the image that would have been written to a regular file.
+ */
+#define SQFS_STREAM_TRAILER_MAGIC "SQFSTAIL"
+
+typedef struct {
+	/* the final super block, encoded the same way as at the start */
+	sqfs_super_t super;
+
+	sqfs_u8 magic[8];
+
+	/* little endian size of the image in front of the trailer */
+	sqfs_u64 image_size;
+} sqfs_stream_trailer_t;
+
 /*
   High level helper function to serialize an entire file system tree to
   a squashfs inode table and directory table.
@@ -84,24 +255,149 @@ typedef struct {
   The function internally creates two meta data writers and uses
   meta_writer_write_inode to serialize the inode table of the fstree.
 
+  If export is not NULL, the reference of every inode is added to it, in
+  the order of the inode numbers.
+
+  The inodes of regular files are taken from the user_ptr of the file info,
+  or read back from the spill file if it is not NULL, see inode_spill_get.
+
+  If align_dirs is set, the inodes of a directory's entries are kept in a
+  single meta block where possible, by starting a new block early.
+
+  If index_step is not 0, directory headers and the index entries pointing
+  to them are emitted at least every index_step entries, see
+  sqfs_dir_writer_set_header_limit.
+
   Returns 0 on success. Prints error messages to stderr on failure.
  */
 int sqfs_serialize_fstree(const char *filename, sqfs_file_t *file,
 			  sqfs_super_t *super, fstree_t *fs,
-			  sqfs_compressor_t *cmp, sqfs_id_table_t *idtbl);
+			  sqfs_compressor_t *cmp, sqfs_id_table_t *idtbl,
+			  export_table_t *export, inode_spill_t *spill,
+			  bool align_dirs, size_t index_step);
 
 /*
-  Generate an NFS export table.
+  An NFS export table that is compressed while the inodes are written and
+  kept in memory until write_export_table is called. The file is the one
+  the table will be written to.
+ */
+export_table_t *export_table_create(sqfs_file_t *file, sqfs_compressor_t *cmp);
+
+void export_table_destroy(export_table_t *tbl);
+
+/* Returns 0 on success or an SQFS_ERROR_* code on failure. */
+int export_table_add(export_table_t *tbl, sqfs_u64 inode_ref);
+
+/*
+  Write an NFS export table to the end of the file.
 
   Returns 0 on success. Prints error messages to stderr on failure.
  */
 int write_export_table(const char *filename, sqfs_file_t *file,
-		       fstree_t *fs, sqfs_super_t *super,
-		       sqfs_compressor_t *cmp);
+		       export_table_t *tbl, sqfs_super_t *super);
+
+/*
+  Write a path index that maps the full path of every node in the tree to
+  its inode reference. Must be called after the image is complete, since the
+  index records the final super block. Returns 0 on success, prints an error
+  message and returns -1 on failure.
+ */
+int write_path_index(const char *filename, const fstree_t *fs,
+		     const sqfs_super_t *super);
 
 /* Print out fancy statistics for squashfs packing tools */
 void sqfs_print_statistics(sqfs_super_t *super, data_writer_stats_t *stats);
 
+/*
+  Write the same statistics as a JSON object to a file. Returns 0 on
+  success, prints an error message and returns -1 on failure.
+ */
+int sqfs_write_statistics_json(const char *filename, sqfs_super_t *super,
+			       data_writer_stats_t *stats);
+
+/* Start timing the first phase, see stats_phase_end. */
+void stats_phase_start(data_writer_stats_t *stats);
+
+/*
+  Record the wall clock and CPU time since the previous phase ended, or
+  since stats_phase_start, as the time of the given phase. The next phase
+  starts right away.
+ */
+void stats_phase_end(data_writer_stats_t *stats, E_WRITER_PHASE phase);
+
+/*
+  Keeps the data writer from being held up by the compressors. Compressors
+  for up to 7 lower levels than the configured one are added to the data
+  writer and every few MiB of input, the one used for the files that follow
+  is picked by comparing how fast the compressors take up the input with
+  how fast it is read and written out.
+
+  The configured level is the highest one used. Prints an error message and
+  returns NULL if the compressor settings have no level to tune.
+ */
+level_tuner_t *level_tuner_create(const sqfs_compressor_config_t *cfg);
+
+/* The data writer must be destroyed first, it uses the compressors. */
+void level_tuner_destroy(level_tuner_t *tuner);
+
+/*
+  Add the compressors to a data writer, which must have been created with
+  SQFS_DATA_WRITER_TIMING. Returns 0 on success, prints an error message
+  and returns -1 on failure.
+ */
+int level_tuner_attach(level_tuner_t *tuner, const char *filename,
+		       sqfs_data_writer_t *data);
+
+/* Called from the post_block_write hook of the statistics. */
+void level_tuner_update(level_tuner_t *tuner, const sqfs_block_t *block,
+			const data_writer_stats_t *stats);
+
+/* Print how many data blocks were compressed at which level. */
+void level_tuner_print(const level_tuner_t *tuner);
+
+/*
+  Picks a block size by trial compressing samples of the input with every
+  block size from 16 KiB to 1 MiB. The samples are the first MiB of every
+  so many input files, spread over all of them and limited to 16 MiB in
+  total. The caller asks block_probe_want for every input file, in order,
+  whether to take a sample from it.
+ */
+block_probe_t *block_probe_create(void);
+
+void block_probe_destroy(block_probe_t *probe);
+
+bool block_probe_want(block_probe_t *probe);
+
+/*
+  Allocate the sample for the file that block_probe_want was last asked
+  about and return it, for the caller to fill with the start of the file.
+  The sample size is returned through the last argument. Prints an error
+  message and returns NULL on failure.
+ */
+sqfs_u8 *block_probe_add(block_probe_t *probe, sqfs_u64 filesize,
+			 size_t *size);
+
+/*
+  Move the samples of the second probe into the first one, e.g. if the
+  input was sampled by several threads, and destroy the second one.
+  Returns 0 on success, prints an error message and returns -1 on failure.
+ */
+int block_probe_merge(block_probe_t *probe, block_probe_t *other);
+
+/*
+  The read amplification of a block size is the average compressed size of
+  a block divided by 4 KiB, i.e. how much has to be read from the image for
+  a random 4 KiB read. Out of the block sizes within cfg->max_read_amp, the
+  one that compresses the samples best is set in cfg and the compressor
+  options, unless quiet, a table of all the block sizes tried is printed.
+
+  Afterwards, the data writer is created as well, unless a zstd dictionary
+  still has to be trained. Returns 0 on success, prints an error message
+  and returns -1 on failure.
+ */
+int block_probe_apply(block_probe_t *probe, sqfs_writer_t *sqfs,
+		      sqfs_writer_cfg_t *cfg);
+
 void compressor_print_available(void);
 
 E_SQFS_COMPRESSOR compressor_get_default(void);
@@ -112,30 +408,294 @@ int compressor_cfg_init_options(sqfs_compressor_config_t *cfg,
 
 void compressor_print_help(E_SQFS_COMPRESSOR id);
 
+/*
+  Get the range of values accepted by the "level" option of a compressor.
+  Returns false if the compressor has no such option.
+ */
+bool compressor_get_level_range(E_SQFS_COMPRESSOR id, size_t *min,
+				size_t *max);
+
+/*
+  Get the option name of a strategy or filter that a compressor reported
+  through sqfs_compressor_t::method, or NULL if it has none.
+ */
+const char *compressor_method_name(E_SQFS_COMPRESSOR id, sqfs_u32 method);
+
+/*
+  Read the compressor options of an image as they are stored behind the
+  super block, i.e. without the meta data block header, into a buffer of
+  at least SQFS_META_BLOCK_SIZE bytes. The size is set to 0 if the image
+  has no compressor options. Returns an SQFS error code on failure.
+ */
+int compressor_read_raw_options(sqfs_file_t *file, const sqfs_super_t *super,
+				sqfs_u8 *buffer, size_t *size);
+
 int inode_stat(const sqfs_tree_node_t *node, struct stat *sb);
 
 char *sqfs_tree_node_get_path(const sqfs_tree_node_t *node);
 
+enum {
+	/* seek over sparse blocks, the output must be a new, empty file */
+	DUMP_ALLOW_SPARSE = 0x01,
+
+	/* also seek over all zero ranges of the uncompressed data, so they
+	   end up as holes too, requires DUMP_ALLOW_SPARSE */
+	DUMP_DETECT_ZEROS = 0x02,
+};
+
+/*
+  Write the contents of a file to a file descriptor, using a combination of
+  DUMP_* flags. Returns 0 on success, prints an error message and returns
+  -1 on failure.
+ */
 int sqfs_data_reader_dump(const char *name, sqfs_data_reader_t *data,
 			  const sqfs_inode_generic_t *inode,
-			  int outfd, size_t block_size, bool allow_sparse);
+			  int outfd, size_t block_size, int flags);
+
+/*
+  Append the contents of a file to an output stream. Returns 0 on success,
+  prints an error message and returns -1 on failure.
+ */
+int sqfs_data_reader_dump_stream(const char *name, sqfs_data_reader_t *data,
+				 const sqfs_inode_generic_t *inode,
+				 ostream_t *fp);
 
-sqfs_file_t *sqfs_get_stdin_file(const sparse_map_t *map, sqfs_u64 size);
+sqfs_file_t *sqfs_get_stdin_file(istream_t *strm, const sparse_map_t *map,
+				 sqfs_u64 size);
 
 sqfs_file_t *sqfs_get_stdout_file(void);
 
+/*
+  Open an image for reading. If the path is an http:// or https:// URL, the
+  image is read through HTTP range requests, if support for that was built
+  in. Returns NULL on failure, with errno set.
+ */
+sqfs_file_t *sqfs_open_image(const char *path, sqfs_u32 flags);
+
+#ifdef WITH_CURL
+/*
+  Read a remote image through HTTP range requests. The data is fetched in
+  chunks that are cached, with the super block and the tables fetched in
+  parallel up front. Prints an error message and returns NULL on failure.
+ */
+sqfs_file_t *sqfs_open_http(const char *url);
+#endif
+
+/*
+  Turn a streamed image with a trailer into a regular one, in place.
+  Returns 0 on success, prints an error message and returns -1 on failure.
+ */
+int sqfs_stream_fixup(const char *filename);
+
+/*
+  Record the trace events of libsquashfs and the tool itself to a file, in
+  the JSON format of the Chrome trace viewer, which Perfetto also loads.
+  Returns 0 on success, prints an error message and returns -1 on failure.
+ */
+int trace_open(const char *filename);
+
+/* Stop recording and close the trace file, if one is open. */
+void trace_close(void);
+
 void register_stat_hooks(sqfs_data_writer_t *data, data_writer_stats_t *stats);
 
+void progress_start(data_writer_stats_t *stats, sqfs_data_writer_t *data,
+		    size_t block_size, size_t max_backlog);
+
+/*
+  Redraw the status line with the bytes processed and written, the throughput,
+  the backlog and, if the total is known, an ETA. Does nothing if progress
+  is not enabled or the line was redrawn less than a moment ago. Called from
+  the block hooks and by the packers after each file.
+ */
+void progress_update(data_writer_stats_t *stats);
+
+/* Draw the status line one last time and end it. */
+void progress_end(data_writer_stats_t *stats);
+
+/*
+  Pack the data of a file. If a block cache is given, full data blocks
+  are looked up in there first.
+ */
 int write_data_from_file(const char *filename, sqfs_data_writer_t *data,
 			 sqfs_inode_generic_t *inode,
-			 sqfs_file_t *file, int flags);
+			 sqfs_file_t *file, block_cache_t *cache, int flags);
+
+/*
+  Same as above, but the file is a condensed view of a sparse file that only
+  contains the data regions listed in the map. Holes are added as sparse
+  blocks without reading anything.
+*/
+int write_data_from_file_condensed(const char *filename,
+				   sqfs_data_writer_t *data,
+				   sqfs_inode_generic_t *inode,
+				   sqfs_file_t *file, const sparse_map_t *map,
+				   int flags);
+
+/*
+  Pack the data of a file from another image that was written with the same
+  block size and compressor options, given its inode in that image. Data
+  blocks are copied without recompressing them, only the tail end is
+  unpacked from its fragment block and packed into a new one. The flags
+  are passed on to sqfs_data_writer_begin_file.
+*/
+int write_data_from_image(const char *filename, sqfs_data_writer_t *data,
+			  sqfs_inode_generic_t *inode, sqfs_file_t *image,
+			  sqfs_data_reader_t *rd,
+			  const sqfs_inode_generic_t *original,
+			  size_t block_size, int flags);
+
+/*
+  Same as above, but the data is read through a data reader and packed
+  again, so the image can use a different compressor or block size. The
+  data reader should read ahead on worker threads, so that the blocks
+  are unpacked and compressed again in parallel.
+*/
+int write_data_from_reader(const char *filename, sqfs_data_writer_t *data,
+			   sqfs_inode_generic_t *inode, sqfs_data_reader_t *rd,
+			   const sqfs_inode_generic_t *original, int flags);
+
+/*
+  A persistent cache of compressed data blocks in a file, keyed by the hash
+  of the uncompressed data, that speeds up rebuilding images from mostly the
+  same data with the same block size and compressor settings. If the cache
+  file does not exist or was built with other settings, it is (re)created.
+  The compressor options are read back from the output file, which must
+  already contain them.
+
+  Prints an error message and returns NULL on failure.
+ */
+block_cache_t *block_cache_open(const char *filename, const sqfs_super_t *super,
+				sqfs_file_t *outfile);
+
+/*
+  Open a cache file and read its index, without settling on block size
+  and compressor settings yet, so it can be kept around for several builds.
+  If the file does not exist, it is created. block_cache_open is the same
+  as this, followed by block_cache_attach.
+
+  Prints an error message and returns NULL on failure.
+ */
+block_cache_t *block_cache_load(const char *filename);
+
+/*
+  Pick up the entries that were added to the cache file since it was last
+  read, e.g. by a build in a child process. If the file was started over in
+  the meantime, everything known about the old contents is dropped.
+
+  Prints an error message and returns -1 on failure.
+ */
+int block_cache_refresh(block_cache_t *cache);
+
+/*
+  Prepare a loaded cache for building an image with the settings in the
+  super block. If the cache file was built with other settings, it is
+  started over. Prints an error message and returns -1 on failure.
+ */
+int block_cache_attach(block_cache_t *cache, const sqfs_super_t *super,
+		       sqfs_file_t *outfile);
+
+/* Returns true if the cache is kept in the given file. */
+bool block_cache_is_file(const block_cache_t *cache, const char *filename);
+
+void block_cache_destroy(block_cache_t *cache);
+
+/*
+  Pack the first size bytes of a file. Full blocks found in the cache are
+  copied over as they are stored, everything else is passed on to the
+  data writer. Prints an error message and returns -1 on failure.
+ */
+int block_cache_append(block_cache_t *cache, const char *filename,
+		       sqfs_data_writer_t *data, sqfs_inode_generic_t *inode,
+		       sqfs_file_t *file, sqfs_u64 size);
+
+/*
+  After the data writer is done, add the blocks that were not found in the
+  cache to it, reading them back from the output file. The inodes of the
+  files packed through the cache must still be around. Prints an error
+  message and returns -1 on failure.
+ */
+int block_cache_flush(block_cache_t *cache, sqfs_file_t *outfile);
+
+/* Number of data blocks that were copied over from the cache */
+size_t block_cache_get_hits(const block_cache_t *cache);
+
+/*
+  Keeps the inodes of regular files out of memory while the data is packed.
+  Files are collected once their data has been handed to the data writer.
+  When the collected inodes take up more than a threshold, the data writer
+  is synced, which makes them final, and they are all appended to an
+  unlinked temporary file and freed. sqfs_serialize_fstree reads them back
+  one at a time when writing the inode table.
+
+  Prints an error message and returns NULL on failure.
+ */
+inode_spill_t *inode_spill_create(sqfs_data_writer_t *data);
+
+void inode_spill_destroy(inode_spill_t *spill);
+
+/*
+  Add a file whose inode is in fi->user_ptr, after all of its data has
+  been handed to the data writer. Files with the linked flag set or that
+  are themselves linked to another file must not be added, their inodes
+  are only final once the data writer is finished.
+
+  Prints an error message and returns -1 on failure.
+ */
+int inode_spill_add(inode_spill_t *spill, file_info_t *fi);
+
+/*
+  Take the inode of a file, either from fi->user_ptr or read back from the
+  temporary file. Either way, the caller gets ownership of it and
+  fi->user_ptr is set to NULL.
+
+  Prints an error message and returns NULL on failure.
+ */
+sqfs_inode_generic_t *inode_spill_get(inode_spill_t *spill, file_info_t *fi);
 
 void sqfs_writer_cfg_init(sqfs_writer_cfg_t *cfg);
 
+/*
+  The number of CPUs the process may run on, limited by the CPU quota of its
+  cgroup, e.g. in a container. Used as the default number of jobs if the
+  compressor threads are adjusted while packing.
+ */
+size_t os_get_available_jobs(void);
+
+/*
+  Open the output file and set up everything needed for building the tree.
+
+  If the compressor options ask for a zstd dictionary, or the block size is
+  picked by sampling the input, the compressor and data writer are not
+  created yet, sqfs->data is NULL and the caller has to call
+  block_probe_apply, train a dictionary and call sqfs_writer_init_data
+  before packing any data, as needed. Otherwise that is done here as well.
+ */
 int sqfs_writer_init(sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *wrcfg);
 
+/*
+  Create the compressor and data writer and write the super block and
+  compressor options. If no dictionary is given, none is used even if the
+  compressor options asked for one.
+ */
+int sqfs_writer_init_data(sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *wrcfg,
+			  const void *dict, size_t dict_size);
+
 int sqfs_writer_finish(sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *cfg);
 
+/*
+  The steps of sqfs_writer_finish before and after the inode and directory
+  tables are written, for tools that write those without an fstree. The
+  first one waits for the data writer and creates the export table, if
+  requested, the second one writes the remaining tables and the super block.
+  The inode count in the super block has to be set before. Both print an
+  error message and return -1 on failure.
+ */
+int sqfs_writer_finish_data(sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *cfg);
+
+int sqfs_writer_finish_tables(sqfs_writer_t *sqfs,
+			      const sqfs_writer_cfg_t *cfg);
+
 void sqfs_writer_cleanup(sqfs_writer_t *sqfs);
 
 void sqfs_perror(const char *file, const char *action, int error_code);
@@ -0,0 +1,174 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * fstream.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef FSTREAM_H
+#define FSTREAM_H
+
+#include "config.h"
+#include "sqfs/predef.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* size of the buffer of an input stream */
+#define ISTREAM_BUFFER_SIZE (1024 * 1024)
+
+/* size of the buffer of an output stream */
+#define OSTREAM_BUFFER_SIZE (128 * 1024)
+
+enum {
+	FSTREAM_COMPRESSOR_GZIP = 1,
+	FSTREAM_COMPRESSOR_XZ = 2,
+	FSTREAM_COMPRESSOR_ZSTD = 3,
+	FSTREAM_COMPRESSOR_BZIP2 = 4,
+};
+
+/*
+  A buffered, sequential input stream. The underlying implementation only
+  has to refill the buffer, reading and skipping is done through the
+  functions below, which print an error message to stderr on failure.
+ */
+typedef struct istream_t {
+	/* the data in the buffer starts at buffer_offset, ends at used */
+	size_t buffer_used;
+	size_t buffer_offset;
+	bool eof;
+
+	sqfs_u8 *buffer;
+
+	/*
+	  Move the remaining data to the start of the buffer and append as
+	  much as possible. Sets eof if nothing more could be read.
+	  Returns 0 on success, prints an error and returns -1 on failure.
+	 */
+	int (*precache)(struct istream_t *strm);
+
+	/*
+	  Optional. Skip past data after the buffer, i.e. the buffer is
+	  known to be empty. Returns 0 on success, > 0 if the data can't
+	  be skipped that way and < 0 on failure.
+	 */
+	int (*seek_forward)(struct istream_t *strm, sqfs_u64 size);
+
+	const char *(*get_filename)(struct istream_t *strm);
+
+	void (*destroy)(struct istream_t *strm);
+} istream_t;
+
+/* Returns NULL on failure and prints an error message to stderr. */
+istream_t *istream_open_file(const char *path);
+
+/* Returns NULL on failure and prints an error message to stderr. */
+istream_t *istream_open_stdin(void);
+
+/*
+  Read up to size bytes. Returns the number of bytes read, which is only
+  less than size at the end of the stream, or -1 on failure.
+ */
+sqfs_s32 istream_read(istream_t *strm, void *data, size_t size);
+
+/* Returns 0 on success, -1 on failure or if the stream ends before. */
+int istream_skip(istream_t *strm, sqfs_u64 size);
+
+/* Refill the buffer, returns 0 on success, -1 on failure. */
+int istream_precache(istream_t *strm);
+
+/*
+  Make sure at least size bytes, at most ISTREAM_BUFFER_SIZE, are available
+  in the buffer starting at buffer_offset. Returns 0 on success, -1 on
+  failure or if the stream ends before.
+ */
+int istream_fill(istream_t *strm, size_t size);
+
+/*
+  Look at the start of a stream without consuming anything. Returns one of
+  the FSTREAM_COMPRESSOR_* values, 0 if the data does not look compressed
+  and -1 on failure.
+ */
+int istream_detect_compressor(istream_t *strm);
+
+/*
+  Create a stream that decompresses the data read from another one, which
+  it takes ownership of. If possible, the decompression runs on a separate
+  thread. Returns NULL on failure and prints an error message to stderr,
+  the wrapped stream is left alone then.
+ */
+istream_t *istream_compressor_create(istream_t *strm, int comp_id);
+
+/*
+  A buffered, sequential output stream. Small pieces of data are gathered
+  in the buffer. Data that doesn't fit is handed to the underlying
+  implementation together with the buffer, instead of copying it first.
+  The functions below print an error message to stderr on failure.
+ */
+typedef struct ostream_t {
+	size_t buffer_used;
+	sqfs_u8 *buffer;
+
+	/*
+	  Consume the data in the buffer, followed by size bytes of data
+	  that didn't fit into it, and empty the buffer. Returns 0 on
+	  success, prints an error and returns -1 on failure.
+	 */
+	int (*write)(struct ostream_t *strm, const void *data, size_t size);
+
+	/*
+	  Optional. Called by ostream_flush after the buffer has been
+	  written, to finish compressed data and flush wrapped streams.
+	  Returns 0 on success, prints an error and returns -1 on failure.
+	 */
+	int (*flush)(struct ostream_t *strm);
+
+	const char *(*get_filename)(struct ostream_t *strm);
+
+	void (*destroy)(struct ostream_t *strm);
+} ostream_t;
+
+/* Returns NULL on failure and prints an error message to stderr. */
+ostream_t *ostream_open_stdout(void);
+
+/*
+  Append data to a stream. The data is either copied or consumed before
+  this returns. Returns 0 on success, -1 on failure.
+ */
+int ostream_append(ostream_t *strm, const void *data, size_t size);
+
+/* Append a number of zero bytes. Returns 0 on success, -1 on failure. */
+int ostream_append_zero(ostream_t *strm, size_t size);
+
+/* Append formatted text. Returns 0 on success, -1 on failure. */
+int ostream_printf(ostream_t *strm, const char *fmt, ...);
+
+/*
+  Write out everything that is buffered. A compressed stream is finished,
+  nothing can be appended to it afterwards. Returns 0 on success, -1 on
+  failure.
+ */
+int ostream_flush(ostream_t *strm);
+
+/*
+  Create a stream that compresses the data appended to it and writes the
+  result to another one, which it takes ownership of. If possible, the
+  compression runs on a separate thread, using up to num_threads threads
+  for compressors that support it. Returns NULL on failure and prints an
+  error message to stderr, the wrapped stream is left alone then.
+ */
+ostream_t *ostream_compressor_create(ostream_t *strm, int comp_id,
+				     unsigned int num_threads);
+
+/* Returns -1 for unknown names. */
+int fstream_compressor_id_from_name(const char *name);
+
+/* Returns true if data can be compressed with a compressor. */
+bool fstream_compressor_can_compress(int id);
+
+/* Returns NULL for unknown IDs. */
+const char *fstream_compressor_name_from_id(int id);
+
+/* Returns true if the library has been built with a compressor. */
+bool fstream_compressor_exists(int id);
+
+#endif /* FSTREAM_H */
@@ -16,6 +16,17 @@
 
 #include "sqfs/predef.h"
 #include "util/compat.h"
+#include "util/str_table.h"
+
+/*
+  Hard links are tree nodes with one of these as mode, neither of which is
+  a valid file type. A link is created with the path of its target, which
+  fstree_resolve_hard_links replaces with a pointer to the target node.
+  Links never get an inode of their own, their directory entries refer to
+  the inode of the target.
+ */
+#define FSTREE_MODE_HARD_LINK (0)
+#define FSTREE_MODE_HARD_LINK_RESOLVED (1)
 
 typedef struct tree_node_t tree_node_t;
 typedef struct file_info_t file_info_t;
@@ -31,6 +42,24 @@ struct file_info_t {
 	char *input_file;
 
 	void *user_ptr;
+
+	/*
+	  E_SQFS_BLK_FLAGS to pack the data with, set by the attributes of
+	  the entry or the layout rules of a pack file, see fstree_from_file.
+	 */
+	sqfs_u32 flags;
+
+	/* Files with a higher priority are packed first, see above. */
+	int priority;
+
+	/*
+	  Set if other files are linked to this one in the data writer, so
+	  its inode must stay in memory, see inode_spill_add.
+	 */
+	bool linked;
+
+	/* Location of the inode in the spill file, see inode_spill_add. */
+	sqfs_u64 spill_offset;
 };
 
 /* Additional meta data stored in a tree_node_t for directories */
@@ -40,6 +69,16 @@ struct dir_info_t {
 
 	/* Set to true for implicitly generated directories.  */
 	bool created_implicitly;
+
+	/* Set if the children are in the hash index of the tree. */
+	bool indexed;
+
+	/*
+	  Cleared as long as the children were added in ascending order of
+	  their names, i.e. the list is in descending order, the way sorted
+	  input such as a tarball created with --sort=name arrives.
+	 */
+	bool out_of_order;
 };
 
 /* A node in a file system tree */
@@ -50,7 +89,10 @@ struct tree_node_t {
 	/* Root node has this set to NULL. */
 	tree_node_t *parent;
 
-	/* For the root node, this points to an empty string. */
+	/*
+	  For the root node, this points to an empty string. Shared with other
+	  nodes if the tree interns strings, so it must not be modified.
+	 */
 	char *name;
 
 	sqfs_u32 xattr_idx;
@@ -59,7 +101,12 @@ struct tree_node_t {
 	sqfs_u32 inode_num;
 	sqfs_u32 mod_time;
 	sqfs_u16 mode;
-	sqfs_u16 pad0;
+
+	/* Length of the name, which is at most 65535 bytes. */
+	sqfs_u16 name_len;
+
+	/* Number of hard links to this node, besides the node itself. */
+	sqfs_u32 link_count;
 
 	/* SquashFS inode refernce number. 32 bit offset of the meta data
 	   block start (relative to inode table start), shifted left by 16
@@ -74,11 +121,23 @@ struct tree_node_t {
 		file_info_t file;
 		char *slink_target;
 		sqfs_u64 devno;
+
+		/* hard links, before and after fstree_resolve_hard_links */
+		char *link_path;
+		tree_node_t *target;
 	} data;
 
 	sqfs_u8 payload[];
 };
 
+/* A block of memory that tree nodes are allocated from */
+typedef struct fstree_chunk_t {
+	struct fstree_chunk_t *next;
+	size_t used;
+	size_t size;
+	sqfs_u64 data[];
+} fstree_chunk_t;
+
 /* Encapsulates a file system tree */
 struct fstree_t {
 	struct stat defaults;
@@ -92,6 +151,30 @@ struct fstree_t {
 
 	/* linear linked list of all regular files */
 	file_info_t *files;
+
+	/* memory owned by the tree, the first chunk is the one being filled */
+	fstree_chunk_t *chunks;
+
+	/* hash index of the children of large directories */
+	tree_node_t **child_index;
+	size_t child_index_size;
+	size_t child_index_used;
+
+	/*
+	  path and node of the directory the last node was added to by path,
+	  so the next one with the same parent doesn't need to resolve it
+	 */
+	char *last_dir;
+	size_t last_dir_len;
+	size_t last_dir_max;
+	tree_node_t *last_parent;
+
+	/* set by fstree_resolve_hard_links if the tree contains any */
+	bool has_hard_links;
+
+	/* distinct names and symlink targets, if enabled */
+	bool intern_strings;
+	str_table_t strings;
 };
 
 /*
@@ -108,6 +191,17 @@ int fstree_init(fstree_t *fs, char *defaults);
 
 void fstree_cleanup(fstree_t *fs);
 
+/*
+  Store the names and symlink targets of nodes created from here on in a
+  string table, so that each distinct string is kept in memory only once
+  and shared by all nodes that use it. This pays off for trees with a lot
+  of repeated names or symlink targets, but costs a little more memory per
+  distinct string otherwise.
+
+  Returns 0 on success. Prints to stderr on failure.
+*/
+int fstree_intern_strings(fstree_t *fs);
+
 /*
   Create a tree node from a struct stat, node name and extra data.
 
@@ -118,11 +212,13 @@ void fstree_cleanup(fstree_t *fs);
   This function does not print anything to stderr, instead it sets an
   appropriate errno value.
 
-  The resulting node can be freed with a single free() call.
+  The node is allocated from memory owned by the tree and released by
+  fstree_cleanup. If fs is NULL, the resulting node can be freed with a
+  single free() call instead.
 */
-tree_node_t *fstree_mknode(tree_node_t *parent, const char *name,
-			   size_t name_len, const char *extra,
-			   const struct stat *sb);
+tree_node_t *fstree_mknode(fstree_t *fs, tree_node_t *parent,
+			   const char *name, size_t name_len,
+			   const char *extra, const struct stat *sb);
 
 /*
   Add a node to an fstree at a specific path.
@@ -142,6 +238,40 @@ tree_node_t *fstree_mknode(tree_node_t *parent, const char *name,
 tree_node_t *fstree_add_generic(fstree_t *fs, const char *path,
 				const struct stat *sb, const char *extra);
 
+/*
+  Add a hard link at a path, to the node at the path target. The target
+  does not have to exist yet, it is looked up when the links are resolved.
+  The paths are relative to the root, without a leading slash.
+
+  This function does not print anything to stderr, instead it sets an
+  appropriate errno value.
+ */
+tree_node_t *fstree_add_hard_link(fstree_t *fs, const char *path,
+				  const char *target);
+
+/*
+  Get the node at a path relative to the root. Leading and duplicate
+  slashes are skipped. Returns NULL if there is no such node.
+ */
+tree_node_t *fstree_get_node_by_path(fstree_t *fs, const char *path);
+
+/*
+  Unlink a node, along with everything below it, from the tree. The nodes
+  stay in the memory owned by the tree, but can no longer be found by name
+  and are left out of everything generated from the tree afterwards.
+  Removing the root node does nothing.
+ */
+void fstree_remove_node(fstree_t *fs, tree_node_t *n);
+
+/*
+  Replace the target paths of all hard links in the tree with pointers to
+  the target nodes and count the links of the targets. A link to a link
+  refers to the same target. The target of a link must not be a directory.
+
+  Returns 0 on success. Prints to stderr on failure.
+ */
+int fstree_resolve_hard_links(fstree_t *fs);
+
 /*
   Parses the file format accepted by gensquashfs and produce a file system
   tree from it. File input paths are interpreted as relative to the current
@@ -150,6 +280,18 @@ tree_node_t *fstree_add_generic(fstree_t *fs, const char *path,
   Data is read from the given file pointer. The filename is only used for
   producing error messages.
 
+  A file entry can have a list of attributes in square brackets right after
+  the gid, e.g. "file /a 0644 0 0 [nocompress,priority=10] input/a". The
+  attributes set the E_SQFS_BLK_FLAGS and the priority in the file_info_t:
+  "nofrag", "align", "nocompress", "nodedup", "random" for the first three
+  and "priority=<n>".
+
+  Besides entries, the file can contain layout rules of the form
+  "layout <pattern> <attr>[,<attr>...]". Once the whole file has been read,
+  the attributes are applied to the regular files whose path in the tree
+  matches the shell wildcard pattern. Flags are combined with those already
+  set, a priority replaces the one already set.
+
   On failure, an error report with filename and line number is written
   to stderr.
 
@@ -160,8 +302,40 @@ int fstree_from_file(fstree_t *fs, const char *filename, FILE *fp);
 /* Returns 0 on success. Prints to stderr on failure */
 int fstree_gen_inode_table(fstree_t *fs);
 
+/*
+  Sort the tree recursively and generate the inode table, with the work
+  split across up to num_threads threads if pthread support is available.
+  The result is the same as for tree_node_sort_recursive followed by
+  fstree_gen_inode_table.
+
+  Returns 0 on success. Prints to stderr on failure.
+ */
+int fstree_sort_gen_inode_table(fstree_t *fs, unsigned int num_threads);
+
 void fstree_gen_file_list(fstree_t *fs);
 
+/*
+  Move the regular files listed in a priority file to the front of the file
+  list, in the order they are listed, so their data is packed first. The
+  file contains one path in the tree per line, e.g. recorded from the files
+  accessed during boot. Empty lines and lines starting with '#' are skipped,
+  as are paths that are not regular files in the tree. The other files keep
+  their order.
+
+  This uses the user_ptr of the files, so it has to be called before they
+  are packed. The filename is only used for producing error messages.
+
+  Returns 0 on success, prints to stderr on failure.
+ */
+int fstree_prioritize_files(fstree_t *fs, const char *filename, FILE *fp);
+
+/*
+  Stable sort the file list by descending priority of the files, so files
+  with the same priority keep the order from fstree_prioritize_files or
+  from ordering them by physical location.
+ */
+void fstree_sort_files_by_priority(fstree_t *fs);
+
 /*
   Generate a string holding the full path of a node. Returned
   string must be freed.
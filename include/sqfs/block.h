@@ -89,6 +89,15 @@ typedef enum {
 	 */
 	SQFS_BLK_DONT_FRAGMENT = 0x0004,
 
+	/**
+	 * @brief Never replace the data of a file with existing data.
+	 *
+	 * If set, the @ref sqfs_data_writer_t always stores the blocks and
+	 * the tail end of the affected file, even if identical data has
+	 * already been written. Files written later can still refer to it.
+	 */
+	SQFS_BLK_DONT_DEDUPLICATE = 0x0008,
+
 	/**
 	 * @brief Set by the @ref sqfs_data_writer_t on the first
 	 *        block of a file.
@@ -122,7 +131,7 @@ typedef enum {
 	/**
 	 * @brief The combination of all flags that are user settable.
 	 */
-	SQFS_BLK_USER_SETTABLE_FLAGS = 0x0007,
+	SQFS_BLK_USER_SETTABLE_FLAGS = 0x000F,
 } E_SQFS_BLK_FLAGS;
 
 /**
@@ -171,6 +180,36 @@ struct sqfs_block_t {
 	 */
 	sqfs_u32 flags;
 
+	/**
+	 * @brief Compressor to use for the block.
+	 *
+	 * An ID returned by @ref sqfs_data_writer_add_compressor, or 0 for
+	 * the compressor the data writer was created with. Set by the data
+	 * writer from @ref sqfs_data_writer_set_compressor.
+	 */
+	sqfs_u32 cmp_id;
+
+	/**
+	 * @brief Set by the data writer to the @ref sqfs_compressor_t::method
+	 *        used for compressing the block, or 0 if none was reported.
+	 */
+	sqfs_u32 cmp_method;
+
+	/**
+	 * @brief Set by the data writer to the value returned by
+	 *        @ref sqfs_compressor_t::probe_file for the first block
+	 *        of the file, or 0.
+	 */
+	sqfs_u32 cmp_hint;
+
+	/**
+	 * @brief A strong digest of the input data.
+	 *
+	 * Only computed if the @ref sqfs_data_writer_t was created with the
+	 * @ref SQFS_DATA_WRITER_VERIFY_DEDUP flag set, zero otherwise.
+	 */
+	sqfs_u64 digest;
+
 	/**
 	 * @brief Raw data to be processed.
 	 */
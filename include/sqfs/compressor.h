@@ -72,6 +72,13 @@ struct sqfs_compressor_t {
 	/**
 	 * @brief Compress or uncompress a chunk of data.
 	 *
+	 * When compressing, the result is only of use if it is smaller than
+	 * the input. The compressors give up as soon as the output reaches
+	 * the size of the input, instead of compressing the rest of the data
+	 * into a larger output buffer first, except for LZO, which cannot
+	 * stop early and needs an output buffer that is large enough for the
+	 * worst case.
+	 *
 	 * @param cmp A pointer to a compressor object.
 	 * @param in A pointer to the input buffer to read from.
 	 * @param size The number of bytes to read from the input and compress.
@@ -81,7 +88,7 @@ struct sqfs_compressor_t {
 	 * @return The number of bytes written to the buffer, a negative
 	 *         value is an @ref E_SQFS_ERROR value. The value 0 means
 	 *         the output buffer was too small when extracting or that
-	 *         the result is larger than the input when compressing.
+	 *         the result is not smaller than the input when compressing.
 	 */
 	sqfs_s32 (*do_block)(sqfs_compressor_t *cmp, const sqfs_u8 *in,
 			     sqfs_u32 size, sqfs_u8 *out, sqfs_u32 outsize);
@@ -94,6 +101,169 @@ struct sqfs_compressor_t {
 	 * @return A deep copy of the given compressor.
 	 */
 	sqfs_compressor_t *(*create_copy)(sqfs_compressor_t *cmp);
+
+	/**
+	 * @brief The variant picked by the last successful do_block call.
+	 *
+	 * Compressors that try several variants per block and keep the
+	 * smallest result (the gzip strategies or the xz BCJ filters) store
+	 * the @ref SQFS_COMP_FLAG value of the one they used here. It is 0
+	 * for all other compressors, or if the xz backend used no filter.
+	 */
+	sqfs_u32 method;
+
+	/**
+	 * @brief Restricts the variants the next do_block call tries.
+	 *
+	 * An opaque value returned by @ref probe_file for the file the block
+	 * belongs to, or 0 to try all variants.
+	 */
+	sqfs_u32 method_hint;
+
+	/**
+	 * @brief Pick the variants to try for all blocks of a file.
+	 *
+	 * Optional, may be NULL. Called with the first data block of a file,
+	 * before it is compressed. Must not change the state of the
+	 * compressor, as other copies may compress blocks at the same time.
+	 *
+	 * @param cmp A pointer to a compressor object.
+	 * @param data The uncompressed data of the first block.
+	 * @param size The number of bytes in the block.
+	 *
+	 * @return A value for @ref method_hint to use for the blocks of
+	 *         the file.
+	 */
+	sqfs_u32 (*probe_file)(sqfs_compressor_t *cmp, const sqfs_u8 *data,
+			       sqfs_u32 size);
+
+	/**
+	 * @brief Get the extra space needed to uncompress in place.
+	 *
+	 * Optional, may be NULL if the compressor cannot do that. If set,
+	 * do_block can uncompress a block into the same buffer that holds
+	 * the compressed data. The compressed data must be stored at the
+	 * very end of the buffer. The buffer must be at least the returned
+	 * number of bytes larger than the uncompressed data.
+	 *
+	 * @param cmp A pointer to a compressor object.
+	 * @param size The maximum size of the uncompressed data.
+	 *
+	 * @return The number of extra bytes needed.
+	 */
+	sqfs_u32 (*inplace_margin)(sqfs_compressor_t *cmp, sqfs_u32 size);
+
+	/**
+	 * @brief Compress or extract several independent blocks in one go.
+	 *
+	 * Optional, may be NULL. Backends that can set up a whole batch at
+	 * once, e.g. to submit it to a hardware offload engine, implement
+	 * this. Each job is processed as if by a call to do_block with the
+	 * job's method hint, and its result and method are stored in the
+	 * job. Use @ref sqfs_compressor_do_blocks, which falls back to
+	 * do_block if this is not set.
+	 *
+	 * @param cmp A pointer to a compressor object.
+	 * @param jobs An array of jobs.
+	 * @param count The number of jobs in the array.
+	 *
+	 * @return Zero if the results of all jobs have been set, even if
+	 *         some of them are negative, an @ref E_SQFS_ERROR value if
+	 *         the batch as a whole failed.
+	 */
+	int (*do_blocks)(sqfs_compressor_t *cmp, sqfs_compressor_job_t *jobs,
+			 size_t count);
+};
+
+/**
+ * @struct sqfs_compressor_job_t
+ *
+ * @brief One block of a batch for @ref sqfs_compressor_t::do_blocks.
+ */
+struct sqfs_compressor_job_t {
+	/**
+	 * @brief The data to compress or extract.
+	 */
+	const sqfs_u8 *in;
+
+	/**
+	 * @brief The output buffer, which must not overlap the input.
+	 */
+	sqfs_u8 *out;
+
+	/**
+	 * @brief The number of bytes in the input buffer.
+	 */
+	sqfs_u32 size;
+
+	/**
+	 * @brief The number of bytes available in the output buffer.
+	 */
+	sqfs_u32 outsize;
+
+	/**
+	 * @brief The @ref sqfs_compressor_t::method_hint for this block.
+	 */
+	sqfs_u32 method_hint;
+
+	/**
+	 * @brief Returns the @ref sqfs_compressor_t::method used for this
+	 *        block.
+	 */
+	sqfs_u32 method;
+
+	/**
+	 * @brief Returns what do_block would have returned for this block.
+	 */
+	sqfs_s32 result;
+};
+
+/**
+ * @struct sqfs_allocator_t
+ *
+ * @brief Memory allocation hooks, e.g. for an arena or a memory cap.
+ *
+ * Compressor backends that need large work buffers (currently xz and lzma)
+ * keep freed buffers in a small, per compressor pool and hand them out again
+ * for the next block, instead of going back to the system allocator for
+ * every block. If an allocator is set in the @ref sqfs_compressor_config_t,
+ * the pool gets its memory from the hooks instead of malloc.
+ *
+ * Copies of a compressor created through the create_copy callback share the
+ * same allocator, so the hooks must be thread safe if the copies are used
+ * from different threads.
+ *
+ * The same hooks can be installed for the block buffers of a data writer
+ * (@ref sqfs_data_writer_set_allocator), the blocks a meta data writer keeps
+ * in memory (@ref sqfs_meta_writer_set_allocator) and the inodes and
+ * directory entries handed out by meta data and directory readers
+ * (@ref sqfs_meta_reader_set_allocator, @ref sqfs_dir_reader_set_allocator).
+ * Bookkeeping that is allocated once when an object is created still uses
+ * the standard library.
+ */
+struct sqfs_allocator_t {
+	/**
+	 * @brief Allocate a chunk of memory.
+	 *
+	 * @param user The user pointer from this structure.
+	 * @param size The number of bytes to allocate.
+	 *
+	 * @return A pointer to the memory or NULL on failure.
+	 */
+	void *(*alloc)(void *user, size_t size);
+
+	/**
+	 * @brief Release memory previously allocated through alloc.
+	 *
+	 * @param user The user pointer from this structure.
+	 * @param ptr A pointer returned by alloc.
+	 */
+	void (*free)(void *user, void *ptr);
+
+	/**
+	 * @brief Passed to the callbacks as first argument.
+	 */
+	void *user;
 };
 
 /**
@@ -144,7 +314,7 @@ struct sqfs_compressor_config_t {
 			 */
 			sqfs_u16 window_size;
 
-			sqfs_u32 padd0[3];
+			sqfs_u32 padd0[5];
 		} gzip;
 
 		/**
@@ -158,7 +328,45 @@ struct sqfs_compressor_config_t {
 			 */
 			sqfs_u16 level;
 
-			sqfs_u16 padd0[7];
+			/**
+			 * @brief Base 2 logarithm of the match window size.
+			 *
+			 * Only affects the compressor. Since every block is a
+			 * single frame, a window larger than the block size
+			 * makes no difference. 0 lets zstd derive it from the
+			 * level and block size.
+			 */
+			sqfs_u16 window_log;
+
+			/**
+			 * @brief Size of the dictionary in bytes.
+			 *
+			 * Only used if @ref SQFS_COMP_FLAG_ZSTD_DICT is set.
+			 * Value between 1 and @ref SQFS_ZSTD_MAX_DICT_SIZE.
+			 */
+			sqfs_u32 dict_size;
+
+			/**
+			 * @brief A dictionary to use for all blocks.
+			 *
+			 * Only used if @ref SQFS_COMP_FLAG_ZSTD_DICT is set.
+			 * The compressor makes its own copy of it. See
+			 * @ref sqfs_compressor_train_dict for creating one.
+			 */
+			const void *dict;
+
+			/**
+			 * @brief Match length at which the match finder stops
+			 *        looking for a better one.
+			 *
+			 * Only affects the compressor. For the fast strategies
+			 * of the lower levels, this instead trades ratio for
+			 * speed as it gets larger. 0 lets zstd derive it from
+			 * the level.
+			 */
+			sqfs_u32 target_length;
+
+			sqfs_u32 padd0;
 		} zstd;
 
 		/**
@@ -184,7 +392,7 @@ struct sqfs_compressor_config_t {
 			 */
 			sqfs_u16 level;
 
-			sqfs_u32 padd0[3];
+			sqfs_u32 padd0[5];
 		} lzo;
 
 		/**
@@ -202,11 +410,57 @@ struct sqfs_compressor_config_t {
 			 */
 			sqfs_u32 dict_size;
 
-			sqfs_u32 padd0[3];
+			/**
+			 * @brief Compression preset, like the level of the xz
+			 *        command line tool. Value between 1 and 9.
+			 *
+			 * Only affects the compressor. 0 selects the
+			 * default, 6.
+			 */
+			sqfs_u16 level;
+
+			/**
+			 * @brief Match length at which the match finder stops
+			 *        looking for a better one.
+			 *
+			 * Value between 2 and 273. Only affects the compressor.
+			 * Smaller values are faster. 0 uses the value of the
+			 * preset.
+			 */
+			sqfs_u16 nice_len;
+
+			sqfs_u32 padd0[4];
 		} xz;
 
-		sqfs_u64 padd0[2];
+		/**
+		 * @brief Options for the lz4 compressor.
+		 */
+		struct {
+			/**
+			 * @brief Compression level of the high compression
+			 *        mode. Value between 3 and 12.
+			 *
+			 * Only used if @ref SQFS_COMP_FLAG_LZ4_HC is set and
+			 * only affects the compressor. 0 selects the default,
+			 * 12.
+			 */
+			sqfs_u16 level;
+
+			sqfs_u16 padd0;
+
+			sqfs_u32 padd1[5];
+		} lz4;
+
+		sqfs_u64 padd0[3];
 	} opt;
+
+	/**
+	 * @brief Optional allocator for the internal buffers.
+	 *
+	 * If set to NULL, the standard library allocator is used. The
+	 * allocator must outlive the compressor and all of its copies.
+	 */
+	const sqfs_allocator_t *allocator;
 };
 
 /**
@@ -252,6 +506,40 @@ typedef enum {
 	SQFS_COMP_FLAG_XZ_SPARC = 0x0020,
 	SQFS_COMP_FLAG_XZ_ALL = 0x003F,
 
+	/**
+	 * @brief For LZMA, instead of trying all selected BCJ filters on
+	 *        every block, pick the filter for all blocks of a file from
+	 *        the ELF header at its start.
+	 *
+	 * Files that are not ELF executables, or are built for an
+	 * architecture without a selected filter, are compressed without a
+	 * filter. This requires a data writer that calls
+	 * @ref sqfs_compressor_t::probe_file. The flag is not stored in the
+	 * on-disk options.
+	 */
+	SQFS_COMP_FLAG_XZ_DETECT = 0x0100,
+
+	/**
+	 * @brief For zstd, set this to compress all blocks using the
+	 *        dictionary from the options.
+	 *
+	 * The dictionary is stored in the compressor options on disk and
+	 * picked up by @ref sqfs_compressor_t::read_options when reading an
+	 * image. This is an extension to the SquashFS format. Other
+	 * implementations, including the Linux kernel, cannot read images
+	 * created with this flag.
+	 */
+	SQFS_COMP_FLAG_ZSTD_DICT = 0x0001,
+	SQFS_COMP_FLAG_ZSTD_ALL = 0x0001,
+
+	/**
+	 * @brief For zstd, set this to enable long distance matching.
+	 *
+	 * Only affects the compressor and is not stored in the on-disk
+	 * options.
+	 */
+	SQFS_COMP_FLAG_ZSTD_LDM = 0x0100,
+
 	/**
 	 * @brief For zlib deflate, set this to try the default strategy.
 	 */
@@ -278,6 +566,16 @@ typedef enum {
 	SQFS_COMP_FLAG_GZIP_FIXED = 0x0010,
 	SQFS_COMP_FLAG_GZIP_ALL = 0x001F,
 
+	/**
+	 * @brief For zlib deflate, if several strategies are enabled, only
+	 *        compress a sample from the start of each block with every
+	 *        strategy and use the best one for the whole block.
+	 *
+	 * This trades a little compression for far less time spent in the
+	 * search. The flag is not stored in the on-disk options.
+	 */
+	SQFS_COMP_FLAG_GZIP_SAMPLE = 0x0100,
+
 	/**
 	 * @brief Set this if the compressor should actually extract
 	 *        instead of compress data.
@@ -307,6 +605,10 @@ typedef enum {
 
 #define SQFS_ZSTD_DEFAULT_LEVEL (15)
 
+#define SQFS_XZ_DEFAULT_LEVEL (6)
+
+#define SQFS_LZ4_DEFAULT_LEVEL (12)
+
 #define SQFS_GZIP_MIN_LEVEL (1)
 #define SQFS_GZIP_MAX_LEVEL (9)
 
@@ -316,6 +618,18 @@ typedef enum {
 #define SQFS_ZSTD_MIN_LEVEL (1)
 #define SQFS_ZSTD_MAX_LEVEL (22)
 
+#define SQFS_XZ_MIN_LEVEL (1)
+#define SQFS_XZ_MAX_LEVEL (9)
+
+#define SQFS_XZ_MIN_NICE_LEN (2)
+#define SQFS_XZ_MAX_NICE_LEN (273)
+
+#define SQFS_LZ4_MIN_LEVEL (3)
+#define SQFS_LZ4_MAX_LEVEL (12)
+
+/* level and dictionary size, followed by the dictionary in one meta block */
+#define SQFS_ZSTD_MAX_DICT_SIZE (8184)
+
 #define SQFS_GZIP_MIN_WINDOW (8)
 #define SQFS_GZIP_MAX_WINDOW (15)
 
@@ -362,6 +676,25 @@ SQFS_API bool sqfs_compressor_exists(E_SQFS_COMPRESSOR id);
 SQFS_API
 sqfs_compressor_t *sqfs_compressor_create(const sqfs_compressor_config_t *cfg);
 
+/**
+ * @brief Compress or extract a batch of independent blocks.
+ *
+ * Hands the whole batch to the do_blocks callback of the compressor if it
+ * has one, otherwise the jobs are processed one after another through
+ * do_block. Afterwards, the method and method_hint of the compressor
+ * object itself are unspecified.
+ *
+ * @param cmp A pointer to a compressor object.
+ * @param jobs An array of jobs.
+ * @param count The number of jobs in the array.
+ *
+ * @return Zero if the results of all jobs have been set, an
+ *         @ref E_SQFS_ERROR value if the batch as a whole failed.
+ */
+SQFS_API int sqfs_compressor_do_blocks(sqfs_compressor_t *cmp,
+				       sqfs_compressor_job_t *jobs,
+				       size_t count);
+
 /**
  * @brief Get the name of a compressor backend from its ID.
  *
@@ -391,6 +724,34 @@ SQFS_API const char *sqfs_compressor_name_from_id(E_SQFS_COMPRESSOR id);
 SQFS_API
 int sqfs_compressor_id_from_name(const char *name, E_SQFS_COMPRESSOR *out);
 
+/**
+ * @brief Create a dictionary from sample data.
+ *
+ * The result can be passed to a compressor through its configuration, to
+ * improve the compression ratio of small blocks, such as fragment blocks
+ * and meta data blocks, that contain data similar to the samples. Currently
+ * only zstd supports this.
+ *
+ * @param id An @ref E_SQFS_COMPRESSOR identifier.
+ * @param samples A pointer to all samples, concatenated.
+ * @param sample_sizes An array holding the size of each sample.
+ * @param num_samples The number of samples.
+ * @param dict A pointer to a buffer to write the dictionary to.
+ * @param dict_size On entry, the size of the dictionary buffer. Returns the
+ *                  actual size of the dictionary.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure. If the
+ *         compressor does not support dictionaries,
+ *         @ref SQFS_ERROR_UNSUPPORTED is returned. If no dictionary could
+ *         be created from the samples, e.g. because they are too few or
+ *         too similar, @ref SQFS_ERROR_COMPRESSOR is returned.
+ */
+SQFS_API int sqfs_compressor_train_dict(E_SQFS_COMPRESSOR id,
+					const void *samples,
+					const size_t *sample_sizes,
+					size_t num_samples,
+					void *dict, size_t *dict_size);
+
 #ifdef __cplusplus
 }
 #endif
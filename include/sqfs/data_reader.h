@@ -47,6 +47,53 @@
  * reading file data through an inode description and a location in the file.
  */
 
+/**
+ * @struct sqfs_data_request_t
+ *
+ * @brief A range of a file to read with @ref sqfs_data_reader_read_batch.
+ */
+struct sqfs_data_request_t {
+	/**
+	 * @brief The inode of the file to read from.
+	 */
+	const sqfs_inode_generic_t *inode;
+
+	/**
+	 * @brief Byte offset into the uncompressed file.
+	 */
+	sqfs_u64 offset;
+
+	/**
+	 * @brief Number of bytes to read, cut off at the end of the file.
+	 *
+	 * Set this to ~0 to read everything after the offset.
+	 */
+	sqfs_u64 size;
+
+	/**
+	 * @brief Not used by the data reader, free to use by the caller.
+	 */
+	void *user;
+};
+
+/**
+ * @brief Receives the data of a request from
+ *        @ref sqfs_data_reader_read_batch.
+ *
+ * @param user The user pointer passed to @ref sqfs_data_reader_read_batch.
+ * @param req The request that the data belongs to.
+ * @param offset The byte offset of the data in the file.
+ * @param data A pointer to the uncompressed data, which is only valid
+ *             until the callback returns.
+ * @param size The number of bytes of data.
+ *
+ * @return Zero to go on, anything else to stop the batch and have
+ *         @ref sqfs_data_reader_read_batch return that value.
+ */
+typedef int (*sqfs_data_batch_cb_t)(void *user, const sqfs_data_request_t *req,
+				    sqfs_u64 offset, const void *data,
+				    size_t size);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -60,13 +107,55 @@ extern "C" {
  *             underlying filesystem image.
  * @param block_size The data block size from the super block.
  * @param cmp A compressor to use for uncompressing blocks read from disk.
+ * @param cache_size The maximum number of bytes used for caching
+ *                   uncompressed data blocks. The blocks are kept by
+ *                   on-disk location and the least recently used one is
+ *                   thrown out if the limit is reached. At least two
+ *                   blocks are always cached, so 0 can be used to only keep
+ *                   the most recently used ones around. A small number of
+ *                   fragment blocks is cached separately on top of that.
  *
  * @return A pointer to a new data reader object. NULL means
  *         allocation failure.
  */
 SQFS_API sqfs_data_reader_t *sqfs_data_reader_create(sqfs_file_t *file,
 						     size_t block_size,
-						     sqfs_compressor_t *cmp);
+						     sqfs_compressor_t *cmp,
+						     size_t cache_size);
+
+/**
+ * @brief Create another data reader that shares the block cache and
+ *        fragment table with an existing one.
+ *
+ * @memberof sqfs_data_reader_t
+ *
+ * A data reader object itself must only be used by one thread at a time.
+ * To read from the same image on several threads, create a copy for each
+ * thread. Each copy has its own compressor, created through the
+ * create_copy function of the original one, and its own scratch buffers,
+ * but they all share the cache of uncompressed blocks. The cache is split
+ * into several independently locked parts, so the threads don't have to
+ * wait for each other on every access.
+ *
+ * The underlying file is shared as well, so its read_at function must be
+ * safe to call from several threads at once. The fragment table should be
+ * loaded before making copies, since loading it replaces the table for all
+ * of them.
+ *
+ * The pointers returned by @ref sqfs_data_reader_peek_block and
+ * @ref sqfs_data_reader_peek_fragment stay valid until the next call on the
+ * same reader, even if another copy throws the block out of the cache.
+ *
+ * The original and the copies can be destroyed in any order. Read ahead
+ * settings are not copied.
+ *
+ * @param data A pointer to a data reader object.
+ *
+ * @return A pointer to a new data reader object. NULL means
+ *         allocation failure.
+ */
+SQFS_API
+sqfs_data_reader_t *sqfs_data_reader_create_copy(sqfs_data_reader_t *data);
 
 /**
  * @brief Destroy a data reader instance and free all memory used by it.
@@ -77,6 +166,88 @@ SQFS_API sqfs_data_reader_t *sqfs_data_reader_create(sqfs_file_t *file,
  */
 SQFS_API void sqfs_data_reader_destroy(sqfs_data_reader_t *data);
 
+/**
+ * @brief Decompress data blocks ahead of time when a file is read
+ *        sequentially.
+ *
+ * @memberof sqfs_data_reader_t
+ *
+ * If a file is accessed block by block from the start, either through
+ * @ref sqfs_data_reader_read or @ref sqfs_data_reader_peek_block, the
+ * compressed data of the following blocks is read in and handed to a pool of
+ * worker threads for decompression. The blocks are consumed in order. The
+ * file interface is only ever accessed from the calling thread.
+ *
+ * The worker count is also used by @ref sqfs_data_reader_load_fragment_table
+ * for uncompressing the fragment table, so this should be called before it.
+ *
+ * If libsquashfs was compiled without thread support, this does nothing.
+ * Calling it again replaces the previous settings.
+ *
+ * @param data A pointer to a data reader object.
+ * @param num_workers The number of worker threads to use. Zero disables
+ *                    reading ahead.
+ * @param num_blocks The maximum number of blocks to read ahead. Each of
+ *                   them uses two block sized buffers.
+ *
+ * @return Zero on succcess, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_reader_set_readahead(sqfs_data_reader_t *data,
+					    unsigned int num_workers,
+					    size_t num_blocks);
+
+/**
+ * @brief Back the block cache and read ahead buffers with huge pages.
+ *
+ * @memberof sqfs_data_reader_t
+ *
+ * Block sized buffers kept by the data reader, i.e. the cached blocks, the
+ * buffers used for reading ahead and the scratch buffers that compressed
+ * data is read into, are carved out of 2 MiB aligned chunks. On Linux,
+ * explicit huge pages are used if the system has some reserved, transparent
+ * huge pages are requested otherwise. This reduces TLB misses with large
+ * block sizes. Blocks returned by @ref sqfs_data_reader_get_block and
+ * @ref sqfs_data_reader_get_fragment are not affected. The chunks are shared
+ * with copies made afterwards and are kept until the last of them is
+ * destroyed.
+ *
+ * This must be called before @ref sqfs_data_reader_set_readahead and
+ * before creating copies of the data reader. Calling it again does
+ * nothing.
+ *
+ * @param data A pointer to a data reader object.
+ *
+ * @return Zero on succcess, @ref SQFS_ERROR_UNSUPPORTED if read ahead is
+ *         enabled or copies exist, an other @ref E_SQFS_ERROR value on
+ *         failure.
+ */
+SQFS_API int sqfs_data_reader_use_huge_pages(sqfs_data_reader_t *data);
+
+/**
+ * @brief Announce a file that is going to be read next.
+ *
+ * @memberof sqfs_data_reader_t
+ *
+ * If read ahead is enabled, this extends it past the end of the file
+ * currently being read. Once a queued file is accessed, decompression of its
+ * blocks, its fragment block and the blocks of the files queued after it is
+ * started on the worker threads, so a sequence of small files is read ahead
+ * as well. Files are expected to be read in the order they are queued, each
+ * of them from the start. Queued files that are not read are skipped.
+ *
+ * The inode must stay valid until the file has been read, or until a file
+ * that was not queued is accessed, which drops the queue.
+ *
+ * If read ahead is disabled, this does nothing.
+ *
+ * @param data A pointer to a data reader object.
+ * @param inode A pointer to the inode of a regular file.
+ *
+ * @return Zero on succcess, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_reader_queue_file(sqfs_data_reader_t *data,
+					 const sqfs_inode_generic_t *inode);
+
 /**
  * @brief Read and decode the fragment table from disk.
  *
@@ -90,6 +261,48 @@ SQFS_API void sqfs_data_reader_destroy(sqfs_data_reader_t *data);
 SQFS_API int sqfs_data_reader_load_fragment_table(sqfs_data_reader_t *data,
 						  const sqfs_super_t *super);
 
+/**
+ * @brief Prepare reading the fragment table from disk on demand.
+ *
+ * @memberof sqfs_data_reader_t
+ *
+ * This is an alternative to @ref sqfs_data_reader_load_fragment_table that
+ * only reads the list of meta data block locations. A block of the table is
+ * read and uncompressed the first time a fragment described in it is
+ * accessed, which makes opening an image cheaper if only a few files are
+ * ever read from it.
+ *
+ * The table is shared with copies of the reader, which load the blocks
+ * using their own compressor.
+ *
+ * @param data A pointer to a data reader object.
+ * @param super A pointer to the super block.
+ *
+ * @return Zero on succcess, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API
+int sqfs_data_reader_load_fragment_table_lazy(sqfs_data_reader_t *data,
+					      const sqfs_super_t *super);
+
+/**
+ * @brief Get the fragment table entry of a fragment block.
+ *
+ * @memberof sqfs_data_reader_t
+ *
+ * This resolves the on-disk location and size of a fragment block, e.g. to
+ * access the raw, compressed data. The fragment index of a file can be
+ * obtained with @ref sqfs_inode_get_frag_location.
+ *
+ * @param data A pointer to a data reader object.
+ * @param index The index into the fragment table.
+ * @param out Returns the fragment table entry, in host byte order.
+ *
+ * @return Zero on succcess, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_reader_get_fragment_entry(sqfs_data_reader_t *data,
+						 sqfs_u32 index,
+						 sqfs_fragment_t *out);
+
 /**
  * @brief Get the tail end of a file.
  *
@@ -121,6 +334,49 @@ SQFS_API int sqfs_data_reader_get_block(sqfs_data_reader_t *data,
 					const sqfs_inode_generic_t *inode,
 					size_t index, sqfs_block_t **out);
 
+/**
+ * @brief Get a read-only view of a data block of a file by block index.
+ *
+ * @memberof sqfs_data_reader_t
+ *
+ * Unlike @ref sqfs_data_reader_get_block, this does not allocate and copy
+ * the block. The returned pointer refers to a buffer inside the data reader
+ * and is only valid until the next call into the data reader.
+ *
+ * @param data A pointer to a data reader object.
+ * @param inode A pointer to the inode describing the file.
+ * @param index The block index in the inodes block list.
+ * @param out Returns a pointer to the uncompressed data.
+ * @param size Returns the number of bytes in the block.
+ *
+ * @return Zero on succcess, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_reader_peek_block(sqfs_data_reader_t *data,
+					 const sqfs_inode_generic_t *inode,
+					 size_t index, const void **out,
+					 size_t *size);
+
+/**
+ * @brief Get a read-only view of the tail end of a file.
+ *
+ * @memberof sqfs_data_reader_t
+ *
+ * Unlike @ref sqfs_data_reader_get_fragment, this does not allocate and copy
+ * the tail end. The returned pointer refers to the cached fragment block
+ * and is only valid until the next call into the data reader.
+ *
+ * @param data A pointer to a data reader object.
+ * @param inode A pointer to the inode describing the file.
+ * @param out Returns a pointer to the tail end of the file, or NULL if the
+ *            file has no tail end.
+ * @param size Returns the size of the tail end.
+ *
+ * @return Zero on succcess, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_reader_peek_fragment(sqfs_data_reader_t *data,
+					    const sqfs_inode_generic_t *inode,
+					    const void **out, size_t *size);
+
 /**
  * @brief A simple UNIX-read-like function to read data from a file.
  *
@@ -145,6 +401,37 @@ SQFS_API sqfs_s32 sqfs_data_reader_read(sqfs_data_reader_t *data,
 					sqfs_u64 offset, void *buffer,
 					sqfs_u32 size);
 
+/**
+ * @brief Read ranges of many files in the order the data is stored in.
+ *
+ * @memberof sqfs_data_reader_t
+ *
+ * The data blocks and fragment blocks of all requests are read in the
+ * order of their on-disk location, so the image is read front to back
+ * instead of seeking back and forth between files. Blocks that several
+ * requests need, e.g. the fragment block that the tail ends of many small
+ * files are in, or the blocks of files with the same content, are only
+ * uncompressed once. The data is handed to the callback one block at a
+ * time, along with its offset in the file. The parts of different requests
+ * are interleaved and the tail end of a file may come before its blocks.
+ *
+ * The fragment table has to be loaded before, if any of the files have
+ * a tail end in a fragment block.
+ *
+ * @param data A pointer to a data reader object.
+ * @param reqs An array of requests.
+ * @param count The number of requests.
+ * @param cb A callback that receives the data.
+ * @param user A pointer passed on to the callback.
+ *
+ * @return Zero on success, a negative @ref E_SQFS_ERROR value on failure
+ *         or the non-zero value returned by the callback.
+ */
+SQFS_API int sqfs_data_reader_read_batch(sqfs_data_reader_t *data,
+					 const sqfs_data_request_t *reqs,
+					 size_t count, sqfs_data_batch_cb_t cb,
+					 void *user);
+
 #ifdef __cplusplus
 }
 #endif
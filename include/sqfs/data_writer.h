@@ -42,6 +42,15 @@
  * and finally writing it to disk.
  */
 
+/**
+ * @struct sqfs_data_stream_t
+ *
+ * @brief A file of a @ref sqfs_data_writer_t that can be filled in from
+ *        another thread.
+ *
+ * See @ref sqfs_data_writer_open_stream.
+ */
+
 /**
  * @struct sqfs_block_hooks_t
  *
@@ -146,8 +155,475 @@ struct sqfs_block_hooks_t {
 	 * @param count The number of padding bytes in the block.
 	 */
 	void (*prepare_padding)(void *user, sqfs_u8 *block, size_t count);
+
+	/**
+	 * @brief Gets called once the data writer is done with a file.
+	 *
+	 * At this point, the block sizes, block start and fragment location
+	 * of the inode are final, deduplication has been decided and the data
+	 * writer no longer touches the inode, so it can be serialized or
+	 * freed. The blocks may still sit in an output buffer, however.
+	 *
+	 * Files are reported in the order in which they are done, which is
+	 * not necessarily the order in which they were written, e.g. if tail
+	 * ends are held back by @ref SQFS_DATA_WRITER_GROUP_FRAGMENTS. Files
+	 * added with @ref sqfs_data_writer_link_file are reported by
+	 * @ref sqfs_data_writer_finish. The hook is called from the thread
+	 * that uses the data writer.
+	 *
+	 * @param user A user pointer.
+	 * @param inode The inode that was passed to
+	 *              @ref sqfs_data_writer_begin_file.
+	 */
+	void (*notify_file_done)(void *user, sqfs_inode_generic_t *inode);
+};
+
+/**
+ * @struct sqfs_data_writer_timing_t
+ *
+ * @brief Where the data writer spent its time.
+ *
+ * Collected if the data writer was created with
+ * @ref SQFS_DATA_WRITER_TIMING and retrieved through
+ * @ref sqfs_data_writer_get_timing. All times are in nanoseconds, measured
+ * with a monotonic clock.
+ *
+ * The main thread is the one that calls the data writer functions. Time
+ * that it does not spend waiting for the workers or writing blocks is spent
+ * elsewhere, e.g. reading the input, or in the rest of the data writer, e.g.
+ * hashing and packing tail ends.
+ */
+struct sqfs_data_writer_timing_t {
+	/**
+	 * @brief Set this to the size of the struct.
+	 *
+	 * Works the same way as @ref sqfs_block_hooks_t::size, so that fields
+	 * can be added in the future.
+	 */
+	size_t size;
+
+	/**
+	 * @brief Time from creating the data writer until
+	 *        @ref sqfs_data_writer_finish returned, or until now if it
+	 *        has not been called yet.
+	 */
+	sqfs_u64 total_time;
+
+	/**
+	 * @brief Time the main thread spent handing blocks to the workers.
+	 *
+	 * Includes waiting for a free slot in the backlog and writing out the
+	 * blocks that were finished in the mean time.
+	 */
+	sqfs_u64 enqueue_time;
+
+	/**
+	 * @brief Time the main thread spent blocked, waiting for the workers
+	 *        to finish a block, because the backlog was full or because
+	 *        everything had to be written out.
+	 */
+	sqfs_u64 backlog_wait;
+
+	/**
+	 * @brief Time the main thread spent writing finished blocks to the
+	 *        output, including deduplication and padding.
+	 */
+	sqfs_u64 write_time;
+
+	/**
+	 * @brief Time spent compressing blocks, summed up over all workers.
+	 */
+	sqfs_u64 compress_time;
+
+	/**
+	 * @brief Time spent compressing blocks by the busiest worker.
+	 */
+	sqfs_u64 compress_time_max;
+
+	/**
+	 * @brief Time blocks waited to be picked up by a worker, summed up
+	 *        over all blocks.
+	 */
+	sqfs_u64 queue_wait;
+
+	/**
+	 * @brief Time finished blocks waited for the blocks in front of them
+	 *        before they could be written, summed up over all blocks.
+	 */
+	sqfs_u64 reorder_wait;
+
+	/**
+	 * @brief The number of blocks, data and fragment blocks, that went
+	 *        through the workers.
+	 */
+	sqfs_u64 block_count;
+
+	/**
+	 * @brief The number of blocks in flight each time a block was added,
+	 *        summed up. Divided by @ref block_count, this is the average
+	 *        backlog depth.
+	 */
+	sqfs_u64 backlog_sum;
+
+	/**
+	 * @brief How often a block was added with the backlog filled to a
+	 *        given eighth of its maximum, i.e. entry 0 counts blocks
+	 *        added to an almost empty backlog and entry 7 counts blocks
+	 *        added to an almost full one.
+	 */
+	sqfs_u64 backlog_hist[8];
+
+	/**
+	 * @brief The maximum number of blocks that were in flight at once.
+	 */
+	sqfs_u32 backlog_max;
+
+	/**
+	 * @brief The maximum size of the backlog.
+	 */
+	sqfs_u32 backlog_limit;
+
+	/**
+	 * @brief The number of worker threads, or 0 if blocks are compressed
+	 *        on the main thread, when they are added.
+	 */
+	sqfs_u32 num_workers;
+
+	/**
+	 * @brief The most memory that was used for data buffers at once, in
+	 *        bytes, counted the same way as for
+	 *        @ref sqfs_data_writer_set_memory_limit.
+	 */
+	sqfs_u64 mem_peak;
+
+	/**
+	 * @brief With @ref SQFS_DATA_WRITER_ADAPTIVE_WORKERS, the lowest
+	 *        number of workers that were active at once. Otherwise the
+	 *        same as @ref num_workers.
+	 */
+	sqfs_u32 workers_min;
+
+	/**
+	 * @brief How often a worker was parked or woken up again.
+	 */
+	sqfs_u32 worker_changes;
+
+	/**
+	 * @brief With @ref SQFS_DATA_WRITER_CACHE_COMPRESSED, the number of
+	 *        blocks that were taken from the cache instead of being
+	 *        compressed again.
+	 */
+	sqfs_u64 cmp_cache_hits;
+};
+
+/**
+ * @struct sqfs_data_writer_stats_t
+ *
+ * @brief A snapshot of the state of a data writer, while it is running.
+ *
+ * Retrieved through @ref sqfs_data_writer_get_stats. The values that the
+ * thread feeding the data writer keeps track of are updated each time it
+ * hands a block to the workers or waits for them, so they may lag behind
+ * by a block.
+ */
+struct sqfs_data_writer_stats_t {
+	/**
+	 * @brief Set this to the size of the struct.
+	 *
+	 * Works the same way as @ref sqfs_block_hooks_t::size, so that fields
+	 * can be added in the future.
+	 */
+	size_t size;
+
+	/**
+	 * @brief The number of blocks that were handed to the workers.
+	 */
+	sqfs_u64 blocks_queued;
+
+	/**
+	 * @brief The number of data and fragment blocks written to the output,
+	 *        not counting the ones that were dropped again as duplicates.
+	 */
+	sqfs_u64 blocks_written;
+
+	/**
+	 * @brief The size of the output so far, in bytes.
+	 */
+	sqfs_u64 output_size;
+
+	/**
+	 * @brief The number of uncompressed bytes in the blocks that are in
+	 *        flight.
+	 */
+	sqfs_u64 bytes_in_flight;
+
+	/**
+	 * @brief The memory used for data buffers, in bytes, counted the same
+	 *        way as for @ref sqfs_data_writer_set_memory_limit.
+	 */
+	sqfs_u64 mem_used;
+
+	/**
+	 * @brief The part of @ref mem_used that is held by recycled blocks,
+	 *        which are not in use right now.
+	 */
+	sqfs_u64 mem_pool;
+
+	/**
+	 * @brief The memory limit, or 0 if there is none.
+	 */
+	sqfs_u64 mem_limit;
+
+	/**
+	 * @brief The number of data blocks that were dropped, because the
+	 *        same blocks were already written for another file.
+	 */
+	sqfs_u64 dedup_blocks;
+
+	/**
+	 * @brief The number of tail ends that were dropped, because the same
+	 *        data was already stored in a fragment block.
+	 */
+	sqfs_u64 dedup_fragments;
+
+	/**
+	 * @brief With @ref SQFS_DATA_WRITER_CACHE_COMPRESSED, the number of
+	 *        blocks that were taken from the cache.
+	 */
+	sqfs_u64 cmp_cache_hits;
+
+	/**
+	 * @brief The number of files the data writer is done with.
+	 */
+	sqfs_u64 files_done;
+
+	/**
+	 * @brief The number of blocks that are in flight, i.e. have been handed
+	 *        to the workers and have not been written out yet.
+	 */
+	sqfs_u32 backlog;
+
+	/**
+	 * @brief The maximum size of the backlog.
+	 */
+	sqfs_u32 backlog_limit;
+
+	/**
+	 * @brief The number of worker threads, or 0 if blocks are compressed
+	 *        on the main thread, when they are added.
+	 */
+	sqfs_u32 num_workers;
+
+	/**
+	 * @brief With @ref SQFS_DATA_WRITER_ADAPTIVE_WORKERS, the number of
+	 *        workers that take new blocks right now. Otherwise the same as
+	 *        @ref num_workers.
+	 */
+	sqfs_u32 active_workers;
 };
 
+/**
+ * @struct sqfs_data_writer_worker_stats_t
+ *
+ * @brief What a single worker thread of a data writer did so far.
+ *
+ * Retrieved through @ref sqfs_data_writer_get_worker_stats.
+ */
+struct sqfs_data_writer_worker_stats_t {
+	/**
+	 * @brief Set this to the size of the struct.
+	 *
+	 * Works the same way as @ref sqfs_block_hooks_t::size, so that fields
+	 * can be added in the future.
+	 */
+	size_t size;
+
+	/**
+	 * @brief The number of blocks the worker processed.
+	 */
+	sqfs_u64 blocks;
+
+	/**
+	 * @brief The number of bytes in those blocks, before compression.
+	 */
+	sqfs_u64 bytes_in;
+
+	/**
+	 * @brief The number of bytes in those blocks, after compression.
+	 */
+	sqfs_u64 bytes_out;
+
+	/**
+	 * @brief With @ref SQFS_DATA_WRITER_TIMING, the time the worker spent
+	 *        compressing, in nanoseconds. Otherwise 0.
+	 */
+	sqfs_u64 busy_time;
+
+	/**
+	 * @brief Non-zero if the worker does not take new blocks right now,
+	 *        see @ref SQFS_DATA_WRITER_ADAPTIVE_WORKERS.
+	 */
+	sqfs_u32 parked;
+};
+
+/**
+ * @enum E_SQFS_DATA_WRITER_FLAGS
+ *
+ * @brief Possible flags for @ref sqfs_data_writer_create.
+ */
+typedef enum {
+	/**
+	 * @brief Confirm duplicate blocks and fragments with a strong digest.
+	 *
+	 * By default, blocks and tail ends are considered to be duplicates
+	 * if their size and 32 bit checksum match. The checksum is folded
+	 * from a 64 bit xxHash of the input data. If this flag is set, the
+	 * full hash is kept for each block (see @ref sqfs_block_t::digest)
+	 * and has to match as well before data is deduplicated.
+	 */
+	SQFS_DATA_WRITER_VERIFY_DEDUP = 0x01,
+
+	/**
+	 * @brief Group tail ends before packing them into fragment blocks.
+	 *
+	 * By default, tail ends are packed in the order the files are
+	 * written. If this flag is set, they are held back and packed
+	 * grouped by the key set with
+	 * @ref sqfs_data_writer_set_fragment_group, and in file order
+	 * within a group. Tail ends of related files then share fragment
+	 * blocks, which tends to compress better and reduces the number of
+	 * fragment blocks a reader has to decompress.
+	 *
+	 * The fragment location of an inode may not be known before
+	 * @ref sqfs_data_writer_finish returns, so inodes must be kept
+	 * around until then.
+	 */
+	SQFS_DATA_WRITER_GROUP_FRAGMENTS = 0x02,
+
+	/**
+	 * @brief Write to the output file from a separate thread.
+	 *
+	 * Consecutive blocks are collected in large buffers that are written
+	 * out in the background, so that the latency of the output file
+	 * does not stall compression. Until @ref sqfs_data_writer_finish
+	 * returns, the output file must not be accessed other than through
+	 * the data writer. Only has an effect if libsquashfs is built with
+	 * pthread support.
+	 */
+	SQFS_DATA_WRITER_ASYNC_OUTPUT = 0x04,
+
+	/**
+	 * @brief Hold back the blocks of a file until its last block.
+	 *
+	 * By default, the blocks of a file are written as soon as they are
+	 * ready and if the file turns out to be a duplicate, the output file
+	 * is truncated again. If this flag is set, the compressed blocks of
+	 * a file are kept in memory until the file is complete and only
+	 * written if the file is not a duplicate. The output is then never
+	 * truncated or written anywhere but at the end, which also allows
+	 * for output files that are not seekable.
+	 *
+	 * Files with more than 64 MiB of compressed data are written out
+	 * directly and are not deduplicated in this mode.
+	 */
+	SQFS_DATA_WRITER_HOLD_BLOCKS = 0x08,
+
+	/**
+	 * @brief Store blocks that look incompressible without trying.
+	 *
+	 * The data writer does a cheap statistical test on samples of each
+	 * data block before handing it to a worker. Blocks with an almost
+	 * uniform byte distribution, e.g. from files that are already
+	 * compressed or encrypted, get the @ref SQFS_BLK_DONT_COMPRESS flag
+	 * set. If the first two blocks of a file look incompressible, the
+	 * rest of the file is stored uncompressed without testing. The tail
+	 * end of a file is not affected, since it shares a fragment block
+	 * with others.
+	 */
+	SQFS_DATA_WRITER_DETECT_INCOMPRESSIBLE = 0x10,
+
+	/**
+	 * @brief Pin each worker thread to a CPU.
+	 *
+	 * The worker threads are spread over the CPUs that the calling
+	 * thread is allowed to run on, one per CPU in order. Each worker
+	 * allocates its scratch buffer after being pinned, so on NUMA
+	 * systems it is placed on the local memory node. Only has an effect
+	 * on systems that support setting thread affinity and if
+	 * libsquashfs is built with pthread support.
+	 */
+	SQFS_DATA_WRITER_PIN_WORKERS = 0x20,
+
+	/**
+	 * @brief Measure where time is spent.
+	 *
+	 * Reads a monotonic clock a few times per block and collects the
+	 * results in a @ref sqfs_data_writer_timing_t, which can be retrieved
+	 * with @ref sqfs_data_writer_get_timing.
+	 */
+	SQFS_DATA_WRITER_TIMING = 0x40,
+
+	/**
+	 * @brief Adjust the number of active workers while running.
+	 *
+	 * The number of workers passed to @ref sqfs_data_writer_create
+	 * becomes the maximum. After every few dozen blocks, the data writer
+	 * parks a worker if the workers got noticeably less CPU time than
+	 * they were running, i.e. the system is oversubscribed, or if the
+	 * backlog stayed mostly empty. It wakes a parked worker up again if
+	 * the caller spent a significant share of the time waiting for a
+	 * full backlog. The output does not depend on it. Only has an effect
+	 * if libsquashfs is built with pthread support.
+	 */
+	SQFS_DATA_WRITER_ADAPTIVE_WORKERS = 0x80,
+
+	/**
+	 * @brief Remember the compressed version of repeated blocks.
+	 *
+	 * Deduplication only catches runs of blocks that match the start of
+	 * a file that was written before. If the same block shows up in the
+	 * middle of different files, e.g. padding or a fill pattern, it is
+	 * stored again and by default also compressed again. With this flag,
+	 * every worker keeps a small cache of blocks it has seen more than
+	 * once, keyed by the hash of the uncompressed data, and takes the
+	 * result from there if the data, compressor and hint all match. The
+	 * output does not depend on it.
+	 */
+	SQFS_DATA_WRITER_CACHE_COMPRESSED = 0x100,
+
+	/**
+	 * @brief Pack tail ends into fragment blocks more tightly.
+	 *
+	 * By default, a few fragment blocks are kept open and a tail end goes
+	 * into the first one it fits into, preferring the one for its size
+	 * class. With this flag, up to 16 blocks are kept open, fewer if
+	 * that would take up more than a quarter of the memory limit, and a
+	 * tail end goes into the block that has the least space left after
+	 * adding it. If no block has room, the fullest one is written out.
+	 * This results in fewer, fuller fragment blocks. Combined with
+	 * @ref SQFS_DATA_WRITER_GROUP_FRAGMENTS, tail ends of different
+	 * groups may end up in the same block more often.
+	 */
+	SQFS_DATA_WRITER_BEST_FIT_FRAGMENTS = 0x200,
+
+	/**
+	 * @brief Back the block buffers with huge pages.
+	 *
+	 * The buffers that blocks are collected and compressed in, and the
+	 * scratch buffers of the workers, are carved out of 2 MiB aligned
+	 * chunks. On Linux, explicit huge pages are used if the system has
+	 * some reserved, transparent huge pages are requested otherwise.
+	 * This reduces TLB misses with large block sizes. Memory taken from
+	 * the chunks is kept until the data writer is destroyed, so the
+	 * peak use may be a few MiB higher. If an allocator is set with
+	 * @ref sqfs_data_writer_set_allocator, it is used for the blocks
+	 * instead.
+	 */
+	SQFS_DATA_WRITER_HUGE_PAGES = 0x400,
+
+	SQFS_DATA_WRITER_ALL_FLAGS = 0x7FF,
+} E_SQFS_DATA_WRITER_FLAGS;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -162,24 +638,40 @@ extern "C" {
  * @param cmp A pointer to a compressor. If multiple worker threads are used,
  *            the deep copy function of the compressor is used to create
  *            several instances that don't interfere with each other.
- * @param num_workers The number of worker threads to create.
- * @param max_backlog The maximum number of blocks currently in flight. When
- *                    trying to add more, enqueueing blocks until the in-flight
- *                    block count drops below the threshold.
+ * @param num_workers The number of worker threads to create. The output
+ *                    does not depend on it, nor on the order in which the
+ *                    workers finish their blocks. Given the same input and
+ *                    settings, the data writer produces the same image byte
+ *                    for byte with any number of workers and any backlog.
+ * @param max_backlog The maximum number of blocks currently in flight, i.e.
+ *                    blocks that are waiting to be processed, are being
+ *                    processed or are done but still waiting to be written
+ *                    to disk in order. When trying to add more, enqueueing
+ *                    blocks until the in-flight block count drops below the
+ *                    threshold.
+ * @param pool_size The maximum number of unused block buffers to keep around
+ *                  for reuse, instead of freeing them once a block has been
+ *                  written. There are never more than max_backlog blocks in
+ *                  flight, so there is little point in making this larger.
+ *                  Setting it to zero disables recycling of buffers.
  * @param devblksz File can optionally be allgined to device block size. This
- *                 specifies the desired alignment.
+ *                 specifies the desired alignment. Zero disables alignment.
  * @param file The output file to write the finished blocks to.
+ * @param flags A combination of @ref E_SQFS_DATA_WRITER_FLAGS.
  *
  * @return A pointer to a data writer object on success, NULL on allocation
- *         failure or on failure to create and initialize the worker threads.
+ *         failure, on failure to create and initialize the worker threads
+ *         or if an unknown flag was set.
  */
 SQFS_API
 sqfs_data_writer_t *sqfs_data_writer_create(size_t max_block_size,
 					    sqfs_compressor_t *cmp,
 					    unsigned int num_workers,
 					    size_t max_backlog,
+					    size_t pool_size,
 					    size_t devblksz,
-					    sqfs_file_t *file);
+					    sqfs_file_t *file,
+					    sqfs_u32 flags);
 
 /**
  * @brief Destroy a data writer and free all memory used by it.
@@ -208,6 +700,9 @@ SQFS_API void sqfs_data_writer_destroy(sqfs_data_writer_t *proc);
  * change. The only point at which the data writer is guarnteed to not touch
  * them anymore is after @ref sqfs_data_writer_finish has returned.
  *
+ * This fails while streams opened with @ref sqfs_data_writer_open_stream
+ * have not been submitted yet.
+ *
  * @param proc A pointer to a data writer object.
  * @param inode The regular file inode representing the file. The data writer
  *              internally updates it while writing blocks to disk.
@@ -220,6 +715,94 @@ SQFS_API int sqfs_data_writer_begin_file(sqfs_data_writer_t *proc,
 					 sqfs_inode_generic_t *inode,
 					 sqfs_u32 flags);
 
+/**
+ * @brief Register an additional compressor that files can be compressed
+ *        with.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * A SquashFS image has a single compressor ID and set of compressor options
+ * that apply to all blocks. The additional compressor must be of the same
+ * kind as the one the data writer was created with and its output must be
+ * readable with the options of that one, so it should only differ in
+ * settings that only matter for compression, like the compression level.
+ *
+ * The data writer does not take ownership of the compressor. It creates
+ * copies for its worker threads, but it may also use the compressor itself,
+ * so it has to be kept around until the data writer is destroyed.
+ *
+ * @param proc A pointer to a data writer object.
+ * @param cmp A pointer to a compressor.
+ * @param id Returns an ID that can be passed to
+ *           @ref sqfs_data_writer_set_compressor.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ *         @ref SQFS_ERROR_OVERFLOW is returned if the maximum of 7
+ *         additional compressors has been reached.
+ */
+SQFS_API int sqfs_data_writer_add_compressor(sqfs_data_writer_t *proc,
+					     sqfs_compressor_t *cmp,
+					     sqfs_u32 *id);
+
+/**
+ * @brief Select the compressor for the data blocks of the current file.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * Call this after @ref sqfs_data_writer_begin_file. By default, files are
+ * compressed with the compressor the data writer was created with, which
+ * has the ID 0, or the one selected with
+ * @ref sqfs_data_writer_set_default_compressor. The tail end of a file is always packed into a fragment
+ * block that is compressed with the default compressor.
+ *
+ * @param proc A pointer to a data writer object.
+ * @param id A compressor ID returned by @ref sqfs_data_writer_add_compressor
+ *           or 0.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_writer_set_compressor(sqfs_data_writer_t *proc,
+					     sqfs_u32 id);
+
+/**
+ * @brief Select the compressor for the data blocks of the files that follow.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * Unlike @ref sqfs_data_writer_set_compressor, this does not affect the
+ * current file, if there is one. Every file begun with
+ * @ref sqfs_data_writer_begin_file afterwards starts out with the given
+ * compressor instead of the one with the ID 0, which is still used for
+ * fragment blocks. It can be called at any time, including from one of the
+ * @ref sqfs_block_hooks_t callbacks.
+ *
+ * @param proc A pointer to a data writer object.
+ * @param id A compressor ID returned by @ref sqfs_data_writer_add_compressor
+ *           or 0.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_writer_set_default_compressor(sqfs_data_writer_t *proc,
+						     sqfs_u32 id);
+
+/**
+ * @brief Set the group of the tail end of the current file.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * Call this after @ref sqfs_data_writer_begin_file. If the data writer was
+ * created with the @ref SQFS_DATA_WRITER_GROUP_FRAGMENTS flag, tail ends with
+ * the same group key are packed together. Otherwise, the key is ignored. If
+ * no group is set, a file is in group 0.
+ *
+ * @param proc A pointer to a data writer object.
+ * @param group An arbitrary key, e.g. a hash of the file name extension.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_writer_set_fragment_group(sqfs_data_writer_t *proc,
+						 sqfs_u32 group);
+
 /**
  * @brief Append data to the current file.
  *
@@ -237,6 +820,88 @@ SQFS_API int sqfs_data_writer_begin_file(sqfs_data_writer_t *proc,
 SQFS_API int sqfs_data_writer_append(sqfs_data_writer_t *proc,
 				     const void *data, size_t size);
 
+/**
+ * @brief Get direct access to the data area of the block that is currently
+ *        being filled, to avoid copying data into it.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * This can be used instead of @ref sqfs_data_writer_append, e.g. to read
+ * file data straight into the block buffer. The caller may write up to the
+ * returned number of bytes to the buffer and then has to call
+ * @ref sqfs_data_writer_commit to tell the data writer how much data was
+ * actually added. The buffer must not be used after that.
+ *
+ * @param proc A pointer to a data writer object.
+ * @param buffer Returns a pointer to the unused part of the current block.
+ * @param size Returns the number of bytes available in the buffer, which is
+ *             always at least 1.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_writer_get_buffer(sqfs_data_writer_t *proc,
+					 void **buffer, size_t *size);
+
+/**
+ * @brief Add data that was written to a buffer obtained through
+ *        @ref sqfs_data_writer_get_buffer to the current file.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * @param proc A pointer to a data writer object.
+ * @param size The number of bytes written to the buffer. Must not be larger
+ *             than the size returned by @ref sqfs_data_writer_get_buffer,
+ *             but can be zero.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_writer_commit(sqfs_data_writer_t *proc, size_t size);
+
+/**
+ * @brief Append a range of zero bytes to the current file.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * This has the same effect as appending a buffer full of zeros, but blocks
+ * that are entirely covered by the range are turned into sparse blocks
+ * directly, without ever being filled in memory.
+ *
+ * @param proc A pointer to a data writer object.
+ * @param size The number of zero bytes to add.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_writer_append_sparse(sqfs_data_writer_t *proc,
+					    sqfs_u64 size);
+
+/**
+ * @brief Append a block to the current file that is already in its on-disk
+ *        form, e.g. copied from another image.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * The block is written out as is, without compressing it. It must have been
+ * produced with the same block size and compressor options as the ones of
+ * the image being written. This can only be used at a block boundary, i.e.
+ * before any data is added to the file through
+ * @ref sqfs_data_writer_append or after a multiple of the block size, and
+ * only a file's last block may hold less than a full block of data.
+ *
+ * Deduplication works on the stored bytes of such blocks, so they are only
+ * matched against other blocks added this way.
+ *
+ * @param proc A pointer to a data writer object.
+ * @param data A pointer to the block data as stored on disk.
+ * @param size The size of the block as stored in an inode block list, i.e.
+ *             the number of bytes, with bit 24 set if the data is not
+ *             compressed. Sparse blocks (a size of 0) must be added with
+ *             @ref sqfs_data_writer_append_sparse instead.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_writer_append_raw(sqfs_data_writer_t *proc,
+					 const void *data, sqfs_u32 size);
+
 /**
  * @brief Stop writing the current file and flush everything that is
  *        buffered internally.
@@ -256,8 +921,182 @@ SQFS_API int sqfs_data_writer_append(sqfs_data_writer_t *proc,
 SQFS_API int sqfs_data_writer_end_file(sqfs_data_writer_t *proc);
 
 /**
- * @brief Wait for the in-flight data blocks to finish and finally flush the
- *        current fragment block.
+ * @brief Open a file that can be filled in from another thread, while other
+ *        files are open as well.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * Any number of streams can be open at the same time and each of them can
+ * be appended to from a different thread with
+ * @ref sqfs_data_stream_append. The data of a stream is buffered until all
+ * streams opened before it are done, then it is handed to the data writer
+ * on the thread that calls @ref sqfs_data_writer_submit_streams. Files are
+ * therefore laid out in the order the streams are opened, exactly as if
+ * they had been written one after another with
+ * @ref sqfs_data_writer_begin_file, no matter in which order the data
+ * arrives.
+ *
+ * Streams that are not up yet keep all of their data in memory, so the
+ * caller should limit how far ahead of the oldest open stream it reads.
+ *
+ * Like all other data writer functions, this must be called from the
+ * thread that uses the data writer. While streams are open,
+ * @ref sqfs_data_writer_begin_file fails, so that files are not mixed up
+ * with them.
+ *
+ * @param proc A pointer to a data writer object.
+ * @param inode The regular file inode representing the file, see
+ *              @ref sqfs_data_writer_begin_file.
+ * @param flags A combination of @ref E_SQFS_BLK_FLAGS.
+ *
+ * @return A pointer to a stream, or NULL on failure, in which case
+ *         the data writer has failed.
+ */
+SQFS_API sqfs_data_stream_t *
+sqfs_data_writer_open_stream(sqfs_data_writer_t *proc,
+			     sqfs_inode_generic_t *inode, sqfs_u32 flags);
+
+/**
+ * @brief Select the compressor for the data blocks of a stream.
+ *
+ * @memberof sqfs_data_stream_t
+ *
+ * The same as @ref sqfs_data_writer_set_compressor, for a stream. Must be
+ * called on the thread that uses the data writer, before the next call to
+ * @ref sqfs_data_writer_submit_streams.
+ *
+ * @param strm A pointer to a stream.
+ * @param id A compressor ID returned by @ref sqfs_data_writer_add_compressor
+ *           or 0.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_stream_set_compressor(sqfs_data_stream_t *strm,
+					     sqfs_u32 id);
+
+/**
+ * @brief Set the group of the tail end of a stream.
+ *
+ * @memberof sqfs_data_stream_t
+ *
+ * The same as @ref sqfs_data_writer_set_fragment_group, for a stream. Must
+ * be called on the thread that uses the data writer, before the next call
+ * to @ref sqfs_data_writer_submit_streams.
+ *
+ * @param strm A pointer to a stream.
+ * @param group An arbitrary key, e.g. a hash of the file name extension.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_stream_set_fragment_group(sqfs_data_stream_t *strm,
+						 sqfs_u32 group);
+
+/**
+ * @brief Append data to a stream.
+ *
+ * @memberof sqfs_data_stream_t
+ *
+ * Can be called from any thread, but only from one at a time for the same
+ * stream. Different streams can be appended to at the same time.
+ *
+ * @param strm A pointer to a stream.
+ * @param data A pointer to a buffer to read data from.
+ * @param size How many bytes should be copied out of the given buffer.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_stream_append(sqfs_data_stream_t *strm,
+				     const void *data, size_t size);
+
+/**
+ * @brief Mark the end of the data of a stream.
+ *
+ * @memberof sqfs_data_stream_t
+ *
+ * Can be called from any thread, like @ref sqfs_data_stream_append. The
+ * stream is freed by the data writer once it has been submitted, so it must
+ * not be used after this anymore. Every stream has to be closed, otherwise
+ * @ref sqfs_data_writer_finish never returns.
+ *
+ * @param strm A pointer to a stream.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_stream_close(sqfs_data_stream_t *strm);
+
+/**
+ * @brief Hand the data of open streams to the data writer, in the order
+ *        the streams were opened.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * Must be called from the thread that uses the data writer, from time to
+ * time while streams are appended to, so that their data is compressed
+ * while more is being read. @ref sqfs_data_writer_finish does this as well
+ * and waits for all streams to be closed.
+ *
+ * @param proc A pointer to a data writer object.
+ * @param wait If false, return as soon as the oldest open stream has no data
+ *             to submit right now. If true, wait for more data and until all
+ *             streams that are open have been closed and submitted.
+ *             Without pthread support in libsquashfs, waiting for a stream
+ *             that is not closed yet fails, as nobody else could close it.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_writer_submit_streams(sqfs_data_writer_t *proc,
+					     bool wait);
+
+/**
+ * @brief Declare that a file has the same content as one that has been
+ *        written through the data writer.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * This can be used instead of actually writing the data of a file, if the
+ * caller already knows that it is a duplicate, e.g. from hashing the input
+ * files up front. The data of the original file may still be in flight.
+ * Once @ref sqfs_data_writer_finish returns, the block list, block start,
+ * sparse byte count and fragment location of the original inode have been
+ * copied over. Both inodes must be kept around until then and the inode
+ * must have space for as many block sizes as the original.
+ *
+ * This must not be called between @ref sqfs_data_writer_begin_file and
+ * @ref sqfs_data_writer_end_file.
+ *
+ * @param proc A pointer to a data writer object.
+ * @param inode The file inode to fill in.
+ * @param original The inode of the file with the same content.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_writer_link_file(sqfs_data_writer_t *proc,
+					sqfs_inode_generic_t *inode,
+					const sqfs_inode_generic_t *original);
+
+/**
+ * @brief Wait until all data submitted so far has been processed.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * Once this returns, the inodes of all files that have been ended have their
+ * final block sizes, block start and fragment location and are no longer
+ * touched by the data writer, so they can be serialized and freed. The
+ * exception are files added with @ref sqfs_data_writer_link_file, which are
+ * filled in by @ref sqfs_data_writer_finish.
+ *
+ * Tail ends held back by @ref SQFS_DATA_WRITER_GROUP_FRAGMENTS are added to
+ * fragment blocks, fragment blocks that still have room are kept open.
+ *
+ * @param proc A pointer to a data writer object.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_writer_sync(sqfs_data_writer_t *proc);
+
+/**
+ * @brief Flush the fragment blocks that are still open and wait for all
+ *        in-flight blocks to be written.
  *
  * @memberof sqfs_data_writer_t
  *
@@ -269,6 +1108,61 @@ SQFS_API int sqfs_data_writer_end_file(sqfs_data_writer_t *proc);
  */
 SQFS_API int sqfs_data_writer_finish(sqfs_data_writer_t *proc);
 
+/**
+ * @brief Save what is needed to continue writing after a restart.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * The fragment blocks that are still open are written out, even if they
+ * are not full, and all blocks in flight are waited for, like in
+ * @ref sqfs_data_writer_finish. Files added with
+ * @ref sqfs_data_writer_link_file are filled in as well. Afterwards, all
+ * inodes of files that have been ended are final.
+ *
+ * The state is appended to the given file. It holds the size of the output
+ * file, the fragment table and the lists that the deduplication of data
+ * blocks and tail ends goes by, but not the inodes. It is only valid once
+ * the output file object has written out everything it buffers, and the
+ * data is only safe from a crash of the system once it is on disk.
+ *
+ * This must not be called between @ref sqfs_data_writer_begin_file and
+ * @ref sqfs_data_writer_end_file.
+ *
+ * @param proc A pointer to a data writer object.
+ * @param file The file to append the state to.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_writer_save_state(sqfs_data_writer_t *proc,
+					 sqfs_file_t *file);
+
+/**
+ * @brief Continue where a data writer left off when saving its state.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * This must be called on a freshly created data writer, with the same block
+ * size and output file as the one that saved the state. The output file is
+ * truncated to the size it had back then, and the files that follow are
+ * deduplicated against the data that was written before. The inodes of the
+ * files written before have to be restored by the caller.
+ *
+ * If this fails, the data writer has to be destroyed.
+ *
+ * @param proc A pointer to a data writer object.
+ * @param file The file that the state was saved to.
+ * @param offset The location of the state in the file. Advanced past it on
+ *               success.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ *         @ref SQFS_ERROR_UNSUPPORTED is returned if the state was saved
+ *         with a different block size or deduplication settings,
+ *         @ref SQFS_ERROR_OUT_OF_BOUNDS if the output file is shorter than
+ *         it was when the state was saved.
+ */
+SQFS_API int sqfs_data_writer_load_state(sqfs_data_writer_t *proc,
+					 sqfs_file_t *file, sqfs_u64 *offset);
+
 /**
  * @brief Write the completed fragment table to disk.
  *
@@ -303,6 +1197,137 @@ SQFS_API
 int sqfs_data_writer_set_hooks(sqfs_data_writer_t *proc, void *user_ptr,
 			       const sqfs_block_hooks_t *hooks);
 
+/**
+ * @brief Limit the amount of memory used for data buffers.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * By default, the amount of memory used only depends on the backlog, the
+ * block size and how many blocks are kept for recycling. If a limit is set,
+ * the data writer accounts for all block buffers, whether queued, being
+ * compressed, waiting to be written or recycled, as well as open fragment
+ * blocks and other internal buffers. Once the limit is reached,
+ * @ref sqfs_data_writer_append and @ref sqfs_data_writer_get_buffer wait
+ * for blocks in flight to complete before allocating more. Tail ends that
+ * are held back for grouping are packed early and a file held back for
+ * deduplication is written out directly.
+ *
+ * The limit is a soft one. If nothing is in flight, it is exceeded rather
+ * than getting stuck. Bookkeeping data, like the list of blocks written so
+ * far, is not counted.
+ *
+ * @param proc A pointer to a data writer object.
+ * @param limit The limit in bytes, or 0 for no limit.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_data_writer_set_memory_limit(sqfs_data_writer_t *proc,
+					       size_t limit);
+
+/**
+ * @brief Allocate the block buffers through user supplied hooks.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * This covers the buffers that data is collected and compressed in, as well
+ * as tail ends held back for grouping, i.e. everything that scales with the
+ * amount of data in flight. The hooks are only called from the thread that
+ * uses the data writer.
+ *
+ * @param proc A pointer to a data writer object.
+ * @param allocator The allocator to use, or NULL for the standard library.
+ *                  It must outlive the data writer.
+ *
+ * @return Zero on success, @ref SQFS_ERROR_UNSUPPORTED if the data writer
+ *         has already allocated blocks, i.e. this must be called before
+ *         the first file is added.
+ */
+SQFS_API int sqfs_data_writer_set_allocator(sqfs_data_writer_t *proc,
+					    const sqfs_allocator_t *allocator);
+
+/**
+ * @brief Get the time measurements of a data writer.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * Only available if the data writer was created with
+ * @ref SQFS_DATA_WRITER_TIMING. Can be called at any time; usually, it is
+ * called after @ref sqfs_data_writer_finish.
+ *
+ * @param proc A pointer to a data writer object.
+ * @param out Returns the measurements. The size field must be set to the
+ *            size of the struct before calling this.
+ *
+ * @return Zero on success, @ref SQFS_ERROR_UNSUPPORTED if the size field
+ *         does not match or the data writer does not collect timing
+ *         information.
+ */
+SQFS_API int sqfs_data_writer_get_timing(sqfs_data_writer_t *proc,
+					 sqfs_data_writer_timing_t *out);
+
+/**
+ * @brief Get the number of blocks that are in flight.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * This is the number of blocks that have been handed to the worker threads
+ * and have not been written out yet, i.e. how much of the backlog passed to
+ * @ref sqfs_data_writer_create is in use. Without worker threads, it is
+ * always zero.
+ *
+ * This is not thread safe. It must be called from the thread that feeds the
+ * data writer, for instance from one of the @ref sqfs_block_hooks_t
+ * callbacks.
+ *
+ * @param proc A pointer to a data writer object.
+ *
+ * @return The number of blocks in flight.
+ */
+SQFS_API size_t sqfs_data_writer_get_backlog(const sqfs_data_writer_t *proc);
+
+/**
+ * @brief Get a snapshot of the state of a data writer.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * Unlike most other functions, this can be called from any thread, at any
+ * time, while another thread is feeding the data writer, e.g. to poll it
+ * for scheduling decisions. If the library was built without worker thread
+ * support, it must be called from the thread that feeds the data writer.
+ *
+ * @param proc A pointer to a data writer object.
+ * @param out Returns the snapshot. The size field must be set to the size
+ *            of the struct before calling this.
+ *
+ * @return Zero on success, @ref SQFS_ERROR_UNSUPPORTED if the size field
+ *         does not match.
+ */
+SQFS_API int sqfs_data_writer_get_stats(sqfs_data_writer_t *proc,
+					sqfs_data_writer_stats_t *out);
+
+/**
+ * @brief Get what a single worker thread of a data writer did so far.
+ *
+ * @memberof sqfs_data_writer_t
+ *
+ * Can be called from any thread, at any time, like
+ * @ref sqfs_data_writer_get_stats.
+ *
+ * @param proc A pointer to a data writer object.
+ * @param index The index of the worker, less than
+ *              @ref sqfs_data_writer_stats_t::num_workers.
+ * @param out Returns the counters. The size field must be set to the size
+ *            of the struct before calling this.
+ *
+ * @return Zero on success, @ref SQFS_ERROR_UNSUPPORTED if the size field
+ *         does not match, @ref SQFS_ERROR_OUT_OF_BOUNDS if there is no
+ *         worker with that index.
+ */
+SQFS_API
+int sqfs_data_writer_get_worker_stats(sqfs_data_writer_t *proc,
+				      unsigned int index,
+				      sqfs_data_writer_worker_stats_t *out);
+
 #ifdef __cplusplus
 }
 #endif
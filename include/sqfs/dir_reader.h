@@ -100,7 +100,50 @@ typedef enum {
 	 */
 	SQFS_TREE_STORE_PARENTS = 0x40,
 
-	SQFS_TREE_ALL_FLAGS = 0x7F,
+	/**
+	 * @brief Only load the immediate children of the start node.
+	 *
+	 * Similar to @ref SQFS_TREE_NO_RECURSE, but sub directories are
+	 * meant to be loaded later on, when they are actually needed,
+	 * using @ref sqfs_dir_reader_expand_node.
+	 *
+	 * Since sub directories are not read, @ref SQFS_TREE_NO_EMPTY only
+	 * omits directories that are empty on disk, not the ones that only
+	 * end up empty after applying the other filter rules.
+	 */
+	SQFS_TREE_LAZY = 0x80,
+
+	/**
+	 * @brief Allocate the tree in large chunks of memory.
+	 *
+	 * The nodes, their names and the inodes, including the block size
+	 * lists of files, are packed into a few large chunks that belong to
+	 * the tree as a whole, instead of being allocated one by one. This
+	 * considerably reduces memory use and loading time for large trees.
+	 *
+	 * The tree can then only be freed as a whole, by calling
+	 * @ref sqfs_dir_tree_destroy on the root node. Individual nodes or
+	 * inodes must not be freed or moved to a different tree.
+	 */
+	SQFS_TREE_COMPACT = 0x100,
+
+	/**
+	 * @brief Do not load the block lists of regular files.
+	 *
+	 * The block list takes up 4 bytes for every data block of a file,
+	 * but is not needed for only looking at the tree, e.g. listing it
+	 * or comparing the meta data of two trees. With this flag set, file
+	 * inodes that have data blocks are loaded with their
+	 * sqfs_inode_generic_t::block_sizes pointer set to NULL, while
+	 * sqfs_inode_generic_t::num_file_blocks still holds the block count.
+	 *
+	 * The data reader refuses to read from such an inode. The block list
+	 * can be loaded later on, once it is actually needed, using
+	 * @ref sqfs_dir_reader_load_block_list.
+	 */
+	SQFS_TREE_NO_BLOCK_LISTS = 0x200,
+
+	SQFS_TREE_ALL_FLAGS = 0x3FF,
 } E_SQFS_TREE_FILTER_FLAGS;
 
 /**
@@ -130,6 +173,22 @@ struct sqfs_tree_node_t {
 	 */
 	sqfs_inode_generic_t *inode;
 
+	/**
+	 * @brief Internal. For a tree loaded with @ref SQFS_TREE_COMPACT,
+	 *        the memory that the node belongs to, NULL otherwise.
+	 */
+	sqfs_tree_arena_t *arena;
+
+	/**
+	 * @brief The location of the inode in the inode table.
+	 *
+	 * This is a reference as used for
+	 * sqfs_super_t::root_inode_ref, i.e. the position of the meta
+	 * data block in the upper 48 bits and the offset into the
+	 * uncompressed block in the lower 16 bits.
+	 */
+	sqfs_u64 inode_ref;
+
 	/**
 	 * @brief Resolved 32 bit user ID from the inode
 	 */
@@ -146,6 +205,28 @@ struct sqfs_tree_node_t {
 	sqfs_u8 name[];
 };
 
+/**
+ * @brief Decides whether a directory entry goes into a tree.
+ *
+ * See @ref sqfs_dir_reader_set_filter. The callback is run for an entry
+ * before its inode is read, so only what the directory listing itself
+ * contains is known at that point.
+ *
+ * @param user The user pointer passed to @ref sqfs_dir_reader_set_filter.
+ * @param parent The tree node of the directory that contains the entry.
+ *               Its parent chain is complete up to the root of the tree
+ *               being loaded, which can be used to work out the full path.
+ * @param ent The directory entry. The name is null-terminated.
+ *
+ * @return Zero to add the entry to the tree, a positive value to leave it
+ *         out, including everything below it, or a negative
+ *         @ref E_SQFS_ERROR value to stop loading the tree and have the
+ *         tree loader return that value.
+ */
+typedef int (*sqfs_tree_filter_cb_t)(void *user,
+				     const sqfs_tree_node_t *parent,
+				     const sqfs_dir_entry_t *ent);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -166,6 +247,120 @@ SQFS_API sqfs_dir_reader_t *sqfs_dir_reader_create(const sqfs_super_t *super,
 						   sqfs_compressor_t *cmp,
 						   sqfs_file_t *file);
 
+/**
+ * @brief Enable caching to speed up repeated path lookups.
+ *
+ * @memberof sqfs_dir_reader_t
+ *
+ * By default, @ref sqfs_dir_reader_find_by_path walks down from the root
+ * for every path, reading every inode and directory listing on the way
+ * again. This function sets up a least recently used cache of resolved
+ * path components, i.e. which inode a name in a given directory refers to,
+ * and a cache of uncompressed meta data blocks shared by the inode and the
+ * directory table readers (see @ref sqfs_meta_cache_t).
+ *
+ * Calling this function resets the current directory position, so a
+ * directory has to be opened again afterwards.
+ *
+ * @param rd A pointer to a directory reader.
+ * @param max_entries The maximum number of path components to remember,
+ *                    or 0 to disable the path lookup cache.
+ * @param max_blocks The number of uncompressed meta data blocks to keep
+ *                   in memory, or 0 to disable the block cache.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_dir_reader_set_cache(sqfs_dir_reader_t *rd,
+				       size_t max_entries, size_t max_blocks);
+
+/**
+ * @brief Uncompress the entire inode and directory tables up front.
+ *
+ * @memberof sqfs_dir_reader_t
+ *
+ * Both tables are read in one go and all their meta data blocks are
+ * uncompressed on a pool of threads (see @ref sqfs_meta_cache_load). All
+ * further accesses, e.g. through @ref sqfs_dir_reader_get_full_hierarchy,
+ * are then served from memory. This replaces the block cache set up by
+ * @ref sqfs_dir_reader_set_cache, and keeps the uncompressed tables in
+ * memory until the reader is destroyed.
+ *
+ * Calling this function resets the current directory position, so a
+ * directory has to be opened again afterwards.
+ *
+ * @param rd A pointer to a directory reader.
+ * @param num_workers The number of threads to use, including the calling
+ *                    thread.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_dir_reader_preload(sqfs_dir_reader_t *rd,
+				     unsigned int num_workers);
+
+/**
+ * @brief Read the inode and directory tables ahead while walking them.
+ *
+ * @memberof sqfs_dir_reader_t
+ *
+ * A lighter alternative to @ref sqfs_dir_reader_preload for large images,
+ * see @ref sqfs_meta_reader_set_readahead. Walking the whole tree, e.g.
+ * through @ref sqfs_dir_reader_get_full_hierarchy, mostly moves through
+ * both tables front to back.
+ *
+ * @param rd A pointer to a directory reader.
+ * @param count The number of meta data blocks to read ahead in each
+ *              table, or 0 to disable it.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_dir_reader_set_readahead(sqfs_dir_reader_t *rd,
+					   size_t count);
+
+/**
+ * @brief Allocate the inodes and directory entries returned to the caller
+ *        through user supplied hooks.
+ *
+ * @memberof sqfs_dir_reader_t
+ *
+ * This affects @ref sqfs_dir_reader_read, @ref sqfs_dir_reader_get_inode,
+ * @ref sqfs_dir_reader_get_root_inode and
+ * @ref sqfs_dir_reader_find_by_path. The objects they return must then be
+ * released through the free hook of the allocator instead of free(). The
+ * allocator can be changed at any time and only affects objects read after
+ * that.
+ *
+ * Trees loaded with @ref sqfs_dir_reader_get_full_hierarchy or expanded
+ * with @ref sqfs_dir_reader_expand_node still use the standard library,
+ * because @ref sqfs_dir_tree_destroy does not know the reader.
+ *
+ * @param rd A pointer to a directory reader.
+ * @param allocator The allocator to use, or NULL for the standard library.
+ */
+SQFS_API void sqfs_dir_reader_set_allocator(sqfs_dir_reader_t *rd,
+					    const sqfs_allocator_t *allocator);
+
+/**
+ * @brief Filter the entries of trees while they are being loaded.
+ *
+ * @memberof sqfs_dir_reader_t
+ *
+ * The callback is run for every entry that the tree loader finds while
+ * walking through directories in @ref sqfs_dir_reader_get_full_hierarchy,
+ * @ref sqfs_dir_reader_get_subtrees and @ref sqfs_dir_reader_expand_node,
+ * after the @ref E_SQFS_TREE_FILTER_FLAGS have been applied. Entries that
+ * it rejects are skipped right away: their inodes are never read and
+ * rejected directories are never opened.
+ *
+ * The entries along explicitly requested paths, e.g. the path passed to
+ * @ref sqfs_dir_reader_get_full_hierarchy, are not filtered.
+ *
+ * @param rd A pointer to a directory reader.
+ * @param cb The filter callback, or NULL to load all entries again.
+ * @param user A user pointer to pass to the callback.
+ */
+SQFS_API void sqfs_dir_reader_set_filter(sqfs_dir_reader_t *rd,
+					 sqfs_tree_filter_cb_t cb, void *user);
+
 /**
  * @brief Cleanup a directory reader and free all its memory.
  *
@@ -240,6 +435,27 @@ SQFS_API int sqfs_dir_reader_find(sqfs_dir_reader_t *rd, const char *name);
 SQFS_API int sqfs_dir_reader_read(sqfs_dir_reader_t *rd,
 				  sqfs_dir_entry_t **out);
 
+/**
+ * @brief Read a directory entry into an internal buffer and advance the
+ *        internal position indicator to the next one.
+ *
+ * @memberof sqfs_dir_reader_t
+ *
+ * This works exactly like @ref sqfs_dir_reader_read, but does not allocate
+ * a new entry every time. Instead, it returns a pointer to a buffer inside
+ * the reader, with a null-terminated name. The entry stays valid until the
+ * next entry is read or the reader is destroyed.
+ *
+ * @param rd A pointer to a directory reader.
+ * @param out Returns a pointer to a directory entry on success. It must not
+ *            be freed or modified.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure, a positive
+ *         number if the end of the current directory listing has been reached.
+ */
+SQFS_API int sqfs_dir_reader_next(sqfs_dir_reader_t *rd,
+				  const sqfs_dir_entry_t **out);
+
 /**
  * @brief Read the inode that the current directory entry points to.
  *
@@ -286,6 +502,77 @@ SQFS_API int sqfs_dir_reader_find_by_path(sqfs_dir_reader_t *rd,
 					  const char *path,
 					  sqfs_inode_generic_t **out);
 
+/**
+ * @brief Find an inode through a path index.
+ *
+ * @memberof sqfs_dir_reader_t
+ *
+ * Instead of reading the directories along the way, the inode reference is
+ * taken from the index and the inode is read directly.
+ *
+ * @param rd A pointer to a directory reader.
+ * @param index A pointer to a path index loaded for the same image. If this
+ *              is NULL, the path is resolved the same way as
+ *              @ref sqfs_dir_reader_find_by_path does.
+ * @param path A path to resolve into an inode. Forward or backward slashes can
+ *             be used to seperate path components.
+ * @param out Returns a pointer to a generic inode that can be freed with a
+ *            single free call.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure,
+ *         @ref SQFS_ERROR_NO_ENTRY if the index has no entry for the path.
+ */
+SQFS_API int sqfs_dir_reader_find_by_index(sqfs_dir_reader_t *rd,
+					   const sqfs_path_index_t *index,
+					   const char *path,
+					   sqfs_inode_generic_t **out);
+
+/**
+ * @brief Map an inode number to the reference of the inode.
+ *
+ * @memberof sqfs_dir_reader_t
+ *
+ * This uses the NFS export table, which is loaded lazily. Only the location
+ * list of the table is read on the first call, the meta data blocks it
+ * points to are read as entries in them are looked up and are kept in
+ * memory until the reader is destroyed. Since a lookup can load table
+ * blocks, the reader must not be accessed from several threads at once.
+ *
+ * @param rd A pointer to a directory reader.
+ * @param number The inode number, starting at 1.
+ * @param out Returns the inode reference, i.e. the location of the meta
+ *            data block relative to the inode table start in the upper 48
+ *            bits and the offset into the uncompressed block in the lower
+ *            16 bits.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure,
+ *         @ref SQFS_ERROR_UNSUPPORTED if the image has no export table,
+ *         @ref SQFS_ERROR_NO_ENTRY if the inode number is out of range.
+ */
+SQFS_API int sqfs_dir_reader_get_inode_ref(sqfs_dir_reader_t *rd,
+					   sqfs_u32 number, sqfs_u64 *out);
+
+/**
+ * @brief Read an inode given its inode number.
+ *
+ * @memberof sqfs_dir_reader_t
+ *
+ * The inode is located through the export table, see
+ * @ref sqfs_dir_reader_get_inode_ref, instead of walking the directories.
+ *
+ * @param rd A pointer to a directory reader.
+ * @param number The inode number, starting at 1.
+ * @param out Returns a pointer to a generic inode that can be freed with a
+ *            single free call.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure,
+ *         @ref SQFS_ERROR_UNSUPPORTED if the image has no export table,
+ *         @ref SQFS_ERROR_NO_ENTRY if the inode number is out of range.
+ */
+SQFS_API int sqfs_dir_reader_find_by_number(sqfs_dir_reader_t *rd,
+					    sqfs_u32 number,
+					    sqfs_inode_generic_t **out);
+
 /**
  * @brief High level helper function for deserializing the entire file system
  *        hierarchy into an in-memory tree structure.
@@ -311,12 +598,98 @@ SQFS_API int sqfs_dir_reader_get_full_hierarchy(sqfs_dir_reader_t *rd,
 						sqfs_u32 flags,
 						sqfs_tree_node_t **out);
 
+/**
+ * @brief Deserialize several sub trees of the file system hierarchy into a
+ *        single in-memory tree structure.
+ *
+ * @memberof sqfs_dir_reader_t
+ *
+ * The result is the same as calling @ref sqfs_dir_reader_get_full_hierarchy
+ * with @ref SQFS_TREE_STORE_PARENTS for every path and merging the trees, but
+ * the paths are resolved in a single descent from the root. A directory that
+ * several paths go through is only read once, and only the entries along the
+ * paths are loaded from it.
+ *
+ * Paths that are inside the sub tree of another path are simply covered by
+ * it. If @p count is zero, only the root node is returned.
+ *
+ * @param rd A pointer to a directory reader.
+ * @param idtbl A pointer to an ID table used for resolving UIDs and GIDs.
+ * @param paths An array of paths to resolve into inodes. Forward or backward
+ *              slashes can be used to seperate path components. Resolving
+ *              '.' or '..' is not supported.
+ * @param count The number of paths in the array.
+ * @param flags A combination of @ref E_SQFS_TREE_FILTER_FLAGS flags.
+ *              @ref SQFS_TREE_STORE_PARENTS is always implied.
+ * @param out Returns the root node of the tree.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure, e.g.
+ *         @ref SQFS_ERROR_NO_ENTRY if one of the paths does not exist.
+ */
+SQFS_API int sqfs_dir_reader_get_subtrees(sqfs_dir_reader_t *rd,
+					  const sqfs_id_table_t *idtbl,
+					  const char *const *paths,
+					  size_t count, sqfs_u32 flags,
+					  sqfs_tree_node_t **out);
+
+/**
+ * @brief Load the children of a directory node on demand.
+ *
+ * @memberof sqfs_dir_reader_t
+ *
+ * This is intended for trees loaded with the @ref SQFS_TREE_LAZY flag set
+ * using @ref sqfs_dir_reader_get_full_hierarchy. The immediate children of
+ * the given directory node are read and attached to it, applying the same
+ * filter rules as the lazy tree loader.
+ *
+ * If the node already has children, it is left unchanged. An empty
+ * directory is read again on every call.
+ *
+ * @param rd A pointer to a directory reader.
+ * @param idtbl A pointer to an ID table used for resolving UIDs and GIDs.
+ * @param node A directory node of a tree loaded through the same reader.
+ * @param flags A combination of @ref E_SQFS_TREE_FILTER_FLAGS flags.
+ *              @ref SQFS_TREE_LAZY is always implied.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure, e.g.
+ *         @ref SQFS_ERROR_NOT_DIR if the node is not a directory. On
+ *         failure, the node is left without children.
+ */
+SQFS_API int sqfs_dir_reader_expand_node(sqfs_dir_reader_t *rd,
+					 const sqfs_id_table_t *idtbl,
+					 sqfs_tree_node_t *node,
+					 sqfs_u32 flags);
+
+/**
+ * @brief Load the block list of a file node on demand.
+ *
+ * @memberof sqfs_dir_reader_t
+ *
+ * This is intended for trees loaded with the @ref SQFS_TREE_NO_BLOCK_LISTS
+ * flag set. The inode of the node is read again, this time including the
+ * block list, and replaces the one stored in the node. Pointers to the
+ * previous inode must no longer be used afterwards.
+ *
+ * If the inode already has its block list, it is left unchanged.
+ *
+ * @param rd A pointer to a directory reader.
+ * @param node A file node of a tree loaded through the same reader.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure, e.g.
+ *         @ref SQFS_ERROR_NOT_FILE if the node is not a regular file.
+ */
+SQFS_API int sqfs_dir_reader_load_block_list(sqfs_dir_reader_t *rd,
+					     sqfs_tree_node_t *node);
+
 /**
  * @brief Recursively destroy a tree of @ref sqfs_tree_node_t nodes
  *
  * This function can be used to clean up after
  * @ref sqfs_dir_reader_get_full_hierarchy.
  *
+ * If the tree was loaded with the @ref SQFS_TREE_COMPACT flag set, the
+ * entire tree is freed at once, so this must be called on the root node.
+ *
  * @param root A pointer to the root node.
  */
 SQFS_API void sqfs_dir_tree_destroy(sqfs_tree_node_t *root);
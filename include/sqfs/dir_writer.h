@@ -84,6 +84,28 @@ SQFS_API sqfs_dir_writer_t *sqfs_dir_writer_create(sqfs_meta_writer_t *dm);
  */
 SQFS_API void sqfs_dir_writer_destroy(sqfs_dir_writer_t *writer);
 
+/**
+ * @brief Limit the number of entries that share one header.
+ *
+ * @memberof sqfs_dir_writer_t
+ *
+ * Every header gets an entry in the index of an extended directory inode.
+ * A lookup jumps to the last header with a name less or equal and scans
+ * from there, so a lower limit leads to a denser index and shorter scans
+ * in huge directories, at the cost of a bigger listing and inode.
+ *
+ * The limit applies to all directories written after this call.
+ *
+ * @param writer A pointer to a directory writer object.
+ * @param max_entries The maximum number of entries per header, between 1
+ *                    and @ref SQFS_MAX_DIR_ENT, which is the default.
+ *
+ * @return Zero on success, @ref SQFS_ERROR_OUT_OF_BOUNDS if the limit is
+ *         out of range.
+ */
+SQFS_API int sqfs_dir_writer_set_header_limit(sqfs_dir_writer_t *writer,
+					      size_t max_entries);
+
 /**
  * @brief Begin writing a directory, i.e. reset and initialize all internal
  *        state neccessary.
@@ -128,6 +128,14 @@ typedef enum {
 	 *        a regular file or a regular file inode.
 	 */
 	SQFS_ERROR_NOT_FILE = -15,
+
+	/**
+	 * @brief Tried to read the data of a file, but its inode was loaded
+	 *        without the block list.
+	 *
+	 * See @ref SQFS_TREE_NO_BLOCK_LISTS.
+	 */
+	SQFS_ERROR_NO_BLOCK_LIST = -16,
 } E_SQFS_ERROR;
 
 #endif /* SQFS_ERROR_H */
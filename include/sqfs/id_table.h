@@ -77,6 +77,26 @@ SQFS_API void sqfs_id_table_destroy(sqfs_id_table_t *tbl);
 SQFS_API int sqfs_id_table_id_to_index(sqfs_id_table_t *tbl, sqfs_u32 id,
 				       sqfs_u16 *out);
 
+/**
+ * @brief Resolve an array of 32 bit IDs to unique 16 bit indices.
+ *
+ * @memberof sqfs_id_table_t
+ *
+ * This does the same as @ref sqfs_id_table_id_to_index for each entry, but
+ * skips the lookup if an ID is identical to the previous one, e.g. if a
+ * UID/GID pair is resolved at once.
+ *
+ * @param tbl A pointer to an ID table object.
+ * @param ids An array of IDs to resolve.
+ * @param out Returns the unique table index for each ID.
+ * @param count The number of entries in both arrays.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR on failure.
+ */
+SQFS_API int sqfs_id_table_ids_to_indices(sqfs_id_table_t *tbl,
+					  const sqfs_u32 *ids, sqfs_u16 *out,
+					  size_t count);
+
 /**
  * @brief Write an ID table to disk.
  *
@@ -110,6 +130,34 @@ SQFS_API int sqfs_id_table_read(sqfs_id_table_t *tbl, sqfs_file_t *file,
 				const sqfs_super_t *super,
 				sqfs_compressor_t *cmp);
 
+/**
+ * @brief Prepare reading an ID table from disk on demand.
+ *
+ * @memberof sqfs_id_table_t
+ *
+ * This only reads the list of meta data block locations. Each block is read
+ * and uncompressed the first time @ref sqfs_id_table_index_to_id is called
+ * for an index in it, which is cheaper if only a few IDs are ever looked up.
+ * Any function that needs the entire table, like
+ * @ref sqfs_id_table_id_to_index, loads the remaining blocks first.
+ *
+ * The file and compressor are kept until the table is completely loaded,
+ * read again or destroyed and must stay around until then. Since looking up
+ * an index can now modify the table, it must not be accessed from several
+ * threads at once.
+ *
+ * @param tbl A pointer to an ID table object.
+ * @param file The underlying file to read the table from.
+ * @param super A pointer to a super block from which to get
+ *              the ID table location.
+ * @param cmp A compressor to use to extract compressed table blocks.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR on failure.
+ */
+SQFS_API int sqfs_id_table_read_lazy(sqfs_id_table_t *tbl, sqfs_file_t *file,
+				     const sqfs_super_t *super,
+				     sqfs_compressor_t *cmp);
+
 /**
  * @brief Resolve a 16 bit index to a 32 bit ID.
  *
@@ -54,9 +54,107 @@ typedef enum {
 	 */
 	SQFS_FILE_OPEN_OVERWRITE = 0x02,
 
-	SQFS_FILE_OPEN_ALL_FLAGS = 0x03,
+	/**
+	 * @brief If the read only flag is set, try to map the file into
+	 *        memory.
+	 *
+	 * The resulting file object implements @ref sqfs_file_t::map_at,
+	 * which the readers in libsquashfs use to decompress data straight
+	 * from the mapping instead of reading it into a buffer first. If the
+	 * file cannot be mapped, or the platform doesn't support it, the
+	 * flag is ignored.
+	 *
+	 * The file must not be truncated by someone else while it is mapped.
+	 */
+	SQFS_FILE_OPEN_MMAP = 0x04,
+
+	/**
+	 * @brief Try to set up asynchronous I/O for the file.
+	 *
+	 * On Linux, this uses io_uring to implement
+	 * @ref sqfs_file_t::read_batch and @ref sqfs_file_t::write_batch,
+	 * which keep many transfers in flight at once. If io_uring is not
+	 * available, e.g. on Windows, the flag is ignored.
+	 */
+	SQFS_FILE_OPEN_ASYNC = 0x08,
+
+	/**
+	 * @brief Try to bypass the page cache of the operating system.
+	 *
+	 * On Linux, this opens the file a second time with O_DIRECT. Reads
+	 * and writes that are suitably aligned in memory and in the file use
+	 * that, everything else still goes through the page cache. The
+	 * buffer that appends are collected in is aligned accordingly. If
+	 * direct I/O is not supported, e.g. on Windows, the flag is ignored.
+	 */
+	SQFS_FILE_OPEN_DIRECT = 0x10,
+
+	/**
+	 * @brief Hint that the file is accessed sequentially and that data
+	 *        is not accessed again once it has been read or written.
+	 *
+	 * On Unix-like systems, this uses posix_fadvise to enable read ahead
+	 * and to drop the data from the page cache after each transfer. On
+	 * Windows, the flag is ignored.
+	 *
+	 * If the file is also memory mapped (see @ref SQFS_FILE_OPEN_MMAP),
+	 * the mapping is advised with MADV_SEQUENTIAL instead, which lets the
+	 * kernel read ahead aggressively and reclaim the pages behind.
+	 */
+	SQFS_FILE_OPEN_SEQUENTIAL = 0x20,
+
+	/**
+	 * @brief If the read only flag is not set, open an existing file
+	 *        without truncating it.
+	 *
+	 * Writing continues with whatever the file already contains, e.g. to
+	 * pick up an interrupted image build. The file is created if it does
+	 * not exist. This takes precedence over
+	 * @ref SQFS_FILE_OPEN_OVERWRITE.
+	 */
+	SQFS_FILE_OPEN_NO_TRUNCATE = 0x40,
+
+	SQFS_FILE_OPEN_ALL_FLAGS = 0x7F,
 } E_SQFS_FILE_OPEN_FLAGS;
 
+/**
+ * @enum E_SQFS_FILE_FLUSH_FLAGS
+ *
+ * @brief Flags for @ref sqfs_file_flush.
+ */
+typedef enum {
+	/**
+	 * @brief Also wait until the data has made it to the storage
+	 *        device, e.g. with fsync.
+	 */
+	SQFS_FILE_FLUSH_SYNC = 0x01,
+
+	SQFS_FILE_FLUSH_ALL_FLAGS = 0x01,
+} E_SQFS_FILE_FLUSH_FLAGS;
+
+/**
+ * @struct sqfs_file_io_t
+ *
+ * @brief Describes one transfer of a batch passed to
+ *        @ref sqfs_file_t::read_batch or @ref sqfs_file_t::write_batch.
+ */
+struct sqfs_file_io_t {
+	/**
+	 * @brief An absolute offset in the file.
+	 */
+	sqfs_u64 offset;
+
+	/**
+	 * @brief The buffer to read into or to write from.
+	 */
+	void *buffer;
+
+	/**
+	 * @brief The number of bytes to transfer.
+	 */
+	size_t size;
+};
+
 /**
  * @interface sqfs_file_t
  *
@@ -118,6 +216,76 @@ struct sqfs_file_t {
 	 *         directly to the caller.
 	 */
 	int (*truncate)(sqfs_file_t *file, sqfs_u64 size);
+
+	/**
+	 * @brief Get a pointer to a chunk of data at an absolute position.
+	 *
+	 * This is optional and can be NULL. If set, the readers in
+	 * libsquashfs use it instead of @ref sqfs_file_t::read_at to avoid
+	 * copying the data into a buffer. The pointer must stay valid until
+	 * the file is destroyed and the data must not change in the mean
+	 * time.
+	 *
+	 * @param file A pointer to the file object.
+	 * @param offset An absolute offset of the data.
+	 * @param size The number of bytes that are accessed.
+	 * @param out Returns a pointer to the data.
+	 *
+	 * @return Zero on success, an @ref E_SQFS_ERROR identifier on failure
+	 *         that the data structures in libsquashfs that use this return
+	 *         directly to the caller.
+	 */
+	int (*map_at)(sqfs_file_t *file, sqfs_u64 offset, size_t size,
+		      const void **out);
+
+	/**
+	 * @brief Read a number of chunks of data at once.
+	 *
+	 * This is optional and can be NULL. The reads can be carried out in
+	 * parallel and in any order, but have all finished when the function
+	 * returns, even if one of them failed.
+	 *
+	 * @param file A pointer to the file object.
+	 * @param io An array of transfers to carry out.
+	 * @param count The number of entries in the array.
+	 *
+	 * @return Zero on success, an @ref E_SQFS_ERROR identifier on failure
+	 *         that the data structures in libsquashfs that use this return
+	 *         directly to the caller.
+	 */
+	int (*read_batch)(sqfs_file_t *file, const sqfs_file_io_t *io,
+			  size_t count);
+
+	/**
+	 * @brief Write a number of chunks of data at once.
+	 *
+	 * This is optional and can be NULL. Works like
+	 * @ref sqfs_file_t::read_batch, but for @ref sqfs_file_t::write_at.
+	 *
+	 * @param file A pointer to the file object.
+	 * @param io An array of transfers to carry out.
+	 * @param count The number of entries in the array.
+	 *
+	 * @return Zero on success, an @ref E_SQFS_ERROR identifier on failure
+	 *         that the data structures in libsquashfs that use this return
+	 *         directly to the caller.
+	 */
+	int (*write_batch)(sqfs_file_t *file, const sqfs_file_io_t *io,
+			   size_t count);
+
+	/**
+	 * @brief Write out data that the file object is still holding back.
+	 *
+	 * This is optional and can be NULL if the file object never holds
+	 * data back and has no way to sync it to the storage device. Use
+	 * @ref sqfs_file_flush instead of calling this directly.
+	 *
+	 * @param file A pointer to the file object.
+	 * @param flags A set of @ref E_SQFS_FILE_FLUSH_FLAGS.
+	 *
+	 * @return Zero on success, an @ref E_SQFS_ERROR identifier on failure.
+	 */
+	int (*flush)(sqfs_file_t *file, sqfs_u32 flags);
 };
 
 #ifdef __cplusplus
@@ -134,6 +302,16 @@ extern "C" {
  * On Unix-like systems, if the open call fails, this function makes sure to
  * preserves the value in errno indicating the underlying problem.
  *
+ * On Unix-like systems, data appended to a file opened for writing is
+ * collected in a buffer and written out in large chunks. Reading, writing
+ * anywhere but the end of the file or truncating the file past the buffer
+ * flushes it first. Whatever is still buffered when the file is destroyed
+ * is written out as well, but errors can no longer be reported at that
+ * point, so anything that writes a file must call @ref sqfs_file_flush and
+ * check the result before destroying it. If writing the buffer fails, it is
+ * kept and written again by the next flush. On Windows, appends are not
+ * buffered.
+ *
  * @param filename The name of the file to open.
  * @param flags A set of @ref E_SQFS_FILE_OPEN_FLAGS.
  *
@@ -142,6 +320,70 @@ extern "C" {
  */
 SQFS_API sqfs_file_t *sqfs_open_file(const char *filename, sqfs_u32 flags);
 
+/**
+ * @brief Create a read only file object for an image in memory
+ *
+ * The buffer is not copied and must stay valid and unchanged until the file
+ * object is destroyed. The file object implements
+ * @ref sqfs_file_t::map_at, so the readers in libsquashfs decompress data
+ * straight from the buffer. Writing to or truncating the file fails with
+ * @ref SQFS_ERROR_IO.
+ *
+ * @param data A pointer to the image data.
+ * @param size The size of the image in bytes.
+ *
+ * @return A pointer to a file object on success, NULL on allocation failure
+ *         or if data is NULL and size is not zero.
+ */
+SQFS_API sqfs_file_t *sqfs_open_memory(const void *data, size_t size);
+
+/**
+ * @brief Create an empty, growable file object that is kept in memory
+ *
+ * The file can be written to anywhere, writing past the end grows it and
+ * fills any gap with zero bytes. Once written, the image can be accessed
+ * using @ref sqfs_memory_file_get_data, or read back through the file
+ * object.
+ *
+ * @param size_hint An estimate of the final size, so the buffer does not
+ *                  have to be grown repeatedly. Can be zero.
+ *
+ * @return A pointer to a file object on success, NULL on allocation failure.
+ */
+SQFS_API sqfs_file_t *sqfs_create_memory_file(size_t size_hint);
+
+/**
+ * @brief Get the contents of a file object created by
+ *        @ref sqfs_create_memory_file or @ref sqfs_open_memory
+ *
+ * The returned pointer is only valid until the file is written to,
+ * truncated or destroyed.
+ *
+ * @param file A pointer to the file object.
+ * @param data Returns a pointer to the data. Can be NULL for an empty file.
+ * @param size Returns the size of the file in bytes.
+ *
+ * @return Zero on success, @ref SQFS_ERROR_UNSUPPORTED if the file object
+ *         is not a memory file.
+ */
+SQFS_API int sqfs_memory_file_get_data(const sqfs_file_t *file,
+				       const void **data, size_t *size);
+
+/**
+ * @brief Write out everything that a file object is still holding back
+ *
+ * Calls @ref sqfs_file_t::flush if the file object implements it. Anything
+ * that writes a file should call this before destroying it, since errors
+ * that happen while destroying a file object cannot be reported.
+ *
+ * @param file A pointer to the file object.
+ * @param flags A set of @ref E_SQFS_FILE_FLUSH_FLAGS.
+ *
+ * @return Zero on success, @ref SQFS_ERROR_UNSUPPORTED if an unknown flag
+ *         is set, an @ref E_SQFS_ERROR identifier if writing failed.
+ */
+SQFS_API int sqfs_file_flush(sqfs_file_t *file, sqfs_u32 flags);
+
 #ifdef __cplusplus
 }
 #endif
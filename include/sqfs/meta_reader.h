@@ -45,6 +45,22 @@
  * from disk and reading transparently across block boarders if required.
  */
 
+/**
+ * @struct sqfs_meta_cache_t
+ *
+ * @brief A cache of uncompressed meta data blocks.
+ *
+ * The cache holds a fixed number of uncompressed meta data blocks, keyed
+ * by their absolute location in the image, and replaces the least recently
+ * used one when full. It can be attached to any number of meta data readers
+ * working on the same file (e.g. one for the inode table and one for the
+ * directory table), so that blocks already uncompressed by one reader can
+ * be reused by all the others.
+ *
+ * The cache itself does no locking, so all readers attached to it have to
+ * be used from the same thread.
+ */
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -78,6 +94,139 @@ SQFS_API sqfs_meta_reader_t *sqfs_meta_reader_create(sqfs_file_t *file,
  */
 SQFS_API void sqfs_meta_reader_destroy(sqfs_meta_reader_t *m);
 
+/**
+ * @brief Create a cache for uncompressed meta data blocks.
+ *
+ * @memberof sqfs_meta_cache_t
+ *
+ * @param count The maximum number of blocks to keep in memory.
+ *
+ * @return A pointer to a cache on success, NULL on allocation failure
+ *         or if the count is zero.
+ */
+SQFS_API sqfs_meta_cache_t *sqfs_meta_cache_create(size_t count);
+
+/**
+ * @brief Uncompress a whole meta data table into a cache.
+ *
+ * @memberof sqfs_meta_cache_t
+ *
+ * The entire range of the image is read into memory at once and the meta
+ * data blocks in it are uncompressed, optionally on a number of threads.
+ * The resulting cache is exactly large enough to hold all of them, so a
+ * meta data reader attached to it never has to touch the file again.
+ *
+ * The file is only accessed from the calling thread. If libsquashfs was
+ * compiled without thread support, the blocks are uncompressed on the
+ * calling thread.
+ *
+ * @param out Returns a pointer to the cache on success.
+ * @param file A pointer to a file object to read from.
+ * @param cmp A compressor to use for unpacking compressed meta data blocks.
+ *            Each additional thread works on a copy of it.
+ * @param start The absolute location of the first meta data block.
+ * @param limit The end of the table, i.e. the location after the last
+ *              meta data block.
+ * @param num_workers The number of threads to use, including the calling
+ *                    thread.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_meta_cache_load(sqfs_meta_cache_t **out, sqfs_file_t *file,
+				  sqfs_compressor_t *cmp, sqfs_u64 start,
+				  sqfs_u64 limit, unsigned int num_workers);
+
+/**
+ * @brief Destroy a meta data block cache and free all memory used by it.
+ *
+ * @memberof sqfs_meta_cache_t
+ *
+ * All meta data readers using the cache must have been destroyed or
+ * detached from it first.
+ *
+ * @param cache A pointer to a cache or NULL.
+ */
+SQFS_API void sqfs_meta_cache_destroy(sqfs_meta_cache_t *cache);
+
+/**
+ * @brief Attach a meta data reader to a shared block cache.
+ *
+ * @memberof sqfs_meta_reader_t
+ *
+ * Instead of uncompressing a block into an internal buffer, the reader
+ * looks it up in the cache first and otherwise uncompresses it into a
+ * cache entry, where other readers attached to the same cache can find it.
+ *
+ * The cache is not owned by the reader and has to outlive it, or the
+ * reader has to be detached first. The current position of the reader is
+ * lost and it has to be seeked again afterwards.
+ *
+ * @param m A pointer to a meta data reader.
+ * @param cache A pointer to a cache, or NULL to detach the reader.
+ */
+SQFS_API void sqfs_meta_reader_set_cache(sqfs_meta_reader_t *m,
+					 sqfs_meta_cache_t *cache);
+
+/**
+ * @brief Keep a number of recently used, uncompressed blocks in memory.
+ *
+ * @memberof sqfs_meta_reader_t
+ *
+ * By default, a meta data reader only keeps the current block around and
+ * has to read and uncompress a block again when seeking back to it. With a
+ * cache, the least recently used block is replaced instead. This helps
+ * with random access patterns, e.g. looking up many paths.
+ *
+ * This is a short hand for creating a private @ref sqfs_meta_cache_t that
+ * is owned and destroyed by the reader.
+ *
+ * @param m A pointer to a meta data reader.
+ * @param count The number of blocks to cache, or 0 to disable the cache.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_meta_reader_set_cache_size(sqfs_meta_reader_t *m,
+					     size_t count);
+
+/**
+ * @brief Read ahead when walking through a table front to back.
+ *
+ * @memberof sqfs_meta_reader_t
+ *
+ * Once the reader moves on from one block to the one right after it, the
+ * following blocks are fetched with a single read and uncompressed in the
+ * background, if libsquashfs was built with thread support. Seeking
+ * elsewhere reads single blocks again, until the reader moves on
+ * sequentially from there.
+ *
+ * The window takes about 16 KiB of memory per block.
+ *
+ * @param m A pointer to a meta data reader.
+ * @param count The number of blocks to read ahead, or 0 to disable it.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_meta_reader_set_readahead(sqfs_meta_reader_t *m,
+					    size_t count);
+
+/**
+ * @brief Allocate decoded inodes and directory entries through user
+ *        supplied hooks.
+ *
+ * @memberof sqfs_meta_reader_t
+ *
+ * This affects @ref sqfs_meta_reader_read_inode and
+ * @ref sqfs_meta_reader_read_dir_ent. The objects they return must then be
+ * released through the free hook of the allocator instead of free(). The
+ * allocator can be changed at any time and only affects objects read after
+ * that.
+ *
+ * @param m A pointer to a meta data reader.
+ * @param allocator The allocator to use, or NULL for the standard library.
+ */
+SQFS_API void sqfs_meta_reader_set_allocator(sqfs_meta_reader_t *m,
+					     const sqfs_allocator_t *allocator);
+
 /**
  * @brief Seek to a specific meta data block and offset.
  *
@@ -184,6 +333,39 @@ int sqfs_meta_reader_read_inode(sqfs_meta_reader_t *ir,
 				sqfs_u64 block_start, size_t offset,
 				sqfs_inode_generic_t **out);
 
+/**
+ * @brief Read the encoded bytes of an inode, without decoding them.
+ *
+ * @memberof sqfs_meta_reader_t
+ *
+ * The inode is copied exactly as stored in the inode table, in little
+ * endian byte order and including the variable sized parts, e.g. the block
+ * list of a file. Two inodes with the same encoding are identical, so
+ * comparing them this way is a lot cheaper than decoding them first.
+ *
+ * If the buffer is too small, as much of the inode is copied as fits, the
+ * size that is actually needed is still returned and the function fails
+ * with @ref SQFS_ERROR_OVERFLOW. The caller can then retry with a larger
+ * buffer.
+ *
+ * @param ir A pointer to a meta data reader.
+ * @param super A pointer to the super block, required for figuring out the
+ *              size of file inodes.
+ * @param block_start The meta data block to seek to for reading the inode.
+ * @param offset A byte offset within the uncompressed block where the
+ *               inode is.
+ * @param buffer A buffer to copy the encoded inode to.
+ * @param max The size of the buffer in bytes.
+ * @param size Returns the size of the encoded inode in bytes.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API
+int sqfs_meta_reader_read_raw_inode(sqfs_meta_reader_t *ir,
+				    const sqfs_super_t *super,
+				    sqfs_u64 block_start, size_t offset,
+				    void *buffer, size_t max, size_t *size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -176,6 +176,26 @@ SQFS_API void sqfs_meta_writer_reset(sqfs_meta_writer_t *m);
  */
 SQFS_API int sqfs_meta_write_write_to_file(sqfs_meta_writer_t *m);
 
+/**
+ * @brief Allocate the blocks that are kept in memory through user supplied
+ *        hooks.
+ *
+ * @memberof sqfs_meta_writer_t
+ *
+ * Only relevant if the meta writer was created with the flag set to store
+ * blocks in memory. Each block is then held in an allocation of its on-disk
+ * size until @ref sqfs_meta_write_write_to_file is called.
+ *
+ * @param m A pointer to a meta data writer.
+ * @param allocator The allocator to use, or NULL for the standard library.
+ *                  It must outlive the meta writer.
+ *
+ * @return Zero on success, @ref SQFS_ERROR_UNSUPPORTED if blocks are
+ *         currently held in memory.
+ */
+SQFS_API int sqfs_meta_writer_set_allocator(sqfs_meta_writer_t *m,
+					    const sqfs_allocator_t *allocator);
+
 /**
  * @brief A convenience function for encoding and writing an inode
  *
@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * path_index.h - This file is part of libsquashfs
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef SQFS_PATH_INDEX_H
+#define SQFS_PATH_INDEX_H
+
+#include "sqfs/predef.h"
+
+/**
+ * @file path_index.h
+ *
+ * @brief Contains declarations for a path index stored next to an image.
+ */
+
+/**
+ * @struct sqfs_path_index_t
+ *
+ * @brief A hash table that maps full paths to inode references.
+ *
+ * Resolving a path with @ref sqfs_dir_reader_find_by_path reads and searches
+ * one directory per path component, each of which may require uncompressing
+ * meta data blocks. An application that looks up lots of paths in the same
+ * image can instead generate a path index when creating the image and store
+ * it in a separate file (a "sidecar"). @ref sqfs_dir_reader_find_by_index
+ * then reads the inode directly, with a single hash table lookup.
+ *
+ * The on-disk format is a header, followed by the hash buckets, the entries
+ * and the NUL terminated paths. All integers are little endian. The header
+ * records a few super block fields, so an index that belongs to a different
+ * image, or an older version of the same image, is rejected when loading.
+ *
+ * Paths are stored without leading, trailing or duplicate separators and
+ * the root directory has an empty path. Lookups accept the same paths as
+ * @ref sqfs_dir_reader_find_by_path.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Create an empty path index.
+ *
+ * @memberof sqfs_path_index_t
+ *
+ * @return A pointer to a path index on success, NULL on allocation failure.
+ */
+SQFS_API sqfs_path_index_t *sqfs_path_index_create(void);
+
+/**
+ * @brief Destroy a path index and free all memory used by it.
+ *
+ * @memberof sqfs_path_index_t
+ *
+ * @param index A pointer to a path index or NULL.
+ */
+SQFS_API void sqfs_path_index_destroy(sqfs_path_index_t *index);
+
+/**
+ * @brief Add a path to an index.
+ *
+ * @memberof sqfs_path_index_t
+ *
+ * Adding the same path twice is not detected, lookups return either one of
+ * the inode references.
+ *
+ * @param index A pointer to a path index.
+ * @param path The full path of a file in the image.
+ * @param inode_ref The reference of its inode, i.e. the start of the meta
+ *                  data block relative to the inode table, shifted left by
+ *                  16 and ored with the offset into the uncompressed block.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_path_index_add(sqfs_path_index_t *index, const char *path,
+				 sqfs_u64 inode_ref);
+
+/**
+ * @brief Write a path index to a file.
+ *
+ * @memberof sqfs_path_index_t
+ *
+ * The index is written to the start of the file and can be looked up in
+ * afterwards. The file is flushed with @ref sqfs_file_flush at the end, so
+ * the file object can be destroyed right away.
+ *
+ * @param index A pointer to a path index.
+ * @param file The file to write to.
+ * @param super A pointer to the super block of the image, after writing all
+ *              tables, i.e. with the final size filled in.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_path_index_write(sqfs_path_index_t *index,
+				   sqfs_file_t *file,
+				   const sqfs_super_t *super);
+
+/**
+ * @brief Load a path index from a file.
+ *
+ * @memberof sqfs_path_index_t
+ *
+ * @param out Returns a pointer to the index on success.
+ * @param file The file to read from.
+ * @param super A pointer to the super block of the image that the index is
+ *              used with.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure,
+ *         @ref SQFS_ERROR_CORRUPTED if the file is not a valid path index
+ *         or was not written for the given image.
+ */
+SQFS_API int sqfs_path_index_load(sqfs_path_index_t **out, sqfs_file_t *file,
+				  const sqfs_super_t *super);
+
+/**
+ * @brief Get the inode reference for a path.
+ *
+ * @memberof sqfs_path_index_t
+ *
+ * @param index A pointer to a path index that has been loaded or written.
+ * @param path The path to look up. Forward or backward slashes can be used
+ *             to seperate path components.
+ * @param out Returns the inode reference on success.
+ *
+ * @return Zero on success, @ref SQFS_ERROR_NO_ENTRY if the index has no
+ *         entry for the path.
+ */
+SQFS_API int sqfs_path_index_lookup(const sqfs_path_index_t *index,
+				    const char *path, sqfs_u64 *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SQFS_PATH_INDEX_H */
@@ -69,19 +69,32 @@ typedef int64_t sqfs_s64;
 
 typedef struct sqfs_block_t sqfs_block_t;
 typedef struct sqfs_data_writer_t sqfs_data_writer_t;
+typedef struct sqfs_data_stream_t sqfs_data_stream_t;
 typedef struct sqfs_compressor_config_t sqfs_compressor_config_t;
 typedef struct sqfs_compressor_t sqfs_compressor_t;
+typedef struct sqfs_compressor_job_t sqfs_compressor_job_t;
+typedef struct sqfs_allocator_t sqfs_allocator_t;
 typedef struct sqfs_dir_writer_t sqfs_dir_writer_t;
 typedef struct sqfs_dir_reader_t sqfs_dir_reader_t;
 typedef struct sqfs_id_table_t sqfs_id_table_t;
 typedef struct sqfs_meta_reader_t sqfs_meta_reader_t;
+typedef struct sqfs_meta_cache_t sqfs_meta_cache_t;
 typedef struct sqfs_meta_writer_t sqfs_meta_writer_t;
 typedef struct sqfs_xattr_reader_t sqfs_xattr_reader_t;
 typedef struct sqfs_file_t sqfs_file_t;
+typedef struct sqfs_file_io_t sqfs_file_io_t;
 typedef struct sqfs_tree_node_t sqfs_tree_node_t;
+typedef struct sqfs_tree_arena_t sqfs_tree_arena_t;
 typedef struct sqfs_data_reader_t sqfs_data_reader_t;
+typedef struct sqfs_data_request_t sqfs_data_request_t;
 typedef struct sqfs_block_hooks_t sqfs_block_hooks_t;
+typedef struct sqfs_trace_hooks_t sqfs_trace_hooks_t;
+typedef struct sqfs_data_writer_timing_t sqfs_data_writer_timing_t;
+typedef struct sqfs_data_writer_stats_t sqfs_data_writer_stats_t;
+typedef struct sqfs_data_writer_worker_stats_t sqfs_data_writer_worker_stats_t;
 typedef struct sqfs_xattr_writer_t sqfs_xattr_writer_t;
+typedef struct sqfs_thread_pool_t sqfs_thread_pool_t;
+typedef struct sqfs_path_index_t sqfs_path_index_t;
 
 typedef struct sqfs_fragment_t sqfs_fragment_t;
 typedef struct sqfs_dir_header_t sqfs_dir_header_t;
@@ -104,5 +117,6 @@ typedef struct sqfs_xattr_entry_t sqfs_xattr_entry_t;
 typedef struct sqfs_xattr_value_t sqfs_xattr_value_t;
 typedef struct sqfs_xattr_id_t sqfs_xattr_id_t;
 typedef struct sqfs_xattr_id_table_t sqfs_xattr_id_table_t;
+typedef struct sqfs_xattr_set_t sqfs_xattr_set_t;
 
 #endif /* SQFS_PREDEF_H */
@@ -303,6 +303,24 @@ SQFS_API int sqfs_super_init(sqfs_super_t *super, size_t block_size,
  */
 SQFS_API int sqfs_super_write(const sqfs_super_t *super, sqfs_file_t *file);
 
+/**
+ * @brief Encode a SquashFS super block and write it to an arbitrary location.
+ *
+ * @memberof sqfs_super_t
+ *
+ * This works like @ref sqfs_super_write, but the encoded super block can be
+ * placed somewhere else than at the start of the file, e.g. when an image is
+ * written to an output that cannot go back to the start.
+ *
+ * @param super A pointer to the super block structure to write.
+ * @param file A file object through which to access the filesystem image.
+ * @param offset The byte offset to write the super block to.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_super_write_at(const sqfs_super_t *super, sqfs_file_t *file,
+				 sqfs_u64 offset);
+
 /**
  * @brief Read a SquashFS super block from disk, decode it and check the fields
  *
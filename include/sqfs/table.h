@@ -52,6 +52,31 @@ SQFS_API int sqfs_write_table(sqfs_file_t *file, sqfs_compressor_t *cmp,
 			      const void *data, size_t table_size,
 			      sqfs_u64 *start);
 
+/**
+ * @brief Write a table to disk, compressing the blocks in parallel.
+ *
+ * This does the same as @ref sqfs_write_table, except that the meta data
+ * blocks are compressed by multiple threads (if libsquashfs was compiled
+ * with thread support) and then written to the file in a single call.
+ * The output is identical to that of @ref sqfs_write_table.
+ *
+ * @param file The output file to write to.
+ * @param cmp A compressor to use for compressing the meta data blocks.
+ *            The extra threads use copies of it.
+ * @param data A pointer to a array to divide into blocks and write to disk.
+ * @param table_size The size of the input array in bytes.
+ * @param start Returns the absolute position of the location list.
+ * @param num_workers The maximum number of threads to use, including the
+ *                    calling thread.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_write_table_parallel(sqfs_file_t *file,
+				       sqfs_compressor_t *cmp,
+				       const void *data, size_t table_size,
+				       sqfs_u64 *start,
+				       unsigned int num_workers);
+
 /**
  * @brief Read a table from a SquashFS filesystem.
  *
@@ -82,6 +107,36 @@ SQFS_API int sqfs_read_table(sqfs_file_t *file, sqfs_compressor_t *cmp,
 			     sqfs_u64 lower_limit, sqfs_u64 upper_limit,
 			     void **out);
 
+/**
+ * @brief Read a table from a SquashFS filesystem, uncompressing the blocks
+ *        in parallel.
+ *
+ * This does the same as @ref sqfs_read_table, except that once all meta
+ * data blocks have been read from the calling thread, they are uncompressed
+ * by multiple threads (if libsquashfs was compiled with thread support).
+ *
+ * @param file An input file to read from.
+ * @param cmp A compressor to use for uncompressing the meta data block.
+ *            The extra threads use copies of it.
+ * @param table_size The size of the entire array in bytes.
+ * @param location The absolute position of the location list.
+ * @param lower_limit The lowest "sane" position at which to expect a meta
+ *                    data block.
+ * @param upper_limit The highest "sane" position at which to expect a meta
+ *                    data block.
+ * @param out Returns a pointer to the table in memory.
+ * @param num_workers The maximum number of threads to use, including the
+ *                    calling thread.
+ *
+ * @return Zero on success, an @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_read_table_parallel(sqfs_file_t *file,
+				      sqfs_compressor_t *cmp,
+				      size_t table_size, sqfs_u64 location,
+				      sqfs_u64 lower_limit,
+				      sqfs_u64 upper_limit, void **out,
+				      unsigned int num_workers);
+
 #ifdef __cplusplus
 }
 #endif
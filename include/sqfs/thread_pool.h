@@ -0,0 +1,138 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * thread_pool.h - This file is part of libsquashfs
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef SQFS_THREAD_POOL_H
+#define SQFS_THREAD_POOL_H
+
+#include "sqfs/predef.h"
+
+/**
+ * @file thread_pool.h
+ *
+ * @brief Contains declarations for a thread pool that all libsquashfs
+ *        objects of a process can share.
+ */
+
+/**
+ * @struct sqfs_thread_pool_t
+ *
+ * @brief A set of threads that runs work for libsquashfs objects.
+ *
+ * By default, every object that uses threads creates its own, e.g. the
+ * compressor workers of a @ref sqfs_data_writer_t, the read ahead workers of
+ * a @ref sqfs_data_reader_t and the helpers that compress or uncompress
+ * tables. A process that uses several of them, one after another or at the
+ * same time, easily ends up with more busy threads than CPUs, or with idle
+ * CPUs while the data writer's workers wait for blocks that never come
+ * because the application is busy writing the meta data.
+ *
+ * If a pool is registered with @ref sqfs_set_thread_pool, objects take their
+ * threads from it instead. The size of the pool limits how many of them work
+ * at the same time. Long running workers, like the ones of the data writer,
+ * always get a thread, but while they wait for work, they leave their share
+ * to others. Short lived helpers only run if the pool has a share to spare,
+ * otherwise the thread that needs them does the work on its own.
+ *
+ * Without thread support in libsquashfs, a pool has no threads and runs
+ * everything submitted to it right away, on the calling thread.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Create a thread pool.
+ *
+ * @memberof sqfs_thread_pool_t
+ *
+ * Threads are only created once there is something for them to do and are
+ * kept around for reuse until the pool is destroyed.
+ *
+ * @param num_threads The number of threads that may work at the same time,
+ *                    typically the number of CPUs available to the process.
+ *                    Values below 1 are treated as 1.
+ *
+ * @return A pointer to a thread pool on success, NULL on allocation failure.
+ */
+SQFS_API sqfs_thread_pool_t *sqfs_thread_pool_create(unsigned int num_threads);
+
+/**
+ * @brief Destroy a thread pool.
+ *
+ * @memberof sqfs_thread_pool_t
+ *
+ * Waits until all work submitted with @ref sqfs_thread_pool_submit is done
+ * and all threads have exited. Objects that took threads from the pool must
+ * be destroyed before and the pool must no longer be registered with
+ * @ref sqfs_set_thread_pool.
+ *
+ * @param pool A pointer to a thread pool.
+ */
+SQFS_API void sqfs_thread_pool_destroy(sqfs_thread_pool_t *pool);
+
+/**
+ * @brief Get the number of threads that may work at the same time.
+ *
+ * @memberof sqfs_thread_pool_t
+ *
+ * @param pool A pointer to a thread pool.
+ *
+ * @return The value passed to @ref sqfs_thread_pool_create, or 0 if
+ *         libsquashfs has no thread support.
+ */
+SQFS_API unsigned int
+sqfs_thread_pool_get_num_threads(const sqfs_thread_pool_t *pool);
+
+/**
+ * @brief Run a function on one of the threads of a pool.
+ *
+ * @memberof sqfs_thread_pool_t
+ *
+ * The function is queued up and runs as soon as the pool has a thread to
+ * spare. Functions are started in the order they are submitted, but can
+ * run in parallel and finish in any order.
+ *
+ * @param pool A pointer to a thread pool.
+ * @param fn The function to call.
+ * @param user A pointer passed to the function.
+ *
+ * @return Zero on success, @ref SQFS_ERROR_ALLOC on allocation failure.
+ */
+SQFS_API int sqfs_thread_pool_submit(sqfs_thread_pool_t *pool,
+				     void (*fn)(void *user), void *user);
+
+/**
+ * @brief Register a process wide thread pool for libsquashfs objects.
+ *
+ * Objects created afterwards take their threads from the pool, instead of
+ * creating their own. Works the same way as @ref sqfs_set_trace_hooks, the
+ * pool should be registered before creating any objects and must not be
+ * changed or removed while they are in use.
+ *
+ * @param pool A pointer to a thread pool, or NULL to go back to every object
+ *             creating its own threads.
+ */
+SQFS_API void sqfs_set_thread_pool(sqfs_thread_pool_t *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SQFS_THREAD_POOL_H */
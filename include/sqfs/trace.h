@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * trace.h - This file is part of libsquashfs
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef SQFS_TRACE_H
+#define SQFS_TRACE_H
+
+#include "sqfs/predef.h"
+
+/**
+ * @file trace.h
+ *
+ * @brief Contains declarations for recording what libsquashfs is doing
+ *        on which thread, and when.
+ */
+
+/**
+ * @struct sqfs_trace_hooks_t
+ *
+ * @brief A sink for trace events.
+ *
+ * If a sink is registered with @ref sqfs_set_trace_hooks, libsquashfs
+ * reports spans of work on all of its threads through it, e.g. compressing
+ * or uncompressing a block in a worker thread, waiting for the workers,
+ * writing out blocks, flushing meta data blocks or writing tables.
+ * Applications can add their own spans with @ref sqfs_trace_begin and
+ * @ref sqfs_trace_end.
+ *
+ * The callbacks are never called concurrently, so they do not need to be
+ * thread safe. Spans on the same thread are properly nested.
+ */
+struct sqfs_trace_hooks_t {
+	/**
+	 * @brief Set this to the size of the struct.
+	 *
+	 * Works the same way as @ref sqfs_block_hooks_t::size.
+	 */
+	size_t size;
+
+	/**
+	 * @brief Gets called when a span starts.
+	 *
+	 * @param user The user pointer passed to @ref sqfs_set_trace_hooks.
+	 * @param thread A number identifying the thread. Threads are numbered
+	 *               in the order they first report something, starting
+	 *               at 1.
+	 * @param time_ns A monotonic time stamp in nanoseconds. Only the
+	 *                difference between two time stamps is meaningful.
+	 * @param category A static string naming the part of the library or
+	 *                 application that reports the span.
+	 * @param name A static string describing the span.
+	 */
+	void (*begin)(void *user, sqfs_u32 thread, sqfs_u64 time_ns,
+		      const char *category, const char *name);
+
+	/**
+	 * @brief Gets called when a span ends.
+	 *
+	 * The arguments are the same as for @ref begin.
+	 */
+	void (*end)(void *user, sqfs_u32 thread, sqfs_u64 time_ns,
+		    const char *category, const char *name);
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Register a process wide sink for trace events.
+ *
+ * Trace events are reported from all threads, for all libsquashfs objects.
+ * The sink should be registered before creating any of them and must not
+ * be changed or removed while they are in use.
+ *
+ * @param user A user pointer passed to the callbacks.
+ * @param hooks A pointer to the callbacks, or NULL to remove the sink.
+ *
+ * @return Zero on success, @ref SQFS_ERROR_UNSUPPORTED if the size field
+ *         does not match.
+ */
+SQFS_API int sqfs_set_trace_hooks(void *user,
+				  const sqfs_trace_hooks_t *hooks);
+
+/**
+ * @brief Report the start of a span on the calling thread.
+ *
+ * Does nothing if no sink is registered.
+ *
+ * @param category A string naming the part of the application that reports
+ *                 the span. Must stay valid until the sink has seen it.
+ * @param name A string describing the span. Must stay valid until the sink
+ *             has seen it.
+ */
+SQFS_API void sqfs_trace_begin(const char *category, const char *name);
+
+/**
+ * @brief Report the end of a span on the calling thread.
+ *
+ * Does nothing if no sink is registered.
+ *
+ * @param category The same category passed to @ref sqfs_trace_begin.
+ * @param name The same name passed to @ref sqfs_trace_begin.
+ */
+SQFS_API void sqfs_trace_end(const char *category, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SQFS_TRACE_H */
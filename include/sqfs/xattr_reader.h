@@ -59,7 +59,36 @@
  * to point the reader to the start of the key-value pairs and the call
  * @ref sqfs_xattr_reader_read_key and @ref sqfs_xattr_reader_read_value
  * consecutively to read and decode each key-value pair.
+ *
+ * Alternatively, @ref sqfs_xattr_reader_get_set returns all key-value pairs
+ * of an index at once and caches them, which is a lot cheaper if many inodes
+ * share the same set of extended attributes.
+ */
+
+/**
+ * @struct sqfs_xattr_set_t
+ *
+ * @brief A fully decoded set of key-value pairs
+ *
+ * Returned by @ref sqfs_xattr_reader_get_set. The pairs are in the order
+ * they are stored in, out-of-band values are already resolved.
  */
+struct sqfs_xattr_set_t {
+	/**
+	 * @brief The number of key-value pairs.
+	 */
+	size_t count;
+
+	/**
+	 * @brief An array of count decoded keys.
+	 */
+	sqfs_xattr_entry_t **keys;
+
+	/**
+	 * @brief An array of count decoded values, in the same order as keys.
+	 */
+	sqfs_xattr_value_t **values;
+};
 
 #ifdef __cplusplus
 extern "C" {
@@ -194,6 +223,32 @@ int sqfs_xattr_reader_read_value(sqfs_xattr_reader_t *xr,
 				 const sqfs_xattr_entry_t *key,
 				 sqfs_xattr_value_t **val_out);
 
+/**
+ * @brief Get all key-value pairs for an xattr index from an inode
+ *
+ * @memberof sqfs_xattr_reader_t
+ *
+ * The first time an index is requested, its descriptor is resolved and all
+ * key-value pairs are read and decoded. The result is kept in the reader, so
+ * every distinct set of extended attributes is only decoded once, no matter
+ * how many inodes refer to it.
+ *
+ * The returned set is owned by the reader and remains valid until the reader
+ * is destroyed. For an index of 0xFFFFFFFF, an empty set is returned.
+ *
+ * Decoding a set moves the position used by @ref sqfs_xattr_reader_read_key
+ * and @ref sqfs_xattr_reader_read_value, so a sequence of those has to be
+ * started over with @ref sqfs_xattr_reader_seek_kv afterwards.
+ *
+ * @param xr A pointer to an xattr reader instance.
+ * @param idx The xattr index to resolve.
+ * @param out Used to return a pointer to the decoded set.
+ *
+ * @return Zero on success, a negative @ref E_SQFS_ERROR value on failure.
+ */
+SQFS_API int sqfs_xattr_reader_get_set(sqfs_xattr_reader_t *xr, sqfs_u32 idx,
+				       const sqfs_xattr_set_t **out);
+
 #ifdef __cplusplus
 }
 #endif
@@ -9,6 +9,7 @@
 
 #include "config.h"
 #include "util/util.h"
+#include "fstream.h"
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -82,8 +83,16 @@ typedef struct {
 	sqfs_u64 actual_size;
 	sqfs_u64 record_size;
 	bool unknown_record;
+
+	/* link_target is the path of an earlier entry in the archive */
+	bool is_hard_link;
+
 	tar_xattr_t *xattr;
 
+	/* if set, the memory the xattr list was allocated from */
+	char *xattr_arena;
+	size_t xattr_used;
+
 	/* broken out since struct stat could contain
 	   32 bit values on 32 bit systems. */
 	sqfs_s64 mtime;
@@ -118,41 +127,32 @@ typedef struct {
   The counter is an incremental record counter used if additional
   headers need to be generated.
 */
-int write_tar_header(int fd, const struct stat *sb, const char *name,
+int write_tar_header(ostream_t *fp, const struct stat *sb, const char *name,
 		     const char *slink_target, const tar_xattr_t *xattr,
 		     unsigned int counter);
 
 /* calcuate and skip the zero padding */
-int skip_padding(int fd, sqfs_u64 size);
+int skip_padding(istream_t *fp, sqfs_u64 size);
 
 /* round up to block size and skip the entire entry */
-int skip_entry(int fd, sqfs_u64 size);
+int skip_entry(istream_t *fp, sqfs_u64 size);
 
-int read_header(int fd, tar_header_decoded_t *out);
+int read_header(istream_t *fp, tar_header_decoded_t *out);
 
 void clear_header(tar_header_decoded_t *hdr);
 
 /*
-  Write zero bytes to an output file to padd it to the tar record size.
+  Write zero bytes to an output stream to padd it to the tar record size.
   Returns 0 on success. On failure, prints error message to stderr.
 */
-int padd_file(int outfd, sqfs_u64 size);
+int padd_file(ostream_t *fp, sqfs_u64 size);
 
 
 /*
-  A wrapper around the read() system call. It retries the read if it is
-  interrupted by a signal or less than the desired size was read. Returns 0
-  on success. Writes to stderr on failure using 'errstr' as a perror style
-  error prefix.
-*/
-int read_retry(const char *errstr, int fd, void *buffer, size_t size);
-
-/*
-  A wrapper around the write() system call. It retries the write if it is
-  interrupted by a signal or only part of the data was written. Returns 0
-  on success. Writes to stderr on failure using 'errstr' as a perror style
-  error prefix.
+  Read exactly the desired size from an input stream, hitting the end of
+  the stream is treated as an error. Returns 0 on success. Writes to stderr
+  on failure using 'errstr' as a perror style error prefix.
 */
-int write_retry(const char *errstr, int fd, const void *data, size_t size);
+int read_retry(const char *errstr, istream_t *fp, void *buffer, size_t size);
 
 #endif /* TAR_H */
@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * cpu.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef UTIL_CPU_H
+#define UTIL_CPU_H
+
+#include "sqfs/predef.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Instruction set extensions that some of the kernels below can use. */
+enum {
+	CPU_FEATURE_SSE2 = 0x0001,
+	CPU_FEATURE_SSSE3 = 0x0002,
+	CPU_FEATURE_SSE42 = 0x0004,
+	CPU_FEATURE_PCLMUL = 0x0008,
+	CPU_FEATURE_AVX2 = 0x0010,
+
+	CPU_FEATURE_NEON = 0x0100,
+	CPU_FEATURE_ARM_CRC32 = 0x0200,
+	CPU_FEATURE_ARM_PMULL = 0x0400,
+};
+
+/* Small, hot functions that have implementations for several instruction
+   sets. The best ones for the CPU we run on are picked once at startup, so
+   generic builds still use the vector units of the machine.
+
+   All of them accept unaligned input of any size. */
+typedef struct {
+	/* Returns true if all bytes in the buffer are zero. */
+	bool (*is_zero)(const void *data, size_t size);
+
+	/* Sum of all bytes in the buffer, each taken as an unsigned value. */
+	sqfs_u32 (*byte_sum)(const void *data, size_t size);
+
+	/* Decode the leading groups of 4 characters of a base64 string as long
+	   as they only contain characters from the standard alphabet. Returns
+	   the number of characters consumed, the caller handles the rest. May
+	   consume none at all. */
+	size_t (*base64_decode)(sqfs_u8 *out, const char *in, size_t len);
+} cpu_kernels_t;
+
+/* The kernels selected for this CPU, set up before main is entered. */
+SQFS_INTERNAL extern cpu_kernels_t cpu_kernels;
+
+/* Get a combination of CPU_FEATURE_* flags that this CPU supports. */
+SQFS_INTERNAL unsigned int cpu_features(void);
+
+/* Fill a kernel table using only the given subset of CPU_FEATURE_* flags.
+   Zero always gives the portable C versions, which is handy for testing. */
+SQFS_INTERNAL void cpu_kernels_select(cpu_kernels_t *out,
+				      unsigned int features);
+
+#endif /* UTIL_CPU_H */
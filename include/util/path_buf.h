@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * path_buf.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef PATH_BUF_H
+#define PATH_BUF_H
+
+#include "sqfs/predef.h"
+
+/* A path that is built up while walking down a tree. A depth first
+   traversal pushes the name of a node before visiting it and truncates
+   the path back to the previous length afterwards, instead of assembling
+   the full path from the parent pointers for every node.
+
+   The string is always null terminated. */
+typedef struct {
+	char *str;
+	size_t len;
+	size_t max;
+} path_buf_t;
+
+/* Initialize the buffer with a copy of a prefix, which may be empty.
+   Returns 0 on success or SQFS_ERROR_ALLOC. */
+SQFS_INTERNAL int path_buf_init(path_buf_t *pb, const char *prefix);
+
+SQFS_INTERNAL void path_buf_cleanup(path_buf_t *pb);
+
+/* Append a path component of a given length. A slash is inserted in front
+   of it, unless the path is empty or already ends with one.
+   Returns 0 on success or SQFS_ERROR_ALLOC. */
+SQFS_INTERNAL int path_buf_push(path_buf_t *pb, const char *name, size_t len);
+
+/* Cut the path back to a length it had before, i.e. remove everything
+   that was pushed since. */
+SQFS_INTERNAL void path_buf_truncate(path_buf_t *pb, size_t len);
+
+#endif /* PATH_BUF_H */
@@ -9,26 +9,36 @@
 
 #include "sqfs/predef.h"
 
-typedef struct str_bucket_t {
-	struct str_bucket_t *next;
-	char *str;
+typedef struct {
+	size_t len;
 	size_t index;
 	size_t refcount;
+	char str[];
 } str_bucket_t;
 
+typedef struct {
+	sqfs_u64 hash;
+	str_bucket_t *bucket;
+} str_slot_t;
+
 /* Stores strings in a hash table and assigns an incremental, unique ID to
    each string. Subsequent additions return the existing ID. The ID can be
-   used for (hopefully) constant time lookup of the original string. */
+   used for constant time lookup of the original string.
+
+   The hash table uses open addressing with linear probing and is kept at
+   most half full. The hash and length of each string is kept inline, so
+   most mismatches are rejected without touching the string itself. */
 typedef struct {
-	str_bucket_t **buckets;
-	size_t num_buckets;
+	str_slot_t *slots;
+	size_t num_slots;
 
-	char **strings;
+	str_bucket_t **strings;
 	size_t num_strings;
 	size_t max_strings;
 } str_table_t;
 
-/* `size` is the number of hash table buckets to use internally. */
+/* `size` is the number of strings to make room for initially. The table
+   grows as needed. */
 SQFS_INTERNAL int str_table_init(str_table_t *table, size_t size);
 
 SQFS_INTERNAL void str_table_cleanup(str_table_t *table);
@@ -37,11 +47,29 @@ SQFS_INTERNAL void str_table_cleanup(str_table_t *table);
 SQFS_INTERNAL
 int str_table_get_index(str_table_t *table, const char *str, size_t *idx);
 
+/* Get a pointer to a stored copy of a string, given its length, adding
+   it if it is not in the table yet. The pointer stays valid until the table
+   is cleaned up. Returns NULL on allocation failure. */
+SQFS_INTERNAL
+const char *str_table_intern(str_table_t *table, const char *str, size_t len);
+
+/* Same as str_table_get_index, but for a binary blob of a given size that
+   may contain null bytes. */
+SQFS_INTERNAL int str_table_get_blob_index(str_table_t *table,
+					   const void *data, size_t size,
+					   size_t *idx);
+
 /* Resolve a unique ID to the string it represents.
    Returns NULL if the ID is unknown, i.e. out of bounds. */
 SQFS_INTERNAL
 const char *str_table_get_string(str_table_t *table, size_t index);
 
+/* Resolve a unique ID to the blob it represents and its size.
+   Returns NULL if the ID is unknown, i.e. out of bounds. */
+SQFS_INTERNAL
+const void *str_table_get_blob(str_table_t *table, size_t index,
+			       size_t *size);
+
 SQFS_INTERNAL void str_table_reset_ref_count(str_table_t *table);
 
 SQFS_INTERNAL void str_table_add_ref(str_table_t *table, size_t index);
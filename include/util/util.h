@@ -64,4 +64,28 @@ void *alloc_array(size_t item_size, size_t nmemb);
 */
 SQFS_INTERNAL int canonicalize_name(char *filename);
 
+/*
+  Compute a 64 bit xxHash (XXH64 with a seed of 0) of a block of memory.
+
+  Unlike a CRC32, this is strong enough to reasonably confirm that two
+  chunks of data with matching digests are actually identical.
+*/
+SQFS_INTERNAL sqfs_u64 xxh64(const void *data, size_t size);
+
+/*
+  Read a monotonic clock, in nanoseconds since some arbitrary point in
+  the past. Only the difference between two readings is meaningful.
+  Returns 0 if the clock cannot be read.
+*/
+SQFS_INTERNAL sqfs_u64 get_time_ns(void);
+
+/*
+  Get the CPU time used by the calling process so far, in nanoseconds,
+  summed up over all of its threads. Returns 0 if it cannot be determined.
+*/
+SQFS_INTERNAL sqfs_u64 get_cpu_time_ns(void);
+
+/* Same as above, but only for the calling thread. */
+SQFS_INTERNAL sqfs_u64 get_thread_cpu_time_ns(void);
+
 #endif /* UTIL_H */
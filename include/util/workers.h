@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * workers.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef UTIL_WORKERS_H
+#define UTIL_WORKERS_H
+
+#include "sqfs/predef.h"
+
+typedef void *(*worker_fun_t)(void *arg);
+
+/* Run a worker function on up to count threads at once, the calling thread
+   being one of them. The i-th thread gets the i-th element of an array
+   with elements of the given size, or all of them the same argument if the
+   size is 0.
+
+   Threads that cannot be started are simply left out, so the workers have
+   to take their work from a shared list until it is empty, and the calling
+   thread does whatever is left. Without thread support, it does all of it.
+
+   Returns once all workers are done, with the number of workers that ran,
+   which is always at least 1. */
+SQFS_INTERNAL size_t run_workers(worker_fun_t fun, void *args, size_t size,
+				 size_t count);
+
+#endif /* UTIL_WORKERS_H */
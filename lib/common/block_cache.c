@@ -0,0 +1,627 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * block_cache.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "common.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+/*
+  The cache file starts with a header that records the settings the
+  blocks were compressed with, followed by the compressor options as
+  stored in the image. After that, each entry consists of an entry header
+  and the block data as stored in the image. All integers are little
+  endian.
+
+  Only full data blocks are cached, so an entry is keyed by the xxHash64
+  of the uncompressed block alone.
+ */
+#define CACHE_MAGIC "SQFSBCv1"
+
+typedef struct {
+	sqfs_u8 magic[8];
+	sqfs_u32 block_size;
+	sqfs_u16 compression_id;
+	sqfs_u16 options_size;
+} cache_header_t;
+
+typedef struct {
+	sqfs_u64 hash;
+	sqfs_u32 size;
+	sqfs_u32 pad0;
+} cache_entry_t;
+
+typedef struct {
+	sqfs_u64 hash;
+
+	/* location of the block data in the cache file, 0 if unused */
+	sqfs_u64 offset;
+
+	/* on-disk size, as stored in the inode block list */
+	sqfs_u32 size;
+} cache_slot_t;
+
+/* a block that was handed to the data writer and has to be added later */
+typedef struct {
+	const sqfs_inode_generic_t *inode;
+	sqfs_u64 hash;
+	size_t index;
+} pending_t;
+
+struct block_cache_t {
+	const char *filename;
+	FILE *fp;
+	sqfs_u64 end;
+	size_t block_size;
+
+	/* header and compressor options as found in the file, if any */
+	sqfs_u8 *header;
+	size_t header_size;
+
+	cache_slot_t *slots;
+	size_t num_slots;
+	size_t used_slots;
+
+	pending_t *pending;
+	size_t num_pending;
+	size_t max_pending;
+
+	sqfs_u8 *buffer;
+	sqfs_u8 *stored;
+	size_t hits;
+};
+
+static cache_slot_t *find_slot(block_cache_t *cache, sqfs_u64 hash)
+{
+	size_t i = (size_t)(hash ^ (hash >> 32)) & (cache->num_slots - 1);
+
+	while (cache->slots[i].offset != 0 && cache->slots[i].hash != hash)
+		i = (i + 1) & (cache->num_slots - 1);
+
+	return cache->slots + i;
+}
+
+/* keep the table at most half full */
+static int insert_slot(block_cache_t *cache, sqfs_u64 hash, sqfs_u64 offset,
+		       sqfs_u32 size)
+{
+	cache_slot_t *old = cache->slots, *slot;
+	size_t i, old_count = cache->num_slots;
+
+	if (cache->used_slots + 1 > cache->num_slots / 2) {
+		cache->num_slots = old_count ? old_count * 2 : 1024;
+		cache->slots = alloc_array(sizeof(cache->slots[0]),
+					   cache->num_slots);
+		if (cache->slots == NULL) {
+			cache->slots = old;
+			cache->num_slots = old_count;
+			return -1;
+		}
+
+		memset(cache->slots, 0,
+		       sizeof(cache->slots[0]) * cache->num_slots);
+
+		for (i = 0; i < old_count; ++i) {
+			if (old[i].offset != 0)
+				*find_slot(cache, old[i].hash) = old[i];
+		}
+
+		free(old);
+	}
+
+	slot = find_slot(cache, hash);
+	if (slot->offset == 0) {
+		slot->hash = hash;
+		slot->offset = offset;
+		slot->size = size;
+		cache->used_slots += 1;
+	}
+
+	return 0;
+}
+
+static void drop_entries(block_cache_t *cache)
+{
+	if (cache->num_slots > 0)
+		memset(cache->slots, 0, sizeof(cache->slots[0]) * cache->num_slots);
+
+	cache->used_slots = 0;
+}
+
+static int set_block_size(block_cache_t *cache, size_t block_size)
+{
+	sqfs_u8 *buffer, *stored;
+
+	if (block_size == cache->block_size && cache->buffer != NULL)
+		return 0;
+
+	buffer = malloc(block_size);
+	stored = malloc(block_size);
+
+	if (buffer == NULL || stored == NULL) {
+		free(buffer);
+		free(stored);
+		perror(cache->filename);
+		return -1;
+	}
+
+	free(cache->buffer);
+	free(cache->stored);
+	cache->buffer = buffer;
+	cache->stored = stored;
+	cache->block_size = block_size;
+	return 0;
+}
+
+/* remember what the file starts with, so a change can be spotted later */
+static int set_header(block_cache_t *cache, const cache_header_t *hdr,
+		      const sqfs_u8 *options, size_t options_size)
+{
+	sqfs_u8 *header = malloc(sizeof(*hdr) + options_size);
+
+	if (header == NULL) {
+		perror(cache->filename);
+		return -1;
+	}
+
+	memcpy(header, hdr, sizeof(*hdr));
+	memcpy(header + sizeof(*hdr), options, options_size);
+
+	free(cache->header);
+	cache->header = header;
+	cache->header_size = sizeof(*hdr) + options_size;
+
+	drop_entries(cache);
+	cache->end = cache->header_size;
+
+	return set_block_size(cache, le32toh(hdr->block_size));
+}
+
+static int write_header(block_cache_t *cache, const cache_header_t *hdr,
+			const sqfs_u8 *options, size_t options_size)
+{
+	if (ftruncate(fileno(cache->fp), 0) != 0 ||
+	    fseeko(cache->fp, 0, SEEK_SET) != 0 ||
+	    fwrite(hdr, sizeof(*hdr), 1, cache->fp) != 1 ||
+	    fwrite(options, 1, options_size, cache->fp) != options_size ||
+	    fflush(cache->fp) != 0) {
+		perror(cache->filename);
+		return -1;
+	}
+
+	return set_header(cache, hdr, options, options_size);
+}
+
+/* returns > 0 if the file does not start with a valid header */
+static int load_header(block_cache_t *cache, cache_header_t *hdr,
+		       sqfs_u8 *options, size_t *options_size)
+{
+	sqfs_u32 block_size;
+
+	if (fseeko(cache->fp, 0, SEEK_SET) != 0)
+		goto fail;
+
+	if (fread(hdr, sizeof(*hdr), 1, cache->fp) != 1)
+		goto out_short;
+
+	block_size = le32toh(hdr->block_size);
+	*options_size = le16toh(hdr->options_size);
+
+	if (memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    block_size < 4096 || block_size > (1 << 20) ||
+	    *options_size > SQFS_META_BLOCK_SIZE) {
+		return 1;
+	}
+
+	if (fread(options, 1, *options_size, cache->fp) != *options_size)
+		goto out_short;
+
+	return 0;
+out_short:
+	if (!ferror(cache->fp))
+		return 1;
+fail:
+	perror(cache->filename);
+	return -1;
+}
+
+/*
+  An entry that was cut short, e.g. because a previous build was killed
+  while adding to the cache, is truncated away with everything after it.
+ */
+static int load_entries(block_cache_t *cache)
+{
+	sqfs_u64 offset, size;
+	cache_entry_t ent;
+	off_t file_size;
+	sqfs_u32 len;
+
+	if (fseeko(cache->fp, 0, SEEK_END) != 0)
+		goto fail;
+
+	file_size = ftello(cache->fp);
+	if (file_size < 0)
+		goto fail;
+
+	size = file_size;
+
+	/* replaced by a new file with the same settings in the meantime */
+	if (size < cache->end) {
+		drop_entries(cache);
+		cache->end = cache->header_size;
+	}
+
+	offset = cache->end;
+
+	while (offset + sizeof(ent) <= size) {
+		if (fseeko(cache->fp, offset, SEEK_SET) != 0)
+			goto fail;
+
+		if (fread(&ent, sizeof(ent), 1, cache->fp) != 1)
+			goto fail;
+
+		len = SQFS_ON_DISK_BLOCK_SIZE(le32toh(ent.size));
+		if (len == 0 || len > cache->block_size ||
+		    offset + sizeof(ent) + len > size) {
+			break;
+		}
+
+		if (insert_slot(cache, le64toh(ent.hash), offset + sizeof(ent),
+				le32toh(ent.size))) {
+			goto fail;
+		}
+
+		offset += sizeof(ent) + len;
+	}
+
+	if (offset < size) {
+		fprintf(stderr, "%s: discarding truncated entry at the end.\n",
+			cache->filename);
+
+		if (ftruncate(fileno(cache->fp), offset) != 0)
+			goto fail;
+	}
+
+	cache->end = offset;
+	return 0;
+fail:
+	perror(cache->filename);
+	return -1;
+}
+
+int block_cache_refresh(block_cache_t *cache)
+{
+	sqfs_u8 options[SQFS_META_BLOCK_SIZE];
+	size_t options_size;
+	cache_header_t hdr;
+	int ret;
+
+	ret = load_header(cache, &hdr, options, &options_size);
+	if (ret < 0)
+		return -1;
+
+	/* empty or garbage, started over once a build attaches to it */
+	if (ret > 0) {
+		free(cache->header);
+		cache->header = NULL;
+		cache->header_size = 0;
+		cache->end = 0;
+		drop_entries(cache);
+		return 0;
+	}
+
+	if (cache->header_size != sizeof(hdr) + options_size ||
+	    memcmp(cache->header, &hdr, sizeof(hdr)) != 0 ||
+	    memcmp(cache->header + sizeof(hdr), options, options_size) != 0) {
+		if (set_header(cache, &hdr, options, options_size))
+			return -1;
+	}
+
+	return load_entries(cache);
+}
+
+block_cache_t *block_cache_load(const char *filename)
+{
+	block_cache_t *cache = calloc(1, sizeof(*cache));
+
+	if (cache == NULL) {
+		perror(filename);
+		return NULL;
+	}
+
+	cache->filename = filename;
+	cache->fp = fopen(filename, "r+b");
+
+	if (cache->fp == NULL && errno == ENOENT)
+		cache->fp = fopen(filename, "w+b");
+
+	if (cache->fp == NULL) {
+		perror(filename);
+		goto fail;
+	}
+
+	if (block_cache_refresh(cache))
+		goto fail;
+
+	return cache;
+fail:
+	block_cache_destroy(cache);
+	return NULL;
+}
+
+int block_cache_attach(block_cache_t *cache, const sqfs_super_t *super,
+		       sqfs_file_t *outfile)
+{
+	sqfs_u8 options[SQFS_META_BLOCK_SIZE];
+	size_t options_size;
+	cache_header_t hdr;
+	int ret;
+
+	ret = compressor_read_raw_options(outfile, super, options,
+					  &options_size);
+	if (ret) {
+		sqfs_perror(cache->filename, "reading compressor options", ret);
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.block_size = htole32(super->block_size);
+	hdr.compression_id = htole16(super->compression_id);
+	hdr.options_size = htole16(options_size);
+
+	if (cache->header_size == sizeof(hdr) + options_size &&
+	    memcmp(cache->header, &hdr, sizeof(hdr)) == 0 &&
+	    memcmp(cache->header + sizeof(hdr), options, options_size) == 0) {
+		return 0;
+	}
+
+	if (cache->header_size > 0) {
+		fprintf(stderr, "%s: created with different block size or "
+			"compressor settings, starting over.\n",
+			cache->filename);
+	}
+
+	return write_header(cache, &hdr, options, options_size);
+}
+
+bool block_cache_is_file(const block_cache_t *cache, const char *filename)
+{
+	struct stat a, b;
+
+	if (fstat(fileno(cache->fp), &a) != 0 || stat(filename, &b) != 0)
+		return false;
+
+	return a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+block_cache_t *block_cache_open(const char *filename, const sqfs_super_t *super,
+				sqfs_file_t *outfile)
+{
+	block_cache_t *cache = block_cache_load(filename);
+
+	if (cache == NULL)
+		return NULL;
+
+	if (block_cache_attach(cache, super, outfile)) {
+		block_cache_destroy(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+void block_cache_destroy(block_cache_t *cache)
+{
+	if (cache == NULL)
+		return;
+
+	if (cache->fp != NULL)
+		fclose(cache->fp);
+
+	free(cache->header);
+	free(cache->pending);
+	free(cache->slots);
+	free(cache->buffer);
+	free(cache->stored);
+	free(cache);
+}
+
+size_t block_cache_get_hits(const block_cache_t *cache)
+{
+	return cache == NULL ? 0 : cache->hits;
+}
+
+static int add_pending(block_cache_t *cache, const sqfs_inode_generic_t *inode,
+		       size_t index, sqfs_u64 hash)
+{
+	size_t new_max;
+	pending_t *new;
+
+	if (cache->num_pending == cache->max_pending) {
+		new_max = cache->max_pending ? cache->max_pending * 2 : 1024;
+		new = realloc(cache->pending, sizeof(new[0]) * new_max);
+
+		if (new == NULL)
+			return -1;
+
+		cache->pending = new;
+		cache->max_pending = new_max;
+	}
+
+	cache->pending[cache->num_pending].inode = inode;
+	cache->pending[cache->num_pending].index = index;
+	cache->pending[cache->num_pending].hash = hash;
+	cache->num_pending += 1;
+	return 0;
+}
+
+static int pack_block(block_cache_t *cache, const char *filename,
+		      sqfs_data_writer_t *data, sqfs_inode_generic_t *inode,
+		      size_t index)
+{
+	sqfs_u64 hash = xxh64(cache->buffer, cache->block_size);
+	cache_slot_t *slot = NULL;
+	size_t len;
+	int ret;
+
+	if (cache->num_slots > 0)
+		slot = find_slot(cache, hash);
+
+	if (slot == NULL || slot->offset == 0) {
+		if (add_pending(cache, inode, index, hash)) {
+			perror(filename);
+			return -1;
+		}
+
+		ret = sqfs_data_writer_append(data, cache->buffer,
+					      cache->block_size);
+		goto out;
+	}
+
+	len = SQFS_ON_DISK_BLOCK_SIZE(slot->size);
+
+	if (fseeko(cache->fp, slot->offset, SEEK_SET) != 0 ||
+	    fread(cache->stored, 1, len, cache->fp) != len) {
+		perror(cache->filename);
+		return -1;
+	}
+
+	ret = sqfs_data_writer_append_raw(data, cache->stored, slot->size);
+	cache->hits += 1;
+out:
+	if (ret) {
+		sqfs_perror(filename, "packing file data", ret);
+		return -1;
+	}
+
+	return 0;
+}
+
+int block_cache_append(block_cache_t *cache, const char *filename,
+		       sqfs_data_writer_t *data, sqfs_inode_generic_t *inode,
+		       sqfs_file_t *file, sqfs_u64 size)
+{
+	sqfs_u64 offset;
+	size_t diff;
+	int ret;
+
+	for (offset = 0; offset < size; offset += diff) {
+		diff = cache->block_size;
+		if (diff > size - offset)
+			diff = size - offset;
+
+		ret = file->read_at(file, offset, cache->buffer, diff);
+		if (ret) {
+			sqfs_perror(filename, "reading file range", ret);
+			return -1;
+		}
+
+		if (diff == cache->block_size) {
+			if (pack_block(cache, filename, data, inode,
+				       offset / cache->block_size)) {
+				return -1;
+			}
+			continue;
+		}
+
+		ret = sqfs_data_writer_append(data, cache->buffer, diff);
+		if (ret) {
+			sqfs_perror(filename, "packing file data", ret);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int store_block(block_cache_t *cache, sqfs_file_t *outfile,
+		       const pending_t *p, sqfs_u64 location)
+{
+	sqfs_u32 size = p->inode->block_sizes[p->index];
+	size_t len = SQFS_ON_DISK_BLOCK_SIZE(size);
+	cache_entry_t ent;
+	int ret;
+
+	/* sparse, or the same block turned up more than once */
+	if (len == 0)
+		return 0;
+
+	if (cache->num_slots > 0 && find_slot(cache, p->hash)->offset != 0)
+		return 0;
+
+	ret = outfile->read_at(outfile, location, cache->stored, len);
+	if (ret) {
+		sqfs_perror(cache->filename, "reading back data block", ret);
+		return -1;
+	}
+
+	memset(&ent, 0, sizeof(ent));
+	ent.hash = htole64(p->hash);
+	ent.size = htole32(size);
+
+	if (fseeko(cache->fp, cache->end, SEEK_SET) != 0 ||
+	    fwrite(&ent, sizeof(ent), 1, cache->fp) != 1 ||
+	    fwrite(cache->stored, 1, len, cache->fp) != len) {
+		perror(cache->filename);
+		return -1;
+	}
+
+	if (insert_slot(cache, p->hash, cache->end + sizeof(ent), size)) {
+		perror(cache->filename);
+		return -1;
+	}
+
+	cache->end += sizeof(ent) + len;
+	return 0;
+}
+
+/*
+  Blocks are added after the fact, by reading them back from the image, so
+  the cache does not have to interfere with the data writer. The blocks of
+  a file are pending in order, so their locations are accumulated along
+  the way instead of summing up the block list for each of them.
+ */
+int block_cache_flush(block_cache_t *cache, sqfs_file_t *outfile)
+{
+	const sqfs_inode_generic_t *inode = NULL;
+	sqfs_u64 location = 0;
+	size_t i, index = 0;
+	const pending_t *p;
+
+	for (i = 0; i < cache->num_pending; ++i) {
+		p = cache->pending + i;
+
+		if (p->inode != inode || p->index < index) {
+			inode = p->inode;
+			index = 0;
+			sqfs_inode_get_file_block_start(inode, &location);
+		}
+
+		while (index < p->index) {
+			location +=
+				SQFS_ON_DISK_BLOCK_SIZE(inode->block_sizes[index]);
+			++index;
+		}
+
+		if (store_block(cache, outfile, p, location))
+			return -1;
+	}
+
+	cache->num_pending = 0;
+
+	if (fflush(cache->fp) != 0) {
+		perror(cache->filename);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,385 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * block_probe.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+/* the block sizes that are tried */
+#define MIN_PROBE_BLOCK (16 * 1024)
+#define MAX_PROBE_BLOCK (1024 * 1024)
+#define NUM_PROBE_SIZES (7)
+
+/* the sample data kept at once */
+#define PROBE_BUDGET (16 * 1024 * 1024)
+
+/* the unit a random read is measured in */
+#define READ_SIZE (4096)
+
+typedef struct {
+	sqfs_u8 *data;
+	size_t size;
+	sqfs_u64 ordinal;
+} probe_sample_t;
+
+struct block_probe_t {
+	probe_sample_t *samples;
+	size_t count;
+	size_t max;
+	size_t used;
+
+	/* every stride-th file is sampled, doubled when over budget */
+	sqfs_u64 files;
+	sqfs_u64 stride;
+};
+
+typedef struct {
+	size_t block_size;
+	sqfs_u64 bytes_in;
+	sqfs_u64 bytes_out;
+	sqfs_u64 blocks;
+	sqfs_u64 time;
+} probe_result_t;
+
+block_probe_t *block_probe_create(void)
+{
+	block_probe_t *probe = calloc(1, sizeof(*probe));
+
+	if (probe == NULL) {
+		perror("creating block size probe");
+		return NULL;
+	}
+
+	probe->stride = 1;
+	return probe;
+}
+
+void block_probe_destroy(block_probe_t *probe)
+{
+	size_t i;
+
+	if (probe == NULL)
+		return;
+
+	for (i = 0; i < probe->count; ++i)
+		free(probe->samples[i].data);
+
+	free(probe->samples);
+	free(probe);
+}
+
+/*
+  Drop every other sample and take half as many from the files that
+  follow, until the samples fit the budget again. The samples stay spread
+  over the whole input, no matter how many files there are.
+ */
+static void trim(block_probe_t *probe)
+{
+	size_t i, j;
+
+	while (probe->used > PROBE_BUDGET) {
+		probe->stride *= 2;
+
+		for (i = j = 0; i < probe->count; ++i) {
+			if ((probe->samples[i].ordinal % probe->stride) == 0) {
+				probe->samples[j++] = probe->samples[i];
+			} else {
+				probe->used -= probe->samples[i].size;
+				free(probe->samples[i].data);
+			}
+		}
+
+		probe->count = j;
+	}
+}
+
+bool block_probe_want(block_probe_t *probe)
+{
+	trim(probe);
+
+	return (probe->files++ % probe->stride) == 0;
+}
+
+static int grow(block_probe_t *probe, size_t count)
+{
+	probe_sample_t *new;
+	size_t max;
+
+	if (probe->count + count <= probe->max)
+		return 0;
+
+	max = probe->max ? probe->max : 64;
+	while (max < probe->count + count)
+		max *= 2;
+
+	new = realloc(probe->samples, max * sizeof(new[0]));
+	if (new == NULL) {
+		perror("sampling the input");
+		return -1;
+	}
+
+	probe->samples = new;
+	probe->max = max;
+	return 0;
+}
+
+sqfs_u8 *block_probe_add(block_probe_t *probe, sqfs_u64 filesize,
+			 size_t *size)
+{
+	probe_sample_t *smp;
+
+	if (grow(probe, 1))
+		return NULL;
+
+	*size = filesize < MAX_PROBE_BLOCK ? filesize : MAX_PROBE_BLOCK;
+
+	smp = probe->samples + probe->count;
+	smp->data = malloc(*size > 0 ? *size : 1);
+	smp->size = *size;
+	smp->ordinal = probe->files - 1;
+
+	if (smp->data == NULL) {
+		perror("sampling the input");
+		return NULL;
+	}
+
+	probe->count += 1;
+	probe->used += *size;
+	return smp->data;
+}
+
+int block_probe_merge(block_probe_t *probe, block_probe_t *other)
+{
+	if (grow(probe, other->count))
+		return -1;
+
+	memcpy(probe->samples + probe->count, other->samples,
+	       other->count * sizeof(other->samples[0]));
+
+	probe->count += other->count;
+	probe->used += other->used;
+	if (other->stride > probe->stride)
+		probe->stride = other->stride;
+
+	other->count = 0;
+	other->used = 0;
+	block_probe_destroy(other);
+
+	trim(probe);
+	return 0;
+}
+
+static int compress_block(sqfs_compressor_t *cmp, probe_result_t *res,
+			  const sqfs_u8 *data, size_t size, sqfs_u8 *scratch)
+{
+	sqfs_s32 ret;
+
+	ret = cmp->do_block(cmp, data, size, scratch, res->block_size);
+	if (ret < 0)
+		return ret;
+
+	res->bytes_in += size;
+	res->bytes_out += ret > 0 ? (size_t)ret : size;
+	res->blocks += 1;
+	return 0;
+}
+
+/*
+  Full blocks are compressed one by one, like the data blocks of a file.
+  What is left of a sample is packed into a shared buffer, like the tail
+  ends in fragment blocks.
+ */
+static int probe_size(const block_probe_t *probe, sqfs_compressor_t *cmp,
+		      probe_result_t *res, sqfs_u8 *scratch, sqfs_u8 *frag)
+{
+	size_t i, offset, diff, frag_used = 0;
+	const probe_sample_t *smp;
+	int ret;
+
+	for (i = 0; i < probe->count; ++i) {
+		smp = probe->samples + i;
+
+		for (offset = 0; smp->size - offset >= res->block_size;
+		     offset += res->block_size) {
+			ret = compress_block(cmp, res, smp->data + offset,
+					     res->block_size, scratch);
+			if (ret)
+				return ret;
+		}
+
+		while (offset < smp->size) {
+			diff = res->block_size - frag_used;
+			if (diff > smp->size - offset)
+				diff = smp->size - offset;
+
+			memcpy(frag + frag_used, smp->data + offset, diff);
+			frag_used += diff;
+			offset += diff;
+
+			if (frag_used == res->block_size) {
+				ret = compress_block(cmp, res, frag,
+						     frag_used, scratch);
+				if (ret)
+					return ret;
+				frag_used = 0;
+			}
+		}
+	}
+
+	if (frag_used > 0)
+		return compress_block(cmp, res, frag, frag_used, scratch);
+
+	return 0;
+}
+
+/* the xz dictionary defaults to the block size */
+static void set_block_size(sqfs_compressor_config_t *cfg, size_t size)
+{
+	if (cfg->id == SQFS_COMP_XZ &&
+	    cfg->opt.xz.dict_size == cfg->block_size) {
+		cfg->opt.xz.dict_size = size;
+	}
+
+	cfg->block_size = size;
+}
+
+static int run_probe(const block_probe_t *probe, const char *filename,
+		     const sqfs_compressor_config_t *base,
+		     probe_result_t *res)
+{
+	sqfs_compressor_config_t cfg = *base;
+	sqfs_u8 *scratch, *frag;
+	sqfs_compressor_t *cmp;
+	sqfs_u64 start;
+	int ret;
+
+	set_block_size(&cfg, res->block_size);
+
+	/* a zstd dictionary is only trained once the block size is known */
+	cfg.flags &= ~SQFS_COMP_FLAG_ZSTD_DICT;
+
+	cmp = sqfs_compressor_create(&cfg);
+	if (cmp == NULL) {
+		fputs("Error creating compressor\n", stderr);
+		return -1;
+	}
+
+	scratch = malloc(res->block_size);
+	frag = malloc(res->block_size);
+
+	if (scratch == NULL || frag == NULL) {
+		perror("probing block sizes");
+		ret = -1;
+		goto out;
+	}
+
+	start = get_time_ns();
+	ret = probe_size(probe, cmp, res, scratch, frag);
+	res->time = get_time_ns() - start;
+
+	if (ret) {
+		sqfs_perror(filename, "probing block sizes", ret);
+		ret = -1;
+	}
+out:
+	free(scratch);
+	free(frag);
+	cmp->destroy(cmp);
+	return ret;
+}
+
+static double read_amp(const probe_result_t *res)
+{
+	if (res->blocks == 0)
+		return 0.0;
+
+	return ((double)res->bytes_out / res->blocks) / READ_SIZE;
+}
+
+static void print_table(const probe_result_t *res, size_t count,
+			size_t best, size_t max_amp)
+{
+	double ratio, avg, rate;
+	size_t i;
+
+	printf("Sampled %.1f MiB of input, %zu KiB blocks with a read "
+	       "amplification of at most %zu:\n",
+	       (double)res[0].bytes_in / (1024.0 * 1024.0),
+	       res[best].block_size / 1024, max_amp);
+	fputs("  block size  ratio  avg. block  read amp.  speed\n", stdout);
+
+	for (i = 0; i < count; ++i) {
+		ratio = 100.0 * res[i].bytes_out / res[i].bytes_in;
+		avg = (double)res[i].bytes_out / res[i].blocks / 1024.0;
+		rate = res[i].time > 0 ?
+			(res[i].bytes_in * 1e9 / res[i].time) /
+			(1024.0 * 1024.0) : 0.0;
+
+		printf("%c %6zu KiB  %4.1f%%  %6.1f KiB  %9.1f  %5.1f MiB/s\n",
+		       i == best ? '*' : ' ', res[i].block_size / 1024,
+		       ratio, avg, read_amp(res + i), rate);
+	}
+}
+
+int block_probe_apply(block_probe_t *probe, sqfs_writer_t *sqfs,
+		      sqfs_writer_cfg_t *cfg)
+{
+	probe_result_t res[NUM_PROBE_SIZES];
+	size_t i, count = 0, best = 0;
+	bool fits = false;
+
+	if (probe->used == 0) {
+		if (!cfg->quiet)
+			fputs("No input to sample, keeping the block size.\n",
+			      stdout);
+		goto out;
+	}
+
+	for (i = MIN_PROBE_BLOCK; i <= MAX_PROBE_BLOCK; i *= 2) {
+		memset(res + count, 0, sizeof(res[count]));
+		res[count].block_size = i;
+
+		if (run_probe(probe, cfg->filename, &sqfs->comp_cfg,
+			      res + count)) {
+			return -1;
+		}
+
+		++count;
+	}
+
+	/* the best ratio within the budget, or else the smallest blocks */
+	for (i = 0; i < count; ++i) {
+		if (read_amp(res + i) > (double)cfg->max_read_amp)
+			continue;
+
+		if (!fits || res[i].bytes_out < res[best].bytes_out) {
+			best = i;
+			fits = true;
+		}
+	}
+
+	if (!cfg->quiet)
+		print_table(res, count, best, cfg->max_read_amp);
+
+	if (!fits) {
+		fprintf(stderr, "No block size stays within a read "
+			"amplification of %zu, using %zu KiB.\n",
+			cfg->max_read_amp, res[best].block_size / 1024);
+	}
+
+	set_block_size(&sqfs->comp_cfg, res[best].block_size);
+	cfg->block_size = res[best].block_size;
+out:
+	/* the dictionary is trained for the block size picked here */
+	if (sqfs->comp_cfg.id == SQFS_COMP_ZSTD &&
+	    (sqfs->comp_cfg.flags & SQFS_COMP_FLAG_ZSTD_DICT)) {
+		return 0;
+	}
+
+	return sqfs_writer_init_data(sqfs, cfg, NULL, 0);
+}
@@ -22,6 +22,7 @@ static const flag_t gzip_flags[] = {
 	{ "huffman", SQFS_COMP_FLAG_GZIP_HUFFMAN },
 	{ "rle", SQFS_COMP_FLAG_GZIP_RLE },
 	{ "fixed", SQFS_COMP_FLAG_GZIP_FIXED },
+	{ "sample", SQFS_COMP_FLAG_GZIP_SAMPLE },
 };
 
 static const flag_t xz_flags[] = {
@@ -31,12 +32,18 @@ static const flag_t xz_flags[] = {
 	{ "arm", SQFS_COMP_FLAG_XZ_ARM },
 	{ "armthumb", SQFS_COMP_FLAG_XZ_ARMTHUMB },
 	{ "sparc", SQFS_COMP_FLAG_XZ_SPARC },
+	{ "detect", SQFS_COMP_FLAG_XZ_DETECT },
 };
 
 static const flag_t lz4_flags[] = {
 	{ "hc", SQFS_COMP_FLAG_LZ4_HC },
 };
 
+static const flag_t zstd_flags[] = {
+	{ "nonstd-dict", SQFS_COMP_FLAG_ZSTD_DICT },
+	{ "ldm", SQFS_COMP_FLAG_ZSTD_LDM },
+};
+
 static const char *lzo_algs[] = {
 	[SQFS_LZO1X_1] = "lzo1x_1",
 	[SQFS_LZO1X_1_11] = "lzo1x_1_11",
@@ -112,20 +119,99 @@ enum {
 	OPT_LEVEL,
 	OPT_ALG,
 	OPT_DICT,
+	OPT_WINDOW_LOG,
+	OPT_TARGET_LEN,
+	OPT_NICE_LEN,
+	OPT_FAST,
 };
 static char *const token[] = {
 	[OPT_WINDOW] = (char *)"window",
 	[OPT_LEVEL] = (char *)"level",
 	[OPT_ALG] = (char *)"algorithm",
 	[OPT_DICT] = (char *)"dictsize",
+	[OPT_WINDOW_LOG] = (char *)"windowlog",
+	[OPT_TARGET_LEN] = (char *)"targetlen",
+	[OPT_NICE_LEN] = (char *)"nicelen",
+	[OPT_FAST] = (char *)"fast",
 	NULL
 };
 
+/*
+  Settings that keep most of the compression of the defaults for a fraction
+  of the CPU time with large (512k - 1M) blocks, picked with sqfsbench.
+ */
+static int set_fast_preset(sqfs_compressor_config_t *cfg)
+{
+	switch (cfg->id) {
+	case SQFS_COMP_GZIP:
+		cfg->opt.gzip.level = 6;
+		break;
+	case SQFS_COMP_ZSTD:
+		cfg->opt.zstd.level = 8;
+		break;
+	case SQFS_COMP_XZ:
+		cfg->opt.xz.level = 2;
+		break;
+	case SQFS_COMP_LZ4:
+		cfg->opt.lz4.level = 9;
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+static int get_number(const char *value, size_t min, size_t max, size_t *out)
+{
+	int i;
+
+	for (i = 0; isdigit(value[i]) && i < 7; ++i)
+		;
+
+	if (i < 1 || i > 6 || value[i] != '\0')
+		return -1;
+
+	*out = atol(value);
+	return (*out < min || *out > max) ? -1 : 0;
+}
+
+bool compressor_get_level_range(E_SQFS_COMPRESSOR id, size_t *min,
+				size_t *max)
+{
+	switch (id) {
+	case SQFS_COMP_GZIP:
+		*min = SQFS_GZIP_MIN_LEVEL;
+		*max = SQFS_GZIP_MAX_LEVEL;
+		return true;
+	case SQFS_COMP_LZO:
+		*min = SQFS_LZO_MIN_LEVEL;
+		*max = SQFS_LZO_MAX_LEVEL;
+		return true;
+	case SQFS_COMP_ZSTD:
+		*min = SQFS_ZSTD_MIN_LEVEL;
+		*max = SQFS_ZSTD_MAX_LEVEL;
+		return true;
+	case SQFS_COMP_XZ:
+		*min = SQFS_XZ_MIN_LEVEL;
+		*max = SQFS_XZ_MAX_LEVEL;
+		return true;
+	case SQFS_COMP_LZ4:
+		*min = SQFS_LZ4_MIN_LEVEL;
+		*max = SQFS_LZ4_MAX_LEVEL;
+		return true;
+	default:
+		*min = 0;
+		*max = 0;
+		return false;
+	}
+}
+
 int compressor_cfg_init_options(sqfs_compressor_config_t *cfg,
 				E_SQFS_COMPRESSOR id,
 				size_t block_size, char *options)
 {
-	size_t num_flags = 0, min_level = 0, max_level = 0, level;
+	size_t num_flags = 0, min_level, max_level, level, num;
 	const flag_t *flags = NULL;
 	char *subopts, *value;
 	int i, opt;
@@ -136,20 +222,16 @@ int compressor_cfg_init_options(sqfs_compressor_config_t *cfg,
 	if (options == NULL)
 		return 0;
 
+	compressor_get_level_range(cfg->id, &min_level, &max_level);
+
 	switch (cfg->id) {
 	case SQFS_COMP_GZIP:
-		min_level = SQFS_GZIP_MIN_LEVEL;
-		max_level = SQFS_GZIP_MAX_LEVEL;
 		flags = gzip_flags;
 		num_flags = sizeof(gzip_flags) / sizeof(gzip_flags[0]);
 		break;
-	case SQFS_COMP_LZO:
-		min_level = SQFS_LZO_MIN_LEVEL;
-		max_level = SQFS_LZO_MAX_LEVEL;
-		break;
 	case SQFS_COMP_ZSTD:
-		min_level = SQFS_ZSTD_MIN_LEVEL;
-		max_level = SQFS_ZSTD_MAX_LEVEL;
+		flags = zstd_flags;
+		num_flags = sizeof(zstd_flags) / sizeof(zstd_flags[0]);
 		break;
 	case SQFS_COMP_XZ:
 		flags = xz_flags;
@@ -213,10 +295,54 @@ int compressor_cfg_init_options(sqfs_compressor_config_t *cfg,
 			case SQFS_COMP_ZSTD:
 				cfg->opt.zstd.level = level;
 				break;
+			case SQFS_COMP_XZ:
+				cfg->opt.xz.level = level;
+				break;
+			case SQFS_COMP_LZ4:
+				cfg->opt.lz4.level = level;
+				break;
 			default:
 				goto fail_opt;
 			}
 			break;
+		case OPT_WINDOW_LOG:
+			if (cfg->id != SQFS_COMP_ZSTD)
+				goto fail_opt;
+
+			if (value == NULL)
+				goto fail_value;
+
+			if (get_number(value, 10, 31, &num))
+				goto fail_number;
+
+			cfg->opt.zstd.window_log = num;
+			break;
+		case OPT_TARGET_LEN:
+			if (cfg->id != SQFS_COMP_ZSTD)
+				goto fail_opt;
+
+			if (value == NULL)
+				goto fail_value;
+
+			if (get_number(value, 1, 131072, &num))
+				goto fail_number;
+
+			cfg->opt.zstd.target_length = num;
+			break;
+		case OPT_NICE_LEN:
+			if (cfg->id != SQFS_COMP_XZ)
+				goto fail_opt;
+
+			if (value == NULL)
+				goto fail_value;
+
+			if (get_number(value, SQFS_XZ_MIN_NICE_LEN,
+				       SQFS_XZ_MAX_NICE_LEN, &num)) {
+				goto fail_number;
+			}
+
+			cfg->opt.xz.nice_len = num;
+			break;
 		case OPT_ALG:
 			if (cfg->id != SQFS_COMP_LZO)
 				goto fail_opt;
@@ -227,6 +353,10 @@ int compressor_cfg_init_options(sqfs_compressor_config_t *cfg,
 			if (find_lzo_alg(cfg, value))
 				goto fail_lzo_alg;
 			break;
+		case OPT_FAST:
+			if (set_fast_preset(cfg))
+				goto fail_token;
+			break;
 		case OPT_DICT:
 			if (cfg->id != SQFS_COMP_XZ)
 				goto fail_opt;
@@ -261,6 +391,14 @@ fail_level:
 fail_opt:
 	fprintf(stderr, "Unknown compressor option '%s'.\n", value);
 	return -1;
+fail_token:
+	fprintf(stderr, "Compressor option '%s' is not supported by %s.\n",
+		token[opt], sqfs_compressor_name_from_id(cfg->id));
+	return -1;
+fail_number:
+	fprintf(stderr, "Invalid value '%s' for compressor option '%s'.\n",
+		value, token[opt]);
+	return -1;
 fail_value:
 	fprintf(stderr, "Missing value for compressor option '%s'.\n",
 		token[opt]);
@@ -284,6 +422,13 @@ static void gzip_print_help(void)
 "                     Defaults to %d.\n"
 "    window=<size>    Deflate compression window size. Value from 8 to 15.\n"
 "                     Defaults to %d.\n"
+"    fast             Use level 6, which is a lot faster and compresses\n"
+"                     almost as well. Options after it override it.\n"
+"\n"
+"    sample           If multiple strategies are provided, only try\n"
+"                     them on the start of each block and use the\n"
+"                     best one for the rest. Faster, but may compress\n"
+"                     slightly worse.\n"
 "\n"
 "In additon to the options, one or more strategies can be specified.\n"
 "If multiple stratgies are provided, the one yielding the best compression\n"
@@ -292,18 +437,26 @@ static void gzip_print_help(void)
 "The following strategies are available:\n",
 	SQFS_GZIP_DEFAULT_LEVEL, SQFS_GZIP_DEFAULT_WINDOW);
 
-	for (i = 0; i < sizeof(gzip_flags) / sizeof(gzip_flags[0]); ++i)
-		printf("\t%s\n", gzip_flags[i].name);
+	for (i = 0; i < sizeof(gzip_flags) / sizeof(gzip_flags[0]); ++i) {
+		if (gzip_flags[i].flag & SQFS_COMP_FLAG_GZIP_ALL)
+			printf("\t%s\n", gzip_flags[i].name);
+	}
 }
 
 static void lz4_print_help(void)
 {
-	fputs("Available options for lz4 compressor:\n"
-	      "\n"
-	      "    hc    If present, use slower but better compressing\n"
-	      "          variant of lz4.\n"
-	      "\n",
-	      stdout);
+	printf("Available options for lz4 compressor:\n"
+	       "\n"
+	       "    hc               If present, use slower but better\n"
+	       "                     compressing variant of lz4.\n"
+	       "    level=<value>    Compression level of the hc variant.\n"
+	       "                     Value from %d to %d. Defaults to %d.\n"
+	       "                     Ignored without hc.\n"
+	       "    fast             For hc, use level 9, which is a lot faster\n"
+	       "                     and compresses almost as well. Options\n"
+	       "                     after it override it.\n"
+	       "\n",
+	       SQFS_LZ4_MIN_LEVEL, SQFS_LZ4_MAX_LEVEL, SQFS_LZ4_DEFAULT_LEVEL);
 }
 
 static void lzo_print_help(void)
@@ -329,24 +482,39 @@ static void xz_print_help(void)
 {
 	size_t i;
 
-	fputs(
+	printf(
 "Available options for xz compressor:\n"
 "\n"
 "    dictsize=<value>  Dictionary size. Either a value in bytes or a\n"
-"                      percentage of the block size. Defaults to 100%.\n"
-"                      The suffix '%' indicates a percentage. 'K' and 'M'\n"
+"                      percentage of the block size. Defaults to 100%%.\n"
+"                      The suffix '%%' indicates a percentage. 'K' and 'M'\n"
 "                      can also be used for kibi and mebi bytes\n"
 "                      respecitively.\n"
+"    level=<value>     Compression preset, like the xz command line\n"
+"                      levels. Value from %d to %d. Defaults to %d.\n"
+"                      Not stored in the image.\n"
+"    nicelen=<value>   Match length at which the encoder stops looking\n"
+"                      for a longer match. Value from %d to %d. Smaller\n"
+"                      is faster. Defaults to the value of the preset.\n"
+"    fast              Use level 2, which is several times faster and\n"
+"                      compresses slightly worse. Options after it\n"
+"                      override it.\n"
+"    detect            Instead of trying every filter on every block, pick\n"
+"                      the filter for a whole file from its ELF header.\n"
+"                      Other files are compressed without a filter.\n"
 "\n"
 "In additon to the options, one or more bcj filters can be specified.\n"
 "If multiple filters are provided, the one yielding the best compression\n"
 "ratio will be used.\n"
 "\n"
 "The following filters are available:\n",
-	stdout);
+	SQFS_XZ_MIN_LEVEL, SQFS_XZ_MAX_LEVEL, SQFS_XZ_DEFAULT_LEVEL,
+	SQFS_XZ_MIN_NICE_LEN, SQFS_XZ_MAX_NICE_LEN);
 
-	for (i = 0; i < sizeof(xz_flags) / sizeof(xz_flags[0]); ++i)
-		printf("\t%s\n", xz_flags[i].name);
+	for (i = 0; i < sizeof(xz_flags) / sizeof(xz_flags[0]); ++i) {
+		if (xz_flags[i].flag & SQFS_COMP_FLAG_XZ_ALL)
+			printf("\t%s\n", xz_flags[i].name);
+	}
 }
 
 static void zstd_print_help(void)
@@ -355,8 +523,30 @@ static void zstd_print_help(void)
 	       "\n"
 	       "    level=<value>    Set compression level. Defaults to %d.\n"
 	       "                     Maximum is %d.\n"
+	       "    windowlog=<n>    Use a match window of 2^n bytes. Only\n"
+	       "                     makes a difference if it is smaller than\n"
+	       "                     the block size. Defaults to what the\n"
+	       "                     level implies for the block size.\n"
+	       "    targetlen=<n>    Match length at which the encoder stops\n"
+	       "                     looking for a longer match. Defaults to\n"
+	       "                     what the level implies.\n"
+	       "    ldm              Enable long distance matching.\n"
+	       "    fast             Use level 8, which is several times\n"
+	       "                     faster and compresses almost as well.\n"
+	       "                     Options after it override it.\n"
+	       "\n"
+	       "    Except for the level, none of these are stored in the\n"
+	       "    image.\n"
+	       "\n"
+	       "    nonstd-dict      Train a dictionary of up to %d bytes\n"
+	       "                     from samples of the input and use it for\n"
+	       "                     all blocks. Only supported by gensquashfs.\n"
+	       "                     This is not part of the SquashFS format,\n"
+	       "                     the result cannot be read by the Linux\n"
+	       "                     kernel or other SquashFS tools.\n"
 	       "\n",
-	       SQFS_ZSTD_DEFAULT_LEVEL, SQFS_ZSTD_MAX_LEVEL);
+	       SQFS_ZSTD_DEFAULT_LEVEL, SQFS_ZSTD_MAX_LEVEL,
+	       SQFS_ZSTD_MAX_DICT_SIZE);
 }
 
 static const compressor_help_fun_t helpfuns[SQFS_COMP_MAX + 1] = {
@@ -377,3 +567,52 @@ void compressor_print_help(E_SQFS_COMPRESSOR id)
 
 	helpfuns[id]();
 }
+
+const char *compressor_method_name(E_SQFS_COMPRESSOR id, sqfs_u32 method)
+{
+	const flag_t *flags;
+	size_t i, count;
+
+	switch (id) {
+	case SQFS_COMP_GZIP:
+		flags = gzip_flags;
+		count = sizeof(gzip_flags) / sizeof(gzip_flags[0]);
+		break;
+	case SQFS_COMP_XZ:
+		flags = xz_flags;
+		count = sizeof(xz_flags) / sizeof(xz_flags[0]);
+		break;
+	default:
+		return NULL;
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (flags[i].flag == method)
+			return flags[i].name;
+	}
+
+	return NULL;
+}
+
+int compressor_read_raw_options(sqfs_file_t *file, const sqfs_super_t *super,
+				sqfs_u8 *buffer, size_t *size)
+{
+	sqfs_u16 header;
+	int ret;
+
+	*size = 0;
+
+	if (!(super->flags & SQFS_FLAG_COMPRESSOR_OPTIONS))
+		return 0;
+
+	ret = file->read_at(file, sizeof(*super), &header, sizeof(header));
+	if (ret)
+		return ret;
+
+	*size = le16toh(header) & 0x7FFF;
+	if (*size > SQFS_META_BLOCK_SIZE)
+		return SQFS_ERROR_CORRUPTED;
+
+	return file->read_at(file, sizeof(*super) + sizeof(header),
+			     buffer, *size);
+}
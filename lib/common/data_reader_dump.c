@@ -5,17 +5,18 @@
  * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
  */
 #include "common.h"
+#include "util/cpu.h"
 
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <errno.h>
 
-static int append_block(int fd, const sqfs_block_t *blk)
+static int append_block(int fd, const void *data, size_t size)
 {
-	const unsigned char *ptr = blk->data;
-	size_t size = blk->size;
+	const unsigned char *ptr = data;
 	ssize_t ret;
 
 	while (size > 0) {
@@ -25,11 +26,13 @@ static int append_block(int fd, const sqfs_block_t *blk)
 			if (errno == EINTR)
 				continue;
 			perror("writing data block");
+			return -1;
 		}
 
 		if (ret == 0) {
 			fputs("writing data block: unexpected end of file\n",
 			      stderr);
+			return -1;
 		}
 
 		ptr += ret;
@@ -39,20 +42,177 @@ static int append_block(int fd, const sqfs_block_t *blk)
 	return 0;
 }
 
+/*
+  Blocks smaller than this are collected in a buffer and written out
+  together, instead of issuing a write for each of them.
+ */
+#define DUMP_BATCH_SIZE (1024 * 1024)
+
+typedef struct {
+	int fd;
+	sqfs_u8 *buffer;
+	size_t size;
+	size_t used;
+} dump_out_t;
+
+static int out_flush(dump_out_t *out)
+{
+	int ret = 0;
+
+	if (out->used > 0) {
+		ret = append_block(out->fd, out->buffer, out->used);
+		out->used = 0;
+	}
+
+	return ret;
+}
+
+static int out_append(dump_out_t *out, const void *data, size_t size)
+{
+	if (out->buffer == NULL || size > out->size)
+		return out_flush(out) ? -1 : append_block(out->fd, data, size);
+
+	if (out->size - out->used < size && out_flush(out))
+		return -1;
+
+	memcpy(out->buffer + out->used, data, size);
+	out->used += size;
+	return 0;
+}
+
+static int out_skip(dump_out_t *out, sqfs_u64 size)
+{
+	if (out_flush(out))
+		return -1;
+
+	if (lseek(out->fd, size, SEEK_CUR) == (off_t)-1) {
+		perror("creating sparse output file");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+  Granularity of the zero detection. Blocks start at a multiple of the
+  block size, so the chunks line up with the file system blocks and a
+  skipped chunk is a block that does not need to be allocated.
+ */
+#define ZERO_CHUNK_SIZE (4096)
+
+/*
+  Append uncompressed data, but seek over runs of all zero chunks, so
+  they become holes in the output file.
+ */
+static int out_append_detect(dump_out_t *out, const sqfs_u8 *data,
+			     size_t size)
+{
+	size_t len, diff;
+	bool zero;
+	int ret;
+
+	while (size > 0) {
+		len = size < ZERO_CHUNK_SIZE ? size : ZERO_CHUNK_SIZE;
+		zero = cpu_kernels.is_zero(data, len);
+
+		while (len < size) {
+			diff = size - len;
+			if (diff > ZERO_CHUNK_SIZE)
+				diff = ZERO_CHUNK_SIZE;
+
+			if (cpu_kernels.is_zero(data + len, diff) != zero)
+				break;
+
+			len += diff;
+		}
+
+		ret = zero ? out_skip(out, len) : out_append(out, data, len);
+		if (ret)
+			return -1;
+
+		data += len;
+		size -= len;
+	}
+
+	return 0;
+}
+
+static int out_append_data(dump_out_t *out, const void *data, size_t size,
+			   int flags)
+{
+	if (flags & DUMP_DETECT_ZEROS)
+		return out_append_detect(out, data, size);
+
+	return out_append(out, data, size);
+}
+
+static bool has_sparse_blocks(const sqfs_inode_generic_t *inode)
+{
+	size_t i;
+
+	for (i = 0; i < inode->num_file_blocks; ++i) {
+		if (SQFS_IS_SPARSE_BLOCK(inode->block_sizes[i]))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+  Reserve the space for the file in one go, so the file system can place it
+  in one piece, instead of growing it block by block. This is only a hint,
+  so failure (e.g. a pipe, or a file system that does not support it) is
+  not an error.
+ */
+static bool preallocate(int fd, sqfs_u64 size)
+{
+#ifdef HAVE_FALLOCATE
+	off_t offset = lseek(fd, 0, SEEK_CUR);
+
+	if (offset == (off_t)-1)
+		return false;
+
+	return fallocate(fd, 0, offset, size) == 0;
+#else
+	(void)fd; (void)size;
+	return false;
+#endif
+}
+
 int sqfs_data_reader_dump(const char *name, sqfs_data_reader_t *data,
 			  const sqfs_inode_generic_t *inode,
-			  int outfd, size_t block_size, bool allow_sparse)
+			  int outfd, size_t block_size, int flags)
 {
-	sqfs_block_t *blk;
+	bool allow_sparse = (flags & DUMP_ALLOW_SPARSE) != 0;
+	bool sparse, prealloc = false;
+	dump_out_t out;
+	const void *ptr;
 	sqfs_u64 filesz;
 	size_t i, diff;
 	int err;
 
 	sqfs_inode_get_file_size(inode, &filesz);
 
-	if (allow_sparse && ftruncate(outfd, filesz))
+	memset(&out, 0, sizeof(out));
+	out.fd = outfd;
+
+	if (!allow_sparse)
+		flags &= ~DUMP_DETECT_ZEROS;
+
+	sparse = allow_sparse && ((flags & DUMP_DETECT_ZEROS) ||
+				  has_sparse_blocks(inode));
+
+	if (!sparse && inode->num_file_blocks > 0)
+		prealloc = preallocate(outfd, filesz);
+
+	if (allow_sparse && !prealloc && ftruncate(outfd, filesz))
 		goto fail_sparse;
 
+	if (inode->num_file_blocks > 1 && block_size < DUMP_BATCH_SIZE) {
+		out.size = filesz < DUMP_BATCH_SIZE ? filesz : DUMP_BATCH_SIZE;
+		out.buffer = malloc(out.size);
+	}
+
 	for (i = 0; i < inode->num_file_blocks; ++i) {
 		if (SQFS_IS_SPARSE_BLOCK(inode->block_sizes[i]) &&
 		    allow_sparse) {
@@ -64,42 +224,42 @@ int sqfs_data_reader_dump(const char *name, sqfs_data_reader_t *data,
 				filesz -= block_size;
 			}
 
-			if (lseek(outfd, diff, SEEK_CUR) == (off_t)-1)
-				goto fail_sparse;
+			if (out_skip(&out, diff))
+				goto fail;
 		} else {
-			err = sqfs_data_reader_get_block(data, inode, i, &blk);
+			err = sqfs_data_reader_peek_block(data, inode, i,
+							  &ptr, &diff);
 			if (err) {
 				sqfs_perror(name, "reading data block", err);
-				return -1;
+				goto fail;
 			}
 
-			if (append_block(outfd, blk)) {
-				free(blk);
-				return -1;
-			}
+			if (out_append_data(&out, ptr, diff, flags))
+				goto fail;
 
-			filesz -= blk->size;
-			free(blk);
+			filesz -= diff;
 		}
 	}
 
 	if (filesz > 0) {
-		err = sqfs_data_reader_get_fragment(data, inode, &blk);
+		err = sqfs_data_reader_peek_fragment(data, inode, &ptr, &diff);
 		if (err) {
 			sqfs_perror(name, "reading fragment block", err);
-			return -1;
+			goto fail;
 		}
 
-		if (append_block(outfd, blk)) {
-			free(blk);
-			return -1;
-		}
-
-		free(blk);
+		if (out_append_data(&out, ptr, diff, flags))
+			goto fail;
 	}
 
+	if (out_flush(&out))
+		goto fail;
+
+	free(out.buffer);
 	return 0;
 fail_sparse:
 	perror("creating sparse output file");
+fail:
+	free(out.buffer);
 	return -1;
 }
@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * data_reader_stream.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "common.h"
+
+int sqfs_data_reader_dump_stream(const char *name, sqfs_data_reader_t *data,
+				 const sqfs_inode_generic_t *inode,
+				 ostream_t *fp)
+{
+	const void *ptr;
+	sqfs_u64 filesz;
+	size_t i, diff;
+	int err;
+
+	sqfs_inode_get_file_size(inode, &filesz);
+
+	/*
+	  The blocks are only valid until the next call to the data reader,
+	  appending them either copies them or writes them out right away.
+	 */
+	for (i = 0; i < inode->num_file_blocks; ++i) {
+		err = sqfs_data_reader_peek_block(data, inode, i, &ptr, &diff);
+		if (err) {
+			sqfs_perror(name, "reading data block", err);
+			return -1;
+		}
+
+		if (ostream_append(fp, ptr, diff))
+			return -1;
+
+		filesz -= diff;
+	}
+
+	if (filesz > 0) {
+		err = sqfs_data_reader_peek_fragment(data, inode, &ptr, &diff);
+		if (err) {
+			sqfs_perror(name, "reading fragment block", err);
+			return -1;
+		}
+
+		if (ostream_append(fp, ptr, diff))
+			return -1;
+	}
+
+	return 0;
+}
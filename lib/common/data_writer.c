@@ -6,14 +6,27 @@
  */
 #include "common.h"
 
-static sqfs_u8 buffer[4096];
+#include <stdlib.h>
+#include <string.h>
 
-int write_data_from_file(const char *filename, sqfs_data_writer_t *data,
-			 sqfs_inode_generic_t *inode, sqfs_file_t *file,
-			 int flags)
+static sqfs_u32 fragment_group(const char *filename)
+{
+	const char *ext, *base = strrchr(filename, '/');
+	sqfs_u64 hash;
+
+	base = (base == NULL) ? filename : (base + 1);
+	ext = strrchr(base, '.');
+
+	if (ext == NULL || ext == base)
+		return 0;
+
+	hash = xxh64(ext, strlen(ext));
+	return (sqfs_u32)(hash ^ (hash >> 32));
+}
+
+static int begin_file(const char *filename, sqfs_data_writer_t *data,
+		      sqfs_inode_generic_t *inode, int flags)
 {
-	sqfs_u64 filesz, offset;
-	size_t diff;
 	int ret;
 
 	ret = sqfs_data_writer_begin_file(data, inode, flags);
@@ -22,29 +35,53 @@ int write_data_from_file(const char *filename, sqfs_data_writer_t *data,
 		return -1;
 	}
 
-	sqfs_inode_get_file_size(inode, &filesz);
+	ret = sqfs_data_writer_set_fragment_group(data,
+						  fragment_group(filename));
+	if (ret) {
+		sqfs_perror(filename, "setting fragment group", ret);
+		return -1;
+	}
 
-	for (offset = 0; offset < filesz; offset += diff) {
-		if (filesz - offset > sizeof(buffer)) {
-			diff = sizeof(buffer);
-		} else {
-			diff = filesz - offset;
+	return 0;
+}
+
+static int copy_range(const char *filename, sqfs_data_writer_t *data,
+		      sqfs_file_t *file, sqfs_u64 offset, sqfs_u64 end)
+{
+	void *buffer;
+	size_t diff;
+	int ret;
+
+	for (; offset < end; offset += diff) {
+		ret = sqfs_data_writer_get_buffer(data, &buffer, &diff);
+		if (ret) {
+			sqfs_perror(filename, "packing file data", ret);
+			return -1;
 		}
 
+		if (diff > end - offset)
+			diff = end - offset;
+
 		ret = file->read_at(file, offset, buffer, diff);
 		if (ret) {
 			sqfs_perror(filename, "reading file range", ret);
 			return -1;
 		}
 
-		ret = sqfs_data_writer_append(data, buffer, diff);
+		ret = sqfs_data_writer_commit(data, diff);
 		if (ret) {
 			sqfs_perror(filename, "packing file data", ret);
 			return -1;
 		}
 	}
 
-	ret = sqfs_data_writer_end_file(data);
+	return 0;
+}
+
+static int end_file(const char *filename, sqfs_data_writer_t *data)
+{
+	int ret = sqfs_data_writer_end_file(data);
+
 	if (ret) {
 		sqfs_perror(filename, "finishing file data", ret);
 		return -1;
@@ -52,3 +89,200 @@ int write_data_from_file(const char *filename, sqfs_data_writer_t *data,
 
 	return 0;
 }
+
+int write_data_from_file(const char *filename, sqfs_data_writer_t *data,
+			 sqfs_inode_generic_t *inode, sqfs_file_t *file,
+			 block_cache_t *cache, int flags)
+{
+	sqfs_u64 filesz;
+	int ret;
+
+	if (begin_file(filename, data, inode, flags))
+		return -1;
+
+	sqfs_inode_get_file_size(inode, &filesz);
+
+	/* the cached blocks are stored the way they were compressed */
+	if (cache != NULL && !(flags & SQFS_BLK_DONT_COMPRESS)) {
+		ret = block_cache_append(cache, filename, data, inode,
+					 file, filesz);
+	} else {
+		ret = copy_range(filename, data, file, 0, filesz);
+	}
+
+	if (ret)
+		return -1;
+
+	return end_file(filename, data);
+}
+
+int write_data_from_file_condensed(const char *filename,
+				   sqfs_data_writer_t *data,
+				   sqfs_inode_generic_t *inode,
+				   sqfs_file_t *file, const sparse_map_t *map,
+				   int flags)
+{
+	sqfs_u64 filesz, offset = 0, end;
+	int ret;
+
+	if (begin_file(filename, data, inode, flags))
+		return -1;
+
+	sqfs_inode_get_file_size(inode, &filesz);
+
+	for (;;) {
+		end = (map == NULL || map->offset > filesz) ?
+			filesz : map->offset;
+
+		if (end > offset) {
+			ret = sqfs_data_writer_append_sparse(data,
+							     end - offset);
+			if (ret) {
+				sqfs_perror(filename, "packing file data",
+					    ret);
+				return -1;
+			}
+
+			offset = end;
+		}
+
+		if (map == NULL)
+			break;
+
+		end = map->offset + map->count;
+		if (end > filesz)
+			end = filesz;
+
+		if (end > offset) {
+			if (copy_range(filename, data, file, offset, end))
+				return -1;
+
+			offset = end;
+		}
+
+		map = map->next;
+	}
+
+	return end_file(filename, data);
+}
+
+int write_data_from_image(const char *filename, sqfs_data_writer_t *data,
+			  sqfs_inode_generic_t *inode, sqfs_file_t *image,
+			  sqfs_data_reader_t *rd,
+			  const sqfs_inode_generic_t *original,
+			  size_t block_size, int flags)
+{
+	sqfs_u64 location, filesz, offset = 0, diff;
+	sqfs_u8 *buffer;
+	const void *ptr;
+	size_t i, size;
+	int ret;
+
+	if (begin_file(filename, data, inode, flags))
+		return -1;
+
+	buffer = malloc(block_size);
+	if (buffer == NULL) {
+		perror(filename);
+		return -1;
+	}
+
+	sqfs_inode_get_file_size(original, &filesz);
+	sqfs_inode_get_file_block_start(original, &location);
+
+	for (i = 0; i < original->num_file_blocks; ++i) {
+		size = SQFS_ON_DISK_BLOCK_SIZE(original->block_sizes[i]);
+
+		diff = filesz - offset;
+		if (diff > block_size)
+			diff = block_size;
+
+		if (size == 0) {
+			ret = sqfs_data_writer_append_sparse(data, diff);
+		} else if (size > block_size) {
+			ret = SQFS_ERROR_CORRUPTED;
+		} else {
+			ret = image->read_at(image, location, buffer, size);
+			if (ret == 0) {
+				ret = sqfs_data_writer_append_raw(data, buffer,
+						original->block_sizes[i]);
+			}
+		}
+
+		if (ret) {
+			sqfs_perror(filename, "copying data block", ret);
+			goto fail;
+		}
+
+		location += size;
+		offset += diff;
+	}
+
+	ret = sqfs_data_reader_peek_fragment(rd, original, &ptr, &size);
+	if (ret == 0 && ptr != NULL)
+		ret = sqfs_data_writer_append(data, ptr, size);
+
+	if (ret) {
+		sqfs_perror(filename, "copying tail end", ret);
+		goto fail;
+	}
+
+	free(buffer);
+	return end_file(filename, data);
+fail:
+	free(buffer);
+	return -1;
+}
+
+int write_data_from_reader(const char *filename, sqfs_data_writer_t *data,
+			   sqfs_inode_generic_t *inode, sqfs_data_reader_t *rd,
+			   const sqfs_inode_generic_t *original, int flags)
+{
+	sqfs_u64 filesz;
+	const void *ptr;
+	size_t i, diff;
+	int ret;
+
+	if (begin_file(filename, data, inode, flags))
+		return -1;
+
+	sqfs_inode_get_file_size(original, &filesz);
+
+	for (i = 0; i < original->num_file_blocks; ++i) {
+		ret = sqfs_data_reader_peek_block(rd, original, i, &ptr, &diff);
+		if (ret) {
+			sqfs_perror(filename, "reading data block", ret);
+			return -1;
+		}
+
+		/* holes stay holes, without looking at the zeros */
+		if (original->block_sizes[i] == 0) {
+			ret = sqfs_data_writer_append_sparse(data, diff);
+		} else {
+			ret = sqfs_data_writer_append(data, ptr, diff);
+		}
+
+		if (ret) {
+			sqfs_perror(filename, "packing data block", ret);
+			return -1;
+		}
+
+		filesz -= diff;
+	}
+
+	if (filesz > 0) {
+		ret = sqfs_data_reader_peek_fragment(rd, original, &ptr, &diff);
+		if (ret) {
+			sqfs_perror(filename, "reading fragment block", ret);
+			return -1;
+		}
+
+		ret = sqfs_data_writer_append(data, ptr, diff);
+		if (ret) {
+			sqfs_perror(filename, "packing tail end", ret);
+			return -1;
+		}
+	}
+
+	return end_file(filename, data);
+}
@@ -0,0 +1,184 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * inode_spill.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "common.h"
+#include "util/util.h"
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+/*
+  Collected inodes are written out once they take up more than this. Every
+  write out has to wait for the data writer to drain its queue, so this
+  should not be too small either.
+ */
+#define SPILL_THRESHOLD (8 * 1024 * 1024)
+
+/*
+  The file is never read by anything else, so an inode is simply stored in
+  memory layout, followed by its block sizes. The block_sizes pointer is
+  meaningless in there and fixed up when reading it back.
+ */
+struct inode_spill_t {
+	sqfs_data_writer_t *data;
+	FILE *fp;
+	sqfs_u64 end;
+
+	file_info_t **pending;
+	size_t num_pending;
+	size_t max_pending;
+	size_t pending_bytes;
+};
+
+static size_t inode_mem_size(const sqfs_inode_generic_t *inode)
+{
+	return sizeof(*inode) +
+		sizeof(inode->block_sizes[0]) * inode->num_file_blocks;
+}
+
+static int spill_pending(inode_spill_t *spill)
+{
+	sqfs_inode_generic_t *inode;
+	size_t i, count;
+	int ret;
+
+	ret = sqfs_data_writer_sync(spill->data);
+	if (ret) {
+		sqfs_perror("inode spill file", "syncing data writer", ret);
+		return -1;
+	}
+
+	if (fseeko(spill->fp, spill->end, SEEK_SET) != 0)
+		goto fail;
+
+	for (i = 0; i < spill->num_pending; ++i) {
+		inode = spill->pending[i]->user_ptr;
+		count = inode->num_file_blocks;
+
+		if (fwrite(inode, sizeof(*inode), 1, spill->fp) != 1)
+			goto fail;
+
+		if (fwrite(inode->block_sizes, sizeof(inode->block_sizes[0]),
+			   count, spill->fp) != count) {
+			goto fail;
+		}
+
+		spill->pending[i]->spill_offset = spill->end;
+		spill->pending[i]->user_ptr = NULL;
+		spill->end += inode_mem_size(inode);
+		free(inode);
+	}
+
+	spill->num_pending = 0;
+	spill->pending_bytes = 0;
+	return 0;
+fail:
+	perror("writing inodes to spill file");
+	return -1;
+}
+
+inode_spill_t *inode_spill_create(sqfs_data_writer_t *data)
+{
+	inode_spill_t *spill = calloc(1, sizeof(*spill));
+
+	if (spill == NULL) {
+		perror("creating inode spill file");
+		return NULL;
+	}
+
+	spill->fp = tmpfile();
+	if (spill->fp == NULL) {
+		perror("creating inode spill file");
+		free(spill);
+		return NULL;
+	}
+
+	spill->data = data;
+	return spill;
+}
+
+void inode_spill_destroy(inode_spill_t *spill)
+{
+	if (spill == NULL)
+		return;
+
+	fclose(spill->fp);
+	free(spill->pending);
+	free(spill);
+}
+
+int inode_spill_add(inode_spill_t *spill, file_info_t *fi)
+{
+	size_t new_sz;
+	void *new;
+
+	if (spill->num_pending == spill->max_pending) {
+		new_sz = spill->max_pending ? spill->max_pending * 2 : 128;
+		new = realloc(spill->pending,
+			      sizeof(spill->pending[0]) * new_sz);
+
+		if (new == NULL) {
+			perror("adding inode to spill file");
+			return -1;
+		}
+
+		spill->pending = new;
+		spill->max_pending = new_sz;
+	}
+
+	spill->pending[spill->num_pending++] = fi;
+	spill->pending_bytes += inode_mem_size(fi->user_ptr);
+
+	if (spill->pending_bytes < SPILL_THRESHOLD)
+		return 0;
+
+	return spill_pending(spill);
+}
+
+sqfs_inode_generic_t *inode_spill_get(inode_spill_t *spill, file_info_t *fi)
+{
+	sqfs_inode_generic_t hdr, *inode = fi->user_ptr;
+	size_t count;
+
+	if (inode != NULL) {
+		fi->user_ptr = NULL;
+		return inode;
+	}
+
+	if (spill == NULL)
+		goto fail_missing;
+
+	if (fseeko(spill->fp, fi->spill_offset, SEEK_SET) != 0 ||
+	    fread(&hdr, sizeof(hdr), 1, spill->fp) != 1) {
+		goto fail_read;
+	}
+
+	count = hdr.num_file_blocks;
+	inode = alloc_flex(sizeof(hdr), sizeof(hdr.block_sizes[0]), count);
+	if (inode == NULL) {
+		perror("reading back inode from spill file");
+		return NULL;
+	}
+
+	memcpy(inode, &hdr, sizeof(hdr));
+	inode->block_sizes = (sqfs_u32 *)inode->extra;
+
+	if (fread(inode->block_sizes, sizeof(inode->block_sizes[0]),
+		  count, spill->fp) != count) {
+		free(inode);
+		goto fail_read;
+	}
+
+	return inode;
+fail_read:
+	perror("reading back inode from spill file");
+	return NULL;
+fail_missing:
+	fputs("internal error: missing inode of a regular file.\n", stderr);
+	return NULL;
+}
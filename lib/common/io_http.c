@@ -0,0 +1,646 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * io_http.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "common.h"
+
+#include <curl/curl.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+/*
+  The image is read in chunks of HTTP_CHUNK_SIZE through range requests and
+  up to HTTP_CACHE_CHUNKS of them are kept around. Missing chunks needed at
+  the same time, e.g. for a batch from the data reader, are fetched over up
+  to HTTP_MAX_PARALLEL connections at once, at most HTTP_FETCH_MAX per
+  round. Reads that are larger than HTTP_DIRECT_SIZE bypass the cache.
+ */
+#define HTTP_CHUNK_SIZE (256 * 1024)
+#define HTTP_CACHE_CHUNKS (256)
+#define HTTP_MAX_PARALLEL (8)
+#define HTTP_FETCH_MAX (32)
+#define HTTP_DIRECT_SIZE (HTTP_FETCH_MAX / 2 * HTTP_CHUNK_SIZE)
+
+/* chunks fetched ahead of a miss right after the previous one */
+#define HTTP_READ_AHEAD (4)
+
+/*
+  When opening an image, all of the tables are fetched up front if they
+  take up at most HTTP_PREFETCH_MAX bytes. Otherwise, only the start of the
+  inode and directory tables and the last HTTP_PREFETCH_TAIL bytes of the
+  image, which hold the look up tables, are fetched.
+ */
+#define HTTP_PREFETCH_MAX (6 * 1024 * 1024)
+#define HTTP_PREFETCH_TAIL (4 * 1024 * 1024)
+
+typedef struct {
+	/* chunk number plus one, 0 if unused */
+	sqfs_u64 index;
+	sqfs_u64 last_use;
+	sqfs_u8 *data;
+} http_chunk_t;
+
+typedef struct {
+	sqfs_u64 offset;
+	sqfs_u8 *dst;
+	size_t size;
+	size_t used;
+} http_xfer_t;
+
+typedef struct {
+	sqfs_file_t base;
+
+	char *url;
+	sqfs_u64 size;
+	sqfs_u64 clock;
+	sqfs_u64 last_miss;
+
+	CURLM *multi;
+	CURL *easy[HTTP_MAX_PARALLEL];
+	bool busy[HTTP_MAX_PARALLEL];
+	char errbuf[HTTP_MAX_PARALLEL][CURL_ERROR_SIZE];
+
+	/* chunks that are wanted, but not cached, and where they go */
+	sqfs_u64 want[HTTP_FETCH_MAX];
+	http_chunk_t *want_slot[HTTP_FETCH_MAX];
+	http_xfer_t xfer[HTTP_FETCH_MAX];
+	size_t num_want;
+
+	http_chunk_t chunks[HTTP_CACHE_CHUNKS];
+} sqfs_file_http_t;
+
+static size_t write_cb(char *ptr, size_t size, size_t nmemb, void *user)
+{
+	http_xfer_t *xfer = user;
+	size_t len = size * nmemb;
+
+	/* a server that ignores the range sends way too much */
+	if (len > xfer->size - xfer->used)
+		return 0;
+
+	memcpy(xfer->dst + xfer->used, ptr, len);
+	xfer->used += len;
+	return len;
+}
+
+static int check_xfer(sqfs_file_http_t *file, CURL *easy, size_t idx,
+		      CURLcode result)
+{
+	http_xfer_t *xfer;
+	long code = 0;
+	char *ptr;
+
+	curl_easy_getinfo(easy, CURLINFO_PRIVATE, &ptr);
+	curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &code);
+	xfer = (http_xfer_t *)ptr;
+
+	if (result != CURLE_OK) {
+		fprintf(stderr, "%s: %s\n", file->url,
+			file->errbuf[idx][0] != '\0' ? file->errbuf[idx] :
+			curl_easy_strerror(result));
+		return SQFS_ERROR_IO;
+	}
+
+	if (code != 206 && !(code == 200 && xfer->offset == 0 &&
+			     xfer->size == file->size)) {
+		fprintf(stderr, "%s: server does not support range requests "
+			"(HTTP status %ld).\n", file->url, code);
+		return SQFS_ERROR_IO;
+	}
+
+	if (xfer->used != xfer->size) {
+		fprintf(stderr, "%s: short read at offset %llu.\n", file->url,
+			(unsigned long long)xfer->offset);
+		return SQFS_ERROR_IO;
+	}
+
+	return 0;
+}
+
+static void start_xfer(sqfs_file_http_t *file, size_t idx, http_xfer_t *xfer)
+{
+	CURL *easy = file->easy[idx];
+	char range[64];
+
+	sprintf(range, "%llu-%llu", (unsigned long long)xfer->offset,
+		(unsigned long long)(xfer->offset + xfer->size - 1));
+
+	xfer->used = 0;
+	file->errbuf[idx][0] = '\0';
+	file->busy[idx] = true;
+
+	curl_easy_setopt(easy, CURLOPT_RANGE, range);
+	curl_easy_setopt(easy, CURLOPT_WRITEDATA, xfer);
+	curl_easy_setopt(easy, CURLOPT_PRIVATE, xfer);
+	curl_multi_add_handle(file->multi, easy);
+}
+
+/*
+  Carry out all transfers, HTTP_MAX_PARALLEL at a time. After a failure,
+  no new transfers are started, but the ones in flight are finished.
+ */
+static int run_xfers(sqfs_file_http_t *file, http_xfer_t *xfer, size_t count)
+{
+	size_t idx, next = 0, active = 0;
+	int err, ret = 0, running, left;
+	CURLMcode mc;
+	CURLMsg *msg;
+
+	while ((ret == 0 && next < count) || active > 0) {
+		for (idx = 0; idx < HTTP_MAX_PARALLEL; ++idx) {
+			if (ret != 0 || next >= count)
+				break;
+
+			if (!file->busy[idx]) {
+				start_xfer(file, idx, xfer + next++);
+				++active;
+			}
+		}
+
+		mc = curl_multi_perform(file->multi, &running);
+
+		while ((msg = curl_multi_info_read(file->multi,
+						   &left)) != NULL) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+
+			for (idx = 0; idx < HTTP_MAX_PARALLEL; ++idx) {
+				if (file->easy[idx] == msg->easy_handle)
+					break;
+			}
+
+			err = check_xfer(file, msg->easy_handle, idx,
+					 msg->data.result);
+			if (err != 0 && ret == 0)
+				ret = err;
+
+			curl_multi_remove_handle(file->multi,
+						 msg->easy_handle);
+			file->busy[idx] = false;
+			--active;
+		}
+
+		if (mc == CURLM_OK && active > 0)
+			mc = curl_multi_poll(file->multi, NULL, 0, 1000, NULL);
+
+		if (mc != CURLM_OK) {
+			fprintf(stderr, "%s: %s\n", file->url,
+				curl_multi_strerror(mc));
+			ret = SQFS_ERROR_IO;
+			break;
+		}
+	}
+
+	if (active > 0) {
+		for (idx = 0; idx < HTTP_MAX_PARALLEL; ++idx) {
+			if (!file->busy[idx])
+				continue;
+
+			curl_multi_remove_handle(file->multi, file->easy[idx]);
+			file->busy[idx] = false;
+		}
+	}
+
+	return ret;
+}
+
+/*****************************************************************************/
+
+static size_t chunk_size(const sqfs_file_http_t *file, sqfs_u64 index)
+{
+	sqfs_u64 start = index * HTTP_CHUNK_SIZE;
+	sqfs_u64 diff = file->size - start;
+
+	return diff < HTTP_CHUNK_SIZE ? diff : HTTP_CHUNK_SIZE;
+}
+
+static http_chunk_t *find_chunk(sqfs_file_http_t *file, sqfs_u64 index)
+{
+	size_t i;
+
+	for (i = 0; i < HTTP_CACHE_CHUNKS; ++i) {
+		if (file->chunks[i].index == index + 1)
+			return file->chunks + i;
+	}
+
+	return NULL;
+}
+
+static bool is_wanted(const sqfs_file_http_t *file, sqfs_u64 index)
+{
+	size_t i;
+
+	for (i = 0; i < file->num_want; ++i) {
+		if (file->want[i] == index)
+			return true;
+	}
+
+	return false;
+}
+
+/* Put a chunk on the list, unless it is cached or on the list already. */
+static void want_chunk(sqfs_file_http_t *file, sqfs_u64 index)
+{
+	http_chunk_t *chunk = find_chunk(file, index);
+
+	if (chunk != NULL) {
+		chunk->last_use = ++file->clock;
+	} else if (!is_wanted(file, index)) {
+		file->want[file->num_want++] = index;
+	}
+}
+
+/*
+  Fetch the wanted chunks into the least recently used slots. Everything
+  that was touched since the last fetch is newer than the slots that are
+  replaced, as long as a round touches less than HTTP_CACHE_CHUNKS.
+ */
+static int fetch_wanted(sqfs_file_http_t *file)
+{
+	http_chunk_t *chunk;
+	size_t i, j;
+	int ret;
+
+	for (i = 0; i < file->num_want; ++i) {
+		chunk = file->chunks;
+
+		for (j = 1; j < HTTP_CACHE_CHUNKS; ++j) {
+			if (file->chunks[j].last_use < chunk->last_use)
+				chunk = file->chunks + j;
+		}
+
+		if (chunk->data == NULL) {
+			chunk->data = malloc(HTTP_CHUNK_SIZE);
+			if (chunk->data == NULL) {
+				file->num_want = 0;
+				return SQFS_ERROR_ALLOC;
+			}
+		}
+
+		chunk->index = 0;
+		chunk->last_use = ++file->clock;
+		file->want_slot[i] = chunk;
+
+		file->xfer[i].offset = file->want[i] * HTTP_CHUNK_SIZE;
+		file->xfer[i].dst = chunk->data;
+		file->xfer[i].size = chunk_size(file, file->want[i]);
+	}
+
+	ret = run_xfers(file, file->xfer, file->num_want);
+
+	if (ret == 0) {
+		for (i = 0; i < file->num_want; ++i)
+			file->want_slot[i]->index = file->want[i] + 1;
+	}
+
+	file->num_want = 0;
+	return ret;
+}
+
+static size_t chunks_spanned(sqfs_u64 offset, size_t size)
+{
+	return (offset + size - 1) / HTTP_CHUNK_SIZE -
+		offset / HTTP_CHUNK_SIZE + 1;
+}
+
+static void want_range(sqfs_file_http_t *file, sqfs_u64 offset, size_t size)
+{
+	sqfs_u64 i = offset / HTTP_CHUNK_SIZE;
+	sqfs_u64 last = (offset + size - 1) / HTTP_CHUNK_SIZE;
+
+	for (; i <= last; ++i)
+		want_chunk(file, i);
+}
+
+/* all chunks of the range must be cached */
+static int copy_range(sqfs_file_http_t *file, sqfs_u64 offset,
+		      void *buffer, size_t size)
+{
+	size_t diff, chunk_off;
+	http_chunk_t *chunk;
+
+	while (size > 0) {
+		chunk = find_chunk(file, offset / HTTP_CHUNK_SIZE);
+		if (chunk == NULL)
+			return SQFS_ERROR_INTERNAL;
+
+		chunk_off = offset % HTTP_CHUNK_SIZE;
+
+		diff = HTTP_CHUNK_SIZE - chunk_off;
+		if (diff > size)
+			diff = size;
+
+		memcpy(buffer, chunk->data + chunk_off, diff);
+
+		buffer = (char *)buffer + diff;
+		offset += diff;
+		size -= diff;
+	}
+
+	return 0;
+}
+
+/*****************************************************************************/
+
+static int http_read_direct(sqfs_file_http_t *file, sqfs_u64 offset,
+			    void *buffer, size_t size)
+{
+	http_xfer_t xfer;
+
+	xfer.offset = offset;
+	xfer.dst = buffer;
+	xfer.size = size;
+	xfer.used = 0;
+
+	return run_xfers(file, &xfer, 1);
+}
+
+static int http_read_at(sqfs_file_t *base, sqfs_u64 offset,
+			void *buffer, size_t size)
+{
+	sqfs_file_http_t *file = (sqfs_file_http_t *)base;
+	sqfs_u64 i, first;
+	int ret;
+
+	if (size == 0)
+		return 0;
+
+	if (offset >= file->size || size > file->size - offset)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	if (size > HTTP_DIRECT_SIZE)
+		return http_read_direct(file, offset, buffer, size);
+
+	want_range(file, offset, size);
+
+	if (file->num_want > 0) {
+		first = file->want[0];
+
+		if (first == file->last_miss + 1) {
+			for (i = 1; i <= HTTP_READ_AHEAD; ++i) {
+				if ((first + i) * HTTP_CHUNK_SIZE >= file->size)
+					break;
+
+				want_chunk(file, first + i);
+			}
+		}
+
+		file->last_miss = file->want[file->num_want - 1];
+
+		ret = fetch_wanted(file);
+		if (ret)
+			return ret;
+	}
+
+	return copy_range(file, offset, buffer, size);
+}
+
+static int finish_io(sqfs_file_http_t *file, const sqfs_file_io_t *io)
+{
+	if (io->size == 0)
+		return 0;
+
+	if (io->size > HTTP_DIRECT_SIZE)
+		return http_read_direct(file, io->offset, io->buffer, io->size);
+
+	return copy_range(file, io->offset, io->buffer, io->size);
+}
+
+/*
+  The reads are gathered in rounds that touch at most 2 * HTTP_FETCH_MAX
+  chunks, so fetching the missing ones never evicts a chunk that is needed
+  in the same round.
+ */
+static int http_read_batch(sqfs_file_t *base, const sqfs_file_io_t *io,
+			   size_t count)
+{
+	sqfs_file_http_t *file = (sqfs_file_http_t *)base;
+	size_t i, diff, first = 0, touched = 0;
+	int ret = 0;
+
+	for (i = 0; i < count && ret == 0; ++i) {
+		if (io[i].size == 0)
+			continue;
+
+		if (io[i].offset >= file->size ||
+		    io[i].size > file->size - io[i].offset) {
+			ret = SQFS_ERROR_OUT_OF_BOUNDS;
+			break;
+		}
+
+		if (io[i].size > HTTP_DIRECT_SIZE)
+			continue;
+
+		diff = chunks_spanned(io[i].offset, io[i].size);
+
+		if (file->num_want + diff > HTTP_FETCH_MAX ||
+		    touched + diff > 2 * HTTP_FETCH_MAX) {
+			ret = fetch_wanted(file);
+
+			for (; ret == 0 && first < i; ++first)
+				ret = finish_io(file, io + first);
+
+			touched = 0;
+		}
+
+		want_range(file, io[i].offset, io[i].size);
+		touched += diff;
+	}
+
+	if (ret == 0)
+		ret = fetch_wanted(file);
+
+	for (; ret == 0 && first < count; ++first)
+		ret = finish_io(file, io + first);
+
+	file->num_want = 0;
+	return ret;
+}
+
+static int http_write_at(sqfs_file_t *base, sqfs_u64 offset,
+			 const void *buffer, size_t size)
+{
+	(void)base; (void)offset; (void)buffer; (void)size;
+	return SQFS_ERROR_IO;
+}
+
+static int http_truncate(sqfs_file_t *base, sqfs_u64 size)
+{
+	(void)base; (void)size;
+	return SQFS_ERROR_IO;
+}
+
+static sqfs_u64 http_get_size(const sqfs_file_t *base)
+{
+	return ((const sqfs_file_http_t *)base)->size;
+}
+
+static void http_destroy(sqfs_file_t *base)
+{
+	sqfs_file_http_t *file = (sqfs_file_http_t *)base;
+	size_t i;
+
+	for (i = 0; i < HTTP_MAX_PARALLEL; ++i) {
+		if (file->easy[i] != NULL)
+			curl_easy_cleanup(file->easy[i]);
+	}
+
+	if (file->multi != NULL)
+		curl_multi_cleanup(file->multi);
+
+	for (i = 0; i < HTTP_CACHE_CHUNKS; ++i)
+		free(file->chunks[i].data);
+
+	free(file->url);
+	free(file);
+	curl_global_cleanup();
+}
+
+/*****************************************************************************/
+
+static int get_remote_size(sqfs_file_http_t *file)
+{
+	CURL *easy = file->easy[0];
+	curl_off_t length = -1;
+	CURLcode ret;
+
+	curl_easy_setopt(easy, CURLOPT_NOBODY, 1L);
+	ret = curl_easy_perform(easy);
+	curl_easy_setopt(easy, CURLOPT_HTTPGET, 1L);
+
+	if (ret != CURLE_OK) {
+		fprintf(stderr, "%s: %s\n", file->url,
+			file->errbuf[0][0] != '\0' ? file->errbuf[0] :
+			curl_easy_strerror(ret));
+		return -1;
+	}
+
+	curl_easy_getinfo(easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+
+	if (length < 0) {
+		fprintf(stderr, "%s: server did not report the size.\n",
+			file->url);
+		return -1;
+	}
+
+	file->size = length;
+	return 0;
+}
+
+/*
+  Fetch the chunks that everything else needs before it can find out where
+  to look next, in one go instead of one round trip after another. A
+  failure is not an error here, reading the super block properly reports
+  it later.
+ */
+static void prefetch_tables(sqfs_file_http_t *file)
+{
+	sqfs_u64 start, root;
+	sqfs_super_t super;
+
+	if (sqfs_super_read(&super, (sqfs_file_t *)file))
+		return;
+
+	if (super.bytes_used > file->size ||
+	    super.inode_table_start >= super.bytes_used ||
+	    super.directory_table_start >= super.bytes_used) {
+		return;
+	}
+
+	start = super.inode_table_start;
+
+	if (super.bytes_used - start > HTTP_PREFETCH_MAX) {
+		root = start + (super.root_inode_ref >> 16);
+
+		if (root < super.bytes_used)
+			want_chunk(file, root / HTTP_CHUNK_SIZE);
+
+		want_chunk(file, super.directory_table_start /
+			   HTTP_CHUNK_SIZE);
+
+		start = super.bytes_used - HTTP_PREFETCH_TAIL;
+	}
+
+	want_range(file, start, super.bytes_used - start);
+	fetch_wanted(file);
+}
+
+sqfs_file_t *sqfs_open_http(const char *url)
+{
+	sqfs_file_http_t *file;
+	sqfs_file_t *base;
+	size_t i;
+
+	if (curl_global_init(CURL_GLOBAL_DEFAULT) != 0) {
+		fprintf(stderr, "%s: error initializing libcurl.\n", url);
+		return NULL;
+	}
+
+	file = calloc(1, sizeof(*file));
+	base = (sqfs_file_t *)file;
+	if (file == NULL)
+		goto fail_errno;
+
+	base->destroy = http_destroy;
+	base->read_at = http_read_at;
+	base->read_batch = http_read_batch;
+	base->write_at = http_write_at;
+	base->get_size = http_get_size;
+	base->truncate = http_truncate;
+	file->last_miss = ~((sqfs_u64)0) - 1;
+
+	file->url = strdup(url);
+	if (file->url == NULL)
+		goto fail_errno;
+
+	file->multi = curl_multi_init();
+	if (file->multi == NULL)
+		goto fail_curl;
+
+	curl_multi_setopt(file->multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+			  (long)HTTP_MAX_PARALLEL);
+
+	for (i = 0; i < HTTP_MAX_PARALLEL; ++i) {
+		file->easy[i] = curl_easy_init();
+		if (file->easy[i] == NULL)
+			goto fail_curl;
+
+		curl_easy_setopt(file->easy[i], CURLOPT_URL, url);
+		curl_easy_setopt(file->easy[i], CURLOPT_FOLLOWLOCATION, 1L);
+		curl_easy_setopt(file->easy[i], CURLOPT_FAILONERROR, 1L);
+		curl_easy_setopt(file->easy[i], CURLOPT_ERRORBUFFER,
+				 file->errbuf[i]);
+		curl_easy_setopt(file->easy[i], CURLOPT_WRITEFUNCTION,
+				 write_cb);
+	}
+
+	if (get_remote_size(file))
+		goto fail;
+
+	if (file->size > 0) {
+		want_chunk(file, 0);
+		if (fetch_wanted(file))
+			goto fail;
+
+		prefetch_tables(file);
+	}
+
+	return base;
+fail_curl:
+	fprintf(stderr, "%s: error initializing libcurl.\n", url);
+	goto fail;
+fail_errno:
+	perror(url);
+fail:
+	if (file != NULL) {
+		http_destroy(base);
+	} else {
+		curl_global_cleanup();
+	}
+	return NULL;
+}
@@ -11,18 +11,32 @@
 #include <string.h>
 #include <errno.h>
 
-
 typedef struct {
 	sqfs_file_t base;
 
+	istream_t *strm;
 	const sparse_map_t *map;
 	sqfs_u64 offset;
 	sqfs_u64 size;
-} sqfs_file_stdinout_t;
 
+	/*
+	  Reads go forward, so the search for a range resumes at the first
+	  map entry that did not end before the previous read. poffset is
+	  the position of its data in the condensed input.
+	 */
+	const sparse_map_t *cursor;
+	sqfs_u64 poffset;
+	sqfs_u64 last_read;
+} sqfs_file_stdinout_t;
 
 static void stdinout_destroy(sqfs_file_t *base)
 {
+	sqfs_file_stdinout_t *file = (sqfs_file_stdinout_t *)base;
+
+	/* a failure shows up when reading whatever comes after it */
+	if (file->strm != NULL && file->offset < file->size)
+		istream_skip(file->strm, file->size - file->offset);
+
 	free(base);
 }
 
@@ -43,47 +57,31 @@ static int stdin_read_at(sqfs_file_t *base, sqfs_u64 offset,
 			 void *buffer, size_t size)
 {
 	sqfs_file_stdinout_t *file = (sqfs_file_stdinout_t *)base;
-	size_t temp_size = 0;
-	sqfs_u8 *temp = NULL;
-	sqfs_u64 diff;
-	ssize_t ret;
+	sqfs_s32 ret;
 
 	if (offset < file->offset)
 		return SQFS_ERROR_IO;
 
-	if (offset > file->offset) {
-		temp_size = 1024;
-		temp = alloca(temp_size);
-	}
-
 	if (offset >= file->size || (offset + size) > file->size)
 		return SQFS_ERROR_OUT_OF_BOUNDS;
 
-	while (size > 0) {
-		if (offset > file->offset) {
-			diff = file->offset - offset;
-			diff = diff > (sqfs_u64)temp_size ? temp_size : diff;
+	if (offset > file->offset) {
+		if (istream_skip(file->strm, offset - file->offset))
+			return SQFS_ERROR_IO;
 
-			ret = read(STDIN_FILENO, temp, diff);
-		} else {
-			ret = read(STDIN_FILENO, buffer, size);
-		}
+		file->offset = offset;
+	}
 
-		if (ret < 0) {
-			if (errno == EINTR)
-				continue;
+	while (size > 0) {
+		ret = istream_read(file->strm, buffer, size);
+		if (ret < 0)
 			return SQFS_ERROR_IO;
-		}
 
 		if (ret == 0)
 			return SQFS_ERROR_OUT_OF_BOUNDS;
 
-		if (offset <= file->offset) {
-			buffer = (char *)buffer + ret;
-			size -= ret;
-			offset += ret;
-		}
-
+		buffer = (char *)buffer + ret;
+		size -= ret;
 		file->offset += ret;
 	}
 
@@ -94,49 +92,45 @@ static int stdin_read_condensed(sqfs_file_t *base, sqfs_u64 offset,
 				void *buffer, size_t size)
 {
 	sqfs_file_stdinout_t *file = (sqfs_file_stdinout_t *)base;
-	sqfs_u64 poffset = 0, src_start;
-	size_t dst_start, diff, count;
+	sqfs_u64 poffset, start, end;
 	const sparse_map_t *it;
 	int err;
 
 	memset(buffer, 0, size);
 
-	for (it = file->map; it != NULL; it = it->next) {
-		if (it->offset + it->count <= offset) {
-			poffset += it->count;
-			continue;
-		}
+	if (offset < file->last_read) {
+		file->cursor = file->map;
+		file->poffset = 0;
+	}
 
-		if (it->offset >= offset + size) {
-			poffset += it->count;
-			continue;
-		}
+	file->last_read = offset;
 
-		count = size;
+	while (file->cursor != NULL &&
+	       file->cursor->offset + file->cursor->count <= offset) {
+		file->poffset += file->cursor->count;
+		file->cursor = file->cursor->next;
+	}
 
-		if (offset + count >= it->offset + it->count)
-			count = it->offset + it->count - offset;
+	poffset = file->poffset;
 
-		if (it->offset < offset) {
-			diff = offset - it->offset;
+	for (it = file->cursor; it != NULL; it = it->next) {
+		if (it->offset >= offset + size)
+			break;
 
-			src_start = poffset + diff;
-			dst_start = 0;
-			count -= diff;
-		} else if (it->offset > offset) {
-			diff = it->offset - offset;
+		start = it->offset > offset ? it->offset : offset;
+		end = it->offset + it->count;
 
-			src_start = poffset;
-			dst_start = diff;
-		} else {
-			src_start = poffset;
-			dst_start = 0;
-		}
+		if (end > offset + size)
+			end = offset + size;
 
-		err = stdin_read_at(base, src_start,
-				    (char *)buffer + dst_start, count);
-		if (err)
-			return err;
+		if (end > start) {
+			err = stdin_read_at(base,
+					    poffset + (start - it->offset),
+					    (char *)buffer + (start - offset),
+					    end - start);
+			if (err)
+				return err;
+		}
 
 		poffset += it->count;
 	}
@@ -153,65 +147,8 @@ static int stdin_write_at(sqfs_file_t *base, sqfs_u64 offset,
 
 /*****************************************************************************/
 
-static int stdout_read_at(sqfs_file_t *base, sqfs_u64 offset,
-			  void *buffer, size_t size)
-{
-	(void)base; (void)offset; (void)buffer; (void)size;
-	return SQFS_ERROR_IO;
-}
-
-static int stdout_write_at(sqfs_file_t *base, sqfs_u64 offset,
-			   const void *buffer, size_t size)
-{
-	sqfs_file_stdinout_t *file = (sqfs_file_stdinout_t *)base;
-	size_t temp_size = 0;
-	sqfs_u8 *temp = NULL;
-	sqfs_u64 diff;
-	ssize_t ret;
-
-	if (offset < file->size)
-		return SQFS_ERROR_IO;
-
-	if (offset > file->size) {
-		temp_size = 1024;
-		temp = alloca(temp_size);
-		memset(temp, 0, temp_size);
-	}
-
-	while (size > 0) {
-		if (offset > file->size) {
-			diff = offset - file->size;
-			diff = diff > (sqfs_u64)temp_size ? temp_size : diff;
-
-			ret = write(STDOUT_FILENO, temp, diff);
-		} else {
-			ret = write(STDOUT_FILENO, buffer, size);
-		}
-
-		if (ret < 0) {
-			if (errno == EINTR)
-				continue;
-			return SQFS_ERROR_IO;
-		}
-
-		if (ret == 0)
-			return SQFS_ERROR_OUT_OF_BOUNDS;
-
-		if (offset <= file->size) {
-			buffer = (char *)buffer + ret;
-			size -= ret;
-			offset += ret;
-		}
-
-		file->size += ret;
-	}
-
-	return 0;
-}
-
-/*****************************************************************************/
-
-sqfs_file_t *sqfs_get_stdin_file(const sparse_map_t *map, sqfs_u64 size)
+sqfs_file_t *sqfs_get_stdin_file(istream_t *strm, const sparse_map_t *map,
+				 sqfs_u64 size)
 {
 	sqfs_file_stdinout_t *file = calloc(1, sizeof(*file));
 	sqfs_file_t *base = (sqfs_file_t *)file;
@@ -219,35 +156,20 @@ sqfs_file_t *sqfs_get_stdin_file(const sparse_map_t *map, sqfs_u64 size)
 	if (file == NULL)
 		return NULL;
 
+	file->strm = strm;
 	file->size = size;
 	file->map = map;
+	file->cursor = map;
 
 	base->destroy = stdinout_destroy;
 	base->write_at = stdin_write_at;
 	base->get_size = stdinout_get_size;
 	base->truncate = stdinout_truncate;
 
-	if (map == NULL) {
-		base->read_at = stdin_read_at;
-	} else {
+	if (map != NULL) {
 		base->read_at = stdin_read_condensed;
+	} else {
+		base->read_at = stdin_read_at;
 	}
 	return base;
 }
-
-sqfs_file_t *sqfs_get_stdout_file(void)
-{
-	sqfs_file_stdinout_t *file = calloc(1, sizeof(*file));
-	sqfs_file_t *base = (sqfs_file_t *)file;
-
-	if (file == NULL)
-		return NULL;
-
-	base->destroy = stdinout_destroy;
-	base->write_at = stdout_write_at;
-	base->get_size = stdinout_get_size;
-	base->truncate = stdinout_truncate;
-	base->read_at = stdout_read_at;
-
-	return base;
-}
@@ -0,0 +1,273 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * level_tuner.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+/* one per compressor the data writer can hold */
+#define MAX_LEVELS (8)
+
+/* input to pack between two decisions, so the timing has settled */
+#define TUNE_INTERVAL (8 * 1024 * 1024)
+
+/*
+  Only go back to a higher level if the compressors could keep up with
+  twice the rate, higher levels easily cost that much.
+ */
+#define RAISE_FACTOR (2)
+
+struct level_tuner_t {
+	sqfs_data_writer_t *data;
+
+	/* descending levels, index 0 is the one the user asked for */
+	sqfs_compressor_t *cmp[MAX_LEVELS];
+	sqfs_u32 id[MAX_LEVELS];
+	unsigned int level[MAX_LEVELS];
+	size_t blocks[MAX_LEVELS];
+	size_t count;
+
+	size_t current;
+	size_t changes;
+
+	/* the measurements at the last decision */
+	sqfs_data_writer_timing_t last;
+	sqfs_u64 last_in;
+};
+
+/*
+  The levels only affect the compressor, so the blocks can be unpacked with
+  the options of the first one. Variants that have no level, like lzo
+  without lzo1x_999 or lz4 without hc, are rejected.
+ */
+static sqfs_u16 *level_field(sqfs_compressor_config_t *cfg,
+			     unsigned int *def)
+{
+	switch (cfg->id) {
+	case SQFS_COMP_GZIP:
+		*def = SQFS_GZIP_DEFAULT_LEVEL;
+		return &cfg->opt.gzip.level;
+	case SQFS_COMP_ZSTD:
+		*def = SQFS_ZSTD_DEFAULT_LEVEL;
+		return &cfg->opt.zstd.level;
+	case SQFS_COMP_XZ:
+		*def = SQFS_XZ_DEFAULT_LEVEL;
+		return &cfg->opt.xz.level;
+	case SQFS_COMP_LZO:
+		if (cfg->opt.lzo.algorithm != SQFS_LZO1X_999)
+			return NULL;
+		*def = SQFS_LZO_DEFAULT_LEVEL;
+		return &cfg->opt.lzo.level;
+	case SQFS_COMP_LZ4:
+		if (!(cfg->flags & SQFS_COMP_FLAG_LZ4_HC))
+			return NULL;
+		*def = SQFS_LZ4_DEFAULT_LEVEL;
+		return &cfg->opt.lz4.level;
+	default:
+		return NULL;
+	}
+}
+
+level_tuner_t *level_tuner_create(const sqfs_compressor_config_t *cfg)
+{
+	size_t min, max, i, count;
+	sqfs_compressor_config_t copy;
+	unsigned int def, top;
+	level_tuner_t *tuner;
+	sqfs_u16 *field;
+
+	copy = *cfg;
+	field = level_field(&copy, &def);
+
+	if (field == NULL ||
+	    !compressor_get_level_range(cfg->id, &min, &max)) {
+		fputs("The compressor settings have no compression level "
+		      "that could be tuned.\n", stderr);
+		return NULL;
+	}
+
+	top = *field > 0 ? *field : def;
+	if (top <= min) {
+		fputs("Already using the fastest compression level, "
+		      "nothing to tune.\n", stderr);
+		return NULL;
+	}
+
+	tuner = calloc(1, sizeof(*tuner));
+	if (tuner == NULL) {
+		perror("creating level tuner");
+		return NULL;
+	}
+
+	count = top - min + 1;
+	if (count > MAX_LEVELS)
+		count = MAX_LEVELS;
+
+	/* spread evenly from the requested level down to the fastest one */
+	for (i = 1; i < count; ++i) {
+		tuner->level[i] = top - ((top - min) * i) / (count - 1);
+		*field = tuner->level[i];
+
+		tuner->cmp[i] = sqfs_compressor_create(&copy);
+		if (tuner->cmp[i] == NULL) {
+			fputs("Error creating compressor\n", stderr);
+			level_tuner_destroy(tuner);
+			return NULL;
+		}
+	}
+
+	tuner->level[0] = top;
+	tuner->count = count;
+	return tuner;
+}
+
+void level_tuner_destroy(level_tuner_t *tuner)
+{
+	size_t i;
+
+	if (tuner == NULL)
+		return;
+
+	for (i = 1; i < MAX_LEVELS; ++i) {
+		if (tuner->cmp[i] != NULL)
+			tuner->cmp[i]->destroy(tuner->cmp[i]);
+	}
+
+	free(tuner);
+}
+
+int level_tuner_attach(level_tuner_t *tuner, const char *filename,
+		       sqfs_data_writer_t *data)
+{
+	size_t i;
+	int ret;
+
+	for (i = 1; i < tuner->count; ++i) {
+		ret = sqfs_data_writer_add_compressor(data, tuner->cmp[i],
+						      &tuner->id[i]);
+		if (ret) {
+			sqfs_perror(filename, "adding compressor", ret);
+			return -1;
+		}
+	}
+
+	tuner->data = data;
+	tuner->last.size = sizeof(tuner->last);
+
+	if (sqfs_data_writer_get_timing(data, &tuner->last)) {
+		fputs("Tuning the compression level requires the data "
+		      "writer timing.\n", stderr);
+		return -1;
+	}
+
+	return 0;
+}
+
+static sqfs_u64 rate(sqfs_u64 bytes, sqfs_u64 ns)
+{
+	return ns > 0 ? (bytes * 1000) / ns : ~((sqfs_u64)0);
+}
+
+static void select_level(level_tuner_t *tuner, size_t idx)
+{
+	if (idx == tuner->current)
+		return;
+
+	if (sqfs_data_writer_set_default_compressor(tuner->data,
+						    tuner->id[idx])) {
+		return;
+	}
+
+	tuner->current = idx;
+	tuner->changes += 1;
+}
+
+/*
+  All rates are in bytes of input per microsecond, so they can be compared
+  directly. The compressors can take up input as fast as one of them does,
+  times the number of workers. Like in the statistics, the time that the
+  main thread spends neither waiting for the compressors nor writing is
+  taken as the time it needs to read the input. Whichever of reading and writing is slower sets
+  the pace the compressors have to keep up with.
+ */
+static void decide(level_tuner_t *tuner, const sqfs_data_writer_timing_t *t,
+		   sqfs_u64 in)
+{
+	sqfs_u64 wall, busy, wait, write, other, workers;
+	sqfs_u64 cmp_rate, in_rate, out_rate, pace;
+	const sqfs_data_writer_timing_t *l = &tuner->last;
+
+	wall = t->total_time - l->total_time;
+	busy = t->compress_time - l->compress_time;
+	write = t->write_time - l->write_time;
+	wait = t->num_workers > 0 ? t->backlog_wait - l->backlog_wait : busy;
+	other = wait + write < wall ? wall - wait - write : 0;
+	workers = t->num_workers > 0 ? t->num_workers : 1;
+
+	/* nothing was actually compressed, e.g. only cached blocks */
+	if (busy == 0 || in == 0)
+		return;
+
+	cmp_rate = rate(in * workers, busy);
+	in_rate = rate(in, other);
+	out_rate = rate(in, write);
+
+	pace = in_rate < out_rate ? in_rate : out_rate;
+
+	if (cmp_rate < pace) {
+		if (tuner->current + 1 < tuner->count)
+			select_level(tuner, tuner->current + 1);
+	} else if (cmp_rate / RAISE_FACTOR > pace) {
+		if (tuner->current > 0)
+			select_level(tuner, tuner->current - 1);
+	}
+}
+
+void level_tuner_update(level_tuner_t *tuner, const sqfs_block_t *block,
+			const data_writer_stats_t *stats)
+{
+	sqfs_data_writer_timing_t now;
+	size_t i;
+
+	if (!(block->flags & SQFS_BLK_FRAGMENT_BLOCK) && block->size > 0) {
+		for (i = 0; i < tuner->count; ++i) {
+			if (tuner->id[i] == block->cmp_id) {
+				tuner->blocks[i] += 1;
+				break;
+			}
+		}
+	}
+
+	if (stats->progress.bytes_in - tuner->last_in < TUNE_INTERVAL)
+		return;
+
+	now.size = sizeof(now);
+	if (sqfs_data_writer_get_timing(tuner->data, &now))
+		return;
+
+	decide(tuner, &now, stats->progress.bytes_in - tuner->last_in);
+
+	tuner->last = now;
+	tuner->last_in = stats->progress.bytes_in;
+}
+
+void level_tuner_print(const level_tuner_t *tuner)
+{
+	size_t i;
+
+	for (i = 0; i < tuner->count; ++i) {
+		if (tuner->blocks[i] == 0)
+			continue;
+
+		printf("Data blocks compressed at level %u: %zu\n",
+		       tuner->level[i], tuner->blocks[i]);
+	}
+
+	printf("Compression level adjusted %zu times, last %u\n",
+	       tuner->changes, tuner->level[tuner->current]);
+}
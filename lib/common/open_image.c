@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * open_image.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "common.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+static bool is_url(const char *path)
+{
+	return strncmp(path, "http://", 7) == 0 ||
+		strncmp(path, "https://", 8) == 0;
+}
+
+sqfs_file_t *sqfs_open_image(const char *path, sqfs_u32 flags)
+{
+	sqfs_file_t *file;
+
+	if (!is_url(path))
+		return sqfs_open_file(path, flags);
+
+#ifdef WITH_CURL
+	file = sqfs_open_http(path);
+	if (file == NULL)
+		errno = EIO;
+#else
+	fprintf(stderr, "%s: not built with support for reading images "
+		"over HTTP.\n", path);
+	file = NULL;
+	errno = ENOTSUP;
+#endif
+	return file;
+}
@@ -58,6 +58,9 @@ void sqfs_perror(const char *file, const char *action, int error_code)
 	case SQFS_ERROR_NOT_FILE:
 		errstr = "target is not a file";
 		break;
+	case SQFS_ERROR_NO_BLOCK_LIST:
+		errstr = "block list of file not loaded";
+		break;
 	default:
 		errstr = "libsquashfs returned an unknown error code";
 		break;
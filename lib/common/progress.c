@@ -0,0 +1,108 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * progress.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "common.h"
+
+#include <unistd.h>
+#include <stdio.h>
+
+/* on a terminal the line is redrawn in place, otherwise a line is added */
+#define TTY_INTERVAL_NS (250 * 1000000ULL)
+#define LOG_INTERVAL_NS (10 * 1000000000ULL)
+
+static double mib(sqfs_u64 bytes)
+{
+	return (double)bytes / (1024.0 * 1024.0);
+}
+
+static void print_line(data_writer_stats_t *stats, sqfs_u64 now)
+{
+	progress_t *p = &stats->progress;
+	sqfs_u64 elapsed = now - p->start, left;
+	double rate;
+
+	rate = elapsed > 0 ? mib(p->bytes_in) * 1e9 / elapsed : 0.0;
+
+	printf("%s%.1f MiB processed, %.1f MiB written", p->tty ? "\r" : "",
+	       mib(p->bytes_in), mib(stats->bytes_written));
+
+	if (p->bytes_in > 0) {
+		printf(" (%u%%)", (unsigned int)((100 * stats->bytes_written) /
+						 p->bytes_in));
+	}
+
+	printf(", %.1f MiB/s", rate);
+
+	if (p->data != NULL) {
+		printf(", backlog %zu/%zu",
+		       sqfs_data_writer_get_backlog(p->data), p->max_backlog);
+	}
+
+	if (p->total > 0 && p->bytes_in <= p->total) {
+		printf(", %u%%", (unsigned int)((100 * p->bytes_in) /
+						p->total));
+
+		if (rate > 0.0) {
+			left = (sqfs_u64)(mib(p->total - p->bytes_in) / rate);
+
+			printf(", ETA %u:%02u:%02u",
+			       (unsigned int)(left / 3600),
+			       (unsigned int)((left / 60) % 60),
+			       (unsigned int)(left % 60));
+		}
+	}
+
+	/* clear what is left of a longer, previous line */
+	fputs(p->tty ? "\033[K" : "\n", stdout);
+	fflush(stdout);
+
+	p->last = now;
+	p->shown = true;
+}
+
+void progress_start(data_writer_stats_t *stats, sqfs_data_writer_t *data,
+		    size_t block_size, size_t max_backlog)
+{
+	progress_t *p = &stats->progress;
+
+	p->data = data;
+	p->block_size = block_size;
+	p->max_backlog = max_backlog;
+	p->start = get_time_ns();
+	p->last = p->start;
+	p->tty = isatty(STDOUT_FILENO);
+	p->shown = false;
+	p->enabled = true;
+}
+
+void progress_update(data_writer_stats_t *stats)
+{
+	progress_t *p = &stats->progress;
+	sqfs_u64 now;
+
+	if (!p->enabled)
+		return;
+
+	now = get_time_ns();
+
+	if (now - p->last >= (p->tty ? TTY_INTERVAL_NS : LOG_INTERVAL_NS))
+		print_line(stats, now);
+}
+
+void progress_end(data_writer_stats_t *stats)
+{
+	progress_t *p = &stats->progress;
+
+	if (!p->enabled)
+		return;
+
+	print_line(stats, get_time_ns());
+
+	if (p->tty)
+		fputc('\n', stdout);
+
+	p->enabled = false;
+}
@@ -29,27 +29,27 @@ static sqfs_inode_generic_t *tree_node_to_inode(tree_node_t *node)
 	switch (node->mode & S_IFMT) {
 	case S_IFSOCK:
 		inode->base.type = SQFS_INODE_SOCKET;
-		inode->data.ipc.nlink = 1;
+		inode->data.ipc.nlink = node->link_count + 1;
 		break;
 	case S_IFIFO:
 		inode->base.type = SQFS_INODE_FIFO;
-		inode->data.ipc.nlink = 1;
+		inode->data.ipc.nlink = node->link_count + 1;
 		break;
 	case S_IFLNK:
 		inode->base.type = SQFS_INODE_SLINK;
-		inode->data.slink.nlink = 1;
+		inode->data.slink.nlink = node->link_count + 1;
 		inode->data.slink.target_size = extra;
 		inode->slink_target = (char *)inode->extra;
 		memcpy(inode->extra, node->data.slink_target, extra);
 		break;
 	case S_IFBLK:
 		inode->base.type = SQFS_INODE_BDEV;
-		inode->data.dev.nlink = 1;
+		inode->data.dev.nlink = node->link_count + 1;
 		inode->data.dev.devno = node->data.devno;
 		break;
 	case S_IFCHR:
 		inode->base.type = SQFS_INODE_CDEV;
-		inode->data.dev.nlink = 1;
+		inode->data.dev.nlink = node->link_count + 1;
 		inode->data.dev.devno = node->data.devno;
 		break;
 	default:
@@ -65,7 +65,7 @@ static sqfs_inode_generic_t *write_dir_entries(const char *filename,
 {
 	sqfs_u32 xattr, parent_inode;
 	sqfs_inode_generic_t *inode;
-	tree_node_t *it;
+	tree_node_t *it, *tgt;
 	int ret;
 
 	ret = sqfs_dir_writer_begin(dirw, 0);
@@ -73,8 +73,12 @@ static sqfs_inode_generic_t *write_dir_entries(const char *filename,
 		goto fail;
 
 	for (it = node->data.dir.children; it != NULL; it = it->next) {
-		ret = sqfs_dir_writer_add_entry(dirw, it->name, it->inode_num,
-						it->inode_ref, it->mode);
+		tgt = it;
+		if (it->mode == FSTREE_MODE_HARD_LINK_RESOLVED)
+			tgt = it->data.target;
+
+		ret = sqfs_dir_writer_add_entry(dirw, it->name, tgt->inode_num,
+						tgt->inode_ref, tgt->mode);
 		if (ret)
 			goto fail;
 	}
@@ -98,18 +102,164 @@ fail:
 	return NULL;
 }
 
+/*
+  Upper bound for the number of inodes that fit into one meta block, the
+  smallest inode being a basic socket or FIFO.
+ */
+#define MAX_BLOCK_INODES \
+	(SQFS_META_BLOCK_SIZE / (sizeof(sqfs_inode_t) + sizeof(sqfs_inode_ipc_t)) + 1)
+
+static size_t inode_disk_size(const sqfs_inode_generic_t *inode)
+{
+	size_t size = sizeof(sqfs_inode_t);
+
+	switch (inode->base.type) {
+	case SQFS_INODE_DIR:
+		return size + sizeof(sqfs_inode_dir_t);
+	case SQFS_INODE_FILE:
+		return size + sizeof(sqfs_inode_file_t) +
+			sizeof(sqfs_u32) * inode->num_file_blocks;
+	case SQFS_INODE_SLINK:
+		return size + sizeof(sqfs_inode_slink_t) +
+			inode->data.slink.target_size;
+	case SQFS_INODE_BDEV:
+	case SQFS_INODE_CDEV:
+		return size + sizeof(sqfs_inode_dev_t);
+	case SQFS_INODE_FIFO:
+	case SQFS_INODE_SOCKET:
+		return size + sizeof(sqfs_inode_ipc_t);
+	case SQFS_INODE_EXT_DIR:
+		return size + sizeof(sqfs_inode_dir_ext_t) +
+			inode->num_dir_idx_bytes;
+	case SQFS_INODE_EXT_FILE:
+		return size + sizeof(sqfs_inode_file_ext_t) +
+			sizeof(sqfs_u32) * inode->num_file_blocks;
+	case SQFS_INODE_EXT_SLINK:
+		return size + sizeof(sqfs_inode_slink_ext_t) +
+			inode->data.slink_ext.target_size + sizeof(sqfs_u32);
+	case SQFS_INODE_EXT_BDEV:
+	case SQFS_INODE_EXT_CDEV:
+		return size + sizeof(sqfs_inode_dev_ext_t);
+	case SQFS_INODE_EXT_FIFO:
+	case SQFS_INODE_EXT_SOCKET:
+		return size + sizeof(sqfs_inode_ipc_ext_t);
+	}
+
+	return size;
+}
+
+/*
+  The entries of a directory need the inode references of their targets,
+  which are only known once those are written. A hard link can point at a
+  sibling of the directory that is still waiting in the same batch.
+ */
+static bool refs_pending(const tree_node_t *n, sqfs_u32 first_pending)
+{
+	const tree_node_t *it, *tgt;
+
+	if (!S_ISDIR(n->mode))
+		return false;
+
+	for (it = n->data.dir.children; it != NULL; it = it->next) {
+		tgt = it;
+		if (it->mode == FSTREE_MODE_HARD_LINK_RESOLVED)
+			tgt = it->data.target;
+
+		if (tgt->inode_num >= first_pending)
+			return true;
+	}
+
+	return false;
+}
+
+static int create_inode(const char *filename, sqfs_dir_writer_t *dirwr,
+			sqfs_id_table_t *idtbl, inode_spill_t *spill,
+			tree_node_t *n, sqfs_inode_generic_t **out)
+{
+	sqfs_inode_generic_t *inode;
+	sqfs_u16 id_idx[2];
+	sqfs_u32 ids[2];
+	int ret;
+
+	if (S_ISDIR(n->mode)) {
+		inode = write_dir_entries(filename, dirwr, n);
+
+		if (inode == NULL)
+			return 1;
+	} else if (S_ISREG(n->mode)) {
+		inode = inode_spill_get(spill, &n->data.file);
+
+		if (inode == NULL)
+			return 1;
+	} else {
+		inode = tree_node_to_inode(n);
+
+		if (inode == NULL)
+			return SQFS_ERROR_ALLOC;
+	}
+
+	inode->base.mode = n->mode;
+	inode->base.mod_time = n->mod_time;
+	inode->base.inode_number = n->inode_num;
+
+	sqfs_inode_set_xattr_index(inode, n->xattr_idx);
+
+	/* only the extended file inode has a link count */
+	if (S_ISREG(n->mode) && n->link_count > 0) {
+		sqfs_inode_make_extended(inode);
+		inode->data.file_ext.nlink = n->link_count + 1;
+	}
+
+	ids[0] = n->uid;
+	ids[1] = n->gid;
+
+	ret = sqfs_id_table_ids_to_indices(idtbl, ids, id_idx, 2);
+	if (ret) {
+		free(inode);
+		return ret;
+	}
+
+	inode->base.uid_idx = id_idx[0];
+	inode->base.gid_idx = id_idx[1];
+
+	*out = inode;
+	return 0;
+}
+
+static int write_inode(sqfs_meta_writer_t *im, export_table_t *export,
+		       tree_node_t *n, sqfs_inode_generic_t *inode)
+{
+	sqfs_u32 offset;
+	sqfs_u64 block;
+	int ret;
+
+	sqfs_meta_writer_get_position(im, &block, &offset);
+	n->inode_ref = (block << 16) | offset;
+
+	if (export != NULL) {
+		ret = export_table_add(export, n->inode_ref);
+		if (ret)
+			return ret;
+	}
+
+	return sqfs_meta_writer_write_inode(im, inode);
+}
+
 int sqfs_serialize_fstree(const char *filename, sqfs_file_t *file,
 			  sqfs_super_t *super, fstree_t *fs,
-			  sqfs_compressor_t *cmp, sqfs_id_table_t *idtbl)
+			  sqfs_compressor_t *cmp, sqfs_id_table_t *idtbl,
+			  export_table_t *export, inode_spill_t *spill,
+			  bool align_dirs, size_t index_step)
 {
-	sqfs_inode_generic_t *inode;
+	sqfs_inode_generic_t *pending[MAX_BLOCK_INODES];
+	size_t i, j, count, used, room;
 	sqfs_meta_writer_t *im, *dm;
 	sqfs_dir_writer_t *dirwr;
+	bool continued = false;
+	tree_node_t *parent;
 	sqfs_u32 offset;
 	sqfs_u64 block;
-	tree_node_t *n;
 	int ret = -1;
-	size_t i;
 
 	im = sqfs_meta_writer_create(file, cmp, 0);
 	if (im == NULL) {
@@ -130,63 +280,71 @@ int sqfs_serialize_fstree(const char *filename, sqfs_file_t *file,
 		goto out_dm;
 	}
 
+	if (index_step > 0) {
+		ret = sqfs_dir_writer_set_header_limit(dirwr, index_step);
+		if (ret)
+			goto out;
+	}
+
 	super->inode_table_start = file->get_size(file);
 
-	for (i = 0; i < fs->inode_tbl_size; ++i) {
-		n = fs->inode_table[i];
-
-		if (S_ISDIR(n->mode)) {
-			inode = write_dir_entries(filename, dirwr, n);
-
-			if (inode == NULL) {
-				ret = 1;
-				goto out;
-			}
-		} else if (S_ISREG(n->mode)) {
-			inode = n->data.file.user_ptr;
-			n->data.file.user_ptr = NULL;
-
-			if (inode == NULL) {
-				ret = SQFS_ERROR_INTERNAL;
-				goto out;
-			}
-		} else {
-			inode = tree_node_to_inode(n);
-
-			if (inode == NULL) {
-				ret = SQFS_ERROR_ALLOC;
-				goto out;
-			}
+	/*
+	  The meta blocks of both tables are compressed one after another
+	  as they fill up. Inode references and directory positions contain
+	  the on-disk location of a meta block, i.e. the compressed size of
+	  everything before it. Directory inodes point into the directory
+	  table and directory headers point back at the inode blocks of the
+	  entries, so the contents of one block generally depend on the
+	  compressed size of the previous block and they cannot be
+	  compressed out of order.
+
+	  The inodes of the entries of a directory are numbered one after
+	  another, in the order of the listing. If aligning is requested,
+	  such a run is collected up to the size of a meta block. If it
+	  would fit into an empty block but not into the rest of the current
+	  one, the current block is cut short, so that listing a directory
+	  and looking at its entries only has to read a single block.
+	 */
+	for (i = 0; i < fs->inode_tbl_size; i += count) {
+		parent = fs->inode_table[i]->parent;
+		sqfs_meta_writer_get_position(im, &block, &offset);
+		room = SQFS_META_BLOCK_SIZE - offset;
+		used = 0;
+		count = 0;
+
+		do {
+			ret = create_inode(filename, dirwr, idtbl, spill,
+					   fs->inode_table[i + count],
+					   pending + count);
+			if (ret)
+				goto out_pending;
+
+			used += inode_disk_size(pending[count++]);
+		} while (align_dirs && used <= SQFS_META_BLOCK_SIZE &&
+			 count < MAX_BLOCK_INODES &&
+			 i + count < fs->inode_tbl_size &&
+			 fs->inode_table[i + count]->parent == parent &&
+			 !refs_pending(fs->inode_table[i + count], i + 1));
+
+		if (align_dirs && used > room && used <= SQFS_META_BLOCK_SIZE &&
+		    offset > 0 && !continued) {
+			ret = sqfs_meta_writer_flush(im);
+			if (ret)
+				goto out_pending;
 		}
 
-		inode->base.mode = n->mode;
-		inode->base.mod_time = n->mod_time;
-		inode->base.inode_number = n->inode_num;
-
-		sqfs_inode_set_xattr_index(inode, n->xattr_idx);
-
-		ret = sqfs_id_table_id_to_index(idtbl, n->uid,
-						&inode->base.uid_idx);
-		if (ret) {
-			free(inode);
-			goto out;
-		}
+		for (j = 0; j < count; ++j) {
+			ret = write_inode(im, export, fs->inode_table[i + j],
+					  pending[j]);
+			if (ret)
+				goto out_pending;
 
-		ret = sqfs_id_table_id_to_index(idtbl, n->gid,
-						&inode->base.gid_idx);
-		if (ret) {
-			free(inode);
-			goto out;
+			free(pending[j]);
+			pending[j] = NULL;
 		}
 
-		sqfs_meta_writer_get_position(im, &block, &offset);
-		fs->inode_table[i]->inode_ref = (block << 16) | offset;
-
-		ret = sqfs_meta_writer_write_inode(im, inode);
-		free(inode);
-
-		if (ret)
-			goto out;
+		continued = i + count < fs->inode_tbl_size &&
+			fs->inode_table[i + count]->parent == parent;
 	}
 
 	ret = sqfs_meta_writer_flush(im);
@@ -205,6 +363,10 @@ int sqfs_serialize_fstree(const char *filename, sqfs_file_t *file,
 		goto out;
 
 	ret = 0;
+	goto out;
+out_pending:
+	for (j = 0; j < count; ++j)
+		free(pending[j]);
 out:
 	sqfs_dir_writer_destroy(dirwr);
 out_dm:
@@ -6,17 +6,61 @@
  */
 #include "common.h"
 
+#include <inttypes.h>
 #include <stdio.h>
 
+/*
+  Blocks only carry their compressed size. Except for the last one, the
+  data blocks of a file are full blocks. Sparse blocks count as well, but
+  not the empty block that marks the end of a file, which is the only one
+  with index 0 that is not flagged as the first block.
+ */
+static void count_input(data_writer_stats_t *stats, const sqfs_block_t *block)
+{
+	progress_t *p = &stats->progress;
+	sqfs_u64 size, offset;
+
+	if (block->inode == NULL || p->block_size == 0)
+		return;
+
+	if ((block->flags & SQFS_BLK_LAST_BLOCK) && block->index == 0 &&
+	    !(block->flags & SQFS_BLK_FIRST_BLOCK)) {
+		return;
+	}
+
+	if (!sqfs_inode_get_file_size(block->inode, &size)) {
+		offset = (sqfs_u64)block->index * p->block_size;
+
+		if (offset < size) {
+			size -= offset;
+			p->bytes_in += size < p->block_size ?
+				size : p->block_size;
+		}
+	}
+}
+
 static void post_block_write(void *user, const sqfs_block_t *block,
 			     sqfs_file_t *file)
 {
 	data_writer_stats_t *stats = user;
+	size_t i;
 	(void)file;
 
+	if (!(block->flags & SQFS_BLK_FRAGMENT_BLOCK))
+		count_input(stats, block);
+
+	if (stats->tuner != NULL)
+		level_tuner_update(stats->tuner, block, stats);
+
 	if (block->size == 0)
 		return;
 
+	for (i = 0; i < sizeof(stats->method_blocks) /
+		     sizeof(stats->method_blocks[0]); ++i) {
+		if (block->cmp_method == (1UL << i))
+			stats->method_blocks[i] += 1;
+	}
+
 	if (block->flags & SQFS_BLK_FRAGMENT_BLOCK) {
 		stats->frag_blocks_written += 1;
 	} else {
@@ -24,14 +68,15 @@ static void post_block_write(void *user, const sqfs_block_t *block,
 	}
 
 	stats->bytes_written += block->size;
+	progress_update(stats);
 }
 
 static void pre_fragment_store(void *user, sqfs_block_t *block)
 {
 	data_writer_stats_t *stats = user;
-	(void)block;
 
 	stats->frag_count += 1;
+	stats->progress.bytes_in += block->size;
 }
 
 static void notify_blocks_erased(void *user, size_t count, sqfs_u64 bytes)
@@ -46,9 +91,9 @@ static void notify_blocks_erased(void *user, size_t count, sqfs_u64 bytes)
 static void notify_fragment_discard(void *user, const sqfs_block_t *block)
 {
 	data_writer_stats_t *stats = user;
-	(void)block;
 
 	stats->frag_dup += 1;
+	stats->progress.bytes_in += block->size;
 }
 
 static const sqfs_block_hooks_t hooks = {
@@ -64,25 +109,314 @@ void register_stat_hooks(sqfs_data_writer_t *data, data_writer_stats_t *stats)
 	sqfs_data_writer_set_hooks(data, stats, &hooks);
 }
 
-void sqfs_print_statistics(sqfs_super_t *super, data_writer_stats_t *stats)
+static void print_methods(sqfs_super_t *super, data_writer_stats_t *stats)
+{
+	const char *name;
+	size_t i;
+
+	for (i = 0; i < sizeof(stats->method_blocks) /
+		     sizeof(stats->method_blocks[0]); ++i) {
+		if (stats->method_blocks[i] == 0)
+			continue;
+
+		name = compressor_method_name(super->compression_id, 1UL << i);
+		if (name == NULL)
+			continue;
+
+		printf("Blocks compressed using '%s': %zu\n",
+		       name, stats->method_blocks[i]);
+	}
+}
+
+static double seconds(sqfs_u64 ns)
+{
+	return (double)ns / 1e9;
+}
+
+static const struct {
+	const char *name;
+	const char *key;
+} phase_names[WRITER_PHASE_COUNT] = {
+	[WRITER_PHASE_SCAN] = { "scanning the input", "scan" },
+	[WRITER_PHASE_DATA] = { "packing file data", "data" },
+	[WRITER_PHASE_INODES] = { "inodes and directories", "inodes" },
+	[WRITER_PHASE_FRAGMENTS] = { "fragment table", "fragments" },
+	[WRITER_PHASE_EXPORT] = { "export table", "export" },
+	[WRITER_PHASE_IDS] = { "ID table", "ids" },
+	[WRITER_PHASE_XATTRS] = { "extended attributes", "xattrs" },
+	[WRITER_PHASE_FINISH] = { "finishing the image", "finish" },
+};
+
+void stats_phase_start(data_writer_stats_t *stats)
+{
+	stats->phase_wall_start = get_time_ns();
+	stats->phase_cpu_start = get_cpu_time_ns();
+}
+
+void stats_phase_end(data_writer_stats_t *stats, E_WRITER_PHASE phase)
+{
+	sqfs_u64 wall = get_time_ns(), cpu = get_cpu_time_ns();
+
+	stats->phases[phase].wall += wall - stats->phase_wall_start;
+	stats->phases[phase].cpu += cpu - stats->phase_cpu_start;
+	stats->phases[phase].done = true;
+
+	stats->phase_wall_start = wall;
+	stats->phase_cpu_start = cpu;
+}
+
+static size_t compression_ratio(const data_writer_stats_t *stats)
+{
+	if (stats->bytes_written == 0 || stats->bytes_read == 0)
+		return 100;
+
+	return (100 * stats->bytes_written) / stats->bytes_read;
+}
+
+static double mib(sqfs_u64 bytes)
 {
-	size_t ratio;
+	return (double)bytes / (1024.0 * 1024.0);
+}
+
+static unsigned int percent(sqfs_u64 part, sqfs_u64 total)
+{
+	return total > 0 ? (unsigned int)((100 * part) / total) : 0;
+}
 
-	if (stats->bytes_written > 0) {
-		ratio = (100 * stats->bytes_written) / stats->bytes_read;
+static double average_ms(sqfs_u64 ns, sqfs_u64 count)
+{
+	return count > 0 ? ((double)ns / 1e6) / count : 0.0;
+}
+
+/*
+  Without workers, blocks are compressed by the main thread. With workers,
+  the main thread waiting for them means the compressors can't keep up.
+  Whatever is left of the main thread's time is spent outside the data
+  writer, mostly reading the input.
+ */
+static void print_timing(const sqfs_data_writer_timing_t *t)
+{
+	sqfs_u64 cmp, other, avail;
+	const char *bound;
+
+	cmp = t->num_workers > 0 ? t->backlog_wait : t->compress_time;
+	other = t->total_time;
+	other -= cmp < other ? cmp : other;
+	other -= t->write_time < other ? t->write_time : other;
+
+	if (cmp >= t->write_time && cmp >= other) {
+		bound = "compression";
+	} else if (t->write_time >= other) {
+		bound = "writing the output";
 	} else {
-		ratio = 100;
+		bound = "reading the input";
+	}
+
+	printf("Data writer time: %.2fs\n", seconds(t->total_time));
+	printf("  %s: %.2fs (%u%%)\n",
+	       t->num_workers > 0 ? "waiting for compressor jobs" :
+	       "compressing blocks",
+	       seconds(cmp), percent(cmp, t->total_time));
+	printf("  writing blocks: %.2fs (%u%%)\n", seconds(t->write_time),
+	       percent(t->write_time, t->total_time));
+	printf("  reading input and other work: %.2fs (%u%%)\n",
+	       seconds(other), percent(other, t->total_time));
+
+	if (t->num_workers > 0) {
+		avail = t->total_time * t->num_workers;
+
+		printf("Compressor jobs busy: %u%% of %u jobs, busiest %u%%\n",
+		       percent(t->compress_time, avail), t->num_workers,
+		       percent(t->compress_time_max, t->total_time));
+		printf("Average block wait for a job: %.3fms, "
+		       "for writing: %.3fms\n",
+		       average_ms(t->queue_wait, t->block_count),
+		       average_ms(t->reorder_wait, t->block_count));
+		printf("Average backlog: %.1f of %u blocks, "
+		       "almost full for %u%% of them\n",
+		       t->block_count > 0 ?
+		       (double)t->backlog_sum / t->block_count : 0.0,
+		       t->backlog_limit,
+		       percent(t->backlog_hist[7], t->block_count));
+
+		if (t->worker_changes > 0) {
+			printf("Active compressor jobs: %u to %u, "
+			       "adjusted %u times\n", t->workers_min,
+			       t->num_workers, t->worker_changes);
+		}
+	}
+
+	if (t->cmp_cache_hits > 0) {
+		printf("Repeated blocks not compressed again: %" PRIu64 "\n",
+		       t->cmp_cache_hits);
+	}
+
+	printf("Peak memory used for data buffers: %.1f MiB\n",
+	       mib(t->mem_peak));
+	printf("Data writer limited by: %s\n", bound);
+}
+
+static void print_phases(const data_writer_stats_t *stats)
+{
+	sqfs_u64 wall = 0, cpu = 0;
+	size_t i;
+
+	for (i = 0; i < WRITER_PHASE_COUNT; ++i) {
+		wall += stats->phases[i].wall;
+		cpu += stats->phases[i].cpu;
 	}
 
+	printf("Total time: %.2fs, CPU time: %.2fs\n",
+	       seconds(wall), seconds(cpu));
+
+	for (i = 0; i < WRITER_PHASE_COUNT; ++i) {
+		if (!stats->phases[i].done)
+			continue;
+
+		printf("  %s: %.2fs, CPU %.2fs\n", phase_names[i].name,
+		       seconds(stats->phases[i].wall),
+		       seconds(stats->phases[i].cpu));
+	}
+}
+
+void sqfs_print_statistics(sqfs_super_t *super, data_writer_stats_t *stats)
+{
 	fputs("---------------------------------------------------\n", stdout);
 	printf("Input files processed: %zu\n", stats->file_count);
+	printf("Duplicate files omitted: %zu\n", stats->duplicate_files);
+	if (stats->reused_files > 0) {
+		printf("Files reused from base image: %zu\n",
+		       stats->reused_files);
+	}
 	printf("Data blocks actually written: %zu\n", stats->blocks_written);
 	printf("Fragment blocks written: %zu\n", stats->frag_blocks_written);
 	printf("Duplicate data blocks omitted: %zu\n", stats->duplicate_blocks);
 	printf("Sparse blocks omitted: %zu\n", stats->sparse_blocks);
+	if (stats->cached_blocks > 0) {
+		printf("Data blocks taken from cache: %zu\n",
+		       stats->cached_blocks);
+	}
 	printf("Fragments actually written: %zu\n", stats->frag_count);
 	printf("Duplicated fragments omitted: %zu\n", stats->frag_dup);
 	printf("Total number of inodes: %u\n", super->inode_count);
 	printf("Number of unique group/user IDs: %u\n", super->id_count);
-	printf("Data compression ratio: %zu%%\n", ratio);
+	print_methods(super, stats);
+	if (stats->tuner != NULL)
+		level_tuner_print(stats->tuner);
+	printf("Data compression ratio: %zu%%\n", compression_ratio(stats));
+
+	if (stats->timing.size > 0)
+		print_timing(&stats->timing);
+
+	print_phases(stats);
+}
+
+static void json_timing(FILE *fp, const sqfs_data_writer_timing_t *t)
+{
+	sqfs_u64 avail = t->total_time * t->num_workers;
+
+	fprintf(fp, ",\n  \"data_writer\": {\n");
+	fprintf(fp, "    \"total_s\": %.6f,\n", seconds(t->total_time));
+	fprintf(fp, "    \"enqueue_s\": %.6f,\n", seconds(t->enqueue_time));
+	fprintf(fp, "    \"backlog_wait_s\": %.6f,\n",
+		seconds(t->backlog_wait));
+	fprintf(fp, "    \"write_s\": %.6f,\n", seconds(t->write_time));
+	fprintf(fp, "    \"compress_s\": %.6f,\n", seconds(t->compress_time));
+	fprintf(fp, "    \"workers\": %u,\n", t->num_workers);
+	fprintf(fp, "    \"workers_min\": %u,\n", t->workers_min);
+	fprintf(fp, "    \"worker_changes\": %u,\n", t->worker_changes);
+	fprintf(fp, "    \"worker_busy_percent\": %u,\n",
+		percent(t->compress_time, avail));
+	fprintf(fp, "    \"busiest_worker_percent\": %u,\n",
+		percent(t->compress_time_max, t->total_time));
+	fprintf(fp, "    \"blocks\": %" PRIu64 ",\n", t->block_count);
+	fprintf(fp, "    \"backlog_max\": %u,\n", t->backlog_max);
+	fprintf(fp, "    \"backlog_limit\": %u,\n", t->backlog_limit);
+	fprintf(fp, "    \"cmp_cache_hits\": %" PRIu64 ",\n",
+		t->cmp_cache_hits);
+	fprintf(fp, "    \"mem_peak_bytes\": %" PRIu64 "\n", t->mem_peak);
+	fprintf(fp, "  }");
+}
+
+int sqfs_write_statistics_json(const char *filename, sqfs_super_t *super,
+			       data_writer_stats_t *stats)
+{
+	const char *name;
+	bool first;
+	FILE *fp;
+	size_t i;
+	int ret;
+
+	fp = fopen(filename, "w");
+	if (fp == NULL) {
+		perror(filename);
+		return -1;
+	}
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"files\": %zu,\n", stats->file_count);
+	fprintf(fp, "  \"duplicate_files\": %zu,\n", stats->duplicate_files);
+	fprintf(fp, "  \"reused_files\": %zu,\n", stats->reused_files);
+	fprintf(fp, "  \"data_blocks\": %zu,\n", stats->blocks_written);
+	fprintf(fp, "  \"fragment_blocks\": %zu,\n",
+		stats->frag_blocks_written);
+	fprintf(fp, "  \"duplicate_blocks\": %zu,\n", stats->duplicate_blocks);
+	fprintf(fp, "  \"sparse_blocks\": %zu,\n", stats->sparse_blocks);
+	fprintf(fp, "  \"cached_blocks\": %zu,\n", stats->cached_blocks);
+	fprintf(fp, "  \"fragments\": %zu,\n", stats->frag_count);
+	fprintf(fp, "  \"duplicate_fragments\": %zu,\n", stats->frag_dup);
+	fprintf(fp, "  \"inodes\": %u,\n", super->inode_count);
+	fprintf(fp, "  \"ids\": %u,\n", super->id_count);
+	fprintf(fp, "  \"bytes_read\": %" PRIu64 ",\n", stats->bytes_read);
+	fprintf(fp, "  \"bytes_written\": %" PRIu64 ",\n",
+		stats->bytes_written);
+	fprintf(fp, "  \"image_bytes\": %" PRIu64 ",\n", super->bytes_used);
+	fprintf(fp, "  \"compression_ratio_percent\": %zu,\n",
+		compression_ratio(stats));
+
+	fprintf(fp, "  \"methods\": {");
+	first = true;
+
+	for (i = 0; i < sizeof(stats->method_blocks) /
+		     sizeof(stats->method_blocks[0]); ++i) {
+		name = compressor_method_name(super->compression_id, 1UL << i);
+		if (stats->method_blocks[i] == 0 || name == NULL)
+			continue;
+
+		fprintf(fp, "%s\n    \"%s\": %zu", first ? "" : ",",
+			name, stats->method_blocks[i]);
+		first = false;
+	}
+
+	fprintf(fp, "%s},\n", first ? "" : "\n  ");
+	fprintf(fp, "  \"phases\": {");
+	first = true;
+
+	for (i = 0; i < WRITER_PHASE_COUNT; ++i) {
+		if (!stats->phases[i].done)
+			continue;
+
+		fprintf(fp, "%s\n    \"%s\": { \"wall_s\": %.6f, "
+			"\"cpu_s\": %.6f }", first ? "" : ",",
+			phase_names[i].key, seconds(stats->phases[i].wall),
+			seconds(stats->phases[i].cpu));
+		first = false;
+	}
+
+	fprintf(fp, "%s}", first ? "" : "\n  ");
+
+	if (stats->timing.size > 0)
+		json_timing(fp, &stats->timing);
+
+	fprintf(fp, "\n}\n");
+
+	ret = ferror(fp) ? -1 : 0;
+
+	if (fclose(fp) != 0)
+		ret = -1;
+
+	if (ret)
+		fprintf(stderr, "%s: error writing statistics\n", filename);
+
+	return ret;
 }
@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * stream_fixup.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "common.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+int sqfs_stream_fixup(const char *filename)
+{
+	sqfs_stream_trailer_t trailer;
+	sqfs_u64 image_size;
+	struct stat sb;
+	off_t offset;
+	ssize_t ret;
+	int fd;
+
+	fd = open(filename, O_RDWR);
+	if (fd < 0)
+		goto fail_errno;
+
+	if (fstat(fd, &sb))
+		goto fail_errno_fd;
+
+	if ((sqfs_u64)sb.st_size < sizeof(trailer) + sizeof(sqfs_super_t))
+		goto fail_trailer;
+
+	offset = sb.st_size - sizeof(trailer);
+
+	ret = pread(fd, &trailer, sizeof(trailer), offset);
+	if (ret < 0)
+		goto fail_errno_fd;
+
+	if ((size_t)ret != sizeof(trailer))
+		goto fail_trailer;
+
+	image_size = le64toh(trailer.image_size);
+
+	if (memcmp(trailer.magic, SQFS_STREAM_TRAILER_MAGIC,
+		   sizeof(trailer.magic)) != 0 ||
+	    image_size != (sqfs_u64)offset) {
+		goto fail_trailer;
+	}
+
+	ret = pwrite(fd, &trailer.super, sizeof(trailer.super), 0);
+	if (ret < 0)
+		goto fail_errno_fd;
+
+	if ((size_t)ret != sizeof(trailer.super)) {
+		fprintf(stderr, "%s: short write while updating super block\n",
+			filename);
+		goto fail_fd;
+	}
+
+	if (ftruncate(fd, offset) != 0 || fsync(fd) != 0)
+		goto fail_errno_fd;
+
+	if (close(fd) != 0)
+		goto fail_errno;
+
+	return 0;
+fail_trailer:
+	fprintf(stderr, "%s: not a streamed image with a trailer\n", filename);
+	goto fail_fd;
+fail_errno_fd:
+	perror(filename);
+fail_fd:
+	close(fd);
+	return -1;
+fail_errno:
+	perror(filename);
+	return -1;
+}
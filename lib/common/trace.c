@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * trace.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "common.h"
+
+#include <stdio.h>
+
+typedef struct {
+	FILE *fp;
+	sqfs_u64 start;
+	bool have_start;
+	bool first;
+} trace_file_t;
+
+static trace_file_t trace;
+
+/*
+  The callbacks are serialized by libsquashfs. Time stamps are written in
+  microseconds relative to the first event, as the trace viewer expects.
+  Category and span names are static strings without anything to escape.
+ */
+static void trace_write(sqfs_u32 thread, sqfs_u64 time_ns,
+			const char *category, const char *name, char phase)
+{
+	if (!trace.have_start) {
+		trace.start = time_ns;
+		trace.have_start = true;
+	}
+
+	time_ns = time_ns >= trace.start ? (time_ns - trace.start) : 0;
+
+	fprintf(trace.fp, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\","
+		"\"ts\":%llu.%03u,\"pid\":1,\"tid\":%u}",
+		trace.first ? "" : ",\n", name, category, phase,
+		(unsigned long long)(time_ns / 1000),
+		(unsigned int)(time_ns % 1000), (unsigned int)thread);
+
+	trace.first = false;
+}
+
+static void trace_begin(void *user, sqfs_u32 thread, sqfs_u64 time_ns,
+			const char *category, const char *name)
+{
+	(void)user;
+	trace_write(thread, time_ns, category, name, 'B');
+}
+
+static void trace_end(void *user, sqfs_u32 thread, sqfs_u64 time_ns,
+		      const char *category, const char *name)
+{
+	(void)user;
+	trace_write(thread, time_ns, category, name, 'E');
+}
+
+static const sqfs_trace_hooks_t trace_hooks = {
+	sizeof(sqfs_trace_hooks_t),
+	trace_begin,
+	trace_end,
+};
+
+int trace_open(const char *filename)
+{
+	int ret;
+
+	trace.fp = fopen(filename, "w");
+	if (trace.fp == NULL) {
+		perror(filename);
+		return -1;
+	}
+
+	trace.have_start = false;
+	trace.first = true;
+	fputs("[\n", trace.fp);
+
+	ret = sqfs_set_trace_hooks(NULL, &trace_hooks);
+	if (ret) {
+		sqfs_perror(filename, "registering trace hooks", ret);
+		fclose(trace.fp);
+		trace.fp = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+void trace_close(void)
+{
+	if (trace.fp == NULL)
+		return;
+
+	sqfs_set_trace_hooks(NULL, NULL);
+
+	fputs("\n]\n", trace.fp);
+	fclose(trace.fp);
+	trace.fp = NULL;
+}
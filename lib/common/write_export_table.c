@@ -9,35 +9,110 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#define ENTRIES_PER_BLOCK (SQFS_META_BLOCK_SIZE / sizeof(sqfs_u64))
+
+/*
+  The entries are compressed into meta data blocks that are kept in memory
+  as the inodes are written, so only the compressed table is held until it
+  is written out, not one raw 64 bit reference per inode. Every block holds
+  exactly ENTRIES_PER_BLOCK entries, except for the last one, so the start
+  of a block is recorded whenever a new one is begun.
+ */
+struct export_table_t {
+	sqfs_meta_writer_t *mw;
+	sqfs_u64 *locations;
+	size_t num_blocks;
+	size_t max_blocks;
+	size_t count;
+};
+
+export_table_t *export_table_create(sqfs_file_t *file, sqfs_compressor_t *cmp)
+{
+	export_table_t *tbl = calloc(1, sizeof(*tbl));
+
+	if (tbl == NULL)
+		return NULL;
+
+	tbl->mw = sqfs_meta_writer_create(file, cmp,
+					  SQFS_META_WRITER_KEEP_IN_MEMORY);
+	if (tbl->mw == NULL) {
+		free(tbl);
+		return NULL;
+	}
+
+	return tbl;
+}
+
+void export_table_destroy(export_table_t *tbl)
+{
+	if (tbl == NULL)
+		return;
+
+	sqfs_meta_writer_destroy(tbl->mw);
+	free(tbl->locations);
+	free(tbl);
+}
+
+int export_table_add(export_table_t *tbl, sqfs_u64 inode_ref)
+{
+	sqfs_u64 block, *new;
+	size_t new_sz;
+	sqfs_u32 offset;
+
+	if ((tbl->count % ENTRIES_PER_BLOCK) == 0) {
+		if (tbl->num_blocks == tbl->max_blocks) {
+			new_sz = tbl->max_blocks ? tbl->max_blocks * 2 : 16;
+			new = realloc(tbl->locations,
+				      sizeof(tbl->locations[0]) * new_sz);
+			if (new == NULL)
+				return SQFS_ERROR_ALLOC;
+
+			tbl->locations = new;
+			tbl->max_blocks = new_sz;
+		}
+
+		sqfs_meta_writer_get_position(tbl->mw, &block, &offset);
+		tbl->locations[tbl->num_blocks++] = block;
+	}
+
+	tbl->count += 1;
+	inode_ref = htole64(inode_ref);
+	return sqfs_meta_writer_append(tbl->mw, &inode_ref, sizeof(inode_ref));
+}
+
 int write_export_table(const char *filename, sqfs_file_t *file,
-		       fstree_t *fs, sqfs_super_t *super,
-		       sqfs_compressor_t *cmp)
+		       export_table_t *tbl, sqfs_super_t *super)
 {
-	sqfs_u64 *table, start;
-	size_t i, size;
+	sqfs_u64 start;
+	size_t i;
 	int ret;
 
-	if (fs->inode_tbl_size < 1)
+	if (tbl->count < 1)
 		return 0;
 
-	table = alloc_array(sizeof(sqfs_u64), fs->inode_tbl_size);
+	start = file->get_size(file);
 
-	if (table == NULL) {
-		perror("Allocating NFS export table");
-		return -1;
-	}
-
-	for (i = 0; i < fs->inode_tbl_size; ++i) {
-		table[i] = htole64(fs->inode_table[i]->inode_ref);
-	}
+	ret = sqfs_meta_writer_flush(tbl->mw);
+	if (ret)
+		goto fail;
 
-	size = sizeof(sqfs_u64) * fs->inode_tbl_size;
-	ret = sqfs_write_table(file, cmp, table, size, &start);
+	ret = sqfs_meta_write_write_to_file(tbl->mw);
 	if (ret)
-		sqfs_perror(filename, "writing NFS export table", ret);
+		goto fail;
+
+	for (i = 0; i < tbl->num_blocks; ++i)
+		tbl->locations[i] = htole64(start + tbl->locations[i]);
 
-	super->export_table_start = start;
+	super->export_table_start = file->get_size(file);
 	super->flags |= SQFS_FLAG_EXPORTABLE;
-	free(table);
-	return ret;
+
+	ret = file->write_at(file, super->export_table_start, tbl->locations,
+			     sizeof(tbl->locations[0]) * tbl->num_blocks);
+	if (ret)
+		goto fail;
+
+	return 0;
+fail:
+	sqfs_perror(filename, "writing NFS export table", ret);
+	return -1;
 }
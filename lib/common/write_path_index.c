@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * write_path_index.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "common.h"
+
+#include <stdio.h>
+
+static int add_subtree(sqfs_path_index_t *index, const tree_node_t *n,
+		       path_buf_t *path)
+{
+	size_t old_len = path->len;
+	const tree_node_t *tgt = n;
+	int ret;
+
+	if (n->parent != NULL) {
+		ret = path_buf_push(path, n->name, n->name_len);
+		if (ret)
+			return ret;
+	}
+
+	if (n->mode == FSTREE_MODE_HARD_LINK_RESOLVED)
+		tgt = n->data.target;
+
+	ret = sqfs_path_index_add(index, path->str, tgt->inode_ref);
+	if (ret)
+		return ret;
+
+	if (S_ISDIR(n->mode)) {
+		for (n = n->data.dir.children; n != NULL; n = n->next) {
+			ret = add_subtree(index, n, path);
+			if (ret)
+				return ret;
+		}
+	}
+
+	path_buf_truncate(path, old_len);
+	return 0;
+}
+
+int write_path_index(const char *filename, const fstree_t *fs,
+		     const sqfs_super_t *super)
+{
+	sqfs_path_index_t *index;
+	sqfs_file_t *file;
+	path_buf_t path;
+	int ret;
+
+	index = sqfs_path_index_create();
+	if (index == NULL) {
+		perror("creating path index");
+		return -1;
+	}
+
+	ret = path_buf_init(&path, "");
+	if (ret == 0) {
+		ret = add_subtree(index, fs->root, &path);
+		path_buf_cleanup(&path);
+	}
+
+	if (ret) {
+		sqfs_perror(filename, "creating path index", ret);
+		goto out;
+	}
+
+	file = sqfs_open_file(filename, SQFS_FILE_OPEN_OVERWRITE);
+	if (file == NULL) {
+		perror(filename);
+		ret = -1;
+		goto out;
+	}
+
+	ret = sqfs_path_index_write(index, file, super);
+	file->destroy(file);
+
+	if (ret)
+		sqfs_perror(filename, "writing path index", ret);
+out:
+	sqfs_path_index_destroy(index);
+	return ret ? -1 : 0;
+}
@@ -11,6 +11,50 @@
 
 #ifdef HAVE_SYS_SYSINFO_H
 #include <sys/sysinfo.h>
+#include <stdio.h>
+
+#ifdef HAVE_SCHED_GETAFFINITY
+#include <sched.h>
+#endif
+
+/*
+  The number of CPUs worth of time the cgroup we are in may use, rounded up,
+  or 0 if there is no limit. In a container, e.g. on a shared CI runner, the
+  cgroup of the container is mounted at the usual place. Both the unified
+  hierarchy and the v1 CPU controller are tried.
+ */
+static size_t cgroup_cpu_limit(void)
+{
+	long long quota = 0, period = 0;
+	FILE *fp;
+
+	fp = fopen("/sys/fs/cgroup/cpu.max", "r");
+	if (fp != NULL) {
+		/* "max <period>" if there is no limit, which fails here */
+		if (fscanf(fp, "%lld %lld", &quota, &period) != 2)
+			quota = 0;
+		fclose(fp);
+	} else {
+		fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+		if (fp != NULL) {
+			if (fscanf(fp, "%lld", &quota) != 1)
+				quota = 0;
+			fclose(fp);
+		}
+
+		fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+		if (fp != NULL) {
+			if (fscanf(fp, "%lld", &period) != 1)
+				period = 0;
+			fclose(fp);
+		}
+	}
+
+	if (quota <= 0 || period <= 0)
+		return 0;
+
+	return (quota + period - 1) / period;
+}
 
 static size_t os_get_num_jobs(void)
 {
@@ -19,11 +63,37 @@ static size_t os_get_num_jobs(void)
 	nprocs = get_nprocs_conf();
 	return nprocs < 1 ? 1 : nprocs;
 }
+
+size_t os_get_available_jobs(void)
+{
+	size_t count, limit;
+	int nprocs;
+#ifdef HAVE_SCHED_GETAFFINITY
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		nprocs = CPU_COUNT(&set);
+	} else {
+		nprocs = get_nprocs();
+	}
+#else
+	nprocs = get_nprocs();
+#endif
+	count = nprocs < 1 ? 1 : nprocs;
+	limit = cgroup_cpu_limit();
+
+	return (limit > 0 && limit < count) ? limit : count;
+}
 #else
 static size_t os_get_num_jobs(void)
 {
 	return 1;
 }
+
+size_t os_get_available_jobs(void)
+{
+	return 1;
+}
 #endif
 
 static int padd_sqfs(sqfs_file_t *file, sqfs_u64 size, size_t blocksize)
@@ -55,6 +125,34 @@ fail_errno:
 	goto out;
 }
 
+static int write_trailer(sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *cfg)
+{
+	sqfs_u64 offset = sqfs->outfile->get_size(sqfs->outfile);
+	sqfs_stream_trailer_t trailer;
+	int ret;
+
+	ret = sqfs_super_write_at(&sqfs->super, sqfs->outfile, offset);
+	if (ret) {
+		sqfs_perror(cfg->filename, "writing super block trailer", ret);
+		return -1;
+	}
+
+	memset(&trailer, 0, sizeof(trailer));
+	memcpy(trailer.magic, SQFS_STREAM_TRAILER_MAGIC, sizeof(trailer.magic));
+	trailer.image_size = htole64(offset);
+
+	ret = sqfs->outfile->write_at(sqfs->outfile,
+				      offset + sizeof(trailer.super),
+				      trailer.magic,
+				      sizeof(trailer) - sizeof(trailer.super));
+	if (ret) {
+		sqfs_perror(cfg->filename, "writing super block trailer", ret);
+		return -1;
+	}
+
+	return 0;
+}
+
 void sqfs_writer_cfg_init(sqfs_writer_cfg_t *cfg)
 {
 	memset(cfg, 0, sizeof(*cfg));
@@ -67,30 +165,118 @@ void sqfs_writer_cfg_init(sqfs_writer_cfg_t *cfg)
 
 int sqfs_writer_init(sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *wrcfg)
 {
-	sqfs_compressor_config_t cfg;
-	int ret;
+	sqfs_u32 outmode = wrcfg->outmode | SQFS_FILE_OPEN_ASYNC;
 
-	if (compressor_cfg_init_options(&cfg, wrcfg->comp_id,
+	memset(sqfs, 0, sizeof(*sqfs));
+	stats_phase_start(&sqfs->stats);
+
+	if (compressor_cfg_init_options(&sqfs->comp_cfg, wrcfg->comp_id,
 					wrcfg->block_size,
 					wrcfg->comp_extra)) {
 		return -1;
 	}
 
-	sqfs->outfile = sqfs_open_file(wrcfg->filename, wrcfg->outmode);
+	if (wrcfg->trace_file != NULL && trace_open(wrcfg->trace_file))
+		return -1;
+
+	if (wrcfg->no_page_cache)
+		outmode |= SQFS_FILE_OPEN_DIRECT | SQFS_FILE_OPEN_SEQUENTIAL;
+
+	if (wrcfg->stream_output) {
+		sqfs->outfile = sqfs_get_stdout_file();
+		sqfs->stream = true;
+	} else {
+		sqfs->outfile = sqfs_open_file(wrcfg->filename, outmode);
+	}
+
 	if (sqfs->outfile == NULL) {
 		perror(wrcfg->filename);
+		trace_close();
 		return -1;
 	}
 
 	if (fstree_init(&sqfs->fs, wrcfg->fs_defaults))
 		goto fail_file;
 
-	sqfs->cmp = sqfs_compressor_create(&cfg);
+	if (wrcfg->intern_strings && fstree_intern_strings(&sqfs->fs))
+		goto fail_fs;
+
+	sqfs->idtbl = sqfs_id_table_create();
+	if (sqfs->idtbl == NULL) {
+		sqfs_perror(wrcfg->filename, "creating ID table",
+			    SQFS_ERROR_ALLOC);
+		goto fail_fs;
+	}
+
+	if (!wrcfg->no_xattr) {
+		sqfs->xwr = sqfs_xattr_writer_create();
+
+		if (sqfs->xwr == NULL) {
+			sqfs_perror(wrcfg->filename, "creating xattr writer",
+				    SQFS_ERROR_ALLOC);
+			goto fail_id;
+		}
+	}
+
+	/* the dictionary has to be trained before anything is compressed */
+	if (sqfs->comp_cfg.id == SQFS_COMP_ZSTD &&
+	    (sqfs->comp_cfg.flags & SQFS_COMP_FLAG_ZSTD_DICT)) {
+		return 0;
+	}
+
+	/* so does the block size, if it is picked by sampling the input */
+	if (wrcfg->max_read_amp > 0)
+		return 0;
+
+	if (sqfs_writer_init_data(sqfs, wrcfg, NULL, 0))
+		goto fail_xwr;
+
+	return 0;
+fail_xwr:
+	if (sqfs->xwr != NULL)
+		sqfs_xattr_writer_destroy(sqfs->xwr);
+fail_id:
+	sqfs_id_table_destroy(sqfs->idtbl);
+fail_fs:
+	fstree_cleanup(&sqfs->fs);
+fail_file:
+	sqfs->outfile->destroy(sqfs->outfile);
+	trace_close();
+	return -1;
+}
+
+int sqfs_writer_init_data(sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *wrcfg,
+			  const void *dict, size_t dict_size)
+{
+	sqfs_u32 flags = SQFS_DATA_WRITER_ASYNC_OUTPUT;
+	int ret;
+
+	if (sqfs->comp_cfg.id == SQFS_COMP_ZSTD) {
+		if (dict != NULL) {
+			sqfs->comp_cfg.opt.zstd.dict = dict;
+			sqfs->comp_cfg.opt.zstd.dict_size = dict_size;
+		} else {
+			sqfs->comp_cfg.flags &= ~SQFS_COMP_FLAG_ZSTD_DICT;
+		}
+	}
+
+	sqfs->cmp = sqfs_compressor_create(&sqfs->comp_cfg);
+
+	/* the other levels need the same dictionary */
+	if (sqfs->cmp != NULL && wrcfg->auto_level)
+		sqfs->tuner = level_tuner_create(&sqfs->comp_cfg);
+
+	if (sqfs->comp_cfg.id == SQFS_COMP_ZSTD)
+		sqfs->comp_cfg.opt.zstd.dict = NULL;
+
 	if (sqfs->cmp == NULL) {
 		fputs("Error creating compressor\n", stderr);
-		goto fail_fs;
+		return -1;
 	}
 
+	if (wrcfg->auto_level && sqfs->tuner == NULL)
+		goto fail_cmp;
+
 	ret = sqfs_super_init(&sqfs->super, wrcfg->block_size,
 			      sqfs->fs.defaults.st_mtime, wrcfg->comp_id);
 	if (ret) {
@@ -113,79 +299,187 @@ int sqfs_writer_init(sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *wrcfg)
 	if (ret > 0)
 		sqfs->super.flags |= SQFS_FLAG_COMPRESSOR_OPTIONS;
 
+	if (wrcfg->group_fragments)
+		flags |= SQFS_DATA_WRITER_GROUP_FRAGMENTS;
+
+	if (wrcfg->best_fit_fragments)
+		flags |= SQFS_DATA_WRITER_BEST_FIT_FRAGMENTS;
+
+	if (wrcfg->skip_incompressible)
+		flags |= SQFS_DATA_WRITER_DETECT_INCOMPRESSIBLE;
+
+	if (wrcfg->pin_workers)
+		flags |= SQFS_DATA_WRITER_PIN_WORKERS;
+
+	if (wrcfg->huge_pages)
+		flags |= SQFS_DATA_WRITER_HUGE_PAGES;
+
+	/* a few clock readings per block, reported with the statistics */
+	if (!wrcfg->quiet || wrcfg->stats_json != NULL ||
+	    sqfs->tuner != NULL) {
+		flags |= SQFS_DATA_WRITER_TIMING;
+	}
+
+	if (wrcfg->adaptive_workers)
+		flags |= SQFS_DATA_WRITER_ADAPTIVE_WORKERS;
+
+	/* cheap unless blocks actually repeat, and the output is the same */
+	flags |= SQFS_DATA_WRITER_CACHE_COMPRESSED;
+
+	/* duplicates must not be written at all, instead of truncated away */
+	if (sqfs->stream)
+		flags |= SQFS_DATA_WRITER_HOLD_BLOCKS;
+
+	/*
+	  The compressor workers and the helpers that compress the tables
+	  take their threads from one pool. While the workers wait for
+	  blocks, the table helpers get their share.
+	 */
+	sqfs->pool = sqfs_thread_pool_create(wrcfg->num_jobs);
+	if (sqfs->pool == NULL) {
+		perror("creating thread pool");
+		goto fail_cmp;
+	}
+
+	sqfs_set_thread_pool(sqfs->pool);
+
 	sqfs->data = sqfs_data_writer_create(sqfs->super.block_size,
 					     sqfs->cmp, wrcfg->num_jobs,
 					     wrcfg->max_backlog,
+					     wrcfg->max_backlog,
 					     wrcfg->devblksize,
-					     sqfs->outfile);
+					     sqfs->outfile, flags);
 	if (sqfs->data == NULL) {
 		perror("creating data block processor");
-		goto fail_cmp;
+		goto fail_pool;
+	}
+
+	if (wrcfg->max_memory > 0) {
+		ret = sqfs_data_writer_set_memory_limit(sqfs->data,
+							wrcfg->max_memory);
+		if (ret) {
+			sqfs_perror(wrcfg->filename, "setting memory limit",
+				    ret);
+			goto fail_data;
+		}
 	}
 
-	memset(&sqfs->stats, 0, sizeof(sqfs->stats));
 	register_stat_hooks(sqfs->data, &sqfs->stats);
 
-	sqfs->idtbl = sqfs_id_table_create();
-	if (sqfs->idtbl == NULL) {
-		sqfs_perror(wrcfg->filename, "creating ID table",
-			    SQFS_ERROR_ALLOC);
+	if (sqfs->tuner != NULL) {
+		if (level_tuner_attach(sqfs->tuner, wrcfg->filename,
+				       sqfs->data)) {
+			goto fail_data;
+		}
+
+		/* the tuner goes by the input counted for the status line */
+		sqfs->stats.progress.block_size = sqfs->super.block_size;
+		sqfs->stats.tuner = sqfs->tuner;
+	}
+
+	if (wrcfg->progress && !wrcfg->quiet)
+		progress_start(&sqfs->stats, sqfs->data,
+			       sqfs->super.block_size, wrcfg->max_backlog);
+
+	if (wrcfg->block_cache != NULL && sqfs->stream) {
+		fputs("A block cache cannot be used when streaming the "
+		      "output.\n", stderr);
 		goto fail_data;
 	}
 
-	if (!wrcfg->no_xattr) {
-		sqfs->xwr = sqfs_xattr_writer_create();
+	/* the cache holds on to inodes until after the data writer is done */
+	if (wrcfg->block_cache != NULL && wrcfg->spill_inodes) {
+		fputs("A block cache cannot be used when spilling the "
+		      "inodes.\n", stderr);
+		goto fail_data;
+	}
 
-		if (sqfs->xwr == NULL) {
-			sqfs_perror(wrcfg->filename, "creating xattr writer",
-				    SQFS_ERROR_ALLOC);
-			goto fail;
+	if (wrcfg->spill_inodes) {
+		sqfs->spill = inode_spill_create(sqfs->data);
+		if (sqfs->spill == NULL)
+			goto fail_data;
+	}
+
+	if (wrcfg->block_cache != NULL && wrcfg->warm_cache != NULL &&
+	    block_cache_is_file(wrcfg->warm_cache, wrcfg->block_cache)) {
+		if (block_cache_attach(wrcfg->warm_cache, &sqfs->super,
+				       sqfs->outfile)) {
+			goto fail_data;
 		}
+
+		sqfs->cache = wrcfg->warm_cache;
+		sqfs->borrowed_cache = true;
+	} else if (wrcfg->block_cache != NULL) {
+		sqfs->cache = block_cache_open(wrcfg->block_cache,
+					       &sqfs->super, sqfs->outfile);
+		if (sqfs->cache == NULL)
+			goto fail_data;
 	}
 
 	return 0;
-fail:
-	if (sqfs->xwr != NULL)
-		sqfs_xattr_writer_destroy(sqfs->xwr);
-	sqfs_id_table_destroy(sqfs->idtbl);
 fail_data:
 	sqfs_data_writer_destroy(sqfs->data);
+	sqfs->data = NULL;
+fail_pool:
+	sqfs_set_thread_pool(NULL);
+	sqfs_thread_pool_destroy(sqfs->pool);
+	sqfs->pool = NULL;
 fail_cmp:
+	level_tuner_destroy(sqfs->tuner);
+	sqfs->tuner = NULL;
 	sqfs->cmp->destroy(sqfs->cmp);
-fail_fs:
-	fstree_cleanup(&sqfs->fs);
-fail_file:
-	sqfs->outfile->destroy(sqfs->outfile);
+	sqfs->cmp = NULL;
 	return -1;
 }
 
-int sqfs_writer_finish(sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *cfg)
+int sqfs_writer_finish_data(sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *cfg)
 {
 	int ret;
 
-	if (!cfg->quiet)
+	if (!cfg->quiet && !cfg->progress)
 		fputs("Waiting for remaining data blocks...\n", stdout);
 
 	ret = sqfs_data_writer_finish(sqfs->data);
+	progress_end(&sqfs->stats);
+
 	if (ret) {
 		sqfs_perror(cfg->filename, "finishing data blocks", ret);
 		return -1;
 	}
 
-	if (!cfg->quiet)
-		fputs("Writing inodes and directories...\n", stdout);
+	sqfs->stats.timing.size = sizeof(sqfs->stats.timing);
 
-	tree_node_sort_recursive(sqfs->fs.root);
-	if (fstree_gen_inode_table(&sqfs->fs))
-		return -1;
+	if (sqfs_data_writer_get_timing(sqfs->data, &sqfs->stats.timing))
+		sqfs->stats.timing.size = 0;
 
-	sqfs->super.inode_count = sqfs->fs.inode_tbl_size;
+	if (sqfs->cache != NULL) {
+		if (!cfg->quiet)
+			fputs("Updating block cache...\n", stdout);
 
-	if (sqfs_serialize_fstree(cfg->filename, sqfs->outfile, &sqfs->super,
-				  &sqfs->fs, sqfs->cmp, sqfs->idtbl)) {
-		return -1;
+		if (block_cache_flush(sqfs->cache, sqfs->outfile))
+			return -1;
+
+		sqfs->stats.cached_blocks = block_cache_get_hits(sqfs->cache);
 	}
 
+	stats_phase_end(&sqfs->stats, WRITER_PHASE_DATA);
+
+	if (cfg->exportable) {
+		sqfs->export = export_table_create(sqfs->outfile, sqfs->cmp);
+		if (sqfs->export == NULL) {
+			perror("creating NFS export table");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int sqfs_writer_finish_tables(sqfs_writer_t *sqfs,
+			      const sqfs_writer_cfg_t *cfg)
+{
+	int ret;
+
 	if (!cfg->quiet)
 		fputs("Writing fragment table...\n", stdout);
 
@@ -195,14 +489,21 @@ int sqfs_writer_finish(sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *cfg)
 		return -1;
 	}
 
+	stats_phase_end(&sqfs->stats, WRITER_PHASE_FRAGMENTS);
+
 	if (cfg->exportable) {
 		if (!cfg->quiet)
 			fputs("Writing export table...\n", stdout);
 
-		if (write_export_table(cfg->filename, sqfs->outfile, &sqfs->fs,
-				       &sqfs->super, sqfs->cmp)) {
+		sqfs_trace_begin("writer", "write export table");
+		ret = write_export_table(cfg->filename, sqfs->outfile,
+					 sqfs->export, &sqfs->super);
+		sqfs_trace_end("writer", "write export table");
+
+		if (ret)
 			return -1;
-		}
+
+		stats_phase_end(&sqfs->stats, WRITER_PHASE_EXPORT);
 	}
 
 	if (!cfg->quiet)
@@ -215,6 +516,8 @@ int sqfs_writer_finish(sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *cfg)
 		return -1;
 	}
 
+	stats_phase_end(&sqfs->stats, WRITER_PHASE_IDS);
+
 	if (!cfg->no_xattr) {
 		if (!cfg->quiet)
 			fputs("Writing extended attributes...\n", stdout);
@@ -225,34 +528,111 @@ int sqfs_writer_finish(sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *cfg)
 			sqfs_perror(cfg->filename, "writing extended attributes", ret);
 			return -1;
 		}
+
+		stats_phase_end(&sqfs->stats, WRITER_PHASE_XATTRS);
 	}
 
 	sqfs->super.bytes_used = sqfs->outfile->get_size(sqfs->outfile);
 
-	ret = sqfs_super_write(&sqfs->super, sqfs->outfile);
-	if (ret) {
-		sqfs_perror(cfg->filename, "updating super block", ret);
+	if (padd_sqfs(sqfs->outfile, sqfs->super.bytes_used,
+		      cfg->devblksize)) {
 		return -1;
 	}
 
-	if (padd_sqfs(sqfs->outfile, sqfs->super.bytes_used,
-		      cfg->devblksize)) {
+	if (sqfs->stream) {
+		if (write_trailer(sqfs, cfg))
+			return -1;
+	} else {
+		ret = sqfs_super_write(&sqfs->super, sqfs->outfile);
+		if (ret) {
+			sqfs_perror(cfg->filename, "updating super block",
+				    ret);
+			return -1;
+		}
+	}
+
+	ret = sqfs_file_flush(sqfs->outfile, 0);
+	if (ret) {
+		sqfs_perror(cfg->filename, "flushing output file", ret);
 		return -1;
 	}
 
+	stats_phase_end(&sqfs->stats, WRITER_PHASE_FINISH);
+
 	if (!cfg->quiet)
 		sqfs_print_statistics(&sqfs->super, &sqfs->stats);
 
+	if (cfg->stats_json != NULL &&
+	    sqfs_write_statistics_json(cfg->stats_json, &sqfs->super,
+				       &sqfs->stats)) {
+		return -1;
+	}
+
+	if (cfg->path_index != NULL &&
+	    write_path_index(cfg->path_index, &sqfs->fs, &sqfs->super)) {
+		return -1;
+	}
+
 	return 0;
 }
 
+int sqfs_writer_finish(sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *cfg)
+{
+	int ret;
+
+	/*
+	  The inode numbers and the order of the inode table do not depend on
+	  the data, so the tree is prepared while the workers are still busy
+	  with the last blocks.
+	 */
+	if (fstree_resolve_hard_links(&sqfs->fs) ||
+	    fstree_sort_gen_inode_table(&sqfs->fs, cfg->num_jobs)) {
+		progress_end(&sqfs->stats);
+		return -1;
+	}
+
+	sqfs->super.inode_count = sqfs->fs.inode_tbl_size;
+
+	if (sqfs_writer_finish_data(sqfs, cfg))
+		return -1;
+
+	if (!cfg->quiet)
+		fputs("Writing inodes and directories...\n", stdout);
+
+	sqfs_trace_begin("writer", "write inodes and directories");
+	ret = sqfs_serialize_fstree(cfg->filename, sqfs->outfile, &sqfs->super,
+				    &sqfs->fs, sqfs->cmp, sqfs->idtbl,
+				    sqfs->export, sqfs->spill,
+				    cfg->align_inodes, cfg->dir_index_step);
+	sqfs_trace_end("writer", "write inodes and directories");
+
+	if (ret)
+		return -1;
+
+	stats_phase_end(&sqfs->stats, WRITER_PHASE_INODES);
+
+	return sqfs_writer_finish_tables(sqfs, cfg);
+}
+
 void sqfs_writer_cleanup(sqfs_writer_t *sqfs)
 {
 	if (sqfs->xwr != NULL)
 		sqfs_xattr_writer_destroy(sqfs->xwr);
 	sqfs_id_table_destroy(sqfs->idtbl);
-	sqfs_data_writer_destroy(sqfs->data);
-	sqfs->cmp->destroy(sqfs->cmp);
+	if (!sqfs->borrowed_cache)
+		block_cache_destroy(sqfs->cache);
+	export_table_destroy(sqfs->export);
+	inode_spill_destroy(sqfs->spill);
+	if (sqfs->data != NULL)
+		sqfs_data_writer_destroy(sqfs->data);
+	if (sqfs->pool != NULL) {
+		sqfs_set_thread_pool(NULL);
+		sqfs_thread_pool_destroy(sqfs->pool);
+	}
+	level_tuner_destroy(sqfs->tuner);
+	if (sqfs->cmp != NULL)
+		sqfs->cmp->destroy(sqfs->cmp);
 	fstree_cleanup(&sqfs->fs);
 	sqfs->outfile->destroy(sqfs->outfile);
+	trace_close();
 }
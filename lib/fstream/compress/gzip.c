@@ -0,0 +1,77 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * gzip.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "../internal.h"
+
+#include <zlib.h>
+
+typedef struct {
+	ostream_comp_t base;
+
+	z_stream strm;
+} ostream_gzip_t;
+
+static int gzip_compress(ostream_comp_t *base, const sqfs_u8 *in,
+			 size_t *in_size, sqfs_u8 *out, size_t *out_size,
+			 bool finish)
+{
+	ostream_gzip_t *gzip = (ostream_gzip_t *)base;
+	size_t avail_in = *in_size, avail_out = *out_size;
+	int ret;
+
+	gzip->strm.next_in = (Bytef *)in;
+	gzip->strm.avail_in = avail_in;
+	gzip->strm.next_out = out;
+	gzip->strm.avail_out = avail_out;
+
+	ret = deflate(&gzip->strm, finish ? Z_FINISH : Z_NO_FLUSH);
+
+	*in_size = avail_in - gzip->strm.avail_in;
+	*out_size = avail_out - gzip->strm.avail_out;
+
+	if (ret == Z_STREAM_END)
+		return 1;
+
+	/* no progress is possible if the output buffer is full */
+	if (ret == Z_OK || ret == Z_BUF_ERROR)
+		return 0;
+
+	fprintf(stderr, "%s: gzip compression failed: %s\n",
+		base->wrapped->get_filename(base->wrapped),
+		gzip->strm.msg != NULL ? gzip->strm.msg : "internal error");
+	return -1;
+}
+
+static void gzip_cleanup(ostream_comp_t *base)
+{
+	deflateEnd(&((ostream_gzip_t *)base)->strm);
+}
+
+ostream_comp_t *ostream_gzip_create(const char *filename,
+				    unsigned int num_threads)
+{
+	ostream_gzip_t *gzip = calloc(1, sizeof(*gzip));
+	ostream_comp_t *base = (ostream_comp_t *)gzip;
+	(void)num_threads;
+
+	if (gzip == NULL) {
+		perror(filename);
+		return NULL;
+	}
+
+	/* a window size of 15 + 16 selects the gzip format */
+	if (deflateInit2(&gzip->strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+			 16 + 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		fprintf(stderr, "%s: initializing the gzip compressor "
+			"failed\n", filename);
+		free(gzip);
+		return NULL;
+	}
+
+	base->compress = gzip_compress;
+	base->cleanup = gzip_cleanup;
+	return base;
+}
@@ -0,0 +1,106 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * xz.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "../internal.h"
+
+#include <lzma.h>
+
+/* the multi threaded encoder is considered stable since 5.2.0 */
+#if LZMA_VERSION >= 50020002
+#define XZ_ENCODER_MT
+#endif
+
+typedef struct {
+	ostream_comp_t base;
+
+	lzma_stream strm;
+} ostream_xz_t;
+
+static int xz_compress(ostream_comp_t *base, const sqfs_u8 *in,
+		       size_t *in_size, sqfs_u8 *out, size_t *out_size,
+		       bool finish)
+{
+	ostream_xz_t *xz = (ostream_xz_t *)base;
+	size_t avail_in = *in_size, avail_out = *out_size;
+	lzma_ret ret;
+
+	xz->strm.next_in = in;
+	xz->strm.avail_in = avail_in;
+	xz->strm.next_out = out;
+	xz->strm.avail_out = avail_out;
+
+	ret = lzma_code(&xz->strm, finish ? LZMA_FINISH : LZMA_RUN);
+
+	*in_size = avail_in - xz->strm.avail_in;
+	*out_size = avail_out - xz->strm.avail_out;
+
+	if (ret == LZMA_STREAM_END)
+		return 1;
+
+	if (ret == LZMA_OK)
+		return 0;
+
+	fprintf(stderr, "%s: xz compression failed (%s)\n",
+		base->wrapped->get_filename(base->wrapped),
+		ret == LZMA_MEM_ERROR ? "out of memory" : "internal error");
+	return -1;
+}
+
+static void xz_cleanup(ostream_comp_t *base)
+{
+	lzma_end(&((ostream_xz_t *)base)->strm);
+}
+
+ostream_comp_t *ostream_xz_create(const char *filename,
+				  unsigned int num_threads)
+{
+	ostream_xz_t *xz = calloc(1, sizeof(*xz));
+	ostream_comp_t *base = (ostream_comp_t *)xz;
+	lzma_stream strm = LZMA_STREAM_INIT;
+#ifdef XZ_ENCODER_MT
+	lzma_mt mt;
+#endif
+	lzma_ret ret;
+
+	if (xz == NULL) {
+		perror(filename);
+		return NULL;
+	}
+
+	xz->strm = strm;
+
+#ifdef XZ_ENCODER_MT
+	/*
+	  The multi threaded encoder splits the data into independent
+	  blocks, which also allows decoding it in parallel later on.
+	 */
+	if (num_threads > 1) {
+		memset(&mt, 0, sizeof(mt));
+		mt.threads = num_threads;
+		mt.preset = LZMA_PRESET_DEFAULT;
+		mt.check = LZMA_CHECK_CRC64;
+
+		ret = lzma_stream_encoder_mt(&xz->strm, &mt);
+	} else {
+		ret = lzma_easy_encoder(&xz->strm, LZMA_PRESET_DEFAULT,
+					LZMA_CHECK_CRC64);
+	}
+#else
+	(void)num_threads;
+	ret = lzma_easy_encoder(&xz->strm, LZMA_PRESET_DEFAULT,
+				LZMA_CHECK_CRC64);
+#endif
+	if (ret != LZMA_OK) {
+		fprintf(stderr, "%s: initializing the xz compressor "
+			"failed\n", filename);
+		free(xz);
+		return NULL;
+	}
+
+	base->compress = xz_compress;
+	base->cleanup = xz_cleanup;
+	return base;
+}
@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * zstd.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "../internal.h"
+
+#include <zstd.h>
+
+typedef struct {
+	ostream_comp_t base;
+
+	ZSTD_CStream *strm;
+} ostream_zstd_t;
+
+static int zstd_compress(ostream_comp_t *base, const sqfs_u8 *in,
+			 size_t *in_size, sqfs_u8 *out, size_t *out_size,
+			 bool finish)
+{
+	ostream_zstd_t *zstd = (ostream_zstd_t *)base;
+	ZSTD_outBuffer outbuf;
+	ZSTD_inBuffer inbuf;
+	size_t ret;
+
+	inbuf.src = in;
+	inbuf.size = *in_size;
+	inbuf.pos = 0;
+
+	outbuf.dst = out;
+	outbuf.size = *out_size;
+	outbuf.pos = 0;
+
+#if ZSTD_VERSION_NUMBER >= 10400
+	ret = ZSTD_compressStream2(zstd->strm, &outbuf, &inbuf,
+				   finish ? ZSTD_e_end : ZSTD_e_continue);
+#else
+	if (finish && inbuf.size == 0) {
+		ret = ZSTD_endStream(zstd->strm, &outbuf);
+	} else {
+		ret = ZSTD_compressStream(zstd->strm, &outbuf, &inbuf);
+
+		/* finish once all input has been consumed */
+		if (finish && !ZSTD_isError(ret))
+			ret = 1;
+	}
+#endif
+
+	*in_size = inbuf.pos;
+	*out_size = outbuf.pos;
+
+	if (ZSTD_isError(ret)) {
+		fprintf(stderr, "%s: zstd compression failed: %s\n",
+			base->wrapped->get_filename(base->wrapped),
+			ZSTD_getErrorName(ret));
+		return -1;
+	}
+
+	/* when finishing, 0 means everything has been flushed */
+	return (finish && ret == 0) ? 1 : 0;
+}
+
+static void zstd_cleanup(ostream_comp_t *base)
+{
+	ZSTD_freeCStream(((ostream_zstd_t *)base)->strm);
+}
+
+ostream_comp_t *ostream_zstd_create(const char *filename,
+				    unsigned int num_threads)
+{
+	ostream_zstd_t *zstd = calloc(1, sizeof(*zstd));
+	ostream_comp_t *base = (ostream_comp_t *)zstd;
+
+	if (zstd == NULL) {
+		perror(filename);
+		return NULL;
+	}
+
+	zstd->strm = ZSTD_createCStream();
+	if (zstd->strm == NULL)
+		goto fail;
+
+#if ZSTD_VERSION_NUMBER >= 10400
+	if (ZSTD_isError(ZSTD_CCtx_setParameter(zstd->strm,
+						ZSTD_c_compressionLevel,
+						ZSTD_CLEVEL_DEFAULT))) {
+		goto fail;
+	}
+
+	/*
+	  The library may have been built without thread support, in which
+	  case this fails and the data is compressed on a single thread.
+	 */
+	if (num_threads > 1) {
+		ZSTD_CCtx_setParameter(zstd->strm, ZSTD_c_nbWorkers,
+				       num_threads);
+	}
+#else
+	(void)num_threads;
+	if (ZSTD_isError(ZSTD_initCStream(zstd->strm, ZSTD_CLEVEL_DEFAULT)))
+		goto fail;
+#endif
+
+	base->compress = zstd_compress;
+	base->cleanup = zstd_cleanup;
+	return base;
+fail:
+	fprintf(stderr, "%s: initializing the zstd compressor failed\n",
+		filename);
+	ZSTD_freeCStream(zstd->strm);
+	free(zstd);
+	return NULL;
+}
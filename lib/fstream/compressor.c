@@ -0,0 +1,355 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * compressor.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "internal.h"
+
+static const struct {
+	int id;
+	const char *name;
+	const sqfs_u8 *magic;
+	size_t length;
+	istream_comp_t *(*create)(const char *filename);
+	ostream_comp_t *(*create_out)(const char *filename,
+				      unsigned int num_threads);
+} compressors[] = {
+	{ FSTREAM_COMPRESSOR_GZIP, "gzip",
+	  (const sqfs_u8 *)"\x1F\x8B\x08", 3,
+#ifdef WITH_GZIP
+	  istream_gzip_create, ostream_gzip_create,
+#else
+	  NULL, NULL,
+#endif
+	},
+	{ FSTREAM_COMPRESSOR_XZ, "xz",
+	  (const sqfs_u8 *)"\xFD" "7zXZ", 6,
+#ifdef WITH_XZ
+	  istream_xz_create, ostream_xz_create,
+#else
+	  NULL, NULL,
+#endif
+	},
+	{ FSTREAM_COMPRESSOR_ZSTD, "zstd",
+	  (const sqfs_u8 *)"\x28\xB5\x2F\xFD", 4,
+#ifdef WITH_ZSTD
+	  istream_zstd_create, ostream_zstd_create,
+#else
+	  NULL, NULL,
+#endif
+	},
+	{ FSTREAM_COMPRESSOR_BZIP2, "bzip2",
+	  (const sqfs_u8 *)"BZh", 3,
+#ifdef WITH_BZIP2
+	  istream_bzip2_create,
+#else
+	  NULL,
+#endif
+	  NULL,
+	},
+};
+
+/* the longest magic number, the xz one including the terminating zero */
+#define MAGIC_MAX (6)
+
+static int comp_precache(istream_t *strm)
+{
+	istream_comp_t *comp = (istream_comp_t *)strm;
+	istream_t *wrapped = comp->wrapped;
+	size_t diff, in_size, out_size;
+	int ret;
+
+	diff = strm->buffer_used - strm->buffer_offset;
+	memmove(strm->buffer, strm->buffer + strm->buffer_offset, diff);
+	strm->buffer_offset = 0;
+	strm->buffer_used = diff;
+
+	while (strm->buffer_used < ISTREAM_BUFFER_SIZE) {
+		if (wrapped->buffer_offset >= wrapped->buffer_used) {
+			if (istream_precache(wrapped))
+				return -1;
+		}
+
+		in_size = wrapped->buffer_used - wrapped->buffer_offset;
+		out_size = ISTREAM_BUFFER_SIZE - strm->buffer_used;
+
+		ret = comp->uncompress(comp,
+				       wrapped->buffer + wrapped->buffer_offset,
+				       &in_size,
+				       strm->buffer + strm->buffer_used,
+				       &out_size);
+		if (ret < 0)
+			return -1;
+
+		wrapped->buffer_offset += in_size;
+		strm->buffer_used += out_size;
+
+		if (ret > 0) {
+			strm->eof = true;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static const char *comp_get_filename(istream_t *strm)
+{
+	istream_t *wrapped = ((istream_comp_t *)strm)->wrapped;
+
+	return wrapped->get_filename(wrapped);
+}
+
+static void comp_destroy(istream_t *strm)
+{
+	istream_comp_t *comp = (istream_comp_t *)strm;
+
+	comp->cleanup(comp);
+	comp->wrapped->destroy(comp->wrapped);
+	free(strm->buffer);
+	free(comp);
+}
+
+int istream_detect_compressor(istream_t *strm)
+{
+	size_t i, avail;
+
+	for (;;) {
+		avail = strm->buffer_used - strm->buffer_offset;
+
+		if (avail >= MAGIC_MAX || strm->eof)
+			break;
+
+		if (istream_precache(strm))
+			return -1;
+	}
+
+	for (i = 0; i < sizeof(compressors) / sizeof(compressors[0]); ++i) {
+		if (avail < compressors[i].length)
+			continue;
+
+		if (memcmp(strm->buffer + strm->buffer_offset,
+			   compressors[i].magic, compressors[i].length) == 0) {
+			return compressors[i].id;
+		}
+	}
+
+	return 0;
+}
+
+istream_t *istream_compressor_create(istream_t *strm, int comp_id)
+{
+	istream_comp_t *comp = NULL;
+	size_t i;
+
+	for (i = 0; i < sizeof(compressors) / sizeof(compressors[0]); ++i) {
+		if (compressors[i].id != comp_id)
+			continue;
+
+		if (compressors[i].create == NULL) {
+			fprintf(stderr, "%s: no support for %s compressed "
+				"input available\n", strm->get_filename(strm),
+				compressors[i].name);
+			return NULL;
+		}
+
+		comp = compressors[i].create(strm->get_filename(strm));
+		if (comp == NULL)
+			return NULL;
+		break;
+	}
+
+	if (comp == NULL) {
+		fprintf(stderr, "%s: unknown compressor\n",
+			strm->get_filename(strm));
+		return NULL;
+	}
+
+	comp->base.buffer = malloc(ISTREAM_BUFFER_SIZE);
+	if (comp->base.buffer == NULL) {
+		perror(strm->get_filename(strm));
+		comp->cleanup(comp);
+		free(comp);
+		return NULL;
+	}
+
+	comp->wrapped = strm;
+	comp->base.precache = comp_precache;
+	comp->base.get_filename = comp_get_filename;
+	comp->base.destroy = comp_destroy;
+
+	return istream_read_ahead((istream_t *)comp);
+}
+
+/* compress data into the buffer of the wrapped stream */
+static int comp_encode(ostream_comp_t *comp, const sqfs_u8 *in, size_t size,
+		       bool finish)
+{
+	ostream_t *wrapped = comp->wrapped;
+	size_t in_size, out_size;
+	int ret;
+
+	for (;;) {
+		if (wrapped->buffer_used == OSTREAM_BUFFER_SIZE &&
+		    wrapped->write(wrapped, NULL, 0)) {
+			return -1;
+		}
+
+		in_size = size;
+		out_size = OSTREAM_BUFFER_SIZE - wrapped->buffer_used;
+
+		ret = comp->compress(comp, in, &in_size,
+				     wrapped->buffer + wrapped->buffer_used,
+				     &out_size, finish);
+		if (ret < 0)
+			return -1;
+
+		wrapped->buffer_used += out_size;
+		in += in_size;
+		size -= in_size;
+
+		if (finish ? (ret > 0) : (size == 0))
+			break;
+	}
+
+	return 0;
+}
+
+static int comp_write(ostream_t *strm, const void *data, size_t size)
+{
+	ostream_comp_t *comp = (ostream_comp_t *)strm;
+	size_t used = strm->buffer_used;
+
+	strm->buffer_used = 0;
+
+	if (used > 0 && comp_encode(comp, strm->buffer, used, false))
+		return -1;
+
+	if (size > 0 && comp_encode(comp, data, size, false))
+		return -1;
+
+	return 0;
+}
+
+static int comp_flush(ostream_t *strm)
+{
+	ostream_comp_t *comp = (ostream_comp_t *)strm;
+
+	if (comp_encode(comp, NULL, 0, true))
+		return -1;
+
+	return ostream_flush(comp->wrapped);
+}
+
+static const char *comp_get_out_filename(ostream_t *strm)
+{
+	ostream_t *wrapped = ((ostream_comp_t *)strm)->wrapped;
+
+	return wrapped->get_filename(wrapped);
+}
+
+static void comp_out_destroy(ostream_t *strm)
+{
+	ostream_comp_t *comp = (ostream_comp_t *)strm;
+
+	comp->cleanup(comp);
+	comp->wrapped->destroy(comp->wrapped);
+	free(strm->buffer);
+	free(comp);
+}
+
+ostream_t *ostream_compressor_create(ostream_t *strm, int comp_id,
+				     unsigned int num_threads)
+{
+	ostream_comp_t *comp = NULL;
+	size_t i;
+
+	for (i = 0; i < sizeof(compressors) / sizeof(compressors[0]); ++i) {
+		if (compressors[i].id != comp_id)
+			continue;
+
+		if (compressors[i].create_out == NULL) {
+			fprintf(stderr, "%s: no support for %s compressed "
+				"output available\n", strm->get_filename(strm),
+				compressors[i].name);
+			return NULL;
+		}
+
+		comp = compressors[i].create_out(strm->get_filename(strm),
+						 num_threads);
+		if (comp == NULL)
+			return NULL;
+		break;
+	}
+
+	if (comp == NULL) {
+		fprintf(stderr, "%s: unknown compressor\n",
+			strm->get_filename(strm));
+		return NULL;
+	}
+
+	comp->base.buffer = malloc(OSTREAM_BUFFER_SIZE);
+	if (comp->base.buffer == NULL) {
+		perror(strm->get_filename(strm));
+		comp->cleanup(comp);
+		free(comp);
+		return NULL;
+	}
+
+	comp->wrapped = strm;
+	comp->base.write = comp_write;
+	comp->base.flush = comp_flush;
+	comp->base.get_filename = comp_get_out_filename;
+	comp->base.destroy = comp_out_destroy;
+
+	return ostream_write_behind((ostream_t *)comp);
+}
+
+int fstream_compressor_id_from_name(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(compressors) / sizeof(compressors[0]); ++i) {
+		if (strcmp(compressors[i].name, name) == 0)
+			return compressors[i].id;
+	}
+
+	return -1;
+}
+
+bool fstream_compressor_can_compress(int id)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(compressors) / sizeof(compressors[0]); ++i) {
+		if (compressors[i].id == id)
+			return compressors[i].create_out != NULL;
+	}
+
+	return false;
+}
+
+const char *fstream_compressor_name_from_id(int id)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(compressors) / sizeof(compressors[0]); ++i) {
+		if (compressors[i].id == id)
+			return compressors[i].name;
+	}
+
+	return NULL;
+}
+
+bool fstream_compressor_exists(int id)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(compressors) / sizeof(compressors[0]); ++i) {
+		if (compressors[i].id == id)
+			return compressors[i].create != NULL;
+	}
+
+	return false;
+}
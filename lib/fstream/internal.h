@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * internal.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef INTERNAL_H
+#define INTERNAL_H
+
+#include "config.h"
+#include "fstream.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+typedef struct istream_comp_t {
+	istream_t base;
+
+	istream_t *wrapped;
+
+	/*
+	  Decode as much as possible. The sizes are the available space
+	  on entry and the consumed or produced amount on return. An empty
+	  input means the wrapped stream has ended. Returns 0 on success,
+	  > 0 at the end of the compressed data and < 0 on failure, after
+	  printing an error message.
+	 */
+	int (*uncompress)(struct istream_comp_t *strm,
+			  const sqfs_u8 *in, size_t *in_size,
+			  sqfs_u8 *out, size_t *out_size);
+
+	void (*cleanup)(struct istream_comp_t *strm);
+} istream_comp_t;
+
+/*
+  Returns a stream that refills the buffer of the given one on a separate
+  thread, or the stream itself if that is not possible. Takes ownership.
+ */
+istream_t *istream_read_ahead(istream_t *strm);
+
+typedef struct ostream_comp_t {
+	ostream_t base;
+
+	ostream_t *wrapped;
+
+	/*
+	  Encode as much as possible. The sizes are the available space on
+	  entry and the consumed or produced amount on return. If finish is
+	  set, the input is the last of the data and the compressed stream
+	  is completed. Returns 0 on success, > 0 once a finished stream has
+	  been completely written out and < 0 on failure, after printing an
+	  error message.
+	 */
+	int (*compress)(struct ostream_comp_t *strm,
+			const sqfs_u8 *in, size_t *in_size,
+			sqfs_u8 *out, size_t *out_size, bool finish);
+
+	void (*cleanup)(struct ostream_comp_t *strm);
+} ostream_comp_t;
+
+/*
+  Returns a stream that writes to the given one on a separate thread, or
+  the stream itself if that is not possible. Takes ownership.
+ */
+ostream_t *ostream_write_behind(ostream_t *strm);
+
+istream_comp_t *istream_gzip_create(const char *filename);
+
+istream_comp_t *istream_xz_create(const char *filename);
+
+istream_comp_t *istream_zstd_create(const char *filename);
+
+istream_comp_t *istream_bzip2_create(const char *filename);
+
+ostream_comp_t *ostream_gzip_create(const char *filename,
+				    unsigned int num_threads);
+
+ostream_comp_t *ostream_xz_create(const char *filename,
+				  unsigned int num_threads);
+
+ostream_comp_t *ostream_zstd_create(const char *filename,
+				    unsigned int num_threads);
+
+#endif /* INTERNAL_H */
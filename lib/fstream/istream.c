@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * istream.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "fstream.h"
+
+#include <string.h>
+#include <stdio.h>
+
+int istream_precache(istream_t *strm)
+{
+	if (strm->eof)
+		return 0;
+
+	return strm->precache(strm);
+}
+
+int istream_fill(istream_t *strm, size_t size)
+{
+	while (strm->buffer_used - strm->buffer_offset < size) {
+		if (strm->eof) {
+			fprintf(stderr, "%s: unexpected end of file\n",
+				strm->get_filename(strm));
+			return -1;
+		}
+
+		if (istream_precache(strm))
+			return -1;
+	}
+
+	return 0;
+}
+
+sqfs_s32 istream_read(istream_t *strm, void *data, size_t size)
+{
+	sqfs_s32 total = 0;
+	size_t diff;
+
+	if (size > 0x7FFFFFFF)
+		size = 0x7FFFFFFF;
+
+	while (size > 0) {
+		if (strm->buffer_offset >= strm->buffer_used) {
+			if (istream_precache(strm))
+				return -1;
+
+			if (strm->buffer_offset >= strm->buffer_used)
+				break;
+		}
+
+		diff = strm->buffer_used - strm->buffer_offset;
+		if (diff > size)
+			diff = size;
+
+		memcpy(data, strm->buffer + strm->buffer_offset, diff);
+		data = (char *)data + diff;
+		strm->buffer_offset += diff;
+		size -= diff;
+		total += diff;
+	}
+
+	return total;
+}
+
+int istream_skip(istream_t *strm, sqfs_u64 size)
+{
+	size_t diff;
+	int ret;
+
+	while (size > 0) {
+		diff = strm->buffer_used - strm->buffer_offset;
+
+		if (diff == 0 && strm->seek_forward != NULL) {
+			ret = strm->seek_forward(strm, size);
+			if (ret <= 0)
+				return ret;
+		}
+
+		if (diff == 0) {
+			if (istream_precache(strm))
+				return -1;
+
+			diff = strm->buffer_used - strm->buffer_offset;
+
+			if (diff == 0) {
+				fprintf(stderr, "%s: unexpected end of file\n",
+					strm->get_filename(strm));
+				return -1;
+			}
+		}
+
+		if ((sqfs_u64)diff > size)
+			diff = size;
+
+		strm->buffer_offset += diff;
+		size -= diff;
+	}
+
+	return 0;
+}
@@ -0,0 +1,235 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * istream_file.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "internal.h"
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+
+#ifdef WITH_PTHREAD
+#include <pthread.h>
+#endif
+
+/* how far ahead of the current position a regular file is read ahead */
+#define PREFETCH_WINDOW (16 * 1024 * 1024)
+
+typedef struct {
+	istream_t base;
+	char *path;
+	int fd;
+
+	/* for regular files: the position after the buffer and the size */
+	bool regular;
+	sqfs_u64 position;
+	sqfs_u64 size;
+	sqfs_u64 prefetch_end;
+} file_istream_t;
+
+static void prefetch(file_istream_t *file)
+{
+#ifdef HAVE_POSIX_FADVISE
+	sqfs_u64 end = file->position + PREFETCH_WINDOW;
+
+	if (file->prefetch_end < file->position)
+		file->prefetch_end = file->position;
+
+	/* only extend the window once half of it has been consumed */
+	if (end - file->prefetch_end < PREFETCH_WINDOW / 2)
+		return;
+
+	posix_fadvise(file->fd, file->prefetch_end, end - file->prefetch_end,
+		      POSIX_FADV_WILLNEED);
+	file->prefetch_end = end;
+#else
+	(void)file;
+#endif
+}
+
+static bool data_pending(int fd)
+{
+#ifdef FIONREAD
+	int avail;
+
+	if (ioctl(fd, FIONREAD, &avail) == 0)
+		return avail > 0;
+#else
+	(void)fd;
+#endif
+	return false;
+}
+
+/*
+  The other end of a pipe may never be closed, so a read ahead thread that
+  is stuck in here is cancelled. Nowhere else is it safe to do that.
+ */
+static ssize_t read_cancelable(int fd, void *buffer, size_t size)
+{
+#ifdef WITH_PTHREAD
+	ssize_t ret;
+	int old;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &old);
+	ret = read(fd, buffer, size);
+	pthread_setcancelstate(old, NULL);
+	return ret;
+#else
+	return read(fd, buffer, size);
+#endif
+}
+
+static int file_precache(istream_t *strm)
+{
+	file_istream_t *file = (file_istream_t *)strm;
+	size_t diff;
+	ssize_t ret;
+
+	diff = strm->buffer_used - strm->buffer_offset;
+	memmove(strm->buffer, strm->buffer + strm->buffer_offset, diff);
+	strm->buffer_offset = 0;
+	strm->buffer_used = diff;
+
+	if (file->regular)
+		prefetch(file);
+
+	while (strm->buffer_used < ISTREAM_BUFFER_SIZE) {
+		ret = read_cancelable(file->fd,
+				      strm->buffer + strm->buffer_used,
+				      ISTREAM_BUFFER_SIZE - strm->buffer_used);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(file->path);
+			return -1;
+		}
+
+		if (ret == 0) {
+			strm->eof = true;
+			break;
+		}
+
+		strm->buffer_used += ret;
+		file->position += ret;
+
+		/* don't sit on data while waiting for a pipe to fill up */
+		if (!file->regular && !data_pending(file->fd))
+			break;
+	}
+
+	return 0;
+}
+
+static int file_seek_forward(istream_t *strm, sqfs_u64 size)
+{
+	file_istream_t *file = (file_istream_t *)strm;
+
+	/* a truncated file is reported when reading through it */
+	if (!file->regular || size > file->size - file->position)
+		return 1;
+
+	if (lseek(file->fd, size, SEEK_CUR) < 0)
+		return 1;
+
+	file->position += size;
+	return 0;
+}
+
+static const char *file_get_filename(istream_t *strm)
+{
+	return ((file_istream_t *)strm)->path;
+}
+
+static void file_destroy(istream_t *strm)
+{
+	file_istream_t *file = (file_istream_t *)strm;
+
+	if (file->fd != STDIN_FILENO)
+		close(file->fd);
+
+	free(file->path);
+	free(strm->buffer);
+	free(file);
+}
+
+static istream_t *create(const char *path, int fd)
+{
+	file_istream_t *file = calloc(1, sizeof(*file));
+	istream_t *strm = (istream_t *)file;
+	struct stat sb;
+	off_t pos;
+
+	if (file == NULL)
+		goto fail_errno;
+
+	file->path = strdup(path);
+	strm->buffer = malloc(ISTREAM_BUFFER_SIZE);
+
+	if (file->path == NULL || strm->buffer == NULL)
+		goto fail_free;
+
+	file->fd = fd;
+
+	if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+		pos = lseek(fd, 0, SEEK_CUR);
+
+		if (pos >= 0 && pos <= sb.st_size) {
+			file->regular = true;
+			file->position = pos;
+			file->size = sb.st_size;
+#ifdef HAVE_POSIX_FADVISE
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+		}
+	}
+
+	strm->precache = file_precache;
+	strm->seek_forward = file_seek_forward;
+	strm->get_filename = file_get_filename;
+	strm->destroy = file_destroy;
+
+	/*
+	  Regular files get by with lseek and fadvise. Anything else is read
+	  on a separate thread, so the consumer doesn't wait for the other
+	  end of the pipe while there is data to work on.
+	 */
+	return file->regular ? strm : istream_read_ahead(strm);
+fail_free:
+	free(strm->buffer);
+	free(file->path);
+	free(file);
+fail_errno:
+	perror(path);
+	return NULL;
+}
+
+istream_t *istream_open_file(const char *path)
+{
+	istream_t *strm;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return NULL;
+	}
+
+	strm = create(path, fd);
+	if (strm == NULL)
+		close(fd);
+
+	return strm;
+}
+
+istream_t *istream_open_stdin(void)
+{
+	return create("stdin", STDIN_FILENO);
+}
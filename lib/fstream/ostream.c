@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * ostream.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "internal.h"
+
+#include <stdarg.h>
+
+int ostream_append(ostream_t *strm, const void *data, size_t size)
+{
+	if (size <= OSTREAM_BUFFER_SIZE - strm->buffer_used) {
+		memcpy(strm->buffer + strm->buffer_used, data, size);
+		strm->buffer_used += size;
+		return 0;
+	}
+
+	return strm->write(strm, data, size);
+}
+
+int ostream_append_zero(ostream_t *strm, size_t size)
+{
+	size_t diff;
+
+	while (size > 0) {
+		if (strm->buffer_used == OSTREAM_BUFFER_SIZE &&
+		    strm->write(strm, NULL, 0)) {
+			return -1;
+		}
+
+		diff = OSTREAM_BUFFER_SIZE - strm->buffer_used;
+		if (diff > size)
+			diff = size;
+
+		memset(strm->buffer + strm->buffer_used, 0, diff);
+		strm->buffer_used += diff;
+		size -= diff;
+	}
+
+	return 0;
+}
+
+int ostream_printf(ostream_t *strm, const char *fmt, ...)
+{
+	size_t avail = OSTREAM_BUFFER_SIZE - strm->buffer_used;
+	char *temp;
+	va_list ap;
+	int ret;
+
+	va_start(ap, fmt);
+	ret = vsnprintf((char *)strm->buffer + strm->buffer_used, avail,
+			fmt, ap);
+	va_end(ap);
+
+	if (ret < 0)
+		goto fail_errno;
+
+	/* vsnprintf needs room for the null terminator */
+	if ((size_t)ret < avail) {
+		strm->buffer_used += ret;
+		return 0;
+	}
+
+	temp = malloc((size_t)ret + 1);
+	if (temp == NULL)
+		goto fail_errno;
+
+	va_start(ap, fmt);
+	vsnprintf(temp, (size_t)ret + 1, fmt, ap);
+	va_end(ap);
+
+	ret = ostream_append(strm, temp, ret);
+	free(temp);
+	return ret;
+fail_errno:
+	perror(strm->get_filename(strm));
+	return -1;
+}
+
+int ostream_flush(ostream_t *strm)
+{
+	if (strm->buffer_used > 0 && strm->write(strm, NULL, 0))
+		return -1;
+
+	return strm->flush == NULL ? 0 : strm->flush(strm);
+}
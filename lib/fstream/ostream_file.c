@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * ostream_file.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "internal.h"
+
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+
+typedef struct {
+	ostream_t base;
+	const char *path;
+	int fd;
+} file_ostream_t;
+
+/* the buffer and the data that didn't fit go out in a single writev */
+static int file_write(ostream_t *strm, const void *data, size_t size)
+{
+	file_ostream_t *file = (file_ostream_t *)strm;
+	struct iovec vec[2], *iov = vec;
+	int count = 0;
+	ssize_t ret;
+
+	if (strm->buffer_used > 0) {
+		vec[count].iov_base = strm->buffer;
+		vec[count].iov_len = strm->buffer_used;
+		++count;
+	}
+
+	if (size > 0) {
+		vec[count].iov_base = (void *)data;
+		vec[count].iov_len = size;
+		++count;
+	}
+
+	strm->buffer_used = 0;
+
+	while (count > 0) {
+		ret = writev(file->fd, iov, count);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(file->path);
+			return -1;
+		}
+
+		if (ret == 0) {
+			fprintf(stderr, "%s: write truncated\n", file->path);
+			return -1;
+		}
+
+		/* skip what has been written, a short write can happen */
+		while (count > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			++iov;
+			--count;
+		}
+
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+static const char *file_get_filename(ostream_t *strm)
+{
+	return ((file_ostream_t *)strm)->path;
+}
+
+static void file_destroy(ostream_t *strm)
+{
+	free(strm->buffer);
+	free(strm);
+}
+
+ostream_t *ostream_open_stdout(void)
+{
+	file_ostream_t *file = calloc(1, sizeof(*file));
+	ostream_t *strm = (ostream_t *)file;
+
+	if (file == NULL) {
+		perror("stdout");
+		return NULL;
+	}
+
+	strm->buffer = malloc(OSTREAM_BUFFER_SIZE);
+	if (strm->buffer == NULL) {
+		perror("stdout");
+		free(file);
+		return NULL;
+	}
+
+	file->path = "stdout";
+	file->fd = STDOUT_FILENO;
+
+	strm->write = file_write;
+	strm->get_filename = file_get_filename;
+	strm->destroy = file_destroy;
+	return strm;
+}
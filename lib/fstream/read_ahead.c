@@ -0,0 +1,239 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * read_ahead.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "internal.h"
+
+#ifdef WITH_PTHREAD
+#include <pthread.h>
+
+/* number of buffers filled ahead of the consumer */
+#define READ_AHEAD_CHUNKS (4)
+
+typedef struct chunk_t {
+	struct chunk_t *next;
+	size_t used;
+	size_t offset;
+	sqfs_u8 *data;
+} chunk_t;
+
+/*
+  The wrapped stream is refilled on a separate thread. Its buffer is swapped
+  with a free chunk afterwards and the consumer in turn swaps the chunk with
+  its own buffer, so the data is never copied in between.
+ */
+typedef struct {
+	istream_t base;
+	istream_t *wrapped;
+
+	pthread_t thread;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	bool stop;
+	bool end;
+	bool error;
+
+	chunk_t *ready_first;
+	chunk_t *ready_last;
+	chunk_t *free_chunks;
+	chunk_t chunks[READ_AHEAD_CHUNKS];
+} read_ahead_t;
+
+static void *reader_proc(void *arg)
+{
+	read_ahead_t *ra = arg;
+	istream_t *wrapped = ra->wrapped;
+	chunk_t *chunk;
+	sqfs_u8 *temp;
+	int ret;
+
+	/* only reading from a file descriptor enables it temporarily */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	pthread_mutex_lock(&ra->mtx);
+	while (!ra->stop) {
+		if (ra->free_chunks == NULL) {
+			pthread_cond_wait(&ra->cond, &ra->mtx);
+			continue;
+		}
+
+		chunk = ra->free_chunks;
+		ra->free_chunks = chunk->next;
+		pthread_mutex_unlock(&ra->mtx);
+
+		ret = istream_precache(wrapped);
+
+		temp = chunk->data;
+		chunk->data = wrapped->buffer;
+		chunk->used = wrapped->buffer_used;
+		chunk->offset = wrapped->buffer_offset;
+		chunk->next = NULL;
+
+		wrapped->buffer = temp;
+		wrapped->buffer_used = 0;
+		wrapped->buffer_offset = 0;
+
+		pthread_mutex_lock(&ra->mtx);
+		if (chunk->offset < chunk->used) {
+			if (ra->ready_last == NULL) {
+				ra->ready_first = chunk;
+			} else {
+				ra->ready_last->next = chunk;
+			}
+			ra->ready_last = chunk;
+		} else {
+			chunk->next = ra->free_chunks;
+			ra->free_chunks = chunk;
+		}
+
+		ra->error = (ret != 0);
+		ra->end = wrapped->eof;
+		pthread_cond_broadcast(&ra->cond);
+
+		if (ra->error || ra->end)
+			break;
+	}
+	pthread_mutex_unlock(&ra->mtx);
+	return NULL;
+}
+
+static int ra_precache(istream_t *strm)
+{
+	read_ahead_t *ra = (read_ahead_t *)strm;
+	size_t diff, count;
+	chunk_t *chunk;
+	sqfs_u8 *temp;
+
+	pthread_mutex_lock(&ra->mtx);
+	while (ra->ready_first == NULL && !ra->end && !ra->error)
+		pthread_cond_wait(&ra->cond, &ra->mtx);
+
+	chunk = ra->ready_first;
+
+	if (chunk == NULL) {
+		pthread_mutex_unlock(&ra->mtx);
+
+		/* the wrapped stream already reported the error */
+		if (ra->error)
+			return -1;
+
+		strm->eof = true;
+		return 0;
+	}
+
+	diff = strm->buffer_used - strm->buffer_offset;
+
+	if (diff == 0) {
+		temp = strm->buffer;
+		strm->buffer = chunk->data;
+		strm->buffer_used = chunk->used;
+		strm->buffer_offset = chunk->offset;
+		chunk->data = temp;
+		chunk->offset = chunk->used;
+	} else {
+		memmove(strm->buffer, strm->buffer + strm->buffer_offset, diff);
+
+		count = chunk->used - chunk->offset;
+		if (count > ISTREAM_BUFFER_SIZE - diff)
+			count = ISTREAM_BUFFER_SIZE - diff;
+
+		memcpy(strm->buffer + diff, chunk->data + chunk->offset, count);
+		chunk->offset += count;
+		strm->buffer_used = diff + count;
+		strm->buffer_offset = 0;
+	}
+
+	if (chunk->offset == chunk->used) {
+		ra->ready_first = chunk->next;
+		if (ra->ready_first == NULL)
+			ra->ready_last = NULL;
+
+		chunk->next = ra->free_chunks;
+		ra->free_chunks = chunk;
+		pthread_cond_broadcast(&ra->cond);
+	}
+	pthread_mutex_unlock(&ra->mtx);
+	return 0;
+}
+
+static const char *ra_get_filename(istream_t *strm)
+{
+	istream_t *wrapped = ((read_ahead_t *)strm)->wrapped;
+
+	return wrapped->get_filename(wrapped);
+}
+
+static void ra_destroy(istream_t *strm)
+{
+	read_ahead_t *ra = (read_ahead_t *)strm;
+	size_t i;
+
+	pthread_mutex_lock(&ra->mtx);
+	ra->stop = true;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->mtx);
+
+	pthread_cancel(ra->thread);
+	pthread_join(ra->thread, NULL);
+
+	for (i = 0; i < READ_AHEAD_CHUNKS; ++i)
+		free(ra->chunks[i].data);
+
+	pthread_cond_destroy(&ra->cond);
+	pthread_mutex_destroy(&ra->mtx);
+
+	ra->wrapped->destroy(ra->wrapped);
+	free(strm->buffer);
+	free(ra);
+}
+
+istream_t *istream_read_ahead(istream_t *strm)
+{
+	read_ahead_t *ra = calloc(1, sizeof(*ra));
+	size_t i;
+
+	if (ra == NULL)
+		return strm;
+
+	ra->base.buffer = malloc(ISTREAM_BUFFER_SIZE);
+	if (ra->base.buffer == NULL)
+		goto fail;
+
+	for (i = 0; i < READ_AHEAD_CHUNKS; ++i) {
+		ra->chunks[i].data = malloc(ISTREAM_BUFFER_SIZE);
+		if (ra->chunks[i].data == NULL)
+			goto fail;
+
+		ra->chunks[i].next = ra->free_chunks;
+		ra->free_chunks = ra->chunks + i;
+	}
+
+	ra->mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	ra->cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+	ra->wrapped = strm;
+
+	ra->base.precache = ra_precache;
+	ra->base.get_filename = ra_get_filename;
+	ra->base.destroy = ra_destroy;
+
+	if (pthread_create(&ra->thread, NULL, reader_proc, ra) != 0)
+		goto fail;
+
+	return (istream_t *)ra;
+fail:
+	/* reading on the calling thread still works */
+	for (i = 0; i < READ_AHEAD_CHUNKS; ++i)
+		free(ra->chunks[i].data);
+
+	free(ra->base.buffer);
+	free(ra);
+	return strm;
+}
+#else
+istream_t *istream_read_ahead(istream_t *strm)
+{
+	return strm;
+}
+#endif
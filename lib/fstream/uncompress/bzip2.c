@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * bzip2.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "../internal.h"
+
+#include <bzlib.h>
+
+typedef struct {
+	istream_comp_t base;
+
+	bz_stream strm;
+	bool initialized;
+	bool in_stream;
+} istream_bzip2_t;
+
+static int bzip2_uncompress(istream_comp_t *base, const sqfs_u8 *in,
+			    size_t *in_size, sqfs_u8 *out, size_t *out_size)
+{
+	istream_bzip2_t *bzip2 = (istream_bzip2_t *)base;
+	size_t avail_in = *in_size, avail_out = *out_size;
+	int ret;
+
+	*in_size = 0;
+	*out_size = 0;
+
+	if (!bzip2->in_stream) {
+		/* like bzip2, ignore trailing garbage after the last stream */
+		if (avail_in == 0 || in[0] != 'B')
+			return 1;
+
+		/* parallel bzip2 writes multiple streams one after another */
+		if (!bzip2->initialized) {
+			memset(&bzip2->strm, 0, sizeof(bzip2->strm));
+
+			if (BZ2_bzDecompressInit(&bzip2->strm, 0, 0) != BZ_OK)
+				goto fail;
+
+			bzip2->initialized = true;
+		}
+	}
+
+	bzip2->strm.next_in = (char *)in;
+	bzip2->strm.avail_in = avail_in;
+	bzip2->strm.next_out = (char *)out;
+	bzip2->strm.avail_out = avail_out;
+	bzip2->in_stream = true;
+
+	ret = BZ2_bzDecompress(&bzip2->strm);
+
+	*in_size = avail_in - bzip2->strm.avail_in;
+	*out_size = avail_out - bzip2->strm.avail_out;
+
+	if (ret == BZ_STREAM_END) {
+		BZ2_bzDecompressEnd(&bzip2->strm);
+		bzip2->initialized = false;
+		bzip2->in_stream = false;
+		return 0;
+	}
+
+	if (ret != BZ_OK)
+		goto fail;
+
+	if (avail_in == 0 && *out_size == 0) {
+		fprintf(stderr, "%s: truncated bzip2 stream\n",
+			base->wrapped->get_filename(base->wrapped));
+		return -1;
+	}
+
+	return 0;
+fail:
+	fprintf(stderr, "%s: bzip2 decompression failed\n",
+		base->wrapped->get_filename(base->wrapped));
+	return -1;
+}
+
+static void bzip2_cleanup(istream_comp_t *base)
+{
+	istream_bzip2_t *bzip2 = (istream_bzip2_t *)base;
+
+	if (bzip2->initialized)
+		BZ2_bzDecompressEnd(&bzip2->strm);
+}
+
+istream_comp_t *istream_bzip2_create(const char *filename)
+{
+	istream_bzip2_t *bzip2 = calloc(1, sizeof(*bzip2));
+	istream_comp_t *base = (istream_comp_t *)bzip2;
+
+	if (bzip2 == NULL) {
+		perror(filename);
+		return NULL;
+	}
+
+	base->uncompress = bzip2_uncompress;
+	base->cleanup = bzip2_cleanup;
+	return base;
+}
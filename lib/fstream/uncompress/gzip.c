@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * gzip.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "../internal.h"
+
+#include <zlib.h>
+
+typedef struct {
+	istream_comp_t base;
+
+	z_stream strm;
+	bool in_member;
+} istream_gzip_t;
+
+static int gzip_uncompress(istream_comp_t *base, const sqfs_u8 *in,
+			   size_t *in_size, sqfs_u8 *out, size_t *out_size)
+{
+	istream_gzip_t *gzip = (istream_gzip_t *)base;
+	size_t avail_in = *in_size, avail_out = *out_size;
+	int ret;
+
+	*in_size = 0;
+	*out_size = 0;
+
+	if (!gzip->in_member) {
+		if (avail_in == 0)
+			return 1;
+
+		/* like gzip, ignore trailing garbage after the last member */
+		if (in[0] != 0x1F)
+			return 1;
+	}
+
+	gzip->strm.next_in = (Bytef *)in;
+	gzip->strm.avail_in = avail_in;
+	gzip->strm.next_out = out;
+	gzip->strm.avail_out = avail_out;
+	gzip->in_member = true;
+
+	ret = inflate(&gzip->strm, Z_NO_FLUSH);
+
+	*in_size = avail_in - gzip->strm.avail_in;
+	*out_size = avail_out - gzip->strm.avail_out;
+
+	switch (ret) {
+	case Z_STREAM_END:
+		/* there may be another member after this one */
+		if (inflateReset(&gzip->strm) != Z_OK)
+			goto fail;
+		gzip->in_member = false;
+		return 0;
+	case Z_BUF_ERROR:
+		if (avail_in == 0 && *out_size == 0) {
+			fprintf(stderr, "%s: truncated gzip stream\n",
+				base->wrapped->get_filename(base->wrapped));
+			return -1;
+		}
+		return 0;
+	case Z_OK:
+		return 0;
+	default:
+		break;
+	}
+fail:
+	fprintf(stderr, "%s: gzip decompression failed: %s\n",
+		base->wrapped->get_filename(base->wrapped),
+		gzip->strm.msg == NULL ? "internal error" : gzip->strm.msg);
+	return -1;
+}
+
+static void gzip_cleanup(istream_comp_t *base)
+{
+	istream_gzip_t *gzip = (istream_gzip_t *)base;
+
+	inflateEnd(&gzip->strm);
+}
+
+istream_comp_t *istream_gzip_create(const char *filename)
+{
+	istream_gzip_t *gzip = calloc(1, sizeof(*gzip));
+	istream_comp_t *base = (istream_comp_t *)gzip;
+
+	if (gzip == NULL) {
+		perror(filename);
+		return NULL;
+	}
+
+	/* 16 + window bits only accepts the gzip wrapper */
+	if (inflateInit2(&gzip->strm, 16 + 15) != Z_OK) {
+		fprintf(stderr, "%s: initializing the gzip decompressor "
+			"failed\n", filename);
+		free(gzip);
+		return NULL;
+	}
+
+	base->uncompress = gzip_uncompress;
+	base->cleanup = gzip_cleanup;
+	return base;
+}
@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * xz.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "../internal.h"
+
+#include <lzma.h>
+
+/* the multi threaded decoder is considered stable since 5.4.0 */
+#if LZMA_VERSION >= 50040002
+#define XZ_DECODER_MT
+#endif
+
+typedef struct {
+	istream_comp_t base;
+
+	lzma_stream strm;
+} istream_xz_t;
+
+static int xz_uncompress(istream_comp_t *base, const sqfs_u8 *in,
+			 size_t *in_size, sqfs_u8 *out, size_t *out_size)
+{
+	istream_xz_t *xz = (istream_xz_t *)base;
+	size_t avail_in = *in_size, avail_out = *out_size;
+	lzma_ret ret;
+
+	xz->strm.next_in = in;
+	xz->strm.avail_in = avail_in;
+	xz->strm.next_out = out;
+	xz->strm.avail_out = avail_out;
+
+	/* further streams may follow, until the input ends */
+	ret = lzma_code(&xz->strm, avail_in == 0 ? LZMA_FINISH : LZMA_RUN);
+
+	*in_size = avail_in - xz->strm.avail_in;
+	*out_size = avail_out - xz->strm.avail_out;
+
+	if (ret == LZMA_STREAM_END)
+		return 1;
+
+	if (ret == LZMA_OK)
+		return 0;
+
+	fprintf(stderr, "%s: xz decompression failed (%s)\n",
+		base->wrapped->get_filename(base->wrapped),
+		ret == LZMA_BUF_ERROR ? "truncated stream" :
+		(ret == LZMA_MEM_ERROR ? "out of memory" : "corrupted data"));
+	return -1;
+}
+
+static void xz_cleanup(istream_comp_t *base)
+{
+	lzma_end(&((istream_xz_t *)base)->strm);
+}
+
+istream_comp_t *istream_xz_create(const char *filename)
+{
+	istream_xz_t *xz = calloc(1, sizeof(*xz));
+	istream_comp_t *base = (istream_comp_t *)xz;
+	lzma_stream strm = LZMA_STREAM_INIT;
+#ifdef XZ_DECODER_MT
+	lzma_mt mt;
+#endif
+	lzma_ret ret;
+
+	if (xz == NULL) {
+		perror(filename);
+		return NULL;
+	}
+
+	xz->strm = strm;
+
+#ifdef XZ_DECODER_MT
+	/*
+	  Only files with multiple blocks and sizes in the block headers,
+	  i.e. the ones created by a multi threaded encoder, are decoded in
+	  parallel, anything else is decoded on a single thread.
+	 */
+	memset(&mt, 0, sizeof(mt));
+	mt.flags = LZMA_CONCATENATED;
+	mt.threads = lzma_cputhreads();
+	mt.memlimit_threading = lzma_physmem() / 4;
+	mt.memlimit_stop = UINT64_MAX;
+
+	if (mt.threads == 0)
+		mt.threads = 1;
+
+	ret = lzma_stream_decoder_mt(&xz->strm, &mt);
+#else
+	ret = lzma_stream_decoder(&xz->strm, UINT64_MAX, LZMA_CONCATENATED);
+#endif
+	if (ret != LZMA_OK) {
+		fprintf(stderr, "%s: initializing the xz decompressor "
+			"failed\n", filename);
+		free(xz);
+		return NULL;
+	}
+
+	base->uncompress = xz_uncompress;
+	base->cleanup = xz_cleanup;
+	return base;
+}
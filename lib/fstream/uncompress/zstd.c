@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * zstd.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "../internal.h"
+
+#include <zstd.h>
+
+typedef struct {
+	istream_comp_t base;
+
+	ZSTD_DStream *strm;
+	bool in_frame;
+} istream_zstd_t;
+
+/* ZSTD_decompressStream moves on to the next frame by itself */
+static int zstd_uncompress(istream_comp_t *base, const sqfs_u8 *in,
+			   size_t *in_size, sqfs_u8 *out, size_t *out_size)
+{
+	istream_zstd_t *zstd = (istream_zstd_t *)base;
+	ZSTD_outBuffer outbuf;
+	ZSTD_inBuffer inbuf;
+	size_t ret;
+
+	if (*in_size == 0 && !zstd->in_frame) {
+		*out_size = 0;
+		return 1;
+	}
+
+	inbuf.src = in;
+	inbuf.size = *in_size;
+	inbuf.pos = 0;
+
+	outbuf.dst = out;
+	outbuf.size = *out_size;
+	outbuf.pos = 0;
+
+	ret = ZSTD_decompressStream(zstd->strm, &outbuf, &inbuf);
+
+	*in_size = inbuf.pos;
+	*out_size = outbuf.pos;
+
+	if (ZSTD_isError(ret)) {
+		fprintf(stderr, "%s: zstd decompression failed: %s\n",
+			base->wrapped->get_filename(base->wrapped),
+			ZSTD_getErrorName(ret));
+		return -1;
+	}
+
+	/* 0 means a frame has been completely decoded and flushed */
+	zstd->in_frame = (ret != 0);
+
+	if (inbuf.size == 0 && outbuf.pos == 0 && zstd->in_frame) {
+		fprintf(stderr, "%s: truncated zstd stream\n",
+			base->wrapped->get_filename(base->wrapped));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void zstd_cleanup(istream_comp_t *base)
+{
+	ZSTD_freeDStream(((istream_zstd_t *)base)->strm);
+}
+
+istream_comp_t *istream_zstd_create(const char *filename)
+{
+	istream_zstd_t *zstd = calloc(1, sizeof(*zstd));
+	istream_comp_t *base = (istream_comp_t *)zstd;
+
+	if (zstd == NULL) {
+		perror(filename);
+		return NULL;
+	}
+
+	zstd->strm = ZSTD_createDStream();
+	if (zstd->strm == NULL ||
+	    ZSTD_isError(ZSTD_initDStream(zstd->strm))) {
+		fprintf(stderr, "%s: initializing the zstd decompressor "
+			"failed\n", filename);
+		ZSTD_freeDStream(zstd->strm);
+		free(zstd);
+		return NULL;
+	}
+
+	base->uncompress = zstd_uncompress;
+	base->cleanup = zstd_cleanup;
+	return base;
+}
@@ -0,0 +1,244 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * write_behind.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "internal.h"
+
+#ifdef WITH_PTHREAD
+#include <pthread.h>
+
+/* number of buffers queued up for the writer thread */
+#define WRITE_BEHIND_CHUNKS (4)
+
+typedef struct chunk_t {
+	struct chunk_t *next;
+	size_t used;
+	sqfs_u8 *data;
+} chunk_t;
+
+/*
+  The buffer of the stream is swapped with a free chunk once it is full and
+  the chunk is appended to the wrapped stream on a separate thread. Data
+  that doesn't fit into the buffer has to be copied, since it is only valid
+  until the write call returns.
+ */
+typedef struct {
+	ostream_t base;
+	ostream_t *wrapped;
+
+	pthread_t thread;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	bool stop;
+	bool busy;
+	bool error;
+
+	chunk_t *ready_first;
+	chunk_t *ready_last;
+	chunk_t *free_chunks;
+	chunk_t chunks[WRITE_BEHIND_CHUNKS];
+} write_behind_t;
+
+static void *writer_proc(void *arg)
+{
+	write_behind_t *wb = arg;
+	chunk_t *chunk;
+	int ret = 0;
+
+	pthread_mutex_lock(&wb->mtx);
+	for (;;) {
+		while (wb->ready_first == NULL && !wb->stop)
+			pthread_cond_wait(&wb->cond, &wb->mtx);
+
+		chunk = wb->ready_first;
+		if (chunk == NULL)
+			break;
+
+		wb->ready_first = chunk->next;
+		if (wb->ready_first == NULL)
+			wb->ready_last = NULL;
+
+		wb->busy = true;
+		pthread_mutex_unlock(&wb->mtx);
+
+		/*
+		  The chunks are large, so they are handed over directly
+		  instead of copying them into the buffer. After an error,
+		  the data is only thrown away.
+		 */
+		if (ret == 0)
+			ret = wb->wrapped->write(wb->wrapped, chunk->data,
+						 chunk->used);
+
+		pthread_mutex_lock(&wb->mtx);
+		chunk->next = wb->free_chunks;
+		wb->free_chunks = chunk;
+		wb->busy = false;
+		wb->error = (ret != 0);
+		pthread_cond_broadcast(&wb->cond);
+	}
+	pthread_mutex_unlock(&wb->mtx);
+	return NULL;
+}
+
+static int submit(write_behind_t *wb)
+{
+	chunk_t *chunk;
+	sqfs_u8 *temp;
+
+	pthread_mutex_lock(&wb->mtx);
+	while (wb->free_chunks == NULL && !wb->error)
+		pthread_cond_wait(&wb->cond, &wb->mtx);
+
+	/* the wrapped stream already reported the error */
+	if (wb->error) {
+		pthread_mutex_unlock(&wb->mtx);
+		return -1;
+	}
+
+	chunk = wb->free_chunks;
+	wb->free_chunks = chunk->next;
+
+	temp = chunk->data;
+	chunk->data = wb->base.buffer;
+	chunk->used = wb->base.buffer_used;
+	chunk->next = NULL;
+
+	wb->base.buffer = temp;
+	wb->base.buffer_used = 0;
+
+	if (wb->ready_last == NULL) {
+		wb->ready_first = chunk;
+	} else {
+		wb->ready_last->next = chunk;
+	}
+
+	wb->ready_last = chunk;
+	pthread_cond_broadcast(&wb->cond);
+	pthread_mutex_unlock(&wb->mtx);
+	return 0;
+}
+
+static int wb_write(ostream_t *strm, const void *data, size_t size)
+{
+	write_behind_t *wb = (write_behind_t *)strm;
+	size_t diff;
+
+	if (strm->buffer_used > 0 && submit(wb))
+		return -1;
+
+	while (size > 0) {
+		diff = size < OSTREAM_BUFFER_SIZE ? size : OSTREAM_BUFFER_SIZE;
+
+		memcpy(strm->buffer, data, diff);
+		strm->buffer_used = diff;
+
+		if (submit(wb))
+			return -1;
+
+		data = (const char *)data + diff;
+		size -= diff;
+	}
+
+	return 0;
+}
+
+static int wb_flush(ostream_t *strm)
+{
+	write_behind_t *wb = (write_behind_t *)strm;
+	bool error;
+
+	pthread_mutex_lock(&wb->mtx);
+	while ((wb->ready_first != NULL || wb->busy) && !wb->error)
+		pthread_cond_wait(&wb->cond, &wb->mtx);
+	error = wb->error;
+	pthread_mutex_unlock(&wb->mtx);
+
+	if (error)
+		return -1;
+
+	/* the writer thread is idle now */
+	return ostream_flush(wb->wrapped);
+}
+
+static const char *wb_get_filename(ostream_t *strm)
+{
+	ostream_t *wrapped = ((write_behind_t *)strm)->wrapped;
+
+	return wrapped->get_filename(wrapped);
+}
+
+static void wb_destroy(ostream_t *strm)
+{
+	write_behind_t *wb = (write_behind_t *)strm;
+	size_t i;
+
+	pthread_mutex_lock(&wb->mtx);
+	wb->stop = true;
+	pthread_cond_broadcast(&wb->cond);
+	pthread_mutex_unlock(&wb->mtx);
+
+	pthread_join(wb->thread, NULL);
+
+	for (i = 0; i < WRITE_BEHIND_CHUNKS; ++i)
+		free(wb->chunks[i].data);
+
+	pthread_cond_destroy(&wb->cond);
+	pthread_mutex_destroy(&wb->mtx);
+
+	wb->wrapped->destroy(wb->wrapped);
+	free(strm->buffer);
+	free(wb);
+}
+
+ostream_t *ostream_write_behind(ostream_t *strm)
+{
+	write_behind_t *wb = calloc(1, sizeof(*wb));
+	size_t i;
+
+	if (wb == NULL)
+		return strm;
+
+	wb->base.buffer = malloc(OSTREAM_BUFFER_SIZE);
+	if (wb->base.buffer == NULL)
+		goto fail;
+
+	for (i = 0; i < WRITE_BEHIND_CHUNKS; ++i) {
+		wb->chunks[i].data = malloc(OSTREAM_BUFFER_SIZE);
+		if (wb->chunks[i].data == NULL)
+			goto fail;
+
+		wb->chunks[i].next = wb->free_chunks;
+		wb->free_chunks = wb->chunks + i;
+	}
+
+	wb->mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	wb->cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+	wb->wrapped = strm;
+
+	wb->base.write = wb_write;
+	wb->base.flush = wb_flush;
+	wb->base.get_filename = wb_get_filename;
+	wb->base.destroy = wb_destroy;
+
+	if (pthread_create(&wb->thread, NULL, writer_proc, wb) != 0)
+		goto fail;
+
+	return (ostream_t *)wb;
+fail:
+	/* writing on the calling thread still works */
+	for (i = 0; i < WRITE_BEHIND_CHUNKS; ++i)
+		free(wb->chunks[i].data);
+
+	free(wb->base.buffer);
+	free(wb);
+	return strm;
+}
+#else
+ostream_t *ostream_write_behind(ostream_t *strm)
+{
+	return strm;
+}
+#endif
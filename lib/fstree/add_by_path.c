@@ -4,28 +4,12 @@
  *
  * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
  */
-#include "config.h"
-
-#include "fstree.h"
+#include "internal.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
-static tree_node_t *child_by_name(tree_node_t *root, const char *name,
-				  size_t len)
-{
-	tree_node_t *n = root->data.dir.children;
-
-	while (n != NULL) {
-		if (strncmp(n->name, name, len) == 0 && n->name[len] == '\0')
-			break;
-
-		n = n->next;
-	}
-
-	return n;
-}
-
 static tree_node_t *get_parent_node(fstree_t *fs, tree_node_t *root,
 				    const char *path)
 {
@@ -42,10 +26,10 @@ static tree_node_t *get_parent_node(fstree_t *fs, tree_node_t *root,
 		if (end == NULL)
 			break;
 
-		n = child_by_name(root, path, end - path);
+		n = fstree_find_child(fs, root, path, end - path);
 
 		if (n == NULL) {
-			n = fstree_mknode(root, path, end - path, NULL,
+			n = fstree_mknode(fs, root, path, end - path, NULL,
 					  &fs->defaults);
 			if (n == NULL)
 				return NULL;
@@ -60,20 +44,71 @@ static tree_node_t *get_parent_node(fstree_t *fs, tree_node_t *root,
 	return root;
 }
 
+/*
+  Entries of a sorted input usually share the parent with the one before.
+  If the cache cannot be updated, the path is simply resolved next time.
+ */
+static tree_node_t *get_parent_cached(fstree_t *fs, const char *path,
+				      size_t len)
+{
+	tree_node_t *parent;
+	char *new;
+
+	if (fs->last_parent != NULL && fs->last_dir_len == len &&
+	    memcmp(fs->last_dir, path, len) == 0) {
+		return fs->last_parent;
+	}
+
+	parent = get_parent_node(fs, fs->root, path);
+	if (parent == NULL)
+		return NULL;
+
+	if (len >= fs->last_dir_max) {
+		new = realloc(fs->last_dir, len + 1);
+		if (new == NULL) {
+			fs->last_parent = NULL;
+			return parent;
+		}
+
+		fs->last_dir = new;
+		fs->last_dir_max = len + 1;
+	}
+
+	memcpy(fs->last_dir, path, len);
+	fs->last_dir_len = len;
+	fs->last_parent = parent;
+	return parent;
+}
+
 tree_node_t *fstree_add_generic(fstree_t *fs, const char *path,
 				const struct stat *sb, const char *extra)
 {
 	tree_node_t *child, *parent;
 	const char *name;
 
-	parent = get_parent_node(fs, fs->root, path);
+	name = strrchr(path, '/');
+
+	if (name == NULL) {
+		parent = get_parent_node(fs, fs->root, path);
+		name = path;
+	} else {
+		parent = get_parent_cached(fs, path, name - path);
+		name += 1;
+	}
+
 	if (parent == NULL)
 		return NULL;
 
-	name = strrchr(path, '/');
-	name = (name == NULL ? path : (name + 1));
+	/* in sorted input, a name past the last one added is always new */
+	child = parent->data.dir.children;
+
+	if (child != NULL && (parent->data.dir.out_of_order ||
+			      strcmp(name, child->name) <= 0)) {
+		child = fstree_find_child(fs, parent, name, strlen(name));
+	} else {
+		child = NULL;
+	}
 
-	child = child_by_name(parent, name, strlen(name));
 	if (child != NULL) {
 		if (!S_ISDIR(child->mode) || !S_ISDIR(sb->st_mode) ||
 		    !child->data.dir.created_implicitly) {
@@ -89,5 +124,32 @@ tree_node_t *fstree_add_generic(fstree_t *fs, const char *path,
 		return child;
 	}
 
-	return fstree_mknode(parent, name, strlen(name), extra, sb);
+	return fstree_mknode(fs, parent, name, strlen(name), extra, sb);
+}
+
+tree_node_t *fstree_get_node_by_path(fstree_t *fs, const char *path)
+{
+	tree_node_t *n = fs->root;
+	const char *end;
+	size_t len;
+
+	for (;;) {
+		while (*path == '/')
+			++path;
+
+		if (*path == '\0')
+			return n;
+
+		if (!S_ISDIR(n->mode))
+			return NULL;
+
+		end = strchr(path, '/');
+		len = end == NULL ? strlen(path) : (size_t)(end - path);
+
+		n = fstree_find_child(fs, n, path, len);
+		if (n == NULL)
+			return NULL;
+
+		path += len;
+	}
 }
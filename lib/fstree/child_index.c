@@ -0,0 +1,181 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * child_index.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "internal.h"
+#include "util/util.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+  A single open addressing table for the whole tree, keyed by the parent
+  node and the name. The linked list of children stays the authoritative
+  order of a directory, the index only speeds up looking names up in it.
+ */
+static size_t child_hash(const tree_node_t *dir, const char *name, size_t len)
+{
+	sqfs_u64 hash = 0xCBF29CE484222325ULL;
+	size_t i;
+
+	hash ^= (sqfs_u64)(uintptr_t)dir * 0x9E3779B97F4A7C15ULL;
+
+	for (i = 0; i < len; ++i) {
+		hash ^= (unsigned char)name[i];
+		hash *= 0x100000001B3ULL;
+	}
+
+	return (size_t)(hash ^ (hash >> 32));
+}
+
+static void insert(tree_node_t **table, size_t size, tree_node_t *n)
+{
+	size_t i = child_hash(n->parent, n->name, n->name_len);
+
+	for (i &= size - 1; table[i] != NULL; i = (i + 1) & (size - 1))
+		;
+
+	table[i] = n;
+}
+
+/* keep the table at most half full */
+static int reserve(fstree_t *fs, size_t count)
+{
+	size_t i, size = fs->child_index_size;
+	tree_node_t **table;
+
+	if (fs->child_index_used + count <= size / 2)
+		return 0;
+
+	if (size == 0)
+		size = 1024;
+
+	while (fs->child_index_used + count > size / 2)
+		size *= 2;
+
+	table = alloc_array(sizeof(table[0]), size);
+	if (table == NULL)
+		return -1;
+
+	memset(table, 0, sizeof(table[0]) * size);
+
+	for (i = 0; i < fs->child_index_size; ++i) {
+		if (fs->child_index[i] != NULL)
+			insert(table, size, fs->child_index[i]);
+	}
+
+	free(fs->child_index);
+	fs->child_index = table;
+	fs->child_index_size = size;
+	return 0;
+}
+
+static void index_directory(fstree_t *fs, tree_node_t *dir, size_t count)
+{
+	tree_node_t *n;
+
+	/* on failure, the directory simply keeps being searched linearly */
+	if (reserve(fs, count))
+		return;
+
+	for (n = dir->data.dir.children; n != NULL; n = n->next)
+		insert(fs->child_index, fs->child_index_size, n);
+
+	fs->child_index_used += count;
+	dir->data.dir.indexed = true;
+}
+
+tree_node_t *fstree_find_child(fstree_t *fs, tree_node_t *dir,
+			       const char *name, size_t len)
+{
+	size_t i, mask, count = 0;
+	tree_node_t *n;
+
+	if (dir->data.dir.indexed) {
+		mask = fs->child_index_size - 1;
+		i = child_hash(dir, name, len) & mask;
+
+		for (; fs->child_index[i] != NULL; i = (i + 1) & mask) {
+			n = fs->child_index[i];
+
+			if (n->parent == dir && n->name_len == len &&
+			    memcmp(n->name, name, len) == 0) {
+				return n;
+			}
+		}
+
+		return NULL;
+	}
+
+	for (n = dir->data.dir.children; n != NULL; n = n->next) {
+		if (n->name_len == len && memcmp(n->name, name, len) == 0)
+			return n;
+
+		++count;
+	}
+
+	if (count > CHILD_INDEX_THRESHOLD)
+		index_directory(fs, dir, count);
+
+	return NULL;
+}
+
+int fstree_index_child(fstree_t *fs, tree_node_t *n)
+{
+	if (n->parent == NULL || !n->parent->data.dir.indexed)
+		return 0;
+
+	if (reserve(fs, 1)) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	insert(fs->child_index, fs->child_index_size, n);
+	fs->child_index_used += 1;
+	return 0;
+}
+
+void fstree_unindex_child(fstree_t *fs, tree_node_t *n)
+{
+	size_t i, j, k, mask;
+
+	if (n->parent == NULL || !n->parent->data.dir.indexed)
+		return;
+
+	mask = fs->child_index_size - 1;
+	i = child_hash(n->parent, n->name, n->name_len) & mask;
+
+	for (; fs->child_index[i] != n; i = (i + 1) & mask) {
+		if (fs->child_index[i] == NULL)
+			return;
+	}
+
+	/* move entries back into the gap, unless their home is past it */
+	fs->child_index[i] = NULL;
+	fs->child_index_used -= 1;
+
+	for (j = (i + 1) & mask; fs->child_index[j] != NULL;
+	     j = (j + 1) & mask) {
+		n = fs->child_index[j];
+		k = child_hash(n->parent, n->name, n->name_len) & mask;
+
+		if (((j - k) & mask) < ((j - i) & mask))
+			continue;
+
+		fs->child_index[i] = n;
+		fs->child_index[j] = NULL;
+		i = j;
+	}
+}
+
+void fstree_index_cleanup(fstree_t *fs)
+{
+	free(fs->child_index);
+	fs->child_index = NULL;
+	fs->child_index_size = 0;
+	fs->child_index_used = 0;
+}
@@ -0,0 +1,184 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * file_priority.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "internal.h"
+#include "util/util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+static tree_node_t *node_by_path(fstree_t *fs, const char *path)
+{
+	tree_node_t *n = fs->root;
+	const char *end;
+
+	while (n != NULL && *path != '\0') {
+		if (!S_ISDIR(n->mode))
+			return NULL;
+
+		end = strchr(path, '/');
+		if (end == NULL)
+			end = path + strlen(path);
+
+		n = fstree_find_child(fs, n, path, end - path);
+		path = (*end == '/') ? (end + 1) : end;
+	}
+
+	return n;
+}
+
+static int add_priority(fstree_t *fs, char *line, file_info_t ***list,
+			size_t *count, size_t *max)
+{
+	file_info_t **new;
+	tree_node_t *n;
+	size_t new_sz;
+
+	if (canonicalize_name(line))
+		return 0;
+
+	n = node_by_path(fs, line);
+
+	/* user_ptr marks files that already are in the list */
+	if (n == NULL || !S_ISREG(n->mode) || n->data.file.user_ptr != NULL)
+		return 0;
+
+	if (*count == *max) {
+		new_sz = *max ? *max * 2 : 64;
+		new = realloc(*list, sizeof((*list)[0]) * new_sz);
+		if (new == NULL)
+			return -1;
+
+		*list = new;
+		*max = new_sz;
+	}
+
+	n->data.file.user_ptr = &n->data.file;
+	(*list)[(*count)++] = &n->data.file;
+	return 0;
+}
+
+static void reorder_files(fstree_t *fs, file_info_t **list, size_t count)
+{
+	file_info_t *fi, *next, *rest = NULL, *last = NULL;
+	size_t i;
+
+	for (fi = fs->files; fi != NULL; fi = next) {
+		next = fi->next;
+
+		if (fi->user_ptr != NULL) {
+			fi->user_ptr = NULL;
+			continue;
+		}
+
+		fi->next = NULL;
+		if (last == NULL) {
+			rest = fi;
+		} else {
+			last->next = fi;
+		}
+		last = fi;
+	}
+
+	for (i = 0; i < count; ++i)
+		list[i]->next = (i + 1) < count ? list[i + 1] : rest;
+
+	if (count > 0)
+		fs->files = list[0];
+}
+
+int fstree_prioritize_files(fstree_t *fs, const char *filename, FILE *fp)
+{
+	size_t i, n = 0, count = 0, max = 0;
+	file_info_t **list = NULL;
+	char *line = NULL;
+	ssize_t ret;
+
+	for (;;) {
+		errno = 0;
+		ret = getline(&line, &n, fp);
+
+		if (ret < 0) {
+			if (errno == 0)
+				break;
+
+			perror(filename);
+			goto fail;
+		}
+
+		while (ret > 0 && isspace(line[ret - 1]))
+			line[--ret] = '\0';
+
+		for (i = 0; isspace(line[i]); ++i)
+			;
+
+		if (line[i] == '\0' || line[i] == '#')
+			continue;
+
+		if (add_priority(fs, line + i, &list, &count, &max)) {
+			perror(filename);
+			goto fail;
+		}
+	}
+
+	reorder_files(fs, list, count);
+	free(line);
+	free(list);
+	return 0;
+fail:
+	for (i = 0; i < count; ++i)
+		list[i]->user_ptr = NULL;
+	free(line);
+	free(list);
+	return -1;
+}
+
+/* merge sort on the linked list, taking from the left on equal priority */
+static file_info_t *merge_sort_files(file_info_t *list, size_t count)
+{
+	file_info_t *left = list, *right, *out = NULL, **tail = &out;
+	size_t i, half = count / 2;
+
+	if (count < 2)
+		return list;
+
+	for (i = 1; i < half; ++i)
+		list = list->next;
+
+	right = list->next;
+	list->next = NULL;
+
+	left = merge_sort_files(left, half);
+	right = merge_sort_files(right, count - half);
+
+	while (left != NULL && right != NULL) {
+		if (right->priority > left->priority) {
+			*tail = right;
+			right = right->next;
+		} else {
+			*tail = left;
+			left = left->next;
+		}
+
+		tail = &(*tail)->next;
+	}
+
+	*tail = (left != NULL) ? left : right;
+	return out;
+}
+
+void fstree_sort_files_by_priority(fstree_t *fs)
+{
+	size_t count = 0;
+	file_info_t *fi;
+
+	for (fi = fs->files; fi != NULL; fi = fi->next)
+		++count;
+
+	fs->files = merge_sort_files(fs->files, count);
+}
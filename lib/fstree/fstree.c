@@ -4,9 +4,7 @@
  *
  * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
  */
-#include "config.h"
-
-#include "fstree.h"
+#include "internal.h"
 #include "util/util.h"
 
 #include <string.h>
@@ -90,22 +88,6 @@ fail_ov:
 	return -1;
 }
 
-static void free_recursive(tree_node_t *n)
-{
-	tree_node_t *it;
-
-	if (S_ISDIR(n->mode)) {
-		while (n->data.dir.children != NULL) {
-			it = n->data.dir.children;
-			n->data.dir.children = it->next;
-
-			free_recursive(it);
-		}
-	}
-
-	free(n);
-}
-
 int fstree_init(fstree_t *fs, char *defaults)
 {
 	memset(fs, 0, sizeof(*fs));
@@ -116,7 +98,7 @@ int fstree_init(fstree_t *fs, char *defaults)
 	if (defaults != NULL && process_defaults(&fs->defaults, defaults) != 0)
 		return -1;
 
-	fs->root = fstree_mknode(NULL, "", 0, NULL, &fs->defaults);
+	fs->root = fstree_mknode(fs, NULL, "", 0, NULL, &fs->defaults);
 
 	if (fs->root == NULL) {
 		perror("initializing file system tree");
@@ -128,7 +110,34 @@ int fstree_init(fstree_t *fs, char *defaults)
 
 void fstree_cleanup(fstree_t *fs)
 {
-	free_recursive(fs->root);
+	fstree_chunk_t *chunk;
+
+	while (fs->chunks != NULL) {
+		chunk = fs->chunks;
+		fs->chunks = chunk->next;
+		free(chunk);
+	}
+
+	if (fs->intern_strings)
+		str_table_cleanup(&fs->strings);
+
+	fstree_index_cleanup(fs);
+	free(fs->last_dir);
 	free(fs->inode_table);
 	memset(fs, 0, sizeof(*fs));
 }
+
+int fstree_intern_strings(fstree_t *fs)
+{
+	if (fs->intern_strings)
+		return 0;
+
+	if (str_table_init(&fs->strings, 1024)) {
+		fputs("creating string table for tree nodes: out of memory\n",
+		      stderr);
+		return -1;
+	}
+
+	fs->intern_strings = true;
+	return 0;
+}
@@ -8,14 +8,108 @@
 
 #include "fstree.h"
 #include "util/util.h"
+#include "sqfs/block.h"
 
 #include <unistd.h>
+#include <fnmatch.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
 
+typedef struct {
+	sqfs_u32 flags;
+	int priority;
+	bool have_priority;
+} file_attr_t;
+
+static const struct {
+	const char *name;
+	sqfs_u32 flags;
+} attr_flags[] = {
+	{ "nofrag", SQFS_BLK_DONT_FRAGMENT },
+	{ "align", SQFS_BLK_ALIGN },
+	{ "nocompress", SQFS_BLK_DONT_COMPRESS },
+	{ "nodedup", SQFS_BLK_DONT_DEDUPLICATE },
+	{ "random", SQFS_BLK_DONT_FRAGMENT | SQFS_BLK_ALIGN |
+		    SQFS_BLK_DONT_COMPRESS },
+};
+
+#define NUM_ATTR_FLAGS (sizeof(attr_flags) / sizeof(attr_flags[0]))
+
+static int parse_priority(const char *str, size_t len, int *out)
+{
+	bool negative = false;
+	int value = 0;
+	size_t i = 0;
+
+	if (len > 0 && (str[0] == '-' || str[0] == '+')) {
+		negative = (str[0] == '-');
+		++i;
+	}
+
+	if (i == len)
+		return -1;
+
+	for (; i < len; ++i) {
+		if (!isdigit(str[i]) || value > (INT_MAX - 9) / 10)
+			return -1;
+
+		value = value * 10 + (str[i] - '0');
+	}
+
+	*out = negative ? -value : value;
+	return 0;
+}
+
+static int parse_attributes(const char *filename, size_t line_num,
+			    const char *list, size_t len, file_attr_t *attr)
+{
+	const char *name, *next, *end = list + len;
+	size_t i, name_len;
+
+	for (name = list; name < end; name = next + 1) {
+		next = memchr(name, ',', end - name);
+		if (next == NULL)
+			next = end;
+
+		name_len = next - name;
+
+		if (name_len > 9 && strncmp(name, "priority=", 9) == 0) {
+			if (parse_priority(name + 9, name_len - 9,
+					   &attr->priority)) {
+				goto fail_value;
+			}
+
+			attr->have_priority = true;
+			continue;
+		}
+
+		for (i = 0; i < NUM_ATTR_FLAGS; ++i) {
+			if (strlen(attr_flags[i].name) == name_len &&
+			    strncmp(attr_flags[i].name, name, name_len) == 0)
+				break;
+		}
+
+		if (i == NUM_ATTR_FLAGS)
+			goto fail_unknown;
+
+		attr->flags |= attr_flags[i].flags;
+	}
+
+	return 0;
+fail_value:
+	fprintf(stderr, "%s: %zu: priority must be a decimal number.\n",
+		filename, line_num);
+	return -1;
+fail_unknown:
+	fprintf(stderr, "%s: %zu: unknown attribute '%.*s'.\n",
+		filename, line_num, (int)name_len, name);
+	return -1;
+}
+
 static int add_generic(fstree_t *fs, const char *filename, size_t line_num,
 		       const char *path, struct stat *sb, const char *extra)
 {
@@ -57,10 +151,45 @@ static int add_device(fstree_t *fs, const char *filename, size_t line_num,
 static int add_file(fstree_t *fs, const char *filename, size_t line_num,
 		    const char *path, struct stat *basic, const char *extra)
 {
+	file_attr_t attr;
+	const char *end;
+	tree_node_t *n;
+
+	memset(&attr, 0, sizeof(attr));
+
+	if (extra != NULL && *extra == '[') {
+		end = strchr(extra, ']');
+
+		if (end == NULL || (end[1] != '\0' && !isspace(end[1]))) {
+			fprintf(stderr, "%s: %zu: expected ']' after file "
+				"attributes.\n", filename, line_num);
+			return -1;
+		}
+
+		if (parse_attributes(filename, line_num, extra + 1,
+				     end - extra - 1, &attr)) {
+			return -1;
+		}
+
+		for (extra = end + 1; isspace(*extra); ++extra)
+			;
+	}
+
 	if (extra == NULL || *extra == '\0')
 		extra = path;
 
-	return add_generic(fs, filename, line_num, path, basic, extra);
+	n = fstree_add_generic(fs, path, basic, extra);
+	if (n == NULL) {
+		fprintf(stderr, "%s: %zu: %s: %s\n",
+			filename, line_num, path, strerror(errno));
+		return -1;
+	}
+
+	n->data.file.flags |= attr.flags;
+	if (attr.have_priority)
+		n->data.file.priority = attr.priority;
+
+	return 0;
 }
 
 static const struct {
@@ -80,30 +209,216 @@ static const struct {
 
 #define NUM_HOOKS (sizeof(file_list_hooks) / sizeof(file_list_hooks[0]))
 
-static void trim_line(char *line)
+typedef struct {
+	char *pattern;
+	file_attr_t attr;
+} layout_rule_t;
+
+/* the layout rules found so far, applied once all entries are read */
+typedef struct {
+	layout_rule_t *list;
+	size_t count;
+	size_t max;
+} layout_rules_t;
+
+#define READ_BUFFER_SIZE (64 * 1024)
+
+/*
+  Lines are handed out from a large read buffer and terminated in place,
+  instead of being copied into an allocation of their own.
+ */
+typedef struct {
+	FILE *fp;
+	char *buffer;
+	size_t size;
+	size_t used;
+	size_t offset;
+	bool eof;
+} line_reader_t;
+
+/* Returns 0 on success, 1 at the end of the file, -1 on failure. */
+static int next_line(line_reader_t *rd, char **out)
 {
-	size_t i;
+	size_t count;
+	char *end;
+	void *new;
 
-	for (i = 0; isspace(line[i]); ++i)
-		;
+	for (;;) {
+		end = memchr(rd->buffer + rd->offset, '\n',
+			     rd->used - rd->offset);
+
+		if (end != NULL || (rd->eof && rd->offset < rd->used)) {
+			if (end == NULL)
+				end = rd->buffer + rd->used;
+
+			*end = '\0';
+			*out = rd->buffer + rd->offset;
+			rd->offset = end - rd->buffer + 1;
+
+			if (rd->offset > rd->used)
+				rd->offset = rd->used;
+			return 0;
+		}
+
+		if (rd->eof)
+			return 1;
+
+		memmove(rd->buffer, rd->buffer + rd->offset,
+			rd->used - rd->offset);
+		rd->used -= rd->offset;
+		rd->offset = 0;
+
+		/* always keep room for terminating the last line */
+		if (rd->size - rd->used < 2) {
+			new = realloc(rd->buffer, rd->size * 2);
+			if (new == NULL)
+				return -1;
+
+			rd->buffer = new;
+			rd->size *= 2;
+		}
 
-	if (line[i] == '#') {
-		line[0] = '\0';
-		return;
+		count = fread(rd->buffer + rd->used, 1,
+			      rd->size - rd->used - 1, rd->fp);
+
+		if (count == 0) {
+			if (ferror(rd->fp))
+				return -1;
+
+			rd->eof = true;
+		}
+
+		rd->used += count;
+	}
+}
+
+static int add_layout_rule(layout_rules_t *rules, const char *filename,
+			   size_t line_num, const char *pattern,
+			   const char *attr)
+{
+	layout_rule_t *new, rule;
+	size_t new_sz;
+
+	memset(&rule, 0, sizeof(rule));
+
+	if (parse_attributes(filename, line_num, attr, strlen(attr),
+			     &rule.attr)) {
+		return -1;
+	}
+
+	rule.pattern = strdup(pattern);
+	if (rule.pattern == NULL)
+		goto fail_errno;
+
+	if (rules->count == rules->max) {
+		new_sz = rules->max ? rules->max * 2 : 8;
+		new = realloc(rules->list, sizeof(rules->list[0]) * new_sz);
+
+		if (new == NULL) {
+			free(rule.pattern);
+			goto fail_errno;
+		}
+
+		rules->list = new;
+		rules->max = new_sz;
+	}
+
+	rules->list[rules->count++] = rule;
+	return 0;
+fail_errno:
+	fprintf(stderr, "%s: %zu: %s\n", filename, line_num, strerror(errno));
+	return -1;
+}
+
+/* path holds the path of n, without the leading slash, up to offset */
+static int apply_layout_rules(const layout_rules_t *rules, tree_node_t *n,
+			      char **path, size_t *max, size_t offset)
+{
+	size_t i, len = offset + n->name_len + 1;
+	char *new;
+
+	if (len + 1 > *max) {
+		new = realloc(*path, len + 1);
+		if (new == NULL)
+			return -1;
+
+		*path = new;
+		*max = len + 1;
+	}
+
+	memcpy(*path + offset, n->name, n->name_len);
+	(*path)[offset + n->name_len] = '\0';
+
+	if (S_ISREG(n->mode)) {
+		for (i = 0; i < rules->count; ++i) {
+			if (fnmatch(rules->list[i].pattern, *path, 0) != 0)
+				continue;
+
+			n->data.file.flags |= rules->list[i].attr.flags;
+
+			if (rules->list[i].attr.have_priority) {
+				n->data.file.priority =
+					rules->list[i].attr.priority;
+			}
+		}
 	}
 
-	if (i > 0)
-		memmove(line, line + i, strlen(line + i) + 1);
+	if (!S_ISDIR(n->mode))
+		return 0;
+
+	(*path)[offset + n->name_len] = '/';
+
+	for (n = n->data.dir.children; n != NULL; n = n->next) {
+		if (apply_layout_rules(rules, n, path, max, len))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int apply_layout(fstree_t *fs, const layout_rules_t *rules,
+			const char *filename)
+{
+	size_t max = 0;
+	char *path = NULL;
+	tree_node_t *n;
+	int ret = 0;
+
+	if (rules->count == 0)
+		return 0;
+
+	for (n = fs->root->data.dir.children; n != NULL && ret == 0;
+	     n = n->next) {
+		ret = apply_layout_rules(rules, n, &path, &max, 0);
+	}
+
+	if (ret)
+		perror(filename);
+
+	free(path);
+	return ret;
+}
+
+static char *trim_line(char *line)
+{
+	size_t i;
+
+	while (isspace(*line))
+		++line;
+
+	if (*line == '#')
+		return line + strlen(line);
 
 	i = strlen(line);
 	while (i > 0 && isspace(line[i - 1]))
 		--i;
 
 	line[i] = '\0';
+	return line;
 }
 
-static int handle_line(fstree_t *fs, const char *filename,
-		       size_t line_num, char *line)
+static int handle_line(fstree_t *fs, layout_rules_t *rules,
+		       const char *filename, size_t line_num, char *line)
 {
 	const char *extra = NULL, *msg = NULL;
 	char keyword[16], *path, *ptr;
@@ -165,6 +480,14 @@ static int handle_line(fstree_t *fs, const char *filename,
 	if (canonicalize_name(path) || *path == '\0')
 		goto fail_ent;
 
+	if (strcmp(keyword, "layout") == 0) {
+		if (line[i] == '\0' || strpbrk(line + i, " \t") != NULL)
+			goto fail_layout;
+
+		return add_layout_rule(rules, filename, line_num,
+				       path, line + i);
+	}
+
 	/* mode */
 	if (!isdigit(line[i]))
 		goto fail_mode;
@@ -256,6 +579,10 @@ fail_mode:
 fail_mode_bits:
 	msg = "you can only set the permission bits in the mode";
 	goto out_desc;
+fail_layout:
+	fprintf(stderr, "%s: %zu: expected: layout <pattern> "
+		"<attr>[,<attr>...]\n", filename, line_num);
+	return -1;
 fail_ent:
 	msg = "error in entry description";
 	goto out_desc;
@@ -268,42 +595,55 @@ out_desc:
 
 int fstree_from_file(fstree_t *fs, const char *filename, FILE *fp)
 {
-	size_t n, line_num = 0;
-	ssize_t ret;
+	layout_rules_t rules;
+	size_t line_num = 0;
+	line_reader_t rd;
 	char *line;
+	size_t i;
+	int ret;
+
+	memset(&rules, 0, sizeof(rules));
+	memset(&rd, 0, sizeof(rd));
+	rd.fp = fp;
+	rd.size = READ_BUFFER_SIZE;
+	rd.buffer = malloc(rd.size);
+
+	if (rd.buffer == NULL) {
+		perror(filename);
+		return -1;
+	}
 
 	for (;;) {
-		line = NULL;
-		n = 0;
 		errno = 0;
-
-		ret = getline(&line, &n, fp);
+		ret = next_line(&rd, &line);
 		++line_num;
 
-		if (ret < 0) {
-			if (errno == 0) {
-				free(line);
-				break;
-			}
+		if (ret > 0)
+			break;
 
+		if (ret < 0) {
 			perror(filename);
-			goto fail_line;
+			goto fail;
 		}
 
-		trim_line(line);
+		line = trim_line(line);
 
-		if (line[0] == '\0') {
-			free(line);
+		if (line[0] == '\0')
 			continue;
-		}
 
-		if (handle_line(fs, filename, line_num, line))
-			goto fail_line;
-
-		free(line);
+		if (handle_line(fs, &rules, filename, line_num, line))
+			goto fail;
 	}
-	return 0;
-fail_line:
-	free(line);
-	return -1;
+
+	ret = apply_layout(fs, &rules, filename);
+out:
+	for (i = 0; i < rules.count; ++i)
+		free(rules.list[i].pattern);
+
+	free(rules.list);
+	free(rd.buffer);
+	return ret;
+fail:
+	ret = -1;
+	goto out;
 }
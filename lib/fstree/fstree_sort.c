@@ -8,9 +8,52 @@
 #include "config.h"
 
 #include "fstree.h"
+#include "util/util.h"
 
+#include <stdlib.h>
 #include <string.h>
 
+/* directories up to this size are sorted without a heap allocation */
+#define SORT_STACK_ENTRIES (64)
+
+/*
+  The children are sorted as an array of entries that carry the first bytes
+  of the name as a big endian integer, so that most comparisons are decided
+  on the key without touching the nodes. Zero padding of short names keeps
+  the order the same as strcmp, since names cannot contain null bytes.
+ */
+typedef struct {
+	sqfs_u64 key;
+	tree_node_t *node;
+} sort_entry_t;
+
+static sqfs_u64 name_key(const tree_node_t *n)
+{
+	size_t i, len = n->name_len < 8 ? n->name_len : 8;
+	sqfs_u64 key = 0;
+
+	for (i = 0; i < 8; ++i) {
+		key <<= 8;
+		if (i < len)
+			key |= (sqfs_u8)n->name[i];
+	}
+
+	return key;
+}
+
+static int compare_entries(const void *lhs, const void *rhs)
+{
+	const sort_entry_t *l = lhs, *r = rhs;
+
+	if (l->key != r->key)
+		return l->key < r->key ? -1 : 1;
+
+	if (l->node->name_len <= 8 && r->node->name_len <= 8)
+		return 0;
+
+	return strcmp(l->node->name + 8, r->node->name + 8);
+}
+
 static tree_node_t *merge(tree_node_t *lhs, tree_node_t *rhs)
 {
 	tree_node_t *it;
@@ -35,7 +78,7 @@ static tree_node_t *merge(tree_node_t *lhs, tree_node_t *rhs)
 	return head;
 }
 
-tree_node_t *tree_node_list_sort(tree_node_t *head)
+static tree_node_t *list_merge_sort(tree_node_t *head)
 {
 	tree_node_t *it, *half, *prev;
 
@@ -58,12 +101,82 @@ tree_node_t *tree_node_list_sort(tree_node_t *head)
 
 	prev->next = NULL;
 
-	return merge(tree_node_list_sort(head), tree_node_list_sort(half));
+	return merge(list_merge_sort(head), list_merge_sort(half));
+}
+
+static tree_node_t *list_reverse(tree_node_t *head)
+{
+	tree_node_t *it, *prev = NULL;
+
+	while (head != NULL) {
+		it = head;
+		head = head->next;
+		it->next = prev;
+		prev = it;
+	}
+
+	return prev;
+}
+
+tree_node_t *tree_node_list_sort(tree_node_t *head)
+{
+	sort_entry_t stack_list[SORT_STACK_ENTRIES], *list = stack_list;
+	bool ascending = true, descending = true;
+	size_t i, count = 0;
+	tree_node_t *it;
+	int ret;
+
+	/*
+	  Children are added to the front of the list, so the list of a
+	  directory from sorted input is exactly reversed. Names in a
+	  directory are unique, so this is checked with strict comparisons.
+	 */
+	for (it = head; it != NULL; it = it->next) {
+		++count;
+
+		if (it->next != NULL && (ascending || descending)) {
+			ret = strcmp(it->name, it->next->name);
+			ascending = ascending && ret < 0;
+			descending = descending && ret > 0;
+		}
+	}
+
+	if (count < 2 || ascending)
+		return head;
+
+	if (descending)
+		return list_reverse(head);
+
+	if (count > SORT_STACK_ENTRIES) {
+		list = alloc_array(sizeof(list[0]), count);
+		if (list == NULL)
+			return list_merge_sort(head);
+	}
+
+	for (i = 0, it = head; it != NULL; it = it->next, ++i) {
+		list[i].key = name_key(it);
+		list[i].node = it;
+	}
+
+	qsort(list, count, sizeof(list[0]), compare_entries);
+
+	for (i = 0; i < count - 1; ++i)
+		list[i].node->next = list[i + 1].node;
+
+	list[count - 1].node->next = NULL;
+	head = list[0].node;
+
+	if (list != stack_list)
+		free(list);
+
+	return head;
 }
 
 void tree_node_sort_recursive(tree_node_t *n)
 {
+	/* ascending now, see dir_info_t */
 	n->data.dir.children = tree_node_list_sort(n->data.dir.children);
+	n->data.dir.out_of_order = true;
 
 	for (n = n->data.dir.children; n != NULL; n = n->next) {
 		if (S_ISDIR(n->mode))
@@ -8,10 +8,19 @@
 
 #include "fstree.h"
 #include "util/util.h"
+#include "util/workers.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <stdio.h>
 
+#ifdef WITH_PTHREAD
+#include <pthread.h>
+#endif
+
+/* number of subtrees to split the work into, per thread */
+#define SUBTREES_PER_THREAD (8)
+
 static size_t count_nodes(tree_node_t *root)
 {
 	tree_node_t *n = root->data.dir.children;
@@ -20,7 +29,7 @@ static size_t count_nodes(tree_node_t *root)
 	while (n != NULL) {
 		if (S_ISDIR(n->mode)) {
 			count += count_nodes(n);
-		} else {
+		} else if (n->mode != FSTREE_MODE_HARD_LINK_RESOLVED) {
 			++count;
 		}
 		n = n->next;
@@ -32,7 +41,7 @@ static size_t count_nodes(tree_node_t *root)
 static void map_child_nodes(fstree_t *fs, tree_node_t *root, size_t *counter)
 {
 	bool has_subdirs = false;
-	tree_node_t *it;
+	tree_node_t *it, *n;
 
 	for (it = root->data.dir.children; it != NULL; it = it->next) {
 		if (S_ISDIR(it->mode)) {
@@ -48,11 +57,27 @@ static void map_child_nodes(fstree_t *fs, tree_node_t *root, size_t *counter)
 		}
 	}
 
+	/*
+	  The target of a hard link is numbered where it is seen first. That
+	  way, it always comes before the directories that refer to it, which
+	  is required for writing the inode table in a single pass.
+	 */
 	for (it = root->data.dir.children; it != NULL; it = it->next) {
-		it->inode_num = *counter;
+		n = it;
+
+		if (n->mode == FSTREE_MODE_HARD_LINK_RESOLVED) {
+			n = n->data.target;
+
+			if (n->inode_num != 0)
+				continue;
+		} else if (n->link_count > 0 && n->inode_num != 0) {
+			continue;
+		}
+
+		n->inode_num = *counter;
 		*counter += 1;
 
-		fs->inode_table[it->inode_num - 1] = it;
+		fs->inode_table[n->inode_num - 1] = n;
 	}
 }
 
@@ -74,3 +99,239 @@ int fstree_gen_inode_table(fstree_t *fs)
 	fs->inode_table[inum - 1] = fs->root;
 	return 0;
 }
+
+#ifdef WITH_PTHREAD
+/*
+  The tree is split into the sub directories at a fixed depth, that are
+  sorted, counted and numbered independently. The directories above them are
+  handled by the calling thread. Given the number of nodes below each
+  directory, the inode numbers map_child_nodes hands out for a subtree can be
+  computed up front, so the result is the same as for the sequential
+  version.
+ */
+typedef struct {
+	tree_node_t *dir;
+	size_t start;
+} subtree_t;
+
+typedef struct {
+	fstree_t *fs;
+	subtree_t *list;
+	size_t count;
+	size_t next;
+	bool number;
+	pthread_mutex_t mtx;
+} subtree_work_t;
+
+/* while sorting, the inode number holds the number of nodes below a dir */
+static void process_subtree(subtree_work_t *work, subtree_t *sub)
+{
+	if (work->number) {
+		map_child_nodes(work->fs, sub->dir, &sub->start);
+	} else {
+		tree_node_sort_recursive(sub->dir);
+		sub->dir->inode_num = count_nodes(sub->dir) - 1;
+	}
+}
+
+static void *subtree_worker(void *arg)
+{
+	subtree_work_t *work = arg;
+	size_t i;
+
+	for (;;) {
+		pthread_mutex_lock(&work->mtx);
+		i = work->next++;
+		pthread_mutex_unlock(&work->mtx);
+
+		if (i >= work->count)
+			break;
+
+		process_subtree(work, work->list + i);
+	}
+
+	return NULL;
+}
+
+static size_t count_below(const tree_node_t *dir)
+{
+	const tree_node_t *n;
+	size_t count = 0;
+
+	for (n = dir->data.dir.children; n != NULL; n = n->next) {
+		count += 1;
+
+		if (S_ISDIR(n->mode))
+			count += n->inode_num;
+	}
+
+	return count;
+}
+
+/* same order as map_child_nodes, but skipping over the split subtrees */
+static void assign_subtrees(fstree_t *fs, tree_node_t *dir, size_t depth,
+			    size_t split, subtree_t **next, size_t *counter)
+{
+	tree_node_t *it;
+
+	for (it = dir->data.dir.children; it != NULL; it = it->next) {
+		if (!S_ISDIR(it->mode))
+			continue;
+
+		if (depth + 1 == split) {
+			(*next)->dir = it;
+			(*next)->start = *counter;
+			*next += 1;
+			*counter += it->inode_num;
+		} else {
+			assign_subtrees(fs, it, depth + 1, split,
+					next, counter);
+		}
+	}
+
+	for (it = dir->data.dir.children; it != NULL; it = it->next) {
+		it->inode_num = *counter;
+		*counter += 1;
+
+		fs->inode_table[it->inode_num - 1] = it;
+	}
+}
+
+static int append_subdirs(tree_node_t ***list, size_t *count, size_t *max,
+			  tree_node_t *dir)
+{
+	tree_node_t **new, *n;
+
+	for (n = dir->data.dir.children; n != NULL; n = n->next) {
+		if (!S_ISDIR(n->mode))
+			continue;
+
+		if (*count == *max) {
+			*max = *max ? *max * 2 : 64;
+			new = realloc(*list, sizeof(new[0]) * *max);
+			if (new == NULL)
+				return -1;
+			*list = new;
+		}
+
+		(*list)[(*count)++] = n;
+	}
+
+	return 0;
+}
+
+static int sort_gen_parallel(fstree_t *fs, unsigned int num_threads)
+{
+	size_t i, start = 0, end, count = 1, max = 1, depth = 0;
+	size_t split = (size_t)-1, counter = 1;
+	tree_node_t **dirs;
+	subtree_work_t work;
+	subtree_t *next;
+	int ret = -1;
+
+	memset(&work, 0, sizeof(work));
+	work.fs = fs;
+
+	dirs = malloc(sizeof(dirs[0]));
+	if (dirs == NULL)
+		goto fail_alloc;
+
+	dirs[0] = fs->root;
+
+	/*
+	  Sort the directories level by level and collect the sub directories
+	  of each level, until there are enough of them to split the work.
+	 */
+	for (;;) {
+		end = count;
+
+		for (i = start; i < end; ++i) {
+			dirs[i]->data.dir.children =
+				tree_node_list_sort(dirs[i]->data.dir.children);
+			dirs[i]->data.dir.out_of_order = true;
+		}
+
+		for (i = start; i < end; ++i) {
+			if (append_subdirs(&dirs, &count, &max, dirs[i]))
+				goto fail_alloc;
+		}
+
+		if (count == end)
+			break;
+
+		if (count - end >= (size_t)num_threads * SUBTREES_PER_THREAD) {
+			split = depth + 1;
+			break;
+		}
+
+		start = end;
+		++depth;
+	}
+
+	work.count = count - end;
+
+	if (work.count > 0) {
+		work.list = alloc_array(sizeof(work.list[0]), work.count);
+		if (work.list == NULL)
+			goto fail_alloc;
+
+		for (i = 0; i < work.count; ++i)
+			work.list[i].dir = dirs[end + i];
+	}
+
+	if (pthread_mutex_init(&work.mtx, NULL) != 0)
+		goto fail_alloc;
+
+	/* sort and count the subtrees, then the directories above them */
+	work.next = 0;
+	if (work.count > 0)
+		run_workers(subtree_worker, &work, 0, num_threads);
+
+	for (i = end; i-- > 0; )
+		dirs[i]->inode_num = count_below(dirs[i]);
+
+	fs->inode_tbl_size = fs->root->inode_num + 1;
+	fs->inode_table = alloc_array(sizeof(tree_node_t *),
+				      fs->inode_tbl_size);
+	if (fs->inode_table == NULL) {
+		perror("allocating inode table");
+		goto out;
+	}
+
+	/* number the directories above, then the subtrees in parallel */
+	next = work.list;
+	assign_subtrees(fs, fs->root, 0, split, &next, &counter);
+
+	fs->root->inode_num = counter;
+	fs->inode_table[counter - 1] = fs->root;
+
+	work.number = true;
+	work.next = 0;
+	if (work.count > 0)
+		run_workers(subtree_worker, &work, 0, num_threads);
+	ret = 0;
+out:
+	pthread_mutex_destroy(&work.mtx);
+	free(work.list);
+	free(dirs);
+	return ret;
+fail_alloc:
+	perror("generating inode table");
+	free(work.list);
+	free(dirs);
+	return -1;
+}
+#endif
+
+int fstree_sort_gen_inode_table(fstree_t *fs, unsigned int num_threads)
+{
+#ifdef WITH_PTHREAD
+	/* the subtrees can't be numbered independently if they share inodes */
+	if (num_threads > 1 && !fs->has_hard_links)
+		return sort_gen_parallel(fs, num_threads);
+#else
+	(void)num_threads;
+#endif
+	tree_node_sort_recursive(fs->root);
+	return fstree_gen_inode_table(fs);
+}
@@ -21,7 +21,7 @@ char *fstree_get_path(tree_node_t *node)
 		return strdup("/");
 
 	for (it = node; it != NULL && it->parent != NULL; it = it->parent) {
-		len += strlen(it->name) + 1;
+		len += it->name_len + 1;
 	}
 
 	str = malloc(len + 1);
@@ -32,10 +32,9 @@ char *fstree_get_path(tree_node_t *node)
 	*ptr = '\0';
 
 	for (it = node; it != NULL && it->parent != NULL; it = it->parent) {
-		len = strlen(it->name);
-		ptr -= len;
+		ptr -= it->name_len;
 
-		memcpy(ptr, it->name, len);
+		memcpy(ptr, it->name, it->name_len);
 		*(--ptr) = '/';
 	}
 
@@ -0,0 +1,96 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * hard_link.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+/* a chain of links to links longer than this is treated as a loop */
+#define MAX_LINK_DEPTH (64)
+
+static void link_error(tree_node_t *n, const char *msg)
+{
+	char *path = fstree_get_path(n);
+
+	fprintf(stderr, "%s: hard link to %s: %s.\n",
+		path == NULL ? n->name : path, n->data.link_path, msg);
+	free(path);
+}
+
+static int resolve_link(fstree_t *fs, tree_node_t *n, size_t depth)
+{
+	tree_node_t *target = fstree_get_node_by_path(fs, n->data.link_path);
+
+	if (target == NULL) {
+		link_error(n, "no such file");
+		return -1;
+	}
+
+	if (target->mode == FSTREE_MODE_HARD_LINK) {
+		if (target == n || depth >= MAX_LINK_DEPTH) {
+			link_error(n, "loop detected");
+			return -1;
+		}
+
+		if (resolve_link(fs, target, depth + 1))
+			return -1;
+	}
+
+	if (target->mode == FSTREE_MODE_HARD_LINK_RESOLVED)
+		target = target->data.target;
+
+	if (S_ISDIR(target->mode)) {
+		link_error(n, "target is a directory");
+		return -1;
+	}
+
+	n->mode = FSTREE_MODE_HARD_LINK_RESOLVED;
+	n->data.target = target;
+	target->link_count += 1;
+	return 0;
+}
+
+static int resolve_dir(fstree_t *fs, tree_node_t *dir)
+{
+	tree_node_t *n;
+
+	for (n = dir->data.dir.children; n != NULL; n = n->next) {
+		if (S_ISDIR(n->mode)) {
+			if (resolve_dir(fs, n))
+				return -1;
+			continue;
+		}
+
+		if (n->mode == FSTREE_MODE_HARD_LINK) {
+			if (resolve_link(fs, n, 0))
+				return -1;
+		}
+
+		if (n->mode == FSTREE_MODE_HARD_LINK_RESOLVED)
+			fs->has_hard_links = true;
+	}
+
+	return 0;
+}
+
+tree_node_t *fstree_add_hard_link(fstree_t *fs, const char *path,
+				  const char *target)
+{
+	struct stat sb;
+
+	memset(&sb, 0, sizeof(sb));
+	sb.st_mode = FSTREE_MODE_HARD_LINK;
+
+	return fstree_add_generic(fs, path, &sb, target);
+}
+
+int fstree_resolve_hard_links(fstree_t *fs)
+{
+	return resolve_dir(fs, fs->root);
+}
@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * internal.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef FSTREE_INTERNAL_H
+#define FSTREE_INTERNAL_H
+
+#include "config.h"
+
+#include "fstree.h"
+
+/*
+  Directories with more than this many children are added to the hash
+  index of the tree the first time a lookup has to walk through them.
+ */
+#define CHILD_INDEX_THRESHOLD (32)
+
+/* Find a child of a directory by name. The name need not be terminated. */
+tree_node_t *fstree_find_child(fstree_t *fs, tree_node_t *dir,
+			       const char *name, size_t len);
+
+/*
+  If the parent of a new node is indexed, add the node to the index.
+  Returns 0 on success, -1 and sets errno on failure.
+ */
+int fstree_index_child(fstree_t *fs, tree_node_t *n);
+
+/* Remove a node from the index, if its parent is indexed. */
+void fstree_unindex_child(fstree_t *fs, tree_node_t *n);
+
+void fstree_index_cleanup(fstree_t *fs);
+
+#endif /* FSTREE_INTERNAL_H */
@@ -4,56 +4,157 @@
  *
  * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
  */
-#include "config.h"
-
-#include "fstree.h"
+#include "internal.h"
+#include "util/util.h"
 
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 
-tree_node_t *fstree_mknode(tree_node_t *parent, const char *name,
-			   size_t name_len, const char *extra,
-			   const struct stat *sb)
+#define NODE_CHUNK_SIZE (64 * 1024)
+
+#define NODE_ALIGN(x) (((x) + sizeof(sqfs_u64) - 1) & ~(sizeof(sqfs_u64) - 1))
+
+/*
+  Nodes are carved out of large chunks in the order they are created,
+  which saves the per allocation overhead of malloc and keeps siblings
+  close together in memory. A node that would waste a large part of a
+  chunk gets a chunk of its own, behind the one currently being filled.
+ */
+static void *alloc_node(fstree_t *fs, size_t size)
+{
+	fstree_chunk_t *chunk;
+	sqfs_u8 *ptr;
+
+	if (fs == NULL)
+		return calloc(1, size);
+
+	size = NODE_ALIGN(size);
+	chunk = fs->chunks;
+
+	if (chunk == NULL || (chunk->size - chunk->used) < size) {
+		if (size > NODE_CHUNK_SIZE / 4) {
+			chunk = alloc_flex(sizeof(*chunk), 1, size);
+			if (chunk == NULL)
+				return NULL;
+
+			chunk->size = size;
+
+			if (fs->chunks == NULL) {
+				chunk->next = NULL;
+				fs->chunks = chunk;
+			} else {
+				chunk->next = fs->chunks->next;
+				fs->chunks->next = chunk;
+			}
+		} else {
+			chunk = alloc_flex(sizeof(*chunk), 1, NODE_CHUNK_SIZE);
+			if (chunk == NULL)
+				return NULL;
+
+			chunk->size = NODE_CHUNK_SIZE;
+			chunk->next = fs->chunks;
+			fs->chunks = chunk;
+		}
+
+		chunk->used = 0;
+	}
+
+	ptr = (sqfs_u8 *)chunk->data + chunk->used;
+	chunk->used += size;
+
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+tree_node_t *fstree_mknode(fstree_t *fs, tree_node_t *parent,
+			   const char *name, size_t name_len,
+			   const char *extra, const struct stat *sb)
 {
+	const char *shared_name = NULL, *shared_extra = NULL;
 	tree_node_t *n;
 	size_t size;
 	char *ptr;
 
-	if (S_ISLNK(sb->st_mode) && extra == NULL) {
+	if (name_len > 0xFFFF) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	if ((S_ISLNK(sb->st_mode) || sb->st_mode == FSTREE_MODE_HARD_LINK) &&
+	    extra == NULL) {
 		errno = EINVAL;
 		return NULL;
 	}
 
-	size = sizeof(tree_node_t) + name_len + 1;
-	if (extra != NULL)
+	/* input file paths are unique, not worth looking up */
+	if (fs != NULL && fs->intern_strings) {
+		shared_name = str_table_intern(&fs->strings, name, name_len);
+		if (shared_name == NULL)
+			goto fail_oom;
+
+		if (S_ISLNK(sb->st_mode)) {
+			shared_extra = str_table_intern(&fs->strings, extra,
+							strlen(extra));
+			if (shared_extra == NULL)
+				goto fail_oom;
+		}
+	}
+
+	size = sizeof(tree_node_t);
+	if (shared_name == NULL)
+		size += name_len + 1;
+	if (extra != NULL && shared_extra == NULL)
 		size += strlen(extra) + 1;
 
-	n = calloc(1, size);
+	n = alloc_node(fs, size);
 	if (n == NULL)
 		return NULL;
 
-	if (parent != NULL) {
-		n->next = parent->data.dir.children;
-		parent->data.dir.children = n;
-		n->parent = parent;
-	}
-
 	n->xattr_idx = 0xFFFFFFFF;
 	n->uid = sb->st_uid;
 	n->gid = sb->st_gid;
 	n->mode = sb->st_mode;
 	n->mod_time = sb->st_mtime;
-	n->name = (char *)n->payload;
-	memcpy(n->name, name, name_len);
+	n->name_len = name_len;
+	ptr = (char *)n->payload;
+
+	if (shared_name != NULL) {
+		n->name = (char *)shared_name;
+	} else {
+		n->name = ptr;
+		memcpy(n->name, name, name_len);
+		ptr += name_len + 1;
+	}
 
-	if (extra != NULL) {
-		ptr = n->name + name_len + 1;
+	if (shared_extra != NULL) {
+		ptr = (char *)shared_extra;
+	} else if (extra != NULL) {
 		strcpy(ptr, extra);
 	} else {
 		ptr = NULL;
 	}
 
+	if (parent != NULL) {
+		n->parent = parent;
+
+		if (fs != NULL && fstree_index_child(fs, n))
+			return NULL;
+
+		if (parent->data.dir.children != NULL &&
+		    strcmp(n->name, parent->data.dir.children->name) <= 0) {
+			parent->data.dir.out_of_order = true;
+		}
+
+		n->next = parent->data.dir.children;
+		parent->data.dir.children = n;
+	}
+
+	if (sb->st_mode == FSTREE_MODE_HARD_LINK) {
+		n->data.link_path = ptr;
+		return n;
+	}
+
 	switch (sb->st_mode & S_IFMT) {
 	case S_IFREG:
 		n->data.file.input_file = ptr;
@@ -69,4 +170,7 @@ tree_node_t *fstree_mknode(tree_node_t *parent, const char *name,
 	}
 
 	return n;
+fail_oom:
+	errno = ENOMEM;
+	return NULL;
 }
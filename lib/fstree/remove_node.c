@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * remove_node.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "internal.h"
+
+void fstree_remove_node(fstree_t *fs, tree_node_t *n)
+{
+	tree_node_t **it;
+
+	if (n->parent == NULL)
+		return;
+
+	for (it = &n->parent->data.dir.children; *it != NULL;
+	     it = &(*it)->next) {
+		if (*it == n) {
+			*it = n->next;
+			break;
+		}
+	}
+
+	/*
+	  The index entries of nodes further down are keyed by parents that
+	  are no longer reachable, so they can simply stay where they are.
+	 */
+	fstree_unindex_child(fs, n);
+
+	/* the cached parent could be in the removed sub tree */
+	fs->last_parent = NULL;
+	n->next = NULL;
+}
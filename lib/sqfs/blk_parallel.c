@@ -0,0 +1,157 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * blk_parallel.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#define SQFS_BUILDING_DLL
+#include "blk_parallel.h"
+
+#include "sqfs/error.h"
+#include "sqfs/trace.h"
+#include "util/util.h"
+
+#include <stdlib.h>
+
+#ifdef WITH_PTHREAD
+#include "thread_pool.h"
+#endif
+
+/* number of indices a thread grabs at once */
+#define BLK_CHUNK 16
+
+typedef struct {
+	blk_parallel_fn_t fn;
+	void *user;
+	size_t count;
+
+	size_t next;
+	int status;
+
+#ifdef WITH_PTHREAD
+	pthread_mutex_t mtx;
+#endif
+} blk_state_t;
+
+static void run_chunks(blk_state_t *state, sqfs_compressor_t *cmp)
+{
+	size_t i, first, last;
+	int ret = 0;
+
+	for (;;) {
+#ifdef WITH_PTHREAD
+		pthread_mutex_lock(&state->mtx);
+#endif
+		if (state->status == 0 && ret != 0)
+			state->status = ret;
+
+		first = state->next;
+		last = first + BLK_CHUNK;
+
+		if (last > state->count)
+			last = state->count;
+
+		state->next = last;
+
+		if (state->status != 0)
+			first = last;
+#ifdef WITH_PTHREAD
+		pthread_mutex_unlock(&state->mtx);
+#endif
+		if (first == last)
+			break;
+
+		sqfs_trace_begin("blk_parallel", "process blocks");
+		for (i = first; i < last && ret == 0; ++i)
+			ret = state->fn(state->user, cmp, i);
+		sqfs_trace_end("blk_parallel", "process blocks");
+	}
+}
+
+#ifdef WITH_PTHREAD
+typedef struct {
+	blk_state_t *state;
+	sqfs_compressor_t *cmp;
+	thread_job_t job;
+} blk_worker_t;
+
+static void *worker_proc(void *arg)
+{
+	blk_worker_t *worker = arg;
+
+	run_chunks(worker->state, worker->cmp);
+	return NULL;
+}
+
+static int run_parallel(blk_state_t *state, sqfs_compressor_t *cmp,
+			unsigned int num_workers)
+{
+	blk_worker_t *workers;
+	unsigned int i, count;
+	int ret = 0;
+
+	workers = alloc_array(sizeof(workers[0]), num_workers - 1);
+	if (workers == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	state->mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+
+	for (count = 0; count < (num_workers - 1); ++count) {
+		workers[count].state = state;
+		workers[count].cmp = cmp->create_copy(cmp);
+
+		if (workers[count].cmp == NULL) {
+			ret = SQFS_ERROR_ALLOC;
+			break;
+		}
+
+		/* with a thread pool, these only run if it has a share to spare */
+		if (thread_job_start(&workers[count].job, worker_proc,
+				     workers + count, false) != 0) {
+			workers[count].cmp->destroy(workers[count].cmp);
+			ret = SQFS_ERROR_INTERNAL;
+			break;
+		}
+	}
+
+	/* the calling thread helps out, even if not all workers started */
+	run_chunks(state, cmp);
+
+	for (i = 0; i < count; ++i) {
+		thread_job_join(&workers[i].job);
+		workers[i].cmp->destroy(workers[i].cmp);
+	}
+
+	pthread_mutex_destroy(&state->mtx);
+	free(workers);
+	return ret;
+}
+#endif
+
+int blk_parallel_run(sqfs_compressor_t *cmp, size_t count,
+		     unsigned int num_workers, blk_parallel_fn_t fn,
+		     void *user)
+{
+	blk_state_t state;
+	int ret = 0;
+
+	state.fn = fn;
+	state.user = user;
+	state.count = count;
+	state.next = 0;
+	state.status = 0;
+
+#ifdef WITH_PTHREAD
+	if (num_workers > 1 && count > BLK_CHUNK) {
+		ret = run_parallel(&state, cmp, num_workers);
+	} else {
+		state.mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+		run_chunks(&state, cmp);
+		pthread_mutex_destroy(&state.mtx);
+	}
+#else
+	(void)num_workers;
+	run_chunks(&state, cmp);
+#endif
+	return ret != 0 ? ret : state.status;
+}
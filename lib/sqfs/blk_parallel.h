@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * blk_parallel.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef BLK_PARALLEL_H
+#define BLK_PARALLEL_H
+
+#include "config.h"
+
+#include "sqfs/predef.h"
+#include "sqfs/compressor.h"
+
+/*
+  Called for every index in the range. The compressor is either the original
+  one, or a copy private to the thread the function is called from.
+ */
+typedef int (*blk_parallel_fn_t)(void *user, sqfs_compressor_t *cmp,
+				 size_t index);
+
+/*
+  Call a function for every index from 0 to count - 1, spread out over up
+  to num_workers threads (including the calling thread) if libsquashfs has
+  thread support. The indices are processed in no particular order and the
+  function must only touch data belonging to its index.
+
+  Returns the first error encountered, in which case the remaining indices
+  may have been skipped.
+ */
+SQFS_INTERNAL int blk_parallel_run(sqfs_compressor_t *cmp, size_t count,
+				   unsigned int num_workers,
+				   blk_parallel_fn_t fn, void *user);
+
+#endif /* BLK_PARALLEL_H */
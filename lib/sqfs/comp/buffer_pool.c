@@ -0,0 +1,96 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * buffer_pool.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#define SQFS_BUILDING_DLL
+#include "internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* keeps the size in front of the buffer, at full alignment */
+typedef union {
+	size_t size;
+	sqfs_u64 align0;
+	long double align1;
+	void *align2;
+} pool_header_t;
+
+void comp_pool_init(comp_pool_t *pool, const sqfs_allocator_t *allocator)
+{
+	memset(pool, 0, sizeof(*pool));
+	pool->allocator = allocator;
+}
+
+static void release(comp_pool_t *pool, pool_header_t *hdr)
+{
+	if (pool->allocator == NULL) {
+		free(hdr);
+	} else {
+		pool->allocator->free(pool->allocator->user, hdr);
+	}
+}
+
+void comp_pool_cleanup(comp_pool_t *pool)
+{
+	size_t i;
+
+	for (i = 0; i < pool->count; ++i)
+		release(pool, pool->free_list[i]);
+
+	pool->count = 0;
+}
+
+void *comp_pool_alloc(void *ptr, size_t nmemb, size_t size)
+{
+	comp_pool_t *pool = ptr;
+	pool_header_t *hdr;
+	size_t i;
+
+	if (SZ_MUL_OV(nmemb, size, &size))
+		return NULL;
+
+	for (i = 0; i < pool->count; ++i) {
+		hdr = pool->free_list[i];
+
+		if (hdr->size == size) {
+			pool->free_list[i] = pool->free_list[--pool->count];
+			return hdr + 1;
+		}
+	}
+
+	if (SZ_ADD_OV(size, sizeof(*hdr), &i))
+		return NULL;
+
+	if (pool->allocator == NULL) {
+		hdr = malloc(i);
+	} else {
+		hdr = pool->allocator->alloc(pool->allocator->user, i);
+	}
+
+	if (hdr == NULL)
+		return NULL;
+
+	hdr->size = size;
+	return hdr + 1;
+}
+
+void comp_pool_free(void *user, void *ptr)
+{
+	comp_pool_t *pool = user;
+	pool_header_t *hdr;
+
+	if (ptr == NULL)
+		return;
+
+	hdr = (pool_header_t *)ptr - 1;
+
+	if (pool->count == COMP_POOL_SIZE) {
+		release(pool, pool->free_list[0]);
+		pool->free_list[0] = pool->free_list[--pool->count];
+	}
+
+	pool->free_list[pool->count++] = hdr;
+}
@@ -107,13 +107,19 @@ sqfs_compressor_t *sqfs_compressor_create(const sqfs_compressor_config_t *cfg)
 			     sizeof(cfg->opt.lzo.padd0));
 		break;
 	case SQFS_COMP_ZSTD:
-		ret = memcmp(cfg->opt.zstd.padd0, padd0,
+		ret = memcmp(&cfg->opt.zstd.padd0, padd0,
 			     sizeof(cfg->opt.zstd.padd0));
 		break;
 	case SQFS_COMP_GZIP:
 		ret = memcmp(cfg->opt.gzip.padd0, padd0,
 			     sizeof(cfg->opt.gzip.padd0));
 		break;
+	case SQFS_COMP_LZ4:
+		ret = memcmp(&cfg->opt.lz4.padd0, padd0,
+			     sizeof(cfg->opt.lz4.padd0));
+		ret |= memcmp(cfg->opt.lz4.padd1, padd0,
+			      sizeof(cfg->opt.lz4.padd1));
+		break;
 	default:
 		ret = memcmp(cfg->opt.padd0, padd0, sizeof(cfg->opt.padd0));
 		break;
@@ -125,6 +131,25 @@ sqfs_compressor_t *sqfs_compressor_create(const sqfs_compressor_config_t *cfg)
 	return compressors[cfg->id](cfg);
 }
 
+int sqfs_compressor_do_blocks(sqfs_compressor_t *cmp,
+			      sqfs_compressor_job_t *jobs, size_t count)
+{
+	size_t i;
+
+	if (cmp->do_blocks != NULL)
+		return cmp->do_blocks(cmp, jobs, count);
+
+	for (i = 0; i < count; ++i) {
+		cmp->method_hint = jobs[i].method_hint;
+
+		jobs[i].result = cmp->do_block(cmp, jobs[i].in, jobs[i].size,
+					       jobs[i].out, jobs[i].outsize);
+		jobs[i].method = cmp->method;
+	}
+
+	return 0;
+}
+
 const char *sqfs_compressor_name_from_id(E_SQFS_COMPRESSOR id)
 {
 	if (id < 0 || (size_t)id >= sizeof(names) / sizeof(names[0]))
@@ -171,6 +196,10 @@ int sqfs_compressor_config_init(sqfs_compressor_config_t *cfg,
 		break;
 	case SQFS_COMP_XZ:
 		cfg->opt.xz.dict_size = block_size;
+		cfg->opt.xz.level = SQFS_XZ_DEFAULT_LEVEL;
+		break;
+	case SQFS_COMP_LZ4:
+		cfg->opt.lz4.level = SQFS_LZ4_DEFAULT_LEVEL;
 		break;
 	default:
 		break;
@@ -178,3 +207,22 @@ int sqfs_compressor_config_init(sqfs_compressor_config_t *cfg,
 
 	return 0;
 }
+
+int sqfs_compressor_train_dict(E_SQFS_COMPRESSOR id, const void *samples,
+			       const size_t *sample_sizes, size_t num_samples,
+			       void *dict, size_t *dict_size)
+{
+	switch (id) {
+#ifdef WITH_ZSTD
+	case SQFS_COMP_ZSTD:
+		return zstd_train_dict(samples, sample_sizes, num_samples,
+				       dict, dict_size);
+#endif
+	default:
+		break;
+	}
+
+	(void)samples; (void)sample_sizes; (void)num_samples; (void)dict;
+	(void)dict_size;
+	return SQFS_ERROR_UNSUPPORTED;
+}
@@ -15,6 +15,9 @@
 
 #include "internal.h"
 
+/* with SQFS_COMP_FLAG_GZIP_SAMPLE, bytes at the start of a block to test */
+#define GZIP_SAMPLE_SIZE (16384)
+
 typedef struct {
 	sqfs_u32 level;
 	sqfs_u16 window;
@@ -26,6 +29,7 @@ typedef struct {
 
 	z_stream strm;
 	bool compress;
+	bool sample;
 
 	size_t block_size;
 	gzip_options_t opt;
@@ -106,42 +110,74 @@ static int flag_to_zlib_strategy(int flag)
 	return 0;
 }
 
-static int find_strategy(gzip_compressor_t *gzip, const sqfs_u8 *in,
-			 sqfs_u32 size, sqfs_u8 *out, sqfs_u32 outsize)
+static int try_strategy(gzip_compressor_t *gzip, int flag,
+			const sqfs_u8 *in, sqfs_u32 size,
+			sqfs_u8 *out, sqfs_u32 outsize)
 {
-	int ret, strategy, selected = Z_DEFAULT_STRATEGY;
-	size_t i, length, minlength = 0;
+	int ret;
 
-	for (i = 0x01; i & SQFS_COMP_FLAG_GZIP_ALL; i <<= 1) {
-		if ((gzip->opt.strategies & i) == 0)
-			continue;
+	ret = deflateReset(&gzip->strm);
+	if (ret != Z_OK)
+		return SQFS_ERROR_COMPRESSOR;
 
-		ret = deflateReset(&gzip->strm);
-		if (ret != Z_OK)
-			return SQFS_ERROR_COMPRESSOR;
+	gzip->strm.next_in = (void *)in;
+	gzip->strm.avail_in = size;
+	gzip->strm.next_out = out;
+	gzip->strm.avail_out = outsize;
 
-		strategy = flag_to_zlib_strategy(i);
+	ret = deflateParams(&gzip->strm, gzip->opt.level,
+			    flag_to_zlib_strategy(flag));
+	if (ret != Z_OK)
+		return SQFS_ERROR_COMPRESSOR;
 
-		gzip->strm.next_in = (void *)in;
-		gzip->strm.avail_in = size;
-		gzip->strm.next_out = out;
-		gzip->strm.avail_out = outsize;
+	ret = deflate(&gzip->strm, Z_FINISH);
 
-		ret = deflateParams(&gzip->strm, gzip->opt.level, strategy);
-		if (ret != Z_OK)
-			return SQFS_ERROR_COMPRESSOR;
+	if (ret == Z_STREAM_END)
+		return gzip->strm.total_out;
 
-		ret = deflate(&gzip->strm, Z_FINISH);
+	if (ret != Z_OK && ret != Z_BUF_ERROR)
+		return SQFS_ERROR_COMPRESSOR;
 
-		if (ret == Z_STREAM_END) {
-			length = gzip->strm.total_out;
+	return 0;
+}
 
-			if (minlength == 0 || length < minlength) {
-				minlength = length;
-				selected = strategy;
-			}
-		} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
-			return SQFS_ERROR_COMPRESSOR;
+/*
+  Returns the strategy flag producing the smallest output, or 0 if none
+  fits. A trial is aborted as soon as it is no smaller than the best one
+  so far. If the output buffer still holds the complete result of the
+  selected strategy, its size is returned through "done".
+ */
+static int find_strategy(gzip_compressor_t *gzip, const sqfs_u8 *in,
+			 sqfs_u32 size, sqfs_u8 *out, sqfs_u32 outsize,
+			 sqfs_u32 *done)
+{
+	int ret, selected = 0;
+	sqfs_u32 minlength = 0;
+	bool sampled = false;
+	size_t i;
+
+	if (gzip->sample && size > 2 * GZIP_SAMPLE_SIZE) {
+		size = GZIP_SAMPLE_SIZE;
+		sampled = true;
+	}
+
+	*done = 0;
+
+	for (i = 0x01; i & SQFS_COMP_FLAG_GZIP_ALL; i <<= 1) {
+		if ((gzip->opt.strategies & i) == 0)
+			continue;
+
+		ret = try_strategy(gzip, i, in, size, out,
+				   minlength > 0 ? minlength - 1 : outsize);
+		if (ret < 0)
+			return ret;
+
+		if (ret > 0) {
+			minlength = ret;
+			selected = i;
+			*done = sampled ? 0 : minlength;
+		} else {
+			*done = 0;
 		}
 	}
 
@@ -153,15 +189,26 @@ static sqfs_s32 gzip_do_block(sqfs_compressor_t *base, const sqfs_u8 *in,
 {
 	gzip_compressor_t *gzip = (gzip_compressor_t *)base;
 	int ret, strategy = 0;
+	sqfs_u32 done;
 	size_t written;
 
 	if (size >= 0x7FFFFFFF)
 		return 0;
 
+	if (gzip->compress)
+		outsize = COMP_MAX_OUTPUT(size, outsize);
+
 	if (gzip->compress && gzip->opt.strategies != 0) {
-		strategy = find_strategy(gzip, in, size, out, outsize);
-		if (strategy < 0)
-			return strategy;
+		ret = find_strategy(gzip, in, size, out, outsize, &done);
+		if (ret < 0)
+			return ret;
+
+		base->method = ret;
+
+		if (done > 0)
+			return done >= size ? 0 : done;
+
+		strategy = flag_to_zlib_strategy(ret);
 	}
 
 	if (gzip->compress) {
@@ -238,6 +285,7 @@ sqfs_compressor_t *gzip_compressor_create(const sqfs_compressor_config_t *cfg)
 	int ret;
 
 	if (cfg->flags & ~(SQFS_COMP_FLAG_GZIP_ALL |
+			   SQFS_COMP_FLAG_GZIP_SAMPLE |
 			   SQFS_COMP_FLAG_GENERIC_ALL)) {
 		return NULL;
 	}
@@ -261,6 +309,7 @@ sqfs_compressor_t *gzip_compressor_create(const sqfs_compressor_config_t *cfg)
 	gzip->opt.level = cfg->opt.gzip.level;
 	gzip->opt.window = cfg->opt.gzip.window_size;
 	gzip->opt.strategies = cfg->flags & SQFS_COMP_FLAG_GZIP_ALL;
+	gzip->sample = (cfg->flags & SQFS_COMP_FLAG_GZIP_SAMPLE) != 0;
 	gzip->compress = (cfg->flags & SQFS_COMP_FLAG_UNCOMPRESS) == 0;
 	gzip->block_size = cfg->block_size;
 	base->do_block = gzip_do_block;
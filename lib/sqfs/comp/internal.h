@@ -16,6 +16,39 @@
 #include "sqfs/io.h"
 #include "util/util.h"
 
+/* number of released buffers a compressor keeps around for reuse */
+#define COMP_POOL_SIZE (16)
+
+/*
+  The output space to compress a block into. A result that is not smaller
+  than the input is stored uncompressed anyway, so the compressor libraries
+  are told to give up as soon as the output reaches the input size.
+ */
+#define COMP_MAX_OUTPUT(size, outsize) \
+	(((size) > 0 && (outsize) >= (size)) ? (size) - 1 : (outsize))
+
+/*
+  Recycles the work buffers of compressor libraries that set up their
+  internal state from scratch for every block. Buffers are only reused
+  if the size matches exactly. Not thread safe, every compressor copy
+  has its own pool.
+ */
+typedef struct {
+	const sqfs_allocator_t *allocator;
+	void *free_list[COMP_POOL_SIZE];
+	size_t count;
+} comp_pool_t;
+
+SQFS_INTERNAL
+void comp_pool_init(comp_pool_t *pool, const sqfs_allocator_t *allocator);
+
+SQFS_INTERNAL void comp_pool_cleanup(comp_pool_t *pool);
+
+/* signatures match the lzma_allocator callbacks, pool is a comp_pool_t */
+SQFS_INTERNAL void *comp_pool_alloc(void *pool, size_t nmemb, size_t size);
+
+SQFS_INTERNAL void comp_pool_free(void *pool, void *ptr);
+
 SQFS_INTERNAL
 int sqfs_generic_write_options(sqfs_file_t *file, const void *data,
 			       size_t size);
@@ -38,6 +71,11 @@ sqfs_compressor_t *lz4_compressor_create(const sqfs_compressor_config_t *cfg);
 SQFS_INTERNAL
 sqfs_compressor_t *zstd_compressor_create(const sqfs_compressor_config_t *cfg);
 
+SQFS_INTERNAL int zstd_train_dict(const void *samples,
+				  const size_t *sample_sizes,
+				  size_t num_samples,
+				  void *dict, size_t *dict_size);
+
 SQFS_INTERNAL
 sqfs_compressor_t *lzma_compressor_create(const sqfs_compressor_config_t *cfg);
 
@@ -19,6 +19,10 @@
 typedef struct {
 	sqfs_compressor_t base;
 	bool high_compression;
+	int level;
+
+	/* reused LZ4HC state, instead of allocating one for every block */
+	void *hc_state;
 } lz4_compressor_t;
 
 typedef struct {
@@ -68,9 +72,13 @@ static sqfs_s32 lz4_comp_block(sqfs_compressor_t *base, const sqfs_u8 *in,
 	if (size >= 0x7FFFFFFF)
 		return 0;
 
+	/* returns 0 if the output does not fit */
+	outsize = COMP_MAX_OUTPUT(size, outsize);
+
 	if (lz4->high_compression) {
-		ret = LZ4_compress_HC((void *)in, (void *)out,
-				      size, outsize, LZ4HC_CLEVEL_MAX);
+		ret = LZ4_compress_HC_extStateHC(lz4->hc_state, (void *)in,
+						 (void *)out, size, outsize,
+						 lz4->level);
 	} else {
 		ret = LZ4_compress_default((void *)in, (void *)out,
 					   size, outsize);
@@ -99,6 +107,14 @@ static sqfs_s32 lz4_uncomp_block(sqfs_compressor_t *base, const sqfs_u8 *in,
 	return ret;
 }
 
+#ifdef LZ4_DECOMPRESS_INPLACE_MARGIN
+static sqfs_u32 lz4_inplace_margin(sqfs_compressor_t *base, sqfs_u32 size)
+{
+	(void)base;
+	return LZ4_DECOMPRESS_INPLACE_MARGIN(size);
+}
+#endif
+
 static sqfs_compressor_t *lz4_create_copy(sqfs_compressor_t *cmp)
 {
 	lz4_compressor_t *lz4 = malloc(sizeof(*lz4));
@@ -107,12 +123,24 @@ static sqfs_compressor_t *lz4_create_copy(sqfs_compressor_t *cmp)
 		return NULL;
 
 	memcpy(lz4, cmp, sizeof(*lz4));
+
+	if (lz4->hc_state != NULL) {
+		lz4->hc_state = malloc(LZ4_sizeofStateHC());
+		if (lz4->hc_state == NULL) {
+			free(lz4);
+			return NULL;
+		}
+	}
+
 	return (sqfs_compressor_t *)lz4;
 }
 
 static void lz4_destroy(sqfs_compressor_t *base)
 {
-	free(base);
+	lz4_compressor_t *lz4 = (lz4_compressor_t *)base;
+
+	free(lz4->hc_state);
+	free(lz4);
 }
 
 sqfs_compressor_t *lz4_compressor_create(const sqfs_compressor_config_t *cfg)
@@ -125,12 +153,29 @@ sqfs_compressor_t *lz4_compressor_create(const sqfs_compressor_config_t *cfg)
 		return NULL;
 	}
 
+	if (cfg->opt.lz4.level != 0 &&
+	    (cfg->opt.lz4.level < SQFS_LZ4_MIN_LEVEL ||
+	     cfg->opt.lz4.level > SQFS_LZ4_MAX_LEVEL)) {
+		return NULL;
+	}
+
 	lz4 = calloc(1, sizeof(*lz4));
 	base = (sqfs_compressor_t *)lz4;
 	if (lz4 == NULL)
 		return NULL;
 
 	lz4->high_compression = (cfg->flags & SQFS_COMP_FLAG_LZ4_HC) != 0;
+	lz4->level = cfg->opt.lz4.level == 0 ?
+		SQFS_LZ4_DEFAULT_LEVEL : cfg->opt.lz4.level;
+
+	if (lz4->high_compression &&
+	    !(cfg->flags & SQFS_COMP_FLAG_UNCOMPRESS)) {
+		lz4->hc_state = malloc(LZ4_sizeofStateHC());
+		if (lz4->hc_state == NULL) {
+			free(lz4);
+			return NULL;
+		}
+	}
 
 	base->destroy = lz4_destroy;
 	base->do_block = (cfg->flags & SQFS_COMP_FLAG_UNCOMPRESS) ?
@@ -138,5 +183,9 @@ sqfs_compressor_t *lz4_compressor_create(const sqfs_compressor_config_t *cfg)
 	base->write_options = lz4_write_options;
 	base->read_options = lz4_read_options;
 	base->create_copy = lz4_create_copy;
+#ifdef LZ4_DECOMPRESS_INPLACE_MARGIN
+	if (cfg->flags & SQFS_COMP_FLAG_UNCOMPRESS)
+		base->inplace_margin = lz4_inplace_margin;
+#endif
 	return base;
 }
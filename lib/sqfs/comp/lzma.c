@@ -24,6 +24,11 @@
 typedef struct {
 	sqfs_compressor_t base;
 	size_t block_size;
+
+	/* persistent coder, reinitialized per block without reallocating */
+	comp_pool_t pool;
+	lzma_allocator alloc;
+	lzma_stream strm;
 } lzma_compressor_t;
 
 static int lzma_write_options(sqfs_compressor_t *base, sqfs_file_t *file)
@@ -43,33 +48,32 @@ static sqfs_s32 lzma_comp_block(sqfs_compressor_t *base, const sqfs_u8 *in,
 				sqfs_u32 size, sqfs_u8 *out, sqfs_u32 outsize)
 {
 	lzma_compressor_t *lzma = (lzma_compressor_t *)base;
-	lzma_stream strm = LZMA_STREAM_INIT;
+	lzma_stream *strm = &lzma->strm;
 	lzma_options_lzma opt;
 	int ret;
 
+	outsize = COMP_MAX_OUTPUT(size, outsize);
+
 	if (outsize < LZMA_HEADER_SIZE || size >= 0x7FFFFFFF)
 		return 0;
 
 	lzma_lzma_preset(&opt, LZMA_DEFAULT_LEVEL);
 	opt.dict_size = lzma->block_size;
 
-	if (lzma_alone_encoder(&strm, &opt) != LZMA_OK) {
-		lzma_end(&strm);
+	if (lzma_alone_encoder(strm, &opt) != LZMA_OK)
 		return SQFS_ERROR_COMPRESSOR;
-	}
 
-	strm.next_out = out;
-	strm.avail_out = outsize;
-	strm.next_in = in;
-	strm.avail_in = size;
+	strm->next_out = out;
+	strm->avail_out = outsize;
+	strm->next_in = in;
+	strm->avail_in = size;
 
-	ret = lzma_code(&strm, LZMA_FINISH);
-	lzma_end(&strm);
+	ret = lzma_code(strm, LZMA_FINISH);
 
 	if (ret != LZMA_STREAM_END)
 		return ret == LZMA_OK ? 0 : SQFS_ERROR_COMPRESSOR;
 
-	if (strm.total_out > size)
+	if (strm->total_out >= size)
 		return 0;
 
 	out[LZMA_SIZE_OFFSET    ] = size & 0xFF;
@@ -80,17 +84,17 @@ static sqfs_s32 lzma_comp_block(sqfs_compressor_t *base, const sqfs_u8 *in,
 	out[LZMA_SIZE_OFFSET + 5] = 0;
 	out[LZMA_SIZE_OFFSET + 6] = 0;
 	out[LZMA_SIZE_OFFSET + 7] = 0;
-	return strm.total_out;
+	return strm->total_out;
 }
 
 static sqfs_s32 lzma_uncomp_block(sqfs_compressor_t *base, const sqfs_u8 *in,
 				  sqfs_u32 size, sqfs_u8 *out, sqfs_u32 outsize)
 {
+	lzma_compressor_t *lzma = (lzma_compressor_t *)base;
 	sqfs_u8 lzma_header[LZMA_HEADER_SIZE];
-	lzma_stream strm = LZMA_STREAM_INIT;
+	lzma_stream *strm = &lzma->strm;
 	size_t hdrsize;
 	int ret;
-	(void)base;
 
 	if (size >= 0x7FFFFFFF)
 		return 0;
@@ -106,56 +110,71 @@ static sqfs_s32 lzma_uncomp_block(sqfs_compressor_t *base, const sqfs_u8 *in,
 	if (hdrsize > outsize)
 		return 0;
 
-	if (lzma_alone_decoder(&strm, MEMLIMIT) != LZMA_OK) {
-		lzma_end(&strm);
+	if (lzma_alone_decoder(strm, MEMLIMIT) != LZMA_OK)
 		return SQFS_ERROR_COMPRESSOR;
-	}
 
 	memcpy(lzma_header, in, sizeof(lzma_header));
 	memset(lzma_header + LZMA_SIZE_OFFSET, 0xFF, LZMA_SIZE_BYTES);
 
-	strm.next_out = out;
-	strm.avail_out = outsize;
-	strm.next_in = lzma_header;
-	strm.avail_in = sizeof(lzma_header);
+	strm->next_out = out;
+	strm->avail_out = outsize;
+	strm->next_in = lzma_header;
+	strm->avail_in = sizeof(lzma_header);
 
-	ret = lzma_code(&strm, LZMA_RUN);
+	ret = lzma_code(strm, LZMA_RUN);
 
-	if (ret != LZMA_OK || strm.avail_in != 0) {
-		lzma_end(&strm);
+	if (ret != LZMA_OK || strm->avail_in != 0)
 		return SQFS_ERROR_COMPRESSOR;
-	}
 
-	strm.next_in = in + sizeof(lzma_header);
-	strm.avail_in = size - sizeof(lzma_header);
+	strm->next_in = in + sizeof(lzma_header);
+	strm->avail_in = size - sizeof(lzma_header);
 
-	ret = lzma_code(&strm, LZMA_FINISH);
-	lzma_end(&strm);
+	ret = lzma_code(strm, LZMA_FINISH);
 
 	if (ret != LZMA_STREAM_END && ret != LZMA_OK)
 		return SQFS_ERROR_COMPRESSOR;
 
 	if (ret == LZMA_OK) {
-		if (strm.total_out < hdrsize || strm.avail_in != 0)
+		if (strm->total_out < hdrsize || strm->avail_in != 0)
 			return 0;
 	}
 
 	return hdrsize;
 }
 
+static void init_state(lzma_compressor_t *lzma,
+		       const sqfs_allocator_t *allocator)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+
+	comp_pool_init(&lzma->pool, allocator);
+	lzma->alloc.alloc = comp_pool_alloc;
+	lzma->alloc.free = comp_pool_free;
+	lzma->alloc.opaque = &lzma->pool;
+
+	lzma->strm = strm;
+	lzma->strm.allocator = &lzma->alloc;
+}
+
 static sqfs_compressor_t *lzma_create_copy(sqfs_compressor_t *cmp)
 {
 	lzma_compressor_t *copy = malloc(sizeof(*copy));
 
-	if (copy != NULL)
+	if (copy != NULL) {
 		memcpy(copy, cmp, sizeof(*copy));
+		init_state(copy, ((lzma_compressor_t *)cmp)->pool.allocator);
+	}
 
 	return (sqfs_compressor_t *)copy;
 }
 
 static void lzma_destroy(sqfs_compressor_t *base)
 {
-	free(base);
+	lzma_compressor_t *lzma = (lzma_compressor_t *)base;
+
+	lzma_end(&lzma->strm);
+	comp_pool_cleanup(&lzma->pool);
+	free(lzma);
 }
 
 sqfs_compressor_t *lzma_compressor_create(const sqfs_compressor_config_t *cfg)
@@ -171,6 +190,7 @@ sqfs_compressor_t *lzma_compressor_create(const sqfs_compressor_config_t *cfg)
 	if (lzma == NULL)
 		return NULL;
 
+	init_state(lzma, cfg->allocator);
 	lzma->block_size = cfg->block_size;
 
 	if (lzma->block_size < SQFS_META_BLOCK_SIZE)
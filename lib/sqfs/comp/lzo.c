@@ -122,6 +122,10 @@ static sqfs_s32 lzo_comp_block(sqfs_compressor_t *base, const sqfs_u8 *in,
 	if (size >= 0x7FFFFFFF)
 		return 0;
 
+	/*
+	  Unlike the other libraries, LZO does not check the output space
+	  and always runs to completion, the buffer must hold the worst case.
+	 */
 	if (lzo->algorithm == SQFS_LZO1X_999 &&
 	    lzo->level != SQFS_LZO_DEFAULT_LEVEL) {
 		ret = lzo1x_999_compress_level(in, size, out, &len,
@@ -159,6 +163,13 @@ static sqfs_s32 lzo_uncomp_block(sqfs_compressor_t *base, const sqfs_u8 *in,
 	return len;
 }
 
+/* worst case overlap for lzo1x, see overlap.c in the LZO examples */
+static sqfs_u32 lzo_inplace_margin(sqfs_compressor_t *base, sqfs_u32 size)
+{
+	(void)base;
+	return size / 16 + 64 + 3;
+}
+
 static sqfs_compressor_t *lzo_create_copy(sqfs_compressor_t *cmp)
 {
 	lzo_compressor_t *other = (lzo_compressor_t *)cmp;
@@ -213,5 +224,8 @@ sqfs_compressor_t *lzo_compressor_create(const sqfs_compressor_config_t *cfg)
 	base->write_options = lzo_write_options;
 	base->read_options = lzo_read_options;
 	base->create_copy = lzo_create_copy;
+
+	if (cfg->flags & SQFS_COMP_FLAG_UNCOMPRESS)
+		base->inplace_margin = lzo_inplace_margin;
 	return base;
 }
@@ -14,11 +14,39 @@
 
 #include "internal.h"
 
+#define MEMLIMIT (32 * 1024 * 1024)
+
+/* set in every hint returned by probe_file, the rest is a filter mask */
+#define HINT_VALID (0x10000)
+
+#define ELF_MACHINE_OFFSET (18)
+
+/* ELF e_machine values */
+#define EM_SPARC (2)
+#define EM_386 (3)
+#define EM_SPARC32PLUS (18)
+#define EM_PPC (20)
+#define EM_PPC64 (21)
+#define EM_ARM (40)
+#define EM_SPARCV9 (43)
+#define EM_IA_64 (50)
+#define EM_X86_64 (62)
+
 typedef struct {
 	sqfs_compressor_t base;
 	size_t block_size;
 	size_t dict_size;
 	int flags;
+
+	/* LZMA2 options from the preset, with dictionary size and nice_len */
+	lzma_options_lzma opt;
+
+	/* liblzma sets up its encoder from scratch for every block */
+	comp_pool_t pool;
+	lzma_allocator alloc;
+
+	/* persistent decoder, reinitialized per block without reallocating */
+	lzma_stream strm;
 } xz_compressor_t;
 
 typedef struct {
@@ -78,15 +106,12 @@ static sqfs_s32 compress(xz_compressor_t *xz, lzma_vli filter,
 			 const sqfs_u8 *in, sqfs_u32 size,
 			 sqfs_u8 *out, sqfs_u32 outsize)
 {
+	lzma_options_lzma opt = xz->opt;
 	lzma_filter filters[5];
-	lzma_options_lzma opt;
 	size_t written = 0;
 	lzma_ret ret;
 	int i = 0;
 
-	if (lzma_lzma_preset(&opt, LZMA_PRESET_DEFAULT))
-		return SQFS_ERROR_COMPRESSOR;
-
 	opt.dict_size = xz->dict_size;
 
 	if (filter != LZMA_VLI_UNKNOWN) {
@@ -103,7 +128,7 @@ static sqfs_s32 compress(xz_compressor_t *xz, lzma_vli filter,
 	filters[i].options = NULL;
 	++i;
 
-	ret = lzma_stream_buffer_encode(filters, LZMA_CHECK_CRC32, NULL,
+	ret = lzma_stream_buffer_encode(filters, LZMA_CHECK_CRC32, &xz->alloc,
 					in, size, out, &written, outsize);
 
 	if (ret == LZMA_OK)
@@ -140,62 +165,148 @@ static sqfs_s32 xz_comp_block(sqfs_compressor_t *base, const sqfs_u8 *in,
 {
 	xz_compressor_t *xz = (xz_compressor_t *)base;
 	lzma_vli filter, selected = LZMA_VLI_UNKNOWN;
+	int method = 0, filters = xz->flags;
 	sqfs_s32 ret, smallest;
+	bool done;
 	size_t i;
 
 	if (size >= 0x7FFFFFFF)
 		return 0;
 
+	outsize = COMP_MAX_OUTPUT(size, outsize);
+	base->method = 0;
+
+	if (base->method_hint & HINT_VALID)
+		filters &= base->method_hint;
+
 	ret = compress(xz, LZMA_VLI_UNKNOWN, in, size, out, outsize);
-	if (ret < 0 || xz->flags == 0)
+	if (ret < 0 || filters == 0)
 		return ret;
 
 	smallest = ret;
+	done = true;
 
+	/* a filter only wins if it is smaller, stop trials early otherwise */
 	for (i = 1; i & SQFS_COMP_FLAG_XZ_ALL; i <<= 1) {
-		if ((xz->flags & i) == 0)
+		if ((filters & i) == 0)
 			continue;
 
 		filter = flag_to_vli(i);
 
-		ret = compress(xz, filter, in, size, out, outsize);
+		ret = compress(xz, filter, in, size, out,
+			       smallest > 0 ? (sqfs_u32)smallest - 1 : outsize);
 		if (ret < 0)
 			return ret;
 
-		if (ret > 0 && (smallest == 0 || ret < smallest)) {
+		done = (ret > 0);
+
+		if (ret > 0) {
 			smallest = ret;
 			selected = filter;
+			method = i;
 		}
 	}
 
 	if (smallest == 0)
 		return 0;
 
+	base->method = method;
+
+	if (done)
+		return smallest;
+
 	return compress(xz, selected, in, size, out, outsize);
 }
 
+static sqfs_u32 xz_probe_file(sqfs_compressor_t *base, const sqfs_u8 *data,
+			      sqfs_u32 size)
+{
+	xz_compressor_t *xz = (xz_compressor_t *)base;
+	sqfs_u16 machine;
+	bool msb;
+	int mask;
+
+	if (size < ELF_MACHINE_OFFSET + 2 || memcmp(data, "\x7F" "ELF", 4))
+		return HINT_VALID;
+
+	msb = (data[5] == 2);
+
+	if (msb) {
+		machine = ((sqfs_u16)data[ELF_MACHINE_OFFSET] << 8) |
+			data[ELF_MACHINE_OFFSET + 1];
+	} else {
+		machine = ((sqfs_u16)data[ELF_MACHINE_OFFSET + 1] << 8) |
+			data[ELF_MACHINE_OFFSET];
+	}
+
+	switch (machine) {
+	case EM_386:
+	case EM_X86_64:
+		mask = SQFS_COMP_FLAG_XZ_X86;
+		break;
+	case EM_PPC:
+	case EM_PPC64:
+		/* the filter only handles big endian code */
+		mask = msb ? SQFS_COMP_FLAG_XZ_POWERPC : 0;
+		break;
+	case EM_IA_64:
+		mask = SQFS_COMP_FLAG_XZ_IA64;
+		break;
+	case EM_ARM:
+		mask = SQFS_COMP_FLAG_XZ_ARM | SQFS_COMP_FLAG_XZ_ARMTHUMB;
+		break;
+	case EM_SPARC:
+	case EM_SPARC32PLUS:
+	case EM_SPARCV9:
+		mask = SQFS_COMP_FLAG_XZ_SPARC;
+		break;
+	default:
+		mask = 0;
+		break;
+	}
+
+	return HINT_VALID | (mask & xz->flags);
+}
+
 static sqfs_s32 xz_uncomp_block(sqfs_compressor_t *base, const sqfs_u8 *in,
 				sqfs_u32 size, sqfs_u8 *out, sqfs_u32 outsize)
 {
-	sqfs_u64 memlimit = 32 * 1024 * 1024;
-	size_t dest_pos = 0;
-	size_t src_pos = 0;
+	xz_compressor_t *xz = (xz_compressor_t *)base;
+	lzma_stream *strm = &xz->strm;
 	lzma_ret ret;
-	(void)base;
 
 	if (outsize >= 0x7FFFFFFF)
 		return 0;
 
-	ret = lzma_stream_buffer_decode(&memlimit, 0, NULL,
-					in, &src_pos, size,
-					out, &dest_pos, outsize);
+	if (lzma_stream_decoder(strm, MEMLIMIT, 0) != LZMA_OK)
+		return SQFS_ERROR_COMPRESSOR;
+
+	strm->next_in = in;
+	strm->avail_in = size;
+	strm->next_out = out;
+	strm->avail_out = outsize;
 
-	if (ret == LZMA_OK && size == src_pos)
-		return dest_pos;
+	ret = lzma_code(strm, LZMA_FINISH);
+
+	if (ret == LZMA_STREAM_END && strm->avail_in == 0)
+		return strm->total_out;
 
 	return SQFS_ERROR_COMPRESSOR;
 }
 
+static void init_state(xz_compressor_t *xz, const sqfs_allocator_t *allocator)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+
+	comp_pool_init(&xz->pool, allocator);
+	xz->alloc.alloc = comp_pool_alloc;
+	xz->alloc.free = comp_pool_free;
+	xz->alloc.opaque = &xz->pool;
+
+	xz->strm = strm;
+	xz->strm.allocator = &xz->alloc;
+}
+
 static sqfs_compressor_t *xz_create_copy(sqfs_compressor_t *cmp)
 {
 	xz_compressor_t *xz = malloc(sizeof(*xz));
@@ -204,12 +315,17 @@ static sqfs_compressor_t *xz_create_copy(sqfs_compressor_t *cmp)
 		return NULL;
 
 	memcpy(xz, cmp, sizeof(*xz));
+	init_state(xz, ((xz_compressor_t *)cmp)->pool.allocator);
 	return (sqfs_compressor_t *)xz;
 }
 
 static void xz_destroy(sqfs_compressor_t *base)
 {
-	free(base);
+	xz_compressor_t *xz = (xz_compressor_t *)base;
+
+	lzma_end(&xz->strm);
+	comp_pool_cleanup(&xz->pool);
+	free(xz);
 }
 
 sqfs_compressor_t *xz_compressor_create(const sqfs_compressor_config_t *cfg)
@@ -218,19 +334,39 @@ sqfs_compressor_t *xz_compressor_create(const sqfs_compressor_config_t *cfg)
 	xz_compressor_t *xz;
 
 	if (cfg->flags & ~(SQFS_COMP_FLAG_GENERIC_ALL |
-			   SQFS_COMP_FLAG_XZ_ALL)) {
+			   SQFS_COMP_FLAG_XZ_ALL |
+			   SQFS_COMP_FLAG_XZ_DETECT)) {
 		return NULL;
 	}
 
 	if (!is_dict_size_valid(cfg->opt.xz.dict_size))
 		return NULL;
 
+	if (cfg->opt.xz.level > SQFS_XZ_MAX_LEVEL)
+		return NULL;
+
+	if (cfg->opt.xz.nice_len != 0 &&
+	    (cfg->opt.xz.nice_len < SQFS_XZ_MIN_NICE_LEN ||
+	     cfg->opt.xz.nice_len > SQFS_XZ_MAX_NICE_LEN)) {
+		return NULL;
+	}
+
 	xz = calloc(1, sizeof(*xz));
 	base = (sqfs_compressor_t *)xz;
 	if (xz == NULL)
 		return NULL;
 
-	xz->flags = cfg->flags;
+	if (lzma_lzma_preset(&xz->opt, cfg->opt.xz.level == 0 ?
+			     SQFS_XZ_DEFAULT_LEVEL : cfg->opt.xz.level)) {
+		free(xz);
+		return NULL;
+	}
+
+	if (cfg->opt.xz.nice_len != 0)
+		xz->opt.nice_len = cfg->opt.xz.nice_len;
+
+	init_state(xz, cfg->allocator);
+	xz->flags = cfg->flags & SQFS_COMP_FLAG_XZ_ALL;
 	xz->dict_size = cfg->opt.xz.dict_size;
 	xz->block_size = cfg->block_size;
 	base->destroy = xz_destroy;
@@ -239,5 +375,8 @@ sqfs_compressor_t *xz_compressor_create(const sqfs_compressor_config_t *cfg)
 	base->write_options = xz_write_options;
 	base->read_options = xz_read_options;
 	base->create_copy = xz_create_copy;
+
+	if (cfg->flags & SQFS_COMP_FLAG_XZ_DETECT)
+		base->probe_file = xz_probe_file;
 	return base;
 }
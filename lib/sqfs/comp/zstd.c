@@ -12,24 +12,143 @@
 #include <string.h>
 
 #include <zstd.h>
+#include <zstd_errors.h>
+#include <zdict.h>
 
 #include "internal.h"
 
 typedef struct {
 	sqfs_compressor_t base;
 	ZSTD_CCtx *zctx;
+	ZSTD_DCtx *dctx;
 	int level;
+
+	/*
+	  Tuning beyond the level. If any is set, the parameters are stored
+	  in the context and every block is compressed with ZSTD_compress2.
+	 */
+	bool advanced;
+	int window_log;
+	int target_length;
+	bool ldm;
+
+	/* optional dictionary, stored in the compressor options */
+	void *dict;
+	size_t dict_size;
+	ZSTD_CDict *cdict;
+	ZSTD_DDict *ddict;
 } zstd_compressor_t;
 
 typedef struct {
 	sqfs_u32 level;
 } zstd_options_t;
 
+/* if a dictionary is used, the options are followed by it */
+typedef struct {
+	sqfs_u32 level;
+	sqfs_u32 dict_size;
+} zstd_options_dict_t;
+
+static void drop_dict(zstd_compressor_t *zstd)
+{
+	ZSTD_freeCDict(zstd->cdict);
+	ZSTD_freeDDict(zstd->ddict);
+	free(zstd->dict);
+
+	zstd->cdict = NULL;
+	zstd->ddict = NULL;
+	zstd->dict = NULL;
+	zstd->dict_size = 0;
+}
+
+static int set_dict(zstd_compressor_t *zstd, const void *dict, size_t size)
+{
+	drop_dict(zstd);
+
+	zstd->dict = malloc(size);
+	if (zstd->dict == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	memcpy(zstd->dict, dict, size);
+	zstd->dict_size = size;
+
+	if (zstd->zctx != NULL) {
+		zstd->cdict = ZSTD_createCDict(zstd->dict, size, zstd->level);
+		if (zstd->cdict == NULL)
+			goto fail;
+	} else {
+		zstd->ddict = ZSTD_createDDict(zstd->dict, size);
+		if (zstd->ddict == NULL)
+			goto fail;
+	}
+
+	return 0;
+fail:
+	drop_dict(zstd);
+	return SQFS_ERROR_ALLOC;
+}
+
+#if ZSTD_VERSION_NUMBER >= 10400
+static int setup_cctx(zstd_compressor_t *zstd)
+{
+	ZSTD_CCtx *ctx = zstd->zctx;
+
+	if (!zstd->advanced)
+		return 0;
+
+	if (ZSTD_isError(ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel,
+						zstd->level))) {
+		return -1;
+	}
+
+	if (ZSTD_isError(ZSTD_CCtx_setParameter(ctx, ZSTD_c_windowLog,
+						zstd->window_log))) {
+		return -1;
+	}
+
+	if (ZSTD_isError(ZSTD_CCtx_setParameter(ctx, ZSTD_c_targetLength,
+						zstd->target_length))) {
+		return -1;
+	}
+
+	if (ZSTD_isError(ZSTD_CCtx_setParameter(ctx,
+					ZSTD_c_enableLongDistanceMatching,
+					zstd->ldm ? 1 : 0))) {
+		return -1;
+	}
+
+	if (zstd->cdict != NULL &&
+	    ZSTD_isError(ZSTD_CCtx_refCDict(ctx, zstd->cdict))) {
+		return -1;
+	}
+
+	return 0;
+}
+#else
+static int setup_cctx(zstd_compressor_t *zstd)
+{
+	return zstd->advanced ? -1 : 0;
+}
+#endif
+
 static int zstd_write_options(sqfs_compressor_t *base, sqfs_file_t *file)
 {
 	zstd_compressor_t *zstd = (zstd_compressor_t *)base;
+	sqfs_u8 buffer[sizeof(zstd_options_dict_t) + SQFS_ZSTD_MAX_DICT_SIZE];
+	zstd_options_dict_t dopt;
 	zstd_options_t opt;
 
+	if (zstd->dict != NULL) {
+		dopt.level = htole32(zstd->level);
+		dopt.dict_size = htole32(zstd->dict_size);
+
+		memcpy(buffer, &dopt, sizeof(dopt));
+		memcpy(buffer + sizeof(dopt), zstd->dict, zstd->dict_size);
+
+		return sqfs_generic_write_options(file, buffer, sizeof(dopt) +
+						  zstd->dict_size);
+	}
+
 	if (zstd->level == SQFS_ZSTD_DEFAULT_LEVEL)
 		return 0;
 
@@ -39,16 +158,45 @@ static int zstd_write_options(sqfs_compressor_t *base, sqfs_file_t *file)
 
 static int zstd_read_options(sqfs_compressor_t *base, sqfs_file_t *file)
 {
-	zstd_options_t opt;
+	zstd_compressor_t *zstd = (zstd_compressor_t *)base;
+	sqfs_u8 buffer[sizeof(zstd_options_dict_t) + SQFS_ZSTD_MAX_DICT_SIZE];
+	zstd_options_dict_t dopt;
+	sqfs_u16 header;
+	size_t size;
 	int ret;
-	(void)base;
 
-	ret = sqfs_generic_read_options(file, &opt, sizeof(opt));
+	ret = file->read_at(file, sizeof(sqfs_super_t),
+			    &header, sizeof(header));
 	if (ret)
 		return ret;
 
-	opt.level = le32toh(opt.level);
-	return 0;
+	header = le16toh(header);
+	size = header & 0x7FFF;
+
+	if (!(header & 0x8000) || size > sizeof(buffer))
+		return SQFS_ERROR_CORRUPTED;
+
+	if (size == sizeof(zstd_options_t))
+		return 0;
+
+	if (size <= sizeof(dopt))
+		return SQFS_ERROR_CORRUPTED;
+
+	ret = sqfs_generic_read_options(file, buffer, size);
+	if (ret)
+		return ret;
+
+	memcpy(&dopt, buffer, sizeof(dopt));
+	dopt.level = le32toh(dopt.level);
+	dopt.dict_size = le32toh(dopt.dict_size);
+
+	if (dopt.dict_size != size - sizeof(dopt))
+		return SQFS_ERROR_CORRUPTED;
+
+	if (dopt.level >= 1 && dopt.level <= (sqfs_u32)ZSTD_maxCLevel())
+		zstd->level = dopt.level;
+
+	return set_dict(zstd, buffer + sizeof(dopt), dopt.dict_size);
 }
 
 static sqfs_s32 zstd_comp_block(sqfs_compressor_t *base, const sqfs_u8 *in,
@@ -60,8 +208,26 @@ static sqfs_s32 zstd_comp_block(sqfs_compressor_t *base, const sqfs_u8 *in,
 	if (size >= 0x7FFFFFFF)
 		return 0;
 
-	ret = ZSTD_compressCCtx(zstd->zctx, out, outsize, in, size,
-				zstd->level);
+	outsize = COMP_MAX_OUTPUT(size, outsize);
+
+#if ZSTD_VERSION_NUMBER >= 10400
+	if (zstd->advanced) {
+		ret = ZSTD_compress2(zstd->zctx, out, outsize, in, size);
+	} else
+#endif
+	if (zstd->cdict != NULL) {
+		ret = ZSTD_compress_usingCDict(zstd->zctx, out, outsize,
+					       in, size, zstd->cdict);
+	} else {
+		ret = ZSTD_compressCCtx(zstd->zctx, out, outsize, in, size,
+					zstd->level);
+	}
+
+	/* the data does not fit, i.e. it has to be stored uncompressed */
+	if (ZSTD_isError(ret) &&
+	    ZSTD_getErrorCode(ret) == ZSTD_error_dstSize_tooSmall) {
+		return 0;
+	}
 
 	if (ZSTD_isError(ret))
 		return SQFS_ERROR_COMPRESSOR;
@@ -72,13 +238,18 @@ static sqfs_s32 zstd_comp_block(sqfs_compressor_t *base, const sqfs_u8 *in,
 static sqfs_s32 zstd_uncomp_block(sqfs_compressor_t *base, const sqfs_u8 *in,
 				  sqfs_u32 size, sqfs_u8 *out, sqfs_u32 outsize)
 {
+	zstd_compressor_t *zstd = (zstd_compressor_t *)base;
 	size_t ret;
-	(void)base;
 
 	if (outsize >= 0x7FFFFFFF)
 		return 0;
 
-	ret = ZSTD_decompress(out, outsize, in, size);
+	if (zstd->ddict != NULL) {
+		ret = ZSTD_decompress_usingDDict(zstd->dctx, out, outsize,
+						 in, size, zstd->ddict);
+	} else {
+		ret = ZSTD_decompressDCtx(zstd->dctx, out, outsize, in, size);
+	}
 
 	if (ZSTD_isError(ret))
 		return SQFS_ERROR_COMPRESSOR;
@@ -89,27 +260,53 @@ static sqfs_s32 zstd_uncomp_block(sqfs_compressor_t *base, const sqfs_u8 *in,
 static sqfs_compressor_t *zstd_create_copy(sqfs_compressor_t *cmp)
 {
 	zstd_compressor_t *zstd = malloc(sizeof(*zstd));
+	zstd_compressor_t *orig = (zstd_compressor_t *)cmp;
 
 	if (zstd == NULL)
 		return NULL;
 
 	memcpy(zstd, cmp, sizeof(*zstd));
+	zstd->dict = NULL;
+	zstd->dict_size = 0;
+	zstd->cdict = NULL;
+	zstd->dctx = NULL;
+	zstd->ddict = NULL;
+	zstd->zctx = NULL;
+
+	if (orig->zctx != NULL) {
+		zstd->zctx = ZSTD_createCCtx();
+		if (zstd->zctx == NULL)
+			goto fail;
+	} else {
+		zstd->dctx = ZSTD_createDCtx();
+		if (zstd->dctx == NULL)
+			goto fail;
+	}
 
-	zstd->zctx = ZSTD_createCCtx();
-
-	if (zstd->zctx == NULL) {
-		free(zstd);
-		return NULL;
+	if (orig->dict != NULL &&
+	    set_dict(zstd, orig->dict, orig->dict_size) != 0) {
+		goto fail;
 	}
 
+	if (zstd->zctx != NULL && setup_cctx(zstd))
+		goto fail;
+
 	return (sqfs_compressor_t *)zstd;
+fail:
+	drop_dict(zstd);
+	ZSTD_freeCCtx(zstd->zctx);
+	ZSTD_freeDCtx(zstd->dctx);
+	free(zstd);
+	return NULL;
 }
 
 static void zstd_destroy(sqfs_compressor_t *base)
 {
 	zstd_compressor_t *zstd = (zstd_compressor_t *)base;
 
+	drop_dict(zstd);
 	ZSTD_freeCCtx(zstd->zctx);
+	ZSTD_freeDCtx(zstd->dctx);
 	free(zstd);
 }
 
@@ -118,21 +315,44 @@ sqfs_compressor_t *zstd_compressor_create(const sqfs_compressor_config_t *cfg)
 	zstd_compressor_t *zstd;
 	sqfs_compressor_t *base;
 
-	if (cfg->flags & ~SQFS_COMP_FLAG_GENERIC_ALL)
+	if (cfg->flags & ~(SQFS_COMP_FLAG_ZSTD_ALL |
+			   SQFS_COMP_FLAG_ZSTD_LDM |
+			   SQFS_COMP_FLAG_GENERIC_ALL)) {
 		return NULL;
+	}
 
 	if (cfg->opt.zstd.level < 1 ||
 	    cfg->opt.zstd.level > ZSTD_maxCLevel()) {
 		return NULL;
 	}
 
+	if (cfg->flags & SQFS_COMP_FLAG_ZSTD_DICT) {
+		if (cfg->opt.zstd.dict == NULL ||
+		    cfg->opt.zstd.dict_size < 1 ||
+		    cfg->opt.zstd.dict_size > SQFS_ZSTD_MAX_DICT_SIZE) {
+			return NULL;
+		}
+	}
+
 	zstd = calloc(1, sizeof(*zstd));
 	base = (sqfs_compressor_t *)zstd;
 	if (zstd == NULL)
 		return NULL;
 
-	zstd->zctx = ZSTD_createCCtx();
-	if (zstd->zctx == NULL) {
+	zstd->level = cfg->opt.zstd.level;
+	zstd->window_log = cfg->opt.zstd.window_log;
+	zstd->target_length = cfg->opt.zstd.target_length;
+	zstd->ldm = (cfg->flags & SQFS_COMP_FLAG_ZSTD_LDM) != 0;
+	zstd->advanced = zstd->window_log != 0 || zstd->target_length != 0 ||
+			 zstd->ldm;
+
+	if (cfg->flags & SQFS_COMP_FLAG_UNCOMPRESS) {
+		zstd->dctx = ZSTD_createDCtx();
+	} else {
+		zstd->zctx = ZSTD_createCCtx();
+	}
+
+	if (zstd->zctx == NULL && zstd->dctx == NULL) {
 		free(zstd);
 		return NULL;
 	}
@@ -143,5 +363,35 @@ sqfs_compressor_t *zstd_compressor_create(const sqfs_compressor_config_t *cfg)
 	base->write_options = zstd_write_options;
 	base->read_options = zstd_read_options;
 	base->create_copy = zstd_create_copy;
+
+	if ((cfg->flags & SQFS_COMP_FLAG_ZSTD_DICT) &&
+	    set_dict(zstd, cfg->opt.zstd.dict, cfg->opt.zstd.dict_size)) {
+		zstd_destroy(base);
+		return NULL;
+	}
+
+	if (zstd->zctx != NULL && setup_cctx(zstd)) {
+		zstd_destroy(base);
+		return NULL;
+	}
+
 	return base;
 }
+
+int zstd_train_dict(const void *samples, const size_t *sample_sizes,
+		    size_t num_samples, void *dict, size_t *dict_size)
+{
+	size_t ret;
+
+	if (num_samples > 0xFFFFFFFF)
+		num_samples = 0xFFFFFFFF;
+
+	ret = ZDICT_trainFromBuffer(dict, *dict_size, samples, sample_sizes,
+				    num_samples);
+
+	if (ZDICT_isError(ret))
+		return SQFS_ERROR_COMPRESSOR;
+
+	*dict_size = ret;
+	return 0;
+}
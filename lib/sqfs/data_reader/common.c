@@ -0,0 +1,1269 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * common.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#define SQFS_BUILDING_DLL
+#include "internal.h"
+
+/*
+  Read and uncompress a block into a buffer of buf_size bytes. If it has
+  room for the in place margin behind out_size, the compressed data is
+  read into its end instead of the scratch buffer.
+ */
+static int read_block(sqfs_data_reader_t *data, sqfs_u64 off, sqfs_u32 size,
+		      void *out, size_t out_size, size_t buf_size)
+{
+	const void *src = data->scratch;
+	sqfs_u32 on_disk_size;
+	sqfs_s32 ret;
+	int err;
+
+	if (SQFS_IS_SPARSE_BLOCK(size)) {
+		memset(out, 0, out_size);
+		return 0;
+	}
+
+	on_disk_size = SQFS_ON_DISK_BLOCK_SIZE(size);
+
+	if (on_disk_size > out_size)
+		return SQFS_ERROR_OVERFLOW;
+
+	if (data->file->map_at != NULL) {
+		err = data->file->map_at(data->file, off, on_disk_size, &src);
+		if (err)
+			return err;
+
+		if (!SQFS_IS_BLOCK_COMPRESSED(size)) {
+			memcpy(out, src, on_disk_size);
+			return 0;
+		}
+	}
+
+	if (SQFS_IS_BLOCK_COMPRESSED(size)) {
+		if (src == data->scratch) {
+			if (data->inplace &&
+			    buf_size - out_size >= data->inplace_margin) {
+				src = (sqfs_u8 *)out + buf_size - on_disk_size;
+			}
+
+			err = data->file->read_at(data->file, off,
+						  (void *)src, on_disk_size);
+			if (err)
+				return err;
+		}
+
+		sqfs_trace_begin("data_reader", "uncompress block");
+		ret = data->cmp->do_block(data->cmp, src,
+					  on_disk_size, out, out_size);
+		sqfs_trace_end("data_reader", "uncompress block");
+		if (ret <= 0)
+			err = ret < 0 ? ret : SQFS_ERROR_OVERFLOW;
+	} else {
+		err = data->file->read_at(data->file, off, out, on_disk_size);
+	}
+
+	return err;
+}
+
+static int get_block(sqfs_data_reader_t *data, sqfs_u64 off, sqfs_u32 size,
+		     size_t unpacked_size, sqfs_block_t **out)
+{
+	size_t buf_size = unpacked_size + data->inplace_margin;
+	sqfs_block_t *blk = alloc_flex(sizeof(*blk), 1, buf_size);
+	int err;
+
+	if (blk == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	blk->size = unpacked_size;
+
+	err = read_block(data, off, size, blk->data, blk->size, buf_size);
+	if (err) {
+		free(blk);
+		return err;
+	}
+
+	*out = blk;
+	return 0;
+}
+
+#ifdef WITH_PTHREAD
+#define LOCK(mtx) pthread_mutex_lock(mtx)
+#define UNLOCK(mtx) pthread_mutex_unlock(mtx)
+#else
+#define LOCK(mtx)
+#define UNLOCK(mtx)
+#endif
+
+static sqfs_u64 cache_hash(sqfs_u64 location)
+{
+	return location * 0x9E3779B97F4A7C15ULL;
+}
+
+static cache_shard_t *get_shard(data_reader_shared_t *shared,
+				sqfs_u64 location)
+{
+	return shared->shards +
+		((cache_hash(location) >> 56) & (shared->num_shards - 1));
+}
+
+static cache_ent_t **get_bucket(cache_shard_t *shard, sqfs_u64 location)
+{
+	return shard->table + ((cache_hash(location) >> 24) & shard->mask);
+}
+
+static void lru_unlink(cache_shard_t *shard, cache_ent_t *ent)
+{
+	if (ent->lru_prev == NULL) {
+		shard->lru_first = ent->lru_next;
+	} else {
+		ent->lru_prev->lru_next = ent->lru_next;
+	}
+
+	if (ent->lru_next == NULL) {
+		shard->lru_last = ent->lru_prev;
+	} else {
+		ent->lru_next->lru_prev = ent->lru_prev;
+	}
+
+	ent->lru_prev = ent->lru_next = NULL;
+}
+
+static void lru_push_front(cache_shard_t *shard, cache_ent_t *ent)
+{
+	ent->lru_prev = NULL;
+	ent->lru_next = shard->lru_first;
+
+	if (shard->lru_first == NULL) {
+		shard->lru_last = ent;
+	} else {
+		shard->lru_first->lru_prev = ent;
+	}
+
+	shard->lru_first = ent;
+}
+
+static cache_ent_t *cache_find(cache_shard_t *shard, sqfs_u64 location)
+{
+	cache_ent_t *ent = *get_bucket(shard, location);
+
+	while (ent != NULL && ent->location != location)
+		ent = ent->next;
+
+	return ent;
+}
+
+static const sqfs_allocator_t *shared_alloc(data_reader_shared_t *shared)
+{
+	if (shared->huge_pool == NULL)
+		return NULL;
+
+	return huge_pool_allocator(shared->huge_pool);
+}
+
+const sqfs_allocator_t *data_reader_allocator(const sqfs_data_reader_t *data)
+{
+	return shared_alloc(data->shared);
+}
+
+static void free_entry(data_reader_shared_t *shared, cache_ent_t *ent)
+{
+	hook_free(shared_alloc(shared), ent->blk);
+	free(ent);
+}
+
+/* called with the shard lock held */
+static void put_entry(data_reader_shared_t *shared, cache_shard_t *shard,
+		      cache_ent_t *ent)
+{
+	ent->refs -= 1;
+	if (ent->refs > 0)
+		return;
+
+	if (shard->spare == NULL) {
+		shard->spare = ent;
+	} else {
+		free_entry(shared, ent);
+	}
+}
+
+/* called with the shard lock held */
+static void cache_remove(data_reader_shared_t *shared, cache_shard_t *shard,
+			 cache_ent_t *ent)
+{
+	cache_ent_t **it = get_bucket(shard, ent->location);
+
+	while (*it != ent)
+		it = &(*it)->next;
+
+	*it = ent->next;
+	lru_unlink(shard, ent);
+	shard->count -= 1;
+	ent->cached = false;
+	put_entry(shared, shard, ent);
+}
+
+static void cache_clear(data_reader_shared_t *shared)
+{
+	cache_shard_t *shard;
+	size_t i;
+
+	for (i = 0; i <= shared->num_shards; ++i) {
+		shard = shared->shards + i;
+
+		LOCK(&shard->mtx);
+		while (shard->lru_first != NULL)
+			cache_remove(shared, shard, shard->lru_first);
+
+		if (shard->spare != NULL) {
+			free_entry(shared, shard->spare);
+			shard->spare = NULL;
+		}
+		UNLOCK(&shard->mtx);
+	}
+}
+
+static bool cache_contains(sqfs_data_reader_t *data, sqfs_u64 location)
+{
+	cache_shard_t *shard = get_shard(data->shared, location);
+	bool ret;
+
+	LOCK(&shard->mtx);
+	ret = cache_find(shard, location) != NULL;
+	UNLOCK(&shard->mtx);
+
+	return ret;
+}
+
+static void release_held(sqfs_data_reader_t *data)
+{
+	cache_shard_t *shard;
+
+	if (data->held != NULL) {
+		shard = data->held->shard;
+
+		LOCK(&shard->mtx);
+		put_entry(data->shared, shard, data->held);
+		UNLOCK(&shard->mtx);
+
+		data->held = NULL;
+	}
+}
+
+/*
+  Get a decompressed block from the cache, reading it in if it isn't
+  there. If the cache is full, the least recently used entry is thrown out
+  and its buffer is recycled for the next block read in. The block is held
+  by the reader handle until the next call.
+
+  The lock is not held while reading and decompressing. If two handles miss
+  on the same block at the same time, the one that comes in second throws
+  its copy away.
+ */
+static int cache_get(sqfs_data_reader_t *data, cache_shard_t *shard,
+		     sqfs_u64 key, sqfs_u64 location, sqfs_u32 size,
+		     sqfs_block_t **out)
+{
+	cache_ent_t *ent, *other, **bucket;
+	bool found = false;
+	int err = 0;
+
+	release_held(data);
+
+	LOCK(&shard->mtx);
+	ent = cache_find(shard, key);
+
+	if (ent != NULL) {
+		if (ent != shard->lru_first) {
+			lru_unlink(shard, ent);
+			lru_push_front(shard, ent);
+		}
+
+		ent->refs += 1;
+		UNLOCK(&shard->mtx);
+		goto out;
+	}
+
+	ent = shard->spare;
+	shard->spare = NULL;
+	UNLOCK(&shard->mtx);
+
+	if (ent == NULL) {
+		ent = calloc(1, sizeof(*ent));
+		if (ent == NULL)
+			return SQFS_ERROR_ALLOC;
+
+		ent->blk = hook_alloc_flex(data_reader_allocator(data),
+					   sizeof(*ent->blk), 1,
+					   data->block_size +
+					   data->inplace_margin);
+		if (ent->blk == NULL) {
+			free(ent);
+			return SQFS_ERROR_ALLOC;
+		}
+	}
+
+	if (data->ra != NULL)
+		err = data_reader_ra_take(data, location, &ent->blk, &found);
+
+	ent->blk->size = data->block_size;
+
+	if (err == 0 && !found)
+		err = read_block(data, location, size,
+				 ent->blk->data, ent->blk->size,
+				 data->block_size + data->inplace_margin);
+
+	if (err) {
+		free_entry(data->shared, ent);
+		return err;
+	}
+
+	ent->location = key;
+	ent->shard = shard;
+	ent->refs = 2;
+	ent->cached = true;
+
+	LOCK(&shard->mtx);
+	other = cache_find(shard, key);
+
+	if (other != NULL) {
+		ent->refs = 1;
+		put_entry(data->shared, shard, ent);
+		other->refs += 1;
+		ent = other;
+	} else {
+		bucket = get_bucket(shard, key);
+		ent->next = *bucket;
+		*bucket = ent;
+		shard->count += 1;
+		lru_push_front(shard, ent);
+
+		while (shard->count > shard->max)
+			cache_remove(data->shared, shard, shard->lru_last);
+	}
+	UNLOCK(&shard->mtx);
+out:
+	data->held = ent;
+	*out = ent->blk;
+	return 0;
+}
+
+static int get_block_offsets(sqfs_data_reader_t *data,
+			     const sqfs_inode_generic_t *inode,
+			     const sqfs_u64 **out)
+{
+	size_t i, count = inode->num_file_blocks;
+	sqfs_u64 *new, start;
+
+	sqfs_inode_get_file_block_start(inode, &start);
+
+	if (data->offsets != NULL && data->offsets_sizes == inode->block_sizes &&
+	    data->offsets_count == count && data->offsets_start == start) {
+		*out = data->offsets;
+		return 0;
+	}
+
+	if (count >= data->offsets_max) {
+		new = alloc_array(sizeof(new[0]), count + 1);
+		if (new == NULL)
+			return SQFS_ERROR_ALLOC;
+
+		free(data->offsets);
+		data->offsets = new;
+		data->offsets_max = count + 1;
+	}
+
+	data->offsets[0] = start;
+
+	for (i = 0; i < count; ++i) {
+		data->offsets[i + 1] = data->offsets[i] +
+			SQFS_ON_DISK_BLOCK_SIZE(inode->block_sizes[i]);
+	}
+
+	data->offsets_sizes = inode->block_sizes;
+	data->offsets_count = count;
+	data->offsets_start = start;
+
+	*out = data->offsets;
+	return 0;
+}
+
+static int get_data_block(sqfs_data_reader_t *data,
+			  const sqfs_inode_generic_t *inode,
+			  const sqfs_u64 *offsets, size_t index,
+			  sqfs_block_t **out)
+{
+	int ret;
+
+	ret = cache_get(data, get_shard(data->shared, offsets[index]),
+			offsets[index], offsets[index],
+			inode->block_sizes[index], out);
+	if (ret)
+		return ret;
+
+	if (data->ra != NULL)
+		data_reader_ra_schedule(data, inode, offsets, index);
+
+	return 0;
+}
+
+static int get_fragment_entry(sqfs_data_reader_t *data, size_t idx,
+			      sqfs_fragment_t *ent)
+{
+	data_reader_shared_t *shared = data->shared;
+	void *ptr;
+	int ret;
+
+	if (idx >= shared->num_fragments)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	if (shared->frag_is_lazy) {
+		LOCK(&shared->mtx);
+		ret = lazy_table_get(&shared->frag_lazy, data->file, data->cmp,
+				     idx * sizeof(*ent), &ptr);
+		if (ret == 0)
+			memcpy(ent, ptr, sizeof(*ent));
+		UNLOCK(&shared->mtx);
+
+		if (ret)
+			return ret;
+
+		ent->size = le32toh(ent->size);
+		ent->start_offset = le64toh(ent->start_offset);
+	} else {
+		*ent = shared->frag[idx];
+	}
+
+	return 0;
+}
+
+static int get_fragment_block(sqfs_data_reader_t *data, size_t idx,
+			      sqfs_block_t **out)
+{
+	sqfs_fragment_t ent;
+	int ret;
+
+	ret = get_fragment_entry(data, idx, &ent);
+	if (ret)
+		return ret;
+
+	return cache_get(data, data->shared->frag_cache, idx,
+			 ent.start_offset, ent.size, out);
+}
+
+int sqfs_data_reader_get_fragment_entry(sqfs_data_reader_t *data,
+					sqfs_u32 index, sqfs_fragment_t *out)
+{
+	return get_fragment_entry(data, index, out);
+}
+
+bool data_reader_fragment_location(sqfs_data_reader_t *data, sqfs_u32 idx,
+				   sqfs_u64 *location, sqfs_u32 *size)
+{
+	cache_shard_t *shard = data->shared->frag_cache;
+	sqfs_fragment_t ent;
+	bool cached;
+
+	if (get_fragment_entry(data, idx, &ent))
+		return false;
+
+	LOCK(&shard->mtx);
+	cached = cache_find(shard, idx) != NULL;
+	UNLOCK(&shard->mtx);
+
+	*location = ent.start_offset;
+	*size = ent.size;
+	return !cached;
+}
+
+static data_reader_shared_t *create_shared(size_t block_size,
+					   size_t cache_size)
+{
+	size_t i, count, shards = 1, per_shard, buckets, max;
+	data_reader_shared_t *shared;
+
+	count = block_size > 0 ? cache_size / block_size : 0;
+	if (count < MIN_CACHED_BLOCKS)
+		count = MIN_CACHED_BLOCKS;
+
+#ifdef WITH_PTHREAD
+	while (shards < MAX_CACHE_SHARDS &&
+	       count / (shards * 2) >= MIN_CACHED_BLOCKS) {
+		shards *= 2;
+	}
+#endif
+	per_shard = count / shards;
+
+	shared = alloc_flex(sizeof(*shared), sizeof(shared->shards[0]),
+			    shards + 1);
+	if (shared == NULL)
+		return NULL;
+
+	for (i = 0; i <= shards; ++i) {
+		max = (i < shards) ? per_shard : FRAG_CACHE_BLOCKS;
+
+		for (buckets = 1; buckets < max; buckets *= 2)
+			;
+
+		shared->shards[i].table =
+			alloc_array(sizeof(shared->shards[i].table[0]),
+				    buckets);
+
+		if (shared->shards[i].table == NULL)
+			goto fail;
+
+#ifdef WITH_PTHREAD
+		shared->shards[i].mtx =
+			(pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+#endif
+		shared->shards[i].mask = buckets - 1;
+		shared->shards[i].max = max;
+	}
+
+#ifdef WITH_PTHREAD
+	shared->mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+#endif
+	shared->num_shards = shards;
+	shared->frag_cache = shared->shards + shards;
+	shared->refs = 1;
+	return shared;
+fail:
+	for (i = 0; i <= shards; ++i)
+		free(shared->shards[i].table);
+	free(shared);
+	return NULL;
+}
+
+static void shared_unref(data_reader_shared_t *shared)
+{
+	bool last;
+	size_t i;
+
+	LOCK(&shared->mtx);
+	shared->refs -= 1;
+	last = (shared->refs == 0);
+	UNLOCK(&shared->mtx);
+
+	if (!last)
+		return;
+
+	cache_clear(shared);
+
+	for (i = 0; i <= shared->num_shards; ++i) {
+#ifdef WITH_PTHREAD
+		pthread_mutex_destroy(&shared->shards[i].mtx);
+#endif
+		free(shared->shards[i].table);
+	}
+
+#ifdef WITH_PTHREAD
+	pthread_mutex_destroy(&shared->mtx);
+#endif
+	if (shared->frag_is_lazy)
+		lazy_table_cleanup(&shared->frag_lazy);
+	huge_pool_destroy(shared->huge_pool);
+	free(shared->frag);
+	free(shared);
+}
+
+sqfs_data_reader_t *sqfs_data_reader_create(sqfs_file_t *file,
+					    size_t block_size,
+					    sqfs_compressor_t *cmp,
+					    size_t cache_size)
+{
+	sqfs_data_reader_t *data = alloc_flex(sizeof(*data), 1, block_size);
+
+	if (data == NULL)
+		return NULL;
+
+	data->shared = create_shared(block_size, cache_size);
+	if (data->shared == NULL) {
+		free(data);
+		return NULL;
+	}
+
+	data->file = file;
+	data->block_size = block_size;
+	data->cmp = cmp;
+	data->scratch = data->scratch_buf;
+
+	if (cmp->inplace_margin != NULL) {
+		data->inplace_margin = cmp->inplace_margin(cmp, block_size);
+		data->inplace = true;
+	}
+	return data;
+}
+
+sqfs_data_reader_t *sqfs_data_reader_create_copy(sqfs_data_reader_t *data)
+{
+	sqfs_data_reader_t *copy;
+
+	copy = alloc_flex(sizeof(*copy), 1, data->block_size);
+	if (copy == NULL)
+		return NULL;
+
+	copy->cmp = data->cmp->create_copy(data->cmp);
+	if (copy->cmp == NULL) {
+		free(copy);
+		return NULL;
+	}
+
+	LOCK(&data->shared->mtx);
+	data->shared->refs += 1;
+	UNLOCK(&data->shared->mtx);
+
+	copy->shared = data->shared;
+	copy->scratch = copy->scratch_buf;
+
+	if (data->shared->huge_pool != NULL) {
+		copy->scratch = huge_pool_alloc(data->shared->huge_pool,
+						data->block_size);
+		if (copy->scratch == NULL) {
+			shared_unref(copy->shared);
+			copy->cmp->destroy(copy->cmp);
+			free(copy);
+			return NULL;
+		}
+	}
+
+	copy->own_cmp = true;
+	copy->file = data->file;
+	copy->block_size = data->block_size;
+	copy->inplace_margin = data->inplace_margin;
+	copy->inplace = data->inplace;
+	return copy;
+}
+
+/*
+  Drop the current fragment table and compute the size of the new one.
+  Returns a size of zero if the image has no fragments.
+ */
+static int reset_fragment_table(sqfs_data_reader_t *data,
+				const sqfs_super_t *super, size_t *size)
+{
+	data_reader_shared_t *shared = data->shared;
+
+	release_held(data);
+	cache_clear(shared);
+	free(shared->frag);
+
+	if (shared->frag_is_lazy) {
+		lazy_table_cleanup(&shared->frag_lazy);
+		shared->frag_is_lazy = false;
+	}
+
+	shared->frag = NULL;
+	shared->num_fragments = 0;
+	*size = 0;
+
+	if (super->fragment_entry_count == 0 ||
+	    (super->flags & SQFS_FLAG_NO_FRAGMENTS) != 0) {
+		return 0;
+	}
+
+	if (super->fragment_table_start >= super->bytes_used)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	if (SZ_MUL_OV(sizeof(shared->frag[0]), super->fragment_entry_count,
+		      size)) {
+		return SQFS_ERROR_OVERFLOW;
+	}
+
+	return 0;
+}
+
+int sqfs_data_reader_load_fragment_table(sqfs_data_reader_t *data,
+					 const sqfs_super_t *super)
+{
+	data_reader_shared_t *shared = data->shared;
+	sqfs_fragment_t *frag;
+	void *raw_frag;
+	size_t size;
+	sqfs_u32 i;
+	int ret;
+
+	ret = reset_fragment_table(data, super, &size);
+	if (ret || size == 0)
+		return ret;
+
+	ret = sqfs_read_table_parallel(data->file, data->cmp, size,
+				       super->fragment_table_start,
+				       super->directory_table_start,
+				       super->fragment_table_start, &raw_frag,
+				       data->num_workers);
+	if (ret)
+		return ret;
+
+	frag = raw_frag;
+
+	for (i = 0; i < super->fragment_entry_count; ++i) {
+		frag[i].size = le32toh(frag[i].size);
+		frag[i].start_offset = le64toh(frag[i].start_offset);
+	}
+
+	shared->num_fragments = super->fragment_entry_count;
+	shared->frag = frag;
+
+	return 0;
+}
+
+int sqfs_data_reader_load_fragment_table_lazy(sqfs_data_reader_t *data,
+					      const sqfs_super_t *super)
+{
+	data_reader_shared_t *shared = data->shared;
+	size_t size;
+	int ret;
+
+	ret = reset_fragment_table(data, super, &size);
+	if (ret || size == 0)
+		return ret;
+
+	ret = lazy_table_init(&shared->frag_lazy, data->file, size,
+			      super->fragment_table_start,
+			      super->directory_table_start,
+			      super->fragment_table_start);
+	if (ret)
+		return ret;
+
+	shared->frag_is_lazy = true;
+	shared->num_fragments = super->fragment_entry_count;
+	return 0;
+}
+
+static void free_scratch(sqfs_data_reader_t *data)
+{
+	if (data->scratch != data->scratch_buf)
+		huge_pool_free(data->shared->huge_pool, data->scratch);
+
+	data->scratch = data->scratch_buf;
+}
+
+void sqfs_data_reader_destroy(sqfs_data_reader_t *data)
+{
+	release_held(data);
+	data_reader_ra_destroy(data->ra);
+	free_scratch(data);
+	shared_unref(data->shared);
+
+	if (data->own_cmp)
+		data->cmp->destroy(data->cmp);
+
+	free(data->offsets);
+	free(data);
+}
+
+int sqfs_data_reader_use_huge_pages(sqfs_data_reader_t *data)
+{
+	data_reader_shared_t *shared = data->shared;
+	huge_pool_t *pool;
+	sqfs_u8 *scratch;
+	bool shared_refs;
+
+	if (shared->huge_pool != NULL)
+		return 0;
+
+	LOCK(&shared->mtx);
+	shared_refs = shared->refs > 1;
+	UNLOCK(&shared->mtx);
+
+	if (shared_refs || data->ra != NULL)
+		return SQFS_ERROR_UNSUPPORTED;
+
+	pool = huge_pool_create(sizeof(sqfs_block_t) + data->block_size +
+				data->inplace_margin);
+	if (pool == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	scratch = huge_pool_alloc(pool, data->block_size);
+	if (scratch == NULL) {
+		huge_pool_destroy(pool);
+		return SQFS_ERROR_ALLOC;
+	}
+
+	/*
+	  Blocks already in the cache came from malloc, the pool passes
+	  those on to free once they are thrown out.
+	 */
+	shared->huge_pool = pool;
+	data->scratch = scratch;
+	return 0;
+}
+
+int sqfs_data_reader_get_block(sqfs_data_reader_t *data,
+			       const sqfs_inode_generic_t *inode,
+			       size_t index, sqfs_block_t **out)
+{
+	const sqfs_u64 *offsets;
+	size_t unpacked_size;
+	sqfs_u64 filesz;
+	int ret;
+
+	sqfs_inode_get_file_size(inode, &filesz);
+
+	if (index >= inode->num_file_blocks)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	if (NO_BLOCK_LIST(inode))
+		return SQFS_ERROR_NO_BLOCK_LIST;
+
+	ret = get_block_offsets(data, inode, &offsets);
+	if (ret)
+		return ret;
+
+	filesz -= (sqfs_u64)index * data->block_size;
+	unpacked_size = filesz < data->block_size ? filesz : data->block_size;
+
+	return get_block(data, offsets[index], inode->block_sizes[index],
+			 unpacked_size, out);
+}
+
+int sqfs_data_reader_peek_block(sqfs_data_reader_t *data,
+				const sqfs_inode_generic_t *inode,
+				size_t index, const void **out, size_t *size)
+{
+	const sqfs_u64 *offsets;
+	sqfs_block_t *blk;
+	sqfs_u64 filesz;
+	int ret;
+
+	sqfs_inode_get_file_size(inode, &filesz);
+
+	if (index >= inode->num_file_blocks)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	if (NO_BLOCK_LIST(inode))
+		return SQFS_ERROR_NO_BLOCK_LIST;
+
+	filesz -= (sqfs_u64)index * data->block_size;
+	*size = filesz < data->block_size ? filesz : data->block_size;
+
+	/* sparse blocks have no location of their own, so can't be cached */
+	if (SQFS_IS_SPARSE_BLOCK(inode->block_sizes[index])) {
+		memset(data->scratch, 0, *size);
+		*out = data->scratch;
+		return 0;
+	}
+
+	ret = get_block_offsets(data, inode, &offsets);
+	if (ret)
+		return ret;
+
+	ret = get_data_block(data, inode, offsets, index, &blk);
+	if (ret)
+		return ret;
+
+	*out = blk->data;
+	return 0;
+}
+
+int sqfs_data_reader_peek_fragment(sqfs_data_reader_t *data,
+				   const sqfs_inode_generic_t *inode,
+				   const void **out, size_t *size)
+{
+	sqfs_u32 frag_idx, frag_off;
+	sqfs_block_t *frag;
+	sqfs_u64 filesz;
+	int ret;
+
+	if (NO_BLOCK_LIST(inode))
+		return SQFS_ERROR_NO_BLOCK_LIST;
+
+	sqfs_inode_get_file_size(inode, &filesz);
+	sqfs_inode_get_frag_location(inode, &frag_idx, &frag_off);
+
+	if (inode->num_file_blocks * data->block_size >= filesz) {
+		*out = NULL;
+		*size = 0;
+		return 0;
+	}
+
+	*size = filesz % data->block_size;
+
+	ret = get_fragment_block(data, frag_idx, &frag);
+	if (ret)
+		return ret;
+
+	if (data->ra != NULL) {
+		data_reader_ra_schedule(data, inode, NULL,
+					inode->num_file_blocks);
+	}
+
+	if (frag_off + *size > data->block_size)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	*out = (const char *)frag->data + frag_off;
+	return 0;
+}
+
+int sqfs_data_reader_get_fragment(sqfs_data_reader_t *data,
+				  const sqfs_inode_generic_t *inode,
+				  sqfs_block_t **out)
+{
+	const void *ptr;
+	sqfs_block_t *blk;
+	size_t size;
+
+	if (sqfs_data_reader_peek_fragment(data, inode, &ptr, &size))
+		return -1;
+
+	if (ptr == NULL) {
+		*out = NULL;
+		return 0;
+	}
+
+	blk = alloc_flex(sizeof(*blk), 1, size);
+	if (blk == NULL)
+		return -1;
+
+	blk->size = size;
+	memcpy(blk->data, ptr, size);
+
+	*out = blk;
+	return 0;
+}
+
+sqfs_s32 sqfs_data_reader_read(sqfs_data_reader_t *data,
+			       const sqfs_inode_generic_t *inode,
+			       sqfs_u64 offset, void *buffer, sqfs_u32 size)
+{
+	sqfs_u32 frag_idx, frag_off, diff, total = 0;
+	const sqfs_u64 *offsets;
+	sqfs_u64 skip, filesz;
+	sqfs_block_t *blk;
+	char *ptr;
+	size_t i;
+
+	if (size >= 0x7FFFFFFF)
+		size = 0x7FFFFFFE;
+
+	if (NO_BLOCK_LIST(inode))
+		return SQFS_ERROR_NO_BLOCK_LIST;
+
+	/* work out file location and size */
+	sqfs_inode_get_file_size(inode, &filesz);
+	sqfs_inode_get_frag_location(inode, &frag_idx, &frag_off);
+
+	if (get_block_offsets(data, inode, &offsets))
+		return -1;
+
+	/* find location of the first block */
+	skip = offset / data->block_size;
+	if (skip > inode->num_file_blocks)
+		skip = inode->num_file_blocks;
+
+	i = skip;
+	skip *= data->block_size;
+	offset -= skip;
+	filesz = filesz > skip ? filesz - skip : 0;
+
+	/* copy data from blocks */
+	while (i < inode->num_file_blocks && size > 0 && filesz > 0) {
+		diff = data->block_size - offset;
+		if (size < diff)
+			diff = size;
+
+		if (SQFS_IS_SPARSE_BLOCK(inode->block_sizes[i])) {
+			memset(buffer, 0, diff);
+		} else if (diff == data->block_size &&
+			   filesz >= data->block_size && data->ra == NULL &&
+			   !cache_contains(data, offsets[i])) {
+			/* whole block that isn't cached, skip the cache */
+			if (read_block(data, offsets[i], inode->block_sizes[i],
+				       buffer, diff, diff)) {
+				return -1;
+			}
+		} else {
+			if (get_data_block(data, inode, offsets, i, &blk))
+				return -1;
+
+			memcpy(buffer, (char *)blk->data + offset, diff);
+		}
+
+		if (filesz >= data->block_size) {
+			filesz -= data->block_size;
+		} else {
+			filesz = 0;
+		}
+
+		++i;
+		offset = 0;
+		size -= diff;
+		total += diff;
+		buffer = (char *)buffer + diff;
+	}
+
+	/* copy from fragment */
+	if (i == inode->num_file_blocks && size > 0 && filesz > 0) {
+		if (get_fragment_block(data, frag_idx, &blk))
+			return -1;
+
+		if (data->ra != NULL) {
+			data_reader_ra_schedule(data, inode, NULL,
+						inode->num_file_blocks);
+		}
+
+		if (frag_off + filesz > data->block_size)
+			return SQFS_ERROR_OUT_OF_BOUNDS;
+
+		if (offset >= filesz)
+			return total;
+
+		if (offset + size > filesz)
+			size = filesz - offset;
+
+		if (size == 0)
+			return total;
+
+		ptr = (char *)blk->data + frag_off + offset;
+		memcpy(buffer, ptr, size);
+		total += size;
+	}
+
+	return total;
+}
+
+/* a block, or the tail end in a fragment block, that a request needs */
+typedef struct {
+	sqfs_u64 location;
+	size_t req;
+
+	/* block index in the file, num_file_blocks for the tail end */
+	size_t index;
+
+	/* on-disk size of a data block, unused for the tail end */
+	sqfs_u32 size;
+	bool frag;
+} batch_piece_t;
+
+typedef struct {
+	batch_piece_t *pieces;
+	size_t count;
+	size_t max;
+} batch_list_t;
+
+static int batch_append(batch_list_t *list, sqfs_u64 location, size_t req,
+			size_t index, sqfs_u32 size, bool frag)
+{
+	batch_piece_t *new;
+	size_t max;
+
+	if (list->count == list->max) {
+		max = list->max ? list->max * 2 : 128;
+		new = realloc(list->pieces, max * sizeof(new[0]));
+		if (new == NULL)
+			return SQFS_ERROR_ALLOC;
+
+		list->pieces = new;
+		list->max = max;
+	}
+
+	list->pieces[list->count].location = location;
+	list->pieces[list->count].req = req;
+	list->pieces[list->count].index = index;
+	list->pieces[list->count].size = size;
+	list->pieces[list->count].frag = frag;
+	list->count += 1;
+	return 0;
+}
+
+static sqfs_u64 request_end(const sqfs_data_request_t *req)
+{
+	sqfs_u64 filesz;
+
+	sqfs_inode_get_file_size(req->inode, &filesz);
+
+	if (req->offset >= filesz)
+		return req->offset;
+
+	if (req->size > filesz - req->offset)
+		return filesz;
+
+	return req->offset + req->size;
+}
+
+static int batch_add_request(sqfs_data_reader_t *data, batch_list_t *list,
+			     const sqfs_data_request_t *reqs, size_t idx)
+{
+	const sqfs_inode_generic_t *inode = reqs[idx].inode;
+	sqfs_u64 end, location, filesz;
+	sqfs_u32 frag_idx, frag_off;
+	size_t i, first, last;
+	sqfs_fragment_t ent;
+	int ret;
+
+	if (NO_BLOCK_LIST(inode))
+		return SQFS_ERROR_NO_BLOCK_LIST;
+
+	end = request_end(reqs + idx);
+	if (end <= reqs[idx].offset)
+		return 0;
+
+	sqfs_inode_get_file_size(inode, &filesz);
+	sqfs_inode_get_file_block_start(inode, &location);
+
+	first = reqs[idx].offset / data->block_size;
+	last = (end - 1) / data->block_size;
+
+	for (i = 0; i < inode->num_file_blocks && i <= last; ++i) {
+		if (i >= first) {
+			ret = batch_append(list, location, idx, i,
+					   inode->block_sizes[i], false);
+			if (ret)
+				return ret;
+		}
+
+		location += SQFS_ON_DISK_BLOCK_SIZE(inode->block_sizes[i]);
+	}
+
+	if (last < inode->num_file_blocks ||
+	    (sqfs_u64)inode->num_file_blocks * data->block_size >= filesz) {
+		return 0;
+	}
+
+	sqfs_inode_get_frag_location(inode, &frag_idx, &frag_off);
+
+	ret = get_fragment_entry(data, frag_idx, &ent);
+	if (ret)
+		return ret;
+
+	return batch_append(list, ent.start_offset, idx,
+			    inode->num_file_blocks, 0, true);
+}
+
+/*
+  Same order as the unpacker uses for files: by on-disk location, and the
+  requests that need the same block one after another.
+ */
+static int compare_pieces(const void *l, const void *r)
+{
+	const batch_piece_t *lhs = l, *rhs = r;
+
+	if (lhs->location != rhs->location)
+		return lhs->location < rhs->location ? -1 : 1;
+
+	if (lhs->req != rhs->req)
+		return lhs->req < rhs->req ? -1 : 1;
+
+	if (lhs->index != rhs->index)
+		return lhs->index < rhs->index ? -1 : 1;
+
+	return 0;
+}
+
+static bool same_block(const batch_piece_t *a, const batch_piece_t *b)
+{
+	return a->location == b->location && a->frag == b->frag;
+}
+
+static int batch_load(sqfs_data_reader_t *data,
+		      const sqfs_data_request_t *req, const batch_piece_t *p,
+		      const sqfs_u8 **out)
+{
+	sqfs_u32 frag_idx, frag_off;
+	sqfs_block_t *blk;
+	int ret;
+
+	if (p->frag) {
+		sqfs_inode_get_frag_location(req->inode, &frag_idx, &frag_off);
+		ret = get_fragment_block(data, frag_idx, &blk);
+	} else {
+		ret = cache_get(data, get_shard(data->shared, p->location),
+				p->location, p->location, p->size, &blk);
+	}
+
+	if (ret)
+		return ret;
+
+	*out = blk->data;
+	return 0;
+}
+
+/* hand the part of a block or tail end that a request asked for on */
+static int batch_deliver(sqfs_data_reader_t *data,
+			 const sqfs_data_request_t *req,
+			 const batch_piece_t *p, const sqfs_u8 *ptr,
+			 sqfs_data_batch_cb_t cb, void *user)
+{
+	sqfs_u64 start, stop, end, filesz;
+	sqfs_u32 frag_idx, frag_off;
+
+	sqfs_inode_get_file_size(req->inode, &filesz);
+
+	start = (sqfs_u64)p->index * data->block_size;
+	stop = filesz - start < data->block_size ?
+		filesz : start + data->block_size;
+	end = request_end(req);
+
+	if (p->frag) {
+		sqfs_inode_get_frag_location(req->inode, &frag_idx, &frag_off);
+
+		if (frag_off + (stop - start) > data->block_size)
+			return SQFS_ERROR_OUT_OF_BOUNDS;
+
+		ptr += frag_off;
+	}
+
+	if (stop > end)
+		stop = end;
+
+	if (req->offset > start) {
+		ptr += req->offset - start;
+		start = req->offset;
+	}
+
+	return cb(user, req, start, ptr, stop - start);
+}
+
+int sqfs_data_reader_read_batch(sqfs_data_reader_t *data,
+				const sqfs_data_request_t *reqs,
+				size_t count, sqfs_data_batch_cb_t cb,
+				void *user)
+{
+	const batch_piece_t *p, *prev = NULL;
+	const sqfs_u8 *ptr = NULL;
+	batch_list_t list;
+	int ret = 0;
+	size_t i;
+
+	memset(&list, 0, sizeof(list));
+
+	for (i = 0; i < count; ++i) {
+		ret = batch_add_request(data, &list, reqs, i);
+		if (ret)
+			goto out;
+	}
+
+	qsort(list.pieces, list.count, sizeof(list.pieces[0]),
+	      compare_pieces);
+
+	/* the block most recently loaded stays held until the next one */
+	for (i = 0; i < list.count; ++i) {
+		p = list.pieces + i;
+
+		if (!p->frag && SQFS_IS_SPARSE_BLOCK(p->size)) {
+			memset(data->scratch, 0, data->block_size);
+			ret = batch_deliver(data, reqs + p->req, p,
+					    data->scratch, cb, user);
+			if (ret)
+				goto out;
+			continue;
+		}
+
+		if (prev == NULL || !same_block(prev, p)) {
+			ret = batch_load(data, reqs + p->req, p, &ptr);
+			if (ret)
+				goto out;
+
+			prev = p;
+		}
+
+		ret = batch_deliver(data, reqs + p->req, p, ptr, cb, user);
+		if (ret)
+			goto out;
+	}
+out:
+	free(list.pieces);
+	return ret;
+}
@@ -0,0 +1,196 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * internal.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef INTERNAL_H
+#define INTERNAL_H
+
+#include "config.h"
+
+#include "sqfs/data_reader.h"
+#include "sqfs/compressor.h"
+#include "sqfs/block.h"
+#include "sqfs/error.h"
+#include "sqfs/table.h"
+#include "sqfs/trace.h"
+#include "sqfs/inode.h"
+#include "sqfs/io.h"
+#include "util/util.h"
+#include "../lazy_table.h"
+#include "../hook_alloc.h"
+#include "../huge_pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#ifdef WITH_PTHREAD
+#include "../thread_pool.h"
+#endif
+
+/* minimum number of cached data blocks */
+#define MIN_CACHED_BLOCKS (2)
+
+/*
+  Number of fragment blocks cached separately from the data blocks, so
+  reading the data blocks of a file doesn't throw out the fragment block
+  its tail end is in.
+ */
+#define FRAG_CACHE_BLOCKS (4)
+
+typedef struct data_reader_ra_t data_reader_ra_t;
+
+/* upper limit for the number of independently locked parts of the cache */
+#define MAX_CACHE_SHARDS (16)
+
+/* a file inode loaded without its block list, see SQFS_TREE_NO_BLOCK_LISTS */
+#define NO_BLOCK_LIST(inode) \
+	((inode)->num_file_blocks > 0 && (inode)->block_sizes == NULL)
+
+typedef struct cache_shard_t cache_shard_t;
+
+typedef struct cache_ent_t {
+	/* hash chain */
+	struct cache_ent_t *next;
+
+	/* LRU list, most recently used first */
+	struct cache_ent_t *lru_prev;
+	struct cache_ent_t *lru_next;
+
+	/* on-disk location of a data block, or the index of a fragment block */
+	sqfs_u64 location;
+
+	cache_shard_t *shard;
+
+	/*
+	  One reference held by the cache while the entry is in it and one by
+	  each reader handle currently using the block.
+	 */
+	unsigned int refs;
+	bool cached;
+
+	sqfs_block_t *blk;
+} cache_ent_t;
+
+struct cache_shard_t {
+#ifdef WITH_PTHREAD
+	pthread_mutex_t mtx;
+#endif
+	cache_ent_t **table;
+	size_t mask;
+	size_t count;
+	size_t max;
+	cache_ent_t *lru_first;
+	cache_ent_t *lru_last;
+
+	/* an evicted entry kept around for the next block read in */
+	cache_ent_t *spare;
+};
+
+/* state shared between a data reader and the copies made from it */
+typedef struct {
+#ifdef WITH_PTHREAD
+	pthread_mutex_t mtx;
+#endif
+	unsigned int refs;
+
+	sqfs_fragment_t *frag;
+	sqfs_u32 num_fragments;
+
+	/* if set, frag is unused and entries are looked up in frag_lazy */
+	bool frag_is_lazy;
+	lazy_table_t frag_lazy;
+
+	/*
+	  Set by sqfs_data_reader_use_huge_pages. Cached blocks, read ahead
+	  buffers and scratch buffers come from here, blocks handed out to
+	  the user do not.
+	 */
+	huge_pool_t *huge_pool;
+
+	/* the data block shards, followed by the fragment block cache */
+	size_t num_shards;
+	cache_shard_t *frag_cache;
+	cache_shard_t shards[];
+} data_reader_shared_t;
+
+struct sqfs_data_reader_t {
+	data_reader_shared_t *shared;
+
+	sqfs_compressor_t *cmp;
+	bool own_cmp;
+
+	/* cache entry of the block most recently handed out, if any */
+	cache_ent_t *held;
+
+	/*
+	  On-disk location of each block of the most recently accessed file,
+	  identified by its block list and block start.
+	 */
+	sqfs_u64 *offsets;
+	size_t offsets_max;
+	size_t offsets_count;
+	const sqfs_u32 *offsets_sizes;
+	sqfs_u64 offsets_start;
+
+	/* read ahead state, NULL if disabled */
+	data_reader_ra_t *ra;
+
+	/* number of threads used for loading the fragment table */
+	unsigned int num_workers;
+
+	sqfs_file_t *file;
+	sqfs_u32 block_size;
+
+	/*
+	  Extra space allocated behind every cached block buffer. If the
+	  compressor can uncompress in place, the compressed data is read
+	  into the end of the destination buffer instead of the scratch
+	  buffer.
+	 */
+	sqfs_u32 inplace_margin;
+	bool inplace;
+
+	/* points to scratch_buf, unless it comes from the huge page pool */
+	sqfs_u8 *scratch;
+	sqfs_u8 scratch_buf[];
+};
+
+/* The allocator for buffers kept by the reader, NULL for the default. */
+SQFS_INTERNAL
+const sqfs_allocator_t *data_reader_allocator(const sqfs_data_reader_t *data);
+
+/*
+  Called after block index of a file has been accessed, or its fragment with
+  an index of num_file_blocks. If the file is being read sequentially,
+  decompression of the blocks after it, and the files queued after it, is
+  started on the read ahead workers. Offsets can be NULL for fragments.
+ */
+SQFS_INTERNAL void data_reader_ra_schedule(sqfs_data_reader_t *data,
+					   const sqfs_inode_generic_t *inode,
+					   const sqfs_u64 *offsets,
+					   size_t index);
+
+/*
+  If a block at the given location has been read ahead, wait for it and
+  swap it with the given block buffer. found is set to false if there is
+  no such block.
+ */
+SQFS_INTERNAL int data_reader_ra_take(sqfs_data_reader_t *data,
+				      sqfs_u64 location, sqfs_block_t **blk,
+				      bool *found);
+
+/*
+  Get the on-disk location and size of a fragment block for reading it
+  ahead. Returns false if there is no such block or if it is cached already.
+ */
+SQFS_INTERNAL bool data_reader_fragment_location(sqfs_data_reader_t *data,
+						 sqfs_u32 idx,
+						 sqfs_u64 *location,
+						 sqfs_u32 *size);
+
+SQFS_INTERNAL void data_reader_ra_destroy(data_reader_ra_t *ra);
+
+#endif /* INTERNAL_H */
@@ -0,0 +1,728 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * pthread.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#define SQFS_BUILDING_DLL
+#include "internal.h"
+
+/*
+  The compressed data is read on the calling thread, so the file
+  implementation does not have to be thread safe. The workers only
+  decompress. Blocks are scheduled in batches once the number of pending
+  jobs drops to half the limit, so a file that supports batched reads gets
+  to keep many of them in flight.
+ */
+typedef struct ra_job_t {
+	struct ra_job_t *next;
+
+	sqfs_u64 location;
+	size_t index;
+	sqfs_u32 size;
+
+	bool done;
+	int status;
+
+	sqfs_block_t *blk;
+	sqfs_u8 *src;
+
+	/*
+	  Either src, the end of blk if it is uncompressed in place, or a
+	  pointer into a memory mapped file.
+	 */
+	const sqfs_u8 *input;
+} ra_job_t;
+
+/* a file announced through sqfs_data_reader_queue_file */
+typedef struct ra_file_t {
+	struct ra_file_t *next;
+	const sqfs_inode_generic_t *inode;
+} ra_file_t;
+
+typedef struct {
+	data_reader_ra_t *shared;
+	sqfs_compressor_t *cmp;
+	thread_job_t job;
+} ra_worker_t;
+
+struct data_reader_ra_t {
+	pthread_mutex_t mtx;
+	pthread_cond_t queue_cond;
+	pthread_cond_t done_cond;
+	bool stop;
+
+	/* scheduled blocks in file order and the first one not yet started */
+	ra_job_t *list_first;
+	ra_job_t *list_last;
+	ra_job_t *queue;
+	size_t count;
+	size_t max_jobs;
+	unsigned int busy;
+
+	ra_job_t *free_jobs;
+	sqfs_file_io_t *batch;
+
+	/* queued files, the first one is the one currently being read */
+	ra_file_t *files_first;
+	ra_file_t *files_last;
+
+	/* the most recently accessed block */
+	const sqfs_u32 *last_sizes;
+	size_t last_index;
+
+	/* the file being read ahead and the next block to schedule */
+	const sqfs_u32 *sizes;
+	size_t next_index;
+
+	/*
+	  If set, the file being read ahead is the queue entry sched, or the
+	  queue has been scheduled completely if it is NULL. The location of
+	  the next block is tracked, since only the offsets of the file that
+	  is being accessed are passed in. Past the blocks of a file, the
+	  index of its fragment block is num_file_blocks.
+	 */
+	bool use_queue;
+	ra_file_t *sched;
+	sqfs_u64 next_location;
+
+	/* most recently scheduled fragment block, to not read it twice */
+	sqfs_u32 last_frag;
+	bool have_last_frag;
+
+	size_t block_size;
+	size_t inplace_margin;
+	bool inplace;
+
+	/* blocks are swapped with cache entries, so they share an allocator */
+	const sqfs_allocator_t *alloc;
+
+	unsigned int num_workers;
+	ra_worker_t workers[];
+};
+
+static void *worker_proc(void *arg)
+{
+	ra_worker_t *worker = arg;
+	data_reader_ra_t *ra = worker->shared;
+	sqfs_u32 on_disk_size;
+	ra_job_t *job;
+	sqfs_s32 ret;
+
+	pthread_mutex_lock(&ra->mtx);
+	for (;;) {
+		while (ra->queue == NULL && !ra->stop) {
+			thread_job_wait_begin(&worker->job);
+			pthread_cond_wait(&ra->queue_cond, &ra->mtx);
+			thread_job_wait_end(&worker->job);
+		}
+
+		if (ra->stop)
+			break;
+
+		job = ra->queue;
+		ra->queue = job->next;
+		ra->busy += 1;
+		pthread_mutex_unlock(&ra->mtx);
+
+		on_disk_size = SQFS_ON_DISK_BLOCK_SIZE(job->size);
+
+		if (SQFS_IS_BLOCK_COMPRESSED(job->size)) {
+			sqfs_trace_begin("data_reader", "uncompress block");
+			ret = worker->cmp->do_block(worker->cmp, job->input,
+						    on_disk_size,
+						    job->blk->data,
+						    ra->block_size);
+			sqfs_trace_end("data_reader", "uncompress block");
+			if (ret <= 0)
+				ret = ret < 0 ? ret : SQFS_ERROR_OVERFLOW;
+			else
+				ret = 0;
+		} else {
+			if (job->input != job->blk->data) {
+				memcpy(job->blk->data, job->input,
+				       on_disk_size);
+			}
+			ret = 0;
+		}
+
+		pthread_mutex_lock(&ra->mtx);
+		job->status = ret;
+		job->done = true;
+		ra->busy -= 1;
+		pthread_cond_broadcast(&ra->done_cond);
+	}
+	pthread_mutex_unlock(&ra->mtx);
+	return NULL;
+}
+
+static void free_job(data_reader_ra_t *ra, ra_job_t *job)
+{
+	hook_free(ra->alloc, job->blk);
+	hook_free(ra->alloc, job->src);
+	free(job);
+}
+
+static ra_job_t *alloc_job(data_reader_ra_t *ra)
+{
+	ra_job_t *job = ra->free_jobs;
+
+	if (job != NULL) {
+		ra->free_jobs = job->next;
+	} else {
+		job = calloc(1, sizeof(*job));
+		if (job == NULL)
+			return NULL;
+
+		job->blk = hook_alloc_flex(ra->alloc, sizeof(*job->blk), 1,
+					   ra->block_size + ra->inplace_margin);
+
+		if (!ra->inplace)
+			job->src = hook_alloc(ra->alloc, ra->block_size);
+
+		if (job->blk == NULL || (!ra->inplace && job->src == NULL)) {
+			free_job(ra, job);
+			return NULL;
+		}
+	}
+
+	job->next = NULL;
+	job->done = false;
+	job->status = 0;
+	return job;
+}
+
+/* called with the mutex held, the job must be the first one in the list */
+static void recycle_first(data_reader_ra_t *ra)
+{
+	ra_job_t *job = ra->list_first;
+
+	ra->list_first = job->next;
+	if (ra->list_first == NULL)
+		ra->list_last = NULL;
+
+	ra->count -= 1;
+	job->next = ra->free_jobs;
+	ra->free_jobs = job;
+}
+
+static void reset(data_reader_ra_t *ra)
+{
+	pthread_mutex_lock(&ra->mtx);
+	ra->queue = NULL;
+
+	while (ra->busy > 0)
+		pthread_cond_wait(&ra->done_cond, &ra->mtx);
+
+	while (ra->list_first != NULL)
+		recycle_first(ra);
+	pthread_mutex_unlock(&ra->mtx);
+}
+
+/*
+  Batched reads are preferred over a memory mapping, since the page faults
+  of the workers on a mapping are served one at a time per thread.
+ */
+static int read_jobs(sqfs_data_reader_t *data, ra_job_t *list, size_t count)
+{
+	sqfs_file_t *file = data->file;
+	data_reader_ra_t *ra = data->ra;
+	sqfs_file_io_t *batch = ra->batch;
+	sqfs_u32 on_disk_size;
+	const void *ptr;
+	sqfs_u8 *dst;
+	ra_job_t *job;
+	size_t i = 0;
+	int ret;
+
+	for (job = list; job != NULL; job = job->next) {
+		on_disk_size = SQFS_ON_DISK_BLOCK_SIZE(job->size);
+		dst = job->src;
+
+		if (ra->inplace) {
+			dst = job->blk->data;
+
+			if (SQFS_IS_BLOCK_COMPRESSED(job->size)) {
+				dst += ra->block_size + ra->inplace_margin -
+					on_disk_size;
+			}
+		}
+
+		job->input = dst;
+
+		if (count > 1 && file->read_batch != NULL) {
+			batch[i].offset = job->location;
+			batch[i].buffer = dst;
+			batch[i].size = on_disk_size;
+			++i;
+		} else if (file->map_at != NULL) {
+			ret = file->map_at(file, job->location,
+					   on_disk_size, &ptr);
+			if (ret)
+				return ret;
+
+			job->input = ptr;
+		} else {
+			ret = file->read_at(file, job->location, dst,
+					    on_disk_size);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return i > 0 ? file->read_batch(file, batch, i) : 0;
+}
+
+static int submit(sqfs_data_reader_t *data, ra_job_t *list, size_t count)
+{
+	data_reader_ra_t *ra = data->ra;
+	ra_job_t *last;
+	int ret;
+
+	ret = read_jobs(data, list, count);
+
+	for (last = list; last->next != NULL; last = last->next)
+		;
+
+	pthread_mutex_lock(&ra->mtx);
+	if (ret) {
+		last->next = ra->free_jobs;
+		ra->free_jobs = list;
+	} else {
+		if (ra->list_last == NULL) {
+			ra->list_first = list;
+		} else {
+			ra->list_last->next = list;
+		}
+
+		ra->list_last = last;
+
+		if (ra->queue == NULL)
+			ra->queue = list;
+
+		ra->count += count;
+		pthread_cond_broadcast(&ra->queue_cond);
+	}
+	pthread_mutex_unlock(&ra->mtx);
+	return ret;
+}
+
+static void drop_files(data_reader_ra_t *ra, const ra_file_t *stop)
+{
+	ra_file_t *f;
+
+	while (ra->files_first != stop) {
+		f = ra->files_first;
+		ra->files_first = f->next;
+
+		if (ra->sched == f)
+			ra->use_queue = false;
+
+		free(f);
+	}
+
+	if (ra->files_first == NULL)
+		ra->files_last = NULL;
+}
+
+/*
+  On the first access to a file, skip the queue ahead to it. If it is not
+  in the queue, the queue is dropped. Returns true if the file is queued.
+ */
+static bool find_queued(data_reader_ra_t *ra,
+			const sqfs_inode_generic_t *inode)
+{
+	ra_file_t *f;
+
+	for (f = ra->files_first; f != NULL; f = f->next) {
+		if (f->inode == inode)
+			break;
+	}
+
+	drop_files(ra, f);
+	return f != NULL;
+}
+
+static void set_queue_pos(data_reader_ra_t *ra, ra_file_t *f)
+{
+	ra->sched = f;
+	ra->next_index = 0;
+
+	if (f != NULL)
+		sqfs_inode_get_file_block_start(f->inode, &ra->next_location);
+}
+
+/*
+  Check if a block is already scheduled, either in the job list or in the
+  list of jobs that is about to be submitted.
+ */
+static bool is_pending(data_reader_ra_t *ra, const ra_job_t *list,
+		       sqfs_u64 location)
+{
+	const ra_job_t *job;
+	bool found = false;
+
+	for (job = list; job != NULL && !found; job = job->next)
+		found = (job->location == location);
+
+	pthread_mutex_lock(&ra->mtx);
+	for (job = ra->list_first; job != NULL && !found; job = job->next)
+		found = (job->location == location);
+	pthread_mutex_unlock(&ra->mtx);
+
+	return found;
+}
+
+/*
+  Get the location and size of the next block to read ahead from the queue.
+  Returns false if the queue has been scheduled completely. The size is
+  set to zero for sparse blocks and for fragments that need not be read.
+ */
+static bool next_queued(sqfs_data_reader_t *data,
+			const sqfs_inode_generic_t *inode,
+			const sqfs_u64 *offsets, const ra_job_t *list,
+			sqfs_u64 *location, sqfs_u32 *size)
+{
+	data_reader_ra_t *ra = data->ra;
+	const sqfs_inode_generic_t *f;
+	sqfs_u32 frag_idx, frag_off;
+	sqfs_u64 filesz;
+	size_t i;
+
+	while (ra->sched != NULL &&
+	       ra->next_index > ra->sched->inode->num_file_blocks) {
+		set_queue_pos(ra, ra->sched->next);
+	}
+
+	if (ra->sched == NULL)
+		return false;
+
+	f = ra->sched->inode;
+	i = ra->next_index++;
+	*size = 0;
+
+	if (i < f->num_file_blocks) {
+		*location = ra->next_location;
+		if (f == inode && offsets != NULL)
+			*location = offsets[i];
+
+		if (!SQFS_IS_SPARSE_BLOCK(f->block_sizes[i]))
+			*size = f->block_sizes[i];
+
+		ra->next_location = *location +
+			SQFS_ON_DISK_BLOCK_SIZE(f->block_sizes[i]);
+		return true;
+	}
+
+	sqfs_inode_get_file_size(f, &filesz);
+	sqfs_inode_get_frag_location(f, &frag_idx, &frag_off);
+
+	if ((sqfs_u64)f->num_file_blocks * ra->block_size >= filesz)
+		return true;
+
+	if (ra->have_last_frag && ra->last_frag == frag_idx)
+		return true;
+
+	ra->last_frag = frag_idx;
+	ra->have_last_frag = true;
+
+	if (!data_reader_fragment_location(data, frag_idx, location, size) ||
+	    is_pending(ra, list, *location)) {
+		*size = 0;
+	}
+	return true;
+}
+
+void data_reader_ra_schedule(sqfs_data_reader_t *data,
+			     const sqfs_inode_generic_t *inode,
+			     const sqfs_u64 *offsets, size_t index)
+{
+	data_reader_ra_t *ra = data->ra;
+	ra_job_t *job, *list = NULL, *last = NULL;
+	bool sequential, stale, queued = false;
+	sqfs_u64 location;
+	size_t i, count = 0;
+	sqfs_u32 size;
+
+	if (ra->last_sizes == inode->block_sizes) {
+		if (index == ra->last_index)
+			return;
+
+		sequential = (index == ra->last_index + 1);
+		queued = (ra->files_first != NULL &&
+			  ra->files_first->inode == inode);
+	} else {
+		queued = find_queued(ra, inode);
+		sequential = queued || (index == 0);
+	}
+
+	ra->last_sizes = inode->block_sizes;
+	ra->last_index = index;
+	if (!sequential)
+		return;
+
+	if (queued) {
+		if (!ra->use_queue || (ra->sched == ra->files_first &&
+				       ra->next_index <= index)) {
+			reset(ra);
+			ra->use_queue = true;
+			ra->have_last_frag = false;
+			set_queue_pos(ra, ra->files_first);
+			ra->next_index = index + 1;
+
+			if (offsets != NULL && index < inode->num_file_blocks)
+				ra->next_location = offsets[index + 1];
+		}
+	} else {
+		/* the fragment is the end of a file that is not queued */
+		if (index >= inode->num_file_blocks)
+			return;
+
+		pthread_mutex_lock(&ra->mtx);
+		stale = ra->list_first != NULL &&
+			ra->list_first->index <= index;
+		pthread_mutex_unlock(&ra->mtx);
+
+		if (ra->use_queue || ra->sizes != inode->block_sizes ||
+		    stale || ra->next_index <= index) {
+			reset(ra);
+			ra->use_queue = false;
+			ra->sizes = inode->block_sizes;
+			ra->next_index = index + 1;
+		}
+	}
+
+	if (ra->count > ra->max_jobs / 2)
+		return;
+
+	/* errors are reported when the blocks are actually read */
+	while (ra->count + count < ra->max_jobs) {
+		if (ra->use_queue) {
+			if (!next_queued(data, inode, offsets, list,
+					 &location, &size)) {
+				break;
+			}
+
+			i = ra->next_index - 1;
+		} else {
+			if (ra->next_index >= inode->num_file_blocks)
+				break;
+
+			i = ra->next_index++;
+			location = offsets[i];
+			size = inode->block_sizes[i];
+		}
+
+		if (size == 0 || SQFS_IS_SPARSE_BLOCK(size))
+			continue;
+
+		if (SQFS_ON_DISK_BLOCK_SIZE(size) > ra->block_size)
+			break;
+
+		pthread_mutex_lock(&ra->mtx);
+		job = alloc_job(ra);
+		pthread_mutex_unlock(&ra->mtx);
+
+		if (job == NULL)
+			break;
+
+		job->location = location;
+		job->index = i;
+		job->size = size;
+
+		if (last == NULL) {
+			list = job;
+		} else {
+			last->next = job;
+		}
+
+		last = job;
+		++count;
+	}
+
+	if (list != NULL)
+		submit(data, list, count);
+}
+
+int data_reader_ra_take(sqfs_data_reader_t *data, sqfs_u64 location,
+			sqfs_block_t **blk, bool *found)
+{
+	data_reader_ra_t *ra = data->ra;
+	sqfs_block_t *temp;
+	ra_job_t *job;
+	int status;
+
+	pthread_mutex_lock(&ra->mtx);
+	for (job = ra->list_first; job != NULL; job = job->next) {
+		if (job->location == location)
+			break;
+	}
+
+	if (job == NULL) {
+		pthread_mutex_unlock(&ra->mtx);
+		*found = false;
+		return 0;
+	}
+
+	/* blocks before it were skipped, drop them once they are done */
+	for (;;) {
+		while (!ra->list_first->done)
+			pthread_cond_wait(&ra->done_cond, &ra->mtx);
+
+		if (ra->list_first == job)
+			break;
+
+		recycle_first(ra);
+	}
+
+	status = job->status;
+	if (status == 0) {
+		temp = job->blk;
+		job->blk = *blk;
+		*blk = temp;
+	}
+
+	recycle_first(ra);
+	pthread_mutex_unlock(&ra->mtx);
+
+	*found = (status == 0);
+	return status;
+}
+
+void data_reader_ra_destroy(data_reader_ra_t *ra)
+{
+	unsigned int i;
+	ra_job_t *job;
+
+	if (ra == NULL)
+		return;
+
+	pthread_mutex_lock(&ra->mtx);
+	ra->stop = true;
+	pthread_cond_broadcast(&ra->queue_cond);
+	pthread_mutex_unlock(&ra->mtx);
+
+	for (i = 0; i < ra->num_workers; ++i) {
+		thread_job_join(&ra->workers[i].job);
+		ra->workers[i].cmp->destroy(ra->workers[i].cmp);
+	}
+
+	while (ra->list_first != NULL)
+		recycle_first(ra);
+
+	drop_files(ra, NULL);
+
+	while (ra->free_jobs != NULL) {
+		job = ra->free_jobs;
+		ra->free_jobs = job->next;
+		free_job(ra, job);
+	}
+
+	free(ra->batch);
+	pthread_cond_destroy(&ra->done_cond);
+	pthread_cond_destroy(&ra->queue_cond);
+	pthread_mutex_destroy(&ra->mtx);
+	free(ra);
+}
+
+int sqfs_data_reader_set_readahead(sqfs_data_reader_t *data,
+				   unsigned int num_workers,
+				   size_t num_blocks)
+{
+	cache_shard_t *shard;
+	data_reader_ra_t *ra;
+	unsigned int i;
+
+	data_reader_ra_destroy(data->ra);
+	data->ra = NULL;
+	data->num_workers = 0;
+
+	if (num_workers == 0 || num_blocks == 0)
+		return 0;
+
+	ra = alloc_flex(sizeof(*ra), sizeof(ra->workers[0]), num_workers);
+	if (ra == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	ra->mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	ra->queue_cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+	ra->done_cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+	ra->max_jobs = num_blocks;
+	ra->block_size = data->block_size;
+	ra->inplace_margin = data->inplace_margin;
+	ra->inplace = data->inplace;
+	ra->alloc = data_reader_allocator(data);
+
+	ra->batch = alloc_array(sizeof(ra->batch[0]), num_blocks);
+	if (ra->batch == NULL) {
+		free(ra);
+		return SQFS_ERROR_ALLOC;
+	}
+
+	for (i = 0; i < num_workers; ++i) {
+		ra->workers[i].shared = ra;
+		ra->workers[i].cmp = data->cmp->create_copy(data->cmp);
+
+		if (ra->workers[i].cmp == NULL)
+			goto fail;
+
+		if (thread_job_start(&ra->workers[i].job, worker_proc,
+				     ra->workers + i, true) != 0) {
+			ra->workers[i].cmp->destroy(ra->workers[i].cmp);
+			goto fail;
+		}
+
+		ra->num_workers += 1;
+	}
+
+	/*
+	  Small files read ahead from the queue don't necessarily use their
+	  fragment blocks in order. Keep as many of them around as can be in
+	  flight, so they aren't thrown out before they are used.
+	 */
+	shard = data->shared->frag_cache;
+	pthread_mutex_lock(&shard->mtx);
+	if (shard->max < num_blocks)
+		shard->max = num_blocks;
+	pthread_mutex_unlock(&shard->mtx);
+
+	data->ra = ra;
+	data->num_workers = num_workers;
+	return 0;
+fail:
+	data_reader_ra_destroy(ra);
+	return SQFS_ERROR_ALLOC;
+}
+
+int sqfs_data_reader_queue_file(sqfs_data_reader_t *data,
+				const sqfs_inode_generic_t *inode)
+{
+	data_reader_ra_t *ra = data->ra;
+	ra_file_t *f;
+
+	if (ra == NULL)
+		return 0;
+
+	if (NO_BLOCK_LIST(inode))
+		return SQFS_ERROR_NO_BLOCK_LIST;
+
+	f = calloc(1, sizeof(*f));
+	if (f == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	f->inode = inode;
+
+	if (ra->files_last == NULL) {
+		ra->files_first = f;
+	} else {
+		ra->files_last->next = f;
+	}
+
+	ra->files_last = f;
+
+	/* resume reading ahead if the queue has been scheduled completely */
+	if (ra->use_queue && ra->sched == NULL)
+		set_queue_pos(ra, f);
+
+	return 0;
+}
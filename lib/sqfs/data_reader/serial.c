@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * serial.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#define SQFS_BUILDING_DLL
+#include "internal.h"
+
+void data_reader_ra_schedule(sqfs_data_reader_t *data,
+			     const sqfs_inode_generic_t *inode,
+			     const sqfs_u64 *offsets, size_t index)
+{
+	(void)data; (void)inode; (void)offsets; (void)index;
+}
+
+int data_reader_ra_take(sqfs_data_reader_t *data, sqfs_u64 location,
+			sqfs_block_t **blk, bool *found)
+{
+	(void)data; (void)location; (void)blk;
+	*found = false;
+	return 0;
+}
+
+void data_reader_ra_destroy(data_reader_ra_t *ra)
+{
+	(void)ra;
+}
+
+int sqfs_data_reader_set_readahead(sqfs_data_reader_t *data,
+				   unsigned int num_workers,
+				   size_t num_blocks)
+{
+	(void)data; (void)num_workers; (void)num_blocks;
+	return 0;
+}
+
+int sqfs_data_reader_queue_file(sqfs_data_reader_t *data,
+				const sqfs_inode_generic_t *inode)
+{
+	(void)data; (void)inode;
+	return 0;
+}
@@ -10,7 +10,8 @@
 #include <string.h>
 
 static int store_block_location(sqfs_data_writer_t *proc, sqfs_u64 offset,
-				sqfs_u32 size, sqfs_u32 chksum)
+				sqfs_u32 size, sqfs_u32 chksum,
+				sqfs_u64 digest)
 {
 	size_t new_sz;
 	void *new;
@@ -28,44 +29,193 @@ static int store_block_location(sqfs_data_writer_t *proc, sqfs_u64 offset,
 
 	proc->blocks[proc->num_blocks].offset = offset;
 	proc->blocks[proc->num_blocks].hash = MK_BLK_HASH(chksum, size);
+	proc->blocks[proc->num_blocks].digest = digest;
 	proc->num_blocks += 1;
 	return 0;
 }
 
+static size_t blk_bucket_index(const sqfs_data_writer_t *proc, sqfs_u64 hash)
+{
+	return ((sqfs_u32)hash ^ (sqfs_u32)(hash >> 32)) % proc->num_blk_buckets;
+}
+
+static void blk_index_insert(sqfs_data_writer_t *proc, size_t idx)
+{
+	blk_bucket_t *bucket;
+
+	bucket = proc->blk_buckets +
+		blk_bucket_index(proc, proc->blocks[idx].hash);
+
+	proc->blocks[idx].next = 0;
+
+	if (bucket->tail == 0) {
+		bucket->head = idx + 1;
+	} else {
+		proc->blocks[bucket->tail - 1].next = idx + 1;
+	}
+
+	bucket->tail = idx + 1;
+}
+
+static int blk_index_grow(sqfs_data_writer_t *proc)
+{
+	size_t i, new_sz = proc->num_blk_buckets * 2;
+	blk_bucket_t *new;
+
+	new = alloc_array(sizeof(new[0]), new_sz);
+	if (new == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	free(proc->blk_buckets);
+	proc->blk_buckets = new;
+	proc->num_blk_buckets = new_sz;
+
+	for (i = 0; i < proc->blk_indexed; ++i)
+		blk_index_insert(proc, i);
+
+	return 0;
+}
+
+/*
+  Add all blocks in front of the current file to the hash index. Those are
+  never removed by the deduplication below, so the bucket chains stay sorted
+  by ascending block index and the search below finds the same, earliest
+  match that a linear scan would.
+ */
+static int blk_index_update(sqfs_data_writer_t *proc)
+{
+	int err;
+
+	while (proc->blk_indexed < proc->file_start) {
+		if (proc->blk_indexed >= proc->num_blk_buckets) {
+			err = blk_index_grow(proc);
+			if (err)
+				return err;
+		}
+
+		blk_index_insert(proc, proc->blk_indexed++);
+	}
+
+	return 0;
+}
+
+/*
+  Only runs that end before the current file are considered. The file's own
+  data is thrown away if a match is found, so a run overlapping it would
+  refer to data that no longer exists.
+ */
 static size_t deduplicate_blocks(sqfs_data_writer_t *proc, size_t count)
 {
+	const blk_info_t *file = proc->blocks + proc->file_start;
 	size_t i, j;
 
-	for (i = 0; i < proc->file_start; ++i) {
+	i = proc->blk_buckets[blk_bucket_index(proc, file->hash)].head;
+
+	for (; i != 0; i = proc->blocks[i - 1].next) {
+		if (i - 1 + count > proc->file_start)
+			break;
+
 		for (j = 0; j < count; ++j) {
-			if (proc->blocks[i + j].hash !=
-			    proc->blocks[proc->file_start + j].hash)
+			if (proc->blocks[i - 1 + j].hash != file[j].hash ||
+			    proc->blocks[i - 1 + j].digest != file[j].digest)
 				break;
 		}
 
 		if (j == count)
-			break;
+			return i - 1;
+	}
+
+	return proc->file_start;
+}
+
+static sqfs_u64 output_size(const sqfs_data_writer_t *proc)
+{
+	if (proc->holding)
+		return proc->start + proc->hold_used;
+
+	return proc->file->get_size(proc->file);
+}
+
+static int flush_held(sqfs_data_writer_t *proc)
+{
+	int err = 0;
+
+	if (proc->holding && proc->hold_used > 0) {
+		err = proc->file->write_at(proc->file, proc->start,
+					   proc->hold_buf, proc->hold_used);
 	}
 
-	return i;
+	proc->holding = false;
+	proc->hold_used = 0;
+	return err;
+}
+
+/*
+  While the blocks of a file are held back, nothing else is written to the
+  output, so the held data always ends up right at proc->start. If a file
+  is too big to be held back completely, it is written out directly and
+  not deduplicated at all.
+ */
+static int output_write(sqfs_data_writer_t *proc, sqfs_u64 offset,
+			const void *data, size_t size)
+{
+	size_t new_sz;
+	void *new;
+	int err;
+
+	if (proc->holding && (proc->hold_used + size > MAX_HOLD_SIZE ||
+			      (proc->mem_limit > 0 &&
+			       proc->hold_used + size >
+				proc->mem_limit / MEM_LIMIT_SHARE))) {
+		err = flush_held(proc);
+		if (err)
+			return err;
+
+		proc->hold_overflow = true;
+	}
+
+	if (!proc->holding)
+		return proc->file->write_at(proc->file, offset, data, size);
+
+	if (proc->hold_used + size > proc->hold_max) {
+		new_sz = proc->hold_max ? proc->hold_max : proc->max_block_size;
+
+		while (new_sz < proc->hold_used + size)
+			new_sz *= 2;
+
+		new = realloc(proc->hold_buf, new_sz);
+		if (new == NULL)
+			return SQFS_ERROR_ALLOC;
+
+		proc->hold_buf = new;
+		proc->hold_max = new_sz;
+		data_writer_track_mem(proc);
+	}
+
+	memcpy(proc->hold_buf + proc->hold_used, data, size);
+	proc->hold_used += size;
+	return 0;
 }
 
 static int align_file(sqfs_data_writer_t *proc, sqfs_block_t *blk)
 {
+	sqfs_u64 digest;
 	sqfs_u32 chksum;
 	void *padding;
 	sqfs_u64 size;
 	size_t diff;
 	int ret;
 
-	if (!(blk->flags & SQFS_BLK_ALIGN))
+	if (!(blk->flags & SQFS_BLK_ALIGN) || proc->devblksz == 0)
 		return 0;
 
-	size = proc->file->get_size(proc->file);
+	size = output_size(proc);
 	diff = size % proc->devblksz;
 	if (diff == 0)
 		return 0;
 
+	diff = proc->devblksz - diff;
+
 	padding = calloc(1, diff);
 	if (padding == 0)
 		return SQFS_ERROR_ALLOC;
@@ -73,20 +223,72 @@ static int align_file(sqfs_data_writer_t *proc, sqfs_block_t *blk)
 	if (proc->hooks != NULL && proc->hooks->prepare_padding != NULL)
 		proc->hooks->prepare_padding(proc->user_ptr, padding, diff);
 
-	chksum = crc32(0, padding, diff);
+	data_writer_hash(proc, padding, diff, &chksum, &digest);
 
-	ret = proc->file->write_at(proc->file, size, padding, diff);
+	ret = output_write(proc, size, padding, diff);
 	free(padding);
 	if (ret)
 		return ret;
 
-	return store_block_location(proc, size, diff | (1 << 24), chksum);
+	return store_block_location(proc, size, diff | (1 << 24),
+				    chksum, digest);
 }
 
-int process_completed_block(sqfs_data_writer_t *proc, sqfs_block_t *blk)
+/*
+  Decide where the blocks of a file start, after all of them have been
+  written, and throw them away if they turn out to be duplicates.
+ */
+static int finish_file(sqfs_data_writer_t *proc, sqfs_block_t *blk)
 {
 	sqfs_u64 offset, bytes;
 	size_t start, count;
+	int err;
+
+	err = align_file(proc, blk);
+	if (err)
+		return err;
+
+	err = blk_index_update(proc);
+	if (err)
+		return err;
+
+	count = proc->num_blocks - proc->file_start;
+	if (count == 0)
+		return flush_held(proc);
+
+	start = proc->file_start;
+	if (!proc->hold_overflow && !(blk->flags & SQFS_BLK_DONT_DEDUPLICATE))
+		start = deduplicate_blocks(proc, count);
+
+	offset = proc->blocks[start].offset;
+
+	sqfs_inode_set_file_block_start(blk->inode, offset);
+
+	if (start >= proc->file_start)
+		return flush_held(proc);
+
+	proc->num_blocks = proc->file_start;
+	proc->blocks_written -= count;
+	proc->dedup_blocks += count;
+
+	if (proc->hooks != NULL && proc->hooks->notify_blocks_erased != NULL) {
+		bytes = output_size(proc) - proc->start;
+
+		proc->hooks->notify_blocks_erased(proc->user_ptr, count, bytes);
+	}
+
+	if (proc->holding) {
+		proc->holding = false;
+		proc->hold_used = 0;
+		return 0;
+	}
+
+	return proc->file->truncate(proc->file, proc->start);
+}
+
+int process_completed_block(sqfs_data_writer_t *proc, sqfs_block_t *blk)
+{
+	sqfs_u64 offset;
 	sqfs_u32 out;
 	int err;
 
@@ -95,12 +297,16 @@ int process_completed_block(sqfs_data_writer_t *proc, sqfs_block_t *blk)
 	}
 
 	if (blk->flags & SQFS_BLK_FIRST_BLOCK) {
-		proc->start = proc->file->get_size(proc->file);
-		proc->file_start = proc->num_blocks;
-
+		/* the padding in front is not part of the file */
 		err = align_file(proc, blk);
 		if (err)
 			return err;
+
+		proc->start = proc->file->get_size(proc->file);
+		proc->file_start = proc->num_blocks;
+		proc->holding = (proc->flags & SQFS_DATA_WRITER_HOLD_BLOCKS) &&
+			!(blk->flags & SQFS_BLK_DONT_DEDUPLICATE);
+		proc->hold_overflow = false;
 	}
 
 	if (blk->size != 0) {
@@ -108,7 +314,7 @@ int process_completed_block(sqfs_data_writer_t *proc, sqfs_block_t *blk)
 		if (!(blk->flags & SQFS_BLK_IS_COMPRESSED))
 			out |= 1 << 24;
 
-		offset = proc->file->get_size(proc->file);
+		offset = output_size(proc);
 
 		if (blk->flags & SQFS_BLK_FRAGMENT_BLOCK) {
 			offset = htole64(offset);
@@ -119,14 +325,16 @@ int process_completed_block(sqfs_data_writer_t *proc, sqfs_block_t *blk)
 			blk->inode->block_sizes[blk->index] = out;
 		}
 
-		err = store_block_location(proc, offset, out, blk->checksum);
+		err = store_block_location(proc, offset, out, blk->checksum,
+					   blk->digest);
 		if (err)
 			return err;
 
-		err = proc->file->write_at(proc->file, offset,
-					   blk->data, blk->size);
+		err = output_write(proc, offset, blk->data, blk->size);
 		if (err)
 			return err;
+
+		proc->blocks_written += 1;
 	}
 
 	if (proc->hooks != NULL && proc->hooks->post_block_write != NULL) {
@@ -134,39 +342,26 @@ int process_completed_block(sqfs_data_writer_t *proc, sqfs_block_t *blk)
 	}
 
 	if (blk->flags & SQFS_BLK_LAST_BLOCK) {
-		err = align_file(proc, blk);
+		err = finish_file(proc, blk);
 		if (err)
 			return err;
 
-		count = proc->num_blocks - proc->file_start;
-		start = deduplicate_blocks(proc, count);
-		offset = proc->blocks[start].offset;
-
-		sqfs_inode_set_file_block_start(blk->inode, offset);
-
-		if (start >= proc->file_start)
-			return 0;
-
-		offset = start + count;
-		if (offset >= proc->file_start) {
-			count = proc->num_blocks - offset;
-			proc->num_blocks = offset;
-		} else {
-			proc->num_blocks = proc->file_start;
-		}
-
-		if (proc->hooks != NULL &&
-		    proc->hooks->notify_blocks_erased != NULL) {
-			bytes = proc->file->get_size(proc->file) - proc->start;
-
-			proc->hooks->notify_blocks_erased(proc->user_ptr,
-							  count, bytes);
-		}
-
-		err = proc->file->truncate(proc->file, proc->start);
-		if (err)
-			return err;
+		data_writer_blocks_done(proc);
 	}
 
 	return 0;
 }
+
+void data_writer_fill_stats(const sqfs_data_writer_t *proc,
+			    sqfs_data_writer_stats_t *out)
+{
+	out->blocks_written = proc->blocks_written;
+	out->output_size = output_size(proc);
+	out->mem_used = data_writer_mem_used(proc);
+	out->mem_pool = proc->pool_count *
+		(sizeof(sqfs_block_t) + proc->max_block_size);
+	out->mem_limit = proc->mem_limit;
+	out->dedup_blocks = proc->dedup_blocks;
+	out->dedup_fragments = proc->dedup_fragments;
+	out->files_done = proc->files_done;
+}
@@ -0,0 +1,153 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * cmp_cache.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#define SQFS_BUILDING_DLL
+#include "internal.h"
+
+/*
+  Every worker has its own cache, so it is never locked. An entry holds the
+  uncompressed data followed by the compressed data, so the block is only
+  taken from the cache if the input actually is identical.
+
+  Caching every block would mean copying every block, while most of them
+  are never seen again. A block is only put into the cache the second time
+  its hash shows up, the hashes of blocks seen once are kept in a small
+  direct mapped table that is simply overwritten on collisions.
+ */
+typedef struct {
+	sqfs_u64 hash;
+	sqfs_u64 last_use;
+	sqfs_u32 size;
+	sqfs_u32 cmp_size;
+	sqfs_u32 cmp_id;
+	sqfs_u32 cmp_hint;
+	sqfs_u32 cmp_method;
+	sqfs_u8 *data;
+} cmp_cache_ent_t;
+
+struct cmp_cache_t {
+	size_t max_block_size;
+	size_t num_entries;
+	sqfs_u64 clock;
+	size_t hits;
+
+	sqfs_u64 seen[CMP_CACHE_SEEN];
+	cmp_cache_ent_t entries[];
+};
+
+cmp_cache_t *cmp_cache_create(size_t max_block_size)
+{
+	size_t count = CMP_CACHE_BYTES / (2 * max_block_size);
+	cmp_cache_t *cache;
+
+	if (count < 1)
+		count = 1;
+
+	if (count > CMP_CACHE_MAX_ENTRIES)
+		count = CMP_CACHE_MAX_ENTRIES;
+
+	cache = alloc_flex(sizeof(*cache), sizeof(cache->entries[0]), count);
+	if (cache == NULL)
+		return NULL;
+
+	cache->max_block_size = max_block_size;
+	cache->num_entries = count;
+	return cache;
+}
+
+void cmp_cache_destroy(cmp_cache_t *cache)
+{
+	size_t i;
+
+	if (cache == NULL)
+		return;
+
+	for (i = 0; i < cache->num_entries; ++i)
+		free(cache->entries[i].data);
+
+	free(cache);
+}
+
+static bool entry_matches(const cmp_cache_ent_t *ent,
+			  const sqfs_block_t *block, sqfs_u64 hash)
+{
+	return ent->data != NULL && ent->hash == hash &&
+		ent->size == block->size && ent->cmp_id == block->cmp_id &&
+		ent->cmp_hint == block->cmp_hint &&
+		memcmp(ent->data, block->data, block->size) == 0;
+}
+
+bool cmp_cache_lookup(cmp_cache_t *cache, sqfs_block_t *block, sqfs_u64 hash)
+{
+	cmp_cache_ent_t *ent;
+	size_t i;
+
+	for (i = 0; i < cache->num_entries; ++i) {
+		ent = cache->entries + i;
+
+		if (entry_matches(ent, block, hash))
+			break;
+	}
+
+	if (i == cache->num_entries)
+		return false;
+
+	ent->last_use = ++cache->clock;
+	cache->hits += 1;
+
+	if (ent->cmp_size > 0) {
+		memcpy(block->data, ent->data + ent->size, ent->cmp_size);
+		block->size = ent->cmp_size;
+		block->flags |= SQFS_BLK_IS_COMPRESSED;
+		block->cmp_method = ent->cmp_method;
+	}
+
+	return true;
+}
+
+void cmp_cache_insert(cmp_cache_t *cache, const sqfs_block_t *block,
+		      sqfs_u64 hash, const sqfs_u8 *cmp_data,
+		      size_t cmp_size, sqfs_u32 cmp_method)
+{
+	sqfs_u64 *seen = cache->seen + (hash & (CMP_CACHE_SEEN - 1));
+	cmp_cache_ent_t *ent = cache->entries;
+	size_t i;
+
+	if (*seen != hash) {
+		*seen = hash;
+		return;
+	}
+
+	for (i = 1; i < cache->num_entries; ++i) {
+		if (cache->entries[i].last_use < ent->last_use)
+			ent = cache->entries + i;
+	}
+
+	if (ent->data == NULL) {
+		ent->data = malloc(2 * cache->max_block_size);
+		if (ent->data == NULL)
+			return;
+	}
+
+	memcpy(ent->data, block->data, block->size);
+	memcpy(ent->data + block->size, cmp_data, cmp_size);
+
+	ent->hash = hash;
+	ent->last_use = ++cache->clock;
+	ent->size = block->size;
+	ent->cmp_size = cmp_size;
+	ent->cmp_id = block->cmp_id;
+	ent->cmp_hint = block->cmp_hint;
+	ent->cmp_method = cmp_method;
+}
+
+size_t cmp_cache_take_hits(cmp_cache_t *cache)
+{
+	size_t hits = cache->hits;
+
+	cache->hits = 0;
+	return hits;
+}
@@ -7,126 +7,296 @@
 #define SQFS_BUILDING_DLL
 #include "internal.h"
 
-void free_blk_list(sqfs_block_t *list)
+void free_blk_list(sqfs_data_writer_t *proc, sqfs_block_t *list)
 {
 	sqfs_block_t *it;
 
 	while (list != NULL) {
 		it = list;
 		list = list->next;
-		free(it);
+		hook_free(proc->allocator, it);
 	}
 }
 
 int data_writer_init(sqfs_data_writer_t *proc, size_t max_block_size,
 		     sqfs_compressor_t *cmp, unsigned int num_workers,
-		     size_t max_backlog, size_t devblksz, sqfs_file_t *file)
+		     size_t max_backlog, size_t pool_size, size_t devblksz,
+		     sqfs_file_t *file, sqfs_u32 flags)
 {
+	proc->flags = flags;
 	proc->max_block_size = max_block_size;
 	proc->num_workers = num_workers;
 	proc->max_backlog = max_backlog;
+	proc->pool_size = pool_size;
 	proc->devblksz = devblksz;
 	proc->cmp = cmp;
+	proc->cmp_list[0] = cmp;
+	proc->num_cmp = 1;
 	proc->file = file;
 	proc->max_blocks = INIT_BLOCK_COUNT;
 	proc->frag_list_max = INIT_BLOCK_COUNT;
+#ifdef WITH_PTHREAD
+	proc->stream_mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	proc->stream_cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+#endif
+
+	if (flags & SQFS_DATA_WRITER_HUGE_PAGES) {
+		proc->huge_pool = huge_pool_create(sizeof(sqfs_block_t) +
+						   max_block_size);
+		if (proc->huge_pool == NULL)
+			return -1;
+
+		proc->allocator = huge_pool_allocator(proc->huge_pool);
+	}
 
 	proc->blocks = alloc_array(sizeof(proc->blocks[0]), proc->max_blocks);
 	if (proc->blocks == NULL)
 		return -1;
 
+	proc->num_blk_buckets = INIT_BLOCK_COUNT;
+	proc->blk_buckets = alloc_array(sizeof(proc->blk_buckets[0]),
+					proc->num_blk_buckets);
+	if (proc->blk_buckets == NULL)
+		return -1;
+
 	proc->frag_list = alloc_array(sizeof(proc->frag_list[0]),
 				      proc->frag_list_max);
 	if (proc->frag_list == NULL)
 		return -1;
 
+	proc->time_start = data_writer_clock(proc);
+
+	proc->frag_hash_max = INIT_FRAG_HASH_SIZE;
+	proc->frag_hash = alloc_array(sizeof(proc->frag_hash[0]),
+				      proc->frag_hash_max);
+	if (proc->frag_hash == NULL)
+		return -1;
+
 	return 0;
 }
 
 void data_writer_cleanup(sqfs_data_writer_t *proc)
 {
-	free_blk_list(proc->queue);
-	free_blk_list(proc->done);
-	free(proc->blk_current);
-	free(proc->frag_block);
+	size_t i;
+
+	if (proc->done != NULL) {
+		for (i = 0; i <= proc->done_mask; ++i)
+			hook_free(proc->allocator, proc->done[i]);
+
+		free(proc->done);
+	}
+
+	free_blk_list(proc, proc->pool);
+	hook_free(proc->allocator, proc->blk_current);
+
+	data_writer_free_streams(proc);
+#ifdef WITH_PTHREAD
+	pthread_cond_destroy(&proc->stream_cond);
+	pthread_mutex_destroy(&proc->stream_mtx);
+#endif
+
+	for (i = 0; i < FRAG_MAX_OPEN; ++i)
+		hook_free(proc->allocator, proc->frag_blocks[i]);
+
+	for (i = 0; i < proc->num_pending; ++i)
+		hook_free(proc->allocator, proc->frag_pending[i].frag);
+
+	free(proc->frag_pending);
+	free(proc->file_wait);
+	free(proc->queued_at);
+	free(proc->done_at);
+#ifdef WITH_PTHREAD
+	free(proc->queued_size);
+#endif
+
+	free(proc->frag_hash);
 	free(proc->frag_list);
 	free(proc->fragments);
+	free(proc->links);
+	free(proc->hold_buf);
+	free(proc->blk_buckets);
 	free(proc->blocks);
+	huge_pool_destroy(proc->huge_pool);
 	free(proc);
 }
 
-void data_writer_store_done(sqfs_data_writer_t *proc, sqfs_block_t *blk,
-			    int status)
+sqfs_block_t *data_writer_alloc_block(sqfs_data_writer_t *proc)
 {
-	sqfs_block_t *it = proc->done, *prev = NULL;
+	sqfs_block_t *blk = proc->pool;
+
+	if (blk == NULL) {
+		blk = hook_alloc_flex(proc->allocator, sizeof(*blk), 1,
+				      proc->max_block_size);
+
+		if (blk != NULL) {
+			proc->blocks_allocated = true;
+			proc->mem_blocks += sizeof(*blk) + proc->max_block_size;
+			data_writer_track_mem(proc);
+		}
 
-	while (it != NULL) {
-		if (it->sequence_number >= blk->sequence_number)
-			break;
-		prev = it;
-		it = it->next;
+		return blk;
 	}
 
-	if (prev == NULL) {
-		blk->next = proc->done;
-		proc->done = blk;
-	} else {
-		blk->next = prev->next;
-		prev->next = blk;
+	proc->pool = blk->next;
+	proc->pool_count -= 1;
+
+	memset(blk, 0, sizeof(*blk));
+	return blk;
+}
+
+void data_writer_free_block(sqfs_data_writer_t *proc, sqfs_block_t *blk)
+{
+	if (blk == NULL)
+		return;
+
+	if (proc->pool_count >= proc->pool_size) {
+		proc->mem_blocks -= sizeof(*blk) + proc->max_block_size;
+		hook_free(proc->allocator, blk);
+		return;
 	}
 
+	blk->next = proc->pool;
+	proc->pool = blk;
+	proc->pool_count += 1;
+}
+
+void data_writer_store_done(sqfs_data_writer_t *proc, sqfs_block_t *blk,
+			    int status)
+{
+	proc->done[blk->sequence_number & proc->done_mask] = blk;
+
 	if (status != 0 && proc->status == 0)
 		proc->status = status;
+}
+
+/*
+  xxHash is several times faster than the CRC32 implementation of zlib, so
+  the data is only hashed once and the checksum used for lookups is folded
+  from the 64 bit hash. The full hash is kept as digest if requested.
+ */
+sqfs_u64 data_writer_hash(const sqfs_data_writer_t *proc, const void *data,
+			  size_t size, sqfs_u32 *checksum, sqfs_u64 *digest)
+{
+	sqfs_u64 hash = xxh64(data, size);
 
-	proc->backlog -= 1;
+	*checksum = (sqfs_u32)(hash ^ (hash >> 32));
+	*digest = (proc->flags & SQFS_DATA_WRITER_VERIFY_DEDUP) ? hash : 0;
+	return hash;
 }
 
-sqfs_block_t *data_writer_next_work_item(sqfs_data_writer_t *proc)
+sqfs_u64 data_writer_checksum(const sqfs_data_writer_t *proc,
+			      sqfs_block_t *block)
 {
-	sqfs_block_t *blk;
+	return data_writer_hash(proc, block->data, block->size,
+				&block->checksum, &block->digest);
+}
 
-	if (proc->status != 0)
-		return NULL;
+/* Returns false if the block is done without going through the compressor. */
+static bool prepare_block(const sqfs_data_writer_t *proc, sqfs_block_t *block,
+			  cmp_cache_t *cache, sqfs_u64 *hash)
+{
+	if (block->size == 0) {
+		block->checksum = 0;
+		block->digest = 0;
+		return false;
+	}
 
-	blk = proc->queue;
-	proc->queue = blk->next;
-	blk->next = NULL;
+	*hash = data_writer_checksum(proc, block);
+	block->cmp_method = 0;
 
-	if (proc->queue == NULL)
-		proc->queue_last = NULL;
+	if (block->flags & SQFS_BLK_DONT_COMPRESS)
+		return false;
 
-	return blk;
+	if (cache != NULL && cmp_cache_lookup(cache, block, *hash))
+		return false;
+
+	return true;
 }
 
-int data_writer_do_block(sqfs_block_t *block, sqfs_compressor_t *cmp,
-			 sqfs_u8 *scratch, size_t scratch_size)
+static int finish_block(sqfs_block_t *block, cmp_cache_t *cache,
+			sqfs_u64 hash, const sqfs_u8 *scratch, sqfs_s32 ret,
+			sqfs_u32 method)
 {
-	ssize_t ret;
+	if (ret < 0)
+		return ret;
 
-	if (block->size == 0) {
-		block->checksum = 0;
-		return 0;
+	if (cache != NULL)
+		cmp_cache_insert(cache, block, hash, scratch, ret, method);
+
+	if (ret > 0) {
+		memcpy(block->data, scratch, ret);
+		block->size = ret;
+		block->flags |= SQFS_BLK_IS_COMPRESSED;
+		block->cmp_method = method;
 	}
 
-	block->checksum = crc32(0, block->data, block->size);
+	return 0;
+}
+
+int data_writer_do_block(const sqfs_data_writer_t *proc, sqfs_block_t *block,
+			 sqfs_compressor_t *cmp, sqfs_u8 *scratch,
+			 cmp_cache_t *cache)
+{
+	sqfs_u64 hash;
+	sqfs_s32 ret;
 
-	if (block->flags & SQFS_BLK_IS_FRAGMENT)
+	if (!prepare_block(proc, block, cache, &hash))
 		return 0;
 
-	if (!(block->flags & SQFS_BLK_DONT_COMPRESS)) {
-		ret = cmp->do_block(cmp, block->data, block->size,
-				    scratch, scratch_size);
-		if (ret < 0)
-			return ret;
+	cmp->method_hint = block->cmp_hint;
 
-		if (ret > 0) {
-			memcpy(block->data, scratch, ret);
-			block->size = ret;
-			block->flags |= SQFS_BLK_IS_COMPRESSED;
-		}
+	ret = cmp->do_block(cmp, block->data, block->size,
+			    scratch, proc->max_block_size);
+
+	return finish_block(block, cache, hash, scratch, ret, cmp->method);
+}
+
+void data_writer_do_blocks(const sqfs_data_writer_t *proc,
+			   sqfs_block_t **blocks, size_t count,
+			   sqfs_compressor_t *cmp, sqfs_u8 *scratch,
+			   cmp_cache_t *cache, int *status)
+{
+	sqfs_compressor_job_t jobs[DATA_WRITER_BATCH];
+	sqfs_u64 hashes[DATA_WRITER_BATCH];
+	size_t idx[DATA_WRITER_BATCH];
+	size_t i, num_jobs = 0;
+	sqfs_block_t *blk;
+	int ret;
+
+	/* the compressor only sees the blocks that actually need it */
+	for (i = 0; i < count; ++i) {
+		status[i] = 0;
+
+		if (!prepare_block(proc, blocks[i], cache, hashes + i))
+			continue;
+
+		jobs[num_jobs].in = blocks[i]->data;
+		jobs[num_jobs].out = scratch + i * proc->max_block_size;
+		jobs[num_jobs].size = blocks[i]->size;
+		jobs[num_jobs].outsize = proc->max_block_size;
+		jobs[num_jobs].method_hint = blocks[i]->cmp_hint;
+		jobs[num_jobs].method = 0;
+		jobs[num_jobs].result = 0;
+		idx[num_jobs++] = i;
 	}
 
-	return 0;
+	if (num_jobs == 0)
+		return;
+
+	ret = sqfs_compressor_do_blocks(cmp, jobs, num_jobs);
+
+	for (i = 0; i < num_jobs; ++i) {
+		blk = blocks[idx[i]];
+
+		if (ret != 0) {
+			status[idx[i]] = ret;
+			continue;
+		}
+
+		status[idx[i]] = finish_block(blk, cache, hashes[idx[i]],
+					      jobs[i].out, jobs[i].result,
+					      jobs[i].method);
+	}
 }
 
 int sqfs_data_writer_write_fragment_table(sqfs_data_writer_t *proc,
@@ -145,8 +315,9 @@ int sqfs_data_writer_write_fragment_table(sqfs_data_writer_t *proc,
 	}
 
 	size = sizeof(proc->fragments[0]) * proc->num_fragments;
-	ret = sqfs_write_table(proc->file, proc->cmp,
-			       proc->fragments, size, &start);
+	ret = sqfs_write_table_parallel(proc->file, proc->cmp,
+					proc->fragments, size, &start,
+					proc->num_workers);
 	if (ret)
 		return ret;
 
@@ -157,6 +328,54 @@ int sqfs_data_writer_write_fragment_table(sqfs_data_writer_t *proc,
 	return 0;
 }
 
+size_t data_writer_mem_used(const sqfs_data_writer_t *proc)
+{
+	size_t total = proc->mem_blocks + proc->hold_max;
+
+	total += proc->pending_bytes +
+		proc->num_pending * sizeof(sqfs_block_t);
+
+	if (proc->output != NULL)
+		total += 2 * OUTPUT_BUFFER_SIZE;
+
+	return total;
+}
+
+void data_writer_track_mem(sqfs_data_writer_t *proc)
+{
+	size_t used = data_writer_mem_used(proc);
+
+	if (used > proc->timing.mem_peak)
+		proc->timing.mem_peak = used;
+}
+
+bool data_writer_over_budget(const sqfs_data_writer_t *proc, size_t extra)
+{
+	if (proc->mem_limit == 0)
+		return false;
+
+	return data_writer_mem_used(proc) + extra > proc->mem_limit;
+}
+
+int sqfs_data_writer_set_memory_limit(sqfs_data_writer_t *proc, size_t limit)
+{
+	proc->mem_limit = limit;
+	return 0;
+}
+
+int sqfs_data_writer_set_allocator(sqfs_data_writer_t *proc,
+				   const sqfs_allocator_t *allocator)
+{
+	if (proc->blocks_allocated)
+		return SQFS_ERROR_UNSUPPORTED;
+
+	if (allocator == NULL && proc->huge_pool != NULL)
+		allocator = huge_pool_allocator(proc->huge_pool);
+
+	proc->allocator = allocator;
+	return 0;
+}
+
 int sqfs_data_writer_set_hooks(sqfs_data_writer_t *proc, void *user_ptr,
 			       const sqfs_block_hooks_t *hooks)
 {
@@ -167,3 +386,77 @@ int sqfs_data_writer_set_hooks(sqfs_data_writer_t *proc, void *user_ptr,
 	proc->user_ptr = user_ptr;
 	return 0;
 }
+
+sqfs_u64 data_writer_clock(const sqfs_data_writer_t *proc)
+{
+	if (!(proc->flags & SQFS_DATA_WRITER_TIMING))
+		return 0;
+
+	return get_time_ns();
+}
+
+void data_writer_sample_backlog(sqfs_data_writer_t *proc, size_t depth)
+{
+	size_t idx;
+
+	if (!(proc->flags & SQFS_DATA_WRITER_TIMING))
+		return;
+
+	idx = (depth * 8) / proc->max_backlog;
+	if (idx > 7)
+		idx = 7;
+
+	proc->timing.backlog_hist[idx] += 1;
+	proc->timing.backlog_sum += depth;
+
+	if (depth > proc->timing.backlog_max)
+		proc->timing.backlog_max = depth;
+}
+
+int sqfs_data_writer_get_timing(sqfs_data_writer_t *proc,
+				sqfs_data_writer_timing_t *out)
+{
+	sqfs_u64 end;
+
+	if (out->size != sizeof(*out) ||
+	    !(proc->flags & SQFS_DATA_WRITER_TIMING)) {
+		return SQFS_ERROR_UNSUPPORTED;
+	}
+
+	data_writer_copy_timing(proc, out);
+
+	end = proc->time_end ? proc->time_end : data_writer_clock(proc);
+
+	out->size = sizeof(*out);
+	out->total_time = end - proc->time_start;
+	out->backlog_limit = proc->max_backlog;
+	return 0;
+}
+
+size_t sqfs_data_writer_get_backlog(const sqfs_data_writer_t *proc)
+{
+	return proc->enqueue_id - proc->dequeue_id;
+}
+
+int sqfs_data_writer_get_stats(sqfs_data_writer_t *proc,
+			       sqfs_data_writer_stats_t *out)
+{
+	if (out->size != sizeof(*out))
+		return SQFS_ERROR_UNSUPPORTED;
+
+	data_writer_copy_stats(proc, out);
+
+	out->size = sizeof(*out);
+	out->backlog_limit = proc->max_backlog;
+	return 0;
+}
+
+int sqfs_data_writer_get_worker_stats(sqfs_data_writer_t *proc,
+				      unsigned int index,
+				      sqfs_data_writer_worker_stats_t *out)
+{
+	if (out->size != sizeof(*out))
+		return SQFS_ERROR_UNSUPPORTED;
+
+	return data_writer_copy_worker_stats(proc, index, out);
+}
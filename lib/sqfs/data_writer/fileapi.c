@@ -7,14 +7,70 @@
 #define SQFS_BUILDING_DLL
 #include "internal.h"
 
-static bool is_zero_block(unsigned char *ptr, size_t size)
+#include "util/cpu.h"
+
+/*
+  Already compressed or encrypted data has an almost uniform byte
+  distribution. Do a chi-squared test of a few samples against the uniform
+  distribution; a statistic below a tenth of the sample size is way outside
+  of anything compressible data produces, while random data ends up around
+  255.
+ */
+static bool is_incompressible(const sqfs_u8 *data, size_t size)
+{
+	size_t i, j, n = 0, step, len, hist[256];
+	sqfs_u64 sum = 0;
+
+	if (size < PROBE_CHUNK_SIZE)
+		return false;
+
+	memset(hist, 0, sizeof(hist));
+
+	len = PROBE_CHUNK_SIZE;
+	step = (size - len) / (PROBE_CHUNKS - 1);
+
+	for (i = 0; i < PROBE_CHUNKS; ++i) {
+		for (j = 0; j < len; ++j)
+			hist[data[i * step + j]] += 1;
+
+		n += len;
+	}
+
+	for (i = 0; i < 256; ++i)
+		sum += (sqfs_u64)hist[i] * hist[i];
+
+	/* chi^2 = 256 * sum / n - n <= n / 10 */
+	return sum * 256 * 10 <= (sqfs_u64)n * n * 11;
+}
+
+static void probe_block(sqfs_data_writer_t *proc, sqfs_block_t *block)
 {
-	return ptr[0] == 0 && memcmp(ptr, ptr + 1, size - 1) == 0;
+	if (!(proc->flags & SQFS_DATA_WRITER_DETECT_INCOMPRESSIBLE) ||
+	    (block->flags & SQFS_BLK_DONT_COMPRESS)) {
+		return;
+	}
+
+	if (proc->skip_compress) {
+		block->flags |= SQFS_BLK_DONT_COMPRESS;
+		return;
+	}
+
+	if (!is_incompressible(block->data, block->size))
+		return;
+
+	block->flags |= SQFS_BLK_DONT_COMPRESS;
+
+	if (block->index == proc->probe_streak) {
+		proc->probe_streak += 1;
+
+		if (proc->probe_streak >= PROBE_LEARN_BLOCKS)
+			proc->skip_compress = true;
+	}
 }
 
 static int add_sentinel_block(sqfs_data_writer_t *proc)
 {
-	sqfs_block_t *blk = calloc(1, sizeof(*blk));
+	sqfs_block_t *blk = data_writer_alloc_block(proc);
 
 	if (blk == NULL)
 		return test_and_set_status(proc, SQFS_ERROR_ALLOC);
@@ -25,8 +81,8 @@ static int add_sentinel_block(sqfs_data_writer_t *proc)
 	return data_writer_enqueue(proc, blk);
 }
 
-int sqfs_data_writer_begin_file(sqfs_data_writer_t *proc,
-				sqfs_inode_generic_t *inode, sqfs_u32 flags)
+int data_writer_begin_file(sqfs_data_writer_t *proc,
+			   sqfs_inode_generic_t *inode, sqfs_u32 flags)
 {
 	if (proc->inode != NULL)
 		return test_and_set_status(proc, SQFS_ERROR_INTERNAL);
@@ -38,110 +94,461 @@ int sqfs_data_writer_begin_file(sqfs_data_writer_t *proc,
 	proc->blk_flags = flags | SQFS_BLK_FIRST_BLOCK;
 	proc->blk_index = 0;
 	proc->blk_current = NULL;
+	proc->frag_group = 0;
+	proc->cmp_id = proc->default_cmp_id;
+	proc->cmp_hint = 0;
+	proc->skip_compress = false;
+	proc->probe_streak = 0;
+	return 0;
+}
+
+/* files have to come after the streams opened before them */
+int sqfs_data_writer_begin_file(sqfs_data_writer_t *proc,
+				sqfs_inode_generic_t *inode, sqfs_u32 flags)
+{
+	if (proc->streams != NULL)
+		return test_and_set_status(proc, SQFS_ERROR_INTERNAL);
+
+	return data_writer_begin_file(proc, inode, flags);
+}
+
+int sqfs_data_writer_set_compressor(sqfs_data_writer_t *proc, sqfs_u32 id)
+{
+	if (proc->inode == NULL || id >= proc->num_cmp)
+		return test_and_set_status(proc, SQFS_ERROR_INTERNAL);
+
+	proc->cmp_id = id;
+	return 0;
+}
+
+int sqfs_data_writer_set_default_compressor(sqfs_data_writer_t *proc,
+					    sqfs_u32 id)
+{
+	if (id >= proc->num_cmp)
+		return test_and_set_status(proc, SQFS_ERROR_INTERNAL);
+
+	proc->default_cmp_id = id;
+	return 0;
+}
+
+int sqfs_data_writer_set_fragment_group(sqfs_data_writer_t *proc,
+					sqfs_u32 group)
+{
+	if (proc->inode == NULL)
+		return test_and_set_status(proc, SQFS_ERROR_INTERNAL);
+
+	proc->frag_group = group;
 	return 0;
 }
 
+static void add_sparse_block(sqfs_data_writer_t *proc, size_t index,
+			     size_t size)
+{
+	sqfs_inode_make_extended(proc->inode);
+	proc->inode->data.file_ext.sparse += size;
+	proc->inode->num_file_blocks += 1;
+	proc->inode->block_sizes[index] = 0;
+}
+
 static int flush_block(sqfs_data_writer_t *proc, sqfs_block_t *block)
 {
+	sqfs_compressor_t *cmp;
+
 	block->index = proc->blk_index++;
 	block->flags = proc->blk_flags;
 	block->inode = proc->inode;
 
-	if (is_zero_block(block->data, block->size)) {
-		sqfs_inode_make_extended(proc->inode);
-		proc->inode->data.file_ext.sparse += block->size;
-		proc->inode->num_file_blocks += 1;
-		proc->inode->block_sizes[block->index] = 0;
-		free(block);
-		return 0;
+	if (cpu_kernels.is_zero(block->data, block->size)) {
+		add_sparse_block(proc, block->index, block->size);
+
+		if (!(block->flags & SQFS_BLK_LAST_BLOCK)) {
+			data_writer_free_block(proc, block);
+			return 0;
+		}
+
+		/* still needed to terminate the file */
+		block->size = 0;
+		return data_writer_enqueue(proc, block);
 	}
 
 	if (block->size < proc->max_block_size &&
 	    !(block->flags & SQFS_BLK_DONT_FRAGMENT)) {
 		block->flags |= SQFS_BLK_IS_FRAGMENT;
-	} else {
-		proc->inode->num_file_blocks += 1;
-		proc->blk_flags &= ~SQFS_BLK_FIRST_BLOCK;
+		return data_writer_add_fragment(proc, block);
 	}
 
+	probe_block(proc, block);
+	block->cmp_id = proc->cmp_id;
+
+	cmp = proc->cmp_list[proc->cmp_id];
+
+	if ((block->flags & SQFS_BLK_FIRST_BLOCK) && cmp->probe_file != NULL)
+		proc->cmp_hint = cmp->probe_file(cmp, block->data, block->size);
+
+	block->cmp_hint = proc->cmp_hint;
+
+	proc->inode->num_file_blocks += 1;
+	proc->blk_flags &= ~SQFS_BLK_FIRST_BLOCK;
 	return data_writer_enqueue(proc, block);
 }
 
+/*
+  If a new block would have to be allocated beyond the memory limit, wait
+  for blocks in flight to come back to the pool. If nothing is in flight,
+  there is nothing to wait for and the limit is exceeded instead of
+  getting stuck.
+ */
+static int wait_for_memory(sqfs_data_writer_t *proc)
+{
+	size_t before, blksz = sizeof(sqfs_block_t) + proc->max_block_size;
+	int err;
+
+	while (proc->pool == NULL && data_writer_over_budget(proc, blksz)) {
+		before = proc->mem_blocks;
+
+		err = data_writer_wait_done(proc);
+		if (err)
+			return err;
+
+		if (proc->pool == NULL && proc->mem_blocks == before)
+			break;
+	}
+
+	return 0;
+}
+
+int sqfs_data_writer_get_buffer(sqfs_data_writer_t *proc, void **buffer,
+				size_t *size)
+{
+	int err;
+
+	if (proc->inode == NULL)
+		return test_and_set_status(proc, SQFS_ERROR_INTERNAL);
+
+	if (proc->blk_current != NULL &&
+	    proc->blk_current->size == proc->max_block_size) {
+		err = flush_block(proc, proc->blk_current);
+		proc->blk_current = NULL;
+		if (err)
+			return err;
+	}
+
+	if (proc->blk_current == NULL) {
+		err = wait_for_memory(proc);
+		if (err)
+			return err;
+
+		proc->blk_current = data_writer_alloc_block(proc);
+
+		if (proc->blk_current == NULL)
+			return test_and_set_status(proc, SQFS_ERROR_ALLOC);
+	}
+
+	*buffer = proc->blk_current->data + proc->blk_current->size;
+	*size = proc->max_block_size - proc->blk_current->size;
+	return 0;
+}
+
+int sqfs_data_writer_commit(sqfs_data_writer_t *proc, size_t size)
+{
+	int err;
+
+	if (proc->blk_current == NULL ||
+	    size > (proc->max_block_size - proc->blk_current->size)) {
+		return test_and_set_status(proc, SQFS_ERROR_INTERNAL);
+	}
+
+	proc->blk_current->size += size;
+
+	if (proc->blk_current->size == proc->max_block_size) {
+		err = flush_block(proc, proc->blk_current);
+		proc->blk_current = NULL;
+		return err;
+	}
+
+	return 0;
+}
+
 int sqfs_data_writer_append(sqfs_data_writer_t *proc, const void *data,
 			    size_t size)
 {
 	size_t diff;
-	void *new;
+	void *ptr;
 	int err;
 
 	while (size > 0) {
-		if (proc->blk_current == NULL) {
-			new = alloc_flex(sizeof(*proc->blk_current), 1,
-					 proc->max_block_size);
+		err = sqfs_data_writer_get_buffer(proc, &ptr, &diff);
+		if (err)
+			return err;
 
-			if (new == NULL)
-				return test_and_set_status(proc,
-							   SQFS_ERROR_ALLOC);
+		if (diff > size)
+			diff = size;
 
-			proc->blk_current = new;
-		}
+		memcpy(ptr, data, diff);
+
+		err = sqfs_data_writer_commit(proc, diff);
+		if (err)
+			return err;
+
+		size -= diff;
+		data = (const char *)data + diff;
+	}
+
+	return 0;
+}
+
+/*
+  Whole blocks of zeros are recorded right away, the same way flush_block
+  handles them, but without filling a block buffer just to look at it.
+ */
+int sqfs_data_writer_append_sparse(sqfs_data_writer_t *proc, sqfs_u64 size)
+{
+	size_t diff;
+	void *ptr;
+	int err;
 
-		diff = proc->max_block_size - proc->blk_current->size;
+	if (proc->inode == NULL)
+		return test_and_set_status(proc, SQFS_ERROR_INTERNAL);
 
-		if (diff == 0) {
-			err = flush_block(proc, proc->blk_current);
-			proc->blk_current = NULL;
-			if (err)
-				return err;
+	while (size > 0) {
+		if (proc->blk_current == NULL && size >= proc->max_block_size) {
+			add_sparse_block(proc, proc->blk_index++,
+					 proc->max_block_size);
+			size -= proc->max_block_size;
 			continue;
 		}
 
-		if (diff > size)
+		err = sqfs_data_writer_get_buffer(proc, &ptr, &diff);
+		if (err)
+			return err;
+
+		if ((sqfs_u64)diff > size)
 			diff = size;
 
-		memcpy(proc->blk_current->data + proc->blk_current->size,
-		       data, diff);
+		memset(ptr, 0, diff);
+
+		err = sqfs_data_writer_commit(proc, diff);
+		if (err)
+			return err;
 
 		size -= diff;
-		proc->blk_current->size += diff;
-		data = (const char *)data + diff;
 	}
 
-	if (proc->blk_current != NULL &&
-	    proc->blk_current->size == proc->max_block_size) {
-		err = flush_block(proc, proc->blk_current);
-		proc->blk_current = NULL;
+	return 0;
+}
+
+/*
+  The block skips the compressor in the workers through the don't compress
+  flag, while the compressed flag tells the output stage how it is stored.
+ */
+int sqfs_data_writer_append_raw(sqfs_data_writer_t *proc, const void *data,
+				sqfs_u32 size)
+{
+	size_t len = SQFS_ON_DISK_BLOCK_SIZE(size);
+	sqfs_block_t *blk;
+	int err;
+
+	if (proc->inode == NULL || proc->blk_current != NULL ||
+	    len == 0 || len > proc->max_block_size) {
+		return test_and_set_status(proc, SQFS_ERROR_INTERNAL);
+	}
+
+	err = wait_for_memory(proc);
+	if (err)
 		return err;
+
+	blk = data_writer_alloc_block(proc);
+	if (blk == NULL)
+		return test_and_set_status(proc, SQFS_ERROR_ALLOC);
+
+	memcpy(blk->data, data, len);
+	blk->size = len;
+	blk->index = proc->blk_index++;
+	blk->inode = proc->inode;
+	blk->flags = proc->blk_flags | SQFS_BLK_DONT_COMPRESS;
+
+	if (SQFS_IS_BLOCK_COMPRESSED(size))
+		blk->flags |= SQFS_BLK_IS_COMPRESSED;
+
+	proc->inode->num_file_blocks += 1;
+	proc->blk_flags &= ~SQFS_BLK_FIRST_BLOCK;
+	return data_writer_enqueue(proc, blk);
+}
+
+static void notify_file_done(sqfs_data_writer_t *proc,
+			     sqfs_inode_generic_t *inode)
+{
+	if (proc->hooks != NULL && proc->hooks->notify_file_done != NULL)
+		proc->hooks->notify_file_done(proc->user_ptr, inode);
+}
+
+/*
+  Must be called before the last block is queued, without threads it is
+  processed right away.
+ */
+static int add_file_wait(sqfs_data_writer_t *proc, bool tail_pending)
+{
+	size_t new_sz, count = proc->files_queued - proc->files_done;
+	file_wait_t *new, *ent;
+	sqfs_u64 i;
+
+	if (proc->file_wait == NULL || count > proc->file_wait_mask) {
+		new_sz = proc->file_wait ? (proc->file_wait_mask + 1) * 2 : 64;
+		new = alloc_array(sizeof(new[0]), new_sz);
+
+		if (new == NULL)
+			return test_and_set_status(proc, SQFS_ERROR_ALLOC);
+
+		for (i = proc->files_done; i < proc->files_queued; ++i) {
+			new[i & (new_sz - 1)] =
+				proc->file_wait[i & proc->file_wait_mask];
+		}
+
+		free(proc->file_wait);
+		proc->file_wait = new;
+		proc->file_wait_mask = new_sz - 1;
 	}
 
+	ent = proc->file_wait + (proc->files_queued & proc->file_wait_mask);
+	ent->inode = proc->inode;
+	ent->tail_pending = tail_pending;
+
+	proc->file_num = ++proc->files_queued;
 	return 0;
 }
 
+void data_writer_blocks_done(sqfs_data_writer_t *proc)
+{
+	file_wait_t *ent;
+
+	ent = proc->file_wait + (proc->files_done & proc->file_wait_mask);
+	proc->files_done += 1;
+
+	if (!ent->tail_pending)
+		notify_file_done(proc, ent->inode);
+}
+
+void data_writer_tail_done(sqfs_data_writer_t *proc,
+			   sqfs_inode_generic_t *inode, sqfs_u64 file_num)
+{
+	if (file_num <= proc->files_done) {
+		notify_file_done(proc, inode);
+	} else {
+		proc->file_wait[(file_num - 1) &
+				proc->file_wait_mask].tail_pending = false;
+	}
+}
+
 int sqfs_data_writer_end_file(sqfs_data_writer_t *proc)
 {
-	int err;
+	sqfs_inode_generic_t *inode = proc->inode;
+	bool tail;
+	int err = 0;
 
 	if (proc->inode == NULL)
 		return test_and_set_status(proc, SQFS_ERROR_INTERNAL);
 
-	if (!(proc->blk_flags & SQFS_BLK_FIRST_BLOCK)) {
-		if (proc->blk_current != NULL &&
-		    (proc->blk_flags & SQFS_BLK_DONT_FRAGMENT)) {
-			proc->blk_flags |= SQFS_BLK_LAST_BLOCK;
-		} else {
+	proc->file_num = 0;
+	proc->tail_deferred = false;
+
+	tail = proc->blk_current != NULL &&
+		!(proc->blk_flags & SQFS_BLK_DONT_FRAGMENT);
+
+	if (proc->blk_current != NULL && !tail) {
+		proc->blk_flags |= SQFS_BLK_LAST_BLOCK;
+		err = add_file_wait(proc, false);
+	} else if (!(proc->blk_flags & SQFS_BLK_FIRST_BLOCK)) {
+		err = add_file_wait(proc, tail);
+		if (err == 0)
 			err = add_sentinel_block(proc);
-			if (err)
-				return err;
-		}
 	}
 
+	if (err)
+		return err;
+
 	if (proc->blk_current != NULL) {
 		err = flush_block(proc, proc->blk_current);
 		proc->blk_current = NULL;
 	}
 
+	/* the tail end is reported by the fragment code if it was deferred */
+	if (err == 0 && !proc->tail_deferred && (tail || proc->file_num == 0))
+		data_writer_tail_done(proc, inode, proc->file_num);
+
 	proc->inode = NULL;
 	proc->blk_flags = 0;
 	proc->blk_index = 0;
 	return 0;
 }
+
+int sqfs_data_writer_link_file(sqfs_data_writer_t *proc,
+			       sqfs_inode_generic_t *inode,
+			       const sqfs_inode_generic_t *original)
+{
+	size_t new_sz;
+	void *new;
+
+	if (proc->inode != NULL)
+		return test_and_set_status(proc, SQFS_ERROR_INTERNAL);
+
+	if (inode->base.type != SQFS_INODE_FILE &&
+	    inode->base.type != SQFS_INODE_EXT_FILE) {
+		return SQFS_ERROR_NOT_FILE;
+	}
+
+	if (original->base.type != SQFS_INODE_FILE &&
+	    original->base.type != SQFS_INODE_EXT_FILE) {
+		return SQFS_ERROR_NOT_FILE;
+	}
+
+	if (proc->num_links == proc->max_links) {
+		new_sz = proc->max_links ? proc->max_links * 2 : 16;
+		new = realloc(proc->links, sizeof(proc->links[0]) * new_sz);
+
+		if (new == NULL)
+			return test_and_set_status(proc, SQFS_ERROR_ALLOC);
+
+		proc->links = new;
+		proc->max_links = new_sz;
+	}
+
+	proc->links[proc->num_links].inode = inode;
+	proc->links[proc->num_links].original = original;
+	proc->num_links += 1;
+	return 0;
+}
+
+static void copy_file_data(sqfs_inode_generic_t *inode,
+			   const sqfs_inode_generic_t *original)
+{
+	sqfs_u32 frag_idx, frag_offset;
+	sqfs_u64 location;
+
+	sqfs_inode_get_file_block_start(original, &location);
+	sqfs_inode_get_frag_location(original, &frag_idx, &frag_offset);
+
+	sqfs_inode_set_file_block_start(inode, location);
+
+	if (original->base.type == SQFS_INODE_EXT_FILE) {
+		sqfs_inode_make_extended(inode);
+		inode->data.file_ext.sparse = original->data.file_ext.sparse;
+	}
+
+	sqfs_inode_set_frag_location(inode, frag_idx, frag_offset);
+
+	memcpy(inode->block_sizes, original->block_sizes,
+	       sizeof(original->block_sizes[0]) * original->num_file_blocks);
+	inode->num_file_blocks = original->num_file_blocks;
+}
+
+void data_writer_resolve_links(sqfs_data_writer_t *proc)
+{
+	size_t i;
+
+	for (i = 0; i < proc->num_links; ++i) {
+		copy_file_data(proc->links[i].inode, proc->links[i].original);
+		notify_file_done(proc, proc->links[i].inode);
+	}
+
+	proc->num_links = 0;
+}
@@ -48,86 +48,266 @@ static int grow_deduplication_list(sqfs_data_writer_t *proc)
 	return 0;
 }
 
+static size_t frag_hash_slot(sqfs_u64 hash, size_t max)
+{
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+
+	return hash & (max - 1);
+}
+
+static size_t *frag_hash_find(sqfs_data_writer_t *proc, sqfs_u64 hash,
+			      sqfs_u64 digest)
+{
+	size_t i = frag_hash_slot(hash, proc->frag_hash_max);
+	const frag_info_t *info;
+
+	while (proc->frag_hash[i] != 0) {
+		info = proc->frag_list + (proc->frag_hash[i] - 1);
+
+		if (info->hash == hash && info->digest == digest)
+			break;
+
+		i = (i + 1) & (proc->frag_hash_max - 1);
+	}
+
+	return proc->frag_hash + i;
+}
+
+static int grow_fragment_hash(sqfs_data_writer_t *proc)
+{
+	size_t i, j, new_sz, *new;
+
+	if (proc->frag_list_num < proc->frag_hash_max / 2)
+		return 0;
+
+	new_sz = proc->frag_hash_max * 2;
+	new = alloc_array(sizeof(new[0]), new_sz);
+	if (new == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	for (i = 0; i < proc->frag_list_num; ++i) {
+		j = frag_hash_slot(proc->frag_list[i].hash, new_sz);
+
+		while (new[j] != 0)
+			j = (j + 1) & (new_sz - 1);
+
+		new[j] = i + 1;
+	}
+
+	free(proc->frag_hash);
+	proc->frag_hash = new;
+	proc->frag_hash_max = new_sz;
+	return 0;
+}
+
+int data_writer_rebuild_frag_hash(sqfs_data_writer_t *proc)
+{
+	size_t i, new_sz = INIT_FRAG_HASH_SIZE, *slot, *new;
+
+	while (proc->frag_list_num >= new_sz / 2)
+		new_sz *= 2;
+
+	new = alloc_array(sizeof(new[0]), new_sz);
+	if (new == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	free(proc->frag_hash);
+	proc->frag_hash = new;
+	proc->frag_hash_max = new_sz;
+
+	/* like in process_completed_fragment, the first duplicate wins */
+	for (i = 0; i < proc->frag_list_num; ++i) {
+		slot = frag_hash_find(proc, proc->frag_list[i].hash,
+				      proc->frag_list[i].digest);
+		if (*slot == 0)
+			*slot = i + 1;
+	}
+
+	return 0;
+}
+
 static int store_fragment(sqfs_data_writer_t *proc, sqfs_block_t *frag,
-			  sqfs_u64 hash)
+			  sqfs_u64 hash, sqfs_block_t *fblk)
 {
 	int err = grow_deduplication_list(proc);
 
 	if (err)
 		return err;
 
-	proc->frag_list[proc->frag_list_num].index = proc->frag_block->index;
-	proc->frag_list[proc->frag_list_num].offset = proc->frag_block->size;
+	proc->frag_list[proc->frag_list_num].index = fblk->index;
+	proc->frag_list[proc->frag_list_num].offset = fblk->size;
 	proc->frag_list[proc->frag_list_num].hash = hash;
+	proc->frag_list[proc->frag_list_num].digest = frag->digest;
 	proc->frag_list_num += 1;
 
-	sqfs_inode_set_frag_location(frag->inode, proc->frag_block->index,
-				     proc->frag_block->size);
+	sqfs_inode_set_frag_location(frag->inode, fblk->index, fblk->size);
 
 	if (proc->hooks != NULL && proc->hooks->pre_fragment_store != NULL) {
 		proc->hooks->pre_fragment_store(proc->user_ptr, frag);
 	}
 
-	memcpy(proc->frag_block->data + proc->frag_block->size,
-	       frag->data, frag->size);
+	memcpy(fblk->data + fblk->size, frag->data, frag->size);
 
-	proc->frag_block->flags |= (frag->flags & SQFS_BLK_DONT_COMPRESS);
-	proc->frag_block->size += frag->size;
+	fblk->flags |= (frag->flags & SQFS_BLK_DONT_COMPRESS);
+	fblk->size += frag->size;
 	return 0;
 }
 
-int process_completed_fragment(sqfs_data_writer_t *proc, sqfs_block_t *frag,
-			       sqfs_block_t **blk_out)
+/*
+  Replace the open block in a slot with a new one. The old one, if any, is
+  returned through blk_out to be compressed.
+ */
+static int open_fragment_block(sqfs_data_writer_t *proc, size_t slot,
+			       sqfs_block_t **fblk, sqfs_block_t **blk_out)
 {
-	sqfs_u64 hash;
-	size_t i, size;
+	sqfs_block_t *blk;
 	int err;
 
-	hash = MK_BLK_HASH(frag->checksum, frag->size);
+	err = grow_fragment_table(proc);
+	if (err)
+		return err;
 
-	for (i = 0; i < proc->frag_list_num; ++i) {
-		if (proc->frag_list[i].hash == hash)
-			goto out_duplicate;
-	}
+	blk = data_writer_alloc_block(proc);
+	if (blk == NULL)
+		return SQFS_ERROR_ALLOC;
 
-	if (proc->frag_block != NULL) {
-		size = proc->frag_block->size + frag->size;
+	blk->index = proc->num_fragments++;
+	blk->flags = SQFS_BLK_FRAGMENT_BLOCK;
 
-		if (size > proc->max_block_size) {
-			*blk_out = proc->frag_block;
-			proc->frag_block = NULL;
+	*blk_out = proc->frag_blocks[slot];
+	proc->frag_blocks[slot] = blk;
+	*fblk = blk;
+	return 0;
+}
+
+/*
+  Try the open block of the fragments size class first, then any other open
+  block that still has room for it. If none fits, the block of the size class
+  is replaced by a new one and returned through blk_out.
+ */
+static int select_fragment_block(sqfs_data_writer_t *proc, size_t size,
+				 sqfs_block_t **fblk, sqfs_block_t **blk_out)
+{
+	size_t i, cls = (size * FRAG_SIZE_CLASSES) / proc->max_block_size;
+	sqfs_block_t *blk;
+
+	for (i = 0; i < FRAG_SIZE_CLASSES; ++i) {
+		blk = proc->frag_blocks[(cls + i) % FRAG_SIZE_CLASSES];
+
+		if (blk != NULL && blk->size + size <= proc->max_block_size) {
+			*fblk = blk;
+			return 0;
 		}
 	}
 
-	if (proc->frag_block == NULL) {
-		size = sizeof(sqfs_block_t) + proc->max_block_size;
+	return open_fragment_block(proc, cls, fblk, blk_out);
+}
 
-		err = grow_fragment_table(proc);
-		if (err)
-			goto fail;
+static size_t max_open_fragment_blocks(const sqfs_data_writer_t *proc)
+{
+	size_t count;
+
+	if (proc->mem_limit == 0)
+		return FRAG_MAX_OPEN;
+
+	count = proc->mem_limit / MEM_LIMIT_SHARE / proc->max_block_size;
 
-		proc->frag_block = calloc(1, size);
-		if (proc->frag_block == NULL) {
-			err = SQFS_ERROR_ALLOC;
-			goto fail;
+	if (count < FRAG_SIZE_CLASSES)
+		return FRAG_SIZE_CLASSES;
+
+	return count < FRAG_MAX_OPEN ? count : FRAG_MAX_OPEN;
+}
+
+/*
+  Put the fragment into the open block that has the least space left
+  after adding it. If none has room, open another block, or if too many
+  are open already, replace the fullest one.
+ */
+static int select_best_fit(sqfs_data_writer_t *proc, size_t size,
+			   sqfs_block_t **fblk, sqfs_block_t **blk_out)
+{
+	size_t i, avail, best_avail = 0, full_avail = 0;
+	size_t count = max_open_fragment_blocks(proc);
+	size_t best = count, fullest = count, empty = count;
+	sqfs_block_t *blk;
+
+	for (i = 0; i < count; ++i) {
+		blk = proc->frag_blocks[i];
+
+		if (blk == NULL) {
+			if (empty == count)
+				empty = i;
+			continue;
 		}
 
-		proc->frag_block->index = proc->num_fragments++;
-		proc->frag_block->flags = SQFS_BLK_FRAGMENT_BLOCK;
+		avail = proc->max_block_size - blk->size;
+
+		if (avail >= size && (best == count || avail < best_avail)) {
+			best = i;
+			best_avail = avail;
+		}
+
+		if (fullest == count || avail < full_avail) {
+			fullest = i;
+			full_avail = avail;
+		}
+	}
+
+	if (best < count) {
+		*fblk = proc->frag_blocks[best];
+		return 0;
+	}
+
+	return open_fragment_block(proc, empty < count ? empty : fullest,
+				   fblk, blk_out);
+}
+
+int process_completed_fragment(sqfs_data_writer_t *proc, sqfs_block_t *frag,
+			       sqfs_block_t **blk_out)
+{
+	sqfs_block_t *fblk;
+	size_t i, *slot;
+	sqfs_u64 hash;
+	int err;
+
+	err = grow_fragment_hash(proc);
+	if (err)
+		goto fail;
+
+	hash = MK_BLK_HASH(frag->checksum, frag->size);
+	slot = frag_hash_find(proc, hash, frag->digest);
+
+	if (*slot != 0 && !(frag->flags & SQFS_BLK_DONT_DEDUPLICATE)) {
+		i = *slot - 1;
+		goto out_duplicate;
 	}
 
-	err = store_fragment(proc, frag, hash);
+	if (proc->flags & SQFS_DATA_WRITER_BEST_FIT_FRAGMENTS) {
+		err = select_best_fit(proc, frag->size, &fblk, blk_out);
+	} else {
+		err = select_fragment_block(proc, frag->size, &fblk, blk_out);
+	}
 	if (err)
 		goto fail;
 
+	err = store_fragment(proc, frag, hash, fblk);
+	if (err)
+		goto fail;
+
+	/* keep the slot of an existing duplicate, it comes first */
+	if (*slot == 0)
+		*slot = proc->frag_list_num;
 	return 0;
 fail:
-	free(*blk_out);
+	data_writer_free_block(proc, *blk_out);
 	*blk_out = NULL;
 	return err;
 out_duplicate:
 	sqfs_inode_set_frag_location(frag->inode, proc->frag_list[i].index,
 				     proc->frag_list[i].offset);
+	proc->dedup_fragments += 1;
 
 	if (proc->hooks != NULL &&
 	    proc->hooks->notify_fragment_discard != NULL) {
@@ -135,3 +315,143 @@ out_duplicate:
 	}
 	return 0;
 }
+
+static int pack_fragment(sqfs_data_writer_t *proc, sqfs_block_t *frag)
+{
+	sqfs_block_t *fblk = NULL;
+	int err;
+
+	data_writer_checksum(proc, frag);
+
+	err = process_completed_fragment(proc, frag, &fblk);
+	if (err)
+		return test_and_set_status(proc, err);
+
+	if (fblk == NULL)
+		return 0;
+
+	return data_writer_enqueue(proc, fblk);
+}
+
+static int cmp_pending(const void *lhs, const void *rhs)
+{
+	const frag_pending_t *l = lhs, *r = rhs;
+
+	if (l->group != r->group)
+		return l->group < r->group ? -1 : 1;
+
+	return l->order < r->order ? -1 : (l->order > r->order ? 1 : 0);
+}
+
+int data_writer_flush_pending(sqfs_data_writer_t *proc)
+{
+	size_t i;
+	int err = 0;
+
+	if (proc->num_pending == 0)
+		return 0;
+
+	qsort(proc->frag_pending, proc->num_pending,
+	      sizeof(proc->frag_pending[0]), cmp_pending);
+
+	for (i = 0; i < proc->num_pending; ++i) {
+		if (err == 0) {
+			err = pack_fragment(proc, proc->frag_pending[i].frag);
+
+			if (err == 0) {
+				data_writer_tail_done(proc,
+					proc->frag_pending[i].frag->inode,
+					proc->frag_pending[i].file_num);
+			}
+		}
+
+		hook_free(proc->allocator, proc->frag_pending[i].frag);
+	}
+
+	proc->num_pending = 0;
+	proc->pending_bytes = 0;
+	return err;
+}
+
+static int defer_fragment(sqfs_data_writer_t *proc, sqfs_block_t *frag)
+{
+	frag_pending_t *new;
+	sqfs_block_t *copy;
+	size_t new_sz, window;
+
+	if (proc->num_pending == proc->max_pending) {
+		new_sz = proc->max_pending ? proc->max_pending * 2 : 64;
+		new = realloc(proc->frag_pending, sizeof(new[0]) * new_sz);
+
+		if (new == NULL)
+			return test_and_set_status(proc, SQFS_ERROR_ALLOC);
+
+		proc->frag_pending = new;
+		proc->max_pending = new_sz;
+	}
+
+	/* the tail end is usually small, don't hold on to a whole block */
+	copy = hook_alloc(proc->allocator, sizeof(*copy) + frag->size);
+	if (copy == NULL)
+		return test_and_set_status(proc, SQFS_ERROR_ALLOC);
+
+	memcpy(copy, frag, sizeof(*frag) + frag->size);
+	copy->next = NULL;
+
+	proc->frag_pending[proc->num_pending].frag = copy;
+	proc->frag_pending[proc->num_pending].group = proc->frag_group;
+	proc->frag_pending[proc->num_pending].order = proc->num_pending;
+	proc->frag_pending[proc->num_pending].file_num = proc->file_num;
+	proc->num_pending += 1;
+	proc->tail_deferred = true;
+	proc->pending_bytes += frag->size;
+	data_writer_track_mem(proc);
+
+	window = FRAG_GROUP_WINDOW * proc->max_block_size;
+	if (proc->mem_limit > 0 && proc->mem_limit / MEM_LIMIT_SHARE < window)
+		window = proc->mem_limit / MEM_LIMIT_SHARE;
+
+	if (proc->pending_bytes >= window)
+		return data_writer_flush_pending(proc);
+
+	return 0;
+}
+
+int data_writer_add_fragment(sqfs_data_writer_t *proc, sqfs_block_t *frag)
+{
+	int err;
+
+	if (proc->flags & SQFS_DATA_WRITER_GROUP_FRAGMENTS) {
+		err = defer_fragment(proc, frag);
+	} else {
+		err = pack_fragment(proc, frag);
+	}
+
+	data_writer_free_block(proc, frag);
+	return err;
+}
+
+int data_writer_flush_fragments(sqfs_data_writer_t *proc)
+{
+	sqfs_block_t *fblk;
+	size_t i;
+	int err;
+
+	err = data_writer_flush_pending(proc);
+	if (err)
+		return err;
+
+	for (i = 0; i < FRAG_MAX_OPEN; ++i) {
+		fblk = proc->frag_blocks[i];
+		proc->frag_blocks[i] = NULL;
+
+		if (fblk == NULL)
+			continue;
+
+		err = data_writer_enqueue(proc, fblk);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
@@ -13,17 +13,19 @@
 #include "sqfs/compressor.h"
 #include "sqfs/inode.h"
 #include "sqfs/table.h"
+#include "sqfs/trace.h"
 #include "sqfs/error.h"
 #include "sqfs/block.h"
 #include "sqfs/io.h"
 #include "util/util.h"
+#include "../hook_alloc.h"
+#include "../huge_pool.h"
 
 #include <string.h>
 #include <stdlib.h>
-#include <zlib.h>
 
 #ifdef WITH_PTHREAD
-#include <pthread.h>
+#include "../thread_pool.h"
 #endif
 
 
@@ -32,25 +34,157 @@
 
 #define INIT_BLOCK_COUNT (128)
 
+/* must be a power of two */
+#define INIT_FRAG_HASH_SIZE (256)
+
+/*
+  Number of fragment blocks that are kept open at the same time. Tail ends
+  preferably go into the block of their size class.
+ */
+#define FRAG_SIZE_CLASSES (4)
+
+/*
+  With SQFS_DATA_WRITER_BEST_FIT_FRAGMENTS, up to this many fragment blocks
+  are kept open, fewer if a memory limit is set.
+ */
+#define FRAG_MAX_OPEN (16)
+
+/*
+  With SQFS_DATA_WRITER_GROUP_FRAGMENTS, tail ends are held back until they
+  add up to this many fragment blocks, then sorted by group and packed.
+ */
+#define FRAG_GROUP_WINDOW (256)
+
+/*
+  With SQFS_DATA_WRITER_DETECT_INCOMPRESSIBLE, the entropy probe looks at
+  PROBE_CHUNKS samples of PROBE_CHUNK_SIZE bytes per block. If the first
+  PROBE_LEARN_BLOCKS blocks of a file all look incompressible, the rest of
+  the file is stored uncompressed without probing.
+ */
+#define PROBE_CHUNK_SIZE (1024)
+#define PROBE_CHUNKS (4)
+#define PROBE_LEARN_BLOCKS (2)
+
+/* the main compressor plus the ones added with add_compressor */
+#define MAX_COMPRESSORS (8)
+
+/* maximum amount of data held back per file for deduplication */
+#define MAX_HOLD_SIZE (64 * 1024 * 1024)
+
+/* size of each of the two buffers of the write-behind output stage */
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+
+/* chunks an output buffer is split into if the file supports batches */
+#define OUTPUT_BATCH_CHUNK (128 * 1024)
+#define OUTPUT_BATCH_MAX (OUTPUT_BUFFER_SIZE / OUTPUT_BATCH_CHUNK)
+
+/*
+  With a memory limit, held back tail ends and held back file data may
+  each use a fixed fraction of it. Not the actual memory use, so whether
+  they are flushed early does not depend on what is in flight.
+ */
+#define MEM_LIMIT_SHARE (4)
+
+/*
+  With SQFS_DATA_WRITER_CACHE_COMPRESSED, each worker keeps up to this many
+  bytes of recently repeated blocks, but at most CMP_CACHE_MAX_ENTRIES and
+  at least one. CMP_CACHE_SEEN hashes of blocks seen once are remembered,
+  it must be a power of two.
+ */
+#define CMP_CACHE_BYTES (4 * 1024 * 1024)
+#define CMP_CACHE_MAX_ENTRIES (32)
+#define CMP_CACHE_SEEN (1024)
+
+typedef struct cmp_cache_t cmp_cache_t;
+
+/*
+  If a compressor can take several blocks at once, workers take up to this
+  many blocks from their queue in one go and hand them over as a batch.
+ */
+#define DATA_WRITER_BATCH (8)
+
+
+typedef struct {
+	sqfs_block_t *frag;
+	sqfs_u32 group;
+	size_t order;
+
+	/* see file_wait_t, 0 if the file has no blocks */
+	sqfs_u64 file_num;
+} frag_pending_t;
+
+/*
+  A file whose last block has been queued, but not processed yet. Files are
+  numbered in the order their last block is queued, starting at 1, which is
+  also the order in which they are processed.
+ */
+typedef struct {
+	sqfs_inode_generic_t *inode;
+
+	/* the tail end has not been put into a fragment block yet */
+	bool tail_pending;
+} file_wait_t;
+
+typedef struct {
+	sqfs_inode_generic_t *inode;
+	const sqfs_inode_generic_t *original;
+} file_link_t;
 
 typedef struct {
 	sqfs_u64 offset;
 	sqfs_u64 hash;
+	sqfs_u64 digest;
+
+	/* 1-based index of the next block in the same hash bucket, 0 if none */
+	size_t next;
 } blk_info_t;
 
+/* 1-based indices into the block list of the first and last bucket entry */
+typedef struct {
+	size_t head;
+	size_t tail;
+} blk_bucket_t;
+
 typedef struct {
 	sqfs_u32 index;
 	sqfs_u32 offset;
 	sqfs_u64 hash;
+	sqfs_u64 digest;
 } frag_info_t;
 
 
 #ifdef WITH_PTHREAD
 typedef struct {
 	sqfs_data_writer_t *shared;
-	sqfs_compressor_t *cmp;
-	pthread_t thread;
-	sqfs_u8 scratch[];
+	sqfs_compressor_t *cmp[MAX_COMPRESSORS];
+	thread_job_t job;
+	unsigned int index;
+
+	/* blocks handed to this worker, protected by the worker mutex */
+	pthread_mutex_t mtx;
+	pthread_cond_t queue_cond;
+	sqfs_block_t *queue;
+	sqfs_block_t *queue_last;
+	bool stop;
+
+	/* takes no new work and does not steal, see adjust_workers */
+	bool parked;
+
+	/*
+	  allocated by the worker thread itself, NULL if that failed, with
+	  room for max_batch blocks
+	 */
+	sqfs_u8 *scratch;
+	size_t max_batch;
+	cmp_cache_t *cache;
+
+	/* time spent compressing, protected by the shared mutex */
+	sqfs_u64 busy;
+
+	/* what the worker did so far, protected by the shared mutex */
+	sqfs_u64 blocks;
+	sqfs_u64 bytes_in;
+	sqfs_u64 bytes_out;
 } compress_worker_t;
 #endif
 
@@ -58,28 +192,76 @@ struct sqfs_data_writer_t {
 	/* synchronization primitives */
 #ifdef WITH_PTHREAD
 	pthread_mutex_t mtx;
-	pthread_cond_t queue_cond;
 	pthread_cond_t done_cond;
 #endif
 
-	/* needs rw access by worker and main thread */
-	sqfs_block_t *queue;
-	sqfs_block_t *queue_last;
+	/*
+	  needs rw access by worker and main thread
 
-	sqfs_block_t *done;
-	size_t backlog;
+	  Reorder buffer for finished blocks, indexed by sequence number
+	  modulo the size, which is a power of two of at least max_backlog.
+	 */
+	sqfs_block_t **done;
+	size_t done_mask;
 	int status;
 
 	/* used by main thread only */
 	sqfs_u32 enqueue_id;
 	sqfs_u32 dequeue_id;
+	unsigned int next_worker;
 
 	unsigned int num_workers;
 	size_t max_backlog;
 
+#ifdef WITH_PTHREAD
+	/*
+	  With SQFS_DATA_WRITER_ADAPTIVE_WORKERS, only the first active_workers
+	  get new blocks. The window is measured since the last adjustment,
+	  the busy times are added up by the workers under the shared mutex.
+	 */
+	unsigned int active_workers;
+
+	/* windows to wait before growing again, doubled if it didn't help */
+	unsigned int grow_delay;
+	unsigned int grow_backoff;
+
+	struct {
+		sqfs_u64 start;
+		sqfs_u64 wait;
+		sqfs_u64 busy_wall;
+		sqfs_u64 busy_cpu;
+		sqfs_u64 depth_sum;
+		size_t blocks;
+	} window;
+#endif
+
+	/* recycled blocks, used by main thread only */
+	sqfs_block_t *pool;
+	size_t pool_count;
+	size_t pool_size;
+
+	/* block buffers come from here, can only be set before the first */
+	const sqfs_allocator_t *allocator;
+	bool blocks_allocated;
+
+	/*
+	  With SQFS_DATA_WRITER_HUGE_PAGES, the default for the allocator
+	  above and where the worker scratch buffers come from.
+	 */
+	huge_pool_t *huge_pool;
+
+	/* bytes in blocks that exist, in flight or not, and the budget */
+	size_t mem_blocks;
+	size_t mem_limit;
+	sqfs_u32 flags;
+
 	size_t devblksz;
 	sqfs_file_t *file;
 
+	/* write-behind stage in front of the output file, if enabled */
+	sqfs_file_t *output;
+	sqfs_file_t *outfile;
+
 	sqfs_fragment_t *fragments;
 	size_t num_fragments;
 	size_t max_fragments;
@@ -92,19 +274,106 @@ struct sqfs_data_writer_t {
 	blk_info_t *blocks;
 	sqfs_compressor_t *cmp;
 
-	sqfs_block_t *frag_block;
+	/* index 0 is cmp, workers use their own copies */
+	sqfs_compressor_t *cmp_list[MAX_COMPRESSORS];
+	size_t num_cmp;
+
+	blk_bucket_t *blk_buckets;
+	size_t num_blk_buckets;
+	size_t blk_indexed;
+
+	/* compressed data of the current file, held back for dedup */
+	sqfs_u8 *hold_buf;
+	size_t hold_used;
+	size_t hold_max;
+	bool holding;
+	bool hold_overflow;
+
+	sqfs_block_t *frag_blocks[FRAG_MAX_OPEN];
 	frag_info_t *frag_list;
 	size_t frag_list_num;
 	size_t frag_list_max;
 
+	/* open addressing hash table of 1-based indices into frag_list */
+	size_t *frag_hash;
+	size_t frag_hash_max;
+
+	/* tail ends held back for grouping */
+	frag_pending_t *frag_pending;
+	size_t num_pending;
+	size_t max_pending;
+	size_t pending_bytes;
+
 	const sqfs_block_hooks_t *hooks;
 	void *user_ptr;
 
+	/*
+	  Ring buffer of files waiting for their last block, indexed by file
+	  number minus one modulo the size, which is a power of two. Only
+	  used by the main thread.
+	 */
+	file_wait_t *file_wait;
+	size_t file_wait_mask;
+	sqfs_u64 files_queued;
+	sqfs_u64 files_done;
+
+	/*
+	  With SQFS_DATA_WRITER_TIMING. The fields updated by the workers are
+	  protected by the shared mutex. The ring buffers hold the times at
+	  which a block was queued and finished, indexed the same way as done.
+	 */
+	sqfs_data_writer_timing_t timing;
+	sqfs_u64 time_start;
+	sqfs_u64 time_end;
+	sqfs_u64 *queued_at;
+	sqfs_u64 *done_at;
+
+	/* counted by the main thread for sqfs_data_writer_get_stats */
+	sqfs_u64 blocks_written;
+	sqfs_u64 dedup_blocks;
+	sqfs_u64 dedup_fragments;
+
+#ifdef WITH_PTHREAD
+	/*
+	  What sqfs_data_writer_get_stats reports, protected by the shared
+	  mutex. The main thread copies its own counters over whenever it
+	  holds the mutex anyway. The ring buffer holds the uncompressed size
+	  of the blocks in flight, indexed the same way as done.
+	 */
+	sqfs_data_writer_stats_t stats;
+	sqfs_u32 *queued_size;
+#endif
+
 	/* file API */
 	sqfs_inode_generic_t *inode;
 	sqfs_block_t *blk_current;
 	sqfs_u32 blk_flags;
 	size_t blk_index;
+	sqfs_u32 frag_group;
+	sqfs_u32 cmp_id;
+	sqfs_u32 default_cmp_id;
+	sqfs_u32 cmp_hint;
+	size_t probe_streak;
+	bool skip_compress;
+	sqfs_u64 file_num;
+	bool tail_deferred;
+
+	/*
+	  Streams in the order they were opened, the first one is the next to
+	  be submitted. The list is only used by the main thread, the stream
+	  mutex protects the data handed over by the threads that append.
+	 */
+	sqfs_data_stream_t *streams;
+	sqfs_data_stream_t *streams_last;
+#ifdef WITH_PTHREAD
+	pthread_mutex_t stream_mtx;
+	pthread_cond_t stream_cond;
+#endif
+
+	/* files with the same content as another one, filled in by finish */
+	file_link_t *links;
+	size_t num_links;
+	size_t max_links;
 
 	/* used only by workers */
 	size_t max_block_size;
@@ -112,6 +381,7 @@ struct sqfs_data_writer_t {
 #ifdef WITH_PTHREAD
 	compress_worker_t *workers[];
 #else
+	cmp_cache_t *cache;
 	sqfs_u8 scratch[];
 #endif
 };
@@ -123,30 +393,201 @@ SQFS_INTERNAL
 int process_completed_fragment(sqfs_data_writer_t *proc, sqfs_block_t *frag,
 			       sqfs_block_t **blk_out);
 
-SQFS_INTERNAL void free_blk_list(sqfs_block_t *list);
+/*
+  Pack a tail end into one of the open fragment blocks, or hold it back if
+  fragments are grouped, and hand a fragment block to the workers once it is
+  full. Called by the main thread in file order, so the placement of
+  fragments is deterministic.
+ */
+SQFS_INTERNAL
+int data_writer_add_fragment(sqfs_data_writer_t *proc, sqfs_block_t *frag);
+
+/* Build the fragment hash table from scratch, for a restored frag_list. */
+SQFS_INTERNAL int data_writer_rebuild_frag_hash(sqfs_data_writer_t *proc);
+
+/* Pack the tail ends held back for grouping into fragment blocks. */
+SQFS_INTERNAL int data_writer_flush_pending(sqfs_data_writer_t *proc);
+
+/* Pack held back tail ends and hand all open fragment blocks to workers. */
+SQFS_INTERNAL int data_writer_flush_fragments(sqfs_data_writer_t *proc);
+
+/*
+  Called once the last block of a file has been processed, and once the
+  tail end of a file has been put into a fragment block, or turned out not
+  to need one. The file_num is 0 for files without blocks. Whichever comes
+  last reports the file as done through the notify_file_done hook.
+ */
+SQFS_INTERNAL void data_writer_blocks_done(sqfs_data_writer_t *proc);
+
+SQFS_INTERNAL void data_writer_tail_done(sqfs_data_writer_t *proc,
+					 sqfs_inode_generic_t *inode,
+					 sqfs_u64 file_num);
+
+/*
+  Start a file, like sqfs_data_writer_begin_file, but also while streams
+  are open, for submitting them.
+ */
+SQFS_INTERNAL int data_writer_begin_file(sqfs_data_writer_t *proc,
+					 sqfs_inode_generic_t *inode,
+					 sqfs_u32 flags);
+
+/* Free the streams that were never submitted, along with their data. */
+SQFS_INTERNAL void data_writer_free_streams(sqfs_data_writer_t *proc);
+
+/* Copy the data locations of linked files over, once everything is done. */
+SQFS_INTERNAL void data_writer_resolve_links(sqfs_data_writer_t *proc);
+
+SQFS_INTERNAL void free_blk_list(sqfs_data_writer_t *proc, sqfs_block_t *list);
 
 SQFS_INTERNAL
 int data_writer_init(sqfs_data_writer_t *proc, size_t max_block_size,
 		     sqfs_compressor_t *cmp, unsigned int num_workers,
-		     size_t max_backlog, size_t devblksz, sqfs_file_t *file);
+		     size_t max_backlog, size_t pool_size, size_t devblksz,
+		     sqfs_file_t *file, sqfs_u32 flags);
+
+/*
+  Get a block with max_block_size bytes of data area, either from the pool
+  of recycled blocks or freshly allocated. Apart from the buffer, the block
+  is zero initialized. Only the main thread is allowed to use the pool.
+ */
+SQFS_INTERNAL sqfs_block_t *data_writer_alloc_block(sqfs_data_writer_t *proc);
+
+/* Put a block back into the pool, or free it if the pool is full. */
+SQFS_INTERNAL void data_writer_free_block(sqfs_data_writer_t *proc,
+					  sqfs_block_t *blk);
 
 SQFS_INTERNAL void data_writer_cleanup(sqfs_data_writer_t *proc);
 
+/*
+  Approximate number of bytes in buffers used by the data writer: blocks,
+  held back tail ends, the hold buffer and the write-behind stage.
+ */
+SQFS_INTERNAL size_t data_writer_mem_used(const sqfs_data_writer_t *proc);
+
+/* Update the peak reported in the timing after the memory used has grown */
+SQFS_INTERNAL void data_writer_track_mem(sqfs_data_writer_t *proc);
+
+/* True if a memory limit is set and allocating extra bytes would exceed it */
+SQFS_INTERNAL
+bool data_writer_over_budget(const sqfs_data_writer_t *proc, size_t extra);
+
+/*
+  Wait for the next block in line to be done, if any are in flight, and
+  process all blocks that are ready.
+ */
+SQFS_INTERNAL int data_writer_wait_done(sqfs_data_writer_t *proc);
+
 SQFS_INTERNAL
 void data_writer_store_done(sqfs_data_writer_t *proc, sqfs_block_t *blk,
 			    int status);
 
+/* Returns the full 64 bit hash, the checksum is folded from it. */
 SQFS_INTERNAL
-sqfs_block_t *data_writer_next_work_item(sqfs_data_writer_t *proc);
+sqfs_u64 data_writer_hash(const sqfs_data_writer_t *proc, const void *data,
+			  size_t size, sqfs_u32 *checksum, sqfs_u64 *digest);
+
+/* Set the checksum and digest of a block, returns the full hash. */
+sqfs_u64 data_writer_checksum(const sqfs_data_writer_t *proc,
+			      sqfs_block_t *block);
 
+/*
+  Compress a block, unless it is found in the cache. The cache is optional
+  and only ever used by one thread.
+ */
 SQFS_INTERNAL
-int data_writer_do_block(sqfs_block_t *block, sqfs_compressor_t *cmp,
-			 sqfs_u8 *scratch, size_t scratch_size);
+int data_writer_do_block(const sqfs_data_writer_t *proc, sqfs_block_t *block,
+			 sqfs_compressor_t *cmp, sqfs_u8 *scratch,
+			 cmp_cache_t *cache);
+
+/*
+  Process up to DATA_WRITER_BATCH blocks that use the same compressor, like
+  data_writer_do_block, but hand all that need compressing to the compressor
+  as one batch. The scratch buffer holds max_block_size bytes per block. The
+  result of each block is stored in the status array.
+ */
+SQFS_INTERNAL
+void data_writer_do_blocks(const sqfs_data_writer_t *proc,
+			   sqfs_block_t **blocks, size_t count,
+			   sqfs_compressor_t *cmp, sqfs_u8 *scratch,
+			   cmp_cache_t *cache, int *status);
+
+SQFS_INTERNAL cmp_cache_t *cmp_cache_create(size_t max_block_size);
+
+SQFS_INTERNAL void cmp_cache_destroy(cmp_cache_t *cache);
+
+/*
+  If a block with the same data was compressed with the same compressor and
+  hint before, replace the data with the compressed version and return true.
+ */
+SQFS_INTERNAL
+bool cmp_cache_lookup(cmp_cache_t *cache, sqfs_block_t *block, sqfs_u64 hash);
+
+/*
+  Remember the result of compressing a block, still holding the uncompressed
+  data. A cmp_size of 0 means the block is stored uncompressed.
+ */
+SQFS_INTERNAL
+void cmp_cache_insert(cmp_cache_t *cache, const sqfs_block_t *block,
+		      sqfs_u64 hash, const sqfs_u8 *cmp_data,
+		      size_t cmp_size, sqfs_u32 cmp_method);
+
+/* Get the number of lookups that hit since the last call. */
+SQFS_INTERNAL size_t cmp_cache_take_hits(cmp_cache_t *cache);
 
 SQFS_INTERNAL
 int test_and_set_status(sqfs_data_writer_t *proc, int status);
 
+/* Read the clock if SQFS_DATA_WRITER_TIMING is set, return 0 otherwise. */
+SQFS_INTERNAL sqfs_u64 data_writer_clock(const sqfs_data_writer_t *proc);
+
+/* Record the number of blocks in flight when adding another one. */
+SQFS_INTERNAL
+void data_writer_sample_backlog(sqfs_data_writer_t *proc, size_t depth);
+
+/*
+  Copy the measurements that may be updated by the workers. The pthread
+  version locks the shared mutex and adds up the per worker times.
+ */
+SQFS_INTERNAL
+void data_writer_copy_timing(sqfs_data_writer_t *proc,
+			     sqfs_data_writer_timing_t *out);
+
+/*
+  Fill in the parts of the stats that the main thread keeps track of. Must
+  only be called from the main thread.
+ */
+SQFS_INTERNAL
+void data_writer_fill_stats(const sqfs_data_writer_t *proc,
+			    sqfs_data_writer_stats_t *out);
+
+/*
+  Get a snapshot of the stats. The pthread version locks the shared mutex
+  and adds what the workers keep track of.
+ */
+SQFS_INTERNAL
+void data_writer_copy_stats(sqfs_data_writer_t *proc,
+			    sqfs_data_writer_stats_t *out);
+
+/* Returns SQFS_ERROR_OUT_OF_BOUNDS if there is no such worker. */
+SQFS_INTERNAL
+int data_writer_copy_worker_stats(sqfs_data_writer_t *proc,
+				  unsigned int index,
+				  sqfs_data_writer_worker_stats_t *out);
+
 SQFS_INTERNAL
 int data_writer_enqueue(sqfs_data_writer_t *proc, sqfs_block_t *block);
 
+#ifdef WITH_PTHREAD
+/*
+  Create a write-behind wrapper around a file that collects consecutive
+  writes into buffers of bufsz bytes and writes them out from a separate
+  thread. Destroying the wrapper does not destroy the underlying file.
+ */
+SQFS_INTERNAL
+sqfs_file_t *data_writer_output_create(sqfs_file_t *file, size_t bufsz);
+
+/* Write out everything buffered and wait until it is on the file. */
+SQFS_INTERNAL int data_writer_output_flush(sqfs_file_t *output);
+#endif
+
 #endif /* INTERNAL_H */
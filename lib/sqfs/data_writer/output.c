@@ -0,0 +1,294 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * output.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#define SQFS_BUILDING_DLL
+#include "internal.h"
+
+/*
+  A write-behind wrapper around the output file. Appended data is collected
+  in a buffer, a full buffer is handed to a writer thread and the next one
+  is filled in the mean time. Anything that can't be served from the
+  buffers (reads, writes elsewhere, truncating written data) waits for the
+  writer thread and goes straight to the underlying file. If the file
+  supports batched writes, the writer thread splits a buffer into chunks
+  that are written concurrently.
+ */
+typedef struct {
+	sqfs_file_t base;
+
+	sqfs_file_t *file;
+	size_t bufsz;
+
+	pthread_t thread;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	bool stop;
+	int status;
+
+	/* filled by the main thread, always ends at the logical file size */
+	sqfs_u8 *fill;
+	size_t fill_used;
+	sqfs_u64 fill_offset;
+
+	/* handed to the writer thread */
+	sqfs_u8 *busy;
+	size_t busy_used;
+	sqfs_u64 busy_offset;
+	bool busy_pending;
+} output_t;
+
+static int write_buffer(output_t *out)
+{
+	sqfs_file_io_t batch[OUTPUT_BATCH_MAX];
+	size_t offset, count = 0;
+
+	if (out->file->write_batch == NULL ||
+	    out->busy_used > OUTPUT_BATCH_MAX * OUTPUT_BATCH_CHUNK ||
+	    out->busy_used <= OUTPUT_BATCH_CHUNK) {
+		return out->file->write_at(out->file, out->busy_offset,
+					   out->busy, out->busy_used);
+	}
+
+	for (offset = 0; offset < out->busy_used;
+	     offset += OUTPUT_BATCH_CHUNK) {
+		batch[count].offset = out->busy_offset + offset;
+		batch[count].buffer = out->busy + offset;
+		batch[count].size = out->busy_used - offset;
+
+		if (batch[count].size > OUTPUT_BATCH_CHUNK)
+			batch[count].size = OUTPUT_BATCH_CHUNK;
+		++count;
+	}
+
+	return out->file->write_batch(out->file, batch, count);
+}
+
+static void *output_proc(void *arg)
+{
+	output_t *out = arg;
+	int ret;
+
+	pthread_mutex_lock(&out->mtx);
+	for (;;) {
+		while (!out->busy_pending && !out->stop)
+			pthread_cond_wait(&out->cond, &out->mtx);
+
+		if (!out->busy_pending)
+			break;
+
+		pthread_mutex_unlock(&out->mtx);
+		ret = write_buffer(out);
+		pthread_mutex_lock(&out->mtx);
+
+		if (ret != 0 && out->status == 0)
+			out->status = ret;
+
+		out->busy_pending = false;
+		pthread_cond_broadcast(&out->cond);
+	}
+	pthread_mutex_unlock(&out->mtx);
+	return NULL;
+}
+
+static int wait_idle(output_t *out)
+{
+	int status;
+
+	pthread_mutex_lock(&out->mtx);
+	while (out->busy_pending)
+		pthread_cond_wait(&out->cond, &out->mtx);
+	status = out->status;
+	pthread_mutex_unlock(&out->mtx);
+
+	return status;
+}
+
+static int submit(output_t *out)
+{
+	sqfs_u8 *temp;
+	int status;
+
+	status = wait_idle(out);
+	if (status != 0 || out->fill_used == 0)
+		return status;
+
+	temp = out->busy;
+	out->busy = out->fill;
+	out->fill = temp;
+
+	pthread_mutex_lock(&out->mtx);
+	out->busy_offset = out->fill_offset;
+	out->busy_used = out->fill_used;
+	out->busy_pending = true;
+	pthread_cond_broadcast(&out->cond);
+	pthread_mutex_unlock(&out->mtx);
+
+	out->fill_offset += out->fill_used;
+	out->fill_used = 0;
+	return 0;
+}
+
+static int flush(output_t *out)
+{
+	int status = submit(out);
+
+	if (status != 0)
+		return status;
+
+	return wait_idle(out);
+}
+
+static void output_destroy(sqfs_file_t *base)
+{
+	output_t *out = (output_t *)base;
+
+	pthread_mutex_lock(&out->mtx);
+	out->stop = true;
+	pthread_cond_broadcast(&out->cond);
+	pthread_mutex_unlock(&out->mtx);
+
+	pthread_join(out->thread, NULL);
+	pthread_cond_destroy(&out->cond);
+	pthread_mutex_destroy(&out->mtx);
+	free(out->fill);
+	free(out->busy);
+	free(out);
+}
+
+static int output_read_at(sqfs_file_t *base, sqfs_u64 offset,
+			  void *buffer, size_t size)
+{
+	output_t *out = (output_t *)base;
+	int status = flush(out);
+
+	if (status != 0)
+		return status;
+
+	return out->file->read_at(out->file, offset, buffer, size);
+}
+
+static int output_write_at(sqfs_file_t *base, sqfs_u64 offset,
+			   const void *buffer, size_t size)
+{
+	output_t *out = (output_t *)base;
+	size_t diff;
+	int status;
+
+	if (offset != out->fill_offset + out->fill_used) {
+		status = flush(out);
+		if (status != 0)
+			return status;
+
+		status = out->file->write_at(out->file, offset, buffer, size);
+		if (status != 0)
+			return status;
+
+		out->fill_offset = out->file->get_size(out->file);
+		return 0;
+	}
+
+	while (size > 0) {
+		if (out->fill_used == out->bufsz) {
+			status = submit(out);
+			if (status != 0)
+				return status;
+		}
+
+		diff = out->bufsz - out->fill_used;
+		if (diff > size)
+			diff = size;
+
+		memcpy(out->fill + out->fill_used, buffer, diff);
+		out->fill_used += diff;
+
+		buffer = (const char *)buffer + diff;
+		size -= diff;
+	}
+
+	return 0;
+}
+
+static int output_flush(sqfs_file_t *base, sqfs_u32 flags)
+{
+	output_t *out = (output_t *)base;
+	int status = flush(out);
+
+	if (status != 0)
+		return status;
+
+	return sqfs_file_flush(out->file, flags);
+}
+
+static sqfs_u64 output_get_size(const sqfs_file_t *base)
+{
+	const output_t *out = (const output_t *)base;
+
+	return out->fill_offset + out->fill_used;
+}
+
+static int output_truncate(sqfs_file_t *base, sqfs_u64 size)
+{
+	output_t *out = (output_t *)base;
+	int status;
+
+	if (size >= out->fill_offset &&
+	    size <= out->fill_offset + out->fill_used) {
+		out->fill_used = size - out->fill_offset;
+		return 0;
+	}
+
+	status = flush(out);
+	if (status != 0)
+		return status;
+
+	status = out->file->truncate(out->file, size);
+	if (status != 0)
+		return status;
+
+	out->fill_offset = size;
+	return 0;
+}
+
+sqfs_file_t *data_writer_output_create(sqfs_file_t *file, size_t bufsz)
+{
+	output_t *out = calloc(1, sizeof(*out));
+	sqfs_file_t *base = (sqfs_file_t *)out;
+
+	if (out == NULL)
+		return NULL;
+
+	out->fill = malloc(bufsz);
+	out->busy = malloc(bufsz);
+	if (out->fill == NULL || out->busy == NULL)
+		goto fail;
+
+	out->file = file;
+	out->bufsz = bufsz;
+	out->fill_offset = file->get_size(file);
+	out->mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	out->cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+
+	if (pthread_create(&out->thread, NULL, output_proc, out) != 0)
+		goto fail;
+
+	base->destroy = output_destroy;
+	base->read_at = output_read_at;
+	base->write_at = output_write_at;
+	base->get_size = output_get_size;
+	base->truncate = output_truncate;
+	base->flush = output_flush;
+	return base;
+fail:
+	free(out->fill);
+	free(out->busy);
+	free(out);
+	return NULL;
+}
+
+int data_writer_output_flush(sqfs_file_t *base)
+{
+	return flush((output_t *)base);
+}
@@ -7,81 +7,406 @@
 #define SQFS_BUILDING_DLL
 #include "internal.h"
 
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#include <sched.h>
+#endif
+
+/*
+  With SQFS_DATA_WRITER_ADAPTIVE_WORKERS, the number of active workers is
+  reconsidered after this many blocks, or after a backlog worth of blocks
+  if that is more. A worker is parked if the workers were on a CPU for less
+  than MIN_CPU_SHARE percent of the time they were compressing, and one is
+  woken up if the caller waited for a full backlog for more than
+  GROW_WAIT_SHARE percent of the time.
+ */
+#define ADJUST_WINDOW (64)
+#define MIN_CPU_SHARE (75)
+#define GROW_WAIT_SHARE (10)
+
+/* the most windows a worker stays parked after the system was busy */
+#define MAX_GROW_BACKOFF (64)
+
+static sqfs_block_t *pop_work(compress_worker_t *worker)
+{
+	sqfs_block_t *blk = worker->queue;
+
+	if (blk != NULL) {
+		worker->queue = blk->next;
+		blk->next = NULL;
+
+		if (worker->queue == NULL)
+			worker->queue_last = NULL;
+	}
+
+	return blk;
+}
+
+static sqfs_block_t *steal_work(compress_worker_t *worker)
+{
+	sqfs_data_writer_t *shared = worker->shared;
+	compress_worker_t *victim;
+	sqfs_block_t *blk = NULL;
+	unsigned int i;
+
+	for (i = 1; i < shared->num_workers && blk == NULL; ++i) {
+		victim = shared->workers[(worker->index + i) %
+					 shared->num_workers];
+
+		if (pthread_mutex_trylock(&victim->mtx) != 0)
+			continue;
+
+		if (!victim->stop)
+			blk = pop_work(victim);
+
+		pthread_mutex_unlock(&victim->mtx);
+	}
+
+	return blk;
+}
+
+static sqfs_block_t *next_work_item(compress_worker_t *worker)
+{
+	sqfs_block_t *blk = NULL;
+
+	pthread_mutex_lock(&worker->mtx);
+	while (!worker->stop) {
+		blk = pop_work(worker);
+		if (blk != NULL)
+			break;
+
+		if (!worker->parked) {
+			pthread_mutex_unlock(&worker->mtx);
+			blk = steal_work(worker);
+			pthread_mutex_lock(&worker->mtx);
+
+			if (blk != NULL)
+				break;
+		}
+
+		if (worker->queue == NULL && !worker->stop) {
+			thread_job_wait_begin(&worker->job);
+			pthread_cond_wait(&worker->queue_cond, &worker->mtx);
+			thread_job_wait_end(&worker->job);
+		}
+	}
+	pthread_mutex_unlock(&worker->mtx);
+
+	return blk;
+}
+
+/*
+  If the compressor of the block can take a batch, take more blocks for it
+  from the own queue. Other workers only ever steal single blocks.
+ */
+static size_t next_work_batch(compress_worker_t *worker, sqfs_block_t **batch)
+{
+	size_t count = 1;
+
+	batch[0] = next_work_item(worker);
+	if (batch[0] == NULL)
+		return 0;
+
+	if (worker->max_batch < 2 ||
+	    worker->cmp[batch[0]->cmp_id]->do_blocks == NULL)
+		return count;
+
+	pthread_mutex_lock(&worker->mtx);
+	while (count < worker->max_batch && worker->queue != NULL &&
+	       worker->queue->cmp_id == batch[0]->cmp_id) {
+		batch[count++] = pop_work(worker);
+	}
+	pthread_mutex_unlock(&worker->mtx);
+
+	return count;
+}
+
+/*
+  Pin the worker to one of the CPUs the process may run on, spreading the
+  workers over them in order. This is best effort, if it fails, the worker
+  simply keeps running wherever the scheduler puts it.
+ */
+static void pin_worker(compress_worker_t *worker)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	unsigned int i, count = 0, target;
+	cpu_set_t allowed, set;
+
+	if (pthread_getaffinity_np(pthread_self(), sizeof(allowed),
+				   &allowed) != 0) {
+		return;
+	}
+
+	if (CPU_COUNT(&allowed) < 1)
+		return;
+
+	target = worker->index % CPU_COUNT(&allowed);
+
+	for (i = 0; i < CPU_SETSIZE; ++i) {
+		if (!CPU_ISSET(i, &allowed) || count++ != target)
+			continue;
+
+		CPU_ZERO(&set);
+		CPU_SET(i, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		break;
+	}
+#else
+	(void)worker;
+#endif
+}
+
+static void free_scratch(sqfs_data_writer_t *shared, sqfs_u8 *scratch)
+{
+	if (shared->huge_pool != NULL) {
+		huge_pool_free(shared->huge_pool, scratch);
+	} else {
+		free(scratch);
+	}
+}
+
 static void *worker_proc(void *arg)
 {
 	compress_worker_t *worker = arg;
 	sqfs_data_writer_t *shared = worker->shared;
-	sqfs_block_t *blk = NULL;
-	int status = 0;
+	sqfs_u64 start, end, wall = 0, cpu = 0;
+	sqfs_block_t *batch[DATA_WRITER_BATCH];
+	sqfs_u32 sizes[DATA_WRITER_BATCH];
+	int status[DATA_WRITER_BATCH];
+	size_t i, idx, count;
+	sqfs_block_t *blk;
+
+	/* pool threads run other jobs later, leave them where they are */
+	if ((shared->flags & SQFS_DATA_WRITER_PIN_WORKERS) &&
+	    worker->job.pool == NULL) {
+		pin_worker(worker);
+	}
+
+	/* compressors added later do not get a batch unless the first does */
+	worker->max_batch = worker->cmp[0]->do_blocks != NULL ?
+		DATA_WRITER_BATCH : 1;
+
+	/* first touched here, so it ends up on the memory node we run on */
+	if (shared->huge_pool != NULL) {
+		worker->scratch = huge_pool_alloc(shared->huge_pool,
+						  worker->max_batch *
+						  shared->max_block_size);
+	} else {
+		worker->scratch = malloc(worker->max_batch *
+					 shared->max_block_size);
+	}
+
+	if (shared->flags & SQFS_DATA_WRITER_CACHE_COMPRESSED) {
+		worker->cache = cmp_cache_create(shared->max_block_size);
+
+		if (worker->cache == NULL) {
+			free_scratch(shared, worker->scratch);
+			worker->scratch = NULL;
+		}
+	}
+
+	while ((count = next_work_batch(worker, batch)) > 0) {
+		if (shared->flags & SQFS_DATA_WRITER_ADAPTIVE_WORKERS) {
+			wall = get_time_ns();
+			cpu = get_thread_cpu_time_ns();
+		}
+
+		for (i = 0; i < count; ++i)
+			sizes[i] = batch[i]->size;
+
+		start = data_writer_clock(shared);
+		sqfs_trace_begin("data_writer", "compress block");
+
+		if (worker->scratch == NULL) {
+			for (i = 0; i < count; ++i)
+				status[i] = SQFS_ERROR_ALLOC;
+		} else {
+			data_writer_do_blocks(shared, batch, count,
+					      worker->cmp[batch[0]->cmp_id],
+					      worker->scratch, worker->cache,
+					      status);
+		}
+
+		sqfs_trace_end("data_writer", "compress block");
+
+		end = data_writer_clock(shared);
+
+		if (shared->flags & SQFS_DATA_WRITER_ADAPTIVE_WORKERS) {
+			wall = get_time_ns() - wall;
+			cpu = get_thread_cpu_time_ns() - cpu;
+		}
 
-	for (;;) {
 		pthread_mutex_lock(&shared->mtx);
-		if (blk != NULL) {
-			data_writer_store_done(shared, blk, status);
-			pthread_cond_broadcast(&shared->done_cond);
+		shared->window.busy_wall += wall;
+		shared->window.busy_cpu += cpu;
+
+		if (shared->flags & SQFS_DATA_WRITER_TIMING) {
+			shared->timing.compress_time += end - start;
+			worker->busy += end - start;
 		}
 
-		while (shared->queue == NULL && shared->status == 0)
-			pthread_cond_wait(&shared->queue_cond, &shared->mtx);
+		if (worker->cache != NULL) {
+			shared->timing.cmp_cache_hits +=
+				cmp_cache_take_hits(worker->cache);
+		}
 
-		blk = data_writer_next_work_item(shared);
-		pthread_mutex_unlock(&shared->mtx);
+		for (i = 0; i < count; ++i) {
+			blk = batch[i];
 
-		if (blk == NULL)
-			break;
+			worker->blocks += 1;
+			worker->bytes_in += sizes[i];
+			worker->bytes_out += blk->size;
+
+			if (shared->flags & SQFS_DATA_WRITER_TIMING) {
+				idx = blk->sequence_number & shared->done_mask;
+
+				shared->timing.queue_wait +=
+					start - shared->queued_at[idx];
+				shared->done_at[idx] = end;
+			}
 
-		status = data_writer_do_block(blk, worker->cmp,
-					      worker->scratch,
-					      shared->max_block_size);
+			data_writer_store_done(shared, blk, status[i]);
+
+			if (status[i] != 0 ||
+			    blk->sequence_number == shared->dequeue_id)
+				pthread_cond_signal(&shared->done_cond);
+		}
+		pthread_mutex_unlock(&shared->mtx);
 	}
 	return NULL;
 }
 
+static void stop_workers(sqfs_data_writer_t *proc)
+{
+	compress_worker_t *worker;
+	unsigned int i;
+
+	for (i = 0; i < proc->num_workers; ++i) {
+		worker = proc->workers[i];
+
+		if (worker == NULL)
+			continue;
+
+		pthread_mutex_lock(&worker->mtx);
+		worker->stop = true;
+		pthread_cond_broadcast(&worker->queue_cond);
+		pthread_mutex_unlock(&worker->mtx);
+	}
+}
+
+static void free_worker(compress_worker_t *worker)
+{
+	size_t i;
+
+	for (i = 0; i < MAX_COMPRESSORS; ++i) {
+		if (worker->cmp[i] != NULL)
+			worker->cmp[i]->destroy(worker->cmp[i]);
+	}
+
+	free_blk_list(worker->shared, worker->queue);
+	free_scratch(worker->shared, worker->scratch);
+	cmp_cache_destroy(worker->cache);
+	pthread_cond_destroy(&worker->queue_cond);
+	pthread_mutex_destroy(&worker->mtx);
+	free(worker);
+}
+
 sqfs_data_writer_t *sqfs_data_writer_create(size_t max_block_size,
 					    sqfs_compressor_t *cmp,
 					    unsigned int num_workers,
 					    size_t max_backlog,
+					    size_t pool_size,
 					    size_t devblksz,
-					    sqfs_file_t *file)
+					    sqfs_file_t *file,
+					    sqfs_u32 flags)
 {
 	sqfs_data_writer_t *proc;
+	size_t ring_size;
 	unsigned int i;
 	int ret;
 
+	if (flags & ~SQFS_DATA_WRITER_ALL_FLAGS)
+		return NULL;
+
 	if (num_workers < 1)
 		num_workers = 1;
 
+	if (max_backlog < 1)
+		max_backlog = 1;
+
 	proc = alloc_flex(sizeof(*proc),
 			  sizeof(proc->workers[0]), num_workers);
 	if (proc == NULL)
 		return NULL;
 
 	proc->mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
-	proc->queue_cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
 	proc->done_cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
 
 	if (data_writer_init(proc, max_block_size, cmp, num_workers,
-			     max_backlog, devblksz, file)) {
+			     max_backlog, pool_size, devblksz, file, flags)) {
+		goto fail_init;
+	}
+
+	for (ring_size = 1; ring_size < max_backlog; ring_size *= 2)
+		;
+
+	proc->done = alloc_array(sizeof(proc->done[0]), ring_size);
+	if (proc->done == NULL)
 		goto fail_init;
+
+	proc->done_mask = ring_size - 1;
+
+	proc->queued_size = alloc_array(sizeof(proc->queued_size[0]),
+					ring_size);
+	if (proc->queued_size == NULL)
+		goto fail_init;
+
+	proc->active_workers = num_workers;
+	proc->timing.workers_min = num_workers;
+
+	if (flags & SQFS_DATA_WRITER_ADAPTIVE_WORKERS)
+		proc->window.start = get_time_ns();
+
+	if (flags & SQFS_DATA_WRITER_TIMING) {
+		proc->queued_at = alloc_array(sizeof(proc->queued_at[0]),
+					      ring_size);
+		proc->done_at = alloc_array(sizeof(proc->done_at[0]),
+					    ring_size);
+
+		if (proc->queued_at == NULL || proc->done_at == NULL)
+			goto fail_init;
+	}
+
+	if (flags & SQFS_DATA_WRITER_ASYNC_OUTPUT) {
+		proc->output = data_writer_output_create(file,
+							 OUTPUT_BUFFER_SIZE);
+		if (proc->output == NULL)
+			goto fail_init;
+
+		proc->outfile = file;
+		proc->file = proc->output;
 	}
 
 	for (i = 0; i < num_workers; ++i) {
-		proc->workers[i] = alloc_flex(sizeof(compress_worker_t),
-					      1, max_block_size);
+		proc->workers[i] = calloc(1, sizeof(compress_worker_t));
 
 		if (proc->workers[i] == NULL)
 			goto fail_init;
 
+		proc->workers[i]->mtx =
+			(pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+		proc->workers[i]->queue_cond =
+			(pthread_cond_t)PTHREAD_COND_INITIALIZER;
 		proc->workers[i]->shared = proc;
-		proc->workers[i]->cmp = cmp->create_copy(cmp);
+		proc->workers[i]->index = i;
+		proc->workers[i]->cmp[0] = cmp->create_copy(cmp);
 
-		if (proc->workers[i]->cmp == NULL)
+		if (proc->workers[i]->cmp[0] == NULL)
 			goto fail_init;
 	}
 
 	for (i = 0; i < num_workers; ++i) {
-		ret = pthread_create(&proc->workers[i]->thread, NULL,
-				     worker_proc, proc->workers[i]);
+		ret = thread_job_start(&proc->workers[i]->job, worker_proc,
+				       proc->workers[i], true);
 
 		if (ret != 0)
 			goto fail_thread;
@@ -89,29 +414,20 @@ sqfs_data_writer_t *sqfs_data_writer_create(size_t max_block_size,
 
 	return proc;
 fail_thread:
-	pthread_mutex_lock(&proc->mtx);
-	proc->status = -1;
-	pthread_cond_broadcast(&proc->queue_cond);
-	pthread_mutex_unlock(&proc->mtx);
+	stop_workers(proc);
 
 	for (i = 0; i < num_workers; ++i) {
-		if (proc->workers[i]->thread > 0) {
-			pthread_join(proc->workers[i]->thread, NULL);
-		}
+		if (proc->workers[i]->job.state != THREAD_JOB_NEW)
+			thread_job_join(&proc->workers[i]->job);
 	}
 fail_init:
 	for (i = 0; i < num_workers; ++i) {
-		if (proc->workers[i] != NULL) {
-			if (proc->workers[i]->cmp != NULL) {
-				proc->workers[i]->cmp->
-					destroy(proc->workers[i]->cmp);
-			}
-
-			free(proc->workers[i]);
-		}
+		if (proc->workers[i] != NULL)
+			free_worker(proc->workers[i]);
 	}
+	if (proc->output != NULL)
+		proc->output->destroy(proc->output);
 	pthread_cond_destroy(&proc->done_cond);
-	pthread_cond_destroy(&proc->queue_cond);
 	pthread_mutex_destroy(&proc->mtx);
 	data_writer_cleanup(proc);
 	return NULL;
@@ -123,128 +439,272 @@ void sqfs_data_writer_destroy(sqfs_data_writer_t *proc)
 
 	pthread_mutex_lock(&proc->mtx);
 	proc->status = -1;
-	pthread_cond_broadcast(&proc->queue_cond);
 	pthread_mutex_unlock(&proc->mtx);
 
-	for (i = 0; i < proc->num_workers; ++i) {
-		pthread_join(proc->workers[i]->thread, NULL);
+	stop_workers(proc);
 
-		proc->workers[i]->cmp->destroy(proc->workers[i]->cmp);
-		free(proc->workers[i]);
+	for (i = 0; i < proc->num_workers; ++i) {
+		thread_job_join(&proc->workers[i]->job);
+		free_worker(proc->workers[i]);
 	}
 
+	if (proc->output != NULL)
+		proc->output->destroy(proc->output);
+
 	pthread_cond_destroy(&proc->done_cond);
-	pthread_cond_destroy(&proc->queue_cond);
 	pthread_mutex_destroy(&proc->mtx);
 
 	data_writer_cleanup(proc);
 }
 
+int sqfs_data_writer_add_compressor(sqfs_data_writer_t *proc,
+				    sqfs_compressor_t *cmp, sqfs_u32 *id)
+{
+	size_t idx = proc->num_cmp;
+	unsigned int i;
+
+	if (idx >= MAX_COMPRESSORS)
+		return SQFS_ERROR_OVERFLOW;
+
+	/*
+	  Blocks that use the new compressor are handed out through the
+	  worker mutexes, so the workers see these copies before they need
+	  them.
+	 */
+	for (i = 0; i < proc->num_workers; ++i) {
+		proc->workers[i]->cmp[idx] = cmp->create_copy(cmp);
+
+		if (proc->workers[i]->cmp[idx] == NULL)
+			goto fail;
+	}
+
+	proc->cmp_list[idx] = cmp;
+	proc->num_cmp += 1;
+	*id = idx;
+	return 0;
+fail:
+	for (i = 0; i < proc->num_workers; ++i) {
+		if (proc->workers[i]->cmp[idx] != NULL) {
+			proc->workers[i]->cmp[idx]->destroy(
+				proc->workers[i]->cmp[idx]);
+			proc->workers[i]->cmp[idx] = NULL;
+		}
+	}
+	return SQFS_ERROR_ALLOC;
+}
+
+/*
+  Hand a block to one of the workers, round robin. Idle workers steal from
+  the others, so this only needs to roughly balance the load. Must be called
+  with the shared mutex held.
+ */
+static void push_work(sqfs_data_writer_t *proc, sqfs_block_t *block)
+{
+	compress_worker_t *worker;
+
+	if (proc->next_worker >= proc->active_workers)
+		proc->next_worker = 0;
+
+	worker = proc->workers[proc->next_worker++];
+
+	pthread_mutex_lock(&worker->mtx);
+	block->next = NULL;
+
+	if (worker->queue_last == NULL) {
+		worker->queue = block;
+	} else {
+		worker->queue_last->next = block;
+	}
+
+	worker->queue_last = block;
+	pthread_cond_signal(&worker->queue_cond);
+	pthread_mutex_unlock(&worker->mtx);
+}
+
+static void set_parked(compress_worker_t *worker, bool parked)
+{
+	pthread_mutex_lock(&worker->mtx);
+	worker->parked = parked;
+	pthread_cond_signal(&worker->queue_cond);
+	pthread_mutex_unlock(&worker->mtx);
+}
+
+/*
+  Park or wake up a worker, based on the last window of blocks. Workers that
+  are on a CPU for less time than they are running mean that there are more
+  runnable threads than CPUs, e.g. on a shared machine, and a backlog that
+  is mostly empty means the workers are starved. In both cases, one less
+  does no harm. A parked worker still finishes the blocks it already has.
+
+  If a worker had to be parked because the system was busy, waking it up
+  again is held off for a while, twice as long each time, so that the count
+  does not flip between two values on a machine that is simply full.
+  Must be called with the shared mutex held.
+ */
+static void adjust_workers(sqfs_data_writer_t *proc)
+{
+	sqfs_u64 now = get_time_ns(), elapsed = now - proc->window.start;
+	unsigned int active = proc->active_workers;
+	sqfs_u64 blocks = proc->window.blocks;
+
+	if (proc->grow_delay > 0)
+		proc->grow_delay -= 1;
+
+	if (active > 1 &&
+	    proc->window.busy_cpu * 100 <
+	    proc->window.busy_wall * MIN_CPU_SHARE) {
+		proc->active_workers -= 1;
+
+		proc->grow_backoff = proc->grow_backoff == 0 ? 1 :
+			proc->grow_backoff * 2;
+		if (proc->grow_backoff > MAX_GROW_BACKOFF)
+			proc->grow_backoff = MAX_GROW_BACKOFF;
+
+		proc->grow_delay = proc->grow_backoff;
+	} else if (active < proc->num_workers && proc->grow_delay == 0 &&
+		   proc->window.wait * 100 > elapsed * GROW_WAIT_SHARE) {
+		proc->active_workers += 1;
+	} else if (active > 1 && proc->window.depth_sum * 2 < blocks * active) {
+		proc->active_workers -= 1;
+	}
+
+	if (proc->active_workers < active) {
+		set_parked(proc->workers[proc->active_workers], true);
+	} else if (proc->active_workers > active) {
+		set_parked(proc->workers[active], false);
+	}
+
+	if (proc->active_workers != active) {
+		proc->timing.worker_changes += 1;
+
+		if (proc->active_workers < proc->timing.workers_min)
+			proc->timing.workers_min = proc->active_workers;
+	}
+
+	memset(&proc->window, 0, sizeof(proc->window));
+	proc->window.start = now;
+}
+
 static void append_to_work_queue(sqfs_data_writer_t *proc,
 				 sqfs_block_t *block)
 {
-	if (proc->queue_last == NULL) {
-		proc->queue = proc->queue_last = block;
-	} else {
-		proc->queue_last->next = block;
-		proc->queue_last = block;
+	if (proc->flags & SQFS_DATA_WRITER_ADAPTIVE_WORKERS) {
+		proc->window.depth_sum += proc->enqueue_id - proc->dequeue_id;
+		proc->window.blocks += 1;
+
+		if (proc->window.blocks >= ADJUST_WINDOW &&
+		    proc->window.blocks >= proc->max_backlog) {
+			adjust_workers(proc);
+		}
 	}
 
+	if (proc->flags & SQFS_DATA_WRITER_TIMING) {
+		data_writer_sample_backlog(proc,
+					   proc->enqueue_id - proc->dequeue_id);
+
+		proc->queued_at[proc->enqueue_id & proc->done_mask] =
+			data_writer_clock(proc);
+		proc->timing.block_count += 1;
+	}
+
+	proc->queued_size[proc->enqueue_id & proc->done_mask] = block->size;
+	proc->stats.bytes_in_flight += block->size;
+	proc->stats.blocks_queued += 1;
+
 	block->sequence_number = proc->enqueue_id++;
-	block->next = NULL;
-	proc->backlog += 1;
-	pthread_cond_broadcast(&proc->queue_cond);
+	push_work(proc, block);
 }
 
-static sqfs_block_t *try_dequeue(sqfs_data_writer_t *proc)
+/*
+  Wait for a worker to finish a block. Must be called with the shared mutex
+  held, like pthread_cond_wait.
+ */
+static void wait_for_workers(sqfs_data_writer_t *proc)
 {
-	sqfs_block_t *queue, *it, *prev;
+	sqfs_u64 start = data_writer_clock(proc);
 
-	it = proc->done;
-	prev = NULL;
+	sqfs_trace_begin("data_writer", "wait for workers");
+	pthread_cond_wait(&proc->done_cond, &proc->mtx);
+	sqfs_trace_end("data_writer", "wait for workers");
 
-	while (it != NULL && it->sequence_number == proc->dequeue_id) {
-		prev = it;
-		it = it->next;
-		proc->dequeue_id += 1;
-	}
+	proc->timing.backlog_wait += data_writer_clock(proc) - start;
+}
 
-	if (prev == NULL) {
-		queue = NULL;
-	} else {
-		queue = proc->done;
-		prev->next = NULL;
-		proc->done = it;
+/* Same as above, with the backlog full. Counted for adjust_workers. */
+static void wait_for_backlog(sqfs_data_writer_t *proc)
+{
+	sqfs_u64 start;
+
+	if (!(proc->flags & SQFS_DATA_WRITER_ADAPTIVE_WORKERS)) {
+		wait_for_workers(proc);
+		return;
 	}
 
-	return queue;
+	start = get_time_ns();
+	wait_for_workers(proc);
+	proc->window.wait += get_time_ns() - start;
 }
 
-static sqfs_block_t *queue_merge(sqfs_block_t *lhs, sqfs_block_t *rhs)
+/*
+  Take the run of finished blocks, that are next in line to be written, out
+  of the reorder buffer. Must be called with the shared mutex held.
+ */
+static sqfs_block_t *try_dequeue(sqfs_data_writer_t *proc)
 {
-	sqfs_block_t *it, *head = NULL, **next_ptr = &head;
+	sqfs_block_t *queue = NULL, **next_ptr = &queue, *it;
+	sqfs_u64 now = 0;
+	size_t idx;
 
-	while (lhs != NULL && rhs != NULL) {
-		if (lhs->sequence_number <= rhs->sequence_number) {
-			it = lhs;
-			lhs = lhs->next;
-		} else {
-			it = rhs;
-			rhs = rhs->next;
+	for (;;) {
+		idx = proc->dequeue_id & proc->done_mask;
+		it = proc->done[idx];
+
+		if (it == NULL || it->sequence_number != proc->dequeue_id)
+			break;
+
+		if (proc->flags & SQFS_DATA_WRITER_TIMING) {
+			if (now == 0)
+				now = data_writer_clock(proc);
+
+			proc->timing.reorder_wait += now - proc->done_at[idx];
 		}
 
+		proc->done[idx] = NULL;
+		proc->dequeue_id += 1;
+		proc->stats.bytes_in_flight -= proc->queued_size[idx];
+
 		*next_ptr = it;
 		next_ptr = &it->next;
 	}
 
-	it = (lhs != NULL ? lhs : rhs);
-	*next_ptr = it;
-	return head;
+	*next_ptr = NULL;
+	return queue;
 }
 
 static int process_done_queue(sqfs_data_writer_t *proc, sqfs_block_t *queue)
 {
-	sqfs_block_t *it, *block = NULL;
+	sqfs_u64 start = data_writer_clock(proc);
+	sqfs_block_t *it;
 	int status = 0;
 
+	if (queue == NULL)
+		return 0;
+
+	sqfs_trace_begin("data_writer", "write blocks");
+
 	while (queue != NULL && status == 0) {
 		it = queue;
 		queue = it->next;
 
-		if (it->flags & SQFS_BLK_IS_FRAGMENT) {
-			block = NULL;
-			status = process_completed_fragment(proc, it, &block);
-
-			if (block != NULL && status == 0) {
-				pthread_mutex_lock(&proc->mtx);
-				proc->dequeue_id = it->sequence_number;
-				block->sequence_number = it->sequence_number;
-
-				if (proc->queue == NULL) {
-					proc->queue = block;
-					proc->queue_last = block;
-				} else {
-					block->next = proc->queue;
-					proc->queue = block;
-				}
-
-				proc->backlog += 1;
-				proc->done = queue_merge(queue, proc->done);
-				pthread_cond_broadcast(&proc->queue_cond);
-				pthread_mutex_unlock(&proc->mtx);
-
-				queue = NULL;
-			} else {
-				free(block);
-			}
-		} else {
-			status = process_completed_block(proc, it);
-		}
-
-		free(it);
+		status = process_completed_block(proc, it);
+		data_writer_free_block(proc, it);
 	}
 
-	free_blk_list(queue);
+	free_blk_list(proc, queue);
+	sqfs_trace_end("data_writer", "write blocks");
+
+	/* only the main thread touches this, no need to lock */
+	proc->timing.write_time += data_writer_clock(proc) - start;
 	return status;
 }
 
@@ -256,24 +716,42 @@ int test_and_set_status(sqfs_data_writer_t *proc, int status)
 	} else {
 		status = proc->status;
 	}
-	pthread_cond_broadcast(&proc->queue_cond);
 	pthread_mutex_unlock(&proc->mtx);
+
+	if (status != 0)
+		stop_workers(proc);
+
 	return status;
 }
 
-int data_writer_enqueue(sqfs_data_writer_t *proc, sqfs_block_t *block)
+static int enqueue_block(sqfs_data_writer_t *proc, sqfs_block_t *block)
 {
 	sqfs_block_t *queue;
 	int status;
 
 	pthread_mutex_lock(&proc->mtx);
-	while (proc->backlog > proc->max_backlog && proc->status == 0)
-		pthread_cond_wait(&proc->done_cond, &proc->mtx);
+	while (proc->status == 0 &&
+	       (proc->enqueue_id - proc->dequeue_id) >= proc->max_backlog) {
+		queue = try_dequeue(proc);
+
+		if (queue == NULL) {
+			wait_for_backlog(proc);
+			continue;
+		}
+
+		pthread_mutex_unlock(&proc->mtx);
+		status = process_done_queue(proc, queue);
+		if (status != 0) {
+			data_writer_free_block(proc, block);
+			return test_and_set_status(proc, status);
+		}
+		pthread_mutex_lock(&proc->mtx);
+	}
 
 	if (proc->status != 0) {
 		status = proc->status;
 		pthread_mutex_unlock(&proc->mtx);
-		free(block);
+		data_writer_free_block(proc, block);
 		return status;
 	}
 
@@ -281,6 +759,7 @@ int data_writer_enqueue(sqfs_data_writer_t *proc, sqfs_block_t *block)
 	block = NULL;
 
 	queue = try_dequeue(proc);
+	data_writer_fill_stats(proc, &proc->stats);
 	pthread_mutex_unlock(&proc->mtx);
 
 	status = process_done_queue(proc, queue);
@@ -290,39 +769,181 @@ int data_writer_enqueue(sqfs_data_writer_t *proc, sqfs_block_t *block)
 	return 0;
 }
 
-int sqfs_data_writer_finish(sqfs_data_writer_t *proc)
+int data_writer_enqueue(sqfs_data_writer_t *proc, sqfs_block_t *block)
+{
+	sqfs_u64 start = data_writer_clock(proc);
+	int status = enqueue_block(proc, block);
+
+	proc->timing.enqueue_time += data_writer_clock(proc) - start;
+	return status;
+}
+
+int data_writer_wait_done(sqfs_data_writer_t *proc)
+{
+	sqfs_block_t *queue = NULL;
+	int status;
+
+	pthread_mutex_lock(&proc->mtx);
+	while (proc->status == 0 && proc->enqueue_id != proc->dequeue_id) {
+		queue = try_dequeue(proc);
+		if (queue != NULL)
+			break;
+
+		wait_for_workers(proc);
+	}
+	status = proc->status;
+	data_writer_fill_stats(proc, &proc->stats);
+	pthread_mutex_unlock(&proc->mtx);
+
+	if (status != 0) {
+		free_blk_list(proc, queue);
+		return status;
+	}
+
+	status = process_done_queue(proc, queue);
+	if (status != 0)
+		return test_and_set_status(proc, status);
+
+	return 0;
+}
+
+/* process everything that has been enqueued so far */
+static int drain_queue(sqfs_data_writer_t *proc)
 {
 	sqfs_block_t *queue;
-	int status = 0;
+	int status;
 
 	for (;;) {
 		pthread_mutex_lock(&proc->mtx);
-		while (proc->backlog > 0 && proc->status == 0)
-			pthread_cond_wait(&proc->done_cond, &proc->mtx);
+		for (;;) {
+			queue = try_dequeue(proc);
 
-		if (proc->status != 0) {
-			status = proc->status;
-			pthread_mutex_unlock(&proc->mtx);
-			return status;
+			if (queue != NULL || proc->status != 0 ||
+			    proc->enqueue_id == proc->dequeue_id) {
+				break;
+			}
+
+			wait_for_workers(proc);
 		}
 
-		queue = proc->done;
-		proc->done = NULL;
+		status = proc->status;
+		data_writer_fill_stats(proc, &proc->stats);
 		pthread_mutex_unlock(&proc->mtx);
 
-		if (queue == NULL) {
-			if (proc->frag_block != NULL) {
-				append_to_work_queue(proc, proc->frag_block);
-				proc->frag_block = NULL;
-				continue;
-			}
-			break;
+		if (status != 0) {
+			free_blk_list(proc, queue);
+			return status;
 		}
 
+		if (queue == NULL)
+			break;
+
 		status = process_done_queue(proc, queue);
 		if (status != 0)
-			return status;
+			return test_and_set_status(proc, status);
+	}
+
+	return 0;
+}
+
+int sqfs_data_writer_sync(sqfs_data_writer_t *proc)
+{
+	int status = data_writer_flush_pending(proc);
+
+	if (status != 0)
+		return status;
+
+	return drain_queue(proc);
+}
+
+int sqfs_data_writer_finish(sqfs_data_writer_t *proc)
+{
+	int status;
+
+	status = sqfs_data_writer_submit_streams(proc, true);
+	if (status != 0)
+		return status;
+
+	status = data_writer_flush_fragments(proc);
+	if (status != 0)
+		return status;
+
+	status = drain_queue(proc);
+	if (status != 0)
+		return status;
+
+	if (proc->output != NULL) {
+		status = data_writer_output_flush(proc->output);
+		if (status != 0)
+			return test_and_set_status(proc, status);
+
+		proc->output->destroy(proc->output);
+		proc->output = NULL;
+		proc->file = proc->outfile;
 	}
 
+	data_writer_resolve_links(proc);
+	proc->time_end = data_writer_clock(proc);
+
+	pthread_mutex_lock(&proc->mtx);
+	data_writer_fill_stats(proc, &proc->stats);
+	pthread_mutex_unlock(&proc->mtx);
+	return 0;
+}
+
+void data_writer_copy_timing(sqfs_data_writer_t *proc,
+			     sqfs_data_writer_timing_t *out)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&proc->mtx);
+	*out = proc->timing;
+	out->compress_time_max = 0;
+
+	for (i = 0; i < proc->num_workers; ++i) {
+		if (proc->workers[i]->busy > out->compress_time_max)
+			out->compress_time_max = proc->workers[i]->busy;
+	}
+	pthread_mutex_unlock(&proc->mtx);
+
+	out->num_workers = proc->num_workers;
+}
+
+void data_writer_copy_stats(sqfs_data_writer_t *proc,
+			    sqfs_data_writer_stats_t *out)
+{
+	pthread_mutex_lock(&proc->mtx);
+	*out = proc->stats;
+	out->backlog = proc->enqueue_id - proc->dequeue_id;
+	out->cmp_cache_hits = proc->timing.cmp_cache_hits;
+	out->active_workers = proc->active_workers;
+	pthread_mutex_unlock(&proc->mtx);
+
+	out->num_workers = proc->num_workers;
+}
+
+int data_writer_copy_worker_stats(sqfs_data_writer_t *proc,
+				  unsigned int index,
+				  sqfs_data_writer_worker_stats_t *out)
+{
+	compress_worker_t *worker;
+
+	if (index >= proc->num_workers)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	worker = proc->workers[index];
+
+	pthread_mutex_lock(&proc->mtx);
+	out->blocks = worker->blocks;
+	out->bytes_in = worker->bytes_in;
+	out->bytes_out = worker->bytes_out;
+	out->busy_time = worker->busy;
+	pthread_mutex_unlock(&proc->mtx);
+
+	pthread_mutex_lock(&worker->mtx);
+	out->parked = worker->parked;
+	pthread_mutex_unlock(&worker->mtx);
+
+	out->size = sizeof(*out);
 	return 0;
 }
@@ -11,30 +11,55 @@ sqfs_data_writer_t *sqfs_data_writer_create(size_t max_block_size,
 					    sqfs_compressor_t *cmp,
 					    unsigned int num_workers,
 					    size_t max_backlog,
+					    size_t pool_size,
 					    size_t devblksz,
-					    sqfs_file_t *file)
+					    sqfs_file_t *file,
+					    sqfs_u32 flags)
 {
 	sqfs_data_writer_t *proc;
 
+	if (flags & ~SQFS_DATA_WRITER_ALL_FLAGS)
+		return NULL;
+
 	proc = alloc_flex(sizeof(*proc), 1, max_block_size);
 
 	if (proc == NULL)
 		return NULL;
 
 	if (data_writer_init(proc, max_block_size, cmp, num_workers,
-			     max_backlog, devblksz, file)) {
+			     max_backlog, pool_size, devblksz, file, flags)) {
 		data_writer_cleanup(proc);
 		return NULL;
 	}
 
+	if (flags & SQFS_DATA_WRITER_CACHE_COMPRESSED) {
+		proc->cache = cmp_cache_create(max_block_size);
+		if (proc->cache == NULL) {
+			data_writer_cleanup(proc);
+			return NULL;
+		}
+	}
+
 	return proc;
 }
 
 void sqfs_data_writer_destroy(sqfs_data_writer_t *proc)
 {
+	cmp_cache_destroy(proc->cache);
 	data_writer_cleanup(proc);
 }
 
+int sqfs_data_writer_add_compressor(sqfs_data_writer_t *proc,
+				    sqfs_compressor_t *cmp, sqfs_u32 *id)
+{
+	if (proc->num_cmp >= MAX_COMPRESSORS)
+		return SQFS_ERROR_OVERFLOW;
+
+	*id = proc->num_cmp;
+	proc->cmp_list[proc->num_cmp++] = cmp;
+	return 0;
+}
+
 int test_and_set_status(sqfs_data_writer_t *proc, int status)
 {
 	if (proc->status == 0)
@@ -45,54 +70,101 @@ int test_and_set_status(sqfs_data_writer_t *proc, int status)
 
 int data_writer_enqueue(sqfs_data_writer_t *proc, sqfs_block_t *block)
 {
-	sqfs_block_t *fragblk = NULL;
+	sqfs_u64 start, compressed, end;
 
 	if (proc->status != 0) {
-		free(block);
+		data_writer_free_block(proc, block);
 		return proc->status;
 	}
 
-	if (block->flags & SQFS_BLK_IS_FRAGMENT) {
-		block->checksum = crc32(0, block->data, block->size);
-
-		proc->status = process_completed_fragment(proc, block,
-							  &fragblk);
-		free(block);
+	start = data_writer_clock(proc);
 
-		if (proc->status != 0) {
-			free(fragblk);
-			return proc->status;
-		}
+	sqfs_trace_begin("data_writer", "compress block");
+	proc->status = data_writer_do_block(proc, block,
+					    proc->cmp_list[block->cmp_id],
+					    proc->scratch, proc->cache);
+	sqfs_trace_end("data_writer", "compress block");
 
-		if (fragblk == NULL)
-			return 0;
+	compressed = data_writer_clock(proc);
 
-		block = fragblk;
+	if (proc->status == 0) {
+		sqfs_trace_begin("data_writer", "write blocks");
+		proc->status = process_completed_block(proc, block);
+		sqfs_trace_end("data_writer", "write blocks");
 	}
 
-	proc->status = data_writer_do_block(block, proc->cmp, proc->scratch,
-					    proc->max_block_size);
+	end = data_writer_clock(proc);
 
-	if (proc->status == 0)
-		proc->status = process_completed_block(proc, block);
+	proc->timing.compress_time += compressed - start;
+	proc->timing.write_time += end - compressed;
+	proc->timing.enqueue_time += end - start;
+	proc->timing.block_count += 1;
+
+	if (proc->cache != NULL)
+		proc->timing.cmp_cache_hits += cmp_cache_take_hits(proc->cache);
 
-	free(block);
+	data_writer_free_block(proc, block);
 	return proc->status;
 }
 
+int data_writer_wait_done(sqfs_data_writer_t *proc)
+{
+	return proc->status;
+}
+
+int sqfs_data_writer_sync(sqfs_data_writer_t *proc)
+{
+	if (proc->status != 0)
+		return proc->status;
+
+	if (data_writer_flush_pending(proc))
+		return proc->status;
+
+	return 0;
+}
+
 int sqfs_data_writer_finish(sqfs_data_writer_t *proc)
 {
-	if (proc->status != 0 || proc->frag_block == NULL)
+	int ret;
+
+	if (proc->status != 0)
 		return proc->status;
 
-	proc->status = data_writer_do_block(proc->frag_block, proc->cmp,
-					    proc->scratch,
-					    proc->max_block_size);
+	ret = sqfs_data_writer_submit_streams(proc, true);
+	if (ret)
+		return ret;
 
-	if (proc->status == 0)
-		proc->status = process_completed_block(proc, proc->frag_block);
+	if (data_writer_flush_fragments(proc))
+		return proc->status;
 
-	free(proc->frag_block);
-	proc->frag_block = NULL;
-	return proc->status;
+	data_writer_resolve_links(proc);
+	proc->time_end = data_writer_clock(proc);
+	return 0;
+}
+
+void data_writer_copy_timing(sqfs_data_writer_t *proc,
+			     sqfs_data_writer_timing_t *out)
+{
+	*out = proc->timing;
+	out->compress_time_max = out->compress_time;
+	out->num_workers = 0;
+}
+
+void data_writer_copy_stats(sqfs_data_writer_t *proc,
+			    sqfs_data_writer_stats_t *out)
+{
+	memset(out, 0, sizeof(*out));
+	data_writer_fill_stats(proc, out);
+	out->blocks_queued = proc->timing.block_count;
+	out->cmp_cache_hits = proc->timing.cmp_cache_hits;
+}
+
+int data_writer_copy_worker_stats(sqfs_data_writer_t *proc,
+				  unsigned int index,
+				  sqfs_data_writer_worker_stats_t *out)
+{
+	(void)proc;
+	(void)index;
+	(void)out;
+	return SQFS_ERROR_OUT_OF_BOUNDS;
 }
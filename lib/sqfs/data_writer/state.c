@@ -0,0 +1,358 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * state.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#define SQFS_BUILDING_DLL
+#include "internal.h"
+
+#define STATE_MAGIC "SQFSDWST"
+#define STATE_VERSION (1)
+
+/* entries converted at once when writing or reading the lists */
+#define STATE_CHUNK (1024)
+
+/*
+  Everything is stored in little endian. The block list is what the
+  deduplication goes by, the fragment list what the tail end deduplication
+  goes by. Neither of the hash tables is stored, they are rebuilt.
+ */
+typedef struct {
+	sqfs_u8 magic[8];
+	sqfs_u32 version;
+	sqfs_u32 block_size;
+	sqfs_u32 flags;
+	sqfs_u32 pad0;
+	sqfs_u64 output_size;
+	sqfs_u64 num_blocks;
+	sqfs_u64 num_fragments;
+	sqfs_u64 num_frag_list;
+} state_header_t;
+
+typedef struct {
+	sqfs_u64 offset;
+	sqfs_u64 hash;
+	sqfs_u64 digest;
+} state_block_t;
+
+typedef struct {
+	sqfs_u32 index;
+	sqfs_u32 offset;
+	sqfs_u64 hash;
+	sqfs_u64 digest;
+} state_frag_t;
+
+/* the flags that change what ends up in the lists */
+#define STATE_FLAGS (SQFS_DATA_WRITER_VERIFY_DEDUP)
+
+static int write_blocks(const sqfs_data_writer_t *proc, sqfs_file_t *file)
+{
+	state_block_t buffer[STATE_CHUNK];
+	size_t i, j, count;
+	int ret;
+
+	for (i = 0; i < proc->num_blocks; i += count) {
+		count = proc->num_blocks - i;
+		if (count > STATE_CHUNK)
+			count = STATE_CHUNK;
+
+		for (j = 0; j < count; ++j) {
+			buffer[j].offset = htole64(proc->blocks[i + j].offset);
+			buffer[j].hash = htole64(proc->blocks[i + j].hash);
+			buffer[j].digest = htole64(proc->blocks[i + j].digest);
+		}
+
+		ret = file->write_at(file, file->get_size(file), buffer,
+				     count * sizeof(buffer[0]));
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int write_frag_list(const sqfs_data_writer_t *proc, sqfs_file_t *file)
+{
+	state_frag_t buffer[STATE_CHUNK];
+	const frag_info_t *info;
+	size_t i, j, count;
+	int ret;
+
+	for (i = 0; i < proc->frag_list_num; i += count) {
+		count = proc->frag_list_num - i;
+		if (count > STATE_CHUNK)
+			count = STATE_CHUNK;
+
+		for (j = 0; j < count; ++j) {
+			info = proc->frag_list + i + j;
+
+			buffer[j].index = htole32(info->index);
+			buffer[j].offset = htole32(info->offset);
+			buffer[j].hash = htole64(info->hash);
+			buffer[j].digest = htole64(info->digest);
+		}
+
+		ret = file->write_at(file, file->get_size(file), buffer,
+				     count * sizeof(buffer[0]));
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+  Get to a point where everything handed to the data writer is on the
+  output file, except for what the file object itself may still buffer.
+ */
+static int settle(sqfs_data_writer_t *proc)
+{
+	int ret;
+
+	if (proc->inode != NULL)
+		return test_and_set_status(proc, SQFS_ERROR_INTERNAL);
+
+	ret = data_writer_flush_fragments(proc);
+	if (ret)
+		return ret;
+
+	ret = sqfs_data_writer_sync(proc);
+	if (ret)
+		return ret;
+
+#ifdef WITH_PTHREAD
+	if (proc->output != NULL) {
+		ret = data_writer_output_flush(proc->output);
+		if (ret)
+			return test_and_set_status(proc, ret);
+	}
+#endif
+
+	data_writer_resolve_links(proc);
+	return 0;
+}
+
+int sqfs_data_writer_save_state(sqfs_data_writer_t *proc, sqfs_file_t *file)
+{
+	state_header_t hdr;
+	int ret;
+
+	ret = settle(proc);
+	if (ret)
+		return ret;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, STATE_MAGIC, sizeof(hdr.magic));
+	hdr.version = htole32(STATE_VERSION);
+	hdr.block_size = htole32(proc->max_block_size);
+	hdr.flags = htole32(proc->flags & STATE_FLAGS);
+	hdr.output_size = htole64(proc->file->get_size(proc->file));
+	hdr.num_blocks = htole64(proc->num_blocks);
+	hdr.num_fragments = htole64(proc->num_fragments);
+	hdr.num_frag_list = htole64(proc->frag_list_num);
+
+	ret = file->write_at(file, file->get_size(file), &hdr, sizeof(hdr));
+	if (ret)
+		return ret;
+
+	ret = write_blocks(proc, file);
+	if (ret)
+		return ret;
+
+	ret = file->write_at(file, file->get_size(file), proc->fragments,
+			     proc->num_fragments * sizeof(proc->fragments[0]));
+	if (ret)
+		return ret;
+
+	return write_frag_list(proc, file);
+}
+
+static int read_blocks(sqfs_data_writer_t *proc, sqfs_file_t *file,
+		       sqfs_u64 *offset, size_t total)
+{
+	state_block_t buffer[STATE_CHUNK];
+	size_t i, j, count;
+	int ret;
+
+	for (i = 0; i < total; i += count) {
+		count = total - i;
+		if (count > STATE_CHUNK)
+			count = STATE_CHUNK;
+
+		ret = file->read_at(file, *offset, buffer,
+				    count * sizeof(buffer[0]));
+		if (ret)
+			return ret;
+
+		*offset += count * sizeof(buffer[0]);
+
+		for (j = 0; j < count; ++j) {
+			proc->blocks[i + j].offset = le64toh(buffer[j].offset);
+			proc->blocks[i + j].hash = le64toh(buffer[j].hash);
+			proc->blocks[i + j].digest = le64toh(buffer[j].digest);
+			proc->blocks[i + j].next = 0;
+		}
+	}
+
+	return 0;
+}
+
+static int read_frag_list(sqfs_data_writer_t *proc, sqfs_file_t *file,
+			  sqfs_u64 *offset, size_t total)
+{
+	state_frag_t buffer[STATE_CHUNK];
+	size_t i, j, count;
+	frag_info_t *info;
+	int ret;
+
+	for (i = 0; i < total; i += count) {
+		count = total - i;
+		if (count > STATE_CHUNK)
+			count = STATE_CHUNK;
+
+		ret = file->read_at(file, *offset, buffer,
+				    count * sizeof(buffer[0]));
+		if (ret)
+			return ret;
+
+		*offset += count * sizeof(buffer[0]);
+
+		for (j = 0; j < count; ++j) {
+			info = proc->frag_list + i + j;
+
+			info->index = le32toh(buffer[j].index);
+			info->offset = le32toh(buffer[j].offset);
+			info->hash = le64toh(buffer[j].hash);
+			info->digest = le64toh(buffer[j].digest);
+
+			if (info->index >= proc->num_fragments)
+				return SQFS_ERROR_CORRUPTED;
+		}
+	}
+
+	return 0;
+}
+
+/* make room for the lists, they are grown by doubling from here on */
+static int reserve(void **array, size_t *max, size_t count, size_t size)
+{
+	size_t new_max = *max;
+	void *new;
+
+	if (count <= new_max)
+		return 0;
+
+	while (new_max < count)
+		new_max *= 2;
+
+	new = realloc(*array, new_max * size);
+	if (new == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	*array = new;
+	*max = new_max;
+	return 0;
+}
+
+int sqfs_data_writer_load_state(sqfs_data_writer_t *proc, sqfs_file_t *file,
+				sqfs_u64 *offset)
+{
+	size_t num_blocks, num_fragments, num_frag_list;
+	sqfs_u64 output_size;
+	state_header_t hdr;
+	void *new;
+	int ret;
+
+	if (proc->files_queued > 0 || proc->num_blocks > 0 ||
+	    proc->num_fragments > 0 || proc->inode != NULL) {
+		return SQFS_ERROR_INTERNAL;
+	}
+
+	ret = file->read_at(file, *offset, &hdr, sizeof(hdr));
+	if (ret)
+		return ret;
+
+	if (memcmp(hdr.magic, STATE_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    le32toh(hdr.version) != STATE_VERSION) {
+		return SQFS_ERROR_CORRUPTED;
+	}
+
+	if (le32toh(hdr.block_size) != proc->max_block_size ||
+	    le32toh(hdr.flags) != (proc->flags & STATE_FLAGS)) {
+		return SQFS_ERROR_UNSUPPORTED;
+	}
+
+	output_size = le64toh(hdr.output_size);
+
+	if (le64toh(hdr.num_blocks) > SIZE_MAX ||
+	    le64toh(hdr.num_fragments) > 0xFFFFFFFF ||
+	    le64toh(hdr.num_frag_list) > SIZE_MAX) {
+		return SQFS_ERROR_OVERFLOW;
+	}
+
+	num_blocks = le64toh(hdr.num_blocks);
+	num_fragments = le64toh(hdr.num_fragments);
+	num_frag_list = le64toh(hdr.num_frag_list);
+
+	/* the output has to hold everything the lists point to */
+	if (proc->file->get_size(proc->file) < output_size)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	*offset += sizeof(hdr);
+
+	ret = reserve((void **)&proc->blocks, &proc->max_blocks,
+		      num_blocks, sizeof(proc->blocks[0]));
+	if (ret)
+		return ret;
+
+	ret = read_blocks(proc, file, offset, num_blocks);
+	if (ret)
+		return ret;
+
+	if (num_fragments > proc->max_fragments) {
+		new = realloc(proc->fragments,
+			      num_fragments * sizeof(proc->fragments[0]));
+		if (new == NULL)
+			return SQFS_ERROR_ALLOC;
+
+		proc->fragments = new;
+		proc->max_fragments = num_fragments;
+	}
+
+	if (num_fragments > 0) {
+		ret = file->read_at(file, *offset, proc->fragments,
+				    num_fragments * sizeof(proc->fragments[0]));
+		if (ret)
+			return ret;
+
+		*offset += num_fragments * sizeof(proc->fragments[0]);
+	}
+
+	proc->num_fragments = num_fragments;
+
+	ret = reserve((void **)&proc->frag_list, &proc->frag_list_max,
+		      num_frag_list, sizeof(proc->frag_list[0]));
+	if (ret)
+		return ret;
+
+	ret = read_frag_list(proc, file, offset, num_frag_list);
+	if (ret)
+		return ret;
+
+	proc->frag_list_num = num_frag_list;
+
+	ret = data_writer_rebuild_frag_hash(proc);
+	if (ret)
+		return ret;
+
+	/* the hash index picks the blocks up in front of the next file */
+	proc->num_blocks = num_blocks;
+	proc->file_start = num_blocks;
+	proc->blk_indexed = 0;
+	memset(proc->blk_buckets, 0,
+	       proc->num_blk_buckets * sizeof(proc->blk_buckets[0]));
+
+	/* anything behind the state, e.g. from a crash, is thrown away */
+	return proc->file->truncate(proc->file, output_size);
+}
@@ -0,0 +1,294 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * stream.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#define SQFS_BUILDING_DLL
+#include "internal.h"
+
+/*
+  A stream collects the data of a file in chunks of up to a block, on
+  whatever thread appends to it. Full chunks are handed over to the main
+  thread through a list protected by the stream mutex of the data writer.
+  The main thread feeds the streams through the regular file API, one
+  after another in the order they were opened, so the image comes out
+  exactly as if the files had been written one after another. Streams that
+  are not up yet simply keep their chunks until it is their turn.
+ */
+typedef struct stream_chunk_t {
+	struct stream_chunk_t *next;
+	size_t size;
+	sqfs_u8 data[];
+} stream_chunk_t;
+
+struct sqfs_data_stream_t {
+	sqfs_data_stream_t *next;
+	sqfs_data_writer_t *proc;
+	sqfs_inode_generic_t *inode;
+	sqfs_u32 flags;
+	sqfs_u32 group;
+	sqfs_u32 cmp_id;
+
+	/* set once the main thread has begun the file */
+	bool begun;
+
+	/* chunks handed over, protected by the stream mutex */
+	stream_chunk_t *chunks;
+	stream_chunk_t *chunks_last;
+	bool closed;
+
+	/* the chunk being filled, only used by the appending thread */
+	stream_chunk_t *current;
+};
+
+#ifdef WITH_PTHREAD
+static void stream_lock(sqfs_data_writer_t *proc)
+{
+	pthread_mutex_lock(&proc->stream_mtx);
+}
+
+static void stream_unlock(sqfs_data_writer_t *proc)
+{
+	pthread_cond_broadcast(&proc->stream_cond);
+	pthread_mutex_unlock(&proc->stream_mtx);
+}
+
+static int stream_wait(sqfs_data_writer_t *proc)
+{
+	pthread_cond_wait(&proc->stream_cond, &proc->stream_mtx);
+	return 0;
+}
+#else
+static void stream_lock(sqfs_data_writer_t *proc)
+{
+	(void)proc;
+}
+
+static void stream_unlock(sqfs_data_writer_t *proc)
+{
+	(void)proc;
+}
+
+/* without threads, nobody else could ever close the stream */
+static int stream_wait(sqfs_data_writer_t *proc)
+{
+	return test_and_set_status(proc, SQFS_ERROR_INTERNAL);
+}
+#endif
+
+static void free_chunks(stream_chunk_t *list)
+{
+	stream_chunk_t *it;
+
+	while (list != NULL) {
+		it = list;
+		list = list->next;
+		free(it);
+	}
+}
+
+static void hand_over(sqfs_data_stream_t *strm)
+{
+	sqfs_data_writer_t *proc = strm->proc;
+
+	stream_lock(proc);
+	if (strm->chunks_last == NULL) {
+		strm->chunks = strm->current;
+	} else {
+		strm->chunks_last->next = strm->current;
+	}
+	strm->chunks_last = strm->current;
+	stream_unlock(proc);
+
+	strm->current = NULL;
+}
+
+sqfs_data_stream_t *sqfs_data_writer_open_stream(sqfs_data_writer_t *proc,
+						 sqfs_inode_generic_t *inode,
+						 sqfs_u32 flags)
+{
+	sqfs_data_stream_t *strm;
+
+	if (flags & ~SQFS_BLK_USER_SETTABLE_FLAGS) {
+		test_and_set_status(proc, SQFS_ERROR_UNSUPPORTED);
+		return NULL;
+	}
+
+	strm = calloc(1, sizeof(*strm));
+	if (strm == NULL) {
+		test_and_set_status(proc, SQFS_ERROR_ALLOC);
+		return NULL;
+	}
+
+	strm->proc = proc;
+	strm->inode = inode;
+	strm->flags = flags;
+	strm->cmp_id = proc->default_cmp_id;
+
+	/* only the main thread walks the list of streams */
+	if (proc->streams_last == NULL) {
+		proc->streams = strm;
+	} else {
+		proc->streams_last->next = strm;
+	}
+	proc->streams_last = strm;
+	return strm;
+}
+
+int sqfs_data_stream_set_compressor(sqfs_data_stream_t *strm, sqfs_u32 id)
+{
+	if (strm->begun || id >= strm->proc->num_cmp)
+		return SQFS_ERROR_INTERNAL;
+
+	strm->cmp_id = id;
+	return 0;
+}
+
+int sqfs_data_stream_set_fragment_group(sqfs_data_stream_t *strm,
+					sqfs_u32 group)
+{
+	if (strm->begun)
+		return SQFS_ERROR_INTERNAL;
+
+	strm->group = group;
+	return 0;
+}
+
+int sqfs_data_stream_append(sqfs_data_stream_t *strm, const void *data,
+			    size_t size)
+{
+	size_t diff, max = strm->proc->max_block_size;
+
+	while (size > 0) {
+		if (strm->current == NULL) {
+			strm->current = alloc_flex(sizeof(*strm->current),
+						   1, max);
+			if (strm->current == NULL)
+				return SQFS_ERROR_ALLOC;
+
+			strm->current->next = NULL;
+			strm->current->size = 0;
+		}
+
+		diff = max - strm->current->size;
+		if (diff > size)
+			diff = size;
+
+		memcpy(strm->current->data + strm->current->size, data, diff);
+		strm->current->size += diff;
+
+		if (strm->current->size == max)
+			hand_over(strm);
+
+		size -= diff;
+		data = (const char *)data + diff;
+	}
+
+	return 0;
+}
+
+int sqfs_data_stream_close(sqfs_data_stream_t *strm)
+{
+	sqfs_data_writer_t *proc = strm->proc;
+
+	if (strm->current != NULL)
+		hand_over(strm);
+
+	stream_lock(proc);
+	strm->closed = true;
+	stream_unlock(proc);
+	return 0;
+}
+
+static int begin_stream(sqfs_data_writer_t *proc, sqfs_data_stream_t *strm)
+{
+	int err;
+
+	err = data_writer_begin_file(proc, strm->inode, strm->flags);
+	if (err)
+		return err;
+
+	proc->cmp_id = strm->cmp_id;
+	proc->frag_group = strm->group;
+	strm->begun = true;
+	return 0;
+}
+
+int sqfs_data_writer_submit_streams(sqfs_data_writer_t *proc, bool wait)
+{
+	sqfs_data_stream_t *strm;
+	stream_chunk_t *list, *it;
+	bool closed;
+	int err;
+
+	while (proc->streams != NULL) {
+		strm = proc->streams;
+
+		if (!strm->begun) {
+			err = begin_stream(proc, strm);
+			if (err)
+				return err;
+		}
+
+		stream_lock(proc);
+		while (wait && strm->chunks == NULL && !strm->closed) {
+			err = stream_wait(proc);
+			if (err) {
+				stream_unlock(proc);
+				return err;
+			}
+		}
+
+		list = strm->chunks;
+		closed = strm->closed;
+		strm->chunks = strm->chunks_last = NULL;
+		stream_unlock(proc);
+
+		while (list != NULL) {
+			it = list;
+			list = list->next;
+
+			err = sqfs_data_writer_append(proc, it->data, it->size);
+			free(it);
+
+			if (err) {
+				free_chunks(list);
+				return err;
+			}
+		}
+
+		if (!closed) {
+			if (!wait)
+				break;
+			continue;
+		}
+
+		proc->streams = strm->next;
+		if (proc->streams == NULL)
+			proc->streams_last = NULL;
+		free(strm);
+
+		err = sqfs_data_writer_end_file(proc);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+void data_writer_free_streams(sqfs_data_writer_t *proc)
+{
+	sqfs_data_stream_t *strm;
+
+	while (proc->streams != NULL) {
+		strm = proc->streams;
+		proc->streams = strm->next;
+
+		free_chunks(strm->chunks);
+		free(strm->current);
+		free(strm);
+	}
+
+	proc->streams_last = NULL;
+}
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * dir_internal.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef DIR_INTERNAL_H
+#define DIR_INTERNAL_H
+
+#include "config.h"
+
+#include "sqfs/predef.h"
+
+#include <stdbool.h>
+
+/*
+  Replace the allocator used for the inodes and entries a directory reader
+  returns and get the previous one. The tree loader uses this to get inodes
+  from the standard library, because sqfs_dir_tree_destroy frees them
+  without knowing the reader.
+ */
+SQFS_INTERNAL const sqfs_allocator_t *
+dir_reader_swap_allocator(sqfs_dir_reader_t *rd,
+			  const sqfs_allocator_t *allocator);
+
+/*
+  Same as sqfs_dir_reader_find, but with a name that is not necessarily
+  null-terminated, e.g. a component in the middle of a path.
+ */
+SQFS_INTERNAL int dir_reader_find_name(sqfs_dir_reader_t *rd,
+				       const char *name, size_t len);
+
+/*
+  Get the location of the inode that the current directory entry refers to,
+  or that of the root inode if root is set.
+ */
+SQFS_INTERNAL sqfs_u64 dir_reader_inode_ref(const sqfs_dir_reader_t *rd,
+					    bool root);
+
+/*
+  Read an inode by its location. If no_blocks is set, the block list of a
+  regular file is left out, see SQFS_TREE_NO_BLOCK_LISTS.
+ */
+SQFS_INTERNAL int dir_reader_read_inode(sqfs_dir_reader_t *rd, sqfs_u64 ref,
+					bool no_blocks,
+					sqfs_inode_generic_t **out);
+
+/*
+  Run the filter callback set with sqfs_dir_reader_set_filter on an entry.
+  Returns zero if there is no filter.
+ */
+SQFS_INTERNAL int dir_reader_filter_entry(sqfs_dir_reader_t *rd,
+					  const sqfs_tree_node_t *parent,
+					  const sqfs_dir_entry_t *ent);
+
+#endif /* DIR_INTERNAL_H */
@@ -9,19 +9,53 @@
 
 #include "sqfs/meta_reader.h"
 #include "sqfs/dir_reader.h"
+#include "sqfs/path_index.h"
 #include "sqfs/compressor.h"
+#include "sqfs/block.h"
 #include "sqfs/super.h"
 #include "sqfs/inode.h"
 #include "sqfs/error.h"
 #include "sqfs/dir.h"
+#include "util/compat.h"
 #include "util/util.h"
+#include "meta_internal.h"
+#include "dir_internal.h"
+#include "lazy_table.h"
+#include "hook_alloc.h"
 
 #include <string.h>
 #include <stdlib.h>
 
+typedef struct {
+	sqfs_u32 index;
+	sqfs_u32 start_block;
+	size_t name_len;
+	const sqfs_u8 *name;
+} dir_index_t;
+
+/* a resolved (directory inode, name) to child inode reference mapping */
+typedef struct dcache_ent_t {
+	struct dcache_ent_t *hash_next;
+	struct dcache_ent_t *lru_prev;
+	struct dcache_ent_t *lru_next;
+
+	sqfs_u64 hash;
+	sqfs_u64 dir_ref;
+	sqfs_u64 child_ref;
+
+	size_t name_len;
+	char name[];
+} dcache_ent_t;
+
 struct sqfs_dir_reader_t {
 	sqfs_meta_reader_t *meta_dir;
 	sqfs_meta_reader_t *meta_inode;
+
+	sqfs_file_t *file;
+	sqfs_compressor_t *cmp;
+
+	/* optional block cache shared by both of the above */
+	sqfs_meta_cache_t *blk_cache;
 	const sqfs_super_t *super;
 
 	sqfs_dir_header_t hdr;
@@ -32,6 +66,36 @@ struct sqfs_dir_reader_t {
 	size_t start_size;
 	sqfs_u16 dir_offset;
 	sqfs_u16 inode_offset;
+
+	/* the entry most recently returned by sqfs_dir_reader_next */
+	sqfs_dir_entry_t *ent;
+	size_t ent_name_max;
+
+	/* copy of the index of an extended directory inode */
+	sqfs_u8 *idx_data;
+	size_t idx_data_max;
+	dir_index_t *idx;
+	size_t idx_count;
+	size_t idx_max;
+
+	/* optional path lookup cache, most recently used entry first */
+	dcache_ent_t **dc_buckets;
+	size_t dc_num_buckets;
+	dcache_ent_t *dc_lru_first;
+	dcache_ent_t *dc_lru_last;
+	size_t dc_count;
+	size_t dc_max;
+
+	/* for the inodes and entries returned to the caller */
+	const sqfs_allocator_t *allocator;
+
+	/* optional filter for the tree loader */
+	sqfs_tree_filter_cb_t filter;
+	void *filter_user;
+
+	/* the export table, loaded on the first lookup by inode number */
+	lazy_table_t export_tbl;
+	bool have_export;
 };
 
 sqfs_dir_reader_t *sqfs_dir_reader_create(const sqfs_super_t *super,
@@ -72,21 +136,305 @@ sqfs_dir_reader_t *sqfs_dir_reader_create(const sqfs_super_t *super,
 	}
 
 	rd->super = super;
+	rd->file = file;
+	rd->cmp = cmp;
 	return rd;
 }
 
+static void dcache_clear(sqfs_dir_reader_t *rd)
+{
+	dcache_ent_t *ent;
+
+	while (rd->dc_lru_first != NULL) {
+		ent = rd->dc_lru_first;
+		rd->dc_lru_first = ent->lru_next;
+		free(ent);
+	}
+
+	free(rd->dc_buckets);
+	rd->dc_buckets = NULL;
+	rd->dc_num_buckets = 0;
+	rd->dc_lru_last = NULL;
+	rd->dc_count = 0;
+	rd->dc_max = 0;
+}
+
+static sqfs_u64 dcache_hash(sqfs_u64 dir_ref, const char *name, size_t len)
+{
+	return xxh64(name, len) ^ (dir_ref * 0x9E3779B185EBCA87ULL);
+}
+
+static void dcache_unlink_lru(sqfs_dir_reader_t *rd, dcache_ent_t *ent)
+{
+	if (ent->lru_prev == NULL) {
+		rd->dc_lru_first = ent->lru_next;
+	} else {
+		ent->lru_prev->lru_next = ent->lru_next;
+	}
+
+	if (ent->lru_next == NULL) {
+		rd->dc_lru_last = ent->lru_prev;
+	} else {
+		ent->lru_next->lru_prev = ent->lru_prev;
+	}
+}
+
+static void dcache_push_lru(sqfs_dir_reader_t *rd, dcache_ent_t *ent)
+{
+	ent->lru_prev = NULL;
+	ent->lru_next = rd->dc_lru_first;
+
+	if (rd->dc_lru_first == NULL) {
+		rd->dc_lru_last = ent;
+	} else {
+		rd->dc_lru_first->lru_prev = ent;
+	}
+
+	rd->dc_lru_first = ent;
+}
+
+static bool dcache_lookup(sqfs_dir_reader_t *rd, sqfs_u64 dir_ref,
+			  const char *name, size_t len, sqfs_u64 *child_ref)
+{
+	dcache_ent_t *ent;
+	sqfs_u64 hash;
+
+	if (rd->dc_buckets == NULL)
+		return false;
+
+	hash = dcache_hash(dir_ref, name, len);
+	ent = rd->dc_buckets[hash & (rd->dc_num_buckets - 1)];
+
+	while (ent != NULL) {
+		if (ent->hash == hash && ent->dir_ref == dir_ref &&
+		    ent->name_len == len && memcmp(ent->name, name, len) == 0) {
+			dcache_unlink_lru(rd, ent);
+			dcache_push_lru(rd, ent);
+			*child_ref = ent->child_ref;
+			return true;
+		}
+
+		ent = ent->hash_next;
+	}
+
+	return false;
+}
+
+static void dcache_evict(sqfs_dir_reader_t *rd)
+{
+	dcache_ent_t *ent = rd->dc_lru_last, **it;
+
+	it = rd->dc_buckets + (ent->hash & (rd->dc_num_buckets - 1));
+
+	while (*it != ent)
+		it = &((*it)->hash_next);
+
+	*it = ent->hash_next;
+
+	dcache_unlink_lru(rd, ent);
+	rd->dc_count -= 1;
+	free(ent);
+}
+
+/* Failing to add an entry is not an error, the cache is just an aid. */
+static void dcache_insert(sqfs_dir_reader_t *rd, sqfs_u64 dir_ref,
+			  const char *name, size_t len, sqfs_u64 child_ref)
+{
+	dcache_ent_t *ent;
+	size_t index;
+
+	if (rd->dc_buckets == NULL)
+		return;
+
+	if (rd->dc_count >= rd->dc_max)
+		dcache_evict(rd);
+
+	ent = alloc_flex(sizeof(*ent), 1, len);
+	if (ent == NULL)
+		return;
+
+	ent->hash = dcache_hash(dir_ref, name, len);
+	ent->dir_ref = dir_ref;
+	ent->child_ref = child_ref;
+	ent->name_len = len;
+	memcpy(ent->name, name, len);
+
+	index = ent->hash & (rd->dc_num_buckets - 1);
+	ent->hash_next = rd->dc_buckets[index];
+	rd->dc_buckets[index] = ent;
+
+	dcache_push_lru(rd, ent);
+	rd->dc_count += 1;
+}
+
+int sqfs_dir_reader_set_cache(sqfs_dir_reader_t *rd, size_t max_entries,
+			      size_t max_blocks)
+{
+	sqfs_meta_cache_t *cache = NULL;
+	size_t count;
+
+	if (max_blocks > 0) {
+		cache = sqfs_meta_cache_create(max_blocks);
+		if (cache == NULL)
+			return SQFS_ERROR_ALLOC;
+	}
+
+	sqfs_meta_reader_set_cache(rd->meta_inode, cache);
+	sqfs_meta_reader_set_cache(rd->meta_dir, cache);
+	sqfs_meta_cache_destroy(rd->blk_cache);
+	rd->blk_cache = cache;
+
+	/* the directory position is lost when changing the block cache */
+	memset(&rd->hdr, 0, sizeof(rd->hdr));
+	rd->size = 0;
+	rd->start_size = 0;
+	rd->entries = 0;
+	rd->idx_count = 0;
+
+	dcache_clear(rd);
+
+	if (max_entries == 0)
+		return 0;
+
+	count = 16;
+	while (count < max_entries && count < (SIZE_MAX / 4))
+		count *= 2;
+
+	rd->dc_buckets = alloc_array(sizeof(rd->dc_buckets[0]), count);
+	if (rd->dc_buckets == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	rd->dc_num_buckets = count;
+	rd->dc_max = max_entries;
+	return 0;
+}
+
+int sqfs_dir_reader_preload(sqfs_dir_reader_t *rd, unsigned int num_workers)
+{
+	const sqfs_super_t *super = rd->super;
+	sqfs_meta_cache_t *cache;
+	sqfs_u64 limit;
+	int ret;
+
+	/* the directory table directly follows the inode table */
+	limit = super->id_table_start;
+
+	if (super->fragment_table_start < limit)
+		limit = super->fragment_table_start;
+
+	if (super->export_table_start < limit)
+		limit = super->export_table_start;
+
+	ret = sqfs_meta_cache_load(&cache, rd->file, rd->cmp,
+				   super->inode_table_start, limit,
+				   num_workers);
+	if (ret)
+		return ret;
+
+	sqfs_meta_reader_set_cache(rd->meta_inode, cache);
+	sqfs_meta_reader_set_cache(rd->meta_dir, cache);
+	sqfs_meta_cache_destroy(rd->blk_cache);
+	rd->blk_cache = cache;
+
+	memset(&rd->hdr, 0, sizeof(rd->hdr));
+	rd->size = 0;
+	rd->start_size = 0;
+	rd->entries = 0;
+	rd->idx_count = 0;
+	return 0;
+}
+
+int sqfs_dir_reader_set_readahead(sqfs_dir_reader_t *rd, size_t count)
+{
+	int ret;
+
+	ret = sqfs_meta_reader_set_readahead(rd->meta_inode, count);
+	if (ret)
+		return ret;
+
+	return sqfs_meta_reader_set_readahead(rd->meta_dir, count);
+}
+
 void sqfs_dir_reader_destroy(sqfs_dir_reader_t *rd)
 {
+	dcache_clear(rd);
 	sqfs_meta_reader_destroy(rd->meta_inode);
 	sqfs_meta_reader_destroy(rd->meta_dir);
+	sqfs_meta_cache_destroy(rd->blk_cache);
+	lazy_table_cleanup(&rd->export_tbl);
+	free(rd->idx_data);
+	free(rd->idx);
+	free(rd->ent);
 	free(rd);
 }
 
+/*
+  Keep a copy of the directory index, since the inode may be gone by the
+  time an entry is looked up. Entries that point outside the listing are
+  dropped, lookups then simply scan further.
+ */
+static int load_index(sqfs_dir_reader_t *rd, const sqfs_inode_generic_t *inode)
+{
+	size_t i, offset, size = inode->num_dir_idx_bytes;
+	sqfs_dir_index_t ent;
+	void *new;
+
+	rd->idx_count = 0;
+
+	if (inode->base.type != SQFS_INODE_EXT_DIR || size == 0)
+		return 0;
+
+	if (size > rd->idx_data_max) {
+		new = realloc(rd->idx_data, size);
+		if (new == NULL)
+			return SQFS_ERROR_ALLOC;
+
+		rd->idx_data = new;
+		rd->idx_data_max = size;
+	}
+
+	memcpy(rd->idx_data, inode->extra, size);
+
+	for (i = 0, offset = 0; i < inode->data.dir_ext.inodex_count; ++i) {
+		if (size - offset < sizeof(ent))
+			break;
+
+		memcpy(&ent, rd->idx_data + offset, sizeof(ent));
+		offset += sizeof(ent);
+
+		if (ent.size >= size - offset)
+			break;
+
+		if (rd->idx_count == rd->idx_max) {
+			new = realloc(rd->idx, sizeof(rd->idx[0]) *
+				      (rd->idx_max ? rd->idx_max * 2 : 16));
+			if (new == NULL)
+				return SQFS_ERROR_ALLOC;
+
+			rd->idx = new;
+			rd->idx_max = rd->idx_max ? rd->idx_max * 2 : 16;
+		}
+
+		if (ent.index < rd->start_size) {
+			rd->idx[rd->idx_count].index = ent.index;
+			rd->idx[rd->idx_count].start_block = ent.start_block;
+			rd->idx[rd->idx_count].name_len = ent.size + 1;
+			rd->idx[rd->idx_count].name = rd->idx_data + offset;
+			rd->idx_count += 1;
+		}
+
+		offset += ent.size + 1;
+	}
+
+	return 0;
+}
+
 int sqfs_dir_reader_open_dir(sqfs_dir_reader_t *rd,
 			     const sqfs_inode_generic_t *inode)
 {
 	sqfs_u64 block_start;
 	size_t size, offset;
+	int err;
 
 	if (inode->base.type == SQFS_INODE_DIR) {
 		size = inode->data.dir.size;
@@ -102,7 +450,9 @@ int sqfs_dir_reader_open_dir(sqfs_dir_reader_t *rd,
 
 	memset(&rd->hdr, 0, sizeof(rd->hdr));
 	rd->size = size;
+	rd->start_size = size;
 	rd->entries = 0;
+	rd->idx_count = 0;
 
 	if (rd->size <= sizeof(rd->hdr))
 		return 0;
@@ -111,15 +461,20 @@ int sqfs_dir_reader_open_dir(sqfs_dir_reader_t *rd,
 
 	rd->dir_block_start = block_start;
 	rd->dir_offset = offset;
-	rd->start_size = size;
+
+	err = load_index(rd, inode);
+	if (err)
+		return err;
 
 	return sqfs_meta_reader_seek(rd->meta_dir, block_start, offset);
 }
 
-int sqfs_dir_reader_read(sqfs_dir_reader_t *rd, sqfs_dir_entry_t **out)
+int sqfs_dir_reader_next(sqfs_dir_reader_t *rd, const sqfs_dir_entry_t **out)
 {
-	sqfs_dir_entry_t *ent;
+	sqfs_u16 *diff_u16;
+	sqfs_dir_entry_t ent;
 	size_t count;
+	void *new;
 	int err;
 
 	if (!rd->entries) {
@@ -134,11 +489,38 @@ int sqfs_dir_reader_read(sqfs_dir_reader_t *rd, sqfs_dir_entry_t **out)
 		rd->entries = rd->hdr.count + 1;
 	}
 
-	err = sqfs_meta_reader_read_dir_ent(rd->meta_dir, &ent);
+	err = sqfs_meta_reader_read(rd->meta_dir, &ent, sizeof(ent));
 	if (err)
 		return err;
 
-	count = sizeof(*ent) + strlen((const char *)ent->name);
+	diff_u16 = (sqfs_u16 *)&ent.inode_diff;
+	*diff_u16 = le16toh(*diff_u16);
+
+	ent.offset = le16toh(ent.offset);
+	ent.type = le16toh(ent.type);
+	ent.size = le16toh(ent.size);
+
+	/* the name is stored off-by-one, plus a null-terminator */
+	if (rd->ent == NULL || (size_t)ent.size + 2 > rd->ent_name_max) {
+		count = ent.size + 2 < 256 ? 256 : ent.size + 2;
+
+		new = realloc(rd->ent, sizeof(ent) + count);
+		if (new == NULL)
+			return SQFS_ERROR_ALLOC;
+
+		rd->ent = new;
+		rd->ent_name_max = count;
+	}
+
+	*(rd->ent) = ent;
+
+	err = sqfs_meta_reader_read(rd->meta_dir, rd->ent->name, ent.size + 1);
+	if (err)
+		return err;
+
+	rd->ent->name[ent.size + 1] = '\0';
+
+	count = sizeof(ent) + strlen((const char *)rd->ent->name);
 
 	if (count > rd->size) {
 		rd->size = 0;
@@ -148,8 +530,28 @@ int sqfs_dir_reader_read(sqfs_dir_reader_t *rd, sqfs_dir_entry_t **out)
 		rd->entries -= 1;
 	}
 
-	rd->inode_offset = ent->offset;
-	*out = ent;
+	rd->inode_offset = ent.offset;
+	*out = rd->ent;
+	return 0;
+}
+
+int sqfs_dir_reader_read(sqfs_dir_reader_t *rd, sqfs_dir_entry_t **out)
+{
+	const sqfs_dir_entry_t *ent;
+	size_t size;
+	int err;
+
+	err = sqfs_dir_reader_next(rd, &ent);
+	if (err)
+		return err;
+
+	size = sizeof(*ent) + ent->size + 2;
+
+	*out = hook_alloc(rd->allocator, size);
+	if (*out == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	memcpy(*out, ent, size);
 	return 0;
 }
 
@@ -163,31 +565,90 @@ int sqfs_dir_reader_rewind(sqfs_dir_reader_t *rd)
 				     rd->dir_offset);
 }
 
-int sqfs_dir_reader_find(sqfs_dir_reader_t *rd, const char *name)
+static int compare_name(const sqfs_u8 *a, size_t a_len,
+			const char *b, size_t b_len)
 {
-	sqfs_dir_entry_t *ent;
-	int ret;
+	int ret = memcmp(a, b, a_len < b_len ? a_len : b_len);
 
-	if (rd->size != rd->start_size) {
-		ret = sqfs_dir_reader_rewind(rd);
-		if (ret)
-			return ret;
+	if (ret == 0 && a_len != b_len)
+		ret = a_len < b_len ? -1 : 1;
+
+	return ret;
+}
+
+/*
+  Position the reader at the header that the entry with the given name has
+  to be in, using a binary search over the directory index if there is one.
+ */
+static int seek_to_name(sqfs_dir_reader_t *rd, const char *name, size_t len)
+{
+	size_t lo = 0, hi = rd->idx_count, mid;
+	const dir_index_t *idx;
+	sqfs_u64 block;
+	size_t offset;
+
+	/* find the last index entry with a name less or equal */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		idx = rd->idx + mid;
+
+		if (compare_name(idx->name, idx->name_len, name, len) > 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	if (lo == 0) {
+		if (rd->size == rd->start_size && rd->entries == 0)
+			return 0;
+
+		return sqfs_dir_reader_rewind(rd);
 	}
 
+	idx = rd->idx + lo - 1;
+	block = rd->super->directory_table_start + idx->start_block;
+	offset = (rd->dir_offset + idx->index) % SQFS_META_BLOCK_SIZE;
+
+	memset(&rd->hdr, 0, sizeof(rd->hdr));
+	rd->size = rd->start_size - idx->index;
+	rd->entries = 0;
+
+	return sqfs_meta_reader_seek(rd->meta_dir, block, offset);
+}
+
+static int find_entry(sqfs_dir_reader_t *rd, const char *name, size_t len)
+{
+	const sqfs_dir_entry_t *ent;
+	int ret;
+
+	ret = seek_to_name(rd, name, len);
+	if (ret)
+		return ret;
+
 	do {
-		ret = sqfs_dir_reader_read(rd, &ent);
+		ret = sqfs_dir_reader_next(rd, &ent);
 		if (ret < 0)
 			return ret;
 		if (ret > 0)
 			return SQFS_ERROR_NO_ENTRY;
 
-		ret = strcmp((const char *)ent->name, name);
-		free(ent);
+		ret = compare_name(ent->name, ent->size + 1, name, len);
 	} while (ret < 0);
 
 	return ret == 0 ? 0 : SQFS_ERROR_NO_ENTRY;
 }
 
+int dir_reader_find_name(sqfs_dir_reader_t *rd, const char *name, size_t len)
+{
+	return find_entry(rd, name, len);
+}
+
+int sqfs_dir_reader_find(sqfs_dir_reader_t *rd, const char *name)
+{
+	return find_entry(rd, name, strlen(name));
+}
+
 int sqfs_dir_reader_get_inode(sqfs_dir_reader_t *rd,
 			      sqfs_inode_generic_t **inode)
 {
@@ -214,13 +675,11 @@ int sqfs_dir_reader_find_by_path(sqfs_dir_reader_t *rd, const char *path,
 				 sqfs_inode_generic_t **out)
 {
 	sqfs_inode_generic_t *inode;
-	sqfs_dir_entry_t *ent;
+	sqfs_u64 ref, child_ref;
 	const char *ptr;
 	int ret;
 
-	ret = sqfs_dir_reader_get_root_inode(rd, &inode);
-	if (ret)
-		return ret;
+	ref = rd->super->root_inode_ref;
 
 	while (*path != '\0') {
 		if (*path == '/' || *path == '\\') {
@@ -229,11 +688,6 @@ int sqfs_dir_reader_find_by_path(sqfs_dir_reader_t *rd, const char *path,
 			continue;
 		}
 
-		ret = sqfs_dir_reader_open_dir(rd, inode);
-		free(inode);
-		if (ret)
-			return ret;
-
 		ptr = strchr(path, '/');
 		if (ptr == NULL) {
 			ptr = strchr(path, '\\');
@@ -244,30 +698,175 @@ int sqfs_dir_reader_find_by_path(sqfs_dir_reader_t *rd, const char *path,
 			}
 		}
 
-		do {
-			ret = sqfs_dir_reader_read(rd, &ent);
-			if (ret < 0)
+		if (!dcache_lookup(rd, ref, path, ptr - path, &child_ref)) {
+			ret = sqfs_meta_reader_read_inode(rd->meta_inode,
+							  rd->super, ref >> 16,
+							  ref & 0xFFFF, &inode);
+			if (ret)
 				return ret;
 
-			if (ret == 0) {
-				ret = strncmp((const char *)ent->name,
-					      path, ptr - path);
-				if (ret == 0)
-					ret = ent->name[ptr - path];
-				free(ent);
-			}
-		} while (ret < 0);
+			ret = sqfs_dir_reader_open_dir(rd, inode);
+			hook_free(rd->allocator, inode);
+			if (ret)
+				return ret;
 
-		if (ret > 0)
-			return SQFS_ERROR_NO_ENTRY;
+			ret = find_entry(rd, path, ptr - path);
+			if (ret)
+				return ret;
 
-		ret = sqfs_dir_reader_get_inode(rd, &inode);
-		if (ret)
-			return ret;
+			child_ref = ((sqfs_u64)rd->hdr.start_block << 16) |
+				rd->inode_offset;
+
+			dcache_insert(rd, ref, path, ptr - path, child_ref);
+		}
 
+		ref = child_ref;
 		path = ptr;
 	}
 
-	*out = inode;
+	return sqfs_meta_reader_read_inode(rd->meta_inode, rd->super,
+					   ref >> 16, ref & 0xFFFF, out);
+}
+
+int sqfs_dir_reader_find_by_index(sqfs_dir_reader_t *rd,
+				  const sqfs_path_index_t *index,
+				  const char *path, sqfs_inode_generic_t **out)
+{
+	sqfs_u64 ref;
+	int ret;
+
+	if (index == NULL)
+		return sqfs_dir_reader_find_by_path(rd, path, out);
+
+	ret = sqfs_path_index_lookup(index, path, &ref);
+	if (ret)
+		return ret;
+
+	return sqfs_meta_reader_read_inode(rd->meta_inode, rd->super,
+					   ref >> 16, ref & 0xFFFF, out);
+}
+
+/*
+  Only the location list is read here. Each meta data block of the table
+  holds the references of 1024 inodes and stays in memory once loaded.
+ */
+static int load_export_table(sqfs_dir_reader_t *rd)
+{
+	const sqfs_super_t *super = rd->super;
+	sqfs_u64 lower, upper;
+	int ret;
+
+	if (!(super->flags & SQFS_FLAG_EXPORTABLE))
+		return SQFS_ERROR_UNSUPPORTED;
+
+	if (super->export_table_start >= super->bytes_used ||
+	    super->inode_count == 0) {
+		return SQFS_ERROR_CORRUPTED;
+	}
+
+	upper = super->export_table_start;
+	lower = super->directory_table_start;
+
+	if (super->fragment_table_start > lower &&
+	    super->fragment_table_start < upper) {
+		lower = super->fragment_table_start;
+	}
+
+	ret = lazy_table_init(&rd->export_tbl, rd->file,
+			      super->inode_count * sizeof(sqfs_u64),
+			      super->export_table_start, lower, upper);
+	if (ret)
+		return ret;
+
+	rd->have_export = true;
 	return 0;
 }
+
+int sqfs_dir_reader_get_inode_ref(sqfs_dir_reader_t *rd, sqfs_u32 number,
+				  sqfs_u64 *out)
+{
+	sqfs_u64 ref;
+	void *ptr;
+	int ret;
+
+	if (!rd->have_export) {
+		ret = load_export_table(rd);
+		if (ret)
+			return ret;
+	}
+
+	if (number < 1 || number > rd->super->inode_count)
+		return SQFS_ERROR_NO_ENTRY;
+
+	ret = lazy_table_get(&rd->export_tbl, rd->file, rd->cmp,
+			     (number - 1) * sizeof(sqfs_u64), &ptr);
+	if (ret)
+		return ret;
+
+	memcpy(&ref, ptr, sizeof(ref));
+	*out = le64toh(ref);
+	return 0;
+}
+
+int sqfs_dir_reader_find_by_number(sqfs_dir_reader_t *rd, sqfs_u32 number,
+				   sqfs_inode_generic_t **out)
+{
+	sqfs_u64 ref;
+	int ret;
+
+	ret = sqfs_dir_reader_get_inode_ref(rd, number, &ref);
+	if (ret)
+		return ret;
+
+	return sqfs_meta_reader_read_inode(rd->meta_inode, rd->super,
+					   ref >> 16, ref & 0xFFFF, out);
+}
+
+void sqfs_dir_reader_set_allocator(sqfs_dir_reader_t *rd,
+				   const sqfs_allocator_t *allocator)
+{
+	rd->allocator = allocator;
+	sqfs_meta_reader_set_allocator(rd->meta_inode, allocator);
+}
+
+const sqfs_allocator_t *
+dir_reader_swap_allocator(sqfs_dir_reader_t *rd,
+			  const sqfs_allocator_t *allocator)
+{
+	const sqfs_allocator_t *old = rd->allocator;
+
+	sqfs_dir_reader_set_allocator(rd, allocator);
+	return old;
+}
+
+void sqfs_dir_reader_set_filter(sqfs_dir_reader_t *rd,
+				sqfs_tree_filter_cb_t cb, void *user)
+{
+	rd->filter = cb;
+	rd->filter_user = user;
+}
+
+int dir_reader_filter_entry(sqfs_dir_reader_t *rd,
+			    const sqfs_tree_node_t *parent,
+			    const sqfs_dir_entry_t *ent)
+{
+	if (rd->filter == NULL)
+		return 0;
+
+	return rd->filter(rd->filter_user, parent, ent);
+}
+
+sqfs_u64 dir_reader_inode_ref(const sqfs_dir_reader_t *rd, bool root)
+{
+	if (root)
+		return rd->super->root_inode_ref;
+
+	return ((sqfs_u64)rd->hdr.start_block << 16) | rd->inode_offset;
+}
+
+int dir_reader_read_inode(sqfs_dir_reader_t *rd, sqfs_u64 ref, bool no_blocks,
+			  sqfs_inode_generic_t **out)
+{
+	return meta_reader_read_inode(rd->meta_inode, rd->super, ref >> 16,
+				      ref & 0xFFFF, no_blocks, out);
+}
@@ -18,6 +18,22 @@
 #include <stdlib.h>
 #include <string.h>
 
+#define ENTRY_CHUNK_SIZE (64 * 1024)
+
+#define ENTRY_ALIGN(x) (((x) + sizeof(sqfs_u64) - 1) & ~(sizeof(sqfs_u64) - 1))
+
+/*
+  The entries and index records of a directory only live until the next one
+  is started. They are carved out of a list of chunks that is rewound, but
+  not freed, when a new directory begins.
+ */
+typedef struct entry_chunk_t {
+	struct entry_chunk_t *next;
+	size_t used;
+	size_t size;
+	sqfs_u64 data[];
+} entry_chunk_t;
+
 typedef struct dir_entry_t {
 	struct dir_entry_t *next;
 	sqfs_u64 inode_ref;
@@ -35,11 +51,18 @@ typedef struct index_ent_t {
 } index_ent_t;
 
 struct sqfs_dir_writer_t {
+	entry_chunk_t *chunks;
+	entry_chunk_t *chunks_end;
+	entry_chunk_t *current;
+
 	dir_entry_t *list;
 	dir_entry_t *list_end;
 
 	index_ent_t *idx;
 	index_ent_t *idx_end;
+	size_t idx_count;
+
+	size_t max_hdr_entries;
 
 	sqfs_u64 dir_ref;
 	size_t dir_size;
@@ -62,25 +85,59 @@ static int get_type(sqfs_u16 mode)
 	return SQFS_ERROR_UNSUPPORTED;
 }
 
-static void writer_reset(sqfs_dir_writer_t *writer)
+static void *writer_alloc(sqfs_dir_writer_t *writer, size_t size)
 {
-	dir_entry_t *ent;
-	index_ent_t *idx;
+	size_t chunk_size;
+	entry_chunk_t *chunk;
+	void *ptr;
+
+	size = ENTRY_ALIGN(size);
 
-	while (writer->idx != NULL) {
-		idx = writer->idx;
-		writer->idx = idx->next;
-		free(idx);
+	while (writer->current != NULL) {
+		chunk = writer->current;
+
+		if ((chunk->size - chunk->used) >= size) {
+			ptr = (sqfs_u8 *)chunk->data + chunk->used;
+			chunk->used += size;
+			return ptr;
+		}
+
+		writer->current = chunk->next;
 	}
 
-	while (writer->list != NULL) {
-		ent = writer->list;
-		writer->list = ent->next;
-		free(ent);
+	chunk_size = size > ENTRY_CHUNK_SIZE ? size : ENTRY_CHUNK_SIZE;
+
+	chunk = alloc_flex(sizeof(*chunk), 1, chunk_size);
+	if (chunk == NULL)
+		return NULL;
+
+	chunk->size = chunk_size;
+	chunk->used = size;
+
+	if (writer->chunks_end == NULL) {
+		writer->chunks = writer->chunks_end = chunk;
+	} else {
+		writer->chunks_end->next = chunk;
+		writer->chunks_end = chunk;
 	}
 
+	writer->current = chunk;
+	return chunk->data;
+}
+
+static void writer_reset(sqfs_dir_writer_t *writer)
+{
+	entry_chunk_t *chunk;
+
+	for (chunk = writer->chunks; chunk != NULL; chunk = chunk->next)
+		chunk->used = 0;
+
+	writer->current = writer->chunks;
+	writer->list = NULL;
 	writer->list_end = NULL;
+	writer->idx = NULL;
 	writer->idx_end = NULL;
+	writer->idx_count = 0;
 	writer->dir_ref = 0;
 	writer->dir_size = 0;
 	writer->ent_count = 0;
@@ -94,12 +151,30 @@ sqfs_dir_writer_t *sqfs_dir_writer_create(sqfs_meta_writer_t *dm)
 		return NULL;
 
 	writer->dm = dm;
+	writer->max_hdr_entries = SQFS_MAX_DIR_ENT;
 	return writer;
 }
 
+int sqfs_dir_writer_set_header_limit(sqfs_dir_writer_t *writer,
+				     size_t max_entries)
+{
+	if (max_entries < 1 || max_entries > SQFS_MAX_DIR_ENT)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	writer->max_hdr_entries = max_entries;
+	return 0;
+}
+
 void sqfs_dir_writer_destroy(sqfs_dir_writer_t *writer)
 {
-	writer_reset(writer);
+	entry_chunk_t *chunk;
+
+	while (writer->chunks != NULL) {
+		chunk = writer->chunks;
+		writer->chunks = chunk->next;
+		free(chunk);
+	}
+
 	free(writer);
 }
 
@@ -122,6 +197,7 @@ int sqfs_dir_writer_add_entry(sqfs_dir_writer_t *writer, const char *name,
 			      sqfs_u32 inode_num, sqfs_u64 inode_ref,
 			      sqfs_u16 mode)
 {
+	size_t len = strlen(name);
 	dir_entry_t *ent;
 	int type;
 
@@ -129,17 +205,18 @@ int sqfs_dir_writer_add_entry(sqfs_dir_writer_t *writer, const char *name,
 	if (type < 0)
 		return type;
 
-	if (name[0] == '\0')
+	if (len == 0)
 		return SQFS_ERROR_CORRUPTED;
 
-	ent = alloc_flex(sizeof(*ent), 1, strlen(name));
+	ent = writer_alloc(writer, sizeof(*ent) + len);
 	if (ent == NULL)
 		return SQFS_ERROR_ALLOC;
 
+	ent->next = NULL;
 	ent->inode_ref = inode_ref;
 	ent->inode_num = inode_num;
 	ent->type = type;
-	ent->name_len = strlen(name);
+	ent->name_len = len;
 	memcpy(ent->name, name, ent->name_len);
 
 	if (writer->list_end == NULL) {
@@ -153,7 +230,8 @@ int sqfs_dir_writer_add_entry(sqfs_dir_writer_t *writer, const char *name,
 	return 0;
 }
 
-static size_t get_conseq_entry_count(sqfs_u32 offset, dir_entry_t *head)
+static size_t get_conseq_entry_count(sqfs_u32 offset, dir_entry_t *head,
+				     size_t max_entries)
 {
 	size_t size, count = 0;
 	dir_entry_t *it;
@@ -177,7 +255,7 @@ static size_t get_conseq_entry_count(sqfs_u32 offset, dir_entry_t *head)
 
 		count += 1;
 
-		if (count == SQFS_MAX_DIR_ENT)
+		if (count == max_entries)
 			break;
 	}
 
@@ -199,10 +277,11 @@ static int add_header(sqfs_dir_writer_t *writer, size_t count,
 	if (err)
 		return err;
 
-	idx = calloc(1, sizeof(*idx));
+	idx = writer_alloc(writer, sizeof(*idx));
 	if (idx == NULL)
 		return SQFS_ERROR_ALLOC;
 
+	idx->next = NULL;
 	idx->ent = ref;
 	idx->block = block;
 	idx->index = writer->dir_size;
@@ -214,6 +293,7 @@ static int add_header(sqfs_dir_writer_t *writer, size_t count,
 		writer->idx_end = idx;
 	}
 
+	writer->idx_count += 1;
 	writer->dir_size += sizeof(hdr);
 	return 0;
 }
@@ -230,7 +310,8 @@ int sqfs_dir_writer_end(sqfs_dir_writer_t *writer)
 
 	for (it = writer->list; it != NULL; ) {
 		sqfs_meta_writer_get_position(writer->dm, &block, &offset);
-		count = get_conseq_entry_count(offset, it);
+		count = get_conseq_entry_count(offset, it,
+					       writer->max_hdr_entries);
 
 		err = add_header(writer, count, it, block);
 		if (err)
@@ -275,13 +356,30 @@ sqfs_u64 sqfs_dir_writer_get_dir_reference(const sqfs_dir_writer_t *writer)
 	return writer->dir_ref;
 }
 
+/*
+  Every header gets an index entry, but the inode can only hold 65535 of
+  them. If there are more, only every n-th header is indexed and lookups
+  scan a little further from where the index lands.
+ */
+static size_t get_index_stride(const sqfs_dir_writer_t *writer)
+{
+	if (writer->idx_count <= 0xFFFF)
+		return 1;
+
+	return (writer->idx_count + 0xFFFE) / 0xFFFF;
+}
+
 size_t sqfs_dir_writer_get_index_size(const sqfs_dir_writer_t *writer)
 {
-	size_t index_size = 0;
+	size_t i = 0, index_size = 0, stride = get_index_stride(writer);
 	index_ent_t *idx;
 
-	for (idx = writer->idx; idx != NULL; idx = idx->next)
-		index_size += sizeof(sqfs_dir_index_t) + idx->ent->name_len;
+	for (idx = writer->idx; idx != NULL; idx = idx->next) {
+		if ((i++ % stride) == 0) {
+			index_size += sizeof(sqfs_dir_index_t);
+			index_size += idx->ent->name_len;
+		}
+	}
 
 	return index_size;
 }
@@ -296,18 +394,15 @@ sqfs_inode_generic_t
 			      size_t hlinks, sqfs_u32 xattr,
 			      sqfs_u32 parent_ino)
 {
+	size_t i, index_size, stride = get_index_stride(writer);
 	sqfs_inode_generic_t *inode;
 	sqfs_dir_index_t ent;
 	sqfs_u64 start_block;
 	sqfs_u16 block_offset;
-	size_t index_size;
 	index_ent_t *idx;
 	sqfs_u8 *ptr;
 
-	index_size = 0;
-
-	for (idx = writer->idx; idx != NULL; idx = idx->next)
-		index_size += sizeof(ent) + idx->ent->name_len;
+	index_size = sqfs_dir_writer_get_index_size(writer);
 
 	inode = alloc_flex(sizeof(*inode), 1, index_size);
 	if (inode == NULL)
@@ -339,7 +434,11 @@ sqfs_inode_generic_t
 		inode->data.dir_ext.inodex_count = 0;
 		inode->num_dir_idx_bytes = 0;
 
-		for (idx = writer->idx; idx != NULL; idx = idx->next) {
+		for (i = 0, idx = writer->idx; idx != NULL;
+		     idx = idx->next, ++i) {
+			if ((i % stride) != 0)
+				continue;
+
 			memset(&ent, 0, sizeof(ent));
 			ent.start_block = idx->block;
 			ent.index = idx->index;
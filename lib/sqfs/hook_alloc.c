@@ -0,0 +1,84 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * hook_alloc.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#define SQFS_BUILDING_DLL
+#include "config.h"
+
+#include "sqfs/compressor.h"
+#include "util/util.h"
+#include "hook_alloc.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+void *hook_alloc(const sqfs_allocator_t *alloc, size_t size)
+{
+	if (alloc == NULL)
+		return malloc(size);
+
+	return alloc->alloc(alloc->user, size);
+}
+
+void *hook_calloc(const sqfs_allocator_t *alloc, size_t size)
+{
+	void *ptr;
+
+	if (alloc == NULL)
+		return calloc(1, size);
+
+	ptr = alloc->alloc(alloc->user, size);
+	if (ptr != NULL)
+		memset(ptr, 0, size);
+
+	return ptr;
+}
+
+void *hook_alloc_flex(const sqfs_allocator_t *alloc, size_t base_size,
+		      size_t item_size, size_t nmemb)
+{
+	size_t size;
+
+	if (SZ_MUL_OV(nmemb, item_size, &size) ||
+	    SZ_ADD_OV(base_size, size, &size)) {
+		errno = EOVERFLOW;
+		return NULL;
+	}
+
+	return hook_calloc(alloc, size);
+}
+
+void *hook_realloc(const sqfs_allocator_t *alloc, void *ptr,
+		   size_t old_size, size_t new_size)
+{
+	void *new;
+
+	if (alloc == NULL)
+		return realloc(ptr, new_size);
+
+	new = alloc->alloc(alloc->user, new_size);
+	if (new == NULL)
+		return NULL;
+
+	if (ptr != NULL) {
+		memcpy(new, ptr, old_size < new_size ? old_size : new_size);
+		alloc->free(alloc->user, ptr);
+	}
+
+	return new;
+}
+
+void hook_free(const sqfs_allocator_t *alloc, void *ptr)
+{
+	if (ptr == NULL)
+		return;
+
+	if (alloc == NULL) {
+		free(ptr);
+	} else {
+		alloc->free(alloc->user, ptr);
+	}
+}
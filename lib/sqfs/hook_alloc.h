@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * hook_alloc.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef HOOK_ALLOC_H
+#define HOOK_ALLOC_H
+
+#include "config.h"
+
+#include "sqfs/predef.h"
+
+/*
+  Wrappers that allocate through a user supplied sqfs_allocator_t, or the
+  standard library if it is NULL. Memory must be released through the same
+  allocator it was obtained from.
+
+  Like the functions in util.h, hook_alloc_flex returns zero initialized
+  memory and sets errno to EOVERFLOW if the size calculation overflows.
+ */
+SQFS_INTERNAL void *hook_alloc(const sqfs_allocator_t *alloc, size_t size);
+
+SQFS_INTERNAL void *hook_calloc(const sqfs_allocator_t *alloc, size_t size);
+
+SQFS_INTERNAL void *hook_alloc_flex(const sqfs_allocator_t *alloc,
+				    size_t base_size, size_t item_size,
+				    size_t nmemb);
+
+/* The allocator has no realloc hook, so the old size must be known. */
+SQFS_INTERNAL void *hook_realloc(const sqfs_allocator_t *alloc, void *ptr,
+				 size_t old_size, size_t new_size);
+
+SQFS_INTERNAL void hook_free(const sqfs_allocator_t *alloc, void *ptr);
+
+#endif /* HOOK_ALLOC_H */
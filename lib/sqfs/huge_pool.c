@@ -0,0 +1,206 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * huge_pool.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#define SQFS_BUILDING_DLL
+#include "config.h"
+
+#include "sqfs/compressor.h"
+#include "huge_pool.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef WITH_PTHREAD
+#include <pthread.h>
+#endif
+
+/* slots are rounded up to this, which keeps them cache line aligned */
+#define SLOT_ALIGN (64)
+
+typedef struct chunk_t {
+	struct chunk_t *next;
+	sqfs_u8 *data;
+} chunk_t;
+
+typedef struct free_slot_t {
+	struct free_slot_t *next;
+} free_slot_t;
+
+struct huge_pool_t {
+	sqfs_allocator_t alloc;
+
+#ifdef WITH_PTHREAD
+	pthread_mutex_t mtx;
+#endif
+
+	size_t slot_size;
+	size_t chunk_size;
+
+	chunk_t *chunks;
+	free_slot_t *free_list;
+};
+
+static void pool_lock(huge_pool_t *pool)
+{
+#ifdef WITH_PTHREAD
+	pthread_mutex_lock(&pool->mtx);
+#else
+	(void)pool;
+#endif
+}
+
+static void pool_unlock(huge_pool_t *pool)
+{
+#ifdef WITH_PTHREAD
+	pthread_mutex_unlock(&pool->mtx);
+#else
+	(void)pool;
+#endif
+}
+
+static void *hook_pool_alloc(void *user, size_t size)
+{
+	return huge_pool_alloc(user, size);
+}
+
+static void hook_pool_free(void *user, void *ptr)
+{
+	huge_pool_free(user, ptr);
+}
+
+static int add_chunk(huge_pool_t *pool)
+{
+	free_slot_t *slot;
+	chunk_t *chunk;
+	size_t i;
+
+	chunk = calloc(1, sizeof(*chunk));
+	if (chunk == NULL)
+		return -1;
+
+	chunk->data = huge_page_map(pool->chunk_size);
+	if (chunk->data == NULL) {
+		free(chunk);
+		return -1;
+	}
+
+	/* in reverse, so slots are handed out in address order */
+	for (i = pool->chunk_size / pool->slot_size; i > 0; --i) {
+		slot = (free_slot_t *)(chunk->data + (i - 1) * pool->slot_size);
+		slot->next = pool->free_list;
+		pool->free_list = slot;
+	}
+
+	chunk->next = pool->chunks;
+	pool->chunks = chunk;
+	return 0;
+}
+
+static bool in_pool(const huge_pool_t *pool, const void *ptr)
+{
+	const chunk_t *it;
+	uintptr_t addr = (uintptr_t)ptr, start;
+
+	for (it = pool->chunks; it != NULL; it = it->next) {
+		start = (uintptr_t)it->data;
+
+		if (addr >= start && addr - start < pool->chunk_size)
+			return true;
+	}
+
+	return false;
+}
+
+huge_pool_t *huge_pool_create(size_t slot_size)
+{
+	huge_pool_t *pool;
+	size_t chunk_size;
+
+	if (slot_size == 0 || slot_size > SIZE_MAX / (2 * HUGE_POOL_MIN_SLOTS))
+		return NULL;
+
+	slot_size = (slot_size + SLOT_ALIGN - 1) & ~((size_t)SLOT_ALIGN - 1);
+	chunk_size = slot_size * HUGE_POOL_MIN_SLOTS;
+	chunk_size = (chunk_size + HUGE_PAGE_SIZE - 1) &
+		~((size_t)HUGE_PAGE_SIZE - 1);
+
+	pool = calloc(1, sizeof(*pool));
+	if (pool == NULL)
+		return NULL;
+
+#ifdef WITH_PTHREAD
+	pool->mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+#endif
+	pool->slot_size = slot_size;
+	pool->chunk_size = chunk_size;
+	pool->alloc.alloc = hook_pool_alloc;
+	pool->alloc.free = hook_pool_free;
+	pool->alloc.user = pool;
+	return pool;
+}
+
+void huge_pool_destroy(huge_pool_t *pool)
+{
+	chunk_t *it;
+
+	if (pool == NULL)
+		return;
+
+	while (pool->chunks != NULL) {
+		it = pool->chunks;
+		pool->chunks = it->next;
+
+		huge_page_unmap(it->data, pool->chunk_size);
+		free(it);
+	}
+
+#ifdef WITH_PTHREAD
+	pthread_mutex_destroy(&pool->mtx);
+#endif
+	free(pool);
+}
+
+void *huge_pool_alloc(huge_pool_t *pool, size_t size)
+{
+	free_slot_t *slot = NULL;
+
+	if (size > pool->slot_size || size <= pool->slot_size / 2)
+		return malloc(size);
+
+	pool_lock(pool);
+	if (pool->free_list != NULL || add_chunk(pool) == 0) {
+		slot = pool->free_list;
+		pool->free_list = slot->next;
+	}
+	pool_unlock(pool);
+
+	/* if no chunk could be mapped, still serve it, just slower */
+	return slot != NULL ? (void *)slot : malloc(size);
+}
+
+void huge_pool_free(huge_pool_t *pool, void *ptr)
+{
+	free_slot_t *slot = ptr;
+
+	if (ptr == NULL)
+		return;
+
+	pool_lock(pool);
+	if (in_pool(pool, ptr)) {
+		slot->next = pool->free_list;
+		pool->free_list = slot;
+		ptr = NULL;
+	}
+	pool_unlock(pool);
+
+	free(ptr);
+}
+
+const sqfs_allocator_t *huge_pool_allocator(huge_pool_t *pool)
+{
+	return &pool->alloc;
+}
@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * huge_pool.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef HUGE_POOL_H
+#define HUGE_POOL_H
+
+#include "config.h"
+
+#include "sqfs/predef.h"
+
+/* chunks of a pool are multiples of this and aligned to it */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* a chunk holds at least this many slots */
+#define HUGE_POOL_MIN_SLOTS (8)
+
+/*
+  A thread safe pool of fixed size slots, carved out of large chunks that
+  are backed by huge pages where the system allows it. Used for the block
+  sized buffers of the data writer and reader, which are otherwise spread
+  over many small pages and cause a lot of TLB misses when compressing.
+
+  Requests that are larger than a slot or smaller than half of one are
+  passed on to malloc, and free accepts either kind, so the pool can be
+  installed as an allocator for buffers that are not all of the same size.
+  Chunks are only released when the pool is destroyed.
+ */
+typedef struct huge_pool_t huge_pool_t;
+
+SQFS_INTERNAL huge_pool_t *huge_pool_create(size_t slot_size);
+
+SQFS_INTERNAL void huge_pool_destroy(huge_pool_t *pool);
+
+SQFS_INTERNAL void *huge_pool_alloc(huge_pool_t *pool, size_t size);
+
+SQFS_INTERNAL void huge_pool_free(huge_pool_t *pool, void *ptr);
+
+/* Allocator hooks that forward to the pool, valid until it is destroyed. */
+SQFS_INTERNAL const sqfs_allocator_t *huge_pool_allocator(huge_pool_t *pool);
+
+/*
+  Implemented per platform. Map a chunk of size bytes, which is a multiple
+  of HUGE_PAGE_SIZE, preferably backed by huge pages. Returns NULL on
+  failure.
+ */
+SQFS_INTERNAL void *huge_page_map(size_t size);
+
+SQFS_INTERNAL void huge_page_unmap(void *ptr, size_t size);
+
+#endif /* HUGE_POOL_H */
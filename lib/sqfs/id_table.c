@@ -11,43 +11,194 @@
 #include "sqfs/super.h"
 #include "sqfs/table.h"
 #include "sqfs/error.h"
+#include "sqfs/block.h"
 #include "util/compat.h"
+#include "util/util.h"
+#include "lazy_table.h"
 
 #include <stdlib.h>
 #include <string.h>
 
+#define ID_HASH_INITIAL_SLOTS 64
+
 struct sqfs_id_table_t {
 	sqfs_u32 *ids;
 	size_t num_ids;
 	size_t max_ids;
+
+	/* open addressing hash table over the ids array, each slot
+	   holds an array index + 1, or 0 if it is unused */
+	sqfs_u32 *slots;
+	size_t num_slots;
+
+	/* set if read lazily and not completely loaded yet */
+	bool is_lazy;
+	lazy_table_t lazy;
+	sqfs_file_t *file;
+	sqfs_compressor_t *cmp;
 };
 
+static size_t id_hash(sqfs_u32 id, size_t num_slots)
+{
+	sqfs_u32 hash = id * 0x9E3779B1U;
+
+	hash ^= hash >> 15;
+	return hash & (num_slots - 1);
+}
+
+static sqfs_u32 *find_slot(const sqfs_id_table_t *tbl, sqfs_u32 id)
+{
+	size_t i = id_hash(id, tbl->num_slots);
+
+	while (tbl->slots[i] != 0 && tbl->ids[tbl->slots[i] - 1] != id)
+		i = (i + 1) & (tbl->num_slots - 1);
+
+	return tbl->slots + i;
+}
+
+static int rebuild_index(sqfs_id_table_t *tbl, size_t num_slots)
+{
+	sqfs_u32 *new = alloc_array(sizeof(new[0]), num_slots);
+	size_t i;
+
+	if (new == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	free(tbl->slots);
+	tbl->slots = new;
+	tbl->num_slots = num_slots;
+
+	for (i = 0; i < tbl->num_ids; ++i)
+		*find_slot(tbl, tbl->ids[i]) = i + 1;
+
+	return 0;
+}
+
 sqfs_id_table_t *sqfs_id_table_create(void)
 {
-	return calloc(1, sizeof(sqfs_id_table_t));
+	sqfs_id_table_t *tbl = calloc(1, sizeof(sqfs_id_table_t));
+
+	if (tbl == NULL)
+		return NULL;
+
+	if (rebuild_index(tbl, ID_HASH_INITIAL_SLOTS)) {
+		free(tbl);
+		return NULL;
+	}
+
+	return tbl;
 }
 
 void sqfs_id_table_destroy(sqfs_id_table_t *tbl)
 {
+	if (tbl->is_lazy)
+		lazy_table_cleanup(&tbl->lazy);
+
+	free(tbl->slots);
 	free(tbl->ids);
 	free(tbl);
 }
 
-int sqfs_id_table_id_to_index(sqfs_id_table_t *tbl, sqfs_u32 id, sqfs_u16 *out)
+static void reset_table(sqfs_id_table_t *tbl)
+{
+	if (tbl->is_lazy) {
+		lazy_table_cleanup(&tbl->lazy);
+		tbl->is_lazy = false;
+	}
+
+	if (tbl->ids != NULL) {
+		free(tbl->ids);
+		tbl->ids = NULL;
+
+		memset(tbl->slots, 0, sizeof(tbl->slots[0]) * tbl->num_slots);
+	}
+
+	tbl->num_ids = 0;
+	tbl->max_ids = 0;
+}
+
+static int set_ids(sqfs_id_table_t *tbl, sqfs_u32 *ids, size_t count)
 {
-	size_t i, sz;
+	size_t i, num_slots;
+
+	tbl->ids = ids;
+	tbl->num_ids = count;
+	tbl->max_ids = count;
+
+	for (i = 0; i < tbl->num_ids; ++i)
+		tbl->ids[i] = le32toh(tbl->ids[i]);
+
+	num_slots = ID_HASH_INITIAL_SLOTS;
+	while (num_slots < tbl->num_ids * 2)
+		num_slots *= 2;
+
+	return rebuild_index(tbl, num_slots);
+}
+
+/* load the remaining blocks of a lazily read table */
+static int load_all(sqfs_id_table_t *tbl)
+{
+	size_t i, diff, count, size = tbl->num_ids * sizeof(sqfs_u32);
+	sqfs_u8 *ids;
 	void *ptr;
+	int ret;
+
+	if (!tbl->is_lazy)
+		return 0;
 
-	for (i = 0; i < tbl->num_ids; ++i) {
-		if (tbl->ids[i] == id) {
-			*out = i;
-			return 0;
+	ids = malloc(size);
+	if (ids == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	for (i = 0; i < size; i += diff) {
+		ret = lazy_table_get(&tbl->lazy, tbl->file, tbl->cmp, i, &ptr);
+		if (ret) {
+			free(ids);
+			return ret;
 		}
+
+		diff = size - i;
+		if (diff > SQFS_META_BLOCK_SIZE)
+			diff = SQFS_META_BLOCK_SIZE;
+
+		memcpy(ids + i, ptr, diff);
+	}
+
+	count = tbl->num_ids;
+	reset_table(tbl);
+	return set_ids(tbl, (sqfs_u32 *)ids, count);
+}
+
+int sqfs_id_table_id_to_index(sqfs_id_table_t *tbl, sqfs_u32 id, sqfs_u16 *out)
+{
+	sqfs_u32 *slot;
+	size_t sz;
+	void *ptr;
+	int ret;
+
+	ret = load_all(tbl);
+	if (ret)
+		return ret;
+
+	slot = find_slot(tbl, id);
+
+	if (*slot != 0) {
+		*out = *slot - 1;
+		return 0;
 	}
 
 	if (tbl->num_ids == 0x10000)
 		return SQFS_ERROR_OVERFLOW;
 
+	/* keep the hash table at most half full */
+	if ((tbl->num_ids + 1) * 2 > tbl->num_slots) {
+		ret = rebuild_index(tbl, tbl->num_slots * 2);
+		if (ret)
+			return ret;
+
+		slot = find_slot(tbl, id);
+	}
+
 	if (tbl->num_ids == tbl->max_ids) {
 		sz = (tbl->max_ids ? tbl->max_ids * 2 : 16);
 		ptr = realloc(tbl->ids, sizeof(tbl->ids[0]) * sz);
@@ -61,63 +212,122 @@ int sqfs_id_table_id_to_index(sqfs_id_table_t *tbl, sqfs_u32 id, sqfs_u16 *out)
 
 	*out = tbl->num_ids;
 	tbl->ids[tbl->num_ids++] = id;
+	*slot = tbl->num_ids;
 	return 0;
 }
 
-int sqfs_id_table_index_to_id(const sqfs_id_table_t *tbl, sqfs_u16 index,
-			      sqfs_u32 *out)
+int sqfs_id_table_ids_to_indices(sqfs_id_table_t *tbl, const sqfs_u32 *ids,
+				 sqfs_u16 *out, size_t count)
 {
-	if (index >= tbl->num_ids)
-		return SQFS_ERROR_OUT_OF_BOUNDS;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < count; ++i) {
+		if (i > 0 && ids[i] == ids[i - 1]) {
+			out[i] = out[i - 1];
+			continue;
+		}
+
+		ret = sqfs_id_table_id_to_index(tbl, ids[i], out + i);
+		if (ret)
+			return ret;
+	}
 
-	*out = tbl->ids[index];
 	return 0;
 }
 
-int sqfs_id_table_read(sqfs_id_table_t *tbl, sqfs_file_t *file,
-		       const sqfs_super_t *super, sqfs_compressor_t *cmp)
+int sqfs_id_table_index_to_id(const sqfs_id_table_t *tbl, sqfs_u16 index,
+			      sqfs_u32 *out)
 {
-	sqfs_u64 upper_limit, lower_limit;
-	void *raw_ids;
-	size_t i;
+	sqfs_id_table_t *mtbl = (sqfs_id_table_t *)tbl;
+	sqfs_u32 id;
+	void *ptr;
 	int ret;
 
-	if (tbl->ids != NULL) {
-		free(tbl->ids);
-		tbl->num_ids = 0;
-		tbl->max_ids = 0;
-		tbl->ids = NULL;
+	if (index >= tbl->num_ids)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	if (!tbl->is_lazy) {
+		*out = tbl->ids[index];
+		return 0;
 	}
 
+	ret = lazy_table_get(&mtbl->lazy, mtbl->file, mtbl->cmp,
+			     index * sizeof(id), &ptr);
+	if (ret)
+		return ret;
+
+	memcpy(&id, ptr, sizeof(id));
+	*out = le32toh(id);
+	return 0;
+}
+
+static int get_limits(const sqfs_super_t *super, sqfs_u64 *lower,
+		      sqfs_u64 *upper)
+{
 	if (!super->id_count || super->id_table_start >= super->bytes_used)
 		return SQFS_ERROR_CORRUPTED;
 
-	upper_limit = super->id_table_start;
-	lower_limit = super->directory_table_start;
+	*upper = super->id_table_start;
+	*lower = super->directory_table_start;
 
-	if (super->fragment_table_start > lower_limit &&
-	    super->fragment_table_start < upper_limit) {
-		lower_limit = super->fragment_table_start;
+	if (super->fragment_table_start > *lower &&
+	    super->fragment_table_start < *upper) {
+		*lower = super->fragment_table_start;
 	}
 
-	if (super->export_table_start > lower_limit &&
-	    super->export_table_start < upper_limit) {
-		lower_limit = super->export_table_start;
+	if (super->export_table_start > *lower &&
+	    super->export_table_start < *upper) {
+		*lower = super->export_table_start;
 	}
 
-	tbl->num_ids = super->id_count;
-	tbl->max_ids = super->id_count;
-	ret = sqfs_read_table(file, cmp, tbl->num_ids * sizeof(sqfs_u32),
+	return 0;
+}
+
+int sqfs_id_table_read(sqfs_id_table_t *tbl, sqfs_file_t *file,
+		       const sqfs_super_t *super, sqfs_compressor_t *cmp)
+{
+	sqfs_u64 upper_limit, lower_limit;
+	void *raw_ids;
+	int ret;
+
+	reset_table(tbl);
+
+	ret = get_limits(super, &lower_limit, &upper_limit);
+	if (ret)
+		return ret;
+
+	ret = sqfs_read_table(file, cmp, super->id_count * sizeof(sqfs_u32),
 			      super->id_table_start, lower_limit,
 			      upper_limit, &raw_ids);
 	if (ret)
 		return ret;
 
-	tbl->ids = raw_ids;
+	return set_ids(tbl, raw_ids, super->id_count);
+}
 
-	for (i = 0; i < tbl->num_ids; ++i)
-		tbl->ids[i] = le32toh(tbl->ids[i]);
+int sqfs_id_table_read_lazy(sqfs_id_table_t *tbl, sqfs_file_t *file,
+			    const sqfs_super_t *super, sqfs_compressor_t *cmp)
+{
+	sqfs_u64 upper_limit, lower_limit;
+	int ret;
+
+	reset_table(tbl);
+
+	ret = get_limits(super, &lower_limit, &upper_limit);
+	if (ret)
+		return ret;
+
+	ret = lazy_table_init(&tbl->lazy, file,
+			      super->id_count * sizeof(sqfs_u32),
+			      super->id_table_start, lower_limit, upper_limit);
+	if (ret)
+		return ret;
 
+	tbl->is_lazy = true;
+	tbl->num_ids = super->id_count;
+	tbl->file = file;
+	tbl->cmp = cmp;
 	return 0;
 }
 
@@ -128,6 +338,10 @@ int sqfs_id_table_write(sqfs_id_table_t *tbl, sqfs_file_t *file,
 	size_t i;
 	int ret;
 
+	ret = load_all(tbl);
+	if (ret)
+		return ret;
+
 	for (i = 0; i < tbl->num_ids; ++i)
 		tbl->ids[i] = htole32(tbl->ids[i]);
 
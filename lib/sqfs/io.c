@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * io.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#define SQFS_BUILDING_DLL
+#include "config.h"
+
+#include "sqfs/error.h"
+#include "sqfs/io.h"
+
+int sqfs_file_flush(sqfs_file_t *file, sqfs_u32 flags)
+{
+	if (flags & ~SQFS_FILE_FLUSH_ALL_FLAGS)
+		return SQFS_ERROR_UNSUPPORTED;
+
+	if (file->flush == NULL)
+		return 0;
+
+	return file->flush(file, flags);
+}
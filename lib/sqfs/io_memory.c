@@ -0,0 +1,228 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * io_memory.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#define SQFS_BUILDING_DLL
+#include "config.h"
+
+#include "sqfs/error.h"
+#include "sqfs/io.h"
+#include "util/util.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* initial capacity of a growable memory file without a size hint */
+#define MEM_FILE_MIN_SIZE (64 * 1024)
+
+typedef struct {
+	sqfs_file_t base;
+
+	/* owned if writable, borrowed from the caller if read only */
+	sqfs_u8 *data;
+	size_t size;
+	size_t max;
+	bool owned;
+} sqfs_file_mem_t;
+
+static void mem_destroy(sqfs_file_t *base)
+{
+	sqfs_file_mem_t *file = (sqfs_file_mem_t *)base;
+
+	if (file->owned)
+		free(file->data);
+
+	free(file);
+}
+
+static int mem_map_at(sqfs_file_t *base, sqfs_u64 offset, size_t size,
+		      const void **out)
+{
+	sqfs_file_mem_t *file = (sqfs_file_mem_t *)base;
+
+	if (offset > file->size || size > file->size - offset)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	*out = file->data + offset;
+	return 0;
+}
+
+static int mem_read_at(sqfs_file_t *base, sqfs_u64 offset,
+		       void *buffer, size_t size)
+{
+	const void *ptr;
+	int ret;
+
+	ret = mem_map_at(base, offset, size, &ptr);
+	if (ret)
+		return ret;
+
+	if (size > 0)
+		memcpy(buffer, ptr, size);
+	return 0;
+}
+
+static int mem_reserve(sqfs_file_mem_t *file, sqfs_u64 size)
+{
+	size_t new_sz = file->max ? file->max : MEM_FILE_MIN_SIZE;
+	sqfs_u8 *new;
+
+	if (size > SIZE_MAX)
+		return SQFS_ERROR_ALLOC;
+
+	if (size <= file->max)
+		return 0;
+
+	while (new_sz < size) {
+		if (SZ_MUL_OV(new_sz, 2, &new_sz))
+			return SQFS_ERROR_ALLOC;
+	}
+
+	new = realloc(file->data, new_sz);
+	if (new == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	file->data = new;
+	file->max = new_sz;
+	return 0;
+}
+
+static int mem_truncate(sqfs_file_t *base, sqfs_u64 size)
+{
+	sqfs_file_mem_t *file = (sqfs_file_mem_t *)base;
+	int ret;
+
+	if (size > file->size) {
+		ret = mem_reserve(file, size);
+		if (ret)
+			return ret;
+
+		memset(file->data + file->size, 0, size - file->size);
+	}
+
+	file->size = size;
+	return 0;
+}
+
+static int mem_write_at(sqfs_file_t *base, sqfs_u64 offset,
+			const void *buffer, size_t size)
+{
+	sqfs_file_mem_t *file = (sqfs_file_mem_t *)base;
+	sqfs_u64 end = offset + size;
+	int ret;
+
+	if (end < offset)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	if (end > file->size) {
+		ret = mem_reserve(file, end);
+		if (ret)
+			return ret;
+
+		if (offset > file->size)
+			memset(file->data + file->size, 0, offset - file->size);
+
+		file->size = end;
+	}
+
+	if (size > 0)
+		memcpy(file->data + offset, buffer, size);
+	return 0;
+}
+
+static int mem_write_fail(sqfs_file_t *base, sqfs_u64 offset,
+			  const void *buffer, size_t size)
+{
+	(void)base; (void)offset; (void)buffer; (void)size;
+	return SQFS_ERROR_IO;
+}
+
+static int mem_truncate_fail(sqfs_file_t *base, sqfs_u64 size)
+{
+	(void)base; (void)size;
+	return SQFS_ERROR_IO;
+}
+
+static sqfs_u64 mem_get_size(const sqfs_file_t *base)
+{
+	return ((const sqfs_file_mem_t *)base)->size;
+}
+
+static sqfs_file_mem_t *mem_file_create(void)
+{
+	sqfs_file_mem_t *file = calloc(1, sizeof(*file));
+	sqfs_file_t *base = (sqfs_file_t *)file;
+
+	if (file == NULL)
+		return NULL;
+
+	base->destroy = mem_destroy;
+	base->read_at = mem_read_at;
+	base->get_size = mem_get_size;
+	return file;
+}
+
+sqfs_file_t *sqfs_open_memory(const void *data, size_t size)
+{
+	sqfs_file_mem_t *file;
+	sqfs_file_t *base;
+
+	if (data == NULL && size > 0)
+		return NULL;
+
+	file = mem_file_create();
+	base = (sqfs_file_t *)file;
+	if (file == NULL)
+		return NULL;
+
+	/* never written to, see mem_write_fail and mem_truncate_fail */
+	file->data = (sqfs_u8 *)data;
+	file->size = size;
+	file->max = size;
+
+	base->write_at = mem_write_fail;
+	base->truncate = mem_truncate_fail;
+	base->map_at = mem_map_at;
+	return base;
+}
+
+sqfs_file_t *sqfs_create_memory_file(size_t size_hint)
+{
+	sqfs_file_mem_t *file = mem_file_create();
+	sqfs_file_t *base = (sqfs_file_t *)file;
+
+	if (file == NULL)
+		return NULL;
+
+	if (size_hint > 0) {
+		file->data = malloc(size_hint);
+		if (file->data == NULL) {
+			free(file);
+			return NULL;
+		}
+
+		file->max = size_hint;
+	}
+
+	file->owned = true;
+	base->write_at = mem_write_at;
+	base->truncate = mem_truncate;
+	return base;
+}
+
+int sqfs_memory_file_get_data(const sqfs_file_t *base, const void **data,
+			      size_t *size)
+{
+	const sqfs_file_mem_t *file = (const sqfs_file_mem_t *)base;
+
+	if (base->destroy != mem_destroy)
+		return SQFS_ERROR_UNSUPPORTED;
+
+	*data = file->data;
+	*size = file->size;
+	return 0;
+}
@@ -0,0 +1,166 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * lazy_table.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#define SQFS_BUILDING_DLL
+#include "lazy_table.h"
+
+#include "sqfs/compressor.h"
+#include "sqfs/error.h"
+#include "sqfs/block.h"
+#include "sqfs/io.h"
+#include "util/util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int lazy_table_init(lazy_table_t *tbl, sqfs_file_t *file,
+		    size_t table_size, sqfs_u64 location,
+		    sqfs_u64 lower_limit, sqfs_u64 upper_limit)
+{
+	size_t i;
+	int ret;
+
+	memset(tbl, 0, sizeof(*tbl));
+
+	tbl->num_blocks = table_size / SQFS_META_BLOCK_SIZE;
+	if ((table_size % SQFS_META_BLOCK_SIZE) != 0)
+		++tbl->num_blocks;
+
+	tbl->locations = alloc_array(sizeof(tbl->locations[0]),
+				     tbl->num_blocks);
+	tbl->blocks = alloc_array(sizeof(tbl->blocks[0]), tbl->num_blocks);
+
+	if (tbl->locations == NULL || tbl->blocks == NULL) {
+		ret = SQFS_ERROR_ALLOC;
+		goto fail;
+	}
+
+	ret = file->read_at(file, location, tbl->locations,
+			    sizeof(tbl->locations[0]) * tbl->num_blocks);
+	if (ret)
+		goto fail;
+
+	for (i = 0; i < tbl->num_blocks; ++i) {
+		tbl->locations[i] = le64toh(tbl->locations[i]);
+
+		if (tbl->locations[i] < lower_limit ||
+		    tbl->locations[i] >= upper_limit) {
+			ret = SQFS_ERROR_OUT_OF_BOUNDS;
+			goto fail;
+		}
+	}
+
+	tbl->table_size = table_size;
+	tbl->lower_limit = lower_limit;
+	tbl->upper_limit = upper_limit;
+	return 0;
+fail:
+	lazy_table_cleanup(tbl);
+	return ret;
+}
+
+void lazy_table_cleanup(lazy_table_t *tbl)
+{
+	size_t i;
+
+	if (tbl->blocks != NULL) {
+		for (i = 0; i < tbl->num_blocks; ++i)
+			free(tbl->blocks[i]);
+	}
+
+	free(tbl->blocks);
+	free(tbl->locations);
+	memset(tbl, 0, sizeof(*tbl));
+}
+
+static int load_block(lazy_table_t *tbl, sqfs_file_t *file,
+		      sqfs_compressor_t *cmp, size_t index)
+{
+	sqfs_u64 start = tbl->locations[index];
+	sqfs_u8 *raw = NULL, *blk;
+	size_t size, expected;
+	sqfs_u16 header;
+	sqfs_s32 ret;
+
+	expected = tbl->table_size - index * SQFS_META_BLOCK_SIZE;
+	if (expected > SQFS_META_BLOCK_SIZE)
+		expected = SQFS_META_BLOCK_SIZE;
+
+	if ((tbl->upper_limit - start) < 2)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	ret = file->read_at(file, start, &header, sizeof(header));
+	if (ret)
+		return ret;
+
+	header = le16toh(header);
+	size = header & 0x7FFF;
+
+	if (size > SQFS_META_BLOCK_SIZE)
+		return SQFS_ERROR_CORRUPTED;
+
+	if ((start + 2 + size) > tbl->upper_limit)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	blk = malloc(SQFS_META_BLOCK_SIZE);
+	if (blk == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	if (header & 0x8000) {
+		ret = file->read_at(file, start + 2, blk, size);
+		if (ret)
+			goto fail;
+	} else {
+		raw = malloc(size);
+		if (raw == NULL) {
+			ret = SQFS_ERROR_ALLOC;
+			goto fail;
+		}
+
+		ret = file->read_at(file, start + 2, raw, size);
+		if (ret)
+			goto fail;
+
+		ret = cmp->do_block(cmp, raw, size, blk, SQFS_META_BLOCK_SIZE);
+		if (ret < 0)
+			goto fail;
+
+		size = ret;
+		free(raw);
+		raw = NULL;
+	}
+
+	if (size < expected) {
+		ret = SQFS_ERROR_CORRUPTED;
+		goto fail;
+	}
+
+	tbl->blocks[index] = blk;
+	return 0;
+fail:
+	free(raw);
+	free(blk);
+	return ret;
+}
+
+int lazy_table_get(lazy_table_t *tbl, sqfs_file_t *file,
+		   sqfs_compressor_t *cmp, size_t offset, void **out)
+{
+	size_t index = offset / SQFS_META_BLOCK_SIZE;
+	int ret;
+
+	if (offset >= tbl->table_size)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	if (tbl->blocks[index] == NULL) {
+		ret = load_block(tbl, file, cmp, index);
+		if (ret)
+			return ret;
+	}
+
+	*out = tbl->blocks[index] + offset % SQFS_META_BLOCK_SIZE;
+	return 0;
+}
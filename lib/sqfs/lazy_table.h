@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * lazy_table.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef LAZY_TABLE_H
+#define LAZY_TABLE_H
+
+#include "config.h"
+
+#include "sqfs/predef.h"
+
+/*
+  A table as written by sqfs_write_table, of which only the location list
+  is read up front. The meta data blocks are read and uncompressed one at
+  a time, the first time an entry inside them is accessed.
+
+  There is no locking, the user has to take care of that.
+ */
+typedef struct {
+	size_t table_size;
+	size_t num_blocks;
+	sqfs_u64 lower_limit;
+	sqfs_u64 upper_limit;
+
+	sqfs_u64 *locations;
+
+	/* uncompressed blocks, NULL if not loaded yet */
+	sqfs_u8 **blocks;
+} lazy_table_t;
+
+/* Read the location list. The arguments are the same as sqfs_read_table. */
+SQFS_INTERNAL int lazy_table_init(lazy_table_t *tbl, sqfs_file_t *file,
+				  size_t table_size, sqfs_u64 location,
+				  sqfs_u64 lower_limit, sqfs_u64 upper_limit);
+
+SQFS_INTERNAL void lazy_table_cleanup(lazy_table_t *tbl);
+
+/*
+  Get a pointer to the table entry at a byte offset, loading the meta data
+  block it is in if necessary. The entry size must divide the meta data
+  block size, so entries never cross a block boundary.
+ */
+SQFS_INTERNAL int lazy_table_get(lazy_table_t *tbl, sqfs_file_t *file,
+				 sqfs_compressor_t *cmp, size_t offset,
+				 void **out);
+
+#endif /* LAZY_TABLE_H */
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * meta_internal.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef META_INTERNAL_H
+#define META_INTERNAL_H
+
+#include "config.h"
+
+#include "sqfs/predef.h"
+
+#include <stdbool.h>
+
+/*
+  Get a pointer to the uncompressed data at the current position of a meta
+  data reader and the number of bytes left from there to the end of the
+  current block. The pointer stays valid until the reader moves to
+  another block.
+ */
+SQFS_INTERNAL void meta_reader_peek(const sqfs_meta_reader_t *m,
+				    const sqfs_u8 **ptr, size_t *avail);
+
+/*
+  Move the position forward inside the current block. The size must not be
+  larger than what meta_reader_peek reported as available.
+ */
+SQFS_INTERNAL void meta_reader_advance(sqfs_meta_reader_t *m, size_t size);
+
+SQFS_INTERNAL const sqfs_allocator_t *
+meta_reader_get_allocator(const sqfs_meta_reader_t *m);
+
+/*
+  Same as sqfs_meta_reader_read_inode, but if no_blocks is set, the block
+  list of a regular file is not read. The inode then has the block_sizes
+  pointer set to NULL, while num_file_blocks still holds the block count.
+ */
+SQFS_INTERNAL int meta_reader_read_inode(sqfs_meta_reader_t *ir,
+					 const sqfs_super_t *super,
+					 sqfs_u64 block_start, size_t offset,
+					 bool no_blocks,
+					 sqfs_inode_generic_t **result);
+
+#endif /* META_INTERNAL_H */
@@ -13,11 +13,82 @@
 #include "sqfs/block.h"
 #include "sqfs/io.h"
 #include "util/util.h"
+#include "blk_parallel.h"
+#include "meta_internal.h"
+
+#ifdef WITH_PTHREAD
+#include "thread_pool.h"
+#endif
 
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 
+enum {
+	RA_SLOT_NEW = 0,
+	RA_SLOT_BUSY,
+	RA_SLOT_DONE,
+};
+
+/* a block in the read ahead window, see ra_fill */
+typedef struct {
+	sqfs_u64 block_offset;
+	sqfs_u64 next_block;
+	const sqfs_u8 *raw;
+
+	int state;
+	int status;
+	size_t data_used;
+	sqfs_u8 data[SQFS_META_BLOCK_SIZE];
+} meta_ra_slot_t;
+
+typedef struct {
+#ifdef WITH_PTHREAD
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	thread_job_t job;
+	bool job_started;
+
+	/* a copy of the compressor for the background job */
+	sqfs_compressor_t *cmp;
+#endif
+	/* the raw blocks, unless they are in a memory mapped file */
+	sqfs_u8 *buffer;
+
+	size_t count;
+	size_t max;
+	meta_ra_slot_t slots[];
+} meta_ra_t;
+
+typedef struct meta_cache_ent_t {
+	struct meta_cache_ent_t *hash_next;
+	struct meta_cache_ent_t *lru_prev;
+	struct meta_cache_ent_t *lru_next;
+
+	sqfs_u64 block_offset;
+	sqfs_u64 next_block;
+
+	/* zero if the entry is unused and not in the hash table */
+	size_t data_used;
+
+	/* number of readers that currently have this as their current block */
+	unsigned int refcount;
+
+	sqfs_u8 data[SQFS_META_BLOCK_SIZE];
+} meta_cache_ent_t;
+
+struct sqfs_meta_cache_t {
+	meta_cache_ent_t **buckets;
+	size_t num_buckets;
+
+	/* all entries, most recently used first, unused ones at the end */
+	meta_cache_ent_t *lru_first;
+	meta_cache_ent_t *lru_last;
+
+	size_t count;
+	meta_cache_ent_t entries[];
+};
+
 struct sqfs_meta_reader_t {
 	sqfs_u64 start;
 	sqfs_u64 limit;
@@ -38,13 +109,526 @@ struct sqfs_meta_reader_t {
 	/* A pointer to the compressor to use for extracting data */
 	sqfs_compressor_t *cmp;
 
-	/* The raw data read from the input file */
-	sqfs_u8 data[SQFS_META_BLOCK_SIZE];
+	/* The uncompressed data of the current block, either pointing to the
+	   data buffer below or into a cache entry */
+	const sqfs_u8 *cur;
+
+	/* If the current block is in the cache, the entry holding it */
+	meta_cache_ent_t *cur_ent;
+
+	/* Optional cache of recently used, uncompressed blocks */
+	sqfs_meta_cache_t *cache;
+
+	/* Where decoded inodes and directory entries are allocated from */
+	const sqfs_allocator_t *allocator;
+
+	/* A cache created by sqfs_meta_reader_set_cache_size */
+	sqfs_meta_cache_t *own_cache;
+
+	/* Read ahead window, set up by sqfs_meta_reader_set_readahead */
+	meta_ra_t *ra;
 
 	/* The uncompressed data read from the input file */
+	sqfs_u8 data[SQFS_META_BLOCK_SIZE];
+
+	/* The raw data read from the input file */
 	sqfs_u8 scratch[SQFS_META_BLOCK_SIZE];
 };
 
+sqfs_meta_cache_t *sqfs_meta_cache_create(size_t count)
+{
+	sqfs_meta_cache_t *cache;
+	size_t i, num_buckets;
+
+	if (count == 0)
+		return NULL;
+
+	cache = alloc_flex(sizeof(*cache), sizeof(cache->entries[0]), count);
+	if (cache == NULL)
+		return NULL;
+
+	num_buckets = 16;
+	while (num_buckets < count && num_buckets < (SIZE_MAX / 4))
+		num_buckets *= 2;
+
+	cache->buckets = alloc_array(sizeof(cache->buckets[0]), num_buckets);
+	if (cache->buckets == NULL) {
+		free(cache);
+		return NULL;
+	}
+
+	for (i = 0; i < count; ++i) {
+		cache->entries[i].lru_prev = i > 0 ? cache->entries + i - 1 :
+			NULL;
+		cache->entries[i].lru_next = (i + 1) < count ?
+			cache->entries + i + 1 : NULL;
+	}
+
+	cache->num_buckets = num_buckets;
+	cache->lru_first = cache->entries;
+	cache->lru_last = cache->entries + count - 1;
+	cache->count = count;
+	return cache;
+}
+
+void sqfs_meta_cache_destroy(sqfs_meta_cache_t *cache)
+{
+	if (cache != NULL) {
+		free(cache->buckets);
+		free(cache);
+	}
+}
+
+static size_t cache_bucket(const sqfs_meta_cache_t *cache, sqfs_u64 offset)
+{
+	return ((offset * 0x9E3779B97F4A7C15ULL) >> 32) &
+		(cache->num_buckets - 1);
+}
+
+static void cache_unlink_lru(sqfs_meta_cache_t *cache, meta_cache_ent_t *ent)
+{
+	if (ent->lru_prev == NULL) {
+		cache->lru_first = ent->lru_next;
+	} else {
+		ent->lru_prev->lru_next = ent->lru_next;
+	}
+
+	if (ent->lru_next == NULL) {
+		cache->lru_last = ent->lru_prev;
+	} else {
+		ent->lru_next->lru_prev = ent->lru_prev;
+	}
+}
+
+static void cache_push_front(sqfs_meta_cache_t *cache, meta_cache_ent_t *ent)
+{
+	cache_unlink_lru(cache, ent);
+
+	ent->lru_prev = NULL;
+	ent->lru_next = cache->lru_first;
+
+	if (cache->lru_first == NULL) {
+		cache->lru_last = ent;
+	} else {
+		cache->lru_first->lru_prev = ent;
+	}
+
+	cache->lru_first = ent;
+}
+
+static void cache_push_back(sqfs_meta_cache_t *cache, meta_cache_ent_t *ent)
+{
+	cache_unlink_lru(cache, ent);
+
+	ent->lru_next = NULL;
+	ent->lru_prev = cache->lru_last;
+
+	if (cache->lru_last == NULL) {
+		cache->lru_first = ent;
+	} else {
+		cache->lru_last->lru_next = ent;
+	}
+
+	cache->lru_last = ent;
+}
+
+static meta_cache_ent_t *cache_find(sqfs_meta_cache_t *cache, sqfs_u64 offset)
+{
+	meta_cache_ent_t *ent = cache->buckets[cache_bucket(cache, offset)];
+
+	while (ent != NULL && ent->block_offset != offset)
+		ent = ent->hash_next;
+
+	return ent;
+}
+
+/*
+  Grab the least recently used entry that no reader currently points into
+  and remove it from the hash table. Returns NULL if all are in use.
+ */
+static meta_cache_ent_t *cache_evict(sqfs_meta_cache_t *cache)
+{
+	meta_cache_ent_t *ent, **it;
+
+	for (ent = cache->lru_last; ent != NULL; ent = ent->lru_prev) {
+		if (ent->refcount == 0)
+			break;
+	}
+
+	if (ent == NULL || ent->data_used == 0)
+		return ent;
+
+	it = cache->buckets + cache_bucket(cache, ent->block_offset);
+
+	while (*it != ent)
+		it = &((*it)->hash_next);
+
+	*it = ent->hash_next;
+	ent->hash_next = NULL;
+	ent->data_used = 0;
+	return ent;
+}
+
+static void cache_insert(sqfs_meta_cache_t *cache, meta_cache_ent_t *ent)
+{
+	size_t index = cache_bucket(cache, ent->block_offset);
+
+	ent->hash_next = cache->buckets[index];
+	cache->buckets[index] = ent;
+}
+
+static void release_current(sqfs_meta_reader_t *m)
+{
+	if (m->cur_ent != NULL) {
+		m->cur_ent->refcount -= 1;
+		m->cur_ent = NULL;
+	}
+
+	m->block_offset = 0;
+	m->data_used = 0;
+	m->offset = 0;
+	m->cur = m->data;
+}
+
+typedef struct {
+	sqfs_meta_cache_t *cache;
+	const sqfs_u8 *raw;
+	sqfs_u64 start;
+} load_state_t;
+
+static int load_entry(void *user, sqfs_compressor_t *cmp, size_t index)
+{
+	load_state_t *state = user;
+	meta_cache_ent_t *ent = state->cache->entries + index;
+	const sqfs_u8 *raw = state->raw + (ent->block_offset - state->start);
+	size_t size = ent->next_block - ent->block_offset - 2;
+	sqfs_u16 header;
+	sqfs_s32 ret;
+
+	memcpy(&header, raw, 2);
+	header = le16toh(header);
+
+	if (header & 0x8000) {
+		memcpy(ent->data, raw + 2, size);
+		ent->data_used = size;
+		return 0;
+	}
+
+	ret = cmp->do_block(cmp, raw + 2, size, ent->data, SQFS_META_BLOCK_SIZE);
+	if (ret <= 0)
+		return ret < 0 ? ret : SQFS_ERROR_CORRUPTED;
+
+	ent->data_used = ret;
+	return 0;
+}
+
+int sqfs_meta_cache_load(sqfs_meta_cache_t **out, sqfs_file_t *file,
+			 sqfs_compressor_t *cmp, sqfs_u64 start,
+			 sqfs_u64 limit, unsigned int num_workers)
+{
+	sqfs_meta_cache_t *cache = NULL;
+	load_state_t state;
+	sqfs_u8 *buffer = NULL;
+	size_t i, count, size;
+	meta_cache_ent_t *ent;
+	sqfs_u64 offset;
+	sqfs_u16 header;
+	int ret;
+
+	*out = NULL;
+
+	if (limit <= start || (limit - start) > SIZE_MAX)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	state.start = start;
+	size = limit - start;
+
+	/* get the whole table into memory in one go */
+	if (file->map_at != NULL) {
+		ret = file->map_at(file, start, size,
+				   (const void **)&state.raw);
+		if (ret)
+			return ret;
+	} else {
+		buffer = malloc(size);
+		if (buffer == NULL)
+			return SQFS_ERROR_ALLOC;
+
+		ret = file->read_at(file, start, buffer, size);
+		if (ret)
+			goto out;
+
+		state.raw = buffer;
+	}
+
+	/* walk the block headers to find out where the blocks are */
+	count = 0;
+
+	for (offset = 0; offset < size; offset += (header & 0x7FFF) + 2) {
+		if ((size - offset) < 2) {
+			ret = SQFS_ERROR_OUT_OF_BOUNDS;
+			goto out;
+		}
+
+		memcpy(&header, state.raw + offset, 2);
+		header = le16toh(header);
+
+		if ((header & 0x7FFF) > SQFS_META_BLOCK_SIZE) {
+			ret = SQFS_ERROR_CORRUPTED;
+			goto out;
+		}
+
+		++count;
+	}
+
+	if (offset > size) {
+		ret = SQFS_ERROR_OUT_OF_BOUNDS;
+		goto out;
+	}
+
+	cache = sqfs_meta_cache_create(count);
+	if (cache == NULL) {
+		ret = SQFS_ERROR_ALLOC;
+		goto out;
+	}
+
+	for (i = 0, offset = 0; i < count; ++i) {
+		memcpy(&header, state.raw + offset, 2);
+		header = le16toh(header);
+
+		ent = cache->entries + i;
+		ent->block_offset = start + offset;
+		offset += (header & 0x7FFF) + 2;
+		ent->next_block = start + offset;
+	}
+
+	state.cache = cache;
+
+	ret = blk_parallel_run(cmp, count, num_workers, load_entry, &state);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < count; ++i)
+		cache_insert(cache, cache->entries + i);
+
+	*out = cache;
+	cache = NULL;
+out:
+	sqfs_meta_cache_destroy(cache);
+	free(buffer);
+	return ret;
+}
+
+/*
+  A block in the read ahead window is uncompressed by whoever gets to it
+  first, the background job or the reader. So the reader never waits for a
+  job that the thread pool has not gotten around to starting yet.
+ */
+static int ra_decode(meta_ra_slot_t *slot, sqfs_compressor_t *cmp)
+{
+	size_t size = slot->next_block - slot->block_offset - 2;
+	sqfs_u16 header;
+	sqfs_s32 ret;
+
+	memcpy(&header, slot->raw, 2);
+	header = le16toh(header);
+
+	if (header & 0x8000) {
+		memcpy(slot->data, slot->raw + 2, size);
+		slot->data_used = size;
+		return 0;
+	}
+
+	ret = cmp->do_block(cmp, slot->raw + 2, size,
+			    slot->data, SQFS_META_BLOCK_SIZE);
+	if (ret < 0)
+		return ret;
+
+	slot->data_used = ret;
+	return 0;
+}
+
+#ifdef WITH_PTHREAD
+#define RA_LOCK(ra) pthread_mutex_lock(&(ra)->mtx)
+#define RA_UNLOCK(ra) pthread_mutex_unlock(&(ra)->mtx)
+#else
+#define RA_LOCK(ra)
+#define RA_UNLOCK(ra)
+#endif
+
+/* called with the lock held, on a slot in the RA_SLOT_NEW state */
+static void ra_process(meta_ra_t *ra, meta_ra_slot_t *slot,
+		       sqfs_compressor_t *cmp)
+{
+	int status;
+
+	slot->state = RA_SLOT_BUSY;
+	RA_UNLOCK(ra);
+	status = ra_decode(slot, cmp);
+	RA_LOCK(ra);
+	slot->status = status;
+	slot->state = RA_SLOT_DONE;
+#ifdef WITH_PTHREAD
+	pthread_cond_broadcast(&ra->cond);
+#else
+	(void)ra;
+#endif
+}
+
+#ifdef WITH_PTHREAD
+static void *ra_worker(void *arg)
+{
+	meta_ra_t *ra = arg;
+	size_t i;
+
+	RA_LOCK(ra);
+	for (i = 0; i < ra->count; ++i) {
+		if (ra->slots[i].state == RA_SLOT_NEW)
+			ra_process(ra, ra->slots + i, ra->cmp);
+	}
+	RA_UNLOCK(ra);
+	return NULL;
+}
+#endif
+
+static void ra_stop(meta_ra_t *ra)
+{
+#ifdef WITH_PTHREAD
+	if (ra->job_started) {
+		thread_job_join(&ra->job);
+		ra->job_started = false;
+	}
+#endif
+	ra->count = 0;
+}
+
+static void ra_destroy(meta_ra_t *ra)
+{
+	if (ra == NULL)
+		return;
+
+	ra_stop(ra);
+#ifdef WITH_PTHREAD
+	if (ra->cmp != NULL)
+		ra->cmp->destroy(ra->cmp);
+	pthread_cond_destroy(&ra->cond);
+	pthread_mutex_destroy(&ra->mtx);
+#endif
+	free(ra->buffer);
+	free(ra);
+}
+
+/*
+  Get as many blocks as fit into the window with a single read, starting
+  at block_start, and uncompress them in the background. Blocks that are
+  broken or cut off by the window are left to read_block to deal with.
+ */
+static int ra_fill(sqfs_meta_reader_t *m, sqfs_u64 block_start)
+{
+	meta_ra_t *ra = m->ra;
+	meta_ra_slot_t *slot;
+	sqfs_u64 offset, size;
+	const sqfs_u8 *raw;
+	sqfs_u16 header;
+	size_t len;
+	int ret;
+
+	ra_stop(ra);
+
+	size = (sqfs_u64)ra->max * (SQFS_META_BLOCK_SIZE + 2);
+	if (size > m->limit - block_start)
+		size = m->limit - block_start;
+
+	if (m->file->map_at != NULL) {
+		ret = m->file->map_at(m->file, block_start, size,
+				      (const void **)&raw);
+	} else {
+		ret = m->file->read_at(m->file, block_start, ra->buffer, size);
+		raw = ra->buffer;
+	}
+
+	if (ret)
+		return ret;
+
+	for (offset = 0; ra->count < ra->max && (size - offset) >= 2;
+	     offset += len + 2) {
+		memcpy(&header, raw + offset, 2);
+		len = le16toh(header) & 0x7FFF;
+
+		if (len > SQFS_META_BLOCK_SIZE || (len + 2) > (size - offset))
+			break;
+
+		slot = ra->slots + ra->count++;
+		slot->block_offset = block_start + offset;
+		slot->next_block = slot->block_offset + len + 2;
+		slot->raw = raw + offset;
+		slot->state = RA_SLOT_NEW;
+		slot->status = 0;
+	}
+
+#ifdef WITH_PTHREAD
+	if (ra->count > 1 &&
+	    thread_job_start(&ra->job, ra_worker, ra, false) == 0) {
+		ra->job_started = true;
+	}
+#endif
+	return 0;
+}
+
+/*
+  Look for a block in the read ahead window. If it is not in there and the
+  reader moves on sequentially, the window is moved to start at the block.
+  Sets found to false if the block has to be read the usual way.
+ */
+static int ra_fetch(sqfs_meta_reader_t *m, sqfs_u64 block_start,
+		    bool sequential, sqfs_u8 *out, size_t *used,
+		    sqfs_u64 *next_block, bool *found)
+{
+	meta_ra_t *ra = m->ra;
+	meta_ra_slot_t *slot = NULL;
+	size_t i;
+	int ret;
+
+	*found = false;
+
+	for (i = 0; i < ra->count; ++i) {
+		if (ra->slots[i].block_offset == block_start) {
+			slot = ra->slots + i;
+			break;
+		}
+	}
+
+	if (slot == NULL) {
+		if (!sequential)
+			return 0;
+
+		ret = ra_fill(m, block_start);
+		if (ret != 0 || ra->count == 0)
+			return ret;
+
+		slot = ra->slots;
+	}
+
+	RA_LOCK(ra);
+	if (slot->state == RA_SLOT_NEW)
+		ra_process(ra, slot, m->cmp);
+#ifdef WITH_PTHREAD
+	while (slot->state != RA_SLOT_DONE)
+		pthread_cond_wait(&ra->cond, &ra->mtx);
+#endif
+	ret = slot->status;
+	RA_UNLOCK(ra);
+
+	if (ret)
+		return ret;
+
+	memcpy(out, slot->data, slot->data_used);
+	*used = slot->data_used;
+	*next_block = slot->next_block;
+	*found = true;
+	return 0;
+}
+
 sqfs_meta_reader_t *sqfs_meta_reader_create(sqfs_file_t *file,
 					    sqfs_compressor_t *cmp,
 					    sqfs_u64 start, sqfs_u64 limit)
@@ -58,34 +642,91 @@ sqfs_meta_reader_t *sqfs_meta_reader_create(sqfs_file_t *file,
 	m->limit = limit;
 	m->file = file;
 	m->cmp = cmp;
+	m->cur = m->data;
 	return m;
 }
 
 void sqfs_meta_reader_destroy(sqfs_meta_reader_t *m)
 {
+	release_current(m);
+	ra_destroy(m->ra);
+	sqfs_meta_cache_destroy(m->own_cache);
 	free(m);
 }
 
-int sqfs_meta_reader_seek(sqfs_meta_reader_t *m, sqfs_u64 block_start,
-			  size_t offset)
+void sqfs_meta_reader_set_cache(sqfs_meta_reader_t *m,
+				sqfs_meta_cache_t *cache)
 {
+	release_current(m);
+
+	if (m->own_cache != NULL && m->own_cache != cache) {
+		sqfs_meta_cache_destroy(m->own_cache);
+		m->own_cache = NULL;
+	}
+
+	m->cache = cache;
+}
+
+int sqfs_meta_reader_set_cache_size(sqfs_meta_reader_t *m, size_t count)
+{
+	sqfs_meta_cache_t *cache = NULL;
+
+	if (count > 0) {
+		cache = sqfs_meta_cache_create(count);
+		if (cache == NULL)
+			return SQFS_ERROR_ALLOC;
+	}
+
+	sqfs_meta_reader_set_cache(m, cache);
+	m->own_cache = cache;
+	return 0;
+}
+
+int sqfs_meta_reader_set_readahead(sqfs_meta_reader_t *m, size_t count)
+{
+	meta_ra_t *ra = NULL;
+
+	if (count > 0) {
+		ra = alloc_flex(sizeof(*ra), sizeof(ra->slots[0]), count);
+		if (ra == NULL)
+			return SQFS_ERROR_ALLOC;
+
+		ra->max = count;
+#ifdef WITH_PTHREAD
+		ra->mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+		ra->cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+		ra->cmp = m->cmp->create_copy(m->cmp);
+
+		if (ra->cmp == NULL) {
+			ra_destroy(ra);
+			return SQFS_ERROR_ALLOC;
+		}
+#endif
+		if (m->file->map_at == NULL) {
+			ra->buffer = alloc_array(SQFS_META_BLOCK_SIZE + 2,
+						 count);
+			if (ra->buffer == NULL) {
+				ra_destroy(ra);
+				return SQFS_ERROR_ALLOC;
+			}
+		}
+	}
+
+	ra_destroy(m->ra);
+	m->ra = ra;
+	return 0;
+}
+
+static int read_block(sqfs_meta_reader_t *m, sqfs_u64 block_start,
+		      sqfs_u8 *out, size_t *used, sqfs_u64 *next_block)
+{
+	const void *src;
 	bool compressed;
 	sqfs_u16 header;
 	sqfs_u32 size;
 	sqfs_s32 ret;
 	int err;
 
-	if (block_start < m->start || block_start >= m->limit)
-		return SQFS_ERROR_OUT_OF_BOUNDS;
-
-	if (block_start == m->block_offset) {
-		if (offset >= m->data_used)
-			return SQFS_ERROR_OUT_OF_BOUNDS;
-
-		m->offset = offset;
-		return 0;
-	}
-
 	err = m->file->read_at(m->file, block_start, &header, 2);
 	if (err)
 		return err;
@@ -94,34 +735,140 @@ int sqfs_meta_reader_seek(sqfs_meta_reader_t *m, sqfs_u64 block_start,
 	compressed = (header & 0x8000) == 0;
 	size = header & 0x7FFF;
 
-	if (size > sizeof(m->data))
+	if (size > SQFS_META_BLOCK_SIZE)
 		return SQFS_ERROR_CORRUPTED;
 
 	if ((block_start + 2 + size) > m->limit)
 		return SQFS_ERROR_OUT_OF_BOUNDS;
 
-	err = m->file->read_at(m->file, block_start + 2, m->data, size);
-	if (err)
-		return err;
+	if (m->file->map_at != NULL) {
+		/* decompress straight from the mapping into the data buffer */
+		err = m->file->map_at(m->file, block_start + 2, size, &src);
+		if (err)
+			return err;
+	} else {
+		err = m->file->read_at(m->file, block_start + 2,
+				       compressed ? m->scratch : out, size);
+		if (err)
+			return err;
 
-	if (compressed) {
-		ret = m->cmp->do_block(m->cmp, m->data, size,
-				       m->scratch, sizeof(m->scratch));
+		src = compressed ? m->scratch : out;
+	}
 
+	if (compressed) {
+		ret = m->cmp->do_block(m->cmp, src, size,
+				       out, SQFS_META_BLOCK_SIZE);
 		if (ret < 0)
 			return ret;
 
-		memcpy(m->data, m->scratch, ret);
-		m->data_used = ret;
+		*used = ret;
 	} else {
-		m->data_used = size;
+		if (src != out)
+			memcpy(out, src, size);
+		*used = size;
 	}
 
-	if (offset >= m->data_used)
+	*next_block = block_start + size + 2;
+	return 0;
+}
+
+static int fetch_block(sqfs_meta_reader_t *m, sqfs_u64 block_start,
+		       bool sequential, sqfs_u8 *out, size_t *used,
+		       sqfs_u64 *next_block)
+{
+	bool found;
+	int ret;
+
+	if (m->ra != NULL) {
+		ret = ra_fetch(m, block_start, sequential, out, used,
+			       next_block, &found);
+		if (ret != 0 || found)
+			return ret;
+	}
+
+	return read_block(m, block_start, out, used, next_block);
+}
+
+int sqfs_meta_reader_seek(sqfs_meta_reader_t *m, sqfs_u64 block_start,
+			  size_t offset)
+{
+	meta_cache_ent_t *ent = NULL;
+	sqfs_u64 next_block;
+	bool sequential;
+	size_t used;
+	int err;
+
+	if (block_start < m->start || block_start >= m->limit)
 		return SQFS_ERROR_OUT_OF_BOUNDS;
 
+	/*
+	  The end of a block is a valid position, it is what get_position
+	  reports after a read that ended there. The next read continues
+	  with the following block.
+	 */
+	if (block_start == m->block_offset && m->data_used > 0) {
+		if (offset > m->data_used)
+			return SQFS_ERROR_OUT_OF_BOUNDS;
+
+		m->offset = offset;
+		return 0;
+	}
+
+	sequential = (m->data_used > 0 && block_start == m->next_block);
+
+	if (m->cache != NULL) {
+		ent = cache_find(m->cache, block_start);
+
+		if (ent != NULL) {
+			/* may have been read through a reader with other bounds */
+			if (ent->next_block > m->limit)
+				return SQFS_ERROR_OUT_OF_BOUNDS;
+		} else {
+			ent = cache_evict(m->cache);
+		}
+
+		if (ent != NULL && ent->data_used == 0) {
+			err = fetch_block(m, block_start, sequential,
+					  ent->data, &ent->data_used,
+					  &ent->next_block);
+			if (err) {
+				ent->data_used = 0;
+				cache_push_back(m->cache, ent);
+				release_current(m);
+				return err;
+			}
+
+			ent->block_offset = block_start;
+			cache_insert(m->cache, ent);
+		}
+	}
+
+	if (ent != NULL) {
+		cache_push_front(m->cache, ent);
+		ent->refcount += 1;
+
+		release_current(m);
+		m->cur_ent = ent;
+		m->cur = ent->data;
+		used = ent->data_used;
+		next_block = ent->next_block;
+	} else {
+		/* the old block may be in the buffer we are about to reuse */
+		release_current(m);
+
+		err = fetch_block(m, block_start, sequential, m->data,
+				  &used, &next_block);
+		if (err)
+			return err;
+	}
+
 	m->block_offset = block_start;
-	m->next_block = block_start + size + 2;
+	m->next_block = next_block;
+	m->data_used = used;
+
+	if (offset > m->data_used)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
 	m->offset = offset;
 	return 0;
 }
@@ -151,7 +898,7 @@ int sqfs_meta_reader_read(sqfs_meta_reader_t *m, void *data, size_t size)
 		if (diff > size)
 			diff = size;
 
-		memcpy(data, m->data + m->offset, diff);
+		memcpy(data, m->cur + m->offset, diff);
 
 		m->offset += diff;
 		data = (char *)data + diff;
@@ -160,3 +907,26 @@ int sqfs_meta_reader_read(sqfs_meta_reader_t *m, void *data, size_t size)
 
 	return 0;
 }
+
+void meta_reader_peek(const sqfs_meta_reader_t *m, const sqfs_u8 **ptr,
+		      size_t *avail)
+{
+	*ptr = m->cur + m->offset;
+	*avail = m->data_used - m->offset;
+}
+
+void meta_reader_advance(sqfs_meta_reader_t *m, size_t size)
+{
+	m->offset += size;
+}
+
+void sqfs_meta_reader_set_allocator(sqfs_meta_reader_t *m,
+				    const sqfs_allocator_t *allocator)
+{
+	m->allocator = allocator;
+}
+
+const sqfs_allocator_t *meta_reader_get_allocator(const sqfs_meta_reader_t *m)
+{
+	return m->allocator;
+}
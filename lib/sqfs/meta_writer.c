@@ -11,8 +11,10 @@
 #include "sqfs/compressor.h"
 #include "sqfs/error.h"
 #include "sqfs/block.h"
+#include "sqfs/trace.h"
 #include "sqfs/io.h"
 #include "util/util.h"
+#include "hook_alloc.h"
 
 #include <string.h>
 #include <stdlib.h>
@@ -22,7 +24,7 @@ typedef struct meta_block_t {
 	struct meta_block_t *next;
 
 	/* possibly compressed data with 2 byte header */
-	sqfs_u8 data[SQFS_META_BLOCK_SIZE + 2];
+	sqfs_u8 data[];
 } meta_block_t;
 
 struct sqfs_meta_writer_t {
@@ -44,14 +46,27 @@ struct sqfs_meta_writer_t {
 	sqfs_u32 flags;
 	meta_block_t *list;
 	meta_block_t *list_end;
+
+	/* where the blocks in the list come from */
+	const sqfs_allocator_t *allocator;
+
+	/*
+	  Every block is compressed into this buffer first. Blocks that are
+	  kept in memory are then copied to an allocation of exactly their
+	  on-disk size, instead of holding on to a full sized buffer each.
+	 */
+	sqfs_u8 scratch[SQFS_META_BLOCK_SIZE + 2];
 };
 
-static int write_block(sqfs_file_t *file, meta_block_t *outblk)
+static int write_block(sqfs_file_t *file, const sqfs_u8 *data)
 {
-	size_t count = le16toh(((sqfs_u16 *)outblk->data)[0]) & 0x7FFF;
-	sqfs_u64 off = file->get_size(file);
+	sqfs_u16 header;
+	sqfs_u64 off;
+
+	memcpy(&header, data, sizeof(header));
+	off = file->get_size(file);
 
-	return file->write_at(file, off, outblk->data, count + 2);
+	return file->write_at(file, off, data, (le16toh(header) & 0x7FFF) + 2);
 }
 
 sqfs_meta_writer_t *sqfs_meta_writer_create(sqfs_file_t *file,
@@ -80,7 +95,7 @@ void sqfs_meta_writer_destroy(sqfs_meta_writer_t *m)
 	while (m->list != NULL) {
 		blk = m->list;
 		m->list = blk->next;
-		free(blk);
+		hook_free(m->allocator, blk);
 	}
 
 	free(m);
@@ -89,35 +104,40 @@ void sqfs_meta_writer_destroy(sqfs_meta_writer_t *m)
 int sqfs_meta_writer_flush(sqfs_meta_writer_t *m)
 {
 	meta_block_t *outblk;
+	sqfs_u16 header;
 	sqfs_u32 count;
 	sqfs_s32 ret;
 
 	if (m->offset == 0)
 		return 0;
 
-	outblk = calloc(1, sizeof(*outblk));
-	if (outblk == NULL)
-		return SQFS_ERROR_ALLOC;
-
+	sqfs_trace_begin("meta_writer", "compress block");
 	ret = m->cmp->do_block(m->cmp, m->data, m->offset,
-			       outblk->data + 2, sizeof(outblk->data) - 2);
-	if (ret < 0) {
-		free(outblk);
+			       m->scratch + 2, sizeof(m->scratch) - 2);
+	sqfs_trace_end("meta_writer", "compress block");
+	if (ret < 0)
 		return ret;
-	}
 
 	if (ret > 0) {
-		((sqfs_u16 *)outblk->data)[0] = htole16(ret);
+		header = htole16(ret);
 		count = ret + 2;
 	} else {
-		((sqfs_u16 *)outblk->data)[0] = htole16(m->offset | 0x8000);
-		memcpy(outblk->data + 2, m->data, m->offset);
+		header = htole16(m->offset | 0x8000);
+		memcpy(m->scratch + 2, m->data, m->offset);
 		count = m->offset + 2;
 	}
 
+	memcpy(m->scratch, &header, sizeof(header));
 	ret = 0;
 
 	if (m->flags & SQFS_META_WRITER_KEEP_IN_MEMORY) {
+		outblk = hook_alloc(m->allocator, sizeof(*outblk) + count);
+		if (outblk == NULL)
+			return SQFS_ERROR_ALLOC;
+
+		outblk->next = NULL;
+		memcpy(outblk->data, m->scratch, count);
+
 		if (m->list == NULL) {
 			m->list = outblk;
 		} else {
@@ -125,11 +145,9 @@ int sqfs_meta_writer_flush(sqfs_meta_writer_t *m)
 		}
 		m->list_end = outblk;
 	} else {
-		ret = write_block(m->file, outblk);
-		free(outblk);
+		ret = write_block(m->file, m->scratch);
 	}
 
-	memset(m->data, 0, sizeof(m->data));
 	m->offset = 0;
 	m->block_offset += count;
 	return ret;
@@ -188,14 +206,24 @@ int sqfs_meta_write_write_to_file(sqfs_meta_writer_t *m)
 	while (m->list != NULL) {
 		blk = m->list;
 
-		ret = write_block(m->file, blk);
+		ret = write_block(m->file, blk->data);
 		if (ret)
 			return ret;
 
 		m->list = blk->next;
-		free(blk);
+		hook_free(m->allocator, blk);
 	}
 
 	m->list_end = NULL;
 	return 0;
 }
+
+int sqfs_meta_writer_set_allocator(sqfs_meta_writer_t *m,
+				   const sqfs_allocator_t *allocator)
+{
+	if (m->list != NULL)
+		return SQFS_ERROR_UNSUPPORTED;
+
+	m->allocator = allocator;
+	return 0;
+}
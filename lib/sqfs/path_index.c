@@ -0,0 +1,466 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * path_index.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#define SQFS_BUILDING_DLL
+#include "config.h"
+
+#include "sqfs/path_index.h"
+#include "sqfs/super.h"
+#include "sqfs/error.h"
+#include "sqfs/io.h"
+#include "util/compat.h"
+#include "util/util.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PATH_INDEX_MAGIC "sqfsPIdx"
+#define PATH_INDEX_VERSION (1)
+
+#define IS_SEP(c) ((c) == '/' || (c) == '\\')
+
+typedef struct {
+	sqfs_u8 magic[8];
+	sqfs_u32 version;
+	sqfs_u32 num_entries;
+	sqfs_u32 num_buckets;
+	sqfs_u32 modification_time;
+	sqfs_u64 bytes_used;
+	sqfs_u64 root_inode_ref;
+	sqfs_u64 inode_table_start;
+	sqfs_u64 strings_size;
+} index_header_t;
+
+typedef struct {
+	sqfs_u64 inode_ref;
+	sqfs_u32 hash;
+
+	/* offset into the string table */
+	sqfs_u32 path;
+} index_ent_t;
+
+struct sqfs_path_index_t {
+	index_ent_t *entries;
+	size_t num_entries;
+	size_t max_entries;
+
+	char *strings;
+	size_t strings_size;
+	size_t max_strings;
+
+	/*
+	  Sorted by hash, the entries of bucket i are in the range
+	  [buckets[i], buckets[i + 1]). NULL until written or loaded.
+	 */
+	sqfs_u32 *buckets;
+	sqfs_u32 num_buckets;
+};
+
+/*
+  FNV-1a over the path without leading, trailing or duplicate separators,
+  with a final avalanche, because the buckets are picked by the upper bits.
+ */
+static sqfs_u32 path_hash(const char *path)
+{
+	sqfs_u32 hash = 0x811C9DC5;
+	bool first = true;
+
+	for (;;) {
+		while (IS_SEP(*path))
+			++path;
+
+		if (*path == '\0')
+			break;
+
+		if (!first)
+			hash = (hash ^ '/') * 0x01000193;
+		first = false;
+
+		while (*path != '\0' && !IS_SEP(*path))
+			hash = (hash ^ (sqfs_u8)*(path++)) * 0x01000193;
+	}
+
+	hash ^= hash >> 16;
+	hash *= 0x85EBCA6B;
+	hash ^= hash >> 13;
+	hash *= 0xC2B2AE35;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+static bool path_equal(const char *stored, const char *path)
+{
+	bool first = true;
+
+	for (;;) {
+		while (IS_SEP(*path))
+			++path;
+
+		if (*path == '\0')
+			break;
+
+		if (!first && *(stored++) != '/')
+			return false;
+		first = false;
+
+		while (*path != '\0' && !IS_SEP(*path)) {
+			if (*(stored++) != *(path++))
+				return false;
+		}
+	}
+
+	return *stored == '\0';
+}
+
+static sqfs_u32 get_bucket(const sqfs_path_index_t *index, sqfs_u32 hash)
+{
+	return ((sqfs_u64)hash * index->num_buckets) >> 32;
+}
+
+static int compare_entries(const void *l, const void *r)
+{
+	const index_ent_t *lhs = l, *rhs = r;
+
+	if (lhs->hash != rhs->hash)
+		return lhs->hash < rhs->hash ? -1 : 1;
+
+	return 0;
+}
+
+static int build_buckets(sqfs_path_index_t *index)
+{
+	size_t i, count = index->num_entries;
+	sqfs_u32 b, *buckets;
+
+	buckets = alloc_array(sizeof(buckets[0]),
+			      (count > 0 ? count : 1) + 1);
+	if (buckets == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	qsort(index->entries, count, sizeof(index->entries[0]),
+	      compare_entries);
+
+	free(index->buckets);
+	index->buckets = buckets;
+	index->num_buckets = count > 0 ? count : 1;
+
+	for (i = 0, b = 0; i < count; ++i) {
+		while (b <= get_bucket(index, index->entries[i].hash))
+			buckets[b++] = i;
+	}
+
+	while (b <= index->num_buckets)
+		buckets[b++] = count;
+
+	return 0;
+}
+
+static void entries_swap(sqfs_path_index_t *index, bool to_le)
+{
+	size_t i;
+
+	for (i = 0; i < index->num_entries; ++i) {
+		index_ent_t *ent = index->entries + i;
+
+		if (to_le) {
+			ent->inode_ref = htole64(ent->inode_ref);
+			ent->hash = htole32(ent->hash);
+			ent->path = htole32(ent->path);
+		} else {
+			ent->inode_ref = le64toh(ent->inode_ref);
+			ent->hash = le32toh(ent->hash);
+			ent->path = le32toh(ent->path);
+		}
+	}
+
+	for (i = 0; i <= index->num_buckets; ++i) {
+		index->buckets[i] = to_le ? htole32(index->buckets[i]) :
+			le32toh(index->buckets[i]);
+	}
+}
+
+sqfs_path_index_t *sqfs_path_index_create(void)
+{
+	return calloc(1, sizeof(sqfs_path_index_t));
+}
+
+void sqfs_path_index_destroy(sqfs_path_index_t *index)
+{
+	if (index == NULL)
+		return;
+
+	free(index->entries);
+	free(index->strings);
+	free(index->buckets);
+	free(index);
+}
+
+int sqfs_path_index_add(sqfs_path_index_t *index, const char *path,
+			sqfs_u64 inode_ref)
+{
+	size_t len = strlen(path), new_sz;
+	index_ent_t *ent;
+	bool first = true;
+	char *dst;
+	void *new;
+
+	if (index->num_entries == index->max_entries) {
+		new_sz = index->max_entries ? index->max_entries * 2 : 128;
+		if (new_sz > 0xFFFFFFFF)
+			return SQFS_ERROR_OVERFLOW;
+
+		new = realloc(index->entries,
+			      sizeof(index->entries[0]) * new_sz);
+		if (new == NULL)
+			return SQFS_ERROR_ALLOC;
+
+		index->entries = new;
+		index->max_entries = new_sz;
+	}
+
+	if (index->max_strings - index->strings_size <= len) {
+		new_sz = index->max_strings ? index->max_strings : 4096;
+
+		while (new_sz - index->strings_size <= len)
+			new_sz *= 2;
+
+		if (new_sz > 0xFFFFFFFF)
+			return SQFS_ERROR_OVERFLOW;
+
+		new = realloc(index->strings, new_sz);
+		if (new == NULL)
+			return SQFS_ERROR_ALLOC;
+
+		index->strings = new;
+		index->max_strings = new_sz;
+	}
+
+	ent = index->entries + index->num_entries++;
+	ent->inode_ref = inode_ref;
+	ent->hash = path_hash(path);
+	ent->path = index->strings_size;
+
+	dst = index->strings + index->strings_size;
+
+	for (;;) {
+		while (IS_SEP(*path))
+			++path;
+
+		if (*path == '\0')
+			break;
+
+		if (!first)
+			*(dst++) = '/';
+		first = false;
+
+		while (*path != '\0' && !IS_SEP(*path))
+			*(dst++) = *(path++);
+	}
+
+	*(dst++) = '\0';
+	index->strings_size = dst - index->strings;
+
+	free(index->buckets);
+	index->buckets = NULL;
+	return 0;
+}
+
+int sqfs_path_index_write(sqfs_path_index_t *index, sqfs_file_t *file,
+			  const sqfs_super_t *super)
+{
+	size_t bucket_size, entry_size;
+	index_header_t hdr;
+	sqfs_u64 offset;
+	int ret;
+
+	ret = build_buckets(index);
+	if (ret)
+		return ret;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PATH_INDEX_MAGIC, sizeof(hdr.magic));
+	hdr.version = htole32(PATH_INDEX_VERSION);
+	hdr.num_entries = htole32(index->num_entries);
+	hdr.num_buckets = htole32(index->num_buckets);
+	hdr.modification_time = htole32(super->modification_time);
+	hdr.bytes_used = htole64(super->bytes_used);
+	hdr.root_inode_ref = htole64(super->root_inode_ref);
+	hdr.inode_table_start = htole64(super->inode_table_start);
+	hdr.strings_size = htole64(index->strings_size);
+
+	bucket_size = sizeof(index->buckets[0]) * (index->num_buckets + 1);
+	entry_size = sizeof(index->entries[0]) * index->num_entries;
+
+	ret = file->write_at(file, 0, &hdr, sizeof(hdr));
+	if (ret)
+		return ret;
+
+	offset = sizeof(hdr);
+
+	entries_swap(index, true);
+	ret = file->write_at(file, offset, index->buckets, bucket_size);
+	offset += bucket_size;
+
+	if (ret == 0 && entry_size > 0) {
+		ret = file->write_at(file, offset, index->entries, entry_size);
+		offset += entry_size;
+	}
+	entries_swap(index, false);
+
+	if (ret == 0 && index->strings_size > 0) {
+		ret = file->write_at(file, offset, index->strings,
+				     index->strings_size);
+	}
+
+	if (ret == 0)
+		ret = sqfs_file_flush(file, 0);
+
+	return ret;
+}
+
+static int check_index(const sqfs_path_index_t *index)
+{
+	size_t i;
+
+	if (index->buckets[0] != 0 ||
+	    index->buckets[index->num_buckets] != index->num_entries) {
+		return SQFS_ERROR_CORRUPTED;
+	}
+
+	for (i = 0; i < index->num_buckets; ++i) {
+		if (index->buckets[i] > index->buckets[i + 1])
+			return SQFS_ERROR_CORRUPTED;
+	}
+
+	if (index->num_entries > 0 &&
+	    (index->strings_size == 0 ||
+	     index->strings[index->strings_size - 1] != '\0')) {
+		return SQFS_ERROR_CORRUPTED;
+	}
+
+	for (i = 0; i < index->num_entries; ++i) {
+		if (index->entries[i].path >= index->strings_size)
+			return SQFS_ERROR_CORRUPTED;
+	}
+
+	return 0;
+}
+
+int sqfs_path_index_load(sqfs_path_index_t **out, sqfs_file_t *file,
+			 const sqfs_super_t *super)
+{
+	sqfs_u64 offset, total, bucket_size, entry_size;
+	sqfs_path_index_t *index;
+	index_header_t hdr;
+	int ret;
+
+	ret = file->read_at(file, 0, &hdr, sizeof(hdr));
+	if (ret)
+		return ret == SQFS_ERROR_OUT_OF_BOUNDS ?
+			SQFS_ERROR_CORRUPTED : ret;
+
+	if (memcmp(hdr.magic, PATH_INDEX_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    le32toh(hdr.version) != PATH_INDEX_VERSION ||
+	    le32toh(hdr.num_buckets) == 0) {
+		return SQFS_ERROR_CORRUPTED;
+	}
+
+	/* written for a different image, or an older build of it */
+	if (le32toh(hdr.modification_time) != super->modification_time ||
+	    le64toh(hdr.bytes_used) != super->bytes_used ||
+	    le64toh(hdr.root_inode_ref) != super->root_inode_ref ||
+	    le64toh(hdr.inode_table_start) != super->inode_table_start) {
+		return SQFS_ERROR_CORRUPTED;
+	}
+
+	bucket_size = sizeof(sqfs_u32) * ((sqfs_u64)le32toh(hdr.num_buckets) + 1);
+	entry_size = sizeof(index_ent_t) * (sqfs_u64)le32toh(hdr.num_entries);
+	total = sizeof(hdr) + bucket_size + entry_size;
+
+	if (le64toh(hdr.strings_size) > 0xFFFFFFFF ||
+	    total + le64toh(hdr.strings_size) != file->get_size(file) ||
+	    total > SIZE_MAX) {
+		return SQFS_ERROR_CORRUPTED;
+	}
+
+	index = calloc(1, sizeof(*index));
+	if (index == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	index->num_entries = le32toh(hdr.num_entries);
+	index->max_entries = index->num_entries;
+	index->num_buckets = le32toh(hdr.num_buckets);
+	index->strings_size = le64toh(hdr.strings_size);
+	index->max_strings = index->strings_size;
+
+	index->buckets = malloc(bucket_size);
+	index->entries = malloc(entry_size > 0 ? entry_size : 1);
+	index->strings = malloc(index->strings_size > 0 ?
+				index->strings_size : 1);
+
+	if (index->buckets == NULL || index->entries == NULL ||
+	    index->strings == NULL) {
+		ret = SQFS_ERROR_ALLOC;
+		goto fail;
+	}
+
+	offset = sizeof(hdr);
+	ret = file->read_at(file, offset, index->buckets, bucket_size);
+	offset += bucket_size;
+
+	if (ret == 0 && entry_size > 0) {
+		ret = file->read_at(file, offset, index->entries, entry_size);
+		offset += entry_size;
+	}
+
+	if (ret == 0 && index->strings_size > 0) {
+		ret = file->read_at(file, offset, index->strings,
+				    index->strings_size);
+	}
+
+	if (ret)
+		goto fail;
+
+	entries_swap(index, false);
+
+	ret = check_index(index);
+	if (ret)
+		goto fail;
+
+	*out = index;
+	return 0;
+fail:
+	sqfs_path_index_destroy(index);
+	return ret;
+}
+
+int sqfs_path_index_lookup(const sqfs_path_index_t *index, const char *path,
+			   sqfs_u64 *out)
+{
+	sqfs_u32 hash, b, i;
+
+	if (index->buckets == NULL)
+		return SQFS_ERROR_NO_ENTRY;
+
+	hash = path_hash(path);
+	b = get_bucket(index, hash);
+
+	for (i = index->buckets[b]; i < index->buckets[b + 1]; ++i) {
+		const index_ent_t *ent = index->entries + i;
+
+		if (ent->hash != hash)
+			continue;
+
+		if (path_equal(index->strings + ent->path, path)) {
+			*out = ent->inode_ref;
+			return 0;
+		}
+	}
+
+	return SQFS_ERROR_NO_ENTRY;
+}
@@ -13,6 +13,8 @@
 #include "sqfs/inode.h"
 #include "sqfs/dir.h"
 #include "util/util.h"
+#include "meta_internal.h"
+#include "hook_alloc.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -22,6 +24,86 @@
 #define SWAB32(x) x = le32toh(x)
 #define SWAB64(x) x = le64toh(x)
 
+/*
+  Inodes are decoded straight from the uncompressed data of the current meta
+  data block. The meta data reader is only used for stepping into the next
+  block when an inode crosses a block boundary.
+ */
+typedef struct {
+	sqfs_meta_reader_t *m;
+	const sqfs_allocator_t *alloc;
+	const sqfs_u8 *ptr;
+	size_t avail;
+} inode_src_t;
+
+static void src_init(inode_src_t *src, sqfs_meta_reader_t *m)
+{
+	src->m = m;
+	src->alloc = meta_reader_get_allocator(m);
+	meta_reader_peek(m, &src->ptr, &src->avail);
+}
+
+static void src_skip(inode_src_t *src, size_t size)
+{
+	src->ptr += size;
+	src->avail -= size;
+	meta_reader_advance(src->m, size);
+}
+
+static int src_read(inode_src_t *src, void *out, size_t size)
+{
+	int err;
+
+	if (size <= src->avail) {
+		memcpy(out, src->ptr, size);
+		src_skip(src, size);
+		return 0;
+	}
+
+	err = sqfs_meta_reader_read(src->m, out, size);
+	if (err)
+		return err;
+
+	src_init(src, src->m);
+	return 0;
+}
+
+/* read an array of 32 bit little endian values and convert them */
+static int src_read_u32_array(inode_src_t *src, sqfs_u32 *out, size_t count)
+{
+	size_t i, diff;
+	sqfs_u32 val;
+	int err;
+
+	while (count > 0) {
+		diff = src->avail / sizeof(val);
+		if (diff > count)
+			diff = count;
+
+		if (diff == 0) {
+			/* the next value crosses a block boundary */
+			err = src_read(src, &val, sizeof(val));
+			if (err)
+				return err;
+
+			*(out++) = le32toh(val);
+			--count;
+			continue;
+		}
+
+		for (i = 0; i < diff; ++i) {
+			memcpy(&val, src->ptr + i * sizeof(val), sizeof(val));
+			out[i] = le32toh(val);
+		}
+
+		src_skip(src, diff * sizeof(val));
+		out += diff;
+		count -= diff;
+	}
+
+	return 0;
+}
+
 static int set_mode(sqfs_inode_t *inode)
 {
 	inode->mode &= ~S_IFMT;
@@ -75,15 +157,16 @@ static sqfs_u64 get_block_count(sqfs_u64 size, sqfs_u64 block_size,
 	return count;
 }
 
-static int read_inode_file(sqfs_meta_reader_t *ir, sqfs_inode_t *base,
-			   size_t block_size, sqfs_inode_generic_t **result)
+static int read_inode_file(inode_src_t *ir, sqfs_inode_t *base,
+			   size_t block_size, bool no_blocks,
+			   sqfs_inode_generic_t **result)
 {
 	sqfs_inode_generic_t *out;
 	sqfs_inode_file_t file;
-	sqfs_u64 i, count;
+	sqfs_u64 count;
 	int err;
 
-	err = sqfs_meta_reader_read(ir, &file, sizeof(file));
+	err = src_read(ir, &file, sizeof(file));
 	if (err)
 		return err;
 
@@ -95,7 +178,8 @@ static int read_inode_file(sqfs_meta_reader_t *ir, sqfs_inode_t *base,
 	count = get_block_count(file.file_size, block_size,
 				file.fragment_index, file.fragment_offset);
 
-	out = alloc_flex(sizeof(*out), sizeof(sqfs_u32), count);
+	out = hook_alloc_flex(ir->alloc, sizeof(*out), sizeof(sqfs_u32),
+			      no_blocks ? 0 : count);
 	if (out == NULL)
 		return SQFS_ERROR_ALLOC;
 
@@ -104,29 +188,32 @@ static int read_inode_file(sqfs_meta_reader_t *ir, sqfs_inode_t *base,
 	out->block_sizes = (sqfs_u32 *)out->extra;
 	out->num_file_blocks = count;
 
-	err = sqfs_meta_reader_read(ir, out->block_sizes,
-				    count * sizeof(sqfs_u32));
+	if (no_blocks && count > 0) {
+		out->block_sizes = NULL;
+		*result = out;
+		return 0;
+	}
+
+	err = src_read_u32_array(ir, out->block_sizes, count);
 	if (err) {
-		free(out);
+		hook_free(ir->alloc, out);
 		return err;
 	}
 
-	for (i = 0; i < count; ++i)
-		SWAB32(out->block_sizes[i]);
-
 	*result = out;
 	return 0;
 }
 
-static int read_inode_file_ext(sqfs_meta_reader_t *ir, sqfs_inode_t *base,
-			       size_t block_size, sqfs_inode_generic_t **result)
+static int read_inode_file_ext(inode_src_t *ir, sqfs_inode_t *base,
+			       size_t block_size, bool no_blocks,
+			       sqfs_inode_generic_t **result)
 {
 	sqfs_inode_file_ext_t file;
 	sqfs_inode_generic_t *out;
-	sqfs_u64 i, count;
+	sqfs_u64 count;
 	int err;
 
-	err = sqfs_meta_reader_read(ir, &file, sizeof(file));
+	err = src_read(ir, &file, sizeof(file));
 	if (err)
 		return err;
 
@@ -141,7 +228,8 @@ static int read_inode_file_ext(sqfs_meta_reader_t *ir, sqfs_inode_t *base,
 	count = get_block_count(file.file_size, block_size,
 				file.fragment_idx, file.fragment_offset);
 
-	out = alloc_flex(sizeof(*out), sizeof(sqfs_u32), count);
+	out = hook_alloc_flex(ir->alloc, sizeof(*out), sizeof(sqfs_u32),
+			      no_blocks ? 0 : count);
 	if (out == NULL) {
 		return errno == EOVERFLOW ? SQFS_ERROR_OVERFLOW :
 			SQFS_ERROR_ALLOC;
@@ -152,21 +240,23 @@ static int read_inode_file_ext(sqfs_meta_reader_t *ir, sqfs_inode_t *base,
 	out->block_sizes = (sqfs_u32 *)out->extra;
 	out->num_file_blocks = count;
 
-	err = sqfs_meta_reader_read(ir, out->block_sizes,
-				    count * sizeof(sqfs_u32));
+	if (no_blocks && count > 0) {
+		out->block_sizes = NULL;
+		*result = out;
+		return 0;
+	}
+
+	err = src_read_u32_array(ir, out->block_sizes, count);
 	if (err) {
-		free(out);
+		hook_free(ir->alloc, out);
 		return err;
 	}
 
-	for (i = 0; i < count; ++i)
-		SWAB32(out->block_sizes[i]);
-
 	*result = out;
 	return 0;
 }
 
-static int read_inode_slink(sqfs_meta_reader_t *ir, sqfs_inode_t *base,
+static int read_inode_slink(inode_src_t *ir, sqfs_inode_t *base,
 			    sqfs_inode_generic_t **result)
 {
 	sqfs_inode_generic_t *out;
@@ -174,7 +264,7 @@ static int read_inode_slink(sqfs_meta_reader_t *ir, sqfs_inode_t *base,
 	size_t size;
 	int err;
 
-	err = sqfs_meta_reader_read(ir, &slink, sizeof(slink));
+	err = src_read(ir, &slink, sizeof(slink));
 	if (err)
 		return err;
 
@@ -186,7 +276,7 @@ static int read_inode_slink(sqfs_meta_reader_t *ir, sqfs_inode_t *base,
 		return SQFS_ERROR_OVERFLOW;
 	}
 
-	out = calloc(1, size);
+	out = hook_calloc(ir->alloc, size);
 	if (out == NULL)
 		return SQFS_ERROR_ALLOC;
 
@@ -194,9 +284,9 @@ static int read_inode_slink(sqfs_meta_reader_t *ir, sqfs_inode_t *base,
 	out->base = *base;
 	out->data.slink = slink;
 
-	err = sqfs_meta_reader_read(ir, out->slink_target, slink.target_size);
+	err = src_read(ir, out->slink_target, slink.target_size);
 	if (err) {
-		free(out);
+		hook_free(ir->alloc, out);
 		return err;
 	}
 
@@ -204,7 +294,7 @@ static int read_inode_slink(sqfs_meta_reader_t *ir, sqfs_inode_t *base,
 	return 0;
 }
 
-static int read_inode_slink_ext(sqfs_meta_reader_t *ir, sqfs_inode_t *base,
+static int read_inode_slink_ext(inode_src_t *ir, sqfs_inode_t *base,
 				sqfs_inode_generic_t **result)
 {
 	sqfs_u32 xattr;
@@ -214,9 +304,9 @@ static int read_inode_slink_ext(sqfs_meta_reader_t *ir, sqfs_inode_t *base,
 	if (err)
 		return err;
 
-	err = sqfs_meta_reader_read(ir, &xattr, sizeof(xattr));
+	err = src_read(ir, &xattr, sizeof(xattr));
 	if (err) {
-		free(*result);
+		hook_free(ir->alloc, *result);
 		return err;
 	}
 
@@ -224,7 +314,7 @@ static int read_inode_slink_ext(sqfs_meta_reader_t *ir, sqfs_inode_t *base,
 	return 0;
 }
 
-static int read_inode_dir_ext(sqfs_meta_reader_t *ir, sqfs_inode_t *base,
+static int read_inode_dir_ext(inode_src_t *ir, sqfs_inode_t *base,
 			      sqfs_inode_generic_t **result)
 {
 	size_t i, new_sz, index_max, index_used;
@@ -234,7 +324,7 @@ static int read_inode_dir_ext(sqfs_meta_reader_t *ir, sqfs_inode_t *base,
 	void *new;
 	int err;
 
-	err = sqfs_meta_reader_read(ir, &dir, sizeof(dir));
+	err = src_read(ir, &dir, sizeof(dir));
 	if (err)
 		return err;
 
@@ -249,7 +339,7 @@ static int read_inode_dir_ext(sqfs_meta_reader_t *ir, sqfs_inode_t *base,
 	index_max = dir.size ? 128 : 0;
 	index_used = 0;
 
-	out = alloc_flex(sizeof(*out), 1, index_max);
+	out = hook_alloc_flex(ir->alloc, sizeof(*out), 1, index_max);
 	if (out == NULL)
 		return SQFS_ERROR_ALLOC;
 
@@ -262,9 +352,9 @@ static int read_inode_dir_ext(sqfs_meta_reader_t *ir, sqfs_inode_t *base,
 	}
 
 	for (i = 0; i < dir.inodex_count; ++i) {
-		err = sqfs_meta_reader_read(ir, &ent, sizeof(ent));
+		err = src_read(ir, &ent, sizeof(ent));
 		if (err) {
-			free(out);
+			hook_free(ir->alloc, out);
 			return err;
 		}
 
@@ -275,15 +365,16 @@ static int read_inode_dir_ext(sqfs_meta_reader_t *ir, sqfs_inode_t *base,
 		new_sz = index_max;
 		while (sizeof(ent) + ent.size + 1 > new_sz - index_used) {
 			if (SZ_MUL_OV(new_sz, 2, &new_sz)) {
-				free(out);
+				hook_free(ir->alloc, out);
 				return SQFS_ERROR_OVERFLOW;
 			}
 		}
 
 		if (new_sz > index_max) {
-			new = realloc(out, sizeof(*out) + new_sz);
+			new = hook_realloc(ir->alloc, out, sizeof(*out) + index_max,
+					   sizeof(*out) + new_sz);
 			if (new == NULL) {
-				free(out);
+				hook_free(ir->alloc, out);
 				return SQFS_ERROR_ALLOC;
 			}
 			out = new;
@@ -293,12 +384,13 @@ static int read_inode_dir_ext(sqfs_meta_reader_t *ir, sqfs_inode_t *base,
 		memcpy(out->extra + index_used, &ent, sizeof(ent));
 		index_used += sizeof(ent);
 
-		err = sqfs_meta_reader_read(ir, out->extra + index_used,
-					    ent.size + 1);
+		err = src_read(ir, out->extra + index_used, ent.size + 1);
 		if (err) {
-			free(out);
+			hook_free(ir->alloc, out);
 			return err;
 		}
+
+		index_used += ent.size + 1;
 	}
 
 	out->num_dir_idx_bytes = index_used;
@@ -306,13 +398,13 @@ static int read_inode_dir_ext(sqfs_meta_reader_t *ir, sqfs_inode_t *base,
 	return 0;
 }
 
-int sqfs_meta_reader_read_inode(sqfs_meta_reader_t *ir,
-				const sqfs_super_t *super,
-				sqfs_u64 block_start, size_t offset,
-				sqfs_inode_generic_t **result)
+int meta_reader_read_inode(sqfs_meta_reader_t *ir, const sqfs_super_t *super,
+			   sqfs_u64 block_start, size_t offset,
+			   bool no_blocks, sqfs_inode_generic_t **result)
 {
 	sqfs_inode_generic_t *out;
 	sqfs_inode_t inode;
+	inode_src_t src;
 	int err;
 
 	/* read base inode */
@@ -322,7 +414,9 @@ int sqfs_meta_reader_read_inode(sqfs_meta_reader_t *ir,
 	if (err)
 		return err;
 
-	err = sqfs_meta_reader_read(ir, &inode, sizeof(inode));
+	src_init(&src, ir);
+
+	err = src_read(&src, &inode, sizeof(inode));
 	if (err)
 		return err;
 
@@ -340,22 +434,23 @@ int sqfs_meta_reader_read_inode(sqfs_meta_reader_t *ir,
 	/* inode types where the size is variable */
 	switch (inode.type) {
 	case SQFS_INODE_FILE:
-		return read_inode_file(ir, &inode, super->block_size, result);
+		return read_inode_file(&src, &inode, super->block_size,
+				       no_blocks, result);
 	case SQFS_INODE_SLINK:
-		return read_inode_slink(ir, &inode, result);
+		return read_inode_slink(&src, &inode, result);
 	case SQFS_INODE_EXT_FILE:
-		return read_inode_file_ext(ir, &inode, super->block_size,
-					   result);
+		return read_inode_file_ext(&src, &inode, super->block_size,
+					   no_blocks, result);
 	case SQFS_INODE_EXT_SLINK:
-		return read_inode_slink_ext(ir, &inode, result);
+		return read_inode_slink_ext(&src, &inode, result);
 	case SQFS_INODE_EXT_DIR:
-		return read_inode_dir_ext(ir, &inode, result);
+		return read_inode_dir_ext(&src, &inode, result);
 	default:
 		break;
 	}
 
 	/* everything else */
-	out = calloc(1, sizeof(*out));
+	out = hook_calloc(src.alloc, sizeof(*out));
 	if (out == NULL)
 		return SQFS_ERROR_ALLOC;
 
@@ -363,8 +458,7 @@ int sqfs_meta_reader_read_inode(sqfs_meta_reader_t *ir,
 
 	switch (inode.type) {
 	case SQFS_INODE_DIR:
-		err = sqfs_meta_reader_read(ir, &out->data.dir,
-					    sizeof(out->data.dir));
+		err = src_read(&src, &out->data.dir, sizeof(out->data.dir));
 		if (err)
 			goto fail_free;
 
@@ -376,8 +470,7 @@ int sqfs_meta_reader_read_inode(sqfs_meta_reader_t *ir,
 		break;
 	case SQFS_INODE_BDEV:
 	case SQFS_INODE_CDEV:
-		err = sqfs_meta_reader_read(ir, &out->data.dev,
-					    sizeof(out->data.dev));
+		err = src_read(&src, &out->data.dev, sizeof(out->data.dev));
 		if (err)
 			goto fail_free;
 		SWAB32(out->data.dev.nlink);
@@ -385,16 +478,15 @@ int sqfs_meta_reader_read_inode(sqfs_meta_reader_t *ir,
 		break;
 	case SQFS_INODE_FIFO:
 	case SQFS_INODE_SOCKET:
-		err = sqfs_meta_reader_read(ir, &out->data.ipc,
-					    sizeof(out->data.ipc));
+		err = src_read(&src, &out->data.ipc, sizeof(out->data.ipc));
 		if (err)
 			goto fail_free;
 		SWAB32(out->data.ipc.nlink);
 		break;
 	case SQFS_INODE_EXT_BDEV:
 	case SQFS_INODE_EXT_CDEV:
-		err = sqfs_meta_reader_read(ir, &out->data.dev_ext,
-					    sizeof(out->data.dev_ext));
+		err = src_read(&src, &out->data.dev_ext,
+			       sizeof(out->data.dev_ext));
 		if (err)
 			goto fail_free;
 		SWAB32(out->data.dev_ext.nlink);
@@ -403,8 +495,8 @@ int sqfs_meta_reader_read_inode(sqfs_meta_reader_t *ir,
 		break;
 	case SQFS_INODE_EXT_FIFO:
 	case SQFS_INODE_EXT_SOCKET:
-		err = sqfs_meta_reader_read(ir, &out->data.ipc_ext,
-					    sizeof(out->data.ipc_ext));
+		err = src_read(&src, &out->data.ipc_ext,
+			       sizeof(out->data.ipc_ext));
 		if (err)
 			goto fail_free;
 		SWAB32(out->data.ipc_ext.nlink);
@@ -418,6 +510,210 @@ int sqfs_meta_reader_read_inode(sqfs_meta_reader_t *ir,
 	*result = out;
 	return 0;
 fail_free:
-	free(out);
+	hook_free(src.alloc, out);
 	return err;
 }
+
+int sqfs_meta_reader_read_inode(sqfs_meta_reader_t *ir,
+				const sqfs_super_t *super,
+				sqfs_u64 block_start, size_t offset,
+				sqfs_inode_generic_t **result)
+{
+	return meta_reader_read_inode(ir, super, block_start, offset,
+				      false, result);
+}
+
+/*
+  The encoded bytes of an inode are copied into the buffer for as long as
+  they fit, but are always counted, so the caller learns the size needed.
+ */
+typedef struct {
+	sqfs_u8 *ptr;
+	size_t max;
+	size_t used;
+} raw_buf_t;
+
+static int raw_append(raw_buf_t *raw, const void *data, size_t size)
+{
+	if (raw->used <= raw->max && size <= raw->max - raw->used)
+		memcpy(raw->ptr + raw->used, data, size);
+
+	if (SZ_ADD_OV(raw->used, size, &raw->used))
+		return SQFS_ERROR_OVERFLOW;
+
+	return 0;
+}
+
+/* if out is not NULL, the bytes are also stored there, e.g. for decoding */
+static int raw_read(inode_src_t *src, raw_buf_t *raw, void *out,
+		    sqfs_u64 size)
+{
+	sqfs_u8 scratch[256];
+	size_t diff;
+	int err;
+
+	if (out != NULL) {
+		err = src_read(src, out, size);
+		if (err)
+			return err;
+
+		return raw_append(raw, out, size);
+	}
+
+	while (size > 0) {
+		diff = size < sizeof(scratch) ? size : sizeof(scratch);
+
+		err = src_read(src, scratch, diff);
+		if (err)
+			return err;
+
+		err = raw_append(raw, scratch, diff);
+		if (err)
+			return err;
+
+		size -= diff;
+	}
+
+	return 0;
+}
+
+static int raw_read_file(inode_src_t *src, raw_buf_t *raw, sqfs_u16 type,
+			 size_t block_size)
+{
+	sqfs_inode_file_ext_t file_ext;
+	sqfs_inode_file_t file;
+	sqfs_u64 count;
+	int err;
+
+	if (type == SQFS_INODE_FILE) {
+		err = raw_read(src, raw, &file, sizeof(file));
+		if (err)
+			return err;
+
+		count = get_block_count(le32toh(file.file_size), block_size,
+					le32toh(file.fragment_index),
+					le32toh(file.fragment_offset));
+	} else {
+		err = raw_read(src, raw, &file_ext, sizeof(file_ext));
+		if (err)
+			return err;
+
+		count = get_block_count(le64toh(file_ext.file_size),
+					block_size,
+					le32toh(file_ext.fragment_idx),
+					le32toh(file_ext.fragment_offset));
+	}
+
+	if (count > (~((sqfs_u64)0) / sizeof(sqfs_u32)))
+		return SQFS_ERROR_OVERFLOW;
+
+	return raw_read(src, raw, NULL, count * sizeof(sqfs_u32));
+}
+
+static int raw_read_dir_ext(inode_src_t *src, raw_buf_t *raw)
+{
+	sqfs_inode_dir_ext_t dir;
+	sqfs_dir_index_t ent;
+	size_t i;
+	int err;
+
+	err = raw_read(src, raw, &dir, sizeof(dir));
+	if (err)
+		return err;
+
+	/* same as the decoder, which ignores the index of empty directories */
+	if (dir.size == 0)
+		return 0;
+
+	for (i = 0; i < le16toh(dir.inodex_count); ++i) {
+		err = raw_read(src, raw, &ent, sizeof(ent));
+		if (err)
+			return err;
+
+		err = raw_read(src, raw, NULL, (sqfs_u64)le32toh(ent.size) + 1);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+int sqfs_meta_reader_read_raw_inode(sqfs_meta_reader_t *ir,
+				    const sqfs_super_t *super,
+				    sqfs_u64 block_start, size_t offset,
+				    void *buffer, size_t max, size_t *size)
+{
+	sqfs_inode_slink_t slink;
+	raw_buf_t raw;
+	sqfs_inode_t base;
+	inode_src_t src;
+	sqfs_u16 type;
+	int err;
+
+	raw.ptr = buffer;
+	raw.max = max;
+	raw.used = 0;
+
+	err = sqfs_meta_reader_seek(ir, block_start + super->inode_table_start,
+				    offset);
+	if (err)
+		return err;
+
+	src_init(&src, ir);
+
+	err = raw_read(&src, &raw, &base, sizeof(base));
+	if (err)
+		return err;
+
+	type = le16toh(base.type);
+
+	switch (type) {
+	case SQFS_INODE_DIR:
+		err = raw_read(&src, &raw, NULL, sizeof(sqfs_inode_dir_t));
+		break;
+	case SQFS_INODE_EXT_DIR:
+		err = raw_read_dir_ext(&src, &raw);
+		break;
+	case SQFS_INODE_FILE:
+	case SQFS_INODE_EXT_FILE:
+		err = raw_read_file(&src, &raw, type, super->block_size);
+		break;
+	case SQFS_INODE_SLINK:
+	case SQFS_INODE_EXT_SLINK:
+		err = raw_read(&src, &raw, &slink, sizeof(slink));
+		if (err)
+			break;
+
+		err = raw_read(&src, &raw, NULL, le32toh(slink.target_size));
+		if (err || type == SQFS_INODE_SLINK)
+			break;
+
+		/* the xattr index follows the target */
+		err = raw_read(&src, &raw, NULL, sizeof(sqfs_u32));
+		break;
+	case SQFS_INODE_BDEV:
+	case SQFS_INODE_CDEV:
+		err = raw_read(&src, &raw, NULL, sizeof(sqfs_inode_dev_t));
+		break;
+	case SQFS_INODE_EXT_BDEV:
+	case SQFS_INODE_EXT_CDEV:
+		err = raw_read(&src, &raw, NULL, sizeof(sqfs_inode_dev_ext_t));
+		break;
+	case SQFS_INODE_FIFO:
+	case SQFS_INODE_SOCKET:
+		err = raw_read(&src, &raw, NULL, sizeof(sqfs_inode_ipc_t));
+		break;
+	case SQFS_INODE_EXT_FIFO:
+	case SQFS_INODE_EXT_SOCKET:
+		err = raw_read(&src, &raw, NULL, sizeof(sqfs_inode_ipc_ext_t));
+		break;
+	default:
+		return SQFS_ERROR_UNSUPPORTED;
+	}
+
+	if (err)
+		return err;
+
+	*size = raw.used;
+	return raw.used > max ? SQFS_ERROR_OVERFLOW : 0;
+}
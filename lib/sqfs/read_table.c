@@ -7,28 +7,68 @@
 #define SQFS_BUILDING_DLL
 #include "config.h"
 
-#include "sqfs/meta_reader.h"
+#include "sqfs/compressor.h"
 #include "sqfs/error.h"
 #include "sqfs/table.h"
+#include "sqfs/trace.h"
 #include "sqfs/block.h"
 #include "sqfs/io.h"
 #include "util/util.h"
+#include "blk_parallel.h"
 
 #include <stdlib.h>
+#include <string.h>
 
-int sqfs_read_table(sqfs_file_t *file, sqfs_compressor_t *cmp,
-		    size_t table_size, sqfs_u64 location, sqfs_u64 lower_limit,
-		    sqfs_u64 upper_limit, void **out)
+typedef struct {
+	sqfs_u8 *raw;
+	size_t *raw_size;
+	bool *compressed;
+	sqfs_u8 *data;
+	size_t table_size;
+} read_state_t;
+
+static int uncompress_block(void *user, sqfs_compressor_t *cmp, size_t index)
+{
+	read_state_t *state = user;
+	const sqfs_u8 *in = state->raw + index * SQFS_META_BLOCK_SIZE;
+	sqfs_u8 *out = state->data + index * SQFS_META_BLOCK_SIZE;
+	size_t size = state->table_size - index * SQFS_META_BLOCK_SIZE;
+	size_t in_size = state->raw_size[index];
+	sqfs_s32 ret;
+
+	if (size > SQFS_META_BLOCK_SIZE)
+		size = SQFS_META_BLOCK_SIZE;
+
+	if (state->compressed[index]) {
+		ret = cmp->do_block(cmp, in, in_size, out,
+				    SQFS_META_BLOCK_SIZE);
+		if (ret < 0)
+			return ret;
+
+		in_size = ret;
+	} else {
+		memcpy(out, in, in_size);
+	}
+
+	/* every block but the last one must be full */
+	return in_size < size ? SQFS_ERROR_CORRUPTED : 0;
+}
+
+int sqfs_read_table_parallel(sqfs_file_t *file, sqfs_compressor_t *cmp,
+			     size_t table_size, sqfs_u64 location,
+			     sqfs_u64 lower_limit, sqfs_u64 upper_limit,
+			     void **out, unsigned int num_workers)
 {
-	size_t diff, block_count, blk_idx = 0;
+	size_t i, block_count;
 	sqfs_u64 start, *locations;
-	sqfs_meta_reader_t *m;
-	void *data, *ptr;
+	read_state_t state;
+	sqfs_u16 header;
 	int err;
 
-	data = malloc(table_size);
-	if (data == NULL)
-		return SQFS_ERROR_ALLOC;
+	memset(&state, 0, sizeof(state));
+	*out = NULL;
+
+	sqfs_trace_begin("table", "read table");
 
 	/* restore list from image */
 	block_count = table_size / SQFS_META_BLOCK_SIZE;
@@ -37,55 +77,81 @@ int sqfs_read_table(sqfs_file_t *file, sqfs_compressor_t *cmp,
 		++block_count;
 
 	locations = alloc_array(sizeof(sqfs_u64), block_count);
-
-	if (locations == NULL) {
+	state.raw = alloc_array(SQFS_META_BLOCK_SIZE, block_count);
+	state.data = alloc_array(SQFS_META_BLOCK_SIZE, block_count);
+	state.raw_size = alloc_array(sizeof(state.raw_size[0]), block_count);
+	state.compressed = alloc_array(sizeof(state.compressed[0]),
+				       block_count);
+
+	if (locations == NULL || state.raw == NULL || state.data == NULL ||
+	    state.raw_size == NULL || state.compressed == NULL) {
 		err = SQFS_ERROR_ALLOC;
-		goto fail_data;
+		goto fail;
 	}
 
 	err = file->read_at(file, location, locations,
 			    sizeof(sqfs_u64) * block_count);
 	if (err)
-		goto fail_idx;
+		goto fail;
 
-	/* Read the actual data */
-	m = sqfs_meta_reader_create(file, cmp, lower_limit, upper_limit);
-	if (m == NULL) {
-		err = SQFS_ERROR_ALLOC;
-		goto fail_idx;
-	}
+	/* read the raw blocks, the file is only accessed from this thread */
+	for (i = 0; i < block_count; ++i) {
+		start = le64toh(locations[i]);
 
-	ptr = data;
-
-	while (table_size > 0) {
-		start = le64toh(locations[blk_idx++]);
+		if (start < lower_limit || start >= upper_limit ||
+		    (upper_limit - start) < 2) {
+			err = SQFS_ERROR_OUT_OF_BOUNDS;
+			goto fail;
+		}
 
-		err = sqfs_meta_reader_seek(m, start, 0);
+		err = file->read_at(file, start, &header, sizeof(header));
 		if (err)
 			goto fail;
 
-		diff = SQFS_META_BLOCK_SIZE;
-		if (diff > table_size)
-			diff = table_size;
+		header = le16toh(header);
+		state.compressed[i] = (header & 0x8000) == 0;
+		state.raw_size[i] = header & 0x7FFF;
 
-		err = sqfs_meta_reader_read(m, ptr, diff);
-		if (err)
+		if (state.raw_size[i] > SQFS_META_BLOCK_SIZE) {
+			err = SQFS_ERROR_CORRUPTED;
+			goto fail;
+		}
+
+		if ((start + 2 + state.raw_size[i]) > upper_limit) {
+			err = SQFS_ERROR_OUT_OF_BOUNDS;
 			goto fail;
+		}
 
-		ptr = (char *)ptr + diff;
-		table_size -= diff;
+		err = file->read_at(file, start + 2,
+				    state.raw + i * SQFS_META_BLOCK_SIZE,
+				    state.raw_size[i]);
+		if (err)
+			goto fail;
 	}
 
-	sqfs_meta_reader_destroy(m);
-	free(locations);
-	*out = data;
-	return 0;
+	state.table_size = table_size;
+
+	err = blk_parallel_run(cmp, block_count, num_workers,
+			       uncompress_block, &state);
+	if (err)
+		goto fail;
+
+	*out = state.data;
+	state.data = NULL;
 fail:
-	sqfs_meta_reader_destroy(m);
-fail_idx:
+	free(state.compressed);
+	free(state.raw_size);
+	free(state.data);
+	free(state.raw);
 	free(locations);
-fail_data:
-	free(data);
-	*out = NULL;
+	sqfs_trace_end("table", "read table");
 	return err;
 }
+
+int sqfs_read_table(sqfs_file_t *file, sqfs_compressor_t *cmp,
+		    size_t table_size, sqfs_u64 location, sqfs_u64 lower_limit,
+		    sqfs_u64 upper_limit, void **out)
+{
+	return sqfs_read_table_parallel(file, cmp, table_size, location,
+					lower_limit, upper_limit, out, 1);
+}
@@ -13,13 +13,107 @@
 #include "sqfs/id_table.h"
 #include "sqfs/super.h"
 #include "sqfs/inode.h"
+#include "sqfs/trace.h"
 #include "sqfs/error.h"
 #include "sqfs/dir.h"
 #include "util/util.h"
+#include "dir_internal.h"
 
 #include <string.h>
 #include <stdlib.h>
 
+#define TREE_CHUNK_SIZE (1024 * 1024)
+
+typedef struct tree_chunk_t {
+	struct tree_chunk_t *next;
+	size_t used;
+	size_t size;
+	sqfs_u8 data[];
+} tree_chunk_t;
+
+/* backing memory for all nodes and inodes of a SQFS_TREE_COMPACT tree */
+struct sqfs_tree_arena_t {
+	tree_chunk_t *chunks;
+};
+
+static void *arena_alloc(sqfs_tree_arena_t *arena, size_t size)
+{
+	tree_chunk_t *chunk = arena->chunks;
+	void *ptr;
+
+	size = (size + sizeof(sqfs_u64) - 1) & ~(sizeof(sqfs_u64) - 1);
+
+	if (chunk == NULL || (chunk->size - chunk->used) < size) {
+		chunk = alloc_flex(sizeof(*chunk), 1, size > TREE_CHUNK_SIZE ?
+				   size : TREE_CHUNK_SIZE);
+		if (chunk == NULL)
+			return NULL;
+
+		chunk->size = size > TREE_CHUNK_SIZE ? size : TREE_CHUNK_SIZE;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+
+	ptr = chunk->data + chunk->used;
+	chunk->used += size;
+	return ptr;
+}
+
+static void arena_destroy(sqfs_tree_arena_t *arena)
+{
+	tree_chunk_t *chunk;
+
+	while (arena->chunks != NULL) {
+		chunk = arena->chunks;
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+
+	free(arena);
+}
+
+static size_t inode_extra_size(const sqfs_inode_generic_t *inode)
+{
+	switch (inode->base.type) {
+	case SQFS_INODE_FILE:
+	case SQFS_INODE_EXT_FILE:
+		if (inode->block_sizes == NULL)
+			return 0;
+		return inode->num_file_blocks * sizeof(sqfs_u32);
+	case SQFS_INODE_SLINK:
+	case SQFS_INODE_EXT_SLINK:
+		return strlen(inode->slink_target) + 1;
+	case SQFS_INODE_EXT_DIR:
+		return inode->num_dir_idx_bytes;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+/* move an inode into the arena, freeing the original on success */
+static sqfs_inode_generic_t *arena_move_inode(sqfs_tree_arena_t *arena,
+					      sqfs_inode_generic_t *inode)
+{
+	size_t size = sizeof(*inode) + inode_extra_size(inode);
+	sqfs_inode_generic_t *copy = arena_alloc(arena, size);
+
+	if (copy == NULL)
+		return NULL;
+
+	memcpy(copy, inode, size);
+
+	if (inode->block_sizes != NULL)
+		copy->block_sizes = (sqfs_u32 *)copy->extra;
+
+	if (inode->slink_target != NULL)
+		copy->slink_target = (char *)copy->extra;
+
+	free(inode);
+	return copy;
+}
+
 static int should_skip(int type, unsigned int flags)
 {
 	switch (type) {
@@ -56,50 +150,134 @@ static bool would_be_own_parent(sqfs_tree_node_t *parent, sqfs_tree_node_t *n)
 	return false;
 }
 
-static sqfs_tree_node_t *create_node(sqfs_inode_generic_t *inode,
-				     const char *name)
+static bool is_dir(const sqfs_inode_generic_t *inode)
+{
+	return inode->base.type == SQFS_INODE_DIR ||
+		inode->base.type == SQFS_INODE_EXT_DIR;
+}
+
+/* without reading a directory, we can only tell if it is empty on disk */
+static bool is_empty_on_disk(const sqfs_inode_generic_t *inode)
+{
+	size_t size;
+
+	if (inode->base.type == SQFS_INODE_EXT_DIR) {
+		size = inode->data.dir_ext.size;
+	} else {
+		size = inode->data.dir.size;
+	}
+
+	return size <= sizeof(sqfs_dir_header_t);
+}
+
+/*
+  Takes ownership of the inode on success. For a compact tree, the inode is
+  moved into the arena, so the original pointer must no longer be used.
+ */
+static sqfs_tree_node_t *create_node(sqfs_tree_arena_t *arena,
+				     sqfs_inode_generic_t *inode, sqfs_u64 ref,
+				     const char *name, size_t len)
 {
 	sqfs_tree_node_t *n;
 
-	n = alloc_flex(sizeof(*n), 1, strlen(name) + 1);
-	if (n == NULL)
-		return NULL;
+	if (arena == NULL) {
+		n = alloc_flex(sizeof(*n), 1, len + 1);
+		if (n == NULL)
+			return NULL;
+	} else {
+		n = arena_alloc(arena, sizeof(*n) + len + 1);
+		if (n == NULL)
+			return NULL;
+
+		memset(n, 0, sizeof(*n));
+
+		inode = arena_move_inode(arena, inode);
+		if (inode == NULL)
+			return NULL;
+
+		n->arena = arena;
+	}
 
 	n->inode = inode;
-	strcpy((char *)n->name, name);
+	n->inode_ref = ref;
+	memcpy(n->name, name, len);
+	n->name[len] = '\0';
 	return n;
 }
 
-static int fill_dir(sqfs_dir_reader_t *dr, sqfs_tree_node_t *root,
-		    unsigned int flags)
+/* nodes in an arena are simply left unused, freed along with the tree */
+static void free_node(sqfs_tree_node_t *n)
+{
+	if (n->arena == NULL) {
+		free(n->inode);
+		free(n);
+	}
+}
+
+/* read the inode of the current directory entry */
+static int get_entry_inode(sqfs_dir_reader_t *rd, sqfs_u32 flags,
+			   sqfs_inode_generic_t **out, sqfs_u64 *ref)
+{
+	*ref = dir_reader_inode_ref(rd, false);
+
+	return dir_reader_read_inode(rd, *ref,
+				     (flags & SQFS_TREE_NO_BLOCK_LISTS) != 0,
+				     out);
+}
+
+static int resolve_ids(sqfs_tree_node_t *n, const sqfs_id_table_t *idtbl)
+{
+	int err;
+
+	err = sqfs_id_table_index_to_id(idtbl, n->inode->base.uid_idx,
+					&n->uid);
+	if (err)
+		return err;
+
+	return sqfs_id_table_index_to_id(idtbl, n->inode->base.gid_idx,
+					 &n->gid);
+}
+
+static int fill_dir(sqfs_dir_reader_t *dr, const sqfs_id_table_t *idtbl,
+		    sqfs_tree_node_t *root, sqfs_u32 flags)
 {
 	sqfs_tree_node_t *n, *prev, **tail;
+	const sqfs_dir_entry_t *ent;
 	sqfs_inode_generic_t *inode;
-	sqfs_dir_entry_t *ent;
+	sqfs_u64 ref;
 	int err;
 
 	tail = &root->children;
 
 	for (;;) {
-		err = sqfs_dir_reader_read(dr, &ent);
+		err = sqfs_dir_reader_next(dr, &ent);
 		if (err > 0)
 			break;
 		if (err < 0)
 			return err;
 
-		if (should_skip(ent->type, flags)) {
-			free(ent);
+		if (should_skip(ent->type, flags))
 			continue;
-		}
 
-		err = sqfs_dir_reader_get_inode(dr, &inode);
-		if (err) {
-			free(ent);
+		err = dir_reader_filter_entry(dr, root, ent);
+		if (err < 0)
 			return err;
+		if (err > 0)
+			continue;
+
+		err = get_entry_inode(dr, flags, &inode, &ref);
+		if (err)
+			return err;
+
+		if ((flags & SQFS_TREE_LAZY) && (flags & SQFS_TREE_NO_EMPTY) &&
+		    is_dir(inode) && is_empty_on_disk(inode)) {
+			free(inode);
+			continue;
 		}
 
-		n = create_node(inode, (const char *)ent->name);
-		free(ent);
+		n = create_node(root->arena, inode, ref,
+				(const char *)ent->name,
+				strlen((const char *)ent->name));
 
 		if (n == NULL) {
 			free(inode);
@@ -107,42 +285,46 @@ static int fill_dir(sqfs_dir_reader_t *dr, sqfs_tree_node_t *root,
 		}
 
 		if (would_be_own_parent(root, n)) {
-			free(n);
-			free(inode);
+			free_node(n);
 			return SQFS_ERROR_LINK_LOOP;
 		}
 
 		*tail = n;
 		tail = &n->next;
 		n->parent = root;
+
+		err = resolve_ids(n, idtbl);
+		if (err)
+			return err;
 	}
 
+	if (flags & SQFS_TREE_LAZY)
+		return 0;
+
 	n = root->children;
 	prev = NULL;
 
 	while (n != NULL) {
-		if (n->inode->base.type == SQFS_INODE_DIR ||
-		    n->inode->base.type == SQFS_INODE_EXT_DIR) {
+		if (is_dir(n->inode)) {
 			if (!(flags & SQFS_TREE_NO_RECURSE)) {
 				err = sqfs_dir_reader_open_dir(dr, n->inode);
 				if (err)
 					return err;
 
-				err = fill_dir(dr, n, flags);
+				err = fill_dir(dr, idtbl, n, flags);
 				if (err)
 					return err;
 			}
 
 			if (n->children == NULL &&
 			    (flags & SQFS_TREE_NO_EMPTY)) {
-				free(n->inode);
 				if (prev == NULL) {
 					root->children = root->children->next;
-					free(n);
+					free_node(n);
 					n = root->children;
 				} else {
 					prev->next = n->next;
-					free(n);
+					free_node(n);
 					n = prev->next;
 				}
 				continue;
@@ -156,27 +338,15 @@ static int fill_dir(sqfs_dir_reader_t *dr, sqfs_tree_node_t *root,
 	return 0;
 }
 
-static int resolve_ids(sqfs_tree_node_t *root, const sqfs_id_table_t *idtbl)
-{
-	sqfs_tree_node_t *it;
-	int err;
-
-	for (it = root->children; it != NULL; it = it->next)
-		resolve_ids(it, idtbl);
-
-	err = sqfs_id_table_index_to_id(idtbl, root->inode->base.uid_idx,
-					&root->uid);
-	if (err)
-		return err;
-
-	return sqfs_id_table_index_to_id(idtbl, root->inode->base.gid_idx,
-					 &root->gid);
-}
-
 void sqfs_dir_tree_destroy(sqfs_tree_node_t *root)
 {
 	sqfs_tree_node_t *it;
 
+	if (root->arena != NULL) {
+		arena_destroy(root->arena);
+		return;
+	}
+
 	while (root->children != NULL) {
 		it = root->children;
 		root->children = it->next;
@@ -188,31 +358,80 @@ void sqfs_dir_tree_destroy(sqfs_tree_node_t *root)
 	free(root);
 }
 
-int sqfs_dir_reader_get_full_hierarchy(sqfs_dir_reader_t *rd,
-				       const sqfs_id_table_t *idtbl,
-				       const char *path, unsigned int flags,
-				       sqfs_tree_node_t **out)
+static int expand_node(sqfs_dir_reader_t *rd, const sqfs_id_table_t *idtbl,
+		       sqfs_tree_node_t *node, sqfs_u32 flags)
+{
+	sqfs_tree_node_t *it;
+	int ret;
+
+	if (flags & ~SQFS_TREE_ALL_FLAGS)
+		return SQFS_ERROR_UNSUPPORTED;
+
+	if (!is_dir(node->inode))
+		return SQFS_ERROR_NOT_DIR;
+
+	if (node->children != NULL)
+		return 0;
+
+	ret = sqfs_dir_reader_open_dir(rd, node->inode);
+	if (ret)
+		return ret;
+
+	ret = fill_dir(rd, idtbl, node, flags | SQFS_TREE_LAZY);
+	if (ret) {
+		if (node->arena != NULL) {
+			node->children = NULL;
+			return ret;
+		}
+
+		while (node->children != NULL) {
+			it = node->children;
+			node->children = it->next;
+			sqfs_dir_tree_destroy(it);
+		}
+	}
+
+	return ret;
+}
+
+static int read_hierarchy(sqfs_dir_reader_t *rd, const sqfs_id_table_t *idtbl,
+			  const char *path, unsigned int flags,
+			  sqfs_tree_node_t **out)
 {
 	sqfs_tree_node_t *root, *tail, *new;
+	sqfs_tree_arena_t *arena = NULL;
 	sqfs_inode_generic_t *inode;
-	sqfs_dir_entry_t *ent;
 	const char *ptr;
+	sqfs_u64 ref;
+	char *name;
 	int ret;
 
 	if (flags & ~SQFS_TREE_ALL_FLAGS)
 		return SQFS_ERROR_UNSUPPORTED;
 
+	if (flags & SQFS_TREE_COMPACT) {
+		arena = calloc(1, sizeof(*arena));
+		if (arena == NULL)
+			return SQFS_ERROR_ALLOC;
+	}
+
 	ret = sqfs_dir_reader_get_root_inode(rd, &inode);
 	if (ret)
-		return ret;
+		goto fail_arena;
 
-	root = tail = create_node(inode, "");
+	root = tail = create_node(arena, inode,
+				  dir_reader_inode_ref(rd, true), "", 0);
 	if (root == NULL) {
 		free(inode);
-		return SQFS_ERROR_ALLOC;
+		ret = SQFS_ERROR_ALLOC;
+		goto fail_arena;
 	}
 	inode = NULL;
 
+	ret = resolve_ids(root, idtbl);
+	if (ret)
+		goto fail;
+
 	while (path != NULL && *path != '\0') {
 		if (*path == '/' || *path == '\\') {
 			while (*path == '/' || *path == '\\')
@@ -234,30 +453,25 @@ int sqfs_dir_reader_get_full_hierarchy(sqfs_dir_reader_t *rd,
 			}
 		}
 
-		for (;;) {
-			ret = sqfs_dir_reader_read(rd, &ent);
-			if (ret < 0)
-				goto fail;
-			if (ret > 0) {
-				ret = SQFS_ERROR_NO_ENTRY;
-				goto fail;
-			}
-
-			ret = strncmp((const char *)ent->name,
-				      path, ptr - path);
-			if (ret == 0 && ent->name[ptr - path] == '\0')
-				break;
-			free(ent);
+		name = malloc(ptr - path + 1);
+		if (name == NULL) {
+			ret = SQFS_ERROR_ALLOC;
+			goto fail;
 		}
 
-		ret = sqfs_dir_reader_get_inode(rd, &inode);
-		if (ret) {
-			free(ent);
+		memcpy(name, path, ptr - path);
+		name[ptr - path] = '\0';
+
+		ret = sqfs_dir_reader_find(rd, name);
+		free(name);
+		if (ret)
+			goto fail;
+
+		ret = get_entry_inode(rd, flags, &inode, &ref);
+		if (ret)
 			goto fail;
-		}
 
-		new = create_node(inode, (const char *)ent->name);
-		free(ent);
+		new = create_node(arena, inode, ref, path, ptr - path);
 
 		if (new == NULL) {
 			free(inode);
@@ -272,30 +486,304 @@ int sqfs_dir_reader_get_full_hierarchy(sqfs_dir_reader_t *rd,
 			tail->children = new;
 			new->parent = tail;
 			tail = new;
+		} else if (arena != NULL) {
+			root = tail = new;
 		} else {
 			sqfs_dir_tree_destroy(root);
 			root = tail = new;
 		}
+
+		ret = resolve_ids(new, idtbl);
+		if (ret)
+			goto fail;
 	}
 
-	if (tail->inode->base.type == SQFS_INODE_DIR ||
-	    tail->inode->base.type == SQFS_INODE_EXT_DIR) {
+	if (is_dir(tail->inode)) {
 		ret = sqfs_dir_reader_open_dir(rd, tail->inode);
 		if (ret)
 			goto fail;
 
-		ret = fill_dir(rd, tail, flags);
+		ret = fill_dir(rd, idtbl, tail, flags);
 		if (ret)
 			goto fail;
 	}
 
+	*out = root;
+	return 0;
+fail:
+	sqfs_dir_tree_destroy(root);
+	return ret;
+fail_arena:
+	if (arena != NULL)
+		arena_destroy(arena);
+	return ret;
+}
+
+static bool is_separator(char c)
+{
+	return c == '/' || c == '\\';
+}
+
+static size_t component_len(const char *path)
+{
+	size_t len = 0;
+
+	while (path[len] != '\0' && !is_separator(path[len]))
+		++len;
+
+	return len;
+}
+
+static int compare_components(const void *lhs, const void *rhs)
+{
+	const char *a = *((const char *const *)lhs);
+	const char *b = *((const char *const *)rhs);
+	size_t a_len = component_len(a), b_len = component_len(b);
+	int ret = memcmp(a, b, a_len < b_len ? a_len : b_len);
+
+	if (ret == 0 && a_len != b_len)
+		ret = a_len < b_len ? -1 : 1;
+
+	return ret;
+}
+
+/* number of paths, starting with the first one, with the same component */
+static size_t group_size(const char **paths, size_t count)
+{
+	size_t i = 1;
+
+	while (i < count && compare_components(paths, paths + i) == 0)
+		++i;
+
+	return i;
+}
+
+/*
+  Attach the parts of a directory that the given paths, relative to it, lead
+  to. The paths are sorted by their first component, so the entries can be
+  looked up in directory order and every directory along the way is only
+  opened and searched once, no matter how many of the paths go through it.
+ */
+static int read_subset(sqfs_dir_reader_t *rd, const sqfs_id_table_t *idtbl,
+		       sqfs_tree_node_t *root, const char **paths,
+		       size_t count, sqfs_u32 flags)
+{
+	sqfs_tree_node_t *n, **tail = &root->children;
+	sqfs_inode_generic_t *inode;
+	size_t i, j, k, len;
+	sqfs_u64 ref;
+	int ret;
+
+	for (i = 0; i < count; ++i) {
+		while (is_separator(*paths[i]))
+			++paths[i];
+
+		/* the entire sub tree is requested, the rest is included */
+		if (*paths[i] == '\0') {
+			if (!is_dir(root->inode))
+				return 0;
+
+			ret = sqfs_dir_reader_open_dir(rd, root->inode);
+			if (ret)
+				return ret;
+
+			return fill_dir(rd, idtbl, root, flags);
+		}
+	}
+
+	if (count == 0)
+		return 0;
+
+	qsort(paths, count, sizeof(paths[0]), compare_components);
+
+	ret = sqfs_dir_reader_open_dir(rd, root->inode);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < count; i += group_size(paths + i, count - i)) {
+		len = component_len(paths[i]);
+
+		ret = dir_reader_find_name(rd, paths[i], len);
+		if (ret)
+			return ret;
+
+		ret = get_entry_inode(rd, flags, &inode, &ref);
+		if (ret)
+			return ret;
+
+		n = create_node(root->arena, inode, ref, paths[i], len);
+		if (n == NULL) {
+			free(inode);
+			return SQFS_ERROR_ALLOC;
+		}
+
+		*tail = n;
+		tail = &n->next;
+		n->parent = root;
+
+		ret = resolve_ids(n, idtbl);
+		if (ret)
+			return ret;
+	}
+
+	n = root->children;
+
+	for (i = 0; i < count; i += j) {
+		j = group_size(paths + i, count - i);
+		len = component_len(paths[i]);
+
+		for (k = i; k < i + j; ++k)
+			paths[k] += len;
+
+		ret = read_subset(rd, idtbl, n, paths + i, j, flags);
+		if (ret)
+			return ret;
+
+		n = n->next;
+	}
+
+	return 0;
+}
+
+int sqfs_dir_reader_expand_node(sqfs_dir_reader_t *rd,
+				const sqfs_id_table_t *idtbl,
+				sqfs_tree_node_t *node, sqfs_u32 flags)
+{
+	const sqfs_allocator_t *alloc;
+	int ret;
+
+	/* sqfs_dir_tree_destroy releases the inodes with free() */
+	alloc = dir_reader_swap_allocator(rd, NULL);
+	ret = expand_node(rd, idtbl, node, flags);
+	dir_reader_swap_allocator(rd, alloc);
+	return ret;
+}
+
+int sqfs_dir_reader_load_block_list(sqfs_dir_reader_t *rd,
+				    sqfs_tree_node_t *node)
+{
+	sqfs_inode_generic_t *inode, *copy;
+	const sqfs_allocator_t *alloc;
+	int ret;
+
+	if (node->inode->base.type != SQFS_INODE_FILE &&
+	    node->inode->base.type != SQFS_INODE_EXT_FILE) {
+		return SQFS_ERROR_NOT_FILE;
+	}
+
+	if (node->inode->block_sizes != NULL)
+		return 0;
+
+	/* sqfs_dir_tree_destroy releases the inodes with free() */
+	alloc = dir_reader_swap_allocator(rd, NULL);
+	ret = dir_reader_read_inode(rd, node->inode_ref, false, &inode);
+	dir_reader_swap_allocator(rd, alloc);
+	if (ret)
+		return ret;
+
+	/* the old inode stays in the arena, until the tree is destroyed */
+	if (node->arena != NULL) {
+		copy = arena_move_inode(node->arena, inode);
+		if (copy == NULL) {
+			free(inode);
+			return SQFS_ERROR_ALLOC;
+		}
+		inode = copy;
+	} else {
+		free(node->inode);
+	}
+
+	node->inode = inode;
+	return 0;
+}
+
+static int read_subtrees(sqfs_dir_reader_t *rd, const sqfs_id_table_t *idtbl,
+			 const char *const *paths, size_t count,
+			 sqfs_u32 flags, sqfs_tree_node_t **out)
+{
+	sqfs_tree_arena_t *arena = NULL;
+	sqfs_inode_generic_t *inode;
+	sqfs_tree_node_t *root;
+	const char **copy;
+	int ret;
+
+	if (flags & ~SQFS_TREE_ALL_FLAGS)
+		return SQFS_ERROR_UNSUPPORTED;
+
+	if (flags & SQFS_TREE_COMPACT) {
+		arena = calloc(1, sizeof(*arena));
+		if (arena == NULL)
+			return SQFS_ERROR_ALLOC;
+	}
+
+	ret = sqfs_dir_reader_get_root_inode(rd, &inode);
+	if (ret)
+		goto fail_arena;
+
+	root = create_node(arena, inode, dir_reader_inode_ref(rd, true),
+			   "", 0);
+	if (root == NULL) {
+		free(inode);
+		ret = SQFS_ERROR_ALLOC;
+		goto fail_arena;
+	}
+
 	ret = resolve_ids(root, idtbl);
 	if (ret)
 		goto fail;
 
+	/* the paths are sorted and advanced in place while descending */
+	copy = alloc_array(sizeof(copy[0]), count + 1);
+	if (copy == NULL) {
+		ret = SQFS_ERROR_ALLOC;
+		goto fail;
+	}
+
+	memcpy(copy, paths, count * sizeof(copy[0]));
+	ret = read_subset(rd, idtbl, root, copy, count, flags);
+	free(copy);
+	if (ret)
+		goto fail;
+
 	*out = root;
 	return 0;
 fail:
 	sqfs_dir_tree_destroy(root);
 	return ret;
+fail_arena:
+	if (arena != NULL)
+		arena_destroy(arena);
+	return ret;
+}
+
+int sqfs_dir_reader_get_full_hierarchy(sqfs_dir_reader_t *rd,
+				       const sqfs_id_table_t *idtbl,
+				       const char *path, unsigned int flags,
+				       sqfs_tree_node_t **out)
+{
+	const sqfs_allocator_t *alloc;
+	int ret;
+
+	sqfs_trace_begin("dir_reader", "read tree");
+	alloc = dir_reader_swap_allocator(rd, NULL);
+	ret = read_hierarchy(rd, idtbl, path, flags, out);
+	dir_reader_swap_allocator(rd, alloc);
+	sqfs_trace_end("dir_reader", "read tree");
+	return ret;
+}
+
+int sqfs_dir_reader_get_subtrees(sqfs_dir_reader_t *rd,
+				 const sqfs_id_table_t *idtbl,
+				 const char *const *paths, size_t count,
+				 sqfs_u32 flags, sqfs_tree_node_t **out)
+{
+	const sqfs_allocator_t *alloc;
+	int ret;
+
+	sqfs_trace_begin("dir_reader", "read tree");
+	alloc = dir_reader_swap_allocator(rd, NULL);
+	ret = read_subtrees(rd, idtbl, paths, count, flags, out);
+	dir_reader_swap_allocator(rd, alloc);
+	sqfs_trace_end("dir_reader", "read tree");
+	return ret;
 }
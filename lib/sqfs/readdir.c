@@ -11,6 +11,8 @@
 #include "sqfs/error.h"
 #include "sqfs/dir.h"
 #include "util/compat.h"
+#include "meta_internal.h"
+#include "hook_alloc.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -35,6 +37,7 @@ int sqfs_meta_reader_read_dir_header(sqfs_meta_reader_t *m,
 int sqfs_meta_reader_read_dir_ent(sqfs_meta_reader_t *m,
 				  sqfs_dir_entry_t **result)
 {
+	const sqfs_allocator_t *alloc = meta_reader_get_allocator(m);
 	sqfs_dir_entry_t ent, *out;
 	sqfs_u16 *diff_u16;
 	int err;
@@ -50,14 +53,14 @@ int sqfs_meta_reader_read_dir_ent(sqfs_meta_reader_t *m,
 	ent.type = le16toh(ent.type);
 	ent.size = le16toh(ent.size);
 
-	out = calloc(1, sizeof(*out) + ent.size + 2);
+	out = hook_calloc(alloc, sizeof(*out) + ent.size + 2);
 	if (out == NULL)
 		return SQFS_ERROR_ALLOC;
 
 	*out = ent;
 	err = sqfs_meta_reader_read(m, out->name, ent.size + 1);
 	if (err) {
-		free(out);
+		hook_free(alloc, out);
 		return err;
 	}
 
@@ -23,7 +23,7 @@ int sqfs_super_init(sqfs_super_t *super, size_t block_size, sqfs_u32 mtime,
 	if (block_size & (block_size - 1))
 		return SQFS_ERROR_SUPER_BLOCK_SIZE;
 
-	if (block_size < 4096 || block_size >= (1 << 20))
+	if (block_size < 4096 || block_size > (1 << 20))
 		return SQFS_ERROR_SUPER_BLOCK_SIZE;
 
 	memset(super, 0, sizeof(*super));
@@ -49,6 +49,12 @@ int sqfs_super_init(sqfs_super_t *super, size_t block_size, sqfs_u32 mtime,
 }
 
 int sqfs_super_write(const sqfs_super_t *super, sqfs_file_t *file)
+{
+	return sqfs_super_write_at(super, file, 0);
+}
+
+int sqfs_super_write_at(const sqfs_super_t *super, sqfs_file_t *file,
+			sqfs_u64 offset)
 {
 	sqfs_super_t copy;
 
@@ -72,5 +78,5 @@ int sqfs_super_write(const sqfs_super_t *super, sqfs_file_t *file)
 	copy.fragment_table_start = htole64(super->fragment_table_start);
 	copy.export_table_start = htole64(super->export_table_start);
 
-	return file->write_at(file, 0, &copy, sizeof(copy));
+	return file->write_at(file, offset, &copy, sizeof(copy));
 }
@@ -0,0 +1,446 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * thread_pool.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#define SQFS_BUILDING_DLL
+#include "config.h"
+
+#include "sqfs/thread_pool.h"
+#include "sqfs/error.h"
+
+#include <stdlib.h>
+
+#ifdef WITH_PTHREAD
+#include "thread_pool.h"
+
+typedef struct pool_thread_t {
+	struct pool_thread_t *next;
+	pthread_t thread;
+} pool_thread_t;
+
+typedef struct {
+	thread_job_t job;
+
+	void (*fn)(void *user);
+	void *user;
+} submitted_job_t;
+
+struct sqfs_thread_pool_t {
+	pthread_mutex_t mtx;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+
+	/* the share: jobs that work at the same time, i.e. do not wait */
+	unsigned int max_busy;
+	unsigned int busy;
+
+	/* threads waiting for a job and threads not running yet */
+	unsigned int idle;
+	unsigned int starting;
+
+	/* dedicated jobs, waiting for a thread */
+	thread_job_t *direct;
+	unsigned int num_direct;
+
+	/* other jobs, waiting for a share */
+	thread_job_t *queue;
+	thread_job_t *queue_last;
+	unsigned int num_queued;
+
+	pool_thread_t *threads;
+	bool stop;
+};
+
+static sqfs_thread_pool_t *default_pool;
+
+static void *pool_thread_proc(void *arg);
+
+static int spawn_thread(sqfs_thread_pool_t *pool)
+{
+	pool_thread_t *t = calloc(1, sizeof(*t));
+
+	if (t == NULL)
+		return -1;
+
+	if (pthread_create(&t->thread, NULL, pool_thread_proc, pool) != 0) {
+		free(t);
+		return -1;
+	}
+
+	t->next = pool->threads;
+	pool->threads = t;
+	pool->starting += 1;
+	return 0;
+}
+
+/* make sure there is a thread for everything that may run now */
+static void wake_or_spawn(sqfs_thread_pool_t *pool)
+{
+	unsigned int runnable = 0, need;
+
+	if (pool->busy < pool->max_busy)
+		runnable = pool->max_busy - pool->busy;
+
+	if (runnable > pool->num_queued)
+		runnable = pool->num_queued;
+
+	need = pool->num_direct + runnable;
+
+	if (need > 0 && pool->idle > 0)
+		pthread_cond_broadcast(&pool->wake);
+
+	while (pool->idle + pool->starting < need) {
+		if (spawn_thread(pool))
+			break;
+	}
+}
+
+static void dequeue(sqfs_thread_pool_t *pool, thread_job_t *job)
+{
+	thread_job_t *it, *prev = NULL;
+
+	it = job->dedicated ? pool->direct : pool->queue;
+
+	while (it != NULL && it != job) {
+		prev = it;
+		it = it->next;
+	}
+
+	if (it == NULL)
+		return;
+
+	if (job->dedicated) {
+		if (prev == NULL) {
+			pool->direct = job->next;
+		} else {
+			prev->next = job->next;
+		}
+		pool->num_direct -= 1;
+	} else {
+		if (prev == NULL) {
+			pool->queue = job->next;
+		} else {
+			prev->next = job->next;
+		}
+
+		if (pool->queue_last == job)
+			pool->queue_last = prev;
+		pool->num_queued -= 1;
+	}
+
+	job->next = NULL;
+}
+
+/*
+  Returns false if the pool cannot run the job, because a dedicated job
+  would not get a thread right away, or there are no threads at all.
+ */
+static bool enqueue(sqfs_thread_pool_t *pool, thread_job_t *job)
+{
+	bool stuck;
+
+	job->pool = pool;
+	job->state = THREAD_JOB_QUEUED;
+
+	if (job->dedicated) {
+		job->next = pool->direct;
+		pool->direct = job;
+		pool->num_direct += 1;
+	} else {
+		job->next = NULL;
+
+		if (pool->queue_last == NULL) {
+			pool->queue = job;
+		} else {
+			pool->queue_last->next = job;
+		}
+
+		pool->queue_last = job;
+		pool->num_queued += 1;
+	}
+
+	wake_or_spawn(pool);
+
+	if (job->dedicated) {
+		stuck = pool->idle + pool->starting < pool->num_direct;
+	} else {
+		stuck = pool->threads == NULL;
+	}
+
+	if (stuck) {
+		dequeue(pool, job);
+		job->pool = NULL;
+		job->state = THREAD_JOB_NEW;
+	}
+
+	return !stuck;
+}
+
+static thread_job_t *next_job(sqfs_thread_pool_t *pool)
+{
+	thread_job_t *job = NULL;
+
+	if (pool->direct != NULL) {
+		job = pool->direct;
+	} else if (pool->queue != NULL && pool->busy < pool->max_busy) {
+		job = pool->queue;
+	}
+
+	if (job != NULL)
+		dequeue(pool, job);
+
+	return job;
+}
+
+static void *pool_thread_proc(void *arg)
+{
+	sqfs_thread_pool_t *pool = arg;
+	thread_job_t *job;
+
+	pthread_mutex_lock(&pool->mtx);
+	pool->starting -= 1;
+
+	for (;;) {
+		job = next_job(pool);
+
+		if (job == NULL) {
+			if (pool->stop && pool->direct == NULL &&
+			    pool->queue == NULL) {
+				break;
+			}
+
+			pool->idle += 1;
+			pthread_cond_wait(&pool->wake, &pool->mtx);
+			pool->idle -= 1;
+			continue;
+		}
+
+		job->state = THREAD_JOB_RUNNING;
+		pool->busy += 1;
+		pthread_mutex_unlock(&pool->mtx);
+
+		job->fn(job->user);
+
+		pthread_mutex_lock(&pool->mtx);
+		pool->busy -= 1;
+
+		if (job->autofree) {
+			free(job);
+		} else {
+			job->state = THREAD_JOB_DONE;
+			pthread_cond_broadcast(&pool->done);
+		}
+
+		wake_or_spawn(pool);
+	}
+
+	pthread_mutex_unlock(&pool->mtx);
+	return NULL;
+}
+
+int thread_job_start(thread_job_t *job, void *(*fn)(void *), void *user,
+		     bool dedicated)
+{
+	sqfs_thread_pool_t *pool = default_pool;
+	bool queued = false;
+
+	job->next = NULL;
+	job->pool = NULL;
+	job->fn = fn;
+	job->user = user;
+	job->state = THREAD_JOB_NEW;
+	job->dedicated = dedicated;
+	job->autofree = false;
+
+	if (pool != NULL) {
+		pthread_mutex_lock(&pool->mtx);
+		queued = enqueue(pool, job);
+		pthread_mutex_unlock(&pool->mtx);
+	}
+
+	if (!queued) {
+		if (pthread_create(&job->thread, NULL, fn, user) != 0)
+			return SQFS_ERROR_INTERNAL;
+
+		job->state = THREAD_JOB_RUNNING;
+	}
+
+	return 0;
+}
+
+bool thread_job_join(thread_job_t *job)
+{
+	sqfs_thread_pool_t *pool = job->pool;
+	bool ran = true;
+
+	if (pool == NULL) {
+		pthread_join(job->thread, NULL);
+	} else {
+		pthread_mutex_lock(&pool->mtx);
+		if (job->state == THREAD_JOB_QUEUED) {
+			dequeue(pool, job);
+			ran = false;
+		} else {
+			while (job->state != THREAD_JOB_DONE)
+				pthread_cond_wait(&pool->done, &pool->mtx);
+		}
+		pthread_mutex_unlock(&pool->mtx);
+	}
+
+	job->state = THREAD_JOB_DONE;
+	return ran;
+}
+
+void thread_job_wait_begin(thread_job_t *job)
+{
+	sqfs_thread_pool_t *pool = job->pool;
+
+	if (pool != NULL) {
+		pthread_mutex_lock(&pool->mtx);
+		pool->busy -= 1;
+		wake_or_spawn(pool);
+		pthread_mutex_unlock(&pool->mtx);
+	}
+}
+
+void thread_job_wait_end(thread_job_t *job)
+{
+	sqfs_thread_pool_t *pool = job->pool;
+
+	if (pool != NULL) {
+		pthread_mutex_lock(&pool->mtx);
+		pool->busy += 1;
+		pthread_mutex_unlock(&pool->mtx);
+	}
+}
+
+sqfs_thread_pool_t *sqfs_thread_pool_create(unsigned int num_threads)
+{
+	sqfs_thread_pool_t *pool = calloc(1, sizeof(*pool));
+
+	if (pool == NULL)
+		return NULL;
+
+	pool->mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	pool->wake = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+	pool->done = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+	pool->max_busy = num_threads < 1 ? 1 : num_threads;
+	return pool;
+}
+
+void sqfs_thread_pool_destroy(sqfs_thread_pool_t *pool)
+{
+	pool_thread_t *list, *it;
+
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->mtx);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->wake);
+
+	/* threads still working off the queue may spawn others */
+	while (pool->threads != NULL) {
+		list = pool->threads;
+		pool->threads = NULL;
+		pthread_mutex_unlock(&pool->mtx);
+
+		while (list != NULL) {
+			it = list;
+			list = list->next;
+
+			pthread_join(it->thread, NULL);
+			free(it);
+		}
+
+		pthread_mutex_lock(&pool->mtx);
+	}
+	pthread_mutex_unlock(&pool->mtx);
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->wake);
+	pthread_mutex_destroy(&pool->mtx);
+	free(pool);
+}
+
+unsigned int sqfs_thread_pool_get_num_threads(const sqfs_thread_pool_t *pool)
+{
+	return pool->max_busy;
+}
+
+static void *run_submitted(void *arg)
+{
+	submitted_job_t *sub = arg;
+
+	sub->fn(sub->user);
+	return NULL;
+}
+
+int sqfs_thread_pool_submit(sqfs_thread_pool_t *pool,
+			    void (*fn)(void *user), void *user)
+{
+	submitted_job_t *sub = calloc(1, sizeof(*sub));
+	bool queued;
+
+	if (sub == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	sub->fn = fn;
+	sub->user = user;
+	sub->job.fn = run_submitted;
+	sub->job.user = sub;
+	sub->job.autofree = true;
+
+	pthread_mutex_lock(&pool->mtx);
+	queued = enqueue(pool, &sub->job);
+	pthread_mutex_unlock(&pool->mtx);
+
+	/* not a single thread could be started, do it ourselves */
+	if (!queued) {
+		fn(user);
+		free(sub);
+	}
+
+	return 0;
+}
+
+void sqfs_set_thread_pool(sqfs_thread_pool_t *pool)
+{
+	default_pool = pool;
+}
+#else
+struct sqfs_thread_pool_t {
+	unsigned int num_threads;
+};
+
+sqfs_thread_pool_t *sqfs_thread_pool_create(unsigned int num_threads)
+{
+	(void)num_threads;
+	return calloc(1, sizeof(sqfs_thread_pool_t));
+}
+
+void sqfs_thread_pool_destroy(sqfs_thread_pool_t *pool)
+{
+	free(pool);
+}
+
+unsigned int sqfs_thread_pool_get_num_threads(const sqfs_thread_pool_t *pool)
+{
+	return pool->num_threads;
+}
+
+int sqfs_thread_pool_submit(sqfs_thread_pool_t *pool,
+			    void (*fn)(void *user), void *user)
+{
+	(void)pool;
+	fn(user);
+	return 0;
+}
+
+void sqfs_set_thread_pool(sqfs_thread_pool_t *pool)
+{
+	(void)pool;
+}
+#endif
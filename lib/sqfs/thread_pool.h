@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * thread_pool.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include "config.h"
+
+#include "sqfs/predef.h"
+#include "sqfs/thread_pool.h"
+#include <pthread.h>
+
+#include <stdbool.h>
+
+enum {
+	THREAD_JOB_NEW = 0,
+	THREAD_JOB_QUEUED,
+	THREAD_JOB_RUNNING,
+	THREAD_JOB_DONE,
+};
+
+/*
+  A function running on a thread of the process wide pool, or on a thread of
+  its own if no pool is registered. Embedded in the object that starts it.
+ */
+typedef struct thread_job_t {
+	struct thread_job_t *next;
+
+	/* NULL if it runs on a thread of its own */
+	sqfs_thread_pool_t *pool;
+	pthread_t thread;
+
+	void *(*fn)(void *user);
+	void *user;
+
+	int state;
+	bool dedicated;
+
+	/* submitted through the public API, freed by the pool when done */
+	bool autofree;
+} thread_job_t;
+
+/*
+  Start a job. A dedicated job is a worker loop that lives as long as the
+  object that starts it and always gets a thread right away. Other jobs
+  wait until the pool has a share to spare and may never start at all,
+  if they are joined before that.
+
+  Returns 0 on success or SQFS_ERROR_INTERNAL if no thread could be started.
+ */
+SQFS_INTERNAL int thread_job_start(thread_job_t *job, void *(*fn)(void *),
+				   void *user, bool dedicated);
+
+/*
+  Wait for a started job to finish. Returns false if the job had not been
+  picked up by a thread yet, in which case it is cancelled instead.
+ */
+SQFS_INTERNAL bool thread_job_join(thread_job_t *job);
+
+/*
+  Bracket waiting for work inside a job, so the pool can hand out the share
+  of the job in the meantime. Does nothing for a job on its own thread.
+ */
+SQFS_INTERNAL void thread_job_wait_begin(thread_job_t *job);
+
+SQFS_INTERNAL void thread_job_wait_end(thread_job_t *job);
+
+#endif /* THREAD_POOL_H */
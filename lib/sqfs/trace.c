@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * trace.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#define SQFS_BUILDING_DLL
+#include "config.h"
+
+#include "sqfs/trace.h"
+#include "sqfs/error.h"
+#include "util/util.h"
+
+#ifdef WITH_PTHREAD
+#include <pthread.h>
+
+static pthread_mutex_t trace_mtx = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static const sqfs_trace_hooks_t *trace_hooks;
+static void *trace_user;
+
+/* assigned on first use, protected by the mutex */
+static __thread sqfs_u32 trace_thread;
+static sqfs_u32 trace_next_thread = 1;
+
+int sqfs_set_trace_hooks(void *user, const sqfs_trace_hooks_t *hooks)
+{
+	if (hooks != NULL && hooks->size != sizeof(*hooks))
+		return SQFS_ERROR_UNSUPPORTED;
+
+	trace_hooks = hooks;
+	trace_user = user;
+	return 0;
+}
+
+/*
+  The time stamp is taken before waiting for the lock, so a thread that
+  has to wait for others reporting something does not show up late.
+ */
+static void trace_event(bool begin, const char *category, const char *name)
+{
+	sqfs_u64 now;
+
+	if (trace_hooks == NULL)
+		return;
+
+	now = get_time_ns();
+
+#ifdef WITH_PTHREAD
+	pthread_mutex_lock(&trace_mtx);
+#endif
+	if (trace_thread == 0)
+		trace_thread = trace_next_thread++;
+
+	if (begin) {
+		if (trace_hooks->begin != NULL) {
+			trace_hooks->begin(trace_user, trace_thread, now,
+					   category, name);
+		}
+	} else if (trace_hooks->end != NULL) {
+		trace_hooks->end(trace_user, trace_thread, now,
+				 category, name);
+	}
+#ifdef WITH_PTHREAD
+	pthread_mutex_unlock(&trace_mtx);
+#endif
+}
+
+void sqfs_trace_begin(const char *category, const char *name)
+{
+	trace_event(true, category, name);
+}
+
+void sqfs_trace_end(const char *category, const char *name)
+{
+	trace_event(false, category, name);
+}
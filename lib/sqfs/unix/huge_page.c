@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * huge_page.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#define SQFS_BUILDING_DLL
+#include "config.h"
+
+#include "../huge_pool.h"
+
+#include <sys/mman.h>
+#include <stdint.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+void *huge_page_map(size_t size)
+{
+	uintptr_t addr, aligned;
+	size_t head;
+	void *ptr;
+
+#ifdef MAP_HUGETLB
+	/* explicit huge pages, only works if the admin reserved some */
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (ptr != MAP_FAILED)
+		return ptr;
+#endif
+
+	/*
+	  Otherwise, ask for transparent huge pages. Those are only used for
+	  huge page aligned ranges, so map more and trim it down.
+	 */
+	ptr = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+
+	addr = (uintptr_t)ptr;
+	aligned = (addr + HUGE_PAGE_SIZE - 1) & ~((uintptr_t)HUGE_PAGE_SIZE - 1);
+	head = aligned - addr;
+
+	if (head > 0)
+		munmap(ptr, head);
+
+	munmap((void *)(aligned + size), HUGE_PAGE_SIZE - head);
+
+#ifdef MADV_HUGEPAGE
+	madvise((void *)aligned, size, MADV_HUGEPAGE);
+#endif
+	return (void *)aligned;
+}
+
+void huge_page_unmap(void *ptr, size_t size)
+{
+	munmap(ptr, size);
+}
@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * internal.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef INTERNAL_H
+#define INTERNAL_H
+
+#include "config.h"
+
+#include "sqfs/predef.h"
+#include "sqfs/error.h"
+#include "sqfs/io.h"
+
+#include <stdbool.h>
+
+/* maximum number of transfers an io_uring backed file keeps in flight */
+#define IO_RING_DEPTH (32)
+
+/* appends to a writable file are collected in chunks of this size */
+#define WRITE_BUFFER_SIZE (1024 * 1024)
+
+/* alignment of memory, offsets and sizes for O_DIRECT transfers */
+#define DIRECT_IO_ALIGN (4096)
+
+typedef struct io_ring_t io_ring_t;
+
+/* returns NULL if io_uring is not supported */
+SQFS_INTERNAL io_ring_t *io_ring_create(int fd, unsigned int depth);
+
+SQFS_INTERNAL void io_ring_destroy(io_ring_t *ring);
+
+SQFS_INTERNAL int io_ring_transfer(io_ring_t *ring, const sqfs_file_io_t *io,
+				   size_t count, bool write);
+
+#endif /* INTERNAL_H */
@@ -5,13 +5,13 @@
  * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
  */
 #define SQFS_BUILDING_DLL
-#include "config.h"
-
-#include "sqfs/io.h"
-#include "sqfs/error.h"
+#include "internal.h"
 
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -22,29 +22,72 @@ typedef struct {
 
 	sqfs_u64 size;
 	int fd;
-} sqfs_file_stdio_t;
 
+	/* opened with O_DIRECT for aligned transfers, or -1 */
+	int direct_fd;
 
-static void stdio_destroy(sqfs_file_t *base)
+	/* drop data from the page cache after transferring it */
+	bool drop_cache;
+
+	/* the whole file if opened with SQFS_FILE_OPEN_MMAP, or NULL */
+	sqfs_u8 *map;
+
+	/* set up if opened with SQFS_FILE_OPEN_ASYNC, or NULL */
+	io_ring_t *ring;
+
+	/*
+	  Appended data not written yet, always ends at the logical file
+	  size. Flushed whenever the end of the file reaches a multiple of
+	  WRITE_BUFFER_SIZE and before anything else touches the file.
+	 */
+	sqfs_u8 *wbuf;
+	size_t wbuf_used;
+} sqfs_file_stdio_t;
+
+static int get_fd(const sqfs_file_stdio_t *file, sqfs_u64 offset,
+		  const void *buffer, size_t size)
 {
-	sqfs_file_stdio_t *file = (sqfs_file_stdio_t *)base;
+	if (file->direct_fd >= 0 &&
+	    (offset % DIRECT_IO_ALIGN) == 0 && (size % DIRECT_IO_ALIGN) == 0 &&
+	    ((uintptr_t)buffer % DIRECT_IO_ALIGN) == 0) {
+		return file->direct_fd;
+	}
 
-	close(file->fd);
-	free(file);
+	return file->fd;
 }
 
-static int stdio_read_at(sqfs_file_t *base, sqfs_u64 offset,
-			 void *buffer, size_t size)
+static void drop_cache(const sqfs_file_stdio_t *file, sqfs_u64 offset,
+		       sqfs_u64 size)
 {
-	sqfs_file_stdio_t *file = (sqfs_file_stdio_t *)base;
+#ifdef HAVE_POSIX_FADVISE
+	if (file->drop_cache && size > 0)
+		posix_fadvise(file->fd, offset, size, POSIX_FADV_DONTNEED);
+#else
+	(void)file; (void)offset; (void)size;
+#endif
+}
+
+static int read_data(sqfs_file_stdio_t *file, sqfs_u64 offset,
+		     void *buffer, size_t size)
+{
+	sqfs_u64 start = offset;
 	ssize_t ret;
+	int fd;
 
 	while (size > 0) {
-		ret = pread(file->fd, buffer, size, offset);
+		fd = get_fd(file, offset, buffer, size);
+		ret = pread(fd, buffer, size, offset);
 
 		if (ret < 0) {
 			if (errno == EINTR)
 				continue;
+
+			/* e.g. the file system refuses direct I/O after all */
+			if (errno == EINVAL && fd == file->direct_fd) {
+				close(file->direct_fd);
+				file->direct_fd = -1;
+				continue;
+			}
 			return SQFS_ERROR_IO;
 		}
 
@@ -56,21 +99,30 @@ static int stdio_read_at(sqfs_file_t *base, sqfs_u64 offset,
 		offset += ret;
 	}
 
+	drop_cache(file, start, offset - start);
 	return 0;
 }
 
-static int stdio_write_at(sqfs_file_t *base, sqfs_u64 offset,
-			  const void *buffer, size_t size)
+static int write_data(sqfs_file_stdio_t *file, sqfs_u64 offset,
+		      const void *buffer, size_t size)
 {
-	sqfs_file_stdio_t *file = (sqfs_file_stdio_t *)base;
+	sqfs_u64 start = offset;
 	ssize_t ret;
+	int fd;
 
 	while (size > 0) {
-		ret = pwrite(file->fd, buffer, size, offset);
+		fd = get_fd(file, offset, buffer, size);
+		ret = pwrite(fd, buffer, size, offset);
 
 		if (ret < 0) {
 			if (errno == EINTR)
 				continue;
+
+			if (errno == EINVAL && fd == file->direct_fd) {
+				close(file->direct_fd);
+				file->direct_fd = -1;
+				continue;
+			}
 			return SQFS_ERROR_IO;
 		}
 
@@ -82,8 +134,194 @@ static int stdio_write_at(sqfs_file_t *base, sqfs_u64 offset,
 		offset += ret;
 	}
 
-	if (offset >= file->size)
-		file->size = offset;
+	drop_cache(file, start, offset - start);
+	return 0;
+}
+
+/* on failure, the data is kept in the buffer for the next attempt */
+static int flush_wbuf(sqfs_file_stdio_t *file)
+{
+	size_t used = file->wbuf_used;
+	int ret;
+
+	if (used == 0)
+		return 0;
+
+	ret = write_data(file, file->size - used, file->wbuf, used);
+	if (ret == 0)
+		file->wbuf_used = 0;
+	return ret;
+}
+
+
+static void stdio_destroy(sqfs_file_t *base)
+{
+	sqfs_file_stdio_t *file = (sqfs_file_stdio_t *)base;
+
+	if (file->map != NULL)
+		munmap(file->map, file->size);
+
+	io_ring_destroy(file->ring);
+
+	/* too late to report errors, see the documentation of the flags */
+	flush_wbuf(file);
+	free(file->wbuf);
+
+	if (file->direct_fd >= 0)
+		close(file->direct_fd);
+	close(file->fd);
+	free(file);
+}
+
+static int mmap_map_at(sqfs_file_t *base, sqfs_u64 offset, size_t size,
+		       const void **out)
+{
+	sqfs_file_stdio_t *file = (sqfs_file_stdio_t *)base;
+
+	if (offset > file->size || size > file->size - offset)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	*out = file->map + offset;
+	return 0;
+}
+
+static int mmap_read_at(sqfs_file_t *base, sqfs_u64 offset,
+			void *buffer, size_t size)
+{
+	const void *ptr;
+	int ret;
+
+	ret = mmap_map_at(base, offset, size, &ptr);
+	if (ret)
+		return ret;
+
+	memcpy(buffer, ptr, size);
+	return 0;
+}
+
+static int stdio_read_at(sqfs_file_t *base, sqfs_u64 offset,
+			 void *buffer, size_t size)
+{
+	sqfs_file_stdio_t *file = (sqfs_file_stdio_t *)base;
+	int ret = flush_wbuf(file);
+
+	if (ret)
+		return ret;
+
+	return read_data(file, offset, buffer, size);
+}
+
+static int stdio_write_at(sqfs_file_t *base, sqfs_u64 offset,
+			  const void *buffer, size_t size)
+{
+	sqfs_file_stdio_t *file = (sqfs_file_stdio_t *)base;
+	size_t room, diff;
+	int ret;
+
+	if (file->wbuf == NULL || offset != file->size) {
+		ret = flush_wbuf(file);
+		if (ret)
+			return ret;
+
+		ret = write_data(file, offset, buffer, size);
+		if (ret)
+			return ret;
+
+		if (offset + size >= file->size)
+			file->size = offset + size;
+		return 0;
+	}
+
+	while (size > 0) {
+		/* a full buffer is left over if flushing it failed before */
+		if (file->wbuf_used > 0 &&
+		    file->size % WRITE_BUFFER_SIZE == 0) {
+			ret = flush_wbuf(file);
+			if (ret)
+				return ret;
+		}
+
+		room = WRITE_BUFFER_SIZE - file->size % WRITE_BUFFER_SIZE;
+
+		/* for direct I/O, everything goes through the aligned buffer */
+		if (file->wbuf_used == 0 && size >= room &&
+		    file->direct_fd < 0) {
+			/* write everything up to the last boundary directly */
+			diff = room + (size - room) / WRITE_BUFFER_SIZE *
+				WRITE_BUFFER_SIZE;
+
+			ret = write_data(file, file->size, buffer, diff);
+			if (ret)
+				return ret;
+		} else {
+			diff = size < room ? size : room;
+
+			memcpy(file->wbuf + file->wbuf_used, buffer, diff);
+			file->wbuf_used += diff;
+		}
+
+		file->size += diff;
+		buffer = (const char *)buffer + diff;
+		size -= diff;
+
+		if (file->size % WRITE_BUFFER_SIZE == 0) {
+			ret = flush_wbuf(file);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int ring_read_batch(sqfs_file_t *base, const sqfs_file_io_t *io,
+			   size_t count)
+{
+	sqfs_file_stdio_t *file = (sqfs_file_stdio_t *)base;
+	int ret = flush_wbuf(file);
+
+	if (ret)
+		return ret;
+
+	return io_ring_transfer(file->ring, io, count, false);
+}
+
+static int ring_write_batch(sqfs_file_t *base, const sqfs_file_io_t *io,
+			    size_t count)
+{
+	sqfs_file_stdio_t *file = (sqfs_file_stdio_t *)base;
+	sqfs_u64 end;
+	size_t i;
+	int ret;
+
+	ret = flush_wbuf(file);
+	if (ret)
+		return ret;
+
+	ret = io_ring_transfer(file->ring, io, count, true);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < count; ++i) {
+		end = io[i].offset + io[i].size;
+
+		if (io[i].size > 0 && end > file->size)
+			file->size = end;
+	}
+
+	return 0;
+}
+
+static int stdio_flush(sqfs_file_t *base, sqfs_u32 flags)
+{
+	sqfs_file_stdio_t *file = (sqfs_file_stdio_t *)base;
+	int ret = flush_wbuf(file);
+
+	if (ret)
+		return ret;
+
+	if ((flags & SQFS_FILE_FLUSH_SYNC) && fsync(file->fd))
+		return SQFS_ERROR_IO;
 
 	return 0;
 }
@@ -98,6 +336,17 @@ static sqfs_u64 stdio_get_size(const sqfs_file_t *base)
 static int stdio_truncate(sqfs_file_t *base, sqfs_u64 size)
 {
 	sqfs_file_stdio_t *file = (sqfs_file_stdio_t *)base;
+	int ret;
+
+	if (size <= file->size && file->size - size <= file->wbuf_used) {
+		file->wbuf_used -= file->size - size;
+		file->size = size;
+		return 0;
+	}
+
+	ret = flush_wbuf(file);
+	if (ret)
+		return ret;
 
 	if (ftruncate(file->fd, size))
 		return SQFS_ERROR_IO;
@@ -124,12 +373,16 @@ sqfs_file_t *sqfs_open_file(const char *filename, sqfs_u32 flags)
 	if (file == NULL)
 		return NULL;
 
+	file->direct_fd = -1;
+
 	if (flags & SQFS_FILE_OPEN_READ_ONLY) {
 		open_mode = O_RDONLY;
 	} else {
 		open_mode = O_CREAT | O_RDWR;
 
-		if (flags & SQFS_FILE_OPEN_OVERWRITE) {
+		if (flags & SQFS_FILE_OPEN_NO_TRUNCATE) {
+			/* keep what is there */
+		} else if (flags & SQFS_FILE_OPEN_OVERWRITE) {
 			open_mode |= O_TRUNC;
 		} else {
 			open_mode |= O_EXCL;
@@ -159,5 +412,64 @@ sqfs_file_t *sqfs_open_file(const char *filename, sqfs_u32 flags)
 	base->write_at = stdio_write_at;
 	base->get_size = stdio_get_size;
 	base->truncate = stdio_truncate;
+	base->flush = stdio_flush;
+
+	if ((flags & SQFS_FILE_OPEN_MMAP) &&
+	    (flags & SQFS_FILE_OPEN_READ_ONLY) &&
+	    file->size > 0 && file->size <= SIZE_MAX) {
+		file->map = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE,
+				 file->fd, 0);
+
+		if (file->map == MAP_FAILED) {
+			file->map = NULL;
+		} else {
+			base->read_at = mmap_read_at;
+			base->map_at = mmap_map_at;
+#ifdef MADV_SEQUENTIAL
+			if (flags & SQFS_FILE_OPEN_SEQUENTIAL) {
+				madvise(file->map, file->size,
+					MADV_SEQUENTIAL);
+			}
+#endif
+		}
+	}
+
+#ifdef O_DIRECT
+	if (flags & SQFS_FILE_OPEN_DIRECT) {
+		open_mode = (flags & SQFS_FILE_OPEN_READ_ONLY) ?
+			O_RDONLY : O_RDWR;
+
+		file->direct_fd = open(filename, open_mode | O_DIRECT);
+	}
+#endif
+
+#ifdef HAVE_POSIX_FADVISE
+	if ((flags & SQFS_FILE_OPEN_SEQUENTIAL) && file->map == NULL) {
+		posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		file->drop_cache = true;
+	}
+#endif
+
+	/* without the buffer, writes simply go straight to the file */
+	if (!(flags & SQFS_FILE_OPEN_READ_ONLY)) {
+		if (posix_memalign((void **)&file->wbuf, DIRECT_IO_ALIGN,
+				   WRITE_BUFFER_SIZE)) {
+			file->wbuf = NULL;
+		}
+	}
+
+	if (flags & SQFS_FILE_OPEN_ASYNC) {
+		file->ring = io_ring_create(file->fd, IO_RING_DEPTH);
+
+		if (file->ring != NULL) {
+			base->read_batch = ring_read_batch;
+
+			/* direct I/O needs the appends aligned by the buffer */
+			if (!(flags & SQFS_FILE_OPEN_READ_ONLY) &&
+			    file->direct_fd < 0) {
+				base->write_batch = ring_write_batch;
+			}
+		}
+	}
 	return base;
 }
@@ -0,0 +1,285 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * io_ring.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#define SQFS_BUILDING_DLL
+#include "internal.h"
+
+#include <stdlib.h>
+
+#if defined(HAVE_LINUX_IO_URING_H)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup) && \
+	defined(__NR_io_uring_enter)
+#include "util/util.h"
+
+/*
+  A bare io_uring without liburing. The submission queue entries are
+  mapped one to one to the slots of the submission ring, so a batch of
+  transfers is pushed by filling in entries, publishing the new tail and
+  calling io_uring_enter, which also waits for at least one completion.
+  Short transfers are resubmitted for the remaining part.
+ */
+struct io_ring_t {
+	int ring_fd;
+	int fd;
+	unsigned int depth;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+static int ring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ring_enter(io_ring_t *ring, unsigned int to_submit)
+{
+	return syscall(__NR_io_uring_enter, ring->ring_fd, to_submit, 1,
+		       IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+io_ring_t *io_ring_create(int fd, unsigned int depth)
+{
+	struct io_uring_params p;
+	io_ring_t *ring;
+	sqfs_u8 *sq, *cq;
+
+	ring = calloc(1, sizeof(*ring));
+	if (ring == NULL)
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = fd;
+	ring->ring_fd = ring_setup(depth, &p);
+	if (ring->ring_fd < 0) {
+		free(ring);
+		return NULL;
+	}
+
+	ring->depth = p.sq_entries;
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = 0;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto fail_fd;
+
+	if (ring->cq_ring_size == 0) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto fail_sq;
+	}
+
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+			  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto fail_cq;
+
+	sq = ring->sq_ring;
+	ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+
+	cq = ring->cq_ring;
+	ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return ring;
+fail_cq:
+	if (ring->cq_ring_size != 0)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+fail_sq:
+	munmap(ring->sq_ring, ring->sq_ring_size);
+fail_fd:
+	close(ring->ring_fd);
+	free(ring);
+	return NULL;
+}
+
+void io_ring_destroy(io_ring_t *ring)
+{
+	if (ring == NULL)
+		return;
+
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring_size != 0)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->ring_fd);
+	free(ring);
+}
+
+static void push_sqe(io_ring_t *ring, const struct iovec *iov,
+		     sqfs_u64 offset, size_t index, bool write)
+{
+	unsigned int tail = *ring->sq_tail;
+	unsigned int slot = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = ring->sqes + slot;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = ring->fd;
+	sqe->off = offset;
+	sqe->addr = (unsigned long)iov;
+	sqe->len = 1;
+	sqe->user_data = index;
+
+	ring->sq_array[slot] = slot;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+int io_ring_transfer(io_ring_t *ring, const sqfs_file_io_t *io,
+		     size_t count, bool write)
+{
+	size_t i, num_pending = 0, in_flight = 0;
+	unsigned int head, to_submit;
+	struct io_uring_cqe *cqe;
+	struct iovec *iov;
+	size_t *pending;
+	sqfs_u64 *offset;
+	int ret, err = 0;
+	sqfs_s32 res;
+
+	iov = alloc_array(sizeof(iov[0]), count);
+	offset = alloc_array(sizeof(offset[0]), count);
+	pending = alloc_array(sizeof(pending[0]), count);
+
+	if (iov == NULL || offset == NULL || pending == NULL) {
+		err = SQFS_ERROR_ALLOC;
+		goto out;
+	}
+
+	/* pushed in reverse, so they are submitted in the original order */
+	for (i = count; i-- > 0; ) {
+		if (io[i].size == 0)
+			continue;
+
+		iov[i].iov_base = io[i].buffer;
+		iov[i].iov_len = io[i].size;
+		offset[i] = io[i].offset;
+		pending[num_pending++] = i;
+	}
+
+	while (num_pending > 0 || in_flight > 0) {
+		while (err == 0 && num_pending > 0 && in_flight < ring->depth) {
+			i = pending[--num_pending];
+			push_sqe(ring, iov + i, offset[i], i, write);
+			++in_flight;
+		}
+
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		to_submit = *ring->sq_tail - head;
+
+		ret = ring_enter(ring, to_submit);
+		if (ret < 0 && errno != EINTR && errno != EAGAIN) {
+			/*
+			  The kernel only looks at the submission ring inside
+			  io_uring_enter, so entries it didn't take can be
+			  dropped again.
+			 */
+			__atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+			in_flight -= to_submit;
+			num_pending = 0;
+			err = SQFS_ERROR_IO;
+
+			if (to_submit == 0)
+				break;
+			continue;
+		}
+
+		head = *ring->cq_head;
+		while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = ring->cqes + (head & *ring->cq_mask);
+			i = cqe->user_data;
+			res = cqe->res;
+			++head;
+			--in_flight;
+
+			if (res == -EINTR || res == -EAGAIN) {
+				pending[num_pending++] = i;
+			} else if (res < 0) {
+				err = SQFS_ERROR_IO;
+			} else if (res == 0) {
+				err = write ? SQFS_ERROR_IO :
+					SQFS_ERROR_OUT_OF_BOUNDS;
+			} else if ((size_t)res < iov[i].iov_len) {
+				iov[i].iov_base = (char *)iov[i].iov_base + res;
+				iov[i].iov_len -= res;
+				offset[i] += res;
+				pending[num_pending++] = i;
+			}
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+		if (err != 0)
+			num_pending = 0;
+	}
+out:
+	free(pending);
+	free(offset);
+	free(iov);
+	return err;
+}
+#else
+io_ring_t *io_ring_create(int fd, unsigned int depth)
+{
+	(void)fd; (void)depth;
+	return NULL;
+}
+
+void io_ring_destroy(io_ring_t *ring)
+{
+	(void)ring;
+}
+
+int io_ring_transfer(io_ring_t *ring, const sqfs_file_io_t *io,
+		     size_t count, bool write)
+{
+	(void)ring; (void)io; (void)count; (void)write;
+	return SQFS_ERROR_UNSUPPORTED;
+}
+#endif
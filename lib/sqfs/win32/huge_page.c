@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * huge_page.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#define SQFS_BUILDING_DLL
+#include "config.h"
+
+#include "../huge_pool.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+void *huge_page_map(size_t size)
+{
+	SIZE_T large = GetLargePageMinimum();
+	void *ptr = NULL;
+
+	/* needs the "lock pages in memory" privilege, which is rarely set */
+	if (large > 0 && (size % large) == 0) {
+		ptr = VirtualAlloc(NULL, size,
+				   MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES,
+				   PAGE_READWRITE);
+	}
+
+	if (ptr == NULL) {
+		ptr = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE,
+				   PAGE_READWRITE);
+	}
+
+	return ptr;
+}
+
+void huge_page_unmap(void *ptr, size_t size)
+{
+	(void)size;
+	VirtualFree(ptr, 0, MEM_RELEASE);
+}
@@ -118,6 +118,16 @@ static int stdio_truncate(sqfs_file_t *base, sqfs_u64 size)
 	return 0;
 }
 
+static int stdio_flush(sqfs_file_t *base, sqfs_u32 flags)
+{
+	sqfs_file_stdio_t *file = (sqfs_file_stdio_t *)base;
+
+	if ((flags & SQFS_FILE_FLUSH_SYNC) && !FlushFileBuffers(file->fd))
+		return SQFS_ERROR_IO;
+
+	return 0;
+}
+
 
 sqfs_file_t *sqfs_open_file(const char *filename, sqfs_u32 flags)
 {
@@ -140,7 +150,9 @@ sqfs_file_t *sqfs_open_file(const char *filename, sqfs_u32 flags)
 	} else {
 		access_flags = GENERIC_READ | GENERIC_WRITE;
 
-		if (flags & SQFS_FILE_OPEN_OVERWRITE) {
+		if (flags & SQFS_FILE_OPEN_NO_TRUNCATE) {
+			creation_mode = OPEN_ALWAYS;
+		} else if (flags & SQFS_FILE_OPEN_OVERWRITE) {
 			creation_mode = TRUNCATE_EXISTING;
 		} else {
 			creation_mode = CREATE_NEW;
@@ -156,6 +168,7 @@ sqfs_file_t *sqfs_open_file(const char *filename, sqfs_u32 flags)
 	}
 
 	if (!GetFileSizeEx(file->fd, &size)) {
+		CloseHandle(file->fd);
 		free(file);
 		return NULL;
 	}
@@ -166,5 +179,6 @@ sqfs_file_t *sqfs_open_file(const char *filename, sqfs_u32 flags)
 	base->write_at = stdio_write_at;
 	base->get_size = stdio_get_size;
 	base->truncate = stdio_truncate;
+	base->flush = stdio_flush;
 	return base;
 }
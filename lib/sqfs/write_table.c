@@ -7,75 +7,129 @@
 #define SQFS_BUILDING_DLL
 #include "config.h"
 
-#include "sqfs/meta_writer.h"
+#include "sqfs/compressor.h"
 #include "sqfs/error.h"
 #include "sqfs/super.h"
 #include "sqfs/table.h"
+#include "sqfs/trace.h"
 #include "sqfs/block.h"
 #include "sqfs/io.h"
 #include "util/util.h"
+#include "blk_parallel.h"
 
 #include <stdlib.h>
+#include <string.h>
 
-int sqfs_write_table(sqfs_file_t *file, sqfs_compressor_t *cmp,
-		     const void *data, size_t table_size, sqfs_u64 *start)
+/* space for a meta data block, including its header */
+#define SLOT_SIZE (SQFS_META_BLOCK_SIZE + 2)
+
+typedef struct {
+	const sqfs_u8 *data;
+	size_t table_size;
+	sqfs_u8 *out;
+} write_state_t;
+
+static int compress_block(void *user, sqfs_compressor_t *cmp, size_t index)
+{
+	write_state_t *state = user;
+	const sqfs_u8 *in = state->data + index * SQFS_META_BLOCK_SIZE;
+	sqfs_u8 *slot = state->out + index * SLOT_SIZE;
+	size_t size = state->table_size - index * SQFS_META_BLOCK_SIZE;
+	sqfs_u16 header;
+	sqfs_s32 ret;
+
+	if (size > SQFS_META_BLOCK_SIZE)
+		size = SQFS_META_BLOCK_SIZE;
+
+	ret = cmp->do_block(cmp, in, size, slot + 2, SQFS_META_BLOCK_SIZE);
+	if (ret < 0)
+		return ret;
+
+	if (ret > 0) {
+		header = htole16(ret);
+	} else {
+		header = htole16(size | 0x8000);
+		memcpy(slot + 2, in, size);
+	}
+
+	memcpy(slot, &header, sizeof(header));
+	return 0;
+}
+
+int sqfs_write_table_parallel(sqfs_file_t *file, sqfs_compressor_t *cmp,
+			      const void *data, size_t table_size,
+			      sqfs_u64 *start, unsigned int num_workers)
 {
-	size_t block_count, list_size, diff, blkidx = 0;
-	sqfs_u64 off, *locations;
-	sqfs_meta_writer_t *m;
+	size_t i, block_count, list_size, used = 0;
+	write_state_t state;
+	sqfs_u64 *locations;
+	sqfs_u16 header;
+	sqfs_u64 off;
+	sqfs_u8 *out;
 	int ret;
 
 	block_count = table_size / SQFS_META_BLOCK_SIZE;
 	if ((table_size % SQFS_META_BLOCK_SIZE) != 0)
 		++block_count;
 
-	locations = alloc_array(sizeof(sqfs_u64), block_count);
+	list_size = sizeof(sqfs_u64) * block_count;
 
-	if (locations == NULL)
-		return SQFS_ERROR_ALLOC;
+	sqfs_trace_begin("table", "write table");
 
-	/* Write actual data */
-	m = sqfs_meta_writer_create(file, cmp, 0);
-	if (m == NULL) {
+	/*
+	  The blocks are compressed into fixed size slots, then packed
+	  together and written out in one go, followed by the location list.
+	 */
+	out = alloc_array(SLOT_SIZE + sizeof(sqfs_u64), block_count);
+	if (out == NULL) {
 		ret = SQFS_ERROR_ALLOC;
-		goto out_idx;
+		goto out;
 	}
 
-	while (table_size > 0) {
-		locations[blkidx++] = htole64(file->get_size(file));
+	state.data = data;
+	state.table_size = table_size;
+	state.out = out;
 
-		diff = SQFS_META_BLOCK_SIZE;
-		if (diff > table_size)
-			diff = table_size;
-
-		ret = sqfs_meta_writer_append(m, data, diff);
-		if (ret)
-			goto out;
+	ret = blk_parallel_run(cmp, block_count, num_workers,
+			       compress_block, &state);
+	if (ret)
+		goto out;
 
-		data = (const char *)data + diff;
-		table_size -= diff;
+	locations = alloc_array(sizeof(sqfs_u64), block_count);
+	if (locations == NULL) {
+		ret = SQFS_ERROR_ALLOC;
+		goto out;
 	}
 
-	ret = sqfs_meta_writer_flush(m);
-	if (ret)
-		goto out;
+	off = file->get_size(file);
 
-	/* write location list */
-	*start = file->get_size(file);
+	for (i = 0; i < block_count; ++i) {
+		locations[i] = htole64(off + used);
 
-	list_size = sizeof(sqfs_u64) * block_count;
+		memcpy(&header, out + i * SLOT_SIZE, sizeof(header));
+		header = le16toh(header) & 0x7FFF;
 
-	off = file->get_size(file);
+		memmove(out + used, out + i * SLOT_SIZE, header + 2);
+		used += header + 2;
+	}
 
-	ret = file->write_at(file, off, locations, list_size);
+	memcpy(out + used, locations, list_size);
+	free(locations);
+
+	ret = file->write_at(file, off, out, used + list_size);
 	if (ret)
 		goto out;
 
-	/* cleanup */
-	ret = 0;
+	*start = off + used;
 out:
-	sqfs_meta_writer_destroy(m);
-out_idx:
-	free(locations);
+	free(out);
+	sqfs_trace_end("table", "write table");
 	return ret;
 }
+
+int sqfs_write_table(sqfs_file_t *file, sqfs_compressor_t *cmp,
+		     const void *data, size_t table_size, sqfs_u64 *start)
+{
+	return sqfs_write_table_parallel(file, cmp, data, table_size,
+					 start, 1);
+}
@@ -32,8 +32,30 @@ struct sqfs_xattr_reader_t {
 	sqfs_meta_reader_t *kvrd;
 	sqfs_super_t *super;
 	sqfs_file_t *file;
+
+	/* decoded key-value pairs, by xattr index, allocated on first use */
+	sqfs_xattr_set_t **sets;
 };
 
+static const sqfs_xattr_set_t empty_set;
+
+static void free_set(sqfs_xattr_set_t *set)
+{
+	size_t i;
+
+	if (set == NULL)
+		return;
+
+	for (i = 0; i < set->count; ++i) {
+		free(set->keys[i]);
+		free(set->values[i]);
+	}
+
+	free(set->keys);
+	free(set->values);
+	free(set);
+}
+
 int sqfs_xattr_reader_load_locations(sqfs_xattr_reader_t *xr)
 {
 	sqfs_xattr_id_table_t idtbl;
@@ -155,6 +177,7 @@ int sqfs_xattr_reader_read_value(sqfs_xattr_reader_t *xr,
 
 		sqfs_meta_reader_get_position(xr->kvrd, &start, &offset);
 
+		ref = le64toh(ref);
 		new_start = xr->xattr_start + (ref >> 16);
 		if (new_start >= xr->super->bytes_used)
 			return SQFS_ERROR_OUT_OF_BOUNDS;
@@ -166,6 +189,11 @@ int sqfs_xattr_reader_read_value(sqfs_xattr_reader_t *xr,
 		ret = sqfs_meta_reader_seek(xr->kvrd, new_start, new_offset);
 		if (ret)
 			return ret;
+
+		/* the actual size is stored in front of the value */
+		ret = sqfs_meta_reader_read(xr->kvrd, &value, sizeof(value));
+		if (ret)
+			return ret;
 	}
 
 	value.size = le32toh(value.size);
@@ -242,8 +270,104 @@ int sqfs_xattr_reader_get_desc(sqfs_xattr_reader_t *xr, sqfs_u32 idx,
 	return 0;
 }
 
+static int read_set(sqfs_xattr_reader_t *xr, const sqfs_xattr_id_t *desc,
+		    sqfs_xattr_set_t **out)
+{
+	sqfs_xattr_set_t *set;
+	size_t count;
+	int ret;
+
+	set = calloc(1, sizeof(*set));
+	if (set == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	count = desc->count ? desc->count : 1;
+	set->keys = alloc_array(sizeof(set->keys[0]), count);
+	set->values = alloc_array(sizeof(set->values[0]), count);
+
+	if (set->keys == NULL || set->values == NULL) {
+		ret = errno == EOVERFLOW ? SQFS_ERROR_OVERFLOW :
+			SQFS_ERROR_ALLOC;
+		goto fail;
+	}
+
+	ret = sqfs_xattr_reader_seek_kv(xr, desc);
+	if (ret)
+		goto fail;
+
+	while (set->count < desc->count) {
+		ret = sqfs_xattr_reader_read_key(xr, set->keys + set->count);
+		if (ret)
+			goto fail;
+
+		ret = sqfs_xattr_reader_read_value(xr, set->keys[set->count],
+						   set->values + set->count);
+		if (ret) {
+			free(set->keys[set->count]);
+			goto fail;
+		}
+
+		set->count += 1;
+	}
+
+	*out = set;
+	return 0;
+fail:
+	free_set(set);
+	return ret;
+}
+
+int sqfs_xattr_reader_get_set(sqfs_xattr_reader_t *xr, sqfs_u32 idx,
+			      const sqfs_xattr_set_t **out)
+{
+	sqfs_xattr_set_t *set;
+	sqfs_xattr_id_t desc;
+	int ret;
+
+	*out = &empty_set;
+
+	if (idx == 0xFFFFFFFF)
+		return 0;
+
+	if (xr->kvrd == NULL || xr->idrd == NULL)
+		return idx == 0 ? 0 : SQFS_ERROR_OUT_OF_BOUNDS;
+
+	if (idx >= xr->num_ids)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	if (xr->sets == NULL) {
+		xr->sets = alloc_array(sizeof(xr->sets[0]), xr->num_ids);
+		if (xr->sets == NULL)
+			return SQFS_ERROR_ALLOC;
+	}
+
+	if (xr->sets[idx] == NULL) {
+		ret = sqfs_xattr_reader_get_desc(xr, idx, &desc);
+		if (ret)
+			return ret;
+
+		ret = read_set(xr, &desc, &set);
+		if (ret)
+			return ret;
+
+		xr->sets[idx] = set;
+	}
+
+	*out = xr->sets[idx];
+	return 0;
+}
+
 void sqfs_xattr_reader_destroy(sqfs_xattr_reader_t *xr)
 {
+	size_t i;
+
+	if (xr->sets != NULL) {
+		for (i = 0; i < xr->num_ids; ++i)
+			free_set(xr->sets[i]);
+
+		free(xr->sets);
+	}
+
 	if (xr->kvrd != NULL)
 		sqfs_meta_reader_destroy(xr->kvrd);
 
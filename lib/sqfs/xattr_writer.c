@@ -26,59 +26,13 @@
 #define XATTR_KEY_BUCKETS 31
 #define XATTR_VALUE_BUCKETS 511
 #define XATTR_INITIAL_PAIR_CAP 128
+#define XATTR_INITIAL_BLOCK_BUCKETS 64
 
 #define MK_PAIR(key, value) (((sqfs_u64)(key) << 32UL) | (sqfs_u64)(value))
 #define GET_KEY(pair) ((pair >> 32UL) & 0x0FFFFFFFFUL)
 #define GET_VALUE(pair) (pair & 0x0FFFFFFFFUL)
 
 
-static const char *hexmap = "0123456789ABCDEF";
-
-static char *to_base32(const void *input, size_t size)
-{
-	const sqfs_u8 *in = input;
-	char *out, *ptr;
-	size_t i;
-
-	out = malloc(2 * size + 1);
-	if (out == NULL)
-		return NULL;
-
-	ptr = out;
-
-	for (i = 0; i < size; ++i) {
-		*(ptr++) = hexmap[ in[i]       & 0x0F];
-		*(ptr++) = hexmap[(in[i] >> 4) & 0x0F];
-	}
-
-	*ptr = '\0';
-	return out;
-}
-
-static void *from_base32(const char *input, size_t *size_out)
-{
-	sqfs_u8 lo, hi, *out, *ptr;
-	size_t len;
-
-	len = strlen(input);
-	*size_out = len / 2;
-
-	out = malloc(*size_out);
-	if (out == NULL)
-		return NULL;
-
-	ptr = out;
-
-	while (*input != '\0') {
-		lo = strchr(hexmap, *(input++)) - hexmap;
-		hi = strchr(hexmap, *(input++)) - hexmap;
-
-		*(ptr++) = lo | (hi << 4);
-	}
-
-	return out;
-}
-
 static int compare_u64(const void *a, const void *b)
 {
 	sqfs_u64 lhs = *((const sqfs_u64 *)a);
@@ -91,6 +45,9 @@ static int compare_u64(const void *a, const void *b)
 
 typedef struct kv_block_desc_t {
 	struct kv_block_desc_t *next;
+	struct kv_block_desc_t *hash_next;
+	sqfs_u64 hash;
+	sqfs_u32 index;
 	size_t start;
 	size_t count;
 
@@ -109,7 +66,12 @@ struct sqfs_xattr_writer_t {
 	size_t kv_start;
 
 	kv_block_desc_t *kv_blocks;
+	kv_block_desc_t *kv_blocks_last;
 	size_t num_blocks;
+
+	/* hash table over the sorted key-value ranges of all blocks */
+	kv_block_desc_t **block_buckets;
+	size_t num_block_buckets;
 };
 
 
@@ -129,7 +91,16 @@ sqfs_xattr_writer_t *sqfs_xattr_writer_create(void)
 	if (xwr->kv_pairs == NULL)
 		goto fail_pairs;
 
+	xwr->num_block_buckets = XATTR_INITIAL_BLOCK_BUCKETS;
+	xwr->block_buckets = alloc_array(sizeof(xwr->block_buckets[0]),
+					 xwr->num_block_buckets);
+
+	if (xwr->block_buckets == NULL)
+		goto fail_buckets;
+
 	return xwr;
+fail_buckets:
+	free(xwr->kv_pairs);
 fail_pairs:
 	str_table_cleanup(&xwr->values);
 fail_values:
@@ -149,6 +120,7 @@ void sqfs_xattr_writer_destroy(sqfs_xattr_writer_t *xwr)
 		free(blk);
 	}
 
+	free(xwr->block_buckets);
 	free(xwr->kv_pairs);
 	str_table_cleanup(&xwr->values);
 	str_table_cleanup(&xwr->keys);
@@ -166,7 +138,6 @@ int sqfs_xattr_writer_add(sqfs_xattr_writer_t *xwr, const char *key,
 {
 	size_t i, key_index, old_value_index, value_index, new_count;
 	sqfs_u64 kv_pair, *new;
-	char *value_str;
 	int err;
 
 	if (!sqfs_has_xattr(key))
@@ -177,12 +148,8 @@ int sqfs_xattr_writer_add(sqfs_xattr_writer_t *xwr, const char *key,
 	if (err)
 		return err;
 
-	value_str = to_base32(value, size);
-	if (value_str == NULL)
-		return SQFS_ERROR_ALLOC;
-
-	err = str_table_get_index(&xwr->values, value_str, &value_index);
-	free(value_str);
+	err = str_table_get_blob_index(&xwr->values, value, size,
+				       &value_index);
 	if (err)
 		return err;
 
@@ -227,12 +194,61 @@ int sqfs_xattr_writer_add(sqfs_xattr_writer_t *xwr, const char *key,
 	return 0;
 }
 
+static kv_block_desc_t *find_block(const sqfs_xattr_writer_t *xwr,
+				   sqfs_u64 hash, size_t count)
+{
+	kv_block_desc_t *blk;
+	size_t size;
+
+	size = sizeof(xwr->kv_pairs[0]) * count;
+	blk = xwr->block_buckets[hash & (xwr->num_block_buckets - 1)];
+
+	while (blk != NULL) {
+		if (blk->hash == hash && blk->count == count &&
+		    memcmp(xwr->kv_pairs + blk->start,
+			   xwr->kv_pairs + xwr->kv_start, size) == 0) {
+			break;
+		}
+
+		blk = blk->hash_next;
+	}
+
+	return blk;
+}
+
+static void block_buckets_grow(sqfs_xattr_writer_t *xwr)
+{
+	size_t i, newsz = xwr->num_block_buckets * 2;
+	kv_block_desc_t **new, *blk;
+
+	if (xwr->num_blocks < xwr->num_block_buckets)
+		return;
+
+	/* if this fails, the chains simply get longer */
+	new = alloc_array(sizeof(new[0]), newsz);
+	if (new == NULL)
+		return;
+
+	for (i = 0; i < xwr->num_block_buckets; ++i) {
+		while (xwr->block_buckets[i] != NULL) {
+			blk = xwr->block_buckets[i];
+			xwr->block_buckets[i] = blk->hash_next;
+
+			blk->hash_next = new[blk->hash & (newsz - 1)];
+			new[blk->hash & (newsz - 1)] = blk;
+		}
+	}
+
+	free(xwr->block_buckets);
+	xwr->block_buckets = new;
+	xwr->num_block_buckets = newsz;
+}
+
 int sqfs_xattr_writer_end(sqfs_xattr_writer_t *xwr, sqfs_u32 *out)
 {
-	kv_block_desc_t *blk, *blk_prev;
 	size_t i, count, value_idx;
-	sqfs_u32 index;
-	int ret;
+	kv_block_desc_t *blk;
+	sqfs_u64 hash;
 
 	count = xwr->num_pairs - xwr->kv_start;
 	if (count == 0) {
@@ -243,27 +259,10 @@ int sqfs_xattr_writer_end(sqfs_xattr_writer_t *xwr, sqfs_u32 *out)
 	qsort(xwr->kv_pairs + xwr->kv_start, count,
 	      sizeof(xwr->kv_pairs[0]), compare_u64);
 
-	blk_prev = NULL;
-	blk = xwr->kv_blocks;
-	index = 0;
+	hash = xxh64(xwr->kv_pairs + xwr->kv_start,
+		     sizeof(xwr->kv_pairs[0]) * count);
 
-	while (blk != NULL) {
-		if (blk->count == count) {
-			ret = memcmp(xwr->kv_pairs + blk->start,
-				     xwr->kv_pairs + xwr->kv_start,
-				     sizeof(xwr->kv_pairs[0]) * count);
-
-			if (ret == 0)
-				break;
-		}
-
-		if (index == 0xFFFFFFFF)
-			return SQFS_ERROR_OVERFLOW;
-
-		++index;
-		blk_prev = blk;
-		blk = blk->next;
-	}
+	blk = find_block(xwr, hash, count);
 
 	if (blk != NULL) {
 		for (i = 0; i < count; ++i) {
@@ -276,23 +275,36 @@ int sqfs_xattr_writer_end(sqfs_xattr_writer_t *xwr, sqfs_u32 *out)
 
 		xwr->num_pairs = xwr->kv_start;
 	} else {
+		if (xwr->num_blocks > 0xFFFFFFFE)
+			return SQFS_ERROR_OVERFLOW;
+
+		block_buckets_grow(xwr);
+
 		blk = calloc(1, sizeof(*blk));
 		if (blk == NULL)
 			return SQFS_ERROR_ALLOC;
 
+		blk->hash = hash;
+		blk->index = xwr->num_blocks;
 		blk->start = xwr->kv_start;
 		blk->count = count;
 
-		if (blk_prev == NULL) {
+		if (xwr->kv_blocks_last == NULL) {
 			xwr->kv_blocks = blk;
 		} else {
-			blk_prev->next = blk;
+			xwr->kv_blocks_last->next = blk;
 		}
 
+		xwr->kv_blocks_last = blk;
+
+		i = hash & (xwr->num_block_buckets - 1);
+		blk->hash_next = xwr->block_buckets[i];
+		xwr->block_buckets[i] = blk;
+
 		xwr->num_blocks += 1;
 	}
 
-	*out = index;
+	*out = blk->index;
 	return 0;
 }
 
@@ -331,20 +343,14 @@ static sqfs_s32 write_key(sqfs_meta_writer_t *mw, const char *key,
 	return sizeof(kent) + len;
 }
 
-static sqfs_s32 write_value(sqfs_meta_writer_t *mw, const char *value_str,
-			    sqfs_u64 *value_ref_out)
+static sqfs_s32 write_value(sqfs_meta_writer_t *mw, const void *value,
+			    size_t size, sqfs_u64 *value_ref_out)
 {
 	sqfs_xattr_value_t vent;
 	sqfs_u32 offset;
 	sqfs_u64 block;
-	size_t size;
-	void *value;
 	int err;
 
-	value = from_base32(value_str, &size);
-	if (value == NULL)
-		return SQFS_ERROR_ALLOC;
-
 	memset(&vent, 0, sizeof(vent));
 	vent.size = htole32(size);
 
@@ -353,17 +359,13 @@ static sqfs_s32 write_value(sqfs_meta_writer_t *mw, const char *value_str,
 
 	err = sqfs_meta_writer_append(mw, &vent, sizeof(vent));
 	if (err)
-		goto fail;
+		return err;
 
 	err = sqfs_meta_writer_append(mw, value, size);
 	if (err)
-		goto fail;
+		return err;
 
-	free(value);
 	return sizeof(vent) + size;
-fail:
-	free(value);
-	return err;
 }
 
 static sqfs_s32 write_value_ool(sqfs_meta_writer_t *mw, sqfs_u64 location)
@@ -387,7 +389,7 @@ static sqfs_s32 write_value_ool(sqfs_meta_writer_t *mw, sqfs_u64 location)
 	return sizeof(vent) + sizeof(ref);
 }
 
-static bool should_store_ool(const char *val_str, size_t refcount)
+static bool should_store_ool(size_t size, size_t refcount)
 {
 	if (refcount < 2)
 		return false;
@@ -403,16 +405,17 @@ static bool should_store_ool(const char *val_str, size_t refcount)
 	   => (refcount - 1) * len > (refcount - 1) * 8
 	   => len > 8
 	 */
-	return (strlen(val_str) / 2) > sizeof(sqfs_u64);
+	return size > sizeof(sqfs_u64);
 }
 
 static int write_block_pairs(sqfs_xattr_writer_t *xwr, sqfs_meta_writer_t *mw,
 			     kv_block_desc_t *blk, sqfs_u64 *ool_locations)
 {
 	sqfs_u32 key_idx, val_idx;
-	const char *key_str, *value_str;
 	sqfs_s32 diff, total = 0;
-	size_t i, refcount;
+	size_t i, refcount, size;
+	const char *key_str;
+	const void *value;
 	sqfs_u64 ref;
 
 	for (i = 0; i < blk->count; ++i) {
@@ -420,7 +423,7 @@ static int write_block_pairs(sqfs_xattr_writer_t *xwr, sqfs_meta_writer_t *mw,
 		val_idx = GET_VALUE(xwr->kv_pairs[blk->start + i]);
 
 		key_str = str_table_get_string(&xwr->keys, key_idx);
-		value_str = str_table_get_string(&xwr->values, val_idx);
+		value = str_table_get_blob(&xwr->values, val_idx, &size);
 
 		if (ool_locations[val_idx] == 0xFFFFFFFFFFFFFFFFUL) {
 			diff = write_key(mw, key_str, false);
@@ -428,7 +431,7 @@ static int write_block_pairs(sqfs_xattr_writer_t *xwr, sqfs_meta_writer_t *mw,
 				return diff;
 			total += diff;
 
-			diff = write_value(mw, value_str, &ref);
+			diff = write_value(mw, value, size, &ref);
 			if (diff < 0)
 				return diff;
 			total += diff;
@@ -436,7 +439,7 @@ static int write_block_pairs(sqfs_xattr_writer_t *xwr, sqfs_meta_writer_t *mw,
 			refcount = str_table_get_ref_count(&xwr->values,
 							   val_idx);
 
-			if (should_store_ool(value_str, refcount))
+			if (should_store_ool(size, refcount))
 				ool_locations[val_idx] = ref;
 		} else {
 			diff = write_key(mw, key_str, true);
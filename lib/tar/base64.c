@@ -8,25 +8,66 @@
 
 #include "internal.h"
 
+#include "util/cpu.h"
+
+/* base64 value of a character plus one, zero if it is not part of it */
+static const sqfs_u8 b64_lut[256] = {
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3F, 0x00, 0x40, 0x00, 0x40,
+	0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+	0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29,
+	0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33, 0x34, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
 static sqfs_u8 convert(char in)
 {
-	if (isupper(in))
-		return in - 'A';
-	if (islower(in))
-		return in - 'a' + 26;
-	if (isdigit(in))
-		return in - '0' + 52;
-	if (in == '+')
-		return 62;
-	if (in == '/' || in == '-')
-		return 63;
-	return 0;
+	sqfs_u8 x = b64_lut[(unsigned char)in];
+
+	return x == 0 ? 0 : (x - 1);
 }
 
 void base64_decode(sqfs_u8 *out, const char *in)
 {
+	size_t len = strlen(in), done;
+	sqfs_u8 a, b, c, d;
+	sqfs_u32 x;
 	char temp[4];
 
+	done = cpu_kernels.base64_decode(out, in, len);
+	out += (done / 4) * 3;
+	in += done;
+	len -= done;
+
+	/* whole groups of valid characters, without the checks below */
+	for (; len >= 4; len -= 4) {
+		a = b64_lut[(unsigned char)in[0]];
+		b = b64_lut[(unsigned char)in[1]];
+		c = b64_lut[(unsigned char)in[2]];
+		d = b64_lut[(unsigned char)in[3]];
+
+		if (a == 0 || b == 0 || c == 0 || d == 0)
+			break;
+
+		x = ((sqfs_u32)(a - 1) << 18) | ((sqfs_u32)(b - 1) << 12) |
+			((sqfs_u32)(c - 1) << 6) | (sqfs_u32)(d - 1);
+
+		*(out++) = (x >> 16) & 0xFF;
+		*(out++) = (x >> 8) & 0xFF;
+		*(out++) = x & 0xFF;
+		in += 4;
+	}
+
 	while (*in != '\0' && *in != '=') {
 		temp[0] = *in == '\0' ? 0 : convert(*(in++));
 		temp[1] = *in == '\0' ? 0 : convert(*(in++));
@@ -8,29 +8,28 @@
 
 #include "internal.h"
 
+#include "util/cpu.h"
+
 static unsigned int get_checksum(const tar_header_t *hdr)
 {
-	const unsigned char *header_start = (const unsigned char *)hdr;
-	const unsigned char *chksum_start = (const unsigned char *)hdr->chksum;
-	const unsigned char *header_end = header_start + sizeof(*hdr);
-	const unsigned char *chksum_end = chksum_start + sizeof(hdr->chksum);
-	const unsigned char *p;
-	unsigned int chksum = 0;
-
-	for (p = header_start; p < chksum_start; p++)
-		chksum += *p;
-	for (; p < chksum_end; p++)
-		chksum += ' ';
-	for (; p < header_end; p++)
-		chksum += *p;
-	return chksum;
+	const unsigned char *chksum = (const unsigned char *)hdr->chksum;
+	unsigned int sum;
+	size_t i;
+
+	/* the checksum field itself is counted as if it were all spaces */
+	sum = cpu_kernels.byte_sum(hdr, sizeof(*hdr));
+
+	for (i = 0; i < sizeof(hdr->chksum); ++i)
+		sum -= chksum[i];
+
+	return sum + sizeof(hdr->chksum) * ' ';
 }
 
 void update_checksum(tar_header_t *hdr)
 {
 	unsigned int chksum = get_checksum(hdr);
 
-	sprintf(hdr->chksum, "%06o", chksum);
+	write_octal(hdr->chksum, chksum, 6);
 	hdr->chksum[6] = '\0';
 	hdr->chksum[7] = ' ';
 }
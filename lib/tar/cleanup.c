@@ -32,7 +32,12 @@ void free_xattr_list(tar_xattr_t *list)
 
 void clear_header(tar_header_decoded_t *hdr)
 {
-	free_xattr_list(hdr->xattr);
+	if (hdr->xattr_arena != NULL) {
+		free(hdr->xattr_arena);
+	} else {
+		free_xattr_list(hdr->xattr);
+	}
+
 	free_sparse_list(hdr->sparse);
 	free(hdr->name);
 	free(hdr->link_target);
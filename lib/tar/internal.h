@@ -48,6 +48,12 @@ int read_binary(const char *str, int digits, sqfs_u64 *out);
 
 int read_number(const char *str, int digits, sqfs_u64 *out);
 
+/*
+  Write exactly the given number of octal digits, padded with leading zeros,
+  without a terminator. Higher digits of the value are cut off.
+ */
+void write_octal(char *dst, sqfs_u64 value, int digits);
+
 int pax_read_decimal(const char *str, sqfs_u64 *out);
 
 void update_checksum(tar_header_t *hdr);
@@ -56,7 +62,7 @@ bool is_checksum_valid(const tar_header_t *hdr);
 
 sparse_map_t *read_sparse_map(const char *line);
 
-sparse_map_t *read_gnu_old_sparse(int fd, tar_header_t *hdr);
+sparse_map_t *read_gnu_old_sparse(istream_t *fp, tar_header_t *hdr);
 
 void free_sparse_list(sparse_map_t *sparse);
 
@@ -8,15 +8,48 @@
 
 #include "internal.h"
 
+#define OCTAL_ZEROS (0x3030303030303030ULL)
+#define OCTAL_MASK (0xF8F8F8F8F8F8F8F8ULL)
+
+/*
+  Convert 8 octal digits at once, if they all are. The first digit is the most
+  significant one, i.e. the lowest byte of the little endian word.
+ */
+static bool octal_word(const char *str, sqfs_u64 *out)
+{
+	sqfs_u64 x;
+
+	memcpy(&x, str, sizeof(x));
+	x = le64toh(x);
+
+	if ((x & OCTAL_MASK) != OCTAL_ZEROS)
+		return false;
+
+	x -= OCTAL_ZEROS;
+	x = ((x & 0x0007000700070007ULL) << 3) | ((x >> 8) & 0x0007000700070007ULL);
+	x = ((x & 0x0000003F0000003FULL) << 6) | ((x >> 16) & 0x0000003F0000003FULL);
+	x = ((x & 0x0000000000000FFFULL) << 12) | ((x >> 32) & 0x0000000000000FFFULL);
+
+	*out = x;
+	return true;
+}
+
 int read_octal(const char *str, int digits, sqfs_u64 *out)
 {
-	sqfs_u64 result = 0;
+	sqfs_u64 result = 0, x;
 
 	while (digits > 0 && isspace(*str)) {
 		++str;
 		--digits;
 	}
 
+	/* the result must not exceed 64 bits, otherwise let the loop fail */
+	while (digits >= 8 && result < (1ULL << 40) && octal_word(str, &x)) {
+		result = (result << 24) | x;
+		str += 8;
+		digits -= 8;
+	}
+
 	while (digits > 0 && *str >= '0' && *str <= '7') {
 		if (result > 0x1FFFFFFFFFFFFFFFUL) {
 			fputs("numeric overflow parsing tar header\n", stderr);
@@ -75,6 +108,14 @@ int read_number(const char *str, int digits, sqfs_u64 *out)
 	return read_octal(str, digits, out);
 }
 
+void write_octal(char *dst, sqfs_u64 value, int digits)
+{
+	while (digits > 0) {
+		dst[--digits] = '0' + (value & 7);
+		value >>= 3;
+	}
+}
+
 int pax_read_decimal(const char *str, sqfs_u64 *out)
 {
 	sqfs_u64 result = 0;
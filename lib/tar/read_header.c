@@ -8,12 +8,7 @@
 
 #include "internal.h"
 
-static bool is_zero_block(const tar_header_t *hdr)
-{
-	const unsigned char *ptr = (const unsigned char *)hdr;
-
-	return ptr[0] == '\0' && memcmp(ptr, ptr + 1, sizeof(*hdr) - 1) == 0;
-}
+#include "util/cpu.h"
 
 static int check_version(const tar_header_t *hdr)
 {
@@ -35,17 +30,17 @@ static int check_version(const tar_header_t *hdr)
 	return ETV_UNKNOWN;
 }
 
-static char *record_to_memory(int fd, sqfs_u64 size)
+static char *record_to_memory(istream_t *fp, sqfs_u64 size)
 {
 	char *buffer = malloc(size + 1);
 
 	if (buffer == NULL)
 		goto fail_errno;
 
-	if (read_retry("reading tar record", fd, buffer, size))
+	if (read_retry("reading tar record", fp, buffer, size))
 		goto fail;
 
-	if (skip_padding(fd, size))
+	if (skip_padding(fp, size))
 		goto fail;
 
 	buffer[size] = '\0';
@@ -58,32 +53,96 @@ fail:
 	return NULL;
 }
 
-static tar_xattr_t *mkxattr(const char *key, size_t keylen,
-			    const char *value, size_t valuelen)
+/*
+  The PAX header is parsed in place in the stream buffer if possible. The
+  parser needs a null byte after the record, so that only works if the
+  record is followed by padding. Otherwise it is copied and *copy has to be
+  freed by the caller.
+ */
+static char *pax_record(istream_t *fp, sqfs_u64 size, char **copy)
 {
-	tar_xattr_t *xattr;
+	size_t padd = size % 512 ? 512 - size % 512 : 0;
+	char *ptr;
+
+	*copy = NULL;
+
+	if (padd == 0) {
+		*copy = record_to_memory(fp, size);
+		return *copy;
+	}
 
-	xattr = calloc(1, sizeof(*xattr) + keylen + 1 + valuelen + 1);
-	if (xattr == NULL)
+	if (istream_fill(fp, size + padd))
 		return NULL;
 
+	ptr = (char *)fp->buffer + fp->buffer_offset;
+	fp->buffer_offset += size + padd;
+
+	ptr[size] = '\0';
+	return ptr;
+}
+
+#define XATTR_ALIGN(x) (((x) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+/*
+  All extended attributes of a header are allocated from a single block,
+  sized for the worst case once the first one is found. A key and value
+  pair never takes up more than the line it was decoded from, so the rest
+  of the record plus a node for every remaining line is enough.
+ */
+static int alloc_xattr_arena(tar_header_decoded_t *out, const char *line,
+			     const char *end)
+{
+	size_t lines = 1, size;
+	const char *ptr;
+
+	for (ptr = line; ptr < end; ++ptr) {
+		if (*ptr == '\n')
+			++lines;
+	}
+
+	size = (end - line) + 1;
+	size += lines * XATTR_ALIGN(sizeof(tar_xattr_t) + 2);
+
+	out->xattr_arena = malloc(size);
+	if (out->xattr_arena == NULL)
+		return -1;
+
+	out->xattr_used = 0;
+	return 0;
+}
+
+static tar_xattr_t *mkxattr(tar_header_decoded_t *out, const char *key,
+			    size_t keylen, const char *value,
+			    size_t valuelen)
+{
+	tar_xattr_t *xattr;
+
+	xattr = (tar_xattr_t *)(out->xattr_arena + out->xattr_used);
+	out->xattr_used += XATTR_ALIGN(sizeof(*xattr) + keylen + 1 +
+				       valuelen + 1);
+
 	xattr->key = xattr->data;
 	xattr->value = xattr->data + keylen + 1;
 	memcpy(xattr->key, key, keylen);
+	xattr->key[keylen] = '\0';
 	memcpy(xattr->value, value, valuelen);
+	xattr->value[valuelen] = '\0';
+
+	xattr->next = out->xattr;
+	out->xattr = xattr;
 	return xattr;
 }
 
-static int read_pax_header(int fd, sqfs_u64 entsize, unsigned int *set_by_pax,
-			   tar_header_decoded_t *out)
+static int read_pax_header(istream_t *fp, sqfs_u64 entsize,
+			   unsigned int *set_by_pax, tar_header_decoded_t *out)
 {
 	sparse_map_t *sparse_last = NULL, *sparse;
 	sqfs_u64 field, offset = 0, num_bytes = 0;
-	char *buffer, *line, *key, *ptr, *value;
+	char *buffer, *copy, *line, *key, *ptr, *value;
 	tar_xattr_t *xattr;
 	sqfs_u64 i;
 
-	buffer = record_to_memory(fd, entsize);
+	buffer = pax_record(fp, entsize, &copy);
 	if (buffer == NULL)
 		return -1;
 
@@ -185,12 +244,12 @@ static int read_pax_header(int fd, sqfs_u64 entsize, unsigned int *set_by_pax,
 
 			value = ptr + 1;
 
-			xattr = mkxattr(key, ptr - key, value, strlen(value));
-			if (xattr == NULL)
+			if (out->xattr_arena == NULL &&
+			    alloc_xattr_arena(out, line, buffer + entsize)) {
 				goto fail_errno;
+			}
 
-			xattr->next = out->xattr;
-			out->xattr = xattr;
+			mkxattr(out, key, ptr - key, value, strlen(value));
 		} else if (!strncmp(line, "LIBARCHIVE.xattr.", 17)) {
 			key = line + 17;
 
@@ -200,25 +259,26 @@ static int read_pax_header(int fd, sqfs_u64 entsize, unsigned int *set_by_pax,
 
 			value = ptr + 1;
 
-			xattr = mkxattr(key, ptr - key, value, strlen(value));
-			if (xattr == NULL)
+			if (out->xattr_arena == NULL &&
+			    alloc_xattr_arena(out, line, buffer + entsize)) {
 				goto fail_errno;
+			}
+
+			xattr = mkxattr(out, key, ptr - key, value,
+					strlen(value));
 
 			urldecode(xattr->key);
 			base64_decode((sqfs_u8 *)xattr->value, value);
-
-			xattr->next = out->xattr;
-			out->xattr = xattr;
 		}
 	}
 
-	free(buffer);
+	free(copy);
 	return 0;
 fail_errno:
 	perror("reading pax header");
 	goto fail;
 fail:
-	free(buffer);
+	free(copy);
 	return -1;
 }
 
@@ -320,8 +380,8 @@ static int decode_header(const tar_header_t *hdr, unsigned int set_by_pax,
 		out->sb.st_mode |= S_IFREG;
 		break;
 	case TAR_TYPE_LINK:
-		/* XXX: hard links are not support yet */
 		out->sb.st_mode = S_IFLNK | 0777;
+		out->is_hard_link = true;
 		break;
 	case TAR_TYPE_SLINK:
 		out->sb.st_mode = S_IFLNK | 0777;
@@ -357,7 +417,7 @@ static int decode_header(const tar_header_t *hdr, unsigned int set_by_pax,
 	return 0;
 }
 
-int read_header(int fd, tar_header_decoded_t *out)
+int read_header(istream_t *fp, tar_header_decoded_t *out)
 {
 	unsigned int set_by_pax = 0;
 	bool prev_was_zero = false;
@@ -368,10 +428,10 @@ int read_header(int fd, tar_header_decoded_t *out)
 	memset(out, 0, sizeof(*out));
 
 	for (;;) {
-		if (read_retry("reading tar header", fd, &hdr, sizeof(hdr)))
+		if (read_retry("reading tar header", fp, &hdr, sizeof(hdr)))
 			goto fail;
 
-		if (is_zero_block(&hdr)) {
+		if (cpu_kernels.is_zero(&hdr, sizeof(hdr))) {
 			if (prev_was_zero)
 				goto out_eof;
 			prev_was_zero = true;
@@ -394,7 +454,7 @@ int read_header(int fd, tar_header_decoded_t *out)
 			if (pax_size < 1 || pax_size > TAR_MAX_SYMLINK_LEN)
 				goto fail_slink_len;
 			free(out->link_target);
-			out->link_target = record_to_memory(fd, pax_size);
+			out->link_target = record_to_memory(fp, pax_size);
 			if (out->link_target == NULL)
 				goto fail;
 			set_by_pax |= PAX_SLINK_TARGET;
@@ -405,7 +465,7 @@ int read_header(int fd, tar_header_decoded_t *out)
 			if (pax_size < 1 || pax_size > TAR_MAX_PATH_LEN)
 				goto fail_path_len;
 			free(out->name);
-			out->name = record_to_memory(fd, pax_size);
+			out->name = record_to_memory(fp, pax_size);
 			if (out->name == NULL)
 				goto fail;
 			set_by_pax |= PAX_NAME;
@@ -417,12 +477,12 @@ int read_header(int fd, tar_header_decoded_t *out)
 			if (pax_size < 1 || pax_size > TAR_MAX_PAX_LEN)
 				goto fail_pax_len;
 			set_by_pax = 0;
-			if (read_pax_header(fd, pax_size, &set_by_pax, out))
+			if (read_pax_header(fp, pax_size, &set_by_pax, out))
 				goto fail;
 			continue;
 		case TAR_TYPE_GNU_SPARSE:
 			free_sparse_list(out->sparse);
-			out->sparse = read_gnu_old_sparse(fd, &hdr);
+			out->sparse = read_gnu_old_sparse(fp, &hdr);
 			if (out->sparse == NULL)
 				goto fail;
 			if (read_number(hdr.tail.gnu.realsize,
@@ -6,22 +6,19 @@
  */
 #include "config.h"
 
-#include <unistd.h>
-#include <errno.h>
 #include <stdio.h>
 
 #include "tar.h"
 
-int read_retry(const char *errstr, int fd, void *buffer, size_t size)
+int read_retry(const char *errstr, istream_t *fp, void *buffer, size_t size)
 {
-	ssize_t ret;
+	sqfs_s32 ret;
 
 	while (size > 0) {
-		ret = read(fd, buffer, size);
+		ret = istream_read(fp, buffer, size);
 		if (ret < 0) {
-			if (errno == EINTR)
-				continue;
-			perror(errstr);
+			fprintf(stderr, "%s: error reading from %s\n", errstr,
+				fp->get_filename(fp));
 			return -1;
 		}
 		if (ret == 0) {
@@ -8,7 +8,13 @@
 
 #include "internal.h"
 
-sparse_map_t *read_gnu_old_sparse(int fd, tar_header_t *hdr)
+/* GNU tar stores offsets that do not fit into 11 octal digits in base 256 */
+static bool is_number(const char *field)
+{
+	return (field[0] & 0x80) || isdigit(field[0]);
+}
+
+sparse_map_t *read_gnu_old_sparse(istream_t *fp, tar_header_t *hdr)
 {
 	sparse_map_t *list = NULL, *end = NULL, *node;
 	gnu_sparse_t sph;
@@ -16,15 +22,15 @@ sparse_map_t *read_gnu_old_sparse(int fd, tar_header_t *hdr)
 	int i;
 
 	for (i = 0; i < 4; ++i) {
-		if (!isdigit(hdr->tail.gnu.sparse[i].offset[0]))
+		if (!is_number(hdr->tail.gnu.sparse[i].offset))
 			break;
-		if (!isdigit(hdr->tail.gnu.sparse[i].numbytes[0]))
+		if (!is_number(hdr->tail.gnu.sparse[i].numbytes))
 			break;
 
-		if (read_octal(hdr->tail.gnu.sparse[i].offset,
+		if (read_number(hdr->tail.gnu.sparse[i].offset,
 			       sizeof(hdr->tail.gnu.sparse[i].offset), &off))
 			goto fail;
-		if (read_octal(hdr->tail.gnu.sparse[i].numbytes,
+		if (read_number(hdr->tail.gnu.sparse[i].numbytes,
 			       sizeof(hdr->tail.gnu.sparse[i].numbytes), &sz))
 			goto fail;
 
@@ -48,20 +54,20 @@ sparse_map_t *read_gnu_old_sparse(int fd, tar_header_t *hdr)
 
 	do {
 		if (read_retry("reading GNU sparse header",
-			       fd, &sph, sizeof(sph))) {
+			       fp, &sph, sizeof(sph))) {
 			goto fail;
 		}
 
 		for (i = 0; i < 21; ++i) {
-			if (!isdigit(sph.sparse[i].offset[0]))
+			if (!is_number(sph.sparse[i].offset))
 				break;
-			if (!isdigit(sph.sparse[i].numbytes[0]))
+			if (!is_number(sph.sparse[i].numbytes))
 				break;
 
-			if (read_octal(sph.sparse[i].offset,
+			if (read_number(sph.sparse[i].offset,
 				       sizeof(sph.sparse[i].offset), &off))
 				goto fail;
-			if (read_octal(sph.sparse[i].numbytes,
+			if (read_number(sph.sparse[i].numbytes,
 				       sizeof(sph.sparse[i].numbytes), &sz))
 				goto fail;
 
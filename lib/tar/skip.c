@@ -9,37 +9,16 @@
 #include "util/util.h"
 #include "tar.h"
 
-#include <stdio.h>
-
-static int skip_bytes(int fd, sqfs_u64 size)
-{
-	unsigned char buffer[1024];
-	size_t diff;
-
-	while (size != 0) {
-		diff = sizeof(buffer);
-		if (diff > size)
-			diff = size;
-
-		if (read_retry("reading tar record padding", fd, buffer, diff))
-			return -1;
-
-		size -= diff;
-	}
-
-	return 0;
-}
-
-int skip_padding(int fd, sqfs_u64 size)
+int skip_padding(istream_t *fp, sqfs_u64 size)
 {
 	size_t tail = size % 512;
 
-	return tail ? skip_bytes(fd, 512 - tail) : 0;
+	return tail ? istream_skip(fp, 512 - tail) : 0;
 }
 
-int skip_entry(int fd, sqfs_u64 size)
+int skip_entry(istream_t *fp, sqfs_u64 size)
 {
 	size_t tail = size % 512;
 
-	return skip_bytes(fd, tail ? (size + 512 - tail) : size);
+	return istream_skip(fp, tail ? (size + 512 - tail) : size);
 }
@@ -19,19 +19,31 @@ static int xdigit(int x)
 
 void urldecode(char *str)
 {
-	unsigned char *out = (unsigned char *)str;
-	char *in = str;
-	int x;
+	char *in = strchr(str, '%'), *next;
+	unsigned char *out;
+	size_t len;
 
-	while (*in != '\0') {
-		x = *(in++);
+	/* most keys have nothing escaped, so skip to the first escape */
+	if (in == NULL)
+		return;
 
-		if (x == '%' && isxdigit(in[0]) && isxdigit(in[1])) {
-			x = xdigit(*(in++)) << 4;
-			x |= xdigit(*(in++));
+	out = (unsigned char *)in;
+
+	while (in != NULL) {
+		if (isxdigit(in[1]) && isxdigit(in[2])) {
+			*(out++) = (xdigit(in[1]) << 4) | xdigit(in[2]);
+			in += 3;
+		} else {
+			*(out++) = *(in++);
 		}
 
-		*(out++) = x;
+		/* move the plain text up to the next escape in one piece */
+		next = strchr(in, '%');
+		len = next == NULL ? strlen(in) : (size_t)(next - in);
+
+		memmove(out, in, len);
+		out += len;
+		in = next;
 	}
 
 	*out = '\0';
@@ -21,26 +21,41 @@ static void write_binary(char *dst, sqfs_u64 value, int digits)
 	((unsigned char *)dst)[0] |= 0x80;
 }
 
+/*
+  Formatting the numbers by hand instead of with sprintf matters for images
+  with lots of small files, where the headers are most of the work.
+ */
 static void write_number(char *dst, sqfs_u64 value, int digits)
 {
 	sqfs_u64 mask = 0;
-	char buffer[64];
 	int i;
 
 	for (i = 0; i < (digits - 1); ++i)
 		mask = (mask << 3) | 7;
 
 	if (value <= mask) {
-		sprintf(buffer, "%0*o ", digits - 1, (unsigned int)value);
-		memcpy(dst, buffer, digits);
+		write_octal(dst, value, digits - 1);
+		dst[digits - 1] = ' ';
 	} else if (value <= ((mask << 3) | 7)) {
-		sprintf(buffer, "%0*o", digits, (unsigned int)value);
-		memcpy(dst, buffer, digits);
+		write_octal(dst, value, digits);
 	} else {
 		write_binary(dst, value, digits);
 	}
 }
 
+static void write_decimal(char *dst, sqfs_u64 value)
+{
+	char buffer[24];
+	size_t i = sizeof(buffer);
+
+	do {
+		buffer[--i] = '0' + (value % 10);
+		value /= 10;
+	} while (value > 0);
+
+	memcpy(dst, buffer + i, sizeof(buffer) - i);
+}
+
 static void write_number_signed(char *dst, sqfs_s64 value, int digits)
 {
 	sqfs_u64 neg;
@@ -53,8 +68,8 @@ static void write_number_signed(char *dst, sqfs_s64 value, int digits)
 	}
 }
 
-static int write_header(int fd, const struct stat *sb, const char *name,
-			const char *slink_target, int type)
+static int write_header(ostream_t *fp, const struct stat *sb,
+			const char *name, const char *slink_target, int type)
 {
 	int maj = 0, min = 0;
 	sqfs_u64 size = 0;
@@ -81,17 +96,17 @@ static int write_header(int fd, const struct stat *sb, const char *name,
 		memcpy(hdr.linkname, slink_target, sb->st_size);
 	memcpy(hdr.magic, TAR_MAGIC_OLD, sizeof(hdr.magic));
 	memcpy(hdr.version, TAR_VERSION_OLD, sizeof(hdr.version));
-	sprintf(hdr.uname, "%u", sb->st_uid);
-	sprintf(hdr.gname, "%u", sb->st_gid);
+	write_decimal(hdr.uname, sb->st_uid);
+	write_decimal(hdr.gname, sb->st_gid);
 	write_number(hdr.devmajor, maj, sizeof(hdr.devmajor));
 	write_number(hdr.devminor, min, sizeof(hdr.devminor));
 
 	update_checksum(&hdr);
 
-	return write_retry("writing tar header record", fd, &hdr, sizeof(hdr));
+	return ostream_append(fp, &hdr, sizeof(hdr));
 }
 
-static int write_gnu_header(int fd, const struct stat *orig,
+static int write_gnu_header(ostream_t *fp, const struct stat *orig,
 			    const char *payload, size_t payload_len,
 			    int type, const char *name)
 {
@@ -101,15 +116,13 @@ static int write_gnu_header(int fd, const struct stat *orig,
 	sb.st_mode = S_IFREG | 0644;
 	sb.st_size = payload_len;
 
-	if (write_header(fd, &sb, name, NULL, type))
+	if (write_header(fp, &sb, name, NULL, type))
 		return -1;
 
-	if (write_retry("writing GNU extension header",
-			fd, payload, payload_len)) {
+	if (ostream_append(fp, payload, payload_len))
 		return -1;
-	}
 
-	return padd_file(fd, payload_len);
+	return padd_file(fp, payload_len);
 }
 
 static size_t num_digits(size_t num)
@@ -124,7 +137,7 @@ static size_t num_digits(size_t num)
 	return i;
 }
 
-static int write_schily_xattr(int fd, const struct stat *orig,
+static int write_schily_xattr(ostream_t *fp, const struct stat *orig,
 			      const char *name, const tar_xattr_t *xattr)
 {
 	static const char *prefix = "SCHILY.xattr.";
@@ -142,20 +155,23 @@ static int write_schily_xattr(int fd, const struct stat *orig,
 	sb.st_mode = S_IFREG | 0644;
 	sb.st_size = total_size;
 
-	if (write_header(fd, &sb, name, NULL, TAR_TYPE_PAX))
+	if (write_header(fp, &sb, name, NULL, TAR_TYPE_PAX))
 		return -1;
 
 	for (it = xattr; it != NULL; it = it->next) {
 		len = strlen(prefix) + strlen(it->key) + strlen(it->value) + 2;
 		len += num_digits(len) + 1;
 
-		dprintf(fd, "%zu %s%s=%s\n", len, prefix, it->key, it->value);
+		if (ostream_printf(fp, "%zu %s%s=%s\n", len, prefix,
+				   it->key, it->value)) {
+			return -1;
+		}
 	}
 
-	return padd_file(fd, total_size);
+	return padd_file(fp, total_size);
 }
 
-int write_tar_header(int fd, const struct stat *sb, const char *name,
+int write_tar_header(ostream_t *fp, const struct stat *sb, const char *name,
 		     const char *slink_target, const tar_xattr_t *xattr,
 		     unsigned int counter)
 {
@@ -166,7 +182,7 @@ int write_tar_header(int fd, const struct stat *sb, const char *name,
 	if (xattr != NULL) {
 		sprintf(buffer, "pax/xattr%u", counter);
 
-		if (write_schily_xattr(fd, sb, buffer, xattr))
+		if (write_schily_xattr(fp, sb, buffer, xattr))
 			return -1;
 	}
 
@@ -175,7 +191,7 @@ int write_tar_header(int fd, const struct stat *sb, const char *name,
 
 	if (S_ISLNK(sb->st_mode) && sb->st_size >= 100) {
 		sprintf(buffer, "gnu/target%u", counter);
-		if (write_gnu_header(fd, sb, slink_target, sb->st_size,
+		if (write_gnu_header(fp, sb, slink_target, sb->st_size,
 				     TAR_TYPE_GNU_SLINK, buffer))
 			return -1;
 		slink_target = NULL;
@@ -184,7 +200,7 @@ int write_tar_header(int fd, const struct stat *sb, const char *name,
 	if (strlen(name) >= 100) {
 		sprintf(buffer, "gnu/name%u", counter);
 
-		if (write_gnu_header(fd, sb, name, strlen(name),
+		if (write_gnu_header(fp, sb, name, strlen(name),
 				     TAR_TYPE_GNU_PATH, buffer)) {
 			return -1;
 		}
@@ -208,7 +224,7 @@ int write_tar_header(int fd, const struct stat *sb, const char *name,
 		goto out_skip;
 	}
 
-	return write_header(fd, sb, name, slink_target, type);
+	return write_header(fp, sb, name, slink_target, type);
 out_skip:
 	fprintf(stderr, "WARNING: %s: %s\n", name, reason);
 	return 1;
@@ -0,0 +1,89 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * clock.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "util/util.h"
+
+#if defined(_WIN32) || defined(__WINDOWS__)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+sqfs_u64 get_time_ns(void)
+{
+	LARGE_INTEGER freq, count;
+
+	if (!QueryPerformanceFrequency(&freq) ||
+	    !QueryPerformanceCounter(&count) || freq.QuadPart <= 0) {
+		return 0;
+	}
+
+	return (sqfs_u64)(count.QuadPart / freq.QuadPart) * 1000000000ULL +
+		((sqfs_u64)(count.QuadPart % freq.QuadPart) * 1000000000ULL) /
+		freq.QuadPart;
+}
+
+static sqfs_u64 filetime_ns(const FILETIME *ft)
+{
+	return (((sqfs_u64)ft->dwHighDateTime << 32) | ft->dwLowDateTime) * 100;
+}
+
+sqfs_u64 get_cpu_time_ns(void)
+{
+	FILETIME created, exited, kernel, user;
+
+	if (!GetProcessTimes(GetCurrentProcess(), &created, &exited,
+			     &kernel, &user)) {
+		return 0;
+	}
+
+	return filetime_ns(&kernel) + filetime_ns(&user);
+}
+
+sqfs_u64 get_thread_cpu_time_ns(void)
+{
+	FILETIME created, exited, kernel, user;
+
+	if (!GetThreadTimes(GetCurrentThread(), &created, &exited,
+			    &kernel, &user)) {
+		return 0;
+	}
+
+	return filetime_ns(&kernel) + filetime_ns(&user);
+}
+#else
+#include <time.h>
+
+sqfs_u64 get_time_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		return 0;
+
+	return (sqfs_u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+sqfs_u64 get_cpu_time_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0)
+		return 0;
+
+	return (sqfs_u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+sqfs_u64 get_thread_cpu_time_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+		return 0;
+
+	return (sqfs_u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
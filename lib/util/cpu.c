@@ -0,0 +1,313 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * cpu.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "util/util.h"
+#include "util/cpu.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_X86
+#include <immintrin.h>
+#include <cpuid.h>
+
+#define TARGET(isa) __attribute__((target(isa)))
+#elif defined(__aarch64__) && defined(__linux__)
+#define CPU_ARM64_LINUX
+#include <sys/auxv.h>
+#endif
+
+#define LO_BYTES (0x00FF00FF00FF00FFULL)
+#define LO_HALVES (0x0000FFFF0000FFFFULL)
+
+/*****************************************************************************/
+
+/*
+  Compare against a zero page that stays in the L1 cache instead of the
+  buffer against itself shifted by one byte, so every byte is only loaded
+  once. The C library's memcmp already picks the widest vector unit the CPU
+  has at runtime and stops at the first difference.
+ */
+static const sqfs_u8 zero_page[4096];
+
+static bool is_zero_generic(const void *data, size_t size)
+{
+	const sqfs_u8 *ptr = data;
+	size_t diff;
+
+	for (; size > 0; size -= diff, ptr += diff) {
+		diff = size < sizeof(zero_page) ? size : sizeof(zero_page);
+
+		if (memcmp(ptr, zero_page, diff) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+static sqfs_u32 byte_sum_generic(const void *data, size_t size)
+{
+	const sqfs_u8 *ptr = data;
+	sqfs_u64 x, acc;
+	size_t i, count;
+	sqfs_u32 sum = 0;
+
+	/*
+	  Add up the bytes in 16 bit lanes, a word at a time. Each lane gains
+	  at most 2 * 255 per word, so fold them every 128 words.
+	 */
+	while (size >= sizeof(x)) {
+		count = size / sizeof(x);
+		if (count > 128)
+			count = 128;
+
+		for (acc = 0, i = 0; i < count; ++i, ptr += sizeof(x)) {
+			memcpy(&x, ptr, sizeof(x));
+			acc += (x & LO_BYTES) + ((x >> 8) & LO_BYTES);
+		}
+
+		acc = (acc & LO_HALVES) + ((acc >> 16) & LO_HALVES);
+		sum += (sqfs_u32)((acc & 0xFFFFFFFF) + (acc >> 32));
+		size -= count * sizeof(x);
+	}
+
+	while (size-- > 0)
+		sum += *(ptr++);
+
+	return sum;
+}
+
+static size_t base64_decode_generic(sqfs_u8 *out, const char *in, size_t len)
+{
+	(void)out; (void)in; (void)len;
+	return 0;
+}
+
+/*****************************************************************************/
+
+#ifdef CPU_X86
+TARGET("sse2")
+static bool is_zero_sse2(const void *data, size_t size)
+{
+	const __m128i *ptr = data;
+	__m128i acc;
+
+	for (; size >= 64; size -= 64, ptr += 4) {
+		acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(ptr),
+						_mm_loadu_si128(ptr + 1)),
+				   _mm_or_si128(_mm_loadu_si128(ptr + 2),
+						_mm_loadu_si128(ptr + 3)));
+		acc = _mm_cmpeq_epi8(acc, _mm_setzero_si128());
+
+		if (_mm_movemask_epi8(acc) != 0xFFFF)
+			return false;
+	}
+
+	return is_zero_generic(ptr, size);
+}
+
+TARGET("avx2")
+static bool is_zero_avx2(const void *data, size_t size)
+{
+	const __m256i *ptr = data;
+	__m256i acc;
+
+	for (; size >= 128; size -= 128, ptr += 4) {
+		acc = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256(ptr),
+						      _mm256_loadu_si256(ptr + 1)),
+				      _mm256_or_si256(_mm256_loadu_si256(ptr + 2),
+						      _mm256_loadu_si256(ptr + 3)));
+
+		if (!_mm256_testz_si256(acc, acc))
+			return false;
+	}
+
+	return is_zero_generic(ptr, size);
+}
+
+/* psadbw against zero adds up 8 bytes into each 64 bit lane */
+TARGET("sse2")
+static sqfs_u32 byte_sum_sse2(const void *data, size_t size)
+{
+	const __m128i *ptr = data;
+	__m128i acc = _mm_setzero_si128();
+
+	for (; size >= 16; size -= 16, ++ptr) {
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128(ptr),
+						      _mm_setzero_si128()));
+	}
+
+	acc = _mm_add_epi64(acc, _mm_srli_si128(acc, 8));
+	return (sqfs_u32)_mm_cvtsi128_si32(acc) + byte_sum_generic(ptr, size);
+}
+
+TARGET("avx2")
+static sqfs_u32 byte_sum_avx2(const void *data, size_t size)
+{
+	const __m256i *ptr = data;
+	__m256i acc = _mm256_setzero_si256();
+	__m128i sum;
+
+	for (; size >= 32; size -= 32, ++ptr) {
+		acc = _mm256_add_epi64(acc,
+				       _mm256_sad_epu8(_mm256_loadu_si256(ptr),
+						       _mm256_setzero_si256()));
+	}
+
+	sum = _mm_add_epi64(_mm256_castsi256_si128(acc),
+			    _mm256_extracti128_si256(acc, 1));
+	sum = _mm_add_epi64(sum, _mm_srli_si128(sum, 8));
+
+	return (sqfs_u32)_mm_cvtsi128_si32(sum) + byte_sum_generic(ptr, size);
+}
+
+/*
+  Decode 16 characters to 12 bytes at a time, as long as all of them are in
+  the standard alphabet. Characters are classified by their high and low
+  nibble, which also gives the offset that maps them to their value.
+ */
+TARGET("ssse3")
+static size_t base64_decode_ssse3(sqfs_u8 *out, const char *in, size_t len)
+{
+	const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+					     0x11, 0x11, 0x11, 0x11, 0x13, 0x1A,
+					     0x1B, 0x1B, 0x1B, 0x1A);
+	const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+					     0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+					     0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+					       0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+					   14, 13, 12, -1, -1, -1, -1);
+	const __m128i mask_2f = _mm_set1_epi8(0x2F);
+	__m128i x, hi_nibbles, lo_nibbles, roll;
+	size_t done = 0;
+	sqfs_u32 tail;
+
+	while (len - done >= 16) {
+		x = _mm_loadu_si128((const __m128i *)(in + done));
+
+		hi_nibbles = _mm_and_si128(_mm_srli_epi32(x, 4), mask_2f);
+		lo_nibbles = _mm_and_si128(x, mask_2f);
+
+		roll = _mm_and_si128(_mm_shuffle_epi8(lut_lo, lo_nibbles),
+				     _mm_shuffle_epi8(lut_hi, hi_nibbles));
+		roll = _mm_cmpeq_epi8(roll, _mm_setzero_si128());
+
+		if (_mm_movemask_epi8(roll) != 0xFFFF)
+			break;
+
+		roll = _mm_add_epi8(_mm_cmpeq_epi8(x, mask_2f), hi_nibbles);
+		x = _mm_add_epi8(x, _mm_shuffle_epi8(lut_roll, roll));
+
+		x = _mm_maddubs_epi16(x, _mm_set1_epi32(0x01400140));
+		x = _mm_madd_epi16(x, _mm_set1_epi32(0x00011000));
+		x = _mm_shuffle_epi8(x, pack);
+
+		_mm_storel_epi64((__m128i *)out, x);
+		tail = _mm_cvtsi128_si32(_mm_srli_si128(x, 8));
+		memcpy(out + 8, &tail, sizeof(tail));
+		out += 12;
+		done += 16;
+	}
+
+	return done;
+}
+#endif
+
+/*****************************************************************************/
+
+unsigned int cpu_features(void)
+{
+	unsigned int features = 0;
+#if defined(CPU_X86)
+	unsigned int eax, ebx, ecx, edx, max;
+	sqfs_u32 xcr0_lo, xcr0_hi;
+
+	max = __get_cpuid_max(0, NULL);
+	if (max < 1)
+		return 0;
+
+	__cpuid(1, eax, ebx, ecx, edx);
+
+	if (edx & (1 << 26))
+		features |= CPU_FEATURE_SSE2;
+	if (ecx & (1 << 9))
+		features |= CPU_FEATURE_SSSE3;
+	if (ecx & (1 << 20))
+		features |= CPU_FEATURE_SSE42;
+	if (ecx & (1 << 1))
+		features |= CPU_FEATURE_PCLMUL;
+
+	/* AVX needs the OS to save the upper register halves */
+	if ((ecx & (1 << 27)) && (ecx & (1 << 28)) && max >= 7) {
+		__asm__ volatile ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi)
+				  : "c"(0));
+		(void)xcr0_hi;
+
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+		if ((xcr0_lo & 0x06) == 0x06 && (ebx & (1 << 5)))
+			features |= CPU_FEATURE_AVX2;
+	}
+#elif defined(CPU_ARM64_LINUX)
+	unsigned long hwcap = getauxval(AT_HWCAP);
+
+#ifdef HWCAP_ASIMD
+	if (hwcap & HWCAP_ASIMD)
+		features |= CPU_FEATURE_NEON;
+#endif
+#ifdef HWCAP_CRC32
+	if (hwcap & HWCAP_CRC32)
+		features |= CPU_FEATURE_ARM_CRC32;
+#endif
+#ifdef HWCAP_PMULL
+	if (hwcap & HWCAP_PMULL)
+		features |= CPU_FEATURE_ARM_PMULL;
+#endif
+	(void)hwcap;
+#endif
+	return features;
+}
+
+void cpu_kernels_select(cpu_kernels_t *out, unsigned int features)
+{
+	out->is_zero = is_zero_generic;
+	out->byte_sum = byte_sum_generic;
+	out->base64_decode = base64_decode_generic;
+
+#ifdef CPU_X86
+	if (features & CPU_FEATURE_SSE2) {
+		out->is_zero = is_zero_sse2;
+		out->byte_sum = byte_sum_sse2;
+	}
+
+	if (features & CPU_FEATURE_SSSE3)
+		out->base64_decode = base64_decode_ssse3;
+
+	if (features & CPU_FEATURE_AVX2) {
+		out->is_zero = is_zero_avx2;
+		out->byte_sum = byte_sum_avx2;
+	}
+#else
+	(void)features;
+#endif
+}
+
+cpu_kernels_t cpu_kernels = {
+	.is_zero = is_zero_generic,
+	.byte_sum = byte_sum_generic,
+	.base64_decode = base64_decode_generic,
+};
+
+/* runs before main, so the table is never written while threads use it */
+__attribute__((constructor))
+static void cpu_kernels_init(void)
+{
+	cpu_kernels_select(&cpu_kernels, cpu_features());
+}
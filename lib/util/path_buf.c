@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * path_buf.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sqfs/error.h"
+#include "util/path_buf.h"
+#include "util/util.h"
+
+static int path_buf_reserve(path_buf_t *pb, size_t len)
+{
+	size_t new_sz = pb->max ? pb->max : 256;
+	char *new;
+
+	if (SZ_ADD_OV(len, 1, &len))
+		return SQFS_ERROR_ALLOC;
+
+	if (len <= pb->max)
+		return 0;
+
+	while (new_sz < len) {
+		if (SZ_MUL_OV(new_sz, 2, &new_sz))
+			return SQFS_ERROR_ALLOC;
+	}
+
+	new = realloc(pb->str, new_sz);
+	if (new == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	pb->str = new;
+	pb->max = new_sz;
+	return 0;
+}
+
+int path_buf_init(path_buf_t *pb, const char *prefix)
+{
+	size_t len = strlen(prefix);
+
+	memset(pb, 0, sizeof(*pb));
+
+	if (path_buf_reserve(pb, len))
+		return SQFS_ERROR_ALLOC;
+
+	memcpy(pb->str, prefix, len + 1);
+	pb->len = len;
+	return 0;
+}
+
+void path_buf_cleanup(path_buf_t *pb)
+{
+	free(pb->str);
+	memset(pb, 0, sizeof(*pb));
+}
+
+int path_buf_push(path_buf_t *pb, const char *name, size_t len)
+{
+	bool slash = pb->len > 0 && pb->str[pb->len - 1] != '/';
+	size_t total;
+
+	if (SZ_ADD_OV(pb->len, len, &total) ||
+	    SZ_ADD_OV(total, slash ? 1 : 0, &total)) {
+		return SQFS_ERROR_ALLOC;
+	}
+
+	if (path_buf_reserve(pb, total))
+		return SQFS_ERROR_ALLOC;
+
+	if (slash)
+		pb->str[pb->len++] = '/';
+
+	memcpy(pb->str + pb->len, name, len);
+	pb->len += len;
+	pb->str[pb->len] = '\0';
+	return 0;
+}
+
+void path_buf_truncate(path_buf_t *pb, size_t len)
+{
+	pb->len = len;
+	pb->str[len] = '\0';
+}
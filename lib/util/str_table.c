@@ -14,20 +14,53 @@
 #include "util/str_table.h"
 #include "util/util.h"
 
-/* R5 hash function (borrowed from reiserfs) */
-static sqfs_u32 strhash(const char *s)
+static str_slot_t *find_slot(str_slot_t *slots, size_t num_slots,
+			     sqfs_u64 hash, const void *str, size_t len)
 {
-	const signed char *str = (const signed char *)s;
-	sqfs_u32 a = 0;
+	size_t i = hash & (num_slots - 1);
 
-	while (*str != '\0') {
-		a += *str << 4;
-		a += *str >> 4;
-		a *= 11;
-		str++;
+	while (slots[i].bucket != NULL) {
+		if (slots[i].hash == hash && slots[i].bucket->len == len &&
+		    memcmp(slots[i].bucket->str, str, len) == 0) {
+			break;
+		}
+
+		i = (i + 1) & (num_slots - 1);
 	}
 
-	return a;
+	return slots + i;
+}
+
+static int slots_grow(str_table_t *table)
+{
+	size_t i, newsz = table->num_slots * 2;
+	str_slot_t *new, *slot;
+
+	if (table->num_strings < table->num_slots / 2)
+		return 0;
+
+	new = alloc_array(newsz, sizeof(new[0]));
+	if (new == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	for (i = 0; i < table->num_slots; ++i) {
+		if (table->slots[i].bucket == NULL)
+			continue;
+
+		slot = new + (table->slots[i].hash & (newsz - 1));
+
+		while (slot->bucket != NULL) {
+			if (++slot == new + newsz)
+				slot = new;
+		}
+
+		*slot = table->slots[i];
+	}
+
+	free(table->slots);
+	table->slots = new;
+	table->num_slots = newsz;
+	return 0;
 }
 
 static int strings_grow(str_table_t *table)
@@ -51,12 +84,17 @@ static int strings_grow(str_table_t *table)
 
 int str_table_init(str_table_t *table, size_t size)
 {
+	size_t count = 16;
+
 	memset(table, 0, sizeof(*table));
 
-	table->buckets = alloc_array(size, sizeof(table->buckets[0]));
-	table->num_buckets = size;
+	while (count < size * 2 && count < (SIZE_MAX / 4))
+		count *= 2;
 
-	if (table->buckets == NULL)
+	table->slots = alloc_array(count, sizeof(table->slots[0]));
+	table->num_slots = count;
+
+	if (table->slots == NULL)
 		return SQFS_ERROR_ALLOC;
 
 	return 0;
@@ -64,66 +102,75 @@ int str_table_init(str_table_t *table, size_t size)
 
 void str_table_cleanup(str_table_t *table)
 {
-	str_bucket_t *bucket;
 	size_t i;
 
-	for (i = 0; i < table->num_buckets; ++i) {
-		while (table->buckets[i] != NULL) {
-			bucket = table->buckets[i];
-			table->buckets[i] = bucket->next;
+	for (i = 0; i < table->num_strings; ++i)
+		free(table->strings[i]);
 
-			free(bucket->str);
-			free(bucket);
-		}
-	}
-
-	free(table->buckets);
+	free(table->slots);
 	free(table->strings);
 	memset(table, 0, sizeof(*table));
 }
 
-int str_table_get_index(str_table_t *table, const char *str, size_t *idx)
+static str_bucket_t *find_or_add(str_table_t *table, const void *str,
+				 size_t len)
 {
+	sqfs_u64 hash = xxh64(str, len);
 	str_bucket_t *bucket;
-	sqfs_u32 hash;
-	size_t index;
-	int err;
-
-	hash = strhash(str);
-	index = hash % table->num_buckets;
-	bucket = table->buckets[index];
-
-	while (bucket != NULL) {
-		if (strcmp(bucket->str, str) == 0) {
-			*idx = bucket->index;
-			return 0;
-		}
+	str_slot_t *slot;
 
-		bucket = bucket->next;
-	}
+	slot = find_slot(table->slots, table->num_slots, hash, str, len);
+	if (slot->bucket != NULL)
+		return slot->bucket;
 
-	err = strings_grow(table);
-	if (err)
-		return err;
+	if (strings_grow(table) || slots_grow(table))
+		return NULL;
 
-	bucket = calloc(1, sizeof(*bucket));
-	if (bucket == NULL)
-		goto fail_oom;
+	slot = find_slot(table->slots, table->num_slots, hash, str, len);
 
-	bucket->str = strdup(str);
-	if (bucket->str == NULL)
-		goto fail_oom;
+	bucket = alloc_flex(sizeof(*bucket), 1, len + 1);
+	if (bucket == NULL)
+		return NULL;
 
+	memcpy(bucket->str, str, len);
+	bucket->str[len] = '\0';
+	bucket->len = len;
 	bucket->index = table->num_strings;
-	table->strings[table->num_strings++] = bucket->str;
+	table->strings[table->num_strings++] = bucket;
+
+	slot->hash = hash;
+	slot->bucket = bucket;
+	return bucket;
+}
+
+int str_table_get_index(str_table_t *table, const char *str, size_t *idx)
+{
+	str_bucket_t *bucket = find_or_add(table, str, strlen(str));
+
+	if (bucket == NULL)
+		return SQFS_ERROR_ALLOC;
+
 	*idx = bucket->index;
+	return 0;
+}
+
+int str_table_get_blob_index(str_table_t *table, const void *data,
+			     size_t size, size_t *idx)
+{
+	str_bucket_t *bucket = find_or_add(table, data, size);
+
+	if (bucket == NULL)
+		return SQFS_ERROR_ALLOC;
 
-	bucket->next = table->buckets[index];
-	table->buckets[index] = bucket;
+	*idx = bucket->index;
 	return 0;
-fail_oom:
-	free(bucket);
-	return SQFS_ERROR_ALLOC;
+}
+
+const char *str_table_intern(str_table_t *table, const char *str, size_t len)
+{
+	str_bucket_t *bucket = find_or_add(table, str, len);
+
+	return bucket == NULL ? NULL : bucket->str;
 }
 
 const char *str_table_get_string(str_table_t *table, size_t index)
@@ -131,38 +178,30 @@ const char *str_table_get_string(str_table_t *table, size_t index)
 	if (index >= table->num_strings)
 		return NULL;
 
-	return table->strings[index];
+	return table->strings[index]->str;
 }
 
-static str_bucket_t *bucket_by_index(str_table_t *table, size_t index)
+const void *str_table_get_blob(str_table_t *table, size_t index,
+			       size_t *size)
 {
-	str_bucket_t *bucket = NULL;
-	sqfs_u32 hash;
-
-	if (index < table->num_strings) {
-		hash = strhash(table->strings[index]);
-		bucket = table->buckets[hash % table->num_buckets];
+	if (index >= table->num_strings)
+		return NULL;
 
-		while (bucket != NULL && bucket->index != index)
-			bucket = bucket->next;
-	}
+	*size = table->strings[index]->len;
+	return table->strings[index]->str;
+}
 
-	return bucket;
+static str_bucket_t *bucket_by_index(str_table_t *table, size_t index)
+{
+	return index < table->num_strings ? table->strings[index] : NULL;
 }
 
 void str_table_reset_ref_count(str_table_t *table)
 {
-	str_bucket_t *bucket;
 	size_t i;
 
-	for (i = 0; i < table->num_buckets; ++i) {
-		bucket = table->buckets[i];
-
-		while (bucket != NULL) {
-			bucket->refcount = 0;
-			bucket = bucket->next;
-		}
-	}
+	for (i = 0; i < table->num_strings; ++i)
+		table->strings[i]->refcount = 0;
 }
 
 void str_table_add_ref(str_table_t *table, size_t index)
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * workers.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "util/workers.h"
+#include "util/util.h"
+
+#include <stdlib.h>
+
+#ifdef WITH_PTHREAD
+#include <pthread.h>
+
+size_t run_workers(worker_fun_t fun, void *args, size_t size, size_t count)
+{
+	pthread_t *threads = NULL;
+	size_t i, started = 0;
+
+	if (count > 1)
+		threads = alloc_array(sizeof(threads[0]), count - 1);
+
+	if (threads != NULL) {
+		for (i = 1; i < count; ++i) {
+			if (pthread_create(threads + started, NULL, fun,
+					   (char *)args + i * size) != 0) {
+				break;
+			}
+			++started;
+		}
+	}
+
+	/* whatever is left if not all threads could be started */
+	fun(args);
+
+	for (i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	return started + 1;
+}
+#else
+size_t run_workers(worker_fun_t fun, void *args, size_t size, size_t count)
+{
+	(void)size; (void)count;
+	fun(args);
+	return 1;
+}
+#endif
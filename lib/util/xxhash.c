@@ -0,0 +1,108 @@
+/* SPDX-License-Identifier: LGPL-3.0-or-later */
+/*
+ * xxhash.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "util/util.h"
+
+#include <string.h>
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static sqfs_u64 rotl64(sqfs_u64 x, unsigned int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static sqfs_u64 read64(const sqfs_u8 *ptr)
+{
+	sqfs_u64 x;
+
+	memcpy(&x, ptr, sizeof(x));
+	return le64toh(x);
+}
+
+static sqfs_u32 read32(const sqfs_u8 *ptr)
+{
+	sqfs_u32 x;
+
+	memcpy(&x, ptr, sizeof(x));
+	return le32toh(x);
+}
+
+static sqfs_u64 xxh_round(sqfs_u64 acc, sqfs_u64 input)
+{
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static sqfs_u64 xxh_merge_round(sqfs_u64 acc, sqfs_u64 val)
+{
+	acc ^= xxh_round(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+sqfs_u64 xxh64(const void *data, size_t size)
+{
+	const sqfs_u8 *ptr = data, *end = ptr + size;
+	sqfs_u64 v1, v2, v3, v4, h;
+
+	if (size >= 32) {
+		v1 = PRIME64_1 + PRIME64_2;
+		v2 = PRIME64_2;
+		v3 = 0;
+		v4 = -PRIME64_1;
+
+		do {
+			v1 = xxh_round(v1, read64(ptr));
+			v2 = xxh_round(v2, read64(ptr + 8));
+			v3 = xxh_round(v3, read64(ptr + 16));
+			v4 = xxh_round(v4, read64(ptr + 24));
+			ptr += 32;
+		} while ((size_t)(end - ptr) >= 32);
+
+		h = rotl64(v1, 1) + rotl64(v2, 7) +
+			rotl64(v3, 12) + rotl64(v4, 18);
+
+		h = xxh_merge_round(h, v1);
+		h = xxh_merge_round(h, v2);
+		h = xxh_merge_round(h, v3);
+		h = xxh_merge_round(h, v4);
+	} else {
+		h = PRIME64_5;
+	}
+
+	h += (sqfs_u64)size;
+
+	while ((size_t)(end - ptr) >= 8) {
+		h ^= xxh_round(0, read64(ptr));
+		h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+		ptr += 8;
+	}
+
+	if ((size_t)(end - ptr) >= 4) {
+		h ^= (sqfs_u64)read32(ptr) * PRIME64_1;
+		h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+		ptr += 4;
+	}
+
+	while (ptr < end) {
+		h ^= (*(ptr++)) * PRIME64_5;
+		h = rotl64(h, 11) * PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
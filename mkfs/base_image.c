@@ -0,0 +1,385 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * base_image.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "mkfs.h"
+
+struct base_image_t {
+	const char *filename;
+	sqfs_file_t *file;
+	sqfs_compressor_t *cmp;
+	sqfs_id_table_t *idtbl;
+	sqfs_dir_reader_t *dirrd;
+	sqfs_data_reader_t *data;
+	sqfs_tree_node_t *root;
+	size_t block_size;
+	bool trust_mtime;
+};
+
+/*
+  Data blocks can only be copied over if the reader of the new image can
+  decompress them with the options it finds in there.
+ */
+static int check_compatible(base_image_t *img, const sqfs_super_t *super,
+			    const sqfs_super_t *new_super, sqfs_file_t *outfile)
+{
+	sqfs_u8 *old_opt, *new_opt;
+	size_t old_size, new_size;
+	int ret;
+
+	if (super->compression_id != new_super->compression_id ||
+	    super->block_size != new_super->block_size) {
+		fprintf(stderr, "%s: different compressor or block size, "
+			"packing all files from scratch.\n", img->filename);
+		return 1;
+	}
+
+	old_opt = malloc(SQFS_META_BLOCK_SIZE);
+	new_opt = malloc(SQFS_META_BLOCK_SIZE);
+
+	if (old_opt == NULL || new_opt == NULL) {
+		perror(img->filename);
+		ret = -1;
+		goto out;
+	}
+
+	ret = compressor_read_raw_options(img->file, super, old_opt,
+					  &old_size);
+	if (ret == 0) {
+		ret = compressor_read_raw_options(outfile, new_super, new_opt,
+						  &new_size);
+	}
+
+	if (ret) {
+		sqfs_perror(img->filename, "reading compressor options", ret);
+		ret = -1;
+		goto out;
+	}
+
+	if (old_size != new_size || memcmp(old_opt, new_opt, old_size) != 0) {
+		fprintf(stderr, "%s: different compressor options, "
+			"packing all files from scratch.\n", img->filename);
+		ret = 1;
+	}
+out:
+	free(old_opt);
+	free(new_opt);
+	return ret;
+}
+
+static int load_image(base_image_t *img, const sqfs_super_t *new_super,
+		      sqfs_file_t *outfile)
+{
+	sqfs_compressor_config_t cfg;
+	sqfs_super_t super;
+	int ret;
+
+	ret = sqfs_super_read(&super, img->file);
+	if (ret) {
+		sqfs_perror(img->filename, "reading super block", ret);
+		return -1;
+	}
+
+	ret = check_compatible(img, &super, new_super, outfile);
+	if (ret)
+		return ret;
+
+	sqfs_compressor_config_init(&cfg, super.compression_id,
+				    super.block_size,
+				    SQFS_COMP_FLAG_UNCOMPRESS);
+
+	img->cmp = sqfs_compressor_create(&cfg);
+	if (img->cmp == NULL) {
+		fprintf(stderr, "%s: error creating compressor.\n",
+			img->filename);
+		return -1;
+	}
+
+	if (super.flags & SQFS_FLAG_COMPRESSOR_OPTIONS) {
+		ret = img->cmp->read_options(img->cmp, img->file);
+		if (ret) {
+			sqfs_perror(img->filename, "reading compressor "
+				    "options", ret);
+			return -1;
+		}
+	}
+
+	img->idtbl = sqfs_id_table_create();
+	if (img->idtbl == NULL) {
+		sqfs_perror(img->filename, "creating ID table",
+			    SQFS_ERROR_ALLOC);
+		return -1;
+	}
+
+	ret = sqfs_id_table_read(img->idtbl, img->file, &super, img->cmp);
+	if (ret) {
+		sqfs_perror(img->filename, "loading ID table", ret);
+		return -1;
+	}
+
+	img->dirrd = sqfs_dir_reader_create(&super, img->cmp, img->file);
+	if (img->dirrd == NULL) {
+		sqfs_perror(img->filename, "creating dir reader",
+			    SQFS_ERROR_ALLOC);
+		return -1;
+	}
+
+	img->data = sqfs_data_reader_create(img->file, super.block_size,
+					    img->cmp, 0);
+	if (img->data == NULL) {
+		sqfs_perror(img->filename, "creating data reader",
+			    SQFS_ERROR_ALLOC);
+		return -1;
+	}
+
+	ret = sqfs_data_reader_load_fragment_table(img->data, &super);
+	if (ret) {
+		sqfs_perror(img->filename, "loading fragment table", ret);
+		return -1;
+	}
+
+	ret = sqfs_dir_reader_get_full_hierarchy(img->dirrd, img->idtbl, NULL,
+						 SQFS_TREE_NO_DEVICES |
+						 SQFS_TREE_NO_SOCKETS |
+						 SQFS_TREE_NO_FIFO |
+						 SQFS_TREE_NO_SLINKS,
+						 &img->root);
+	if (ret) {
+		sqfs_perror(img->filename, "reading filesystem tree", ret);
+		return -1;
+	}
+
+	img->block_size = super.block_size;
+	return 0;
+}
+
+base_image_t *base_image_open(const char *filename, const sqfs_super_t *super,
+			      sqfs_file_t *outfile, bool trust_mtime)
+{
+	base_image_t *img = calloc(1, sizeof(*img));
+	int ret;
+
+	if (img == NULL) {
+		perror(filename);
+		return NULL;
+	}
+
+	img->filename = filename;
+	img->trust_mtime = trust_mtime;
+
+	img->file = sqfs_open_file(filename, SQFS_FILE_OPEN_READ_ONLY);
+	if (img->file == NULL) {
+		perror(filename);
+		free(img);
+		return NULL;
+	}
+
+	ret = load_image(img, super, outfile);
+	if (ret) {
+		base_image_destroy(img);
+		return ret > 0 ? BASE_IMAGE_UNUSABLE : NULL;
+	}
+
+	return img;
+}
+
+void base_image_destroy(base_image_t *img)
+{
+	if (img == NULL || img == BASE_IMAGE_UNUSABLE)
+		return;
+
+	if (img->root != NULL)
+		sqfs_dir_tree_destroy(img->root);
+	if (img->data != NULL)
+		sqfs_data_reader_destroy(img->data);
+	if (img->dirrd != NULL)
+		sqfs_dir_reader_destroy(img->dirrd);
+	if (img->idtbl != NULL)
+		sqfs_id_table_destroy(img->idtbl);
+	if (img->cmp != NULL)
+		img->cmp->destroy(img->cmp);
+
+	img->file->destroy(img->file);
+	free(img);
+}
+
+static int cmp_node_name(const void *lhs, const void *rhs)
+{
+	const sqfs_tree_node_t *l = *((sqfs_tree_node_t *const *)lhs);
+	const sqfs_tree_node_t *r = *((sqfs_tree_node_t *const *)rhs);
+
+	return strcmp((const char *)l->name, (const char *)r->name);
+}
+
+static int find_node_name(const void *key, const void *elem)
+{
+	const sqfs_tree_node_t *n = *((sqfs_tree_node_t *const *)elem);
+
+	return strcmp(key, (const char *)n->name);
+}
+
+static int match_dir(const base_image_t *img, tree_node_t *dir,
+		     const sqfs_tree_node_t *old)
+{
+	sqfs_tree_node_t **list, **found;
+	size_t count = 0;
+	sqfs_tree_node_t *it;
+	tree_node_t *n;
+	int ret = 0;
+
+	for (it = old->children; it != NULL; it = it->next)
+		++count;
+
+	if (count == 0)
+		return 0;
+
+	list = alloc_array(sizeof(list[0]), count);
+	if (list == NULL) {
+		perror("matching files against base image");
+		return -1;
+	}
+
+	count = 0;
+	for (it = old->children; it != NULL; it = it->next)
+		list[count++] = it;
+
+	qsort(list, count, sizeof(list[0]), cmp_node_name);
+
+	for (n = dir->data.dir.children; n != NULL; n = n->next) {
+		found = bsearch(n->name, list, count, sizeof(list[0]),
+				find_node_name);
+		if (found == NULL)
+			continue;
+
+		it = *found;
+
+		if (S_ISDIR(n->mode) && S_ISDIR(it->inode->base.mode)) {
+			ret = match_dir(img, n, it);
+			if (ret)
+				break;
+		} else if (S_ISREG(n->mode) && S_ISREG(it->inode->base.mode)) {
+			if (img->trust_mtime &&
+			    it->inode->base.mod_time != n->mod_time) {
+				continue;
+			}
+
+			n->data.file.user_ptr = it;
+		}
+	}
+
+	free(list);
+	return ret;
+}
+
+int base_image_match(const base_image_t *img, fstree_t *fs)
+{
+	if (img == NULL || img == BASE_IMAGE_UNUSABLE)
+		return 0;
+
+	return match_dir(img, fs->root, img->root);
+}
+
+static int same_content(const base_image_t *img, const sqfs_tree_node_t *old,
+			sqfs_file_t *file, sqfs_u64 filesize, bool *same)
+{
+	sqfs_u8 *buffer = malloc(img->block_size);
+	sqfs_u64 offset = 0;
+	const void *ptr;
+	size_t i, size;
+	int ret = 0;
+
+	*same = false;
+
+	if (buffer == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	for (i = 0; i < old->inode->num_file_blocks; ++i) {
+		ret = sqfs_data_reader_peek_block(img->data, old->inode, i,
+						  &ptr, &size);
+		if (ret)
+			goto out;
+
+		if (size > filesize - offset)
+			goto out;
+
+		ret = file->read_at(file, offset, buffer, size);
+		if (ret)
+			goto out;
+
+		if (memcmp(ptr, buffer, size) != 0)
+			goto out;
+
+		offset += size;
+	}
+
+	ret = sqfs_data_reader_peek_fragment(img->data, old->inode,
+					     &ptr, &size);
+	if (ret)
+		goto out;
+
+	if (ptr != NULL) {
+		if (size != filesize - offset)
+			goto out;
+
+		ret = file->read_at(file, offset, buffer, size);
+		if (ret)
+			goto out;
+
+		if (memcmp(ptr, buffer, size) != 0)
+			goto out;
+
+		offset += size;
+	}
+
+	*same = (offset == filesize);
+out:
+	free(buffer);
+	return ret;
+}
+
+int base_image_pack(const base_image_t *img, const file_info_t *fi,
+		    sqfs_data_writer_t *data, sqfs_inode_generic_t *inode,
+		    sqfs_file_t *file, bool *done)
+{
+	const sqfs_tree_node_t *old = fi->user_ptr;
+	sqfs_u64 filesize, old_size;
+	bool same;
+	int ret;
+
+	*done = false;
+
+	if (img == NULL || img == BASE_IMAGE_UNUSABLE || old == NULL)
+		return 0;
+
+	/* the old data may not be laid out the way the file asks for */
+	if (fi->flags != 0)
+		return 0;
+
+	sqfs_inode_get_file_size(inode, &filesize);
+	sqfs_inode_get_file_size(old->inode, &old_size);
+
+	if (filesize != old_size)
+		return 0;
+
+	if (!img->trust_mtime) {
+		ret = same_content(img, old, file, filesize, &same);
+		if (ret) {
+			sqfs_perror(fi->input_file,
+				    "comparing against base image", ret);
+			return -1;
+		}
+
+		if (!same)
+			return 0;
+	}
+
+	if (write_data_from_image(fi->input_file, data, inode, img->file,
+				  img->data, old->inode, img->block_size, 0)) {
+		return -1;
+	}
+
+	*done = true;
+	return 0;
+}
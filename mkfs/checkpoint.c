@@ -0,0 +1,306 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * checkpoint.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "mkfs.h"
+
+#define CHECKPOINT_MAGIC "GSQFSCKP"
+#define CHECKPOINT_VERSION (1)
+
+/* time between checkpoints, in nanoseconds */
+#define CHECKPOINT_INTERVAL (5 * 60 * 1000000000ULL)
+
+/*
+  The header is followed by the data writer state and then by one record
+  for each file that was packed before the checkpoint, in file list order.
+  Everything is stored in little endian.
+ */
+typedef struct {
+	sqfs_u8 magic[8];
+	sqfs_u32 version;
+	sqfs_u32 block_size;
+	sqfs_u64 options_hash;
+	sqfs_u64 file_list_hash;
+	sqfs_u64 num_files;
+	sqfs_u64 files_done;
+	sqfs_u64 records_start;
+} checkpoint_header_t;
+
+struct checkpoint_t {
+	char *filename;
+	char *tmpname;
+	const char *outname;
+
+	sqfs_writer_t *sqfs;
+	sqfs_u64 options_hash;
+	sqfs_u64 file_list_hash;
+	sqfs_u64 num_files;
+
+	/* the data locations of all files so far, as stored in the file */
+	file_records_t records;
+	size_t files_done;
+
+	/* the next file to add a record for */
+	const file_info_t *next;
+
+	sqfs_u64 last_save;
+};
+
+static int write_checkpoint(checkpoint_t *cp, sqfs_file_t *file,
+			    size_t files_done)
+{
+	checkpoint_header_t hdr;
+	sqfs_u64 start;
+	int ret;
+
+	memset(&hdr, 0, sizeof(hdr));
+	ret = file->write_at(file, 0, &hdr, sizeof(hdr));
+	if (ret)
+		return ret;
+
+	/* the inodes of all files so far are final once the state is saved */
+	ret = sqfs_data_writer_save_state(cp->sqfs->data, file);
+	if (ret)
+		return ret;
+
+	for (; cp->files_done < files_done; ++cp->files_done) {
+		ret = file_records_add(&cp->records, cp->next->user_ptr);
+		if (ret)
+			return ret;
+
+		cp->next = cp->next->next;
+	}
+
+	start = file->get_size(file);
+
+	ret = file->write_at(file, start, cp->records.data, cp->records.size);
+	if (ret)
+		return ret;
+
+	memcpy(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic));
+	hdr.version = htole32(CHECKPOINT_VERSION);
+	hdr.block_size = htole32(cp->sqfs->super.block_size);
+	hdr.options_hash = htole64(cp->options_hash);
+	hdr.file_list_hash = htole64(cp->file_list_hash);
+	hdr.num_files = htole64(cp->num_files);
+	hdr.files_done = htole64(files_done);
+	hdr.records_start = htole64(start);
+
+	return file->write_at(file, 0, &hdr, sizeof(hdr));
+}
+
+static int save_checkpoint(checkpoint_t *cp, size_t files_done)
+{
+	sqfs_writer_t *sqfs = cp->sqfs;
+	sqfs_file_t *file;
+	int ret;
+
+	file = sqfs_open_file(cp->tmpname, SQFS_FILE_OPEN_OVERWRITE);
+	if (file == NULL) {
+		perror(cp->tmpname);
+		return -1;
+	}
+
+	/*
+	  Both files have to be on the disk, so the rename does not leave an
+	  empty checkpoint or one that is ahead of the image after a crash.
+	 */
+	ret = write_checkpoint(cp, file, files_done);
+	if (ret == 0)
+		ret = sqfs_file_flush(file, SQFS_FILE_FLUSH_SYNC);
+	file->destroy(file);
+
+	if (ret) {
+		sqfs_perror(cp->tmpname, "writing checkpoint", ret);
+		return -1;
+	}
+
+	ret = sqfs_super_write(&sqfs->super, sqfs->outfile);
+	if (ret == 0)
+		ret = sqfs_file_flush(sqfs->outfile, SQFS_FILE_FLUSH_SYNC);
+
+	if (ret) {
+		sqfs_perror(cp->outname, "flushing output", ret);
+		return -1;
+	}
+
+#if defined(_WIN32) || defined(__WINDOWS__)
+	remove(cp->filename);
+#endif
+	if (rename(cp->tmpname, cp->filename)) {
+		perror(cp->filename);
+		return -1;
+	}
+
+	cp->last_save = get_time_ns();
+	return 0;
+}
+
+static int load_checkpoint(checkpoint_t *cp)
+{
+	sqfs_writer_t *sqfs = cp->sqfs;
+	checkpoint_header_t hdr;
+	sqfs_u64 offset;
+	sqfs_file_t *file;
+	int ret;
+
+	file = sqfs_open_file(cp->filename, SQFS_FILE_OPEN_READ_ONLY);
+	if (file == NULL) {
+		perror(cp->filename);
+		return -1;
+	}
+
+	ret = file->read_at(file, 0, &hdr, sizeof(hdr));
+	if (ret)
+		goto fail_read;
+
+	if (memcmp(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    le32toh(hdr.version) != CHECKPOINT_VERSION) {
+		fprintf(stderr, "%s: not a gensquashfs checkpoint\n",
+			cp->filename);
+		goto fail;
+	}
+
+	if (le32toh(hdr.block_size) != sqfs->super.block_size ||
+	    le64toh(hdr.options_hash) != cp->options_hash) {
+		fprintf(stderr, "%s: block size or compressor options "
+			"differ from the interrupted run\n", cp->filename);
+		goto fail;
+	}
+
+	if (le64toh(hdr.file_list_hash) != cp->file_list_hash ||
+	    le64toh(hdr.num_files) != cp->num_files ||
+	    le64toh(hdr.files_done) > cp->num_files) {
+		fprintf(stderr, "%s: the input files differ from the "
+			"interrupted run\n", cp->filename);
+		goto fail;
+	}
+
+	offset = sizeof(hdr);
+
+	ret = sqfs_data_writer_load_state(sqfs->data, file, &offset);
+	if (ret)
+		goto fail_read;
+
+	if (offset != le64toh(hdr.records_start)) {
+		ret = SQFS_ERROR_CORRUPTED;
+		goto fail_read;
+	}
+
+	if (offset > file->get_size(file)) {
+		ret = SQFS_ERROR_CORRUPTED;
+		goto fail_read;
+	}
+
+	ret = file_records_load(&cp->records, file, offset,
+				file->get_size(file) - offset);
+	if (ret)
+		goto fail_read;
+
+	cp->files_done = le64toh(hdr.files_done);
+	file->destroy(file);
+	return 0;
+fail_read:
+	sqfs_perror(cp->filename, "resuming from checkpoint", ret);
+fail:
+	file->destroy(file);
+	return -1;
+}
+
+checkpoint_t *checkpoint_create(const char *filename, sqfs_writer_t *sqfs,
+				const char *outname, bool resume)
+{
+	checkpoint_t *cp;
+	int ret;
+
+	cp = calloc(1, sizeof(*cp));
+	if (cp == NULL)
+		goto fail_errno;
+
+	cp->filename = strdup(filename);
+	cp->tmpname = malloc(strlen(filename) + 5);
+	if (cp->filename == NULL || cp->tmpname == NULL)
+		goto fail_errno;
+
+	sprintf(cp->tmpname, "%s.tmp", filename);
+
+	cp->sqfs = sqfs;
+	cp->outname = outname;
+	cp->next = sqfs->fs.files;
+	cp->file_list_hash = file_list_hash(&sqfs->fs, &cp->num_files);
+
+	ret = compressor_options_hash(sqfs, &cp->options_hash);
+	if (ret) {
+		sqfs_perror(filename, "hashing compressor options", ret);
+		goto fail;
+	}
+
+	if (resume && load_checkpoint(cp))
+		goto fail;
+
+	cp->last_save = get_time_ns();
+	return cp;
+fail_errno:
+	perror(filename);
+fail:
+	checkpoint_destroy(cp);
+	return NULL;
+}
+
+void checkpoint_destroy(checkpoint_t *cp)
+{
+	if (cp != NULL) {
+		file_records_cleanup(&cp->records);
+		free(cp->tmpname);
+		free(cp->filename);
+		free(cp);
+	}
+}
+
+size_t checkpoint_files_done(const checkpoint_t *cp)
+{
+	return cp == NULL ? 0 : cp->files_done;
+}
+
+sqfs_inode_generic_t *checkpoint_restore(checkpoint_t *cp, file_info_t *fi)
+{
+	sqfs_inode_generic_t *inode;
+
+	inode = file_records_next(&cp->records, fi->input_file);
+	if (inode != NULL)
+		cp->next = fi->next;
+
+	return inode;
+}
+
+int checkpoint_update(checkpoint_t *cp, size_t files_done)
+{
+	if (cp == NULL || files_done <= cp->files_done)
+		return 0;
+
+	if (get_time_ns() - cp->last_save < CHECKPOINT_INTERVAL)
+		return 0;
+
+	return save_checkpoint(cp, files_done);
+}
+
+int checkpoint_remove(checkpoint_t *cp)
+{
+	if (cp == NULL)
+		return 0;
+
+	/* the temporary file is left over if a run is killed while saving */
+	if (remove(cp->tmpname) != 0 && errno != ENOENT) {
+		perror(cp->tmpname);
+		return -1;
+	}
+
+	if (remove(cp->filename) != 0 && errno != ENOENT) {
+		perror(cp->filename);
+		return -1;
+	}
+
+	return 0;
+}
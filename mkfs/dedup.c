@@ -0,0 +1,237 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * dedup.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "mkfs.h"
+
+#define CHUNK_SIZE (64 * 1024)
+
+typedef struct {
+	file_info_t *fi;
+	sqfs_u64 size;
+	sqfs_u64 digest;
+	size_t index;
+} file_entry_t;
+
+static int cmp_entry(const void *lhs, const void *rhs)
+{
+	const file_entry_t *l = lhs, *r = rhs;
+
+	if (l->size != r->size)
+		return l->size < r->size ? -1 : 1;
+
+	if (l->fi->flags != r->fi->flags)
+		return l->fi->flags < r->fi->flags ? -1 : 1;
+
+	if (l->digest != r->digest)
+		return l->digest < r->digest ? -1 : 1;
+
+	return l->index < r->index ? -1 : (l->index > r->index ? 1 : 0);
+}
+
+static int open_file(const char *path, sqfs_file_t **out)
+{
+	*out = sqfs_open_file(path, SQFS_FILE_OPEN_READ_ONLY);
+
+	if (*out == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int hash_file(file_entry_t *ent, sqfs_u8 *buffer)
+{
+	sqfs_u64 offset, hash = 0;
+	sqfs_file_t *file;
+	size_t diff;
+	int ret;
+
+	if (open_file(ent->fi->input_file, &file))
+		return -1;
+
+	for (offset = 0; offset < ent->size; offset += diff) {
+		diff = CHUNK_SIZE;
+		if (diff > ent->size - offset)
+			diff = ent->size - offset;
+
+		ret = file->read_at(file, offset, buffer, diff);
+		if (ret) {
+			sqfs_perror(ent->fi->input_file, "hashing file", ret);
+			file->destroy(file);
+			return -1;
+		}
+
+		hash = (hash * 0x9E3779B97F4A7C15ULL) ^ xxh64(buffer, diff);
+	}
+
+	file->destroy(file);
+	ent->digest = hash;
+	return 0;
+}
+
+/* The digest only narrows down the candidates, this decides. */
+static int same_content(const file_entry_t *a, const file_entry_t *b,
+			sqfs_u8 *buffer, bool *result)
+{
+	sqfs_file_t *fa, *fb;
+	sqfs_u64 offset;
+	size_t diff;
+	int ret = 0;
+
+	if (open_file(a->fi->input_file, &fa))
+		return -1;
+
+	if (open_file(b->fi->input_file, &fb)) {
+		fa->destroy(fa);
+		return -1;
+	}
+
+	*result = true;
+
+	for (offset = 0; offset < a->size; offset += diff) {
+		diff = CHUNK_SIZE;
+		if (diff > a->size - offset)
+			diff = a->size - offset;
+
+		ret = fa->read_at(fa, offset, buffer, diff);
+		if (ret) {
+			sqfs_perror(a->fi->input_file, "comparing files", ret);
+			break;
+		}
+
+		ret = fb->read_at(fb, offset, buffer + CHUNK_SIZE, diff);
+		if (ret) {
+			sqfs_perror(b->fi->input_file, "comparing files", ret);
+			break;
+		}
+
+		if (memcmp(buffer, buffer + CHUNK_SIZE, diff) != 0) {
+			*result = false;
+			break;
+		}
+	}
+
+	fa->destroy(fa);
+	fb->destroy(fb);
+	return ret ? -1 : 0;
+}
+
+static int get_sizes(file_entry_t *list, size_t count)
+{
+	sqfs_file_t *file;
+	size_t i;
+
+	for (i = 0; i < count; ++i) {
+		if (open_file(list[i].fi->input_file, &file))
+			return -1;
+
+		list[i].size = file->get_size(file);
+		file->destroy(file);
+	}
+
+	return 0;
+}
+
+/* files that can be linked to one another, i.e. same size and flags */
+static bool same_group(const file_entry_t *a, const file_entry_t *b)
+{
+	return a->size == b->size && a->fi->flags == b->fi->flags;
+}
+
+/*
+  Files are only hashed and compared if there is at least one other file
+  with the same size and flags that does not disable deduplication. The
+  first file in list order is kept as original, so it is always packed
+  before the files that refer to it.
+ */
+file_info_t **find_duplicate_files(fstree_t *fs, bool search,
+				   sqfs_u64 *total_size)
+{
+	size_t i, j, k, count = 0, index = 0;
+	file_info_t **out = NULL, *fi;
+	sqfs_u8 *buffer = NULL;
+	file_entry_t *list;
+	bool same;
+
+	for (fi = fs->files; fi != NULL; fi = fi->next)
+		++count;
+
+	list = alloc_array(sizeof(list[0]), count ? count : 1);
+	out = alloc_array(sizeof(out[0]), count ? count : 1);
+	buffer = malloc(2 * CHUNK_SIZE);
+
+	if (list == NULL || out == NULL || buffer == NULL) {
+		perror("searching duplicate files");
+		goto fail;
+	}
+
+	for (fi = fs->files; fi != NULL; fi = fi->next) {
+		list[index].fi = fi;
+		list[index].index = index;
+		++index;
+	}
+
+	if (get_sizes(list, count))
+		goto fail;
+
+	if (!search)
+		goto out;
+
+	qsort(list, count, sizeof(list[0]), cmp_entry);
+
+	for (i = 0; i < count; i = j) {
+		for (j = i + 1; j < count && same_group(list + i, list + j); ++j)
+			;
+
+		if (j - i < 2 || list[i].size == 0 ||
+		    (list[i].fi->flags & SQFS_BLK_DONT_DEDUPLICATE)) {
+			continue;
+		}
+
+		for (k = i; k < j; ++k) {
+			if (hash_file(list + k, buffer))
+				goto fail;
+		}
+	}
+
+	qsort(list, count, sizeof(list[0]), cmp_entry);
+
+	for (i = 0; i < count; i = j) {
+		for (j = i + 1; j < count; ++j) {
+			if (!same_group(list + i, list + j) ||
+			    list[j].digest != list[i].digest) {
+				break;
+			}
+
+			if (list[i].size == 0 || out[list[j].index] != NULL ||
+			    (list[j].fi->flags & SQFS_BLK_DONT_DEDUPLICATE)) {
+				continue;
+			}
+
+			if (same_content(list + i, list + j, buffer, &same))
+				goto fail;
+
+			if (same)
+				out[list[j].index] = list[i].fi;
+		}
+	}
+
+out:
+	for (*total_size = 0, i = 0; i < count; ++i) {
+		if (out[list[i].index] == NULL)
+			*total_size += list[i].size;
+	}
+
+	free(buffer);
+	free(list);
+	return out;
+fail:
+	free(buffer);
+	free(list);
+	free(out);
+	return NULL;
+}
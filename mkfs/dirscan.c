@@ -6,49 +6,138 @@
  */
 #include "mkfs.h"
 
-static char *get_file_path(tree_node_t *n, const char *name)
-{
-	char *ptr, *new;
-	int ret;
+#ifdef WITH_PTHREAD
+#include <pthread.h>
+#endif
 
-	if (n->parent == NULL) {
-		ptr = strdup(name);
-		if (ptr == NULL)
-			goto fail;
-		return ptr;
-	}
+/*
+  The directory tree is read in two steps: scanning a directory collects
+  the stat data, link targets and extended attributes of its entries
+  without touching the tree, populating then creates the tree nodes for
+  them on the main thread, in a fixed order. With scanner threads, sub
+  directories are scanned ahead from a shared stack of jobs, while the
+  resulting tree is the same as without them.
 
-	ptr = fstree_get_path(n);
-	if (ptr == NULL)
-		goto fail;
+  With a scan cache, the entries of a directory whose time stamps did not
+  change since the last scan are taken from the cache. Adding, removing or
+  renaming an entry changes the time stamps of the directory, but changes
+  further down do not, so sub directories are still looked at one by one.
+ */
+typedef struct scan_job_t scan_job_t;
 
-	ret = canonicalize_name(ptr);
-	assert(ret == 0);
+typedef struct {
+	struct stat sb;
 
-	new = realloc(ptr, strlen(ptr) + strlen(name) + 2);
-	if (new == NULL)
-		goto fail;
+	/* symlink target */
+	char *link;
 
-	ptr = new;
-	strcat(ptr, "/");
-	strcat(ptr, name);
-	return ptr;
-fail:
-	perror("getting absolute file path");
-	free(ptr);
-	return NULL;
-}
+	/* packed extended attributes, see read_xattr */
+	char *xattr;
+	size_t xattr_size;
+
+	/* SELinux label, if a label file is used */
+	char *selinux_context;
+
+	/* for directories, the job that scans its contents */
+	scan_job_t *job;
+
+	/* the tree node created for the entry */
+	tree_node_t *node;
+
+	/* set for entries on a different file system */
+	bool skip;
+
+	char name[];
+} scan_entry_t;
+
+enum {
+	JOB_QUEUED = 0,
+	JOB_RUNNING,
+	JOB_DONE,
+};
+
+struct scan_job_t {
+	/* links for the stack of pending jobs */
+	scan_job_t *prev;
+	scan_job_t *next;
+
+	int state;
+	bool failed;
+
+	/* set once listing xattrs failed with ENOTSUP in this directory */
+	bool no_xattr;
+
+	char *path;
+
+	/* stat data of the directory itself */
+	struct stat sb;
+
+	scan_entry_t **entries;
+	size_t num_entries;
+	size_t max_entries;
+};
+
+/*
+  Non-directories with more than one link are remembered by device and
+  inode number, so that the other names they are found under become hard
+  links to the tree node created for the first one. Only used while
+  populating, i.e. on the main thread.
+ */
+typedef struct {
+	dev_t dev;
+	ino_t ino;
+	tree_node_t *node;
+} inode_entry_t;
+
+typedef struct {
+	dev_t devstart;
+	unsigned int flags;
+
+	/* open addressing hash table, at most half full */
+	inode_entry_t *inodes;
+	size_t inodes_size;
+	size_t inodes_used;
+
+	/* for looking up labels, the image path is the scan path after
+	   the first root_len characters */
+	void *selinux_handle;
+	size_t root_len;
+
+	scan_cache_t *cache;
+
+#ifdef WITH_PTHREAD
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	bool stop;
+
+	/* pending jobs, most recently added first */
+	scan_job_t *queue;
+
+	unsigned int num_threads;
+	pthread_t *threads;
+#endif
+} scanner_t;
 
 #ifdef HAVE_SYS_XATTR_H
-static int populate_xattr(sqfs_xattr_writer_t *xwr, tree_node_t *node)
+/*
+  Append the extended attributes of a file to the entry, packed as a
+  sequence of null terminated key, 32 bit value size and value.
+ */
+static int read_xattr(scan_job_t *job, scan_entry_t *e, const char *path)
 {
-	char *key, *value = NULL, *buffer = NULL;
+	char *key, *new, *buffer = NULL;
 	ssize_t buflen, vallen, keylen;
-	int ret;
+	sqfs_u32 size;
 
-	buflen = listxattr(node->name, NULL, 0);
+	buflen = listxattr(path, NULL, 0);
 
 	if (buflen < 0) {
+		/* the file system has no xattrs, don't ask for every file */
+		if (errno == ENOTSUP) {
+			job->no_xattr = true;
+			return 0;
+		}
+
 		perror("listxattr");
 		return -1;
 	}
@@ -62,7 +151,7 @@ static int populate_xattr(sqfs_xattr_writer_t *xwr, tree_node_t *node)
 		return -1;
 	}
 
-	buflen = listxattr(node->name, buffer, buflen);
+	buflen = listxattr(path, buffer, buflen);
 	if (buflen == -1) {
 		perror("listxattr");
 		goto fail;
@@ -70,37 +159,37 @@ static int populate_xattr(sqfs_xattr_writer_t *xwr, tree_node_t *node)
 
 	key = buffer;
 	while (buflen > 0) {
-		vallen = getxattr(node->name, key, NULL, 0);
+		keylen = strlen(key) + 1;
+
+		vallen = getxattr(path, key, NULL, 0);
 		if (vallen == -1)
 			goto fail;
 
 		if (vallen > 0) {
-			value = calloc(1, vallen);
-			if (value == NULL) {
+			new = realloc(e->xattr, e->xattr_size + keylen +
+				      sizeof(size) + vallen);
+			if (new == NULL) {
 				perror("allocating xattr value buffer");
 				goto fail;
 			}
 
-			vallen = getxattr(node->name, key, value, vallen);
+			e->xattr = new;
+			new += e->xattr_size;
+
+			vallen = getxattr(path, key, new + keylen + sizeof(size),
+					  vallen);
 			if (vallen == -1) {
 				fprintf(stderr, "%s: getxattr: %s\n",
-					node->name, strerror(errno));
+					path, strerror(errno));
 				goto fail;
 			}
 
-			ret = sqfs_xattr_writer_add(xwr, key, value, vallen);
-			if (ret) {
-				sqfs_perror(node->name,
-					    "storing xattr key-value pairs",
-					    ret);
-				goto fail;
-			}
-
-			free(value);
-			value = NULL;
+			size = vallen;
+			memcpy(new, key, keylen);
+			memcpy(new + keylen, &size, sizeof(size));
+			e->xattr_size += keylen + sizeof(size) + vallen;
 		}
 
-		keylen = strlen(key) + 1;
 		buflen -= keylen;
 		key += keylen;
 	}
@@ -108,26 +197,378 @@ static int populate_xattr(sqfs_xattr_writer_t *xwr, tree_node_t *node)
 	free(buffer);
 	return 0;
 fail:
-	free(value);
 	free(buffer);
 	return -1;
 }
+
+static int store_xattr(sqfs_xattr_writer_t *xwr, const scan_entry_t *e)
+{
+	const char *key, *ptr = e->xattr, *end = e->xattr + e->xattr_size;
+	sqfs_u32 size;
+	int ret;
+
+	while (ptr < end) {
+		key = ptr;
+		ptr += strlen(key) + 1;
+
+		memcpy(&size, ptr, sizeof(size));
+		ptr += sizeof(size);
+
+		ret = sqfs_xattr_writer_add(xwr, key, ptr, size);
+		if (ret) {
+			sqfs_perror(e->name, "storing xattr key-value pairs",
+				    ret);
+			return -1;
+		}
+
+		ptr += size;
+	}
+
+	return 0;
+}
+#endif
+
+static char *join_path(const char *dir, const char *name)
+{
+	char *path = malloc(strlen(dir) + strlen(name) + 2);
+
+	if (path == NULL) {
+		perror(name);
+		return NULL;
+	}
+
+	sprintf(path, "%s/%s", dir, name);
+	return path;
+}
+
+static scan_job_t *job_create(const char *dir, const char *name)
+{
+	scan_job_t *job = calloc(1, sizeof(*job));
+
+	if (job == NULL) {
+		perror(name);
+		return NULL;
+	}
+
+	job->path = dir == NULL ? strdup(name) : join_path(dir, name);
+	if (job->path == NULL) {
+		if (dir == NULL)
+			perror(name);
+		free(job);
+		return NULL;
+	}
+
+	return job;
+}
+
+static void job_destroy(scan_job_t *job);
+
+static void entry_destroy(scan_entry_t *e)
+{
+	job_destroy(e->job);
+	free(e->link);
+	free(e->xattr);
+	free(e->selinux_context);
+	free(e);
+}
+
+static void job_destroy(scan_job_t *job)
+{
+	size_t i;
+
+	if (job == NULL)
+		return;
+
+	for (i = 0; i < job->num_entries; ++i)
+		entry_destroy(job->entries[i]);
+
+	free(job->entries);
+	free(job->path);
+	free(job);
+}
+
+static int add_entry(scan_job_t *job, scan_entry_t *e)
+{
+	size_t new_sz;
+	void *new;
+
+	if (job->num_entries == job->max_entries) {
+		new_sz = job->max_entries ? job->max_entries * 2 : 16;
+		new = realloc(job->entries, sizeof(job->entries[0]) * new_sz);
+
+		if (new == NULL) {
+			perror(e->name);
+			return -1;
+		}
+
+		job->entries = new;
+		job->max_entries = new_sz;
+	}
+
+	job->entries[job->num_entries++] = e;
+	return 0;
+}
+
+#ifdef HAVE_STATX
+/*
+  Only ask for the fields that are actually used, which spares e.g. network
+  file systems from revalidating the time stamps if they are not kept. The
+  size is only needed for symlinks, so it is skipped if the directory entry
+  already says it is something else.
+ */
+static int stat_entry(scanner_t *sc, int dir_fd, const char *name,
+		      unsigned char type, struct stat *sb)
+{
+	unsigned int mask = STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID |
+		STATX_NLINK | STATX_INO;
+	struct statx stx;
+
+	if (sc->flags & DIR_SCAN_KEEP_TIME)
+		mask |= STATX_MTIME;
+
+	/* what directories in the scan cache are checked against */
+	if (sc->cache != NULL)
+		mask |= STATX_MTIME | STATX_CTIME;
+
+	if (type == DT_LNK || type == DT_UNKNOWN)
+		mask |= STATX_SIZE;
+
+	if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW, mask, &stx))
+		return -1;
+
+	if ((stx.stx_mask & mask) != mask ||
+	    (S_ISLNK(stx.stx_mode) && !(stx.stx_mask & STATX_SIZE))) {
+		return fstatat(dir_fd, name, sb, AT_SYMLINK_NOFOLLOW);
+	}
+
+	memset(sb, 0, sizeof(*sb));
+	sb->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	sb->st_ino = stx.stx_ino;
+	sb->st_nlink = stx.stx_nlink;
+	sb->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+	sb->st_mode = stx.stx_mode;
+	sb->st_uid = stx.stx_uid;
+	sb->st_gid = stx.stx_gid;
+	sb->st_size = stx.stx_size;
+	sb->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+	sb->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+	sb->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+	sb->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+	return 0;
+}
+#else
+static int stat_entry(scanner_t *sc, int dir_fd, const char *name,
+		      unsigned char type, struct stat *sb)
+{
+	(void)sc; (void)type;
+	return fstatat(dir_fd, name, sb, AT_SYMLINK_NOFOLLOW);
+}
 #endif
 
-static int populate_dir(fstree_t *fs, tree_node_t *root, dev_t devstart,
-			void *selinux_handle, sqfs_xattr_writer_t *xwr,
-			unsigned int flags)
+static int lookup_label(scanner_t *sc, scan_job_t *job, scan_entry_t *e)
+{
+	char *path;
+
+	if (sc->selinux_handle == NULL)
+		return 0;
+
+	path = join_path(job->path + sc->root_len, e->name);
+	if (path == NULL)
+		return -1;
+
+	e->selinux_context = selinux_get_context(sc->selinux_handle,
+						 path, e->sb.st_mode);
+	free(path);
+
+	return e->selinux_context == NULL ? -1 : 0;
+}
+
+static scan_entry_t *scan_entry(scanner_t *sc, scan_job_t *job, int dir_fd,
+				const char *name, unsigned char type)
+{
+	scan_entry_t *e = calloc(1, sizeof(*e) + strlen(name) + 1);
+	char *path;
+#ifdef HAVE_SYS_XATTR_H
+	int ret;
+#endif
+
+	if (e == NULL) {
+		perror(name);
+		return NULL;
+	}
+
+	strcpy(e->name, name);
+
+	if (stat_entry(sc, dir_fd, name, type, &e->sb)) {
+		fprintf(stderr, "%s/%s: %s\n", job->path, name,
+			strerror(errno));
+		goto fail;
+	}
+
+	if ((sc->flags & DIR_SCAN_ONE_FILESYSTEM) &&
+	    e->sb.st_dev != sc->devstart) {
+		e->skip = true;
+		return e;
+	}
+
+	if (S_ISLNK(e->sb.st_mode)) {
+		e->link = calloc(1, e->sb.st_size + 1);
+		if (e->link == NULL)
+			goto fail_rdlink;
+
+		if (readlinkat(dir_fd, name, e->link, e->sb.st_size) < 0)
+			goto fail_rdlink;
+
+		e->link[e->sb.st_size] = '\0';
+	} else if (S_ISDIR(e->sb.st_mode)) {
+		e->job = job_create(job->path, name);
+		if (e->job == NULL)
+			goto fail;
+
+		e->job->sb = e->sb;
+	}
+
+#ifdef HAVE_SYS_XATTR_H
+	if ((sc->flags & DIR_SCAN_READ_XATTR) && !job->no_xattr) {
+		path = join_path(job->path, name);
+		if (path == NULL)
+			goto fail;
+
+		ret = read_xattr(job, e, path);
+		free(path);
+
+		if (ret)
+			goto fail;
+	}
+#endif
+	if (lookup_label(sc, job, e))
+		goto fail;
+	return e;
+fail_rdlink:
+	perror("readlink");
+fail:
+	job_destroy(e->job);
+	free(e->link);
+	free(e->xattr);
+	free(e);
+	return NULL;
+}
+
+static scan_entry_t *cached_entry(scanner_t *sc, scan_job_t *job,
+				  const scan_cache_entry_t *ent)
+{
+	scan_entry_t *e = calloc(1, sizeof(*e) + strlen(ent->name) + 1);
+
+	if (e == NULL) {
+		perror(ent->name);
+		return NULL;
+	}
+
+	strcpy(e->name, ent->name);
+	e->sb = ent->sb;
+
+	if (ent->link != NULL) {
+		e->link = strdup(ent->link);
+		if (e->link == NULL)
+			goto fail_errno;
+	}
+
+	if (ent->xattr_size > 0) {
+		e->xattr = malloc(ent->xattr_size);
+		if (e->xattr == NULL)
+			goto fail_errno;
+
+		memcpy(e->xattr, ent->xattr, ent->xattr_size);
+		e->xattr_size = ent->xattr_size;
+	}
+
+	if (lookup_label(sc, job, e))
+		goto fail;
+
+	return e;
+fail_errno:
+	perror(ent->name);
+fail:
+	entry_destroy(e);
+	return NULL;
+}
+
+/*
+  Take the entries of an unchanged directory from the scan cache. Only the
+  sub directories are looked at, to find changes further down.
+ */
+static int reuse_directory(scanner_t *sc, scan_job_t *job,
+			   scan_cache_dir_t *dir)
 {
-	char *extra = NULL, *path;
+	scan_cache_entry_t ent;
+	scan_entry_t *e;
+	int fd = -1;
+
+	while (dir->count > 0) {
+		scan_cache_dir_next(dir, &ent);
+
+		if (S_ISDIR(ent.sb.st_mode)) {
+			if (fd < 0) {
+				fd = open(job->path, O_RDONLY | O_DIRECTORY);
+				if (fd < 0) {
+					perror(job->path);
+					return -1;
+				}
+			}
+
+			e = scan_entry(sc, job, fd, ent.name, DT_DIR);
+		} else {
+			e = cached_entry(sc, job, &ent);
+		}
+
+		if (e == NULL)
+			goto fail;
+
+		if (e->skip) {
+			free(e);
+			continue;
+		}
+
+		if (add_entry(job, e)) {
+			entry_destroy(e);
+			goto fail;
+		}
+	}
+
+	if (fd >= 0)
+		close(fd);
+	return 0;
+fail:
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
+/* Read the entries of a directory, without touching the tree. */
+static int scan_directory(scanner_t *sc, scan_job_t *job)
+{
+	scan_cache_dir_t cached;
 	struct dirent *ent;
-	struct stat sb;
-	tree_node_t *n;
+	scan_entry_t *e;
 	DIR *dir;
-	int ret;
+	int fd;
+
+	if (sc->cache != NULL &&
+	    scan_cache_find(sc->cache, job->path + sc->root_len, &job->sb,
+			    &cached)) {
+		return reuse_directory(sc, job, &cached);
+	}
+
+	fd = open(job->path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		perror(job->path);
+		return -1;
+	}
 
-	dir = opendir(".");
+	dir = fdopendir(fd);
 	if (dir == NULL) {
-		perror("opendir");
+		perror(job->path);
+		close(fd);
 		return -1;
 	}
 
@@ -146,37 +587,381 @@ static int populate_dir(fstree_t *fs, tree_node_t *root, dev_t devstart,
 		if (!strcmp(ent->d_name, "..") || !strcmp(ent->d_name, "."))
 			continue;
 
-		if (fstatat(AT_FDCWD, ent->d_name, &sb, AT_SYMLINK_NOFOLLOW)) {
-			perror(ent->d_name);
+		e = scan_entry(sc, job, fd, ent->d_name, ent->d_type);
+		if (e == NULL)
 			goto fail;
+
+		if (e->skip) {
+			free(e);
+			continue;
 		}
 
-		if ((flags & DIR_SCAN_ONE_FILESYSTEM) && sb.st_dev != devstart)
+		if (add_entry(job, e)) {
+			entry_destroy(e);
+			goto fail;
+		}
+	}
+
+	closedir(dir);
+	return 0;
+fail:
+	closedir(dir);
+	return -1;
+}
+
+#ifdef WITH_PTHREAD
+static void queue_remove(scanner_t *sc, scan_job_t *job)
+{
+	if (job->prev != NULL) {
+		job->prev->next = job->next;
+	} else if (sc->queue == job) {
+		sc->queue = job->next;
+	}
+
+	if (job->next != NULL)
+		job->next->prev = job->prev;
+
+	job->prev = job->next = NULL;
+}
+
+static void job_finish(scanner_t *sc, scan_job_t *job, int ret)
+{
+	scan_job_t *sub;
+	size_t i;
+
+	pthread_mutex_lock(&sc->mtx);
+	job->failed = (ret != 0);
+
+	/* the main thread gives up there, no need to scan any further */
+	if (job->failed)
+		sc->stop = true;
+
+	/* push in reverse, so the first sub directory is picked up first */
+	for (i = job->num_entries; !job->failed && i-- > 0; ) {
+		sub = job->entries[i]->job;
+		if (sub == NULL)
 			continue;
 
-		if (S_ISLNK(sb.st_mode)) {
-			extra = calloc(1, sb.st_size + 1);
-			if (extra == NULL)
-				goto fail_rdlink;
+		sub->next = sc->queue;
+		if (sc->queue != NULL)
+			sc->queue->prev = sub;
+		sc->queue = sub;
+	}
 
-			if (readlink(ent->d_name, extra, sb.st_size) < 0)
-				goto fail_rdlink;
+	job->state = JOB_DONE;
+	pthread_cond_broadcast(&sc->cond);
+	pthread_mutex_unlock(&sc->mtx);
+}
 
-			extra[sb.st_size] = '\0';
-		} else if (S_ISREG(sb.st_mode)) {
-			extra = get_file_path(root, ent->d_name);
-			if (extra == NULL)
-				goto fail;
+static void *scan_proc(void *arg)
+{
+	scanner_t *sc = arg;
+	scan_job_t *job;
+
+	pthread_mutex_lock(&sc->mtx);
+	for (;;) {
+		while (!sc->stop && sc->queue == NULL)
+			pthread_cond_wait(&sc->cond, &sc->mtx);
+
+		if (sc->stop)
+			break;
+
+		job = sc->queue;
+		queue_remove(sc, job);
+		job->state = JOB_RUNNING;
+		pthread_mutex_unlock(&sc->mtx);
+
+		job_finish(sc, job, scan_directory(sc, job));
+		pthread_mutex_lock(&sc->mtx);
+	}
+	pthread_mutex_unlock(&sc->mtx);
+	return NULL;
+}
+
+static void scanner_start(scanner_t *sc, unsigned int num_threads)
+{
+	unsigned int i;
+
+	if (num_threads == 0)
+		return;
+
+	sc->threads = alloc_array(sizeof(sc->threads[0]), num_threads);
+	if (sc->threads == NULL) {
+		perror("creating directory scanner threads");
+		return;
+	}
+
+	sc->mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	sc->cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+
+	for (i = 0; i < num_threads; ++i) {
+		if (pthread_create(sc->threads + i, NULL, scan_proc, sc))
+			break;
+
+		sc->num_threads += 1;
+	}
+
+	if (sc->num_threads == 0)
+		fputs("creating directory scanner threads: failed\n", stderr);
+}
+
+static void scanner_stop(scanner_t *sc)
+{
+	unsigned int i;
+
+	if (sc->threads == NULL)
+		return;
+
+	pthread_mutex_lock(&sc->mtx);
+	sc->stop = true;
+	pthread_cond_broadcast(&sc->cond);
+	pthread_mutex_unlock(&sc->mtx);
+
+	for (i = 0; i < sc->num_threads; ++i)
+		pthread_join(sc->threads[i], NULL);
+
+	pthread_cond_destroy(&sc->cond);
+	pthread_mutex_destroy(&sc->mtx);
+	free(sc->threads);
+}
+
+/*
+  Get the entries of a directory. If no scanner thread has picked it up
+  yet, the main thread scans it itself instead of waiting.
+ */
+static int wait_for_job(scanner_t *sc, scan_job_t *job)
+{
+	if (sc->num_threads == 0)
+		return scan_directory(sc, job);
+
+	pthread_mutex_lock(&sc->mtx);
+	if (job->state == JOB_QUEUED) {
+		queue_remove(sc, job);
+		job->state = JOB_RUNNING;
+		pthread_mutex_unlock(&sc->mtx);
+
+		job_finish(sc, job, scan_directory(sc, job));
+		pthread_mutex_lock(&sc->mtx);
+	}
+
+	while (job->state != JOB_DONE)
+		pthread_cond_wait(&sc->cond, &sc->mtx);
+	pthread_mutex_unlock(&sc->mtx);
+
+	return job->failed ? -1 : 0;
+}
+#else
+static void scanner_start(scanner_t *sc, unsigned int num_threads)
+{
+	(void)sc; (void)num_threads;
+}
+
+static void scanner_stop(scanner_t *sc)
+{
+	(void)sc;
+}
+
+static int wait_for_job(scanner_t *sc, scan_job_t *job)
+{
+	return scan_directory(sc, job);
+}
+#endif
+
+static size_t inode_hash(dev_t dev, ino_t ino)
+{
+	sqfs_u64 hash = ((sqfs_u64)dev << 32) ^ (sqfs_u64)ino;
+
+	hash *= 0x9E3779B97F4A7C15ULL;
+	return (size_t)(hash ^ (hash >> 32));
+}
+
+static inode_entry_t *find_inode(scanner_t *sc, const struct stat *sb)
+{
+	size_t i, mask = sc->inodes_size - 1;
+	inode_entry_t *ent;
+
+	i = inode_hash(sb->st_dev, sb->st_ino) & mask;
+
+	for (;; i = (i + 1) & mask) {
+		ent = sc->inodes + i;
+
+		if (ent->node == NULL ||
+		    (ent->dev == sb->st_dev && ent->ino == sb->st_ino)) {
+			return ent;
 		}
+	}
+}
+
+static int grow_inodes(scanner_t *sc)
+{
+	inode_entry_t *old = sc->inodes, *ent;
+	size_t i, old_size = sc->inodes_size;
+	struct stat sb;
 
-		if (!(flags & DIR_SCAN_KEEP_TIME))
-			sb.st_mtim = fs->defaults.st_mtim;
+	sc->inodes_size = old_size ? old_size * 2 : 256;
+	sc->inodes = calloc(sc->inodes_size, sizeof(sc->inodes[0]));
+
+	if (sc->inodes == NULL) {
+		perror("recording hard linked files");
+		sc->inodes = old;
+		sc->inodes_size = old_size;
+		return -1;
+	}
+
+	for (i = 0; i < old_size; ++i) {
+		if (old[i].node == NULL)
+			continue;
+
+		sb.st_dev = old[i].dev;
+		sb.st_ino = old[i].ino;
+		ent = find_inode(sc, &sb);
+		*ent = old[i];
+	}
+
+	free(old);
+	return 0;
+}
+
+/*
+  If the entry is another name for a node that was already created, add a
+  hard link to it instead. Returns 1 if it was, 0 if not, -1 on failure.
+ */
+static int add_hard_link(fstree_t *fs, tree_node_t *root, scanner_t *sc,
+			 scan_entry_t *e)
+{
+	inode_entry_t *ent;
+	struct stat sb;
+	tree_node_t *n;
+
+	if (S_ISDIR(e->sb.st_mode) || e->sb.st_nlink < 2 ||
+	    sc->inodes_size == 0) {
+		return 0;
+	}
+
+	ent = find_inode(sc, &e->sb);
+	if (ent->node == NULL)
+		return 0;
+
+	memset(&sb, 0, sizeof(sb));
+	sb.st_mode = FSTREE_MODE_HARD_LINK_RESOLVED;
+
+	n = fstree_mknode(fs, root, e->name, strlen(e->name), NULL, &sb);
+	if (n == NULL) {
+		perror("creating tree node");
+		return -1;
+	}
+
+	n->data.target = ent->node;
+	ent->node->link_count += 1;
+	e->node = n;
+	return 1;
+}
+
+static int remember_inode(scanner_t *sc, const scan_entry_t *e)
+{
+	inode_entry_t *ent;
+
+	if (sc->inodes_used >= sc->inodes_size / 2 && grow_inodes(sc))
+		return -1;
+
+	ent = find_inode(sc, &e->sb);
+	ent->dev = e->sb.st_dev;
+	ent->ino = e->sb.st_ino;
+	ent->node = e->node;
+	sc->inodes_used += 1;
+	return 0;
+}
+
+static int push_name(path_buf_t *path, const char *name)
+{
+	int ret = path_buf_push(path, name, strlen(name));
+
+	if (ret)
+		sqfs_perror(name, "getting absolute file path", ret);
+
+	return ret;
+}
+
+static int save_directory(scanner_t *sc, const scan_job_t *job)
+{
+	scan_cache_entry_t ent;
+	const scan_entry_t *e;
+	size_t i;
+
+	if (scan_cache_begin_dir(sc->cache, job->path + sc->root_len,
+				 &job->sb, job->num_entries)) {
+		return -1;
+	}
+
+	for (i = 0; i < job->num_entries; ++i) {
+		e = job->entries[i];
+
+		ent.sb = e->sb;
+		ent.name = e->name;
+		ent.link = e->link;
+		ent.xattr = e->xattr;
+		ent.xattr_size = e->xattr_size;
+
+		if (scan_cache_add_entry(sc->cache, &ent))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* path is the input path of the directory, relative to the root */
+static int populate_dir(fstree_t *fs, tree_node_t *root, scanner_t *sc,
+			scan_job_t *job, sqfs_xattr_writer_t *xwr,
+			path_buf_t *path)
+{
+	size_t old_len = path->len;
+	const char *extra;
+	scan_entry_t *e;
+	tree_node_t *n;
+	size_t i;
+	int ret;
+
+	if (wait_for_job(sc, job))
+		return -1;
+
+	/* before the time stamps are replaced below */
+	if (sc->cache != NULL && save_directory(sc, job))
+		return -1;
+
+	for (i = 0; i < job->num_entries; ++i) {
+		e = job->entries[i];
+		extra = NULL;
+
+		ret = add_hard_link(fs, root, sc, e);
+		if (ret < 0)
+			return -1;
+		if (ret > 0)
+			continue;
+
+		if (S_ISREG(e->sb.st_mode)) {
+			if (push_name(path, e->name))
+				return -1;
+			extra = path->str;
+		}
+
+		if (!(sc->flags & DIR_SCAN_KEEP_TIME))
+			e->sb.st_mtim = fs->defaults.st_mtim;
+
+		n = fstree_mknode(fs, root, e->name, strlen(e->name),
+				  S_ISLNK(e->sb.st_mode) ? e->link : extra,
+				  &e->sb);
+		path_buf_truncate(path, old_len);
 
-		n = fstree_mknode(root, ent->d_name, strlen(ent->d_name),
-				  extra, &sb);
 		if (n == NULL) {
 			perror("creating tree node");
-			goto fail;
+			return -1;
+		}
+
+		e->node = n;
+
+		if (!S_ISDIR(e->sb.st_mode) && e->sb.st_nlink > 1 &&
+		    remember_inode(sc, e)) {
+			return -1;
 		}
 
 		if (sqfs_xattr_writer_begin(xwr)) {
@@ -185,68 +970,49 @@ static int populate_dir(fstree_t *fs, tree_node_t *root, dev_t devstart,
 		}
 
 #ifdef HAVE_SYS_XATTR_H
-		if (flags & DIR_SCAN_READ_XATTR) {
-			if (populate_xattr(xwr, n))
-				goto fail;
-		}
+		if (store_xattr(xwr, e))
+			return -1;
 #endif
-		if (selinux_handle != NULL) {
-			path = fstree_get_path(n);
-			if (path == NULL) {
-				perror("getting full path for "
-				       "SELinux relabeling");
-				goto fail;
-			}
-
-			if (selinux_relable_node(selinux_handle, xwr,
-						 n, path)) {
-				free(path);
-				goto fail;
-			}
-
-			free(path);
+		if (e->selinux_context != NULL &&
+		    selinux_add_context(xwr, n->name, e->selinux_context)) {
+			return -1;
 		}
 
 		ret = sqfs_xattr_writer_end(xwr, &n->xattr_idx);
 		if (ret) {
 			sqfs_perror(n->name,
 				    "completing xattr key-value pairs", ret);
-			goto fail;
+			return -1;
 		}
-
-		free(extra);
-		extra = NULL;
 	}
 
-	closedir(dir);
+	for (i = 0; i < job->num_entries; ++i) {
+		e = job->entries[i];
+		if (e->job == NULL)
+			continue;
 
-	for (n = root->data.dir.children; n != NULL; n = n->next) {
-		if (S_ISDIR(n->mode)) {
-			if (pushd(n->name))
-				return -1;
+		if (push_name(path, e->name))
+			return -1;
 
-			if (populate_dir(fs, n, devstart, selinux_handle,
-					 xwr, flags)) {
-				return -1;
-			}
+		if (populate_dir(fs, e->node, sc, e->job, xwr, path))
+			return -1;
 
-			if (popd())
-				return -1;
-		}
+		path_buf_truncate(path, old_len);
+
+		job_destroy(e->job);
+		e->job = NULL;
 	}
 
 	return 0;
-fail_rdlink:
-	perror("readlink");
-fail:
-	closedir(dir);
-	free(extra);
-	return -1;
 }
 
 int fstree_from_dir(fstree_t *fs, const char *path, void *selinux_handle,
-		    sqfs_xattr_writer_t *xwr, unsigned int flags)
+		    sqfs_xattr_writer_t *xwr, unsigned int flags,
+		    unsigned int num_threads, const char *cache_file)
 {
+	path_buf_t rel_path;
+	scan_job_t *root;
+	scanner_t sc;
 	struct stat sb;
 	int ret;
 
@@ -255,14 +1021,45 @@ int fstree_from_dir(fstree_t *fs, const char *path, void *selinux_handle,
 		return -1;
 	}
 
-	if (pushd(path))
+	ret = path_buf_init(&rel_path, "");
+	if (ret) {
+		sqfs_perror(path, "scanning directory", ret);
+		return -1;
+	}
+
+	root = job_create(NULL, path);
+	if (root == NULL) {
+		path_buf_cleanup(&rel_path);
 		return -1;
+	}
+
+	root->sb = sb;
+
+	memset(&sc, 0, sizeof(sc));
+	sc.devstart = sb.st_dev;
+	sc.flags = flags;
+	sc.selinux_handle = selinux_handle;
+	sc.root_len = strlen(path);
+
+	if (cache_file != NULL) {
+		sc.cache = scan_cache_open(cache_file, flags);
+		if (sc.cache == NULL) {
+			ret = -1;
+			goto out;
+		}
+	}
 
-	ret = populate_dir(fs, fs->root, sb.st_dev, selinux_handle,
-			   xwr, flags);
+	scanner_start(&sc, num_threads);
+	ret = populate_dir(fs, fs->root, &sc, root, xwr, &rel_path);
+	scanner_stop(&sc);
 
-	if (popd())
-		ret = -1;
+	if (ret == 0 && sc.cache != NULL)
+		ret = scan_cache_commit(sc.cache);
 
+	scan_cache_destroy(sc.cache);
+out:
+	free(sc.inodes);
+	path_buf_cleanup(&rel_path);
+	job_destroy(root);
 	return ret;
 }
@@ -0,0 +1,127 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * file_order.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "mkfs.h"
+
+#include <sys/stat.h>
+
+#if defined(HAVE_LINUX_FIEMAP_H) && defined(HAVE_LINUX_FS_H)
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#define HAVE_FIEMAP
+#endif
+
+typedef struct {
+	file_info_t *fi;
+	sqfs_u64 physical;
+	sqfs_u64 inode;
+	size_t index;
+} file_loc_t;
+
+static int cmp_loc(const void *lhs, const void *rhs)
+{
+	const file_loc_t *l = lhs, *r = rhs;
+
+	if (l->physical != r->physical)
+		return l->physical < r->physical ? -1 : 1;
+
+	if (l->inode != r->inode)
+		return l->inode < r->inode ? -1 : 1;
+
+	return l->index < r->index ? -1 : (l->index > r->index ? 1 : 0);
+}
+
+#ifdef HAVE_FIEMAP
+/* Physical byte offset of the first extent, 0 if there is none. */
+static sqfs_u64 first_extent(int fd)
+{
+	union {
+		struct fiemap map;
+		sqfs_u8 raw[sizeof(struct fiemap) +
+			    sizeof(struct fiemap_extent)];
+	} buffer;
+
+	memset(&buffer, 0, sizeof(buffer));
+	buffer.map.fm_length = FIEMAP_MAX_OFFSET;
+	buffer.map.fm_extent_count = 1;
+
+	if (ioctl(fd, FS_IOC_FIEMAP, &buffer.map) != 0)
+		return 0;
+
+	if (buffer.map.fm_mapped_extents == 0)
+		return 0;
+
+	if (buffer.map.fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN)
+		return 0;
+
+	return buffer.map.fm_extents[0].fe_physical;
+}
+#endif
+
+static int get_location(file_loc_t *loc)
+{
+	struct stat sb;
+	int fd;
+
+	fd = open(loc->fi->input_file, O_RDONLY);
+	if (fd < 0)
+		goto fail;
+
+	if (fstat(fd, &sb)) {
+		close(fd);
+		goto fail;
+	}
+
+	loc->inode = sb.st_ino;
+#ifdef HAVE_FIEMAP
+	loc->physical = first_extent(fd);
+#endif
+	close(fd);
+	return 0;
+fail:
+	perror(loc->fi->input_file);
+	return -1;
+}
+
+int sort_files_physical(fstree_t *fs)
+{
+	size_t i, count = 0;
+	file_info_t *fi;
+	file_loc_t *list;
+
+	for (fi = fs->files; fi != NULL; fi = fi->next)
+		++count;
+
+	if (count < 2)
+		return 0;
+
+	list = alloc_array(sizeof(list[0]), count);
+	if (list == NULL) {
+		perror("sorting files by location");
+		return -1;
+	}
+
+	for (fi = fs->files, i = 0; fi != NULL; fi = fi->next, ++i) {
+		memset(list + i, 0, sizeof(list[i]));
+		list[i].fi = fi;
+		list[i].index = i;
+
+		if (get_location(list + i)) {
+			free(list);
+			return -1;
+		}
+	}
+
+	qsort(list, count, sizeof(list[0]), cmp_loc);
+
+	for (i = 0; i < count; ++i)
+		list[i].fi->next = (i + 1) < count ? list[i + 1].fi : NULL;
+
+	fs->files = list[0].fi;
+	free(list);
+	return 0;
+}
@@ -28,30 +28,357 @@ static int restore_working_dir(options_t *opt)
 	return 0;
 }
 
-static int pack_files(sqfs_data_writer_t *data, fstree_t *fs,
-		      data_writer_stats_t *stats, options_t *opt)
+static int order_files(fstree_t *fs, options_t *opt)
 {
-	sqfs_inode_generic_t *inode;
-	size_t max_blk_count;
+	FILE *fp;
+	int ret;
+
+	if (opt->physical_order) {
+		if (set_working_dir(opt))
+			return -1;
+
+		ret = sort_files_physical(fs);
+
+		if (restore_working_dir(opt) || ret)
+			return -1;
+	}
+
+	if (opt->priority_file != NULL) {
+		fp = fopen(opt->priority_file, "r");
+		if (fp == NULL) {
+			perror(opt->priority_file);
+			return -1;
+		}
+
+		ret = fstree_prioritize_files(fs, opt->priority_file, fp);
+		fclose(fp);
+
+		if (ret)
+			return -1;
+	}
+
+	fstree_sort_files_by_priority(fs);
+	return 0;
+}
+
+/* limits for the samples a zstd dictionary is trained from */
+#define DICT_MAX_SAMPLES (4096)
+#define DICT_MAX_SAMPLE_SIZE (4096)
+
+typedef struct {
+	sqfs_u8 *data;
+	size_t *sizes;
+	size_t count;
+	size_t used;
+} dict_samples_t;
+
+static sqfs_u8 *sample_reserve(dict_samples_t *smp, size_t size)
+{
+	if (smp->count == DICT_MAX_SAMPLES || size > DICT_MAX_SAMPLE_SIZE)
+		return NULL;
+
+	smp->sizes[smp->count++] = size;
+	smp->used += size;
+	return smp->data + smp->used - size;
+}
+
+/* the tail ends of a subset of the files, which end up in fragment blocks */
+static int sample_tail_ends(dict_samples_t *smp, fstree_t *fs, options_t *opt)
+{
+	size_t i, stride, size, count = 0;
 	sqfs_u64 filesize;
 	sqfs_file_t *file;
 	file_info_t *fi;
+	sqfs_u8 *ptr;
 	int ret;
 
+	for (fi = fs->files; fi != NULL; fi = fi->next)
+		++count;
+
+	stride = count / (DICT_MAX_SAMPLES / 2) + 1;
+
+	for (fi = fs->files, i = 0; fi != NULL; fi = fi->next, ++i) {
+		if ((i % stride) != 0)
+			continue;
+
+		file = sqfs_open_file(fi->input_file, SQFS_FILE_OPEN_READ_ONLY);
+		if (file == NULL) {
+			perror(fi->input_file);
+			return -1;
+		}
+
+		filesize = file->get_size(file);
+		size = filesize % opt->cfg.block_size;
+		if (size > DICT_MAX_SAMPLE_SIZE)
+			size = DICT_MAX_SAMPLE_SIZE;
+
+		ptr = size > 0 ? sample_reserve(smp, size) : NULL;
+		ret = 0;
+
+		if (ptr != NULL) {
+			ret = file->read_at(file, filesize - size, ptr, size);
+			if (ret)
+				sqfs_perror(fi->input_file, "sampling", ret);
+		}
+
+		file->destroy(file);
+
+		if (ret)
+			return -1;
+
+		if (smp->count >= DICT_MAX_SAMPLES / 2)
+			break;
+	}
+
+	return 0;
+}
+
+/* the entry names of each directory, standing in for the directory table */
+static void sample_names(dict_samples_t *smp, const tree_node_t *root)
+{
+	const tree_node_t *it;
+	size_t size = 0, len;
+	sqfs_u8 *ptr;
+
+	for (it = root->data.dir.children; it != NULL; it = it->next) {
+		len = strlen(it->name);
+		if (size + len > DICT_MAX_SAMPLE_SIZE)
+			break;
+		size += len;
+	}
+
+	ptr = size > 0 ? sample_reserve(smp, size) : NULL;
+
+	for (it = root->data.dir.children; it != NULL; it = it->next) {
+		len = strlen(it->name);
+		if (ptr == NULL || len > size)
+			break;
+
+		memcpy(ptr, it->name, len);
+		ptr += len;
+		size -= len;
+	}
+
+	for (it = root->data.dir.children; it != NULL; it = it->next) {
+		if (S_ISDIR(it->mode))
+			sample_names(smp, it);
+	}
+}
+
+static int train_dictionary(sqfs_writer_t *sqfs, options_t *opt)
+{
+	sqfs_u8 dict[SQFS_ZSTD_MAX_DICT_SIZE];
+	size_t dict_size = sizeof(dict);
+	dict_samples_t smp;
+	int ret = -1;
+
+	if (!opt->cfg.quiet)
+		fputs("Training compressor dictionary...\n", stdout);
+
+	memset(&smp, 0, sizeof(smp));
+	smp.data = alloc_array(DICT_MAX_SAMPLES, DICT_MAX_SAMPLE_SIZE);
+	smp.sizes = alloc_array(sizeof(smp.sizes[0]), DICT_MAX_SAMPLES);
+
+	if (smp.data == NULL || smp.sizes == NULL) {
+		perror("allocating dictionary samples");
+		goto out;
+	}
+
 	if (set_working_dir(opt))
-		return -1;
+		goto out;
+
+	ret = sample_tail_ends(&smp, &sqfs->fs, opt);
+
+	if (restore_working_dir(opt) || ret) {
+		ret = -1;
+		goto out;
+	}
+
+	sample_names(&smp, sqfs->fs.root);
+
+	ret = sqfs_compressor_train_dict(opt->cfg.comp_id, smp.data,
+					 smp.sizes, smp.count,
+					 dict, &dict_size);
+	if (ret == SQFS_ERROR_COMPRESSOR) {
+		fputs("Not enough sample data for a dictionary, "
+		      "compressing without one.\n", stderr);
+		ret = sqfs_writer_init_data(sqfs, &opt->cfg, NULL, 0);
+	} else if (ret != 0) {
+		sqfs_perror(opt->cfg.filename, "training dictionary", ret);
+		ret = -1;
+	} else {
+		fputs("WARNING: the image uses a zstd dictionary and cannot be "
+		      "read by the Linux kernel.\n", stderr);
+		ret = sqfs_writer_init_data(sqfs, &opt->cfg, dict, dict_size);
+	}
+out:
+	free(smp.sizes);
+	free(smp.data);
+	return ret;
+}
+
+static int sample_input(block_probe_t *probe, fstree_t *fs)
+{
+	sqfs_u64 filesize;
+	sqfs_file_t *file;
+	file_info_t *fi;
+	sqfs_u8 *ptr;
+	size_t size;
+	int ret;
 
 	for (fi = fs->files; fi != NULL; fi = fi->next) {
-		if (!opt->cfg.quiet)
-			printf("packing %s\n", fi->input_file);
+		if (!block_probe_want(probe))
+			continue;
 
-		file = sqfs_open_file(fi->input_file,
-				      SQFS_FILE_OPEN_READ_ONLY);
+		file = sqfs_open_file(fi->input_file, SQFS_FILE_OPEN_READ_ONLY);
 		if (file == NULL) {
 			perror(fi->input_file);
 			return -1;
 		}
 
+		filesize = file->get_size(file);
+		ret = 0;
+
+		if (filesize > 0) {
+			ptr = block_probe_add(probe, filesize, &size);
+			ret = ptr == NULL ? -1 :
+				file->read_at(file, 0, ptr, size);
+
+			if (ret > 0)
+				sqfs_perror(fi->input_file, "sampling", ret);
+		}
+
+		file->destroy(file);
+
+		if (ret)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int probe_block_size(sqfs_writer_t *sqfs, options_t *opt)
+{
+	block_probe_t *probe;
+	int ret;
+
+	if (!opt->cfg.quiet)
+		fputs("Sampling the input to pick a block size...\n", stdout);
+
+	probe = block_probe_create();
+	if (probe == NULL)
+		return -1;
+
+	if (set_working_dir(opt)) {
+		block_probe_destroy(probe);
+		return -1;
+	}
+
+	ret = sample_input(probe, &sqfs->fs);
+
+	if (restore_working_dir(opt))
+		ret = -1;
+
+	if (ret == 0)
+		ret = block_probe_apply(probe, sqfs, &opt->cfg);
+
+	block_probe_destroy(probe);
+	return ret;
+}
+
+#define MMAP_MIN_BLOCKS (4)
+
+/*
+  Files that span a few blocks are read through a private mapping, so the
+  data writer copies each block straight out of the page cache instead of
+  issuing a read per block. With --no-page-cache, the data is dropped from
+  the page cache after each read instead, which a mapping would defeat.
+ */
+static sqfs_file_t *open_input(const file_info_t *fi, const options_t *opt,
+			       sqfs_u32 open_flags)
+{
+	sqfs_file_t *file;
+
+	file = sqfs_open_file(fi->input_file, open_flags);
+	if (file == NULL || opt->cfg.no_page_cache)
+		return file;
+
+	if (file->get_size(file) < MMAP_MIN_BLOCKS * opt->cfg.block_size)
+		return file;
+
+	file->destroy(file);
+
+	return sqfs_open_file(fi->input_file, open_flags |
+			      SQFS_FILE_OPEN_MMAP | SQFS_FILE_OPEN_SEQUENTIAL);
+}
+
+static int pack_files(sqfs_data_writer_t *data, fstree_t *fs,
+		      data_writer_stats_t *stats, options_t *opt,
+		      const base_image_t *img, block_cache_t *cache,
+		      inode_spill_t *spill, checkpoint_t *cp,
+		      size_t first, size_t end)
+{
+	sqfs_u32 open_flags = SQFS_FILE_OPEN_READ_ONLY;
+	file_info_t *fi, **dups;
+	sqfs_inode_generic_t *inode;
+	prefetch_t *pf;
+	size_t i, max_blk_count;
+	sqfs_u64 filesize;
+	sqfs_file_t *file;
+	bool reused;
+	int ret = -1;
+
+	if (set_working_dir(opt))
+		return -1;
+
+	/* each input file is read exactly once from here on */
+	if (opt->cfg.no_page_cache)
+		open_flags |= SQFS_FILE_OPEN_SEQUENTIAL;
+
+	dups = find_duplicate_files(fs, !opt->no_file_dedup,
+				    &stats->progress.total);
+	if (dups == NULL)
+		return -1;
+
+	for (fi = fs->files, i = 0; fi != NULL; fi = fi->next, ++i) {
+		if (dups[i] != NULL)
+			dups[i]->linked = true;
+	}
+
+	pf = prefetch_create(fs, dups, opt->read_threads);
+
+	for (fi = fs->files, i = 0; fi != NULL; fi = fi->next, ++i) {
+		/* packed by other workers into their partial images */
+		if (i < first || i >= end)
+			continue;
+
+		/* the first copy may be in the part of another worker */
+		if (dups[i] != NULL && dups[i]->user_ptr == NULL)
+			dups[i] = NULL;
+
+		/* packed by the interrupted run, the data is already there */
+		if (i < checkpoint_files_done(cp)) {
+			fi->user_ptr = checkpoint_restore(cp, fi);
+			if (fi->user_ptr == NULL) {
+				ret = -1;
+				goto out;
+			}
+
+			stats->file_count += 1;
+			continue;
+		}
+
+		if (!opt->cfg.quiet && !opt->cfg.progress)
+			printf("packing %s\n", fi->input_file);
+
+		prefetch_advance(pf, i);
+
+		file = open_input(fi, opt, open_flags);
+		if (file == NULL) {
+			perror(fi->input_file);
+			goto out;
+		}
+
 		filesize = file->get_size(file);
 
 		max_blk_count = filesize / opt->cfg.block_size;
@@ -63,7 +390,7 @@ static int pack_files(sqfs_data_writer_t *data, fstree_t *fs,
 		if (inode == NULL) {
 			perror("creating file inode");
 			file->destroy(file);
-			return -1;
+			goto out;
 		}
 
 		inode->block_sizes = (sqfs_u32 *)inode->extra;
@@ -71,59 +398,82 @@ static int pack_files(sqfs_data_writer_t *data, fstree_t *fs,
 		sqfs_inode_set_file_size(inode, filesize);
 		sqfs_inode_set_frag_location(inode, 0xFFFFFFFF, 0xFFFFFFFF);
 
+		reused = false;
+		ret = 0;
+
+		if (dups[i] == NULL)
+			ret = base_image_pack(img, fi, data, inode, file,
+					      &reused);
+
 		fi->user_ptr = inode;
 
-		ret = write_data_from_file(fi->input_file, data,
-					   inode, file, 0);
+		if (ret) {
+			file->destroy(file);
+			goto out;
+		}
+
+		if (dups[i] != NULL) {
+			ret = sqfs_data_writer_link_file(data, inode,
+							 dups[i]->user_ptr);
+			if (ret) {
+				sqfs_perror(fi->input_file,
+					    "linking duplicate file", ret);
+				ret = -1;
+			}
+
+			stats->duplicate_files += 1;
+		} else if (reused) {
+			stats->reused_files += 1;
+			stats->bytes_read += filesize;
+		} else {
+			sqfs_trace_begin("gensquashfs", "pack file");
+			ret = write_data_from_file(fi->input_file, data,
+						   inode, file, cache,
+						   fi->flags);
+			sqfs_trace_end("gensquashfs", "pack file");
+			stats->bytes_read += filesize;
+		}
+
 		file->destroy(file);
 
 		if (ret)
-			return -1;
+			goto out;
+
+		if (spill != NULL && dups[i] == NULL && !fi->linked &&
+		    inode_spill_add(spill, fi)) {
+			goto out;
+		}
 
 		stats->file_count += 1;
-		stats->bytes_read += filesize;
+		progress_update(stats);
+
+		if (checkpoint_update(cp, i + 1)) {
+			ret = -1;
+			goto out;
+		}
 	}
 
-	return restore_working_dir(opt);
+	prefetch_destroy(pf);
+	pf = NULL;
+	ret = restore_working_dir(opt);
+out:
+	prefetch_destroy(pf);
+	free(dups);
+	return ret;
 }
 
-static int relabel_tree_dfs(const char *filename, sqfs_xattr_writer_t *xwr,
-			    tree_node_t *n, void *selinux_handle)
+static int select_shard(fstree_t *fs, options_t *opt,
+			size_t *first, size_t *end)
 {
-	char *path = fstree_get_path(n);
 	int ret;
 
-	if (path == NULL) {
-		perror("getting absolute node path for SELinux relabeling");
-		return -1;
-	}
-
-	ret = sqfs_xattr_writer_begin(xwr);
-	if (ret) {
-		sqfs_perror(filename, "recording xattr key-value pairs", ret);
+	if (set_working_dir(opt))
 		return -1;
-	}
 
-	if (selinux_relable_node(selinux_handle, xwr, n, path)) {
-		free(path);
-		return -1;
-	}
+	ret = shard_select(fs, opt->shard_index, opt->shard_count, first, end);
 
-	ret = sqfs_xattr_writer_end(xwr, &n->xattr_idx);
-	if (ret) {
-		sqfs_perror(filename, "flushing completed key-value pairs",
-			    ret);
+	if (restore_working_dir(opt) || ret)
 		return -1;
-	}
-
-	free(path);
-
-	if (S_ISDIR(n->mode)) {
-		for (n = n->data.dir.children; n != NULL; n = n->next) {
-			if (relabel_tree_dfs(filename, xwr, n, selinux_handle))
-				return -1;
-		}
-	}
 
 	return 0;
 }
@@ -135,8 +485,12 @@ static int read_fstree(fstree_t *fs, options_t *opt, sqfs_xattr_writer_t *xwr,
 	int ret;
 
 	if (opt->infile == NULL) {
-		return fstree_from_dir(fs, opt->packdir, selinux_handle,
-				       xwr, opt->dirscan_flags);
+		sqfs_trace_begin("gensquashfs", "scan directory");
+		ret = fstree_from_dir(fs, opt->packdir, selinux_handle,
+				      xwr, opt->dirscan_flags,
+				      opt->scan_threads, opt->scan_cache);
+		sqfs_trace_end("gensquashfs", "scan directory");
+		return ret;
 	}
 
 	fp = fopen(opt->infile, "rb");
@@ -149,31 +503,39 @@ static int read_fstree(fstree_t *fs, options_t *opt, sqfs_xattr_writer_t *xwr,
 	fclose(fp);
 
 	if (ret == 0 && selinux_handle != NULL)
-		ret = relabel_tree_dfs(opt->cfg.filename, xwr,
-				       fs->root, selinux_handle);
+		ret = selinux_relabel_tree(selinux_handle, xwr, fs,
+					   opt->cfg.filename,
+					   opt->scan_threads);
 
 	return ret;
 }
 
-int main(int argc, char **argv)
+int build_image(options_t *opt)
 {
 	int status = EXIT_FAILURE;
+	base_image_t *img = NULL;
+	checkpoint_t *cp = NULL;
+	size_t first = 0, end = SIZE_MAX;
+	bool resume = false;
 	void *sehnd = NULL;
 	sqfs_writer_t sqfs;
-	options_t opt;
 
-	process_command_line(&opt, argc, argv);
+	/* continue writing the image of the interrupted run */
+	if (opt->checkpoint != NULL && access(opt->checkpoint, F_OK) == 0) {
+		opt->cfg.outmode |= SQFS_FILE_OPEN_NO_TRUNCATE;
+		resume = true;
+	}
 
-	if (sqfs_writer_init(&sqfs, &opt.cfg))
+	if (sqfs_writer_init(&sqfs, &opt->cfg))
 		return EXIT_FAILURE;
 
-	if (opt.selinux != NULL) {
-		sehnd = selinux_open_context_file(opt.selinux);
+	if (opt->selinux != NULL) {
+		sehnd = selinux_open_context_file(opt->selinux);
 		if (sehnd == NULL)
 			goto out;
 	}
 
-	if (read_fstree(&sqfs.fs, &opt, sqfs.xwr, sehnd)) {
+	if (read_fstree(&sqfs.fs, opt, sqfs.xwr, sehnd)) {
 		if (sehnd != NULL)
 			selinux_close_context_file(sehnd);
 		goto out;
@@ -187,14 +549,81 @@ int main(int argc, char **argv)
 	tree_node_sort_recursive(sqfs.fs.root);
 	fstree_gen_file_list(&sqfs.fs);
 
-	if (pack_files(sqfs.data, &sqfs.fs, &sqfs.stats, &opt))
+	if (order_files(&sqfs.fs, opt))
+		goto out;
+
+	if (opt->cfg.max_read_amp > 0 && probe_block_size(&sqfs, opt))
+		goto out;
+
+	if (sqfs.data == NULL && train_dictionary(&sqfs, opt))
+		goto out;
+
+	if (opt->checkpoint != NULL) {
+		cp = checkpoint_create(opt->checkpoint, &sqfs,
+				       opt->cfg.filename, resume);
+		if (cp == NULL)
+			goto out;
+	}
+
+	if (opt->base_image != NULL) {
+		img = base_image_open(opt->base_image, &sqfs.super,
+				      sqfs.outfile, opt->infile == NULL &&
+				      opt->scan_cache == NULL &&
+				      (opt->dirscan_flags & DIR_SCAN_KEEP_TIME));
+		if (img == NULL)
+			goto out;
+
+		if (base_image_match(img, &sqfs.fs))
+			goto out;
+	}
+
+	if (opt->shard_count > 0 && select_shard(&sqfs.fs, opt, &first, &end))
+		goto out;
+
+	stats_phase_end(&sqfs.stats, WRITER_PHASE_SCAN);
+
+	if (opt->num_partials > 0) {
+		if (shard_merge(&sqfs, opt))
+			goto out;
+	} else if (pack_files(sqfs.data, &sqfs.fs, &sqfs.stats, opt, img,
+			      sqfs.cache, sqfs.spill, cp, first, end)) {
+		goto out;
+	}
+
+	if (opt->shard_count > 0) {
+		if (shard_write_partial(&sqfs, &opt->cfg, opt->shard_index,
+					opt->shard_count, first, end))
+			goto out;
+	} else if (sqfs_writer_finish(&sqfs, &opt->cfg)) {
 		goto out;
+	}
 
-	if (sqfs_writer_finish(&sqfs, &opt.cfg))
+	if (checkpoint_remove(cp))
 		goto out;
 
 	status = EXIT_SUCCESS;
 out:
+	checkpoint_destroy(cp);
+	base_image_destroy(img);
 	sqfs_writer_cleanup(&sqfs);
 	return status;
 }
+
+int main(int argc, char **argv)
+{
+	options_t opt;
+	int status;
+
+	process_command_line(&opt, argc, argv);
+
+	if (opt.serve != NULL) {
+		status = serve_jobs(&opt);
+	} else if (opt.connect != NULL) {
+		status = serve_connect(opt.connect, argc, argv);
+	} else {
+		status = build_image(&opt);
+	}
+
+	free(opt.partials);
+	return status;
+}
@@ -40,8 +40,62 @@ typedef struct {
 	const char *infile;
 	const char *packdir;
 	const char *selinux;
+	unsigned int read_threads;
+	unsigned int scan_threads;
+	bool physical_order;
+	bool no_file_dedup;
+	const char *priority_file;
+	const char *base_image;
+	const char *checkpoint;
+	unsigned int shard_index;
+	unsigned int shard_count;
+	const char **partials;
+	size_t num_partials;
+	const char *serve;
+	const char *connect;
+	const char *scan_cache;
 } options_t;
 
+typedef struct prefetch_t prefetch_t;
+
+typedef struct base_image_t base_image_t;
+
+typedef struct checkpoint_t checkpoint_t;
+
+typedef struct scan_cache_t scan_cache_t;
+
+/* A directory entry as recorded in a scan cache */
+typedef struct {
+	struct stat sb;
+	const char *name;
+
+	/* symlink target, NULL for anything else */
+	const char *link;
+
+	/* packed extended attributes, as read by the directory scanner */
+	const char *xattr;
+	size_t xattr_size;
+} scan_cache_entry_t;
+
+/* The entries of a directory in a scan cache that are not read yet */
+typedef struct {
+	const sqfs_u8 *ptr;
+	size_t count;
+} scan_cache_dir_t;
+
+/*
+  The data locations of packed files, one after another, as stored in
+  checkpoints and partial images.
+ */
+typedef struct {
+	sqfs_u8 *data;
+	size_t size;
+	size_t max;
+	size_t read_offset;
+} file_records_t;
+
+#define BASE_IMAGE_UNUSABLE ((base_image_t *)-1)
+
 enum {
 	DIR_SCAN_KEEP_TIME = 0x01,
 
@@ -52,15 +106,257 @@ enum {
 
 void process_command_line(options_t *opt, int argc, char **argv);
 
+/*
+  Build the tree from the contents of a directory. If num_threads is not 0
+  and pthread support is available, that many threads scan sub directories
+  ahead of the main thread. The resulting tree does not depend on it.
+
+  If cache_file is not NULL, the entries of directories that have not
+  changed since the last scan are taken from there instead of looking at
+  each of them, and the file is updated once the scan is done.
+ */
 int fstree_from_dir(fstree_t *fs, const char *path, void *selinux_handle,
-		    sqfs_xattr_writer_t *xwr, unsigned int flags);
+		    sqfs_xattr_writer_t *xwr, unsigned int flags,
+		    unsigned int num_threads, const char *cache_file);
+
+/*
+  Load the directory listings recorded by a previous scan with the same
+  flags, if the file exists, and start recording a new one next to it. On
+  failure, an error message is printed and NULL is returned.
+ */
+scan_cache_t *scan_cache_open(const char *filename, unsigned int flags);
+
+/* Drops the new recording, unless it was committed. Accepts NULL. */
+void scan_cache_destroy(scan_cache_t *cache);
+
+/*
+  Look up the entries of a directory by its path relative to the scan root.
+  Returns false if it is not in the cache, or if the device and inode
+  number or the modification or change time of the directory differ.
+  Safe to call from multiple threads at once.
+ */
+bool scan_cache_find(const scan_cache_t *cache, const char *path,
+		     const struct stat *sb, scan_cache_dir_t *dir);
+
+/*
+  Get the next entry of a directory that was found. The strings point into
+  the cache and stay valid until it is destroyed.
+ */
+void scan_cache_dir_next(scan_cache_dir_t *dir, scan_cache_entry_t *ent);
+
+/*
+  Record a directory in the new file, followed by num_entries calls to
+  scan_cache_add_entry. Returns 0 on success, prints an error message and
+  returns -1 on failure.
+ */
+int scan_cache_begin_dir(scan_cache_t *cache, const char *path,
+			 const struct stat *sb, size_t num_entries);
+
+int scan_cache_add_entry(scan_cache_t *cache, const scan_cache_entry_t *ent);
+
+/* Replace the old file with the new recording */
+int scan_cache_commit(scan_cache_t *cache);
 
 
 void *selinux_open_context_file(const char *filename);
 
-int selinux_relable_node(void *sehnd, sqfs_xattr_writer_t *xwr,
-			 tree_node_t *node, const char *path);
+/*
+  Look up the SELinux label for a path in the image. Safe to call from
+  multiple threads at once. Returns a string that the caller has to free,
+  prints an error message and returns NULL on failure.
+ */
+char *selinux_get_context(void *sehnd, const char *path, mode_t mode);
+
+int selinux_add_context(sqfs_xattr_writer_t *xwr, const char *name,
+			const char *context);
+
+/*
+  Add SELinux labels to all nodes of a tree. If num_threads is not 0 and
+  pthread support is available, that many threads look up the labels ahead
+  of the main thread. The xattrs are recorded in tree order either way.
+  Returns 0 on success, prints an error message and returns -1 on failure.
+ */
+int selinux_relabel_tree(void *sehnd, sqfs_xattr_writer_t *xwr,
+			 fstree_t *fs, const char *filename,
+			 unsigned int num_threads);
 
 void selinux_close_context_file(void *sehnd);
 
+/*
+  Find input files with identical content. Returns an array with one entry
+  per file in the file list, pointing to an earlier file with the same
+  content or NULL. If search is false, no files are read and all entries
+  are NULL. The combined size of the files that are not duplicates is
+  returned through total_size. On failure, an error message is printed
+  and NULL is returned.
+ */
+file_info_t **find_duplicate_files(fstree_t *fs, bool search,
+				   sqfs_u64 *total_size);
+
+/*
+  Reorder the file list by the location of the file data on the input
+  device (the first extent as reported by FIEMAP, the inode number if that
+  is not available), to reduce seeking while packing. Input file paths are
+  relative to the current working directory. Returns 0 on success, prints
+  an error message and returns -1 on failure.
+ */
+int sort_files_physical(fstree_t *fs);
+
+/*
+  Start threads that read upcoming input files into the page cache ahead of
+  the main thread, skipping files that have a duplicate entry. Returns NULL
+  if the number of threads is 0, if built without pthread support or if
+  the threads cannot be created, in which case an error message is printed
+  and the files are simply read without help. All prefetch functions
+  accept a NULL pointer.
+ */
+prefetch_t *prefetch_create(fstree_t *fs, file_info_t **dups,
+			    unsigned int num_threads);
+
+/* Tell the readers that the main thread is now packing the file at index */
+void prefetch_advance(prefetch_t *pf, size_t index);
+
+void prefetch_destroy(prefetch_t *pf);
+
+/*
+  Open an existing image to reuse data from. The output file must already
+  contain the super block and compressor options of the new image. If the
+  data blocks cannot be copied over because the block size or compressor
+  settings differ, a message is printed and BASE_IMAGE_UNUSABLE is returned,
+  which all other base image functions accept as a no-op. On failure, an
+  error message is printed and NULL is returned.
+
+  If trust_mtime is set, a file whose modification time matches the one in
+  the image is assumed to be unchanged, otherwise the contents are compared.
+ */
+base_image_t *base_image_open(const char *filename, const sqfs_super_t *super,
+			      sqfs_file_t *outfile, bool trust_mtime);
+
+void base_image_destroy(base_image_t *img);
+
+/*
+  Find regular files in the image with the same path as the ones in the
+  file list and store a pointer to their image tree node in the user_ptr
+  of the file. Returns 0 on success, prints an error message and returns
+  -1 on failure.
+ */
+int base_image_match(const base_image_t *img, fstree_t *fs);
+
+/*
+  If the file matched an unchanged file in the image, copy the data over
+  from there and set done to true. Otherwise, done is set to false and
+  nothing is packed. Returns 0 on success, prints an error message and
+  returns -1 on failure.
+ */
+int base_image_pack(const base_image_t *img, const file_info_t *fi,
+		    sqfs_data_writer_t *data, sqfs_inode_generic_t *inode,
+		    sqfs_file_t *file, bool *done);
+
+/* A hash of the input file paths and attributes in packing order */
+sqfs_u64 file_list_hash(const fstree_t *fs, sqfs_u64 *count);
+
+/*
+  A hash of the compressor id and of the compressor options as they are
+  stored in the image. Returns 0 on success, an E_SQFS_ERROR value on
+  failure.
+ */
+int compressor_options_hash(sqfs_writer_t *sqfs, sqfs_u64 *out);
+
+/*
+  Append the data location of a file, once the inode is final. Returns 0 on
+  success, an E_SQFS_ERROR value on failure.
+ */
+int file_records_add(file_records_t *rec, const sqfs_inode_generic_t *inode);
+
+/* Append size bytes of records stored in a file at start */
+int file_records_load(file_records_t *rec, sqfs_file_t *file,
+		      sqfs_u64 start, sqfs_u64 size);
+
+/*
+  Create an inode from the next record. Returns NULL and prints an error
+  message for the given file name on failure.
+ */
+sqfs_inode_generic_t *file_records_next(file_records_t *rec,
+					const char *filename);
+
+void file_records_cleanup(file_records_t *rec);
+
+/*
+  Keep track of the packing progress in a checkpoint file, to pick up from
+  there if the build is interrupted. Must be created once the data writer
+  exists and the file list is final. If resume is set, the data writer state
+  is restored from the file, which must have been written by a run with the
+  same settings and input files. On failure, an error message is printed
+  and NULL is returned.
+ */
+checkpoint_t *checkpoint_create(const char *filename, sqfs_writer_t *sqfs,
+				const char *outname, bool resume);
+
+void checkpoint_destroy(checkpoint_t *cp);
+
+/* The number of files at the start of the list that were already packed */
+size_t checkpoint_files_done(const checkpoint_t *cp);
+
+/*
+  Create the inode of the next file that was already packed, as it was
+  recorded. Returns NULL and prints an error message on failure.
+ */
+sqfs_inode_generic_t *checkpoint_restore(checkpoint_t *cp, file_info_t *fi);
+
+/*
+  Called after a number of files at the start of the list are packed. Saves
+  a checkpoint every few minutes, which makes the data writer finish all
+  blocks in flight. Accepts a NULL pointer. Returns 0 on success, prints an
+  error message and returns -1 on failure.
+ */
+int checkpoint_update(checkpoint_t *cp, size_t files_done);
+
+/* Delete the checkpoint file once the image is done */
+int checkpoint_remove(checkpoint_t *cp);
+
+/*
+  Pick the files that worker number index out of count packs, as a run of
+  files in the list with about the same amount of input data as the other
+  workers get. Input file paths are relative to the current working
+  directory. Returns 0 on success, prints an error message and returns -1
+  on failure.
+ */
+int shard_select(const fstree_t *fs, unsigned int index, unsigned int count,
+		 size_t *first, size_t *end);
+
+/*
+  Instead of the inodes and directories, write the fragment table and the
+  data locations of the files in the given range of the list to the output,
+  which makes it a partial image to merge with shard_merge.
+ */
+int shard_write_partial(sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *cfg,
+			unsigned int index, unsigned int count,
+			size_t first, size_t end);
+
+/*
+  Pack the files from the partial images given on the command line, in
+  order. The data blocks are copied over, the tail ends are packed into new
+  fragment blocks. Returns 0 on success, prints an error message and
+  returns -1 on failure.
+ */
+int shard_merge(sqfs_writer_t *sqfs, const options_t *opt);
+
+/*
+  Build an image as described by the options and return the exit status.
+ */
+int build_image(options_t *opt);
+
+/*
+  Listen on the socket given with --serve and run the jobs sent by clients
+  one after another, each in a child process that inherits the block cache
+  the server keeps loaded. Returns the exit status of the server.
+ */
+int serve_jobs(const options_t *opt);
+
+/*
+  Send the command line to a server and print the output of the job.
+  Returns the exit status of the job.
+ */
+int serve_connect(const char *socket_path, int argc, char **argv);
+
 #endif /* MKFS_H */
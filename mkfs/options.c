@@ -6,22 +6,59 @@
  */
 #include "mkfs.h"
 
+/* options that only have a long form */
+enum {
+	OPT_NO_FILE_DEDUP = 0x100,
+	OPT_ADAPTIVE_JOBS,
+};
+
 static struct option long_opts[] = {
 	{ "compressor", required_argument, NULL, 'c' },
 	{ "block-size", required_argument, NULL, 'b' },
 	{ "dev-block-size", required_argument, NULL, 'B' },
+	{ "auto-block-size", required_argument, NULL, 'Z' },
 	{ "defaults", required_argument, NULL, 'd' },
 	{ "comp-extra", required_argument, NULL, 'X' },
+	{ "auto-level", no_argument, NULL, 'a' },
 	{ "pack-file", required_argument, NULL, 'F' },
 	{ "pack-dir", required_argument, NULL, 'D' },
 	{ "num-jobs", required_argument, NULL, 'j' },
+	{ "adaptive-jobs", no_argument, NULL, OPT_ADAPTIVE_JOBS },
 	{ "queue-backlog", required_argument, NULL, 'Q' },
+	{ "max-memory", required_argument, NULL, 'M' },
+	{ "pin-workers", no_argument, NULL, 'P' },
+	{ "huge-pages", no_argument, NULL, 'U' },
+	{ "no-page-cache", no_argument, NULL, 'N' },
+	{ "read-threads", required_argument, NULL, 'r' },
+	{ "scan-threads", required_argument, NULL, 'S' },
+	{ "scan-cache", required_argument, NULL, 'z' },
+	{ "physical-order", no_argument, NULL, 'O' },
+	{ "priority-file", required_argument, NULL, 'p' },
+	{ "update", required_argument, NULL, 'u' },
+	{ "block-cache", required_argument, NULL, 'C' },
+	{ "resume", required_argument, NULL, 'E' },
+	{ "shard", required_argument, NULL, 'y' },
+	{ "merge", required_argument, NULL, 'm' },
+	{ "serve", required_argument, NULL, 'l' },
+	{ "connect", required_argument, NULL, 'w' },
+	{ "intern-strings", no_argument, NULL, 'i' },
+	{ "spill-inodes", no_argument, NULL, 'W' },
+	{ "align-inodes", no_argument, NULL, 'A' },
+	{ "dir-index-step", required_argument, NULL, 'H' },
+	{ "trace", required_argument, NULL, 'T' },
+	{ "progress", no_argument, NULL, 'R' },
+	{ "stats-json", required_argument, NULL, 'J' },
+	{ "path-index", required_argument, NULL, 'L' },
 	{ "keep-time", no_argument, NULL, 'k' },
 #ifdef HAVE_SYS_XATTR_H
 	{ "keep-xattr", no_argument, NULL, 'x' },
 #endif
 	{ "one-file-system", no_argument, NULL, 'o' },
 	{ "exportable", no_argument, NULL, 'e' },
+	{ "group-fragments", no_argument, NULL, 'G' },
+	{ "best-fit-fragments", no_argument, NULL, 'K' },
+	{ "skip-incompressible", no_argument, NULL, 'I' },
+	{ "no-file-dedup", no_argument, NULL, OPT_NO_FILE_DEDUP },
 	{ "force", no_argument, NULL, 'f' },
 	{ "quiet", no_argument, NULL, 'q' },
 #ifdef WITH_SELINUX
@@ -31,7 +68,7 @@ static struct option long_opts[] = {
 	{ "help", no_argument, NULL, 'h' },
 };
 
-static const char *short_opts = "F:D:X:c:b:B:d:j:Q:kxoefqhV"
+static const char *short_opts = "F:D:X:c:b:B:Z:d:j:Q:M:PUNr:S:z:Op:u:C:E:y:m:l:w:T:RJ:L:iWAH:akxoeGKIfqhV"
 #ifdef WITH_SELINUX
 "s:"
 #endif
@@ -65,15 +102,41 @@ static const char *help_string =
 "  --comp-extra, -X <options>  A comma seperated list of extra options for\n"
 "                              the selected compressor. Specify 'help' to\n"
 "                              get a list of available options.\n"
+"  --auto-level, -a            Use lower compression levels for the files\n"
+"                              that follow while the compressor jobs can't\n"
+"                              keep up with reading and writing, and go back\n"
+"                              up once they can.\n"
 "  --num-jobs, -j <count>      Number of compressor jobs to create.\n"
+"  --adaptive-jobs             Park and wake up jobs while packing, based on\n"
+"                              the backlog and the CPU time they get.\n"
 "  --queue-backlog, -Q <count> Maximum number of data blocks in the thread\n"
 "                              worker queue before the packer starts waiting\n"
 "                              for the block processors to catch up.\n"
 "                              Defaults to 10 times the number of jobs.\n"
+"  --max-memory, -M <MiB>      Approximate limit for the memory used to buffer\n"
+"                              data blocks. The packer waits for blocks to be\n"
+"                              written out before going past it.\n"
+"  --pin-workers, -P           Pin each compressor job to a CPU.\n"
+"  --huge-pages, -U            Back the block buffers with huge pages.\n"
+"  --no-page-cache, -N         Keep the input files and the image out of the\n"
+"                              page cache as far as possible.\n"
+"  --read-threads, -r <count>  Number of threads that read upcoming input\n"
+"                              files ahead of the packer. Defaults to 0.\n"
+"  --scan-threads, -S <count>  Threads reading the pack directory or looking\n"
+"                              up SELinux labels ahead.\n"
+"  --scan-cache, -z <file>     When using --pack-dir only, take the entries\n"
+"                              of directories that did not change since the\n"
+"                              last run from <file> and update it.\n"
+"  --physical-order, -O        Pack files in their order on the disk.\n"
+"  --priority-file, -p <file>  Pack the files listed in <file> first.\n"
 "  --block-size, -b <size>     Block size to use for Squashfs image.\n"
 "                              Defaults to %u.\n"
 "  --dev-block-size, -B <size> Device block size to padd the image to.\n"
 "                              Defaults to %u.\n"
+"  --auto-block-size, -Z <amp> Trial compress a sample of the input and pick\n"
+"                              the block size with the best ratio, as long as\n"
+"                              a random 4 KiB read loads at most <amp> times\n"
+"                              that much from the image on average.\n"
 "  --defaults, -d <options>    A comma seperated list of default values for\n"
 "                              implicitly created directories.\n"
 "\n"
@@ -82,7 +145,37 @@ static const char *help_string =
 "                                 gid=<value>    0 if not set.\n"
 "                                 mode=<value>   0755 if not set.\n"
 "                                 mtime=<value>  0 if not set.\n"
-"\n"
+"\n";
+
+static const char *help_flags =
+"  --update, -u <image>        Copy the data of unchanged files over from an\n"
+"                              existing image instead of compressing it.\n"
+"  --block-cache, -C <file>    Reuse compressed blocks from a cache file and\n"
+"                              add new ones to it.\n"
+"  --resume, -E <file>         Save the progress to <file> every few minutes.\n"
+"                              If it exists, skip the files packed by the\n"
+"                              interrupted run and continue from there.\n"
+"  --shard, -y <i>/<n>         Only pack the data of the i-th of n about equal\n"
+"                              parts of the input into a partial image.\n"
+"  --merge, -m <partial>       Build the image from partial images instead of\n"
+"                              the input files. Given once for each part, in\n"
+"                              order.\n"
+"  --serve, -l <socket>        Run builds sent by --connect one after another,\n"
+"                              keeping the --block-cache file loaded.\n"
+"  --connect, -w <socket>      Run this build in a gensquashfs --serve\n"
+"                              process listening on <socket>.\n"
+"  --intern-strings, -i        Store repeated names and symlink targets only\n"
+"                              once in memory, for very large trees.\n"
+"  --spill-inodes, -W          Move the inodes of packed files to a temporary\n"
+"                              file, for very large trees.\n"
+"  --align-inodes, -A          Keep the inodes of a directory's entries in\n"
+"                              one meta data block, where possible.\n"
+"  --dir-index-step, -H <count> Start a new directory header, which the index\n"
+"                              of huge directories points to, at least every\n"
+"                              <count> entries (1 to 256, default 256).\n"
+"  --trace, -T <file>          Record what the packer and its threads are\n"
+"                              doing to a Chrome trace JSON file, e.g. for\n"
+"                              Perfetto.\n"
 #ifdef WITH_SELINUX
 "  --selinux, -s <file>        Specify an SELinux label file to get context\n"
 "                              attributes from.\n"
@@ -95,7 +188,24 @@ static const char *help_string =
 "  --one-file-system, -o       When using --pack-dir only, stay in local file\n"
 "                              system and do not cross mount points.\n"
 "  --exportable, -e            Generate an export table for NFS support.\n"
+"  --group-fragments, -G       Pack tail ends of files with the same name\n"
+"                              extension into the same fragment blocks.\n"
+"  --best-fit-fragments, -K    Keep more fragment blocks open and put each\n"
+"                              tail end into the one it fills up best.\n"
+"  --skip-incompressible, -I   Store data blocks that look like they are\n"
+"                              already compressed without compressing them.\n"
+"  --no-file-dedup             Do not read the input files up front to find\n"
+"                              identical ones. Duplicate blocks and tail ends\n"
+"                              are still only stored once.\n"
 "  --force, -f                 Overwrite the output file if it exists.\n"
+"  --progress, -R              Show the amount of data read and written, the\n"
+"                              throughput and the queue backlog in a status\n"
+"                              line instead of the name of each file packed.\n"
+"  --stats-json, -J <file>     Write the statistics, including the time taken\n"
+"                              by each phase, to a JSON file.\n"
+"  --path-index, -L <file>     Write an index that maps the full path of every\n"
+"                              file in the image to its inode, for fast\n"
+"                              lookups with libsquashfs.\n"
 "  --quiet, -q                 Do not print out progress reports.\n"
 "  --help, -h                  Print help text and exit.\n"
 "  --version, -V               Print version information and exit.\n"
@@ -107,15 +217,17 @@ const char *help_details =
 "SquashFS image. The following entry types can be specified:\n"
 "\n"
 "# a comment\n"
-"file <path> <mode> <uid> <gid> [<location>]\n"
+"file <path> <mode> <uid> <gid> [<attributes>] [<location>]\n"
 "dir <path> <mode> <uid> <gid>\n"
 "nod <path> <mode> <uid> <gid> <dev_type> <maj> <min>\n"
 "slink <path> <mode> <uid> <gid> <target>\n"
 "pipe <path> <mode> <uid> <gid>\n"
 "sock <path> <mode> <uid> <gid>\n"
+"layout <pattern> <attr>[,<attr>...]\n"
 "\n"
 "<path>       Absolute path of the entry in the image. Can be put in quotes\n"
 "             if some components contain spaces.\n"
+"<attributes> Optional, comma separated list of <attr> in square brackets.\n"
 "<location>   If given, location of the input file. Either absolute or relative\n"
 "             to the description file. If omitted, the image path is used,\n"
 "             relative to the description file.\n"
@@ -126,6 +238,21 @@ const char *help_details =
 "<dev_type>   Device type (b=block, c=character).\n"
 "<maj>        Major number of a device special file.\n"
 "<min>        Minor number of a device special file.\n"
+"<pattern>    Shell wildcard pattern, matched against the absolute path of\n"
+"             every regular file once all entries are read. A '*' also\n"
+"             matches slashes.\n"
+"<attr>       How to pack the data of a file:\n"
+"               nofrag      never pack the tail end into a fragment block.\n"
+"               align       align the data on a device block boundary.\n"
+"               nocompress  store the data blocks uncompressed.\n"
+"               nodedup     always store the data, even if a copy of it\n"
+"                           is already in the image.\n"
+"               random      nofrag, align and nocompress, for files that\n"
+"                           are read at random offsets.\n"
+"               priority=N  pack files with a higher priority first,\n"
+"                           the default is 0.\n"
+"             A layout rule adds its flags to those of the matching files\n"
+"             and replaces their priority.\n"
 "\n"
 "Example:\n"
 "    # A simple squashfs image\n"
@@ -143,11 +270,60 @@ const char *help_details =
 "    \n"
 "    # file name with a space in it.\n"
 "    file \"/opt/my app/\\\"special\\\"/data\" 0600 0 0\n"
+"    \n"
+"    # Pack the init binary first and store it uncompressed.\n"
+"    file /sbin/init 0755 0 0 [nocompress,priority=100] ../init/sbin/init\n"
+"    \n"
+"    # Keep database files cheap to read at random offsets.\n"
+"    layout /var/lib/db/*.db random\n"
 "\n\n";
 
+static int parse_shard(options_t *opt, const char *arg)
+{
+	unsigned long index, count;
+	char *end;
+
+	index = strtoul(arg, &end, 10);
+
+	if (end == arg || *end != '/')
+		goto fail;
+
+	arg = end + 1;
+	count = strtoul(arg, &end, 10);
+
+	if (end == arg || *end != '\0')
+		goto fail;
+
+	if (index < 1 || index > count || count > UINT_MAX)
+		goto fail;
+
+	opt->shard_index = index - 1;
+	opt->shard_count = count;
+	return 0;
+fail:
+	fputs("Expected a shard as <i>/<n>, with i from 1 to n.\n", stderr);
+	return -1;
+}
+
+static int add_partial(options_t *opt, const char *filename)
+{
+	const char **new;
+
+	new = realloc(opt->partials,
+		      (opt->num_partials + 1) * sizeof(opt->partials[0]));
+	if (new == NULL) {
+		perror("processing command line arguments");
+		return -1;
+	}
+
+	new[opt->num_partials++] = filename;
+	opt->partials = new;
+	return 0;
+}
+
 void process_command_line(options_t *opt, int argc, char **argv)
 {
-	bool have_compressor;
+	bool have_compressor, have_num_jobs = false;
 	int i;
 
 	memset(opt, 0, sizeof(*opt));
@@ -181,10 +357,109 @@ void process_command_line(options_t *opt, int argc, char **argv)
 			break;
 		case 'j':
 			opt->cfg.num_jobs = strtol(optarg, NULL, 0);
+			have_num_jobs = true;
+			break;
+		case OPT_ADAPTIVE_JOBS:
+			opt->cfg.adaptive_workers = true;
 			break;
 		case 'Q':
 			opt->cfg.max_backlog = strtol(optarg, NULL, 0);
 			break;
+		case 'M':
+			opt->cfg.max_memory = strtoul(optarg, NULL, 0);
+			opt->cfg.max_memory *= 1024 * 1024;
+			break;
+		case 'P':
+			opt->cfg.pin_workers = true;
+			break;
+		case 'U':
+			opt->cfg.huge_pages = true;
+			break;
+		case 'a':
+			opt->cfg.auto_level = true;
+			break;
+		case 'Z':
+			opt->cfg.max_read_amp = strtoul(optarg, NULL, 0);
+			if (opt->cfg.max_read_amp < 1) {
+				fputs("Read amplification must be at least 1\n",
+				      stderr);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'N':
+			opt->cfg.no_page_cache = true;
+			break;
+		case 'r':
+			opt->read_threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			opt->scan_threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'z':
+			opt->scan_cache = optarg;
+			break;
+		case 'O':
+			opt->physical_order = true;
+			break;
+		case OPT_NO_FILE_DEDUP:
+			opt->no_file_dedup = true;
+			break;
+		case 'p':
+			opt->priority_file = optarg;
+			break;
+		case 'u':
+			opt->base_image = optarg;
+			break;
+		case 'C':
+			opt->cfg.block_cache = optarg;
+			break;
+		case 'E':
+			opt->checkpoint = optarg;
+			break;
+		case 'y':
+			if (parse_shard(opt, optarg))
+				goto fail_arg;
+			break;
+		case 'm':
+			if (add_partial(opt, optarg))
+				exit(EXIT_FAILURE);
+			break;
+		case 'l':
+			opt->serve = optarg;
+			break;
+		case 'w':
+			opt->connect = optarg;
+			break;
+		case 'T':
+			opt->cfg.trace_file = optarg;
+			break;
+		case 'R':
+			opt->cfg.progress = true;
+			break;
+		case 'J':
+			opt->cfg.stats_json = optarg;
+			break;
+		case 'L':
+			opt->cfg.path_index = optarg;
+			break;
+		case 'i':
+			opt->cfg.intern_strings = true;
+			break;
+		case 'W':
+			opt->cfg.spill_inodes = true;
+			break;
+		case 'A':
+			opt->cfg.align_inodes = true;
+			break;
+		case 'H':
+			opt->cfg.dir_index_step = strtoul(optarg, NULL, 0);
+			if (opt->cfg.dir_index_step < 1 ||
+			    opt->cfg.dir_index_step > SQFS_MAX_DIR_ENT) {
+				fputs("Directory index step must be between "
+				      "1 and 256\n", stderr);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'B':
 			opt->cfg.devblksize = strtol(optarg, NULL, 0);
 			if (opt->cfg.devblksize < 1024) {
@@ -210,6 +485,15 @@ void process_command_line(options_t *opt, int argc, char **argv)
 		case 'e':
 			opt->cfg.exportable = true;
 			break;
+		case 'G':
+			opt->cfg.group_fragments = true;
+			break;
+		case 'K':
+			opt->cfg.best_fit_fragments = true;
+			break;
+		case 'I':
+			opt->cfg.skip_incompressible = true;
+			break;
 		case 'f':
 			opt->cfg.outmode |= SQFS_FILE_OPEN_OVERWRITE;
 			break;
@@ -233,6 +517,7 @@ void process_command_line(options_t *opt, int argc, char **argv)
 		case 'h':
 			printf(help_string, __progname,
 			       SQFS_DEFAULT_BLOCK_SIZE, SQFS_DEVBLK_SIZE);
+			fputs(help_flags, stdout);
 			fputs(help_details, stdout);
 			compressor_print_available();
 			exit(EXIT_SUCCESS);
@@ -244,6 +529,9 @@ void process_command_line(options_t *opt, int argc, char **argv)
 		}
 	}
 
+	if (opt->cfg.adaptive_workers && !have_num_jobs)
+		opt->cfg.num_jobs = os_get_available_jobs();
+
 	if (opt->cfg.num_jobs < 1)
 		opt->cfg.num_jobs = 1;
 
@@ -256,6 +544,15 @@ void process_command_line(options_t *opt, int argc, char **argv)
 		exit(EXIT_SUCCESS);
 	}
 
+	if (opt->serve != NULL && opt->connect != NULL) {
+		fputs("--serve cannot be combined with --connect.\n", stderr);
+		goto fail_arg;
+	}
+
+	/* the server only needs the block cache, the rest comes with jobs */
+	if (opt->serve != NULL)
+		return;
+
 	if (opt->infile == NULL && opt->packdir == NULL) {
 		fputs("No input file or directory specified.\n", stderr);
 		goto fail_arg;
@@ -266,6 +563,27 @@ void process_command_line(options_t *opt, int argc, char **argv)
 		goto fail_arg;
 	}
 
+	/* neither of them is part of the checkpoint */
+	if (opt->checkpoint != NULL &&
+	    (opt->cfg.block_cache != NULL || opt->cfg.spill_inodes)) {
+		fputs("--resume cannot be combined with --block-cache "
+		      "or --spill-inodes.\n", stderr);
+		goto fail_arg;
+	}
+
+	if ((opt->shard_count > 0 || opt->num_partials > 0) &&
+	    (opt->checkpoint != NULL || opt->base_image != NULL ||
+	     opt->cfg.block_cache != NULL || opt->cfg.spill_inodes)) {
+		fputs("--shard and --merge cannot be combined with --resume, "
+		      "--update, --block-cache or --spill-inodes.\n", stderr);
+		goto fail_arg;
+	}
+
+	if (opt->shard_count > 0 && opt->num_partials > 0) {
+		fputs("--shard cannot be combined with --merge.\n", stderr);
+		goto fail_arg;
+	}
+
 	opt->cfg.filename = argv[optind++];
 	return;
 fail_arg:
@@ -0,0 +1,226 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * prefetch.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "mkfs.h"
+
+#ifdef WITH_PTHREAD
+#include <pthread.h>
+
+#define CHUNK_SIZE (1024 * 1024)
+
+/* maximum number of bytes read ahead of the file currently being packed */
+#define PREFETCH_WINDOW (64 * 1024 * 1024)
+
+struct prefetch_t {
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	bool stop;
+
+	/* next file to be picked up by a reader thread */
+	file_info_t *next;
+	size_t next_index;
+
+	/* index of the file currently packed by the main thread */
+	size_t current;
+
+	/* bytes read ahead for files after the current one */
+	sqfs_u64 ahead;
+	sqfs_u64 *sizes;
+
+	file_info_t **dups;
+
+	unsigned int num_threads;
+	pthread_t threads[];
+};
+
+/*
+  Read the start of a file into a throw away buffer, so it is in the page
+  cache by the time the main thread gets to it. Errors are ignored, the
+  main thread reports them when it opens the file itself.
+ */
+static sqfs_u64 read_ahead(prefetch_t *pf, file_info_t *fi, size_t index,
+			   sqfs_u8 *buffer)
+{
+	sqfs_u64 offset, size, limit;
+	sqfs_file_t *file;
+	size_t diff;
+	bool skip;
+
+	file = sqfs_open_file(fi->input_file, SQFS_FILE_OPEN_READ_ONLY);
+	if (file == NULL)
+		return 0;
+
+	size = file->get_size(file);
+	limit = size < PREFETCH_WINDOW ? size : PREFETCH_WINDOW;
+
+	for (offset = 0; offset < limit; offset += diff) {
+		pthread_mutex_lock(&pf->mtx);
+		skip = pf->stop || pf->current > index;
+		pthread_mutex_unlock(&pf->mtx);
+
+		if (skip)
+			break;
+
+		diff = CHUNK_SIZE;
+		if (diff > limit - offset)
+			diff = limit - offset;
+
+		if (file->read_at(file, offset, buffer, diff))
+			break;
+	}
+
+	file->destroy(file);
+	return offset;
+}
+
+static void *reader_proc(void *arg)
+{
+	prefetch_t *pf = arg;
+	sqfs_u8 *buffer = malloc(CHUNK_SIZE);
+	sqfs_u64 size;
+	file_info_t *fi;
+	size_t index;
+
+	if (buffer == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&pf->mtx);
+	for (;;) {
+		while (!pf->stop && pf->next != NULL &&
+		       pf->ahead >= PREFETCH_WINDOW) {
+			pthread_cond_wait(&pf->cond, &pf->mtx);
+		}
+
+		if (pf->stop || pf->next == NULL)
+			break;
+
+		fi = pf->next;
+		index = pf->next_index;
+		pf->next = fi->next;
+		pf->next_index += 1;
+
+		if (index <= pf->current || pf->dups[index] != NULL)
+			continue;
+
+		pthread_mutex_unlock(&pf->mtx);
+		size = read_ahead(pf, fi, index, buffer);
+		pthread_mutex_lock(&pf->mtx);
+
+		if (index > pf->current) {
+			pf->sizes[index] = size;
+			pf->ahead += size;
+		}
+	}
+	pthread_mutex_unlock(&pf->mtx);
+
+	free(buffer);
+	return NULL;
+}
+
+prefetch_t *prefetch_create(fstree_t *fs, file_info_t **dups,
+			    unsigned int num_threads)
+{
+	size_t count = 0;
+	file_info_t *fi;
+	prefetch_t *pf;
+	unsigned int i;
+
+	if (num_threads == 0)
+		return NULL;
+
+	for (fi = fs->files; fi != NULL; fi = fi->next)
+		++count;
+
+	pf = alloc_flex(sizeof(*pf), sizeof(pf->threads[0]), num_threads);
+	if (pf == NULL)
+		goto fail_errno;
+
+	pf->sizes = alloc_array(sizeof(pf->sizes[0]), count ? count : 1);
+	if (pf->sizes == NULL) {
+		free(pf);
+		goto fail_errno;
+	}
+
+	pf->mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	pf->cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+	pf->next = fs->files;
+	pf->dups = dups;
+
+	for (i = 0; i < num_threads; ++i) {
+		if (pthread_create(pf->threads + i, NULL, reader_proc, pf))
+			break;
+
+		pf->num_threads += 1;
+	}
+
+	if (pf->num_threads == 0) {
+		prefetch_destroy(pf);
+		fputs("creating read ahead threads: failed\n", stderr);
+		return NULL;
+	}
+
+	return pf;
+fail_errno:
+	perror("creating read ahead threads");
+	return NULL;
+}
+
+void prefetch_advance(prefetch_t *pf, size_t index)
+{
+	size_t i;
+
+	if (pf == NULL)
+		return;
+
+	pthread_mutex_lock(&pf->mtx);
+	for (i = pf->current; i <= index; ++i) {
+		pf->ahead -= pf->sizes[i];
+		pf->sizes[i] = 0;
+	}
+
+	pf->current = index;
+	pthread_cond_broadcast(&pf->cond);
+	pthread_mutex_unlock(&pf->mtx);
+}
+
+void prefetch_destroy(prefetch_t *pf)
+{
+	unsigned int i;
+
+	if (pf == NULL)
+		return;
+
+	pthread_mutex_lock(&pf->mtx);
+	pf->stop = true;
+	pthread_cond_broadcast(&pf->cond);
+	pthread_mutex_unlock(&pf->mtx);
+
+	for (i = 0; i < pf->num_threads; ++i)
+		pthread_join(pf->threads[i], NULL);
+
+	pthread_cond_destroy(&pf->cond);
+	pthread_mutex_destroy(&pf->mtx);
+	free(pf->sizes);
+	free(pf);
+}
+#else
+prefetch_t *prefetch_create(fstree_t *fs, file_info_t **dups,
+			    unsigned int num_threads)
+{
+	(void)fs; (void)dups; (void)num_threads;
+	return NULL;
+}
+
+void prefetch_advance(prefetch_t *pf, size_t index)
+{
+	(void)pf; (void)index;
+}
+
+void prefetch_destroy(prefetch_t *pf)
+{
+	(void)pf;
+}
+#endif
@@ -0,0 +1,202 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * records.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "mkfs.h"
+
+/* followed by num_blocks block sizes, everything is in little endian */
+typedef struct {
+	sqfs_u64 blocks_start;
+	sqfs_u64 file_size;
+	sqfs_u64 sparse;
+	sqfs_u32 frag_idx;
+	sqfs_u32 frag_offset;
+	sqfs_u32 num_blocks;
+	sqfs_u32 pad0;
+} file_record_t;
+
+sqfs_u64 file_list_hash(const fstree_t *fs, sqfs_u64 *count)
+{
+	const file_info_t *fi;
+	sqfs_u64 hash = 0;
+
+	*count = 0;
+
+	for (fi = fs->files; fi != NULL; fi = fi->next) {
+		hash = (hash << 7) | (hash >> 57);
+		hash ^= xxh64(fi->input_file, strlen(fi->input_file));
+		hash += fi->flags;
+		*count += 1;
+	}
+
+	return hash;
+}
+
+/* the compressor options as they end up in the image, e.g. with the level */
+int compressor_options_hash(sqfs_writer_t *sqfs, sqfs_u64 *out)
+{
+	sqfs_file_t *file;
+	const void *data;
+	size_t size;
+	int ret;
+
+	file = sqfs_create_memory_file(0);
+	if (file == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	ret = sqfs->cmp->write_options(sqfs->cmp, file);
+
+	if (ret >= 0)
+		ret = sqfs_memory_file_get_data(file, &data, &size);
+
+	if (ret == 0) {
+		*out = sqfs->super.compression_id;
+
+		if (size > sizeof(sqfs_super_t)) {
+			*out ^= xxh64((const char *)data + sizeof(sqfs_super_t),
+				      size - sizeof(sqfs_super_t));
+		}
+	}
+
+	file->destroy(file);
+	return ret;
+}
+
+static int grow_records(file_records_t *rec, size_t size)
+{
+	size_t new_max = rec->max ? rec->max : 4096;
+	void *new;
+
+	while (new_max - rec->size < size) {
+		if (SZ_MUL_OV(new_max, 2, &new_max))
+			return SQFS_ERROR_OVERFLOW;
+	}
+
+	if (new_max == rec->max)
+		return 0;
+
+	new = realloc(rec->data, new_max);
+	if (new == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	rec->data = new;
+	rec->max = new_max;
+	return 0;
+}
+
+int file_records_add(file_records_t *rec, const sqfs_inode_generic_t *inode)
+{
+	sqfs_u32 frag_idx, frag_offset, *sizes;
+	sqfs_u64 blocks_start, file_size;
+	file_record_t ent;
+	size_t i, size;
+	int ret;
+
+	sqfs_inode_get_file_block_start(inode, &blocks_start);
+	sqfs_inode_get_file_size(inode, &file_size);
+	sqfs_inode_get_frag_location(inode, &frag_idx, &frag_offset);
+
+	memset(&ent, 0, sizeof(ent));
+	ent.blocks_start = htole64(blocks_start);
+	ent.file_size = htole64(file_size);
+	ent.frag_idx = htole32(frag_idx);
+	ent.frag_offset = htole32(frag_offset);
+	ent.num_blocks = htole32(inode->num_file_blocks);
+
+	if (inode->base.type == SQFS_INODE_EXT_FILE)
+		ent.sparse = htole64(inode->data.file_ext.sparse);
+
+	size = sizeof(ent) + inode->num_file_blocks * sizeof(sqfs_u32);
+
+	ret = grow_records(rec, size);
+	if (ret)
+		return ret;
+
+	memcpy(rec->data + rec->size, &ent, sizeof(ent));
+	sizes = (sqfs_u32 *)(rec->data + rec->size + sizeof(ent));
+
+	for (i = 0; i < inode->num_file_blocks; ++i)
+		sizes[i] = htole32(inode->block_sizes[i]);
+
+	rec->size += size;
+	return 0;
+}
+
+int file_records_load(file_records_t *rec, sqfs_file_t *file,
+		      sqfs_u64 start, sqfs_u64 size)
+{
+	int ret;
+
+	if (size > SIZE_MAX)
+		return SQFS_ERROR_OVERFLOW;
+
+	ret = grow_records(rec, size);
+	if (ret)
+		return ret;
+
+	ret = file->read_at(file, start, rec->data + rec->size, size);
+	if (ret)
+		return ret;
+
+	rec->size += size;
+	return 0;
+}
+
+sqfs_inode_generic_t *file_records_next(file_records_t *rec,
+					const char *filename)
+{
+	sqfs_inode_generic_t *inode;
+	const sqfs_u32 *sizes;
+	file_record_t ent;
+	size_t i, size;
+
+	if (rec->size - rec->read_offset < sizeof(ent))
+		goto fail_corrupted;
+
+	memcpy(&ent, rec->data + rec->read_offset, sizeof(ent));
+
+	size = le32toh(ent.num_blocks) * sizeof(sqfs_u32);
+	if (rec->size - rec->read_offset - sizeof(ent) < size)
+		goto fail_corrupted;
+
+	inode = alloc_flex(sizeof(*inode), sizeof(sqfs_u32),
+			   le32toh(ent.num_blocks));
+	if (inode == NULL) {
+		perror(filename);
+		return NULL;
+	}
+
+	inode->block_sizes = (sqfs_u32 *)inode->extra;
+	inode->base.type = SQFS_INODE_FILE;
+	sqfs_inode_set_file_size(inode, le64toh(ent.file_size));
+	sqfs_inode_set_file_block_start(inode, le64toh(ent.blocks_start));
+	sqfs_inode_set_frag_location(inode, le32toh(ent.frag_idx),
+				     le32toh(ent.frag_offset));
+
+	if (ent.sparse != 0) {
+		sqfs_inode_make_extended(inode);
+		inode->data.file_ext.sparse = le64toh(ent.sparse);
+	}
+
+	sizes = (const sqfs_u32 *)(rec->data + rec->read_offset +
+				   sizeof(ent));
+
+	for (i = 0; i < le32toh(ent.num_blocks); ++i)
+		inode->block_sizes[i] = le32toh(sizes[i]);
+
+	inode->num_file_blocks = le32toh(ent.num_blocks);
+
+	rec->read_offset += sizeof(ent) + size;
+	return inode;
+fail_corrupted:
+	fprintf(stderr, "%s: data location of file not recorded\n", filename);
+	return NULL;
+}
+
+void file_records_cleanup(file_records_t *rec)
+{
+	free(rec->data);
+	memset(rec, 0, sizeof(*rec));
+}
@@ -0,0 +1,503 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * scan_cache.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "mkfs.h"
+
+#include <time.h>
+
+/*
+  The file starts with a header that records the scan flags, followed by
+  one record for each directory, consisting of the directory header, the
+  null-terminated path of the directory relative to the scan root and its
+  entries. Each entry is an entry header, followed by the null-terminated
+  name, symlink target (only for symlinks) and the packed extended
+  attributes, as collected by the directory scanner. All integers are
+  little endian.
+
+  A new file is written next to the old one while scanning and replaces it
+  once the scan is done, so the old one is never seen half updated.
+ */
+#define SCAN_CACHE_MAGIC "SQFSSCv1"
+
+typedef struct {
+	sqfs_u8 magic[8];
+	sqfs_u32 flags;
+	sqfs_u32 pad0;
+} disk_header_t;
+
+typedef struct {
+	sqfs_u32 path_len;
+	sqfs_u32 num_entries;
+	sqfs_u64 dev;
+	sqfs_u64 ino;
+	sqfs_s64 mtime;
+	sqfs_u32 mtime_nsec;
+	sqfs_u32 ctime_nsec;
+	sqfs_s64 ctime;
+} disk_dir_t;
+
+typedef struct {
+	sqfs_u64 dev;
+	sqfs_u64 ino;
+	sqfs_u64 rdev;
+	sqfs_u64 size;
+	sqfs_s64 mtime;
+	sqfs_u32 mtime_nsec;
+	sqfs_u32 mode;
+	sqfs_u32 uid;
+	sqfs_u32 gid;
+	sqfs_u32 nlink;
+	sqfs_u32 name_len;
+	sqfs_u32 link_len;
+	sqfs_u32 xattr_size;
+} disk_entry_t;
+
+typedef struct {
+	sqfs_u64 hash;
+
+	/* location of the directory record in the data, 0 if unused */
+	size_t offset;
+} dir_slot_t;
+
+struct scan_cache_t {
+	const char *filename;
+	char *tmpname;
+	unsigned int flags;
+
+	/* directories changed after this are not recorded, see below */
+	time_t start;
+
+	/* contents of the old file, if it was written with the same flags */
+	sqfs_u8 *data;
+	size_t size;
+
+	dir_slot_t *slots;
+	size_t num_slots;
+
+	/* the new file */
+	FILE *fp;
+	size_t entries_left;
+	bool skip_dir;
+};
+
+static dir_slot_t *find_slot(const scan_cache_t *cache, const char *path,
+			     sqfs_u64 hash)
+{
+	size_t i = (size_t)(hash ^ (hash >> 32)) & (cache->num_slots - 1);
+	const char *name;
+
+	for (;; i = (i + 1) & (cache->num_slots - 1)) {
+		if (cache->slots[i].offset == 0)
+			break;
+
+		name = (const char *)cache->data + cache->slots[i].offset +
+			sizeof(disk_dir_t);
+
+		if (cache->slots[i].hash == hash && strcmp(name, path) == 0)
+			break;
+	}
+
+	return cache->slots + i;
+}
+
+static bool is_string(const sqfs_u8 *data, size_t len)
+{
+	return len > 0 && data[len - 1] == '\0';
+}
+
+/* returns the size of the record at offset, 0 if it is broken */
+static size_t check_record(const scan_cache_t *cache, size_t offset)
+{
+	size_t i, len, start = offset;
+	disk_entry_t ent;
+	disk_dir_t dir;
+
+	if (cache->size - offset < sizeof(dir))
+		return 0;
+
+	memcpy(&dir, cache->data + offset, sizeof(dir));
+	offset += sizeof(dir);
+
+	len = le32toh(dir.path_len);
+	if (cache->size - offset < len ||
+	    !is_string(cache->data + offset, len)) {
+		return 0;
+	}
+
+	offset += len;
+
+	for (i = 0; i < le32toh(dir.num_entries); ++i) {
+		if (cache->size - offset < sizeof(ent))
+			return 0;
+
+		memcpy(&ent, cache->data + offset, sizeof(ent));
+		offset += sizeof(ent);
+
+		len = le32toh(ent.name_len);
+		if (cache->size - offset < len ||
+		    !is_string(cache->data + offset, len)) {
+			return 0;
+		}
+
+		offset += len;
+
+		len = le32toh(ent.link_len);
+		if (len > 0 && (cache->size - offset < len ||
+				!is_string(cache->data + offset, len))) {
+			return 0;
+		}
+
+		offset += len;
+
+		len = le32toh(ent.xattr_size);
+		if (cache->size - offset < len)
+			return 0;
+
+		offset += len;
+	}
+
+	return offset - start;
+}
+
+static int index_records(scan_cache_t *cache)
+{
+	size_t offset, len, count = 0;
+	dir_slot_t *slot;
+	const char *path;
+	sqfs_u64 hash;
+
+	for (offset = sizeof(disk_header_t); offset < cache->size;
+	     offset += len) {
+		len = check_record(cache, offset);
+		if (len == 0)
+			goto fail_broken;
+		++count;
+	}
+
+	/* keep the table at most half full */
+	cache->num_slots = 1024;
+	while (cache->num_slots / 2 < count)
+		cache->num_slots *= 2;
+
+	cache->slots = calloc(cache->num_slots, sizeof(cache->slots[0]));
+	if (cache->slots == NULL) {
+		perror(cache->filename);
+		return -1;
+	}
+
+	for (offset = sizeof(disk_header_t); offset < cache->size;
+	     offset += check_record(cache, offset)) {
+		path = (const char *)cache->data + offset + sizeof(disk_dir_t);
+
+		hash = xxh64(path, strlen(path));
+
+		slot = find_slot(cache, path, hash);
+		slot->hash = hash;
+		slot->offset = offset;
+	}
+
+	return 0;
+fail_broken:
+	fprintf(stderr, "%s: broken record, scanning everything again.\n",
+		cache->filename);
+	free(cache->data);
+	cache->data = NULL;
+	cache->size = 0;
+	return 0;
+}
+
+static int load_old(scan_cache_t *cache)
+{
+	disk_header_t hdr;
+	sqfs_file_t *file;
+	sqfs_u64 size;
+	int ret;
+
+	file = sqfs_open_file(cache->filename, SQFS_FILE_OPEN_READ_ONLY);
+	if (file == NULL) {
+		if (errno == ENOENT)
+			return 0;
+		perror(cache->filename);
+		return -1;
+	}
+
+	size = file->get_size(file);
+	if (size < sizeof(hdr) || size > SIZE_MAX)
+		goto out_unusable;
+
+	cache->data = malloc(size);
+	if (cache->data == NULL) {
+		perror(cache->filename);
+		goto fail;
+	}
+
+	ret = file->read_at(file, 0, cache->data, size);
+	if (ret) {
+		sqfs_perror(cache->filename, "loading scan cache", ret);
+		goto fail;
+	}
+
+	file->destroy(file);
+	file = NULL;
+	cache->size = size;
+
+	memcpy(&hdr, cache->data, sizeof(hdr));
+
+	if (memcmp(hdr.magic, SCAN_CACHE_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    le32toh(hdr.flags) != cache->flags) {
+		goto out_unusable;
+	}
+
+	return index_records(cache);
+out_unusable:
+	fprintf(stderr, "%s: not created with the same settings, "
+		"scanning everything again.\n", cache->filename);
+	free(cache->data);
+	cache->data = NULL;
+	cache->size = 0;
+	if (file != NULL)
+		file->destroy(file);
+	return 0;
+fail:
+	if (file != NULL)
+		file->destroy(file);
+	return -1;
+}
+
+scan_cache_t *scan_cache_open(const char *filename, unsigned int flags)
+{
+	scan_cache_t *cache = calloc(1, sizeof(*cache));
+	disk_header_t hdr;
+
+	if (cache == NULL) {
+		perror(filename);
+		return NULL;
+	}
+
+	cache->filename = filename;
+	cache->flags = flags;
+	cache->start = time(NULL);
+
+	if (load_old(cache))
+		goto fail;
+
+	cache->tmpname = malloc(strlen(filename) + 5);
+	if (cache->tmpname == NULL) {
+		perror(filename);
+		goto fail;
+	}
+
+	sprintf(cache->tmpname, "%s.tmp", filename);
+
+	cache->fp = fopen(cache->tmpname, "wb");
+	if (cache->fp == NULL) {
+		perror(cache->tmpname);
+		goto fail;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SCAN_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.flags = htole32(flags);
+
+	if (fwrite(&hdr, sizeof(hdr), 1, cache->fp) != 1) {
+		perror(cache->tmpname);
+		goto fail;
+	}
+
+	return cache;
+fail:
+	scan_cache_destroy(cache);
+	return NULL;
+}
+
+void scan_cache_destroy(scan_cache_t *cache)
+{
+	if (cache == NULL)
+		return;
+
+	if (cache->fp != NULL) {
+		fclose(cache->fp);
+		remove(cache->tmpname);
+	}
+
+	free(cache->tmpname);
+	free(cache->slots);
+	free(cache->data);
+	free(cache);
+}
+
+bool scan_cache_find(const scan_cache_t *cache, const char *path,
+		     const struct stat *sb, scan_cache_dir_t *out)
+{
+	const dir_slot_t *slot;
+	disk_dir_t dir;
+
+	if (cache->data == NULL)
+		return false;
+
+	slot = find_slot(cache, path, xxh64(path, strlen(path)));
+	if (slot->offset == 0)
+		return false;
+
+	memcpy(&dir, cache->data + slot->offset, sizeof(dir));
+
+	if (le64toh(dir.dev) != (sqfs_u64)sb->st_dev ||
+	    le64toh(dir.ino) != (sqfs_u64)sb->st_ino ||
+	    (sqfs_s64)le64toh(dir.mtime) != (sqfs_s64)sb->st_mtim.tv_sec ||
+	    le32toh(dir.mtime_nsec) != (sqfs_u32)sb->st_mtim.tv_nsec ||
+	    (sqfs_s64)le64toh(dir.ctime) != (sqfs_s64)sb->st_ctim.tv_sec ||
+	    le32toh(dir.ctime_nsec) != (sqfs_u32)sb->st_ctim.tv_nsec) {
+		return false;
+	}
+
+	out->ptr = cache->data + slot->offset + sizeof(dir) +
+		le32toh(dir.path_len);
+	out->count = le32toh(dir.num_entries);
+	return true;
+}
+
+void scan_cache_dir_next(scan_cache_dir_t *dir, scan_cache_entry_t *out)
+{
+	disk_entry_t ent;
+	size_t len;
+
+	assert(dir->count > 0);
+
+	memcpy(&ent, dir->ptr, sizeof(ent));
+	dir->ptr += sizeof(ent);
+	dir->count -= 1;
+
+	memset(out, 0, sizeof(*out));
+	out->sb.st_dev = le64toh(ent.dev);
+	out->sb.st_ino = le64toh(ent.ino);
+	out->sb.st_rdev = le64toh(ent.rdev);
+	out->sb.st_size = le64toh(ent.size);
+	out->sb.st_mtim.tv_sec = (sqfs_s64)le64toh(ent.mtime);
+	out->sb.st_mtim.tv_nsec = le32toh(ent.mtime_nsec);
+	out->sb.st_mode = le32toh(ent.mode);
+	out->sb.st_uid = le32toh(ent.uid);
+	out->sb.st_gid = le32toh(ent.gid);
+	out->sb.st_nlink = le32toh(ent.nlink);
+
+	out->name = (const char *)dir->ptr;
+	dir->ptr += le32toh(ent.name_len);
+
+	len = le32toh(ent.link_len);
+	if (len > 0) {
+		out->link = (const char *)dir->ptr;
+		dir->ptr += len;
+	}
+
+	out->xattr_size = le32toh(ent.xattr_size);
+	out->xattr = (const char *)dir->ptr;
+	dir->ptr += out->xattr_size;
+}
+
+int scan_cache_begin_dir(scan_cache_t *cache, const char *path,
+			 const struct stat *sb, size_t num_entries)
+{
+	size_t len = strlen(path) + 1;
+	disk_dir_t dir;
+
+	/*
+	  A directory that changed in the same second the scan started in can
+	  change again without getting a different time stamp. It is left out,
+	  so the next scan reads it again.
+	 */
+	cache->skip_dir = (sb->st_ctim.tv_sec >= cache->start);
+	cache->entries_left = num_entries;
+
+	if (cache->skip_dir)
+		return 0;
+
+	memset(&dir, 0, sizeof(dir));
+	dir.path_len = htole32(len);
+	dir.num_entries = htole32(num_entries);
+	dir.dev = htole64(sb->st_dev);
+	dir.ino = htole64(sb->st_ino);
+	dir.mtime = htole64(sb->st_mtim.tv_sec);
+	dir.mtime_nsec = htole32(sb->st_mtim.tv_nsec);
+	dir.ctime = htole64(sb->st_ctim.tv_sec);
+	dir.ctime_nsec = htole32(sb->st_ctim.tv_nsec);
+
+	if (fwrite(&dir, sizeof(dir), 1, cache->fp) != 1 ||
+	    fwrite(path, 1, len, cache->fp) != len) {
+		perror(cache->tmpname);
+		return -1;
+	}
+
+	return 0;
+}
+
+int scan_cache_add_entry(scan_cache_t *cache, const scan_cache_entry_t *ent)
+{
+	size_t name_len = strlen(ent->name) + 1;
+	size_t link_len = ent->link == NULL ? 0 : strlen(ent->link) + 1;
+	disk_entry_t dent;
+
+	assert(cache->entries_left > 0);
+	cache->entries_left -= 1;
+
+	if (cache->skip_dir)
+		return 0;
+
+	memset(&dent, 0, sizeof(dent));
+	dent.dev = htole64(ent->sb.st_dev);
+	dent.ino = htole64(ent->sb.st_ino);
+	dent.rdev = htole64(ent->sb.st_rdev);
+	dent.size = htole64(ent->sb.st_size);
+	dent.mtime = htole64(ent->sb.st_mtim.tv_sec);
+	dent.mtime_nsec = htole32(ent->sb.st_mtim.tv_nsec);
+	dent.mode = htole32(ent->sb.st_mode);
+	dent.uid = htole32(ent->sb.st_uid);
+	dent.gid = htole32(ent->sb.st_gid);
+	dent.nlink = htole32(ent->sb.st_nlink);
+	dent.name_len = htole32(name_len);
+	dent.link_len = htole32(link_len);
+	dent.xattr_size = htole32(ent->xattr_size);
+
+	if (fwrite(&dent, sizeof(dent), 1, cache->fp) != 1 ||
+	    fwrite(ent->name, 1, name_len, cache->fp) != name_len) {
+		goto fail;
+	}
+
+	if (link_len > 0 &&
+	    fwrite(ent->link, 1, link_len, cache->fp) != link_len) {
+		goto fail;
+	}
+
+	if (ent->xattr_size > 0 &&
+	    fwrite(ent->xattr, 1, ent->xattr_size,
+		   cache->fp) != ent->xattr_size) {
+		goto fail;
+	}
+
+	return 0;
+fail:
+	perror(cache->tmpname);
+	return -1;
+}
+
+int scan_cache_commit(scan_cache_t *cache)
+{
+	int ret = fclose(cache->fp);
+
+	cache->fp = NULL;
+
+	if (ret != 0) {
+		perror(cache->tmpname);
+		remove(cache->tmpname);
+		return -1;
+	}
+
+	if (rename(cache->tmpname, cache->filename) != 0) {
+		perror(cache->filename);
+		remove(cache->tmpname);
+		return -1;
+	}
+
+	return 0;
+}
@@ -6,33 +6,31 @@
  */
 #include "mkfs.h"
 
+#ifdef WITH_PTHREAD
+#include <pthread.h>
+#endif
+
 #define XATTR_NAME_SELINUX "security.selinux"
 #define XATTR_VALUE_SELINUX "system_u:object_r:unlabeled_t:s0"
 
+/* number of labels a thread looks up before handing them over at once */
+#define RELABEL_CHUNK 64
+
+/* maximum number of labels looked up ahead of the main thread */
+#define RELABEL_WINDOW 8192
+
 #ifdef WITH_SELINUX
-int selinux_relable_node(void *sehnd, sqfs_xattr_writer_t *xwr,
-			 tree_node_t *node, const char *path)
+char *selinux_get_context(void *sehnd, const char *path, mode_t mode)
 {
 	char *context = NULL;
-	int ret;
 
-	if (selabel_lookup(sehnd, &context, path, node->mode) < 0) {
+	if (selabel_lookup(sehnd, &context, path, mode) < 0) {
 		context = strdup(XATTR_VALUE_SELINUX);
 		if (context == NULL)
-			goto fail;
+			perror("relabeling files");
 	}
 
-	ret = sqfs_xattr_writer_add(xwr, XATTR_NAME_SELINUX,
-				    context, strlen(context));
-	free(context);
-
-	if (ret)
-		sqfs_perror(node->name, "storing SELinux xattr", ret);
-
-	return ret;
-fail:
-	perror("relabeling files");
-	return -1;
+	return context;
 }
 
 void *selinux_open_context_file(const char *filename)
@@ -54,13 +52,12 @@ void selinux_close_context_file(void *sehnd)
 	selabel_close(sehnd);
 }
 #else
-int selinux_relable_node(void *sehnd, sqfs_xattr_writer_t *xwr,
-			 tree_node_t *node, const char *path)
+char *selinux_get_context(void *sehnd, const char *path, mode_t mode)
 {
-	(void)sehnd; (void)xwr; (void)node; (void)path;
+	(void)sehnd; (void)path; (void)mode;
 	fputs("Built without SELinux support, cannot add SELinux labels\n",
 	      stderr);
-	return -1;
+	return NULL;
 }
 
 void *selinux_open_context_file(const char *filename)
@@ -76,3 +73,303 @@ void selinux_close_context_file(void *sehnd)
 	(void)sehnd;
 }
 #endif
+
+int selinux_add_context(sqfs_xattr_writer_t *xwr, const char *name,
+			const char *context)
+{
+	int ret = sqfs_xattr_writer_add(xwr, XATTR_NAME_SELINUX,
+					context, strlen(context));
+
+	if (ret)
+		sqfs_perror(name, "storing SELinux xattr", ret);
+
+	return ret;
+}
+
+static char *node_get_context(void *sehnd, tree_node_t *n)
+{
+	char *context, *path = fstree_get_path(n);
+
+	if (path == NULL) {
+		perror("getting absolute node path for SELinux relabeling");
+		return NULL;
+	}
+
+	context = selinux_get_context(sehnd, path, n->mode);
+	free(path);
+	return context;
+}
+
+/*****************************************************************************/
+
+typedef struct {
+	void *sehnd;
+
+	/* all nodes of the tree in depth first pre-order */
+	tree_node_t **nodes;
+	size_t num_nodes;
+
+	/* contexts looked up by the threads, NULL if not available yet */
+	char **contexts;
+
+#ifdef WITH_PTHREAD
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	bool stop;
+	bool failed;
+
+	/* next node to be picked up by a thread */
+	size_t next;
+
+	/* the node the main thread is currently waiting for */
+	size_t current;
+
+	unsigned int num_threads;
+	pthread_t *threads;
+#endif
+} relabel_t;
+
+static size_t count_nodes(tree_node_t *n)
+{
+	size_t count = 1;
+
+	if (S_ISDIR(n->mode)) {
+		for (n = n->data.dir.children; n != NULL; n = n->next)
+			count += count_nodes(n);
+	}
+
+	return count;
+}
+
+static size_t collect_nodes(tree_node_t **nodes, tree_node_t *n)
+{
+	size_t count = 1;
+
+	nodes[0] = n;
+
+	if (S_ISDIR(n->mode)) {
+		for (n = n->data.dir.children; n != NULL; n = n->next)
+			count += collect_nodes(nodes + count, n);
+	}
+
+	return count;
+}
+
+#ifdef WITH_PTHREAD
+static void *relabel_proc(void *arg)
+{
+	char *contexts[RELABEL_CHUNK];
+	relabel_t *rl = arg;
+	size_t i, start, count;
+	bool failed;
+
+	pthread_mutex_lock(&rl->mtx);
+	for (;;) {
+		while (!rl->stop && rl->next < rl->num_nodes &&
+		       rl->next >= rl->current + RELABEL_WINDOW) {
+			pthread_cond_wait(&rl->cond, &rl->mtx);
+		}
+
+		if (rl->stop || rl->next >= rl->num_nodes)
+			break;
+
+		start = rl->next;
+		count = rl->num_nodes - start;
+		if (count > RELABEL_CHUNK)
+			count = RELABEL_CHUNK;
+		rl->next += count;
+		pthread_mutex_unlock(&rl->mtx);
+
+		failed = false;
+
+		for (i = 0; i < count && !failed; ++i) {
+			contexts[i] = node_get_context(rl->sehnd,
+						       rl->nodes[start + i]);
+			failed = (contexts[i] == NULL);
+		}
+
+		pthread_mutex_lock(&rl->mtx);
+		if (failed) {
+			count = i - 1;
+			rl->failed = true;
+			rl->stop = true;
+		}
+
+		for (i = 0; i < count; ++i)
+			rl->contexts[start + i] = contexts[i];
+
+		pthread_cond_broadcast(&rl->cond);
+	}
+	pthread_mutex_unlock(&rl->mtx);
+	return NULL;
+}
+
+static void relabel_start(relabel_t *rl, unsigned int num_threads)
+{
+	unsigned int i;
+
+	if (num_threads == 0)
+		return;
+
+	rl->threads = alloc_array(sizeof(rl->threads[0]), num_threads);
+	if (rl->threads == NULL) {
+		perror("creating SELinux relabeling threads");
+		return;
+	}
+
+	rl->mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	rl->cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+
+	for (i = 0; i < num_threads; ++i) {
+		if (pthread_create(rl->threads + i, NULL, relabel_proc, rl))
+			break;
+
+		rl->num_threads += 1;
+	}
+
+	if (rl->num_threads == 0)
+		fputs("creating SELinux relabeling threads: failed\n", stderr);
+}
+
+static void relabel_stop(relabel_t *rl)
+{
+	unsigned int i;
+
+	if (rl->threads == NULL)
+		return;
+
+	pthread_mutex_lock(&rl->mtx);
+	rl->stop = true;
+	pthread_cond_broadcast(&rl->cond);
+	pthread_mutex_unlock(&rl->mtx);
+
+	for (i = 0; i < rl->num_threads; ++i)
+		pthread_join(rl->threads[i], NULL);
+
+	pthread_cond_destroy(&rl->cond);
+	pthread_mutex_destroy(&rl->mtx);
+	free(rl->threads);
+}
+
+/*
+  Get the context for a node. If no thread has picked it up yet, the main
+  thread looks it up itself instead of waiting.
+ */
+static char *wait_for_context(relabel_t *rl, size_t index)
+{
+	char *context;
+
+	if (rl->num_threads == 0)
+		return node_get_context(rl->sehnd, rl->nodes[index]);
+
+	pthread_mutex_lock(&rl->mtx);
+	rl->current = index;
+
+	if (rl->next <= index) {
+		rl->next = index + 1;
+		pthread_cond_broadcast(&rl->cond);
+		pthread_mutex_unlock(&rl->mtx);
+
+		return node_get_context(rl->sehnd, rl->nodes[index]);
+	}
+
+	if (index % RELABEL_CHUNK == 0)
+		pthread_cond_broadcast(&rl->cond);
+
+	while (!rl->failed && rl->contexts[index] == NULL)
+		pthread_cond_wait(&rl->cond, &rl->mtx);
+
+	context = rl->contexts[index];
+	rl->contexts[index] = NULL;
+	pthread_mutex_unlock(&rl->mtx);
+	return context;
+}
+#else
+static void relabel_start(relabel_t *rl, unsigned int num_threads)
+{
+	(void)rl; (void)num_threads;
+}
+
+static void relabel_stop(relabel_t *rl)
+{
+	(void)rl;
+}
+
+static char *wait_for_context(relabel_t *rl, size_t index)
+{
+	return node_get_context(rl->sehnd, rl->nodes[index]);
+}
+#endif
+
+static int store_context(sqfs_xattr_writer_t *xwr, const char *filename,
+			 tree_node_t *n, char *context)
+{
+	int ret = sqfs_xattr_writer_begin(xwr);
+
+	if (ret) {
+		sqfs_perror(filename, "recording xattr key-value pairs", ret);
+		goto out;
+	}
+
+	ret = selinux_add_context(xwr, n->name, context);
+	if (ret)
+		goto out;
+
+	ret = sqfs_xattr_writer_end(xwr, &n->xattr_idx);
+	if (ret) {
+		sqfs_perror(filename, "flushing completed key-value pairs",
+			    ret);
+	}
+out:
+	free(context);
+	return ret;
+}
+
+int selinux_relabel_tree(void *sehnd, sqfs_xattr_writer_t *xwr,
+			 fstree_t *fs, const char *filename,
+			 unsigned int num_threads)
+{
+	char *context;
+	relabel_t rl;
+	int ret = -1;
+	size_t i;
+
+	memset(&rl, 0, sizeof(rl));
+	rl.sehnd = sehnd;
+	rl.num_nodes = count_nodes(fs->root);
+
+	rl.nodes = alloc_array(sizeof(rl.nodes[0]), rl.num_nodes);
+	rl.contexts = alloc_array(sizeof(rl.contexts[0]), rl.num_nodes);
+
+	if (rl.nodes == NULL || rl.contexts == NULL) {
+		perror("relabeling files");
+		goto out;
+	}
+
+	collect_nodes(rl.nodes, fs->root);
+	relabel_start(&rl, num_threads);
+
+	/* the xattr writer is fed in tree order, no matter who was faster */
+	for (i = 0; i < rl.num_nodes; ++i) {
+		context = wait_for_context(&rl, i);
+		if (context == NULL)
+			break;
+
+		if (store_context(xwr, filename, rl.nodes[i], context))
+			break;
+	}
+
+	relabel_stop(&rl);
+
+	if (i == rl.num_nodes)
+		ret = 0;
+out:
+	if (rl.contexts != NULL) {
+		for (i = 0; i < rl.num_nodes; ++i)
+			free(rl.contexts[i]);
+	}
+
+	free(rl.contexts);
+	free(rl.nodes);
+	return ret;
+}
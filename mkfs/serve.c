@@ -0,0 +1,418 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * serve.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "mkfs.h"
+
+/*
+  A job is sent as the number of arguments, as a 32 bit little endian
+  integer, followed by the working directory of the client and the command
+  line arguments, each null-terminated. The client then shuts down its
+  sending side. The output of the job is sent back over the connection and,
+  once the job is done, a last byte with its exit status.
+
+  Jobs run one after another, in a child process forked off the server, so
+  they cannot interfere with the server or each other and the block cache
+  file is only ever written by one of them. The children inherit the index
+  of the block cache without loading it. After a job, the server picks up
+  the blocks that it added to the file.
+ */
+#define MAX_JOB_SIZE (1024 * 1024)
+
+#if defined(_WIN32) || defined(__WINDOWS__)
+int serve_jobs(const options_t *opt)
+{
+	(void)opt;
+	fputs("--serve is not supported on this platform.\n", stderr);
+	return EXIT_FAILURE;
+}
+
+int serve_connect(const char *socket_path, int argc, char **argv)
+{
+	(void)socket_path; (void)argc; (void)argv;
+	fputs("--connect is not supported on this platform.\n", stderr);
+	return EXIT_FAILURE;
+}
+#else
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <signal.h>
+
+typedef struct {
+	char *data;
+	size_t size;
+
+	const char *cwd;
+	char **argv;
+	int argc;
+} job_t;
+
+static int write_all(int fd, const void *data, size_t size)
+{
+	const char *ptr = data;
+	ssize_t ret;
+
+	while (size > 0) {
+		ret = write(fd, ptr, size);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		ptr += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+static int open_socket(const char *path, bool server)
+{
+	struct sockaddr_un addr;
+	struct stat sb;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path is too long.\n", path);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		goto fail;
+
+	if (!server) {
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+			goto fail_fd;
+		return fd;
+	}
+
+	/* left behind by a server that was killed */
+	if (lstat(path, &sb) == 0 && S_ISSOCK(sb.st_mode))
+		unlink(path);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    listen(fd, 16) != 0) {
+		goto fail_fd;
+	}
+
+	return fd;
+fail_fd:
+	close(fd);
+fail:
+	perror(path);
+	return -1;
+}
+
+static void job_cleanup(job_t *job)
+{
+	free(job->argv);
+	free(job->data);
+	memset(job, 0, sizeof(*job));
+}
+
+/* returns > 0 if the client sent garbage */
+static int read_job(int fd, job_t *job)
+{
+	size_t max = 0, i, offset;
+	sqfs_u32 argc;
+	ssize_t ret;
+	char *new;
+
+	memset(job, 0, sizeof(*job));
+
+	for (;;) {
+		if (job->size == max) {
+			if (max == MAX_JOB_SIZE)
+				goto fail_garbage;
+
+			max = max ? max * 2 : 4096;
+			new = realloc(job->data, max);
+			if (new == NULL)
+				goto fail_errno;
+			job->data = new;
+		}
+
+		ret = read(fd, job->data + job->size, max - job->size);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			goto fail_errno;
+		}
+
+		if (ret == 0)
+			break;
+
+		job->size += ret;
+	}
+
+	if (job->size < sizeof(argc))
+		goto fail_garbage;
+
+	memcpy(&argc, job->data, sizeof(argc));
+	argc = le32toh(argc);
+
+	if (argc == 0 || argc > job->size)
+		goto fail_garbage;
+
+	job->argv = calloc(argc + 1, sizeof(job->argv[0]));
+	if (job->argv == NULL)
+		goto fail_errno;
+
+	offset = sizeof(argc);
+
+	for (i = 0; i <= argc; ++i) {
+		new = memchr(job->data + offset, '\0', job->size - offset);
+		if (new == NULL)
+			goto fail_garbage;
+
+		if (i == 0) {
+			job->cwd = job->data + offset;
+		} else {
+			job->argv[i - 1] = job->data + offset;
+		}
+
+		offset = new - job->data + 1;
+	}
+
+	job->argc = argc;
+	return 0;
+fail_garbage:
+	fputs("Received a malformed job, ignoring it.\n", stderr);
+	job_cleanup(job);
+	return 1;
+fail_errno:
+	perror("receiving job");
+	job_cleanup(job);
+	return -1;
+}
+
+static void run_child(int sfd, int fd, block_cache_t *cache, job_t *job)
+{
+	options_t opt;
+	int status;
+
+	close(sfd);
+
+	if (dup2(fd, STDOUT_FILENO) < 0 || dup2(fd, STDERR_FILENO) < 0)
+		_exit(EXIT_FAILURE);
+
+	close(fd);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	if (chdir(job->cwd) != 0) {
+		perror(job->cwd);
+		exit(EXIT_FAILURE);
+	}
+
+	optind = 1;
+	process_command_line(&opt, job->argc, job->argv);
+
+	if (opt.serve != NULL) {
+		fputs("A job cannot start another server.\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	opt.cfg.warm_cache = cache;
+	status = build_image(&opt);
+	free(opt.partials);
+	exit(status);
+}
+
+static int run_job(int sfd, int fd, block_cache_t *cache, job_t *job)
+{
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		perror("starting job");
+		return EXIT_FAILURE;
+	}
+
+	if (pid == 0)
+		run_child(sfd, fd, cache, job);
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			perror("waiting for job");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!WIFEXITED(status))
+		return EXIT_FAILURE;
+
+	return WEXITSTATUS(status);
+}
+
+int serve_jobs(const options_t *opt)
+{
+	block_cache_t *cache = NULL;
+	int sfd, fd, ret;
+	sqfs_u8 status;
+	job_t job;
+
+	if (opt->cfg.block_cache != NULL) {
+		cache = block_cache_load(opt->cfg.block_cache);
+		if (cache == NULL)
+			return EXIT_FAILURE;
+	}
+
+	sfd = open_socket(opt->serve, true);
+	if (sfd < 0)
+		goto fail;
+
+	/* a client that went away must not take the server down with it */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (!opt->cfg.quiet)
+		printf("Waiting for jobs on %s\n", opt->serve);
+
+	for (;;) {
+		fflush(stdout);
+
+		fd = accept(sfd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(opt->serve);
+			break;
+		}
+
+		ret = read_job(fd, &job);
+		if (ret < 0)
+			break;
+
+		if (ret > 0) {
+			close(fd);
+			continue;
+		}
+
+		/* blocks added by the last job or by anyone else */
+		if (cache != NULL && block_cache_refresh(cache)) {
+			job_cleanup(&job);
+			close(fd);
+			break;
+		}
+
+		status = run_job(sfd, fd, cache, &job);
+
+		if (!opt->cfg.quiet) {
+			printf("Job in %s finished with status %u\n",
+			       job.cwd, status);
+		}
+
+		write_all(fd, &status, 1);
+		job_cleanup(&job);
+		close(fd);
+	}
+
+	close(sfd);
+fail:
+	block_cache_destroy(cache);
+	return EXIT_FAILURE;
+}
+
+int serve_connect(const char *socket_path, int argc, char **argv)
+{
+	char *cwd, *data, *ptr, buffer[4096], last = 0;
+	bool have_last = false;
+	size_t size, len;
+	sqfs_u32 count;
+	ssize_t ret;
+	int fd, i;
+
+	cwd = getcwd(NULL, 0);
+	if (cwd == NULL) {
+		perror("getting working directory");
+		return EXIT_FAILURE;
+	}
+
+	size = sizeof(count) + strlen(cwd) + 1;
+
+	for (i = 0; i < argc; ++i)
+		size += strlen(argv[i]) + 1;
+
+	data = malloc(size);
+	if (data == NULL) {
+		perror("sending job");
+		free(cwd);
+		return EXIT_FAILURE;
+	}
+
+	count = htole32(argc);
+	memcpy(data, &count, sizeof(count));
+	ptr = data + sizeof(count);
+
+	len = strlen(cwd) + 1;
+	memcpy(ptr, cwd, len);
+	ptr += len;
+	free(cwd);
+
+	for (i = 0; i < argc; ++i) {
+		len = strlen(argv[i]) + 1;
+		memcpy(ptr, argv[i], len);
+		ptr += len;
+	}
+
+	fd = open_socket(socket_path, false);
+	if (fd < 0) {
+		free(data);
+		return EXIT_FAILURE;
+	}
+
+	if (write_all(fd, data, size) != 0 || shutdown(fd, SHUT_WR) != 0) {
+		perror(socket_path);
+		goto fail;
+	}
+
+	free(data);
+	data = NULL;
+
+	/* the very last byte is the exit status, not output */
+	for (;;) {
+		ret = read(fd, buffer, sizeof(buffer));
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(socket_path);
+			goto fail;
+		}
+
+		if (ret == 0)
+			break;
+
+		if (have_last)
+			write_all(STDOUT_FILENO, &last, 1);
+
+		write_all(STDOUT_FILENO, buffer, ret - 1);
+		last = buffer[ret - 1];
+		have_last = true;
+	}
+
+	close(fd);
+
+	if (!have_last) {
+		fprintf(stderr, "%s: connection closed before the job was "
+			"done.\n", socket_path);
+		return EXIT_FAILURE;
+	}
+
+	return (sqfs_u8)last;
+fail:
+	free(data);
+	close(fd);
+	return EXIT_FAILURE;
+}
+#endif
@@ -0,0 +1,447 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * shard.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "mkfs.h"
+
+#include <sys/stat.h>
+
+#define PARTIAL_MAGIC "GSQFSPRT"
+#define PARTIAL_VERSION (1)
+
+/*
+  A partial image starts like a regular one, with a super block and the
+  compressor options, followed by the data blocks, the fragment blocks and
+  the fragment table of the files in one shard of the file list. After that
+  come the data locations of the files in that shard, in file list order,
+  and this trailer at the very end. Everything is stored in little endian.
+ */
+typedef struct {
+	sqfs_u8 magic[8];
+	sqfs_u32 version;
+	sqfs_u32 block_size;
+	sqfs_u32 shard;
+	sqfs_u32 num_shards;
+	sqfs_u64 options_hash;
+	sqfs_u64 file_list_hash;
+	sqfs_u64 num_files;
+	sqfs_u64 first_file;
+	sqfs_u64 end_file;
+	sqfs_u64 records_start;
+	sqfs_u64 fragment_table_start;
+	sqfs_u32 fragment_count;
+	sqfs_u32 pad0;
+} partial_trailer_t;
+
+int shard_select(const fstree_t *fs, unsigned int index, unsigned int count,
+		 size_t *first, size_t *end)
+{
+	sqfs_u64 *sizes, total = 0, mid, shard;
+	size_t i, num_files = 0;
+	const file_info_t *fi;
+	struct stat sb;
+
+	for (fi = fs->files; fi != NULL; fi = fi->next)
+		++num_files;
+
+	sizes = alloc_array(sizeof(sizes[0]), num_files > 0 ? num_files : 1);
+	if (sizes == NULL) {
+		perror("splitting file list");
+		return -1;
+	}
+
+	for (fi = fs->files, i = 0; fi != NULL; fi = fi->next, ++i) {
+		if (stat(fi->input_file, &sb) != 0) {
+			perror(fi->input_file);
+			free(sizes);
+			return -1;
+		}
+
+		sizes[i] = sb.st_size;
+		total += sizes[i];
+	}
+
+	/*
+	  Runs of files with about the same amount of input each. A file goes
+	  to the shard that the middle of its data falls into.
+	 */
+	*first = num_files;
+	*end = num_files;
+	mid = 0;
+
+	for (i = 0; i < num_files; ++i) {
+		if (total > 0) {
+			shard = (mid + sizes[i] / 2) / (total / count + 1);
+		} else {
+			shard = i * count / num_files;
+		}
+
+		if (shard == index && *first == num_files)
+			*first = i;
+
+		if (shard > index) {
+			*end = i;
+			break;
+		}
+
+		mid += sizes[i];
+	}
+
+	if (*first > *end)
+		*first = *end;
+
+	free(sizes);
+	return 0;
+}
+
+int shard_write_partial(sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *cfg,
+			unsigned int index, unsigned int count,
+			size_t first, size_t end)
+{
+	file_records_t records;
+	partial_trailer_t trailer;
+	sqfs_u64 options_hash, num_files, hash, start;
+	sqfs_file_t *out = sqfs->outfile;
+	file_info_t *fi;
+	size_t i;
+	int ret;
+
+	if (!cfg->quiet && !cfg->progress)
+		fputs("Waiting for remaining data blocks...\n", stdout);
+
+	ret = sqfs_data_writer_finish(sqfs->data);
+	progress_end(&sqfs->stats);
+
+	if (ret) {
+		sqfs_perror(cfg->filename, "finishing data blocks", ret);
+		return -1;
+	}
+
+	ret = sqfs_data_writer_write_fragment_table(sqfs->data, &sqfs->super);
+	if (ret) {
+		sqfs_perror(cfg->filename, "writing fragment table", ret);
+		return -1;
+	}
+
+	ret = compressor_options_hash(sqfs, &options_hash);
+	if (ret) {
+		sqfs_perror(cfg->filename, "hashing compressor options", ret);
+		return -1;
+	}
+
+	hash = file_list_hash(&sqfs->fs, &num_files);
+
+	memset(&records, 0, sizeof(records));
+	ret = 0;
+
+	/* the inodes are not serialized, so they go away here instead */
+	for (fi = sqfs->fs.files, i = 0; fi != NULL; fi = fi->next, ++i) {
+		if (i < first || i >= end)
+			continue;
+
+		if (ret == 0)
+			ret = file_records_add(&records, fi->user_ptr);
+
+		free(fi->user_ptr);
+		fi->user_ptr = NULL;
+	}
+
+	start = out->get_size(out);
+
+	if (ret == 0)
+		ret = out->write_at(out, start, records.data, records.size);
+
+	file_records_cleanup(&records);
+
+	if (ret) {
+		sqfs_perror(cfg->filename, "writing data locations", ret);
+		return -1;
+	}
+
+	memset(&trailer, 0, sizeof(trailer));
+	memcpy(trailer.magic, PARTIAL_MAGIC, sizeof(trailer.magic));
+	trailer.version = htole32(PARTIAL_VERSION);
+	trailer.block_size = htole32(sqfs->super.block_size);
+	trailer.shard = htole32(index);
+	trailer.num_shards = htole32(count);
+	trailer.options_hash = htole64(options_hash);
+	trailer.file_list_hash = htole64(hash);
+	trailer.num_files = htole64(num_files);
+	trailer.first_file = htole64(first);
+	trailer.end_file = htole64(end);
+	trailer.records_start = htole64(start);
+	trailer.fragment_table_start =
+		htole64(sqfs->super.fragment_table_start);
+	trailer.fragment_count = htole32(sqfs->super.fragment_entry_count);
+
+	ret = out->write_at(out, out->get_size(out), &trailer, sizeof(trailer));
+	if (ret) {
+		sqfs_perror(cfg->filename, "writing trailer", ret);
+		return -1;
+	}
+
+	sqfs->super.bytes_used = out->get_size(out);
+
+	ret = sqfs_super_write(&sqfs->super, out);
+	if (ret) {
+		sqfs_perror(cfg->filename, "updating super block", ret);
+		return -1;
+	}
+
+	ret = sqfs_file_flush(out, 0);
+	if (ret) {
+		sqfs_perror(cfg->filename, "flushing output file", ret);
+		return -1;
+	}
+
+	if (!cfg->quiet) {
+		printf("Packed %lu of %lu files into shard %u of %u.\n",
+		       (unsigned long)(end - first), (unsigned long)num_files,
+		       index + 1, count);
+	}
+
+	return 0;
+}
+
+typedef struct {
+	const char *filename;
+	sqfs_file_t *file;
+	sqfs_compressor_t *cmp;
+	sqfs_data_reader_t *data;
+	file_records_t records;
+	size_t first;
+	size_t end;
+} partial_t;
+
+static void partial_close(partial_t *part)
+{
+	if (part->data != NULL)
+		sqfs_data_reader_destroy(part->data);
+	if (part->cmp != NULL)
+		part->cmp->destroy(part->cmp);
+	if (part->file != NULL)
+		part->file->destroy(part->file);
+	file_records_cleanup(&part->records);
+}
+
+static int check_trailer(const partial_trailer_t *trailer, partial_t *part,
+			 sqfs_writer_t *sqfs, unsigned int index,
+			 unsigned int count, size_t first)
+{
+	sqfs_u64 options_hash, num_files, hash;
+	int ret;
+
+	if (memcmp(trailer->magic, PARTIAL_MAGIC,
+		   sizeof(trailer->magic)) != 0 ||
+	    le32toh(trailer->version) != PARTIAL_VERSION) {
+		fprintf(stderr, "%s: not a partial image\n", part->filename);
+		return -1;
+	}
+
+	if (le32toh(trailer->shard) != index ||
+	    le32toh(trailer->num_shards) != count) {
+		fprintf(stderr, "%s: expected shard %u of %u, found "
+			"shard %u of %u\n", part->filename, index + 1, count,
+			le32toh(trailer->shard) + 1,
+			le32toh(trailer->num_shards));
+		return -1;
+	}
+
+	ret = compressor_options_hash(sqfs, &options_hash);
+	if (ret) {
+		sqfs_perror(part->filename, "hashing compressor options", ret);
+		return -1;
+	}
+
+	if (le32toh(trailer->block_size) != sqfs->super.block_size ||
+	    le64toh(trailer->options_hash) != options_hash) {
+		fprintf(stderr, "%s: different block size or compressor "
+			"options\n", part->filename);
+		return -1;
+	}
+
+	hash = file_list_hash(&sqfs->fs, &num_files);
+
+	if (le64toh(trailer->file_list_hash) != hash ||
+	    le64toh(trailer->num_files) != num_files ||
+	    le64toh(trailer->first_file) != first ||
+	    le64toh(trailer->end_file) < first ||
+	    le64toh(trailer->end_file) > num_files) {
+		fprintf(stderr, "%s: packed from different input files\n",
+			part->filename);
+		return -1;
+	}
+
+	part->first = first;
+	part->end = le64toh(trailer->end_file);
+	return 0;
+}
+
+static int partial_open(partial_t *part, sqfs_writer_t *sqfs,
+			unsigned int index, unsigned int count, size_t first)
+{
+	sqfs_compressor_config_t cfg;
+	partial_trailer_t trailer;
+	sqfs_super_t super;
+	sqfs_u64 size, start;
+	int ret;
+
+	part->file = sqfs_open_file(part->filename, SQFS_FILE_OPEN_READ_ONLY);
+	if (part->file == NULL) {
+		perror(part->filename);
+		return -1;
+	}
+
+	size = part->file->get_size(part->file);
+	if (size < sizeof(sqfs_super_t) + sizeof(trailer)) {
+		fprintf(stderr, "%s: not a partial image\n", part->filename);
+		return -1;
+	}
+
+	ret = part->file->read_at(part->file, size - sizeof(trailer),
+				  &trailer, sizeof(trailer));
+	if (ret)
+		goto fail_read;
+
+	if (check_trailer(&trailer, part, sqfs, index, count, first))
+		return -1;
+
+	start = le64toh(trailer.records_start);
+	if (start > size - sizeof(trailer)) {
+		ret = SQFS_ERROR_CORRUPTED;
+		goto fail_read;
+	}
+
+	ret = file_records_load(&part->records, part->file, start,
+				size - sizeof(trailer) - start);
+	if (ret)
+		goto fail_read;
+
+	sqfs_compressor_config_init(&cfg, sqfs->super.compression_id,
+				    sqfs->super.block_size,
+				    SQFS_COMP_FLAG_UNCOMPRESS);
+
+	part->cmp = sqfs_compressor_create(&cfg);
+	if (part->cmp == NULL) {
+		fprintf(stderr, "%s: error creating compressor.\n",
+			part->filename);
+		return -1;
+	}
+
+	if (sqfs->super.flags & SQFS_FLAG_COMPRESSOR_OPTIONS) {
+		ret = part->cmp->read_options(part->cmp, part->file);
+		if (ret)
+			goto fail_read;
+	}
+
+	part->data = sqfs_data_reader_create(part->file,
+					     sqfs->super.block_size,
+					     part->cmp, 0);
+	if (part->data == NULL) {
+		ret = SQFS_ERROR_ALLOC;
+		goto fail_read;
+	}
+
+	/* all the data reader looks at */
+	memset(&super, 0, sizeof(super));
+	super.directory_table_start = sizeof(sqfs_super_t);
+	super.fragment_table_start = le64toh(trailer.fragment_table_start);
+	super.fragment_entry_count = le32toh(trailer.fragment_count);
+	super.bytes_used = start;
+
+	if (super.fragment_entry_count == 0)
+		super.flags |= SQFS_FLAG_NO_FRAGMENTS;
+
+	ret = sqfs_data_reader_load_fragment_table(part->data, &super);
+	if (ret)
+		goto fail_read;
+
+	return 0;
+fail_read:
+	sqfs_perror(part->filename, "reading partial image", ret);
+	return -1;
+}
+
+static int merge_partial(sqfs_writer_t *sqfs, const options_t *opt,
+			 partial_t *part, file_info_t **fi_list)
+{
+	sqfs_inode_generic_t *original, *inode;
+	file_info_t *fi = *fi_list;
+	sqfs_u64 filesize;
+	size_t i;
+	int ret;
+
+	for (i = part->first; i < part->end; ++i, fi = fi->next) {
+		original = file_records_next(&part->records, part->filename);
+		if (original == NULL)
+			return -1;
+
+		inode = alloc_flex(sizeof(*inode), sizeof(sqfs_u32),
+				   original->num_file_blocks);
+		if (inode == NULL) {
+			perror("creating file inode");
+			free(original);
+			return -1;
+		}
+
+		sqfs_inode_get_file_size(original, &filesize);
+
+		inode->block_sizes = (sqfs_u32 *)inode->extra;
+		inode->base.type = SQFS_INODE_FILE;
+		sqfs_inode_set_file_size(inode, filesize);
+		sqfs_inode_set_frag_location(inode, 0xFFFFFFFF, 0xFFFFFFFF);
+
+		fi->user_ptr = inode;
+
+		if (!opt->cfg.quiet && !opt->cfg.progress)
+			printf("merging %s\n", fi->input_file);
+
+		ret = write_data_from_image(fi->input_file, sqfs->data, inode,
+					    part->file, part->data, original,
+					    sqfs->super.block_size, fi->flags);
+		free(original);
+
+		if (ret)
+			return -1;
+
+		sqfs->stats.file_count += 1;
+		progress_update(&sqfs->stats);
+	}
+
+	*fi_list = fi;
+	return 0;
+}
+
+int shard_merge(sqfs_writer_t *sqfs, const options_t *opt)
+{
+	file_info_t *fi = sqfs->fs.files;
+	size_t i, first = 0;
+	partial_t part;
+	int ret;
+
+	for (i = 0; i < opt->num_partials; ++i) {
+		memset(&part, 0, sizeof(part));
+		part.filename = opt->partials[i];
+
+		ret = partial_open(&part, sqfs, i, opt->num_partials, first);
+		if (ret == 0)
+			ret = merge_partial(sqfs, opt, &part, &fi);
+
+		partial_close(&part);
+
+		if (ret)
+			return -1;
+
+		first = part.end;
+	}
+
+	if (fi != NULL) {
+		fprintf(stderr, "%s: the partial images do not cover all "
+			"files\n", opt->partials[opt->num_partials - 1]);
+		return -1;
+	}
+
+	return 0;
+}
@@ -8,6 +8,7 @@
 #include "common.h"
 #include "tar.h"
 
+#include <fnmatch.h>
 #include <getopt.h>
 #include <string.h>
 #include <stdlib.h>
@@ -20,13 +21,17 @@
 static struct option long_opts[] = {
 	{ "subdir", required_argument, NULL, 'd' },
 	{ "keep-as-dir", no_argument, NULL, 'k' },
+	{ "exclude", required_argument, NULL, 'E' },
 	{ "no-skip", no_argument, NULL, 's' },
 	{ "no-xattr", no_argument, NULL, 'X' },
+	{ "num-jobs", required_argument, NULL, 'j' },
+	{ "compress", required_argument, NULL, 'z' },
+	{ "trace", required_argument, NULL, 'T' },
 	{ "help", no_argument, NULL, 'h' },
 	{ "version", no_argument, NULL, 'V' },
 };
 
-static const char *short_opts = "d:ksXhV";
+static const char *short_opts = "d:kE:sXj:z:T:hV";
 
 static const char *usagestr =
 "Usage: sqfs2tar [OPTIONS...] <sqfsfile>\n"
@@ -47,20 +52,38 @@ static const char *usagestr =
 "                            prefix for all unpacked files.\n"
 "                            Using --subdir more than once implies\n"
 "                            --keep-as-dir.\n"
+"  --exclude, -E <pattern>   Leave out everything with a path in the archive\n"
+"                            that matches the given shell wildcard pattern,\n"
+"                            including the contents of matching\n"
+"                            directories. Can be specified more than once.\n"
 "  --no-xattr, -X            Do not copy extended attributes.\n"
 "\n"
 "  --no-skip, -s             Abort if a file cannot be stored in a tar\n"
 "                            archive. By default, it is simply skipped\n"
 "                            and a warning is written to stderr.\n"
 "\n"
+"  --num-jobs, -j <count>    Number of threads to use for decompressing data\n"
+"                            blocks of the files to be written next ahead of\n"
+"                            time and the inode & directory tables up front.\n"
+"                            The archive is still written in order from the\n"
+"                            main thread. The default is to decompress\n"
+"                            everything on the main thread.\n"
+"\n"
+"  --compress, -z <name>     Compress the archive with gzip, xz or zstd.\n"
+"                            This runs on a separate thread. xz and zstd use\n"
+"                            as many threads as set with --num-jobs.\n"
+"\n"
+"  --trace, -T <file>        Record what sqfs2tar and its threads are doing\n"
+"                            to a Chrome trace JSON file, e.g. for Perfetto.\n"
+"\n"
 "  --help, -h                Print help text and exit.\n"
 "  --version, -V             Print version information and exit.\n"
 "\n"
 "Examples:\n"
 "\n"
 "\tsqfs2tar rootfs.sqfs > rootfs.tar\n"
-"\tsqfs2tar rootfs.sqfs | gzip > rootfs.tar.gz\n"
-"\tsqfs2tar rootfs.sqfs | xz > rootfs.tar.xz\n"
+"\tsqfs2tar -z gzip rootfs.sqfs > rootfs.tar.gz\n"
+"\tsqfs2tar -j 4 -z xz rootfs.sqfs > rootfs.tar.xz\n"
 "\n";
 
 static const char *filename;
@@ -68,21 +91,53 @@ static unsigned int record_counter;
 static bool dont_skip = false;
 static bool keep_as_dir = false;
 static bool no_xattr = false;
+static long num_jobs = 1;
+static int out_compressor = 0;
+static const char *trace_file = NULL;
 
 static char **subdirs = NULL;
 static size_t num_subdirs = 0;
 static size_t max_subdirs = 0;
 
+static char **excludes = NULL;
+static size_t num_excludes = 0;
+static size_t max_excludes = 0;
+static path_buf_t exclude_path;
+
 static sqfs_xattr_reader_t *xr;
 static sqfs_data_reader_t *data;
+static ostream_t *out_file;
 static sqfs_file_t *file;
 static sqfs_super_t super;
 
+static int append_string(char ***list, size_t *count, size_t *max,
+			 const char *str)
+{
+	size_t new_count;
+	void *new;
+
+	if (*count == *max) {
+		new_count = *max ? *max * 2 : 16;
+		new = realloc(*list, new_count * sizeof((*list)[0]));
+		if (new == NULL)
+			return -1;
+
+		*max = new_count;
+		*list = new;
+	}
+
+	(*list)[*count] = strdup(str);
+	if ((*list)[*count] == NULL)
+		return -1;
+
+	*count += 1;
+	return 0;
+}
+
 static void process_args(int argc, char **argv)
 {
-	size_t idx, new_count;
+	size_t idx;
 	int i, ret;
-	void *new;
 
 	for (;;) {
 		i = getopt_long(argc, argv, short_opts, long_opts, NULL);
@@ -91,37 +146,47 @@ static void process_args(int argc, char **argv)
 
 		switch (i) {
 		case 'd':
-			if (num_subdirs == max_subdirs) {
-				new_count = max_subdirs ? max_subdirs * 2 : 16;
-				new = realloc(subdirs,
-					      new_count * sizeof(subdirs[0]));
-				if (new == NULL)
-					goto fail_errno;
-
-				max_subdirs = new_count;
-				subdirs = new;
-			}
-
-			subdirs[num_subdirs] = strdup(optarg);
-			if (subdirs[num_subdirs] == NULL)
+			if (append_string(&subdirs, &num_subdirs,
+					  &max_subdirs, optarg)) {
 				goto fail_errno;
+			}
 
-			if (canonicalize_name(subdirs[num_subdirs])) {
+			if (canonicalize_name(subdirs[num_subdirs - 1])) {
 				perror(optarg);
 				goto fail;
 			}
-
-			++num_subdirs;
 			break;
 		case 'k':
 			keep_as_dir = true;
 			break;
+		case 'E':
+			if (append_string(&excludes, &num_excludes,
+					  &max_excludes, optarg)) {
+				goto fail_errno;
+			}
+			break;
 		case 's':
 			dont_skip = true;
 			break;
 		case 'X':
 			no_xattr = true;
 			break;
+		case 'j':
+			num_jobs = strtol(optarg, NULL, 0);
+			break;
+		case 'T':
+			trace_file = optarg;
+			break;
+		case 'z':
+			out_compressor = fstream_compressor_id_from_name(optarg);
+
+			if (out_compressor < 0 ||
+			    !fstream_compressor_can_compress(out_compressor)) {
+				fprintf(stderr, "Unsupported compressor '%s'\n",
+					optarg);
+				goto fail;
+			}
+			break;
 		case 'h':
 			fputs(usagestr, stdout);
 			goto out_success;
@@ -165,26 +230,70 @@ out_exit:
 	for (idx = 0; idx < num_subdirs; ++idx)
 		free(subdirs[idx]);
 	free(subdirs);
+	for (idx = 0; idx < num_excludes; ++idx)
+		free(excludes[idx]);
+	free(excludes);
 	exit(ret);
 }
 
-static int terminate_archive(void)
+/* the path of a node in the archive, which leaves out the tree root */
+static int push_node_path(path_buf_t *path, const sqfs_tree_node_t *n)
+{
+	int ret;
+
+	if (n->parent == NULL)
+		return 0;
+
+	ret = push_node_path(path, n->parent);
+	if (ret)
+		return ret;
+
+	return path_buf_push(path, (const char *)n->name,
+			     strlen((const char *)n->name));
+}
+
+/* runs while the tree is loaded, excluded sub trees are never read */
+static int exclude_filter(void *user, const sqfs_tree_node_t *parent,
+			  const sqfs_dir_entry_t *ent)
 {
-	char buffer[1024];
+	path_buf_t *path = user;
+	size_t i;
+	int ret;
+
+	path_buf_truncate(path, 0);
+
+	ret = push_node_path(path, parent);
+	if (ret == 0) {
+		ret = path_buf_push(path, (const char *)ent->name,
+				    strlen((const char *)ent->name));
+	}
+
+	if (ret)
+		return ret;
+
+	for (i = 0; i < num_excludes; ++i) {
+		if (fnmatch(excludes[i], path->str, 0) == 0)
+			return 1;
+	}
+
+	return 0;
+}
 
-	memset(buffer, '\0', sizeof(buffer));
+static int terminate_archive(void)
+{
+	if (ostream_append_zero(out_file, 2 * TAR_RECORD_SIZE))
+		return -1;
 
-	return write_retry("adding archive terminator", STDOUT_FILENO,
-			   buffer, sizeof(buffer));
+	return ostream_flush(out_file);
 }
 
 static int get_xattrs(const char *name, const sqfs_inode_generic_t *inode,
 		      tar_xattr_t **out)
 {
 	tar_xattr_t *list = NULL, *ent;
+	const sqfs_xattr_set_t *set;
 	sqfs_xattr_value_t *value;
 	sqfs_xattr_entry_t *key;
-	sqfs_xattr_id_t desc;
 	sqfs_u32 index;
 	size_t i;
 	int ret;
@@ -197,38 +306,20 @@ static int get_xattrs(const char *name, const sqfs_inode_generic_t *inode,
 	if (index == 0xFFFFFFFF)
 		return 0;
 
-	ret = sqfs_xattr_reader_get_desc(xr, index, &desc);
+	ret = sqfs_xattr_reader_get_set(xr, index, &set);
 	if (ret) {
-		sqfs_perror(name, "resolving xattr index", ret);
+		sqfs_perror(name, "reading xattr key-value pairs", ret);
 		return -1;
 	}
 
-	ret = sqfs_xattr_reader_seek_kv(xr, &desc);
-	if (ret) {
-		sqfs_perror(name, "locating xattr key-value pairs", ret);
-		return -1;
-	}
-
-	for (i = 0; i < desc.count; ++i) {
-		ret = sqfs_xattr_reader_read_key(xr, &key);
-		if (ret) {
-			sqfs_perror(name, "reading xattr key", ret);
-			goto fail;
-		}
-
-		ret = sqfs_xattr_reader_read_value(xr, key, &value);
-		if (ret) {
-			sqfs_perror(name, "reading xattr value", ret);
-			free(key);
-			goto fail;
-		}
+	for (i = 0; i < set->count; ++i) {
+		key = set->keys[i];
+		value = set->values[i];
 
 		ent = calloc(1, sizeof(*ent) + strlen((const char *)key->key) +
 			     value->size + 2);
 		if (ent == NULL) {
 			perror("creating xattr entry");
-			free(key);
-			free(value);
 			goto fail;
 		}
 
@@ -240,9 +331,6 @@ static int get_xattrs(const char *name, const sqfs_inode_generic_t *inode,
 
 		ent->next = list;
 		list = ent;
-
-		free(key);
-		free(value);
 	}
 
 	*out = list;
@@ -256,9 +344,33 @@ fail:
 	return -1;
 }
 
-static int write_tree_dfs(const sqfs_tree_node_t *n)
+/*
+  Tell the data reader which files are going to be dumped, in the order
+  write_tree_dfs visits them, so it can read ahead across file boundaries.
+ */
+static int queue_files_dfs(const sqfs_tree_node_t *n)
+{
+	int ret;
+
+	if (S_ISREG(n->inode->base.mode)) {
+		ret = sqfs_data_reader_queue_file(data, n->inode);
+		if (ret) {
+			sqfs_perror(filename, "queueing files to read", ret);
+			return -1;
+		}
+	}
+
+	for (n = n->children; n != NULL; n = n->next) {
+		if (queue_files_dfs(n))
+			return -1;
+	}
+	return 0;
+}
+
+static int write_tree_dfs(const sqfs_tree_node_t *n, path_buf_t *path)
 {
 	tar_xattr_t *xattr = NULL, *xit;
+	size_t old_len = path->len;
 	char *name, *target;
 	struct stat sb;
 	int ret;
@@ -276,26 +388,26 @@ static int write_tree_dfs(const sqfs_tree_node_t *n)
 		return 0;
 	}
 
-	name = sqfs_tree_node_get_path(n);
-	if (name == NULL) {
-		perror("resolving tree node path");
-		return -1;
+	if (n->parent != NULL) {
+		ret = path_buf_push(path, (const char *)n->name,
+				    strlen((const char *)n->name));
+		if (ret) {
+			sqfs_perror((const char *)n->name,
+				    "resolving tree node path", ret);
+			return -1;
+		}
 	}
 
-	if (canonicalize_name(name))
-		goto out_skip;
-
+	name = path->str;
 	inode_stat(n, &sb);
 
 	if (!no_xattr) {
-		if (get_xattrs(name, n->inode, &xattr)) {
-			free(name);
+		if (get_xattrs(name, n->inode, &xattr))
 			return -1;
-		}
 	}
 
 	target = S_ISLNK(sb.st_mode) ? n->inode->slink_target : NULL;
-	ret = write_tar_header(STDOUT_FILENO, &sb, name, target, xattr,
+	ret = write_tar_header(out_file, &sb, name, target, xattr,
 			       record_counter++);
 
 	while (xattr != NULL) {
@@ -307,95 +419,59 @@ static int write_tree_dfs(const sqfs_tree_node_t *n)
 	if (ret > 0)
 		goto out_skip;
 
-	if (ret < 0) {
-		free(name);
+	if (ret < 0)
 		return -1;
-	}
 
 	if (S_ISREG(sb.st_mode)) {
-		if (sqfs_data_reader_dump(name, data, n->inode, STDOUT_FILENO,
-					  super.block_size, false)) {
-			free(name);
+		sqfs_trace_begin("sqfs2tar", "write file");
+		ret = sqfs_data_reader_dump_stream(name, data, n->inode,
+						   out_file);
+		sqfs_trace_end("sqfs2tar", "write file");
+
+		if (ret)
 			return -1;
-		}
 
-		if (padd_file(STDOUT_FILENO, sb.st_size)) {
-			free(name);
+		if (padd_file(out_file, sb.st_size))
 			return -1;
-		}
 	}
-
-	free(name);
 skip_hdr:
 	for (n = n->children; n != NULL; n = n->next) {
-		if (write_tree_dfs(n))
+		if (write_tree_dfs(n, path))
 			return -1;
 	}
+
+	path_buf_truncate(path, old_len);
 	return 0;
 out_skip:
 	if (dont_skip) {
 		fputs("Not allowed to skip files, aborting!\n", stderr);
-		ret = -1;
-	} else {
-		fprintf(stderr, "Skipping %s\n", name);
-		ret = 0;
-	}
-	free(name);
-	return ret;
-}
-
-static sqfs_tree_node_t *tree_merge(sqfs_tree_node_t *lhs,
-				    sqfs_tree_node_t *rhs)
-{
-	sqfs_tree_node_t *head = NULL, **next_ptr = &head;
-	sqfs_tree_node_t *it, *l, *r;
-	int diff;
-
-	while (lhs->children != NULL && rhs->children != NULL) {
-		diff = strcmp((const char *)lhs->children->name,
-			      (const char *)rhs->children->name);
-
-		if (diff < 0) {
-			it = lhs->children;
-			lhs->children = lhs->children->next;
-		} else if (diff > 0) {
-			it = rhs->children;
-			rhs->children = rhs->children->next;
-		} else {
-			l = lhs->children;
-			lhs->children = lhs->children->next;
-
-			r = rhs->children;
-			rhs->children = rhs->children->next;
-
-			it = tree_merge(l, r);
-		}
-
-		*next_ptr = it;
-		next_ptr = &it->next;
+		return -1;
 	}
 
-	it = (lhs->children != NULL ? lhs->children : rhs->children);
-	*next_ptr = it;
-
-	sqfs_dir_tree_destroy(rhs);
-	lhs->children = head;
-	return lhs;
+	fprintf(stderr, "Skipping %s\n", name);
+	path_buf_truncate(path, old_len);
+	return 0;
 }
 
 int main(int argc, char **argv)
 {
-	sqfs_tree_node_t *root = NULL, *subtree;
-	int flags, ret, status = EXIT_FAILURE;
+	sqfs_tree_node_t *root = NULL;
+	int ret, status = EXIT_FAILURE;
+	ostream_t *compressed;
 	sqfs_compressor_config_t cfg;
 	sqfs_compressor_t *cmp;
 	sqfs_id_table_t *idtbl;
 	sqfs_dir_reader_t *dr;
+	path_buf_t path;
 	size_t i;
 
 	process_args(argc, argv);
 
-	file = sqfs_open_file(filename, SQFS_FILE_OPEN_READ_ONLY);
+	if (trace_file != NULL && trace_open(trace_file))
+		goto out_dirs;
+
+	file = sqfs_open_image(filename, SQFS_FILE_OPEN_READ_ONLY |
+			      SQFS_FILE_OPEN_MMAP | SQFS_FILE_OPEN_ASYNC);
 	if (file == NULL) {
 		perror(filename);
 		goto out_dirs;
@@ -438,20 +514,38 @@ int main(int argc, char **argv)
 		goto out_cmp;
 	}
 
-	ret = sqfs_id_table_read(idtbl, file, &super, cmp);
+	if (num_subdirs > 0) {
+		ret = sqfs_id_table_read_lazy(idtbl, file, &super, cmp);
+	} else {
+		ret = sqfs_id_table_read(idtbl, file, &super, cmp);
+	}
 	if (ret) {
 		sqfs_perror(filename, "loading ID table", ret);
 		goto out_id;
 	}
 
-	data = sqfs_data_reader_create(file, super.block_size, cmp);
+	data = sqfs_data_reader_create(file, super.block_size, cmp, 0);
 	if (data == NULL) {
 		sqfs_perror(filename, "creating data reader",
 			    SQFS_ERROR_ALLOC);
 		goto out_id;
 	}
 
-	ret = sqfs_data_reader_load_fragment_table(data, &super);
+	if (num_jobs > 1) {
+		ret = sqfs_data_reader_set_readahead(data, num_jobs,
+					num_jobs * READAHEAD_PER_JOB);
+		if (ret) {
+			sqfs_perror(filename, "creating decompressor threads",
+				    ret);
+			goto out_data;
+		}
+	}
+
+	if (num_subdirs > 0) {
+		ret = sqfs_data_reader_load_fragment_table_lazy(data, &super);
+	} else {
+		ret = sqfs_data_reader_load_fragment_table(data, &super);
+	}
 	if (ret) {
 		sqfs_perror(filename, "loading fragment table", ret);
 		goto out_data;
@@ -464,6 +558,22 @@ int main(int argc, char **argv)
 		goto out_data;
 	}
 
+	if (num_jobs > 1) {
+		ret = sqfs_dir_reader_preload(dr, num_jobs);
+		if (ret) {
+			sqfs_perror(filename, "loading inode & directory table",
+				    ret);
+			goto out_dr;
+		}
+	} else {
+		ret = sqfs_dir_reader_set_readahead(dr, META_READAHEAD);
+		if (ret) {
+			sqfs_perror(filename, "setting up meta data read ahead",
+				    ret);
+			goto out_dr;
+		}
+	}
+
 	if (!no_xattr && !(super.flags & SQFS_FLAG_NO_XATTRS)) {
 		xr = sqfs_xattr_reader_create(file, &super, cmp);
 		if (xr == NULL) {
@@ -479,39 +589,68 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (num_excludes > 0) {
+		ret = path_buf_init(&exclude_path, "");
+		if (ret) {
+			sqfs_perror(filename, "loading filesystem tree", ret);
+			goto out;
+		}
+
+		sqfs_dir_reader_set_filter(dr, exclude_filter, &exclude_path);
+	}
+
 	if (num_subdirs == 0) {
 		ret = sqfs_dir_reader_get_full_hierarchy(dr, idtbl, NULL,
-							 0, &root);
+							 SQFS_TREE_COMPACT,
+							 &root);
+		if (ret) {
+			sqfs_perror(filename, "loading filesystem tree", ret);
+			goto out;
+		}
+	} else if (keep_as_dir || num_subdirs > 1) {
+		ret = sqfs_dir_reader_get_subtrees(dr, idtbl,
+						   (const char *const *)subdirs,
+						   num_subdirs, 0, &root);
 		if (ret) {
 			sqfs_perror(filename, "loading filesystem tree", ret);
 			goto out;
 		}
 	} else {
-		flags = 0;
-
-		if (keep_as_dir || num_subdirs > 1)
-			flags = SQFS_TREE_STORE_PARENTS;
-
-		for (i = 0; i < num_subdirs; ++i) {
-			ret = sqfs_dir_reader_get_full_hierarchy(dr, idtbl,
-								 subdirs[i],
-								 flags,
-								 &subtree);
-			if (ret) {
-				sqfs_perror(subdirs[i], "loading filesystem "
-					    "tree", ret);
-				goto out;
-			}
-
-			if (root == NULL) {
-				root = subtree;
-			} else {
-				root = tree_merge(root, subtree);
-			}
+		ret = sqfs_dir_reader_get_full_hierarchy(dr, idtbl, subdirs[0],
+							 0, &root);
+		if (ret) {
+			sqfs_perror(subdirs[0], "loading filesystem tree", ret);
+			goto out;
 		}
 	}
 
-	if (write_tree_dfs(root))
+	out_file = ostream_open_stdout();
+	if (out_file == NULL)
+		goto out;
+
+	if (out_compressor > 0) {
+		compressed = ostream_compressor_create(out_file,
+						       out_compressor,
+						       num_jobs > 1 ?
+						       num_jobs : 1);
+		if (compressed == NULL)
+			goto out;
+
+		out_file = compressed;
+	}
+
+	if (num_jobs > 1 && queue_files_dfs(root))
+		goto out;
+
+	ret = path_buf_init(&path, "");
+	if (ret) {
+		sqfs_perror(filename, "writing tar ball", ret);
+		goto out;
+	}
+
+	ret = write_tree_dfs(root, &path);
+	path_buf_cleanup(&path);
+	if (ret)
 		goto out;
 
 	if (terminate_archive())
@@ -519,6 +658,8 @@ int main(int argc, char **argv)
 
 	status = EXIT_SUCCESS;
 out:
+	if (out_file != NULL)
+		out_file->destroy(out_file);
 	if (root != NULL)
 		sqfs_dir_tree_destroy(root);
 out_xr:
@@ -538,5 +679,10 @@ out_dirs:
 	for (i = 0; i < num_subdirs; ++i)
 		free(subdirs[i]);
 	free(subdirs);
+	for (i = 0; i < num_excludes; ++i)
+		free(excludes[i]);
+	free(excludes);
+	path_buf_cleanup(&exclude_path);
+	trace_close();
 	return status;
 }
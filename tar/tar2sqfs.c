@@ -14,32 +14,78 @@
 #include <string.h>
 #include <stdio.h>
 
+#ifdef WITH_PTHREAD
+#include <pthread.h>
+#endif
+
+/* options that only have a long form */
+enum {
+	OPT_ADAPTIVE_JOBS = 0x100,
+};
+
 static struct option long_opts[] = {
 	{ "compressor", required_argument, NULL, 'c' },
 	{ "block-size", required_argument, NULL, 'b' },
 	{ "dev-block-size", required_argument, NULL, 'B' },
 	{ "defaults", required_argument, NULL, 'd' },
 	{ "num-jobs", required_argument, NULL, 'j' },
+	{ "adaptive-jobs", no_argument, NULL, OPT_ADAPTIVE_JOBS },
 	{ "queue-backlog", required_argument, NULL, 'Q' },
+	{ "max-memory", required_argument, NULL, 'M' },
+	{ "pin-workers", no_argument, NULL, 'P' },
+	{ "huge-pages", no_argument, NULL, 'U' },
+	{ "no-page-cache", no_argument, NULL, 'N' },
+	{ "block-cache", required_argument, NULL, 'C' },
+	{ "intern-strings", no_argument, NULL, 'i' },
+	{ "spill-inodes", no_argument, NULL, 'W' },
+	{ "align-inodes", no_argument, NULL, 'A' },
+	{ "dir-index-step", required_argument, NULL, 'H' },
+	{ "trace", required_argument, NULL, 'T' },
+	{ "progress", no_argument, NULL, 'R' },
+	{ "stats-json", required_argument, NULL, 'J' },
+	{ "path-index", required_argument, NULL, 'L' },
 	{ "comp-extra", required_argument, NULL, 'X' },
+	{ "auto-level", no_argument, NULL, 'a' },
+	{ "auto-block-size", required_argument, NULL, 'Z' },
 	{ "no-skip", no_argument, NULL, 's' },
 	{ "no-xattr", no_argument, NULL, 'x' },
 	{ "no-keep-time", no_argument, NULL, 'k' },
 	{ "exportable", no_argument, NULL, 'e' },
+	{ "group-fragments", no_argument, NULL, 'G' },
+	{ "best-fit-fragments", no_argument, NULL, 'K' },
+	{ "skip-incompressible", no_argument, NULL, 'I' },
+	{ "fixup", no_argument, NULL, 'F' },
 	{ "force", no_argument, NULL, 'f' },
 	{ "quiet", no_argument, NULL, 'q' },
 	{ "help", no_argument, NULL, 'h' },
 	{ "version", no_argument, NULL, 'V' },
 };
 
-static const char *short_opts = "c:b:B:d:X:j:Q:sxekfqhV";
+static const char *short_opts = "c:b:B:Z:d:X:j:Q:M:PUNC:T:RJ:L:iWAH:asxekGKIFfqhV";
 
 static const char *usagestr =
-"Usage: tar2sqfs [OPTIONS...] <sqfsfile>\n"
+"Usage: tar2sqfs [OPTIONS...] <sqfsfile> [<layer>...]\n"
 "\n"
-"Read an uncompressed tar archive from stdin and turn it into a squashfs\n"
-"filesystem image.\n"
+"Read a tar archive from stdin and turn it into a squashfs filesystem image.\n"
+"Archives compressed with gzip, xz, zstd or bzip2 are detected and\n"
+"decompressed on the fly, if support for the compressor is available.\n"
 "\n"
+"If tar archives are given after the image file name, they are read instead\n"
+"of stdin and stacked on top of each other, like the layers of a container\n"
+"image, the first one at the bottom. Entries in a layer replace entries with\n"
+"the same path in the layers below. OCI whiteout files (.wh.<name>) remove\n"
+"<name> from the layers below and an opaque whiteout (.wh..wh..opq) removes\n"
+"everything in its directory that comes from the layers below. Only the data\n"
+"of files that end up in the image is packed. The layers are read in\n"
+"parallel, up to --num-jobs at a time.\n"
+"\n"
+"If the image file name is '-', the image is written to stdout strictly\n"
+"front to back, e.g. into a pipe. The super block at the start is only a\n"
+"placeholder then and the final one is appended in a trailer. Once the\n"
+"image has been stored in a file, run tar2sqfs --fixup on it.\n"
+"\n";
+
+static const char *help_options =
 "Possible options:\n"
 "\n"
 "  --compressor, -c <name>     Select the compressor to use.\n"
@@ -47,13 +93,44 @@ static const char *usagestr =
 "  --comp-extra, -X <options>  A comma seperated list of extra options for\n"
 "                              the selected compressor. Specify 'help' to\n"
 "                              get a list of available options.\n"
+"  --auto-level, -a            Use lower compression levels for the files\n"
+"                              that follow while the compressor jobs can't\n"
+"                              keep up with reading and writing, and go back\n"
+"                              up once they can.\n"
 "  --num-jobs, -j <count>      Number of compressor jobs to create.\n"
+"  --adaptive-jobs             Park and wake up jobs while packing, based on\n"
+"                              the backlog and the CPU time they get.\n"
 "  --queue-backlog, -Q <count> Maximum number of data blocks in the thread\n"
 "                              worker queue before the packer starts waiting\n"
 "                              for the block processors to catch up.\n"
 "                              Defaults to 10 times the number of jobs.\n"
+"  --max-memory, -M <MiB>      Approximate limit for the memory used to buffer\n"
+"                              data blocks. The packer waits for blocks to be\n"
+"                              written out before going past it.\n"
+"  --pin-workers, -P           Pin each compressor job to a CPU.\n"
+"  --huge-pages, -U            Back the block buffers with huge pages.\n"
+"  --no-page-cache, -N         Keep the input files and the image out of the\n"
+"                              page cache as far as possible.\n"
+"  --block-cache, -C <file>    Reuse compressed blocks from a cache file and\n"
+"                              add new ones to it.\n"
+"  --intern-strings, -i        Store repeated names and symlink targets only\n"
+"                              once in memory, for very large trees.\n"
+"  --spill-inodes, -W          Move the inodes of packed files to a temporary\n"
+"                              file, for very large trees.\n"
+"  --align-inodes, -A          Keep the inodes of a directory's entries in\n"
+"                              one meta data block, where possible.\n"
+"  --dir-index-step, -H <count> Start a new directory header, which the index\n"
+"                              of huge directories points to, at least every\n"
+"                              <count> entries (1 to 256, default 256).\n"
+"  --trace, -T <file>          Record what the packer and its threads are\n"
+"                              doing to a Chrome trace JSON file, e.g. for\n"
+"                              Perfetto.\n"
 "  --block-size, -b <size>     Block size to use for Squashfs image.\n"
 "                              Defaults to %u.\n"
+"  --auto-block-size, -Z <amp> Trial compress a sample of the layers and pick\n"
+"                              the block size with the best ratio, as long as\n"
+"                              a random 4 KiB read loads at most <amp> times\n"
+"                              that much from the image on average.\n"
 "  --dev-block-size, -B <size> Device block size to padd the image to.\n"
 "                              Defaults to %u.\n"
 "  --defaults, -d <options>    A comma seperated list of default values for\n"
@@ -64,14 +141,33 @@ static const char *usagestr =
 "                                 gid=<value>    0 if not set.\n"
 "                                 mode=<value>   0755 if not set.\n"
 "                                 mtime=<value>  0 if not set.\n"
-"\n"
+"\n";
+
+static const char *help_flags =
 "  --no-skip, -s               Abort if a tar record cannot be read instead\n"
 "                              of skipping it.\n"
 "  --no-xattr, -x              Do not copy extended attributes from archive.\n"
 "  --no-keep-time, -k          Do not keep the time stamps stored in the\n"
 "                              archive. Instead, set defaults on all files.\n"
 "  --exportable, -e            Generate an export table for NFS support.\n"
+"  --group-fragments, -G       Pack tail ends of files with the same name\n"
+"                              extension into the same fragment blocks.\n"
+"  --best-fit-fragments, -K    Keep more fragment blocks open and put each\n"
+"                              tail end into the one it fills up best.\n"
+"  --skip-incompressible, -I   Store data blocks that look like they are\n"
+"                              already compressed without compressing them.\n"
+"  --fixup, -F                 Do not read a tar archive. Instead, move the\n"
+"                              super block of a streamed image from the\n"
+"                              trailer into place.\n"
 "  --force, -f                 Overwrite the output file if it exists.\n"
+"  --progress, -R              Show the amount of data read and written, the\n"
+"                              throughput and the queue backlog in a status\n"
+"                              line instead of the name of each file packed.\n"
+"  --stats-json, -J <file>     Write the statistics, including the time taken\n"
+"                              by each phase, to a JSON file.\n"
+"  --path-index, -L <file>     Write an index that maps the full path of every\n"
+"                              file in the image to its inode, for fast\n"
+"                              lookups with libsquashfs.\n"
 "  --quiet, -q                 Do not print out progress reports.\n"
 "  --help, -h                  Print help text and exit.\n"
 "  --version, -V               Print version information and exit.\n"
@@ -81,16 +177,44 @@ static const char *usagestr =
 "\ttar2sqfs rootfs.sqfs < rootfs.tar\n"
 "\tzcat rootfs.tar.gz | tar2sqfs rootfs.sqfs\n"
 "\txzcat rootfs.tar.xz | tar2sqfs rootfs.sqfs\n"
+"\ttar2sqfs - < rootfs.tar | ssh host 'cat > rootfs.sqfs'\n"
+"\tssh host tar2sqfs --fixup rootfs.sqfs\n"
 "\n";
 
 static bool dont_skip = false;
 static bool keep_time = true;
+static bool fixup = false;
 static sqfs_writer_cfg_t cfg;
 static sqfs_writer_t sqfs;
+static istream_t *input_file = NULL;
+
+/* an entry of a layer that is used in the merged tree */
+typedef struct {
+	tar_header_decoded_t hdr;
+
+	/* position of the header in the archive, counting skipped ones */
+	size_t index;
+
+	/* the node of a regular file, if it is still in the tree at the end */
+	tree_node_t *node;
+} layer_ent_t;
+
+typedef struct {
+	const char *filename;
+	layer_ent_t *ents;
+	size_t num_ents;
+	size_t max_ents;
+
+	/* samples of the file data, if the block size is picked from them */
+	block_probe_t *probe;
+} layer_t;
+
+static layer_t *layers = NULL;
+static size_t num_layers = 0;
 
 static void process_args(int argc, char **argv)
 {
-	bool have_compressor;
+	bool have_compressor, have_num_jobs = false;
 	int i;
 
 	sqfs_writer_cfg_init(&cfg);
@@ -129,10 +253,71 @@ static void process_args(int argc, char **argv)
 			break;
 		case 'j':
 			cfg.num_jobs = strtol(optarg, NULL, 0);
+			have_num_jobs = true;
+			break;
+		case OPT_ADAPTIVE_JOBS:
+			cfg.adaptive_workers = true;
 			break;
 		case 'Q':
 			cfg.max_backlog = strtol(optarg, NULL, 0);
 			break;
+		case 'M':
+			cfg.max_memory = strtoul(optarg, NULL, 0);
+			cfg.max_memory *= 1024 * 1024;
+			break;
+		case 'P':
+			cfg.pin_workers = true;
+			break;
+		case 'U':
+			cfg.huge_pages = true;
+			break;
+		case 'a':
+			cfg.auto_level = true;
+			break;
+		case 'Z':
+			cfg.max_read_amp = strtoul(optarg, NULL, 0);
+			if (cfg.max_read_amp < 1) {
+				fputs("Read amplification must be at least 1\n",
+				      stderr);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'N':
+			cfg.no_page_cache = true;
+			break;
+		case 'C':
+			cfg.block_cache = optarg;
+			break;
+		case 'T':
+			cfg.trace_file = optarg;
+			break;
+		case 'R':
+			cfg.progress = true;
+			break;
+		case 'J':
+			cfg.stats_json = optarg;
+			break;
+		case 'L':
+			cfg.path_index = optarg;
+			break;
+		case 'i':
+			cfg.intern_strings = true;
+			break;
+		case 'W':
+			cfg.spill_inodes = true;
+			break;
+		case 'A':
+			cfg.align_inodes = true;
+			break;
+		case 'H':
+			cfg.dir_index_step = strtoul(optarg, NULL, 0);
+			if (cfg.dir_index_step < 1 ||
+			    cfg.dir_index_step > SQFS_MAX_DIR_ENT) {
+				fputs("Directory index step must be between "
+				      "1 and 256\n", stderr);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'X':
 			cfg.comp_extra = optarg;
 			break;
@@ -151,6 +336,18 @@ static void process_args(int argc, char **argv)
 		case 'e':
 			cfg.exportable = true;
 			break;
+		case 'G':
+			cfg.group_fragments = true;
+			break;
+		case 'K':
+			cfg.best_fit_fragments = true;
+			break;
+		case 'I':
+			cfg.skip_incompressible = true;
+			break;
+		case 'F':
+			fixup = true;
+			break;
 		case 'f':
 			cfg.outmode |= SQFS_FILE_OPEN_OVERWRITE;
 			break;
@@ -158,8 +355,10 @@ static void process_args(int argc, char **argv)
 			cfg.quiet = true;
 			break;
 		case 'h':
-			printf(usagestr, SQFS_DEFAULT_BLOCK_SIZE,
+			fputs(usagestr, stdout);
+			printf(help_options, SQFS_DEFAULT_BLOCK_SIZE,
 			       SQFS_DEVBLK_SIZE);
+			fputs(help_flags, stdout);
 			compressor_print_available();
 			exit(EXIT_SUCCESS);
 		case 'V':
@@ -170,6 +369,9 @@ static void process_args(int argc, char **argv)
 		}
 	}
 
+	if (cfg.adaptive_workers && !have_num_jobs)
+		cfg.num_jobs = os_get_available_jobs();
+
 	if (cfg.num_jobs < 1)
 		cfg.num_jobs = 1;
 
@@ -188,10 +390,35 @@ static void process_args(int argc, char **argv)
 
 	cfg.filename = argv[optind++];
 
+	if (optind < argc && !fixup) {
+		num_layers = argc - optind;
+		layers = alloc_array(sizeof(layers[0]), num_layers);
+		if (layers == NULL) {
+			perror("processing arguments");
+			exit(EXIT_FAILURE);
+		}
+
+		for (i = 0; optind < argc; ++i)
+			layers[i].filename = argv[optind++];
+	}
+
 	if (optind < argc) {
 		fputs("Unknown extra arguments\n", stderr);
 		goto fail_arg;
 	}
+
+	/* the sample is taken in the first pass over the layers */
+	if (cfg.max_read_amp > 0 && num_layers == 0 && !fixup) {
+		fputs("Picking the block size by sampling the input requires "
+		      "the archives to be given as files.\n", stderr);
+		goto fail_arg;
+	}
+
+	/* stdout carries the image, so it can't carry progress reports */
+	if (strcmp(cfg.filename, "-") == 0 && !fixup) {
+		cfg.stream_output = true;
+		cfg.quiet = true;
+	}
 	return;
 fail_arg:
 	fputs("Try `tar2sqfs --help' for more information.\n", stderr);
@@ -229,29 +456,44 @@ static int write_file(tar_header_decoded_t *hdr, file_info_t *fi,
 		for (sum = 0, it = hdr->sparse; it != NULL; it = it->next)
 			sum += it->count;
 
-		file = sqfs_get_stdin_file(hdr->sparse, sum);
+		file = sqfs_get_stdin_file(input_file, hdr->sparse, sum);
 		if (file == NULL) {
 			perror("packing files");
 			return -1;
 		}
 	} else {
-		file = sqfs_get_stdin_file(NULL, filesize);
+		file = sqfs_get_stdin_file(input_file, NULL, filesize);
 		if (file == NULL) {
 			perror("packing files");
 			return -1;
 		}
 	}
 
-	ret = write_data_from_file(hdr->name, sqfs.data, inode, file, 0);
+	sqfs_trace_begin("tar2sqfs", "pack file");
+
+	if (hdr->sparse != NULL) {
+		ret = write_data_from_file_condensed(hdr->name, sqfs.data,
+						     inode, file, hdr->sparse,
+						     0);
+	} else {
+		ret = write_data_from_file(hdr->name, sqfs.data, inode,
+					   file, sqfs.cache, 0);
+	}
 	file->destroy(file);
 
+	sqfs_trace_end("tar2sqfs", "pack file");
+
 	sqfs.stats.bytes_read += filesize;
 	sqfs.stats.file_count += 1;
+	progress_update(&sqfs.stats);
 
 	if (ret)
 		return -1;
 
-	return skip_padding(STDIN_FILENO, hdr->sparse == NULL ?
+	if (sqfs.spill != NULL && inode_spill_add(sqfs.spill, fi))
+		return -1;
+
+	return skip_padding(input_file, hdr->sparse == NULL ?
 			    filesize : hdr->record_size);
 }
 
@@ -296,7 +538,7 @@ static int copy_xattr(tree_node_t *node, tar_header_decoded_t *hdr)
 	return 0;
 }
 
-static int create_node_and_repack_data(tar_header_decoded_t *hdr)
+static tree_node_t *create_node(tar_header_decoded_t *hdr)
 {
 	tree_node_t *node;
 
@@ -304,127 +546,699 @@ static int create_node_and_repack_data(tar_header_decoded_t *hdr)
 		hdr->sb.st_mtime = sqfs.fs.defaults.st_mtime;
 	}
 
+	/* the target was already packed, its data is not stored again */
+	if (hdr->is_hard_link) {
+		node = fstree_add_hard_link(&sqfs.fs, hdr->name,
+					    hdr->link_target);
+		if (node == NULL)
+			goto fail_errno;
+		return node;
+	}
+
 	node = fstree_add_generic(&sqfs.fs, hdr->name,
 				  &hdr->sb, hdr->link_target);
 	if (node == NULL)
 		goto fail_errno;
 
-	if (!cfg.quiet)
-		printf("Packing %s\n", hdr->name);
-
 	if (!cfg.no_xattr) {
 		if (copy_xattr(node, hdr))
-			return -1;
+			return NULL;
 	}
 
-	if (S_ISREG(hdr->sb.st_mode)) {
+	return node;
+fail_errno:
+	perror(hdr->name);
+	return NULL;
+}
+
+static int create_node_and_repack_data(tar_header_decoded_t *hdr)
+{
+	tree_node_t *node;
+
+	node = create_node(hdr);
+	if (node == NULL)
+		return -1;
+
+	if (!cfg.quiet && !cfg.progress) {
+		if (hdr->is_hard_link) {
+			printf("Hard link %s -> %s\n", hdr->name,
+			       hdr->link_target);
+		} else {
+			printf("Packing %s\n", hdr->name);
+		}
+	}
+
+	if (S_ISREG(hdr->sb.st_mode) && !hdr->is_hard_link) {
 		if (write_file(hdr, &node->data.file, hdr->sb.st_size))
 			return -1;
 	}
 
 	return 0;
-fail_errno:
-	perror(hdr->name);
-	return -1;
 }
 
-static int process_tar_ball(void)
+/*
+  tar entries might be prefixed with ./ which is stripped by
+  cannonicalize_name, but the tar file may contain a directory
+  entry named './'
+ */
+static bool is_root_entry(const tar_header_decoded_t *hdr)
+{
+	return hdr->name != NULL && strcmp(hdr->name, "./") == 0 &&
+		S_ISDIR(hdr->sb.st_mode);
+}
+
+/* Returns true and prints the reason if an entry cannot be packed. */
+static bool must_skip(tar_header_decoded_t *hdr)
 {
-	tar_header_decoded_t hdr;
 	sqfs_u64 offset, count;
 	sparse_map_t *m;
-	bool skip;
+	bool skip = false;
+
+	if (hdr->name == NULL || canonicalize_name(hdr->name) != 0) {
+		fprintf(stderr, "skipping '%s' (invalid name)\n",
+			hdr->name);
+		skip = true;
+	}
+
+	if (hdr->name[0] == '\0') {
+		fputs("skipping entry with empty name\n", stderr);
+		skip = true;
+	}
+
+	if (!skip && hdr->is_hard_link &&
+	    (hdr->link_target == NULL ||
+	     canonicalize_name(hdr->link_target) != 0 ||
+	     hdr->link_target[0] == '\0')) {
+		fprintf(stderr, "%s: invalid hard link target\n",
+			hdr->name);
+		skip = true;
+	}
+
+	if (!skip && hdr->unknown_record) {
+		fprintf(stderr, "%s: unknown entry type\n", hdr->name);
+		skip = true;
+	}
+
+	if (!skip && hdr->sparse != NULL) {
+		offset = hdr->sparse->offset;
+		count = 0;
+
+		for (m = hdr->sparse; m != NULL; m = m->next) {
+			if (m->offset < offset) {
+				skip = true;
+				break;
+			}
+			offset = m->offset + m->count;
+			count += m->count;
+		}
+
+		if (count != hdr->record_size)
+			skip = true;
+
+		if (skip) {
+			fprintf(stderr, "%s: broken sparse "
+				"file layout\n", hdr->name);
+		}
+	}
+
+	return skip;
+}
+
+static int process_tar_ball(void)
+{
+	tar_header_decoded_t hdr;
 	int ret;
 
 	for (;;) {
-		ret = read_header(STDIN_FILENO, &hdr);
+		ret = read_header(input_file, &hdr);
 		if (ret > 0)
 			break;
 		if (ret < 0)
 			return -1;
 
-		skip = false;
-
-		if (hdr.name != NULL && strcmp(hdr.name, "./") == 0 &&
-		    S_ISDIR(hdr.sb.st_mode)) {
-			/* XXX: tar entries might be prefixed with ./ which is
-			   stripped by cannonicalize_name, but the tar file may
-			   contain a directory entry named './' */
+		if (is_root_entry(&hdr)) {
 			clear_header(&hdr);
 			continue;
 		}
 
-		if (hdr.name == NULL || canonicalize_name(hdr.name) != 0) {
-			fprintf(stderr, "skipping '%s' (invalid name)\n",
-				hdr.name);
-			skip = true;
+		if (must_skip(&hdr)) {
+			if (dont_skip)
+				goto fail;
+			if (skip_entry(input_file, hdr.sb.st_size))
+				goto fail;
+
+			clear_header(&hdr);
+			continue;
 		}
 
-		if (hdr.name[0] == '\0') {
-			fputs("skipping entry with empty name\n", stderr);
-			skip = true;
+		if (create_node_and_repack_data(&hdr))
+			goto fail;
+
+		clear_header(&hdr);
+	}
+
+	return 0;
+fail:
+	clear_header(&hdr);
+	return -1;
+}
+
+static istream_t *open_input(istream_t *strm)
+{
+	istream_t *wrapper;
+	int ret;
+
+	ret = istream_detect_compressor(strm);
+	if (ret < 0)
+		goto fail;
+
+	if (ret > 0) {
+		wrapper = istream_compressor_create(strm, ret);
+		if (wrapper == NULL)
+			goto fail;
+
+		strm = wrapper;
+	}
+
+	return strm;
+fail:
+	strm->destroy(strm);
+	return NULL;
+}
+
+/*
+  The data of a regular file is only read in the second pass, if the file
+  is still in the tree after merging all layers.
+ */
+static int sample_data(block_probe_t *probe, istream_t *strm,
+		       const tar_header_decoded_t *hdr)
+{
+	sqfs_u64 padded = hdr->record_size;
+	sqfs_u8 *ptr;
+	size_t size;
+
+	if (padded % 512)
+		padded += 512 - padded % 512;
+
+	ptr = block_probe_add(probe, hdr->record_size, &size);
+	if (ptr == NULL)
+		return -1;
+
+	if (read_retry("sampling the input", strm, ptr, size))
+		return -1;
+
+	return istream_skip(strm, padded - size);
+}
+
+static int skip_data(block_probe_t *probe, istream_t *strm,
+		     const tar_header_decoded_t *hdr)
+{
+	if (hdr->is_hard_link || !S_ISREG(hdr->sb.st_mode))
+		return 0;
+
+	/* sparse files are archived without the holes, unlike in the image */
+	if (probe != NULL && hdr->sparse == NULL && hdr->record_size > 0 &&
+	    block_probe_want(probe)) {
+		return sample_data(probe, strm, hdr);
+	}
+
+	return skip_entry(strm, hdr->record_size);
+}
+
+static int read_layer(layer_t *layer)
+{
+	layer_ent_t *ent, *new;
+	istream_t *strm;
+	size_t index, count;
+	int ret;
+
+	strm = istream_open_file(layer->filename);
+	if (strm == NULL)
+		return -1;
+
+	strm = open_input(strm);
+	if (strm == NULL)
+		return -1;
+
+	sqfs_trace_begin("tar2sqfs", "read layer");
+
+	for (index = 0;; ++index) {
+		if (layer->num_ents == layer->max_ents) {
+			count = layer->max_ents ? layer->max_ents * 2 : 128;
+			new = realloc(layer->ents, count * sizeof(new[0]));
+			if (new == NULL) {
+				perror(layer->filename);
+				goto fail;
+			}
+
+			layer->ents = new;
+			layer->max_ents = count;
 		}
 
-		if (!skip && hdr.unknown_record) {
-			fprintf(stderr, "%s: unknown entry type\n", hdr.name);
-			skip = true;
+		ent = layer->ents + layer->num_ents;
+		memset(ent, 0, sizeof(*ent));
+
+		ret = read_header(strm, &ent->hdr);
+		if (ret > 0)
+			break;
+		if (ret < 0)
+			goto fail;
+
+		if (is_root_entry(&ent->hdr)) {
+			clear_header(&ent->hdr);
+			continue;
 		}
 
-		if (!skip && hdr.sparse != NULL) {
-			offset = hdr.sparse->offset;
-			count = 0;
-
-			for (m = hdr.sparse; m != NULL; m = m->next) {
-				if (m->offset < offset) {
-					skip = true;
-					break;
-				}
-				offset = m->offset + m->count;
-				count += m->count;
+		if (must_skip(&ent->hdr)) {
+			if (dont_skip ||
+			    skip_entry(strm, ent->hdr.sb.st_size)) {
+				clear_header(&ent->hdr);
+				goto fail;
 			}
 
-			if (count != hdr.record_size)
-				skip = true;
+			clear_header(&ent->hdr);
+			continue;
+		}
+
+		if (skip_data(layer->probe, strm, &ent->hdr)) {
+			clear_header(&ent->hdr);
+			goto fail;
+		}
+
+		ent->index = index;
+		layer->num_ents += 1;
+	}
+
+	sqfs_trace_end("tar2sqfs", "read layer");
+	strm->destroy(strm);
+	return 0;
+fail:
+	sqfs_trace_end("tar2sqfs", "read layer");
+	strm->destroy(strm);
+	return -1;
+}
+
+#ifdef WITH_PTHREAD
+typedef struct {
+	size_t next;
+	bool failed;
+	pthread_mutex_t mtx;
+} read_work_t;
+
+static void *read_worker(void *arg)
+{
+	read_work_t *work = arg;
+	size_t i;
+
+	for (;;) {
+		pthread_mutex_lock(&work->mtx);
+		i = work->next++;
+		if (work->failed)
+			i = num_layers;
+		pthread_mutex_unlock(&work->mtx);
+
+		if (i >= num_layers)
+			break;
+
+		if (read_layer(layers + i)) {
+			pthread_mutex_lock(&work->mtx);
+			work->failed = true;
+			pthread_mutex_unlock(&work->mtx);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static int read_layers(void)
+{
+	size_t i, num_threads, started = 0;
+	pthread_t *threads;
+	read_work_t work;
+
+	num_threads = cfg.num_jobs;
+	if (num_threads > num_layers)
+		num_threads = num_layers;
+
+	memset(&work, 0, sizeof(work));
+
+	threads = alloc_array(sizeof(threads[0]), num_threads);
+	if (threads == NULL)
+		goto fail_alloc;
+
+	if (pthread_mutex_init(&work.mtx, NULL) != 0) {
+		free(threads);
+		goto fail_alloc;
+	}
+
+	/* the main thread reads layers as well */
+	for (i = 1; i < num_threads; ++i) {
+		if (pthread_create(threads + i, NULL, read_worker, &work) != 0)
+			break;
+
+		++started;
+	}
 
-			if (skip) {
-				fprintf(stderr, "%s: broken sparse "
-					"file layout\n", hdr.name);
+	read_worker(&work);
+
+	for (i = 1; i <= started; ++i)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&work.mtx);
+	free(threads);
+	return work.failed ? -1 : 0;
+fail_alloc:
+	perror("starting layer reader threads");
+	return -1;
+}
+#else
+static int read_layers(void)
+{
+	size_t i;
+
+	for (i = 0; i < num_layers; ++i) {
+		if (read_layer(layers + i))
+			return -1;
+	}
+
+	return 0;
+}
+#endif
+
+#define WHITEOUT_PREFIX ".wh."
+#define WHITEOUT_OPAQUE ".wh..wh..opq"
+
+static const char *base_name(const char *path)
+{
+	const char *name = strrchr(path, '/');
+
+	return name == NULL ? path : (name + 1);
+}
+
+static bool is_whiteout(const char *path)
+{
+	return strncmp(base_name(path), WHITEOUT_PREFIX,
+		       strlen(WHITEOUT_PREFIX)) == 0;
+}
+
+/* remove what a whiteout file hides from the layers below */
+static int apply_whiteout(const char *path)
+{
+	const char *name = base_name(path);
+	size_t dir_len = name - path;
+	tree_node_t *n;
+	char *target;
+
+	target = strdup(path);
+	if (target == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	if (strcmp(name, WHITEOUT_OPAQUE) == 0) {
+		target[dir_len] = '\0';
+
+		n = fstree_get_node_by_path(&sqfs.fs, target);
+
+		if (n != NULL && S_ISDIR(n->mode)) {
+			while (n->data.dir.children != NULL) {
+				fstree_remove_node(&sqfs.fs,
+						   n->data.dir.children);
 			}
 		}
+	} else {
+		strcpy(target + dir_len, name + strlen(WHITEOUT_PREFIX));
 
-		if (skip) {
-			if (dont_skip)
-				goto fail;
-			if (skip_entry(STDIN_FILENO, hdr.sb.st_size))
-				goto fail;
+		n = fstree_get_node_by_path(&sqfs.fs, target);
+		if (n != NULL)
+			fstree_remove_node(&sqfs.fs, n);
+	}
 
-			clear_header(&hdr);
+	free(target);
+	return 0;
+}
+
+static int merge_entry(layer_ent_t *ent)
+{
+	tar_header_decoded_t *hdr = &ent->hdr;
+	tree_node_t *n;
+
+	n = fstree_get_node_by_path(&sqfs.fs, hdr->name);
+
+	if (n != NULL) {
+		/* a directory keeps its contents, but takes the attributes */
+		if (S_ISDIR(n->mode) && S_ISDIR(hdr->sb.st_mode) &&
+		    !hdr->is_hard_link) {
+			if (!keep_time)
+				hdr->sb.st_mtime = sqfs.fs.defaults.st_mtime;
+
+			n->uid = hdr->sb.st_uid;
+			n->gid = hdr->sb.st_gid;
+			n->mode = hdr->sb.st_mode;
+			n->mod_time = hdr->sb.st_mtime;
+			n->data.dir.created_implicitly = false;
+
+			if (!cfg.no_xattr)
+				return copy_xattr(n, hdr);
+			return 0;
+		}
+
+		fstree_remove_node(&sqfs.fs, n);
+	}
+
+	n = create_node(hdr);
+	if (n == NULL)
+		return -1;
+
+	if (S_ISREG(n->mode))
+		n->data.file.user_ptr = ent;
+
+	return 0;
+}
+
+static int merge_layer(layer_t *layer)
+{
+	size_t i;
+
+	/* whiteouts only hide entries of the layers below */
+	for (i = 0; i < layer->num_ents; ++i) {
+		if (!is_whiteout(layer->ents[i].hdr.name))
+			continue;
+
+		if (apply_whiteout(layer->ents[i].hdr.name))
+			return -1;
+	}
+
+	for (i = 0; i < layer->num_ents; ++i) {
+		if (is_whiteout(layer->ents[i].hdr.name))
 			continue;
+
+		if (merge_entry(layer->ents + i))
+			return -1;
+	}
+
+	/* only the index and the node are needed from here on */
+	for (i = 0; i < layer->num_ents; ++i)
+		clear_header(&layer->ents[i].hdr);
+
+	return 0;
+}
+
+static void mark_files(tree_node_t *n)
+{
+	layer_ent_t *ent;
+
+	if (S_ISDIR(n->mode)) {
+		for (n = n->data.dir.children; n != NULL; n = n->next)
+			mark_files(n);
+	} else if (S_ISREG(n->mode)) {
+		ent = n->data.file.user_ptr;
+		ent->node = n;
+	}
+}
+
+static int pack_layer(layer_t *layer)
+{
+	tar_header_decoded_t hdr;
+	layer_ent_t *ent = layer->ents;
+	layer_ent_t *end = layer->ents + layer->num_ents;
+	size_t index;
+	int ret;
+
+	while (ent != end && ent->node == NULL)
+		++ent;
+
+	/* nothing from this layer made it into the image */
+	if (ent == end)
+		return 0;
+
+	input_file = istream_open_file(layer->filename);
+	if (input_file == NULL)
+		return -1;
+
+	input_file = open_input(input_file);
+	if (input_file == NULL)
+		return -1;
+
+	for (index = 0; ent != end; ++index) {
+		ret = read_header(input_file, &hdr);
+		if (ret > 0) {
+			fprintf(stderr, "%s: archive changed while "
+				"reading it\n", layer->filename);
+			goto fail_strm;
 		}
+		if (ret < 0)
+			goto fail_strm;
+
+		if (index < ent->index) {
+			ret = skip_entry(input_file, hdr.sb.st_size);
+		} else if (ent->node == NULL) {
+			ret = skip_data(NULL, input_file, &hdr);
+		} else {
+			if (hdr.name == NULL ||
+			    canonicalize_name(hdr.name) != 0) {
+				fprintf(stderr, "%s: archive changed while "
+					"reading it\n", layer->filename);
+				goto fail;
+			}
 
-		if (create_node_and_repack_data(&hdr))
-			goto fail;
+			if (!cfg.quiet && !cfg.progress)
+				printf("Packing %s\n", hdr.name);
+
+			ret = write_file(&hdr, &ent->node->data.file,
+					 hdr.sb.st_size);
+		}
+
+		if (index == ent->index) {
+			do {
+				++ent;
+			} while (ent != end && ent->node == NULL);
+		}
 
 		clear_header(&hdr);
+		if (ret)
+			goto fail_strm;
 	}
 
+	input_file->destroy(input_file);
+	input_file = NULL;
 	return 0;
 fail:
 	clear_header(&hdr);
+fail_strm:
+	input_file->destroy(input_file);
+	input_file = NULL;
 	return -1;
 }
 
+/* the samples of all layers are put together, as if taken from one */
+static int probe_block_size(void)
+{
+	block_probe_t *probe = layers[0].probe;
+	size_t i;
+
+	for (i = 1; i < num_layers; ++i) {
+		if (block_probe_merge(probe, layers[i].probe))
+			return -1;
+
+		layers[i].probe = NULL;
+	}
+
+	return block_probe_apply(probe, &sqfs, &cfg);
+}
+
+static int process_layers(void)
+{
+	size_t i;
+
+	if (cfg.max_read_amp > 0) {
+		if (!cfg.quiet) {
+			fputs("Sampling the input to pick a block size...\n",
+			      stdout);
+		}
+
+		for (i = 0; i < num_layers; ++i) {
+			layers[i].probe = block_probe_create();
+			if (layers[i].probe == NULL)
+				return -1;
+		}
+	}
+
+	if (read_layers())
+		return -1;
+
+	if (cfg.max_read_amp > 0 && probe_block_size())
+		return -1;
+
+	for (i = 0; i < num_layers; ++i) {
+		if (merge_layer(layers + i))
+			return -1;
+	}
+
+	mark_files(sqfs.fs.root);
+
+	for (i = 0; i < num_layers; ++i) {
+		if (pack_layer(layers + i))
+			return -1;
+	}
+
+	return 0;
+}
+
+static void free_layers(void)
+{
+	size_t i, j;
+
+	for (i = 0; i < num_layers; ++i) {
+		for (j = 0; j < layers[i].num_ents; ++j)
+			clear_header(&layers[i].ents[j].hdr);
+
+		block_probe_destroy(layers[i].probe);
+		free(layers[i].ents);
+	}
+
+	free(layers);
+}
+
 int main(int argc, char **argv)
 {
 	int status = EXIT_FAILURE;
 
 	process_args(argc, argv);
 
+	if (fixup)
+		return sqfs_stream_fixup(cfg.filename) ? EXIT_FAILURE :
+			EXIT_SUCCESS;
+
+	if (num_layers == 0) {
+		input_file = istream_open_stdin();
+		if (input_file == NULL)
+			return EXIT_FAILURE;
+
+		input_file = open_input(input_file);
+		if (input_file == NULL)
+			return EXIT_FAILURE;
+	}
+
 	if (sqfs_writer_init(&sqfs, &cfg))
-		return EXIT_FAILURE;
+		goto out_if;
 
-	if (process_tar_ball())
+	/* the input is a stream, there is nothing to sample up front */
+	if (sqfs.comp_cfg.id == SQFS_COMP_ZSTD &&
+	    (sqfs.comp_cfg.flags & SQFS_COMP_FLAG_ZSTD_DICT)) {
+		fputs("The nonstd-dict compressor option is only supported "
+		      "by gensquashfs.\n", stderr);
 		goto out;
+	}
+
+	if (num_layers > 0) {
+		if (process_layers())
+			goto out;
+	} else {
+		if (process_tar_ball())
+			goto out;
+	}
 
 	if (sqfs_writer_finish(&sqfs, &cfg))
 		goto out;
@@ -432,5 +1246,9 @@ int main(int argc, char **argv)
 	status = EXIT_SUCCESS;
 out:
 	sqfs_writer_cleanup(&sqfs);
+out_if:
+	if (input_file != NULL)
+		input_file->destroy(input_file);
+	free_layers();
 	return status;
 }
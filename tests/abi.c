@@ -19,6 +19,7 @@ int main(void)
 	assert(sizeof(cfg.opt.zstd) == sizeof(cfg.opt));
 	assert(sizeof(cfg.opt.lzo) == sizeof(cfg.opt));
 	assert(sizeof(cfg.opt.xz) == sizeof(cfg.opt));
+	assert(sizeof(cfg.opt.lz4) == sizeof(cfg.opt));
 	assert(sizeof(cfg.opt.padd0) == sizeof(cfg.opt));
 
 	return EXIT_SUCCESS;
@@ -9,6 +9,7 @@
 #include "fstree.h"
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
@@ -17,6 +18,8 @@ int main(void)
 {
 	tree_node_t *a, *b;
 	struct stat sb;
+	char name[32];
+	unsigned int i;
 	fstree_t fs;
 	char *opts;
 
@@ -113,6 +116,40 @@ int main(void)
 	assert(fstree_add_generic(&fs, "dir/foo", &sb, NULL) == NULL);
 	assert(errno == EEXIST);
 
+	/* enough entries for the directory to be hash indexed */
+	memset(&sb, 0, sizeof(sb));
+	sb.st_mode = S_IFCHR | 0640;
+
+	for (i = 0; i < 1000; ++i) {
+		sprintf(name, "big/%u", i);
+		assert(fstree_add_generic(&fs, name, &sb, NULL) != NULL);
+	}
+
+	for (i = 0; i < 1000; ++i) {
+		sprintf(name, "big/%u", i);
+		assert(fstree_add_generic(&fs, name, &sb, NULL) == NULL);
+		assert(errno == EEXIST);
+	}
+
+	/* names added in sorted order are not looked up */
+	for (i = 0; i < 500; ++i) {
+		sprintf(name, "sorted/%04u", i);
+		assert(fstree_add_generic(&fs, name, &sb, NULL) != NULL);
+	}
+
+	for (i = 0; i < 500; i += 7) {
+		sprintf(name, "sorted/%04u", i);
+		assert(fstree_add_generic(&fs, name, &sb, NULL) == NULL);
+		assert(errno == EEXIST);
+	}
+
+	/* but they are once a name was added out of order */
+	assert(fstree_add_generic(&fs, "mixed/b", &sb, NULL) != NULL);
+	assert(fstree_add_generic(&fs, "mixed/c", &sb, NULL) != NULL);
+	assert(fstree_add_generic(&fs, "mixed/a", &sb, NULL) != NULL);
+	assert(fstree_add_generic(&fs, "mixed/b", &sb, NULL) == NULL);
+	assert(errno == EEXIST);
+
 	fstree_cleanup(&fs);
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,251 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * compressor.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "sqfs/compressor.h"
+#include "sqfs/super.h"
+#include "sqfs/error.h"
+
+#include <stdbool.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#define BLK_SZ (16384)
+#define NUM_BLOCKS (4)
+#define ROUNDS (3)
+
+/* LZO cannot stop early and needs room for the worst case */
+#define OUT_SZ (2 * BLK_SZ)
+
+static sqfs_u8 blocks[NUM_BLOCKS][BLK_SZ];
+
+/*
+  Text like blocks with different contents, a block that does not compress
+  and one of zeros, so a backend that keeps its context between blocks gets
+  to see each kind after the others.
+ */
+static void init_blocks(void)
+{
+	static const char *words[] = {
+		"squashfs", "inode", "fragment", "block", "directory",
+		"compressor", "xattr", "table", "super", "export",
+	};
+	sqfs_u32 state = 0x12345678;
+	size_t i, j, len;
+
+	for (i = 0; i < 2; ++i) {
+		for (j = 0; j < BLK_SZ; j += len) {
+			state = state * 1103515245 + 12345;
+			len = strlen(words[(state >> 16) % 10]);
+
+			if (len > BLK_SZ - j)
+				len = BLK_SZ - j;
+
+			memcpy(blocks[i] + j, words[(state >> 16) % 10], len);
+		}
+	}
+
+	for (j = 0; j < BLK_SZ; ++j) {
+		state = state * 1103515245 + 12345;
+		blocks[2][j] = state >> 24;
+	}
+
+	memset(blocks[3], 0, BLK_SZ);
+}
+
+/* counts the outstanding allocations of the work buffer pools */
+static size_t alloc_count;
+
+static void *count_alloc(void *user, size_t size)
+{
+	(void)user;
+	alloc_count += 1;
+	return malloc(size);
+}
+
+static void count_free(void *user, void *ptr)
+{
+	(void)user;
+	assert(alloc_count > 0);
+	alloc_count -= 1;
+	free(ptr);
+}
+
+static const sqfs_allocator_t counter = {
+	.alloc = count_alloc,
+	.free = count_free,
+};
+
+static sqfs_compressor_t *create(E_SQFS_COMPRESSOR id, sqfs_u16 flags)
+{
+	sqfs_compressor_config_t cfg;
+	sqfs_compressor_t *cmp;
+
+	assert(sqfs_compressor_config_init(&cfg, id, BLK_SZ, flags) == 0);
+	cfg.allocator = &counter;
+
+	cmp = sqfs_compressor_create(&cfg);
+	assert(cmp != NULL);
+	return cmp;
+}
+
+static sqfs_s32 pack(sqfs_compressor_t *cmp, size_t idx, sqfs_u8 *out)
+{
+	sqfs_s32 ret;
+
+	cmp->method_hint = 0;
+	ret = cmp->do_block(cmp, blocks[idx], BLK_SZ, out, OUT_SZ);
+	assert(ret >= 0 && ret < BLK_SZ);
+
+	/* only random data is kept as is */
+	assert((ret == 0) == (idx == 2));
+	return ret;
+}
+
+static void unpack(sqfs_compressor_t *uncmp, size_t idx,
+		   const sqfs_u8 *in, sqfs_s32 size)
+{
+	sqfs_u8 out[BLK_SZ];
+
+	assert(uncmp->do_block(uncmp, in, size, out, sizeof(out)) == BLK_SZ);
+	assert(memcmp(out, blocks[idx], BLK_SZ) == 0);
+}
+
+/*
+  None of the built-in compressors take batches, so they are processed one
+  block at a time and the results have to be the same as without a batch.
+ */
+static void test_batch(sqfs_compressor_t *cmp, sqfs_compressor_t *uncmp,
+		       const sqfs_s32 *sizes,
+		       sqfs_u8 first[NUM_BLOCKS][OUT_SZ])
+{
+	static sqfs_u8 out[NUM_BLOCKS][OUT_SZ];
+	static sqfs_u8 data[NUM_BLOCKS][BLK_SZ];
+	sqfs_compressor_job_t jobs[NUM_BLOCKS];
+	size_t i, count = 0;
+
+	assert(cmp->do_blocks == NULL && uncmp->do_blocks == NULL);
+
+	memset(jobs, 0, sizeof(jobs));
+
+	for (i = 0; i < NUM_BLOCKS; ++i) {
+		jobs[i].in = blocks[NUM_BLOCKS - 1 - i];
+		jobs[i].out = out[i];
+		jobs[i].size = BLK_SZ;
+		jobs[i].outsize = OUT_SZ;
+		jobs[i].result = -1;
+	}
+
+	assert(sqfs_compressor_do_blocks(cmp, jobs, NUM_BLOCKS) == 0);
+
+	for (i = 0; i < NUM_BLOCKS; ++i) {
+		size_t idx = NUM_BLOCKS - 1 - i;
+
+		assert(jobs[i].result == sizes[idx]);
+		assert(jobs[i].method == 0);
+		assert(memcmp(out[i], first[idx], sizes[idx]) == 0);
+	}
+
+	/* the blocks that compressed are unpacked as a batch as well */
+	for (i = 0; i < NUM_BLOCKS; ++i) {
+		size_t idx = NUM_BLOCKS - 1 - i;
+
+		if (sizes[idx] == 0)
+			continue;
+
+		jobs[count].in = first[idx];
+		jobs[count].out = data[count];
+		jobs[count].size = sizes[idx];
+		jobs[count].outsize = BLK_SZ;
+		jobs[count].result = -1;
+		++count;
+	}
+
+	assert(sqfs_compressor_do_blocks(uncmp, jobs, count) == 0);
+
+	for (i = 0, count = 0; i < NUM_BLOCKS; ++i) {
+		size_t idx = NUM_BLOCKS - 1 - i;
+
+		if (sizes[idx] == 0)
+			continue;
+
+		assert(jobs[count].result == BLK_SZ);
+		assert(memcmp(data[count], blocks[idx], BLK_SZ) == 0);
+		++count;
+	}
+}
+
+static void test_compressor(E_SQFS_COMPRESSOR id)
+{
+	sqfs_compressor_t *cmp, *copy, *uncmp, *uncopy;
+	static sqfs_u8 first[NUM_BLOCKS][OUT_SZ];
+	sqfs_s32 sizes[NUM_BLOCKS], ret;
+	static sqfs_u8 out[OUT_SZ];
+	size_t i, round;
+
+	cmp = create(id, 0);
+	uncmp = create(id, SQFS_COMP_FLAG_UNCOMPRESS);
+
+	for (i = 0; i < NUM_BLOCKS; ++i) {
+		sizes[i] = pack(cmp, i, first[i]);
+		if (sizes[i] > 0)
+			unpack(uncmp, i, first[i], sizes[i]);
+	}
+
+	copy = cmp->create_copy(cmp);
+	uncopy = uncmp->create_copy(uncmp);
+	assert(copy != NULL && uncopy != NULL);
+	assert(copy->do_blocks == NULL && uncopy->do_blocks == NULL);
+
+	/*
+	  A context that is reused must not carry anything over from the
+	  previous blocks, so the results are the same in every order.
+	 */
+	for (round = 0; round < ROUNDS; ++round) {
+		for (i = 0; i < NUM_BLOCKS; ++i) {
+			size_t idx = (i + round) % NUM_BLOCKS;
+			sqfs_compressor_t *c = (i % 2) ? copy : cmp;
+			sqfs_compressor_t *u = (i % 2) ? uncmp : uncopy;
+
+			ret = pack(c, idx, out);
+			assert(ret == sizes[idx]);
+			assert(memcmp(out, first[idx], ret) == 0);
+
+			if (ret > 0)
+				unpack(u, idx, out, ret);
+		}
+	}
+
+	test_batch(cmp, uncmp, sizes, first);
+
+	cmp->destroy(cmp);
+	copy->destroy(copy);
+	uncmp->destroy(uncmp);
+	uncopy->destroy(uncopy);
+
+	/* everything taken from the allocator has been given back */
+	assert(alloc_count == 0);
+}
+
+int main(void)
+{
+	E_SQFS_COMPRESSOR id;
+
+	init_blocks();
+
+	for (id = SQFS_COMP_MIN; id <= SQFS_COMP_MAX; ++id) {
+		if (!sqfs_compressor_exists(id))
+			continue;
+
+		printf("%s\n", sqfs_compressor_name_from_id(id));
+		test_compressor(id);
+	}
+
+	return EXIT_SUCCESS;
+}
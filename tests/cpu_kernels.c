@@ -0,0 +1,130 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * cpu_kernels.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "util/util.h"
+#include "util/cpu.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+static const char *b64_alphabet =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static const unsigned int levels[] = {
+	0,
+	CPU_FEATURE_SSE2,
+	CPU_FEATURE_SSE2 | CPU_FEATURE_SSSE3,
+	~0U,
+};
+
+static sqfs_u8 buffer[1024 + 1];
+
+static void check_is_zero(const cpu_kernels_t *k)
+{
+	size_t size, i;
+
+	memset(buffer, 0, sizeof(buffer));
+
+	for (size = 0; size < sizeof(buffer); size += 7) {
+		assert(k->is_zero(buffer + 1, size));
+
+		for (i = 0; i < size; ++i) {
+			buffer[1 + i] = 0x80;
+			assert(!k->is_zero(buffer + 1, size));
+			buffer[1 + i] = 0;
+		}
+
+		/* just outside of the range */
+		buffer[0] = buffer[1 + size] = 0xFF;
+		assert(k->is_zero(buffer + 1, size));
+		buffer[0] = buffer[1 + size] = 0;
+	}
+}
+
+static void check_byte_sum(const cpu_kernels_t *k)
+{
+	size_t size, i;
+	sqfs_u32 sum;
+
+	for (i = 0; i < sizeof(buffer); ++i)
+		buffer[i] = (i * 7919) ^ (i >> 3);
+
+	for (size = 0; size < sizeof(buffer); size += 3) {
+		for (sum = 0, i = 0; i < size; ++i)
+			sum += buffer[1 + i];
+
+		assert(k->byte_sum(buffer + 1, size) == sum);
+	}
+
+	memset(buffer, 0xFF, sizeof(buffer));
+	assert(k->byte_sum(buffer, sizeof(buffer)) == 0xFF * sizeof(buffer));
+}
+
+static void check_base64(const cpu_kernels_t *k)
+{
+	sqfs_u8 out[3 * 32];
+	char in[4 * 32 + 1];
+	size_t i, j, done;
+	sqfs_u32 x;
+
+	for (i = 0; i < sizeof(in) - 1; ++i)
+		in[i] = b64_alphabet[(i * 37) % 64];
+	in[sizeof(in) - 1] = '\0';
+
+	for (i = 0; i <= sizeof(in) - 1; i += 4) {
+		memset(out, 0, sizeof(out));
+		done = k->base64_decode(out, in, i);
+
+		assert(done <= i && (done % 4) == 0);
+
+		for (j = 0; j < done; j += 4) {
+			x = ((strchr(b64_alphabet, in[j]) - b64_alphabet) << 18) |
+			((strchr(b64_alphabet, in[j + 1]) - b64_alphabet) << 12) |
+			((strchr(b64_alphabet, in[j + 2]) - b64_alphabet) << 6) |
+			(strchr(b64_alphabet, in[j + 3]) - b64_alphabet);
+
+			assert(out[j / 4 * 3] == ((x >> 16) & 0xFF));
+			assert(out[j / 4 * 3 + 1] == ((x >> 8) & 0xFF));
+			assert(out[j / 4 * 3 + 2] == (x & 0xFF));
+		}
+
+		/* nothing written past the decoded data */
+		for (j = done / 4 * 3; j < sizeof(out); ++j)
+			assert(out[j] == 0);
+	}
+
+	/* must stop in front of anything outside the standard alphabet */
+	in[20] = '=';
+	done = k->base64_decode(out, in, sizeof(in) - 1);
+	assert(done <= 20);
+
+	in[20] = '-';
+	done = k->base64_decode(out, in, sizeof(in) - 1);
+	assert(done <= 20);
+}
+
+int main(void)
+{
+	unsigned int features = cpu_features();
+	cpu_kernels_t k;
+	size_t i;
+
+	for (i = 0; i < sizeof(levels) / sizeof(levels[0]); ++i) {
+		cpu_kernels_select(&k, levels[i] & features);
+
+		check_is_zero(&k);
+		check_byte_sum(&k);
+		check_base64(&k);
+	}
+
+	check_is_zero(&cpu_kernels);
+	check_byte_sum(&cpu_kernels);
+	check_base64(&cpu_kernels);
+	return EXIT_SUCCESS;
+}
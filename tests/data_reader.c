@@ -0,0 +1,361 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * data_reader.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+#include "test.h"
+
+#include "sqfs/data_reader.h"
+#include "sqfs/compressor.h"
+#include "sqfs/super.h"
+#include "sqfs/inode.h"
+#include "sqfs/block.h"
+#include "sqfs/table.h"
+#include "sqfs/error.h"
+#include "sqfs/io.h"
+#include "util/compat.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define BLK_SZ (4096)
+#define UNCOMPRESSED (1 << 24)
+
+enum {
+	FILE_A = 1,
+	FILE_B,
+};
+
+static sqfs_u8 image_data[64 * BLK_SZ];
+static dummy_file_t image;
+static sqfs_super_t super;
+static sqfs_inode_generic_t *file_a, *file_b;
+
+static sqfs_u8 content(int id, sqfs_u64 pos)
+{
+	return (pos * 7 + id * 31 + pos / BLK_SZ) & 0xFF;
+}
+
+static sqfs_u64 append_content(int id, sqfs_u64 pos, size_t size)
+{
+	sqfs_u64 start = image.size;
+	size_t i;
+
+	for (i = 0; i < size; ++i)
+		image_data[start + i] = content(id, pos + i);
+
+	image.size += size;
+	return start;
+}
+
+static sqfs_inode_generic_t *make_file(sqfs_u64 start, const sqfs_u32 *sizes,
+				       size_t count, sqfs_u32 file_size,
+				       sqfs_u32 frag_idx, sqfs_u32 frag_off)
+{
+	sqfs_inode_generic_t *inode;
+
+	inode = calloc(1, sizeof(*inode) + count * sizeof(sizes[0]));
+	assert(inode != NULL);
+
+	inode->base.type = SQFS_INODE_FILE;
+	inode->block_sizes = (sqfs_u32 *)inode->extra;
+	inode->num_file_blocks = count;
+	memcpy(inode->block_sizes, sizes, count * sizeof(sizes[0]));
+
+	inode->data.file.blocks_start = start;
+	inode->data.file.file_size = file_size;
+	inode->data.file.fragment_index = frag_idx;
+	inode->data.file.fragment_offset = frag_off;
+	return inode;
+}
+
+/*
+  A has 5 blocks, the one in the middle sparse, and a tail end of 100 bytes
+  in fragment 0. B has 2 blocks and a tail end of 300 bytes in fragment 1.
+ */
+static void make_image(void)
+{
+	sqfs_u32 sizes_a[5], sizes_b[2];
+	sqfs_u64 start_a, start_b, pos;
+	sqfs_fragment_t frag[2];
+	size_t i;
+
+	dummy_file_init(&image, image_data, 96, sizeof(image_data));
+
+	start_a = append_content(FILE_A, 0, 2 * BLK_SZ);
+	append_content(FILE_A, 3 * BLK_SZ, 2 * BLK_SZ);
+
+	for (i = 0; i < 5; ++i)
+		sizes_a[i] = BLK_SZ | UNCOMPRESSED;
+	sizes_a[2] = 0;
+
+	pos = append_content(FILE_A, 5 * BLK_SZ, 100);
+	frag[0].start_offset = htole64(pos);
+	frag[0].size = htole32(100 | UNCOMPRESSED);
+	frag[0].pad0 = 0;
+
+	start_b = append_content(FILE_B, 0, 2 * BLK_SZ);
+	sizes_b[0] = BLK_SZ | UNCOMPRESSED;
+	sizes_b[1] = BLK_SZ | UNCOMPRESSED;
+
+	pos = append_content(FILE_B, 2 * BLK_SZ, 300);
+	frag[1].start_offset = htole64(pos);
+	frag[1].size = htole32(300 | UNCOMPRESSED);
+	frag[1].pad0 = 0;
+
+	memset(&super, 0, sizeof(super));
+	super.directory_table_start = image.size;
+	super.fragment_entry_count = 2;
+	assert(sqfs_write_table(&image.base, &dummy_cmp, frag, sizeof(frag),
+				&super.fragment_table_start) == 0);
+	super.bytes_used = image.size;
+
+	file_a = make_file(start_a, sizes_a, 5, 5 * BLK_SZ + 100, 0, 0);
+	file_b = make_file(start_b, sizes_b, 2, 2 * BLK_SZ + 300, 1, 0);
+}
+
+static int file_id(const sqfs_inode_generic_t *inode)
+{
+	return inode == file_a ? FILE_A : FILE_B;
+}
+
+static void check_content(const sqfs_inode_generic_t *inode, sqfs_u64 pos,
+			  const sqfs_u8 *data, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; ++i) {
+		if (inode == file_a && (pos + i) / BLK_SZ == 2) {
+			assert(data[i] == 0);
+		} else {
+			assert(data[i] == content(file_id(inode), pos + i));
+		}
+	}
+}
+
+/* peek a block and return the number of times the image was read */
+static size_t peek(sqfs_data_reader_t *rd, const sqfs_inode_generic_t *inode,
+		   size_t index)
+{
+	size_t count = image.num_reads, size;
+	const void *ptr;
+
+	assert(sqfs_data_reader_peek_block(rd, inode, index, &ptr,
+					   &size) == 0);
+	assert(size == BLK_SZ);
+	check_content(inode, index * BLK_SZ, ptr, size);
+
+	return image.num_reads - count;
+}
+
+static size_t peek_frag(sqfs_data_reader_t *rd,
+			const sqfs_inode_generic_t *inode)
+{
+	size_t count = image.num_reads, size;
+	sqfs_u64 filesz;
+	const void *ptr;
+
+	sqfs_inode_get_file_size(inode, &filesz);
+
+	assert(sqfs_data_reader_peek_fragment(rd, inode, &ptr, &size) == 0);
+	assert(size == filesz % BLK_SZ);
+	check_content(inode, filesz - size, ptr, size);
+
+	return image.num_reads - count;
+}
+
+static sqfs_data_reader_t *create_reader(size_t cache_size)
+{
+	sqfs_data_reader_t *rd;
+
+	rd = sqfs_data_reader_create(&image.base, BLK_SZ, &dummy_cmp,
+				     cache_size);
+	assert(rd != NULL);
+	assert(sqfs_data_reader_load_fragment_table(rd, &super) == 0);
+	return rd;
+}
+
+/* with a cache size of 0, the two most recently used blocks are kept */
+static void test_lru(void)
+{
+	sqfs_data_reader_t *rd = create_reader(0);
+
+	assert(peek(rd, file_a, 0) == 1);
+	assert(peek(rd, file_a, 0) == 0);
+	assert(peek(rd, file_a, 1) == 1);
+
+	/* touch block 0, so block 1 is the least recently used one */
+	assert(peek(rd, file_a, 0) == 0);
+	assert(peek(rd, file_a, 3) == 1);
+	assert(peek(rd, file_a, 0) == 0);
+	assert(peek(rd, file_a, 1) == 1);
+	assert(peek(rd, file_a, 3) == 1);
+
+	sqfs_data_reader_destroy(rd);
+}
+
+/* fragment blocks are not thrown out by reading data blocks */
+static void test_fragment_cache(void)
+{
+	sqfs_data_reader_t *rd = create_reader(0);
+
+	assert(peek_frag(rd, file_a) == 1);
+	assert(peek_frag(rd, file_b) == 1);
+
+	assert(peek(rd, file_a, 0) == 1);
+	assert(peek(rd, file_a, 1) == 1);
+	assert(peek(rd, file_a, 3) == 1);
+	assert(peek(rd, file_b, 0) == 1);
+
+	assert(peek_frag(rd, file_a) == 0);
+	assert(peek_frag(rd, file_b) == 0);
+
+	sqfs_data_reader_destroy(rd);
+}
+
+/*
+  The block locations are computed once per file. Switching between files
+  and going backwards must not mix them up, the sparse block has no space
+  on disk and shifts the blocks after it.
+ */
+static void test_offsets(void)
+{
+	sqfs_data_reader_t *rd = create_reader(0);
+	size_t size, count;
+	const void *ptr;
+
+	assert(peek(rd, file_a, 4) == 1);
+	assert(peek(rd, file_b, 1) == 1);
+	assert(peek(rd, file_a, 3) == 1);
+	assert(peek(rd, file_b, 0) == 1);
+	assert(peek(rd, file_a, 0) == 1);
+
+	/* sparse blocks are never read or cached */
+	count = image.num_reads;
+	assert(sqfs_data_reader_peek_block(rd, file_a, 2, &ptr, &size) == 0);
+	assert(size == BLK_SZ);
+	check_content(file_a, 2 * BLK_SZ, ptr, size);
+	assert(image.num_reads == count);
+
+	assert(sqfs_data_reader_peek_block(rd, file_a, 5, &ptr,
+					   &size) == SQFS_ERROR_OUT_OF_BOUNDS);
+
+	sqfs_data_reader_destroy(rd);
+}
+
+/* whole blocks that are not cached are read straight into the buffer */
+static void test_read(void)
+{
+	sqfs_data_reader_t *rd = create_reader(0);
+	sqfs_u8 buffer[2 * BLK_SZ];
+	size_t count;
+
+	count = image.num_reads;
+	assert(sqfs_data_reader_read(rd, file_b, 0, buffer,
+				     BLK_SZ) == BLK_SZ);
+	check_content(file_b, 0, buffer, BLK_SZ);
+	assert(image.num_reads == count + 1);
+
+	/* so it is not in the cache afterwards */
+	assert(peek(rd, file_b, 0) == 1);
+
+	/* but a cached block is used */
+	count = image.num_reads;
+	assert(sqfs_data_reader_read(rd, file_b, 0, buffer,
+				     BLK_SZ) == BLK_SZ);
+	check_content(file_b, 0, buffer, BLK_SZ);
+	assert(image.num_reads == count);
+
+	/* across a block boundary, into the tail end */
+	assert(sqfs_data_reader_read(rd, file_b, BLK_SZ + 100, buffer,
+				     sizeof(buffer)) == BLK_SZ + 200);
+	check_content(file_b, BLK_SZ + 100, buffer, BLK_SZ + 200);
+
+	/* through the sparse block of A */
+	assert(sqfs_data_reader_read(rd, file_a, BLK_SZ + 10, buffer,
+				     sizeof(buffer)) == sizeof(buffer));
+	check_content(file_a, BLK_SZ + 10, buffer, sizeof(buffer));
+
+	sqfs_data_reader_destroy(rd);
+}
+
+/* copies share the cache, and it outlives the original */
+static void test_copy(void)
+{
+	sqfs_data_reader_t *rd = create_reader(64 * BLK_SZ), *copy;
+	size_t i;
+
+	for (i = 0; i < 2; ++i)
+		assert(peek(rd, file_b, i) == 1);
+	assert(peek_frag(rd, file_b) == 1);
+
+	copy = sqfs_data_reader_create_copy(rd);
+	assert(copy != NULL);
+
+	for (i = 0; i < 2; ++i)
+		assert(peek(copy, file_b, i) == 0);
+	assert(peek_frag(copy, file_b) == 0);
+
+	/* and what the copy reads in is there for the original */
+	assert(peek(copy, file_a, 0) == 1);
+	assert(peek(rd, file_a, 0) == 0);
+
+	sqfs_data_reader_destroy(rd);
+
+	assert(peek(copy, file_a, 0) == 0);
+	assert(peek(copy, file_a, 1) == 1);
+
+	sqfs_data_reader_destroy(copy);
+}
+
+/* reading files sequentially gets the same data with read ahead enabled */
+static void test_readahead(void)
+{
+	sqfs_data_reader_t *rd = create_reader(0);
+	sqfs_u8 buffer[BLK_SZ];
+	sqfs_u64 pos, filesz;
+	sqfs_s32 ret;
+
+	assert(sqfs_data_reader_set_readahead(rd, 2, 4) == 0);
+	assert(sqfs_data_reader_queue_file(rd, file_a) == 0);
+	assert(sqfs_data_reader_queue_file(rd, file_b) == 0);
+
+	sqfs_inode_get_file_size(file_a, &filesz);
+
+	for (pos = 0; pos < filesz; pos += ret) {
+		ret = sqfs_data_reader_read(rd, file_a, pos, buffer,
+					    sizeof(buffer));
+		assert(ret > 0);
+		check_content(file_a, pos, buffer, ret);
+	}
+
+	sqfs_inode_get_file_size(file_b, &filesz);
+
+	for (pos = 0; pos < filesz; pos += ret) {
+		ret = sqfs_data_reader_read(rd, file_b, pos, buffer,
+					    sizeof(buffer));
+		assert(ret > 0);
+		check_content(file_b, pos, buffer, ret);
+	}
+
+	sqfs_data_reader_destroy(rd);
+}
+
+int main(void)
+{
+	make_image();
+
+	test_lru();
+	test_fragment_cache();
+	test_offsets();
+	test_read();
+	test_copy();
+	test_readahead();
+
+	free(file_a);
+	free(file_b);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,298 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * data_reader_batch.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+#include "test.h"
+
+#include "sqfs/data_reader.h"
+#include "sqfs/compressor.h"
+#include "sqfs/super.h"
+#include "sqfs/inode.h"
+#include "sqfs/block.h"
+#include "sqfs/table.h"
+#include "sqfs/error.h"
+#include "sqfs/io.h"
+#include "util/compat.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define BLK_SZ (4096)
+#define UNCOMPRESSED (1 << 24)
+#define NO_FRAGMENT (0xFFFFFFFF)
+
+#define MAX_READS (64)
+
+enum {
+	FILE_A = 0,
+	FILE_B,
+	FILE_D,
+	NUM_CONTENTS,
+};
+
+/* records where the data reader reads from */
+static sqfs_file_t *image;
+static sqfs_u64 reads[MAX_READS];
+static size_t num_reads;
+
+static int log_read_at(sqfs_file_t *file, sqfs_u64 offset,
+		       void *buffer, size_t size)
+{
+	(void)file;
+	assert(num_reads < MAX_READS);
+	reads[num_reads++] = offset;
+	return image->read_at(image, offset, buffer, size);
+}
+
+static int log_write_at(sqfs_file_t *file, sqfs_u64 offset,
+			const void *buffer, size_t size)
+{
+	(void)file;
+	return image->write_at(image, offset, buffer, size);
+}
+
+static sqfs_u64 log_get_size(const sqfs_file_t *file)
+{
+	(void)file;
+	return image->get_size(image);
+}
+
+static sqfs_file_t log_file = {
+	.read_at = log_read_at,
+	.write_at = log_write_at,
+	.get_size = log_get_size,
+};
+
+static sqfs_u8 content(int id, sqfs_u64 pos)
+{
+	return (pos * 7 + id * 31 + pos / BLK_SZ) & 0xFF;
+}
+
+static sqfs_u64 append(const void *data, size_t size)
+{
+	sqfs_u64 start = image->get_size(image);
+
+	assert(image->write_at(image, start, data, size) == 0);
+	return start;
+}
+
+static sqfs_u64 append_content(int id, sqfs_u64 pos, size_t size)
+{
+	sqfs_u8 buffer[BLK_SZ];
+	size_t i;
+
+	for (i = 0; i < size; ++i)
+		buffer[i] = content(id, pos + i);
+
+	return append(buffer, size);
+}
+
+static sqfs_inode_generic_t *make_file(sqfs_u64 start, const sqfs_u32 *sizes,
+				       size_t count, sqfs_u32 file_size,
+				       sqfs_u32 frag_idx, sqfs_u32 frag_off)
+{
+	sqfs_inode_generic_t *inode;
+
+	inode = calloc(1, sizeof(*inode) + count * sizeof(sizes[0]));
+	assert(inode != NULL);
+
+	inode->base.type = SQFS_INODE_FILE;
+	inode->block_sizes = (sqfs_u32 *)inode->extra;
+	inode->num_file_blocks = count;
+	memcpy(inode->block_sizes, sizes, count * sizeof(sizes[0]));
+
+	inode->data.file.blocks_start = start;
+	inode->data.file.file_size = file_size;
+	inode->data.file.fragment_index = frag_idx;
+	inode->data.file.fragment_offset = frag_off;
+	return inode;
+}
+
+/* what a request should get, filled in by the callback */
+typedef struct {
+	int id;
+	sqfs_u64 zero_start;
+	sqfs_u64 zero_end;
+	sqfs_u64 expect;
+	sqfs_u64 got;
+} result_t;
+
+static size_t num_calls;
+
+static int check_data(void *user, const sqfs_data_request_t *req,
+		      sqfs_u64 offset, const void *data, size_t size)
+{
+	const sqfs_u8 *ptr = data;
+	result_t *res = req->user;
+	size_t i;
+
+	assert(user == &num_calls);
+	num_calls += 1;
+
+	assert(size > 0 && size <= BLK_SZ);
+	assert(offset >= req->offset);
+	assert(offset + size <= req->offset + res->expect);
+
+	for (i = 0; i < size; ++i) {
+		if (offset + i >= res->zero_start &&
+		    offset + i < res->zero_end) {
+			assert(ptr[i] == 0);
+		} else {
+			assert(ptr[i] == content(res->id, offset + i));
+		}
+	}
+
+	res->got += size;
+	return 0;
+}
+
+static int stop_early(void *user, const sqfs_data_request_t *req,
+		      sqfs_u64 offset, const void *data, size_t size)
+{
+	(void)user; (void)req; (void)offset; (void)data; (void)size;
+	return 42;
+}
+
+int main(void)
+{
+	sqfs_u32 sizes_a[3], sizes_b[3];
+	sqfs_inode_generic_t *a, *b, *c, *d;
+	sqfs_u64 start_a, start_b, pos;
+	sqfs_data_request_t reqs[7];
+	sqfs_fragment_t frag[2];
+	sqfs_data_reader_t *rd;
+	result_t res[7];
+	sqfs_super_t super;
+	sqfs_u8 pad[96];
+	size_t i;
+
+	image = sqfs_create_memory_file(0);
+	assert(image != NULL);
+
+	memset(pad, 0, sizeof(pad));
+	append(pad, sizeof(pad));
+
+	/* three blocks and a tail end of 100 bytes */
+	start_a = append_content(FILE_A, 0, BLK_SZ);
+	append_content(FILE_A, BLK_SZ, BLK_SZ);
+	append_content(FILE_A, 2 * BLK_SZ, BLK_SZ);
+
+	for (i = 0; i < 3; ++i)
+		sizes_a[i] = BLK_SZ | UNCOMPRESSED;
+
+	/* the tail ends of A and B, stored before the blocks of B */
+	pos = append_content(FILE_A, 3 * BLK_SZ, 100);
+	append_content(FILE_B, 3 * BLK_SZ, 200);
+	frag[0].start_offset = htole64(pos);
+	frag[0].size = htole32(300 | UNCOMPRESSED);
+	frag[0].pad0 = 0;
+
+	/* a block, a hole, another block and a tail end of 200 bytes */
+	start_b = append_content(FILE_B, 0, BLK_SZ);
+	append_content(FILE_B, 2 * BLK_SZ, BLK_SZ);
+	sizes_b[0] = BLK_SZ | UNCOMPRESSED;
+	sizes_b[1] = 0;
+	sizes_b[2] = BLK_SZ | UNCOMPRESSED;
+
+	/* a file that is only a tail end */
+	pos = append_content(FILE_D, 0, 50);
+	frag[1].start_offset = htole64(pos);
+	frag[1].size = htole32(50 | UNCOMPRESSED);
+	frag[1].pad0 = 0;
+
+	memset(&super, 0, sizeof(super));
+	super.directory_table_start = image->get_size(image);
+	super.fragment_entry_count = 2;
+	assert(sqfs_write_table(image, &dummy_cmp, frag, sizeof(frag),
+				&super.fragment_table_start) == 0);
+	super.bytes_used = image->get_size(image);
+
+	a = make_file(start_a, sizes_a, 3, 3 * BLK_SZ + 100, 0, 0);
+	b = make_file(start_b, sizes_b, 3, 3 * BLK_SZ + 200, 0, 100);
+	d = make_file(0, NULL, 0, 50, 1, 0);
+
+	/* the same data as A, without the tail end */
+	c = make_file(start_a, sizes_a, 3, 3 * BLK_SZ, NO_FRAGMENT, 0);
+
+	rd = sqfs_data_reader_create(&log_file, BLK_SZ, &dummy_cmp, 0);
+	assert(rd != NULL);
+	assert(sqfs_data_reader_load_fragment_table(rd, &super) == 0);
+
+	memset(reqs, 0, sizeof(reqs));
+	memset(res, 0, sizeof(res));
+
+	reqs[0].inode = a;
+	reqs[0].size = ~((sqfs_u64)0);
+	res[0].id = FILE_A;
+	res[0].expect = 3 * BLK_SZ + 100;
+
+	reqs[1].inode = c;
+	reqs[1].size = ~((sqfs_u64)0);
+	res[1].id = FILE_A;
+	res[1].expect = 3 * BLK_SZ;
+
+	reqs[2].inode = b;
+	reqs[2].offset = 4000;
+	reqs[2].size = 5000;
+	res[2].id = FILE_B;
+	res[2].zero_start = BLK_SZ;
+	res[2].zero_end = 2 * BLK_SZ;
+	res[2].expect = 5000;
+
+	reqs[3].inode = d;
+	reqs[3].size = 1000;
+	res[3].id = FILE_D;
+	res[3].expect = 50;
+
+	reqs[4].inode = a;
+	reqs[4].offset = 12000;
+	reqs[4].size = 1000;
+	res[4].id = FILE_A;
+	res[4].expect = 3 * BLK_SZ + 100 - 12000;
+
+	reqs[5].inode = b;
+	reqs[5].offset = 3 * BLK_SZ + 12;
+	reqs[5].size = ~((sqfs_u64)0);
+	res[5].id = FILE_B;
+	res[5].expect = 200 - 12;
+
+	reqs[6].inode = a;
+	reqs[6].offset = 20000;
+	reqs[6].size = 10;
+	res[6].id = FILE_A;
+	res[6].expect = 0;
+
+	for (i = 0; i < 7; ++i)
+		reqs[i].user = res + i;
+
+	num_reads = 0;
+	assert(sqfs_data_reader_read_batch(rd, reqs, 7, check_data,
+					   &num_calls) == 0);
+
+	for (i = 0; i < 7; ++i)
+		assert(res[i].got == res[i].expect);
+
+	/* 4 + 3 + 3 (with the hole) + 1 + 2 + 1 */
+	assert(num_calls == 14);
+
+	/* every block is read once, front to back */
+	assert(num_reads == 7);
+
+	for (i = 1; i < num_reads; ++i)
+		assert(reads[i] > reads[i - 1]);
+
+	assert(sqfs_data_reader_read_batch(rd, reqs, 7, stop_early,
+					   NULL) == 42);
+
+	sqfs_data_reader_destroy(rd);
+	free(a);
+	free(b);
+	free(c);
+	free(d);
+	image->destroy(image);
+	return EXIT_SUCCESS;
+}
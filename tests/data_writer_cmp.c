@@ -0,0 +1,241 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * data_writer_cmp.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+#include "test.h"
+
+#include "sqfs/data_writer.h"
+#include "sqfs/compressor.h"
+#include "sqfs/block.h"
+#include "sqfs/inode.h"
+#include "sqfs/super.h"
+#include "sqfs/error.h"
+#include "sqfs/io.h"
+
+#include <stdbool.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLK_SZ (4096)
+#define MAX_BLOCKS (4)
+#define TAG (0xB5)
+
+/*
+  "Compresses" every block to a single tag byte. Like the dummy compressor,
+  it has no state and the single worker of the data writer shares it.
+ */
+static size_t tag_calls;
+
+static sqfs_s32 tag_do_block(sqfs_compressor_t *cmp, const sqfs_u8 *in,
+			     sqfs_u32 size, sqfs_u8 *out, sqfs_u32 outsize)
+{
+	(void)cmp; (void)in;
+	assert(size > 1 && outsize >= 1);
+	out[0] = TAG;
+	tag_calls += 1;
+	return 1;
+}
+
+static sqfs_compressor_t *tag_create_copy(sqfs_compressor_t *cmp)
+{
+	return cmp;
+}
+
+static void tag_destroy(sqfs_compressor_t *cmp)
+{
+	(void)cmp;
+}
+
+static sqfs_compressor_t tag_cmp = {
+	.do_block = tag_do_block,
+	.create_copy = tag_create_copy,
+	.destroy = tag_destroy,
+};
+
+static sqfs_data_writer_t *create_writer(sqfs_file_t *out)
+{
+	sqfs_data_writer_t *wr;
+
+	wr = sqfs_data_writer_create(BLK_SZ, &dummy_cmp, 1, 4, 4, 0, out, 0);
+	assert(wr != NULL);
+	return wr;
+}
+
+static sqfs_inode_generic_t *begin_file(sqfs_data_writer_t *wr)
+{
+	sqfs_inode_generic_t *inode;
+
+	inode = calloc(1, sizeof(*inode) + MAX_BLOCKS * sizeof(sqfs_u32));
+	assert(inode != NULL);
+
+	inode->block_sizes = (sqfs_u32 *)inode->extra;
+	inode->base.type = SQFS_INODE_FILE;
+	sqfs_inode_set_frag_location(inode, 0xFFFFFFFF, 0xFFFFFFFF);
+
+	assert(sqfs_data_writer_begin_file(wr, inode, 0) == 0);
+	return inode;
+}
+
+/* two blocks and a tail end, with contents unique to the file */
+static void end_file(sqfs_data_writer_t *wr, sqfs_inode_generic_t *inode,
+		     int id)
+{
+	size_t i, size = 2 * BLK_SZ + 100;
+	sqfs_u8 *data;
+
+	sqfs_inode_set_file_size(inode, size);
+
+	data = malloc(size);
+	assert(data != NULL);
+
+	for (i = 0; i < size; ++i)
+		data[i] = (i * 13 + id * 101 + i / 251 + 1) & 0xFF;
+
+	assert(sqfs_data_writer_append(wr, data, size) == 0);
+	assert(sqfs_data_writer_end_file(wr) == 0);
+	free(data);
+}
+
+/* check which compressor the data blocks of a file went through */
+static void check_file(sqfs_file_t *out,
+		       const sqfs_inode_generic_t *inode, bool tagged)
+{
+	sqfs_u64 offset;
+	sqfs_u32 i, size;
+	sqfs_u8 byte;
+
+	assert(inode->num_file_blocks == 2);
+	sqfs_inode_get_file_block_start(inode, &offset);
+
+	for (i = 0; i < inode->num_file_blocks; ++i) {
+		size = inode->block_sizes[i];
+
+		if (tagged) {
+			assert(SQFS_IS_BLOCK_COMPRESSED(size));
+			assert(SQFS_ON_DISK_BLOCK_SIZE(size) == 1);
+
+			byte = 0;
+			assert(out->read_at(out, offset, &byte, 1) == 0);
+			assert(byte == TAG);
+		} else {
+			assert(!SQFS_IS_BLOCK_COMPRESSED(size));
+			assert(SQFS_ON_DISK_BLOCK_SIZE(size) == BLK_SZ);
+		}
+
+		offset += SQFS_ON_DISK_BLOCK_SIZE(size);
+	}
+
+	/* the tail end is in a fragment block of the default compressor */
+	assert(inode->data.file.fragment_index != 0xFFFFFFFF);
+}
+
+static void test_select(void)
+{
+	sqfs_inode_generic_t *inodes[5];
+	sqfs_data_writer_t *wr;
+	sqfs_super_t super;
+	sqfs_file_t *out;
+	sqfs_u32 id;
+	size_t i;
+
+	out = sqfs_create_memory_file(0);
+	assert(out != NULL);
+
+	wr = create_writer(out);
+	assert(sqfs_data_writer_add_compressor(wr, &tag_cmp, &id) == 0);
+	assert(id == 1);
+
+	/* the one the writer was created with, unless selected otherwise */
+	inodes[0] = begin_file(wr);
+	end_file(wr, inodes[0], 0);
+
+	inodes[1] = begin_file(wr);
+	assert(sqfs_data_writer_set_compressor(wr, id) == 0);
+	end_file(wr, inodes[1], 1);
+
+	/* the selection does not carry over to the next file */
+	inodes[2] = begin_file(wr);
+	end_file(wr, inodes[2], 2);
+
+	/* the default applies to all files that follow, but can be changed */
+	assert(sqfs_data_writer_set_default_compressor(wr, id) == 0);
+	inodes[3] = begin_file(wr);
+	end_file(wr, inodes[3], 3);
+
+	inodes[4] = begin_file(wr);
+	assert(sqfs_data_writer_set_compressor(wr, 0) == 0);
+	end_file(wr, inodes[4], 4);
+
+	assert(sqfs_data_writer_finish(wr) == 0);
+
+	memset(&super, 0, sizeof(super));
+	assert(sqfs_data_writer_write_fragment_table(wr, &super) == 0);
+	assert(super.fragment_entry_count > 0);
+	sqfs_data_writer_destroy(wr);
+
+	check_file(out, inodes[0], false);
+	check_file(out, inodes[1], true);
+	check_file(out, inodes[2], false);
+	check_file(out, inodes[3], true);
+	check_file(out, inodes[4], false);
+
+	/* only the data blocks of two files, never a fragment block */
+	assert(tag_calls == 4);
+
+	for (i = 0; i < sizeof(inodes) / sizeof(inodes[0]); ++i)
+		free(inodes[i]);
+
+	out->destroy(out);
+}
+
+static void test_errors(void)
+{
+	sqfs_inode_generic_t *inode;
+	sqfs_data_writer_t *wr;
+	sqfs_file_t *out;
+	sqfs_u32 i, id;
+
+	out = sqfs_create_memory_file(0);
+	assert(out != NULL);
+
+	/* up to 7 additional compressors */
+	wr = create_writer(out);
+
+	for (i = 1; i < 8; ++i) {
+		assert(sqfs_data_writer_add_compressor(wr, &tag_cmp,
+						       &id) == 0);
+		assert(id == i);
+	}
+
+	assert(sqfs_data_writer_add_compressor(wr, &tag_cmp, &id) ==
+	       SQFS_ERROR_OVERFLOW);
+	assert(sqfs_data_writer_set_default_compressor(wr, 8) != 0);
+	sqfs_data_writer_destroy(wr);
+
+	/* a compressor is selected for a file, so there has to be one */
+	wr = create_writer(out);
+	assert(sqfs_data_writer_add_compressor(wr, &tag_cmp, &id) == 0);
+	assert(sqfs_data_writer_set_compressor(wr, id) != 0);
+	sqfs_data_writer_destroy(wr);
+
+	/* unknown IDs are rejected */
+	wr = create_writer(out);
+	assert(sqfs_data_writer_add_compressor(wr, &tag_cmp, &id) == 0);
+	inode = begin_file(wr);
+	assert(sqfs_data_writer_set_compressor(wr, id + 1) != 0);
+	sqfs_data_writer_destroy(wr);
+	free(inode);
+
+	out->destroy(out);
+}
+
+int main(void)
+{
+	test_select();
+	test_errors();
+	return EXIT_SUCCESS;
+}
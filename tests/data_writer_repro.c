@@ -0,0 +1,742 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * data_writer_repro.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "sqfs/data_writer.h"
+#include "sqfs/compressor.h"
+#include "sqfs/block.h"
+#include "sqfs/inode.h"
+#include "sqfs/super.h"
+#include "sqfs/error.h"
+#include "sqfs/io.h"
+#include "sqfs/thread_pool.h"
+
+#include <stdbool.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE (4096)
+#define DEV_BLOCK_SIZE (1024)
+#define NUM_FILES (64)
+#define MAX_FILE_SIZE (5 * BLOCK_SIZE + 1000)
+#define MAX_BLOCKS (MAX_FILE_SIZE / BLOCK_SIZE + 1)
+#define SYNC_INTERVAL (8)
+
+typedef struct {
+	sqfs_file_t base;
+	sqfs_u8 *data;
+	size_t size;
+	size_t max;
+} mem_file_t;
+
+typedef struct {
+	sqfs_compressor_t base;
+	sqfs_compressor_t *real;
+	sqfs_u32 counter;
+} slow_compressor_t;
+
+typedef struct {
+	sqfs_u8 *data;
+	size_t size;
+	sqfs_u32 flags;
+	sqfs_u32 group;
+} test_file_t;
+
+typedef struct {
+	sqfs_u64 block_start;
+	sqfs_u32 frag_idx;
+	sqfs_u32 frag_offset;
+	size_t num_blocks;
+	sqfs_u32 block_sizes[MAX_BLOCKS];
+} file_result_t;
+
+typedef struct {
+	mem_file_t file;
+	file_result_t files[NUM_FILES];
+} result_t;
+
+static test_file_t files[NUM_FILES];
+
+/* if set, installed on the data writer by build() */
+static const sqfs_allocator_t *build_allocator;
+
+/* if set, the wrapped compressors take blocks in batches */
+static bool slow_batched;
+
+/* if set, build() writes the files through streams filled in by threads */
+static unsigned int stream_threads;
+
+/*****************************************************************************/
+
+static int mem_write_at(sqfs_file_t *base, sqfs_u64 offset,
+			const void *buffer, size_t size)
+{
+	mem_file_t *file = (mem_file_t *)base;
+
+	if (offset + size > file->max) {
+		while (offset + size > file->max)
+			file->max = file->max ? file->max * 2 : BLOCK_SIZE;
+
+		file->data = realloc(file->data, file->max);
+		assert(file->data != NULL);
+	}
+
+	if (offset > file->size)
+		memset(file->data + file->size, 0, offset - file->size);
+
+	memcpy(file->data + offset, buffer, size);
+
+	if (offset + size > file->size)
+		file->size = offset + size;
+
+	return 0;
+}
+
+static int mem_read_at(sqfs_file_t *base, sqfs_u64 offset,
+		       void *buffer, size_t size)
+{
+	mem_file_t *file = (mem_file_t *)base;
+
+	if (offset + size > file->size)
+		return SQFS_ERROR_OUT_OF_BOUNDS;
+
+	memcpy(buffer, file->data + offset, size);
+	return 0;
+}
+
+static sqfs_u64 mem_get_size(const sqfs_file_t *base)
+{
+	return ((const mem_file_t *)base)->size;
+}
+
+static int mem_truncate(sqfs_file_t *base, sqfs_u64 size)
+{
+	mem_file_t *file = (mem_file_t *)base;
+
+	if (size > file->size)
+		return mem_write_at(base, size, "", 0);
+
+	file->size = size;
+	return 0;
+}
+
+/*****************************************************************************/
+
+typedef struct {
+	size_t total;
+	size_t live;
+} alloc_count_t;
+
+static void *count_alloc(void *user, size_t size)
+{
+	alloc_count_t *count = user;
+
+	count->total += 1;
+	count->live += 1;
+	return malloc(size);
+}
+
+static void count_free(void *user, void *ptr)
+{
+	alloc_count_t *count = user;
+
+	assert(count->live > 0);
+	count->live -= 1;
+	free(ptr);
+}
+
+/*****************************************************************************/
+
+/*
+  Wraps a real compressor and spins for a while after each block, for a
+  different amount of time depending on the data and the worker, so blocks
+  are finished in a different order than they were handed out.
+ */
+static sqfs_s32 slow_do_block(sqfs_compressor_t *base, const sqfs_u8 *in,
+			      sqfs_u32 size, sqfs_u8 *out, sqfs_u32 outsize)
+{
+	slow_compressor_t *cmp = (slow_compressor_t *)base;
+	volatile sqfs_u32 spin;
+	sqfs_u32 i, delay;
+	sqfs_s32 ret;
+
+	cmp->real->method_hint = base->method_hint;
+	ret = cmp->real->do_block(cmp->real, in, size, out, outsize);
+	base->method = cmp->real->method;
+
+	delay = (cmp->counter++ * 7919 + (size > 0 ? in[size / 2] : 0)) % 13;
+
+	for (i = 0, spin = 0; i < delay * 20000; ++i)
+		spin += i;
+
+	return ret;
+}
+
+/* the blocks of a batch are independent, with separate output buffers */
+static int slow_do_blocks(sqfs_compressor_t *base,
+			  sqfs_compressor_job_t *jobs, size_t count)
+{
+	size_t i, j;
+
+	assert(count > 0);
+
+	for (i = 0; i < count; ++i) {
+		for (j = 0; j < i; ++j)
+			assert(jobs[i].out != jobs[j].out);
+
+		base->method_hint = jobs[i].method_hint;
+		jobs[i].result = slow_do_block(base, jobs[i].in, jobs[i].size,
+					       jobs[i].out, jobs[i].outsize);
+		jobs[i].method = base->method;
+	}
+
+	return 0;
+}
+
+static void slow_destroy(sqfs_compressor_t *base)
+{
+	slow_compressor_t *cmp = (slow_compressor_t *)base;
+
+	cmp->real->destroy(cmp->real);
+	free(cmp);
+}
+
+static sqfs_compressor_t *slow_wrap(sqfs_compressor_t *real, sqfs_u32 seed);
+
+static sqfs_compressor_t *slow_create_copy(sqfs_compressor_t *base)
+{
+	slow_compressor_t *cmp = (slow_compressor_t *)base;
+	sqfs_compressor_t *real = cmp->real->create_copy(cmp->real);
+
+	assert(real != NULL);
+	return slow_wrap(real, cmp->counter * 31 + 17);
+}
+
+static sqfs_compressor_t *slow_wrap(sqfs_compressor_t *real, sqfs_u32 seed)
+{
+	slow_compressor_t *cmp = calloc(1, sizeof(*cmp));
+
+	assert(cmp != NULL);
+	cmp->real = real;
+	cmp->counter = seed;
+	cmp->base.destroy = slow_destroy;
+	cmp->base.do_block = slow_do_block;
+	cmp->base.create_copy = slow_create_copy;
+	cmp->base.do_blocks = slow_batched ? slow_do_blocks : NULL;
+	cmp->base.write_options = real->write_options;
+	cmp->base.probe_file = real->probe_file;
+	return (sqfs_compressor_t *)cmp;
+}
+
+/*****************************************************************************/
+
+static sqfs_u32 rnd_state = 42;
+
+static sqfs_u32 rnd(void)
+{
+	rnd_state = rnd_state * 1103515245 + 12345;
+	return rnd_state >> 8;
+}
+
+/*
+  A mix of compressible text, random data, zero blocks, exact duplicates,
+  tail ends of all sizes and files that skip the fragment blocks, are
+  aligned or never deduplicated, in a few fragment groups.
+ */
+static void generate_files(void)
+{
+	size_t i, j, size;
+	sqfs_u8 *data;
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		if (i > 4 && (rnd() % 6) == 0) {
+			files[i] = files[rnd() % i];
+			continue;
+		}
+
+		switch (rnd() % 4) {
+		case 0:  size = rnd() % BLOCK_SIZE; break;
+		case 1:  size = BLOCK_SIZE * (1 + rnd() % 3); break;
+		default: size = rnd() % MAX_FILE_SIZE; break;
+		}
+
+		data = malloc(size > 0 ? size : 1);
+		assert(data != NULL);
+
+		switch (rnd() % 3) {
+		case 0:
+			for (j = 0; j < size; ++j)
+				data[j] = rnd();
+			break;
+		case 1:
+			for (j = 0; j < size; ++j)
+				data[j] = "squashfs "[(j + i) % 9];
+			break;
+		default:
+			memset(data, 0, size);
+			for (j = BLOCK_SIZE; j < size; j += 3)
+				data[j] = j % 251;
+			break;
+		}
+
+		files[i].data = data;
+		files[i].size = size;
+		switch (rnd() % 16) {
+		case 0:
+		case 1:  files[i].flags = SQFS_BLK_DONT_FRAGMENT; break;
+		case 2:  files[i].flags = SQFS_BLK_DONT_DEDUPLICATE; break;
+		case 3:  files[i].flags = SQFS_BLK_ALIGN; break;
+		default: files[i].flags = 0; break;
+		}
+		files[i].group = rnd() % 3;
+	}
+}
+
+static void free_files(void)
+{
+	size_t i, j;
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		for (j = 0; j < i; ++j) {
+			if (files[j].data == files[i].data)
+				break;
+		}
+
+		if (j == i)
+			free(files[i].data);
+	}
+}
+
+/*****************************************************************************/
+
+static void get_result(file_result_t *out, const sqfs_inode_generic_t *inode)
+{
+	memset(out, 0, sizeof(*out));
+
+	sqfs_inode_get_file_block_start(inode, &out->block_start);
+	sqfs_inode_get_frag_location(inode, &out->frag_idx,
+				     &out->frag_offset);
+
+	out->num_blocks = inode->num_file_blocks;
+	assert(out->num_blocks <= MAX_BLOCKS);
+
+	memcpy(out->block_sizes, inode->block_sizes,
+	       inode->num_file_blocks * sizeof(sqfs_u32));
+}
+
+typedef struct {
+	sqfs_data_writer_t *wr;
+	sqfs_inode_generic_t **inodes;
+	file_result_t results[NUM_FILES];
+	size_t count[NUM_FILES];
+	sqfs_u64 files_done;
+} done_state_t;
+
+static void notify_file_done(void *user, sqfs_inode_generic_t *inode)
+{
+	done_state_t *state = user;
+	sqfs_data_writer_stats_t stats;
+	size_t i;
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		if (state->inodes[i] == inode)
+			break;
+	}
+
+	assert(i < NUM_FILES);
+	state->count[i] += 1;
+	get_result(&state->results[i], inode);
+
+	/* the snapshot may lag behind, but never goes back */
+	memset(&stats, 0, sizeof(stats));
+	stats.size = sizeof(stats);
+	assert(sqfs_data_writer_get_stats(state->wr, &stats) == 0);
+	assert(stats.backlog <= stats.backlog_limit);
+	assert(stats.files_done >= state->files_done);
+	state->files_done = stats.files_done;
+}
+
+/* once everything is written out, the counters add up */
+static void check_stats(sqfs_data_writer_t *wr, const result_t *res)
+{
+	sqfs_data_writer_worker_stats_t wstats;
+	sqfs_data_writer_stats_t stats;
+	sqfs_u64 blocks = 0;
+	unsigned int i;
+
+	memset(&stats, 0, sizeof(stats));
+	assert(sqfs_data_writer_get_stats(wr, &stats) ==
+	       SQFS_ERROR_UNSUPPORTED);
+
+	stats.size = sizeof(stats);
+	assert(sqfs_data_writer_get_stats(wr, &stats) == 0);
+	assert(stats.backlog == 0);
+	assert(stats.bytes_in_flight == 0);
+	assert(stats.output_size == res->file.size);
+	assert(stats.blocks_written <= stats.blocks_queued);
+	assert(stats.mem_pool <= stats.mem_used);
+
+	for (i = 0; i < stats.num_workers; ++i) {
+		memset(&wstats, 0, sizeof(wstats));
+		wstats.size = sizeof(wstats);
+
+		assert(sqfs_data_writer_get_worker_stats(wr, i, &wstats) == 0);
+		assert(wstats.bytes_out <= wstats.bytes_in);
+		blocks += wstats.blocks;
+	}
+
+	if (stats.num_workers > 0)
+		assert(blocks == stats.blocks_queued);
+
+	wstats.size = sizeof(wstats);
+	assert(sqfs_data_writer_get_worker_stats(wr, stats.num_workers,
+						 &wstats) ==
+	       SQFS_ERROR_OUT_OF_BOUNDS);
+}
+
+static const sqfs_block_hooks_t hooks = {
+	.size = sizeof(hooks),
+	.notify_file_done = notify_file_done,
+};
+
+typedef struct {
+	sqfs_data_stream_t *strm;
+	size_t index;
+} stream_job_t;
+
+/* append in pieces of odd sizes, so they never line up with the blocks */
+static void fill_stream(void *user)
+{
+	stream_job_t *job = user;
+	const test_file_t *f = files + job->index;
+	size_t diff, offset = 0;
+
+	while (offset < f->size) {
+		diff = 1 + (offset * 31 + job->index * 7) % 3000;
+		if (diff > f->size - offset)
+			diff = f->size - offset;
+
+		assert(sqfs_data_stream_append(job->strm, f->data + offset,
+					       diff) == 0);
+		offset += diff;
+	}
+
+	assert(sqfs_data_stream_close(job->strm) == 0);
+}
+
+/*
+  Open a stream for every file and have the threads of a pool fill them in,
+  the last ones first. The caller waits for them in the data writer and
+  destroys the pool.
+ */
+static sqfs_thread_pool_t *write_streams(sqfs_data_writer_t *wr,
+					 sqfs_inode_generic_t **inodes,
+					 stream_job_t *jobs)
+{
+	sqfs_thread_pool_t *pool;
+	size_t i;
+
+	pool = sqfs_thread_pool_create(stream_threads);
+	assert(pool != NULL);
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		jobs[i].index = i;
+		jobs[i].strm = sqfs_data_writer_open_stream(wr, inodes[i],
+							    files[i].flags);
+		assert(jobs[i].strm != NULL);
+		assert(sqfs_data_stream_set_fragment_group(jobs[i].strm,
+							   files[i].group) == 0);
+	}
+
+	for (i = NUM_FILES; i-- > 0; )
+		assert(sqfs_thread_pool_submit(pool, fill_stream, jobs + i) == 0);
+
+	assert(sqfs_data_writer_submit_streams(wr, false) == 0);
+	return pool;
+}
+
+/*
+  If sync is set, the writer is synced after every SYNC_INTERVAL files and
+  the inodes of all files so far must not change anymore after that.
+ */
+static void build(result_t *res, const sqfs_compressor_config_t *cfg,
+		  unsigned int num_workers, size_t backlog, sqfs_u32 flags,
+		  bool sync)
+{
+	sqfs_inode_generic_t *inodes[NUM_FILES];
+	file_result_t synced[NUM_FILES];
+	sqfs_thread_pool_t *pool = NULL;
+	stream_job_t jobs[NUM_FILES];
+	sqfs_compressor_t *real, *cmp;
+	done_state_t done;
+	size_t i, j, num_synced = 0;
+	sqfs_data_writer_t *wr;
+	sqfs_super_t super;
+
+	memset(res, 0, sizeof(*res));
+	res->file.base.write_at = mem_write_at;
+	res->file.base.read_at = mem_read_at;
+	res->file.base.get_size = mem_get_size;
+	res->file.base.truncate = mem_truncate;
+
+	real = sqfs_compressor_create(cfg);
+	assert(real != NULL);
+	cmp = slow_wrap(real, 0);
+
+	wr = sqfs_data_writer_create(BLOCK_SIZE, cmp, num_workers, backlog,
+				     backlog, DEV_BLOCK_SIZE,
+				     (sqfs_file_t *)&res->file, flags);
+	assert(wr != NULL);
+	assert(sqfs_data_writer_set_allocator(wr, build_allocator) == 0);
+
+	memset(&done, 0, sizeof(done));
+	memset(inodes, 0, sizeof(inodes));
+	done.inodes = inodes;
+	done.wr = wr;
+	assert(sqfs_data_writer_set_hooks(wr, &done, &hooks) == 0);
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		inodes[i] = calloc(1, sizeof(*inodes[i]) +
+				   MAX_BLOCKS * sizeof(sqfs_u32));
+		assert(inodes[i] != NULL);
+
+		inodes[i]->block_sizes = (sqfs_u32 *)inodes[i]->extra;
+		inodes[i]->base.type = SQFS_INODE_FILE;
+		sqfs_inode_set_file_size(inodes[i], files[i].size);
+		sqfs_inode_set_frag_location(inodes[i], 0xFFFFFFFF,
+					     0xFFFFFFFF);
+
+		if (stream_threads > 0)
+			continue;
+
+		assert(sqfs_data_writer_begin_file(wr, inodes[i],
+						   files[i].flags) == 0);
+		assert(sqfs_data_writer_set_fragment_group(wr,
+						files[i].group) == 0);
+		assert(sqfs_data_writer_append(wr, files[i].data,
+					       files[i].size) == 0);
+		assert(sqfs_data_writer_end_file(wr) == 0);
+
+		/* too late to change where the blocks come from */
+		if (i == 0) {
+			assert(sqfs_data_writer_set_allocator(wr, NULL) ==
+			       SQFS_ERROR_UNSUPPORTED);
+		}
+
+		if (sync && (i % SYNC_INTERVAL) == SYNC_INTERVAL - 1) {
+			assert(sqfs_data_writer_sync(wr) == 0);
+
+			for (j = num_synced; j <= i; ++j)
+				get_result(&synced[j], inodes[j]);
+
+			num_synced = i + 1;
+		}
+	}
+
+	if (stream_threads > 0)
+		pool = write_streams(wr, inodes, jobs);
+
+	/* also waits for the streams to be filled in */
+	assert(sqfs_data_writer_finish(wr) == 0);
+
+	if (pool != NULL)
+		sqfs_thread_pool_destroy(pool);
+
+	check_stats(wr, res);
+
+	memset(&super, 0, sizeof(super));
+	assert(sqfs_data_writer_write_fragment_table(wr, &super) == 0);
+
+	/* every file is reported once, with its final data locations */
+	for (i = 0; i < NUM_FILES; ++i) {
+		get_result(&res->files[i], inodes[i]);
+		assert(done.count[i] == 1);
+		assert(memcmp(&done.results[i], &res->files[i],
+			      sizeof(res->files[i])) == 0);
+		free(inodes[i]);
+	}
+
+	for (i = 0; i < num_synced; ++i) {
+		assert(memcmp(&synced[i], &res->files[i],
+			      sizeof(synced[i])) == 0);
+	}
+
+	sqfs_data_writer_destroy(wr);
+	cmp->destroy(cmp);
+}
+
+static void compare(const result_t *a, const result_t *b)
+{
+	size_t i;
+
+	assert(a->file.size == b->file.size);
+	assert(memcmp(a->file.data, b->file.data, a->file.size) == 0);
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		assert(a->files[i].block_start == b->files[i].block_start);
+		assert(a->files[i].frag_idx == b->files[i].frag_idx);
+		assert(a->files[i].frag_offset == b->files[i].frag_offset);
+		assert(a->files[i].num_blocks == b->files[i].num_blocks);
+		assert(memcmp(a->files[i].block_sizes, b->files[i].block_sizes,
+			      a->files[i].num_blocks * sizeof(sqfs_u32)) == 0);
+	}
+}
+
+/* files that must not be deduplicated never share data with earlier ones */
+static void check_no_dedup(const result_t *res)
+{
+	size_t i, j;
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		if (!(files[i].flags & SQFS_BLK_DONT_DEDUPLICATE))
+			continue;
+
+		for (j = 0; j < i; ++j) {
+			if (res->files[i].num_blocks > 0 &&
+			    res->files[j].num_blocks > 0) {
+				assert(res->files[i].block_start !=
+				       res->files[j].block_start);
+			}
+
+			if (res->files[i].frag_idx != 0xFFFFFFFF) {
+				assert(res->files[i].frag_idx !=
+				       res->files[j].frag_idx ||
+				       res->files[i].frag_offset !=
+				       res->files[j].frag_offset);
+			}
+		}
+	}
+}
+
+static const sqfs_u32 flag_sets[] = {
+	0,
+	SQFS_DATA_WRITER_GROUP_FRAGMENTS,
+	SQFS_DATA_WRITER_HOLD_BLOCKS | SQFS_DATA_WRITER_VERIFY_DEDUP,
+	SQFS_DATA_WRITER_DETECT_INCOMPRESSIBLE |
+	SQFS_DATA_WRITER_ASYNC_OUTPUT | SQFS_DATA_WRITER_GROUP_FRAGMENTS,
+	SQFS_DATA_WRITER_ADAPTIVE_WORKERS | SQFS_DATA_WRITER_ASYNC_OUTPUT,
+	SQFS_DATA_WRITER_CACHE_COMPRESSED | SQFS_DATA_WRITER_GROUP_FRAGMENTS,
+	SQFS_DATA_WRITER_BEST_FIT_FRAGMENTS | SQFS_DATA_WRITER_VERIFY_DEDUP,
+};
+
+/* all blocks go through the allocator hooks and are released again */
+static void check_allocator(const sqfs_compressor_config_t *cfg)
+{
+	alloc_count_t count = { 0, 0 };
+	sqfs_allocator_t alloc = { count_alloc, count_free, &count };
+	result_t ref, res;
+
+	build(&ref, cfg, 1, 1, SQFS_DATA_WRITER_GROUP_FRAGMENTS, false);
+
+	build_allocator = &alloc;
+	build(&res, cfg, 3, 5, SQFS_DATA_WRITER_GROUP_FRAGMENTS, false);
+	build_allocator = NULL;
+
+	compare(&ref, &res);
+	assert(count.total > 0 && count.live == 0);
+
+	free(res.file.data);
+	free(ref.file.data);
+}
+
+static const unsigned int worker_counts[] = { 2, 3, 8 };
+static const size_t backlogs[] = { 1, 5, 64 };
+
+int main(void)
+{
+	sqfs_compressor_config_t cfg;
+	sqfs_thread_pool_t *pool;
+	result_t ref, res;
+	size_t i, j, k;
+	int id;
+
+	for (id = SQFS_COMP_MIN; id <= SQFS_COMP_MAX; ++id) {
+		if (sqfs_compressor_exists(id))
+			break;
+	}
+
+	if (id > SQFS_COMP_MAX)
+		return 77;
+
+	assert(sqfs_compressor_config_init(&cfg, id, BLOCK_SIZE, 0) == 0);
+
+	generate_files();
+
+	for (i = 0; i < sizeof(flag_sets) / sizeof(flag_sets[0]); ++i) {
+		build(&ref, &cfg, 1, 1, flag_sets[i], false);
+		assert(ref.file.size > 0);
+		check_no_dedup(&ref);
+
+		for (j = 0; j < sizeof(worker_counts) /
+			     sizeof(worker_counts[0]); ++j) {
+			for (k = 0; k < sizeof(backlogs) /
+				     sizeof(backlogs[0]); ++k) {
+				build(&res, &cfg, worker_counts[j],
+				      backlogs[k], flag_sets[i], false);
+				compare(&ref, &res);
+				free(res.file.data);
+			}
+		}
+
+		free(ref.file.data);
+
+		/* syncing in between may change the packing, but not between runs */
+		build(&ref, &cfg, 1, 1, flag_sets[i], true);
+		check_no_dedup(&ref);
+
+		build(&res, &cfg, 8, 5, flag_sets[i], true);
+		compare(&ref, &res);
+
+		free(res.file.data);
+		free(ref.file.data);
+	}
+
+	check_allocator(&cfg);
+
+	/* taking repeated blocks from the cache must not change anything */
+	build(&ref, &cfg, 1, 1, 0, false);
+	build(&res, &cfg, 3, 5, SQFS_DATA_WRITER_CACHE_COMPRESSED, false);
+	compare(&ref, &res);
+	free(res.file.data);
+
+	/* neither must taking the buffers from the huge page pool */
+	build(&res, &cfg, 3, 5, SQFS_DATA_WRITER_HUGE_PAGES, false);
+	compare(&ref, &res);
+	free(res.file.data);
+
+	/* nor handing the blocks to the compressor in batches */
+	slow_batched = true;
+	build(&res, &cfg, 3, 64, SQFS_DATA_WRITER_CACHE_COMPRESSED, false);
+	slow_batched = false;
+	compare(&ref, &res);
+	free(res.file.data);
+
+	/* nor running the workers on a pool with fewer threads than them */
+	pool = sqfs_thread_pool_create(2);
+	assert(pool != NULL);
+	sqfs_set_thread_pool(pool);
+	build(&res, &cfg, 8, 5, SQFS_DATA_WRITER_ADAPTIVE_WORKERS, false);
+	sqfs_set_thread_pool(NULL);
+	sqfs_thread_pool_destroy(pool);
+	compare(&ref, &res);
+	free(res.file.data);
+
+	/* nor filling in the files from several threads at once */
+	for (i = 1; i <= 4; i *= 2) {
+		stream_threads = i;
+		build(&res, &cfg, 3, 5, 0, false);
+		stream_threads = 0;
+		compare(&ref, &res);
+		free(res.file.data);
+	}
+
+	free(ref.file.data);
+
+	free_files();
+	return EXIT_SUCCESS;
+}
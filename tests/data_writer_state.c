@@ -0,0 +1,223 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * data_writer_state.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+#include "test.h"
+
+#include "sqfs/data_writer.h"
+#include "sqfs/compressor.h"
+#include "sqfs/block.h"
+#include "sqfs/inode.h"
+#include "sqfs/super.h"
+#include "sqfs/error.h"
+#include "sqfs/io.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLK_SZ (4096)
+#define NUM_FILES (5)
+#define MAX_BLOCKS (4)
+
+/*
+  Two files before the state is saved and three after it. The third one has
+  the same contents as the first one and the last one the same tail end as
+  the second one, so both have to be deduplicated against data written
+  before the state was saved.
+ */
+static const struct {
+	int id;
+	size_t size;
+} files[NUM_FILES] = {
+	{ 0, 2 * BLK_SZ + 100 },
+	{ 1, BLK_SZ + 300 },
+	{ 0, 2 * BLK_SZ + 100 },
+	{ 2, 3 * BLK_SZ + 50 },
+	{ 1, 300 },
+};
+
+#define NUM_BEFORE (2)
+
+static sqfs_u8 content(int id, size_t pos, size_t size)
+{
+	/* the tail end of a file depends only on the offset into it */
+	if (pos >= size - size % BLK_SZ)
+		pos -= size - size % BLK_SZ;
+
+	return (pos * 13 + id * 101 + pos / 251) & 0xFF;
+}
+
+static sqfs_inode_generic_t *write_file(sqfs_data_writer_t *wr, size_t i)
+{
+	sqfs_inode_generic_t *inode;
+	sqfs_u8 *data;
+	size_t j;
+
+	inode = calloc(1, sizeof(*inode) + MAX_BLOCKS * sizeof(sqfs_u32));
+	assert(inode != NULL);
+
+	inode->block_sizes = (sqfs_u32 *)inode->extra;
+	inode->base.type = SQFS_INODE_FILE;
+	sqfs_inode_set_file_size(inode, files[i].size);
+	sqfs_inode_set_frag_location(inode, 0xFFFFFFFF, 0xFFFFFFFF);
+
+	data = malloc(files[i].size);
+	assert(data != NULL);
+
+	for (j = 0; j < files[i].size; ++j)
+		data[j] = content(files[i].id, j, files[i].size);
+
+	assert(sqfs_data_writer_begin_file(wr, inode, 0) == 0);
+	assert(sqfs_data_writer_append(wr, data, files[i].size) == 0);
+	assert(sqfs_data_writer_end_file(wr) == 0);
+
+	free(data);
+	return inode;
+}
+
+static sqfs_data_writer_t *create_writer(sqfs_file_t *out, size_t block_size)
+{
+	sqfs_data_writer_t *wr;
+
+	wr = sqfs_data_writer_create(block_size, &dummy_cmp, 1, 4, 4, 0,
+				     out, 0);
+	assert(wr != NULL);
+	return wr;
+}
+
+static void finish(sqfs_data_writer_t *wr)
+{
+	sqfs_super_t super;
+
+	assert(sqfs_data_writer_finish(wr) == 0);
+
+	memset(&super, 0, sizeof(super));
+	assert(sqfs_data_writer_write_fragment_table(wr, &super) == 0);
+	assert(super.fragment_entry_count > 0);
+}
+
+static void compare_inodes(const sqfs_inode_generic_t *a,
+			   const sqfs_inode_generic_t *b)
+{
+	sqfs_u32 frag_a, frag_b, off_a, off_b;
+	sqfs_u64 start_a, start_b;
+
+	sqfs_inode_get_file_block_start(a, &start_a);
+	sqfs_inode_get_file_block_start(b, &start_b);
+	sqfs_inode_get_frag_location(a, &frag_a, &off_a);
+	sqfs_inode_get_frag_location(b, &frag_b, &off_b);
+
+	assert(start_a == start_b);
+	assert(frag_a == frag_b && off_a == off_b);
+	assert(a->num_file_blocks == b->num_file_blocks);
+	assert(memcmp(a->block_sizes, b->block_sizes,
+		      a->num_file_blocks * sizeof(sqfs_u32)) == 0);
+}
+
+static void compare_files(const sqfs_file_t *a, const sqfs_file_t *b)
+{
+	const void *data_a, *data_b;
+	size_t size_a, size_b;
+
+	assert(sqfs_memory_file_get_data(a, &data_a, &size_a) == 0);
+	assert(sqfs_memory_file_get_data(b, &data_b, &size_b) == 0);
+	assert(size_a == size_b);
+	assert(memcmp(data_a, data_b, size_a) == 0);
+}
+
+int main(void)
+{
+	sqfs_inode_generic_t *ref[NUM_FILES], *inodes[NUM_FILES];
+	sqfs_file_t *out, *resumed, *state;
+	sqfs_u64 offset, saved_size;
+	sqfs_data_writer_t *wr;
+	const void *data;
+	size_t i, size;
+
+	out = sqfs_create_memory_file(0);
+	state = sqfs_create_memory_file(0);
+	assert(out != NULL && state != NULL);
+
+	/* a build that saves its state half way through and goes on */
+	wr = create_writer(out, BLK_SZ);
+
+	for (i = 0; i < NUM_BEFORE; ++i)
+		ref[i] = write_file(wr, i);
+
+	assert(sqfs_data_writer_save_state(wr, state) == 0);
+	saved_size = out->get_size(out);
+	assert(saved_size > 0);
+
+	for (i = NUM_BEFORE; i < NUM_FILES; ++i)
+		ref[i] = write_file(wr, i);
+
+	finish(wr);
+	sqfs_data_writer_destroy(wr);
+
+	/* the duplicates did not make it to the image a second time */
+	compare_inodes(ref[0], ref[2]);
+	assert(ref[4]->data.file.fragment_index ==
+	       ref[1]->data.file.fragment_index);
+	assert(ref[4]->data.file.fragment_offset ==
+	       ref[1]->data.file.fragment_offset);
+
+	/* pick up from the state, on top of the finished image */
+	resumed = sqfs_create_memory_file(0);
+	assert(resumed != NULL);
+	assert(sqfs_memory_file_get_data(out, &data, &size) == 0);
+	assert(resumed->write_at(resumed, 0, data, size) == 0);
+
+	wr = create_writer(resumed, BLK_SZ);
+
+	offset = 0;
+	assert(sqfs_data_writer_load_state(wr, state, &offset) == 0);
+	assert(offset == state->get_size(state));
+	assert(resumed->get_size(resumed) == saved_size);
+
+	for (i = NUM_BEFORE; i < NUM_FILES; ++i)
+		inodes[i] = write_file(wr, i);
+
+	finish(wr);
+	sqfs_data_writer_destroy(wr);
+
+	/* the same image as without the interruption */
+	compare_files(out, resumed);
+
+	for (i = NUM_BEFORE; i < NUM_FILES; ++i) {
+		compare_inodes(ref[i], inodes[i]);
+		free(inodes[i]);
+	}
+
+	/* the state only fits a writer with the same settings */
+	wr = create_writer(resumed, 2 * BLK_SZ);
+	offset = 0;
+	assert(sqfs_data_writer_load_state(wr, state, &offset) ==
+	       SQFS_ERROR_UNSUPPORTED);
+	sqfs_data_writer_destroy(wr);
+
+	/* the output must still hold the data from before */
+	assert(resumed->truncate(resumed, saved_size - 1) == 0);
+	wr = create_writer(resumed, BLK_SZ);
+	offset = 0;
+	assert(sqfs_data_writer_load_state(wr, state, &offset) ==
+	       SQFS_ERROR_OUT_OF_BOUNDS);
+	sqfs_data_writer_destroy(wr);
+
+	wr = create_writer(resumed, BLK_SZ);
+	offset = 1;
+	assert(sqfs_data_writer_load_state(wr, state, &offset) ==
+	       SQFS_ERROR_CORRUPTED);
+	sqfs_data_writer_destroy(wr);
+
+	for (i = 0; i < NUM_FILES; ++i)
+		free(ref[i]);
+
+	resumed->destroy(resumed);
+	state->destroy(state);
+	out->destroy(out);
+	return EXIT_SUCCESS;
+}
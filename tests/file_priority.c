@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * file_priority.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "fstree.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+
+static const char *priolist =
+"# comment line\n"
+"/dir/c\n"
+"\n"
+"  /a  \n"
+"/missing\n"
+"/dir\n"
+"//dir/./c\n";
+
+int main(void)
+{
+	tree_node_t *a, *b, *c, *d;
+	file_info_t *fi;
+	struct stat sb;
+	fstree_t fs;
+	char *ptr;
+	FILE *fp;
+
+	assert(fstree_init(&fs, NULL) == 0);
+
+	memset(&sb, 0, sizeof(sb));
+	sb.st_mode = S_IFREG | 0644;
+
+	a = fstree_add_generic(&fs, "a", &sb, "a");
+	b = fstree_add_generic(&fs, "b", &sb, "b");
+	c = fstree_add_generic(&fs, "dir/c", &sb, "c");
+	d = fstree_add_generic(&fs, "dir/d", &sb, "d");
+	assert(a != NULL && b != NULL && c != NULL && d != NULL);
+
+	tree_node_sort_recursive(fs.root);
+	fstree_gen_file_list(&fs);
+
+	fi = fs.files;
+	assert(fi == &a->data.file);
+	assert(fi->next == &b->data.file);
+	assert(fi->next->next == &c->data.file);
+	assert(fi->next->next->next == &d->data.file);
+
+	ptr = strdup(priolist);
+	assert(ptr != NULL);
+
+	fp = fmemopen(ptr, strlen(ptr), "r");
+	assert(fp != NULL);
+
+	assert(fstree_prioritize_files(&fs, "priolist", fp) == 0);
+	fclose(fp);
+	free(ptr);
+
+	fi = fs.files;
+	assert(fi == &c->data.file);
+	fi = fi->next;
+	assert(fi == &a->data.file);
+	fi = fi->next;
+	assert(fi == &b->data.file);
+	fi = fi->next;
+	assert(fi == &d->data.file);
+	assert(fi->next == NULL);
+
+	for (fi = fs.files; fi != NULL; fi = fi->next)
+		assert(fi->user_ptr == NULL);
+
+	/* a stable sort by priority, keeping the order from above */
+	b->data.file.priority = 5;
+	d->data.file.priority = 5;
+	c->data.file.priority = -1;
+	fstree_sort_files_by_priority(&fs);
+
+	fi = fs.files;
+	assert(fi == &b->data.file);
+	fi = fi->next;
+	assert(fi == &d->data.file);
+	fi = fi->next;
+	assert(fi == &a->data.file);
+	fi = fi->next;
+	assert(fi == &c->data.file);
+	assert(fi->next == NULL);
+
+	fstree_cleanup(&fs);
+	return EXIT_SUCCESS;
+}
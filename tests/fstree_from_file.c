@@ -7,6 +7,7 @@
 #include "config.h"
 
 #include "fstree.h"
+#include "sqfs/block.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -24,10 +25,38 @@ static const char *testdesc =
 "dir \"/foo bar/ test \\\"/\" 0755 0 0\n"
 "  sock  /sock  0555  12  13  ";
 
+static const char *layoutdesc =
+"layout /db/*.db nofrag\n"
+"file /db/a.db 0644 0 0\n"
+"file /db/sub/b.db 0644 0 0\n"
+"file /db/c.txt 0644 0 0 [nodedup,priority=-3] input/c.txt\n"
+"file /db/d.bin 0644 0 0 [priority=7]\n"
+"layout \"/db/sub/*\" align,nocompress,priority=2\n";
+
+static const char *baddesc[] = {
+	"layout /foo sparse\n",
+	"file /foo 0644 0 0 [nofrag\n",
+	"file /foo 0644 0 0 [nofrag]input\n",
+	"file /foo 0644 0 0 [nofrag,,align]\n",
+	"file /foo 0644 0 0 [priority=high]\n",
+	"file /foo 0644 0 0 [priority=99999999999]\n",
+};
+
+static tree_node_t *find_node(tree_node_t *n, const char *name)
+{
+	while (n != NULL && strcmp(n->name, name) != 0)
+		n = n->next;
+
+	assert(n != NULL);
+	return n;
+}
+
 int main(void)
 {
+	file_info_t *fi;
 	tree_node_t *n;
 	fstree_t fs;
+	size_t i;
 	char *ptr;
 	FILE *fp;
 
@@ -99,5 +128,58 @@ int main(void)
 
 	fclose(fp);
 	fstree_cleanup(&fs);
+	free(ptr);
+
+	/* layout rules apply to all matching files, even ones added later */
+	ptr = strdup(layoutdesc);
+	assert(ptr != NULL);
+
+	fp = fmemopen(ptr, strlen(ptr), "r");
+	assert(fp != NULL);
+
+	assert(fstree_init(&fs, NULL) == 0);
+	assert(fstree_from_file(&fs, "testfile", fp) == 0);
+
+	n = find_node(fs.root->data.dir.children, "db");
+	assert(find_node(n->data.dir.children, "a.db")->data.file.flags ==
+	       SQFS_BLK_DONT_FRAGMENT);
+	assert(find_node(n->data.dir.children, "a.db")->data.file.priority == 0);
+
+	fi = &find_node(n->data.dir.children, "c.txt")->data.file;
+	assert(fi->flags == SQFS_BLK_DONT_DEDUPLICATE);
+	assert(fi->priority == -3);
+	assert(strcmp(fi->input_file, "input/c.txt") == 0);
+
+	fi = &find_node(n->data.dir.children, "d.bin")->data.file;
+	assert(fi->flags == 0);
+	assert(fi->priority == 7);
+	assert(strcmp(fi->input_file, "db/d.bin") == 0);
+
+	n = find_node(n->data.dir.children, "sub");
+	fi = &find_node(n->data.dir.children, "b.db")->data.file;
+	assert(fi->flags == (SQFS_BLK_DONT_FRAGMENT | SQFS_BLK_ALIGN |
+			     SQFS_BLK_DONT_COMPRESS));
+	assert(fi->priority == 2);
+
+	fclose(fp);
+	fstree_cleanup(&fs);
+	free(ptr);
+
+	/* unknown attributes and broken lists are rejected */
+	for (i = 0; i < sizeof(baddesc) / sizeof(baddesc[0]); ++i) {
+		ptr = strdup(baddesc[i]);
+		assert(ptr != NULL);
+
+		fp = fmemopen(ptr, strlen(ptr), "r");
+		assert(fp != NULL);
+
+		assert(fstree_init(&fs, NULL) == 0);
+		assert(fstree_from_file(&fs, "testfile", fp) != 0);
+
+		fclose(fp);
+		fstree_cleanup(&fs);
+		free(ptr);
+	}
+
 	return EXIT_SUCCESS;
 }
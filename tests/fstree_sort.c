@@ -10,8 +10,44 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
 #include <assert.h>
 
+/* names sharing long prefixes, with bytes above 0x7F, more than 64 */
+static void check_long_list(const struct stat *sb)
+{
+	tree_node_t *list = NULL, *n;
+	char name[32];
+	unsigned int i;
+
+	for (i = 0; i < 300; ++i) {
+		sprintf(name, "%s%u", (i % 3) ? "libfoo.so." : "\xC3\xA4",
+			i * 7919 % 1000);
+		if (i % 5 == 0)
+			name[8] = '\0';
+
+		n = fstree_mknode(NULL, NULL, name, strlen(name), NULL, sb);
+		assert(n != NULL);
+		n->next = list;
+		list = n;
+	}
+
+	list = tree_node_list_sort(list);
+
+	for (n = list, i = 0; n != NULL; n = n->next, ++i) {
+		if (n->next != NULL)
+			assert(strcmp(n->name, n->next->name) <= 0);
+	}
+
+	assert(i == 300);
+
+	while (list != NULL) {
+		n = list;
+		list = list->next;
+		free(n);
+	}
+}
+
 int main(void)
 {
 	tree_node_t *a, *b, *c, *d;
@@ -23,10 +59,10 @@ int main(void)
 	sb.st_mode = S_IFBLK | 0600;
 	sb.st_rdev = 1337;
 
-	a = fstree_mknode(NULL, "a", 1, NULL, &sb);
-	b = fstree_mknode(NULL, "b", 1, NULL, &sb);
-	c = fstree_mknode(NULL, "c", 1, NULL, &sb);
-	d = fstree_mknode(NULL, "d", 1, NULL, &sb);
+	a = fstree_mknode(NULL, NULL, "a", 1, NULL, &sb);
+	b = fstree_mknode(NULL, NULL, "b", 1, NULL, &sb);
+	c = fstree_mknode(NULL, NULL, "c", 1, NULL, &sb);
+	d = fstree_mknode(NULL, NULL, "d", 1, NULL, &sb);
 	assert(a != NULL && b != NULL && c != NULL && d != NULL);
 
 	/* empty list */
@@ -94,6 +130,8 @@ int main(void)
 	assert(c->next == d);
 	assert(d->next == NULL);
 
+	check_long_list(&sb);
+
 	/* cleanup and done */
 	free(a);
 	free(b);
@@ -11,15 +11,17 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <stdio.h>
 
-static tree_node_t *gen_node(tree_node_t *parent, const char *name)
+static tree_node_t *gen_node(fstree_t *fs, tree_node_t *parent,
+			     const char *name)
 {
 	struct stat sb;
 
 	memset(&sb, 0, sizeof(sb));
 	sb.st_mode = S_IFDIR | 0755;
 
-	return fstree_mknode(parent, name, strlen(name), NULL, &sb);
+	return fstree_mknode(fs, parent, name, strlen(name), NULL, &sb);
 }
 
 static void check_children_before_root(tree_node_t *root)
@@ -47,6 +49,78 @@ static void check_children_continuous(tree_node_t *root)
 		check_children_continuous(n);
 }
 
+static void gen_random_tree(fstree_t *fs, tree_node_t *root,
+			    unsigned int depth, unsigned int *seed)
+{
+	unsigned int i, count;
+	tree_node_t *n;
+	struct stat sb;
+	char name[32];
+
+	*seed = *seed * 1103515245 + 12345;
+	count = (*seed >> 16) % (depth > 0 ? 12 : 4);
+
+	for (i = 0; i < count; ++i) {
+		*seed = *seed * 1103515245 + 12345;
+		sprintf(name, "%u_%u", (*seed >> 16) % 1000, i);
+
+		memset(&sb, 0, sizeof(sb));
+		sb.st_mode = ((*seed >> 8) % 3 == 0 && depth > 0) ?
+			(S_IFDIR | 0755) : (S_IFCHR | 0644);
+
+		n = fstree_mknode(fs, root, name, strlen(name), NULL, &sb);
+		assert(n != NULL);
+
+		if (S_ISDIR(n->mode))
+			gen_random_tree(fs, n, depth - 1, seed);
+	}
+}
+
+static void compare_trees(const tree_node_t *a, const tree_node_t *b)
+{
+	assert(strcmp(a->name, b->name) == 0);
+	assert(a->inode_num == b->inode_num);
+
+	if (!S_ISDIR(a->mode))
+		return;
+
+	a = a->data.dir.children;
+	b = b->data.dir.children;
+
+	while (a != NULL && b != NULL) {
+		compare_trees(a, b);
+		a = a->next;
+		b = b->next;
+	}
+
+	assert(a == NULL && b == NULL);
+}
+
+static void check_parallel(unsigned int seed, unsigned int num_threads)
+{
+	unsigned int seed_b = seed;
+	fstree_t a, b;
+	size_t i;
+
+	assert(fstree_init(&a, NULL) == 0);
+	assert(fstree_init(&b, NULL) == 0);
+	gen_random_tree(&a, a.root, 6, &seed);
+	gen_random_tree(&b, b.root, 6, &seed_b);
+
+	tree_node_sort_recursive(a.root);
+	assert(fstree_gen_inode_table(&a) == 0);
+	assert(fstree_sort_gen_inode_table(&b, num_threads) == 0);
+
+	assert(a.inode_tbl_size == b.inode_tbl_size);
+	compare_trees(a.root, b.root);
+
+	for (i = 0; i < b.inode_tbl_size; ++i)
+		assert(b.inode_table[i]->inode_num == i + 1);
+
+	fstree_cleanup(&a);
+	fstree_cleanup(&b);
+}
+
 int main(void)
 {
 	tree_node_t *a, *b, *c;
@@ -64,24 +138,24 @@ int main(void)
 	// tree with 2 levels under root, fan out 3
 	assert(fstree_init(&fs, NULL) == 0);
 
-	a = gen_node(fs.root, "a");
-	b = gen_node(fs.root, "b");
-	c = gen_node(fs.root, "c");
+	a = gen_node(&fs, fs.root, "a");
+	b = gen_node(&fs, fs.root, "b");
+	c = gen_node(&fs, fs.root, "c");
 	assert(a != NULL);
 	assert(b != NULL);
 	assert(c != NULL);
 
-	assert(gen_node(a, "a_a") != NULL);
-	assert(gen_node(a, "a_b") != NULL);
-	assert(gen_node(a, "a_c") != NULL);
+	assert(gen_node(&fs, a, "a_a") != NULL);
+	assert(gen_node(&fs, a, "a_b") != NULL);
+	assert(gen_node(&fs, a, "a_c") != NULL);
 
-	assert(gen_node(b, "b_a") != NULL);
-	assert(gen_node(b, "b_b") != NULL);
-	assert(gen_node(b, "b_c") != NULL);
+	assert(gen_node(&fs, b, "b_a") != NULL);
+	assert(gen_node(&fs, b, "b_b") != NULL);
+	assert(gen_node(&fs, b, "b_c") != NULL);
 
-	assert(gen_node(c, "c_a") != NULL);
-	assert(gen_node(c, "c_b") != NULL);
-	assert(gen_node(c, "c_c") != NULL);
+	assert(gen_node(&fs, c, "c_a") != NULL);
+	assert(gen_node(&fs, c, "c_b") != NULL);
+	assert(gen_node(&fs, c, "c_c") != NULL);
 
 	assert(fstree_gen_inode_table(&fs) == 0);
 	assert(fs.inode_tbl_size == 13);
@@ -95,5 +169,10 @@ int main(void)
 	check_children_continuous(fs.root);
 
 	fstree_cleanup(&fs);
+
+	// splitting the work across threads yields the same numbers
+	for (i = 1; i <= 20; ++i)
+		check_parallel(i, i % 5);
+
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,116 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * hard_link.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "fstree.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+static void init_tree(fstree_t *fs)
+{
+	char *opts = strdup("mode=0755");
+
+	assert(opts != NULL);
+	assert(fstree_init(fs, opts) == 0);
+	free(opts);
+}
+
+static tree_node_t *add_file(fstree_t *fs, const char *path)
+{
+	struct stat sb;
+
+	memset(&sb, 0, sizeof(sb));
+	sb.st_mode = S_IFREG | 0644;
+
+	return fstree_add_generic(fs, path, &sb, path);
+}
+
+/* directories must come after the inodes their entries refer to */
+static void check_dir_order(const tree_node_t *dir)
+{
+	const tree_node_t *n, *tgt;
+
+	for (n = dir->data.dir.children; n != NULL; n = n->next) {
+		tgt = n;
+		if (n->mode == FSTREE_MODE_HARD_LINK_RESOLVED)
+			tgt = n->data.target;
+
+		assert(tgt->inode_num > 0);
+		assert(tgt->inode_num < dir->inode_num);
+
+		if (S_ISDIR(n->mode))
+			check_dir_order(n);
+	}
+}
+
+static void check_resolve_fails(const char *link, const char *target)
+{
+	fstree_t fs;
+
+	init_tree(&fs);
+	assert(add_file(&fs, "dir/file") != NULL);
+	assert(fstree_add_hard_link(&fs, link, target) != NULL);
+	assert(fstree_resolve_hard_links(&fs) != 0);
+	fstree_cleanup(&fs);
+}
+
+int main(void)
+{
+	tree_node_t *a, *b, *c, *d, *late;
+	size_t i;
+	fstree_t fs;
+
+	init_tree(&fs);
+
+	a = add_file(&fs, "x/file");
+	b = fstree_add_hard_link(&fs, "a/link", "x/file");
+	c = fstree_add_hard_link(&fs, "link2", "a/link");
+	d = fstree_add_hard_link(&fs, "b/early", "y/late");
+	late = add_file(&fs, "y/late");
+	assert(a != NULL && b != NULL && c != NULL && d != NULL);
+	assert(late != NULL);
+
+	assert(b->mode == FSTREE_MODE_HARD_LINK);
+	assert(strcmp(b->data.link_path, "x/file") == 0);
+
+	assert(fstree_add_hard_link(&fs, "a/link", "y/late") == NULL);
+
+	assert(fstree_resolve_hard_links(&fs) == 0);
+	assert(fs.has_hard_links);
+
+	assert(b->mode == FSTREE_MODE_HARD_LINK_RESOLVED);
+	assert(c->mode == FSTREE_MODE_HARD_LINK_RESOLVED);
+	assert(d->mode == FSTREE_MODE_HARD_LINK_RESOLVED);
+	assert(b->data.target == a);
+	assert(c->data.target == a);
+	assert(d->data.target == late);
+	assert(a->link_count == 2);
+	assert(late->link_count == 1);
+
+	/* links get no inode, their targets are numbered before "b" */
+	assert(fstree_sort_gen_inode_table(&fs, 4) == 0);
+	assert(fs.inode_tbl_size == 7);
+
+	for (i = 0; i < fs.inode_tbl_size; ++i) {
+		assert(fs.inode_table[i]->inode_num == i + 1);
+		assert(fs.inode_table[i]->mode != FSTREE_MODE_HARD_LINK);
+		assert(fs.inode_table[i]->mode !=
+		       FSTREE_MODE_HARD_LINK_RESOLVED);
+	}
+
+	check_dir_order(fs.root);
+	fstree_cleanup(&fs);
+
+	check_resolve_fails("link", "none");
+	check_resolve_fails("link", "dir");
+	check_resolve_fails("link", "link");
+	check_resolve_fails("link", "dir/file/x");
+	return EXIT_SUCCESS;
+}
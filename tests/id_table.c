@@ -0,0 +1,115 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * id_table.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+#include "test.h"
+
+#include "sqfs/id_table.h"
+#include "sqfs/compressor.h"
+#include "sqfs/super.h"
+#include "sqfs/error.h"
+#include "sqfs/io.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+static sqfs_u8 image[0x8000];
+static dummy_file_t file;
+
+static sqfs_u32 make_id(sqfs_u32 i)
+{
+	/* spread them out like user namespace ranges would */
+	return (i % 16) * 65536 + (i / 16);
+}
+
+int main(void)
+{
+	sqfs_u32 i, id, ids[4];
+	sqfs_id_table_t *tbl;
+	sqfs_u16 idx, out[4];
+	sqfs_super_t super;
+
+	tbl = sqfs_id_table_create();
+	assert(tbl != NULL);
+
+	for (i = 0; i < 0x10000; ++i) {
+		assert(sqfs_id_table_id_to_index(tbl, make_id(i), &idx) == 0);
+		assert(idx == i);
+	}
+
+	assert(sqfs_id_table_id_to_index(tbl, make_id(0x10000), &idx) ==
+	       SQFS_ERROR_OVERFLOW);
+
+	for (i = 0; i < 0x10000; ++i) {
+		assert(sqfs_id_table_id_to_index(tbl, make_id(i), &idx) == 0);
+		assert(idx == i);
+
+		assert(sqfs_id_table_index_to_id(tbl, i, &id) == 0);
+		assert(id == make_id(i));
+	}
+
+	ids[0] = make_id(42);
+	ids[1] = make_id(42);
+	ids[2] = make_id(7);
+	ids[3] = make_id(0xFFFF);
+
+	assert(sqfs_id_table_ids_to_indices(tbl, ids, out, 4) == 0);
+	assert(out[0] == 42);
+	assert(out[1] == 42);
+	assert(out[2] == 7);
+	assert(out[3] == 0xFFFF);
+
+	sqfs_id_table_destroy(tbl);
+
+	/* write a table out and read it back in lazily */
+	tbl = sqfs_id_table_create();
+	assert(tbl != NULL);
+
+	for (i = 0; i < 5000; ++i)
+		assert(sqfs_id_table_id_to_index(tbl, make_id(i), &idx) == 0);
+
+	memset(&super, 0, sizeof(super));
+	dummy_file_init(&file, image, 1, sizeof(image));
+
+	assert(sqfs_id_table_write(tbl, &file.base, &super, &dummy_cmp) == 0);
+	assert(super.id_count == 5000);
+	super.bytes_used = file.size;
+	sqfs_id_table_destroy(tbl);
+
+	tbl = sqfs_id_table_create();
+	assert(tbl != NULL);
+	assert(sqfs_id_table_read_lazy(tbl, &file.base, &super,
+				       &dummy_cmp) == 0);
+	assert(file.num_reads == 1);
+
+	/* only the block with the requested index is loaded */
+	assert(sqfs_id_table_index_to_id(tbl, 4999, &id) == 0);
+	assert(id == make_id(4999));
+	assert(file.num_reads == 3);
+
+	assert(sqfs_id_table_index_to_id(tbl, 4100, &id) == 0);
+	assert(id == make_id(4100));
+	assert(file.num_reads == 3);
+
+	assert(sqfs_id_table_index_to_id(tbl, 5000, &id) ==
+	       SQFS_ERROR_OUT_OF_BOUNDS);
+
+	/* mapping IDs to indices loads the rest of the table */
+	assert(sqfs_id_table_id_to_index(tbl, make_id(7), &idx) == 0);
+	assert(idx == 7);
+	assert(file.num_reads == 3 + 2 * 2);
+
+	for (i = 0; i < 5000; ++i) {
+		assert(sqfs_id_table_index_to_id(tbl, i, &id) == 0);
+		assert(id == make_id(i));
+	}
+
+	assert(file.num_reads == 3 + 2 * 2);
+
+	sqfs_id_table_destroy(tbl);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,137 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * inode_lookup.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+#include "test.h"
+
+#include "sqfs/meta_writer.h"
+#include "sqfs/dir_reader.h"
+#include "sqfs/compressor.h"
+#include "sqfs/super.h"
+#include "sqfs/inode.h"
+#include "sqfs/table.h"
+#include "sqfs/error.h"
+#include "sqfs/io.h"
+#include "util/compat.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/* enough for the export table to span several meta data blocks */
+#define NUM_INODES (3000)
+
+static sqfs_u64 refs[NUM_INODES];
+
+static void write_inodes(sqfs_file_t *file, sqfs_super_t *super)
+{
+	sqfs_inode_generic_t inode;
+	sqfs_meta_writer_t *mw;
+	sqfs_u64 block;
+	sqfs_u32 offset;
+	unsigned int i;
+
+	mw = sqfs_meta_writer_create(file, &dummy_cmp, 0);
+	assert(mw != NULL);
+
+	super->inode_table_start = file->get_size(file);
+
+	for (i = 0; i < NUM_INODES; ++i) {
+		memset(&inode, 0, sizeof(inode));
+		inode.base.type = SQFS_INODE_FIFO;
+		inode.base.mode = SQFS_INODE_MODE_FIFO | 0644;
+		inode.base.inode_number = i + 1;
+		inode.base.mod_time = i;
+		inode.data.ipc.nlink = 1;
+
+		sqfs_meta_writer_get_position(mw, &block, &offset);
+		refs[i] = (block << 16) | offset;
+
+		assert(sqfs_meta_writer_write_inode(mw, &inode) == 0);
+	}
+
+	assert(sqfs_meta_writer_flush(mw) == 0);
+	sqfs_meta_writer_destroy(mw);
+
+	super->inode_count = NUM_INODES;
+	super->directory_table_start = file->get_size(file);
+	super->fragment_table_start = 0xFFFFFFFFFFFFFFFFUL;
+}
+
+static void write_export_table(sqfs_file_t *file, sqfs_super_t *super)
+{
+	sqfs_u64 raw[NUM_INODES];
+	unsigned int i;
+
+	for (i = 0; i < NUM_INODES; ++i)
+		raw[i] = htole64(refs[i]);
+
+	assert(sqfs_write_table(file, &dummy_cmp, raw, sizeof(raw),
+				&super->export_table_start) == 0);
+
+	super->flags |= SQFS_FLAG_EXPORTABLE;
+	super->id_table_start = file->get_size(file);
+	super->bytes_used = file->get_size(file);
+}
+
+int main(void)
+{
+	sqfs_inode_generic_t *inode;
+	sqfs_dir_reader_t *rd;
+	sqfs_u8 pad[96];
+	sqfs_super_t super;
+	sqfs_file_t *file;
+	unsigned int i;
+	sqfs_u64 ref;
+
+	memset(&super, 0, sizeof(super));
+	memset(pad, 0, sizeof(pad));
+
+	file = sqfs_create_memory_file(0);
+	assert(file != NULL);
+	assert(file->write_at(file, 0, pad, sizeof(pad)) == 0);
+
+	write_inodes(file, &super);
+
+	/* without an export table, there is nothing to look up in */
+	super.export_table_start = 0xFFFFFFFFFFFFFFFFUL;
+	super.id_table_start = file->get_size(file);
+	super.bytes_used = file->get_size(file);
+
+	rd = sqfs_dir_reader_create(&super, &dummy_cmp, file);
+	assert(rd != NULL);
+	assert(sqfs_dir_reader_get_inode_ref(rd, 1,
+					     &ref) == SQFS_ERROR_UNSUPPORTED);
+	sqfs_dir_reader_destroy(rd);
+
+	write_export_table(file, &super);
+
+	rd = sqfs_dir_reader_create(&super, &dummy_cmp, file);
+	assert(rd != NULL);
+
+	/* backwards, so the table blocks are not loaded in order */
+	for (i = NUM_INODES; i > 0; --i) {
+		assert(sqfs_dir_reader_get_inode_ref(rd, i, &ref) == 0);
+		assert(ref == refs[i - 1]);
+	}
+
+	for (i = 1; i <= NUM_INODES; i += 97) {
+		assert(sqfs_dir_reader_find_by_number(rd, i, &inode) == 0);
+		assert(inode->base.type == SQFS_INODE_FIFO);
+		assert(inode->base.inode_number == i);
+		assert(inode->base.mod_time == i - 1);
+		free(inode);
+	}
+
+	assert(sqfs_dir_reader_get_inode_ref(rd, 0,
+					     &ref) == SQFS_ERROR_NO_ENTRY);
+	assert(sqfs_dir_reader_get_inode_ref(rd, NUM_INODES + 1,
+					     &ref) == SQFS_ERROR_NO_ENTRY);
+
+	sqfs_dir_reader_destroy(rd);
+	file->destroy(file);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,93 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * io_file.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "sqfs/error.h"
+#include "sqfs/io.h"
+
+#include <sys/stat.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+
+static void check_flush(void)
+{
+	char filename[] = "io_file_test.XXXXXX";
+	sqfs_u8 buffer[4000];
+	sqfs_file_t *file;
+	struct stat sb;
+	size_t i;
+	int fd;
+
+	fd = mkstemp(filename);
+	assert(fd >= 0);
+
+	file = sqfs_open_file(filename, SQFS_FILE_OPEN_OVERWRITE);
+	assert(file != NULL);
+
+	for (i = 0; i < sizeof(buffer); ++i)
+		buffer[i] = i * 13;
+
+	/* small appends are held back until the file is flushed */
+	assert(file->write_at(file, 0, buffer, sizeof(buffer)) == 0);
+	assert(file->get_size(file) == sizeof(buffer));
+
+	assert(sqfs_file_flush(file, 0x80) == SQFS_ERROR_UNSUPPORTED);
+	assert(sqfs_file_flush(file, SQFS_FILE_FLUSH_SYNC) == 0);
+	assert(fstat(fd, &sb) == 0);
+	assert(sb.st_size == sizeof(buffer));
+
+	memset(buffer, 0, sizeof(buffer));
+	assert(read(fd, buffer, sizeof(buffer)) == sizeof(buffer));
+
+	for (i = 0; i < sizeof(buffer); ++i)
+		assert(buffer[i] == (sqfs_u8)(i * 13));
+
+	file->destroy(file);
+	close(fd);
+	unlink(filename);
+}
+
+static void check_flush_error(void)
+{
+	sqfs_u8 buffer[100];
+	sqfs_file_t *file;
+
+	file = sqfs_open_file("/dev/full", SQFS_FILE_OPEN_NO_TRUNCATE);
+	if (file == NULL)
+		return;
+
+	memset(buffer, 0xAA, sizeof(buffer));
+	assert(file->write_at(file, 0, buffer, sizeof(buffer)) == 0);
+
+	/* the data is kept, so every flush reports the error again */
+	assert(sqfs_file_flush(file, 0) != 0);
+	assert(sqfs_file_flush(file, 0) != 0);
+
+	file->destroy(file);
+}
+
+/* files without a flush callback have nothing to write out */
+static void check_no_callback(void)
+{
+	sqfs_file_t *file = sqfs_create_memory_file(0);
+
+	assert(file != NULL);
+	assert(file->flush == NULL);
+	assert(sqfs_file_flush(file, 0) == 0);
+	file->destroy(file);
+}
+
+int main(void)
+{
+	check_flush();
+	check_flush_error();
+	check_no_callback();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,159 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * io_memory.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "sqfs/meta_reader.h"
+#include "sqfs/super.h"
+#include "sqfs/error.h"
+#include "sqfs/io.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_DATA 100
+
+static void check_growable(void)
+{
+	sqfs_u8 buffer[300], big[100000];
+	const void *data;
+	sqfs_file_t *file;
+	size_t size, i;
+
+	file = sqfs_create_memory_file(0);
+	assert(file != NULL);
+	assert(file->get_size(file) == 0);
+	assert(sqfs_memory_file_get_data(file, &data, &size) == 0);
+	assert(size == 0);
+
+	/* writing past the end leaves a gap filled with zeros */
+	assert(file->write_at(file, 200, "abc", 3) == 0);
+	assert(file->get_size(file) == 203);
+	assert(file->read_at(file, 0, buffer, 203) == 0);
+
+	for (i = 0; i < 200; ++i)
+		assert(buffer[i] == 0);
+	assert(memcmp(buffer + 200, "abc", 3) == 0);
+
+	assert(file->read_at(file, 200, buffer, 4) ==
+	       SQFS_ERROR_OUT_OF_BOUNDS);
+
+	/* overwrite in place, then grow the buffer */
+	assert(file->write_at(file, 10, "xyz", 3) == 0);
+	assert(file->get_size(file) == 203);
+
+	for (i = 0; i < sizeof(big); ++i)
+		big[i] = i * 7;
+
+	assert(file->write_at(file, 203, big, sizeof(big)) == 0);
+	assert(file->get_size(file) == 203 + sizeof(big));
+
+	assert(sqfs_memory_file_get_data(file, &data, &size) == 0);
+	assert(size == 203 + sizeof(big));
+	assert(memcmp((const sqfs_u8 *)data + 10, "xyz", 3) == 0);
+	assert(memcmp((const sqfs_u8 *)data + 200, "abc", 3) == 0);
+	assert(memcmp((const sqfs_u8 *)data + 203, big, sizeof(big)) == 0);
+
+	/* shrink, then grow again with zeros */
+	assert(file->truncate(file, 5) == 0);
+	assert(file->get_size(file) == 5);
+	assert(file->truncate(file, 20) == 0);
+	assert(file->read_at(file, 0, buffer, 20) == 0);
+
+	for (i = 5; i < 20; ++i)
+		assert(buffer[i] == 0);
+
+	file->destroy(file);
+}
+
+static void check_read_only(void)
+{
+	static const sqfs_u8 image[] = "0123456789";
+	sqfs_file_t *file;
+	const void *ptr;
+	sqfs_u8 buffer[4];
+	size_t size;
+
+	assert(sqfs_open_memory(NULL, 10) == NULL);
+
+	file = sqfs_open_memory(image, 10);
+	assert(file != NULL);
+	assert(file->get_size(file) == 10);
+
+	/* the buffer is used directly */
+	assert(file->map_at != NULL);
+	assert(file->map_at(file, 3, 4, &ptr) == 0);
+	assert(ptr == image + 3);
+	assert(file->map_at(file, 8, 4, &ptr) == SQFS_ERROR_OUT_OF_BOUNDS);
+
+	assert(sqfs_memory_file_get_data(file, &ptr, &size) == 0);
+	assert(ptr == image && size == 10);
+
+	assert(file->read_at(file, 6, buffer, 4) == 0);
+	assert(memcmp(buffer, "6789", 4) == 0);
+
+	assert(file->write_at(file, 0, "x", 1) == SQFS_ERROR_IO);
+	assert(file->truncate(file, 0) == SQFS_ERROR_IO);
+	assert(image[0] == '0');
+
+	file->destroy(file);
+}
+
+static void check_round_trip(void)
+{
+	sqfs_u8 block[2 + BLOCK_DATA], buffer[BLOCK_DATA];
+	sqfs_super_t super, read_back;
+	sqfs_meta_reader_t *m;
+	sqfs_file_t *out, *in;
+	const void *data;
+	size_t size, i;
+
+	/* a super block followed by an uncompressed meta data block */
+	out = sqfs_create_memory_file(4096);
+	assert(out != NULL);
+
+	assert(sqfs_super_init(&super, 4096, 0, SQFS_COMP_GZIP) == 0);
+	super.id_count = 1;
+	super.bytes_used = sizeof(sqfs_super_t) + sizeof(block);
+	assert(sqfs_super_write(&super, out) == 0);
+
+	block[0] = BLOCK_DATA;
+	block[1] = 0x80;
+	for (i = 0; i < BLOCK_DATA; ++i)
+		block[2 + i] = i * 31;
+
+	assert(out->write_at(out, sizeof(sqfs_super_t),
+			     block, sizeof(block)) == 0);
+
+	assert(sqfs_memory_file_get_data(out, &data, &size) == 0);
+	assert(size == super.bytes_used);
+
+	in = sqfs_open_memory(data, size);
+	assert(in != NULL);
+
+	assert(sqfs_super_read(&read_back, in) == 0);
+	assert(read_back.bytes_used == super.bytes_used);
+	assert(read_back.block_size == 4096);
+
+	m = sqfs_meta_reader_create(in, NULL, sizeof(sqfs_super_t), size);
+	assert(m != NULL);
+	assert(sqfs_meta_reader_seek(m, sizeof(sqfs_super_t), 0) == 0);
+	assert(sqfs_meta_reader_read(m, buffer, sizeof(buffer)) == 0);
+	assert(memcmp(buffer, block + 2, sizeof(buffer)) == 0);
+
+	sqfs_meta_reader_destroy(m);
+	in->destroy(in);
+	out->destroy(out);
+}
+
+int main(void)
+{
+	check_growable();
+	check_read_only();
+	check_round_trip();
+	return EXIT_SUCCESS;
+}
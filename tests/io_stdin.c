@@ -0,0 +1,81 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * io_stdin.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "common.h"
+#include "tar.h"
+
+#include <unistd.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#define STR(x) #x
+#define STRVALUE(x) STR(x)
+
+#define TEST_PATH STRVALUE(TESTPATH)
+
+/* bytes after the end of the requested range that must not be touched */
+#define GUARD (64)
+
+static void read_range(sqfs_file_t *file, sqfs_u64 offset, size_t size,
+		       size_t data_at)
+{
+	sqfs_u8 buffer[64 + GUARD];
+	size_t i;
+
+	assert(size <= 64);
+	memset(buffer, 0xAA, sizeof(buffer));
+
+	assert(file->read_at(file, offset, buffer, size) == 0);
+
+	for (i = 0; i < size; ++i) {
+		if (i >= data_at && i < data_at + 5) {
+			assert(buffer[i] == "test\n"[i - data_at]);
+		} else {
+			assert(buffer[i] == 0);
+		}
+	}
+
+	for (; i < sizeof(buffer); ++i)
+		assert(buffer[i] == 0xAA);
+}
+
+int main(void)
+{
+	tar_header_decoded_t hdr;
+	sqfs_file_t *file;
+	istream_t *fp;
+
+	assert(chdir(TEST_PATH) == 0);
+
+	/* "test\n" at the start of the regions at 0 and 256k, 4k each */
+	fp = istream_open_file("sparse-files/gnu-small.tar");
+	assert(fp != NULL);
+	assert(read_header(fp, &hdr) == 0);
+	assert(hdr.sparse != NULL);
+
+	file = sqfs_get_stdin_file(fp, hdr.sparse, hdr.record_size);
+	assert(file != NULL);
+
+	read_range(file, 0, 8, 0);
+
+	/* reaches past the end of a region, into the hole after it */
+	read_range(file, 4096 - 8, 16, 16);
+
+	/* starts in a hole, ends in a region that goes past the buffer */
+	read_range(file, 262144 - 16, 32, 16);
+
+	/* entirely in a hole */
+	read_range(file, 300000, 64, 64);
+
+	file->destroy(file);
+	clear_header(&hdr);
+	fp->destroy(fp);
+	return EXIT_SUCCESS;
+}
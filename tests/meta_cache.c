@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * meta_cache.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+#include "test.h"
+
+#include "sqfs/meta_reader.h"
+#include "sqfs/error.h"
+#include "sqfs/io.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_BLOCKS 8
+#define BLOCK_DATA 100
+#define BLOCK_SIZE (BLOCK_DATA + 2)
+
+static sqfs_u8 image[NUM_BLOCKS * BLOCK_SIZE];
+static dummy_file_t file;
+
+static void check_block(sqfs_meta_reader_t *m, size_t i)
+{
+	sqfs_u8 buffer[BLOCK_DATA];
+	size_t j;
+
+	assert(sqfs_meta_reader_seek(m, i * BLOCK_SIZE, 0) == 0);
+	assert(sqfs_meta_reader_read(m, buffer, sizeof(buffer)) == 0);
+
+	for (j = 0; j < sizeof(buffer); ++j)
+		assert(buffer[j] == (sqfs_u8)(i * 31 + j));
+}
+
+int main(void)
+{
+	sqfs_meta_reader_t *a, *b;
+	sqfs_meta_cache_t *cache;
+	size_t i, j;
+	sqfs_u8 x;
+
+	/* uncompressed blocks, so no compressor is needed */
+	for (i = 0; i < NUM_BLOCKS; ++i) {
+		image[i * BLOCK_SIZE] = BLOCK_DATA;
+		image[i * BLOCK_SIZE + 1] = 0x80;
+
+		for (j = 0; j < BLOCK_DATA; ++j)
+			image[i * BLOCK_SIZE + 2 + j] = i * 31 + j;
+	}
+
+	dummy_file_init(&file, image, sizeof(image), 0);
+	assert(sqfs_meta_cache_create(0) == NULL);
+
+	cache = sqfs_meta_cache_create(3);
+	assert(cache != NULL);
+
+	a = sqfs_meta_reader_create(&file.base, NULL, 0, sizeof(image));
+	b = sqfs_meta_reader_create(&file.base, NULL, 0, sizeof(image));
+	assert(a != NULL && b != NULL);
+
+	sqfs_meta_reader_set_cache(a, cache);
+	sqfs_meta_reader_set_cache(b, cache);
+
+	/* blocks read by one reader are found by the other */
+	check_block(a, 0);
+	check_block(a, 1);
+	assert(file.num_reads == 4);
+
+	check_block(b, 0);
+	check_block(b, 1);
+	check_block(a, 0);
+	assert(file.num_reads == 4);
+
+	/* the least recently used block gets replaced */
+	check_block(b, 2);
+	check_block(a, 3);
+	assert(file.num_reads == 8);
+
+	check_block(b, 2);
+	check_block(a, 0);
+	assert(file.num_reads == 8);
+
+	check_block(a, 1);
+	assert(file.num_reads == 10);
+
+	/* blocks that a reader currently points into are never replaced */
+	check_block(a, 4);
+	check_block(b, 5);
+	for (i = 0; i < NUM_BLOCKS; ++i) {
+		if (i != 4)
+			check_block(b, i);
+	}
+	check_block(a, 4);
+	assert(sqfs_meta_reader_seek(a, 4 * BLOCK_SIZE, 42) == 0);
+
+	/* a cached block outside the bounds of a reader is not served */
+	check_block(a, 3);
+	sqfs_meta_reader_destroy(b);
+	b = sqfs_meta_reader_create(&file.base, NULL, 0, 4 * BLOCK_SIZE - 1);
+	assert(b != NULL);
+	sqfs_meta_reader_set_cache(b, cache);
+
+	assert(sqfs_meta_reader_seek(b, 3 * BLOCK_SIZE, 0) ==
+	       SQFS_ERROR_OUT_OF_BOUNDS);
+	check_block(b, 2);
+
+	/* the cache is no longer used after detaching */
+	sqfs_meta_reader_set_cache(a, NULL);
+	file.num_reads = 0;
+	check_block(a, 3);
+	assert(file.num_reads == 2);
+
+	/* the end of a block is a valid position, reading continues after */
+	assert(sqfs_meta_reader_seek(a, 2 * BLOCK_SIZE, BLOCK_DATA) == 0);
+	assert(sqfs_meta_reader_read(a, &x, 1) == 0);
+	assert(x == (sqfs_u8)(3 * 31));
+	assert(sqfs_meta_reader_seek(a, 2 * BLOCK_SIZE, BLOCK_DATA + 1) ==
+	       SQFS_ERROR_OUT_OF_BOUNDS);
+
+	sqfs_meta_reader_destroy(a);
+	sqfs_meta_reader_destroy(b);
+	sqfs_meta_cache_destroy(cache);
+	return EXIT_SUCCESS;
+}
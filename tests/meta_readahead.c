@@ -0,0 +1,133 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * meta_readahead.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+#include "test.h"
+
+#include "sqfs/meta_writer.h"
+#include "sqfs/meta_reader.h"
+#include "sqfs/compressor.h"
+#include "sqfs/error.h"
+#include "sqfs/block.h"
+#include "sqfs/io.h"
+#include "util/compat.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define NUM_BLOCKS (40)
+#define DATA_SIZE (NUM_BLOCKS * SQFS_META_BLOCK_SIZE - 1000)
+#define WINDOW (8)
+
+/* counts how often the meta data reader reads from the image */
+static sqfs_file_t *image;
+static size_t num_reads;
+
+static int count_read_at(sqfs_file_t *file, sqfs_u64 offset,
+			 void *buffer, size_t size)
+{
+	(void)file;
+	num_reads += 1;
+	return image->read_at(image, offset, buffer, size);
+}
+
+static sqfs_u64 count_get_size(const sqfs_file_t *file)
+{
+	(void)file;
+	return image->get_size(image);
+}
+
+static sqfs_file_t count_file = {
+	.read_at = count_read_at,
+	.get_size = count_get_size,
+};
+
+static sqfs_u8 data[DATA_SIZE];
+
+static void check_read(sqfs_meta_reader_t *m, size_t pos, size_t size)
+{
+	sqfs_u8 buffer[3000];
+
+	assert(size <= sizeof(buffer));
+	assert(sqfs_meta_reader_read(m, buffer, size) == 0);
+	assert(memcmp(buffer, data + pos, size) == 0);
+}
+
+int main(void)
+{
+	sqfs_u64 start, limit, blocks[NUM_BLOCKS];
+	sqfs_meta_reader_t *m;
+	sqfs_meta_writer_t *mw;
+	sqfs_u8 buffer[1000];
+	size_t i, pos, diff;
+	sqfs_u32 offset;
+
+	for (i = 0; i < DATA_SIZE; ++i)
+		data[i] = (i * 13 + i / 251) & 0xFF;
+
+	image = sqfs_create_memory_file(0);
+	assert(image != NULL);
+
+	mw = sqfs_meta_writer_create(image, &dummy_cmp, 0);
+	assert(mw != NULL);
+
+	for (i = 0; i < NUM_BLOCKS; ++i) {
+		diff = i == NUM_BLOCKS - 1 ? SQFS_META_BLOCK_SIZE - 1000 :
+			SQFS_META_BLOCK_SIZE;
+
+		sqfs_meta_writer_get_position(mw, blocks + i, &offset);
+		assert(offset == 0);
+
+		assert(sqfs_meta_writer_append(mw,
+				data + i * SQFS_META_BLOCK_SIZE, diff) == 0);
+	}
+
+	assert(sqfs_meta_writer_flush(mw) == 0);
+	sqfs_meta_writer_destroy(mw);
+
+	start = 0;
+	limit = image->get_size(image);
+
+	m = sqfs_meta_reader_create(&count_file, &dummy_cmp, start, limit);
+	assert(m != NULL);
+	assert(sqfs_meta_reader_set_readahead(m, WINDOW) == 0);
+
+	/* front to back, in chunks that straddle the block boundaries */
+	num_reads = 0;
+	assert(sqfs_meta_reader_seek(m, start, 0) == 0);
+
+	for (pos = 0; pos < DATA_SIZE; pos += diff) {
+		diff = DATA_SIZE - pos < 2999 ? DATA_SIZE - pos : 2999;
+		check_read(m, pos, diff);
+	}
+
+	/* 2 reads for the first block, then one per window */
+	assert(num_reads == 2 + (NUM_BLOCKS - 1 + WINDOW - 1) / WINDOW);
+
+	/* back to the start and into a block in the current window */
+	assert(sqfs_meta_reader_seek(m, blocks[3], 100) == 0);
+	check_read(m, 3 * SQFS_META_BLOCK_SIZE + 100, 2000);
+
+	assert(sqfs_meta_reader_seek(m, blocks[NUM_BLOCKS - 2], 10) == 0);
+	check_read(m, (NUM_BLOCKS - 2) * SQFS_META_BLOCK_SIZE + 10, 3000);
+
+	/* past the end of the table */
+	assert(sqfs_meta_reader_seek(m, blocks[NUM_BLOCKS - 1], 7000) == 0);
+	assert(sqfs_meta_reader_read(m, buffer, 1000) ==
+	       SQFS_ERROR_OUT_OF_BOUNDS);
+
+	/* turning it off again goes back to reading single blocks */
+	assert(sqfs_meta_reader_set_readahead(m, 0) == 0);
+	assert(sqfs_meta_reader_seek(m, blocks[10], 0) == 0);
+	check_read(m, 10 * SQFS_META_BLOCK_SIZE, 3000);
+	check_read(m, 10 * SQFS_META_BLOCK_SIZE + 3000, 3000);
+	check_read(m, 10 * SQFS_META_BLOCK_SIZE + 6000, 3000);
+
+	sqfs_meta_reader_destroy(m);
+	image->destroy(image);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,116 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * mkfs_dedup.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "mkfs.h"
+#include "test.h"
+
+#define NUM_FILES (7)
+#define FILE_SIZE (1000)
+
+/*
+  Two groups of identical files that may and may not be deduplicated, a
+  file that only shares the size with them but has other flags and one
+  with a size of its own.
+ */
+static const struct {
+	const char *name;
+	sqfs_u32 flags;
+	size_t size;
+	int content;
+} inputs[NUM_FILES] = {
+	{ "a", 0, FILE_SIZE, 1 },
+	{ "b", SQFS_BLK_DONT_DEDUPLICATE, FILE_SIZE, 2 },
+	{ "c", 0, FILE_SIZE, 1 },
+	{ "d", SQFS_BLK_DONT_DEDUPLICATE, FILE_SIZE, 2 },
+	{ "e", SQFS_BLK_DONT_FRAGMENT, FILE_SIZE, 1 },
+	{ "f", 0, 2 * FILE_SIZE, 1 },
+	{ "g", SQFS_BLK_DONT_DEDUPLICATE, FILE_SIZE, 3 },
+};
+
+static sqfs_u8 data[NUM_FILES][2 * FILE_SIZE];
+static dummy_file_t files[NUM_FILES];
+static file_info_t infos[NUM_FILES];
+
+static void dummy_file_destroy(sqfs_file_t *file)
+{
+	(void)file;
+}
+
+/* the input files are opened by name, hand out the dummy ones instead */
+sqfs_file_t *sqfs_open_file(const char *filename, sqfs_u32 flags)
+{
+	size_t i;
+
+	assert(flags == SQFS_FILE_OPEN_READ_ONLY);
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		if (strcmp(filename, inputs[i].name) == 0)
+			return (sqfs_file_t *)(files + i);
+	}
+
+	assert(0);
+	return NULL;
+}
+
+static void init_tree(fstree_t *fs)
+{
+	size_t i;
+
+	memset(fs, 0, sizeof(*fs));
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		memset(data[i], inputs[i].content, inputs[i].size);
+		dummy_file_init(files + i, data[i], inputs[i].size, 0);
+		files[i].base.destroy = dummy_file_destroy;
+
+		infos[i].input_file = (char *)inputs[i].name;
+		infos[i].flags = inputs[i].flags;
+		infos[i].next = (i + 1 < NUM_FILES) ? (infos + i + 1) : NULL;
+	}
+
+	fs->files = infos;
+}
+
+int main(void)
+{
+	file_info_t **dups;
+	sqfs_u64 total;
+	fstree_t fs;
+	size_t i;
+
+	/* only the two files that can be deduplicated are read */
+	init_tree(&fs);
+	dups = find_duplicate_files(&fs, true, &total);
+	assert(dups != NULL);
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		if (i == 0 || i == 2) {
+			assert(files[i].num_reads > 0);
+		} else {
+			assert(files[i].num_reads == 0);
+		}
+	}
+
+	for (i = 0; i < NUM_FILES; ++i)
+		assert(dups[i] == (i == 2 ? infos : NULL));
+
+	assert(total == 5 * FILE_SIZE + 2 * FILE_SIZE);
+	free(dups);
+
+	/* without the search, nothing is read or linked */
+	init_tree(&fs);
+	dups = find_duplicate_files(&fs, false, &total);
+	assert(dups != NULL);
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		assert(files[i].num_reads == 0);
+		assert(dups[i] == NULL);
+	}
+
+	assert(total == 6 * FILE_SIZE + 2 * FILE_SIZE);
+	free(dups);
+	return EXIT_SUCCESS;
+}
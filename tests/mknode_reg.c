@@ -28,7 +28,7 @@ int main(void)
 	sb.st_rdev = 789;
 	sb.st_size = 4096;
 
-	node = fstree_mknode(NULL, "filename", 8, "input", &sb);
+	node = fstree_mknode(NULL, NULL, "filename", 8, "input", &sb);
 	assert(node->uid == sb.st_uid);
 	assert(node->gid == sb.st_gid);
 	assert(node->mode == sb.st_mode);
@@ -26,7 +26,7 @@ int main(void)
 	sb.st_rdev = 789;
 	sb.st_size = 1337;
 
-	node = fstree_mknode(NULL, "sockfile", 8, NULL, &sb);
+	node = fstree_mknode(NULL, NULL, "sockfile", 8, NULL, &sb);
 	assert((char *)node->name >= (char *)node->payload);
 	assert(strcmp(node->name, "sockfile") == 0);
 	assert(node->uid == sb.st_uid);
@@ -45,7 +45,7 @@ int main(void)
 	sb.st_rdev = 789;
 	sb.st_size = 1337;
 
-	node = fstree_mknode(NULL, "fifo", 4, NULL, &sb);
+	node = fstree_mknode(NULL, NULL, "fifo", 4, NULL, &sb);
 	assert((char *)node->name >= (char *)node->payload);
 	assert(strcmp(node->name, "fifo") == 0);
 	assert(node->uid == sb.st_uid);
@@ -64,7 +64,7 @@ int main(void)
 	sb.st_rdev = 789;
 	sb.st_size = 1337;
 
-	node = fstree_mknode(NULL, "blkdev", 6, NULL, &sb);
+	node = fstree_mknode(NULL, NULL, "blkdev", 6, NULL, &sb);
 	assert((char *)node->name >= (char *)node->payload);
 	assert(strcmp(node->name, "blkdev") == 0);
 	assert(node->uid == sb.st_uid);
@@ -82,7 +82,7 @@ int main(void)
 	sb.st_rdev = 789;
 	sb.st_size = 1337;
 
-	node = fstree_mknode(NULL, "chardev", 7, NULL, &sb);
+	node = fstree_mknode(NULL, NULL, "chardev", 7, NULL, &sb);
 	assert((char *)node->name >= (char *)node->payload);
 	assert(strcmp(node->name, "chardev") == 0);
 	assert(node->uid == sb.st_uid);
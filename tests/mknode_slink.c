@@ -14,7 +14,7 @@
 
 int main(void)
 {
-	tree_node_t *node;
+	tree_node_t *node, *parent, *other;
 	struct stat sb;
 	fstree_t fs;
 
@@ -26,7 +26,7 @@ int main(void)
 	sb.st_rdev = 789;
 	sb.st_size = 1337;
 
-	node = fstree_mknode(NULL, "symlink", 7, "target", &sb);
+	node = fstree_mknode(NULL, NULL, "symlink", 7, "target", &sb);
 	assert(node->uid == sb.st_uid);
 	assert(node->gid == sb.st_gid);
 	assert(node->mode == (S_IFLNK | 0777));
@@ -38,7 +38,7 @@ int main(void)
 	assert(strcmp(node->data.slink_target, "target") == 0);
 	free(node);
 
-	node = fstree_mknode(NULL, "symlink", 7, "", &sb);
+	node = fstree_mknode(NULL, NULL, "symlink", 7, "", &sb);
 	assert(node->uid == sb.st_uid);
 	assert(node->gid == sb.st_gid);
 	assert(node->mode == (S_IFLNK | 0777));
@@ -50,5 +50,34 @@ int main(void)
 	assert(node->data.slink_target[0] == '\0');
 	free(node);
 
+	/* symlinks with the same name and target share the strings */
+	assert(fstree_init(&fs, NULL) == 0);
+	assert(fstree_intern_strings(&fs) == 0);
+
+	node = fstree_mknode(&fs, fs.root, "symlink", 7, "target", &sb);
+	assert(node != NULL);
+	assert(strcmp(node->name, "symlink") == 0);
+	assert(strcmp(node->data.slink_target, "target") == 0);
+
+	sb.st_mode = S_IFDIR | 0755;
+	parent = fstree_mknode(&fs, fs.root, "dir", 3, NULL, &sb);
+	assert(parent != NULL);
+
+	sb.st_mode = S_IFLNK | 0654;
+	other = fstree_mknode(&fs, parent, "symlink", 7, "target", &sb);
+	assert(other != NULL);
+	assert(other != node);
+	assert(other->name == node->name);
+	assert(other->name_len == 7);
+	assert(other->data.slink_target == node->data.slink_target);
+
+	other = fstree_mknode(&fs, parent, "symlink2", 8, "target", &sb);
+	assert(other != NULL);
+	assert(other->name != node->name);
+	assert(strcmp(other->name, "symlink2") == 0);
+	assert(other->data.slink_target == node->data.slink_target);
+
+	fstree_cleanup(&fs);
+
 	return EXIT_SUCCESS;
 }
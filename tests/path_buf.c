@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * path_buf.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "util/path_buf.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+int main(void)
+{
+	char name[300];
+	path_buf_t pb;
+	size_t len;
+
+	assert(path_buf_init(&pb, "") == 0);
+	assert(pb.len == 0 && strcmp(pb.str, "") == 0);
+
+	assert(path_buf_push(&pb, "usr", 3) == 0);
+	assert(strcmp(pb.str, "usr") == 0);
+
+	len = pb.len;
+	assert(path_buf_push(&pb, "bin/xyz", 3) == 0);
+	assert(strcmp(pb.str, "usr/bin") == 0);
+	assert(pb.len == strlen(pb.str));
+
+	path_buf_truncate(&pb, len);
+	assert(strcmp(pb.str, "usr") == 0);
+
+	/* must grow the buffer */
+	memset(name, 'a', sizeof(name));
+	assert(path_buf_push(&pb, name, sizeof(name)) == 0);
+	assert(pb.len == 4 + sizeof(name));
+	assert(pb.str[3] == '/' && pb.str[pb.len] == '\0');
+	assert(memcmp(pb.str + 4, name, sizeof(name)) == 0);
+
+	path_buf_truncate(&pb, 0);
+	assert(strcmp(pb.str, "") == 0);
+	path_buf_cleanup(&pb);
+
+	/* no double slash after a prefix that ends with one */
+	assert(path_buf_init(&pb, "/") == 0);
+	assert(path_buf_push(&pb, "etc", 3) == 0);
+	assert(path_buf_push(&pb, "fstab", 5) == 0);
+	assert(strcmp(pb.str, "/etc/fstab") == 0);
+	path_buf_cleanup(&pb);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,137 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * path_index.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "sqfs/path_index.h"
+#include "sqfs/super.h"
+#include "sqfs/error.h"
+#include "sqfs/io.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+
+#define NUM_FILES (5000)
+
+static sqfs_u64 file_ref(unsigned int i)
+{
+	return ((sqfs_u64)(i * 37) << 16) | (i % 8192);
+}
+
+static void check_lookups(const sqfs_path_index_t *index)
+{
+	char path[64];
+	unsigned int i;
+	sqfs_u64 ref;
+
+	assert(sqfs_path_index_lookup(index, "", &ref) == 0);
+	assert(ref == 0x1234);
+	assert(sqfs_path_index_lookup(index, "/", &ref) == 0);
+	assert(ref == 0x1234);
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		sprintf(path, "dir%u/file%u", i % 13, i);
+
+		ref = 0;
+		assert(sqfs_path_index_lookup(index, path, &ref) == 0);
+		assert(ref == file_ref(i));
+	}
+
+	/* same separators as sqfs_dir_reader_find_by_path */
+	assert(sqfs_path_index_lookup(index, "/dir3/file3", &ref) == 0);
+	assert(ref == file_ref(3));
+	assert(sqfs_path_index_lookup(index, "dir3//file3/", &ref) == 0);
+	assert(ref == file_ref(3));
+	assert(sqfs_path_index_lookup(index, "\\dir3\\file3", &ref) == 0);
+	assert(ref == file_ref(3));
+
+	assert(sqfs_path_index_lookup(index, "dir3", &ref) == 0);
+	assert(ref == 3);
+
+	assert(sqfs_path_index_lookup(index, "dir3/file4",
+				      &ref) == SQFS_ERROR_NO_ENTRY);
+	assert(sqfs_path_index_lookup(index, "dir3/file",
+				      &ref) == SQFS_ERROR_NO_ENTRY);
+	assert(sqfs_path_index_lookup(index, "dir3/file33",
+				      &ref) == SQFS_ERROR_NO_ENTRY);
+	assert(sqfs_path_index_lookup(index, "dir",
+				      &ref) == SQFS_ERROR_NO_ENTRY);
+}
+
+int main(void)
+{
+	sqfs_path_index_t *index, *loaded;
+	const void *data;
+	sqfs_super_t super;
+	sqfs_file_t *file, *copy;
+	char path[64];
+	unsigned int i;
+	size_t size;
+	sqfs_u8 *buf;
+
+	memset(&super, 0, sizeof(super));
+	super.modification_time = 1234;
+	super.bytes_used = 4096 * 10;
+	super.root_inode_ref = 0x1234;
+	super.inode_table_start = 4096;
+
+	index = sqfs_path_index_create();
+	assert(index != NULL);
+
+	assert(sqfs_path_index_add(index, "/", 0x1234) == 0);
+
+	for (i = 0; i < 13; ++i) {
+		sprintf(path, "dir%u", i);
+		assert(sqfs_path_index_add(index, path, i) == 0);
+	}
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		sprintf(path, "/dir%u/file%u", i % 13, i);
+		assert(sqfs_path_index_add(index, path, file_ref(i)) == 0);
+	}
+
+	file = sqfs_create_memory_file(0);
+	assert(file != NULL);
+	assert(sqfs_path_index_write(index, file, &super) == 0);
+
+	/* usable right after writing */
+	check_lookups(index);
+	sqfs_path_index_destroy(index);
+
+	assert(sqfs_path_index_load(&loaded, file, &super) == 0);
+	check_lookups(loaded);
+	sqfs_path_index_destroy(loaded);
+
+	/* an index for a different image is rejected */
+	super.bytes_used += 4096;
+	assert(sqfs_path_index_load(&loaded, file,
+				    &super) == SQFS_ERROR_CORRUPTED);
+	super.bytes_used -= 4096;
+
+	/* so is a truncated one */
+	assert(sqfs_memory_file_get_data(file, &data, &size) == 0);
+	buf = malloc(size);
+	assert(buf != NULL);
+	memcpy(buf, data, size);
+
+	copy = sqfs_open_memory(buf, size - 1);
+	assert(copy != NULL);
+	assert(sqfs_path_index_load(&loaded, copy,
+				    &super) == SQFS_ERROR_CORRUPTED);
+	copy->destroy(copy);
+
+	copy = sqfs_open_memory(buf, 16);
+	assert(copy != NULL);
+	assert(sqfs_path_index_load(&loaded, copy,
+				    &super) == SQFS_ERROR_CORRUPTED);
+	copy->destroy(copy);
+
+	free(buf);
+	file->destroy(file);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,120 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * read_inode.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+#include "test.h"
+
+#include "sqfs/meta_writer.h"
+#include "sqfs/meta_reader.h"
+#include "sqfs/compressor.h"
+#include "sqfs/super.h"
+#include "sqfs/inode.h"
+#include "sqfs/dir.h"
+#include "sqfs/io.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+
+/* enough for the index to not fit into the initial allocation */
+#define NUM_INDEX (20)
+
+static size_t make_index(sqfs_u8 *data)
+{
+	sqfs_dir_index_t ent;
+	size_t i, offset = 0;
+	char name[16];
+
+	for (i = 0; i < NUM_INDEX; ++i) {
+		sprintf(name, "entry_%02u", (unsigned int)i);
+
+		ent.index = i * 1000;
+		ent.start_block = i * 8192;
+		ent.size = strlen(name) - 1;
+
+		memcpy(data + offset, &ent, sizeof(ent));
+		offset += sizeof(ent);
+
+		memcpy(data + offset, name, strlen(name));
+		offset += strlen(name);
+	}
+
+	return offset;
+}
+
+int main(void)
+{
+	sqfs_inode_generic_t *inode, *out;
+	sqfs_meta_writer_t *mw;
+	sqfs_meta_reader_t *mr;
+	sqfs_dir_index_t ent;
+	sqfs_super_t super;
+	sqfs_file_t *file;
+	size_t i, offset;
+	char name[16];
+
+	memset(&super, 0, sizeof(super));
+	super.block_size = SQFS_DEFAULT_BLOCK_SIZE;
+
+	inode = calloc(1, sizeof(*inode) + NUM_INDEX * (sizeof(ent) + 16));
+	assert(inode != NULL);
+
+	inode->base.type = SQFS_INODE_EXT_DIR;
+	inode->base.mode = SQFS_INODE_MODE_DIR | 0755;
+	inode->base.inode_number = 2;
+	inode->data.dir_ext.nlink = 2;
+	inode->data.dir_ext.size = NUM_INDEX * 1000;
+	inode->data.dir_ext.start_block = 4096;
+	inode->data.dir_ext.parent_inode = 1;
+	inode->data.dir_ext.inodex_count = NUM_INDEX;
+	inode->data.dir_ext.offset = 42;
+	inode->data.dir_ext.xattr_idx = 0xFFFFFFFF;
+	inode->num_dir_idx_bytes = make_index(inode->extra);
+
+	file = sqfs_create_memory_file(0);
+	assert(file != NULL);
+
+	mw = sqfs_meta_writer_create(file, &dummy_cmp, 0);
+	assert(mw != NULL);
+	assert(sqfs_meta_writer_write_inode(mw, inode) == 0);
+	assert(sqfs_meta_writer_flush(mw) == 0);
+	sqfs_meta_writer_destroy(mw);
+
+	mr = sqfs_meta_reader_create(file, &dummy_cmp, 0,
+				     file->get_size(file));
+	assert(mr != NULL);
+	assert(sqfs_meta_reader_read_inode(mr, &super, 0, 0, &out) == 0);
+	sqfs_meta_reader_destroy(mr);
+
+	assert(out->base.type == SQFS_INODE_EXT_DIR);
+	assert(out->data.dir_ext.size == NUM_INDEX * 1000);
+	assert(out->data.dir_ext.start_block == 4096);
+	assert(out->data.dir_ext.inodex_count == NUM_INDEX);
+	assert(out->data.dir_ext.offset == 42);
+
+	/* every entry is followed by its name, not overwritten by the next */
+	assert(out->num_dir_idx_bytes == inode->num_dir_idx_bytes);
+
+	for (i = 0, offset = 0; i < NUM_INDEX; ++i) {
+		sprintf(name, "entry_%02u", (unsigned int)i);
+
+		memcpy(&ent, out->extra + offset, sizeof(ent));
+		offset += sizeof(ent);
+
+		assert(ent.index == i * 1000);
+		assert(ent.start_block == i * 8192);
+		assert(ent.size == strlen(name) - 1);
+		assert(memcmp(out->extra + offset, name, strlen(name)) == 0);
+
+		offset += strlen(name);
+	}
+
+	free(out);
+	free(inode);
+	file->destroy(file);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,98 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * remove_node.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "fstree.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#define NUM_FILES (1000)
+
+int main(void)
+{
+	tree_node_t *dir, *n;
+	struct stat sb;
+	char path[64];
+	unsigned int i;
+	fstree_t fs;
+
+	assert(fstree_init(&fs, NULL) == 0);
+
+	memset(&sb, 0, sizeof(sb));
+	sb.st_mode = S_IFDIR | 0755;
+
+	dir = fstree_add_generic(&fs, "dir", &sb, NULL);
+	assert(dir != NULL);
+	assert(fstree_add_generic(&fs, "dir/sub", &sb, NULL) != NULL);
+
+	sb.st_mode = S_IFREG | 0644;
+
+	/* enough files in one directory to get it into the hash index */
+	for (i = 0; i < NUM_FILES; ++i) {
+		sprintf(path, "dir/file%u", i);
+		assert(fstree_add_generic(&fs, path, &sb, NULL) != NULL);
+	}
+
+	assert(fstree_add_generic(&fs, "dir/sub/a", &sb, NULL) != NULL);
+
+	assert(fstree_get_node_by_path(&fs, "") == fs.root);
+	assert(fstree_get_node_by_path(&fs, "/dir") == dir);
+	assert(fstree_get_node_by_path(&fs, "dir//file3") != NULL);
+	assert(fstree_get_node_by_path(&fs, "dir/file3/x") == NULL);
+	assert(fstree_get_node_by_path(&fs, "dir/nope") == NULL);
+
+	/* remove every other file, the rest must still be found */
+	for (i = 0; i < NUM_FILES; i += 2) {
+		sprintf(path, "dir/file%u", i);
+		n = fstree_get_node_by_path(&fs, path);
+		assert(n != NULL);
+		fstree_remove_node(&fs, n);
+	}
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		sprintf(path, "dir/file%u", i);
+		n = fstree_get_node_by_path(&fs, path);
+
+		if (i % 2) {
+			assert(n != NULL);
+			assert(n->parent == dir);
+		} else {
+			assert(n == NULL);
+		}
+	}
+
+	for (i = 0, n = dir->data.dir.children; n != NULL; n = n->next)
+		++i;
+	assert(i == NUM_FILES / 2 + 1);
+
+	/* a removed name can be added again */
+	assert(fstree_add_generic(&fs, "dir/file0", &sb, NULL) != NULL);
+	assert(fstree_add_generic(&fs, "dir/file1", &sb, NULL) == NULL);
+
+	/* removing a directory takes everything below with it */
+	n = fstree_get_node_by_path(&fs, "dir/sub");
+	assert(n != NULL);
+	fstree_remove_node(&fs, n);
+	assert(fstree_get_node_by_path(&fs, "dir/sub") == NULL);
+	assert(fstree_get_node_by_path(&fs, "dir/sub/a") == NULL);
+
+	assert(fstree_add_generic(&fs, "dir/sub/b", &sb, NULL) != NULL);
+	n = fstree_get_node_by_path(&fs, "dir/sub");
+	assert(n != NULL);
+	assert(n->data.dir.created_implicitly);
+	assert(n->data.dir.children != NULL);
+	assert(n->data.dir.children->next == NULL);
+
+	fstree_remove_node(&fs, fs.root);
+	assert(fstree_get_node_by_path(&fs, "dir") == dir);
+
+	fstree_cleanup(&fs);
+	return EXIT_SUCCESS;
+}
@@ -60,8 +60,10 @@ fail:
 
 int main(void)
 {
+	static const sqfs_u8 blob[] = { 0x00, 0x01, 0x00, 0xFF, 0x00 };
+	size_t i, j, idx, size;
 	str_table_t table;
-	size_t i, j, idx;
+	const void *data;
 	const char *str;
 
 	assert(chdir(TEST_PATH) == 0);
@@ -101,6 +103,41 @@ int main(void)
 		assert(strcmp(str, strings[i]) == 0);
 	}
 
+	/* interning without the line break adds a copy, but only once */
+	for (i = 0; i < 1000; ++i) {
+		str = str_table_intern(&table, strings[i],
+				       strlen(strings[i]) - 1);
+		assert(str != NULL);
+		assert(strncmp(str, strings[i], strlen(str)) == 0);
+		assert(strlen(str) == strlen(strings[i]) - 1);
+
+		assert(str_table_intern(&table, str, strlen(str)) == str);
+		assert(str_table_get_index(&table, str, &idx) == 0);
+		assert(idx == 1000 + i);
+	}
+
+	/* binary blobs may contain null bytes and differ only in size */
+	assert(str_table_get_blob_index(&table, blob, sizeof(blob),
+					&idx) == 0);
+	assert(idx == 2000);
+	assert(str_table_get_blob_index(&table, blob, sizeof(blob) - 1,
+					&idx) == 0);
+	assert(idx == 2001);
+	assert(str_table_get_blob_index(&table, blob, sizeof(blob),
+					&idx) == 0);
+	assert(idx == 2000);
+
+	data = str_table_get_blob(&table, 2000, &size);
+	assert(data != NULL);
+	assert(size == sizeof(blob));
+	assert(memcmp(data, blob, sizeof(blob)) == 0);
+
+	data = str_table_get_blob(&table, 2001, &size);
+	assert(data != NULL);
+	assert(size == sizeof(blob) - 1);
+
+	assert(str_table_get_blob(&table, 2002, &size) == NULL);
+
 	str_table_cleanup(&table);
 
 	for (i = 0; i < 1000; ++i)
@@ -9,44 +9,41 @@
 #include "util/util.h"
 #include "tar.h"
 
-#include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <fcntl.h>
 
 int main(int argc, char **argv)
 {
 	tar_header_decoded_t hdr;
-	int fd, ret;
+	istream_t *fp;
+	int ret;
 
 	if (argc != 2) {
 		fputs("usage: tar_fuzz <tarball>\n", stderr);
 		return EXIT_FAILURE;
 	}
 
-	fd = open(argv[1], O_RDONLY);
-	if (fd < 0) {
-		perror(argv[1]);
+	fp = istream_open_file(argv[1]);
+	if (fp == NULL)
 		return EXIT_FAILURE;
-	}
 
 	for (;;) {
-		ret = read_header(fd, &hdr);
+		ret = read_header(fp, &hdr);
 		if (ret > 0)
 			break;
 		if (ret < 0)
 			goto fail;
 
-		ret = lseek(fd, hdr.sb.st_size, SEEK_CUR);
+		ret = skip_entry(fp, hdr.sb.st_size);
 
 		clear_header(&hdr);
 		if (ret < 0)
 			goto fail;
 	}
 
-	close(fd);
+	fp->destroy(fp);
 	return EXIT_SUCCESS;
 fail:
-	close(fd);
+	fp->destroy(fp);
 	return EXIT_FAILURE;
 }
@@ -13,7 +13,6 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
-#include <fcntl.h>
 #include <stdio.h>
 
 #define STR(x) #x
@@ -21,16 +20,14 @@
 
 #define TEST_PATH STRVALUE(TESTPATH)
 
-static int open_read(const char *path)
+static istream_t *open_read(const char *path)
 {
-	int fd = open(path, O_RDONLY);
+	istream_t *fp = istream_open_file(path);
 
-	if (fd < 0) {
-		perror(path);
+	if (fp == NULL)
 		exit(EXIT_FAILURE);
-	}
 
-	return fd;
+	return fp;
 }
 
 static const char *filename =
@@ -42,12 +39,12 @@ int main(void)
 {
 	tar_header_decoded_t hdr;
 	char buffer[6];
-	int fd;
+	istream_t *fp;
 
 	assert(chdir(TEST_PATH) == 0);
 
-	fd = open_read("format-acceptance/pax.tar");
-	assert(read_header(fd, &hdr) == 0);
+	fp = open_read("format-acceptance/pax.tar");
+	assert(read_header(fp, &hdr) == 0);
 	assert(hdr.sb.st_mode == (S_IFREG | 0644));
 	assert(hdr.sb.st_uid == 01750);
 	assert(hdr.sb.st_gid == 01750);
@@ -56,14 +53,14 @@ int main(void)
 	assert(hdr.mtime == 1542905892);
 	assert(strcmp(hdr.name, "input.txt") == 0);
 	assert(!hdr.unknown_record);
-	assert(read_retry("data0", fd, buffer, 5) == 0);
+	assert(read_retry("data0", fp, buffer, 5) == 0);
 	buffer[5] = '\0';
 	assert(strcmp(buffer, "test\n") == 0);
 	clear_header(&hdr);
-	close(fd);
+	fp->destroy(fp);
 
-	fd = open_read("file-size/pax.tar");
-	assert(read_header(fd, &hdr) == 0);
+	fp = open_read("file-size/pax.tar");
+	assert(read_header(fp, &hdr) == 0);
 	assert(hdr.sb.st_mode == (S_IFREG | 0644));
 	assert(hdr.sb.st_uid == 01750);
 	assert(hdr.sb.st_gid == 01750);
@@ -73,10 +70,10 @@ int main(void)
 	assert(strcmp(hdr.name, "big-file.bin") == 0);
 	assert(!hdr.unknown_record);
 	clear_header(&hdr);
-	close(fd);
+	fp->destroy(fp);
 
-	fd = open_read("user-group-largenum/pax.tar");
-	assert(read_header(fd, &hdr) == 0);
+	fp = open_read("user-group-largenum/pax.tar");
+	assert(read_header(fp, &hdr) == 0);
 	assert(hdr.sb.st_mode == (S_IFREG | 0644));
 	assert(hdr.sb.st_uid == 2147483648);
 	assert(hdr.sb.st_gid == 2147483648);
@@ -85,14 +82,14 @@ int main(void)
 	assert(hdr.mtime == 013376036700);
 	assert(strcmp(hdr.name, "input.txt") == 0);
 	assert(!hdr.unknown_record);
-	assert(read_retry("data1", fd, buffer, 5) == 0);
+	assert(read_retry("data1", fp, buffer, 5) == 0);
 	buffer[5] = '\0';
 	assert(strcmp(buffer, "test\n") == 0);
 	clear_header(&hdr);
-	close(fd);
+	fp->destroy(fp);
 
-	fd = open_read("large-mtime/pax.tar");
-	assert(read_header(fd, &hdr) == 0);
+	fp = open_read("large-mtime/pax.tar");
+	assert(read_header(fp, &hdr) == 0);
 	assert(hdr.sb.st_mode == (S_IFREG | 0644));
 	assert(hdr.sb.st_uid == 01750);
 	assert(hdr.sb.st_gid == 01750);
@@ -105,14 +102,14 @@ int main(void)
 	assert(hdr.mtime == 8589934592L);
 	assert(strcmp(hdr.name, "input.txt") == 0);
 	assert(!hdr.unknown_record);
-	assert(read_retry("data2", fd, buffer, 5) == 0);
+	assert(read_retry("data2", fp, buffer, 5) == 0);
 	buffer[5] = '\0';
 	assert(strcmp(buffer, "test\n") == 0);
 	clear_header(&hdr);
-	close(fd);
+	fp->destroy(fp);
 
-	fd = open_read("negative-mtime/pax.tar");
-	assert(read_header(fd, &hdr) == 0);
+	fp = open_read("negative-mtime/pax.tar");
+	assert(read_header(fp, &hdr) == 0);
 	assert(hdr.sb.st_mode == (S_IFREG | 0644));
 	assert(hdr.sb.st_uid == 01750);
 	assert(hdr.sb.st_gid == 01750);
@@ -121,14 +118,14 @@ int main(void)
 	assert(hdr.mtime == -315622800);
 	assert(strcmp(hdr.name, "input.txt") == 0);
 	assert(!hdr.unknown_record);
-	assert(read_retry("data3", fd, buffer, 5) == 0);
+	assert(read_retry("data3", fp, buffer, 5) == 0);
 	buffer[5] = '\0';
 	assert(strcmp(buffer, "test\n") == 0);
 	clear_header(&hdr);
-	close(fd);
+	fp->destroy(fp);
 
-	fd = open_read("long-paths/pax.tar");
-	assert(read_header(fd, &hdr) == 0);
+	fp = open_read("long-paths/pax.tar");
+	assert(read_header(fp, &hdr) == 0);
 	assert(hdr.sb.st_mode == (S_IFREG | 0644));
 	assert(hdr.sb.st_uid == 01750);
 	assert(hdr.sb.st_gid == 01750);
@@ -137,11 +134,11 @@ int main(void)
 	assert(hdr.mtime == 1542909670);
 	assert(strcmp(hdr.name, filename) == 0);
 	assert(!hdr.unknown_record);
-	assert(read_retry("data4", fd, buffer, 5) == 0);
+	assert(read_retry("data4", fp, buffer, 5) == 0);
 	buffer[5] = '\0';
 	assert(strcmp(buffer, "test\n") == 0);
 	clear_header(&hdr);
-	close(fd);
+	fp->destroy(fp);
 
 	return EXIT_SUCCESS;
 }
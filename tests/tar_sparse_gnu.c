@@ -13,7 +13,6 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
-#include <fcntl.h>
 #include <stdio.h>
 
 #define STR(x) #x
@@ -21,28 +20,26 @@
 
 #define TEST_PATH STRVALUE(TESTPATH)
 
-static int open_read(const char *path)
+static istream_t *open_read(const char *path)
 {
-	int fd = open(path, O_RDONLY);
+	istream_t *fp = istream_open_file(path);
 
-	if (fd < 0) {
-		perror(path);
+	if (fp == NULL)
 		exit(EXIT_FAILURE);
-	}
 
-	return fd;
+	return fp;
 }
 
 int main(void)
 {
 	tar_header_decoded_t hdr;
 	sparse_map_t *sparse;
-	int fd;
+	istream_t *fp;
 
 	assert(chdir(TEST_PATH) == 0);
 
-	fd = open_read("sparse-files/gnu-small.tar");
-	assert(read_header(fd, &hdr) == 0);
+	fp = open_read("sparse-files/gnu-small.tar");
+	assert(read_header(fp, &hdr) == 0);
 	assert(hdr.sb.st_mode == (S_IFREG | 0644));
 	assert(hdr.sb.st_uid == 01750);
 	assert(hdr.sb.st_gid == 01750);
@@ -70,10 +67,10 @@ int main(void)
 	assert(sparse->next == NULL);
 
 	clear_header(&hdr);
-	close(fd);
+	fp->destroy(fp);
 
-	fd = open_read("sparse-files/gnu.tar");
-	assert(read_header(fd, &hdr) == 0);
+	fp = open_read("sparse-files/gnu.tar");
+	assert(read_header(fp, &hdr) == 0);
 	assert(hdr.sb.st_mode == (S_IFREG | 0644));
 	assert(hdr.sb.st_uid == 01750);
 	assert(hdr.sb.st_gid == 01750);
@@ -132,7 +129,38 @@ int main(void)
 	assert(sparse == NULL);
 
 	clear_header(&hdr);
-	close(fd);
+	fp->destroy(fp);
+
+	/* offsets beyond 8 GiB are stored in base 256 */
+	fp = open_read("sparse-files/gnu-base256.tar");
+	assert(read_header(fp, &hdr) == 0);
+	assert(hdr.sb.st_mode == (S_IFREG | 0644));
+	assert(hdr.sb.st_size == 10737418240);
+	assert(hdr.actual_size == 10737418240);
+	assert(hdr.record_size == 8192);
+	assert(strcmp(hdr.name, "big.bin") == 0);
+	assert(!hdr.unknown_record);
+
+	sparse = hdr.sparse;
+	assert(sparse != NULL);
+	assert(sparse->offset == 0);
+	assert(sparse->count == 4096);
+
+	sparse = sparse->next;
+	assert(sparse != NULL);
+	assert(sparse->offset == 9663676416);
+	assert(sparse->count == 4096);
+
+	sparse = sparse->next;
+	assert(sparse != NULL);
+	assert(sparse->offset == 10737418240);
+	assert(sparse->count == 0);
+
+	sparse = sparse->next;
+	assert(sparse == NULL);
+
+	clear_header(&hdr);
+	fp->destroy(fp);
 
 	return EXIT_SUCCESS;
 }
@@ -13,7 +13,6 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
-#include <fcntl.h>
 #include <stdio.h>
 
 #define STR(x) #x
@@ -21,28 +20,26 @@
 
 #define TEST_PATH STRVALUE(TESTPATH)
 
-static int open_read(const char *path)
+static istream_t *open_read(const char *path)
 {
-	int fd = open(path, O_RDONLY);
+	istream_t *fp = istream_open_file(path);
 
-	if (fd < 0) {
-		perror(path);
+	if (fp == NULL)
 		exit(EXIT_FAILURE);
-	}
 
-	return fd;
+	return fp;
 }
 
 int main(void)
 {
 	tar_header_decoded_t hdr;
 	sparse_map_t *sparse;
-	int fd;
+	istream_t *fp;
 
 	assert(chdir(TEST_PATH) == 0);
 
-	fd = open_read("sparse-files/pax-gnu0-1.tar");
-	assert(read_header(fd, &hdr) == 0);
+	fp = open_read("sparse-files/pax-gnu0-1.tar");
+	assert(read_header(fp, &hdr) == 0);
 	assert(hdr.sb.st_mode == (S_IFREG | 0644));
 	assert(hdr.sb.st_uid == 01750);
 	assert(hdr.sb.st_gid == 01750);
@@ -101,10 +98,10 @@ int main(void)
 	assert(sparse == NULL);
 
 	clear_header(&hdr);
-	close(fd);
+	fp->destroy(fp);
 
-	fd = open_read("sparse-files/pax-gnu1-0.tar");
-	assert(read_header(fd, &hdr) == 0);
+	fp = open_read("sparse-files/pax-gnu1-0.tar");
+	assert(read_header(fp, &hdr) == 0);
 	assert(hdr.sb.st_mode == (S_IFREG | 0644));
 	assert(hdr.sb.st_uid == 01750);
 	assert(hdr.sb.st_gid == 01750);
@@ -163,7 +160,7 @@ int main(void)
 	assert(sparse == NULL);
 
 	clear_header(&hdr);
-	close(fd);
+	fp->destroy(fp);
 
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,93 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * tar_write.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "util/util.h"
+#include "tar.h"
+
+#include <sys/stat.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+static sqfs_u8 buffer[OSTREAM_BUFFER_SIZE];
+
+/* a single header always fits into the buffer */
+static int mem_write(ostream_t *strm, const void *data, size_t size)
+{
+	(void)strm; (void)data; (void)size;
+	return -1;
+}
+
+static int mem_precache(istream_t *strm)
+{
+	strm->eof = true;
+	return 0;
+}
+
+static const char *ostrm_get_filename(ostream_t *strm)
+{
+	(void)strm;
+	return "tar_write";
+}
+
+static const char *istrm_get_filename(istream_t *strm)
+{
+	(void)strm;
+	return "tar_write";
+}
+
+static void check_size(sqfs_u64 size, const char *field)
+{
+	tar_header_decoded_t hdr;
+	const tar_header_t *raw;
+	istream_t istrm;
+	ostream_t ostrm;
+	struct stat sb;
+
+	memset(&ostrm, 0, sizeof(ostrm));
+	ostrm.buffer = buffer;
+	ostrm.write = mem_write;
+	ostrm.get_filename = ostrm_get_filename;
+
+	memset(&sb, 0, sizeof(sb));
+	sb.st_mode = S_IFREG | 0644;
+	sb.st_size = size;
+
+	assert(write_tar_header(&ostrm, &sb, "file", NULL, NULL, 0) == 0);
+	assert(ostrm.buffer_used == TAR_RECORD_SIZE);
+
+	raw = (const tar_header_t *)buffer;
+	assert(memcmp(raw->size, field, sizeof(raw->size)) == 0);
+
+	memset(&istrm, 0, sizeof(istrm));
+	istrm.buffer = buffer;
+	istrm.buffer_used = ostrm.buffer_used;
+	istrm.precache = mem_precache;
+	istrm.get_filename = istrm_get_filename;
+
+	assert(read_header(&istrm, &hdr) == 0);
+	assert(strcmp(hdr.name, "file") == 0);
+	assert((sqfs_u64)hdr.sb.st_size == size);
+	assert(hdr.actual_size == size);
+	assert(hdr.record_size == size);
+	clear_header(&hdr);
+}
+
+int main(void)
+{
+	check_size(4095, "00000007777 ");
+
+	/* needs more than 32 bits, but still fits into 11 octal digits */
+	check_size(4294967297, "40000000001 ");
+	check_size(8589934591, "77777777777 ");
+
+	/* all 12 digits, without a terminator */
+	check_size(8589934592, "100000000000");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * test.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+#include "test.h"
+
+#include "sqfs/error.h"
+
+#include <assert.h>
+#include <string.h>
+
+static sqfs_s32 dummy_do_block(sqfs_compressor_t *cmp, const sqfs_u8 *in,
+			       sqfs_u32 size, sqfs_u8 *out, sqfs_u32 outsize)
+{
+	(void)cmp; (void)in; (void)size; (void)out; (void)outsize;
+	return 0;
+}
+
+static sqfs_compressor_t *dummy_create_copy(sqfs_compressor_t *cmp)
+{
+	return cmp;
+}
+
+static void dummy_destroy(sqfs_compressor_t *cmp)
+{
+	(void)cmp;
+}
+
+sqfs_compressor_t dummy_cmp = {
+	.do_block = dummy_do_block,
+	.create_copy = dummy_create_copy,
+	.destroy = dummy_destroy,
+};
+
+static int dummy_read_at(sqfs_file_t *base, sqfs_u64 offset,
+			 void *buffer, size_t size)
+{
+	dummy_file_t *file = (dummy_file_t *)base;
+
+	assert(offset + size <= file->size);
+	memcpy(buffer, file->data + offset, size);
+	++file->num_reads;
+	return 0;
+}
+
+static int dummy_write_at(sqfs_file_t *base, sqfs_u64 offset,
+			  const void *buffer, size_t size)
+{
+	dummy_file_t *file = (dummy_file_t *)base;
+
+	if (offset + size > file->max_size)
+		return SQFS_ERROR_IO;
+
+	memcpy(file->data + offset, buffer, size);
+	if (offset + size > file->size)
+		file->size = offset + size;
+	return 0;
+}
+
+static sqfs_u64 dummy_get_size(const sqfs_file_t *base)
+{
+	return ((const dummy_file_t *)base)->size;
+}
+
+void dummy_file_init(dummy_file_t *file, void *data, size_t size,
+		     size_t max_size)
+{
+	memset(file, 0, sizeof(*file));
+	file->data = data;
+	file->size = size;
+	file->max_size = max_size;
+
+	file->base.read_at = dummy_read_at;
+	file->base.write_at = dummy_write_at;
+	file->base.get_size = dummy_get_size;
+}
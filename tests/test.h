@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * test.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef TEST_H
+#define TEST_H
+
+#include "sqfs/compressor.h"
+#include "sqfs/io.h"
+
+#include <stddef.h>
+
+/*
+  Always "fails" to compress, so the blocks are stored uncompressed. It has
+  no state, so the workers of the data writer and reader can all share it.
+ */
+extern sqfs_compressor_t dummy_cmp;
+
+/* an image in a caller supplied buffer, that counts the reads from it */
+typedef struct {
+	sqfs_file_t base;
+
+	sqfs_u8 *data;
+	size_t size;
+	size_t max_size;
+
+	size_t num_reads;
+} dummy_file_t;
+
+/*
+  The first size bytes of the buffer are the image. Writes can grow it up
+  to max_size bytes, or are rejected if max_size is 0.
+ */
+void dummy_file_init(dummy_file_t *file, void *data, size_t size,
+		     size_t max_size);
+
+#endif /* TEST_H */
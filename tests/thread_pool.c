@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * thread_pool.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "sqfs/thread_pool.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+#define NUM_JOBS (1000)
+#define NUM_SPAWNING (10)
+
+static sqfs_thread_pool_t *pool;
+static unsigned long sum;
+
+static void add_value(void *user)
+{
+	__sync_fetch_and_add(&sum, (unsigned long)user);
+}
+
+/* jobs may submit more jobs, even while the pool is being destroyed */
+static void spawn_more(void *user)
+{
+	unsigned long i;
+
+	(void)user;
+
+	for (i = 1; i <= NUM_SPAWNING; ++i)
+		assert(sqfs_thread_pool_submit(pool, add_value, (void *)i) == 0);
+}
+
+int main(void)
+{
+	unsigned long i, expect = 0;
+
+	pool = sqfs_thread_pool_create(3);
+	assert(pool != NULL);
+	assert(sqfs_thread_pool_get_num_threads(pool) == 3 ||
+	       sqfs_thread_pool_get_num_threads(pool) == 0);
+
+	for (i = 1; i <= NUM_JOBS; ++i) {
+		assert(sqfs_thread_pool_submit(pool, add_value, (void *)i) == 0);
+		expect += i;
+	}
+
+	for (i = 0; i < NUM_SPAWNING; ++i) {
+		assert(sqfs_thread_pool_submit(pool, spawn_more, NULL) == 0);
+		expect += NUM_SPAWNING * (NUM_SPAWNING + 1) / 2;
+	}
+
+	/* must wait for all of them */
+	sqfs_thread_pool_destroy(pool);
+	assert(sum == expect);
+
+	/* an empty pool */
+	pool = sqfs_thread_pool_create(0);
+	assert(pool != NULL);
+	sqfs_thread_pool_destroy(pool);
+	return EXIT_SUCCESS;
+}
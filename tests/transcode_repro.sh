@@ -0,0 +1,46 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-3.0-or-later
+#
+# Pack a directory with one block size, transcode the image to another one
+# and check that the result is the same as packing it with the new block
+# size directly.
+set -e
+
+srcdir=${srcdir:-.}
+work=transcode_repro.$$
+
+cleanup() {
+	rm -rf "$work"
+}
+trap cleanup EXIT
+
+mkdir -p "$work/in/src" "$work/in/big" "$work/in/dup"
+
+# small files that only have a tail end, files with data blocks, whole
+# duplicates and files that share their leading blocks with others
+cp "$srcdir"/lib/sqfs/*.c "$work/in/src"
+cat "$srcdir"/lib/sqfs/*.c > "$work/in/big/all"
+cat "$srcdir"/lib/sqfs/[a-m]*.c > "$work/in/big/first"
+cat "$srcdir"/lib/sqfs/[a-m]*.c "$srcdir"/tests/*.c > "$work/in/big/more"
+cat "$srcdir"/tests/*.c > "$work/in/big/tests"
+cp "$srcdir"/lib/sqfs/io_memory.c "$srcdir"/lib/sqfs/xattr.c "$work/in/dup"
+cp "$work/in/big/first" "$work/in/dup/first"
+
+for from in 4096 131072; do
+	for to in 16384 65536; do
+		./gensquashfs -q -f -c gzip -b "$from" -D "$work/in" \
+			      "$work/src.sqfs"
+		./gensquashfs -q -f -c gzip -b "$to" -D "$work/in" \
+			      "$work/direct.sqfs"
+		./sqfstranscode -q -f -b "$to" "$work/src.sqfs" \
+				"$work/transcoded.sqfs"
+
+		if ! cmp "$work/direct.sqfs" "$work/transcoded.sqfs"; then
+			echo "transcoding from $from to $to byte blocks" \
+			     "differs from a direct build" >&2
+			exit 1
+		fi
+	done
+done
+
+exit 0
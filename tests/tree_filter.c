@@ -0,0 +1,282 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * tree_filter.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+#include "test.h"
+
+#include "sqfs/meta_writer.h"
+#include "sqfs/dir_writer.h"
+#include "sqfs/dir_reader.h"
+#include "sqfs/compressor.h"
+#include "sqfs/id_table.h"
+#include "sqfs/super.h"
+#include "sqfs/inode.h"
+#include "sqfs/error.h"
+#include "sqfs/dir.h"
+#include "sqfs/io.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+typedef struct {
+	const char *name;
+	sqfs_u32 inode_num;
+	sqfs_u64 ref;
+	sqfs_u16 mode;
+} entry_t;
+
+static sqfs_meta_writer_t *im;
+static sqfs_dir_writer_t *dirw;
+
+static void write_inode(sqfs_inode_generic_t *inode, entry_t *ent)
+{
+	sqfs_u64 block;
+	sqfs_u32 offset;
+
+	sqfs_meta_writer_get_position(im, &block, &offset);
+	ent->ref = (block << 16) | offset;
+	ent->mode = inode->base.mode;
+
+	assert(sqfs_meta_writer_write_inode(im, inode) == 0);
+}
+
+static void write_fifo(entry_t *ent)
+{
+	sqfs_inode_generic_t inode;
+
+	memset(&inode, 0, sizeof(inode));
+	inode.base.type = SQFS_INODE_FIFO;
+	inode.base.mode = SQFS_INODE_MODE_FIFO | 0644;
+	inode.base.inode_number = ent->inode_num;
+	inode.data.ipc.nlink = 1;
+
+	write_inode(&inode, ent);
+}
+
+/* entries must be sorted by name */
+static void write_dir(entry_t *ent, const entry_t *children, size_t count,
+		      sqfs_u32 parent)
+{
+	sqfs_inode_generic_t *inode;
+	size_t i;
+
+	assert(sqfs_dir_writer_begin(dirw, 0) == 0);
+
+	for (i = 0; i < count; ++i) {
+		assert(sqfs_dir_writer_add_entry(dirw, children[i].name,
+						 children[i].inode_num,
+						 children[i].ref,
+						 children[i].mode) == 0);
+	}
+
+	assert(sqfs_dir_writer_end(dirw) == 0);
+
+	inode = sqfs_dir_writer_create_inode(dirw, 0, 0xFFFFFFFF, parent);
+	assert(inode != NULL);
+	inode->base.mode = SQFS_INODE_MODE_DIR | 0755;
+	inode->base.inode_number = ent->inode_num;
+
+	write_inode(inode, ent);
+	free(inode);
+}
+
+/*
+  /a/x
+  /a/z
+  /b
+  /c/y
+ */
+static void write_image(sqfs_file_t *file, sqfs_super_t *super)
+{
+	entry_t a[] = { { "x", 1, 0, 0 }, { "z", 2, 0, 0 } };
+	entry_t c[] = { { "y", 5, 0, 0 } };
+	entry_t root_ents[] = {
+		{ "a", 3, 0, 0 }, { "b", 4, 0, 0 }, { "c", 6, 0, 0 },
+	};
+	entry_t root = { "", 7, 0, 0 };
+	sqfs_meta_writer_t *dm;
+	sqfs_id_table_t *idtbl;
+	sqfs_u16 idx;
+
+	im = sqfs_meta_writer_create(file, &dummy_cmp,
+				     SQFS_META_WRITER_KEEP_IN_MEMORY);
+	dm = sqfs_meta_writer_create(file, &dummy_cmp,
+				     SQFS_META_WRITER_KEEP_IN_MEMORY);
+	assert(im != NULL && dm != NULL);
+
+	dirw = sqfs_dir_writer_create(dm);
+	assert(dirw != NULL);
+
+	write_fifo(a + 0);
+	write_fifo(a + 1);
+	write_dir(root_ents + 0, a, 2, 7);
+	write_fifo(root_ents + 1);
+	write_fifo(c + 0);
+	write_dir(root_ents + 2, c, 1, 7);
+	write_dir(&root, root_ents, 3, 0);
+
+	super->root_inode_ref = root.ref;
+	super->inode_count = 7;
+
+	assert(sqfs_meta_writer_flush(im) == 0);
+	assert(sqfs_meta_writer_flush(dm) == 0);
+
+	super->inode_table_start = file->get_size(file);
+	assert(sqfs_meta_write_write_to_file(im) == 0);
+
+	super->directory_table_start = file->get_size(file);
+	assert(sqfs_meta_write_write_to_file(dm) == 0);
+
+	idtbl = sqfs_id_table_create();
+	assert(idtbl != NULL);
+	assert(sqfs_id_table_id_to_index(idtbl, 0, &idx) == 0);
+	assert(sqfs_id_table_write(idtbl, file, super, &dummy_cmp) == 0);
+	sqfs_id_table_destroy(idtbl);
+
+	super->fragment_table_start = 0xFFFFFFFFFFFFFFFFUL;
+	super->export_table_start = 0xFFFFFFFFFFFFFFFFUL;
+	super->xattr_id_table_start = 0xFFFFFFFFFFFFFFFFUL;
+	super->bytes_used = file->get_size(file);
+
+	sqfs_dir_writer_destroy(dirw);
+	sqfs_meta_writer_destroy(dm);
+	sqfs_meta_writer_destroy(im);
+}
+
+static unsigned int num_calls;
+
+static int filter(void *user, const sqfs_tree_node_t *parent,
+		  const sqfs_dir_entry_t *ent)
+{
+	const char *name = (const char *)ent->name;
+
+	++num_calls;
+
+	/* nothing below an excluded directory is ever looked at */
+	assert(strcmp(name, "x") != 0 && strcmp(name, "z") != 0);
+
+	if (strcmp(name, "y") == 0) {
+		assert(strcmp((const char *)parent->name, "c") == 0);
+		assert(parent->parent != NULL);
+		assert(parent->parent->parent == NULL);
+		return *((int *)user);
+	}
+
+	return strcmp(name, "a") == 0 ? 1 : 0;
+}
+
+static unsigned int count_nodes(const sqfs_tree_node_t *n)
+{
+	unsigned int count = 1;
+
+	for (n = n->children; n != NULL; n = n->next)
+		count += count_nodes(n);
+
+	return count;
+}
+
+int main(void)
+{
+	sqfs_tree_node_t *root, *n;
+	sqfs_id_table_t *idtbl;
+	sqfs_dir_reader_t *rd;
+	sqfs_super_t super;
+	sqfs_file_t *file;
+	const char *path;
+	sqfs_u8 pad[96];
+	int y_result;
+
+	memset(&super, 0, sizeof(super));
+	memset(pad, 0, sizeof(pad));
+
+	file = sqfs_create_memory_file(0);
+	assert(file != NULL);
+	assert(file->write_at(file, 0, pad, sizeof(pad)) == 0);
+
+	write_image(file, &super);
+
+	idtbl = sqfs_id_table_create();
+	assert(idtbl != NULL);
+	assert(sqfs_id_table_read(idtbl, file, &super, &dummy_cmp) == 0);
+
+	rd = sqfs_dir_reader_create(&super, &dummy_cmp, file);
+	assert(rd != NULL);
+
+	/* without a filter, the entire tree is loaded */
+	assert(sqfs_dir_reader_get_full_hierarchy(rd, idtbl, NULL, 0,
+						  &root) == 0);
+	assert(count_nodes(root) == 7);
+	sqfs_dir_tree_destroy(root);
+
+	/* /a is left out along with everything inside it */
+	y_result = 0;
+	sqfs_dir_reader_set_filter(rd, filter, &y_result);
+
+	assert(sqfs_dir_reader_get_full_hierarchy(rd, idtbl, NULL, 0,
+						  &root) == 0);
+	assert(num_calls == 4);
+	assert(count_nodes(root) == 4);
+	assert(strcmp((const char *)root->children->name, "b") == 0);
+	assert(strcmp((const char *)root->children->next->name, "c") == 0);
+	assert(root->children->next->children != NULL);
+	sqfs_dir_tree_destroy(root);
+
+	/* empty directories that are left are dropped as usual */
+	y_result = 1;
+	num_calls = 0;
+
+	assert(sqfs_dir_reader_get_full_hierarchy(rd, idtbl, NULL,
+						  SQFS_TREE_NO_EMPTY |
+						  SQFS_TREE_COMPACT,
+						  &root) == 0);
+	assert(num_calls == 4);
+	assert(count_nodes(root) == 2);
+	assert(strcmp((const char *)root->children->name, "b") == 0);
+	sqfs_dir_tree_destroy(root);
+
+	/* explicitly requested paths are not filtered, only what is below */
+	num_calls = 0;
+	path = "c";
+
+	assert(sqfs_dir_reader_get_subtrees(rd, idtbl, &path, 1, 0,
+					    &root) == 0);
+	assert(num_calls == 1);
+	assert(count_nodes(root) == 2);
+	sqfs_dir_tree_destroy(root);
+
+	y_result = 0;
+	assert(sqfs_dir_reader_get_subtrees(rd, idtbl, &path, 1, 0,
+					    &root) == 0);
+	assert(count_nodes(root) == 3);
+	sqfs_dir_tree_destroy(root);
+
+	/* errors from the filter abort loading the tree */
+	y_result = SQFS_ERROR_IO;
+
+	assert(sqfs_dir_reader_get_full_hierarchy(rd, idtbl, NULL, 0,
+						  &root) == SQFS_ERROR_IO);
+
+	/* also applies to lazily expanded directories */
+	y_result = 1;
+	num_calls = 0;
+
+	assert(sqfs_dir_reader_get_full_hierarchy(rd, idtbl, NULL,
+						  SQFS_TREE_LAZY,
+						  &root) == 0);
+	assert(num_calls == 3);
+	n = root->children->next;
+	assert(strcmp((const char *)n->name, "c") == 0);
+	assert(sqfs_dir_reader_expand_node(rd, idtbl, n, 0) == 0);
+	assert(num_calls == 4);
+	assert(n->children == NULL);
+	sqfs_dir_tree_destroy(root);
+
+	sqfs_dir_reader_destroy(rd);
+	sqfs_id_table_destroy(idtbl);
+	file->destroy(file);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,145 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * xattr_reader.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+#include "test.h"
+
+#include "sqfs/xattr_writer.h"
+#include "sqfs/xattr_reader.h"
+#include "sqfs/compressor.h"
+#include "sqfs/super.h"
+#include "sqfs/xattr.h"
+#include "sqfs/io.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/* long enough to be stored out of line if more than one key uses it */
+static const char *shared = "a value that is shared by two keys";
+
+static sqfs_u32 add_set(sqfs_xattr_writer_t *xwr, const char *key,
+			const char *value)
+{
+	sqfs_u32 idx;
+
+	assert(sqfs_xattr_writer_begin(xwr) == 0);
+	assert(sqfs_xattr_writer_add(xwr, key, value, strlen(value)) == 0);
+	assert(sqfs_xattr_writer_add(xwr, "user.shared", shared,
+				     strlen(shared)) == 0);
+	assert(sqfs_xattr_writer_end(xwr, &idx) == 0);
+	return idx;
+}
+
+static void check_value(const sqfs_xattr_value_t *value, const char *str)
+{
+	assert(value->size == strlen(str));
+	assert(memcmp(value->value, str, value->size) == 0);
+}
+
+/* the writer may reorder the pairs of a set */
+static void check_set(sqfs_xattr_reader_t *xr, sqfs_u32 idx,
+		      const char *key, const char *value)
+{
+	bool have_key = false, have_shared = false;
+	const sqfs_xattr_set_t *set;
+	size_t i;
+
+	assert(sqfs_xattr_reader_get_set(xr, idx, &set) == 0);
+	assert(set->count == 2);
+
+	for (i = 0; i < set->count; ++i) {
+		const char *str = (const char *)set->keys[i]->key;
+
+		if (strcmp(str, key) == 0) {
+			check_value(set->values[i], value);
+			have_key = true;
+		} else {
+			assert(strcmp(str, "user.shared") == 0);
+			check_value(set->values[i], shared);
+			have_shared = true;
+		}
+	}
+
+	assert(have_key && have_shared);
+}
+
+int main(void)
+{
+	sqfs_xattr_entry_t *key, *ool_key = NULL;
+	sqfs_xattr_writer_t *xwr;
+	sqfs_xattr_reader_t *xr;
+	sqfs_xattr_value_t *val;
+	sqfs_u32 idx0, idx1, i;
+	sqfs_xattr_id_t desc;
+	sqfs_u8 pad[96];
+	sqfs_super_t super;
+	sqfs_file_t *file;
+
+	memset(&super, 0, sizeof(super));
+	memset(pad, 0, sizeof(pad));
+
+	file = sqfs_create_memory_file(0);
+	assert(file != NULL);
+	assert(file->write_at(file, 0, pad, sizeof(pad)) == 0);
+
+	xwr = sqfs_xattr_writer_create();
+	assert(xwr != NULL);
+
+	idx0 = add_set(xwr, "user.first", "one");
+	idx1 = add_set(xwr, "user.second", "two");
+	assert(idx0 != idx1);
+
+	super.id_table_start = file->get_size(file);
+	assert(sqfs_xattr_writer_flush(xwr, file, &super, &dummy_cmp) == 0);
+	sqfs_xattr_writer_destroy(xwr);
+
+	super.bytes_used = file->get_size(file);
+
+	xr = sqfs_xattr_reader_create(file, &super, &dummy_cmp);
+	assert(xr != NULL);
+	assert(sqfs_xattr_reader_load_locations(xr) == 0);
+
+	/* one of the sets must refer to the value of the other one */
+	for (i = 0; i < 2 && ool_key == NULL; ++i) {
+		assert(sqfs_xattr_reader_get_desc(xr, i == 0 ? idx0 : idx1,
+						  &desc) == 0);
+		assert(desc.count == 2);
+		assert(sqfs_xattr_reader_seek_kv(xr, &desc) == 0);
+
+		while (desc.count-- > 0) {
+			assert(sqfs_xattr_reader_read_key(xr, &key) == 0);
+
+			if (key->type & SQFS_XATTR_FLAG_OOL) {
+				ool_key = key;
+				break;
+			}
+
+			assert(sqfs_xattr_reader_read_value(xr, key,
+							    &val) == 0);
+			free(val);
+			free(key);
+		}
+	}
+
+	assert(ool_key != NULL);
+	assert(strcmp((const char *)ool_key->key, "user.shared") == 0);
+	assert(sqfs_xattr_reader_read_value(xr, ool_key, &val) == 0);
+	check_value(val, shared);
+	free(val);
+	free(ool_key);
+
+	/* the same through the cached sets, twice to also hit the cache */
+	for (i = 0; i < 2; ++i) {
+		check_set(xr, idx0, "user.first", "one");
+		check_set(xr, idx1, "user.second", "two");
+	}
+
+	sqfs_xattr_reader_destroy(xr);
+	file->destroy(file);
+	return EXIT_SUCCESS;
+}
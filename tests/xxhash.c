@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * xxhash.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+
+#include "util/util.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+static const struct {
+	const char *in;
+	sqfs_u64 out;
+} testvec[] = {
+	{ "", 0xEF46DB3751D8E999ULL },
+	{ "a", 0xD24EC4F1A98C6E5BULL },
+	{ "abc", 0x44BC2CF5AD770999ULL },
+	{ "Nobody inspects the spammish repetition", 0xFBCEA83C8A378BF1ULL },
+};
+
+int main(void)
+{
+	sqfs_u64 hash;
+	size_t i;
+
+	for (i = 0; i < sizeof(testvec) / sizeof(testvec[0]); ++i) {
+		hash = xxh64(testvec[i].in, strlen(testvec[i].in));
+
+		if (hash != testvec[i].out) {
+			fprintf(stderr, "Hash mismatch for '%s'\n",
+				testvec[i].in);
+			fprintf(stderr, "Expected: %016llX\n",
+				(unsigned long long)testvec[i].out);
+			fprintf(stderr, "Actual: %016llX\n",
+				(unsigned long long)hash);
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
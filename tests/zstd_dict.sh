@@ -0,0 +1,39 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-3.0-or-later
+#
+# Pack a directory with a zstd dictionary, unpack the image again and check
+# that the result is the same as the input.
+set -e
+
+srcdir=${srcdir:-.}
+work=zstd_dict.$$
+
+cleanup() {
+	rm -rf "$work"
+}
+trap cleanup EXIT
+
+mkdir -p "$work/in/src" "$work/in/big" "$work/out"
+
+# many small files that only have a tail end, and some with data blocks
+cp "$srcdir"/lib/sqfs/*.c "$srcdir"/lib/sqfs/*.h "$work/in/src"
+cat "$srcdir"/lib/sqfs/*.c > "$work/in/big/all"
+cat "$srcdir"/tests/*.c > "$work/in/big/tests"
+
+./gensquashfs -q -f -c zstd -X nonstd-dict -D "$work/in" \
+	      "$work/dict.sqfs" 2> "$work/log"
+
+# without enough samples, the image would be packed without a dictionary
+if ! grep -q "zstd dictionary" "$work/log"; then
+	echo "no dictionary was used" >&2
+	exit 1
+fi
+
+./rdsquashfs -q -u / -p "$work/out" "$work/dict.sqfs"
+
+if ! diff -r "$work/in" "$work/out"; then
+	echo "unpacked image differs from the input" >&2
+	exit 1
+fi
+
+exit 0
@@ -0,0 +1,173 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * source.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "sqfstranscode.h"
+
+static int load_source(source_t *src, size_t num_jobs, bool no_xattr)
+{
+	sqfs_compressor_config_t cfg;
+	int ret;
+
+	ret = sqfs_super_read(&src->super, src->file);
+	if (ret) {
+		sqfs_perror(src->filename, "reading super block", ret);
+		return -1;
+	}
+
+	sqfs_compressor_config_init(&cfg, src->super.compression_id,
+				    src->super.block_size,
+				    SQFS_COMP_FLAG_UNCOMPRESS);
+
+	src->cmp = sqfs_compressor_create(&cfg);
+	if (src->cmp == NULL) {
+		fprintf(stderr, "%s: error creating compressor.\n",
+			src->filename);
+		return -1;
+	}
+
+	if (src->super.flags & SQFS_FLAG_COMPRESSOR_OPTIONS) {
+		ret = src->cmp->read_options(src->cmp, src->file);
+		if (ret) {
+			sqfs_perror(src->filename, "reading compressor "
+				    "options", ret);
+			return -1;
+		}
+	}
+
+	src->idtbl = sqfs_id_table_create();
+	if (src->idtbl == NULL) {
+		sqfs_perror(src->filename, "creating ID table",
+			    SQFS_ERROR_ALLOC);
+		return -1;
+	}
+
+	ret = sqfs_id_table_read(src->idtbl, src->file, &src->super,
+				 src->cmp);
+	if (ret) {
+		sqfs_perror(src->filename, "loading ID table", ret);
+		return -1;
+	}
+
+	if (!no_xattr && !(src->super.flags & SQFS_FLAG_NO_XATTRS)) {
+		src->xattr = sqfs_xattr_reader_create(src->file, &src->super,
+						      src->cmp);
+		if (src->xattr == NULL) {
+			sqfs_perror(src->filename, "creating xattr reader",
+				    SQFS_ERROR_ALLOC);
+			return -1;
+		}
+
+		ret = sqfs_xattr_reader_load_locations(src->xattr);
+		if (ret) {
+			sqfs_perror(src->filename, "loading xattr table", ret);
+			return -1;
+		}
+	}
+
+	src->dirrd = sqfs_dir_reader_create(&src->super, src->cmp, src->file);
+	if (src->dirrd == NULL) {
+		sqfs_perror(src->filename, "creating dir reader",
+			    SQFS_ERROR_ALLOC);
+		return -1;
+	}
+
+	if (num_jobs > 1) {
+		ret = sqfs_dir_reader_preload(src->dirrd, num_jobs);
+		if (ret) {
+			sqfs_perror(src->filename, "loading inode & directory "
+				    "table", ret);
+			return -1;
+		}
+	} else {
+		ret = sqfs_dir_reader_set_readahead(src->dirrd,
+						    META_READAHEAD);
+		if (ret) {
+			sqfs_perror(src->filename, "setting up meta data "
+				    "read ahead", ret);
+			return -1;
+		}
+	}
+
+	src->data = sqfs_data_reader_create(src->file, src->super.block_size,
+					    src->cmp, 0);
+	if (src->data == NULL) {
+		sqfs_perror(src->filename, "creating data reader",
+			    SQFS_ERROR_ALLOC);
+		return -1;
+	}
+
+	if (num_jobs > 1) {
+		ret = sqfs_data_reader_set_readahead(src->data, num_jobs,
+					num_jobs * READAHEAD_PER_JOB);
+		if (ret) {
+			sqfs_perror(src->filename, "creating decompressor "
+				    "threads", ret);
+			return -1;
+		}
+	}
+
+	ret = sqfs_data_reader_load_fragment_table(src->data, &src->super);
+	if (ret) {
+		sqfs_perror(src->filename, "loading fragment table", ret);
+		return -1;
+	}
+
+	return 0;
+}
+
+int source_open(source_t *src, const char *filename, size_t num_jobs,
+		bool no_xattr)
+{
+	memset(src, 0, sizeof(*src));
+	src->filename = filename;
+
+	src->file = sqfs_open_file(filename, SQFS_FILE_OPEN_READ_ONLY);
+	if (src->file == NULL) {
+		perror(filename);
+		return -1;
+	}
+
+	if (load_source(src, num_jobs, no_xattr)) {
+		source_close(src);
+		return -1;
+	}
+
+	return 0;
+}
+
+int source_read_tree(source_t *src)
+{
+	int ret;
+
+	ret = sqfs_dir_reader_get_full_hierarchy(src->dirrd, src->idtbl, NULL,
+						 0, &src->root);
+	if (ret) {
+		sqfs_perror(src->filename, "reading filesystem tree", ret);
+		return -1;
+	}
+
+	return 0;
+}
+
+void source_close(source_t *src)
+{
+	if (src->root != NULL)
+		sqfs_dir_tree_destroy(src->root);
+	if (src->data != NULL)
+		sqfs_data_reader_destroy(src->data);
+	if (src->dirrd != NULL)
+		sqfs_dir_reader_destroy(src->dirrd);
+	if (src->xattr != NULL)
+		sqfs_xattr_reader_destroy(src->xattr);
+	if (src->idtbl != NULL)
+		sqfs_id_table_destroy(src->idtbl);
+	if (src->cmp != NULL)
+		src->cmp->destroy(src->cmp);
+	if (src->file != NULL)
+		src->file->destroy(src->file);
+
+	memset(src, 0, sizeof(*src));
+}
@@ -0,0 +1,502 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * sqfstranscode.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "sqfstranscode.h"
+
+static struct option long_opts[] = {
+	{ "compressor", required_argument, NULL, 'c' },
+	{ "comp-extra", required_argument, NULL, 'X' },
+	{ "block-size", required_argument, NULL, 'b' },
+	{ "num-jobs", required_argument, NULL, 'j' },
+	{ "queue-backlog", required_argument, NULL, 'Q' },
+	{ "max-memory", required_argument, NULL, 'M' },
+	{ "dev-block-size", required_argument, NULL, 'B' },
+	{ "stats-json", required_argument, NULL, 'J' },
+	{ "no-xattr", no_argument, NULL, 'x' },
+	{ "exportable", no_argument, NULL, 'e' },
+	{ "group-fragments", no_argument, NULL, 'G' },
+	{ "best-fit-fragments", no_argument, NULL, 'K' },
+	{ "progress", no_argument, NULL, 'R' },
+	{ "force", no_argument, NULL, 'f' },
+	{ "quiet", no_argument, NULL, 'q' },
+	{ "help", no_argument, NULL, 'h' },
+	{ "version", no_argument, NULL, 'V' },
+};
+
+static const char *short_opts = "c:X:b:j:Q:M:B:J:xeGKRfqhV";
+
+static const char *usagestr =
+"Usage: sqfstranscode [OPTIONS...] <image> <sqfsfile>\n"
+"\n"
+"Pack an existing squashfs image again with a different compressor,\n"
+"compressor options or block size.\n"
+"\n"
+"The data blocks are unpacked and compressed again in parallel, in the\n"
+"order they are stored in. The inodes and directories are taken over from\n"
+"the image as they are, only with new locations.\n"
+"\n"
+"Possible options:\n"
+"\n"
+"  --compressor, -c <name>     Select the compressor to use. Defaults to the\n"
+"                              one of the image.\n"
+"  --comp-extra, -X <options>  A comma separated list of extra options for\n"
+"                              the selected compressor, see gensquashfs.\n"
+"                              The options of the image are not kept.\n"
+"  --block-size, -b <size>     Block size to use. Defaults to the one of the\n"
+"                              image.\n"
+"  --num-jobs, -j <count>      Number of compressor jobs to create, and of\n"
+"                              threads that unpack the image.\n"
+"  --queue-backlog, -Q <count> Maximum number of data blocks in the thread\n"
+"                              worker queue before the packer starts waiting\n"
+"                              for the block processors to catch up.\n"
+"                              Defaults to 10 times the number of jobs.\n"
+"  --max-memory, -M <MiB>      Approximate limit for the memory used to buffer\n"
+"                              data blocks.\n"
+"  --dev-block-size, -B <size> Device block size to padd the image to.\n"
+"                              Defaults to %u.\n"
+"  --stats-json, -J <file>     Write the statistics, including the time taken\n"
+"                              by each phase, to a JSON file.\n"
+"\n"
+"  --no-xattr, -x              Do not copy extended attributes.\n"
+"  --exportable, -e            Generate an export table for NFS support, even\n"
+"                              if the image does not have one.\n"
+"  --group-fragments, -G       Pack tail ends of files with the same name\n"
+"                              extension into the same fragment blocks.\n"
+"  --best-fit-fragments, -K    Keep more fragment blocks open and put each\n"
+"                              tail end into the one it fills up best.\n"
+"  --progress, -R              Show a status line instead of the name of\n"
+"                              each file packed.\n"
+"  --force, -f                 Overwrite the output file if it exists.\n"
+"  --quiet, -q                 Do not print out progress reports.\n"
+"  --help, -h                  Print help text and exit.\n"
+"  --version, -V               Print version information and exit.\n"
+"\n"
+"Examples:\n"
+"\n"
+"\tsqfstranscode -c xz -X level=9 rootfs-lz4.sqfs rootfs.sqfs\n"
+"\n";
+
+static sqfs_writer_cfg_t cfg;
+static sqfs_writer_t sqfs;
+static source_t src;
+static const char *image;
+static bool have_compressor = false;
+static bool have_block_size = false;
+
+static void process_args(int argc, char **argv)
+{
+	int i;
+
+	sqfs_writer_cfg_init(&cfg);
+
+	for (;;) {
+		i = getopt_long(argc, argv, short_opts, long_opts, NULL);
+		if (i == -1)
+			break;
+
+		switch (i) {
+		case 'c':
+			if (sqfs_compressor_id_from_name(optarg,
+							 &cfg.comp_id) ||
+			    !sqfs_compressor_exists(cfg.comp_id)) {
+				fprintf(stderr, "Unsupported compressor '%s'\n",
+					optarg);
+				exit(EXIT_FAILURE);
+			}
+			have_compressor = true;
+			break;
+		case 'X':
+			cfg.comp_extra = optarg;
+			break;
+		case 'b':
+			cfg.block_size = strtol(optarg, NULL, 0);
+			have_block_size = true;
+			break;
+		case 'j':
+			cfg.num_jobs = strtol(optarg, NULL, 0);
+			break;
+		case 'Q':
+			cfg.max_backlog = strtol(optarg, NULL, 0);
+			break;
+		case 'M':
+			cfg.max_memory = strtoul(optarg, NULL, 0);
+			cfg.max_memory *= 1024 * 1024;
+			break;
+		case 'B':
+			cfg.devblksize = strtol(optarg, NULL, 0);
+			if (cfg.devblksize < 1024) {
+				fputs("Device block size must be at "
+				      "least 1024\n", stderr);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'J':
+			cfg.stats_json = optarg;
+			break;
+		case 'x':
+			cfg.no_xattr = true;
+			break;
+		case 'e':
+			cfg.exportable = true;
+			break;
+		case 'G':
+			cfg.group_fragments = true;
+			break;
+		case 'K':
+			cfg.best_fit_fragments = true;
+			break;
+		case 'R':
+			cfg.progress = true;
+			break;
+		case 'f':
+			cfg.outmode |= SQFS_FILE_OPEN_OVERWRITE;
+			break;
+		case 'q':
+			cfg.quiet = true;
+			break;
+		case 'h':
+			printf(usagestr, SQFS_DEVBLK_SIZE);
+			exit(EXIT_SUCCESS);
+		case 'V':
+			print_version();
+			exit(EXIT_SUCCESS);
+		default:
+			goto fail_arg;
+		}
+	}
+
+	if (cfg.num_jobs < 1)
+		cfg.num_jobs = 1;
+
+	if (cfg.max_backlog < 1)
+		cfg.max_backlog = 10 * cfg.num_jobs;
+
+	if (optind >= argc) {
+		fputs("Missing argument: squashfs image to transcode\n",
+		      stderr);
+		goto fail_arg;
+	}
+
+	image = argv[optind++];
+
+	if (optind >= argc) {
+		fputs("Missing argument: output squashfs image\n", stderr);
+		goto fail_arg;
+	}
+
+	cfg.filename = argv[optind++];
+
+	if (optind < argc) {
+		fputs("Unknown extra arguments specified.\n", stderr);
+		goto fail_arg;
+	}
+	return;
+fail_arg:
+	fputs("Try `sqfstranscode --help' for more information.\n", stderr);
+	exit(EXIT_FAILURE);
+}
+
+static const sqfs_inode_generic_t *file_inode(const inode_info_t *table,
+					      sqfs_u32 num)
+{
+	return table[num].node->inode;
+}
+
+/* a regular file of the source image, while working out the packing order */
+typedef struct {
+	sqfs_u32 num;
+
+	/* the position in the directory tree */
+	size_t pos;
+
+	/* where the data blocks of the file are, if it has any */
+	sqfs_u64 start;
+	sqfs_u64 end;
+
+	/*
+	  The number of files with blocks of their own before this one or,
+	  for files without, before it in the tree, and the place after them.
+	 */
+	size_t anchor;
+	size_t rank;
+} file_order_t;
+
+static int cmp_blocks(const void *lhs, const void *rhs)
+{
+	const file_order_t *l = lhs, *r = rhs;
+
+	if (l->start != r->start)
+		return l->start < r->start ? -1 : 1;
+
+	return l->pos < r->pos ? -1 : (l->pos > r->pos ? 1 : 0);
+}
+
+static int cmp_order(const void *lhs, const void *rhs)
+{
+	const file_order_t *l = lhs, *r = rhs;
+
+	if (l->anchor != r->anchor)
+		return l->anchor < r->anchor ? -1 : 1;
+
+	return l->rank < r->rank ? -1 : (l->rank > r->rank ? 1 : 0);
+}
+
+static void collect_files(const inode_info_t *table,
+			  const sqfs_tree_node_t *n,
+			  file_order_t *list, size_t *count)
+{
+	const sqfs_inode_generic_t *inode = n->inode;
+	sqfs_u32 num = inode->base.inode_number;
+	file_order_t *fo;
+	size_t i;
+
+	/* hard links are only packed once, at the first entry */
+	if (S_ISREG(inode->base.mode) && table[num].node == n) {
+		fo = list + (*count)++;
+		fo->num = num;
+		fo->pos = *count;
+
+		sqfs_inode_get_file_block_start(inode, &fo->start);
+		fo->end = fo->start;
+
+		for (i = 0; i < inode->num_file_blocks; ++i)
+			fo->end += SQFS_ON_DISK_BLOCK_SIZE(inode->block_sizes[i]);
+	}
+
+	for (n = n->children; n != NULL; n = n->next)
+		collect_files(table, n, list, count);
+}
+
+/*
+  The inode numbers of the regular files, in the order they were packed
+  in originally, which is the order they are packed in again.
+
+  Files with data blocks of their own are put in the order of their
+  blocks. Everything else, i.e. files that only have a tail end or whose
+  blocks were deduplicated, is placed relative to those by the position in
+  the directory tree. For an image that was packed in tree order, which
+  gensquashfs does unless told otherwise, this is exactly the original
+  order, so the fragment blocks are filled up the same way.
+ */
+static sqfs_u32 *gen_file_list(inode_info_t *table, size_t *count)
+{
+	size_t i, anchor, total = 0;
+	file_order_t *files, *fo;
+	sqfs_u64 end = 0;
+	sqfs_u32 *list;
+
+	for (i = 1; i <= src.super.inode_count; ++i) {
+		if (S_ISREG(file_inode(table, i)->base.mode))
+			total += 1;
+	}
+
+	files = alloc_array(sizeof(files[0]), total > 0 ? total : 1);
+	list = alloc_array(sizeof(list[0]), total > 0 ? total : 1);
+	if (files == NULL || list == NULL) {
+		perror("sorting files");
+		free(files);
+		free(list);
+		return NULL;
+	}
+
+	*count = 0;
+	collect_files(table, src.root, files, count);
+
+	/* files with blocks of their own, in on-disk order */
+	qsort(files, *count, sizeof(files[0]), cmp_blocks);
+
+	for (i = 0, anchor = 0; i < *count; ++i) {
+		if (files[i].end > files[i].start && files[i].start >= end) {
+			files[i].anchor = ++anchor;
+			end = files[i].end;
+		}
+	}
+
+	/* everything else goes after the one before it in the tree */
+	for (i = 0; i < *count; ++i)
+		list[files[i].pos - 1] = i;
+
+	for (i = 0, anchor = 0; i < *count; ++i) {
+		fo = files + list[i];
+
+		if (fo->anchor > 0) {
+			anchor = fo->anchor;
+			fo->rank = 0;
+		} else {
+			fo->anchor = anchor;
+			fo->rank = fo->pos;
+		}
+	}
+
+	qsort(files, *count, sizeof(files[0]), cmp_order);
+
+	for (i = 0; i < *count; ++i)
+		list[i] = files[i].num;
+
+	free(files);
+	return list;
+}
+
+static int pack_file(inode_info_t *info)
+{
+	const sqfs_inode_generic_t *original = info->node->inode;
+	sqfs_inode_generic_t *inode;
+	sqfs_u64 filesize, max_blk_count;
+	char *path;
+	int ret;
+
+	path = sqfs_tree_node_get_path(info->node);
+	if (path == NULL) {
+		perror("packing files");
+		return -1;
+	}
+
+	sqfs_inode_get_file_size(original, &filesize);
+
+	max_blk_count = filesize / cfg.block_size;
+	if (filesize % cfg.block_size)
+		++max_blk_count;
+
+	inode = alloc_flex(sizeof(*inode), sizeof(sqfs_u32), max_blk_count);
+	if (inode == NULL) {
+		perror(path);
+		free(path);
+		return -1;
+	}
+
+	inode->block_sizes = (sqfs_u32 *)inode->extra;
+	inode->base.type = SQFS_INODE_FILE;
+	sqfs_inode_set_file_size(inode, filesize);
+	sqfs_inode_set_frag_location(inode, 0xFFFFFFFF, 0xFFFFFFFF);
+
+	info->inode = inode;
+
+	if (!cfg.quiet && !cfg.progress)
+		printf("packing %s\n", path);
+
+	ret = write_data_from_reader(path, sqfs.data, inode, src.data,
+				     original, 0);
+	free(path);
+
+	if (ret)
+		return -1;
+
+	sqfs.stats.bytes_read += filesize;
+	sqfs.stats.file_count += 1;
+	progress_update(&sqfs.stats);
+	return 0;
+}
+
+static int pack_files(inode_info_t *table)
+{
+	sqfs_u64 filesize;
+	size_t i, count;
+	sqfs_u32 *list;
+	int ret = 0;
+
+	list = gen_file_list(table, &count);
+	if (list == NULL)
+		return -1;
+
+	stats_phase_end(&sqfs.stats, WRITER_PHASE_SCAN);
+
+	for (i = 0; i < count; ++i) {
+		sqfs_inode_get_file_size(file_inode(table, list[i]),
+					 &filesize);
+		sqfs.stats.progress.total += filesize;
+
+		/* unpacking runs ahead across files, in the same order */
+		ret = sqfs_data_reader_queue_file(src.data,
+						  file_inode(table, list[i]));
+		if (ret) {
+			sqfs_perror(src.filename, "queueing files to read",
+				    ret);
+			goto out;
+		}
+	}
+
+	for (i = 0; i < count; ++i) {
+		ret = pack_file(table + list[i]);
+		if (ret)
+			break;
+	}
+out:
+	free(list);
+	return ret ? -1 : 0;
+}
+
+static int transcode(void)
+{
+	inode_info_t *table = NULL;
+	int ret = -1;
+
+	if (source_open(&src, image, cfg.num_jobs, cfg.no_xattr))
+		return -1;
+
+	if (!have_compressor)
+		cfg.comp_id = src.super.compression_id;
+
+	if (!have_block_size)
+		cfg.block_size = src.super.block_size;
+
+	if (src.super.flags & SQFS_FLAG_EXPORTABLE)
+		cfg.exportable = true;
+
+	if (sqfs_writer_init(&sqfs, &cfg))
+		return -1;
+
+	if (sqfs.data == NULL) {
+		fputs("A zstd dictionary cannot be used when transcoding an "
+		      "image.\n", stderr);
+		goto out;
+	}
+
+	sqfs.super.modification_time = src.super.modification_time;
+
+	if (source_read_tree(&src))
+		goto out;
+
+	table = inode_table_create(&src);
+	if (table == NULL)
+		goto out;
+
+	if (pack_files(table))
+		goto out;
+
+	sqfs.super.inode_count = src.super.inode_count;
+
+	if (sqfs_writer_finish_data(&sqfs, &cfg))
+		goto out;
+
+	if (!cfg.quiet)
+		fputs("Writing inodes and directories...\n", stdout);
+
+	if (write_tables(&src, table, &sqfs, &cfg))
+		goto out;
+
+	stats_phase_end(&sqfs.stats, WRITER_PHASE_INODES);
+
+	if (sqfs_writer_finish_tables(&sqfs, &cfg))
+		goto out;
+
+	ret = 0;
+out:
+	inode_table_destroy(table, src.super.inode_count);
+	sqfs_writer_cleanup(&sqfs);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+
+	process_args(argc, argv);
+
+	ret = transcode();
+	source_close(&src);
+
+	return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
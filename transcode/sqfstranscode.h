@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * sqfstranscode.h
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#ifndef SQFSTRANSCODE_H
+#define SQFSTRANSCODE_H
+
+#include "config.h"
+#include "common.h"
+#include "util/util.h"
+#include "util/compat.h"
+
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+/* the image that is transcoded */
+typedef struct {
+	const char *filename;
+	sqfs_file_t *file;
+	sqfs_super_t super;
+	sqfs_compressor_t *cmp;
+	sqfs_id_table_t *idtbl;
+	sqfs_dir_reader_t *dirrd;
+	sqfs_data_reader_t *data;
+	sqfs_xattr_reader_t *xattr;
+	sqfs_tree_node_t *root;
+} source_t;
+
+/* an inode of the source image, the table is indexed by inode number */
+typedef struct {
+	/* the first entry of the inode in the tree */
+	const sqfs_tree_node_t *node;
+
+	/* for regular files, the inode in the new image once it is packed */
+	sqfs_inode_generic_t *inode;
+
+	/* the reference of the inode in the new image, once it is written */
+	sqfs_u64 ref;
+	bool written;
+} inode_info_t;
+
+/*
+  Open an image and load everything except the directory tree. If num_jobs
+  is more than 1, the data blocks are unpacked ahead of time on that many
+  threads. Prints an error message and returns -1 on failure.
+ */
+int source_open(source_t *src, const char *filename, size_t num_jobs,
+		bool no_xattr);
+
+/* Prints an error message and returns -1 on failure. */
+int source_read_tree(source_t *src);
+
+void source_close(source_t *src);
+
+/*
+  Create a table with an entry for every inode number of the image. Every
+  number from 1 to the inode count has to be used exactly once, except for
+  hard links. Prints an error message and returns NULL on failure.
+ */
+inode_info_t *inode_table_create(const source_t *src);
+
+void inode_table_destroy(inode_info_t *table, size_t count);
+
+/*
+  Write the inode and directory tables of the new image from the tree of
+  the source image. The inodes keep their numbers and are written in the
+  same order, where possible, and the entries of each directory in the
+  same order as well. The inodes of regular files have to be packed
+  already. Prints an error message and returns -1 on failure.
+ */
+int write_tables(const source_t *src, inode_info_t *table,
+		 sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *cfg);
+
+#endif /* SQFSTRANSCODE_H */
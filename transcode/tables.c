@@ -0,0 +1,410 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * tables.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "sqfstranscode.h"
+
+static int add_inodes(inode_info_t *table, const source_t *src,
+		      const sqfs_tree_node_t *n)
+{
+	sqfs_u32 num = n->inode->base.inode_number;
+
+	if (num == 0 || num > src->super.inode_count) {
+		fprintf(stderr, "%s: inode number %u out of range\n",
+			src->filename, (unsigned int)num);
+		return -1;
+	}
+
+	if (table[num].node == NULL) {
+		table[num].node = n;
+	} else if (S_ISDIR(n->inode->base.mode) ||
+		   S_ISDIR(table[num].node->inode->base.mode)) {
+		fprintf(stderr, "%s: directory inode %u has more than one "
+			"entry\n", src->filename, (unsigned int)num);
+		return -1;
+	}
+
+	for (n = n->children; n != NULL; n = n->next) {
+		if (add_inodes(table, src, n))
+			return -1;
+	}
+
+	return 0;
+}
+
+inode_info_t *inode_table_create(const source_t *src)
+{
+	size_t count = src->super.inode_count;
+	inode_info_t *table;
+	size_t i;
+
+	table = calloc(count + 1, sizeof(table[0]));
+	if (table == NULL) {
+		perror(src->filename);
+		return NULL;
+	}
+
+	if (add_inodes(table, src, src->root))
+		goto fail;
+
+	for (i = 1; i <= count; ++i) {
+		if (table[i].node == NULL) {
+			fprintf(stderr, "%s: inode %lu is not in the directory "
+				"tree\n", src->filename, (unsigned long)i);
+			goto fail;
+		}
+	}
+
+	return table;
+fail:
+	inode_table_destroy(table, count);
+	return NULL;
+}
+
+void inode_table_destroy(inode_info_t *table, size_t count)
+{
+	size_t i;
+
+	if (table == NULL)
+		return;
+
+	for (i = 0; i <= count; ++i)
+		free(table[i].inode);
+
+	free(table);
+}
+
+typedef struct {
+	const source_t *src;
+	inode_info_t *table;
+	sqfs_writer_t *sqfs;
+	sqfs_meta_writer_t *im;
+	sqfs_dir_writer_t *dirwr;
+} serializer_t;
+
+static int copy_xattr(serializer_t *s, const sqfs_tree_node_t *n,
+		      sqfs_u32 *out)
+{
+	const sqfs_xattr_set_t *set;
+	sqfs_u32 index;
+	size_t i;
+	int ret;
+
+	*out = 0xFFFFFFFF;
+
+	if (s->src->xattr == NULL || s->sqfs->xwr == NULL)
+		return 0;
+
+	sqfs_inode_get_xattr_index(n->inode, &index);
+	if (index == 0xFFFFFFFF)
+		return 0;
+
+	ret = sqfs_xattr_reader_get_set(s->src->xattr, index, &set);
+	if (ret)
+		return ret;
+
+	ret = sqfs_xattr_writer_begin(s->sqfs->xwr);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < set->count; ++i) {
+		ret = sqfs_xattr_writer_add(s->sqfs->xwr,
+					    (const char *)set->keys[i]->key,
+					    set->values[i]->value,
+					    set->values[i]->size);
+		if (ret)
+			return ret;
+	}
+
+	return sqfs_xattr_writer_end(s->sqfs->xwr, out);
+}
+
+/* symlinks, devices, FIFOs and sockets are taken over as they are */
+static sqfs_inode_generic_t *copy_inode(const sqfs_inode_generic_t *orig)
+{
+	sqfs_inode_generic_t *inode;
+	size_t extra = 0;
+
+	if (orig->base.type == SQFS_INODE_SLINK) {
+		extra = orig->data.slink.target_size;
+	} else if (orig->base.type == SQFS_INODE_EXT_SLINK) {
+		extra = orig->data.slink_ext.target_size;
+	}
+
+	inode = alloc_flex(sizeof(*inode), 1, extra);
+	if (inode == NULL)
+		return NULL;
+
+	memcpy(inode, orig, sizeof(*inode));
+	inode->block_sizes = NULL;
+	inode->slink_target = NULL;
+
+	if (extra > 0) {
+		inode->slink_target = (char *)inode->extra;
+		memcpy(inode->extra, orig->slink_target, extra);
+	}
+
+	return inode;
+}
+
+static int write_dir(serializer_t *s, const sqfs_tree_node_t *n,
+		     sqfs_u32 xattr, sqfs_inode_generic_t **out)
+{
+	const sqfs_inode_generic_t *orig = n->inode;
+	const sqfs_tree_node_t *it;
+	sqfs_inode_generic_t *inode;
+	sqfs_u32 num, parent, nlink;
+	int ret;
+
+	ret = sqfs_dir_writer_begin(s->dirwr, 0);
+	if (ret)
+		return ret;
+
+	for (it = n->children; it != NULL; it = it->next) {
+		num = it->inode->base.inode_number;
+
+		ret = sqfs_dir_writer_add_entry(s->dirwr,
+						(const char *)it->name, num,
+						s->table[num].ref,
+						it->inode->base.mode);
+		if (ret)
+			return ret;
+	}
+
+	ret = sqfs_dir_writer_end(s->dirwr);
+	if (ret)
+		return ret;
+
+	if (orig->base.type == SQFS_INODE_EXT_DIR) {
+		parent = orig->data.dir_ext.parent_inode;
+		nlink = orig->data.dir_ext.nlink;
+	} else {
+		parent = orig->data.dir.parent_inode;
+		nlink = orig->data.dir.nlink;
+	}
+
+	inode = sqfs_dir_writer_create_inode(s->dirwr, 0, xattr, parent);
+	if (inode == NULL)
+		return SQFS_ERROR_ALLOC;
+
+	if (inode->base.type == SQFS_INODE_EXT_DIR) {
+		inode->data.dir_ext.nlink = nlink;
+	} else {
+		inode->data.dir.nlink = nlink;
+	}
+
+	*out = inode;
+	return 0;
+}
+
+static int create_inode(serializer_t *s, sqfs_u32 num,
+			sqfs_inode_generic_t **out)
+{
+	inode_info_t *info = s->table + num;
+	const sqfs_inode_generic_t *orig = info->node->inode;
+	sqfs_inode_generic_t *inode = NULL;
+	sqfs_u16 id_idx[2];
+	sqfs_u32 xattr, ids[2];
+	int ret;
+
+	ret = copy_xattr(s, info->node, &xattr);
+	if (ret)
+		return ret;
+
+	if (S_ISDIR(orig->base.mode)) {
+		ret = write_dir(s, info->node, xattr, &inode);
+		if (ret)
+			return ret;
+	} else {
+		if (S_ISREG(orig->base.mode)) {
+			inode = info->inode;
+			info->inode = NULL;
+		} else {
+			inode = copy_inode(orig);
+		}
+
+		if (inode == NULL)
+			return SQFS_ERROR_ALLOC;
+
+		ret = sqfs_inode_set_xattr_index(inode, xattr);
+		if (ret)
+			goto fail;
+	}
+
+	/* only the extended file inode has a link count */
+	if (orig->base.type == SQFS_INODE_EXT_FILE &&
+	    orig->data.file_ext.nlink > 1) {
+		sqfs_inode_make_extended(inode);
+		inode->data.file_ext.nlink = orig->data.file_ext.nlink;
+	}
+
+	inode->base.mode = orig->base.mode;
+	inode->base.mod_time = orig->base.mod_time;
+	inode->base.inode_number = num;
+
+	ids[0] = info->node->uid;
+	ids[1] = info->node->gid;
+
+	ret = sqfs_id_table_ids_to_indices(s->sqfs->idtbl, ids, id_idx, 2);
+	if (ret)
+		goto fail;
+
+	inode->base.uid_idx = id_idx[0];
+	inode->base.gid_idx = id_idx[1];
+
+	*out = inode;
+	return 0;
+fail:
+	free(inode);
+	return ret;
+}
+
+/*
+  A directory refers to the inodes of its entries, so they are written
+  first. In images from this package and from mksquashfs, the entries
+  already have lower inode numbers than their directory and the inodes
+  end up in exactly the same order as before.
+ */
+static int write_node(serializer_t *s, sqfs_u32 num)
+{
+	inode_info_t *info = s->table + num;
+	const sqfs_tree_node_t *it;
+	sqfs_inode_generic_t *inode;
+	sqfs_u32 offset;
+	sqfs_u64 block;
+	int ret;
+
+	if (info->written)
+		return 0;
+
+	for (it = info->node->children; it != NULL; it = it->next) {
+		ret = write_node(s, it->inode->base.inode_number);
+		if (ret)
+			return ret;
+	}
+
+	ret = create_inode(s, num, &inode);
+	if (ret)
+		return ret;
+
+	sqfs_meta_writer_get_position(s->im, &block, &offset);
+	info->ref = (block << 16) | offset;
+	info->written = true;
+
+	ret = sqfs_meta_writer_write_inode(s->im, inode);
+	free(inode);
+	return ret;
+}
+
+/*
+  Adding the IDs in the order of the old table first keeps the indices
+  the same, even though the inodes look them up by value.
+ */
+static int copy_id_table(const source_t *src, sqfs_id_table_t *idtbl)
+{
+	sqfs_u16 index;
+	sqfs_u32 id;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < src->super.id_count; ++i) {
+		ret = sqfs_id_table_index_to_id(src->idtbl, i, &id);
+		if (ret)
+			return ret;
+
+		ret = sqfs_id_table_id_to_index(idtbl, id, &index);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+int write_tables(const source_t *src, inode_info_t *table,
+		 sqfs_writer_t *sqfs, const sqfs_writer_cfg_t *cfg)
+{
+	sqfs_file_t *file = sqfs->outfile;
+	sqfs_meta_writer_t *dm;
+	serializer_t s;
+	sqfs_u32 i;
+	int ret;
+
+	memset(&s, 0, sizeof(s));
+	s.src = src;
+	s.table = table;
+	s.sqfs = sqfs;
+
+	ret = copy_id_table(src, sqfs->idtbl);
+	if (ret)
+		goto out_err;
+
+	s.im = sqfs_meta_writer_create(file, sqfs->cmp, 0);
+	if (s.im == NULL) {
+		ret = SQFS_ERROR_ALLOC;
+		goto out_err;
+	}
+
+	dm = sqfs_meta_writer_create(file, sqfs->cmp,
+				     SQFS_META_WRITER_KEEP_IN_MEMORY);
+	if (dm == NULL) {
+		ret = SQFS_ERROR_ALLOC;
+		goto out_im;
+	}
+
+	s.dirwr = sqfs_dir_writer_create(dm);
+	if (s.dirwr == NULL) {
+		ret = SQFS_ERROR_ALLOC;
+		goto out_dm;
+	}
+
+	if (cfg->dir_index_step > 0) {
+		ret = sqfs_dir_writer_set_header_limit(s.dirwr,
+						       cfg->dir_index_step);
+		if (ret)
+			goto out;
+	}
+
+	sqfs->super.inode_table_start = file->get_size(file);
+
+	for (i = 1; i <= src->super.inode_count; ++i) {
+		ret = write_node(&s, i);
+		if (ret)
+			goto out;
+	}
+
+	ret = sqfs_meta_writer_flush(s.im);
+	if (ret)
+		goto out;
+
+	ret = sqfs_meta_writer_flush(dm);
+	if (ret)
+		goto out;
+
+	i = src->root->inode->base.inode_number;
+	sqfs->super.root_inode_ref = table[i].ref;
+	sqfs->super.directory_table_start = file->get_size(file);
+
+	ret = sqfs_meta_write_write_to_file(dm);
+	if (ret)
+		goto out;
+
+	for (i = 1; sqfs->export != NULL && i <= src->super.inode_count; ++i) {
+		ret = export_table_add(sqfs->export, table[i].ref);
+		if (ret)
+			goto out;
+	}
+out:
+	sqfs_dir_writer_destroy(s.dirwr);
+out_dm:
+	sqfs_meta_writer_destroy(dm);
+out_im:
+	sqfs_meta_writer_destroy(s.im);
+out_err:
+	if (ret) {
+		sqfs_perror(cfg->filename, "storing filesystem tree", ret);
+		return -1;
+	}
+	return 0;
+}
@@ -6,18 +6,9 @@
  */
 #include "rdsquashfs.h"
 
-static int print_name(const sqfs_tree_node_t *n)
+static void print_name(const char *name)
 {
-	char *start, *ptr, *name = sqfs_tree_node_get_path(n);
-	int ret;
-
-	if (name == NULL) {
-		perror("Recovering file path of tree node");
-		return -1;
-	}
-
-	ret = canonicalize_name(name);
-	assert(ret == 0);
+	const char *start, *ptr;
 
 	if (strchr(name, ' ') == NULL && strchr(name, '"') == NULL) {
 		fputs(name, stdout);
@@ -43,9 +34,6 @@ static int print_name(const sqfs_tree_node_t *n)
 
 		fputc('"', stdout);
 	}
-
-	free(name);
-	return 0;
 }
 
 static void print_perm(const sqfs_tree_node_t *n)
@@ -53,41 +41,56 @@ static void print_perm(const sqfs_tree_node_t *n)
 	printf(" 0%o %d %d", n->inode->base.mode & (~S_IFMT), n->uid, n->gid);
 }
 
-static int print_simple(const char *type, const sqfs_tree_node_t *n,
-			const char *extra)
+static void print_simple(const char *type, const sqfs_tree_node_t *n,
+			 const char *path, const char *extra)
 {
 	printf("%s ", type);
-	if (print_name(n))
-		return -1;
+	print_name(path);
 	print_perm(n);
 	if (extra != NULL)
 		printf(" %s", extra);
 	fputc('\n', stdout);
-	return 0;
 }
 
-int describe_tree(const sqfs_tree_node_t *root, const char *unpack_root)
+static int describe_dfs(const sqfs_tree_node_t *root, const char *unpack_root,
+			path_buf_t *path)
 {
+	size_t old_len = path->len;
 	const sqfs_tree_node_t *n;
+	int ret;
+
+	if (root->parent != NULL) {
+		ret = path_buf_push(path, (const char *)root->name,
+				    strlen((const char *)root->name));
+		if (ret) {
+			sqfs_perror((const char *)root->name,
+				    "Recovering file path of tree node", ret);
+			return -1;
+		}
+	}
 
 	switch (root->inode->base.mode & S_IFMT) {
 	case S_IFSOCK:
-		return print_simple("sock", root, NULL);
+		print_simple("sock", root, path->str, NULL);
+		break;
 	case S_IFLNK:
-		return print_simple("slink", root, root->inode->slink_target);
+		print_simple("slink", root, path->str,
+			     root->inode->slink_target);
+		break;
 	case S_IFIFO:
-		return print_simple("pipe", root, NULL);
+		print_simple("pipe", root, path->str, NULL);
+		break;
 	case S_IFREG:
-		if (unpack_root == NULL)
-			return print_simple("file", root, NULL);
+		if (unpack_root == NULL) {
+			print_simple("file", root, path->str, NULL);
+			break;
+		}
 
 		fputs("file ", stdout);
-		if (print_name(root))
-			return -1;
+		print_name(path->str);
 		print_perm(root);
 		printf(" %s/", unpack_root);
-		if (print_name(root))
-			return -1;
+		print_name(path->str);
 		fputc('\n', stdout);
 		break;
 	case S_IFCHR:
@@ -105,20 +108,37 @@ int describe_tree(const sqfs_tree_node_t *root, const char *unpack_root)
 		sprintf(buffer, "%c %d %d",
 			S_ISCHR(root->inode->base.mode) ? 'c' : 'b',
 			major(devno), minor(devno));
-		return print_simple("nod", root, buffer);
+		print_simple("nod", root, path->str, buffer);
+		break;
 	}
 	case S_IFDIR:
-		if (root->name[0] != '\0') {
-			if (print_simple("dir", root, NULL))
-				return -1;
-		}
+		if (root->name[0] != '\0')
+			print_simple("dir", root, path->str, NULL);
 
 		for (n = root->children; n != NULL; n = n->next) {
-			if (describe_tree(n, unpack_root))
+			if (describe_dfs(n, unpack_root, path))
 				return -1;
 		}
 		break;
 	}
 
+	path_buf_truncate(path, old_len);
 	return 0;
 }
+
+int describe_tree(const sqfs_tree_node_t *root, const char *unpack_root)
+{
+	path_buf_t path;
+	int ret;
+
+	ret = path_buf_init(&path, "");
+	if (ret) {
+		sqfs_perror("describe", "Recovering file path of tree node",
+			    ret);
+		return -1;
+	}
+
+	ret = describe_dfs(root, unpack_root, &path);
+	path_buf_cleanup(&path);
+	return ret;
+}
@@ -7,6 +7,18 @@
 #include "config.h"
 #include "rdsquashfs.h"
 
+#ifdef HAVE_LINUX_FS_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#ifdef WITH_PTHREAD
+#include <pthread.h>
+
+/* number of chunks to split the file list into, per thread */
+#define CHUNKS_PER_THREAD (8)
+#endif
+
 static struct file_ent {
 	char *path;
 	const sqfs_inode_generic_t *inode;
@@ -15,57 +27,114 @@ static struct file_ent {
 static size_t num_files = 0, max_files = 0;
 static size_t block_size = 0;
 
-static int compare_files(const void *l, const void *r)
+static bool has_fragment(const struct file_ent *ent, sqfs_u32 *idx)
 {
-	sqfs_u32 lhs_frag_idx, lhs_frag_off, rhs_frag_idx, rhs_frag_off;
-	sqfs_u64 lhs_size, rhs_size, lhs_start, rhs_start;
-	const struct file_ent *lhs = l, *rhs = r;
+	sqfs_u32 frag_off;
+	sqfs_u64 size;
+
+	sqfs_inode_get_frag_location(ent->inode, idx, &frag_off);
+	sqfs_inode_get_file_size(ent->inode, &size);
+
+	return (size % block_size) && (frag_off < block_size) &&
+		(*idx != 0xFFFFFFFF);
+}
+
+static int compare_data(const struct file_ent *lhs,
+			const struct file_ent *rhs)
+{
+	sqfs_u32 lhs_idx, lhs_off, rhs_idx, rhs_off;
+	sqfs_u64 lhs_size, rhs_size;
+	size_t count;
+
+	if (lhs->inode->num_file_blocks != rhs->inode->num_file_blocks) {
+		return lhs->inode->num_file_blocks <
+			rhs->inode->num_file_blocks ? -1 : 1;
+	}
 
-	sqfs_inode_get_frag_location(lhs->inode, &lhs_frag_idx, &lhs_frag_off);
-	sqfs_inode_get_file_block_start(lhs->inode, &lhs_start);
 	sqfs_inode_get_file_size(lhs->inode, &lhs_size);
+	sqfs_inode_get_file_size(rhs->inode, &rhs_size);
+
+	if (lhs_size != rhs_size)
+		return lhs_size < rhs_size ? -1 : 1;
 
-	sqfs_inode_get_frag_location(rhs->inode, &rhs_frag_idx, &rhs_frag_off);
+	sqfs_inode_get_frag_location(lhs->inode, &lhs_idx, &lhs_off);
+	sqfs_inode_get_frag_location(rhs->inode, &rhs_idx, &rhs_off);
+
+	if (lhs_idx != rhs_idx)
+		return lhs_idx < rhs_idx ? -1 : 1;
+
+	if (lhs_off != rhs_off)
+		return lhs_off < rhs_off ? -1 : 1;
+
+	count = lhs->inode->num_file_blocks;
+
+	return memcmp(lhs->inode->block_sizes, rhs->inode->block_sizes,
+		      count * sizeof(lhs->inode->block_sizes[0]));
+}
+
+/*
+  If the data writer deduplicated an entire file, both inodes refer to the
+  same blocks and fragment. Only files with data blocks are considered, the
+  tail ends of small files are cheap to get from the fragment cache.
+ */
+static bool same_data(const struct file_ent *lhs, const struct file_ent *rhs)
+{
+	sqfs_u64 lhs_start, rhs_start;
+
+	if (lhs->inode->num_file_blocks == 0)
+		return false;
+
+	sqfs_inode_get_file_block_start(lhs->inode, &lhs_start);
 	sqfs_inode_get_file_block_start(rhs->inode, &rhs_start);
-	sqfs_inode_get_file_size(rhs->inode, &rhs_size);
 
-	/* Files with fragments come first, ordered by ID.
-	   In case of tie, files without data blocks come first,
-	   and the others are ordered by start block. */
-	if ((lhs_size % block_size) && (lhs_frag_off < block_size) &&
-	    (lhs_frag_idx != 0xFFFFFFFF)) {
-		if ((rhs_size % block_size) && (rhs_frag_off < block_size) &&
-		    (rhs_frag_idx != 0xFFFFFFFF))
-			return -1;
+	return lhs_start == rhs_start && compare_data(lhs, rhs) == 0;
+}
 
-		if (lhs_frag_idx < rhs_frag_idx)
-			return -1;
+static int compare_files(const void *l, const void *r)
+{
+	const struct file_ent *lhs = l, *rhs = r;
+	sqfs_u32 lhs_frag_idx, rhs_frag_idx;
+	sqfs_u64 lhs_start, rhs_start;
+	bool lhs_frag, rhs_frag;
 
-		if (lhs_frag_idx > rhs_frag_idx)
-			return 1;
+	lhs_frag = has_fragment(lhs, &lhs_frag_idx);
+	rhs_frag = has_fragment(rhs, &rhs_frag_idx);
 
-		if (lhs_size < block_size)
-			return (rhs_size < block_size) ? 0 : -1;
+	sqfs_inode_get_file_block_start(lhs->inode, &lhs_start);
+	sqfs_inode_get_file_block_start(rhs->inode, &rhs_start);
 
-		if (rhs_size < block_size)
+	/*
+	  Files with fragments come first, ordered by fragment index, so
+	  each fragment block only has to be decompressed once. Files that
+	  share a fragment block and the files without fragments are ordered
+	  by their start block, i.e. with files without data blocks first.
+	 */
+	if (lhs_frag != rhs_frag)
+		return lhs_frag ? -1 : 1;
+
+	if (lhs_frag && lhs_frag_idx != rhs_frag_idx)
+		return lhs_frag_idx < rhs_frag_idx ? -1 : 1;
+
+	if (lhs->inode->num_file_blocks == 0 ||
+	    rhs->inode->num_file_blocks == 0) {
+		if (lhs->inode->num_file_blocks != 0)
 			return 1;
-
-		goto order_by_start;
+		if (rhs->inode->num_file_blocks != 0)
+			return -1;
+		return 0;
 	}
 
-	if ((rhs_size % block_size) && (rhs_frag_off < block_size) &&
-	    (rhs_frag_idx != 0xFFFFFFFF))
-		return 1;
+	if (lhs_start != rhs_start)
+		return lhs_start < rhs_start ? -1 : 1;
 
-	/* order the rest by start block */
-order_by_start:
-	return lhs_start < rhs_start ? -1 : lhs_start > rhs_start ? 1 : 0;
+	/* keep files with the exact same data next to each other */
+	return compare_data(lhs, rhs);
 }
 
-static int add_file(const sqfs_tree_node_t *node)
+static int add_file(const sqfs_tree_node_t *node, const char *path)
 {
 	size_t new_sz;
-	char *path;
+	char *copy;
 	void *new;
 
 	if (num_files == max_files) {
@@ -81,19 +150,13 @@ static int add_file(const sqfs_tree_node_t *node)
 		max_files = new_sz;
 	}
 
-	path = sqfs_tree_node_get_path(node);
-	if (path == NULL) {
+	copy = strdup(path);
+	if (copy == NULL) {
 		perror("assembling file path");
 		return -1;
 	}
 
-	if (canonicalize_name(path)) {
-		fprintf(stderr, "Invalid file path '%s'\n", path);
-		free(path);
-		return -1;
-	}
-
-	files[num_files].path = path;
+	files[num_files].path = copy;
 	files[num_files].inode = node->inode;
 	num_files++;
 	return 0;
@@ -112,71 +175,561 @@ static void clear_file_list(void)
 	max_files = 0;
 }
 
-static int gen_file_list_dfs(const sqfs_tree_node_t *n)
+static int gen_file_list_dfs(const sqfs_tree_node_t *n, path_buf_t *path)
 {
+	size_t old_len = path->len;
+	int ret;
+
 	if (!is_filename_sane((const char *)n->name)) {
 		fprintf(stderr, "Found an entry named '%s', skipping.\n",
 			n->name);
 		return 0;
 	}
 
-	if (S_ISREG(n->inode->base.mode))
-		return add_file(n);
+	if (n->parent != NULL) {
+		ret = path_buf_push(path, (const char *)n->name,
+				    strlen((const char *)n->name));
+		if (ret) {
+			sqfs_perror((const char *)n->name,
+				    "assembling file path", ret);
+			return -1;
+		}
+	}
 
-	if (S_ISDIR(n->inode->base.mode)) {
+	if (S_ISREG(n->inode->base.mode)) {
+		if (add_file(n, path->str))
+			return -1;
+	} else if (S_ISDIR(n->inode->base.mode)) {
 		for (n = n->children; n != NULL; n = n->next) {
-			if (gen_file_list_dfs(n))
+			if (gen_file_list_dfs(n, path))
 				return -1;
 		}
 	}
 
+	path_buf_truncate(path, old_len);
 	return 0;
 }
 
-static int fill_files(sqfs_data_reader_t *data, int flags)
+#ifdef HAVE_COPY_FILE_RANGE
+static bool has_sparse_blocks(const sqfs_inode_generic_t *inode)
 {
 	size_t i;
-	int fd;
 
-	for (i = 0; i < num_files; ++i) {
-		fd = open(files[i].path, O_WRONLY);
-		if (fd < 0) {
-			fprintf(stderr, "unpacking %s: %s\n",
-				files[i].path, strerror(errno));
+	for (i = 0; i < inode->num_file_blocks; ++i) {
+		if (SQFS_IS_SPARSE_BLOCK(inode->block_sizes[i]))
+			return true;
+	}
+
+	return false;
+}
+
+static int copy_range(const struct file_ent *src, int srcfd, int fd)
+{
+	bool first = true;
+	sqfs_u64 size;
+	ssize_t ret;
+
+	sqfs_inode_get_file_size(src->inode, &size);
+
+	while (size > 0) {
+		ret = copy_file_range(srcfd, NULL, fd, NULL, size, 0);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0) {
+			/* not supported, nothing has been written yet */
+			if (first)
+				return 1;
+
+			fprintf(stderr, "copying %s: %s\n", src->path,
+				ret == 0 ? "unexpected end of file" :
+				strerror(errno));
 			return -1;
 		}
 
-		if (!(flags & UNPACK_QUIET))
-			printf("unpacking %s\n", files[i].path);
+		size -= ret;
+		first = false;
+	}
+
+	return 0;
+}
+#endif
 
-		if (sqfs_data_reader_dump(files[i].path, data, files[i].inode,
-					  fd, block_size,
-					  (flags & UNPACK_NO_SPARSE) == 0)) {
-			close(fd);
+/*
+  Fill a file from an already unpacked copy of the same data, either by
+  sharing the extents on a file system that supports it, or with an in
+  kernel copy. Returns 1 if neither is possible, so the caller can fall back
+  to uncompressing the blocks again.
+ */
+static int copy_unpacked(const struct file_ent *src, int fd, int flags)
+{
+	int ret = 1, srcfd;
+
+	srcfd = open(src->path, O_RDONLY);
+	if (srcfd < 0)
+		return 1;
+
+#ifdef FICLONE
+	if (ioctl(fd, FICLONE, srcfd) == 0)
+		ret = 0;
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+	/* an in kernel copy would fill in the holes */
+	if (ret == 1 && ((flags & UNPACK_NO_SPARSE) ||
+			 (!(flags & UNPACK_DETECT_ZEROS) &&
+			  !has_sparse_blocks(src->inode)))) {
+		ret = copy_range(src, srcfd, fd);
+	}
+#else
+	(void)flags;
+#endif
+
+	close(srcfd);
+	return ret;
+}
+
+static ssize_t read_at(int fd, void *data, size_t size, off_t offset)
+{
+	size_t total = 0;
+	ssize_t ret;
+
+	while (total < size) {
+		ret = pread(fd, (char *)data + total, size - total,
+			    offset + total);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0)
+			return -1;
+
+		if (ret == 0)
+			break;
+
+		total += ret;
+	}
+
+	return total;
+}
+
+static int write_at(int fd, const void *data, size_t size, off_t offset)
+{
+	ssize_t ret;
+
+	while (size > 0) {
+		ret = pwrite(fd, data, size, offset);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0)
 			return -1;
+
+		data = (const char *)data + ret;
+		offset += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+/*
+  Compare an existing file with the image block by block and only write the
+  blocks that differ, so unchanged parts of a file are only read.
+ */
+static int update_blocks(sqfs_data_reader_t *data, const struct file_ent *ent,
+			 int fd, const struct stat *sb, int flags)
+{
+	size_t i, diff, changed = 0;
+	sqfs_u64 size, offset = 0;
+	sqfs_u8 *buffer;
+	const void *ptr;
+	ssize_t ret;
+	int err;
+
+	sqfs_inode_get_file_size(ent->inode, &size);
+
+	buffer = malloc(block_size);
+	if (buffer == NULL) {
+		perror(ent->path);
+		return -1;
+	}
+
+	for (i = 0; offset < size; ++i) {
+		if (i < ent->inode->num_file_blocks) {
+			err = sqfs_data_reader_peek_block(data, ent->inode, i,
+							  &ptr, &diff);
+		} else {
+			err = sqfs_data_reader_peek_fragment(data, ent->inode,
+							     &ptr, &diff);
+		}
+
+		if (err) {
+			sqfs_perror(ent->path, "reading data block", err);
+			goto fail;
+		}
+
+		if (diff == 0)
+			break;
+
+		ret = read_at(fd, buffer, diff, offset);
+		if (ret < 0)
+			goto fail_errno;
+
+		if ((size_t)ret != diff || memcmp(buffer, ptr, diff) != 0) {
+			if (write_at(fd, ptr, diff, offset))
+				goto fail_errno;
+			++changed;
+		}
+
+		offset += diff;
+	}
+
+	if ((sqfs_u64)sb->st_size != size) {
+		if (ftruncate(fd, size))
+			goto fail_errno;
+		++changed;
+	}
+
+	if (changed > 0 && !(flags & UNPACK_QUIET))
+		printf("updating %s\n", ent->path);
+
+	free(buffer);
+	return 0;
+fail_errno:
+	fprintf(stderr, "updating %s: %s\n", ent->path, strerror(errno));
+fail:
+	free(buffer);
+	return -1;
+}
+
+/*
+  Bring an existing file up to date. By default, a file with the same size
+  and modification time as the inode is assumed to be unchanged and anything
+  else is truncated, so it can be filled from scratch. With
+  UNPACK_COMPARE_DATA, the contents are compared instead. Returns 0 if the
+  file is up to date, 1 if it has to be filled and -1 on failure.
+ */
+static int update_file(sqfs_data_reader_t *data, const struct file_ent *ent,
+		       int fd, int flags)
+{
+	struct stat sb;
+	sqfs_u64 size;
+	int ret;
+
+	if (fstat(fd, &sb)) {
+		fprintf(stderr, "stat %s: %s\n", ent->path, strerror(errno));
+		return -1;
+	}
+
+	if (flags & UNPACK_COMPARE_DATA) {
+		sqfs_trace_begin("rdsquashfs", "update file");
+		ret = update_blocks(data, ent, fd, &sb, flags);
+		sqfs_trace_end("rdsquashfs", "update file");
+		return ret;
+	}
+
+	sqfs_inode_get_file_size(ent->inode, &size);
+
+	if ((sqfs_u64)sb.st_size == size &&
+	    sb.st_mtime == (time_t)ent->inode->base.mod_time) {
+		return 0;
+	}
+
+	if (ftruncate(fd, 0)) {
+		fprintf(stderr, "truncating %s: %s\n",
+			ent->path, strerror(errno));
+		return -1;
+	}
+
+	return 1;
+}
+
+static int open_file(const struct file_ent *ent, int flags)
+{
+	int fd;
+
+	if (!(flags & UNPACK_UPDATE))
+		return open(ent->path, O_WRONLY);
+
+	fd = open(ent->path, O_RDWR);
+
+	/* made read only by a previous unpack with --chmod */
+	if (fd < 0 && errno == EACCES && chmod(ent->path, 0600) == 0)
+		fd = open(ent->path, O_RDWR);
+
+	return fd;
+}
+
+static int dump_flags(int flags)
+{
+	if (flags & UNPACK_NO_SPARSE)
+		return 0;
+
+	if (flags & UNPACK_DETECT_ZEROS)
+		return DUMP_ALLOW_SPARSE | DUMP_DETECT_ZEROS;
+
+	return DUMP_ALLOW_SPARSE;
+}
+
+static int fill_file(sqfs_data_reader_t *data, const struct file_ent *ent,
+		     const struct file_ent *src, int flags)
+{
+	int fd, ret;
+
+	fd = open_file(ent, flags);
+	if (fd < 0) {
+		fprintf(stderr, "unpacking %s: %s\n",
+			ent->path, strerror(errno));
+		return -1;
+	}
+
+	if (flags & UNPACK_UPDATE) {
+		ret = update_file(data, ent, fd, flags);
+		if (ret <= 0) {
+			close(fd);
+			return ret;
 		}
+	}
 
-		close(fd);
+	if (!(flags & UNPACK_QUIET))
+		printf("unpacking %s\n", ent->path);
+
+	if (src != NULL) {
+		ret = copy_unpacked(src, fd, flags);
+		if (ret <= 0) {
+			close(fd);
+			return ret;
+		}
+	}
+
+	sqfs_trace_begin("rdsquashfs", "unpack file");
+	ret = sqfs_data_reader_dump(ent->path, data, ent->inode, fd,
+				    block_size, dump_flags(flags));
+	sqfs_trace_end("rdsquashfs", "unpack file");
+
+	close(fd);
+	return ret ? -1 : 0;
+}
+
+/* an unpacked file with the same data right before this one, if any */
+static const struct file_ent *get_copy_source(size_t i, size_t first)
+{
+	if (i > first && same_data(files + i - 1, files + i))
+		return files + i - 1;
+
+	return NULL;
+}
+
+static int fill_files(sqfs_data_reader_t *data, int flags)
+{
+	size_t i;
+
+	for (i = 0; i < num_files; ++i) {
+		if (fill_file(data, files + i, get_copy_source(i, 0), flags))
+			return -1;
 	}
 
 	return 0;
 }
 
+#ifdef WITH_PTHREAD
+typedef struct {
+	size_t *chunks;
+	size_t num_chunks;
+	size_t next;
+	int flags;
+	bool failed;
+	pthread_mutex_t mtx;
+} fill_work_t;
+
+typedef struct {
+	fill_work_t *work;
+	sqfs_data_reader_t *data;
+} fill_worker_t;
+
+static sqfs_u64 file_cost(const struct file_ent *ent)
+{
+	sqfs_u64 size;
+
+	sqfs_inode_get_file_size(ent->inode, &size);
+
+	/* account for opening and closing the file as well */
+	return size + block_size / 4;
+}
+
+/*
+  Split the sorted file list into contiguous chunks of roughly equal data
+  size. Each chunk is unpacked in order by a single thread, so the data is
+  still read sequentially within a chunk. Files that share a fragment block
+  are kept in the same chunk, so it is only uncompressed once, and so are
+  files with the exact same data, so they can be copied.
+ */
+static size_t *split_chunks(unsigned int num_jobs, size_t *count)
+{
+	sqfs_u64 total = 0, target, acc = 0;
+	sqfs_u32 idx, next_idx;
+	size_t i, max, *chunks;
+
+	for (i = 0; i < num_files; ++i)
+		total += file_cost(files + i);
+
+	max = (size_t)num_jobs * CHUNKS_PER_THREAD;
+	target = total / max;
+
+	chunks = alloc_array(sizeof(chunks[0]), max + 1);
+	if (chunks == NULL)
+		return NULL;
+
+	*count = 0;
+	chunks[0] = 0;
+
+	for (i = 0; i < num_files; ++i) {
+		acc += file_cost(files + i);
+
+		if (acc < target || i + 1 == num_files || *count + 1 == max)
+			continue;
+
+		if (has_fragment(files + i, &idx) &&
+		    has_fragment(files + i + 1, &next_idx) &&
+		    idx == next_idx) {
+			continue;
+		}
+
+		if (same_data(files + i, files + i + 1))
+			continue;
+
+		chunks[++(*count)] = i + 1;
+		acc = 0;
+	}
+
+	chunks[++(*count)] = num_files;
+	return chunks;
+}
+
+static void *fill_worker(void *arg)
+{
+	fill_worker_t *worker = arg;
+	fill_work_t *work = worker->work;
+	size_t i, j;
+
+	for (;;) {
+		pthread_mutex_lock(&work->mtx);
+		i = work->next++;
+		if (work->failed)
+			i = work->num_chunks;
+		pthread_mutex_unlock(&work->mtx);
+
+		if (i >= work->num_chunks)
+			break;
+
+		for (j = work->chunks[i]; j < work->chunks[i + 1]; ++j) {
+			if (fill_file(worker->data, files + j,
+				      get_copy_source(j, work->chunks[i]),
+				      work->flags)) {
+				pthread_mutex_lock(&work->mtx);
+				work->failed = true;
+				pthread_mutex_unlock(&work->mtx);
+				return NULL;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static int fill_files_parallel(sqfs_data_reader_t *data, int flags,
+			       unsigned int num_jobs)
+{
+	unsigned int i, count;
+	fill_worker_t *workers;
+	fill_work_t work;
+	int ret = -1;
+
+	memset(&work, 0, sizeof(work));
+	work.flags = flags;
+
+	work.chunks = split_chunks(num_jobs, &work.num_chunks);
+	if (work.chunks == NULL)
+		goto fail_alloc;
+
+	workers = alloc_array(sizeof(workers[0]), num_jobs);
+	if (workers == NULL) {
+		free(work.chunks);
+		goto fail_alloc;
+	}
+
+	if (pthread_mutex_init(&work.mtx, NULL) != 0) {
+		free(workers);
+		free(work.chunks);
+		goto fail_alloc;
+	}
+
+	/* the main thread works through the list with the original reader */
+	workers[0].work = &work;
+	workers[0].data = data;
+
+	for (count = 1; count < num_jobs; ++count) {
+		workers[count].work = &work;
+		workers[count].data = sqfs_data_reader_create_copy(data);
+		if (workers[count].data == NULL)
+			break;
+	}
+
+	run_workers(fill_worker, workers, sizeof(workers[0]), count);
+
+	for (i = 1; i < count; ++i)
+		sqfs_data_reader_destroy(workers[i].data);
+
+	if (!work.failed)
+		ret = 0;
+
+	pthread_mutex_destroy(&work.mtx);
+	free(workers);
+	free(work.chunks);
+	return ret;
+fail_alloc:
+	perror("starting unpack threads");
+	return -1;
+}
+#endif
+
 int fill_unpacked_files(size_t blk_sz, const sqfs_tree_node_t *root,
-			sqfs_data_reader_t *data, int flags)
+			sqfs_data_reader_t *data, int flags,
+			unsigned int num_jobs)
 {
+	path_buf_t path;
 	int status;
 
 	block_size = blk_sz;
 
-	if (gen_file_list_dfs(root)) {
+	status = path_buf_init(&path, "");
+	if (status) {
+		sqfs_perror("unpacking files", "assembling file path", status);
+		return -1;
+	}
+
+	status = gen_file_list_dfs(root, &path);
+	path_buf_cleanup(&path);
+
+	if (status) {
 		clear_file_list();
 		return -1;
 	}
 
 	qsort(files, num_files, sizeof(files[0]), compare_files);
 
+#ifdef WITH_PTHREAD
+	if (num_jobs > 1 && num_files > 1) {
+		status = fill_files_parallel(data, flags, num_jobs);
+	} else {
+		status = fill_files(data, flags);
+	}
+#else
+	(void)num_jobs;
 	status = fill_files(data, flags);
+#endif
 	clear_file_list();
 	return status;
 }
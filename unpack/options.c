@@ -18,20 +18,27 @@ static struct option long_opts[] = {
 	{ "no-slink", no_argument, NULL, 'L' },
 	{ "no-empty-dir", no_argument, NULL, 'E' },
 	{ "no-sparse", no_argument, NULL, 'Z' },
+	{ "detect-zeros", no_argument, NULL, 'z' },
 #ifdef HAVE_SYS_XATTR_H
 	{ "set-xattr", no_argument, NULL, 'X' },
 #endif
 	{ "set-times", no_argument, NULL, 'T' },
+	{ "update", no_argument, NULL, 'U' },
+	{ "compare-data", no_argument, NULL, 'B' },
+	{ "delete", no_argument, NULL, 'R' },
 	{ "describe", no_argument, NULL, 'd' },
+	{ "verify", no_argument, NULL, 'v' },
 	{ "chmod", no_argument, NULL, 'C' },
 	{ "chown", no_argument, NULL, 'O' },
+	{ "num-jobs", required_argument, NULL, 'j' },
+	{ "trace", required_argument, NULL, 't' },
 	{ "quiet", no_argument, NULL, 'q' },
 	{ "help", no_argument, NULL, 'h' },
 	{ "version", no_argument, NULL, 'V' },
 };
 
 static const char *short_opts =
-	"l:c:u:p:x:DSFLCOEZTj:dqhV"
+	"l:c:u:p:x:DSFLCOEZzTUBRj:t:dvqhV"
 #ifdef HAVE_SYS_XATTR_H
 	"X"
 #endif
@@ -53,6 +60,10 @@ static const char *help_string =
 "  --unpack-path, -u <path>  Unpack this sub directory from the image. To\n"
 "                            unpack everything, simply specify /.\n"
 "  --describe, -d            Produce a file listing from the image.\n"
+"  --verify, -v              Check the image for errors, by uncompressing\n"
+"                            all meta data and data blocks and checking\n"
+"                            that they are where they should be and have\n"
+"                            the sizes the inodes say they have.\n"
 "\n"
 "  --unpack-root, -p <path>  If used with --unpack-path, this is where the\n"
 "                            data unpacked to. If used with --describe, this\n"
@@ -67,16 +78,36 @@ static const char *help_string =
 "                            empty after applying the above rules.\n"
 "  --no-sparse, -Z           Do not create sparse files, always write zero\n"
 "                            blocks to disk.\n"
+"  --detect-zeros, -z        Also turn ranges of zero bytes in the unpacked\n"
+"                            data into holes, not only the blocks that are\n"
+"                            stored as sparse in the image.\n"
 #ifdef HAVE_SYS_XATTR_H
 "  --set-xattr, -X           When unpacking files to disk, set the extended\n"
 "                            attributes from the squashfs image.\n"
 #endif
 "  --set-times, -T           When unpacking files to disk, set the create\n"
 "                            and modify timestamps from the squashfs image.\n"
+"  --update, -U              Unpack on top of a tree unpacked from an older\n"
+"                            version of the image. Files with the same size\n"
+"                            and modification time are left alone, other\n"
+"                            entries are replaced. Implies --set-times.\n"
+"  --compare-data, -B        With --update, compare the data of every file\n"
+"                            with the image and only write the blocks that\n"
+"                            differ, instead of relying on the time stamps.\n"
+"  --delete, -R              With --update, remove everything from the\n"
+"                            unpacked directories that is not in the image.\n"
 "  --chmod, -C               Change permission flags of unpacked files to\n"
 "                            those store in the squashfs image.\n"
 "  --chown, -O               Change ownership of unpacked files to the\n"
 "                            UID/GID set in the squashfs image.\n"
+"  --num-jobs, -j <count>    Number of threads to use for decompressing data\n"
+"                            blocks ahead of time and the inode & directory\n"
+"                            tables up front. When unpacking, that many files\n"
+"                            are extracted and directory sub trees restored\n"
+"                            in parallel. The default is to do everything on\n"
+"                            the main thread.\n"
+"  --trace, -t <file>        Record what rdsquashfs and its threads are doing\n"
+"                            to a Chrome trace JSON file, e.g. for Perfetto.\n"
 "  --quiet, -q               Do not print out progress while unpacking.\n"
 "\n"
 "  --help, -h                Print help text and exit.\n"
@@ -116,6 +147,8 @@ void process_command_line(options_t *opt, int argc, char **argv)
 	opt->cmdpath = NULL;
 	opt->unpack_root = NULL;
 	opt->image_name = NULL;
+	opt->num_jobs = 1;
+	opt->trace_file = NULL;
 
 	for (;;) {
 		i = getopt_long(argc, argv, short_opts, long_opts, NULL);
@@ -147,6 +180,9 @@ void process_command_line(options_t *opt, int argc, char **argv)
 		case 'Z':
 			opt->flags |= UNPACK_NO_SPARSE;
 			break;
+		case 'z':
+			opt->flags |= UNPACK_DETECT_ZEROS;
+			break;
 #ifdef HAVE_SYS_XATTR_H
 		case 'X':
 			opt->flags |= UNPACK_SET_XATTR;
@@ -155,6 +191,15 @@ void process_command_line(options_t *opt, int argc, char **argv)
 		case 'T':
 			opt->flags |= UNPACK_SET_TIMES;
 			break;
+		case 'U':
+			opt->flags |= UNPACK_UPDATE | UNPACK_SET_TIMES;
+			break;
+		case 'B':
+			opt->flags |= UNPACK_COMPARE_DATA;
+			break;
+		case 'R':
+			opt->flags |= UNPACK_DELETE;
+			break;
 		case 'c':
 			opt->op = OP_CAT;
 			opt->cmdpath = get_path(opt->cmdpath, optarg);
@@ -164,6 +209,11 @@ void process_command_line(options_t *opt, int argc, char **argv)
 			free(opt->cmdpath);
 			opt->cmdpath = NULL;
 			break;
+		case 'v':
+			opt->op = OP_VERIFY;
+			free(opt->cmdpath);
+			opt->cmdpath = NULL;
+			break;
 		case 'x':
 			opt->op = OP_RDATTR;
 			opt->cmdpath = get_path(opt->cmdpath, optarg);
@@ -179,6 +229,12 @@ void process_command_line(options_t *opt, int argc, char **argv)
 			opt->op = OP_UNPACK;
 			opt->cmdpath = get_path(opt->cmdpath, optarg);
 			break;
+		case 'j':
+			opt->num_jobs = strtol(optarg, NULL, 0);
+			break;
+		case 't':
+			opt->trace_file = optarg;
+			break;
 		case 'q':
 			opt->flags |= UNPACK_QUIET;
 			break;
@@ -195,13 +251,35 @@ void process_command_line(options_t *opt, int argc, char **argv)
 		}
 	}
 
+	if (opt->num_jobs < 1)
+		opt->num_jobs = 1;
+
+	if ((opt->flags & (UNPACK_COMPARE_DATA | UNPACK_DELETE)) &&
+	    !(opt->flags & UNPACK_UPDATE)) {
+		fputs("--compare-data and --delete require --update\n",
+		      stderr);
+		goto fail_arg;
+	}
+
+	if ((opt->flags & UNPACK_DETECT_ZEROS) &&
+	    (opt->flags & UNPACK_NO_SPARSE)) {
+		fputs("--detect-zeros cannot be used with --no-sparse\n",
+		      stderr);
+		goto fail_arg;
+	}
+
 	if (opt->op == OP_NONE) {
 		fputs("No operation specified\n", stderr);
 		goto fail_arg;
 	}
 
 	if (opt->op == OP_LS || opt->op == OP_CAT || opt->op == OP_RDATTR) {
-		opt->rdtree_flags |= SQFS_TREE_NO_RECURSE;
+		opt->rdtree_flags |= SQFS_TREE_LAZY;
+	}
+
+	if (opt->op == OP_LS || opt->op == OP_DESCRIBE ||
+	    opt->op == OP_RDATTR) {
+		opt->rdtree_flags |= SQFS_TREE_NO_BLOCK_LISTS;
 	}
 
 	if (optind >= argc) {
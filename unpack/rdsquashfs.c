@@ -23,7 +23,11 @@ int main(int argc, char **argv)
 
 	process_command_line(&opt, argc, argv);
 
-	file = sqfs_open_file(opt.image_name, SQFS_FILE_OPEN_READ_ONLY);
+	if (opt.trace_file != NULL && trace_open(opt.trace_file))
+		goto out_cmd;
+
+	file = sqfs_open_image(opt.image_name, SQFS_FILE_OPEN_READ_ONLY |
+			      SQFS_FILE_OPEN_MMAP | SQFS_FILE_OPEN_ASYNC);
 	if (file == NULL) {
 		perror(opt.image_name);
 		goto out_cmd;
@@ -83,7 +87,11 @@ int main(int argc, char **argv)
 		goto out_xr;
 	}
 
-	ret = sqfs_id_table_read(idtbl, file, &super, cmp);
+	if (opt.rdtree_flags & SQFS_TREE_LAZY) {
+		ret = sqfs_id_table_read_lazy(idtbl, file, &super, cmp);
+	} else {
+		ret = sqfs_id_table_read(idtbl, file, &super, cmp);
+	}
 	if (ret) {
 		sqfs_perror(opt.image_name, "loading ID table", ret);
 		goto out_id;
@@ -96,21 +104,53 @@ int main(int argc, char **argv)
 		goto out_id;
 	}
 
-	data = sqfs_data_reader_create(file, super.block_size, cmp);
+	data = sqfs_data_reader_create(file, super.block_size, cmp, 0);
 	if (data == NULL) {
 		sqfs_perror(opt.image_name, "creating data reader",
 			    SQFS_ERROR_ALLOC);
 		goto out_dr;
 	}
 
-	ret = sqfs_data_reader_load_fragment_table(data, &super);
+	if (opt.num_jobs > 1 && opt.op != OP_VERIFY) {
+		ret = sqfs_data_reader_set_readahead(data, opt.num_jobs,
+					opt.num_jobs * READAHEAD_PER_JOB);
+		if (ret) {
+			sqfs_perror(opt.image_name,
+				    "creating decompressor threads", ret);
+			goto out_data;
+		}
+	}
+
+	/* when verifying, this uncompresses every block of both tables */
+	if (opt.num_jobs > 1 || opt.op == OP_VERIFY) {
+		ret = sqfs_dir_reader_preload(dirrd, opt.num_jobs);
+		if (ret) {
+			sqfs_perror(opt.image_name,
+				    "loading inode & directory table", ret);
+			goto out_data;
+		}
+	} else {
+		ret = sqfs_dir_reader_set_readahead(dirrd, META_READAHEAD);
+		if (ret) {
+			sqfs_perror(opt.image_name,
+				    "setting up meta data read ahead", ret);
+			goto out_data;
+		}
+	}
+
+	if (opt.rdtree_flags & SQFS_TREE_LAZY) {
+		ret = sqfs_data_reader_load_fragment_table_lazy(data, &super);
+	} else {
+		ret = sqfs_data_reader_load_fragment_table(data, &super);
+	}
 	if (ret) {
 		sqfs_perror(opt.image_name, "loading fragment table", ret);
 		goto out_data;
 	}
 
 	ret = sqfs_dir_reader_get_full_hierarchy(dirrd, idtbl, opt.cmdpath,
-						 opt.rdtree_flags, &n);
+						 opt.rdtree_flags |
+						 SQFS_TREE_COMPACT, &n);
 	if (ret) {
 		sqfs_perror(opt.image_name, "reading filesystem tree", ret);
 		goto out_data;
@@ -129,7 +169,7 @@ int main(int argc, char **argv)
 
 		if (sqfs_data_reader_dump(opt.cmdpath, data, n->inode,
 					  STDOUT_FILENO,
-					  super.block_size, false)) {
+					  super.block_size, 0)) {
 			goto out;
 		}
 		break;
@@ -142,13 +182,25 @@ int main(int argc, char **argv)
 				return -1;
 		}
 
-		if (restore_fstree(n, opt.flags))
+		sqfs_trace_begin("rdsquashfs", "create directories");
+		ret = restore_fstree(n, opt.flags, opt.num_jobs);
+		sqfs_trace_end("rdsquashfs", "create directories");
+		if (ret)
 			goto out;
 
-		if (fill_unpacked_files(super.block_size, n, data, opt.flags))
+		/* the unpack threads uncompress the blocks themselves */
+		if (opt.num_jobs > 1)
+			sqfs_data_reader_set_readahead(data, 0, 0);
+
+		if (fill_unpacked_files(super.block_size, n, data, opt.flags,
+					opt.num_jobs)) {
 			goto out;
+		}
 
-		if (update_tree_attribs(xattr, n, opt.flags))
+		sqfs_trace_begin("rdsquashfs", "restore attributes");
+		ret = update_tree_attribs(xattr, n, opt.flags, opt.num_jobs);
+		sqfs_trace_end("rdsquashfs", "restore attributes");
+		if (ret)
 			goto out;
 
 		if (opt.unpack_root != NULL && popd() != 0)
@@ -162,6 +214,12 @@ int main(int argc, char **argv)
 		if (dump_xattrs(xattr, n->inode))
 			goto out;
 		break;
+	case OP_VERIFY:
+		if (verify_image(&super, file, cmp, n, data, opt.flags,
+				 opt.num_jobs)) {
+			goto out;
+		}
+		break;
 	}
 
 	status = EXIT_SUCCESS;
@@ -182,5 +240,6 @@ out_file:
 	file->destroy(file);
 out_cmd:
 	free(opt.cmdpath);
+	trace_close();
 	return status;
 }
@@ -11,6 +11,7 @@
 #include "common.h"
 #include "fstree.h"
 #include "util/util.h"
+#include "util/workers.h"
 
 #ifdef HAVE_SYS_XATTR_H
 #include <sys/xattr.h>
@@ -32,6 +33,10 @@ enum UNPACK_FLAGS {
 	UNPACK_NO_SPARSE = 0x08,
 	UNPACK_SET_XATTR = 0x10,
 	UNPACK_SET_TIMES = 0x20,
+	UNPACK_UPDATE = 0x40,
+	UNPACK_COMPARE_DATA = 0x80,
+	UNPACK_DELETE = 0x100,
+	UNPACK_DETECT_ZEROS = 0x200,
 };
 
 enum {
@@ -41,6 +46,7 @@ enum {
 	OP_UNPACK,
 	OP_DESCRIBE,
 	OP_RDATTR,
+	OP_VERIFY,
 };
 
 typedef struct {
@@ -50,20 +56,28 @@ typedef struct {
 	char *cmdpath;
 	const char *unpack_root;
 	const char *image_name;
+	unsigned int num_jobs;
+	const char *trace_file;
 } options_t;
 
 void list_files(const sqfs_tree_node_t *node);
 
-int restore_fstree(sqfs_tree_node_t *root, int flags);
+int restore_fstree(sqfs_tree_node_t *root, int flags, unsigned int num_jobs);
 
 int update_tree_attribs(sqfs_xattr_reader_t *xattr,
-			const sqfs_tree_node_t *root, int flags);
+			const sqfs_tree_node_t *root, int flags,
+			unsigned int num_jobs);
 
 int fill_unpacked_files(size_t blk_sz, const sqfs_tree_node_t *root,
-			sqfs_data_reader_t *data, int flags);
+			sqfs_data_reader_t *data, int flags,
+			unsigned int num_jobs);
 
 int describe_tree(const sqfs_tree_node_t *root, const char *unpack_root);
 
+int verify_image(const sqfs_super_t *super, sqfs_file_t *file,
+		 sqfs_compressor_t *cmp, const sqfs_tree_node_t *root,
+		 sqfs_data_reader_t *data, int flags, unsigned int num_jobs);
+
 int dump_xattrs(sqfs_xattr_reader_t *xattr, const sqfs_inode_generic_t *inode);
 
 void process_command_line(options_t *opt, int argc, char **argv);
@@ -6,61 +6,369 @@
  */
 #include "rdsquashfs.h"
 
-static int create_node(const sqfs_tree_node_t *n, int flags)
+#include <sys/stat.h>
+#include <dirent.h>
+
+#ifdef WITH_PTHREAD
+#include <pthread.h>
+
+/* number of subtrees to split the work into, per thread */
+#define SUBTREES_PER_THREAD (8)
+
+static pthread_mutex_t xattr_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+#define XATTR_LOCK() pthread_mutex_lock(&xattr_mtx)
+#define XATTR_UNLOCK() pthread_mutex_unlock(&xattr_mtx)
+#else
+#define XATTR_LOCK()
+#define XATTR_UNLOCK()
+#endif
+
+#define NO_SPLIT ((size_t)-1)
+
+typedef struct {
+	const sqfs_tree_node_t *root;
+	sqfs_xattr_reader_t *xattr;
+	int flags;
+
+	/* the contents of directories at this depth are handled by workers */
+	size_t split;
+} restore_t;
+
+static int open_dir(int dirfd, const char *name)
+{
+	int fd;
+
+	fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd < 0)
+		fprintf(stderr, "opening %s: %s\n", name, strerror(errno));
+
+	return fd;
+}
+
+static int push_name(path_buf_t *path, const char *name)
+{
+	int ret = path_buf_push(path, name, strlen(name));
+
+	if (ret)
+		sqfs_perror(name, "restoring directory tree", ret);
+
+	return ret;
+}
+
+static int remove_entry(int dirfd, const char *name, bool is_dir);
+
+static int remove_dir_contents(int fd)
+{
+	struct dirent *ent;
+	struct stat sb;
+	int ret = 0;
+	DIR *dir;
+
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		perror("reading directory");
+		close(fd);
+		return -1;
+	}
+
+	while (ret == 0 && (ent = readdir(dir)) != NULL) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+
+		if (fstatat(fd, ent->d_name, &sb, AT_SYMLINK_NOFOLLOW)) {
+			fprintf(stderr, "stat %s: %s\n", ent->d_name,
+				strerror(errno));
+			ret = -1;
+			break;
+		}
+
+		ret = remove_entry(fd, ent->d_name, S_ISDIR(sb.st_mode));
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+static int remove_entry(int dirfd, const char *name, bool is_dir)
+{
+	int fd;
+
+	if (is_dir) {
+		fd = open_dir(dirfd, name);
+		if (fd < 0 || remove_dir_contents(fd))
+			return -1;
+	}
+
+	if (unlinkat(dirfd, name, is_dir ? AT_REMOVEDIR : 0)) {
+		fprintf(stderr, "removing %s: %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static bool same_link(int dirfd, const char *name, const char *target,
+		      const struct stat *sb)
+{
+	size_t len = strlen(target);
+	char *buffer;
+	ssize_t ret;
+
+	if ((sqfs_u64)sb->st_size != len)
+		return false;
+
+	buffer = malloc(len + 1);
+	if (buffer == NULL)
+		return false;
+
+	ret = readlinkat(dirfd, name, buffer, len + 1);
+	ret = (ret >= 0 && (size_t)ret == len &&
+	       memcmp(buffer, target, len) == 0);
+
+	free(buffer);
+	return ret != 0;
+}
+
+/*
+  When updating a tree, check if an existing entry can be kept or has to be
+  replaced. Regular files and directories of the same type are kept, their
+  contents are updated later. Returns 1 if the entry is kept, 0 if there is
+  nothing there (anymore) and -1 on failure.
+ */
+static int check_existing(int dirfd, const char *name,
+			  const sqfs_tree_node_t *n)
+{
+	sqfs_u16 mode = n->inode->base.mode;
+	struct stat sb;
+	sqfs_u32 devno;
+
+	if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW)) {
+		if (errno == ENOENT)
+			return 0;
+
+		fprintf(stderr, "stat %s: %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	if ((sb.st_mode & S_IFMT) == (mode & S_IFMT)) {
+		switch (mode & S_IFMT) {
+		case S_IFLNK:
+			if (same_link(dirfd, name, n->inode->slink_target,
+				      &sb)) {
+				return 1;
+			}
+			break;
+		case S_IFBLK:
+		case S_IFCHR:
+			if (n->inode->base.type == SQFS_INODE_EXT_BDEV ||
+			    n->inode->base.type == SQFS_INODE_EXT_CDEV) {
+				devno = n->inode->data.dev_ext.devno;
+			} else {
+				devno = n->inode->data.dev.devno;
+			}
+
+			if (sb.st_rdev == devno)
+				return 1;
+			break;
+		default:
+			return 1;
+		}
+	}
+
+	return remove_entry(dirfd, name, S_ISDIR(sb.st_mode)) ? -1 : 0;
+}
+
+static int compare_names(const void *lhs, const void *rhs)
+{
+	return strcmp(*((const char *const *)lhs), *((const char *const *)rhs));
+}
+
+/*
+  Remove everything from a directory on disk that is not a child of the
+  directory node, e.g. files that were removed from the image since the
+  tree was last unpacked.
+ */
+static int remove_stale(const restore_t *rs, int dirfd,
+			const sqfs_tree_node_t *dir, const char *path)
+{
+	const sqfs_tree_node_t *n;
+	size_t i, count = 0, num_stale = 0, max_stale = 0;
+	char **stale = NULL, *name;
+	const char **names;
+	struct dirent *ent;
+	struct stat sb;
+	int fd, ret = -1;
+	void *new;
+	DIR *d;
+
+	if (!(rs->flags & UNPACK_DELETE))
+		return 0;
+
+	for (n = dir->children; n != NULL; n = n->next)
+		++count;
+
+	names = alloc_array(sizeof(names[0]), count ? count : 1);
+	if (names == NULL)
+		goto fail_errno;
+
+	for (i = 0, n = dir->children; n != NULL; n = n->next)
+		names[i++] = (const char *)n->name;
+
+	qsort(names, count, sizeof(names[0]), compare_names);
+
+	if (dirfd == AT_FDCWD) {
+		fd = open(".", O_RDONLY | O_DIRECTORY);
+	} else {
+		fd = dup(dirfd);
+	}
+
+	if (fd < 0 || (d = fdopendir(fd)) == NULL) {
+		if (fd >= 0)
+			close(fd);
+		goto fail_errno;
+	}
+
+	/* a duplicate shares the position with the original */
+	rewinddir(d);
+
+	while ((ent = readdir(d)) != NULL) {
+		name = ent->d_name;
+
+		if (!strcmp(name, ".") || !strcmp(name, ".."))
+			continue;
+
+		if (bsearch(&name, names, count, sizeof(names[0]),
+			    compare_names) != NULL) {
+			continue;
+		}
+
+		if (num_stale == max_stale) {
+			max_stale = max_stale ? max_stale * 2 : 16;
+			new = realloc(stale, sizeof(stale[0]) * max_stale);
+			if (new == NULL)
+				break;
+			stale = new;
+		}
+
+		stale[num_stale] = strdup(name);
+		if (stale[num_stale] == NULL)
+			break;
+		++num_stale;
+	}
+
+	if (ent != NULL) {
+		closedir(d);
+		goto fail_errno;
+	}
+
+	closedir(d);
+
+	for (i = 0; i < num_stale; ++i) {
+		if (fstatat(dirfd, stale[i], &sb, AT_SYMLINK_NOFOLLOW)) {
+			fprintf(stderr, "stat %s: %s\n", stale[i],
+				strerror(errno));
+			goto out;
+		}
+
+		if (!(rs->flags & UNPACK_QUIET)) {
+			printf("removing %s%s%s\n", path, *path ? "/" : "",
+			       stale[i]);
+		}
+
+		if (remove_entry(dirfd, stale[i], S_ISDIR(sb.st_mode)))
+			goto out;
+	}
+
+	ret = 0;
+	goto out;
+fail_errno:
+	perror("removing stale entries");
+out:
+	for (i = 0; i < num_stale; ++i)
+		free(stale[i]);
+	free(stale);
+	free(names);
+	return ret;
+}
+
+static int create_node(const restore_t *rs, int dirfd,
+		       const sqfs_tree_node_t *n, size_t depth,
+		       path_buf_t *path)
 {
+	size_t old_len = path->len;
 	const sqfs_tree_node_t *c;
-	int fd, ret;
-	char *name;
+	const char *name;
+	int fd, exists = 0;
+
+	name = (const char *)n->name;
 
-	if (!is_filename_sane((const char *)n->name)) {
+	if (!is_filename_sane(name)) {
 		fprintf(stderr, "Found an entry named '%s', skipping.\n",
-			n->name);
+			name);
 		return 0;
 	}
 
-	if (!(flags & UNPACK_QUIET)) {
-		name = sqfs_tree_node_get_path(n);
-		if (name != NULL) {
-			ret = canonicalize_name(name);
-			assert(ret == 0);
-			printf("creating %s\n", name);
-			free(name);
+	if (push_name(path, name))
+		return -1;
+
+	if (rs->flags & UNPACK_UPDATE) {
+		exists = check_existing(dirfd, name, n);
+		if (exists < 0)
+			return -1;
+
+		if (exists && !S_ISDIR(n->inode->base.mode)) {
+			path_buf_truncate(path, old_len);
+			return 0;
 		}
 	}
 
+	if (!(rs->flags & UNPACK_QUIET) && !exists)
+		printf("creating %s\n", path->str);
+
 	switch (n->inode->base.mode & S_IFMT) {
 	case S_IFDIR:
-		if (mkdir((const char *)n->name, 0755) && errno != EEXIST) {
+		if (mkdirat(dirfd, name, 0755) && errno != EEXIST) {
 			fprintf(stderr, "mkdir %s: %s\n",
-				n->name, strerror(errno));
+				name, strerror(errno));
 			return -1;
 		}
 
-		if (pushd((const char *)n->name))
+		if (depth == rs->split)
+			break;
+
+		fd = open_dir(dirfd, name);
+		if (fd < 0)
+			return -1;
+
+		if (remove_stale(rs, fd, n, path->str)) {
+			close(fd);
 			return -1;
+		}
 
 		for (c = n->children; c != NULL; c = c->next) {
-			if (create_node(c, flags))
+			if (create_node(rs, fd, c, depth + 1, path)) {
+				close(fd);
 				return -1;
+			}
 		}
 
-		if (popd())
-			return -1;
+		close(fd);
 		break;
 	case S_IFLNK:
-		if (symlink(n->inode->slink_target, (const char *)n->name)) {
+		if (symlinkat(n->inode->slink_target, dirfd, name)) {
 			fprintf(stderr, "ln -s %s %s: %s\n",
-				n->inode->slink_target, n->name,
+				n->inode->slink_target, name,
 				strerror(errno));
 			return -1;
 		}
 		break;
 	case S_IFSOCK:
 	case S_IFIFO:
-		if (mknod((const char *)n->name,
-			  (n->inode->base.mode & S_IFMT) | 0700, 0)) {
+		if (mknodat(dirfd, name,
+			    (n->inode->base.mode & S_IFMT) | 0700, 0)) {
 			fprintf(stderr, "creating %s: %s\n",
-				n->name, strerror(errno));
+				name, strerror(errno));
 			return -1;
 		}
 		break;
@@ -75,20 +383,19 @@ static int create_node(const sqfs_tree_node_t *n, int flags)
 			devno = n->inode->data.dev.devno;
 		}
 
-		if (mknod((const char *)n->name, n->inode->base.mode & S_IFMT,
-			  devno)) {
+		if (mknodat(dirfd, name, n->inode->base.mode & S_IFMT,
+			    devno)) {
 			fprintf(stderr, "creating device %s: %s\n",
-				n->name, strerror(errno));
+				name, strerror(errno));
 			return -1;
 		}
 		break;
 	}
 	case S_IFREG:
-		fd = open((const char *)n->name, O_WRONLY | O_CREAT | O_EXCL,
-			  0600);
+		fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL, 0600);
 		if (fd < 0) {
 			fprintf(stderr, "creating %s: %s\n",
-				n->name, strerror(errno));
+				name, strerror(errno));
 			return -1;
 		}
 
@@ -98,15 +405,15 @@ static int create_node(const sqfs_tree_node_t *n, int flags)
 		break;
 	}
 
+	path_buf_truncate(path, old_len);
 	return 0;
 }
 
 #ifdef HAVE_SYS_XATTR_H
-static int set_xattr(sqfs_xattr_reader_t *xattr, const sqfs_tree_node_t *n)
+static int set_xattr(const restore_t *rs, const sqfs_tree_node_t *n,
+		     const char *path)
 {
-	sqfs_xattr_value_t *value;
-	sqfs_xattr_entry_t *key;
-	sqfs_xattr_id_t desc;
+	const sqfs_xattr_set_t *set;
 	sqfs_u32 index;
 	size_t i;
 	int ret;
@@ -116,149 +423,417 @@ static int set_xattr(sqfs_xattr_reader_t *xattr, const sqfs_tree_node_t *n)
 	if (index == 0xFFFFFFFF)
 		return 0;
 
-	if (sqfs_xattr_reader_get_desc(xattr, index, &desc)) {
-		fputs("Error resolving xattr index\n", stderr);
-		return -1;
-	}
+	/*
+	  The reader caches the decoded sets, so only the lookup has to
+	  be done with the lock held. A set is never modified afterwards.
+	 */
+	XATTR_LOCK();
+	ret = sqfs_xattr_reader_get_set(rs->xattr, index, &set);
+	XATTR_UNLOCK();
 
-	if (sqfs_xattr_reader_seek_kv(xattr, &desc)) {
-		fputs("Error locating xattr key-value pairs\n", stderr);
+	if (ret) {
+		sqfs_perror(path, "reading xattrs", ret);
 		return -1;
 	}
 
-	for (i = 0; i < desc.count; ++i) {
-		if (sqfs_xattr_reader_read_key(xattr, &key)) {
-			fputs("Error reading xattr key\n", stderr);
-			return -1;
-		}
-
-		if (sqfs_xattr_reader_read_value(xattr, key, &value)) {
-			fputs("Error reading xattr value\n", stderr);
-			free(key);
-			return -1;
-		}
-
-		ret = lsetxattr((const char *)n->name, (const char *)key->key,
-				value->value, value->size, 0);
+	/* there is no lsetxattrat, so go through the path from the top */
+	for (i = 0; i < set->count; ++i) {
+		ret = lsetxattr(path, (const char *)set->keys[i]->key,
+				set->values[i]->value, set->values[i]->size,
+				0);
 		if (ret) {
 			fprintf(stderr, "setting xattr '%s' on %s: %s\n",
-				key->key, n->name, strerror(errno));
-		}
-
-		free(key);
-		free(value);
-		if (ret)
+				set->keys[i]->key, path, strerror(errno));
 			return -1;
+		}
 	}
 
 	return 0;
 }
 #endif
 
-static int set_attribs(sqfs_xattr_reader_t *xattr,
-		       const sqfs_tree_node_t *n, int flags)
+static int set_attribs(const restore_t *rs, int dirfd,
+		       const sqfs_tree_node_t *n, size_t depth,
+		       path_buf_t *path)
 {
+	size_t old_len = path->len;
 	const sqfs_tree_node_t *c;
+	const char *name;
+	int fd;
 
-	if (!is_filename_sane((const char *)n->name))
+	name = (const char *)n->name;
+
+	if (!is_filename_sane(name))
 		return 0;
 
-	if (S_ISDIR(n->inode->base.mode)) {
-		if (pushd((const char *)n->name))
+	if (push_name(path, name))
+		return -1;
+
+	if (S_ISDIR(n->inode->base.mode) && depth != rs->split) {
+		fd = open_dir(dirfd, name);
+		if (fd < 0)
 			return -1;
 
 		for (c = n->children; c != NULL; c = c->next) {
-			if (set_attribs(xattr, c, flags))
+			if (set_attribs(rs, fd, c, depth + 1, path)) {
+				close(fd);
 				return -1;
+			}
 		}
 
-		if (popd())
-			return -1;
+		close(fd);
 	}
 
 #ifdef HAVE_SYS_XATTR_H
-	if ((flags & UNPACK_SET_XATTR) && xattr != NULL) {
-		if (set_xattr(xattr, n))
+	if ((rs->flags & UNPACK_SET_XATTR) && rs->xattr != NULL) {
+		if (set_xattr(rs, n, path->str))
 			return -1;
 	}
 #endif
 
-	if (flags & UNPACK_SET_TIMES) {
+	if (rs->flags & UNPACK_SET_TIMES) {
 		struct timespec times[2];
 
 		memset(times, 0, sizeof(times));
 		times[0].tv_sec = n->inode->base.mod_time;
 		times[1].tv_sec = n->inode->base.mod_time;
 
-		if (utimensat(AT_FDCWD, (const char *)n->name, times,
-			      AT_SYMLINK_NOFOLLOW)) {
+		if (utimensat(dirfd, name, times, AT_SYMLINK_NOFOLLOW)) {
 			fprintf(stderr, "setting timestamp on %s: %s\n",
-				n->name, strerror(errno));
+				name, strerror(errno));
 			return -1;
 		}
 	}
 
-	if (flags & UNPACK_CHOWN) {
-		if (fchownat(AT_FDCWD, (const char *)n->name, n->uid, n->gid,
+	if (rs->flags & UNPACK_CHOWN) {
+		if (fchownat(dirfd, name, n->uid, n->gid,
 			     AT_SYMLINK_NOFOLLOW)) {
 			fprintf(stderr, "chown %s: %s\n",
-				n->name, strerror(errno));
+				name, strerror(errno));
 			return -1;
 		}
 	}
 
-	if (flags & UNPACK_CHMOD && !S_ISLNK(n->inode->base.mode)) {
-		if (fchmodat(AT_FDCWD, (const char *)n->name,
-			     n->inode->base.mode & ~S_IFMT, 0)) {
+	if (rs->flags & UNPACK_CHMOD && !S_ISLNK(n->inode->base.mode)) {
+		if (fchmodat(dirfd, name, n->inode->base.mode & ~S_IFMT, 0)) {
 			fprintf(stderr, "chmod %s: %s\n",
-				n->name, strerror(errno));
+				name, strerror(errno));
 			return -1;
 		}
 	}
+
+	path_buf_truncate(path, old_len);
 	return 0;
 }
 
-int restore_fstree(sqfs_tree_node_t *root, int flags)
+typedef int (*node_fun_t)(const restore_t *rs, int dirfd,
+			  const sqfs_tree_node_t *n, size_t depth,
+			  path_buf_t *path);
+
+/* apply a function to the nodes below the root, down to the split depth */
+static int process_top(const restore_t *rs, node_fun_t fun)
 {
-	sqfs_tree_node_t *n, *old_parent;
+	const sqfs_tree_node_t *n;
+	path_buf_t path;
+	int ret;
 
-	/* make sure fstree_get_path() stops at this node */
-	old_parent = root->parent;
-	root->parent = NULL;
+	ret = path_buf_init(&path, "");
+	if (ret) {
+		sqfs_perror("unpack", "restoring directory tree", ret);
+		return -1;
+	}
 
-	if (S_ISDIR(root->inode->base.mode)) {
-		for (n = root->children; n != NULL; n = n->next) {
-			if (create_node(n, flags))
-				return -1;
-		}
+	if (!S_ISDIR(rs->root->inode->base.mode)) {
+		ret = fun(rs, AT_FDCWD, rs->root, 0, &path);
+	} else if (fun == create_node &&
+		   remove_stale(rs, AT_FDCWD, rs->root, path.str)) {
+		ret = -1;
 	} else {
-		if (create_node(root, flags))
-			return -1;
+		for (n = rs->root->children; n != NULL; n = n->next) {
+			ret = fun(rs, AT_FDCWD, n, 0, &path);
+			if (ret)
+				break;
+		}
 	}
 
-	root->parent = old_parent;
-	return 0;
+	path_buf_cleanup(&path);
+	return ret ? -1 : 0;
 }
 
-int update_tree_attribs(sqfs_xattr_reader_t *xattr,
-			const sqfs_tree_node_t *root, int flags)
+#ifdef WITH_PTHREAD
+typedef struct {
+	const restore_t *rs;
+	node_fun_t fun;
+	const sqfs_tree_node_t **list;
+	size_t count;
+	size_t next;
+	bool failed;
+	pthread_mutex_t mtx;
+} subtree_work_t;
+
+/* path of a node, relative to the directory we unpack into */
+static char *node_path(const restore_t *rs, const sqfs_tree_node_t *n)
+{
+	const sqfs_tree_node_t *it;
+	size_t skip = 1;
+	char *str;
+
+	str = sqfs_tree_node_get_path(n);
+	if (str == NULL)
+		return NULL;
+
+	/* drop the leading slash and the names above the unpack root */
+	for (it = rs->root->parent; it != NULL && it->parent != NULL;
+	     it = it->parent) {
+		skip += strlen((const char *)it->name) + 1;
+	}
+
+	memmove(str, str + skip, strlen(str + skip) + 1);
+	return str;
+}
+
+/* apply a function to the children of a directory at the split depth */
+static int process_subtree(subtree_work_t *work, const sqfs_tree_node_t *dir)
 {
 	const sqfs_tree_node_t *n;
+	path_buf_t path;
+	char *str;
+	int ret, fd;
 
-	if ((flags & (UNPACK_CHOWN | UNPACK_CHMOD |
-		      UNPACK_SET_TIMES | UNPACK_SET_XATTR)) == 0) {
-		return 0;
+	str = node_path(work->rs, dir);
+	if (str == NULL) {
+		perror("restoring directory tree");
+		return -1;
 	}
 
-	if (S_ISDIR(root->inode->base.mode)) {
-		for (n = root->children; n != NULL; n = n->next) {
-			if (set_attribs(xattr, n, flags))
+	ret = path_buf_init(&path, str);
+	free(str);
+	if (ret) {
+		sqfs_perror("unpack", "restoring directory tree", ret);
+		return -1;
+	}
+
+	fd = open_dir(AT_FDCWD, path.str);
+	if (fd < 0) {
+		path_buf_cleanup(&path);
+		return -1;
+	}
+
+	if (work->fun == create_node &&
+	    remove_stale(work->rs, fd, dir, path.str)) {
+		ret = -1;
+	} else {
+		for (n = dir->children; n != NULL; n = n->next) {
+			ret = work->fun(work->rs, fd, n, work->rs->split + 1,
+					&path);
+			if (ret)
+				break;
+		}
+	}
+
+	close(fd);
+	path_buf_cleanup(&path);
+	return ret ? -1 : 0;
+}
+
+static void *subtree_worker(void *arg)
+{
+	subtree_work_t *work = arg;
+	size_t i;
+
+	for (;;) {
+		pthread_mutex_lock(&work->mtx);
+		i = work->next++;
+		if (work->failed)
+			i = work->count;
+		pthread_mutex_unlock(&work->mtx);
+
+		if (i >= work->count)
+			break;
+
+		if (process_subtree(work, work->list[i])) {
+			pthread_mutex_lock(&work->mtx);
+			work->failed = true;
+			pthread_mutex_unlock(&work->mtx);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static int run_work(subtree_work_t *work, node_fun_t fun,
+		    unsigned int num_threads)
+{
+	work->fun = fun;
+	work->next = 0;
+	work->failed = false;
+
+	run_workers(subtree_worker, work, 0, num_threads);
+	return work->failed ? -1 : 0;
+}
+
+static int append_subdirs(const sqfs_tree_node_t ***list, size_t *count,
+			  size_t *max, const sqfs_tree_node_t *dir)
+{
+	const sqfs_tree_node_t **new, *n;
+
+	for (n = dir->children; n != NULL; n = n->next) {
+		if (!S_ISDIR(n->inode->base.mode) ||
+		    !is_filename_sane((const char *)n->name)) {
+			continue;
+		}
+
+		if (*count == *max) {
+			*max = *max ? *max * 2 : 64;
+			new = realloc(*list, sizeof(new[0]) * *max);
+			if (new == NULL)
 				return -1;
+			*list = new;
 		}
-	} else {
-		if (set_attribs(xattr, root, flags))
-			return -1;
+
+		(*list)[(*count)++] = n;
 	}
 
 	return 0;
 }
+
+/*
+  Collect the directories level by level, until there are enough of them
+  to split the work. The depth of that level is stored in split, or NO_SPLIT
+  if the tree is too small.
+ */
+static int split_subtrees(subtree_work_t *work, unsigned int num_threads,
+			  size_t *split)
+{
+	const sqfs_tree_node_t **dirs = NULL;
+	size_t i, start = 0, end = 0, count = 0, max = 0, depth = 0;
+
+	*split = NO_SPLIT;
+
+	if (append_subdirs(&dirs, &count, &max, work->rs->root))
+		goto fail;
+
+	while (count > start) {
+		end = count;
+
+		if (end - start >= (size_t)num_threads * SUBTREES_PER_THREAD) {
+			*split = depth;
+			break;
+		}
+
+		for (i = start; i < end; ++i) {
+			if (append_subdirs(&dirs, &count, &max, dirs[i]))
+				goto fail;
+		}
+
+		start = end;
+		++depth;
+	}
+
+	if (*split == NO_SPLIT) {
+		free(dirs);
+		return 0;
+	}
+
+	memmove(dirs, dirs + start, (end - start) * sizeof(dirs[0]));
+	work->list = dirs;
+	work->count = end - start;
+	return 0;
+fail:
+	perror("restoring directory tree");
+	free(dirs);
+	return -1;
+}
+
+static int restore_parallel(restore_t *rs, unsigned int num_jobs,
+			    bool create)
+{
+	subtree_work_t work;
+	int ret = -1;
+
+	memset(&work, 0, sizeof(work));
+	work.rs = rs;
+
+	if (!S_ISDIR(rs->root->inode->base.mode))
+		return process_top(rs, create ? create_node : set_attribs);
+
+	if (split_subtrees(&work, num_jobs, &rs->split))
+		return -1;
+
+	if (rs->split == NO_SPLIT)
+		return process_top(rs, create ? create_node : set_attribs);
+
+	if (pthread_mutex_init(&work.mtx, NULL) != 0) {
+		perror("restoring directory tree");
+		goto out;
+	}
+
+	/*
+	  Directories above the split are created first, and their attributes
+	  are set last, since modifying their contents changes them.
+	 */
+	if (create) {
+		if (process_top(rs, create_node))
+			goto out_mtx;
+		if (run_work(&work, create_node, num_jobs))
+			goto out_mtx;
+	} else {
+		if (run_work(&work, set_attribs, num_jobs))
+			goto out_mtx;
+		if (process_top(rs, set_attribs))
+			goto out_mtx;
+	}
+
+	ret = 0;
+out_mtx:
+	pthread_mutex_destroy(&work.mtx);
+out:
+	free(work.list);
+	return ret;
+}
+#endif
+
+int restore_fstree(sqfs_tree_node_t *root, int flags, unsigned int num_jobs)
+{
+	restore_t rs;
+
+	memset(&rs, 0, sizeof(rs));
+	rs.root = root;
+	rs.flags = flags;
+	rs.split = NO_SPLIT;
+
+#ifdef WITH_PTHREAD
+	if (num_jobs > 1)
+		return restore_parallel(&rs, num_jobs, true);
+#else
+	(void)num_jobs;
+#endif
+	return process_top(&rs, create_node);
+}
+
+int update_tree_attribs(sqfs_xattr_reader_t *xattr,
+			const sqfs_tree_node_t *root, int flags,
+			unsigned int num_jobs)
+{
+	restore_t rs;
+
+	if ((flags & (UNPACK_CHOWN | UNPACK_CHMOD |
+		      UNPACK_SET_TIMES | UNPACK_SET_XATTR)) == 0) {
+		return 0;
+	}
+
+	memset(&rs, 0, sizeof(rs));
+	rs.root = root;
+	rs.xattr = xattr;
+	rs.flags = flags;
+	rs.split = NO_SPLIT;
+
+#ifdef WITH_PTHREAD
+	if (num_jobs > 1)
+		return restore_parallel(&rs, num_jobs, false);
+#else
+	(void)num_jobs;
+#endif
+	return process_top(&rs, set_attribs);
+}
@@ -0,0 +1,605 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * verify.c
+ *
+ * Copyright (C) 2019 David Oberhollenzer <goliath@infraroot.at>
+ */
+#include "config.h"
+#include "rdsquashfs.h"
+
+#ifdef WITH_PTHREAD
+#include <pthread.h>
+#endif
+
+/* number of chunks to split the block list into, per thread */
+#define CHUNKS_PER_THREAD (8)
+
+#define NO_FILE ((size_t)-1)
+
+typedef struct {
+	sqfs_u64 offset;
+
+	/* on-disk size, including the uncompressed flag */
+	sqfs_u32 size;
+
+	/* exact uncompressed size, or the minimum size of a fragment block */
+	sqfs_u32 expected;
+
+	/* index into the path list and block index, or the fragment index */
+	size_t file;
+	sqfs_u32 index;
+} blk_ent_t;
+
+typedef struct {
+	const sqfs_super_t *super;
+
+	char **paths;
+	size_t num_paths, max_paths;
+
+	blk_ent_t *blocks;
+	size_t num_blocks, max_blocks;
+
+	/* the largest offset into each fragment block used by a file */
+	sqfs_u32 *frag_used;
+
+	size_t errors;
+} verify_state_t;
+
+typedef struct {
+	const verify_state_t *state;
+	size_t *chunks;
+	size_t num_chunks;
+	size_t next;
+#ifdef WITH_PTHREAD
+	pthread_mutex_t mtx;
+#endif
+} verify_work_t;
+
+typedef struct {
+	verify_work_t *work;
+	sqfs_compressor_t *cmp;
+	sqfs_file_t *file;
+	sqfs_u8 *input;
+	sqfs_u8 *output;
+	size_t errors;
+} verify_worker_t;
+
+static void report_block(const verify_state_t *state, const blk_ent_t *blk,
+			 const char *msg)
+{
+	if (blk->file == NO_FILE) {
+		fprintf(stderr, "fragment block %u: %s\n",
+			(unsigned int)blk->index, msg);
+	} else {
+		fprintf(stderr, "%s: block %u: %s\n",
+			state->paths[blk->file], (unsigned int)blk->index, msg);
+	}
+}
+
+static int add_block(verify_state_t *state, sqfs_u64 offset, sqfs_u32 size,
+		     sqfs_u32 expected, size_t file, sqfs_u32 index)
+{
+	size_t new_sz;
+	void *new;
+
+	if (state->num_blocks == state->max_blocks) {
+		new_sz = state->max_blocks ? state->max_blocks * 2 : 1024;
+		new = realloc(state->blocks, sizeof(state->blocks[0]) * new_sz);
+
+		if (new == NULL) {
+			perror("expanding block list");
+			return -1;
+		}
+
+		state->blocks = new;
+		state->max_blocks = new_sz;
+	}
+
+	state->blocks[state->num_blocks].offset = offset;
+	state->blocks[state->num_blocks].size = size;
+	state->blocks[state->num_blocks].expected = expected;
+	state->blocks[state->num_blocks].file = file;
+	state->blocks[state->num_blocks].index = index;
+	state->num_blocks++;
+	return 0;
+}
+
+/*
+  Check that a block lies within the data area, i.e. between the super block
+  and the inode table, and that it is not larger than a block would be if it
+  were stored uncompressed.
+ */
+static bool check_block(verify_state_t *state, const blk_ent_t *blk)
+{
+	const sqfs_super_t *super = state->super;
+	sqfs_u32 size = SQFS_ON_DISK_BLOCK_SIZE(blk->size);
+
+	if (size > super->block_size) {
+		report_block(state, blk, "on-disk size exceeds the block size");
+	} else if (blk->offset < sizeof(sqfs_super_t) ||
+		   blk->offset > super->inode_table_start ||
+		   (super->inode_table_start - blk->offset) < size) {
+		report_block(state, blk, "outside of the data area");
+	} else {
+		return true;
+	}
+
+	state->errors += 1;
+	return false;
+}
+
+static int add_file(verify_state_t *state, const sqfs_inode_generic_t *inode,
+		    const char *path)
+{
+	const sqfs_super_t *super = state->super;
+	sqfs_u32 frag_idx, frag_off, tail, expected;
+	sqfs_u64 size, location;
+	size_t i, new_sz, file;
+	blk_ent_t blk;
+	void *new;
+
+	if (state->num_paths == state->max_paths) {
+		new_sz = state->max_paths ? state->max_paths * 2 : 256;
+		new = realloc(state->paths, sizeof(state->paths[0]) * new_sz);
+
+		if (new == NULL) {
+			perror("expanding file list");
+			return -1;
+		}
+
+		state->paths = new;
+		state->max_paths = new_sz;
+	}
+
+	file = state->num_paths;
+	state->paths[file] = strdup(path);
+	if (state->paths[file] == NULL) {
+		perror("assembling file path");
+		return -1;
+	}
+	state->num_paths++;
+
+	sqfs_inode_get_file_size(inode, &size);
+	sqfs_inode_get_file_block_start(inode, &location);
+	sqfs_inode_get_frag_location(inode, &frag_idx, &frag_off);
+
+	tail = size % super->block_size;
+
+	if (tail != 0 && frag_idx != 0xFFFFFFFF && frag_off != 0xFFFFFFFF) {
+		if (frag_idx >= super->fragment_entry_count) {
+			fprintf(stderr, "%s: fragment index %u out of "
+				"bounds\n", path, (unsigned int)frag_idx);
+			state->errors += 1;
+		} else if (frag_off > super->block_size ||
+			   (super->block_size - frag_off) < tail) {
+			fprintf(stderr, "%s: tail end exceeds the fragment "
+				"block\n", path);
+			state->errors += 1;
+		} else if (state->frag_used[frag_idx] < frag_off + tail) {
+			state->frag_used[frag_idx] = frag_off + tail;
+		}
+
+		tail = 0;
+	}
+
+	for (i = 0; i < inode->num_file_blocks; ++i) {
+		if (SQFS_IS_SPARSE_BLOCK(inode->block_sizes[i]))
+			continue;
+
+		expected = super->block_size;
+		if (tail != 0 && i == inode->num_file_blocks - 1)
+			expected = tail;
+
+		blk.offset = location;
+		blk.size = inode->block_sizes[i];
+		blk.file = file;
+		blk.index = i;
+
+		location += SQFS_ON_DISK_BLOCK_SIZE(blk.size);
+
+		if (!check_block(state, &blk))
+			continue;
+
+		if (add_block(state, blk.offset, blk.size, expected, file, i))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int gen_block_list_dfs(verify_state_t *state, const sqfs_tree_node_t *n,
+			      path_buf_t *path)
+{
+	size_t old_len = path->len;
+	int ret;
+
+	if (n->parent != NULL) {
+		ret = path_buf_push(path, (const char *)n->name,
+				    strlen((const char *)n->name));
+		if (ret) {
+			sqfs_perror((const char *)n->name,
+				    "assembling file path", ret);
+			return -1;
+		}
+	}
+
+	if (S_ISREG(n->inode->base.mode)) {
+		if (add_file(state, n->inode, path->str))
+			return -1;
+	} else if (S_ISDIR(n->inode->base.mode)) {
+		for (n = n->children; n != NULL; n = n->next) {
+			if (gen_block_list_dfs(state, n, path))
+				return -1;
+		}
+	}
+
+	path_buf_truncate(path, old_len);
+	return 0;
+}
+
+static int add_fragments(verify_state_t *state, sqfs_data_reader_t *data)
+{
+	sqfs_fragment_t ent;
+	blk_ent_t blk;
+	sqfs_u32 i;
+	int ret;
+
+	for (i = 0; i < state->super->fragment_entry_count; ++i) {
+		ret = sqfs_data_reader_get_fragment_entry(data, i, &ent);
+		if (ret) {
+			sqfs_perror("fragment table", "reading entry", ret);
+			return -1;
+		}
+
+		blk.offset = ent.start_offset;
+		blk.size = ent.size;
+		blk.file = NO_FILE;
+		blk.index = i;
+
+		if (SQFS_IS_SPARSE_BLOCK(blk.size)) {
+			report_block(state, &blk, "empty fragment block");
+			state->errors += 1;
+			continue;
+		}
+
+		if (!check_block(state, &blk))
+			continue;
+
+		if (add_block(state, blk.offset, blk.size, state->frag_used[i],
+			      NO_FILE, i)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int compare_blocks(const void *l, const void *r)
+{
+	const blk_ent_t *lhs = l, *rhs = r;
+
+	if (lhs->offset != rhs->offset)
+		return lhs->offset < rhs->offset ? -1 : 1;
+
+	if (lhs->size != rhs->size)
+		return lhs->size < rhs->size ? -1 : 1;
+
+	if (lhs->expected != rhs->expected)
+		return lhs->expected < rhs->expected ? -1 : 1;
+
+	return 0;
+}
+
+/*
+  Deduplicated files refer to the same blocks, so only keep one copy of each
+  and check that blocks that are not the same don't overlap.
+ */
+static void merge_blocks(verify_state_t *state)
+{
+	blk_ent_t *blk = state->blocks;
+	size_t i, count = 0;
+	sqfs_u64 end;
+
+	for (i = 0; i < state->num_blocks; ++i) {
+		if (count > 0 && compare_blocks(blk + count - 1, blk + i) == 0)
+			continue;
+
+		if (count > 0 && blk[count - 1].offset != blk[i].offset) {
+			end = blk[count - 1].offset +
+				SQFS_ON_DISK_BLOCK_SIZE(blk[count - 1].size);
+
+			if (end > blk[i].offset) {
+				report_block(state, blk + i, "overlaps the "
+					     "previous block on disk");
+				state->errors += 1;
+			}
+		}
+
+		blk[count++] = blk[i];
+	}
+
+	state->num_blocks = count;
+}
+
+/*
+  Split the sorted block list into contiguous chunks of roughly equal on-disk
+  size. The workers take them in order, so the image is read front to back,
+  even if the files are stored in a different order than the tree.
+ */
+static size_t *split_chunks(const verify_state_t *state,
+			    unsigned int num_jobs, size_t *count)
+{
+	sqfs_u64 total = 0, target, acc = 0;
+	size_t i, max, *chunks;
+
+	for (i = 0; i < state->num_blocks; ++i)
+		total += SQFS_ON_DISK_BLOCK_SIZE(state->blocks[i].size);
+
+	max = (size_t)num_jobs * CHUNKS_PER_THREAD;
+	target = total / max;
+
+	chunks = alloc_array(sizeof(chunks[0]), max + 1);
+	if (chunks == NULL)
+		return NULL;
+
+	*count = 0;
+	chunks[0] = 0;
+
+	for (i = 0; i < state->num_blocks; ++i) {
+		acc += SQFS_ON_DISK_BLOCK_SIZE(state->blocks[i].size);
+
+		if (acc < target || i + 1 == state->num_blocks ||
+		    *count + 1 == max) {
+			continue;
+		}
+
+		chunks[++(*count)] = i + 1;
+		acc = 0;
+	}
+
+	chunks[++(*count)] = state->num_blocks;
+	return chunks;
+}
+
+static bool verify_block(verify_worker_t *worker, const blk_ent_t *blk)
+{
+	const verify_state_t *state = worker->work->state;
+	sqfs_u32 size = SQFS_ON_DISK_BLOCK_SIZE(blk->size);
+	sqfs_s32 ret;
+	char msg[64];
+
+	if (worker->file->read_at(worker->file, blk->offset,
+				  worker->input, size)) {
+		report_block(state, blk, "cannot be read");
+		return false;
+	}
+
+	if (SQFS_IS_BLOCK_COMPRESSED(blk->size)) {
+		ret = worker->cmp->do_block(worker->cmp, worker->input, size,
+					    worker->output,
+					    state->super->block_size);
+		if (ret <= 0) {
+			report_block(state, blk, "cannot be uncompressed");
+			return false;
+		}
+	} else {
+		ret = size;
+	}
+
+	if (blk->file == NO_FILE) {
+		if ((sqfs_u32)ret >= blk->expected)
+			return true;
+
+		snprintf(msg, sizeof(msg), "%u bytes, files use %u",
+			 (unsigned int)ret, (unsigned int)blk->expected);
+	} else {
+		if ((sqfs_u32)ret == blk->expected)
+			return true;
+
+		snprintf(msg, sizeof(msg), "%u bytes, expected %u",
+			 (unsigned int)ret, (unsigned int)blk->expected);
+	}
+
+	report_block(state, blk, msg);
+	return false;
+}
+
+static size_t next_chunk(verify_work_t *work)
+{
+	size_t i;
+
+#ifdef WITH_PTHREAD
+	pthread_mutex_lock(&work->mtx);
+	i = work->next++;
+	pthread_mutex_unlock(&work->mtx);
+#else
+	i = work->next++;
+#endif
+	return i;
+}
+
+static void *verify_worker(void *arg)
+{
+	verify_worker_t *worker = arg;
+	verify_work_t *work = worker->work;
+	const blk_ent_t *blocks = work->state->blocks;
+	size_t i, j;
+
+	while ((i = next_chunk(work)) < work->num_chunks) {
+		sqfs_trace_begin("rdsquashfs", "verify blocks");
+
+		for (j = work->chunks[i]; j < work->chunks[i + 1]; ++j) {
+			if (!verify_block(worker, blocks + j))
+				worker->errors += 1;
+		}
+
+		sqfs_trace_end("rdsquashfs", "verify blocks");
+	}
+
+	return NULL;
+}
+
+static int worker_init(verify_worker_t *worker, verify_work_t *work,
+		       sqfs_compressor_t *cmp, sqfs_file_t *file)
+{
+	size_t block_size = work->state->super->block_size;
+
+	memset(worker, 0, sizeof(*worker));
+	worker->work = work;
+	worker->cmp = cmp;
+	worker->file = file;
+	worker->input = malloc(block_size);
+	worker->output = malloc(block_size);
+
+	if (worker->input == NULL || worker->output == NULL) {
+		free(worker->input);
+		free(worker->output);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void worker_cleanup(verify_worker_t *worker)
+{
+	free(worker->input);
+	free(worker->output);
+}
+
+static int verify_blocks(verify_state_t *state, sqfs_compressor_t *cmp,
+			 sqfs_file_t *file, unsigned int num_jobs)
+{
+	unsigned int i, count = 1;
+	verify_worker_t *workers;
+	verify_work_t work;
+
+	memset(&work, 0, sizeof(work));
+	work.state = state;
+
+	work.chunks = split_chunks(state, num_jobs, &work.num_chunks);
+	if (work.chunks == NULL)
+		goto fail_alloc;
+
+	workers = alloc_array(sizeof(workers[0]), num_jobs);
+	if (workers == NULL)
+		goto fail_chunks;
+
+#ifdef WITH_PTHREAD
+	if (pthread_mutex_init(&work.mtx, NULL) != 0)
+		goto fail_workers;
+#endif
+
+	/* the main thread works through the list with the original compressor */
+	if (worker_init(workers, &work, cmp, file))
+		goto fail_mtx;
+
+#ifdef WITH_PTHREAD
+	for (; count < num_jobs; ++count) {
+		sqfs_compressor_t *copy = cmp->create_copy(cmp);
+
+		if (copy == NULL)
+			break;
+
+		if (worker_init(workers + count, &work, copy, file)) {
+			copy->destroy(copy);
+			break;
+		}
+	}
+#endif
+
+	run_workers(verify_worker, workers, sizeof(workers[0]), count);
+
+	for (i = 0; i < count; ++i) {
+		state->errors += workers[i].errors;
+		worker_cleanup(workers + i);
+
+		if (i > 0)
+			workers[i].cmp->destroy(workers[i].cmp);
+	}
+
+#ifdef WITH_PTHREAD
+	pthread_mutex_destroy(&work.mtx);
+#endif
+	free(workers);
+	free(work.chunks);
+	return 0;
+fail_mtx:
+#ifdef WITH_PTHREAD
+	pthread_mutex_destroy(&work.mtx);
+fail_workers:
+#endif
+	free(workers);
+fail_chunks:
+	free(work.chunks);
+fail_alloc:
+	perror("starting verify threads");
+	return -1;
+}
+
+int verify_image(const sqfs_super_t *super, sqfs_file_t *file,
+		 sqfs_compressor_t *cmp, const sqfs_tree_node_t *root,
+		 sqfs_data_reader_t *data, int flags, unsigned int num_jobs)
+{
+	verify_state_t state;
+	path_buf_t path;
+	int status = -1;
+	size_t i;
+
+	memset(&state, 0, sizeof(state));
+	state.super = super;
+
+	if (super->fragment_entry_count > 0) {
+		state.frag_used = alloc_array(sizeof(state.frag_used[0]),
+					      super->fragment_entry_count);
+		if (state.frag_used == NULL) {
+			perror("creating fragment list");
+			return -1;
+		}
+
+		memset(state.frag_used, 0, sizeof(state.frag_used[0]) *
+		       super->fragment_entry_count);
+	}
+
+	if (path_buf_init(&path, "")) {
+		perror("assembling file path");
+		goto out;
+	}
+
+	sqfs_trace_begin("rdsquashfs", "gather blocks");
+	status = gen_block_list_dfs(&state, root, &path);
+	if (status == 0)
+		status = add_fragments(&state, data);
+	sqfs_trace_end("rdsquashfs", "gather blocks");
+
+	path_buf_cleanup(&path);
+	if (status)
+		goto out;
+
+	qsort(state.blocks, state.num_blocks, sizeof(state.blocks[0]),
+	      compare_blocks);
+	merge_blocks(&state);
+
+	if (state.num_blocks > 0) {
+		status = verify_blocks(&state, cmp, file, num_jobs);
+		if (status)
+			goto out;
+	}
+
+	if (state.errors > 0) {
+		fprintf(stderr, "%lu errors found.\n",
+			(unsigned long)state.errors);
+		status = -1;
+	} else if (!(flags & UNPACK_QUIET)) {
+		printf("%lu files, %lu blocks OK.\n",
+		       (unsigned long)state.num_paths,
+		       (unsigned long)state.num_blocks);
+	}
+out:
+	for (i = 0; i < state.num_paths; ++i)
+		free(state.paths[i]);
+
+	free(state.paths);
+	free(state.blocks);
+	free(state.frag_used);
+	return status;
+}